@@ -30,10 +30,13 @@
 #include "exec/tb-hash.h"
 #include "exec/tb-lookup.h"
 #include "exec/log.h"
+#include "exec/sample-profile.h"
+#include "exec/cpu_ldst.h"
 #include "qemu/main-loop.h"
 #if defined(TARGET_I386) && !defined(CONFIG_USER_ONLY)
 #include "hw/i386/apic.h"
 #endif
+#include "sysemu/accel.h"
 #include "sysemu/cpus.h"
 #include "sysemu/replay.h"
 
@@ -190,6 +193,9 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
             cc->set_pc(cpu, last_tb->pc);
         }
     }
+    if (CPU_GET_CLASS(cpu)->tb_exit) {
+        CPU_GET_CLASS(cpu)->tb_exit(cpu);
+    }
     return ret;
 }
 
@@ -376,6 +382,142 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
     tb_next->jmp_list_first = (uintptr_t)tb | n;
 }
 
+bool tb_pretranslate(CPUState *cpu, target_ulong pc, target_ulong cs_base,
+                     uint32_t flags)
+{
+    uint32_t cf_mask = curr_cflags();
+    TranslationBlock *tb;
+
+    /* A full buffer or a fetch fault leaves tb_gen_code() by longjmp */
+    if (sigsetjmp(cpu->jmp_env, 0) != 0) {
+        tb_lock_reset();
+        cpu->exception_index = -1;
+        return false;
+    }
+
+    mmap_lock();
+    tb_lock();
+    tb = tb_htable_lookup(cpu, pc, cs_base, flags, cf_mask);
+    if (!tb) {
+        tb = tb_gen_code(cpu, pc, cs_base, flags, cf_mask);
+    }
+    tb_unlock();
+    mmap_unlock();
+    cpu_tb_jmp_cache_set(cpu, tb_jmp_cache_hash_func(pc), tb);
+    return true;
+}
+
+bool tb_speculate(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    unsigned int i;
+    target_ulong pc;
+
+    if (!cpu->tb_speculate_count) {
+        return false;
+    }
+    cpu->tb_speculate_count--;
+    i = --cpu->tb_speculate_head % TB_SPECULATE_SIZE;
+    pc = cpu->tb_speculate[i].pc;
+
+    /* Filling the TLB could raise a guest-visible fault */
+    if (tlb_vaddr_to_host(env, pc, MMU_INST_FETCH,
+                          cpu_mmu_index(env, true))) {
+        tb_pretranslate(cpu, pc, cpu->tb_speculate[i].cs_base,
+                        cpu->tb_speculate[i].flags);
+    }
+    return true;
+}
+
+void tb_superblock(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    TranslationBlock *tb;
+
+    cpu->tb_hot = false;
+
+    /* As in tb_speculate(), do not risk a fault on the lookup */
+    if (!tlb_vaddr_to_host(env, cpu->tb_hot_pc, MMU_INST_FETCH,
+                           cpu_mmu_index(env, true))) {
+        return;
+    }
+
+    mmap_lock();
+    tb_lock();
+    tb = tb_htable_lookup(cpu, cpu->tb_hot_pc, cpu->tb_hot_cs_base,
+                          cpu->tb_hot_flags, cpu->tb_hot_cflags);
+    /* Another vCPU may have got there first */
+    if (tb && !(tb->cflags & CF_SUPERBLOCK)) {
+        tb_phys_invalidate(tb, -1);
+        tb_gen_code(cpu, cpu->tb_hot_pc, cpu->tb_hot_cs_base,
+                    cpu->tb_hot_flags, cpu->tb_hot_cflags | CF_SUPERBLOCK);
+    }
+    tb_unlock();
+    mmap_unlock();
+}
+
+static gboolean tb_hot_iter(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+
+    if (!(tb->cflags & (CF_HOT | CF_INVALID)) &&
+        atomic_read__nocheck(&tb->exec_count) >= TB_HOT_THRESHOLD) {
+        g_array_append_val(data, tb);
+    }
+    return false;
+}
+
+static gint tb_hot_cmp(gconstpointer a, gconstpointer b)
+{
+    uint64_t ca = (*(TranslationBlock * const *)a)->exec_count;
+    uint64_t cb = (*(TranslationBlock * const *)b)->exec_count;
+
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+void tb_relocate_hot(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    GArray *hot = g_array_new(false, false, sizeof(TranslationBlock *));
+    int i;
+
+    mmap_lock();
+    tb_lock();
+    /* Invalidated TBs stay in the tree, so the snapshot remains valid */
+    g_tree_foreach(tb_ctx.tb_tree, tb_hot_iter, hot);
+    g_array_sort(hot, tb_hot_cmp);
+
+    for (i = 0; i < hot->len; i++) {
+        TranslationBlock *tb = g_array_index(hot, TranslationBlock *, i);
+        TranslationBlock *new_tb;
+        uint64_t count = tb->exec_count;
+
+        /* As in tb_superblock(), do not risk a fault on the lookup */
+        if (!tlb_vaddr_to_host(env, tb->pc, MMU_INST_FETCH,
+                               cpu_mmu_index(env, true))) {
+            continue;
+        }
+        /* The same code again, plus its TB and search data */
+        if (!tcg_region_hot_enter(tcg_ctx, sizeof(TranslationBlock) +
+                                  2 * tb->tc.size + 16 * tb->icount)) {
+            break;
+        }
+        new_tb = tb_gen_code(cpu, tb->pc, tb->cs_base, tb->flags,
+                             (tb->cflags & (CF_HASH_MASK | CF_SUPERBLOCK)) |
+                             CF_HOT);
+        tcg_region_hot_exit(tcg_ctx, !new_tb);
+        if (!new_tb) {
+            /* Larger than estimated: the original TB stays in use */
+            break;
+        }
+        tb_phys_invalidate(tb, -1);
+        new_tb->exec_count = count;
+    }
+    tb_unlock();
+    mmap_unlock();
+    g_array_free(hot, true);
+}
+
 static inline TranslationBlock *tb_find(CPUState *cpu,
                                         TranslationBlock *last_tb,
                                         int tb_exit, uint32_t cf_mask)
@@ -406,14 +548,15 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
 
         mmap_unlock();
         /* We add the TB in the virtual pc hash table for the fast lookup */
-        atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+        cpu_tb_jmp_cache_set(cpu, tb_jmp_cache_hash_func(pc), tb);
     }
 #ifndef CONFIG_USER_ONLY
     /* We don't take care of direct jumps when address mapping changes in
      * system emulation. So it's not safe to make a direct jump to a TB
-     * spanning two pages because the mapping for the second page can change.
+     * spanning two pages because the mapping for the second page can change,
+     * unless the CPU has no way of changing it.
      */
-    if (tb->page_addr[1] != -1) {
+    if (tb->page_addr[1] != -1 && !cpu->static_mapping) {
         last_tb = NULL;
     }
 #endif
@@ -447,11 +590,17 @@ static inline bool cpu_handle_halt(CPUState *cpu)
         }
 #endif
         if (!cpu_has_work(cpu)) {
+#ifndef CONFIG_USER_ONLY
+            cpu_account_halt(cpu, true);
+#endif
             return true;
         }
 
         cpu->halted = 0;
     }
+#ifndef CONFIG_USER_ONLY
+    cpu_account_halt(cpu, false);
+#endif
 
     return false;
 }
@@ -509,6 +658,7 @@ static inline bool cpu_handle_exception(CPUState *cpu, int *ret)
         if (replay_exception()) {
             CPUClass *cc = CPU_GET_CLASS(cpu);
             qemu_mutex_lock_iothread();
+            cpu->exec_stats.exceptions++;
             cc->do_interrupt(cpu);
             qemu_mutex_unlock_iothread();
             cpu->exception_index = -1;
@@ -584,6 +734,8 @@ static inline bool cpu_handle_interrupt(CPUState *cpu,
            and via longjmp via cpu_loop_exit.  */
         else {
             if (cc->cpu_exec_interrupt(cpu, interrupt_request)) {
+                cpu->exec_stats.exceptions++;
+                cpu->exec_stats.irqs++;
                 replay_interrupt();
                 cpu->exception_index = -1;
                 *last_tb = NULL;
@@ -730,8 +882,33 @@ int cpu_exec(CPUState *cpu)
                 cpu->cflags_next_tb = -1;
             }
 
+            if (unlikely(atomic_read(&cpu->profile_sample))) {
+                sample_profile_take(cpu);
+            }
+
+            if (unlikely(cpu->tb_hot)) {
+                /* last_tb may be the TB it replaces */
+                tb_superblock(cpu);
+                last_tb = NULL;
+            }
+
             tb = tb_find(cpu, last_tb, tb_exit, cflags);
+            if (unlikely(tcg_tb_hot_size) && !(tb->cflags & CF_HOT) &&
+                atomic_read__nocheck(&tb->exec_count) >= TB_HOT_THRESHOLD &&
+                !tcg_region_hot_full()) {
+                tb_relocate_hot(cpu);
+                tb = tb_find(cpu, NULL, 0, cflags);
+                last_tb = NULL;
+            }
             cpu_loop_exec_tb(cpu, tb, &last_tb, &tb_exit);
+#ifndef CONFIG_USER_ONLY
+            /* Back to the vCPU loop to run QEMU_CLOCK_VIRTUAL timers */
+            if (unlikely(vcpu_timers) &&
+                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) >=
+                atomic_read(&vcpu_timers_deadline)) {
+                atomic_set(&cpu->exit_request, 1);
+            }
+#endif
             /* Try to align the host and virtual clocks
                if the guest is in advance */
             align_clocks(&sc, cpu);
@@ -31,7 +31,10 @@
 #include "qemu/error-report.h"
 #include "exec/log.h"
 #include "exec/helper-proto.h"
+#include "translate-all.h"
 #include "qemu/atomic.h"
+#include "sysemu/cpus.h"
+#include "trace-root.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
 /* #define DEBUG_TLB */
@@ -92,6 +95,121 @@ static void flush_all_helper(CPUState *src, run_on_cpu_func fn,
     }
 }
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+void tlb_init(CPUState *cpu)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    CPUArchState *env = cpu->env_ptr;
+    int bits = cc->tlb_bits ? cc->tlb_bits : CPU_TLB_DYN_DEFAULT_BITS;
+    size_t n_entries = 1 << MIN(bits, CPU_TLB_DYN_MAX_BITS);
+    int i;
+
+    qemu_spin_init(&env->tlb_lock);
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        env->tlb_desc[i].n_used_entries = 0;
+        env->tlb_mask[i] = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
+        env->tlb_table[i] = g_new(CPUTLBEntry, n_entries);
+        env->iotlb[i] = g_new(CPUIOTLBEntry, n_entries);
+        memset(env->tlb_table[i], -1, sizeof(CPUTLBEntry) * n_entries);
+    }
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int i;
+
+    qemu_spin_lock(&env->tlb_lock);
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        g_free(env->tlb_table[i]);
+        g_free(env->iotlb[i]);
+        env->tlb_table[i] = NULL;
+        env->iotlb[i] = NULL;
+    }
+    qemu_spin_unlock(&env->tlb_lock);
+}
+
+static inline void tlb_table_lock(CPUArchState *env)
+{
+    qemu_spin_lock(&env->tlb_lock);
+}
+
+static inline void tlb_table_unlock(CPUArchState *env)
+{
+    qemu_spin_unlock(&env->tlb_lock);
+}
+
+/* A flush is the only point where no entry is live, so that is where a
+ * table that filled up since the last one grows.  It never shrinks: the
+ * model's starting size is a lower bound, set for its working set.
+ */
+static void tlb_flush_one_mmuidx(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_desc[mmu_idx];
+    size_t old_size = tlb_n_entries(env, mmu_idx);
+    size_t new_size = old_size;
+
+    if (desc->n_used_entries > old_size * 7 / 10 &&
+        old_size < (1 << CPU_TLB_DYN_MAX_BITS)) {
+        CPUTLBEntry *new_table = g_new(CPUTLBEntry, new_size * 2);
+        CPUIOTLBEntry *new_iotlb = g_new(CPUIOTLBEntry, new_size * 2);
+        CPUTLBEntry *old_table = env->tlb_table[mmu_idx];
+        CPUIOTLBEntry *old_iotlb = env->iotlb[mmu_idx];
+
+        new_size *= 2;
+        memset(new_table, -1, sizeof(CPUTLBEntry) * new_size);
+
+        /* tlb_reset_dirty may be walking the old table right now */
+        tlb_table_lock(env);
+        env->tlb_table[mmu_idx] = new_table;
+        env->iotlb[mmu_idx] = new_iotlb;
+        env->tlb_mask[mmu_idx] = (new_size - 1) << CPU_TLB_ENTRY_BITS;
+        tlb_table_unlock(env);
+
+        g_free(old_table);
+        g_free(old_iotlb);
+    } else {
+        memset(env->tlb_table[mmu_idx], -1, sizeof(CPUTLBEntry) * new_size);
+    }
+    desc->n_used_entries = 0;
+}
+
+/* A victim TLB hit can refill a slot without counting it, so don't
+ * let the count wrap.
+ */
+static inline void tlb_entry_dropped(CPUArchState *env, int mmu_idx)
+{
+    if (env->tlb_desc[mmu_idx].n_used_entries) {
+        env->tlb_desc[mmu_idx].n_used_entries--;
+    }
+}
+#else
+void tlb_init(CPUState *cpu)
+{
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+}
+
+static void tlb_flush_one_mmuidx(CPUArchState *env, int mmu_idx)
+{
+    memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+}
+
+static inline void tlb_table_lock(CPUArchState *env)
+{
+}
+
+static inline void tlb_table_unlock(CPUArchState *env)
+{
+}
+
+static inline void tlb_entry_dropped(CPUArchState *env, int mmu_idx)
+{
+}
+#endif
+
 size_t tlb_flush_count(void)
 {
     CPUState *cpu;
@@ -113,6 +231,7 @@ size_t tlb_flush_count(void)
 static void tlb_flush_nocheck(CPUState *cpu)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
     /* The QOM tests will trigger tlb_flushes without setting up TCG
      * so we bug out here in that case.
@@ -127,8 +246,11 @@ static void tlb_flush_nocheck(CPUState *cpu)
 
     tb_lock();
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_one_mmuidx(env, mmu_idx);
+    }
     memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    memset(cpu->mmio_cache, 0, sizeof(cpu->mmio_cache));
     cpu_tb_jmp_cache_clear(cpu);
 
     env->vtlb_index = 0;
@@ -189,11 +311,12 @@ static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
         if (test_bit(mmu_idx, &mmu_idx_bitmask)) {
             tlb_debug("%d\n", mmu_idx);
 
-            memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+            tlb_flush_one_mmuidx(env, mmu_idx);
             memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
         }
     }
 
+    memset(cpu->mmio_cache, 0, sizeof(cpu->mmio_cache));
     cpu_tb_jmp_cache_clear(cpu);
 
     tlb_debug("done\n");
@@ -245,7 +368,8 @@ void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
 
 
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+/* Returns true if the entry was live and has been dropped */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -254,7 +378,9 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
     }
+    return false;
 }
 
 static void tlb_flush_page_async_work(CPUState *cpu, run_on_cpu_data data)
@@ -279,9 +405,11 @@ static void tlb_flush_page_async_work(CPUState *cpu, run_on_cpu_data data)
     }
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        i = tlb_index(env, mmu_idx, addr);
+        if (tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr)) {
+            tlb_entry_dropped(env, mmu_idx);
+        }
     }
 
     /* check whether there are entries that need to be flushed in the vtlb */
@@ -319,18 +447,21 @@ static void tlb_flush_page_by_mmuidx_async_work(CPUState *cpu,
     target_ulong addr_and_mmuidx = (target_ulong) data.target_ptr;
     target_ulong addr = addr_and_mmuidx & TARGET_PAGE_MASK;
     unsigned long mmu_idx_bitmap = addr_and_mmuidx & ALL_MMUIDX_BITS;
-    int page = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     int mmu_idx;
     int i;
 
     assert_cpu_is_self(cpu);
 
-    tlb_debug("page:%d addr:"TARGET_FMT_lx" mmu_idx:0x%lx\n",
-              page, addr, mmu_idx_bitmap);
+    tlb_debug("addr:"TARGET_FMT_lx" mmu_idx:0x%lx\n",
+              addr, mmu_idx_bitmap);
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         if (test_bit(mmu_idx, &mmu_idx_bitmap)) {
-            tlb_flush_entry(&env->tlb_table[mmu_idx][page], addr);
+            if (tlb_flush_entry(&env->tlb_table[mmu_idx]
+                                               [tlb_index(env, mmu_idx, addr)],
+                                addr)) {
+                tlb_entry_dropped(env, mmu_idx);
+            }
 
             /* check whether there are vltb entries that need to be flushed */
             for (i = 0; i < CPU_VTLB_SIZE; i++) {
@@ -534,10 +665,12 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
     int mmu_idx;
 
     env = cpu->env_ptr;
+    /* keeps the owner from swapping a table out from under the walk */
+    tlb_table_lock(env);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         unsigned int i;
 
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
+        for (i = 0; i < tlb_n_entries(env, mmu_idx); i++) {
             tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                   start1, length);
         }
@@ -547,6 +680,7 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
                                   start1, length);
         }
     }
+    tlb_table_unlock(env);
 }
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
@@ -567,8 +701,8 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
     assert_cpu_is_self(cpu);
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        i = tlb_index(env, mmu_idx, vaddr);
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
 
@@ -622,6 +756,8 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     uintptr_t addend;
     CPUTLBEntry *te, *tv, tn;
     hwaddr iotlb, xlat, sz;
+    ram_addr_t watch_ram;
+    int watch;
     unsigned vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
     int asidx = cpu_asidx_from_attrs(cpu, attrs);
 
@@ -653,7 +789,18 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    /* RAM that only takes the I/O path because of watchpoints */
+    watch = 0;
+    watch_ram = 0;
+    if ((address & TLB_MMIO) && !(code_address & TLB_MMIO)) {
+        watch = PAGE_READ;
+        if (memory_region_is_ram(section->mr) && !section->readonly) {
+            watch |= PAGE_WRITE;
+            watch_ram = memory_region_get_ram_addr(section->mr) + xlat;
+        }
+    }
+
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
     /* do not discard the translation in te, evict it into a victim tlb */
     tv = &env->tlb_v_table[mmu_idx][vidx];
@@ -663,9 +810,17 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
 
     env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    if (te->addr_read == -1 && te->addr_write == -1 && te->addr_code == -1) {
+        env->tlb_desc[mmu_idx].n_used_entries++;
+    }
+#endif
+
     /* refill the tlb */
     env->iotlb[mmu_idx][index].addr = iotlb - vaddr;
     env->iotlb[mmu_idx][index].attrs = attrs;
+    env->iotlb[mmu_idx][index].watch = watch;
+    env->iotlb[mmu_idx][index].watch_ram = watch_ram;
 
     /* Now calculate the new entry */
     tn.addend = addend - vaddr;
@@ -760,22 +915,159 @@ static inline ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
     return ram_addr;
 }
 
+/* Before a store to @haddr, the host address of @addr in RAM that holds
+ * translated code: drops the TBs that the @size bytes written overlap,
+ * see tb_invalidate_phys_page_fast().
+ */
+static inline void notdirty_write_prepare(CPUArchState *env,
+                                          NotDirtyInfo *ndi,
+                                          target_ulong addr, uintptr_t haddr,
+                                          unsigned size, uintptr_t retaddr)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    /* As io_writex() sets them for precise SMC */
+    cpu->mem_io_vaddr = addr;
+    cpu->mem_io_pc = retaddr;
+    memory_notdirty_write_prepare(ndi, cpu, addr,
+                                  qemu_ram_addr_from_host_nofail((void *)haddr),
+                                  size);
+}
+
+/* Reads in a row of the same value by the same load before the vCPU is
+ * considered to be spinning
+ */
+#define CPU_POLL_SKIP_READS 64
+
+static void cpu_poll_check(CPUState *cpu, MemoryRegion *mr, hwaddr addr,
+                           uint64_t val, uintptr_t retaddr)
+{
+    if (cpu->poll_mr != mr || cpu->poll_addr != addr ||
+        cpu->poll_val != val || cpu->poll_pc != retaddr) {
+        cpu->poll_mr = mr;
+        cpu->poll_addr = addr;
+        cpu->poll_val = val;
+        cpu->poll_pc = retaddr;
+        cpu->poll_count = 0;
+        return;
+    }
+
+    if (++cpu->poll_count < CPU_POLL_SKIP_READS) {
+        return;
+    }
+    cpu->poll_count = 0;
+    if (qemu_mutex_iothread_locked()) {
+        qemu_poll_skip(cpu);
+    } else {
+        qemu_mutex_lock_iothread();
+        qemu_poll_skip(cpu);
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* Find the region behind @iotlbentry, and how it may be accessed without
+ * going through memory_region_dispatch_read/write.
+ */
+static CPUMMIOCacheEntry *io_cache_lookup(CPUState *cpu,
+                                          CPUIOTLBEntry *iotlbentry)
+{
+    hwaddr key = iotlbentry->addr;
+    CPUMMIOCacheEntry *e;
+
+    e = &cpu->mmio_cache[(key ^ (key >> TARGET_PAGE_BITS)) &
+                         (CPU_MMIO_CACHE_SIZE - 1)];
+    if (unlikely(!e->mr || e->iotlb != key ||
+                 memcmp(&e->attrs, &iotlbentry->attrs, sizeof(e->attrs)))) {
+        e->iotlb = key;
+        e->attrs = iotlbentry->attrs;
+        e->mr = iotlb_to_region(cpu, key, iotlbentry->attrs);
+        e->ops = e->mr->ops;
+        e->opaque = e->mr->opaque;
+        e->read_sizes = memory_region_direct_sizes(e->mr, false);
+        e->write_sizes = memory_region_direct_sizes(e->mr, true);
+    }
+    return e;
+}
+
+/* Accesses to a RAM page with watchpoints that miss every watched byte
+ * use host memory like the fast path would, rather than the watchpoint
+ * region.  Like the I/O callbacks, they work in target byte order.
+ */
+static void *io_watch_haddr(CPUArchState *env, int mmu_idx, target_ulong addr)
+{
+    CPUTLBEntry *entry = &env->tlb_table[mmu_idx][tlb_index(env, mmu_idx,
+                                                            addr)];
+
+    return (void *)((uintptr_t)addr + entry->addend);
+}
+
+static uint64_t io_watch_read(CPUArchState *env, int mmu_idx,
+                              target_ulong addr, int size)
+{
+    void *haddr = io_watch_haddr(env, mmu_idx, addr);
+
+    switch (size) {
+    case 1:
+        return ldub_p(haddr);
+    case 2:
+        return lduw_p(haddr);
+    case 4:
+        return (uint32_t)ldl_p(haddr);
+    case 8:
+        return ldq_p(haddr);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void io_watch_write(CPUArchState *env, int mmu_idx,
+                           uint64_t val, target_ulong addr, int size)
+{
+    void *haddr = io_watch_haddr(env, mmu_idx, addr);
+
+    switch (size) {
+    case 1:
+        stb_p(haddr, val);
+        break;
+    case 2:
+        stw_p(haddr, val);
+        break;
+    case 4:
+        stl_p(haddr, val);
+        break;
+    case 8:
+        stq_p(haddr, val);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
 static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
                          int mmu_idx,
                          target_ulong addr, uintptr_t retaddr, int size)
 {
     CPUState *cpu = ENV_GET_CPU(env);
     hwaddr physaddr = iotlbentry->addr;
-    MemoryRegion *mr = iotlb_to_region(cpu, physaddr, iotlbentry->attrs);
+    CPUMMIOCacheEntry *e;
+    MemoryRegion *mr;
     uint64_t val;
     bool locked = false;
     MemTxResult r;
 
+    if (unlikely(iotlbentry->watch & PAGE_READ) &&
+        !cpu_watchpoint_may_hit(cpu, addr, size, BP_MEM_READ)) {
+        return io_watch_read(env, mmu_idx, addr, size);
+    }
+
+    e = io_cache_lookup(cpu, iotlbentry);
+    mr = e->mr;
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     cpu->mem_io_pc = retaddr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !cpu->can_do_io) {
         cpu_io_recompile(cpu, retaddr);
     }
+    atomic_set(&cpu->exec_stats.mmio, cpu->exec_stats.mmio + 1);
 
     cpu->mem_io_vaddr = addr;
 
@@ -783,12 +1075,24 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
         qemu_mutex_lock_iothread();
         locked = true;
     }
-    r = memory_region_dispatch_read(mr, physaddr,
-                                    &val, size, iotlbentry->attrs);
+    if ((e->read_sizes & size) && !(physaddr & (size - 1)) &&
+        !trace_event_get_state_backends(TRACE_MEMORY_REGION_OPS_READ)) {
+        val = e->ops->read(e->opaque, physaddr, size) &
+              MAKE_64BIT_MASK(0, size * 8);
+        r = MEMTX_OK;
+    } else {
+        r = memory_region_dispatch_read(mr, physaddr,
+                                        &val, size, iotlbentry->attrs);
+    }
     if (r != MEMTX_OK) {
         cpu_transaction_failed(cpu, physaddr, addr, size, MMU_DATA_LOAD,
                                mmu_idx, iotlbentry->attrs, r, retaddr);
     }
+    if (unlikely(mr->pollable)) {
+        cpu_poll_check(cpu, mr, physaddr, val, retaddr);
+    } else {
+        cpu->poll_mr = NULL;
+    }
     if (locked) {
         qemu_mutex_unlock_iothread();
     }
@@ -803,23 +1107,45 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 {
     CPUState *cpu = ENV_GET_CPU(env);
     hwaddr physaddr = iotlbentry->addr;
-    MemoryRegion *mr = iotlb_to_region(cpu, physaddr, iotlbentry->attrs);
+    CPUMMIOCacheEntry *e;
+    MemoryRegion *mr;
     bool locked = false;
     MemTxResult r;
 
+    /* Clean pages still need the dirty tracking of the slow path */
+    if (unlikely(iotlbentry->watch & PAGE_WRITE) &&
+        !cpu_physical_memory_is_clean(iotlbentry->watch_ram +
+                                      (addr & ~TARGET_PAGE_MASK)) &&
+        !cpu_watchpoint_may_hit(cpu, addr, size, BP_MEM_WRITE)) {
+        io_watch_write(env, mmu_idx, val, addr, size);
+        return;
+    }
+
+    e = io_cache_lookup(cpu, iotlbentry);
+    mr = e->mr;
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !cpu->can_do_io) {
         cpu_io_recompile(cpu, retaddr);
     }
+    atomic_set(&cpu->exec_stats.mmio, cpu->exec_stats.mmio + 1);
     cpu->mem_io_vaddr = addr;
     cpu->mem_io_pc = retaddr;
+    cpu->poll_mr = NULL;
 
     if (mr->global_locking && !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         locked = true;
     }
-    r = memory_region_dispatch_write(mr, physaddr,
-                                     val, size, iotlbentry->attrs);
+    if ((e->write_sizes & size) && !(physaddr & (size - 1)) &&
+        !mr->ioeventfd_nb &&
+        !trace_event_get_state_backends(TRACE_MEMORY_REGION_OPS_WRITE)) {
+        e->ops->write(e->opaque, physaddr, val & MAKE_64BIT_MASK(0, size * 8),
+                      size);
+        r = MEMTX_OK;
+    } else {
+        r = memory_region_dispatch_write(mr, physaddr,
+                                         val, size, iotlbentry->attrs);
+    }
     if (r != MEMTX_OK) {
         cpu_transaction_failed(cpu, physaddr, addr, size, MMU_DATA_STORE,
                                mmu_idx, iotlbentry->attrs, r, retaddr);
@@ -875,13 +1201,15 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env, target_ulong addr)
     CPUIOTLBEntry *iotlbentry;
     hwaddr physaddr;
 
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env, true);
+    index = tlb_index(env, mmu_idx, addr);
     if (unlikely(env->tlb_table[mmu_idx][index].addr_code !=
                  (addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK)))) {
         if (!VICTIM_TLB_HIT(addr_read, addr)) {
             tlb_fill(ENV_GET_CPU(env), addr, 0, MMU_INST_FETCH, mmu_idx, 0);
         }
+        /* A flush in tlb_fill() may have resized the table */
+        index = tlb_index(env, mmu_idx, addr);
     }
     iotlbentry = &env->iotlb[mmu_idx][index];
     pd = iotlbentry->addr & ~TARGET_PAGE_MASK;
@@ -919,7 +1247,7 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env, target_ulong addr)
         exit(1);
     }
     p = (void *)((uintptr_t)addr + env->tlb_table[mmu_idx][index].addend);
-    return qemu_ram_addr_from_host_nofail(p);
+    return tb_share_lookup(qemu_ram_addr_from_host_nofail(p));
 }
 
 /* Probe for whether the specified guest write access is permitted.
@@ -931,7 +1259,7 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env, target_ulong addr)
 void probe_write(CPUArchState *env, target_ulong addr, int size, int mmu_idx,
                  uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
 
     if ((addr & TARGET_PAGE_MASK)
@@ -944,6 +1272,176 @@ void probe_write(CPUArchState *env, target_ulong addr, int size, int mmu_idx,
     }
 }
 
+bool tlb_access_burst(CPUArchState *env, target_ulong addr, uint32_t *data,
+                      unsigned count, bool is_write, int mmu_idx,
+                      uintptr_t retaddr)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    int index = tlb_index(env, mmu_idx, addr);
+    CPUTLBEntry *tlbe = &env->tlb_table[mmu_idx][index];
+    target_ulong tlb_addr = is_write ? tlbe->addr_write : tlbe->addr_read;
+    CPUIOTLBEntry *iotlbentry = &env->iotlb[mmu_idx][index];
+    CPUMMIOCacheEntry *e;
+    hwaddr physaddr;
+    bool locked = false;
+    MemTxResult r;
+
+    /* Only a present MMIO entry: the first access to a page, RAM and
+     * watchpoints all take the word-by-word path.
+     */
+    if ((addr & 3) || count < 2 ||
+        ((addr + count * 4 - 1) & TARGET_PAGE_MASK) !=
+        (addr & TARGET_PAGE_MASK) ||
+        (tlb_addr & (TARGET_PAGE_MASK | TLB_FLAGS_MASK)) !=
+        ((addr & TARGET_PAGE_MASK) | TLB_MMIO)) {
+        return false;
+    }
+
+    e = io_cache_lookup(cpu, iotlbentry);
+    if (!e->ops->access_burst || e->mr == &io_mem_rom ||
+        e->mr == &io_mem_notdirty) {
+        return false;
+    }
+
+    physaddr = (iotlbentry->addr & TARGET_PAGE_MASK) + addr;
+    cpu->mem_io_pc = retaddr;
+    if (!cpu->can_do_io) {
+        cpu_io_recompile(cpu, retaddr);
+    }
+    cpu->mem_io_vaddr = addr;
+
+    if (e->mr->global_locking && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
+    r = memory_region_dispatch_burst(e->mr, physaddr, data, count, is_write,
+                                     iotlbentry->attrs);
+    if (r != MEMTX_OK) {
+        cpu_transaction_failed(cpu, physaddr, addr, count * 4,
+                               is_write ? MMU_DATA_STORE : MMU_DATA_LOAD,
+                               mmu_idx, iotlbentry->attrs, r, retaddr);
+    }
+    cpu->poll_mr = NULL;
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return true;
+}
+
+struct MMIODirect {
+    MemoryRegion *mr;
+    const MemoryRegionOps *ops;
+    void *opaque;
+    hwaddr offset;
+    unsigned size;
+    bool is_write;
+    unsigned generation;
+};
+
+/* Every handle handed out, so that translating the same access again
+ * reuses one.  A handle of an older memory map is never freed: TBs may
+ * still hold it.  Protected by tb_lock.
+ */
+static GHashTable *mmio_direct_handles;
+
+static guint mmio_direct_hash(gconstpointer p)
+{
+    const MMIODirect *d = p;
+
+    return g_direct_hash(d->mr) ^ d->offset ^ (d->size << 24) ^
+           (guint)d->is_write << 31 ^ d->generation;
+}
+
+static gboolean mmio_direct_equal(gconstpointer a, gconstpointer b)
+{
+    const MMIODirect *da = a;
+    const MMIODirect *db = b;
+
+    return da->mr == db->mr && da->offset == db->offset &&
+           da->size == db->size && da->is_write == db->is_write &&
+           da->generation == db->generation;
+}
+
+MMIODirect *mmio_direct_lookup(AddressSpace *as, hwaddr addr,
+                               unsigned size, bool is_write)
+{
+    MMIODirect key, *d = NULL;
+    hwaddr xlat, len = size;
+    MemoryRegion *mr;
+
+    rcu_read_lock();
+    key.generation = atomic_mb_read(&memory_map_generation);
+    mr = address_space_translate(as, addr, &xlat, &len, is_write);
+    if (!mr->direct_call || mr->ram || mr->romd_mode || len < size ||
+        (xlat & (size - 1)) ||
+        !(memory_region_direct_sizes(mr, is_write) & size)) {
+        goto out;
+    }
+
+    key.mr = mr;
+    key.offset = xlat;
+    key.size = size;
+    key.is_write = is_write;
+    if (!mmio_direct_handles) {
+        mmio_direct_handles = g_hash_table_new(mmio_direct_hash,
+                                               mmio_direct_equal);
+    }
+    d = g_hash_table_lookup(mmio_direct_handles, &key);
+    if (!d) {
+        d = g_memdup(&key, sizeof(key));
+        d->ops = mr->ops;
+        d->opaque = mr->opaque;
+        g_hash_table_add(mmio_direct_handles, d);
+    }
+out:
+    rcu_read_unlock();
+    return d;
+}
+
+bool mmio_direct_access(CPUState *cpu, MMIODirect *d, target_ulong addr,
+                        uint64_t *val, uintptr_t retaddr)
+{
+    MemoryRegion *mr = d->mr;
+    bool locked = false;
+
+    /* Watchpoints and the dispatch trace events are only in the slow path */
+    if (unlikely(d->generation != atomic_read(&memory_map_generation) ||
+                 !QTAILQ_EMPTY(&cpu->watchpoints) ||
+                 (d->is_write ?
+                  mr->ioeventfd_nb ||
+                  trace_event_get_state_backends(
+                      TRACE_MEMORY_REGION_OPS_WRITE) :
+                  trace_event_get_state_backends(
+                      TRACE_MEMORY_REGION_OPS_READ)))) {
+        return false;
+    }
+
+    atomic_set(&cpu->exec_stats.mmio, cpu->exec_stats.mmio + 1);
+    cpu->mem_io_vaddr = addr;
+    cpu->mem_io_pc = retaddr;
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
+    if (d->is_write) {
+        cpu->poll_mr = NULL;
+        d->ops->write(d->opaque, d->offset,
+                      *val & MAKE_64BIT_MASK(0, d->size * 8), d->size);
+    } else {
+        *val = d->ops->read(d->opaque, d->offset, d->size) &
+               MAKE_64BIT_MASK(0, d->size * 8);
+        if (unlikely(mr->pollable)) {
+            cpu_poll_check(cpu, mr, d->offset, *val, retaddr);
+        } else {
+            cpu->poll_mr = NULL;
+        }
+    }
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return true;
+}
+
 /* Probe for a read-modify-write atomic operation.  Do not allow unaligned
  * operations, or io operations to proceed.  Return the host address.  */
 static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
@@ -951,7 +1449,7 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
                                NotDirtyInfo *ndi)
 {
     size_t mmu_idx = get_mmuidx(oi);
-    size_t index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    size_t index = tlb_index(env, mmu_idx, addr);
     CPUTLBEntry *tlbe = &env->tlb_table[mmu_idx][index];
     target_ulong tlb_addr = tlbe->addr_write;
     TCGMemOp mop = get_memop(oi);
@@ -985,6 +1483,9 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
             tlb_fill(ENV_GET_CPU(env), addr, 1 << s_bits, MMU_DATA_STORE,
                      mmu_idx, retaddr);
         }
+        /* A flush in tlb_fill() may have resized the table */
+        index = tlb_index(env, mmu_idx, addr);
+        tlbe = &env->tlb_table[mmu_idx][index];
         tlb_addr = tlbe->addr_write & ~TLB_INVALID_MASK;
     }
 
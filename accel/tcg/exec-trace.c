@@ -0,0 +1,206 @@
+/*
+ * Binary trace of translation block executions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/helper-proto.h"
+#include "exec/exec-trace.h"
+#include <zlib.h>
+
+#define EXEC_TRACE_MAGIC        "QEMUEXT1"
+#define EXEC_TRACE_CHUNK_SIZE   (256 * 1024)
+/* Three varints of at most 10 bytes */
+#define EXEC_TRACE_RECORD_MAX   30
+
+/*
+ * The records of one vCPU since its last chunk.  Each chunk starts from
+ * zero, so that chunks can be decoded on their own.
+ */
+typedef struct ExecTraceBuffer {
+    uint8_t *data;
+    size_t len;
+    int cpu_index;
+    uint32_t prev_id;
+    uint64_t prev_pc;
+    uint32_t prev_insns;
+} ExecTraceBuffer;
+
+typedef struct ExecTraceChunk {
+    uint8_t *data;
+    size_t len;
+    int cpu_index;
+} ExecTraceChunk;
+
+bool tcg_exec_trace;
+static uint32_t exec_trace_next_id;
+
+static FILE *exec_trace_file;
+static QemuThread exec_trace_thread;
+static QemuMutex exec_trace_lock;
+static QemuCond exec_trace_cond;
+static GQueue exec_trace_queue = G_QUEUE_INIT;
+static bool exec_trace_stopping;
+
+/* Chunk header: vCPU index, compressed size, raw size, little endian */
+static void exec_trace_write_chunk(ExecTraceChunk *chunk, uint8_t *out,
+                                   uLongf out_size)
+{
+    uint8_t header[12];
+
+    if (compress2(out, &out_size, chunk->data, chunk->len, 1) != Z_OK) {
+        error_report("-exec-trace: cannot compress %zu bytes", chunk->len);
+        return;
+    }
+    stl_le_p(header, chunk->cpu_index);
+    stl_le_p(header + 4, out_size);
+    stl_le_p(header + 8, chunk->len);
+    if (fwrite(header, sizeof(header), 1, exec_trace_file) != 1 ||
+        fwrite(out, out_size, 1, exec_trace_file) != 1) {
+        error_report("-exec-trace: write failed: %s", strerror(errno));
+    }
+}
+
+static void *exec_trace_writer(void *opaque)
+{
+    uLongf out_size = compressBound(EXEC_TRACE_CHUNK_SIZE);
+    uint8_t *out = g_malloc(out_size);
+    ExecTraceChunk *chunk;
+
+    qemu_mutex_lock(&exec_trace_lock);
+    for (;;) {
+        chunk = g_queue_pop_head(&exec_trace_queue);
+        if (!chunk) {
+            if (exec_trace_stopping) {
+                break;
+            }
+            qemu_cond_wait(&exec_trace_cond, &exec_trace_lock);
+            continue;
+        }
+        qemu_mutex_unlock(&exec_trace_lock);
+
+        exec_trace_write_chunk(chunk, out, out_size);
+        g_free(chunk->data);
+        g_free(chunk);
+
+        qemu_mutex_lock(&exec_trace_lock);
+    }
+    qemu_mutex_unlock(&exec_trace_lock);
+
+    g_free(out);
+    return NULL;
+}
+
+static void exec_trace_submit(ExecTraceBuffer *buf)
+{
+    ExecTraceChunk *chunk;
+
+    if (!buf->len) {
+        return;
+    }
+    chunk = g_new(ExecTraceChunk, 1);
+    chunk->data = buf->data;
+    chunk->len = buf->len;
+    chunk->cpu_index = buf->cpu_index;
+
+    qemu_mutex_lock(&exec_trace_lock);
+    g_queue_push_tail(&exec_trace_queue, chunk);
+    qemu_cond_signal(&exec_trace_cond);
+    qemu_mutex_unlock(&exec_trace_lock);
+
+    buf->data = g_malloc(EXEC_TRACE_CHUNK_SIZE);
+    buf->len = 0;
+    buf->prev_id = 0;
+    buf->prev_pc = 0;
+}
+
+static inline void exec_trace_put(ExecTraceBuffer *buf, uint64_t val)
+{
+    while (val >= 0x80) {
+        buf->data[buf->len++] = val | 0x80;
+        val >>= 7;
+    }
+    buf->data[buf->len++] = val;
+}
+
+static inline uint64_t exec_trace_zigzag(int64_t val)
+{
+    return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+uint32_t exec_trace_new_id(void)
+{
+    return atomic_fetch_inc(&exec_trace_next_id);
+}
+
+void HELPER(exec_trace)(CPUArchState *env, void *ptr)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    TranslationBlock *tb = ptr;
+    ExecTraceBuffer *buf = cpu->exec_trace;
+
+    if (unlikely(!buf)) {
+        buf = cpu->exec_trace = g_new0(ExecTraceBuffer, 1);
+        buf->data = g_malloc(EXEC_TRACE_CHUNK_SIZE);
+        buf->cpu_index = cpu->cpu_index;
+    } else if (buf->len + EXEC_TRACE_RECORD_MAX > EXEC_TRACE_CHUNK_SIZE) {
+        exec_trace_submit(buf);
+    }
+
+    exec_trace_put(buf, exec_trace_zigzag((int32_t)(tb->trace_id -
+                                                    buf->prev_id)));
+    exec_trace_put(buf, exec_trace_zigzag(tb->pc - buf->prev_pc));
+    exec_trace_put(buf, buf->prev_insns);
+    buf->prev_id = tb->trace_id;
+    buf->prev_pc = tb->pc;
+    buf->prev_insns = tb->icount;
+}
+
+void exec_trace_start(const char *path)
+{
+    exec_trace_file = fopen(path, "wb");
+    if (!exec_trace_file) {
+        error_report("-exec-trace: cannot open %s: %s", path,
+                     strerror(errno));
+        exit(1);
+    }
+    fwrite(EXEC_TRACE_MAGIC, strlen(EXEC_TRACE_MAGIC), 1, exec_trace_file);
+
+    qemu_mutex_init(&exec_trace_lock);
+    qemu_cond_init(&exec_trace_cond);
+    qemu_thread_create(&exec_trace_thread, "exec-trace", exec_trace_writer,
+                       NULL, QEMU_THREAD_JOINABLE);
+    tcg_exec_trace = true;
+}
+
+void exec_trace_stop(void)
+{
+    CPUState *cpu;
+
+    if (!exec_trace_file) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        if (cpu->exec_trace) {
+            exec_trace_submit(cpu->exec_trace);
+        }
+    }
+
+    qemu_mutex_lock(&exec_trace_lock);
+    exec_trace_stopping = true;
+    qemu_cond_signal(&exec_trace_cond);
+    qemu_mutex_unlock(&exec_trace_lock);
+    qemu_thread_join(&exec_trace_thread);
+
+    fclose(exec_trace_file);
+    exec_trace_file = NULL;
+}
@@ -0,0 +1,186 @@
+/*
+ * Statistical sampling profiler for guest code
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "cpu.h"
+#include "disas/disas.h"
+#include "exec/sample-profile.h"
+
+#define SAMPLE_PROFILE_FRAMES   4
+
+/* SampleProfileStack::context besides exception numbers */
+#define SAMPLE_PROFILE_THREAD   -1
+#define SAMPLE_PROFILE_IDLE     -2
+
+typedef struct SampleProfileStack {
+    int context;
+    int nframes;
+    vaddr frames[SAMPLE_PROFILE_FRAMES];    /* innermost first */
+    uint64_t count;                         /* not part of the key */
+} SampleProfileStack;
+
+static char *sample_profile_path;
+static unsigned long sample_profile_period_us;
+static QemuThread sample_profile_thread;
+static bool sample_profile_stopping;
+
+/* Stacks seen so far; both key and value */
+static GHashTable *sample_profile_stacks;
+static QemuMutex sample_profile_lock;
+
+static guint sample_profile_hash(gconstpointer key)
+{
+    const SampleProfileStack *s = key;
+    guint hash = s->context * 31 + s->nframes;
+    int i;
+
+    for (i = 0; i < s->nframes; i++) {
+        hash = hash * 31 + (guint)s->frames[i] + (guint)(s->frames[i] >> 32);
+    }
+    return hash;
+}
+
+static gboolean sample_profile_equal(gconstpointer a, gconstpointer b)
+{
+    const SampleProfileStack *sa = a;
+    const SampleProfileStack *sb = b;
+
+    return sa->context == sb->context && sa->nframes == sb->nframes &&
+           !memcmp(sa->frames, sb->frames, sa->nframes * sizeof(vaddr));
+}
+
+static void sample_profile_add(const SampleProfileStack *stack)
+{
+    SampleProfileStack *s;
+
+    qemu_mutex_lock(&sample_profile_lock);
+    s = g_hash_table_lookup(sample_profile_stacks, stack);
+    if (!s) {
+        s = g_memdup(stack, sizeof(*stack));
+        g_hash_table_add(sample_profile_stacks, s);
+    }
+    s->count++;
+    qemu_mutex_unlock(&sample_profile_lock);
+}
+
+void sample_profile_take(CPUState *cpu)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    SampleProfileStack stack = { 0 };
+
+    atomic_set(&cpu->profile_sample, false);
+    if (!cc->profile_sample) {
+        return;
+    }
+    stack.nframes = cc->profile_sample(cpu, stack.frames,
+                                       SAMPLE_PROFILE_FRAMES, &stack.context);
+    sample_profile_add(&stack);
+}
+
+static void *sample_profile_run(void *opaque)
+{
+    SampleProfileStack idle = { .context = SAMPLE_PROFILE_IDLE };
+    CPUState *cpu;
+
+    rcu_register_thread();
+    while (!atomic_read(&sample_profile_stopping)) {
+        g_usleep(sample_profile_period_us);
+
+        rcu_read_lock();
+        CPU_FOREACH(cpu) {
+            if (atomic_read(&cpu->halted)) {
+                sample_profile_add(&idle);
+            } else {
+                /* Leave the TB chain at the next boundary */
+                atomic_set(&cpu->profile_sample, true);
+                atomic_set(&cpu->icount_decr.u16.high, -1);
+            }
+        }
+        rcu_read_unlock();
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void sample_profile_start(const char *path, unsigned int hz)
+{
+    if (!hz || hz > 100000) {
+        error_report("-sample-profile: hz must be between 1 and 100000");
+        exit(1);
+    }
+    sample_profile_path = g_strdup(path);
+    sample_profile_period_us = 1000000 / hz;
+    sample_profile_stacks = g_hash_table_new_full(sample_profile_hash,
+                                                  sample_profile_equal,
+                                                  g_free, NULL);
+    qemu_mutex_init(&sample_profile_lock);
+    qemu_thread_create(&sample_profile_thread, "sample-profile",
+                       sample_profile_run, NULL, QEMU_THREAD_JOINABLE);
+}
+
+static void sample_profile_print_frame(FILE *f, vaddr pc)
+{
+    const char *symbol = lookup_symbol(pc);
+
+    if (symbol[0]) {
+        fprintf(f, ";%s", symbol);
+    } else {
+        fprintf(f, ";0x%" VADDR_PRIx, pc);
+    }
+}
+
+static void sample_profile_print(gpointer key, gpointer value,
+                                 gpointer opaque)
+{
+    SampleProfileStack *s = key;
+    FILE *f = opaque;
+    int i;
+
+    switch (s->context) {
+    case SAMPLE_PROFILE_IDLE:
+        fprintf(f, "idle");
+        break;
+    case SAMPLE_PROFILE_THREAD:
+        fprintf(f, "thread");
+        break;
+    default:
+        fprintf(f, "exception %d", s->context);
+        break;
+    }
+    for (i = s->nframes - 1; i >= 0; i--) {
+        sample_profile_print_frame(f, s->frames[i]);
+    }
+    fprintf(f, " %" PRIu64 "\n", s->count);
+}
+
+void sample_profile_stop(void)
+{
+    FILE *f;
+
+    if (!sample_profile_path) {
+        return;
+    }
+    atomic_set(&sample_profile_stopping, true);
+    qemu_thread_join(&sample_profile_thread);
+
+    f = fopen(sample_profile_path, "w");
+    if (!f) {
+        error_report("-sample-profile: cannot write %s: %s",
+                     sample_profile_path, strerror(errno));
+    } else {
+        qemu_mutex_lock(&sample_profile_lock);
+        g_hash_table_foreach(sample_profile_stacks, sample_profile_print, f);
+        qemu_mutex_unlock(&sample_profile_lock);
+        fclose(f);
+    }
+    g_free(sample_profile_path);
+    sample_profile_path = NULL;
+}
@@ -0,0 +1,239 @@
+/*
+ * Guest code coverage from translation blocks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "cpu.h"
+#include "disas/disas.h"
+#include "exec/tb-coverage.h"
+#ifdef CONFIG_POSIX
+#include <sys/shm.h>
+#endif
+
+typedef struct TBCoverageBlock {
+    uint64_t pc;            /* hash key */
+    uint32_t size;
+    uint8_t hit;
+} TBCoverageBlock;
+
+int tcg_tb_coverage;
+uint8_t *tb_coverage_edge_map;
+
+/* pc -> TBCoverageBlock, never freed: the flags are in generated code */
+static GHashTable *tb_coverage_blocks;
+
+static TBCoverageBlock *tb_coverage_block(target_ulong pc)
+{
+    uint64_t key = pc;
+    TBCoverageBlock *block;
+
+    if (!tb_coverage_blocks) {
+        tb_coverage_blocks = g_hash_table_new(g_int64_hash, g_int64_equal);
+    }
+    block = g_hash_table_lookup(tb_coverage_blocks, &key);
+    if (!block) {
+        block = g_new0(TBCoverageBlock, 1);
+        block->pc = pc;
+        g_hash_table_insert(tb_coverage_blocks, &block->pc, block);
+    }
+    return block;
+}
+
+void tb_coverage_add(TranslationBlock *tb)
+{
+    TBCoverageBlock *block = tb_coverage_block(tb->pc);
+
+    block->size = MAX(block->size, tb->size);
+}
+
+uint8_t *tb_coverage_hit_flag(target_ulong pc)
+{
+    return &tb_coverage_block(pc)->hit;
+}
+
+bool tb_coverage_edge_map_open(const char *file, Error **errp)
+{
+#ifdef CONFIG_POSIX
+    const char *shm_id = getenv("__AFL_SHM_ID");
+    void *map;
+    int fd;
+
+    if (!file) {
+        if (!shm_id) {
+            error_setg(errp, "no map file given and __AFL_SHM_ID is not set");
+            return false;
+        }
+        map = shmat(atoi(shm_id), NULL, 0);
+        if (map == (void *)-1) {
+            error_setg_errno(errp, errno, "cannot attach shared memory %s",
+                             shm_id);
+            return false;
+        }
+        tb_coverage_edge_map = map;
+        return true;
+    }
+
+    fd = qemu_open(file, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot open %s", file);
+        return false;
+    }
+    if (ftruncate(fd, TB_COVERAGE_EDGE_MAP_SIZE) < 0) {
+        error_setg_errno(errp, errno, "cannot size %s", file);
+        qemu_close(fd);
+        return false;
+    }
+    map = mmap(NULL, TB_COVERAGE_EDGE_MAP_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    qemu_close(fd);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "cannot map %s", file);
+        return false;
+    }
+    tb_coverage_edge_map = map;
+    return true;
+#else
+    error_setg(errp, "edge coverage needs a POSIX host");
+    return false;
+#endif
+}
+
+void tb_coverage_edge_reset(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->tb_edge_prev, 0);
+    }
+}
+
+static gint tb_coverage_cmp(gconstpointer a, gconstpointer b)
+{
+    const TBCoverageBlock *ba = *(TBCoverageBlock * const *)a;
+    const TBCoverageBlock *bb = *(TBCoverageBlock * const *)b;
+
+    return ba->pc < bb->pc ? -1 : ba->pc > bb->pc;
+}
+
+static bool tb_coverage_covered(TBCoverageBlock *block)
+{
+    return block->size && (tcg_tb_coverage != TB_COVERAGE_EXECUTED ||
+                           atomic_read(&block->hit));
+}
+
+/*
+ * drcov version 2, as written by DynamoRIO and read by e.g. Lighthouse:
+ * a text header with the module table, then a binary table of the
+ * covered blocks as module offsets.
+ */
+static void tb_coverage_dump_drcov(FILE *f, GPtrArray *blocks,
+                                   const char *image)
+{
+    uint64_t base = 0, end = 0;
+    unsigned count = 0;
+    int i;
+
+    for (i = 0; i < blocks->len; i++) {
+        TBCoverageBlock *block = g_ptr_array_index(blocks, i);
+
+        if (tb_coverage_covered(block)) {
+            if (!count++) {
+                base = block->pc;
+            }
+            end = MAX(end, block->pc + block->size);
+        }
+    }
+
+    fprintf(f, "DRCOV VERSION: 2\n"
+            "DRCOV FLAVOR: qemu\n"
+            "Module Table: version 2, count 1\n"
+            "Columns: id, base, end, entry, checksum, timestamp, path\n"
+            " 0, 0x%" PRIx64 ", 0x%" PRIx64 ", 0x0, 0x0, 0x0, %s\n"
+            "BB Table: %u bbs\n", base, end, image, count);
+
+    for (i = 0; i < blocks->len; i++) {
+        TBCoverageBlock *block = g_ptr_array_index(blocks, i);
+        uint8_t bb[8];
+
+        if (tb_coverage_covered(block)) {
+            stl_le_p(bb, block->pc - base);
+            stw_le_p(bb + 4, MIN(block->size, UINT16_MAX));
+            stw_le_p(bb + 6, 0);
+            fwrite(bb, sizeof(bb), 1, f);
+        }
+    }
+}
+
+static void tb_coverage_dump_lcov(FILE *f, GPtrArray *blocks,
+                                  const char *image)
+{
+    unsigned fn = 0, fn_hit = 0, lines = 0, lines_hit = 0;
+    int i, j;
+
+    fprintf(f, "TN:\nSF:%s\n", image);
+
+    /* Blocks are in address order, so a function's blocks are together */
+    for (i = 0; i < blocks->len; i = j) {
+        TBCoverageBlock *block = g_ptr_array_index(blocks, i);
+        const char *symbol = lookup_symbol(block->pc);
+        bool covered = false;
+
+        for (j = i; j < blocks->len; j++) {
+            TBCoverageBlock *b = g_ptr_array_index(blocks, j);
+
+            if (strcmp(lookup_symbol(b->pc), symbol) != 0) {
+                break;
+            }
+            covered |= tb_coverage_covered(b);
+        }
+        if (symbol[0]) {
+            fprintf(f, "FN:%" PRIu64 ",%s\nFNDA:%d,%s\n",
+                    block->pc, symbol, covered, symbol);
+            fn++;
+            fn_hit += covered;
+        }
+    }
+    fprintf(f, "FNF:%u\nFNH:%u\n", fn, fn_hit);
+
+    for (i = 0; i < blocks->len; i++) {
+        TBCoverageBlock *block = g_ptr_array_index(blocks, i);
+        bool covered = tb_coverage_covered(block);
+
+        if (block->size) {
+            fprintf(f, "DA:%" PRIu64 ",%d\n", block->pc, covered);
+            lines++;
+            lines_hit += covered;
+        }
+    }
+    fprintf(f, "LF:%u\nLH:%u\nend_of_record\n", lines, lines_hit);
+}
+
+void tb_coverage_dump(FILE *f, int format, const char *image)
+{
+    GPtrArray *blocks = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer block;
+
+    tb_lock();
+    if (tb_coverage_blocks) {
+        g_hash_table_iter_init(&iter, tb_coverage_blocks);
+        while (g_hash_table_iter_next(&iter, NULL, &block)) {
+            g_ptr_array_add(blocks, block);
+        }
+    }
+    g_ptr_array_sort(blocks, tb_coverage_cmp);
+
+    if (format == TB_COVERAGE_LCOV) {
+        tb_coverage_dump_lcov(f, blocks, image);
+    } else {
+        tb_coverage_dump_drcov(f, blocks, image);
+    }
+    tb_unlock();
+
+    g_ptr_array_free(blocks, true);
+}
@@ -31,8 +31,17 @@
 #include "qom/cpu.h"
 #include "sysemu/cpus.h"
 #include "qemu/main-loop.h"
+#include "hw/boards.h"
 
 unsigned long tcg_tb_size;
+bool tcg_tb_size_auto;
+
+/*
+ * Host code per byte of guest code that "-tb-size auto" reserves.  This
+ * leaves room for the usual expansion plus retranslations under different
+ * CPU state flags before the buffer fills and is flushed.
+ */
+#define TCG_AUTO_CODE_RATIO 8
 
 #ifndef CONFIG_USER_ONLY
 /* mask must never be zero, except for A20 change call */
@@ -63,7 +72,14 @@ static void tcg_handle_interrupt(CPUState *cpu, int mask)
 
 static int tcg_init(MachineState *ms)
 {
-    tcg_exec_init(tcg_tb_size * 1024 * 1024);
+    MachineClass *mc = MACHINE_GET_CLASS(ms);
+    size_t tb_size = tcg_tb_size * 1024 * 1024;
+
+    /* Without a hint, auto keeps the default size */
+    if (tcg_tb_size_auto) {
+        tb_size = mc->tcg_code_size_hint * TCG_AUTO_CODE_RATIO;
+    }
+    tcg_exec_init(tb_size);
     cpu_interrupt_handler = tcg_handle_interrupt;
     return 0;
 }
@@ -28,6 +28,7 @@
 #include "exec/cpu_ldst.h"
 #include "exec/exec-all.h"
 #include "exec/tb-lookup.h"
+#include "exec/translator.h"
 #include "disas/disas.h"
 #include "exec/log.h"
 
@@ -167,3 +168,33 @@ void HELPER(exit_atomic)(CPUArchState *env)
 {
     cpu_loop_exit_atomic(ENV_GET_CPU(env), GETPC());
 }
+
+/* @tb reached TB_SUPERBLOCK_THRESHOLD entries: leave the chain of TBs at
+   the next boundary so that cpu_exec() calls tb_superblock().  */
+void HELPER(tb_hot)(CPUArchState *env, void *ptr)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    TranslationBlock *tb = ptr;
+
+    cpu->tb_hot = true;
+    cpu->tb_hot_pc = tb->pc;
+    cpu->tb_hot_cs_base = tb->cs_base;
+    cpu->tb_hot_flags = tb->flags;
+    cpu->tb_hot_cflags = tb->cflags & CF_HASH_MASK;
+    atomic_set(&cpu->icount_decr.u16.high, -1);
+}
+
+/* The TB used up the vCPU's -cpu-quota instructions: leave at the next
+   TB boundary, for the vCPU thread to find its quota exhausted.  */
+void HELPER(cpu_quota)(CPUArchState *env)
+{
+    cpu_exit(ENV_GET_CPU(env));
+}
+
+/* See translator_instrument_call() */
+void HELPER(instrument)(void *fn, void *opaque, uint64_t info, uint64_t vaddr)
+{
+    TranslatorInstrumentFn *instrument_fn = fn;
+
+    instrument_fn(opaque, info, vaddr);
+}
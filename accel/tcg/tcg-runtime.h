@@ -28,6 +28,11 @@ DEF_HELPER_FLAGS_1(lookup_tb_ptr, TCG_CALL_NO_WG_SE, ptr, env)
 
 DEF_HELPER_FLAGS_1(exit_atomic, TCG_CALL_NO_WG, noreturn, env)
 
+DEF_HELPER_FLAGS_2(tb_hot, TCG_CALL_NO_RWG, void, env, ptr)
+DEF_HELPER_FLAGS_2(exec_trace, TCG_CALL_NO_RWG, void, env, ptr)
+DEF_HELPER_FLAGS_1(cpu_quota, TCG_CALL_NO_RWG, void, env)
+DEF_HELPER_FLAGS_4(instrument, TCG_CALL_NO_RWG, void, ptr, ptr, i64, i64)
+
 #ifdef CONFIG_SOFTMMU
 
 DEF_HELPER_FLAGS_5(atomic_cmpxchgb, TCG_CALL_NO_WG,
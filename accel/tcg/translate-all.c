@@ -58,6 +58,9 @@
 #include "qemu/main-loop.h"
 #include "exec/log.h"
 #include "sysemu/cpus.h"
+#include "sysemu/accel.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc.h"
 
 /* #define DEBUG_TB_INVALIDATE */
 /* #define DEBUG_TB_FLUSH */
@@ -156,6 +159,11 @@ TCGContext tcg_init_ctx;
 __thread TCGContext *tcg_ctx;
 TBContext tb_ctx;
 bool parallel_cpus;
+bool tcg_tb_profile;
+bool tcg_tb_speculate;
+bool tcg_tb_superblock;
+size_t tcg_tb_hot_size;
+bool tcg_cpu_quota;
 
 /* translation block context */
 static __thread int have_tb_lock;
@@ -259,6 +267,8 @@ static target_long decode_sleb128(uint8_t **pp)
    The logical table consists of TARGET_INSN_START_WORDS target_ulong's,
    which come from the target's insn_start data, followed by a uintptr_t
    which comes from the host pc of the end of the code implementing the insn.
+   TBs that charge icount other than one unit per insn append the insn's
+   cost to each line.
 
    Each line of the table is encoded as sleb128 deltas from the previous
    line.  The seed for the first line is { tb->pc, 0..., tb->tc.ptr }.
@@ -284,6 +294,9 @@ static int encode_search(TranslationBlock *tb, uint8_t *block)
         }
         prev = (i == 0 ? 0 : tcg_ctx->gen_insn_end_off[i - 1]);
         p = encode_sleb128(p, tcg_ctx->gen_insn_end_off[i] - prev);
+        if (tb->cycles) {
+            p = encode_sleb128(p, tcg_ctx->gen_insn_cycles[i]);
+        }
 
         /* Test for (pending) buffer overflow.  The assumption is that any
            one row beginning below the high water mark cannot overrun
@@ -302,19 +315,22 @@ static int encode_search(TranslationBlock *tb, uint8_t *block)
  * When reset_icount is true, current TB will be interrupted and
  * icount should be recalculated.
  */
-static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
-                                     uintptr_t searched_pc, bool reset_icount)
+/* Reconstruct the insn_start data of the guest insn at searched_pc.
+ * Returns the index of that insn within the TB, or -1 if not found.
+ * If @cycles is not NULL, it is set to the icount units charged for the
+ * insns before that one.
+ */
+static int cpu_unwind_data_from_tb(TranslationBlock *tb,
+                                   uintptr_t searched_pc, target_ulong *data,
+                                   int *cycles)
 {
-    target_ulong data[TARGET_INSN_START_WORDS] = { tb->pc };
     uintptr_t host_pc = (uintptr_t)tb->tc.ptr;
-    CPUArchState *env = cpu->env_ptr;
     uint8_t *p = tb->tc.ptr + tb->tc.size;
     int i, j, num_insns = tb->icount;
-#ifdef CONFIG_PROFILER
-    TCGProfile *prof = &tcg_ctx->prof;
-    int64_t ti = profile_getclock();
-#endif
+    int done = 0, cost = 1;
 
+    memset(data, 0, sizeof(target_ulong) * TARGET_INSN_START_WORDS);
+    data[0] = tb->pc;
     searched_pc -= GETPC_ADJ;
 
     if (searched_pc < host_pc) {
@@ -328,18 +344,41 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
             data[j] += decode_sleb128(&p);
         }
         host_pc += decode_sleb128(&p);
+        if (tb->cycles) {
+            cost = decode_sleb128(&p);
+        }
         if (host_pc > searched_pc) {
-            goto found;
+            if (cycles) {
+                *cycles = done;
+            }
+            return i;
         }
+        done += cost;
     }
     return -1;
+}
+
+static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
+                                     uintptr_t searched_pc, bool reset_icount)
+{
+    target_ulong data[TARGET_INSN_START_WORDS];
+    CPUArchState *env = cpu->env_ptr;
+    int i, cycles, num_cycles = tb->cycles ? tb->cycles : tb->icount;
+#ifdef CONFIG_PROFILER
+    TCGProfile *prof = &tcg_ctx->prof;
+    int64_t ti = profile_getclock();
+#endif
+
+    i = cpu_unwind_data_from_tb(tb, searched_pc, data, &cycles);
+    if (i < 0) {
+        return -1;
+    }
 
- found:
     if (reset_icount && (tb->cflags & CF_USE_ICOUNT)) {
         assert(use_icount);
         /* Reset the cycle counter to the start of the block
            and shift if to the number of actually executed instructions */
-        cpu->icount_decr.u16.low += num_insns - i;
+        cpu->icount_decr.u16.low += num_cycles - cycles;
     }
     restore_state_to_opc(env, tb, data);
 
@@ -391,6 +430,29 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t host_pc, bool will_exit)
     return r;
 }
 
+bool cpu_unwind_pc(uintptr_t host_pc, target_ulong *pc)
+{
+    target_ulong data[TARGET_INSN_START_WORDS];
+    TranslationBlock *tb;
+    bool r = false;
+    uintptr_t check_offset;
+
+    /* Same checks as cpu_restore_state(), but the vCPU is left alone */
+    check_offset = host_pc - (uintptr_t) tcg_init_ctx.code_gen_buffer;
+
+    if (check_offset < tcg_init_ctx.code_gen_buffer_size) {
+        tb_lock();
+        tb = tb_find_pc(host_pc);
+        if (tb && cpu_unwind_data_from_tb(tb, host_pc, data, NULL) >= 0) {
+            *pc = data[0];
+            r = true;
+        }
+        tb_unlock();
+    }
+
+    return r;
+}
+
 static void page_init(void)
 {
     page_size_init();
@@ -553,6 +615,9 @@ static inline PageDesc *page_find(tb_page_addr_t index)
   (DEFAULT_CODE_GEN_BUFFER_SIZE_1 < MAX_CODE_GEN_BUFFER_SIZE \
    ? DEFAULT_CODE_GEN_BUFFER_SIZE_1 : MAX_CODE_GEN_BUFFER_SIZE)
 
+/* Alignment that lets transparent huge pages back the buffer */
+#define CODE_GEN_HUGE_PAGE (2u * 1024 * 1024)
+
 static inline size_t size_code_gen_buffer(size_t tb_size)
 {
     /* Size the buffer.  */
@@ -687,6 +752,24 @@ static inline void *alloc_code_gen_buffer(void)
 #  endif
 # endif
 
+#if !defined(__mips__)
+    /* Transparent huge pages only back aligned ones, so map one more
+       and trim it to alignment.  */
+    if (!start && QEMU_MADV_HUGEPAGE != QEMU_MADV_INVALID) {
+        buf = mmap(NULL, size + CODE_GEN_HUGE_PAGE, prot, flags, -1, 0);
+        if (buf != MAP_FAILED) {
+            void *aligned = QEMU_ALIGN_PTR_UP(buf, CODE_GEN_HUGE_PAGE);
+
+            if (aligned != buf) {
+                munmap(buf, aligned - buf);
+            }
+            munmap(aligned + size, buf + CODE_GEN_HUGE_PAGE - aligned);
+            qemu_madvise(aligned, size, QEMU_MADV_HUGEPAGE);
+            return aligned;
+        }
+    }
+#endif
+
     buf = mmap((void *)start, size, prot, flags, -1, 0);
     if (buf == MAP_FAILED) {
         return NULL;
@@ -776,6 +859,7 @@ static gint tb_tc_cmp(gconstpointer ap, gconstpointer bp)
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx->code_gen_buffer_size = size_code_gen_buffer(tb_size);
+    tcg_ctx->code_gen_hot_size = tcg_tb_hot_size;
     tcg_ctx->code_gen_buffer = alloc_code_gen_buffer();
     if (tcg_ctx->code_gen_buffer == NULL) {
         fprintf(stderr, "Could not allocate dynamic translator buffer\n");
@@ -888,16 +972,43 @@ static gboolean tb_host_size_iter(gpointer key, gpointer value, gpointer data)
 }
 
 /* flush all the translation blocks */
-static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
+/*
+ * A buffer shrunk below the default (e.g. by "-tb-size auto") that keeps
+ * filling up spends its time retranslating.  That is still correct, so
+ * just say once that a bigger buffer would help.
+ */
+#define TB_FLUSH_WARN_COUNT 16
+#define TB_FLUSH_WARN_WINDOW_NS NANOSECONDS_PER_SECOND
+
+static void tb_flush_check_rate(void)
 {
-    tb_lock();
+    static int64_t window_start;
+    static unsigned flushes;
+    static bool warned;
+    int64_t now;
 
-    /* If it is already been done on request of another CPU,
-     * just retry.
-     */
-    if (tb_ctx.tb_flush_count != tb_flush_count.host_int) {
-        goto done;
+    /* The prologue comes off the top, so compare against half the default */
+    if (warned || tcg_init_ctx.code_gen_buffer_size >=
+                  DEFAULT_CODE_GEN_BUFFER_SIZE / 2) {
+        return;
+    }
+    now = get_clock_realtime();
+    if (now - window_start > TB_FLUSH_WARN_WINDOW_NS) {
+        window_start = now;
+        flushes = 0;
     }
+    if (++flushes >= TB_FLUSH_WARN_COUNT) {
+        warn_report("translation buffer of %zu KiB flushed %u times in a "
+                    "second; consider a larger -tb-size",
+                    tcg_init_ctx.code_gen_buffer_size / 1024, flushes);
+        warned = true;
+    }
+}
+
+/* Called with tb_lock held, from a safe-work context.  */
+static void tb_flush__locked(void)
+{
+    CPUState *cpu;
 
     if (DEBUG_TB_FLUSH_GATE) {
         size_t nb_tbs = g_tree_nnodes(tb_ctx.tb_tree);
@@ -923,8 +1034,20 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     atomic_mb_set(&tb_ctx.tb_flush_count, tb_ctx.tb_flush_count + 1);
+    tb_flush_check_rate();
+}
+
+static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
+{
+    tb_lock();
+
+    /* If it is already been done on request of another CPU,
+     * just retry.
+     */
+    if (tb_ctx.tb_flush_count == tb_flush_count.host_int) {
+        tb_flush__locked();
+    }
 
-done:
     tb_unlock();
 }
 
@@ -937,6 +1060,72 @@ void tb_flush(CPUState *cpu)
     }
 }
 
+typedef struct TBEvictRange {
+    void *start;
+    void *end;
+    GPtrArray *tbs;
+} TBEvictRange;
+
+static gboolean tb_evict_collect(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+    TBEvictRange *r = data;
+
+    /* The tree is ordered by host address */
+    if ((void *)tb->tc.ptr >= r->end) {
+        return true;
+    }
+    if ((void *)tb->tc.ptr >= r->start) {
+        g_ptr_array_add(r->tbs, tb);
+    }
+    return false;
+}
+
+static void do_tb_evict(CPUState *cpu, run_on_cpu_data tb_evict_count)
+{
+    TBEvictRange r;
+    guint i;
+
+    tb_lock();
+
+    /* Another CPU may have made room already */
+    if (tb_ctx.tb_evict_count != tb_evict_count.host_int) {
+        goto done;
+    }
+    atomic_mb_set(&tb_ctx.tb_evict_count, tb_ctx.tb_evict_count + 1);
+
+    if (!tcg_region_evict(&r.start, &r.end)) {
+        tb_flush__locked();
+        goto done;
+    }
+
+    /* Unlink and invalidate what the region holds; the rest stays hot */
+    r.tbs = g_ptr_array_new();
+    g_tree_foreach(tb_ctx.tb_tree, tb_evict_collect, &r);
+    for (i = 0; i < r.tbs->len; i++) {
+        TranslationBlock *tb = g_ptr_array_index(r.tbs, i);
+
+        tb_phys_invalidate(tb, -1);
+        tb_remove(tb);
+    }
+    g_ptr_array_free(r.tbs, true);
+
+done:
+    tb_unlock();
+}
+
+/*
+ * Make room in a full code buffer by evicting the region that filled up
+ * first, falling back to a full flush when there is no such region.
+ */
+static void tb_evict(CPUState *cpu)
+{
+    unsigned tb_evict_count = atomic_mb_read(&tb_ctx.tb_evict_count);
+
+    async_safe_run_on_cpu(cpu, do_tb_evict,
+                          RUN_ON_CPU_HOST_INT(tb_evict_count));
+}
+
 /*
  * Formerly ifdef DEBUG_TB_CHECK. These debug functions are user-mode-only,
  * so in order to prevent bit rot we compile them unconditionally in user-mode,
@@ -1103,8 +1292,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
-            atomic_set(&cpu->tb_jmp_cache[h], NULL);
+        if (atomic_read(&cpu->tb_jmp_cache[h].tb) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h].tb, NULL);
         }
     }
 
@@ -1119,10 +1308,31 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 }
 
 #ifdef CONFIG_SOFTMMU
+/* Mark the bytes of the page that @tb, linked as its page @n, covers */
+static void page_bitmap_add(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
     TranslationBlock *tb;
+    int n;
 
     p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
 
@@ -1130,20 +1340,7 @@ static void build_page_bitmap(PageDesc *p)
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-             }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+        page_bitmap_add(p, tb, n);
         tb = tb->page_next[n];
     }
 }
@@ -1170,7 +1367,13 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+#ifdef CONFIG_SOFTMMU
+    /* Keep the bitmap of a page written to, rather than build it anew
+       after another SMC_BITMAP_USE_THRESHOLD writes */
+    if (p->code_bitmap) {
+        page_bitmap_add(p, tb, n);
+    }
+#endif
 
 #if defined(CONFIG_USER_ONLY)
     if (p->flags & PAGE_WRITE) {
@@ -1241,6 +1444,21 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 }
 
 /* Called with mmap_lock held for user mode emulation.  */
+/* Called by the thread that owns tcg_ctx */
+static void tb_account_quality(TranslationBlock *tb)
+{
+    TCGQualityStats *q = &tcg_ctx->quality;
+
+    atomic_set__nocheck(&q->tb_count, q->tb_count + 1);
+    atomic_set__nocheck(&q->guest_insns, q->guest_insns + tb->icount);
+    atomic_set__nocheck(&q->ops, q->ops + tb->nb_ops);
+    atomic_set__nocheck(&q->ops_opt, q->ops_opt + tb->nb_ops_opt);
+    atomic_set__nocheck(&q->host_bytes, q->host_bytes + tb->tc.size);
+    atomic_set__nocheck(&q->spills, q->spills + tb->nb_spills);
+    atomic_set__nocheck(&q->translate_ns,
+                        q->translate_ns + tb->translate_ns);
+}
+
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               uint32_t flags, int cflags)
@@ -1251,6 +1469,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size;
+    int64_t start = get_clock();
 #ifdef CONFIG_PROFILER
     TCGProfile *prof = &tcg_ctx->prof;
     int64_t ti;
@@ -1259,11 +1478,19 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
 
     phys_pc = get_page_addr_code(env, pc);
 
+    tb = NULL;
  buffer_overflow:
+    /* The hot region is out of room: tb_relocate_hot() keeps the TB */
+    if (unlikely(tb && (cflags & CF_HOT))) {
+        return NULL;
+    }
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
-        /* flush must be done */
-        tb_flush(cpu);
+        if (cflags & CF_HOT) {
+            return NULL;
+        }
+        /* eviction or flush must be done */
+        tb_evict(cpu);
         mmap_unlock();
         /* Make the execution loop process the flush as soon as possible.  */
         cpu->exception_index = EXCP_INTERRUPT;
@@ -1277,6 +1504,11 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->flags = flags;
     tb->cflags = cflags;
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
+    tb->cycles = 0;
+    tb->data_page2 = false;
+    tb->exec_count = 0;
+    tb->hot_count = TB_SUPERBLOCK_THRESHOLD;
+    tb->indirect_pc[0] = tb->indirect_pc[1] = 0;
     tcg_ctx->tb_cflags = cflags;
 
 #ifdef CONFIG_PROFILER
@@ -1325,6 +1557,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         goto buffer_overflow;
     }
     tb->tc.size = gen_code_size;
+    tb->translate_ns = MIN(get_clock() - start, UINT32_MAX);
+    tb_account_quality(tb);
 
 #ifdef CONFIG_PROFILER
     atomic_set(&prof->code_time, prof->code_time + profile_getclock() - ti);
@@ -1388,6 +1622,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     phys_page2 = -1;
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
         phys_page2 = get_page_addr_code(env, virt_page2);
+    } else if (tb->data_page2) {
+        /* The same page tb_cmp() expects for a TB that crosses one */
+        phys_page2 = get_page_addr_code(env, virt_page2 + TARGET_PAGE_SIZE);
     }
     /* As long as consistency of the TB stuff is provided by tb_lock in user
      * mode and is implicit in single-threaded softmmu emulation, no explicit
@@ -1396,9 +1633,132 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
      */
     tb_link_page(tb, phys_pc, phys_page2);
     g_tree_insert(tb_ctx.tb_tree, &tb->tc, tb);
+    tb_ctx.tb_gen_count++;
     return tb;
 }
 
+#ifdef CONFIG_SOFTMMU
+/*
+ * Code shared between RAM of the same content, such as the flash of
+ * boards that run the same firmware.  TBs of a shared page are looked
+ * up, linked and invalidated under the address of its canonical copy,
+ * so every CPU that runs the page finds the TBs the first one made.
+ * Translated code only refers to the CPU it runs on through env, which
+ * makes that safe as long as the copies stay the same: the first write
+ * to either one ends the sharing of that page, see tb_share_write().
+ *
+ * The table only changes while no vCPU runs, lookups read it unlocked;
+ * the bitmaps only gain bits, under tb_lock.
+ */
+typedef struct TBShareRange {
+    ram_addr_t start;
+    ram_addr_t canonical;
+    ram_addr_t size;
+    /* Pages that differed, or have been written since */
+    unsigned long *unshared;
+} TBShareRange;
+
+static GArray *tb_share_ranges;
+
+void tb_share_code(ram_addr_t start, ram_addr_t canonical, ram_addr_t size)
+{
+    TBShareRange r = {
+        .start = start,
+        .canonical = canonical,
+        .size = size,
+        .unshared = bitmap_new(size >> TARGET_PAGE_BITS),
+    };
+    CPUState *cpu;
+    ram_addr_t off;
+    guint i;
+
+    g_assert(!((start | canonical | size) & ~TARGET_PAGE_MASK));
+    tb_lock();
+    if (!tb_share_ranges) {
+        tb_share_ranges = g_array_new(FALSE, FALSE, sizeof(TBShareRange));
+    }
+    for (i = 0; i < tb_share_ranges->len; i++) {
+        TBShareRange *old = &g_array_index(tb_share_ranges, TBShareRange, i);
+
+        if (old->start == start) {
+            g_free(old->unshared);
+            g_array_remove_index_fast(tb_share_ranges, i);
+            break;
+        }
+    }
+    for (off = 0; off < size; off += TARGET_PAGE_SIZE) {
+        if (memcmp(qemu_map_ram_ptr(NULL, start + off),
+                   qemu_map_ram_ptr(NULL, canonical + off),
+                   TARGET_PAGE_SIZE)) {
+            set_bit(off >> TARGET_PAGE_BITS, r.unshared);
+            continue;
+        }
+        /* Catch the first write to either copy */
+        tlb_protect_code(start + off);
+        tlb_protect_code(canonical + off);
+    }
+    g_array_append_val(tb_share_ranges, r);
+    tb_unlock();
+
+    /* The TBs the vCPUs found before must be looked up again */
+    CPU_FOREACH(cpu) {
+        cpu_tb_jmp_cache_clear(cpu);
+    }
+}
+
+tb_page_addr_t tb_share_lookup(tb_page_addr_t addr)
+{
+    guint i;
+
+    if (likely(!tb_share_ranges)) {
+        return addr;
+    }
+    for (i = 0; i < tb_share_ranges->len; i++) {
+        TBShareRange *r = &g_array_index(tb_share_ranges, TBShareRange, i);
+
+        if (addr - r->start < r->size &&
+            !test_bit((addr - r->start) >> TARGET_PAGE_BITS, r->unshared)) {
+            return addr - r->start + r->canonical;
+        }
+    }
+    return addr;
+}
+
+/*
+ * A write to @addr ends the sharing of its page, for a copy as for the
+ * canonical page.  The TBs of the canonical page go as well: CPUs that
+ * no longer share it could still reach them through chained jumps.
+ */
+static void tb_share_write(tb_page_addr_t addr, int is_cpu_write_access)
+{
+    ram_addr_t off;
+    guint i;
+
+    if (likely(!tb_share_ranges)) {
+        return;
+    }
+    for (i = 0; i < tb_share_ranges->len; i++) {
+        TBShareRange *r = &g_array_index(tb_share_ranges, TBShareRange, i);
+
+        if (addr - r->start < r->size) {
+            off = (addr - r->start) & TARGET_PAGE_MASK;
+        } else if (addr - r->canonical < r->size) {
+            off = (addr - r->canonical) & TARGET_PAGE_MASK;
+        } else {
+            continue;
+        }
+        if (test_bit(off >> TARGET_PAGE_BITS, r->unshared)) {
+            continue;
+        }
+        /* Before invalidating, which comes back here for the canonical page */
+        set_bit(off >> TARGET_PAGE_BITS, r->unshared);
+        tb_invalidate_phys_page_range(r->canonical + off,
+                                      r->canonical + off + TARGET_PAGE_SIZE,
+                                      is_cpu_write_access);
+    }
+}
+#endif
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1464,6 +1824,9 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     assert_memory_lock();
     assert_tb_locked();
 
+#if !defined(CONFIG_USER_ONLY)
+    tb_share_write(start, is_cpu_write_access);
+#endif
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
         return;
@@ -1557,6 +1920,8 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
 #endif
     assert_memory_lock();
 
+    /* The copy of a shared page has no TBs of its own */
+    tb_share_write(start, 1);
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
         return;
@@ -1718,6 +2083,15 @@ void tb_check_watchpoint(CPUState *cpu)
 }
 
 #ifndef CONFIG_USER_ONLY
+/* Guest PCs of the insns cpu_io_recompile() stopped at, under tb_lock */
+static GHashTable *tb_io_insns;
+
+bool tb_io_insn(target_ulong pc)
+{
+    return tb_io_insns &&
+           g_hash_table_contains(tb_io_insns, (gpointer)(uintptr_t)pc);
+}
+
 /* in deterministic execution mode, instructions doing device I/Os
  * must be at the end of the TB.
  *
@@ -1725,10 +2099,10 @@ void tb_check_watchpoint(CPUState *cpu)
  */
 void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
 {
-#if defined(TARGET_MIPS) || defined(TARGET_SH4)
     CPUArchState *env = cpu->env_ptr;
-#endif
     TranslationBlock *tb;
+    target_ulong pc, cs_base;
+    uint32_t flags;
     uint32_t n;
 
     tb_lock();
@@ -1762,9 +2136,20 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     }
 #endif
 
-    /* Generate a new TB executing the I/O insn.  */
+    /* Generate a new TB executing the I/O insn.  It stays in the hash
+     * table, for any other TB that still runs into the insn.
+     */
     cpu->cflags_next_tb = curr_cflags() | CF_LAST_IO | n;
 
+    /* From now on translation ends TBs before the insn and gives it a TB
+     * of its own that may do I/O, see translator_loop().  The TB that ran
+     * into it goes, so that the next pass no longer does.
+     */
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    if (!tb_io_insns) {
+        tb_io_insns = g_hash_table_new(NULL, NULL);
+    }
+    g_hash_table_add(tb_io_insns, (gpointer)(uintptr_t)pc);
     if (tb->cflags & CF_NOCACHE) {
         if (tb->orig_tb) {
             /* Invalidate original TB if this TB was generated in
@@ -1772,15 +2157,11 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
             tb_phys_invalidate(tb->orig_tb, -1);
         }
         tb_remove(tb);
+    } else {
+        tb_phys_invalidate(tb, -1);
     }
 
-    /* TODO: If env->pc != tb->pc (i.e. the faulting instruction was not
-     * the first in the TB) then we end up generating a whole new TB and
-     *  repeating the fault, which is horribly inefficient.
-     *  Better would be to execute just this insn uncached, or generate a
-     *  second new TB.
-     *
-     * cpu_loop_exit_noexc will longjmp back to cpu_exec where the
+    /* cpu_loop_exit_noexc will longjmp back to cpu_exec where the
      * tb_lock gets reset.
      */
     cpu_loop_exit_noexc(cpu);
@@ -1791,7 +2172,7 @@ static void tb_jmp_cache_clear_page(CPUState *cpu, target_ulong page_addr)
     unsigned int i, i0 = tb_jmp_cache_hash_page(page_addr);
 
     for (i = 0; i < TB_JMP_PAGE_SIZE; i++) {
-        atomic_set(&cpu->tb_jmp_cache[i0 + i], NULL);
+        atomic_set(&cpu->tb_jmp_cache[i0 + i].tb, NULL);
     }
 }
 
@@ -1913,6 +2294,8 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %u\n",
                 atomic_read(&tb_ctx.tb_flush_count));
+    cpu_fprintf(f, "TB evict count      %u\n",
+                atomic_read(&tb_ctx.tb_evict_count));
     cpu_fprintf(f, "TB invalidate count %d\n", tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %zu\n", tlb_flush_count());
     tcg_dump_info(f, cpu_fprintf);
@@ -1925,6 +2308,237 @@ void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
     tcg_dump_op_count(f, cpu_fprintf);
 }
 
+typedef struct TBForeach {
+    void (*fn)(TranslationBlock *tb, void *opaque);
+    void *opaque;
+} TBForeach;
+
+static gboolean tb_foreach_iter(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+    TBForeach *f = data;
+
+    if (!(tb_cflags(tb) & CF_INVALID)) {
+        f->fn(tb, f->opaque);
+    }
+    return false;
+}
+
+void tb_foreach(void (*fn)(TranslationBlock *tb, void *opaque), void *opaque)
+{
+    TBForeach f = { .fn = fn, .opaque = opaque };
+
+    tb_lock();
+    g_tree_foreach(tb_ctx.tb_tree, tb_foreach_iter, &f);
+    tb_unlock();
+}
+
+#define TB_PROFILE_DEFAULT_MAX 20
+
+typedef struct TBProfileSample {
+    TranslationBlock *tb;
+    uint64_t count;
+} TBProfileSample;
+
+static gboolean tb_profile_iter(gpointer key, gpointer value, gpointer data)
+{
+    TBProfileSample sample = {
+        .tb = value,
+        .count = atomic_read(&((TranslationBlock *)value)->exec_count),
+    };
+
+    if (sample.count) {
+        g_array_append_val(data, sample);
+    }
+    return false;
+}
+
+static gint tb_profile_cmp(gconstpointer a, gconstpointer b)
+{
+    const TBProfileSample *sa = a;
+    const TBProfileSample *sb = b;
+
+    if (sa->count != sb->count) {
+        return sa->count < sb->count ? 1 : -1;
+    }
+    return sa->tb->pc < sb->tb->pc ? -1 : sa->tb->pc > sb->tb->pc;
+}
+
+TbProfileEntryList *qmp_query_tb_profile(bool has_max, int64_t max,
+                                         Error **errp)
+{
+    TbProfileEntryList *head = NULL, **tail = &head;
+    GArray *samples;
+    int i;
+
+    if (!tcg_tb_profile) {
+        error_setg(errp, "TB profiling is disabled, start with -tb-profile");
+        return NULL;
+    }
+    if (!has_max) {
+        max = TB_PROFILE_DEFAULT_MAX;
+    } else if (max <= 0) {
+        error_setg(errp, "Parameter 'max' expects a positive number");
+        return NULL;
+    }
+
+    /* The vCPUs keep counting while we look; sort a snapshot */
+    samples = g_array_new(false, false, sizeof(TBProfileSample));
+    tb_lock();
+    g_tree_foreach(tb_ctx.tb_tree, tb_profile_iter, samples);
+    g_array_sort(samples, tb_profile_cmp);
+
+    for (i = 0; i < samples->len && i < max; i++) {
+        TBProfileSample *sample = &g_array_index(samples, TBProfileSample, i);
+        TbProfileEntry *entry = g_new0(TbProfileEntry, 1);
+        const char *symbol = lookup_symbol(sample->tb->pc);
+
+        entry->pc = sample->tb->pc;
+        entry->size = sample->tb->size;
+        entry->insns = sample->tb->icount;
+        entry->count = sample->count;
+        if (symbol[0]) {
+            entry->has_symbol = true;
+            entry->symbol = g_strdup(symbol);
+        }
+
+        *tail = g_new0(TbProfileEntryList, 1);
+        (*tail)->value = entry;
+        tail = &(*tail)->next;
+    }
+
+    tb_unlock();
+    g_array_free(samples, true);
+    return head;
+}
+
+#define TCG_QUALITY_DEFAULT_MAX 20
+
+static gboolean tcg_quality_iter(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+
+    if (tb->icount) {
+        g_array_append_val(data, tb);
+    }
+    return false;
+}
+
+/* Most host bytes per guest insn first */
+static gint tcg_quality_cmp(gconstpointer a, gconstpointer b)
+{
+    const TranslationBlock *ta = *(TranslationBlock * const *)a;
+    const TranslationBlock *tb = *(TranslationBlock * const *)b;
+    uint64_t ra = (uint64_t)ta->tc.size * tb->icount;
+    uint64_t rb = (uint64_t)tb->tc.size * ta->icount;
+
+    if (ra != rb) {
+        return ra < rb ? 1 : -1;
+    }
+    return ta->pc < tb->pc ? -1 : ta->pc > tb->pc;
+}
+
+void dump_tcg_quality(FILE *f, fprintf_function cpu_fprintf, int max)
+{
+    TCGQualityStats q = {};
+    int64_t tbs, insns;
+    GArray *worst;
+    int i;
+
+    if (max <= 0) {
+        max = TCG_QUALITY_DEFAULT_MAX;
+    }
+
+    tcg_quality_snapshot(&q);
+    tbs = q.tb_count ? q.tb_count : 1;
+    insns = q.guest_insns ? q.guest_insns : 1;
+    cpu_fprintf(f, "translated TBs      %" PRId64 "\n", q.tb_count);
+    cpu_fprintf(f, "guest insns/TB      %0.1f\n", (double)q.guest_insns / tbs);
+    cpu_fprintf(f, "TCG ops/insn        %0.1f, %0.1f optimized (-%0.1f%%)\n",
+                (double)q.ops / insns, (double)q.ops_opt / insns,
+                q.ops ? (double)(q.ops - q.ops_opt) / q.ops * 100.0 : 0);
+    cpu_fprintf(f, "host bytes/insn     %0.1f\n", (double)q.host_bytes / insns);
+    cpu_fprintf(f, "spills/TB           %0.2f\n", (double)q.spills / tbs);
+    cpu_fprintf(f, "translation time/TB %0.1f us\n",
+                (double)q.translate_ns / tbs / SCALE_US);
+
+    /* Only the TBs that are still in the code buffer */
+    worst = g_array_new(false, false, sizeof(TranslationBlock *));
+    tb_lock();
+    g_tree_foreach(tb_ctx.tb_tree, tcg_quality_iter, worst);
+    g_array_sort(worst, tcg_quality_cmp);
+
+    cpu_fprintf(f, "\n%-10s %5s %5s %5s %6s %5s %10s\n", "pc", "insns",
+                "ops", "opt", "spills", "host", "bytes/insn");
+    for (i = 0; i < worst->len && i < max; i++) {
+        TranslationBlock *tb = g_array_index(worst, TranslationBlock *, i);
+
+        cpu_fprintf(f, "0x%08" PRIx64 " %5u %5u %5u %6u %5zu %10.1f  %s\n",
+                    (uint64_t)tb->pc, tb->icount, tb->nb_ops, tb->nb_ops_opt,
+                    tb->nb_spills, tb->tc.size,
+                    (double)tb->tc.size / tb->icount, lookup_symbol(tb->pc));
+    }
+
+    tb_unlock();
+    g_array_free(worst, true);
+}
+
+static ExecCpuStats *exec_cpu_stats(CPUState *cpu)
+{
+    ExecCpuStats *stats = g_new0(ExecCpuStats, 1);
+    CPUExecStats *st = &cpu->exec_stats;
+    ExecVectorStatsList **tail = &stats->vectors;
+    unsigned i;
+
+    stats->cpu = cpu->cpu_index;
+    stats->instructions = atomic_read__nocheck(&cpu->exec_insns);
+    stats->exceptions = st->exceptions;
+    stats->irqs = st->irqs;
+    stats->mmio = atomic_read__nocheck(&st->mmio);
+    stats->halted_ns = st->halted_ns;
+    for (i = 0; i < st->nr_vectors; i++) {
+        ExecVectorStats *v;
+
+        if (!st->vector_irqs[i]) {
+            continue;
+        }
+        v = g_new0(ExecVectorStats, 1);
+        v->vector = i;
+        v->count = st->vector_irqs[i];
+        *tail = g_new0(ExecVectorStatsList, 1);
+        (*tail)->value = v;
+        tail = &(*tail)->next;
+    }
+    return stats;
+}
+
+ExecStats *qmp_query_exec_stats(Error **errp)
+{
+    ExecStats *stats = g_new0(ExecStats, 1);
+    ExecCpuStatsList **tail = &stats->cpus;
+    CPUState *cpu;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "Execution statistics require TCG");
+        g_free(stats);
+        return NULL;
+    }
+
+    tb_lock();
+    stats->translations = tb_ctx.tb_gen_count;
+    stats->flushes = atomic_read(&tb_ctx.tb_flush_count);
+    tb_unlock();
+    stats->code_size = tcg_code_size();
+    stats->code_capacity = tcg_code_capacity();
+
+    CPU_FOREACH(cpu) {
+        *tail = g_new0(ExecCpuStatsList, 1);
+        (*tail)->value = exec_cpu_stats(cpu);
+        tail = &(*tail)->next;
+    }
+    return stats;
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
@@ -17,6 +17,9 @@
 #include "exec/gen-icount.h"
 #include "exec/log.h"
 #include "exec/translator.h"
+#include "exec/tb-coverage.h"
+#include "exec/exec-trace.h"
+#include "sysemu/accel.h"
 
 /* Pairs with tcg_clear_temp_count.
    To be called by #TranslatorOps.{translate_insn,tb_stop} if
@@ -31,10 +34,229 @@ void translator_loop_temp_check(DisasContextBase *db)
     }
 }
 
+void translator_note_branch(DisasContextBase *db, target_ulong dest)
+{
+    CPUState *cpu = tcg_ctx->cpu;
+    unsigned int i;
+
+    if (!tcg_tb_speculate) {
+        return;
+    }
+    i = cpu->tb_speculate_head++ % TB_SPECULATE_SIZE;
+    cpu->tb_speculate[i].pc = dest;
+    cpu->tb_speculate[i].cs_base = db->tb->cs_base;
+    cpu->tb_speculate[i].flags = db->tb->flags;
+    if (cpu->tb_speculate_count < TB_SPECULATE_SIZE) {
+        cpu->tb_speculate_count++;
+    }
+}
+
+/* Count each entry into @tb for query-tb-profile.  The increment is not
+   atomic, so with MTTCG concurrent entries may be lost.  */
+static void gen_tb_count(TranslationBlock *tb)
+{
+    TCGv_ptr ptr = tcg_const_ptr(&tb->exec_count);
+    TCGv_i64 count = tcg_temp_new_i64();
+
+    tcg_gen_ld_i64(count, ptr, 0);
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, ptr, 0);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(ptr);
+}
+
+/* Add the TB's instruction count to CPUState.exec_insns.  That count is
+   not known yet: return the op holding it, for the caller to patch.
+   With -cpu-quota instructions, a TB that takes the count to the quota
+   ends the chain of TBs at the next boundary.  */
+static TCGOp *gen_tb_insn_count(void)
+{
+    TCGv_i32 n = tcg_temp_new_i32();
+    TCGv_i64 n64 = tcg_temp_new_i64();
+    TCGv_i64 count = tcg_temp_new_i64();
+    TCGOp *op;
+
+    tcg_gen_movi_i32(n, 0xdeadbeef);
+    op = tcg_last_op();
+    tcg_gen_extu_i32_i64(n64, n);
+    tcg_gen_ld_i64(count, cpu_env,
+                   -ENV_OFFSET + offsetof(CPUState, exec_insns));
+    tcg_gen_add_i64(count, count, n64);
+    tcg_gen_st_i64(count, cpu_env,
+                   -ENV_OFFSET + offsetof(CPUState, exec_insns));
+    if (tcg_cpu_quota) {
+        TCGLabel *under = gen_new_label();
+        TCGv_i64 limit = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(limit, cpu_env,
+                       -ENV_OFFSET + offsetof(CPUState, quota_insns));
+        tcg_gen_brcond_i64(TCG_COND_LTU, count, limit, under);
+        tcg_temp_free_i64(limit);
+        gen_helper_cpu_quota(cpu_env);
+        gen_set_label(under);
+    }
+    tcg_temp_free_i64(count);
+    tcg_temp_free_i64(n64);
+    tcg_temp_free_i32(n);
+    return op;
+}
+
+bool translator_instrumented;
+
+static QSLIST_HEAD(, TranslatorInstrument) translator_instruments =
+    QSLIST_HEAD_INITIALIZER(translator_instruments);
+
+/* What the TranslatorInstrument callback being run is about */
+static __thread target_ulong instrument_pc;
+static __thread TCGv instrument_addr;
+static __thread bool instrument_is_mem;
+
+void translator_instrument_register(TranslatorInstrument *ti)
+{
+    QSLIST_INSERT_HEAD(&translator_instruments, ti, next);
+    translator_instrumented = true;
+}
+
+void translator_instrument_count(uint64_t *counter)
+{
+    TCGv_ptr ptr = tcg_const_ptr(counter);
+    TCGv_i64 count = tcg_temp_new_i64();
+
+    tcg_gen_ld_i64(count, ptr, 0);
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, ptr, 0);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(ptr);
+}
+
+void translator_instrument_call(TranslatorInstrumentFn *fn, void *opaque,
+                                uint64_t info)
+{
+    TCGv_ptr fn_ptr = tcg_const_ptr(fn);
+    TCGv_ptr opaque_ptr = tcg_const_ptr(opaque);
+    TCGv_i64 info_val = tcg_const_i64(info);
+    TCGv_i64 vaddr = tcg_temp_new_i64();
+
+    if (instrument_is_mem) {
+        tcg_gen_extu_tl_i64(vaddr, instrument_addr);
+    } else {
+        tcg_gen_movi_i64(vaddr, instrument_pc);
+    }
+    gen_helper_instrument(fn_ptr, opaque_ptr, info_val, vaddr);
+    tcg_temp_free_i64(vaddr);
+    tcg_temp_free_i64(info_val);
+    tcg_temp_free_ptr(opaque_ptr);
+    tcg_temp_free_ptr(fn_ptr);
+}
+
+static void translator_instrument_insn(target_ulong pc)
+{
+    TranslatorInstrument *ti;
+
+    instrument_pc = pc;
+    QSLIST_FOREACH(ti, &translator_instruments, next) {
+        if (ti->insn) {
+            ti->insn(ti, pc);
+        }
+    }
+}
+
+void translator_instrument_mem(TCGv addr, TCGMemOp memop, bool store)
+{
+    TranslatorInstrument *ti;
+
+    instrument_is_mem = true;
+    instrument_addr = addr;
+    QSLIST_FOREACH(ti, &translator_instruments, next) {
+        if (ti->mem) {
+            ti->mem(ti, instrument_pc, memop, store);
+        }
+    }
+    instrument_is_mem = false;
+}
+
+/* Mark the block at @tb's PC as run for -tb-coverage mode=executed */
+static void gen_tb_coverage_hit(TranslationBlock *tb)
+{
+    TCGv_ptr ptr = tcg_const_ptr(tb_coverage_hit_flag(tb->pc));
+    TCGv_i32 one = tcg_const_i32(1);
+
+    tcg_gen_st8_i32(one, ptr, 0);
+    tcg_temp_free_i32(one);
+    tcg_temp_free_ptr(ptr);
+}
+
+/*
+ * Bump the -tb-coverage mode=edges counter of the edge from the TB run
+ * last to @tb.  Like AFL's, the increment is not atomic and wraps.
+ */
+static void gen_tb_coverage_edge(TranslationBlock *tb)
+{
+    uint32_t id = tb_coverage_edge_id(tb->pc);
+    TCGv_i32 edge = tcg_temp_new_i32();
+    TCGv_i32 count = tcg_temp_new_i32();
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+
+    tcg_gen_ld_i32(edge, cpu_env,
+                   -ENV_OFFSET + offsetof(CPUState, tb_edge_prev));
+    tcg_gen_xori_i32(edge, edge, id);
+    tcg_gen_ext_i32_ptr(ptr, edge);
+    tcg_gen_addi_ptr(ptr, ptr, (intptr_t)tb_coverage_edge_map);
+    tcg_gen_ld8u_i32(count, ptr, 0);
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st8_i32(count, ptr, 0);
+    tcg_gen_movi_i32(edge, id >> 1);
+    tcg_gen_st_i32(edge, cpu_env,
+                   -ENV_OFFSET + offsetof(CPUState, tb_edge_prev));
+    tcg_temp_free_ptr(ptr);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_i32(edge);
+}
+
+/* Append an -exec-trace record on each entry into @tb */
+static void gen_exec_trace(TranslationBlock *tb)
+{
+    TCGv_ptr ptr = tcg_const_ptr(tb);
+
+    tb->trace_id = exec_trace_new_id();
+    gen_helper_exec_trace(cpu_env, ptr);
+    tcg_temp_free_ptr(ptr);
+}
+
+/* Call helper_tb_hot() on the TB_SUPERBLOCK_THRESHOLD'th entry of @tb */
+static void gen_tb_hot_count(TranslationBlock *tb)
+{
+    TCGv_ptr ptr = tcg_const_ptr(&tb->hot_count);
+    TCGv_i32 count = tcg_temp_new_i32();
+    TCGLabel *cold = gen_new_label();
+
+    tcg_gen_ld_i32(count, ptr, 0);
+    tcg_gen_subi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, 0);
+    tcg_gen_brcondi_i32(TCG_COND_NE, count, 0, cold);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+
+    ptr = tcg_const_ptr(tb);
+    gen_helper_tb_hot(cpu_env, ptr);
+    tcg_temp_free_ptr(ptr);
+    gen_set_label(cold);
+}
+
+/* Record what the instruction just translated costs under icount */
+static void translator_charge_insn(DisasContextBase *db)
+{
+    tcg_ctx->gen_insn_cycles[db->num_insns - 1] = db->insn_cycles;
+    db->num_cycles += db->insn_cycles;
+}
+
 void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
                      CPUState *cpu, TranslationBlock *tb)
 {
     int max_insns;
+    unsigned int max_cycles;
+    bool io_insns, io_last;
+    TCGOp *insn_count_op;
 
     /* Initialize DisasContext */
     db->tb = tb;
@@ -42,6 +264,7 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
     db->pc_next = db->pc_first;
     db->is_jmp = DISAS_NEXT;
     db->num_insns = 0;
+    db->num_cycles = 0;
     db->singlestep_enabled = cpu->singlestep_enabled;
 
     /* Instruction counting */
@@ -56,6 +279,24 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
         max_insns = 1;
     }
 
+    /* Under icount, an insn that cpu_io_recompile() once stopped at gets
+       a TB of its own, which may do I/O, and TBs end before it.  */
+    io_insns = (tb_cflags(db->tb) & (CF_USE_ICOUNT | CF_LAST_IO)) ==
+               CF_USE_ICOUNT;
+    io_last = tb_cflags(db->tb) & CF_LAST_IO;
+    if (io_insns && tb_io_insn(db->pc_first)) {
+        max_insns = 1;
+        io_last = true;
+    }
+
+    /* A TB sized to what is left of the icount budget must not cost more
+       than that, or it could never start.  The I/O re-execution TB counts
+       instructions instead, and is paid for by the TB it replaces.  */
+    max_cycles = tb_cflags(db->tb) & CF_COUNT_MASK;
+    if (max_cycles == 0 || (tb_cflags(db->tb) & CF_LAST_IO)) {
+        max_cycles = UINT_MAX;
+    }
+
     max_insns = ops->init_disas_context(db, cpu, max_insns);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
@@ -64,11 +305,30 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
 
     /* Start translating.  */
     gen_tb_start(db->tb);
+    insn_count_op = gen_tb_insn_count();
+    if (tcg_tb_profile) {
+        gen_tb_count(db->tb);
+    }
+    if (tcg_tb_coverage == TB_COVERAGE_EXECUTED) {
+        gen_tb_coverage_hit(db->tb);
+    } else if (tcg_tb_coverage == TB_COVERAGE_EDGES) {
+        gen_tb_coverage_edge(db->tb);
+    }
+    if (tcg_exec_trace) {
+        gen_exec_trace(db->tb);
+    }
+    /* Side exits would leave without refunding icount for the rest */
+    if (tcg_tb_superblock &&
+        !(tb_cflags(db->tb) & (CF_SUPERBLOCK | CF_NOCACHE | CF_LAST_IO |
+                                CF_USE_ICOUNT))) {
+        gen_tb_hot_count(db->tb);
+    }
     ops->tb_start(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
     while (true) {
         db->num_insns++;
+        db->insn_cycles = 1;
         ops->insn_start(db, cpu);
         tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
@@ -76,6 +336,10 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
         if (unlikely(!QTAILQ_EMPTY(&cpu->breakpoints))) {
             CPUBreakpoint *bp;
             QTAILQ_FOREACH(bp, &cpu->breakpoints, entry) {
+                /* Stepping from a gdb breakpoint runs the instruction */
+                if (db->singlestep_enabled && (bp->flags & BP_GDB)) {
+                    continue;
+                }
                 if (bp->pc == db->pc_next) {
                     if (ops->breakpoint_check(db, cpu, bp)) {
                         break;
@@ -87,15 +351,23 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
                it should use DISAS_NORETURN when generating an exception,
                but may use a DISAS_TARGET_* value for Something Else.  */
             if (db->is_jmp > DISAS_TOO_MANY) {
+                /* The instruction does not run, so it costs no icount;
+                   otherwise a breakpoint would throw replay off */
+                db->insn_cycles = 0;
+                translator_charge_insn(db);
                 break;
             }
         }
 
+        if (unlikely(translator_instrumented)) {
+            translator_instrument_insn(db->pc_next);
+        }
+
         /* Disassemble one instruction.  The translate_insn hook should
            update db->pc_next and db->is_jmp to indicate what should be
            done next -- either exiting this loop or locate the start of
            the next instruction.  */
-        if (db->num_insns == max_insns && (tb_cflags(db->tb) & CF_LAST_IO)) {
+        if (db->num_insns == max_insns && io_last) {
             /* Accept I/O on the last instruction.  */
             gen_io_start();
             ops->translate_insn(db, cpu);
@@ -103,6 +375,7 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
         } else {
             ops->translate_insn(db, cpu);
         }
+        translator_charge_insn(db);
 
         /* Stop translation if translate_insn so indicated.  */
         if (db->is_jmp != DISAS_NEXT) {
@@ -111,7 +384,9 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
 
         /* Stop translation if the output buffer is full,
            or we have executed all of the allowed instructions.  */
-        if (tcg_op_buf_full() || db->num_insns >= max_insns) {
+        if (tcg_op_buf_full() || db->num_insns >= max_insns
+            || db->num_cycles >= max_cycles
+            || (io_insns && tb_io_insn(db->pc_next))) {
             db->is_jmp = DISAS_TOO_MANY;
             break;
         }
@@ -119,11 +394,26 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
 
     /* Emit code to exit the TB, as indicated by db->is_jmp.  */
     ops->tb_stop(db, cpu);
-    gen_tb_end(db->tb, db->num_insns);
+
+    /* The last instruction may overrun a budget-sized TB; let it go for
+       the rest of the budget so that execution still makes progress.  */
+    if (db->num_cycles > max_cycles) {
+        tcg_ctx->gen_insn_cycles[db->num_insns - 1] -=
+            db->num_cycles - max_cycles;
+        db->num_cycles = max_cycles;
+    }
+    gen_tb_end(db->tb, db->num_cycles);
+    tcg_set_insn_param(insn_count_op, 1, db->num_insns);
 
     /* The disas_log hook may use these values rather than recompute.  */
     db->tb->size = db->pc_next - db->pc_first;
     db->tb->icount = db->num_insns;
+    if (db->num_cycles != db->num_insns) {
+        db->tb->cycles = db->num_cycles;
+    }
+    if (tcg_tb_coverage && tcg_tb_coverage != TB_COVERAGE_EDGES) {
+        tb_coverage_add(db->tb);
+    }
 
 #ifdef DEBUG_DISAS
     if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)
@@ -0,0 +1,248 @@
+/*
+ * Shared memory ring chardev
+ *
+ * Guest output goes into a single-producer, single-consumer ring in a
+ * file-backed shared mapping, so that a collector process can drain
+ * many instances without a system call per write.  The file holds a
+ * ShmRingHeader followed by the data area of @size bytes:
+ *
+ *   magic, version, size    set up once at open, magic last
+ *   prod                    bytes ever written, advanced by QEMU
+ *   cons                    bytes ever read, advanced by the collector
+ *   dropped                 bytes discarded because the ring was full
+ *
+ * All fields are 32-bit, in host byte order; the indices wrap.  Byte n
+ * of the stream lives at data[n & (size - 1)].  QEMU never blocks:
+ * what does not fit is dropped and counted.
+ *
+ * With a doorbell eventfd, QEMU kicks it only when a write finds the
+ * ring empty.  To not miss a kick, the collector must store cons, then
+ * (after a full barrier) re-read prod and only wait on the eventfd if
+ * the two are equal; QEMU does the mirror image with prod and cons.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "chardev/char.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/option.h"
+#include "monitor/monitor.h"
+
+#define SHMRING_MAGIC       0x52534d51  /* "QMSR" little endian */
+#define SHMRING_VERSION     1
+#define SHMRING_ALIGN       64
+
+typedef struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    /* Each index on its own cache line, written by one side only */
+    uint32_t prod QEMU_ALIGNED(SHMRING_ALIGN);
+    uint32_t cons QEMU_ALIGNED(SHMRING_ALIGN);
+    uint32_t dropped QEMU_ALIGNED(SHMRING_ALIGN);
+} QEMU_ALIGNED(SHMRING_ALIGN) ShmRingHeader;
+
+typedef struct {
+    Chardev parent;
+    ShmRingHeader *hdr;
+    uint8_t *data;
+    uint32_t size;
+    size_t map_size;
+    uint32_t prod;
+    int doorbell;
+} ShmRingChardev;
+
+#define TYPE_CHARDEV_SHMRING "chardev-shmring"
+#define SHMRING_CHARDEV(obj) \
+    OBJECT_CHECK(ShmRingChardev, (obj), TYPE_CHARDEV_SHMRING)
+
+static void shmring_kick(ShmRingChardev *d)
+{
+    uint64_t one = 1;
+    ssize_t ret;
+
+    do {
+        ret = write(d->doorbell, &one, sizeof(one));
+    } while (ret < 0 && errno == EINTR);
+}
+
+/* Called with chr_write_lock held, which makes QEMU a single producer */
+static int shmring_chr_write(Chardev *chr, const uint8_t *buf, int len)
+{
+    ShmRingChardev *d = SHMRING_CHARDEV(chr);
+    uint32_t prod = d->prod;
+    uint32_t cons, count, off, chunk;
+
+    /* Pairs with the collector's store to cons after reading data */
+    cons = atomic_load_acquire(&d->hdr->cons);
+    count = MIN((uint32_t)len, d->size - (prod - cons));
+    if (count < len) {
+        atomic_set(&d->hdr->dropped, d->hdr->dropped + len - count);
+    }
+    if (!count) {
+        return len;
+    }
+
+    off = prod & (d->size - 1);
+    chunk = MIN(count, d->size - off);
+    memcpy(d->data + off, buf, chunk);
+    memcpy(d->data, buf + chunk, count - chunk);
+
+    d->prod = prod + count;
+    atomic_store_release(&d->hdr->prod, d->prod);
+
+    if (d->doorbell >= 0) {
+        /* Order the store to prod before the load of cons */
+        smp_mb();
+        if (atomic_read(&d->hdr->cons) == prod) {
+            shmring_kick(d);
+        }
+    }
+    return len;
+}
+
+static void char_shmring_finalize(Object *obj)
+{
+    ShmRingChardev *d = SHMRING_CHARDEV(obj);
+
+    if (d->hdr) {
+        munmap(d->hdr, d->map_size);
+    }
+    if (d->doorbell >= 0) {
+        close(d->doorbell);
+    }
+}
+
+static void char_shmring_init(Object *obj)
+{
+    SHMRING_CHARDEV(obj)->doorbell = -1;
+}
+
+static void qemu_chr_open_shmring(Chardev *chr,
+                                  ChardevBackend *backend,
+                                  bool *be_opened,
+                                  Error **errp)
+{
+    ChardevShmring *opts = backend->u.shmring.data;
+    ShmRingChardev *d = SHMRING_CHARDEV(chr);
+    int64_t size;
+    void *map;
+    int fd;
+
+    size = opts->has_size ? opts->size : 65536;
+    if (size <= 0 || size > 1U << 31 || (size & (size - 1))) {
+        error_setg(errp, "size of shmring chardev must be power of two, "
+                   "at most 2G");
+        return;
+    }
+    d->size = size;
+
+    if (opts->has_doorbell) {
+        /* An inherited fd number, or an fd passed with getfd */
+        if (qemu_isdigit(opts->doorbell[0])) {
+            d->doorbell = qemu_parse_fd(opts->doorbell);
+            if (d->doorbell < 0) {
+                error_setg(errp, "Invalid doorbell fd '%s'", opts->doorbell);
+                return;
+            }
+        } else if (cur_mon) {
+            d->doorbell = monitor_get_fd(cur_mon, opts->doorbell, errp);
+            if (d->doorbell < 0) {
+                return;
+            }
+        } else {
+            error_setg(errp, "Doorbell fd '%s' must be a number here",
+                       opts->doorbell);
+            return;
+        }
+    }
+
+    TFR(fd = qemu_open(opts->path, O_RDWR | O_CREAT, 0600));
+    if (fd < 0) {
+        error_setg_file_open(errp, errno, opts->path);
+        return;
+    }
+    d->map_size = sizeof(ShmRingHeader) + d->size;
+    if (ftruncate(fd, d->map_size) < 0) {
+        error_setg_errno(errp, errno, "Could not resize '%s'", opts->path);
+        qemu_close(fd);
+        return;
+    }
+    map = mmap(NULL, d->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    qemu_close(fd);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Could not map '%s'", opts->path);
+        return;
+    }
+
+    d->hdr = map;
+    d->data = map + sizeof(ShmRingHeader);
+    d->prod = 0;
+    d->hdr->magic = 0;
+    d->hdr->version = SHMRING_VERSION;
+    d->hdr->size = d->size;
+    d->hdr->prod = 0;
+    d->hdr->cons = 0;
+    d->hdr->dropped = 0;
+    /* A collector that sees the magic sees the rest of the header */
+    smp_wmb();
+    atomic_set(&d->hdr->magic, SHMRING_MAGIC);
+}
+
+static void qemu_chr_parse_shmring(QemuOpts *opts, ChardevBackend *backend,
+                                   Error **errp)
+{
+    const char *path = qemu_opt_get(opts, "path");
+    const char *doorbell = qemu_opt_get(opts, "doorbell");
+    ChardevShmring *shmring;
+    uint64_t val;
+
+    backend->type = CHARDEV_BACKEND_KIND_SHMRING;
+    if (path == NULL) {
+        error_setg(errp, "chardev: shmring: no path given");
+        return;
+    }
+    shmring = backend->u.shmring.data = g_new0(ChardevShmring, 1);
+    qemu_chr_parse_common(opts, qapi_ChardevShmring_base(shmring));
+    shmring->path = g_strdup(path);
+
+    val = qemu_opt_get_size(opts, "size", 0);
+    if (val != 0) {
+        shmring->has_size = true;
+        shmring->size = val;
+    }
+    if (doorbell) {
+        shmring->has_doorbell = true;
+        shmring->doorbell = g_strdup(doorbell);
+    }
+}
+
+static void char_shmring_class_init(ObjectClass *oc, void *data)
+{
+    ChardevClass *cc = CHARDEV_CLASS(oc);
+
+    cc->parse = qemu_chr_parse_shmring;
+    cc->open = qemu_chr_open_shmring;
+    cc->chr_write = shmring_chr_write;
+}
+
+static const TypeInfo char_shmring_type_info = {
+    .name = TYPE_CHARDEV_SHMRING,
+    .parent = TYPE_CHARDEV,
+    .class_init = char_shmring_class_init,
+    .instance_size = sizeof(ShmRingChardev),
+    .instance_init = char_shmring_init,
+    .instance_finalize = char_shmring_finalize,
+};
+
+static void register_types(void)
+{
+    type_register_static(&char_shmring_type_info);
+}
+
+type_init(register_types);
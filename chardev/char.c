@@ -864,6 +864,9 @@ QemuOptsList qemu_chardev_opts = {
         },{
             .name = "size",
             .type = QEMU_OPT_SIZE,
+        },{
+            .name = "doorbell",
+            .type = QEMU_OPT_STRING,
         },{
             .name = "chardev",
             .type = QEMU_OPT_STRING,
@@ -28,6 +28,7 @@
 #include "monitor/monitor.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-misc.h"
+#include "qapi/qapi-events-misc.h"
 #include "qapi/qapi-events-run-state.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/error-report.h"
@@ -36,6 +37,7 @@
 #include "exec/gdbstub.h"
 #include "sysemu/dma.h"
 #include "sysemu/hw_accel.h"
+#include "sysemu/accel.h"
 #include "sysemu/kvm.h"
 #include "sysemu/hax.h"
 #include "sysemu/hvf.h"
@@ -49,6 +51,7 @@
 #include "qemu/option.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "qemu/startup-profile.h"
 #include "tcg.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
@@ -88,12 +91,14 @@ bool cpu_is_stopped(CPUState *cpu)
     return cpu->stopped || !runstate_is_running();
 }
 
+static bool cpu_quota_exhausted(CPUState *cpu);
+
 static bool cpu_thread_is_idle(CPUState *cpu)
 {
     if (cpu->stop || cpu->queued_work_first) {
         return false;
     }
-    if (cpu_is_stopped(cpu)) {
+    if (cpu_is_stopped(cpu) || cpu_quota_exhausted(cpu)) {
         return true;
     }
     if (!cpu->halted || cpu_has_work(cpu) ||
@@ -121,6 +126,14 @@ static bool all_cpu_threads_idle(void)
 /* Protected by TimersState seqlock */
 
 static bool icount_sleep = true;
+/* Jump QEMU_CLOCK_VIRTUAL over idle periods without icount */
+static bool idle_skip;
+/* Likewise while a vCPU spins on a pollable MMIO register */
+static bool poll_skip;
+/* The single TCG vCPU runs QEMU_CLOCK_VIRTUAL timers without icount */
+bool vcpu_timers;
+/* When the next of them expires; INT64_MIN to look at the timer list */
+int64_t vcpu_timers_deadline = INT64_MAX;
 /* Conversion factor from emulated instructions to virtual clock ticks.  */
 static int icount_time_shift;
 /* Arbitrarily pick 1MIPS as the minimum allowable speed.  */
@@ -137,6 +150,9 @@ typedef struct TimersState {
     QemuSeqLock vm_clock_seqlock;
     int64_t cpu_clock_offset;
     int32_t cpu_ticks_enabled;
+    /* -rtc scale: virtual ns per host ns, counted from clock_scale_base */
+    int clock_scale;
+    int64_t clock_scale_base;
     int64_t dummy;
 
     /* Compensate for varying guest execution speed.  */
@@ -152,6 +168,8 @@ typedef struct TimersState {
 
 static TimersState timers_state;
 bool mttcg_enabled;
+/* With -accel tcg,thread=pool, the requested number of workers */
+static int tcg_pool_size;
 
 /*
  * We default to false if we know other options have been enabled
@@ -199,7 +217,7 @@ void qemu_tcg_configure(QemuOpts *opts, Error **errp)
 {
     const char *t = qemu_opt_get(opts, "thread");
     if (t) {
-        if (strcmp(t, "multi") == 0) {
+        if (strcmp(t, "multi") == 0 || strcmp(t, "pool") == 0) {
             if (TCG_OVERSIZED_GUEST) {
                 error_setg(errp, "No MTTCG when guest word size > hosts");
             } else if (use_icount) {
@@ -215,6 +233,16 @@ void qemu_tcg_configure(QemuOpts *opts, Error **errp)
                     error_printf("This may cause strange/hard to debug errors\n");
                 }
                 mttcg_enabled = true;
+                if (strcmp(t, "pool") == 0) {
+                    tcg_pool_size = qemu_opt_get_number(opts, "pool-size",
+                                                        0);
+#ifdef _SC_NPROCESSORS_ONLN
+                    if (!tcg_pool_size) {
+                        tcg_pool_size = sysconf(_SC_NPROCESSORS_ONLN);
+                    }
+#endif
+                    tcg_pool_size = MAX(tcg_pool_size, 1);
+                }
             }
         } else if (strcmp(t, "single") == 0) {
             mttcg_enabled = false;
@@ -328,13 +356,23 @@ int64_t cpu_get_ticks(void)
     return ticks;
 }
 
+/* Host time, sped up by -rtc scale */
+static int64_t cpu_get_scaled_clock(void)
+{
+    if (timers_state.clock_scale > 1) {
+        return (get_clock() - timers_state.clock_scale_base) *
+               timers_state.clock_scale;
+    }
+    return get_clock();
+}
+
 static int64_t cpu_get_clock_locked(void)
 {
     int64_t time;
 
     time = timers_state.cpu_clock_offset;
     if (timers_state.cpu_ticks_enabled) {
-        time += get_clock();
+        time += cpu_get_scaled_clock();
     }
 
     return time;
@@ -365,7 +403,7 @@ void cpu_enable_ticks(void)
     seqlock_write_begin(&timers_state.vm_clock_seqlock);
     if (!timers_state.cpu_ticks_enabled) {
         timers_state.cpu_ticks_offset -= cpu_get_host_ticks();
-        timers_state.cpu_clock_offset -= get_clock();
+        timers_state.cpu_clock_offset -= cpu_get_scaled_clock();
         timers_state.cpu_ticks_enabled = 1;
     }
     seqlock_write_end(&timers_state.vm_clock_seqlock);
@@ -608,6 +646,119 @@ void qemu_start_warp_timer(void)
     }
 }
 
+/* Make QEMU_CLOCK_VIRTUAL run @scale times faster than host time.
+ * Must be called before the VM starts, without icount.
+ */
+void cpu_set_clock_scale(int scale)
+{
+    assert(!use_icount && !timers_state.cpu_ticks_enabled);
+    timers_state.clock_scale = scale;
+    timers_state.clock_scale_base = get_clock();
+    qemu_clock_set_virtual_scale(scale);
+}
+
+void cpu_set_idle_skip(bool enable)
+{
+    idle_skip = enable;
+}
+
+void cpu_set_poll_skip(bool enable)
+{
+    poll_skip = enable;
+}
+
+void cpu_set_vcpu_timers(bool enable)
+{
+    assert(!use_icount && !qemu_tcg_mttcg_enabled());
+    vcpu_timers = enable;
+    qemu_clock_set_virtual_on_vcpu(enable);
+}
+
+/* Called by the vCPU thread.  Returns true if the deadline moved earlier */
+static bool vcpu_timers_update_deadline(void)
+{
+    int64_t deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
+    int64_t old = atomic_read(&vcpu_timers_deadline);
+
+    if (deadline >= 0) {
+        deadline += qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    } else {
+        deadline = INT64_MAX;
+    }
+    atomic_set(&vcpu_timers_deadline, deadline);
+    return deadline < old;
+}
+
+/* Host nanoseconds a halted vCPU may sleep before the next timer, or -1 */
+static int64_t vcpu_timers_sleep_ns(void)
+{
+    int64_t deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
+
+    if (deadline > 0 && timers_state.clock_scale > 1) {
+        deadline = DIV_ROUND_UP(deadline, timers_state.clock_scale);
+    }
+    return deadline;
+}
+
+/* Move cpu_clock_offset straight to the next QEMU_CLOCK_VIRTUAL deadline */
+static void qemu_clock_skip_to_deadline(void)
+{
+    int64_t deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
+
+    if (deadline < 0) {
+        return;
+    }
+
+    if (deadline > 0) {
+        seqlock_write_begin(&timers_state.vm_clock_seqlock);
+        timers_state.cpu_clock_offset += deadline;
+        seqlock_write_end(&timers_state.vm_clock_seqlock);
+    }
+    qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+}
+
+void qemu_idle_skip(void)
+{
+    if (!idle_skip || use_icount || !runstate_is_running()) {
+        return;
+    }
+
+    if (!all_cpu_threads_idle() || qtest_enabled()) {
+        return;
+    }
+
+    /* With every vCPU halted nothing can happen before the next
+     * QEMU_CLOCK_VIRTUAL deadline, so skip to it instead of sleeping.
+     * Without timers the CPU waits for I/O.
+     */
+    qemu_clock_skip_to_deadline();
+}
+
+/* Called with the BQL held by a vCPU that keeps reading the same value
+ * from a pollable register, or from RAM that only an ISR changes.  Only
+ * a timer can change that value, so the time until the next one is
+ * spent spinning; skip it, as if the host had not scheduled the vCPU
+ * meanwhile.  Other running vCPUs still need that time, so this is only
+ * done when they are all idle.
+ */
+void qemu_poll_skip(CPUState *cpu)
+{
+    CPUState *other;
+
+    if (!poll_skip || use_icount || !runstate_is_running() ||
+        qtest_enabled()) {
+        return;
+    }
+
+    CPU_FOREACH(other) {
+        if (other != cpu && !cpu_thread_is_idle(other)) {
+            return;
+        }
+    }
+
+    qemu_clock_skip_to_deadline();
+}
+
 static void qemu_account_warp_timer(void)
 {
     if (!use_icount || !icount_sleep) {
@@ -778,6 +929,174 @@ int cpu_throttle_get_percentage(void)
     return atomic_read(&throttle_percentage);
 }
 
+/*
+ * -cpu-quota: each vCPU may run so many guest instructions, or spend so
+ * much host CPU time in cpu_exec(), per wall-clock period.  Every TB
+ * checks the instruction count as it adds itself to exec_insns, and
+ * past the quota calls cpu_exit(), so the vCPU leaves at the next TB
+ * boundary.  CPU time is added up when cpu_exec() returns, which the
+ * quota timer forces CPU_QUOTA_TICKS times a period, so it may overrun
+ * by a tick.  A vCPU over its quota does not run until the next period;
+ * or with action=stop, the VM stops and the quota starts over on "cont".
+ */
+#define CPU_QUOTA_TICKS 10
+
+static struct {
+    bool enabled;
+    uint64_t insns;
+    int64_t time_ns;
+    int64_t period_ns;
+    CpuQuotaAction action;
+    int ticks;              /* timer ticks per period */
+    int tick;
+    QEMUTimer *timer;
+} cpu_quota;
+
+static int64_t cpu_quota_clock(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+#else
+    return get_clock();
+#endif
+}
+
+/* Start a new period for @cpu.  Called with the BQL held.  */
+static void cpu_quota_refill(CPUState *cpu)
+{
+    atomic_set__nocheck(&cpu->quota_insns, cpu_quota.insns ?
+                        atomic_read__nocheck(&cpu->exec_insns) +
+                        cpu_quota.insns : UINT64_MAX);
+    cpu->quota_time = cpu_quota.time_ns ?
+        atomic_read__nocheck(&cpu->quota_cpu_time) + cpu_quota.time_ns :
+        INT64_MAX;
+    cpu->quota_was_exhausted = cpu->quota_exhausted;
+    cpu->quota_exhausted = false;
+}
+
+/*
+ * Called with the BQL held, before @cpu runs and to see whether it is
+ * idle.  A throttled vCPU reports CPU_QUOTA_EXCEEDED once, not in each
+ * period it keeps running into the quota.
+ */
+static bool cpu_quota_exhausted(CPUState *cpu)
+{
+    CpuQuotaReason reason;
+
+    if (!cpu_quota.enabled || cpu->quota_exhausted) {
+        return cpu->quota_exhausted;
+    }
+    if (!cpu->quota_insns) {
+        /* Not seen by the timer yet */
+        cpu_quota_refill(cpu);
+    }
+    if (atomic_read__nocheck(&cpu->exec_insns) >= cpu->quota_insns) {
+        reason = CPU_QUOTA_REASON_INSNS;
+    } else if (atomic_read__nocheck(&cpu->quota_cpu_time) >=
+               cpu->quota_time) {
+        reason = CPU_QUOTA_REASON_CPU_TIME;
+    } else {
+        return false;
+    }
+
+    cpu->quota_exhausted = true;
+    if (cpu_quota.action == CPU_QUOTA_ACTION_STOP) {
+        qemu_system_vmstop_request_prepare();
+        qemu_system_vmstop_request(RUN_STATE_PAUSED);
+    } else if (cpu->quota_was_exhausted) {
+        return true;
+    }
+    qapi_event_send_cpu_quota_exceeded(cpu->cpu_index, reason,
+                                       cpu_quota.action,
+                                       atomic_read__nocheck(&cpu->exec_insns),
+                                       &error_abort);
+    return true;
+}
+
+static void cpu_quota_tick(void *opaque)
+{
+    CPUState *cpu;
+
+    cpu_quota.tick = (cpu_quota.tick + 1) % cpu_quota.ticks;
+    timer_mod(cpu_quota.timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+              cpu_quota.period_ns / cpu_quota.ticks);
+    if (!runstate_is_running()) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        if (cpu_quota.tick) {
+            /* Have cpu_exec() return and account its CPU time */
+            if (atomic_read(&cpu->running)) {
+                cpu_exit(cpu);
+            }
+        } else {
+            bool throttled = cpu->quota_exhausted;
+
+            cpu_quota_refill(cpu);
+            if (throttled) {
+                qemu_cpu_kick(cpu);
+            }
+        }
+    }
+}
+
+static void cpu_quota_vm_state_change(void *opaque, int running,
+                                      RunState state)
+{
+    CPUState *cpu;
+
+    if (!running) {
+        return;
+    }
+    CPU_FOREACH(cpu) {
+        cpu->quota_exhausted = false;
+        cpu_quota_refill(cpu);
+    }
+    cpu_quota.tick = 0;
+    timer_mod(cpu_quota.timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+              cpu_quota.period_ns / cpu_quota.ticks);
+}
+
+void configure_cpu_quota(QemuOpts *opts, Error **errp)
+{
+    Error *err = NULL;
+    int action;
+
+    cpu_quota.insns = qemu_opt_get_number(opts, "insns", 0);
+    cpu_quota.time_ns = qemu_opt_get_number(opts, "time", 0) * SCALE_MS;
+    cpu_quota.period_ns = qemu_opt_get_number(opts, "period", 100) * SCALE_MS;
+    if (!cpu_quota.insns && !cpu_quota.time_ns) {
+        error_setg(errp, "-cpu-quota: insns or time is required");
+        return;
+    }
+    if (cpu_quota.period_ns <= 0) {
+        error_setg(errp, "-cpu-quota: period must be at least 1 ms");
+        return;
+    }
+    if (cpu_quota.time_ns >= cpu_quota.period_ns) {
+        error_setg(errp, "-cpu-quota: time must be shorter than the period");
+        return;
+    }
+    action = qapi_enum_parse(&CpuQuotaAction_lookup,
+                             qemu_opt_get(opts, "action"),
+                             CPU_QUOTA_ACTION_THROTTLE, &err);
+    if (err) {
+        error_propagate(errp, err);
+        return;
+    }
+
+    cpu_quota.action = action;
+    cpu_quota.ticks = cpu_quota.time_ns ? CPU_QUOTA_TICKS : 1;
+    cpu_quota.timer = timer_new_ns(QEMU_CLOCK_REALTIME, cpu_quota_tick, NULL);
+    qemu_add_vm_change_state_handler(cpu_quota_vm_state_change, NULL);
+    tcg_cpu_quota = cpu_quota.insns != 0;
+    cpu_quota.enabled = true;
+}
+
 void cpu_ticks_init(void)
 {
     seqlock_init(&timers_state.vm_clock_seqlock);
@@ -887,6 +1206,30 @@ static void do_nothing(CPUState *cpu, run_on_cpu_data unused)
 
 void qemu_timer_notify_cb(void *opaque, QEMUClockType type)
 {
+    if (vcpu_timers && type == QEMU_CLOCK_VIRTUAL) {
+        /* The main loop only has to learn of earlier deadlines, to
+         * wake up if the vCPU does not get there.  Re-arming a timer
+         * from its callback does not need that.
+         */
+        if (qemu_in_vcpu_thread()) {
+            if (vcpu_timers_update_deadline()) {
+                qemu_notify_event();
+            }
+            return;
+        }
+
+        /* Overdue, or modified by another thread: look at the timer
+         * list at the next TB boundary, and wake the vCPU if it is
+         * halted or stuck in chained TBs.
+         */
+        atomic_set(&vcpu_timers_deadline, INT64_MIN);
+        if (first_cpu) {
+            async_run_on_cpu(first_cpu, do_nothing, RUN_ON_CPU_NULL);
+        }
+        qemu_notify_event();
+        return;
+    }
+
     if (!use_icount || type != QEMU_CLOCK_VIRTUAL) {
         qemu_notify_event();
         return;
@@ -902,7 +1245,7 @@ void qemu_timer_notify_cb(void *opaque, QEMUClockType type)
         /* qemu_cpu_kick is not enough to kick a halted CPU out of
          * qemu_tcg_wait_io_event.  async_run_on_cpu, instead,
          * causes cpu_thread_is_idle to return false.  This way,
-         * handle_icount_deadline can run.
+         * handle_virtual_deadline can run.
          * If we have no CPUs at all for some reason, we don't
          * need to do anything.
          */
@@ -1035,14 +1378,264 @@ static bool cpu_can_run(CPUState *cpu)
     if (cpu->stop) {
         return false;
     }
-    if (cpu_is_stopped(cpu)) {
+    if (cpu_is_stopped(cpu) || cpu_quota_exhausted(cpu)) {
         return false;
     }
     return true;
 }
 
+/*
+ * run-until: stop the VM at a PC, an instruction count, a virtual time or
+ * a value written to guest memory, whichever comes first.  The PC and the
+ * memory watch are a BP_RUN_UNTIL breakpoint and watchpoint, seen in
+ * cpu_handle_guest_debug(); the instruction count and the virtual time
+ * share one QEMU_CLOCK_VIRTUAL timer, which with icount lets the vCPU run
+ * exactly up to it.
+ */
+static struct {
+    bool armed;
+    CPUState *cpu;
+    bool has_pc;
+    vaddr pc;
+    bool has_icount;
+    int64_t icount;
+    bool has_vtime;
+    int64_t vtime;
+    bool has_watch;
+    vaddr watch_addr;
+    uint64_t watch_value;
+    int watch_size;
+    QEMUTimer *timer;
+} run_until;
+
+/* Called with the BQL held, from the vCPU's thread or with vCPUs paused */
+static void run_until_disarm(void)
+{
+    if (run_until.timer) {
+        timer_del(run_until.timer);
+    }
+    if (run_until.cpu) {
+        cpu_breakpoint_remove_all(run_until.cpu, BP_RUN_UNTIL);
+        cpu_watchpoint_remove_all(run_until.cpu, BP_RUN_UNTIL);
+    }
+    run_until.armed = false;
+}
+
+static void run_until_reached(RunUntilReason reason)
+{
+    CPUState *cpu = run_until.cpu;
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+
+    /* From the main loop this pauses the vCPUs before returning; the
+       vCPU thread stops itself once it leaves the guest.  */
+    vm_stop(RUN_STATE_PAUSED);
+    run_until_disarm();
+    qapi_event_send_run_until_reached(reason, cpu->cpu_index,
+                                      cc->get_pc != NULL,
+                                      cc->get_pc ? cc->get_pc(cpu) : 0,
+                                      use_icount != 0,
+                                      use_icount ? cpu_get_icount_raw() : 0,
+                                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL),
+                                      &error_abort);
+}
+
+static void run_until_timer_update(void)
+{
+    int64_t deadline = INT64_MAX;
+
+    if (run_until.has_vtime) {
+        deadline = run_until.vtime;
+    }
+    if (run_until.has_icount) {
+        /* Idle time warps advance the clock without instructions, so this
+           is a lower bound that may need to be moved on */
+        deadline = MIN(deadline, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                       cpu_icount_to_ns(run_until.icount -
+                                        cpu_get_icount_raw()));
+    }
+    timer_mod(run_until.timer, deadline);
+}
+
+static void run_until_timer_cb(void *opaque)
+{
+    if (!run_until.armed) {
+        return;
+    }
+    if (run_until.has_icount && cpu_get_icount_raw() >= run_until.icount) {
+        run_until_reached(RUN_UNTIL_REASON_ICOUNT);
+    } else if (run_until.has_vtime &&
+               qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) >= run_until.vtime) {
+        run_until_reached(RUN_UNTIL_REASON_VTIME);
+    } else {
+        run_until_timer_update();
+    }
+}
+
+/* Returns true if the debug exception was for run-until */
+static bool run_until_debug(CPUState *cpu)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    CPUWatchpoint *wp = cpu->watchpoint_hit;
+    uint8_t buf[8];
+    uint64_t value;
+
+    if (!run_until.armed || cpu != run_until.cpu) {
+        return false;
+    }
+
+    if (wp) {
+        if (!(wp->flags & BP_RUN_UNTIL)) {
+            return false;
+        }
+        /* The write has been done; carry on unless it wrote the value */
+        wp->flags &= ~BP_WATCHPOINT_HIT;
+        cpu->watchpoint_hit = NULL;
+        if (cpu_memory_rw_debug(cpu, run_until.watch_addr, buf,
+                                run_until.watch_size, 0) < 0) {
+            return true;
+        }
+        switch (run_until.watch_size) {
+        case 1:
+            value = ldub_p(buf);
+            break;
+        case 2:
+            value = lduw_p(buf);
+            break;
+        case 4:
+            value = ldl_p(buf);
+            break;
+        default:
+            value = ldq_p(buf);
+            break;
+        }
+        if (value == run_until.watch_value) {
+            run_until_reached(RUN_UNTIL_REASON_WATCH);
+            cpu->stopped = true;
+        }
+        return true;
+    }
+
+    if (run_until.has_pc && !cpu->singlestep_enabled && cc->get_pc &&
+        cc->get_pc(cpu) == run_until.pc &&
+        !cpu_breakpoint_test(cpu, run_until.pc, BP_GDB)) {
+        run_until_reached(RUN_UNTIL_REASON_PC);
+        cpu->stopped = true;
+        return true;
+    }
+    return false;
+}
+
+void qmp_run_until(bool has_cpu_index, int64_t cpu_index,
+                   bool has_pc, uint64_t pc,
+                   bool has_icount, int64_t icount,
+                   bool has_vtime_ns, int64_t vtime_ns,
+                   bool has_watch, RunUntilWatch *watch, Error **errp)
+{
+    CPUState *cpu = qemu_get_cpu(has_cpu_index ? cpu_index : 0);
+    Error *local_err = NULL;
+    int watch_size = 4;
+
+    if (!cpu) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cpu-index",
+                   "a CPU number");
+        return;
+    }
+    if (!has_pc && !has_icount && !has_vtime_ns && !has_watch) {
+        error_setg(errp, "run-until needs at least one condition");
+        return;
+    }
+    if (has_pc && !CPU_GET_CLASS(cpu)->get_pc) {
+        error_setg(errp, "this CPU cannot stop at a PC");
+        return;
+    }
+    if (has_icount && !use_icount) {
+        error_setg(errp, "an icount condition requires -icount");
+        return;
+    }
+    if (has_vtime_ns && vtime_ns <= qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)) {
+        error_setg(errp, "vtime-ns is not in the future");
+        return;
+    }
+    if (has_watch) {
+        if (watch->has_size) {
+            watch_size = watch->size;
+        }
+        if (watch_size != 1 && watch_size != 2 && watch_size != 4 &&
+            watch_size != 8) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "size",
+                       "1, 2, 4 or 8");
+            return;
+        }
+        if (watch->addr & (watch_size - 1)) {
+            error_setg(errp, "watch address must be aligned to its size");
+            return;
+        }
+    }
+
+    vm_stop(RUN_STATE_PAUSED);
+    run_until_disarm();
+
+    run_until.cpu = cpu;
+    run_until.has_pc = has_pc;
+    run_until.pc = pc;
+    run_until.has_icount = has_icount;
+    run_until.icount = icount;
+    run_until.has_vtime = has_vtime_ns;
+    run_until.vtime = vtime_ns;
+    run_until.has_watch = has_watch;
+    if (has_watch) {
+        run_until.watch_addr = watch->addr;
+        run_until.watch_value = watch->value;
+        run_until.watch_size = watch_size;
+    }
+
+    if (has_pc && cpu_breakpoint_insert(cpu, pc, BP_RUN_UNTIL, NULL) < 0) {
+        error_setg(errp, "could not set a breakpoint at 0x%" PRIx64, pc);
+        return;
+    }
+    if (has_watch &&
+        cpu_watchpoint_insert(cpu, watch->addr, watch_size,
+                              BP_MEM_WRITE | BP_RUN_UNTIL, NULL) < 0) {
+        cpu_breakpoint_remove_all(cpu, BP_RUN_UNTIL);
+        error_setg(errp, "could not set a watchpoint at 0x%" PRIx64,
+                   watch->addr);
+        return;
+    }
+    if (has_icount || has_vtime_ns) {
+        if (!run_until.timer) {
+            run_until.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                           run_until_timer_cb, NULL);
+        }
+        run_until_timer_update();
+    }
+    run_until.armed = true;
+
+    qmp_cont(&local_err);
+    if (local_err) {
+        run_until_disarm();
+        error_propagate(errp, local_err);
+    }
+}
+
 static void cpu_handle_guest_debug(CPUState *cpu)
 {
+    if (run_until_debug(cpu)) {
+        return;
+    }
+    if (replay_running_debug()) {
+        /* Replaying for reverse debugging: note the hit and carry on,
+           single-stepping over a breakpoint */
+        if (cpu->watchpoint_hit) {
+            replay_breakpoint();
+            cpu->watchpoint_hit = NULL;
+        } else if (!cpu->singlestep_enabled) {
+            replay_breakpoint();
+            cpu_single_step(cpu, SSTEP_ENABLE);
+        } else {
+            cpu_single_step(cpu, 0);
+        }
+        return;
+    }
     gdb_set_stop_cpu(cpu);
     qemu_system_debug_request();
     cpu->stopped = true;
@@ -1158,11 +1751,89 @@ static void qemu_wait_io_event_common(CPUState *cpu)
     process_queued_cpu_work(cpu);
 }
 
+/* Spend the idle time of @cpu on one -tb-speculate branch target.
+ * Returns false once there is none left to try.
+ */
+static bool qemu_tcg_speculate(CPUState *cpu)
+{
+    bool busy;
+
+    if (!tcg_tb_speculate || !tcg_enabled()) {
+        return false;
+    }
+    qemu_mutex_unlock_iothread();
+    busy = tb_speculate(cpu);
+    qemu_mutex_lock_iothread();
+    return busy;
+}
+
+/* Run expired QEMU_CLOCK_VIRTUAL timers if the vCPU thread owns them,
+ * that is with icount or vcpu_timers.
+ */
+static void handle_virtual_deadline(void)
+{
+    assert(qemu_in_vcpu_thread());
+    if (use_icount || vcpu_timers) {
+        int64_t deadline =
+            qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
+
+        if (deadline == 0) {
+            /* Wake up other AioContexts.  */
+            qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+            qemu_clock_run_timers(QEMU_CLOCK_VIRTUAL);
+        }
+    }
+    if (vcpu_timers) {
+        vcpu_timers_update_deadline();
+    }
+}
+
+/* Wait on @cpu's halt_cond, counting the host time it takes as halted
+ * time of @cpu, or with @all of every halted vCPU.
+ */
+static void qemu_cpu_halt_wait(CPUState *cpu, bool all)
+{
+    int64_t sleep_ns = vcpu_timers ? vcpu_timers_sleep_ns() : -1;
+    int64_t waited = -get_clock();
+    CPUState *other;
+
+    /* With vcpu_timers nobody else runs them, so wake up in time */
+    if (sleep_ns < 0) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    } else if (sleep_ns > 0) {
+        qemu_cond_timedwait(cpu->halt_cond, &qemu_global_mutex, sleep_ns);
+    }
+    waited += get_clock();
+    CPU_FOREACH(other) {
+        if ((all || other == cpu) && other->halted) {
+            other->exec_stats.halted_ns += waited;
+        }
+    }
+}
+
 static void qemu_tcg_rr_wait_io_event(CPUState *cpu)
 {
+    CPUState *other;
+
     while (all_cpu_threads_idle()) {
         stop_tcg_kick_timer();
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        CPU_FOREACH(other) {
+            if (qemu_tcg_speculate(other)) {
+                break;
+            }
+        }
+        if (other) {
+            continue;
+        }
+        qemu_idle_skip();
+        if (vcpu_timers) {
+            /* They may raise an interrupt and end the wait */
+            handle_virtual_deadline();
+            if (!all_cpu_threads_idle()) {
+                break;
+            }
+        }
+        qemu_cpu_halt_wait(cpu, true);
     }
 
     start_tcg_kick_timer();
@@ -1173,7 +1844,11 @@ static void qemu_tcg_rr_wait_io_event(CPUState *cpu)
 static void qemu_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        if (qemu_tcg_speculate(cpu)) {
+            continue;
+        }
+        qemu_idle_skip();
+        qemu_cpu_halt_wait(cpu, false);
     }
 
 #ifdef _WIN32
@@ -1294,21 +1969,6 @@ static int64_t tcg_get_icount_limit(void)
     }
 }
 
-static void handle_icount_deadline(void)
-{
-    assert(qemu_in_vcpu_thread());
-    if (use_icount) {
-        int64_t deadline =
-            qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
-
-        if (deadline == 0) {
-            /* Wake up other AioContexts.  */
-            qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
-            qemu_clock_run_timers(QEMU_CLOCK_VIRTUAL);
-        }
-    }
-}
-
 static void prepare_icount_for_run(CPUState *cpu)
 {
     if (use_icount) {
@@ -1351,6 +2011,7 @@ static void process_icount_data(CPUState *cpu)
 static int tcg_cpu_exec(CPUState *cpu)
 {
     int ret;
+    int64_t quota_ti = 0;
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
@@ -1358,9 +2019,17 @@ static int tcg_cpu_exec(CPUState *cpu)
 #ifdef CONFIG_PROFILER
     ti = profile_getclock();
 #endif
+    startup_profile_finish("first guest instruction");
+    if (cpu_quota.time_ns) {
+        quota_ti = cpu_quota_clock();
+    }
     cpu_exec_start(cpu);
     ret = cpu_exec(cpu);
     cpu_exec_end(cpu);
+    if (cpu_quota.time_ns) {
+        atomic_set__nocheck(&cpu->quota_cpu_time, cpu->quota_cpu_time +
+                            cpu_quota_clock() - quota_ti);
+    }
 #ifdef CONFIG_PROFILER
     tcg_time += profile_getclock() - ti;
 #endif
@@ -1436,7 +2105,7 @@ static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
         /* Run the timers here.  This is much more efficient than
          * waking up the I/O thread and waiting for completion.
          */
-        handle_icount_deadline();
+        handle_virtual_deadline();
 
         replay_mutex_unlock();
 
@@ -1463,6 +2132,11 @@ static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
                 process_icount_data(cpu);
                 qemu_mutex_lock_iothread();
 
+                if (vcpu_timers) {
+                    /* cpu_exec also returns when one of them expires */
+                    handle_virtual_deadline();
+                }
+
                 if (r == EXCP_DEBUG) {
                     cpu_handle_guest_debug(cpu);
                     break;
@@ -1690,6 +2364,255 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* For temporary buffers for forming a name */
+#define VCPU_THREAD_NAME_SIZE 16
+
+/* Multi-threaded TCG on a pool of threads
+ *
+ * With thread=pool, vCPUs are tasks run by a fixed number of worker
+ * threads, so that a fleet of mostly idle boards does not need a host
+ * thread each.  Each worker has a deque of runnable vCPUs: it runs
+ * them in turn from the head, one slice of cpu_exec() each, and when
+ * its own deque is empty steals from the tail of another's.  A halted
+ * vCPU is not queued at all until qemu_cpu_kick() wakes it up.
+ *
+ * While a worker runs a vCPU, cpu->thread and current_cpu are the
+ * worker's, so qemu_cpu_is_self() and run_on_cpu() work as usual.
+ */
+
+#define TCG_POOL_SLICE (NANOSECONDS_PER_SECOND / 100)
+
+enum {
+    TCG_POOL_IDLE,      /* parked until kicked */
+    TCG_POOL_QUEUED,    /* on a worker's deque */
+    TCG_POOL_RUNNING,   /* on a worker */
+    TCG_POOL_KICKED,    /* on a worker, and kicked since it started */
+};
+
+typedef struct TCGPoolWorker {
+    QemuThread thread;
+    int thread_id;
+    QemuMutex lock;
+    GQueue deque;
+} TCGPoolWorker;
+
+static struct {
+    TCGPoolWorker *workers;
+    int n;
+    int queued;             /* vCPUs on all deques */
+    int sleepers;
+    QemuMutex lock;         /* for sleepers */
+    QemuCond cond;
+    QEMUTimer *slice_timer;
+} tcg_pool;
+
+static __thread TCGPoolWorker *tcg_pool_self;
+
+static void qemu_tcg_pool_push(CPUState *cpu)
+{
+    TCGPoolWorker *w = tcg_pool_self ?:
+        &tcg_pool.workers[cpu->cpu_index % tcg_pool.n];
+
+    qemu_mutex_lock(&w->lock);
+    g_queue_push_tail(&w->deque, cpu);
+    qemu_mutex_unlock(&w->lock);
+
+    atomic_inc(&tcg_pool.queued);
+    qemu_mutex_lock(&tcg_pool.lock);
+    if (tcg_pool.sleepers) {
+        qemu_cond_signal(&tcg_pool.cond);
+    }
+    qemu_mutex_unlock(&tcg_pool.lock);
+}
+
+static CPUState *qemu_tcg_pool_pop(TCGPoolWorker *w, bool steal)
+{
+    CPUState *cpu;
+
+    qemu_mutex_lock(&w->lock);
+    cpu = steal ? g_queue_pop_tail(&w->deque) : g_queue_pop_head(&w->deque);
+    qemu_mutex_unlock(&w->lock);
+    if (cpu) {
+        atomic_dec(&tcg_pool.queued);
+    }
+    return cpu;
+}
+
+static CPUState *qemu_tcg_pool_take(TCGPoolWorker *w)
+{
+    int self = w - tcg_pool.workers;
+    CPUState *cpu;
+    int i;
+
+    while (true) {
+        cpu = qemu_tcg_pool_pop(w, false);
+        for (i = 1; !cpu && i < tcg_pool.n; i++) {
+            cpu = qemu_tcg_pool_pop(&tcg_pool.workers[(self + i) % tcg_pool.n],
+                                    true);
+        }
+        if (cpu) {
+            return cpu;
+        }
+
+        qemu_mutex_lock(&tcg_pool.lock);
+        tcg_pool.sleepers++;
+        while (!atomic_read(&tcg_pool.queued)) {
+            qemu_cond_wait(&tcg_pool.cond, &tcg_pool.lock);
+        }
+        tcg_pool.sleepers--;
+        qemu_mutex_unlock(&tcg_pool.lock);
+    }
+}
+
+/* Called from qemu_cpu_kick(): make sure @cpu gets to look at its state */
+static void qemu_tcg_pool_wake(CPUState *cpu)
+{
+    while (true) {
+        switch (atomic_read(&cpu->pool_state)) {
+        case TCG_POOL_IDLE:
+            if (atomic_cmpxchg(&cpu->pool_state, TCG_POOL_IDLE,
+                               TCG_POOL_QUEUED) == TCG_POOL_IDLE) {
+                qemu_tcg_pool_push(cpu);
+                return;
+            }
+            break;
+        case TCG_POOL_RUNNING:
+            if (atomic_cmpxchg(&cpu->pool_state, TCG_POOL_RUNNING,
+                               TCG_POOL_KICKED) == TCG_POOL_RUNNING) {
+                return;
+            }
+            break;
+        default:
+            return;
+        }
+    }
+}
+
+/*
+ * Called by the worker that ran @cpu, with the BQL held.  Queue it
+ * again or park it, and return true; or return false if it was kicked
+ * while deciding and should be looked at again.
+ */
+static bool qemu_tcg_pool_release(CPUState *cpu)
+{
+    bool idle = cpu_thread_is_idle(cpu);
+
+    if (!idle && !cpu->unplug) {
+        cpu->thread = cpu->pool_parked;
+        atomic_set(&cpu->pool_state, TCG_POOL_QUEUED);
+        qemu_tcg_pool_push(cpu);
+        return true;
+    }
+    if (atomic_cmpxchg(&cpu->pool_state, TCG_POOL_RUNNING,
+                       TCG_POOL_IDLE) != TCG_POOL_RUNNING) {
+        atomic_set(&cpu->pool_state, TCG_POOL_RUNNING);
+        return false;
+    }
+    cpu->thread = cpu->pool_parked;
+    return true;
+}
+
+/* End the slices of running vCPUs while others wait for a worker */
+static void qemu_tcg_pool_slice(void *opaque)
+{
+    CPUState *cpu;
+
+    timer_mod(tcg_pool.slice_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + TCG_POOL_SLICE);
+    if (!atomic_read(&tcg_pool.queued)) {
+        return;
+    }
+    CPU_FOREACH(cpu) {
+        if (atomic_read(&cpu->pool_state) >= TCG_POOL_RUNNING) {
+            cpu_exit(cpu);
+        }
+    }
+}
+
+static void *qemu_tcg_pool_thread_fn(void *arg)
+{
+    TCGPoolWorker *w = arg;
+    CPUState *cpu;
+
+    g_assert(!use_icount);
+
+    rcu_register_thread();
+    tcg_register_thread();
+    tcg_pool_self = w;
+    qemu_thread_get_self(&w->thread);
+    w->thread_id = qemu_get_thread_id();
+
+    while (true) {
+        cpu = qemu_tcg_pool_take(w);
+
+        qemu_mutex_lock_iothread();
+        atomic_set(&cpu->pool_state, TCG_POOL_RUNNING);
+        cpu->thread = &w->thread;
+        cpu->thread_id = w->thread_id;
+        current_cpu = cpu;
+
+        do {
+            qemu_wait_io_event_common(cpu);
+            if (cpu_can_run(cpu)) {
+                int r;
+                qemu_mutex_unlock_iothread();
+                r = tcg_cpu_exec(cpu);
+                qemu_mutex_lock_iothread();
+                switch (r) {
+                case EXCP_DEBUG:
+                    cpu_handle_guest_debug(cpu);
+                    break;
+                case EXCP_ATOMIC:
+                    qemu_mutex_unlock_iothread();
+                    cpu_exec_step_atomic(cpu);
+                    qemu_mutex_lock_iothread();
+                    break;
+                default:
+                    break;
+                }
+            }
+            atomic_mb_set(&cpu->exit_request, 0);
+            qemu_wait_io_event_common(cpu);
+        } while (!qemu_tcg_pool_release(cpu));
+
+        if (cpu->unplug && !cpu_can_run(cpu)) {
+            qemu_tcg_destroy_vcpu(cpu);
+            cpu->created = false;
+            qemu_cond_signal(&qemu_cpu_cond);
+        }
+        current_cpu = NULL;
+        qemu_mutex_unlock_iothread();
+    }
+    return NULL;
+}
+
+static void qemu_tcg_pool_init(void)
+{
+    char thread_name[VCPU_THREAD_NAME_SIZE];
+    int i;
+
+    /* One TCG region per worker, so no more workers than vCPUs */
+    tcg_pool.n = MIN(tcg_pool_size, max_cpus);
+    tcg_pool.workers = g_new0(TCGPoolWorker, tcg_pool.n);
+    qemu_mutex_init(&tcg_pool.lock);
+    qemu_cond_init(&tcg_pool.cond);
+
+    for (i = 0; i < tcg_pool.n; i++) {
+        TCGPoolWorker *w = &tcg_pool.workers[i];
+
+        qemu_mutex_init(&w->lock);
+        g_queue_init(&w->deque);
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "Pool %d/TCG", i);
+        qemu_thread_create(&w->thread, thread_name, qemu_tcg_pool_thread_fn,
+                           w, QEMU_THREAD_JOINABLE);
+    }
+
+    tcg_pool.slice_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                        qemu_tcg_pool_slice, NULL);
+    timer_mod(tcg_pool.slice_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + TCG_POOL_SLICE);
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1722,6 +2645,9 @@ void qemu_cpu_kick(CPUState *cpu)
     qemu_cond_broadcast(cpu->halt_cond);
     if (tcg_enabled()) {
         cpu_exit(cpu);
+        if (tcg_pool.n) {
+            qemu_tcg_pool_wake(cpu);
+        }
         /* NOP unless doing single-thread RR */
         qemu_cpu_kick_rr_cpu();
     } else {
@@ -1839,14 +2765,18 @@ void cpu_remove_sync(CPUState *cpu)
     cpu->stop = true;
     cpu->unplug = true;
     qemu_cpu_kick(cpu);
+    if (tcg_pool.n) {
+        /* The worker stays, just wait until it lets go of the vCPU */
+        while (cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
     qemu_mutex_unlock_iothread();
     qemu_thread_join(cpu->thread);
     qemu_mutex_lock_iothread();
 }
 
-/* For temporary buffers for forming a name */
-#define VCPU_THREAD_NAME_SIZE 16
-
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
     char thread_name[VCPU_THREAD_NAME_SIZE];
@@ -1865,6 +2795,21 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
         tcg_region_init();
     }
 
+    if (tcg_pool_size) {
+        if (!tcg_pool.n) {
+            qemu_tcg_pool_init();
+        }
+        /* Never a live thread, for qemu_cpu_is_self() while parked */
+        cpu->pool_parked = g_malloc0(sizeof(QemuThread));
+        cpu->thread = cpu->pool_parked;
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        parallel_cpus = true;
+        cpu->can_do_io = 1;
+        cpu->created = true;
+        return;
+    }
+
     if (qemu_tcg_mttcg_enabled() || !single_tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
         cpu->halt_cond = g_malloc0(sizeof(QemuCond));
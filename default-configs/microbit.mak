@@ -0,0 +1,10 @@
+# Device set for an arm-softmmu build that only runs the micro:bit
+# machines; select it with configure --with-devices-arm=microbit
+
+CONFIG_MICROBIT=y
+CONFIG_ARM_V7M=y
+CONFIG_PTIMER=y
+CONFIG_I2C=y
+CONFIG_SSI=y
+CONFIG_CMSDK_APB_TIMER=y
+CONFIG_CMSDK_APB_UART=y
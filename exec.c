@@ -772,6 +772,11 @@ void cpu_exec_unrealizefn(CPUState *cpu)
     if (qdev_get_vmsd(DEVICE(cpu)) == NULL) {
         vmstate_unregister(NULL, &vmstate_cpu_common, cpu);
     }
+#ifndef CONFIG_USER_ONLY
+    if (tcg_enabled()) {
+        tlb_destroy(cpu);
+    }
+#endif
 }
 
 Property cpu_common_props[] = {
@@ -813,6 +818,9 @@ void cpu_exec_realizefn(CPUState *cpu, Error **errp)
     }
 
 #ifndef CONFIG_USER_ONLY
+    if (tcg_enabled()) {
+        tlb_init(cpu);
+    }
     if (qdev_get_vmsd(DEVICE(cpu)) == NULL) {
         vmstate_register(NULL, cpu->cpu_index, &vmstate_cpu_common, cpu);
     }
@@ -890,6 +898,135 @@ int cpu_watchpoint_insert(CPUState *cpu, vaddr addr, vaddr len,
     return -ENOSYS;
 }
 #else
+/* Return true if this watchpoint address matches the specified
+ * access (ie the address range covered by the watchpoint overlaps
+ * partially or completely with the address range covered by the
+ * access).
+ */
+static inline bool cpu_watchpoint_address_matches(CPUWatchpoint *wp,
+                                                  vaddr addr,
+                                                  vaddr len)
+{
+    /* We know the lengths are non-zero, but a little caution is
+     * required to avoid errors in the case where the range ends
+     * exactly at the top of the address space and so addr + len
+     * wraps round to zero.
+     */
+    vaddr wpend = wp->vaddr + wp->len - 1;
+    vaddr addrend = addr + len - 1;
+
+    return !(addr > wpend || wp->vaddr > addrend);
+}
+
+/* Watchpoints that cover more pages than this have no bitmaps, and
+ * while there is one every access to a watched page is checked.
+ */
+#define WATCHPOINT_MAX_PAGES 16
+
+/* The bytes of a page that read and write watchpoints cover */
+typedef struct CPUWatchpointPage {
+    uint64_t page;
+    unsigned long map[];
+} CPUWatchpointPage;
+
+static unsigned long *watchpoint_page_map(CPUWatchpointPage *wpage, int flags)
+{
+    return wpage->map + (flags == BP_MEM_READ ? 0 :
+                         BITS_TO_LONGS(TARGET_PAGE_SIZE));
+}
+
+static bool cpu_watchpoint_is_wide(CPUWatchpoint *wp)
+{
+    return ((wp->vaddr + wp->len - 1) >> TARGET_PAGE_BITS) -
+           (wp->vaddr >> TARGET_PAGE_BITS) >= WATCHPOINT_MAX_PAGES;
+}
+
+/* Recompute the bitmaps of @page from the watchpoints that remain */
+static void cpu_watchpoint_update_page(CPUState *cpu, uint64_t page)
+{
+    size_t longs = 2 * BITS_TO_LONGS(TARGET_PAGE_SIZE);
+    CPUWatchpointPage *wpage;
+    CPUWatchpoint *wp;
+    bool watched = false;
+
+    if (!cpu->watchpoint_pages) {
+        cpu->watchpoint_pages = g_hash_table_new_full(g_int64_hash,
+                                                      g_int64_equal,
+                                                      NULL, g_free);
+    }
+    wpage = g_hash_table_lookup(cpu->watchpoint_pages, &page);
+    if (!wpage) {
+        wpage = g_malloc(sizeof(*wpage) + longs * sizeof(unsigned long));
+        wpage->page = page;
+        g_hash_table_insert(cpu->watchpoint_pages, &wpage->page, wpage);
+    }
+    bitmap_zero(wpage->map, longs * BITS_PER_LONG);
+
+    QTAILQ_FOREACH(wp, &cpu->watchpoints, entry) {
+        uint64_t start, end;
+
+        if (cpu_watchpoint_is_wide(wp) ||
+            !cpu_watchpoint_address_matches(wp, page, TARGET_PAGE_SIZE)) {
+            continue;
+        }
+        start = MAX(wp->vaddr, page) - page;
+        end = MIN(wp->vaddr + wp->len - 1, page + TARGET_PAGE_SIZE - 1) - page;
+        if (wp->flags & BP_MEM_READ) {
+            bitmap_set(watchpoint_page_map(wpage, BP_MEM_READ),
+                       start, end - start + 1);
+        }
+        if (wp->flags & BP_MEM_WRITE) {
+            bitmap_set(watchpoint_page_map(wpage, BP_MEM_WRITE),
+                       start, end - start + 1);
+        }
+        watched = true;
+    }
+
+    if (!watched) {
+        g_hash_table_remove(cpu->watchpoint_pages, &page);
+    }
+}
+
+static void cpu_watchpoint_update_pages(CPUState *cpu, CPUWatchpoint *wp)
+{
+    uint64_t page = wp->vaddr & TARGET_PAGE_MASK;
+    uint64_t n = ((wp->vaddr + wp->len - 1) >> TARGET_PAGE_BITS) -
+                 (wp->vaddr >> TARGET_PAGE_BITS);
+
+    if (cpu_watchpoint_is_wide(wp)) {
+        return;
+    }
+    do {
+        cpu_watchpoint_update_page(cpu, page);
+        page += TARGET_PAGE_SIZE;
+    } while (n--);
+}
+
+bool cpu_watchpoint_may_hit(CPUState *cpu, vaddr addr, vaddr len, int flags)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    CPUWatchpointPage *wpage;
+    uint64_t page, off;
+
+    /* A hit being replayed raises its exception from check_watchpoint() */
+    if (cpu->watchpoint_hit || cpu->watchpoint_wide) {
+        return true;
+    }
+    addr = cc->adjust_watchpoint_address(cpu, addr, len);
+    page = addr & TARGET_PAGE_MASK;
+    off = addr - page;
+    if (off + len > TARGET_PAGE_SIZE) {
+        return true;
+    }
+    wpage = cpu->watchpoint_pages ?
+            g_hash_table_lookup(cpu->watchpoint_pages, &page) : NULL;
+    if (!wpage) {
+        return false;
+    }
+    return find_next_bit(watchpoint_page_map(wpage, flags),
+                         off + len, off) < off + len;
+}
+
 /* Add a watchpoint.  */
 int cpu_watchpoint_insert(CPUState *cpu, vaddr addr, vaddr len,
                           int flags, CPUWatchpoint **watchpoint)
@@ -908,12 +1045,23 @@ int cpu_watchpoint_insert(CPUState *cpu, vaddr addr, vaddr len,
     wp->len = len;
     wp->flags = flags;
 
+    /* Targets may translate memory accesses that skip the TLB, and so any
+       watchpoint, while there are none */
+    if (QTAILQ_EMPTY(&cpu->watchpoints)) {
+        tb_flush(cpu);
+    }
+
     /* keep all GDB-injected watchpoints in front */
     if (flags & BP_GDB) {
         QTAILQ_INSERT_HEAD(&cpu->watchpoints, wp, entry);
     } else {
         QTAILQ_INSERT_TAIL(&cpu->watchpoints, wp, entry);
     }
+    if (cpu_watchpoint_is_wide(wp)) {
+        cpu->watchpoint_wide++;
+    } else {
+        cpu_watchpoint_update_pages(cpu, wp);
+    }
 
     tlb_flush_page(cpu, addr);
 
@@ -942,6 +1090,11 @@ int cpu_watchpoint_remove(CPUState *cpu, vaddr addr, vaddr len,
 void cpu_watchpoint_remove_by_ref(CPUState *cpu, CPUWatchpoint *watchpoint)
 {
     QTAILQ_REMOVE(&cpu->watchpoints, watchpoint, entry);
+    if (cpu_watchpoint_is_wide(watchpoint)) {
+        cpu->watchpoint_wide--;
+    } else {
+        cpu_watchpoint_update_pages(cpu, watchpoint);
+    }
 
     tlb_flush_page(cpu, watchpoint->vaddr);
 
@@ -960,26 +1113,6 @@ void cpu_watchpoint_remove_all(CPUState *cpu, int mask)
     }
 }
 
-/* Return true if this watchpoint address matches the specified
- * access (ie the address range covered by the watchpoint overlaps
- * partially or completely with the address range covered by the
- * access).
- */
-static inline bool cpu_watchpoint_address_matches(CPUWatchpoint *wp,
-                                                  vaddr addr,
-                                                  vaddr len)
-{
-    /* We know the lengths are non-zero, but a little caution is
-     * required to avoid errors in the case where the range ends
-     * exactly at the top of the address space and so addr + len
-     * wraps round to zero.
-     */
-    vaddr wpend = wp->vaddr + wp->len - 1;
-    vaddr addrend = addr + len - 1;
-
-    return !(addr > wpend || wp->vaddr > addrend);
-}
-
 #endif
 
 /* Add a breakpoint.  */
@@ -83,6 +83,8 @@ this code that are retained.
  * target-dependent and needs the TARGET_* macros.
  */
 #include "qemu/osdep.h"
+#include <float.h>
+#include <math.h>
 #include "qemu/bitops.h"
 #include "fpu/softfloat.h"
 
@@ -722,6 +724,99 @@ static FloatParts addsub_floats(FloatParts a, FloatParts b, bool subtract,
     g_assert_not_reached();
 }
 
+/*
+ * Host FPU fast path for float32 arithmetic
+ *
+ * With round to nearest even, and normal (or zero) inputs whose result
+ * is neither tiny nor overflows, an IEEE host computes exactly the value
+ * softfloat would and raises no flag but inexact.  So once inexact is
+ * already set, which guest FP code does early and keeps, the host result
+ * can be returned as is.  Everything else goes through softfloat.  This
+ * needs the host to evaluate float expressions in float, without excess
+ * precision (no x87), and to run with its default rounding and no
+ * flush-to-zero, as QEMU always does.
+ */
+#if defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ == 0
+#define QEMU_HARDFLOAT 1
+#else
+#define QEMU_HARDFLOAT 0
+#endif
+
+typedef enum {
+    HOST_F32_ADD,
+    HOST_F32_SUB,
+    HOST_F32_MUL,
+    HOST_F32_DIV,
+    HOST_F32_SQRT,
+} HostF32Op;
+
+typedef union {
+    uint32_t i;
+    float f;
+} HostFloat32;
+
+static inline bool float32_is_zero_or_normal(float32 a)
+{
+    uint32_t exp = extract32(float32_val(a), 23, 8);
+
+    return exp == 0 ? float32_is_zero(a) : exp != 0xff;
+}
+
+/* Set *@r to a @op b (or sqrt(a)) and return true if the host can do it */
+static inline bool float32_host_op(HostF32Op op, float32 a, float32 b,
+                                   float32 *r, float_status *s)
+{
+    HostFloat32 ua = { .i = float32_val(a) };
+    HostFloat32 ub = { .i = float32_val(b) };
+    HostFloat32 ur;
+
+    if (!QEMU_HARDFLOAT ||
+        s->float_rounding_mode != float_round_nearest_even ||
+        !(s->float_exception_flags & float_flag_inexact) ||
+        !float32_is_zero_or_normal(a) || !float32_is_zero_or_normal(b)) {
+        return false;
+    }
+
+    switch (op) {
+    case HOST_F32_ADD:
+        ur.f = ua.f + ub.f;
+        break;
+    case HOST_F32_SUB:
+        ur.f = ua.f - ub.f;
+        break;
+    case HOST_F32_MUL:
+        ur.f = ua.f * ub.f;
+        break;
+    case HOST_F32_DIV:
+        if (float32_is_zero(b)) {
+            return false;
+        }
+        ur.f = ua.f / ub.f;
+        break;
+    case HOST_F32_SQRT:
+        if (float32_is_neg(a)) {
+            return false;
+        }
+        ur.f = sqrtf(ua.f);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    if (isinf(ur.f)) {
+        return false;
+    }
+    /* A tiny result may have underflowed, unless a zero input made it 0 */
+    if (fabsf(ur.f) <= FLT_MIN &&
+        !((op == HOST_F32_MUL || op == HOST_F32_DIV || op == HOST_F32_SQRT)
+          && float32_is_zero(a)) &&
+        !(op == HOST_F32_MUL && float32_is_zero(b))) {
+        return false;
+    }
+    *r = make_float32(ur.i);
+    return true;
+}
+
 /*
  * Returns the result of adding or subtracting the floating-point
  * values `a' and `b'. The operation is performed according to the
@@ -741,9 +836,15 @@ float16  __attribute__((flatten)) float16_add(float16 a, float16 b,
 float32 __attribute__((flatten)) float32_add(float32 a, float32 b,
                                              float_status *status)
 {
-    FloatParts pa = float32_unpack_canonical(a, status);
-    FloatParts pb = float32_unpack_canonical(b, status);
-    FloatParts pr = addsub_floats(pa, pb, false, status);
+    FloatParts pa, pb, pr;
+    float32 r;
+
+    if (float32_host_op(HOST_F32_ADD, a, b, &r, status)) {
+        return r;
+    }
+    pa = float32_unpack_canonical(a, status);
+    pb = float32_unpack_canonical(b, status);
+    pr = addsub_floats(pa, pb, false, status);
 
     return float32_round_pack_canonical(pr, status);
 }
@@ -771,9 +872,15 @@ float16 __attribute__((flatten)) float16_sub(float16 a, float16 b,
 float32 __attribute__((flatten)) float32_sub(float32 a, float32 b,
                                              float_status *status)
 {
-    FloatParts pa = float32_unpack_canonical(a, status);
-    FloatParts pb = float32_unpack_canonical(b, status);
-    FloatParts pr = addsub_floats(pa, pb, true, status);
+    FloatParts pa, pb, pr;
+    float32 r;
+
+    if (float32_host_op(HOST_F32_SUB, a, b, &r, status)) {
+        return r;
+    }
+    pa = float32_unpack_canonical(a, status);
+    pb = float32_unpack_canonical(b, status);
+    pr = addsub_floats(pa, pb, true, status);
 
     return float32_round_pack_canonical(pr, status);
 }
@@ -852,9 +959,15 @@ float16 __attribute__((flatten)) float16_mul(float16 a, float16 b,
 float32 __attribute__((flatten)) float32_mul(float32 a, float32 b,
                                              float_status *status)
 {
-    FloatParts pa = float32_unpack_canonical(a, status);
-    FloatParts pb = float32_unpack_canonical(b, status);
-    FloatParts pr = mul_floats(pa, pb, status);
+    FloatParts pa, pb, pr;
+    float32 r;
+
+    if (float32_host_op(HOST_F32_MUL, a, b, &r, status)) {
+        return r;
+    }
+    pa = float32_unpack_canonical(a, status);
+    pb = float32_unpack_canonical(b, status);
+    pr = mul_floats(pa, pb, status);
 
     return float32_round_pack_canonical(pr, status);
 }
@@ -1178,9 +1291,15 @@ float16 float16_div(float16 a, float16 b, float_status *status)
 
 float32 float32_div(float32 a, float32 b, float_status *status)
 {
-    FloatParts pa = float32_unpack_canonical(a, status);
-    FloatParts pb = float32_unpack_canonical(b, status);
-    FloatParts pr = div_floats(pa, pb, status);
+    FloatParts pa, pb, pr;
+    float32 r;
+
+    if (float32_host_op(HOST_F32_DIV, a, b, &r, status)) {
+        return r;
+    }
+    pa = float32_unpack_canonical(a, status);
+    pb = float32_unpack_canonical(b, status);
+    pr = div_floats(pa, pb, status);
 
     return float32_round_pack_canonical(pr, status);
 }
@@ -1993,8 +2112,14 @@ float16 __attribute__((flatten)) float16_sqrt(float16 a, float_status *status)
 
 float32 __attribute__((flatten)) float32_sqrt(float32 a, float_status *status)
 {
-    FloatParts pa = float32_unpack_canonical(a, status);
-    FloatParts pr = sqrt_float(pa, status, &float32_params);
+    FloatParts pa, pr;
+    float32 r;
+
+    if (float32_host_op(HOST_F32_SQRT, a, float32_zero, &r, status)) {
+        return r;
+    }
+    pa = float32_unpack_canonical(a, status);
+    pr = sqrt_float(pa, status, &float32_params);
     return float32_round_pack_canonical(pr, status);
 }
 
@@ -29,6 +29,7 @@
 #include "chardev/char.h"
 #include "chardev/char-fe.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/replay.h"
 #include "exec/gdbstub.h"
 #endif
 
@@ -297,6 +298,13 @@ typedef struct GDBRegisterState {
     struct GDBRegisterState *next;
 } GDBRegisterState;
 
+/* A gdb inferior: the CPUs that share a cluster_index, e.g. one board */
+typedef struct GDBProcess {
+    uint32_t pid;
+    bool attached;
+    char target_xml[1024];
+} GDBProcess;
+
 enum RSState {
     RS_INACTIVE,
     RS_IDLE,
@@ -310,6 +318,9 @@ typedef struct GDBState {
     CPUState *c_cpu; /* current CPU for step/continue ops */
     CPUState *g_cpu; /* current CPU for other ops */
     CPUState *query_cpu; /* for q{f|s}ThreadInfo */
+    GDBProcess *processes;
+    int process_num;
+    bool multiprocess; /* gdb speaks the multiprocess extensions */
     enum RSState state; /* parsing state */
     char line_buf[MAX_PACKET_LENGTH];
     int line_buf_index;
@@ -327,6 +338,11 @@ typedef struct GDBState {
 #endif
     char syscall_buf[256];
     gdb_syscall_complete_cb current_syscall_cb;
+    /* The 'g' register block of regs_cache_cpu, until it runs again */
+    CPUState *regs_cache_cpu;
+    uint8_t regs_cache[MAX_PACKET_LENGTH];
+    int regs_cache_len;
+    int *regs_cache_offset; /* of each register, then the end */
 } GDBState;
 
 /* By default use no IRQs and no timers while single stepping so as to
@@ -393,10 +409,152 @@ int use_gdb_syscalls(void)
     return gdb_syscall_mode == GDB_SYS_ENABLED;
 }
 
+static inline void gdb_regs_cache_reset(GDBState *s)
+{
+    s->regs_cache_cpu = NULL;
+}
+
+/* Processes are numbered from 1, as 0 means "any process" */
+static uint32_t gdb_get_cpu_pid(CPUState *cpu)
+{
+    return cpu->cluster_index + 1;
+}
+
+static void gdb_create_processes(GDBState *s)
+{
+    CPUState *cpu;
+    int i;
+
+    s->process_num = 1;
+    CPU_FOREACH(cpu) {
+        s->process_num = MAX(s->process_num, gdb_get_cpu_pid(cpu));
+    }
+    s->processes = g_new0(GDBProcess, s->process_num);
+    for (i = 0; i < s->process_num; i++) {
+        s->processes[i].pid = i + 1;
+        s->processes[i].attached = true;
+    }
+}
+
+static GDBProcess *gdb_get_process(const GDBState *s, uint32_t pid)
+{
+    if (!pid) {
+        return &s->processes[0];
+    }
+    if (pid > s->process_num) {
+        return NULL;
+    }
+    return &s->processes[pid - 1];
+}
+
+static GDBProcess *gdb_get_cpu_process(const GDBState *s, CPUState *cpu)
+{
+    return gdb_get_process(s, gdb_get_cpu_pid(cpu));
+}
+
+static CPUState *gdb_first_cpu_in_process(const GDBProcess *process)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (gdb_get_cpu_pid(cpu) == process->pid) {
+            return cpu;
+        }
+    }
+    return NULL;
+}
+
+/* @cpu or the first CPU after it that gdb is attached to */
+static CPUState *gdb_attached_cpu_from(const GDBState *s, CPUState *cpu)
+{
+    while (cpu && !gdb_get_cpu_process(s, cpu)->attached) {
+        cpu = CPU_NEXT(cpu);
+    }
+    return cpu;
+}
+
+/* The CPU of an attached process for a thread id, 0 meaning any */
+static CPUState *gdb_get_cpu(const GDBState *s, uint32_t pid, uint32_t tid)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if ((!pid || gdb_get_cpu_pid(cpu) == pid) &&
+            (!tid || cpu_gdb_index(cpu) == tid)) {
+            return gdb_get_cpu_process(s, cpu)->attached ? cpu : NULL;
+        }
+    }
+    return NULL;
+}
+
+/* gdb selects the general thread of an inferior before setting its
+ * breakpoints, which then only apply to the CPUs of that process.
+ */
+static bool gdb_cpu_in_g_process(const GDBState *s, CPUState *cpu)
+{
+    return !s->multiprocess ||
+           gdb_get_cpu_pid(cpu) == gdb_get_cpu_pid(s->g_cpu);
+}
+
+static const char *gdb_fmt_thread_id(const GDBState *s, CPUState *cpu,
+                                     char *buf, size_t buf_size)
+{
+    if (s->multiprocess) {
+        snprintf(buf, buf_size, "p%02x.%02x",
+                 gdb_get_cpu_pid(cpu), cpu_gdb_index(cpu));
+    } else {
+        snprintf(buf, buf_size, "%02x", cpu_gdb_index(cpu));
+    }
+    return buf;
+}
+
+typedef enum GDBThreadIdKind {
+    GDB_ONE_THREAD = 0,
+    GDB_ALL_THREADS,     /* One process, all threads */
+    GDB_ALL_PROCESSES,
+    GDB_READ_THREAD_ERR
+} GDBThreadIdKind;
+
+/* Parse "<tid>" or "p<pid>.<tid>", where either may be -1 for all */
+static GDBThreadIdKind read_thread_id(const char *buf, const char **end_buf,
+                                      uint32_t *pid, uint32_t *tid)
+{
+    unsigned long p, t;
+
+    if (*buf == 'p') {
+        if (qemu_strtoul(buf + 1, &buf, 16, &p)) {
+            return GDB_READ_THREAD_ERR;
+        }
+        /* Skip '.' */
+        if (*buf != '.') {
+            *end_buf = buf;
+            *pid = p;
+            *tid = -1;
+            return p == -1 ? GDB_ALL_PROCESSES : GDB_ALL_THREADS;
+        }
+        buf++;
+    } else {
+        p = 0;
+    }
+    if (qemu_strtoul(buf, &buf, 16, &t)) {
+        return GDB_READ_THREAD_ERR;
+    }
+    *end_buf = buf;
+    if (p == -1) {
+        return GDB_ALL_PROCESSES;
+    }
+    *pid = p;
+    *tid = t;
+    if (t == -1) {
+        return p ? GDB_ALL_THREADS : GDB_ALL_PROCESSES;
+    }
+    return GDB_ONE_THREAD;
+}
+
 /* Resume execution.  */
 static inline void gdb_continue(GDBState *s)
 {
-
+    gdb_regs_cache_reset(s);
 #ifdef CONFIG_USER_ONLY
     s->running_state = 1;
     trace_gdbstub_op_continue();
@@ -416,6 +574,8 @@ static int gdb_continue_partial(GDBState *s, char *newstates)
 {
     CPUState *cpu;
     int res = 0;
+
+    gdb_regs_cache_reset(s);
 #ifdef CONFIG_USER_ONLY
     /*
      * This is not exactly accurate, but it's an improvement compared to the
@@ -611,6 +771,36 @@ static int put_packet(GDBState *s, const char *buf)
     return put_packet_binary(s, buf, strlen(buf), false);
 }
 
+/* Encode data using the encoding for 'x' packets, stopping before
+   the result would exceed @size.  Returns the encoded length, and
+   sets *@len to how much of @mem that holds.  */
+static int memtox_bounded(char *buf, int size, const uint8_t *mem, int *len)
+{
+    char *p = buf;
+    int i;
+
+    for (i = 0; i < *len; i++) {
+        switch (mem[i]) {
+        case '#': case '$': case '*': case '}':
+            if (p + 2 > buf + size) {
+                goto out;
+            }
+            *(p++) = '}';
+            *(p++) = mem[i] ^ 0x20;
+            break;
+        default:
+            if (p + 1 > buf + size) {
+                goto out;
+            }
+            *(p++) = mem[i];
+            break;
+        }
+    }
+out:
+    *len = i;
+    return p - buf;
+}
+
 /* Encode data using the encoding for 'x' packets.  */
 static int memtox(char *buf, const char *mem, int len)
 {
@@ -632,13 +822,104 @@ static int memtox(char *buf, const char *mem, int len)
     return p - buf;
 }
 
+/* Reply to a qXfer read of @data, @p pointing at "offset,length".  */
+static void gdb_xfer_read(GDBState *s, const char *data, size_t total_len,
+                          const char *p)
+{
+    char buf[MAX_PACKET_LENGTH];
+    unsigned long addr, len;
+
+    addr = strtoul(p, (char **)&p, 16);
+    if (*p == ',')
+        p++;
+    len = strtoul(p, (char **)&p, 16);
+
+    if (addr > total_len) {
+        put_packet(s, "E00");
+        return;
+    }
+    if (len > (MAX_PACKET_LENGTH - 5) / 2)
+        len = (MAX_PACKET_LENGTH - 5) / 2;
+    if (len < total_len - addr) {
+        buf[0] = 'm';
+        len = memtox(buf + 1, data + addr, len);
+    } else {
+        buf[0] = 'l';
+        len = memtox(buf + 1, data + addr, total_len - addr);
+    }
+    put_packet_binary(s, buf, len + 1, true);
+}
+
+#ifndef CONFIG_USER_ONLY
+typedef struct GDBMemoryMap {
+    GString *xml;
+    bool pending;
+    hwaddr start;
+    hwaddr last;
+} GDBMemoryMap;
+
+static void gdb_memory_map_flush(GDBMemoryMap *map)
+{
+    uint64_t length = map->last - map->start + 1;
+
+    if (!map->pending) {
+        return;
+    }
+    /* All of it is "ram": gdb will not write to "rom", as load would,
+       while the debug accessors write to ROM like to RAM.  */
+    g_string_append_printf(map->xml, "<memory type=\"ram\" start=\"0x%"
+                           HWADDR_PRIx "\" length=\"0x%" PRIx64 "\"/>",
+                           map->start, length ? length : UINT64_MAX);
+    map->pending = false;
+}
+
+static void gdb_memory_map_add(MemoryRegionSection *section, void *opaque)
+{
+    GDBMemoryMap *map = opaque;
+    hwaddr start = section->offset_within_address_space;
+    hwaddr last = int128_get64(int128_sub(int128_add(int128_make64(start),
+                                                     section->size),
+                                          int128_one()));
+
+    if (map->pending && start == map->last + 1) {
+        map->last = last;
+        return;
+    }
+    gdb_memory_map_flush(map);
+    map->pending = true;
+    map->start = start;
+    map->last = last;
+}
+
+/* The memory map tells gdb where there is something to read, so that it
+   can read large blocks without running into unmapped addresses.  */
+static GString *gdb_memory_map_xml(CPUState *cpu)
+{
+    GDBMemoryMap map = { .xml = g_string_new(NULL) };
+
+    g_string_append(map.xml,
+                    "<?xml version=\"1.0\"?>"
+                    "<!DOCTYPE memory-map PUBLIC "
+                    "\"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" "
+                    "\"http://sourceware.org/gdb/gdb-memory-map.dtd\">"
+                    "<memory-map>");
+    address_space_foreach_section(cpu->as, gdb_memory_map_add, &map);
+    gdb_memory_map_flush(&map);
+    g_string_append(map.xml, "</memory-map>");
+    return map.xml;
+}
+#endif
+
 static const char *get_feature_xml(const char *p, const char **newp,
-                                   CPUClass *cc)
+                                   GDBProcess *process)
 {
     size_t len;
     int i;
     const char *name;
-    static char target_xml[1024];
+    CPUState *cpu = gdb_first_cpu_in_process(process);
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    char *target_xml = process->target_xml;
+    size_t xml_size = sizeof(process->target_xml);
 
     len = 0;
     while (p[len] && p[len] != ':')
@@ -650,28 +931,27 @@ static const char *get_feature_xml(const char *p, const char **newp,
         /* Generate the XML description for this CPU.  */
         if (!target_xml[0]) {
             GDBRegisterState *r;
-            CPUState *cpu = first_cpu;
 
-            pstrcat(target_xml, sizeof(target_xml),
+            pstrcat(target_xml, xml_size,
                     "<?xml version=\"1.0\"?>"
                     "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
                     "<target>");
             if (cc->gdb_arch_name) {
                 gchar *arch = cc->gdb_arch_name(cpu);
-                pstrcat(target_xml, sizeof(target_xml), "<architecture>");
-                pstrcat(target_xml, sizeof(target_xml), arch);
-                pstrcat(target_xml, sizeof(target_xml), "</architecture>");
+                pstrcat(target_xml, xml_size, "<architecture>");
+                pstrcat(target_xml, xml_size, arch);
+                pstrcat(target_xml, xml_size, "</architecture>");
                 g_free(arch);
             }
-            pstrcat(target_xml, sizeof(target_xml), "<xi:include href=\"");
-            pstrcat(target_xml, sizeof(target_xml), cc->gdb_core_xml_file);
-            pstrcat(target_xml, sizeof(target_xml), "\"/>");
+            pstrcat(target_xml, xml_size, "<xi:include href=\"");
+            pstrcat(target_xml, xml_size, cc->gdb_core_xml_file);
+            pstrcat(target_xml, xml_size, "\"/>");
             for (r = cpu->gdb_regs; r; r = r->next) {
-                pstrcat(target_xml, sizeof(target_xml), "<xi:include href=\"");
-                pstrcat(target_xml, sizeof(target_xml), r->xml);
-                pstrcat(target_xml, sizeof(target_xml), "\"/>");
+                pstrcat(target_xml, xml_size, "<xi:include href=\"");
+                pstrcat(target_xml, xml_size, r->xml);
+                pstrcat(target_xml, xml_size, "\"/>");
             }
-            pstrcat(target_xml, sizeof(target_xml), "</target>");
+            pstrcat(target_xml, xml_size, "</target>");
         }
         return target_xml;
     }
@@ -719,6 +999,27 @@ static int gdb_write_register(CPUState *cpu, uint8_t *mem_buf, int reg)
     return 0;
 }
 
+/* Read all the 'g' registers of @cpu at once, for 'g' and 'p' to reply
+   from until the CPU runs or gdb writes a register.  */
+static void gdb_regs_cache_fill(GDBState *s, CPUState *cpu)
+{
+    int reg, len = 0;
+
+    if (s->regs_cache_cpu == cpu) {
+        return;
+    }
+    cpu_synchronize_state(cpu);
+    s->regs_cache_offset = g_renew(int, s->regs_cache_offset,
+                                   cpu->gdb_num_g_regs + 1);
+    for (reg = 0; reg < cpu->gdb_num_g_regs; reg++) {
+        s->regs_cache_offset[reg] = len;
+        len += gdb_read_register(cpu, s->regs_cache + len, reg);
+    }
+    s->regs_cache_offset[reg] = len;
+    s->regs_cache_len = len;
+    s->regs_cache_cpu = cpu;
+}
+
 /* Register a supplemental set of CPU registers.  If g_pos is nonzero it
    specifies the first register number and these registers are included in
    a standard "g" packet.  Direction is relative to gdb, i.e. get_reg is
@@ -780,19 +1081,23 @@ static inline int xlat_gdb_type(CPUState *cpu, int gdbtype)
 }
 #endif
 
-static int gdb_breakpoint_insert(target_ulong addr, target_ulong len, int type)
+static int gdb_breakpoint_insert(GDBState *s, target_ulong addr,
+                                 target_ulong len, int type)
 {
     CPUState *cpu;
     int err = 0;
 
     if (kvm_enabled()) {
-        return kvm_insert_breakpoint(gdbserver_state->c_cpu, addr, len, type);
+        return kvm_insert_breakpoint(s->c_cpu, addr, len, type);
     }
 
     switch (type) {
     case GDB_BREAKPOINT_SW:
     case GDB_BREAKPOINT_HW:
         CPU_FOREACH(cpu) {
+            if (!gdb_cpu_in_g_process(s, cpu)) {
+                continue;
+            }
             err = cpu_breakpoint_insert(cpu, addr, BP_GDB, NULL);
             if (err) {
                 break;
@@ -804,6 +1109,9 @@ static int gdb_breakpoint_insert(target_ulong addr, target_ulong len, int type)
     case GDB_WATCHPOINT_READ:
     case GDB_WATCHPOINT_ACCESS:
         CPU_FOREACH(cpu) {
+            if (!gdb_cpu_in_g_process(s, cpu)) {
+                continue;
+            }
             err = cpu_watchpoint_insert(cpu, addr, len,
                                         xlat_gdb_type(cpu, type), NULL);
             if (err) {
@@ -817,19 +1125,23 @@ static int gdb_breakpoint_insert(target_ulong addr, target_ulong len, int type)
     }
 }
 
-static int gdb_breakpoint_remove(target_ulong addr, target_ulong len, int type)
+static int gdb_breakpoint_remove(GDBState *s, target_ulong addr,
+                                 target_ulong len, int type)
 {
     CPUState *cpu;
     int err = 0;
 
     if (kvm_enabled()) {
-        return kvm_remove_breakpoint(gdbserver_state->c_cpu, addr, len, type);
+        return kvm_remove_breakpoint(s->c_cpu, addr, len, type);
     }
 
     switch (type) {
     case GDB_BREAKPOINT_SW:
     case GDB_BREAKPOINT_HW:
         CPU_FOREACH(cpu) {
+            if (!gdb_cpu_in_g_process(s, cpu)) {
+                continue;
+            }
             err = cpu_breakpoint_remove(cpu, addr, BP_GDB);
             if (err) {
                 break;
@@ -841,6 +1153,9 @@ static int gdb_breakpoint_remove(target_ulong addr, target_ulong len, int type)
     case GDB_WATCHPOINT_READ:
     case GDB_WATCHPOINT_ACCESS:
         CPU_FOREACH(cpu) {
+            if (!gdb_cpu_in_g_process(s, cpu)) {
+                continue;
+            }
             err = cpu_watchpoint_remove(cpu, addr, len,
                                         xlat_gdb_type(cpu, type));
             if (err)
@@ -853,16 +1168,20 @@ static int gdb_breakpoint_remove(target_ulong addr, target_ulong len, int type)
     }
 }
 
-static void gdb_breakpoint_remove_all(void)
+/* Those of @process, or of every process if NULL */
+static void gdb_breakpoint_remove_all(GDBState *s, GDBProcess *process)
 {
     CPUState *cpu;
 
     if (kvm_enabled()) {
-        kvm_remove_all_breakpoints(gdbserver_state->c_cpu);
+        kvm_remove_all_breakpoints(s->c_cpu);
         return;
     }
 
     CPU_FOREACH(cpu) {
+        if (process && gdb_get_cpu_pid(cpu) != process->pid) {
+            continue;
+        }
         cpu_breakpoint_remove_all(cpu, BP_GDB);
 #ifndef CONFIG_USER_ONLY
         cpu_watchpoint_remove_all(cpu, BP_GDB);
@@ -878,19 +1197,6 @@ static void gdb_set_cpu_pc(GDBState *s, target_ulong pc)
     cpu_set_pc(cpu, pc);
 }
 
-static CPUState *find_cpu(uint32_t thread_id)
-{
-    CPUState *cpu;
-
-    CPU_FOREACH(cpu) {
-        if (cpu_gdb_index(cpu) == thread_id) {
-            return cpu;
-        }
-    }
-
-    return NULL;
-}
-
 static int is_query_packet(const char *p, const char *query, char separator)
 {
     unsigned int query_len = strlen(query);
@@ -906,10 +1212,13 @@ static int is_query_packet(const char *p, const char *query, char separator)
  */
 static int gdb_handle_vcont(GDBState *s, const char *p)
 {
-    int res, idx, signal = 0;
+    int res, signal = 0;
     char cur_action;
     char *newstates;
     unsigned long tmp;
+    uint32_t pid, tid;
+    GDBThreadIdKind kind;
+    GDBProcess *process;
     CPUState *cpu;
 #ifdef CONFIG_USER_ONLY
     int max_cpus = 1; /* global variable max_cpus exists only in system mode */
@@ -922,7 +1231,8 @@ static int gdb_handle_vcont(GDBState *s, const char *p)
     newstates = g_new0(char, max_cpus);
 
     /* mark valid CPUs with 1 */
-    CPU_FOREACH(cpu) {
+    for (cpu = gdb_attached_cpu_from(s, first_cpu); cpu;
+         cpu = gdb_attached_cpu_from(s, CPU_NEXT(cpu))) {
         newstates[cpu->cpu_index] = 1;
     }
 
@@ -953,24 +1263,39 @@ static int gdb_handle_vcont(GDBState *s, const char *p)
             goto out;
         }
         /* thread specification. special values: (none), -1 = all; 0 = any */
-        if ((p[0] == ':' && p[1] == '-' && p[2] == '1') || (p[0] != ':')) {
-            if (*p == ':') {
-                p += 3;
-            }
-            for (idx = 0; idx < max_cpus; idx++) {
-                if (newstates[idx] == 1) {
-                    newstates[idx] = cur_action;
+        if (*p != ':') {
+            kind = GDB_ALL_PROCESSES;
+        } else {
+            kind = read_thread_id(p + 1, &p, &pid, &tid);
+        }
+
+        switch (kind) {
+        case GDB_READ_THREAD_ERR:
+            res = -EINVAL;
+            goto out;
+        case GDB_ALL_PROCESSES:
+            CPU_FOREACH(cpu) {
+                if (newstates[cpu->cpu_index] == 1) {
+                    newstates[cpu->cpu_index] = cur_action;
                 }
             }
-        } else if (*p == ':') {
-            p++;
-            res = qemu_strtoul(p, &p, 16, &tmp);
-            if (res) {
+            break;
+        case GDB_ALL_THREADS:
+            process = gdb_get_process(s, pid);
+            if (!process || !process->attached) {
+                res = -EINVAL;
                 goto out;
             }
-
+            CPU_FOREACH(cpu) {
+                if (gdb_get_cpu_pid(cpu) == pid &&
+                    newstates[cpu->cpu_index] == 1) {
+                    newstates[cpu->cpu_index] = cur_action;
+                }
+            }
+            break;
+        case GDB_ONE_THREAD:
             /* 0 means any thread, so we pick the first valid CPU */
-            cpu = tmp ? find_cpu(tmp) : first_cpu;
+            cpu = gdb_get_cpu(s, pid, tid);
 
             /* invalid CPU/thread specified */
             if (!cpu) {
@@ -982,8 +1307,17 @@ static int gdb_handle_vcont(GDBState *s, const char *p)
             if (newstates[cpu->cpu_index] == 1) {
                 newstates[cpu->cpu_index] = cur_action;
             }
+            break;
         }
     }
+#ifndef CONFIG_USER_ONLY
+    /* The boards gdb is not attached to keep running */
+    CPU_FOREACH(cpu) {
+        if (!gdb_get_cpu_process(s, cpu)->attached) {
+            newstates[cpu->cpu_index] = 'c';
+        }
+    }
+#endif
     s->signal = signal;
     gdb_continue_partial(s, newstates);
 
@@ -997,9 +1331,13 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
 {
     CPUState *cpu;
     CPUClass *cc;
+    GDBProcess *process;
+    GDBThreadIdKind kind;
     const char *p;
-    uint32_t thread;
-    int ch, reg_size, type, res;
+    uint32_t pid, tid;
+    unsigned long lpid;
+    char thread_id[16];
+    int ch, reg_size, type, res, i;
     uint8_t mem_buf[MAX_PACKET_LENGTH];
     char buf[sizeof(mem_buf) + 1 /* trailing NUL */];
     uint8_t *registers;
@@ -1012,14 +1350,14 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
     switch(ch) {
     case '?':
         /* TODO: Make this return the correct value for user-mode.  */
-        snprintf(buf, sizeof(buf), "T%02xthread:%02x;", GDB_SIGNAL_TRAP,
-                 cpu_gdb_index(s->c_cpu));
+        snprintf(buf, sizeof(buf), "T%02xthread:%s;", GDB_SIGNAL_TRAP,
+                 gdb_fmt_thread_id(s, s->c_cpu, thread_id, sizeof(thread_id)));
         put_packet(s, buf);
         /* Remove all the breakpoints when this query is issued,
          * because gdb is doing and initial connect and the state
          * should be cleaned up.
          */
-        gdb_breakpoint_remove_all();
+        gdb_breakpoint_remove_all(s, NULL);
         break;
     case 'c':
         if (*p != '\0') {
@@ -1053,6 +1391,30 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
                 goto unknown_command;
             }
             break;
+        } else if (strncmp(p, "Attach;", 7) == 0) {
+            /* Another board, as a new inferior */
+            if (qemu_strtoul(p + 7, &p, 16, &lpid) || !lpid) {
+                put_packet(s, "E22");
+                break;
+            }
+            process = gdb_get_process(s, lpid);
+            cpu = process ? gdb_first_cpu_in_process(process) : NULL;
+            if (!cpu) {
+                put_packet(s, "E22");
+                break;
+            }
+            process->attached = true;
+            s->g_cpu = cpu;
+            s->c_cpu = cpu;
+            snprintf(buf, sizeof(buf), "T%02xthread:%s;", GDB_SIGNAL_TRAP,
+                     gdb_fmt_thread_id(s, cpu, thread_id, sizeof(thread_id)));
+            put_packet(s, buf);
+            break;
+        } else if (strncmp(p, "Kill;", 5) == 0) {
+            /* Boards cannot go away on their own: as 'k' */
+            put_packet(s, "OK");
+            error_report("QEMU: Terminated via GDBstub");
+            exit(0);
         } else {
             goto unknown_command;
         }
@@ -1061,10 +1423,34 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         error_report("QEMU: Terminated via GDBstub");
         exit(0);
     case 'D':
-        /* Detach packet */
-        gdb_breakpoint_remove_all();
-        gdb_syscall_mode = GDB_SYS_DISABLED;
-        gdb_continue(s);
+        /* Detach packet, "D;pid" for one process with multiprocess */
+        if (!s->multiprocess) {
+            gdb_breakpoint_remove_all(s, NULL);
+        } else {
+            if (*p != ';' || qemu_strtoul(p + 1, &p, 16, &lpid) || !lpid) {
+                put_packet(s, "E22");
+                break;
+            }
+            process = gdb_get_process(s, lpid);
+            if (!process) {
+                put_packet(s, "E22");
+                break;
+            }
+            gdb_breakpoint_remove_all(s, process);
+            process->attached = false;
+            cpu = gdb_attached_cpu_from(s, first_cpu);
+            if (gdb_get_cpu_pid(s->c_cpu) == process->pid) {
+                s->c_cpu = cpu ? cpu : first_cpu;
+            }
+            if (gdb_get_cpu_pid(s->g_cpu) == process->pid) {
+                s->g_cpu = cpu ? cpu : first_cpu;
+            }
+        }
+        if (!s->multiprocess || !gdb_attached_cpu_from(s, first_cpu)) {
+            /* No process left attached */
+            gdb_syscall_mode = GDB_SYS_DISABLED;
+            gdb_continue(s);
+        }
         put_packet(s, "OK");
         break;
     case 's':
@@ -1075,6 +1461,30 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         cpu_single_step(s->c_cpu, sstep_flags);
         gdb_continue(s);
         return RS_IDLE;
+#ifndef CONFIG_USER_ONLY
+    case 'b':
+        /* Reverse execution, when replaying with snapshots */
+        if (replay_mode != REPLAY_MODE_PLAY) {
+            goto unknown_command;
+        }
+        if (*p == 's') {
+            res = replay_reverse_step();
+        } else if (*p == 'c') {
+            res = replay_reverse_continue();
+        } else {
+            goto unknown_command;
+        }
+        if (!res) {
+            /* Nothing recorded to go back to */
+            snprintf(buf, sizeof(buf), "T%02xthread:%s;replaylog:begin;",
+                     GDB_SIGNAL_TRAP, gdb_fmt_thread_id(s, s->c_cpu, thread_id,
+                                                        sizeof(thread_id)));
+            put_packet(s, buf);
+            break;
+        }
+        /* The stop is reported once the replay gets there */
+        return RS_IDLE;
+#endif
     case 'F':
         {
             target_ulong ret;
@@ -1102,16 +1512,12 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         }
         break;
     case 'g':
-        cpu_synchronize_state(s->g_cpu);
-        len = 0;
-        for (addr = 0; addr < s->g_cpu->gdb_num_g_regs; addr++) {
-            reg_size = gdb_read_register(s->g_cpu, mem_buf + len, addr);
-            len += reg_size;
-        }
-        memtohex(buf, mem_buf, len);
+        gdb_regs_cache_fill(s, s->g_cpu);
+        memtohex(buf, s->regs_cache, s->regs_cache_len);
         put_packet(s, buf);
         break;
     case 'G':
+        gdb_regs_cache_reset(s);
         cpu_synchronize_state(s->g_cpu);
         registers = mem_buf;
         len = strlen(p) / 2;
@@ -1142,6 +1548,27 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             put_packet(s, buf);
         }
         break;
+    case 'x':
+        /* As 'm', but in binary rather than twice the size in hex */
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, NULL, 16);
+        if (len > MAX_PACKET_LENGTH - 1) {
+            len = MAX_PACKET_LENGTH - 1;
+        }
+
+        if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, false) != 0) {
+            put_packet(s, "E14");
+        } else {
+            /* What escaping leaves no room for, gdb asks for again */
+            reg_size = len;
+            buf[0] = 'b';
+            res = memtox_bounded(buf + 1, MAX_PACKET_LENGTH - 1, mem_buf,
+                                 &reg_size);
+            put_packet_binary(s, buf, res + 1, true);
+        }
+        break;
     case 'M':
         addr = strtoull(p, (char **)&p, 16);
         if (*p == ',')
@@ -1170,7 +1597,15 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         if (!gdb_has_xml)
             goto unknown_command;
         addr = strtoull(p, (char **)&p, 16);
-        reg_size = gdb_read_register(s->g_cpu, mem_buf, addr);
+        if (addr < s->g_cpu->gdb_num_g_regs) {
+            gdb_regs_cache_fill(s, s->g_cpu);
+            reg_size = s->regs_cache_offset[addr + 1] -
+                       s->regs_cache_offset[addr];
+            memcpy(mem_buf, s->regs_cache + s->regs_cache_offset[addr],
+                   reg_size);
+        } else {
+            reg_size = gdb_read_register(s->g_cpu, mem_buf, addr);
+        }
         if (reg_size) {
             memtohex(buf, mem_buf, reg_size);
             put_packet(s, buf);
@@ -1186,6 +1621,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             p++;
         reg_size = strlen(p) / 2;
         hextomem(mem_buf, p, reg_size);
+        gdb_regs_cache_reset(s);
         gdb_write_register(s->g_cpu, mem_buf, addr);
         put_packet(s, "OK");
         break;
@@ -1199,9 +1635,9 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             p++;
         len = strtoull(p, (char **)&p, 16);
         if (ch == 'Z')
-            res = gdb_breakpoint_insert(addr, len, type);
+            res = gdb_breakpoint_insert(s, addr, len, type);
         else
-            res = gdb_breakpoint_remove(addr, len, type);
+            res = gdb_breakpoint_remove(s, addr, len, type);
         if (res >= 0)
              put_packet(s, "OK");
         else if (res == -ENOSYS)
@@ -1211,12 +1647,16 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         break;
     case 'H':
         type = *p++;
-        thread = strtoull(p, (char **)&p, 16);
-        if (thread == -1 || thread == 0) {
+        kind = read_thread_id(p, &p, &pid, &tid);
+        if (kind == GDB_READ_THREAD_ERR) {
+            put_packet(s, "E22");
+            break;
+        }
+        if (kind != GDB_ONE_THREAD || (!pid && !tid)) {
             put_packet(s, "OK");
             break;
         }
-        cpu = find_cpu(thread);
+        cpu = gdb_get_cpu(s, pid, tid);
         if (cpu == NULL) {
             put_packet(s, "E22");
             break;
@@ -1236,8 +1676,8 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         }
         break;
     case 'T':
-        thread = strtoull(p, (char **)&p, 16);
-        cpu = find_cpu(thread);
+        kind = read_thread_id(p, &p, &pid, &tid);
+        cpu = kind == GDB_ONE_THREAD ? gdb_get_cpu(s, pid, tid) : NULL;
 
         if (cpu != NULL) {
             put_packet(s, "OK");
@@ -1272,24 +1712,31 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             break;
         } else if (strcmp(p,"C") == 0) {
             /* "Current thread" remains vague in the spec, so always return
-             *  the first CPU (gdb returns the first thread). */
-            put_packet(s, "QC1");
+             *  the first CPU (gdb returns the first thread) of the current
+             *  process. */
+            cpu = gdb_first_cpu_in_process(gdb_get_cpu_process(s, s->g_cpu));
+            snprintf(buf, sizeof(buf), "QC%s",
+                     gdb_fmt_thread_id(s, cpu, thread_id, sizeof(thread_id)));
+            put_packet(s, buf);
             break;
         } else if (strcmp(p,"fThreadInfo") == 0) {
-            s->query_cpu = first_cpu;
+            s->query_cpu = gdb_attached_cpu_from(s, first_cpu);
             goto report_cpuinfo;
         } else if (strcmp(p,"sThreadInfo") == 0) {
         report_cpuinfo:
             if (s->query_cpu) {
-                snprintf(buf, sizeof(buf), "m%x", cpu_gdb_index(s->query_cpu));
+                snprintf(buf, sizeof(buf), "m%s",
+                         gdb_fmt_thread_id(s, s->query_cpu, thread_id,
+                                           sizeof(thread_id)));
                 put_packet(s, buf);
-                s->query_cpu = CPU_NEXT(s->query_cpu);
+                s->query_cpu = gdb_attached_cpu_from(s,
+                                                     CPU_NEXT(s->query_cpu));
             } else
                 put_packet(s, "l");
             break;
         } else if (strncmp(p,"ThreadExtraInfo,", 16) == 0) {
-            thread = strtoull(p+16, (char **)&p, 16);
-            cpu = find_cpu(thread);
+            kind = read_thread_id(p + 16, &p, &pid, &tid);
+            cpu = kind == GDB_ONE_THREAD ? gdb_get_cpu(s, pid, tid) : NULL;
             if (cpu != NULL) {
                 cpu_synchronize_state(cpu);
                 /* memtohex() doubles the required space */
@@ -1332,26 +1779,45 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         }
 #endif /* !CONFIG_USER_ONLY */
         if (is_query_packet(p, "Supported", ':')) {
+            /* gdb (re)connects: with multiprocess it attaches to the
+             * first board, and to the others with vAttach; without,
+             * every board's CPUs are threads of one process.
+             */
+            s->multiprocess = strstr(p, "multiprocess+") != NULL;
+            for (i = 0; i < s->process_num; i++) {
+                s->processes[i].attached = !s->multiprocess || !i;
+            }
+            s->c_cpu = first_cpu;
+            s->g_cpu = first_cpu;
             snprintf(buf, sizeof(buf), "PacketSize=%x", MAX_PACKET_LENGTH);
             cc = CPU_GET_CLASS(first_cpu);
             if (cc->gdb_core_xml_file != NULL) {
                 pstrcat(buf, sizeof(buf), ";qXfer:features:read+");
             }
+            pstrcat(buf, sizeof(buf), ";binary-upload+");
+            if (s->multiprocess) {
+                pstrcat(buf, sizeof(buf), ";multiprocess+");
+            }
+#ifndef CONFIG_USER_ONLY
+            pstrcat(buf, sizeof(buf), ";qXfer:memory-map:read+");
+            if (replay_mode == REPLAY_MODE_PLAY) {
+                pstrcat(buf, sizeof(buf), ";ReverseStep+;ReverseContinue+");
+            }
+#endif
             put_packet(s, buf);
             break;
         }
         if (strncmp(p, "Xfer:features:read:", 19) == 0) {
             const char *xml;
-            target_ulong total_len;
 
-            cc = CPU_GET_CLASS(first_cpu);
+            cc = CPU_GET_CLASS(s->g_cpu);
             if (cc->gdb_core_xml_file == NULL) {
                 goto unknown_command;
             }
 
             gdb_has_xml = true;
             p += 19;
-            xml = get_feature_xml(p, &p, cc);
+            xml = get_feature_xml(p, &p, gdb_get_cpu_process(s, s->g_cpu));
             if (!xml) {
                 snprintf(buf, sizeof(buf), "E00");
                 put_packet(s, buf);
@@ -1360,29 +1826,18 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
 
             if (*p == ':')
                 p++;
-            addr = strtoul(p, (char **)&p, 16);
-            if (*p == ',')
-                p++;
-            len = strtoul(p, (char **)&p, 16);
+            gdb_xfer_read(s, xml, strlen(xml), p);
+            break;
+        }
+#ifndef CONFIG_USER_ONLY
+        if (strncmp(p, "Xfer:memory-map:read::", 22) == 0) {
+            GString *xml = gdb_memory_map_xml(s->g_cpu);
 
-            total_len = strlen(xml);
-            if (addr > total_len) {
-                snprintf(buf, sizeof(buf), "E00");
-                put_packet(s, buf);
-                break;
-            }
-            if (len > (MAX_PACKET_LENGTH - 5) / 2)
-                len = (MAX_PACKET_LENGTH - 5) / 2;
-            if (len < total_len - addr) {
-                buf[0] = 'm';
-                len = memtox(buf + 1, xml + addr, len);
-            } else {
-                buf[0] = 'l';
-                len = memtox(buf + 1, xml + addr, total_len - addr);
-            }
-            put_packet_binary(s, buf, len + 1, true);
+            gdb_xfer_read(s, xml->str, xml->len, p + 22);
+            g_string_free(xml, true);
             break;
         }
+#endif
         if (is_query_packet(p, "Attached", ':')) {
             put_packet(s, GDB_ATTACHED);
             break;
@@ -1412,9 +1867,11 @@ static void gdb_vm_state_change(void *opaque, int running, RunState state)
     GDBState *s = gdbserver_state;
     CPUState *cpu = s->c_cpu;
     char buf[256];
+    char thread_id[16];
     const char *type;
     int ret;
 
+    gdb_regs_cache_reset(s);
     if (running || s->state == RS_INACTIVE) {
         return;
     }
@@ -1440,15 +1897,18 @@ static void gdb_vm_state_change(void *opaque, int running, RunState state)
             trace_gdbstub_hit_watchpoint(type, cpu_gdb_index(cpu),
                     (target_ulong)cpu->watchpoint_hit->vaddr);
             snprintf(buf, sizeof(buf),
-                     "T%02xthread:%02x;%swatch:" TARGET_FMT_lx ";",
-                     GDB_SIGNAL_TRAP, cpu_gdb_index(cpu), type,
-                     (target_ulong)cpu->watchpoint_hit->vaddr);
+                     "T%02xthread:%s;%swatch:" TARGET_FMT_lx ";",
+                     GDB_SIGNAL_TRAP,
+                     gdb_fmt_thread_id(s, cpu, thread_id, sizeof(thread_id)),
+                     type, (target_ulong)cpu->watchpoint_hit->vaddr);
             cpu->watchpoint_hit = NULL;
             goto send_packet;
         } else {
             trace_gdbstub_hit_break();
         }
-        tb_flush(cpu);
+        /* No tb_flush(): inserting and removing a breakpoint invalidates
+         * the TBs at its address, so the other boards keep their code.
+         */
         ret = GDB_SIGNAL_TRAP;
         break;
     case RUN_STATE_PAUSED:
@@ -1483,7 +1943,8 @@ static void gdb_vm_state_change(void *opaque, int running, RunState state)
         break;
     }
     gdb_set_stop_cpu(cpu);
-    snprintf(buf, sizeof(buf), "T%02xthread:%02x;", ret, cpu_gdb_index(cpu));
+    snprintf(buf, sizeof(buf), "T%02xthread:%s;", ret,
+             gdb_fmt_thread_id(s, cpu, thread_id, sizeof(thread_id)));
 
 send_packet:
     put_packet(s, buf);
@@ -1714,7 +2175,7 @@ static void gdb_read_byte(GDBState *s, int ch)
 void gdb_exit(CPUArchState *env, int code)
 {
   GDBState *s;
-  char buf[4];
+  char buf[32];
 
   s = gdbserver_state;
   if (!s) {
@@ -1728,7 +2189,12 @@ void gdb_exit(CPUArchState *env, int code)
 
   trace_gdbstub_op_exiting((uint8_t)code);
 
-  snprintf(buf, sizeof(buf), "W%02x", (uint8_t)code);
+  if (s->multiprocess) {
+      snprintf(buf, sizeof(buf), "W%02x;process:%x", (uint8_t)code,
+               gdb_get_cpu_pid(ENV_GET_CPU(env)));
+  } else {
+      snprintf(buf, sizeof(buf), "W%02x", (uint8_t)code);
+  }
   put_packet(s, buf);
 
 #ifndef CONFIG_USER_ONLY
@@ -1832,6 +2298,7 @@ static void gdb_accept(void)
     s->c_cpu = first_cpu;
     s->g_cpu = first_cpu;
     s->fd = fd;
+    gdb_create_processes(s);
     gdb_has_xml = false;
 
     gdbserver_state = s;
@@ -2036,11 +2503,13 @@ int gdbserver_start(const char *device)
     } else {
         qemu_chr_fe_deinit(&s->chr, true);
         mon_chr = s->mon_chr;
+        g_free(s->processes);
         memset(s, 0, sizeof(GDBState));
         s->mon_chr = mon_chr;
     }
     s->c_cpu = first_cpu;
     s->g_cpu = first_cpu;
+    gdb_create_processes(s);
     if (chr) {
         qemu_chr_fe_init(&s->chr, chr, &error_abort);
         qemu_chr_fe_set_handlers(&s->chr, gdb_chr_can_receive, gdb_chr_receive,
@@ -293,6 +293,27 @@ STEXI
 @item info opcount
 @findex info opcount
 Show dynamic compiler opcode counters
+ETEXI
+
+#if defined(CONFIG_TCG)
+    {
+        .name       = "tcg-quality",
+        .args_type  = "max:i?",
+        .params     = "[max]",
+        .help       = "show translation statistics and the TBs with the "
+                      "most host code per guest instruction",
+        .cmd        = hmp_info_tcg_quality,
+    },
+#endif
+
+STEXI
+@item info tcg-quality [@var{max}]
+@findex info tcg-quality
+Show the TCG ops per guest instruction before and after optimization,
+the host code bytes per guest instruction, register spills and
+translation time, summed over every translation so far.  Then list the
+@var{max} (default 20) translation blocks still in the code buffer that
+produced the most host code per guest instruction.
 ETEXI
 
     {
@@ -881,6 +902,70 @@ STEXI
 @item info sev
 @findex info sev
 Show SEV information.
+ETEXI
+
+    {
+        .name       = "mmio-stats",
+        .args_type  = "reset:-r",
+        .params     = "[-r]",
+        .help       = "show per-register MMIO access counts "
+                      "(-r: clear them afterwards)",
+        .cmd        = hmp_info_mmio_stats,
+    },
+
+STEXI
+@item info mmio-stats [-r]
+@findex info mmio-stats
+Show how often each register of the counted MMIO regions was read and
+written, per vCPU.  With @option{-r}, clear the counts afterwards.
+ETEXI
+
+    {
+        .name       = "log-ratelimit",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show how often rate-limited log messages were hit",
+        .cmd        = hmp_info_log_ratelimit,
+    },
+
+STEXI
+@item info log-ratelimit
+@findex info log-ratelimit
+Show, for each rate-limited log message, the source line it comes from,
+what it was about (e.g. a register offset) and how many times it was hit.
+Only the first hit is written to the log.
+ETEXI
+
+    {
+        .name       = "startup-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show how long each phase of startup took",
+        .cmd        = hmp_info_startup_profile,
+    },
+
+STEXI
+@item info startup-profile
+@findex info startup-profile
+Show the phases of startup, from exec up to the first guest instruction,
+with the time each one ended at and how long it took.
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "max:i?",
+        .params     = "[max]",
+        .help       = "show the most executed translation blocks",
+        .cmd        = hmp_info_tb_profile,
+    },
+
+STEXI
+@item info tb-profile [@var{max}]
+@findex info tb-profile
+Show the @var{max} (default 20) most executed translation blocks with
+their guest address, size and execution count, and the guest symbol
+they belong to when the image was loaded from an ELF file.  Requires
+@option{-tb-profile}.
 ETEXI
 
 STEXI
@@ -21,6 +21,8 @@
 #include "sysemu/block-backend.h"
 #include "sysemu/sysemu.h"
 #include "qemu/config-file.h"
+#include "qemu/log.h"
+#include "qemu/startup-profile.h"
 #include "qemu/option.h"
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
@@ -370,6 +372,14 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
+        assert(params->has_x_dedup_store);
+        monitor_printf(mon, "%s: '%s'\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_DEDUP_STORE),
+            params->x_dedup_store);
+        assert(params->has_x_stop_copy_limit);
+        monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_STOP_COPY_LIMIT),
+            params->x_stop_copy_limit);
     }
 
     qapi_free_MigrationParameters(params);
@@ -1657,6 +1667,14 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         }
         p->xbzrle_cache_size = cache_size;
         break;
+    case MIGRATION_PARAMETER_X_DEDUP_STORE:
+        p->has_x_dedup_store = true;
+        visit_type_str(v, param, &p->x_dedup_store, &err);
+        break;
+    case MIGRATION_PARAMETER_X_STOP_COPY_LIMIT:
+        p->has_x_stop_copy_limit = true;
+        visit_type_size(v, param, &p->x_stop_copy_limit, &err);
+        break;
     default:
         assert(0);
     }
@@ -2488,6 +2506,80 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     qapi_free_IOThreadInfoList(info_list);
 }
 
+void hmp_info_mmio_stats(Monitor *mon, const QDict *qdict)
+{
+    bool reset = qdict_get_try_bool(qdict, "reset", false);
+    MmioStatsEntryList *info_list = qmp_query_mmio_stats(true, reset, NULL);
+    MmioStatsEntryList *info;
+    MmioStatsEntry *value;
+
+    for (info = info_list; info; info = info->next) {
+        value = info->value;
+        monitor_printf(mon, "%-24s +0x%03" PRIx64 " (0x%08" PRIx64 ") "
+                       "cpu %" PRId64 ": %" PRIu64 " reads, " "%" PRIu64
+                       " writes\n", value->region, value->offset,
+                       value->address, value->cpu, value->reads,
+                       value->writes);
+    }
+
+    qapi_free_MmioStatsEntryList(info_list);
+}
+
+static void hmp_print_log_ratelimit(const char *site, uint64_t id,
+                                    uint64_t count, void *opaque)
+{
+    Monitor *mon = opaque;
+
+    monitor_printf(mon, "%-32s 0x%-8" PRIx64 " %" PRIu64 "\n",
+                   site, id, count);
+}
+
+void hmp_info_log_ratelimit(Monitor *mon, const QDict *qdict)
+{
+    qemu_log_ratelimit_foreach(hmp_print_log_ratelimit, mon);
+}
+
+static void hmp_print_startup_phase(const char *phase, int64_t end_ns,
+                                    int64_t len_ns, void *opaque)
+{
+    Monitor *mon = opaque;
+
+    monitor_printf(mon, "%10.3f ms %+10.3f ms  %s\n",
+                   end_ns / (double)SCALE_MS, len_ns / (double)SCALE_MS,
+                   phase);
+}
+
+void hmp_info_startup_profile(Monitor *mon, const QDict *qdict)
+{
+    monitor_printf(mon, "%13s %13s  %s\n", "end", "length", "phase");
+    startup_profile_foreach(hmp_print_startup_phase, mon);
+}
+
+void hmp_info_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    bool has_max = qdict_haskey(qdict, "max");
+    int64_t max = qdict_get_try_int(qdict, "max", 0);
+    Error *err = NULL;
+    TbProfileEntryList *info_list = qmp_query_tb_profile(has_max, max, &err);
+    TbProfileEntryList *info;
+    TbProfileEntry *value;
+
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    for (info = info_list; info; info = info->next) {
+        value = info->value;
+        monitor_printf(mon, "0x%08" PRIx64 " %4" PRId64 " bytes %3" PRId64
+                       " insns: %12" PRIu64 "  %s\n", value->pc, value->size,
+                       value->insns, value->count,
+                       value->has_symbol ? value->symbol : "");
+    }
+
+    qapi_free_TbProfileEntryList(info_list);
+}
+
 void hmp_qom_list(Monitor *mon, const QDict *qdict)
 {
     const char *path = qdict_get_try_str(qdict, "path");
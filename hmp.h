@@ -144,5 +144,9 @@ void hmp_hotpluggable_cpus(Monitor *mon, const QDict *qdict);
 void hmp_info_vm_generation_id(Monitor *mon, const QDict *qdict);
 void hmp_info_memory_size_summary(Monitor *mon, const QDict *qdict);
 void hmp_info_sev(Monitor *mon, const QDict *qdict);
+void hmp_info_mmio_stats(Monitor *mon, const QDict *qdict);
+void hmp_info_log_ratelimit(Monitor *mon, const QDict *qdict);
+void hmp_info_startup_profile(Monitor *mon, const QDict *qdict);
+void hmp_info_tb_profile(Monitor *mon, const QDict *qdict);
 
 #endif
@@ -19,6 +19,8 @@
 #include "sysemu/qtest.h"
 #include "qemu/error-report.h"
 #include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "qemu/atomic.h"
 #include "target/arm/idau.h"
 
 /* Bitbanded IO.  Each word corresponds to a single bit.  */
@@ -29,17 +31,60 @@ static inline hwaddr bitband_addr(BitBandState *s, hwaddr offset)
     return s->base | (offset & 0x1ffffff) >> 5;
 }
 
+static void bitband_commit(MemoryListener *listener)
+{
+    BitBandState *s = container_of(listener, BitBandState, listener);
+
+    s->host = NULL;
+}
+
+/* The byte of the bit at @offset if it is RAM, else NULL.  Bitbanding
+ * is mostly used on SRAM, where a bit operation on the host byte needs
+ * neither the read nor the write dispatch of the generic path.
+ */
+static uint8_t *bitband_host_byte(BitBandState *s, hwaddr offset)
+{
+    hwaddr addr = bitband_addr(s, offset) - s->base;
+    MemoryRegion *mr;
+    hwaddr xlat, len = 0x100000;
+
+    if (!s->host) {
+        rcu_read_lock();
+        mr = address_space_translate(&s->source_as, s->base, &xlat, &len,
+                                     true);
+        if (memory_region_is_ram(mr) && !mr->readonly &&
+            !memory_region_is_ram_device(mr)) {
+            s->host = memory_region_get_ram_ptr(mr) + xlat;
+            s->host_len = len;
+            s->host_mr = mr;
+            s->host_ram_addr = memory_region_get_ram_addr(mr) + xlat;
+        }
+        rcu_read_unlock();
+        if (!s->host) {
+            return NULL;
+        }
+    }
+    return addr < s->host_len ? s->host + addr : NULL;
+}
+
 static MemTxResult bitband_read(void *opaque, hwaddr offset,
                                 uint64_t *data, unsigned size, MemTxAttrs attrs)
 {
     BitBandState *s = opaque;
     uint8_t buf[4];
+    uint8_t *host;
     MemTxResult res;
     int bitpos, bit;
     hwaddr addr;
 
     assert(size <= 4);
 
+    host = bitband_host_byte(s, offset);
+    if (host) {
+        *data = (atomic_read(host) >> ((offset >> 2) & 7)) & 1;
+        return MEMTX_OK;
+    }
+
     /* Find address in underlying memory and round down to multiple of size */
     addr = bitband_addr(s, offset) & (-size);
     res = address_space_read(&s->source_as, addr, attrs, buf, size);
@@ -59,12 +104,29 @@ static MemTxResult bitband_write(void *opaque, hwaddr offset, uint64_t value,
 {
     BitBandState *s = opaque;
     uint8_t buf[4];
+    uint8_t *host;
     MemTxResult res;
     int bitpos, bit;
     hwaddr addr;
 
     assert(size <= 4);
 
+    /* Unless the byte still has to be marked dirty, or translations of
+     * it dropped: address_space_write() does that.
+     */
+    host = bitband_host_byte(s, offset);
+    if (host && !cpu_physical_memory_range_includes_clean(
+            s->host_ram_addr + (host - s->host), 1,
+            memory_region_get_dirty_log_mask(s->host_mr))) {
+        bit = 1 << ((offset >> 2) & 7);
+        if (value & 1) {
+            atomic_or(host, bit);
+        } else {
+            atomic_and(host, ~bit);
+        }
+        return MEMTX_OK;
+    }
+
     /* Find address in underlying memory and round down to multiple of size */
     addr = bitband_addr(s, offset) & (-size);
     res = address_space_read(&s->source_as, addr, attrs, buf, size);
@@ -113,6 +175,8 @@ static void bitband_realize(DeviceState *dev, Error **errp)
     }
 
     address_space_init(&s->source_as, s->source_memory, "bitband-source");
+    s->listener.commit = bitband_commit;
+    memory_listener_register(&s->listener, &s->source_as);
 }
 
 /* Board init.  */
@@ -143,6 +207,9 @@ static void armv7m_instance_init(Object *obj)
         object_initialize(&s->bitband[i], sizeof(s->bitband[i]), TYPE_BITBAND);
         qdev_set_parent_bus(DEVICE(&s->bitband[i]), sysbus_get_default());
     }
+
+    object_initialize(&s->itm, sizeof(s->itm), TYPE_ARMV7M_ITM);
+    qdev_set_parent_bus(DEVICE(&s->itm), sysbus_get_default());
 }
 
 static void armv7m_realize(DeviceState *dev, Error **errp)
@@ -206,8 +273,22 @@ static void armv7m_realize(DeviceState *dev, Error **errp)
 
     memory_region_add_subregion(&s->container, 0xe000e000,
                                 sysbus_mmio_get_region(sbd, 0));
+    memory_region_add_subregion(&s->container, 0xe0001000,
+                                sysbus_mmio_get_region(sbd, 1));
 
-    for (i = 0; i < ARRAY_SIZE(s->bitband); i++) {
+    /* The ITM's chardev is set with -global armv7m_itm.chardev=<id> */
+    if (arm_feature(&s->cpu->env, ARM_FEATURE_V7)) {
+        object_property_set_bool(OBJECT(&s->itm), true, "realized", &err);
+        if (err != NULL) {
+            error_propagate(errp, err);
+            return;
+        }
+        sbd = SYS_BUS_DEVICE(&s->itm);
+        memory_region_add_subregion(&s->container, 0xe0000000,
+                                    sysbus_mmio_get_region(sbd, 0));
+    }
+
+    for (i = 0; s->enable_bitband && i < ARRAY_SIZE(s->bitband); i++) {
         Object *obj = OBJECT(&s->bitband[i]);
         SysBusDevice *sbd = SYS_BUS_DEVICE(&s->bitband[i]);
 
@@ -235,6 +316,7 @@ static Property armv7m_properties[] = {
                      MemoryRegion *),
     DEFINE_PROP_LINK("idau", ARMv7MState, idau, TYPE_IDAU_INTERFACE, Object *),
     DEFINE_PROP_UINT32("init-svtor", ARMv7MState, init_svtor, 0),
+    DEFINE_PROP_BOOL("enable-bitband", ARMv7MState, enable_bitband, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
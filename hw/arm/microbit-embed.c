@@ -0,0 +1,282 @@
+/*
+ * In-process control of a micro:bit machine
+ *
+ * The functions of hw/arm/microbit-embed.h, for a host program linked
+ * with libqemu-arm.so.  Each one does in a direct call what a harness
+ * would otherwise ask for over QMP or qtest: running the guest is a
+ * vm_start() and turns of the main loop until a QEMU_CLOCK_VIRTUAL
+ * timer, armed for the budget, asks for the VM to stop.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "hw/arm/microbit-embed.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "exec/memory.h"
+#include "exec/address-spaces.h"
+#include "sysemu/sysemu.h"
+#include "chardev/char.h"
+#include "migration/snapshot.h"
+
+#define TYPE_CHARDEV_MICROBIT_EMBED "chardev-microbit-embed"
+#define MICROBIT_EMBED_UART "microbit-embed-uart"
+
+struct MicrobitEmbedSnapshot {
+    MemSnapshot *ms;
+};
+
+static struct {
+    bool initialized;
+    bool budget_done;
+    QEMUTimer *budget;
+    Chardev *uart;
+    MicrobitEmbedUARTFn *uart_fn;
+    void *uart_opaque;
+    char *error;
+} microbit_embed;
+
+static void microbit_embed_set_error(Error *err)
+{
+    g_free(microbit_embed.error);
+    microbit_embed.error = g_strdup(error_get_pretty(err));
+    error_free(err);
+}
+
+const char *microbit_embed_error(void)
+{
+    return microbit_embed.error;
+}
+
+/* The UART's backend, handing guest output to the host program */
+static int microbit_embed_chr_write(Chardev *chr, const uint8_t *buf, int len)
+{
+    if (microbit_embed.uart_fn) {
+        microbit_embed.uart_fn(buf, len, microbit_embed.uart_opaque);
+    }
+    return len;
+}
+
+static void char_microbit_embed_class_init(ObjectClass *oc, void *data)
+{
+    ChardevClass *cc = CHARDEV_CLASS(oc);
+
+    cc->chr_write = microbit_embed_chr_write;
+}
+
+static const TypeInfo char_microbit_embed_type_info = {
+    .name = TYPE_CHARDEV_MICROBIT_EMBED,
+    .parent = TYPE_CHARDEV,
+    .class_init = char_microbit_embed_class_init,
+};
+
+static void microbit_embed_budget_cb(void *opaque)
+{
+    microbit_embed.budget_done = true;
+    qemu_system_vmstop_request_prepare();
+    qemu_system_vmstop_request(RUN_STATE_PAUSED);
+}
+
+int microbit_embed_init(int argc, const char * const *argv)
+{
+    static const char * const defaults[] = {
+        "microbit-embed", "-machine", "microbit", "-display", "none",
+        "-nodefaults", "-no-shutdown", "-S",
+        "-chardev", "microbit-embed,id=" MICROBIT_EMBED_UART,
+        "-serial", "chardev:" MICROBIT_EMBED_UART,
+    };
+    char **args;
+    int n = 0;
+    int i;
+
+    if (microbit_embed.initialized) {
+        g_free(microbit_embed.error);
+        microbit_embed.error = g_strdup("the machine was already created");
+        return -1;
+    }
+    microbit_embed.initialized = true;
+
+    args = g_new(char *, ARRAY_SIZE(defaults) + argc + 1);
+    for (i = 0; i < ARRAY_SIZE(defaults); i++) {
+        args[n++] = (char *)defaults[i];
+    }
+    for (i = 0; i < argc; i++) {
+        args[n++] = (char *)argv[i];
+    }
+    args[n] = NULL;
+
+    /* qemu_init() keeps pointers into the arguments */
+    qemu_init(n, args, NULL);
+
+    microbit_embed.uart = qemu_chr_find(MICROBIT_EMBED_UART);
+    microbit_embed.budget = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                         microbit_embed_budget_cb, NULL);
+    return 0;
+}
+
+void microbit_embed_exit(void)
+{
+    timer_free(microbit_embed.budget);
+    microbit_embed.budget = NULL;
+    qemu_cleanup();
+}
+
+int64_t microbit_embed_clock(void)
+{
+    return qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+}
+
+int microbit_embed_run(int64_t budget_ns, int64_t *ran_ns)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    bool exited = false;
+
+    if (runstate_needs_reset()) {
+        g_free(microbit_embed.error);
+        microbit_embed.error = g_strdup("the guest shut down, reset it or "
+                                        "load a snapshot first");
+        return -1;
+    }
+
+    microbit_embed.budget_done = false;
+    timer_mod(microbit_embed.budget, start + MAX(budget_ns, 0));
+    vm_start();
+    while (runstate_is_running() && !exited) {
+        exited = qemu_main_loop_step();
+    }
+    timer_del(microbit_embed.budget);
+    if (exited) {
+        /* Nothing but a signal to the process gets here */
+        vm_stop(RUN_STATE_PAUSED);
+    }
+
+    if (ran_ns) {
+        *ran_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - start;
+    }
+    return microbit_embed.budget_done && runstate_check(RUN_STATE_PAUSED) ?
+           MICROBIT_EMBED_BUDGET : MICROBIT_EMBED_STOPPED;
+}
+
+void microbit_embed_reset(void)
+{
+    qemu_system_reset(SHUTDOWN_CAUSE_HOST_QMP);
+    if (runstate_needs_reset()) {
+        runstate_set(RUN_STATE_PRELAUNCH);
+    }
+}
+
+static int microbit_embed_rw(uint32_t addr, void *buf, size_t len,
+                             bool is_write)
+{
+    MemTxResult res;
+
+    res = address_space_rw(&address_space_memory, addr,
+                           MEMTXATTRS_UNSPECIFIED, buf, len, is_write);
+    if (res != MEMTX_OK) {
+        g_free(microbit_embed.error);
+        microbit_embed.error = g_strdup_printf("cannot %s 0x%" PRIx32,
+                                               is_write ? "write" : "read",
+                                               addr);
+        return -1;
+    }
+    return 0;
+}
+
+int microbit_embed_read(uint32_t addr, void *buf, size_t len)
+{
+    return microbit_embed_rw(addr, buf, len, false);
+}
+
+int microbit_embed_write(uint32_t addr, const void *buf, size_t len)
+{
+    return microbit_embed_rw(addr, (void *)buf, len, true);
+}
+
+int microbit_embed_gpio_set(uint32_t mask, bool level, int64_t delay_ns)
+{
+    MicrobitGpioEvent ev = {
+        .time = MAX(delay_ns, 0),
+        .mask = mask,
+        .level = level,
+    };
+    MicrobitGpioEventList events = { .value = &ev };
+    Error *err = NULL;
+
+    qmp_microbit_gpio_inject(&events, true, true, &err);
+    if (err) {
+        microbit_embed_set_error(err);
+        return -1;
+    }
+    return 0;
+}
+
+size_t microbit_embed_uart_write(const void *buf, size_t len)
+{
+    size_t n;
+
+    if (!microbit_embed.uart) {
+        return 0;
+    }
+    n = MIN(qemu_chr_be_can_write(microbit_embed.uart), len);
+    if (n) {
+        qemu_chr_be_write(microbit_embed.uart, (uint8_t *)buf, n);
+    }
+    return n;
+}
+
+void microbit_embed_uart_set_output(MicrobitEmbedUARTFn *fn, void *opaque)
+{
+    microbit_embed.uart_opaque = opaque;
+    microbit_embed.uart_fn = fn;
+}
+
+MicrobitEmbedSnapshot *microbit_embed_snapshot_save(void)
+{
+    MicrobitEmbedSnapshot *snap;
+    Error *err = NULL;
+    MemSnapshot *ms;
+
+    ms = mem_snapshot_save(true, &err);
+    if (!ms) {
+        microbit_embed_set_error(err);
+        return NULL;
+    }
+    snap = g_new(MicrobitEmbedSnapshot, 1);
+    snap->ms = ms;
+    return snap;
+}
+
+int microbit_embed_snapshot_load(MicrobitEmbedSnapshot *snap)
+{
+    Error *err = NULL;
+
+    if (mem_snapshot_load(snap->ms, &err) < 0) {
+        microbit_embed_set_error(err);
+        return -1;
+    }
+    /* The snapshot was running, or could have been */
+    if (runstate_needs_reset()) {
+        runstate_set(RUN_STATE_PRELAUNCH);
+    }
+    return 0;
+}
+
+void microbit_embed_snapshot_free(MicrobitEmbedSnapshot *snap)
+{
+    if (snap) {
+        mem_snapshot_free(snap->ms);
+        g_free(snap);
+    }
+}
+
+static void microbit_embed_register_types(void)
+{
+    type_register_static(&char_microbit_embed_type_info);
+}
+
+type_init(microbit_embed_register_types)
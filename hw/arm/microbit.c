@@ -7,37 +7,642 @@
  */
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "qemu/error-report.h"
 #include "hw/arm/arm.h"
 #include "hw/arm/armv7m.h"
 #include "hw/or-irq.h"
+#include "hw/core/split-irq.h"
+#include "hw/register.h"
 #include "hw/boards.h"
 #include "exec/address-spaces.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
+#include "sysemu/qtest.h"
+#include "sysemu/replay.h"
+#include "sysemu/reset.h"
 #include "hw/misc/unimp.h"
+#include "hw/misc/mmio-stats.h"
+#include "exec/exec-all.h"
+#include "exec/tb-coverage.h"
 #include "hw/char/cmsdk-apb-uart.h"
 #include "hw/timer/cmsdk-apb-timer.h"
 #include "hw/devices.h"
 #include "qemu/log.h"
 #include "hw/loader.h"
-#include "hw/block/flash.h"
+#include "elf.h"
+#include "sysemu/block-backend.h"
+#include "sysemu/watchdog.h"
 #include "hw/ptimer.h"
+#include "hw/i2c/i2c.h"
+#include "hw/ssi/ssi.h"
 #include "crypto/random.h"
+#include "crypto/cipher.h"
+#include "chardev/char-fe.h"
+#include "qemu/fifo8.h"
+#include "qemu/main-loop.h"
+#include "qemu/memfd.h"
+#include "qemu/startup-profile.h"
+#include "chardev/char.h"
+#include "migration/snapshot.h"
+#include "migration/blocker.h"
+#include "qapi/qapi-commands-misc.h"
+#include "io/channel-websock.h"
+#include "io/net-listener.h"
+#include "qemu/sockets.h"
+#include "trace.h"
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "ui/console.h"
 #include "ui/pixel_ops.h"
+#include "audio/audio.h"
+#include <zlib.h>
+
+/**
+ * LOCKING
+ */
+
+/*
+ * The state of the devices in this file is protected by nrf51_lock,
+ * which nrf51_init_io()'s ops take around every access, as does every
+ * callback into the devices from elsewhere: timers, bottom halves,
+ * chardev, console and replay handlers, input lines.  It nests, since
+ * devices call each other.  Regions that nrf51_io_set_bql_free() is
+ * called on are then dispatched without the BQL, so that a vCPU busy
+ * with the LEDs, GPIO or a timer no longer contends with the main loop.
+ *
+ * Without the BQL, device code must not change an NVIC input, access a
+ * region that still needs the BQL (a PPI task) or touch the UI.  It
+ * hands such work to nrf51_with_bql(), which runs it when the outermost
+ * nrf51_unlock() has taken the BQL, before nrf51_lock as everyone else.
+ */
+
+typedef void NRF51BqlFn(void *opaque, uint64_t a, uint64_t b, uint64_t c);
+
+typedef struct {
+    NRF51BqlFn *fn;
+    void *opaque;
+    uint64_t a, b, c;
+} NRF51BqlWork;
+
+static QemuMutex nrf51_lock_mutex;
+static __thread unsigned nrf51_lock_depth;
+/* This thread's work waiting for the BQL */
+static __thread GArray *nrf51_bql_work;
+
+static void __attribute__((constructor)) nrf51_lock_init(void)
+{
+    qemu_mutex_init(&nrf51_lock_mutex);
+}
+
+static void nrf51_lock(void)
+{
+    if (!nrf51_lock_depth++) {
+        qemu_mutex_lock(&nrf51_lock_mutex);
+    }
+}
+
+/* Leaves the outermost section without the BQL, doing what needed it */
+static void nrf51_bql_flush(void)
+{
+    NRF51BqlWork w;
+    guint i;
+
+    qemu_mutex_unlock(&nrf51_lock_mutex);
+    qemu_mutex_lock_iothread();
+    qemu_mutex_lock(&nrf51_lock_mutex);
+    nrf51_lock_depth = 1;
+    for (i = 0; i < nrf51_bql_work->len; i++) {
+        w = g_array_index(nrf51_bql_work, NRF51BqlWork, i);
+        w.fn(w.opaque, w.a, w.b, w.c);
+    }
+    g_array_set_size(nrf51_bql_work, 0);
+    nrf51_lock_depth = 0;
+    qemu_mutex_unlock(&nrf51_lock_mutex);
+    qemu_mutex_unlock_iothread();
+}
+
+static void nrf51_unlock(void)
+{
+    assert(nrf51_lock_depth);
+    if (--nrf51_lock_depth) {
+        return;
+    }
+    if (nrf51_bql_work && nrf51_bql_work->len) {
+        nrf51_bql_flush();
+        return;
+    }
+    qemu_mutex_unlock(&nrf51_lock_mutex);
+}
+
+/* fn(opaque, a, b, c) now if the BQL is held, else once it is */
+static void nrf51_with_bql(NRF51BqlFn *fn, void *opaque,
+                           uint64_t a, uint64_t b, uint64_t c)
+{
+    NRF51BqlWork w = { fn, opaque, a, b, c };
+
+    if (qemu_mutex_iothread_locked()) {
+        fn(opaque, a, b, c);
+        return;
+    }
+    assert(nrf51_lock_depth);
+    if (!nrf51_bql_work) {
+        nrf51_bql_work = g_array_new(FALSE, FALSE, sizeof(NRF51BqlWork));
+    }
+    g_array_append_val(nrf51_bql_work, w);
+}
+
+/* Record and replay order all I/O by the BQL, so there it stays */
+static void nrf51_io_set_bql_free(MemoryRegion *mr)
+{
+    if (replay_mode == REPLAY_MODE_NONE) {
+        memory_region_clear_global_locking(mr);
+    }
+}
+
+typedef struct {
+    QEMUTimerCB *cb;
+    void *opaque;
+} NRF51LockedCB;
+
+static void nrf51_locked_cb(void *opaque)
+{
+    NRF51LockedCB *l = opaque;
+
+    nrf51_lock();
+    l->cb(l->opaque);
+    nrf51_unlock();
+}
+
+static NRF51LockedCB *nrf51_locked_cb_new(QEMUTimerCB *cb, void *opaque)
+{
+    NRF51LockedCB *l = g_new(NRF51LockedCB, 1);
+
+    l->cb = cb;
+    l->opaque = opaque;
+    return l;
+}
+
+/* timer_new() and qemu_bh_new() for the devices, under nrf51_lock */
+static QEMUTimer *nrf51_locked_timer_new(QEMUClockType type, int scale,
+                                         QEMUTimerCB *cb, void *opaque)
+{
+    return timer_new(type, scale, nrf51_locked_cb,
+                     nrf51_locked_cb_new(cb, opaque));
+}
+
+static QEMUBH *nrf51_locked_bh_new(QEMUBHFunc *cb, void *opaque)
+{
+    return qemu_bh_new(nrf51_locked_cb, nrf51_locked_cb_new(cb, opaque));
+}
+
+/* An NVIC input, for devices that may set it without the BQL */
+typedef struct {
+    qemu_irq out;
+    int level;
+} NRF51BqlIrq;
+
+/* Forwards the latest level, whoever set it since it was queued */
+static void nrf51_bql_irq_forward(void *opaque, uint64_t a, uint64_t b,
+                                  uint64_t c)
+{
+    NRF51BqlIrq *irq = opaque;
+
+    qemu_set_irq(irq->out, irq->level);
+}
+
+static void nrf51_bql_irq_set(void *opaque, int n, int level)
+{
+    NRF51BqlIrq *irq = opaque;
+
+    irq->level = level;
+    nrf51_with_bql(nrf51_bql_irq_forward, irq, 0, 0, 0);
+}
+
+static void nrf51_bql_irq_pulse_forward(void *opaque, uint64_t a,
+                                        uint64_t b, uint64_t c)
+{
+    NRF51BqlIrq *irq = opaque;
+
+    qemu_irq_pulse(irq->out);
+}
+
+/* A pulse has no level to keep, it is forwarded as it is */
+static void nrf51_bql_irq_pulse(void *opaque, int n)
+{
+    nrf51_with_bql(nrf51_bql_irq_pulse_forward, opaque, 0, 0, 0);
+}
+
+static qemu_irq nrf51_bql_irq_new(qemu_irq out)
+{
+    NRF51BqlIrq *irq = g_new0(NRF51BqlIrq, 1);
+    qemu_irq in = qemu_allocate_irq(nrf51_bql_irq_set, irq, 0);
+
+    irq->out = out;
+    qemu_irq_set_edge_handler(in, nrf51_bql_irq_pulse);
+    return in;
+}
+
+/**
+ * MMIO TRACING
+ */
+
+/*
+ * Every LED and nRF51 register access goes through nrf51_init_io()'s
+ * ops, which fire the nrf51_mmio_read/write trace events and, when the
+ * machine has an mmio-ring, append a fixed-size record to a ring file
+ * mapped by the accessing thread.  The file is MAP_SHARED, so whatever
+ * the guest did last is still on disk when QEMU dies.
+ */
+
+#define NRF51_MMIO_RING_MAGIC   0x474e495238464e4eULL /* "NNF8RING" */
+#define NRF51_MMIO_RING_VERSION 1
+#define NRF51_MMIO_RING_RECORDS (64 * 1024)
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t records;
+    /* Records written so far; the next one goes to head % records */
+    uint64_t head;
+} NRF51MmioRingHeader;
+
+typedef struct {
+    int64_t vclock;
+    /* Guest PC of the accessing instruction, or -1 if unknown */
+    uint64_t pc;
+    uint64_t addr;
+    uint64_t value;
+    uint32_t size;
+    uint32_t is_write;
+} NRF51MmioRecord;
+
+typedef struct {
+    NRF51MmioRingHeader *header;
+    NRF51MmioRecord *records;
+} NRF51MmioRing;
+
+typedef struct {
+    /* The device's ops, with our tracing read and write */
+    MemoryRegionOps ops;
+    const MemoryRegionOps *inner;
+    void *opaque;
+    MemoryRegion *mr;
+    const char *name;
+} NRF51MmioTrace;
+
+/* Path prefix of the ring files, set by the machine's mmio-ring */
+static char *nrf51_mmio_ring_prefix;
+/* This thread's ring; ring_failed once it could not be created */
+static __thread NRF51MmioRing *nrf51_mmio_ring;
+static __thread bool nrf51_mmio_ring_failed;
+
+static NRF51MmioRing *nrf51_mmio_ring_open(void)
+{
+    size_t len = sizeof(NRF51MmioRingHeader) +
+                 NRF51_MMIO_RING_RECORDS * sizeof(NRF51MmioRecord);
+    char *path = g_strdup_printf("%s.%d", nrf51_mmio_ring_prefix,
+                                 qemu_get_thread_id());
+    NRF51MmioRing *ring = NULL;
+    void *map = MAP_FAILED;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && ftruncate(fd, len) == 0) {
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        warn_report("microbit: cannot map MMIO ring '%s': %s", path,
+                    strerror(errno));
+    } else {
+        ring = g_new0(NRF51MmioRing, 1);
+        ring->header = map;
+        ring->records = (NRF51MmioRecord *)(ring->header + 1);
+        ring->header->version = NRF51_MMIO_RING_VERSION;
+        ring->header->record_size = sizeof(NRF51MmioRecord);
+        ring->header->records = NRF51_MMIO_RING_RECORDS;
+        /* A reader only trusts a ring whose magic is in place */
+        smp_wmb();
+        ring->header->magic = NRF51_MMIO_RING_MAGIC;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    g_free(path);
+    return ring;
+}
+
+static hwaddr nrf51_mmio_region_base(MemoryRegion *mr)
+{
+    hwaddr base = 0;
+
+    for (; mr; mr = mr->container) {
+        base += mr->addr;
+    }
+    return base;
+}
+
+static void nrf51_mmio_ring_record(NRF51MmioTrace *t, hwaddr offset,
+                                   uint64_t value, unsigned size,
+                                   bool is_write)
+{
+    NRF51MmioRecord *rec;
+    target_ulong pc;
+    uint64_t head;
+
+    if (!nrf51_mmio_ring) {
+        if (nrf51_mmio_ring_failed) {
+            return;
+        }
+        nrf51_mmio_ring = nrf51_mmio_ring_open();
+        if (!nrf51_mmio_ring) {
+            nrf51_mmio_ring_failed = true;
+            return;
+        }
+    }
+
+    head = nrf51_mmio_ring->header->head;
+    rec = &nrf51_mmio_ring->records[head % NRF51_MMIO_RING_RECORDS];
+    rec->vclock = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    rec->pc = -1;
+    if (current_cpu && tcg_enabled() &&
+        cpu_unwind_pc(current_cpu->mem_io_pc, &pc)) {
+        rec->pc = pc;
+    }
+    rec->addr = nrf51_mmio_region_base(t->mr) + offset;
+    rec->value = value;
+    rec->size = size;
+    rec->is_write = is_write;
+    smp_wmb();
+    atomic_set__nocheck(&nrf51_mmio_ring->header->head, head + 1);
+}
+
+static uint64_t nrf51_mmio_read(void *opaque, hwaddr offset, unsigned size)
+{
+    NRF51MmioTrace *t = opaque;
+    uint64_t value;
+
+    nrf51_lock();
+    value = t->inner->read(t->opaque, offset, size);
+    nrf51_unlock();
+    trace_nrf51_mmio_read(t->name, offset, value, size);
+    if (nrf51_mmio_ring_prefix) {
+        nrf51_mmio_ring_record(t, offset, value, size, false);
+    }
+    return value;
+}
+
+static void nrf51_mmio_write(void *opaque, hwaddr offset, uint64_t value,
+                             unsigned size);
+
+static void nrf51_mmio_write_bql(void *opaque, uint64_t offset,
+                                 uint64_t value, uint64_t size)
+{
+    nrf51_mmio_write(opaque, offset, value, size);
+}
+
+static void nrf51_mmio_write(void *opaque, hwaddr offset, uint64_t value,
+                             unsigned size)
+{
+    NRF51MmioTrace *t = opaque;
+
+    /* A PPI task, from a device without the BQL, of one that needs it */
+    if (t->mr->global_locking && !qemu_mutex_iothread_locked()) {
+        nrf51_with_bql(nrf51_mmio_write_bql, t, offset, value, size);
+        return;
+    }
+    trace_nrf51_mmio_write(t->name, offset, value, size);
+    if (nrf51_mmio_ring_prefix) {
+        nrf51_mmio_ring_record(t, offset, value, size, true);
+    }
+    nrf51_lock();
+    t->inner->write(t->opaque, offset, value, size);
+    nrf51_unlock();
+}
+
+/* Load/store multiple: the device's own burst callback if it has one,
+ * else its read or write once per word, still without a dispatch each.
+ */
+static void nrf51_mmio_access_burst(void *opaque, hwaddr offset,
+                                    uint32_t *data, unsigned count,
+                                    bool is_write)
+{
+    NRF51MmioTrace *t = opaque;
+    unsigned i;
+
+    if (t->inner->access_burst) {
+        if (is_write) {
+            for (i = 0; i < count; i++) {
+                trace_nrf51_mmio_write(t->name, offset + i * 4, data[i], 4);
+            }
+        }
+        nrf51_lock();
+        t->inner->access_burst(t->opaque, offset, data, count, is_write);
+        nrf51_unlock();
+        if (!is_write) {
+            for (i = 0; i < count; i++) {
+                trace_nrf51_mmio_read(t->name, offset + i * 4, data[i], 4);
+            }
+        }
+        if (nrf51_mmio_ring_prefix) {
+            for (i = 0; i < count; i++) {
+                nrf51_mmio_ring_record(t, offset + i * 4, data[i], 4,
+                                       is_write);
+            }
+        }
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (is_write) {
+            nrf51_mmio_write(t, offset + i * 4, data[i], 4);
+        } else {
+            data[i] = nrf51_mmio_read(t, offset + i * 4, 4);
+        }
+    }
+}
+
+/* mmio_stats_init_io() with tracing of every access */
+static void nrf51_init_io(MemoryRegion *mr, Object *owner,
+                          const MemoryRegionOps *ops, void *opaque,
+                          const char *name, uint64_t size)
+{
+    NRF51MmioTrace *t = g_new0(NRF51MmioTrace, 1);
+
+    memcpy(&t->ops, ops, sizeof(t->ops));
+    t->ops.read = nrf51_mmio_read;
+    t->ops.write = nrf51_mmio_write;
+    /* Word accesses must reach the device as they are */
+    if ((!ops->impl.min_access_size || ops->impl.min_access_size <= 4) &&
+        (!ops->impl.max_access_size || ops->impl.max_access_size >= 4) &&
+        (!ops->valid.max_access_size || ops->valid.max_access_size >= 4)) {
+        t->ops.access_burst = nrf51_mmio_access_burst;
+    }
+    t->inner = ops;
+    t->opaque = opaque;
+    t->mr = mr;
+    t->name = name;
+    mmio_stats_init_io(mr, owner, &t->ops, t, name, size);
+    /* The callbacks above take nrf51_lock or the BQL themselves */
+    memory_region_set_direct_call(mr, true);
+}
+
+/*
+ * Register tables
+ *   A device's registers as a dense array indexed by (offset - base) / 4,
+ *   written with NRF51_REG() or NRF51_PERIPH_REG() designators, so that
+ *   an access indexes the table instead of running through a switch.  A
+ *   register is a uint32_t field of the device's state that reads as it
+ *   is and takes the bits of a write in its mask as op says, or has
+ *   handlers of its own; a handler gets the offset, so that one handler
+ *   serves a register array.
+ */
+
+enum {
+    NRF51_REG_STORE,    /* field = value & mask */
+    NRF51_REG_SET,      /* field |= value & mask */
+    NRF51_REG_CLEAR,    /* field &= ~(value & mask) */
+};
+
+typedef uint64_t NRF51RegReadFn(void *opaque, hwaddr offset);
+typedef void NRF51RegWriteFn(void *opaque, hwaddr offset, uint64_t value);
+
+typedef struct {
+    /* Offset of the field in the device's state, or 0 */
+    unsigned field:24;
+    unsigned op:8;
+    /* The bits a write changes; with neither mask nor write, read-only */
+    uint32_t mask;
+    /* Instead of reading the field */
+    NRF51RegReadFn *read;
+    /* Instead of changing the field */
+    NRF51RegWriteFn *write;
+} NRF51Reg;
+
+#define NRF51_REG(offset) [(offset) >> 2]
+#define NRF51_REG_ARRAY(first, last) [(first) >> 2 ... (last) >> 2]
+#define NRF51_FIELD_OP(type, name, wmask, wop) \
+    .field = offsetof(type, name) + \
+             QEMU_BUILD_BUG_ON_ZERO(sizeof(((type *)0)->name) != 4 || \
+                                    offsetof(type, name) >= 1 << 24), \
+    .mask = (wmask), .op = (wop)
+#define NRF51_FIELD(type, name, wmask) \
+    NRF51_FIELD_OP(type, name, wmask, NRF51_REG_STORE)
+#define NRF51_FIELD_SET(type, name, wmask) \
+    NRF51_FIELD_OP(type, name, wmask, NRF51_REG_SET)
+#define NRF51_FIELD_CLEAR(type, name, wmask) \
+    NRF51_FIELD_OP(type, name, wmask, NRF51_REG_CLEAR)
+
+/* Register @offset in @regs, whose first register is at @base */
+static const NRF51Reg *nrf51_reg(const NRF51Reg *regs, size_t num_regs,
+                                 hwaddr base, hwaddr offset)
+{
+    hwaddr n = (offset - base) >> 2;
+
+    if (offset < base || (offset & 3) || n >= num_regs) {
+        return NULL;
+    }
+    return &regs[n];
+}
+
+static inline uint32_t *nrf51_reg_field(void *opaque, const NRF51Reg *r)
+{
+    return (uint32_t *)((uint8_t *)opaque + r->field);
+}
+
+static uint64_t nrf51_regs_read(void *opaque, const NRF51Reg *regs,
+                                size_t num_regs, hwaddr base, hwaddr offset)
+{
+    const NRF51Reg *r = nrf51_reg(regs, num_regs, base, offset);
+
+    if (r && r->read) {
+        return r->read(opaque, offset);
+    }
+    if (r && r->field) {
+        return *nrf51_reg_field(opaque, r);
+    }
+    qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                              "%s: reading a bad offset 0x%x\n",
+                              object_get_typename(OBJECT(opaque)),
+                              (int)offset);
+    return 0;
+}
+
+static void nrf51_regs_write(void *opaque, const NRF51Reg *regs,
+                             size_t num_regs, hwaddr base, hwaddr offset,
+                             uint64_t value)
+{
+    const NRF51Reg *r = nrf51_reg(regs, num_regs, base, offset);
+    uint32_t *field;
+
+    if (r && r->write) {
+        r->write(opaque, offset, value);
+        return;
+    }
+    if (!r || !r->mask) {
+        qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                  "%s: writing a bad offset 0x%x\n",
+                                  object_get_typename(OBJECT(opaque)),
+                                  (int)offset);
+        return;
+    }
+
+    field = nrf51_reg_field(opaque, r);
+    switch (r->op) {
+        case NRF51_REG_SET:
+            *field |= value & r->mask;
+            break;
+        case NRF51_REG_CLEAR:
+            *field &= ~(value & r->mask);
+            break;
+        default:
+            *field = value & r->mask;
+            break;
+    }
+}
+
+/* For write-only registers, i.e. tasks */
+static uint64_t nrf51_reg_read_zero(void *opaque, hwaddr offset)
+{
+    return 0;
+}
+
+/* For registers whose writes have no effect here */
+static void nrf51_reg_write_ignore(void *opaque, hwaddr offset,
+                                   uint64_t value)
+{
+}
 
 /**
  * MICROBIT LED MATRIX
+ *   NOTE: the matrix is wired to the GPIO as on the board: rows on P0.13-15,
+ *         driven high, columns on P0.4-12, driven low. Each write to the
+ *         pins is decoded with one table lookup per row that is driven.
+ *         The time each LED is driven is accumulated in virtual time, and
+ *         turned into a brightness level once per display refresh, so
+ *         row multiplexing and greyscale PWM cost nothing to draw. Each
+ *         consumer of levels (the console, the websocket push) samples
+ *         the running totals over a window of its own.
  */
 
 #define TYPE_MICROBIT_LED_MATRIX "microbit_led_matrix"
 #define MICROBIT_LED_MATRIX(obj) \
     OBJECT_CHECK(MICROBITLedMatrixState, (obj), TYPE_MICROBIT_LED_MATRIX)
 
+/* The GPIO below, whose output pins drive the matrix */
+typedef struct NRF51GPIOState NRF51GPIOState;
+
+/* Output pins in mask now driven to the levels in value */
+typedef struct {
+    uint32_t mask;
+    uint32_t value;
+} NRF51GPIOLevels;
+
+static uint32_t nrf51_gpio_out_level(NRF51GPIOState *s);
+static void nrf51_gpio_add_level_notifier(NRF51GPIOState *s, Notifier *n);
+
 enum {
-    MICROBIT_LED_MAP_MASK = 0x01FFFFFF,
     MICROBIT_LED_HSIZE = 10,
     MICROBIT_LED_VSIZE = 40,
     MICROBIT_LED_HSKIP = 40,
@@ -47,101 +652,200 @@ enum {
     MICROBIT_LED_EVENT_NONE  = 0,
     MICROBIT_LED_EVENT_FRONT = 1,
     MICROBIT_LED_EVENT_BACK  = 2,
+    MICROBIT_LED_NUM  = 25,
+    /* An LED on for its whole row slot is at full brightness */
+    MICROBIT_LED_ROWS = 3,
+    /* Brightness levels, coarse enough not to flicker between refreshes */
+    MICROBIT_LED_LEVELS = 16,
 };
 
+/* Totals in on_ns as of start_ns, the last time levels were taken */
+typedef struct {
+    int64_t on_ns[MICROBIT_LED_NUM];
+    int64_t start_ns;
+} MICROBITLedWindow;
+
 typedef struct {
     /* Private */
     SysBusDevice parent;
 
     /* Public */
-    MemoryRegion iomem;
+    NRF51GPIOState *gpio;
+    Notifier level_notifier;
     /* Only 25 bits are used */
     uint32_t led_state;
+    /* LEDs of the rows being driven, lit since lit_ns */
+    uint32_t lit;
+    int64_t lit_ns;
+    /* Running total of the time each LED was lit */
+    int64_t on_ns[MICROBIT_LED_NUM];
+    /* The console's window */
+    MICROBITLedWindow window;
+    /* Levels currently on the surface, only LEDs that differ are redrawn */
+    uint8_t drawn_level[MICROBIT_LED_NUM];
     uint8_t led_event;
+    /* Without a console of its own, the matrix is drawn by the dashboard */
+    bool console;
     QemuConsole *con;
+    QemuConsole *dashboard;
+    /* Headless mode: LED changes are streamed here instead of drawn */
+    CharBackend chr;
 
 } MICROBITLedMatrixState;
 
-static uint64_t microbit_led_matrix_read(void *opaque, hwaddr addr,
-                                         unsigned size)
+/**
+ * Headless frame record, one per led_state change, little-endian:
+ * QEMU_CLOCK_VIRTUAL timestamp in ns followed by the 25-bit LED state,
+ * bit (x + 5 * y) for the LED at column x, row y.
+ */
+typedef struct QEMU_PACKED {
+    uint64_t timestamp;
+    uint32_t state;
+} MICROBITLedRecord;
+
+/* Charge the LEDs lit since lit_ns with the time up to `now` */
+static void microbit_led_matrix_accumulate(MICROBITLedMatrixState *s,
+                                           int64_t now)
 {
-    MICROBITLedMatrixState *s = (MICROBITLedMatrixState *)opaque;
-    s->led_event = MICROBIT_LED_EVENT_BACK | MICROBIT_LED_EVENT_FRONT;
-    return s->led_state;
+    uint32_t lit = s->lit;
+
+    while (lit) {
+        s->on_ns[ctz32(lit)] += now - s->lit_ns;
+        lit &= lit - 1;
+    }
+    s->lit_ns = now;
 }
 
-typedef struct {
-    int x;
-    int y;
-} matrix_point_t;
+/* Start a new window `w` at `now` */
+static void microbit_led_matrix_restart(MICROBITLedMatrixState *s,
+                                        MICROBITLedWindow *w, int64_t now)
+{
+    memcpy(w->on_ns, s->on_ns, sizeof(w->on_ns));
+    w->start_ns = now;
+}
 
-static const matrix_point_t matrix_map[3 * 9] = {
-    /* Row 2 Col 8 and 9 not used, set as (5,5) */
-    {0,0},{4,2},{2,4},
-    {2,0},{0,2},{4,4},
-    {4,0},{2,2},{0,4},
-    {4,3},{1,0},{0,1},
-    {3,3},{3,0},{1,1},
-    {2,3},{3,4},{2,1},
-    {1,3},{1,4},{3,1},
-    {0,3},{5,5},{4,1},
-    {1,2},{5,5},{3,2},
-};
+/* Streams `state`, as of virtual time `now`, to the chardev */
+static void microbit_led_matrix_stream(void *opaque, uint64_t now,
+                                       uint64_t state, uint64_t unused)
+{
+    MICROBITLedMatrixState *s = opaque;
+    MICROBITLedRecord rec;
 
-static void microbit_led_matrix_write(void *opaque, hwaddr addr,
-                                      uint64_t val, unsigned size)
+    rec.timestamp = cpu_to_le64(now);
+    rec.state = cpu_to_le32(state);
+    qemu_chr_fe_write_all(&s->chr, (const uint8_t *)&rec, sizeof(rec));
+}
+
+static void microbit_led_matrix_changed(void *opaque, uint64_t a,
+                                        uint64_t b, uint64_t c)
 {
-    MICROBITLedMatrixState *s = (MICROBITLedMatrixState *)opaque;
+    MICROBITLedMatrixState *s = opaque;
+
+    graphic_hw_changed(s->con);
+    graphic_hw_changed(s->dashboard);
+}
+
+/*
+ * The LED lit by row `r` and column `c`, as the bit (x + 5 * y) of the LED
+ * state it sets when column bit `c` of `cols` is on.  Row 1 has no LEDs on
+ * columns 7 and 8.
+ */
+#define MICROBIT_LED(cols, c, x, y) \
+    ((cols) & (1 << (c)) ? 1u << ((x) + 5 * (y)) : 0)
+#define MICROBIT_LED_ROW0(cols) \
+    (MICROBIT_LED(cols, 0, 0, 0) | MICROBIT_LED(cols, 1, 2, 0) | \
+     MICROBIT_LED(cols, 2, 4, 0) | MICROBIT_LED(cols, 3, 4, 3) | \
+     MICROBIT_LED(cols, 4, 3, 3) | MICROBIT_LED(cols, 5, 2, 3) | \
+     MICROBIT_LED(cols, 6, 1, 3) | MICROBIT_LED(cols, 7, 0, 3) | \
+     MICROBIT_LED(cols, 8, 1, 2))
+#define MICROBIT_LED_ROW1(cols) \
+    (MICROBIT_LED(cols, 0, 4, 2) | MICROBIT_LED(cols, 1, 0, 2) | \
+     MICROBIT_LED(cols, 2, 2, 2) | MICROBIT_LED(cols, 3, 1, 0) | \
+     MICROBIT_LED(cols, 4, 3, 0) | MICROBIT_LED(cols, 5, 3, 4) | \
+     MICROBIT_LED(cols, 6, 1, 4))
+#define MICROBIT_LED_ROW2(cols) \
+    (MICROBIT_LED(cols, 0, 2, 4) | MICROBIT_LED(cols, 1, 4, 4) | \
+     MICROBIT_LED(cols, 2, 0, 4) | MICROBIT_LED(cols, 3, 0, 1) | \
+     MICROBIT_LED(cols, 4, 1, 1) | MICROBIT_LED(cols, 5, 2, 1) | \
+     MICROBIT_LED(cols, 6, 3, 1) | MICROBIT_LED(cols, 7, 4, 1) | \
+     MICROBIT_LED(cols, 8, 3, 2))
 
-    uint32_t clear_bits;
-    uint32_t row_bits = (val >> 13) & 7;
-    uint32_t col_bits = (~(val >> 4)) & 0x1FF;
+/* ROW(n), ROW(n + 1), ... for each of the 512 column patterns from n */
+#define MICROBIT_LED_X4(ROW, n) \
+    ROW(n), ROW((n) + 1), ROW((n) + 2), ROW((n) + 3)
+#define MICROBIT_LED_X16(ROW, n) \
+    MICROBIT_LED_X4(ROW, n), MICROBIT_LED_X4(ROW, (n) + 4), \
+    MICROBIT_LED_X4(ROW, (n) + 8), MICROBIT_LED_X4(ROW, (n) + 12)
+#define MICROBIT_LED_X64(ROW, n) \
+    MICROBIT_LED_X16(ROW, n), MICROBIT_LED_X16(ROW, (n) + 16), \
+    MICROBIT_LED_X16(ROW, (n) + 32), MICROBIT_LED_X16(ROW, (n) + 48)
+#define MICROBIT_LED_X512(ROW) \
+    MICROBIT_LED_X64(ROW, 0), MICROBIT_LED_X64(ROW, 64), \
+    MICROBIT_LED_X64(ROW, 128), MICROBIT_LED_X64(ROW, 192), \
+    MICROBIT_LED_X64(ROW, 256), MICROBIT_LED_X64(ROW, 320), \
+    MICROBIT_LED_X64(ROW, 384), MICROBIT_LED_X64(ROW, 448)
+
+enum {
+    MICROBIT_LED_ROW_PIN = 13,
+    MICROBIT_LED_COL_PIN = 4,
+    MICROBIT_LED_COLS = 9,
+    MICROBIT_LED_PINS = 0x0000FFF0,
+};
+
+/* LEDs lit by each row for the columns that are on, indexed by column bits */
+static const uint32_t microbit_led_row_map[MICROBIT_LED_ROWS]
+                                          [1 << MICROBIT_LED_COLS] = {
+    { MICROBIT_LED_X512(MICROBIT_LED_ROW0) },
+    { MICROBIT_LED_X512(MICROBIT_LED_ROW1) },
+    { MICROBIT_LED_X512(MICROBIT_LED_ROW2) },
+};
+
+/* Output pins were driven: latch the rows driven high, light their LEDs */
+static void microbit_led_matrix_levels_changed(Notifier *n, void *data)
+{
+    MICROBITLedMatrixState *s = container_of(n, MICROBITLedMatrixState,
+                                             level_notifier);
+    const NRF51GPIOLevels *levels = data;
+    uint32_t pins = nrf51_gpio_out_level(s->gpio);
+    uint32_t rows = extract32(pins, MICROBIT_LED_ROW_PIN, MICROBIT_LED_ROWS);
+    uint32_t cols = extract32(~pins, MICROBIT_LED_COL_PIN, MICROBIT_LED_COLS);
+    uint32_t old_state = s->led_state;
     uint32_t led_bits = 0;
-    int index;
-    int row;
 
-    switch (row_bits) {
-        case 1:
-            clear_bits = 0x000f8815;
-            row = 0;
-            break;
-        case 2:
-            clear_bits = 0x00a0540a;
-            row = 1;
-            break;
-        case 4:
-            clear_bits = 0x015023e0;
-            row = 2;
-            break;
-        default:
-            // printf("%s: abort due to wrong row bits %d\n", __func__, row_bits);
-            return;
-    };
+    if (!(levels->mask & MICROBIT_LED_PINS)) {
+        return;
+    }
 
-    for (int col = 0; col < 9; col++) {
-        if ((row == 1) && ((col == 8) || (col == 9)))
-            continue;
-        
-        index = row + col * 3;
-        if (col_bits & (1 << col))
-            led_bits |= 1 << (matrix_map[index].x + matrix_map[index].y * 5);
+    while (rows) {
+        const uint32_t *map = microbit_led_row_map[ctz32(rows)];
+
+        /* All columns on is every LED of the row */
+        s->led_state &= ~map[(1 << MICROBIT_LED_COLS) - 1];
+        s->led_state |= map[cols];
+        led_bits |= map[cols];
+        rows &= rows - 1;
     }
 
-    s->led_state &= ~clear_bits;
-    s->led_state |= led_bits;
-    s->led_state &= MICROBIT_LED_MAP_MASK;
-    // printf("%s: led_state 0x%08x\n", __func__, s->led_state);
+    if (qemu_chr_fe_backend_connected(&s->chr)) {
+        if (s->led_state != old_state) {
+            nrf51_with_bql(microbit_led_matrix_stream, s,
+                           qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL),
+                           s->led_state, 0);
+        }
+        return;
+    }
 
-    /* Redraw background and front */
-    s->led_event = MICROBIT_LED_EVENT_BACK | MICROBIT_LED_EVENT_FRONT;
+    /* Only the driven rows are lit; levels are worked out on refresh */
+    if (led_bits != s->lit) {
+        microbit_led_matrix_accumulate(s,
+                                       qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        s->lit = led_bits;
+        if (s->con || s->dashboard) {
+            nrf51_with_bql(microbit_led_matrix_changed, s, 0, 0, 0);
+        }
+    }
 }
 
-static const MemoryRegionOps microbit_led_matrix_mem_ops = {
-    .read = microbit_led_matrix_read,
-    .write = microbit_led_matrix_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
-
 static void microbit_led_matrix_draw_block(DisplaySurface *ds,
                                            int ltx, int lty,
                                            int rbx, int rby,
@@ -192,74 +896,134 @@ static void microbit_led_matrix_draw_block(DisplaySurface *ds,
     }
 }
 
-static void microbit_led_matrix_update_display(void *opaque)
+/* Grey of brightness `level` */
+static uint32_t microbit_led_matrix_color(int bits_per_pixel, int level)
 {
-    MICROBITLedMatrixState *s = (MICROBITLedMatrixState *)opaque;
-    DisplaySurface *surf = qemu_console_surface(s->con);
-    int bits_per_pixel = surface_bits_per_pixel(surf);
-    uint32_t front_color;
-    uint8_t *d1;
-    int bpp;
-    int y;
-    int ltx, lty;
-    int row, col;
-    int i;
+    unsigned int c = level * 0xFF / (MICROBIT_LED_LEVELS - 1);
 
     switch (bits_per_pixel) {
         case 8:
-            front_color = rgb_to_pixel8(0xFF, 0xFF, 0xFF);
-            break;
+            return rgb_to_pixel8(c, c, c);
         case 15:
-            front_color = rgb_to_pixel15(0xFF, 0xFF, 0xFF);
-            break;
+            return rgb_to_pixel15(c, c, c);
         case 16:
-            front_color = rgb_to_pixel16(0xFF, 0xFF, 0xFF);
-            break;
+            return rgb_to_pixel16(c, c, c);
         case 24:
-            front_color = rgb_to_pixel24(0xFF, 0xFF, 0xFF);
-            break;
+            return rgb_to_pixel24(c, c, c);
         case 32:
-            front_color = rgb_to_pixel32(0xFF, 0xFF, 0xFF);
-            break;
+            return rgb_to_pixel32(c, c, c);
         default:
             error_report("microbit internal error: " \
                          "[%s] can't handle %d bit color\n",
                          __func__, bits_per_pixel);
             exit(1);
     }
+}
+
+/**
+ * Close window `w` and fill `level` with each LED's brightness over it.
+ * With virtual time stopped there is nothing new to show, and the caller
+ * keeps the levels it has; after loadvm took time back, `w` starts over.
+ */
+static bool microbit_led_matrix_levels(MICROBITLedMatrixState *s,
+                                       MICROBITLedWindow *w, uint8_t *level)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t window = now - w->start_ns;
+
+    if (window <= 0) {
+        if (window < 0) {
+            microbit_led_matrix_restart(s, w, now);
+        }
+        return false;
+    }
+    microbit_led_matrix_accumulate(s, now);
+    for (int i = 0; i < MICROBIT_LED_NUM; i++) {
+        int64_t on = (s->on_ns[i] - w->on_ns[i]) * MICROBIT_LED_ROWS;
+
+        level[i] = on >= window ? MICROBIT_LED_LEVELS - 1 :
+                   on * (MICROBIT_LED_LEVELS - 1) / window;
+    }
+    microbit_led_matrix_restart(s, w, now);
+    return true;
+}
+
+static void microbit_led_matrix_update_display(void *opaque)
+{
+    MICROBITLedMatrixState *s = (MICROBITLedMatrixState *)opaque;
+    DisplaySurface *surf = qemu_console_surface(s->con);
+    int bits_per_pixel = surface_bits_per_pixel(surf);
+    uint8_t level[MICROBIT_LED_NUM];
+    uint32_t dirty = 0;
+    bool full;
+    uint8_t *d1;
+    int bpp;
+    int y;
+    int ltx, lty;
+    int row, col;
+    int i;
+
+    nrf51_lock();
+    if (!microbit_led_matrix_levels(s, &s->window, level)) {
+        memcpy(level, s->drawn_level, sizeof(level));
+    }
+    nrf51_unlock();
+    full = s->led_event & MICROBIT_LED_EVENT_BACK;
+    for (i = 0; i < MICROBIT_LED_NUM; i++) {
+        if ((s->led_event & MICROBIT_LED_EVENT_FRONT) ||
+            level[i] != s->drawn_level[i]) {
+            dirty |= 1 << i;
+        }
+    }
+    if (!dirty && !full) {
+        return;
+    }
 
     /* Clear screen */
-    if (s->led_event & MICROBIT_LED_EVENT_BACK) {
+    if (full) {
         bpp = (surface_bits_per_pixel(surf) + 7) >> 3;
         d1 = surface_data(surf);
         for (y = 0; y < surface_height(surf); y++) {
             memset(d1, 0x00, surface_width(surf) * bpp);
             d1 += surface_stride(surf);
         }
+        /* The background already shows every unlit LED */
+        for (i = 0; i < MICROBIT_LED_NUM; i++) {
+            if (!level[i]) {
+                dirty &= ~(1 << i);
+            }
+        }
     }
 
-    /* Render matrix */
-    if (s->led_event & MICROBIT_LED_EVENT_FRONT) {
-        for (i = 0; i < 25; i ++) {
-            if (s->led_state & (1 << i)) {
-                row = i / 5;
-                col = i % 5;
-                ltx = MICROBIT_LED_HBASE + 
-                    col * (MICROBIT_LED_HSKIP + MICROBIT_LED_HSIZE);
-                lty = MICROBIT_LED_VBASE +
-                    row * (MICROBIT_LED_VSKIP + MICROBIT_LED_VSIZE);
-                microbit_led_matrix_draw_block(surf,
-                                               ltx, lty,
-                                               ltx + MICROBIT_LED_HSIZE,
-                                               lty + MICROBIT_LED_VSIZE,
-                                               front_color);
-            }
+    /* Render changed LEDs, reporting damage per LED */
+    for (i = 0; i < MICROBIT_LED_NUM; i++) {
+        if (!(dirty & (1 << i))) {
+            continue;
+        }
+        row = i / 5;
+        col = i % 5;
+        ltx = MICROBIT_LED_HBASE +
+            col * (MICROBIT_LED_HSKIP + MICROBIT_LED_HSIZE);
+        lty = MICROBIT_LED_VBASE +
+            row * (MICROBIT_LED_VSKIP + MICROBIT_LED_VSIZE);
+        microbit_led_matrix_draw_block(surf,
+                                       ltx, lty,
+                                       ltx + MICROBIT_LED_HSIZE,
+                                       lty + MICROBIT_LED_VSIZE,
+                                       microbit_led_matrix_color(
+                                           bits_per_pixel, level[i]));
+        if (!full) {
+            dpy_gfx_update(s->con, ltx, lty,
+                           MICROBIT_LED_HSIZE + 1, MICROBIT_LED_VSIZE + 1);
         }
     }
 
+    memcpy(s->drawn_level, level, sizeof(level));
     s->led_event = MICROBIT_LED_EVENT_NONE;
-    dpy_gfx_update(s->con, 0, 0,
-                   surface_width(surf), surface_height(surf));
+    if (full) {
+        dpy_gfx_update(s->con, 0, 0,
+                       surface_width(surf), surface_height(surf));
+    }
 }
 
 static void microbit_led_matrix_invalidate_display(void *opaque)
@@ -268,25 +1032,69 @@ static void microbit_led_matrix_invalidate_display(void *opaque)
     s->led_event = MICROBIT_LED_EVENT_BACK | MICROBIT_LED_EVENT_FRONT;
 }
 
+/*
+ * Text consoles get the matrix as a 5x5 grid, one character per LED,
+ * heavier for brighter.  Like the surface, only cells whose level
+ * changed are written and reported.
+ */
+static const char microbit_led_matrix_ramp[] = ":-=+*#%@";
+
+static console_ch_t microbit_led_matrix_text_cell(uint8_t level)
+{
+    int n = sizeof(microbit_led_matrix_ramp) - 1;
+
+    if (!level) {
+        return ATTR2CHTYPE('.', QEMU_COLOR_BLUE, QEMU_COLOR_BLACK, 1);
+    }
+    return ATTR2CHTYPE(microbit_led_matrix_ramp[(level - 1) * n /
+                                                (MICROBIT_LED_LEVELS - 1)],
+                       QEMU_COLOR_RED, QEMU_COLOR_BLACK, 1);
+}
+
 static void microbit_led_matrix_text_update(void *opaque,
                                             console_ch_t *chardata)
 {
     MICROBITLedMatrixState *s = (MICROBITLedMatrixState *)opaque;
-    char buf[5];
+    uint8_t level[MICROBIT_LED_NUM];
+    bool full;
+    int i;
 
-    dpy_text_cursor(s->con, -1, -1);
-    qemu_console_resize(s->con, 4, 1);
+    nrf51_lock();
+    if (!microbit_led_matrix_levels(s, &s->window, level)) {
+        memcpy(level, s->drawn_level, sizeof(level));
+    }
+    nrf51_unlock();
 
-    snprintf(buf, 5, "%04hhx", s->led_state);
-    for (int i = 0; i < 4; i++) {
-        console_write_ch(chardata++, ATTR2CHTYPE(buf[i], QEMU_COLOR_BLUE,
-                                                QEMU_COLOR_BLACK, 1));
+    /* Reset and invalidate leave a graphic-sized surface behind */
+    full = s->led_event != MICROBIT_LED_EVENT_NONE;
+    if (full) {
+        dpy_text_cursor(s->con, -1, -1);
+        qemu_console_resize(s->con, 5, 5);
+    }
+    for (i = 0; i < MICROBIT_LED_NUM; i++) {
+        if (full || level[i] != s->drawn_level[i]) {
+            console_write_ch(&chardata[i],
+                             microbit_led_matrix_text_cell(level[i]));
+            if (!full) {
+                dpy_text_update(s->con, i % 5, i / 5, 1, 1);
+            }
+        }
+    }
+    memcpy(s->drawn_level, level, sizeof(level));
+    s->led_event = MICROBIT_LED_EVENT_NONE;
+    if (full) {
+        dpy_text_update(s->con, 0, 0, 5, 5);
     }
-    dpy_text_update(s->con, 0, 0, 4, 1);
 }
 
 static int microbit_led_matrix_post_load(void *opaque, int version_id)
 {
+    MICROBITLedMatrixState *s = (MICROBITLedMatrixState *)opaque;
+
+    /* Until the guest drives a row again, show nothing lit */
+    s->lit = 0;
+    s->lit_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    microbit_led_matrix_restart(s, &s->window, s->lit_ns);
     microbit_led_matrix_invalidate_display(opaque);
     return 0;
 }
@@ -311,32 +1119,68 @@ static const GraphicHwOps microbit_led_matrix_graph_ops = {
 static void microbit_led_matrix_init(Object *obj)
 {
     MICROBITLedMatrixState *s = MICROBIT_LED_MATRIX(obj);
-    SysBusDevice *dev = SYS_BUS_DEVICE(obj);
 
-    memory_region_init_io(&s->iomem, obj, &microbit_led_matrix_mem_ops,
-                          s, TYPE_MICROBIT_LED_MATRIX, 1);
-    sysbus_init_mmio(dev, &s->iomem);
+    object_property_add_uint32_ptr(obj, "led-state", &s->led_state,
+                                   &error_abort);
 }
 
-static void microbit_led_matrix_realize(DeviceState *dev, Error **errep)
+static void microbit_led_matrix_realize(DeviceState *dev, Error **errp)
 {
     MICROBITLedMatrixState *s = MICROBIT_LED_MATRIX(dev);
+
+    if (!s->gpio) {
+        error_setg(errp, "%s: gpio is required", __func__);
+        return;
+    }
+    s->level_notifier.notify = microbit_led_matrix_levels_changed;
+    nrf51_gpio_add_level_notifier(s->gpio, &s->level_notifier);
+
+    /* No console, surface or refresh callback when streaming */
+    if (qemu_chr_fe_backend_connected(&s->chr) || !s->console) {
+        return;
+    }
     s->con = graphic_console_init(dev, 0, &microbit_led_matrix_graph_ops, s);
 }
 
 static void microbit_led_matrix_reset(DeviceState *d)
 {
     MICROBITLedMatrixState *s = MICROBIT_LED_MATRIX(d);
+    uint32_t old_state = s->led_state;
+    static const uint8_t unlit[MICROBIT_LED_NUM];
+
     s->led_state = 0;
-    s->led_event = MICROBIT_LED_EVENT_BACK | MICROBIT_LED_EVENT_FRONT;
-    qemu_console_resize(s->con, 400, 400);
+    s->lit = 0;
+    s->lit_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    microbit_led_matrix_restart(s, &s->window, s->lit_ns);
+    if (s->con) {
+        DisplaySurface *surf = qemu_console_surface(s->con);
+
+        /* A surface showing all LEDs unlit is already what reset shows */
+        if (memcmp(s->drawn_level, unlit, sizeof(unlit)) ||
+            surface_width(surf) != 400 || surface_height(surf) != 400) {
+            s->led_event = MICROBIT_LED_EVENT_BACK | MICROBIT_LED_EVENT_FRONT;
+        }
+        qemu_console_resize(s->con, 400, 400);
+    } else if (old_state && qemu_chr_fe_backend_connected(&s->chr)) {
+        microbit_led_matrix_stream(s, s->lit_ns, 0, 0);
+    }
+    memset(s->drawn_level, 0, sizeof(s->drawn_level));
 }
 
+static Property microbit_led_matrix_properties[] = {
+    DEFINE_PROP_LINK("gpio", MICROBITLedMatrixState, gpio,
+                     TYPE_NRF51_GPIO, NRF51GPIOState *),
+    DEFINE_PROP_CHR("chardev", MICROBITLedMatrixState, chr),
+    DEFINE_PROP_BOOL("console", MICROBITLedMatrixState, console, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void microbit_led_matrix_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->desc = TYPE_MICROBIT_LED_MATRIX;
+    dc->props = microbit_led_matrix_properties;
     dc->vmsd = &vmstate_microbit_led_matrix;
     dc->reset = microbit_led_matrix_reset;
     dc->realize = microbit_led_matrix_realize;
@@ -350,13 +1194,196 @@ static const TypeInfo microbit_led_matrix_info = {
     .class_init = microbit_led_matrix_class_init,
 };
 
+/**
+ * MICROBIT DASHBOARD
+ *   NOTE: one console showing the LED matrices of all the machine's boards
+ *         in a grid, board n in cell n, left to right and top to bottom,
+ *         so that a single display server and refresh timer follow a
+ *         whole fleet. The matrices get no console of their own. Each
+ *         cell samples its matrix over a window of its own, and only the
+ *         LEDs whose level changed are drawn and reported as damage.
+ */
+
+#define TYPE_MICROBIT_DASHBOARD "microbit_dashboard"
+#define MICROBIT_DASHBOARD(obj) \
+    OBJECT_CHECK(MICROBITDashboardState, (obj), TYPE_MICROBIT_DASHBOARD)
+
+enum {
+    MICROBIT_DASHBOARD_LED_SIZE = 8,
+    MICROBIT_DASHBOARD_LED_SKIP = 4,
+    MICROBIT_DASHBOARD_BORDER = 8,
+    MICROBIT_DASHBOARD_CELL = 2 * MICROBIT_DASHBOARD_BORDER +
+                              5 * MICROBIT_DASHBOARD_LED_SIZE +
+                              4 * MICROBIT_DASHBOARD_LED_SKIP,
+};
+
+typedef struct {
+    MICROBITLedMatrixState *led;
+    MICROBITLedWindow window;
+    uint8_t drawn_level[MICROBIT_LED_NUM];
+} MICROBITDashboardCell;
+
+typedef struct {
+    /* Private */
+    DeviceState parent;
+
+    /* Public */
+    QemuConsole *con;
+    MICROBITDashboardCell *cells;
+    uint32_t num_cells;
+    uint32_t cols;
+    /* The surface must be cleared and drawn again */
+    bool full;
+} MICROBITDashboardState;
+
+static void microbit_dashboard_update_display(void *opaque)
+{
+    MICROBITDashboardState *s = opaque;
+    DisplaySurface *surf = qemu_console_surface(s->con);
+    int bits_per_pixel = surface_bits_per_pixel(surf);
+    uint8_t level[MICROBIT_LED_NUM];
+    bool full = s->full;
+
+    if (full) {
+        int bpp = (bits_per_pixel + 7) >> 3;
+        uint8_t *d = surface_data(surf);
+
+        for (int y = 0; y < surface_height(surf); y++) {
+            memset(d, 0x00, surface_width(surf) * bpp);
+            d += surface_stride(surf);
+        }
+    }
+
+    for (uint32_t n = 0; n < s->num_cells; n++) {
+        MICROBITDashboardCell *cell = &s->cells[n];
+        int x0 = (n % s->cols) * MICROBIT_DASHBOARD_CELL +
+                 MICROBIT_DASHBOARD_BORDER;
+        int y0 = (n / s->cols) * MICROBIT_DASHBOARD_CELL +
+                 MICROBIT_DASHBOARD_BORDER;
+
+        nrf51_lock();
+        if (!microbit_led_matrix_levels(cell->led, &cell->window, level)) {
+            memcpy(level, cell->drawn_level, sizeof(level));
+        }
+        nrf51_unlock();
+
+        for (int i = 0; i < MICROBIT_LED_NUM; i++) {
+            int x, y;
+
+            /* The cleared background already shows every unlit LED */
+            if (full ? !level[i] : level[i] == cell->drawn_level[i]) {
+                continue;
+            }
+            x = x0 + (i % 5) * (MICROBIT_DASHBOARD_LED_SIZE +
+                                MICROBIT_DASHBOARD_LED_SKIP);
+            y = y0 + (i / 5) * (MICROBIT_DASHBOARD_LED_SIZE +
+                                MICROBIT_DASHBOARD_LED_SKIP);
+            microbit_led_matrix_draw_block(surf, x, y,
+                                           x + MICROBIT_DASHBOARD_LED_SIZE - 1,
+                                           y + MICROBIT_DASHBOARD_LED_SIZE - 1,
+                                           microbit_led_matrix_color(
+                                               bits_per_pixel, level[i]));
+            if (!full) {
+                dpy_gfx_update(s->con, x, y, MICROBIT_DASHBOARD_LED_SIZE,
+                               MICROBIT_DASHBOARD_LED_SIZE);
+            }
+        }
+        memcpy(cell->drawn_level, level, sizeof(level));
+    }
+
+    if (full) {
+        s->full = false;
+        dpy_gfx_update(s->con, 0, 0,
+                       surface_width(surf), surface_height(surf));
+    }
+}
+
+static void microbit_dashboard_invalidate_display(void *opaque)
+{
+    MICROBITDashboardState *s = opaque;
+
+    s->full = true;
+}
+
+static const GraphicHwOps microbit_dashboard_graph_ops = {
+    .invalidate  = microbit_dashboard_invalidate_display,
+    .gfx_update  = microbit_dashboard_update_display,
+};
+
+static void microbit_dashboard_realize(DeviceState *dev, Error **errp)
+{
+    MICROBITDashboardState *s = MICROBIT_DASHBOARD(dev);
+    Object *machine = qdev_get_machine();
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    GPtrArray *leds = g_ptr_array_new();
+    uint32_t rows;
+
+    /* The boards are the machine's soc[0], soc[1], ... */
+    for (uint32_t n = 0; ; n++) {
+        char *name = g_strdup_printf("soc[%" PRIu32 "]", n);
+        Object *soc = object_resolve_path_component(machine, name);
+
+        g_free(name);
+        if (!soc) {
+            break;
+        }
+        g_ptr_array_add(leds, object_resolve_path_component(soc,
+                                                            "led-matrix"));
+    }
+    if (!leds->len) {
+        error_setg(errp, "%s: the machine has no micro:bit board", __func__);
+        g_ptr_array_free(leds, true);
+        return;
+    }
+
+    s->num_cells = leds->len;
+    s->cells = g_new0(MICROBITDashboardCell, s->num_cells);
+    s->cols = 1;
+    while (s->cols * s->cols < s->num_cells) {
+        s->cols++;
+    }
+    rows = DIV_ROUND_UP(s->num_cells, s->cols);
+    s->con = graphic_console_init(dev, 0, &microbit_dashboard_graph_ops, s);
+    qemu_console_resize(s->con, s->cols * MICROBIT_DASHBOARD_CELL,
+                        rows * MICROBIT_DASHBOARD_CELL);
+    for (uint32_t n = 0; n < s->num_cells; n++) {
+        MICROBITDashboardCell *cell = &s->cells[n];
+
+        cell->led = MICROBIT_LED_MATRIX(g_ptr_array_index(leds, n));
+        cell->led->dashboard = s->con;
+        microbit_led_matrix_restart(cell->led, &cell->window, now);
+    }
+    g_ptr_array_free(leds, true);
+    s->full = true;
+}
+
+static void microbit_dashboard_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = microbit_dashboard_realize;
+    /* Only the board creates it, from its dashboard option */
+    dc->user_creatable = false;
+}
+
+static const TypeInfo microbit_dashboard_info = {
+    .name          = TYPE_MICROBIT_DASHBOARD,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(MICROBITDashboardState),
+    .class_init    = microbit_dashboard_class_init,
+};
+
 /**
  * NRF51 GPIO
+ *   NOTE: with audio-pin set (micro:bit's edge pin 0 is P0.03), edges
+ *         written to that pin are stamped with virtual time and queued to
+ *         the audio backend's callback, which turns a whole period's worth
+ *         of them into PCM at once, e.g. -global nrf51_gpio.audio-pin=3
  */
 
 #define TYPE_NRF51_GPIO "nrf51_gpio"
 #define NRF51_GPIO(obj) \
-    OBJECT_CHECK(NRF51GPIOState, (obj), TYPE_NRF51_GPIO)
+    OBJECT_CHECK_HOT(NRF51GPIOState, (obj), TYPE_NRF51_GPIO)
 
 enum {
     NRF51_GPIO_OUT       = 0x504,
@@ -433,26 +1460,110 @@ typedef struct {
     uint32_t sense;
 } NRF51GPIOPin;
 
+#define NRF51_GPIO_AUDIO_RATE    32000
+#define NRF51_GPIO_AUDIO_SAMPLE  (NANOSECONDS_PER_SECOND / \
+                                  NRF51_GPIO_AUDIO_RATE)
+/* Edges that fit between two audio callbacks; more are dropped */
+#define NRF51_GPIO_AUDIO_EDGES   4096
+/* How far playback may trail virtual time before it skips ahead */
+#define NRF51_GPIO_AUDIO_LATENCY (100 * SCALE_MS)
+#define NRF51_GPIO_AUDIO_VOLUME  8192
+
+/* An audio pin edge, queued from the vCPU for the audio callback */
+typedef struct {
+    int64_t time;
+    bool level;
+} NRF51GPIOAudioEdge;
+
+/* Pin levels (output pins as driven, inputs as applied) from time on */
 typedef struct {
+    int64_t time;
+    uint32_t level;
+    uint32_t dir;
+} NRF51GPIOCapture;
+
+/* A queued input change, see nrf51_gpio_queue_input() */
+typedef struct {
+    int64_t time;
+    uint64_t seq;
+    uint32_t mask;
+    bool level;
+} NRF51GPIOInjection;
+
+struct NRF51GPIOState {
     /* Private */
     SysBusDevice parent;
 
     /* Public */
     MemoryRegion iomem;
+    /* Notified with the mask of IN bits that changed, 0 for a SENSE change */
+    NotifierList pin_notifiers;
+    /* Notified with the OUT value after each write to it */
+    NotifierList out_notifiers;
+    /* Notified with an NRF51GPIOLevels for each write driving output pins */
+    NotifierList level_notifiers;
     NRF51GPIOPin pin[32];
     uint32_t out;
     uint32_t in;
     uint32_t dir;
-} NRF51GPIOState;
+
+    /* Pending input changes, sorted by time and then by queue order */
+    GArray *injections;
+    uint64_t injection_seq;
+    QEMUTimer *inject_timer;
+    char *script;
+    /* Monitor injections go through the record/replay log */
+    ReplayDeviceState *replay;
+
+    /* Levels driven on the output pins */
+    uint32_t out_level;
+    /* Capture ring of `capture` records, a power of two, when not 0: the
+       vCPU appends under the lock, a dump copies out under the lock */
+    uint32_t capture;
+    NRF51GPIOCapture *capture_ring;
+    uint32_t capture_head;
+
+    /* Audio sink, when audio_pin is not -1 */
+    int32_t audio_pin;
+    QEMUSoundCard card;
+    SWVoiceOut *voice;
+    /* Single producer, single consumer ring: the vCPU advances audio_head,
+       the audio callback audio_tail */
+    NRF51GPIOAudioEdge *audio_edges;
+    unsigned int audio_head;
+    unsigned int audio_tail;
+    /* Last level queued */
+    bool audio_level;
+    /* Playback: level and virtual time reached, DC estimate */
+    bool play_level;
+    int64_t play_ns;
+    int32_t play_dc;
+};
+
+static const VMStateDescription vmstate_nrf51_gpio_pin = {
+    .name = "nrf51_gpio_pin",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(dir, NRF51GPIOPin),
+        VMSTATE_UINT32(input, NRF51GPIOPin),
+        VMSTATE_UINT32(pull, NRF51GPIOPin),
+        VMSTATE_UINT32(drive, NRF51GPIOPin),
+        VMSTATE_UINT32(sense, NRF51GPIOPin),
+        VMSTATE_END_OF_LIST()
+    }
+};
 
 static const VMStateDescription vmstate_nrf51_gpio = {
     .name = TYPE_NRF51_GPIO,
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32(out, NRF51GPIOState),
         VMSTATE_UINT32(in, NRF51GPIOState),
         VMSTATE_UINT32(dir, NRF51GPIOState),
+        VMSTATE_STRUCT_ARRAY(pin, NRF51GPIOState, 32, 2,
+                             vmstate_nrf51_gpio_pin, NRF51GPIOPin),
         VMSTATE_END_OF_LIST()
     }
 };
@@ -461,6 +1572,9 @@ static Property nrf51_gpio_properties[] = {
     DEFINE_PROP_UINT32("out", NRF51GPIOState, out, 0),
     DEFINE_PROP_UINT32("in", NRF51GPIOState, in, 0),
     DEFINE_PROP_UINT32("dir", NRF51GPIOState, dir, 0),
+    DEFINE_PROP_STRING("script", NRF51GPIOState, script),
+    DEFINE_PROP_INT32("audio-pin", NRF51GPIOState, audio_pin, -1),
+    DEFINE_PROP_UINT32("capture", NRF51GPIOState, capture, 0),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -497,1411 +1611,15950 @@ static void nrf51_gpio_pin_dir_update(NRF51GPIOState *s)
     }
 }
 
-static void nrf51_gpio_write_out(NRF51GPIOState *s)
+/* Queue an edge if a write of `value` to the pins in `mask` moves audio_pin */
+static void nrf51_gpio_audio_out(NRF51GPIOState *s, uint32_t mask,
+                                 uint32_t value)
 {
-    AddressSpace *as = cpu_get_address_space(CPU(first_cpu), 0);
-    if (s->out & 0x0000FFF0) {
-        stw_phys(as, 0x40020000, s->out & 0x0000FFF0);
+    NRF51GPIOAudioEdge *e;
+    unsigned int head;
+    bool level;
+
+    if (!s->voice || !extract32(mask, s->audio_pin, 1)) {
+        return;
+    }
+    level = extract32(value, s->audio_pin, 1);
+    if (level == s->audio_level) {
+        return;
+    }
+    s->audio_level = level;
+    head = s->audio_head;
+    if (head - atomic_load_acquire(&s->audio_tail) == NRF51_GPIO_AUDIO_EDGES) {
+        return;
     }
-    s->out = 0;
+    e = &s->audio_edges[head % NRF51_GPIO_AUDIO_EDGES];
+    e->time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    e->level = level;
+    atomic_store_release(&s->audio_head, head + 1);
 }
 
-static void nrf51_gpio_read_in(NRF51GPIOState *s)
+/* The edge at `tail` if it was queued and comes before `limit`, or NULL */
+static NRF51GPIOAudioEdge *nrf51_gpio_audio_peek(NRF51GPIOState *s,
+                                                 unsigned int tail,
+                                                 unsigned int head,
+                                                 int64_t limit)
 {
-    /* TODO: update */
+    NRF51GPIOAudioEdge *e;
+
+    if (tail == head) {
+        return NULL;
+    }
+    e = &s->audio_edges[tail % NRF51_GPIO_AUDIO_EDGES];
+    return e->time < limit ? e : NULL;
 }
 
-static uint64_t nrf51_gpio_read(void *opaque, hwaddr offset,
-                                unsigned size)
+/**
+ * Synthesise as much of the square wave as virtual time has produced, up
+ * to what the backend can take. Each sample is the time the pin was high
+ * during it, so edges between samples are not lost, followed by a DC
+ * blocker so a pin left high is silent.
+ */
+static void nrf51_gpio_audio_callback(void *opaque, int free)
 {
-    NRF51GPIOState *s = (NRF51GPIOState *)opaque;
+    NRF51GPIOState *s = NRF51_GPIO(opaque);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    unsigned int head = atomic_load_acquire(&s->audio_head);
+    unsigned int tail = s->audio_tail;
+    NRF51GPIOAudioEdge *e;
+    int16_t buf[512];
+    int64_t todo;
+    int n, i;
 
-    switch (offset) {
-        case NRF51_GPIO_OUT:
-        case NRF51_GPIO_OUTSET:
-        case NRF51_GPIO_OUTCLR:
-            return s->out;
-        case NRF51_GPIO_IN:
-            nrf51_gpio_read_in(s);
-            return s->in;
-        case NRF51_GPIO_DIR:
-        case NRF51_GPIO_DIRSET:
-        case NRF51_GPIO_DIRCLR:
-            return s->dir;
-        case NRF51_GPIO_PIN_CNF0:
-        case NRF51_GPIO_PIN_CNF1:
-        case NRF51_GPIO_PIN_CNF2:
-        case NRF51_GPIO_PIN_CNF3:
-        case NRF51_GPIO_PIN_CNF4:
-        case NRF51_GPIO_PIN_CNF5:
-        case NRF51_GPIO_PIN_CNF6:
-        case NRF51_GPIO_PIN_CNF7:
-        case NRF51_GPIO_PIN_CNF8:
-        case NRF51_GPIO_PIN_CNF9:
-        case NRF51_GPIO_PIN_CNF10:
-        case NRF51_GPIO_PIN_CNF11:
-        case NRF51_GPIO_PIN_CNF12:
-        case NRF51_GPIO_PIN_CNF13:
-        case NRF51_GPIO_PIN_CNF14:
-        case NRF51_GPIO_PIN_CNF15:
-        case NRF51_GPIO_PIN_CNF16:
-        case NRF51_GPIO_PIN_CNF17:
-        case NRF51_GPIO_PIN_CNF18:
-        case NRF51_GPIO_PIN_CNF19:
-        case NRF51_GPIO_PIN_CNF20:
-        case NRF51_GPIO_PIN_CNF21:
-        case NRF51_GPIO_PIN_CNF22:
-        case NRF51_GPIO_PIN_CNF23:
-        case NRF51_GPIO_PIN_CNF24:
-        case NRF51_GPIO_PIN_CNF25:
-        case NRF51_GPIO_PIN_CNF26:
-        case NRF51_GPIO_PIN_CNF27:
-        case NRF51_GPIO_PIN_CNF28:
-        case NRF51_GPIO_PIN_CNF29:
-        case NRF51_GPIO_PIN_CNF30:
-        case NRF51_GPIO_PIN_CNF31:
-            return nrf51_gpio_pin_cnf_read(&s->pin[(offset >> 2) & 0x1f]);
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                            "%s: reading a bad offset 0x%x\n",
-                            __func__,
-                            (int)offset);
-            return 0;
-    };
-}
+    if (now - s->play_ns > NRF51_GPIO_AUDIO_LATENCY) {
+        s->play_ns = now - NRF51_GPIO_AUDIO_LATENCY;
+        while ((e = nrf51_gpio_audio_peek(s, tail, head, s->play_ns))) {
+            s->play_level = e->level;
+            tail++;
+        }
+    }
+    todo = MIN(free / (int)sizeof(int16_t),
+               (now - s->play_ns) / NRF51_GPIO_AUDIO_SAMPLE);
 
-static void nrf51_gpio_write(void *opaque, hwaddr offset,
-                             uint64_t value, unsigned size)
-{
-    NRF51GPIOState *s = (NRF51GPIOState *)opaque;
-    int index;
+    while (todo > 0) {
+        n = MIN(todo, ARRAY_SIZE(buf));
+        for (i = 0; i < n; i++) {
+            int64_t end = s->play_ns + NRF51_GPIO_AUDIO_SAMPLE;
+            int64_t t = s->play_ns, high = 0;
+            int32_t x;
 
-    switch (offset) {
-        case NRF51_GPIO_OUT:
-            s->out = value & s->dir;
-            nrf51_gpio_write_out(s);
-            break;
-        case NRF51_GPIO_OUTSET:
-            s->out |= value & s->dir;
-            nrf51_gpio_write_out(s);
-            break;
-        case NRF51_GPIO_OUTCLR:
-            s->out &= ~((uint32_t)value) & s->dir;
-            nrf51_gpio_write_out(s);
-            break;
-        case NRF51_GPIO_DIR:
-            s->dir = value;
-            nrf51_gpio_pin_dir_update(s);
-            break;
-        case NRF51_GPIO_DIRSET:
-            s->dir |= value;
-            nrf51_gpio_pin_dir_update(s);
-            break;
-        case NRF51_GPIO_DIRCLR:
-            s->dir &= ~((uint32_t)value);
-            nrf51_gpio_pin_dir_update(s);
-            break;
-        case NRF51_GPIO_PIN_CNF0:
-        case NRF51_GPIO_PIN_CNF1:
-        case NRF51_GPIO_PIN_CNF2:
-        case NRF51_GPIO_PIN_CNF3:
-        case NRF51_GPIO_PIN_CNF4:
-        case NRF51_GPIO_PIN_CNF5:
-        case NRF51_GPIO_PIN_CNF6:
-        case NRF51_GPIO_PIN_CNF7:
-        case NRF51_GPIO_PIN_CNF8:
-        case NRF51_GPIO_PIN_CNF9:
-        case NRF51_GPIO_PIN_CNF10:
-        case NRF51_GPIO_PIN_CNF11:
-        case NRF51_GPIO_PIN_CNF12:
-        case NRF51_GPIO_PIN_CNF13:
-        case NRF51_GPIO_PIN_CNF14:
-        case NRF51_GPIO_PIN_CNF15:
-        case NRF51_GPIO_PIN_CNF16:
-        case NRF51_GPIO_PIN_CNF17:
-        case NRF51_GPIO_PIN_CNF18:
-        case NRF51_GPIO_PIN_CNF19:
-        case NRF51_GPIO_PIN_CNF20:
-        case NRF51_GPIO_PIN_CNF21:
-        case NRF51_GPIO_PIN_CNF22:
-        case NRF51_GPIO_PIN_CNF23:
-        case NRF51_GPIO_PIN_CNF24:
-        case NRF51_GPIO_PIN_CNF25:
-        case NRF51_GPIO_PIN_CNF26:
-        case NRF51_GPIO_PIN_CNF27:
-        case NRF51_GPIO_PIN_CNF28:
-        case NRF51_GPIO_PIN_CNF29:
-        case NRF51_GPIO_PIN_CNF30:
-        case NRF51_GPIO_PIN_CNF31:
-            index = (offset >> 2) & 0x1f;
-            s->dir |= (value & 1) << index;
-            nrf51_gpio_pin_cnf_write(&s->pin[index], value);
-            break;
-        case NRF51_GPIO_IN:
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                            "%s: writing a bad offset 0x%x\n",
-                            __func__,
-                            (int)offset);
+            while ((e = nrf51_gpio_audio_peek(s, tail, head, end))) {
+                if (e->time > t) {
+                    high += s->play_level ? e->time - t : 0;
+                    t = e->time;
+                }
+                s->play_level = e->level;
+                tail++;
+            }
+            high += s->play_level ? end - t : 0;
+            s->play_ns = end;
+
+            x = (2 * high - NRF51_GPIO_AUDIO_SAMPLE) *
+                NRF51_GPIO_AUDIO_VOLUME / NRF51_GPIO_AUDIO_SAMPLE;
+            s->play_dc += (x - s->play_dc) / 256;
+            buf[i] = x - s->play_dc;
+        }
+        if (AUD_write(s->voice, buf, n * sizeof(int16_t)) !=
+            n * sizeof(int16_t)) {
             break;
-    };
+        }
+        todo -= n;
+    }
+    atomic_store_release(&s->audio_tail, tail);
 }
 
-static const MemoryRegionOps nrf51_gpio_ops = {
-    .read = nrf51_gpio_read,
-    .write = nrf51_gpio_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
+/* Record the pin levels, if they or the directions changed */
+static void nrf51_gpio_capture(NRF51GPIOState *s)
+{
+    uint32_t level = (s->out_level & s->dir) | (s->in & ~s->dir);
+    uint32_t head = s->capture_head;
+    NRF51GPIOCapture *c;
 
-static void nrf51_gpio_init(Object *obj)
+    if (!s->capture_ring) {
+        return;
+    }
+    c = &s->capture_ring[(head - 1) & (s->capture - 1)];
+    if (head && c->level == level && c->dir == s->dir) {
+        return;
+    }
+    c = &s->capture_ring[head & (s->capture - 1)];
+    c->time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    c->level = level;
+    c->dir = s->dir;
+    s->capture_head = head + 1;
+}
+
+/* Pins in `mask` are driven to the levels in `value` */
+static void nrf51_gpio_drive(NRF51GPIOState *s, uint32_t mask, uint32_t value)
 {
-    NRF51GPIOState *s = NRF51_GPIO(obj);
-    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+    NRF51GPIOLevels levels = { mask, value };
 
-    memory_region_init_io(&s->iomem, obj, &nrf51_gpio_ops, s,
-                          TYPE_NRF51_GPIO, 0x1000);
-    sysbus_init_mmio(sdb, &s->iomem);
+    nrf51_gpio_audio_out(s, mask, value);
+    s->out_level = (s->out_level & ~mask) | (value & mask);
+    nrf51_gpio_capture(s);
+    notifier_list_notify(&s->level_notifiers, &levels);
 }
 
-static void nrf51_gpio_class_init(ObjectClass *klass, void *data)
+static void nrf51_gpio_write_out(NRF51GPIOState *s)
 {
-    DeviceClass *dc = DEVICE_CLASS(klass);
-    dc->props = nrf51_gpio_properties;
-    dc->vmsd = &vmstate_nrf51_gpio;
+    notifier_list_notify(&s->out_notifiers, &s->out);
 }
 
-static const TypeInfo nrf51_gpio_info = {
-    .name          = TYPE_NRF51_GPIO,
-    .parent        = TYPE_SYS_BUS_DEVICE,
-    .instance_size = sizeof(NRF51GPIOState),
-    .instance_init = nrf51_gpio_init,
-    .class_init    = nrf51_gpio_class_init,
-};
+static void nrf51_gpio_read_in(NRF51GPIOState *s)
+{
+    /* IN is kept current by nrf51_gpio_set_input() */
+}
 
-/**
- * NRF51 RNG
- *   Random Number Generator
- *   NOTE: ought to raise irq, but microbit does not handle it
- *         so ommit the irq implementation
- */
+/* DETECT is the OR of every pin whose level matches its SENSE setting */
+static bool nrf51_gpio_detect(NRF51GPIOState *s)
+{
+    for (int i = 0; i < 32; i++) {
+        bool level = extract32(s->in, i, 1);
 
-#define TYPE_NRF51_RNG "nrf51_rng"
-#define NRF51_RNG(obj) \
-    OBJECT_CHECK(NRF51RNGState, (obj), TYPE_NRF51_RNG)
+        if ((s->pin[i].sense == PIN_CNF_SENSE_HIGH && level) ||
+            (s->pin[i].sense == PIN_CNF_SENSE_LOW && !level)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-enum {
-    NRF51_RNG_START    = 0x000,
-    NRF51_RNG_STOP     = 0x004,
-    NRF51_RNG_VALRDY   = 0x100,
-    NRF51_RNG_SHORTS   = 0x200,
-    NRF51_RNG_INTEN    = 0x300,
-    NRF51_RNG_INTENSET = 0x304,
-    NRF51_RNG_INTENCLR = 0x308,
-    NRF51_RNG_CONFIG   = 0x504,
-    NRF51_RNG_VALUE    = 0x508,
-};
+static void nrf51_gpio_notify(NRF51GPIOState *s, uint32_t changed)
+{
+    notifier_list_notify(&s->pin_notifiers, &changed);
+}
 
-typedef struct {
-    /* Private */
-    SysBusDevice parent;
-
-    /* Public */
-    MemoryRegion iomem;
-    uint8_t value;
-    uint32_t config;
-    bool ready;
-    bool started;
-} NRF51RNGState;
+static void nrf51_gpio_apply_input(NRF51GPIOState *s, uint32_t mask,
+                                   bool level)
+{
+    uint32_t old = s->in;
 
-static const VMStateDescription vmstate_nrf51_rng = {
-    .name = TYPE_NRF51_RNG,
-    .version_id = 1,
-    .minimum_version_id = 1,
-    .fields = (VMStateField[]) {
-        VMSTATE_UINT8(value, NRF51RNGState),
-        VMSTATE_UINT32(config, NRF51RNGState),
-        VMSTATE_BOOL(ready, NRF51RNGState),
-        VMSTATE_BOOL(started, NRF51RNGState),
-        VMSTATE_END_OF_LIST()
+    s->in = level ? (s->in | mask) : (s->in & ~mask);
+    if (s->in != old) {
+        nrf51_gpio_capture(s);
+        nrf51_gpio_notify(s, s->in ^ old);
     }
-};
+}
 
-static Property nrf51_rng_properties[] = {
-    DEFINE_PROP_UINT8("value", NRF51RNGState, value, 0),
-    DEFINE_PROP_UINT32("config", NRF51RNGState, config, 0),
-    DEFINE_PROP_BOOL("ready", NRF51RNGState, ready, false),
-    DEFINE_PROP_BOOL("started", NRF51RNGState, started, false),
-    DEFINE_PROP_END_OF_LIST()
-};
+/* Input line handler: `level` is the level applied to pin `n` */
+static void nrf51_gpio_set_input(void *opaque, int n, int level)
+{
+    NRF51GPIOState *s = NRF51_GPIO(opaque);
 
-static uint64_t nrf51_rng_read(void *opaque, hwaddr offset,
-                               unsigned size)
+    nrf51_lock();
+    nrf51_gpio_apply_input(s, 1u << n, level);
+    nrf51_unlock();
+}
+
+static gint nrf51_gpio_injection_cmp(gconstpointer a, gconstpointer b)
 {
-    NRF51RNGState *s = (NRF51RNGState *)opaque;
+    const NRF51GPIOInjection *ia = a;
+    const NRF51GPIOInjection *ib = b;
 
-    switch (offset) {
-        case NRF51_RNG_START:
-            return s->started;
-        case NRF51_RNG_STOP:
-            return s->started;
-        case NRF51_RNG_VALRDY:
-            /* Always ready, actually generated when reading VALUE*/
-            return (s->started) && 1; 
-        case NRF51_RNG_SHORTS:
-        case NRF51_RNG_INTEN:
-        case NRF51_RNG_INTENSET:
-        case NRF51_RNG_INTENCLR:
-            qemu_log_mask(LOG_UNIMP,
-                          "%s: writing unimp offset 0x%x\n",
-                          __func__,
-                          (int)offset);
-            return 0;
-        case NRF51_RNG_VALUE:
-            qcrypto_random_bytes(&s->value, 1, &error_fatal);
-            return s->value;
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                            "%s: reading a bad offset 0x%x\n",
-                            __func__,
-                            (int)offset);
-            return 0;
+    if (ia->time != ib->time) {
+        return ia->time < ib->time ? -1 : 1;
     }
+    return ia->seq < ib->seq ? -1 : ia->seq > ib->seq;
 }
 
-static void nrf51_rng_write(void *opaque, hwaddr offset,
-                            uint64_t value, unsigned size)
+static void nrf51_gpio_inject_rearm(NRF51GPIOState *s)
 {
-    NRF51RNGState *s = (NRF51RNGState *)opaque;
+    if (s->injections->len) {
+        timer_mod(s->inject_timer,
+                  g_array_index(s->injections, NRF51GPIOInjection, 0).time);
+    } else {
+        timer_del(s->inject_timer);
+    }
+}
 
-    switch (offset) {
-        case NRF51_RNG_START:
-            s->started = true;
-            break;
-        case NRF51_RNG_STOP:
-            s->started = false;
-            break;
-        case NRF51_RNG_CONFIG:
-            s->config = value & 1;
-            break;
-        case NRF51_RNG_SHORTS:
-        case NRF51_RNG_INTEN:
-        case NRF51_RNG_INTENSET:
-        case NRF51_RNG_INTENCLR:
-        case NRF51_RNG_VALRDY:
-            qemu_log_mask(LOG_UNIMP,
-                          "%s: writing unimp offset 0x%x\n",
-                          __func__,
-                          (int)offset);
-            break;
-        case NRF51_RNG_VALUE:
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                            "%s: writing a bad offset 0x%x\n",
-                            __func__,
-                            (int)offset);
+static void nrf51_gpio_inject_expire(void *opaque)
+{
+    NRF51GPIOState *s = NRF51_GPIO(opaque);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    guint n;
+
+    for (n = 0; n < s->injections->len; n++) {
+        NRF51GPIOInjection *e = &g_array_index(s->injections,
+                                               NRF51GPIOInjection, n);
+        if (e->time > now) {
             break;
+        }
+        nrf51_gpio_apply_input(s, e->mask, e->level);
     }
+    g_array_remove_range(s->injections, 0, n);
+    nrf51_gpio_inject_rearm(s);
 }
 
-static const MemoryRegionOps nrf51_rng_ops = {
-    .read = nrf51_rng_read,
-    .write = nrf51_rng_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
+/*
+ * Queue an input change at virtual time `time`. Callers queue a whole
+ * batch and then call nrf51_gpio_inject_commit() once.
+ */
+static void nrf51_gpio_queue_input(NRF51GPIOState *s, int64_t time,
+                                   uint32_t mask, bool level)
+{
+    NRF51GPIOInjection e = {
+        .time = time,
+        .seq = s->injection_seq++,
+        .mask = mask,
+        .level = level,
+    };
 
-static void nrf51_rng_init(Object *obj)
+    g_array_append_val(s->injections, e);
+}
+
+static void nrf51_gpio_inject_commit(NRF51GPIOState *s)
 {
-    NRF51RNGState *s = NRF51_RNG(obj);
-    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+    g_array_sort(s->injections, nrf51_gpio_injection_cmp);
+    nrf51_gpio_inject_rearm(s);
+}
 
-    memory_region_init_io(&s->iomem, obj, &nrf51_rng_ops, s,
-                          TYPE_NRF51_RNG, 0x1000);
-    sysbus_init_mmio(sdb, &s->iomem);
+/*
+ * The script holds one "<time-ns> <mask> <level>" change per line, in
+ * absolute virtual time; blank lines and lines starting with '#' are
+ * skipped. Numbers may be given in decimal, hex (0x) or octal (0).
+ */
+static bool nrf51_gpio_load_script(NRF51GPIOState *s, Error **errp)
+{
+    GError *gerr = NULL;
+    gchar *contents;
+    gchar **lines;
+    bool ok = true;
+    int i;
+
+    if (!g_file_get_contents(s->script, &contents, NULL, &gerr)) {
+        error_setg(errp, "%s: cannot read script %s: %s",
+                   __func__, s->script, gerr->message);
+        g_error_free(gerr);
+        return false;
+    }
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        char *line = g_strstrip(lines[i]);
+        int64_t time, mask;
+        int level;
+
+        if (*line == '\0' || *line == '#') {
+            continue;
+        }
+        if (sscanf(line, "%" SCNi64 " %" SCNi64 " %i",
+                   &time, &mask, &level) != 3 ||
+            time < 0 || mask < 0 || mask > UINT32_MAX ||
+            (level != 0 && level != 1)) {
+            error_setg(errp, "%s: %s:%d: expected <time-ns> <mask> <0|1>",
+                       __func__, s->script, i + 1);
+            ok = false;
+            break;
+        }
+        nrf51_gpio_queue_input(s, time, mask, level);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return ok;
 }
 
-static void nrf51_rng_class_init(ObjectClass *klass, void *data)
+/* Levels driven on the output pins, for the LED matrix */
+static uint32_t nrf51_gpio_out_level(NRF51GPIOState *s)
 {
-    DeviceClass *dc = DEVICE_CLASS(klass);
-    dc->props = nrf51_rng_properties;
-    dc->vmsd = &vmstate_nrf51_rng;
+    return s->out_level;
 }
 
-static const TypeInfo nrf51_rng_info = {
-    .name          = TYPE_NRF51_RNG,
-    .parent        = TYPE_SYS_BUS_DEVICE,
-    .instance_size = sizeof(NRF51RNGState),
-    .instance_init = nrf51_rng_init,
-    .class_init    = nrf51_rng_class_init,
-};
+/* n is called with an NRF51GPIOLevels each time output pins are driven */
+static void nrf51_gpio_add_level_notifier(NRF51GPIOState *s, Notifier *n)
+{
+    notifier_list_add(&s->level_notifiers, n);
+}
 
-/**
- * NRF51 NVMC
- *   Non-Volatile Memory Controller
- */
+/* Drive an output pin on behalf of another peripheral, e.g. GPIOTE */
+static void nrf51_gpio_drive_pin(NRF51GPIOState *s, uint32_t pin, bool level)
+{
+    nrf51_gpio_drive(s, 1u << pin, level ? ~0u : 0);
+    s->out = deposit32(s->out, pin, 1, level);
+    nrf51_gpio_write_out(s);
+}
 
-#define TYPE_NRF51_NVMC "nrf51_nvmc"
-#define NRF51_NVMC(obj) \
-    OBJECT_CHECK(NRF51NVMCState, (obj), TYPE_NRF51_NVMC)
+static uint64_t nrf51_gpio_in_read(void *opaque, hwaddr offset)
+{
+    NRF51GPIOState *s = (NRF51GPIOState *)opaque;
 
-enum{
-    NRF51_NVMC_READY     = 0x400,
-    NRF51_NVMC_CONFIG    = 0x504,
-    NRF51_NVMC_ERASEPAGE = 0x508,
-    NRF51_NVMC_ERASEPCR1 = 0x508,
-    NRF51_NVMC_ERASEALL  = 0x50C,
-    NRF51_NVMC_ERASEPCR0 = 0x510,
-    NRF51_NVMC_ERASEUICR = 0x514,
-};
+    nrf51_gpio_read_in(s);
+    return s->in;
+}
 
-typedef struct {
-    /* Private */
-    SysBusDevice parent;
+static uint64_t nrf51_gpio_pin_cnf_reg_read(void *opaque, hwaddr offset)
+{
+    NRF51GPIOState *s = (NRF51GPIOState *)opaque;
 
-    /* Public */
-    MemoryRegion iomem;
-    uint32_t ready;
-    uint32_t config;
-} NRF51NVMCState;
+    return nrf51_gpio_pin_cnf_read(&s->pin[(offset >> 2) & 0x1f]);
+}
 
-static uint64_t nrf51_nvmc_read(void *opaque, hwaddr offset,
-                                unsigned size)
+static void nrf51_gpio_out_write(void *opaque, hwaddr offset,
+                                 uint64_t value)
 {
-    NRF51NVMCState *s = (NRF51NVMCState *)opaque;
-    
+    NRF51GPIOState *s = (NRF51GPIOState *)opaque;
+
     switch (offset) {
-        case NRF51_NVMC_READY:
-            return s->ready;
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                            "%s: reading a bad offset 0x%x\n",
-                            __func__,
-                            (int)offset);
-            return 0;
+        case NRF51_GPIO_OUT:
+            nrf51_gpio_drive(s, s->dir, value);
+            s->out = value & s->dir;
+            break;
+        case NRF51_GPIO_OUTSET:
+            nrf51_gpio_drive(s, value & s->dir, ~0u);
+            s->out |= value & s->dir;
+            break;
+        case NRF51_GPIO_OUTCLR:
+            nrf51_gpio_drive(s, value & s->dir, 0);
+            s->out &= ~((uint32_t)value) & s->dir;
+            break;
     }
+    nrf51_gpio_write_out(s);
 }
 
-static void nrf51_nvmc_write(void *opaque, hwaddr offset,
-                             uint64_t value, unsigned size)
+static void nrf51_gpio_dir_write(void *opaque, hwaddr offset,
+                                 uint64_t value)
 {
-    NRF51NVMCState *s = (NRF51NVMCState *)opaque;
-    
+    NRF51GPIOState *s = (NRF51GPIOState *)opaque;
+
     switch (offset) {
-        case NRF51_NVMC_CONFIG:
-            s->config = value;
+        case NRF51_GPIO_DIR:
+            s->dir = value;
             break;
-        case NRF51_NVMC_READY:
-        case NRF51_NVMC_ERASEPAGE:
-        /* case NRF51_NVMC_ERASEPCR1: OVERLAPPED */
-        case NRF51_NVMC_ERASEALL:
-        case NRF51_NVMC_ERASEPCR0:
-        case NRF51_NVMC_ERASEUICR:
-            qemu_log_mask(LOG_UNIMP,
-                          "%s: writing unimp offset 0x%x\n",
-                          __func__,
-                          (int)offset);
+        case NRF51_GPIO_DIRSET:
+            s->dir |= value;
             break;
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                            "%s: writing a bad offset 0x%x\n",
-                            __func__,
-                            (int)offset);
+        case NRF51_GPIO_DIRCLR:
+            s->dir &= ~((uint32_t)value);
             break;
     }
+    nrf51_gpio_pin_dir_update(s);
+    nrf51_gpio_capture(s);
 }
 
-static const MemoryRegionOps nrf51_nvmc_ops = {
-    .read = nrf51_nvmc_read,
-    .write = nrf51_nvmc_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
+static void nrf51_gpio_pin_cnf_reg_write(void *opaque, hwaddr offset,
+                                         uint64_t value)
+{
+    NRF51GPIOState *s = (NRF51GPIOState *)opaque;
+    int index = (offset >> 2) & 0x1f;
 
-static const VMStateDescription vmstate_nrf51_nvmc = {
-    .name = TYPE_NRF51_NVMC,
-    .version_id = 1,
-    .minimum_version_id = 1,
-    .fields = (VMStateField[]) {
-        VMSTATE_UINT32(ready, NRF51NVMCState),
-        VMSTATE_UINT32(config, NRF51NVMCState),
-        VMSTATE_END_OF_LIST()
-    }
+    s->dir |= (value & 1) << index;
+    nrf51_gpio_pin_cnf_write(&s->pin[index], value);
+    nrf51_gpio_capture(s);
+    nrf51_gpio_notify(s, 0);
+}
+
+static const NRF51Reg nrf51_gpio_regs[] = {
+    NRF51_REG_ARRAY(NRF51_GPIO_OUT, NRF51_GPIO_OUTCLR) = {
+        NRF51_FIELD(NRF51GPIOState, out, 0),
+        .write = nrf51_gpio_out_write,
+    },
+    NRF51_REG(NRF51_GPIO_IN) = {
+        .read = nrf51_gpio_in_read,
+    },
+    NRF51_REG_ARRAY(NRF51_GPIO_DIR, NRF51_GPIO_DIRCLR) = {
+        NRF51_FIELD(NRF51GPIOState, dir, 0),
+        .write = nrf51_gpio_dir_write,
+    },
+    NRF51_REG_ARRAY(NRF51_GPIO_PIN_CNF0, NRF51_GPIO_PIN_CNF31) = {
+        .read = nrf51_gpio_pin_cnf_reg_read,
+        .write = nrf51_gpio_pin_cnf_reg_write,
+    },
 };
 
-static Property nrf51_nvmc_properties[] = {
-    DEFINE_PROP_UINT32("ready", NRF51NVMCState, ready, 1),
-    DEFINE_PROP_UINT32("config", NRF51NVMCState, config, 0),
-    DEFINE_PROP_END_OF_LIST()
+static uint64_t nrf51_gpio_read(void *opaque, hwaddr offset,
+                                unsigned size)
+{
+    return nrf51_regs_read(opaque, nrf51_gpio_regs,
+                           ARRAY_SIZE(nrf51_gpio_regs), 0, offset);
+}
+
+static void nrf51_gpio_write(void *opaque, hwaddr offset,
+                             uint64_t value, unsigned size)
+{
+    nrf51_regs_write(opaque, nrf51_gpio_regs,
+                     ARRAY_SIZE(nrf51_gpio_regs), 0, offset, value);
+}
+
+static const MemoryRegionOps nrf51_gpio_ops = {
+    .read = nrf51_gpio_read,
+    .write = nrf51_gpio_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
-static void nrf51_nvmc_init(Object *obj)
+static void nrf51_gpio_init(Object *obj)
 {
-    NRF51NVMCState *s = NRF51_NVMC(obj);
+    NRF51GPIOState *s = NRF51_GPIO(obj);
     SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
 
-    memory_region_init_io(&s->iomem, obj, &nrf51_nvmc_ops, s,
-                          TYPE_NRF51_NVMC, 0x1000);
+    nrf51_init_io(&s->iomem, obj, &nrf51_gpio_ops, s,
+                  TYPE_NRF51_GPIO, 0x1000);
+    nrf51_io_set_bql_free(&s->iomem);
     sysbus_init_mmio(sdb, &s->iomem);
+    notifier_list_init(&s->pin_notifiers);
+    notifier_list_init(&s->out_notifiers);
+    notifier_list_init(&s->level_notifiers);
+    qdev_init_gpio_in(DEVICE(obj), nrf51_gpio_set_input, 32);
+    s->injections = g_array_new(FALSE, FALSE, sizeof(NRF51GPIOInjection));
 }
 
-static void nrf51_nvmc_class_init(ObjectClass *klass, void *data)
+/* A batch is a relative flag byte, then time, mask and level per change */
+#define NRF51_GPIO_REPLAY_EVENT_SIZE 13
+
+static void nrf51_gpio_replay_inject(void *opaque, const uint8_t *data,
+                                     size_t size)
 {
-    DeviceClass *dc = DEVICE_CLASS(klass);
-    dc->props = nrf51_nvmc_properties;
-    dc->vmsd = &vmstate_nrf51_nvmc;
+    NRF51GPIOState *s = NRF51_GPIO(opaque);
+    int64_t base = 0;
+    size_t n;
+
+    nrf51_lock();
+    if (size && data[0]) {
+        base = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    }
+    for (n = 1; n + NRF51_GPIO_REPLAY_EVENT_SIZE <= size;
+         n += NRF51_GPIO_REPLAY_EVENT_SIZE) {
+        nrf51_gpio_queue_input(s, base + ldq_le_p(data + n),
+                               ldl_le_p(data + n + 8), data[n + 12]);
+    }
+    nrf51_gpio_inject_commit(s);
+    nrf51_unlock();
 }
 
-static const TypeInfo nrf51_nvmc_info = {
-    .name          = TYPE_NRF51_NVMC,
-    .parent        = TYPE_SYS_BUS_DEVICE,
-    .instance_size = sizeof(NRF51NVMCState),
-    .instance_init = nrf51_nvmc_init,
-    .class_init    = nrf51_nvmc_class_init,
-};
+static void nrf51_gpio_realize(DeviceState *dev, Error **errp)
+{
+    NRF51GPIOState *s = NRF51_GPIO(dev);
 
-/**
- * NRF51 FICR
- */
+    s->inject_timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                             nrf51_gpio_inject_expire, s);
+    s->replay = replay_register_device(nrf51_gpio_replay_inject, s);
+    if (s->script && !nrf51_gpio_load_script(s, errp)) {
+        return;
+    }
+    nrf51_gpio_inject_commit(s);
 
-#define TYPE_NRF51_FICR "nrf51_ficr"
-#define NRF51_FICR(obj) \
-    OBJECT_CHECK(NRF51FICRState, (obj), TYPE_NRF51_FICR)
+    if (s->capture) {
+        if (s->capture & (s->capture - 1)) {
+            error_setg(errp, "%s: capture must be a power of two", __func__);
+            return;
+        }
+        s->capture_ring = g_new0(NRF51GPIOCapture, s->capture);
+    }
 
-enum{
-    NRF51_FICR_CODEPAGESIZE = 0x010,
-    NRF51_FICR_CODESIZE = 0x014,
-    NRF51_FICR_CLENR0 = 0x028,
-    NRF51_FICR_PPFC = 0x02C,
-    NRF51_FICR_NUMRAMBLOCK = 0x034,
-    NRF51_FICR_SIZERAMBLOCKS = 0x038,
-    NRF51_FICR_SIZERAMBLOCK0 = 0x038,
-    NRF51_FICR_SIZERAMBLOCK1 = 0x03C,
-    NRF51_FICR_SIZERAMBLOCK2 = 0x040,
-    NRF51_FICR_SIZERAMBLOCK3 = 0x044,
-    NRF51_FICR_CONFIGID = 0x05C,
-    NRF51_FICR_DEVICEID0 = 0x060,
-    NRF51_FICR_DEVICEID1 = 0x064,
-    NRF51_FICR_ER0 = 0x080,
-    NRF51_FICR_ER1 = 0x084,
-    NRF51_FICR_ER2 = 0x088,
-    NRF51_FICR_ER3 = 0x08C,
-    NRF51_FICR_IR0 = 0x090,
-    NRF51_FICR_IR1 = 0x094,
-    NRF51_FICR_IR2 = 0x098,
-    NRF51_FICR_IR3 = 0x09C,
-    NRF51_FICR_DEVICEADDRTYPE = 0x0A0,
-    NRF51_FICR_DEVICEADDR0 = 0x0A4,
-    NRF51_FICR_DEVICEADDR1 = 0x0A8,
-    NRF51_FICR_OVERRIDEEN = 0x0AC,
-    NRF51_FICR_NRF_1MBIT0 = 0x0B0,
-    NRF51_FICR_NRF_1MBIT1 = 0x0B4,
-    NRF51_FICR_NRF_1MBIT2 = 0x0B8,
-    NRF51_FICR_NRF_1MBIT3 = 0x0BC,
-    NRF51_FICR_NRF_1MBIT4 = 0x0C0,
-    NRF51_FICR_BLE_1MBIT0 = 0x0EC,
-    NRF51_FICR_BLE_1MBIT1 = 0x0F0,
-    NRF51_FICR_BLE_1MBIT2 = 0x0F4,
-    NRF51_FICR_BLE_1MBIT3 = 0x0F8,
-    NRF51_FICR_BLE_1MBIT4 = 0x0FC,
-};
+    if (s->audio_pin != -1) {
+        struct audsettings as = {
+            NRF51_GPIO_AUDIO_RATE, 1, AUD_FMT_S16, AUDIO_HOST_ENDIANNESS
+        };
 
-typedef struct {
-    /* Private */
-    SysBusDevice parent;
+        if (s->audio_pin < 0 || s->audio_pin >= 32) {
+            error_setg(errp, "%s: audio-pin must be -1 or 0..31", __func__);
+            return;
+        }
+        AUD_register_card(TYPE_NRF51_GPIO, &s->card);
+        s->voice = AUD_open_out(&s->card, s->voice, TYPE_NRF51_GPIO, s,
+                                nrf51_gpio_audio_callback, &as);
+        if (!s->voice) {
+            error_setg(errp, "%s: cannot open an audio voice", __func__);
+            return;
+        }
+        s->audio_edges = g_new(NRF51GPIOAudioEdge, NRF51_GPIO_AUDIO_EDGES);
+        s->play_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        AUD_set_active_out(s->voice, 1);
+    }
+}
 
-    /* Public */
-    MemoryRegion iomem;
-    uint32_t codepagesize;
-    uint32_t codesize;
+void qmp_microbit_gpio_inject(MicrobitGpioEventList *events,
+                              bool has_relative, bool relative, Error **errp)
+{
+    Object *obj = object_resolve_path_type("", TYPE_NRF51_GPIO, NULL);
+    MicrobitGpioEventList *e;
+    uint8_t *buf, *p;
+    size_t size = 1;
 
-} NRF51FICRState;
+    if (!obj) {
+        error_setg(errp, "machine has no unique %s device", TYPE_NRF51_GPIO);
+        return;
+    }
+    if (replay_mode == REPLAY_MODE_PLAY) {
+        error_setg(errp, "input is taken from the replay log");
+        return;
+    }
+    for (e = events; e; e = e->next) {
+        if (e->value->time < 0) {
+            error_setg(errp, "event time must not be negative");
+            return;
+        }
+        size += NRF51_GPIO_REPLAY_EVENT_SIZE;
+    }
 
-static uint64_t nrf51_ficr_read(void *opaque, hwaddr offset,
-                                unsigned size)
+    p = buf = g_malloc(size);
+    *p++ = has_relative && relative;
+    for (e = events; e; e = e->next) {
+        stq_le_p(p, e->value->time);
+        stl_le_p(p + 8, e->value->mask);
+        p[12] = e->value->level;
+        p += NRF51_GPIO_REPLAY_EVENT_SIZE;
+    }
+    replay_device_event(NRF51_GPIO(obj)->replay, buf, size);
+    g_free(buf);
+}
+
+/* Capture records as of the call, oldest first, in a new array */
+static NRF51GPIOCapture *nrf51_gpio_capture_snapshot(NRF51GPIOState *s,
+                                                     uint32_t *n)
 {
-    NRF51FICRState *s = (NRF51FICRState *)opaque;
+    NRF51GPIOCapture *c;
+    uint32_t head, i;
 
-    switch (offset) {
-        case NRF51_FICR_CODEPAGESIZE:
-            return s->codepagesize;
-        case NRF51_FICR_CODESIZE:
-            return s->codesize;
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                            "%s: reading a bad offset 0x%x\n",
-                            __func__,
-                            (int)offset);
-            return 0;
-    };
+    nrf51_lock();
+    head = s->capture_head;
+    *n = MIN(head, s->capture);
+    c = g_new(NRF51GPIOCapture, *n);
+    for (i = 0; i < *n; i++) {
+        c[i] = s->capture_ring[(head - *n + i) & (s->capture - 1)];
+    }
+    nrf51_unlock();
+    return c;
 }
 
-static void nrf51_ficr_write(void *opaque, hwaddr offset,
-                             uint64_t value, unsigned size)
+static GByteArray *nrf51_gpio_capture_vcd(const NRF51GPIOCapture *c,
+                                          uint32_t n)
 {
-    NRF51FICRState *s = (NRF51FICRState *)opaque;
+    GString *vcd = g_string_new("$timescale 1ns $end\n"
+                                "$scope module nrf51_gpio $end\n");
+    uint32_t level = 0;
+    uint32_t i;
+    gsize len;
+    int pin;
 
-    switch (offset) {
-        case NRF51_FICR_CODEPAGESIZE:
-            s->codepagesize = value;
-            break;
-        case NRF51_FICR_CODESIZE:
-            s->codesize = value;
-            break;
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                            "%s: writing a bad offset 0x%x\n",
-                            __func__,
-                            (int)offset);
-            break;
-    };
+    for (pin = 0; pin < 32; pin++) {
+        g_string_append_printf(vcd, "$var wire 1 %c P0.%02d $end\n",
+                               '!' + pin, pin);
+    }
+    g_string_append(vcd, "$upscope $end\n$enddefinitions $end\n");
+
+    for (i = 0; i < n; i++) {
+        uint32_t changed = i ? c[i].level ^ level : ~0u;
+
+        g_string_append_printf(vcd, "#%" PRId64 "\n%s", c[i].time,
+                               i ? "" : "$dumpvars\n");
+        for (pin = 0; pin < 32; pin++) {
+            if (extract32(changed, pin, 1)) {
+                g_string_append_printf(vcd, "%d%c\n",
+                                       extract32(c[i].level, pin, 1),
+                                       '!' + pin);
+            }
+        }
+        if (!i) {
+            g_string_append(vcd, "$end\n");
+        }
+        level = c[i].level;
+    }
+    len = vcd->len;
+    return g_byte_array_new_take((guint8 *)g_string_free(vcd, false), len);
 }
 
-static const MemoryRegionOps nrf51_ficr_ops = {
-    .read = nrf51_ficr_read,
-    .write = nrf51_ficr_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
+static void nrf51_gpio_zip_le16(GByteArray *a, uint16_t v)
+{
+    uint8_t b[2];
 
-static const VMStateDescription vmstate_nrf51_ficr = {
-    .name = TYPE_NRF51_FICR,
-    .version_id = 1,
-    .minimum_version_id = 1,
-    .fields = (VMStateField[]) {
-        VMSTATE_UINT32(codepagesize, NRF51FICRState),
-        VMSTATE_UINT32(codesize, NRF51FICRState),
-        VMSTATE_END_OF_LIST()
+    stw_le_p(b, v);
+    g_byte_array_append(a, b, sizeof(b));
+}
+
+static void nrf51_gpio_zip_le32(GByteArray *a, uint32_t v)
+{
+    uint8_t b[4];
+
+    stl_le_p(b, v);
+    g_byte_array_append(a, b, sizeof(b));
+}
+
+/* A zip archive's header for a stored (uncompressed) file */
+static void nrf51_gpio_zip_header(GByteArray *a, bool central,
+                                  const char *name, const GByteArray *data,
+                                  uint32_t offset)
+{
+    nrf51_gpio_zip_le32(a, central ? 0x02014b50 : 0x04034b50);
+    if (central) {
+        nrf51_gpio_zip_le16(a, 20);     /* version made by */
     }
-};
+    nrf51_gpio_zip_le16(a, 20);         /* version needed */
+    nrf51_gpio_zip_le16(a, 0);          /* flags */
+    nrf51_gpio_zip_le16(a, 0);          /* stored */
+    nrf51_gpio_zip_le16(a, 0);          /* 00:00:00 */
+    nrf51_gpio_zip_le16(a, 0x21);       /* 1980-01-01 */
+    nrf51_gpio_zip_le32(a, crc32(0, data->data, data->len));
+    nrf51_gpio_zip_le32(a, data->len);
+    nrf51_gpio_zip_le32(a, data->len);
+    nrf51_gpio_zip_le16(a, strlen(name));
+    nrf51_gpio_zip_le16(a, 0);          /* extra field */
+    if (central) {
+        nrf51_gpio_zip_le16(a, 0);      /* comment */
+        nrf51_gpio_zip_le16(a, 0);      /* disk */
+        nrf51_gpio_zip_le16(a, 0);      /* internal attributes */
+        nrf51_gpio_zip_le32(a, 0);      /* external attributes */
+        nrf51_gpio_zip_le32(a, offset);
+    }
+    g_byte_array_append(a, (const guint8 *)name, strlen(name));
+}
 
-static Property nrf51_ficr_properties[] = {
-    DEFINE_PROP_UINT32("codepagesize", NRF51FICRState, codepagesize, 4096),
-    DEFINE_PROP_UINT32("codesize", NRF51FICRState, codesize, 64),
-    DEFINE_PROP_END_OF_LIST()
-};
+/* Most samples of a sigrok session, 256 MiB of data */
+#define NRF51_GPIO_SIGROK_MAX_SAMPLES (64 * 1024 * 1024)
 
-static void nrf51_ficr_init(Object *obj)
+/**
+ * A sigrok session (format version 2): a zip archive holding the
+ * version, the metadata and the samples of the 32 pins, taken every
+ * 1/@samplerate s from the first record to the last.
+ */
+static GByteArray *nrf51_gpio_capture_sigrok(const NRF51GPIOCapture *c,
+                                             uint32_t n, uint64_t samplerate,
+                                             Error **errp)
 {
-    NRF51FICRState *s = NRF51_FICR(obj);
-    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+    static const char *const names[] = { "version", "metadata", "logic-1-1" };
+    GByteArray *files[ARRAY_SIZE(names)];
+    GByteArray *zip, *cd;
+    GString *meta;
+    uint64_t nsamples, k;
+    uint32_t cd_size;
+    uint32_t i = 0;
+    gsize len;
+    int pin, f;
 
-    memory_region_init_io(&s->iomem, obj, &nrf51_ficr_ops, s,
-                          TYPE_NRF51_FICR, 0x1000);
-    sysbus_init_mmio(sdb, &s->iomem);
+    nsamples = n ? muldiv64(c[n - 1].time - c[0].time, samplerate,
+                            NANOSECONDS_PER_SECOND) + 1 : 0;
+    if (nsamples > NRF51_GPIO_SIGROK_MAX_SAMPLES) {
+        error_setg(errp, "capture spans %" PRIu64 " samples, more than %d; "
+                   "use a lower samplerate", nsamples,
+                   NRF51_GPIO_SIGROK_MAX_SAMPLES);
+        return NULL;
+    }
+
+    meta = g_string_new(NULL);
+    g_string_append_printf(meta, "[global]\nsigrok version=0.5.0\n\n"
+                           "[device 1]\ncapturefile=logic-1\n"
+                           "total probes=32\nsamplerate=%" PRIu64 "\n"
+                           "total analog=0\n", samplerate);
+    for (pin = 0; pin < 32; pin++) {
+        g_string_append_printf(meta, "probe%d=P0.%02d\n", pin + 1, pin);
+    }
+    g_string_append(meta, "unitsize=4\n");
+
+    files[0] = g_byte_array_new();
+    g_byte_array_append(files[0], (const guint8 *)"2", 1);
+    len = meta->len;
+    files[1] = g_byte_array_new_take((guint8 *)g_string_free(meta, false),
+                                     len);
+    files[2] = g_byte_array_sized_new(nsamples * 4);
+    for (k = 0; k < nsamples; k++) {
+        int64_t t = c[0].time + muldiv64(k, NANOSECONDS_PER_SECOND,
+                                         samplerate);
+
+        while (i + 1 < n && c[i + 1].time <= t) {
+            i++;
+        }
+        nrf51_gpio_zip_le32(files[2], c[i].level);
+    }
+
+    zip = g_byte_array_new();
+    cd = g_byte_array_new();
+    for (f = 0; f < ARRAY_SIZE(names); f++) {
+        nrf51_gpio_zip_header(cd, true, names[f], files[f], zip->len);
+        nrf51_gpio_zip_header(zip, false, names[f], files[f], 0);
+        g_byte_array_append(zip, files[f]->data, files[f]->len);
+        g_byte_array_free(files[f], true);
+    }
+    cd_size = cd->len;
+    nrf51_gpio_zip_le32(cd, 0x06054b50);
+    nrf51_gpio_zip_le16(cd, 0);                 /* this disk */
+    nrf51_gpio_zip_le16(cd, 0);                 /* central directory disk */
+    nrf51_gpio_zip_le16(cd, ARRAY_SIZE(names));
+    nrf51_gpio_zip_le16(cd, ARRAY_SIZE(names));
+    nrf51_gpio_zip_le32(cd, cd_size);
+    nrf51_gpio_zip_le32(cd, zip->len);
+    nrf51_gpio_zip_le16(cd, 0);                 /* comment */
+    g_byte_array_append(zip, cd->data, cd->len);
+    g_byte_array_free(cd, true);
+    return zip;
 }
 
-static void nrf51_ficr_class_init(ObjectClass *klass, void *data)
+void qmp_microbit_gpio_capture_dump(const char *filename, bool has_format,
+                                    MicrobitGpioCaptureFormat format,
+                                    bool has_samplerate, uint64_t samplerate,
+                                    Error **errp)
+{
+    Object *obj = object_resolve_path_type("", TYPE_NRF51_GPIO, NULL);
+    NRF51GPIOState *s;
+    NRF51GPIOCapture *c;
+    GByteArray *data;
+    GError *gerr = NULL;
+    uint32_t n;
+
+    if (!obj) {
+        error_setg(errp, "machine has no unique %s device", TYPE_NRF51_GPIO);
+        return;
+    }
+    s = NRF51_GPIO(obj);
+    if (!s->capture_ring) {
+        error_setg(errp, "capture is off, see %s.capture", TYPE_NRF51_GPIO);
+        return;
+    }
+    if (has_samplerate &&
+        (!samplerate || samplerate > NANOSECONDS_PER_SECOND)) {
+        error_setg(errp, "samplerate must be 1 Hz to 1 GHz");
+        return;
+    }
+
+    c = nrf51_gpio_capture_snapshot(s, &n);
+    if (has_format && format == MICROBIT_GPIO_CAPTURE_FORMAT_SIGROK) {
+        data = nrf51_gpio_capture_sigrok(c, n, has_samplerate ? samplerate
+                                                              : 1000000,
+                                         errp);
+    } else {
+        data = nrf51_gpio_capture_vcd(c, n);
+    }
+    g_free(c);
+    if (!data) {
+        return;
+    }
+    if (!g_file_set_contents(filename, (const gchar *)data->data, data->len,
+                             &gerr)) {
+        error_setg(errp, "%s", gerr->message);
+        g_error_free(gerr);
+    }
+    g_byte_array_free(data, true);
+}
+
+static void nrf51_gpio_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
-    dc->props = nrf51_ficr_properties;
-    dc->vmsd = &vmstate_nrf51_ficr;
+    dc->realize = nrf51_gpio_realize;
+    dc->props = nrf51_gpio_properties;
+    dc->vmsd = &vmstate_nrf51_gpio;
 }
 
-static const TypeInfo nrf51_ficr_info = {
-    .name          = TYPE_NRF51_FICR,
+static const TypeInfo nrf51_gpio_info = {
+    .name          = TYPE_NRF51_GPIO,
     .parent        = TYPE_SYS_BUS_DEVICE,
-    .instance_size = sizeof(NRF51FICRState),
-    .instance_init = nrf51_ficr_init,
-    .class_init    = nrf51_ficr_class_init,
+    .instance_size = sizeof(NRF51GPIOState),
+    .instance_init = nrf51_gpio_init,
+    .class_init    = nrf51_gpio_class_init,
 };
 
 /**
- * NRF51 CLOCK & POWER & MPU
- *   With respect to nRF51822 Reference Manual
- *   NOTE: incomplete implementation
- *         timer does not need clock input,
- *         so the clock is a fake one
+ * MICROBIT NEOPIXEL
+ *   NOTE: a WS2812 strip on one nrf51_gpio output pin. The pin's edges are
+ *         only stamped with virtual time into a buffer; once the pin has
+ *         stayed low for the latch gap, the whole frame is decoded from
+ *         the high time of each bit relative to its period, so that it
+ *         does not depend on how fast the guest's bit-banging loop runs,
+ *         and streamed to the chardev, e.g.
+ *         -device microbit_neopixel,pin=0,count=30,chardev=strip
  */
 
-#define TYPE_NRF51_CPM "nrf51_clock_power_mpu"
-#define NRF51_CPM(obj) \
-    OBJECT_CHECK(NRF51CPMState, (obj), TYPE_NRF51_CPM)
+#define TYPE_MICROBIT_NEOPIXEL "microbit_neopixel"
+#define MICROBIT_NEOPIXEL(obj) \
+    OBJECT_CHECK(MICROBITNeopixelState, (obj), TYPE_MICROBIT_NEOPIXEL)
+
+/* Most pixels a strip may have */
+#define MICROBIT_NEOPIXEL_MAX   1024
 
 typedef struct {
     /* Private */
-    SysBusDevice parent;
+    DeviceState parent;
 
     /* Public */
-    MemoryRegion iomem;
+    NRF51GPIOState *gpio;
+    uint32_t pin;
+    uint32_t count;
+    uint32_t latch_ns;
+    CharBackend chr;
+    Notifier level_notifier;
+    bool level;
+    /* Edges of the frame being sent, from its first rising one */
+    int64_t *edges;
+    uint32_t nedges;
+    uint32_t max_edges;
+    QEMUTimer *latch_timer;
+    bool latch_pending;
+    /* GRB as sent, three bytes per pixel */
+    uint8_t *grb;
+} MICROBITNeopixelState;
 
-    /* Clock */
-    bool hfclk_enabled;
-    bool lfclk_enabled;
+/**
+ * Frame record, one per latched frame, little-endian: QEMU_CLOCK_VIRTUAL
+ * timestamp in ns, the number of pixels, then R, G and B of each pixel.
+ */
+typedef struct QEMU_PACKED {
+    uint64_t timestamp;
+    uint32_t count;
+} MICROBITNeopixelRecord;
 
-    /* Power */
-    bool ramon;
-} NRF51CPMState;
+static void microbit_neopixel_latch(MICROBITNeopixelState *s)
+{
+    MICROBITNeopixelRecord rec;
+    uint32_t nbits = s->nedges / 2;
+    uint8_t *rgb;
+    int64_t period = 0;
+    uint32_t i;
 
-enum {
-    NRF51_CLK_HFCLKSTART   = 0x000,
-    NRF51_CLK_HFCLKSTOP    = 0x004,
-    NRF51_CLK_LFCLKSTART   = 0x008,
-    NRF51_CLK_LFCLKSTOP    = 0x00C,
-    NRF51_CLK_HFCLKSTARTED = 0x100,
-    NRF51_CLK_LFCLKSTARTED = 0x104,
-    NRF51_CLK_CAL          = 0x010,
-    NRF51_CLK_CTSTART      = 0x014,
-    NRF51_CLK_CTSTOP       = 0x018,
-    NRF51_CLK_INTENSET     = 0x304,
-    NRF51_CLK_INTENCLR     = 0x308,
-    NRF51_CLK_HFCLKRUN     = 0x408,
-    NRF51_CLK_HFCLKSTAT    = 0x40c,
-    NRF51_CLK_LFCLKRUN     = 0x414,
-    NRF51_CLK_LFCLKSTAT    = 0x418,
-    NRF51_CLK_LFCLKSRCCOPY = 0x41c,
-    NRF51_CLK_LFCLKSRC     = 0x518,
-    NRF51_CLK_CTIV         = 0x538,
-    NRF51_CLK_XTALFREQ     = 0x550,
-    NRF51_PWR_RAMON        = 0x524,
-    NRF51_UNKNOWN_VAL      = 0,
-};
+    /* Pixels past the end of a short frame keep their colour */
+    nbits = MIN(nbits, s->count * 24);
+    for (i = 0; i < nbits; i++) {
+        int64_t *e = &s->edges[2 * i];
+        uint8_t *byte = &s->grb[i / 8];
 
-static uint64_t nrf51_cpm_read(void *opaque, hwaddr offset,
-                               unsigned size)
-{
-    NRF51CPMState *s = (NRF51CPMState *)opaque;
+        if (i + 1 < s->nedges / 2) {
+            period = e[2] - e[0];
+        }
+        *byte = deposit32(*byte, 7 - i % 8, 1, 2 * (e[1] - e[0]) > period);
+    }
+    s->nedges = 0;
+    if (!nbits || !qemu_chr_fe_backend_connected(&s->chr)) {
+        return;
+    }
 
-    switch (offset) {
-        case NRF51_CLK_HFCLKSTART:
-        case NRF51_CLK_LFCLKSTART:
-        case NRF51_CLK_HFCLKSTOP:
-        case NRF51_CLK_LFCLKSTOP:
-            return 0;
-        case NRF51_CLK_HFCLKSTARTED:
-            return s->hfclk_enabled;
-        case NRF51_CLK_LFCLKSTARTED:
-            return s->lfclk_enabled;
-        case NRF51_PWR_RAMON:
-            return s->ramon;
-        case NRF51_CLK_LFCLKSRC:
-            return NRF51_UNKNOWN_VAL;
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                            "%s: reading a bad offset 0x%x\n",
-                            __func__,
-                            (int)offset);
-            return 0;
-    };
+    rgb = g_malloc(sizeof(rec) + s->count * 3);
+    rec.timestamp = cpu_to_le64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    rec.count = cpu_to_le32(s->count);
+    memcpy(rgb, &rec, sizeof(rec));
+    for (i = 0; i < s->count; i++) {
+        rgb[sizeof(rec) + 3 * i] = s->grb[3 * i + 1];
+        rgb[sizeof(rec) + 3 * i + 1] = s->grb[3 * i];
+        rgb[sizeof(rec) + 3 * i + 2] = s->grb[3 * i + 2];
+    }
+    qemu_chr_fe_write_all(&s->chr, rgb, sizeof(rec) + s->count * 3);
+    g_free(rgb);
 }
 
-static void nrf51_cpm_write(void *opaque, hwaddr offset,
-                            uint64_t value, unsigned size)
+static void microbit_neopixel_latch_expired(void *opaque)
 {
-    NRF51CPMState *s = (NRF51CPMState *)opaque;
+    MICROBITNeopixelState *s = opaque;
+    int64_t last;
 
-    switch (offset) {
-        case NRF51_CLK_HFCLKSTART:
-            s->hfclk_enabled = (value & 1);
-            break;
-        case NRF51_CLK_LFCLKSTART:
-            s->lfclk_enabled = (value & 1);
-            break;
-        case NRF51_CLK_HFCLKSTOP:
-            s->hfclk_enabled = (value & 1) ? false : true;
-            break;
-        case NRF51_CLK_LFCLKSTOP:
-            s->lfclk_enabled = (value & 1) ? false : true;
-            break;
-        case NRF51_CLK_HFCLKSTARTED:
-        case NRF51_CLK_LFCLKSTARTED:
-            break;
-        case NRF51_PWR_RAMON:
-            s->ramon = value & 0x00030003;
-            break;
-        case NRF51_CLK_LFCLKSRC:
-            break;
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                            "%s: writing a bad offset 0x%x\n",
-                            __func__,
-                            (int)offset);
-            break;
-    };
+    if (!s->nedges || s->level) {
+        /* Held high, not a latch; the next falling edge re-arms */
+        s->latch_pending = false;
+        return;
+    }
+    last = s->edges[s->nedges - 1];
+    if (qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - last < s->latch_ns) {
+        /* Still sending: look again a gap after the last edge */
+        timer_mod(s->latch_timer, last + s->latch_ns);
+        return;
+    }
+    s->latch_pending = false;
+    microbit_neopixel_latch(s);
 }
 
-static const MemoryRegionOps nrf51_cpm_ops = {
-    .read = nrf51_cpm_read,
-    .write = nrf51_cpm_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
+static void microbit_neopixel_levels(Notifier *n, void *data)
+{
+    MICROBITNeopixelState *s = container_of(n, MICROBITNeopixelState,
+                                            level_notifier);
+    NRF51GPIOLevels *l = data;
+    bool level;
+    int64_t now;
 
-static const VMStateDescription vmstate_nrf51_cpm = {
-    .name = TYPE_NRF51_CPM,
-    .version_id = 1,
-    .minimum_version_id = 1,
-    .fields = (VMStateField[]) {
-        VMSTATE_BOOL(hfclk_enabled, NRF51CPMState),
-        VMSTATE_BOOL(lfclk_enabled, NRF51CPMState),
-        VMSTATE_END_OF_LIST()
+    if (!extract32(l->mask, s->pin, 1)) {
+        return;
     }
-};
-
-static Property nrf51_cpm_properties[] = {
-    DEFINE_PROP_BOOL("hfclk_enabled", NRF51CPMState, hfclk_enabled, false),
-    DEFINE_PROP_BOOL("lfclk_enabled", NRF51CPMState, lfclk_enabled, false),
-    DEFINE_PROP_END_OF_LIST(),
-};
+    level = extract32(l->value, s->pin, 1);
+    if (level == s->level) {
+        return;
+    }
+    s->level = level;
+    if (!s->nedges && !level) {
+        return;
+    }
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (level && s->nedges && now - s->edges[s->nedges - 1] >= s->latch_ns) {
+        /* The latch timer has not run yet */
+        microbit_neopixel_latch(s);
+    }
+    if (s->nedges < s->max_edges) {
+        s->edges[s->nedges++] = now;
+    }
+    if (!s->latch_pending) {
+        s->latch_pending = true;
+        timer_mod(s->latch_timer, now + s->latch_ns);
+    }
+}
 
-static void nrf51_cpm_init(Object *obj)
+static void microbit_neopixel_realize(DeviceState *dev, Error **errp)
 {
-    NRF51CPMState *s = NRF51_CPM(obj);
-    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+    MICROBITNeopixelState *s = MICROBIT_NEOPIXEL(dev);
 
-    memory_region_init_io(&s->iomem, obj, &nrf51_cpm_ops, s,
-                          TYPE_NRF51_CPM, 0x1000);
-    sysbus_init_mmio(sdb, &s->iomem);
+    if (!s->gpio) {
+        Object *obj = object_resolve_path_type("", TYPE_NRF51_GPIO, NULL);
+
+        if (!obj) {
+            error_setg(errp, "%s: gpio is required when the machine has no "
+                       "unique %s device", __func__, TYPE_NRF51_GPIO);
+            return;
+        }
+        s->gpio = NRF51_GPIO(obj);
+    }
+    if (s->pin >= 32) {
+        error_setg(errp, "%s: pin must be 0..31", __func__);
+        return;
+    }
+    if (!s->count || s->count > MICROBIT_NEOPIXEL_MAX) {
+        error_setg(errp, "%s: count must be 1..%d", __func__,
+                   MICROBIT_NEOPIXEL_MAX);
+        return;
+    }
+
+    /* A rising and a falling edge per bit, 24 bits per pixel */
+    s->max_edges = s->count * 24 * 2;
+    s->edges = g_new(int64_t, s->max_edges);
+    s->grb = g_malloc0(s->count * 3);
+    s->latch_timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                            microbit_neopixel_latch_expired,
+                                            s);
+    s->level_notifier.notify = microbit_neopixel_levels;
+    notifier_list_add(&s->gpio->level_notifiers, &s->level_notifier);
 }
 
-static void nrf51_cpm_class_init(ObjectClass *klass, void *data)
+static Property microbit_neopixel_properties[] = {
+    DEFINE_PROP_LINK("gpio", MICROBITNeopixelState, gpio,
+                     TYPE_NRF51_GPIO, NRF51GPIOState *),
+    DEFINE_PROP_UINT32("pin", MICROBITNeopixelState, pin, 0),
+    DEFINE_PROP_UINT32("count", MICROBITNeopixelState, count, 1),
+    /* WS2812B resets after 50 us low, later parts need up to 280 us */
+    DEFINE_PROP_UINT32("latch-ns", MICROBITNeopixelState, latch_ns, 50000),
+    DEFINE_PROP_CHR("chardev", MICROBITNeopixelState, chr),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void microbit_neopixel_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
-    dc->props = nrf51_cpm_properties;
-    dc->vmsd = &vmstate_nrf51_cpm;
+
+    dc->desc = "WS2812 (NeoPixel) strip on an nrf51_gpio pin";
+    dc->realize = microbit_neopixel_realize;
+    dc->props = microbit_neopixel_properties;
 }
 
-static const TypeInfo nrf51_cpm_info = {
-    .name          = TYPE_NRF51_CPM,
-    .parent        = TYPE_SYS_BUS_DEVICE,
-    .instance_size = sizeof(NRF51CPMState),
-    .instance_init = nrf51_cpm_init,
-    .class_init    = nrf51_cpm_class_init,
+static const TypeInfo microbit_neopixel_info = {
+    .name          = TYPE_MICROBIT_NEOPIXEL,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(MICROBITNeopixelState),
+    .class_init    = microbit_neopixel_class_init,
 };
 
 /**
- * NRF51 Timer
- *   With respect to nRF51822 Reference Manual
+ * MICROBIT WIRE
+ *   NOTE: a wire from an output pin of one nrf51_gpio to an input pin of
+ *         another, for boards connected edge to edge. Only changes of
+ *         the driven level are sent, stamped with the virtual time they
+ *         happened at plus "latency-ns". Within one process, e.g. between
+ *         the boards of a microbit-fleet, the change is queued straight
+ *         on the far GPIO:
+ *         -device microbit_wire,src=/machine/soc[0]/gpio,src-pin=2,
+ *                 dst=/machine/soc[1]/gpio,dst-pin=1
+ *         Across processes, the sending end has only "src" and the
+ *         receiving end only "dst", both with the same "shm" file; the
+ *         receiver polls it every "poll-ns" of its own virtual time, and
+ *         applies a change no earlier than that.
  */
 
-#define TYPE_NRF51_TIMER "nrf51_timer"
-#define NRF51_TIMER(obj) \
-    OBJECT_CHECK(NRF51TimerState, (obj), TYPE_NRF51_TIMER)
+#define TYPE_MICROBIT_WIRE "microbit_wire"
+#define MICROBIT_WIRE(obj) \
+    OBJECT_CHECK(MICROBITWireState, (obj), TYPE_MICROBIT_WIRE)
 
-#define NRF51_TIMER_BASE_FREQ 0x01000000
+#define MICROBIT_WIRE_MAGIC     0x5257424d  /* "MBWR" little endian */
+#define MICROBIT_WIRE_VERSION   1
+#define MICROBIT_WIRE_ALIGN     64
+
+/*
+ * The shared file: a header, then `size` records. The sender alone
+ * writes prod and the records, the receiver alone cons; both count
+ * records ever passed and wrap. Changes that find the ring full are
+ * dropped and counted. All in host byte order.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t prod QEMU_ALIGNED(MICROBIT_WIRE_ALIGN);
+    uint32_t cons QEMU_ALIGNED(MICROBIT_WIRE_ALIGN);
+    uint32_t dropped QEMU_ALIGNED(MICROBIT_WIRE_ALIGN);
+} QEMU_ALIGNED(MICROBIT_WIRE_ALIGN) MICROBITWireHeader;
+
+typedef struct {
+    int64_t time;
+    uint32_t level;
+    uint32_t reserved;
+} MICROBITWireRecord;
 
 typedef struct {
     /* Private */
-    SysBusDevice parent;
+    DeviceState parent;
 
     /* Public */
-    MemoryRegion iomem;
-    qemu_irq irq;
-    ptimer_state *timer;
-    bool pulsed;
-    uint32_t inten;
-    uint32_t limit_mask;
-    
-    /**
-     * freq = 16MHz / (2 ^ prescaler)
-     * 0 <= prescaler <= 9
-     * i.e:
-     *   16MHz  <= freq <= 32KHz
-     *   62.5ns <= tick <= 31.25us
-     */
-    uint32_t freq;
+    NRF51GPIOState *src;
+    uint32_t src_pin;
+    NRF51GPIOState *dst;
+    uint32_t dst_pin;
+    uint32_t latency_ns;
+    char *shm;
+    uint32_t depth;
+    uint32_t poll_ns;
+    Notifier level_notifier;
+    /* Last level sent, -1 before the first */
+    int level;
+    MICROBITWireHeader *hdr;
+    MICROBITWireRecord *ring;
+    size_t map_size;
+    QEMUTimer *poll_timer;
+} MICROBITWireState;
 
-    /* Public Regs */
-    uint32_t start;
-    uint32_t stop;
-    uint32_t count;
-    uint32_t clear;
-    uint32_t shutdown;
-    uint32_t capture[4];
-    uint32_t compare[4];
-    uint32_t shorts;
-    uint32_t intenset;
-    uint32_t intenclr;
-    uint32_t mode;
-    uint32_t bitmode;
-    uint32_t prescaler;
-    uint32_t cc[4];
+static void microbit_wire_deliver(MICROBITWireState *s, int64_t time,
+                                  bool level)
+{
+    nrf51_gpio_queue_input(s->dst, time, 1u << s->dst_pin, level);
+    nrf51_gpio_inject_commit(s->dst);
+}
 
-    /* Internal Regs */
-    uint32_t internal_counter;
-} NRF51TimerState;
+static void microbit_wire_send(MICROBITWireState *s, int64_t time,
+                               bool level)
+{
+    MICROBITWireHeader *hdr = s->hdr;
+    uint32_t prod = hdr->prod;
+    MICROBITWireRecord *r;
 
-enum {
-    NRF51_TIMER_START     = 0x000,
-    NRF51_TIMER_STOP      = 0x004,
-    NRF51_TIMER_COUNT     = 0x008,
-    NRF51_TIMER_CLEAR     = 0x00C,
-    NRF51_TIMER_SHUTDOWN  = 0x010,
-    NRF51_TIMER_CAPTURE0  = 0x040,
-    NRF51_TIMER_CAPTURE1  = 0x044,
-    NRF51_TIMER_CAPTURE2  = 0x048,
-    NRF51_TIMER_CAPTURE3  = 0x04C,
-    NRF51_TIMER_COMPARE0  = 0x140,
-    NRF51_TIMER_COMPARE1  = 0x144,
-    NRF51_TIMER_COMPARE2  = 0x148,
-    NRF51_TIMER_COMPARE3  = 0x14C,
-    NRF51_TIMER_SHORTS    = 0x200,
-    NRF51_TIMER_INTENSET  = 0x304,
-    NRF51_TIMER_INTENCLR  = 0x308,
-    NRF51_TIMER_MODE      = 0x504,
-    NRF51_TIMER_BITMODE   = 0x508,
-    NRF51_TIMER_PRESCALER = 0x510,
-    NRF51_TIMER_CC0       = 0x540,
-    NRF51_TIMER_CC1       = 0x544,
-    NRF51_TIMER_CC2       = 0x548,
-    NRF51_TIMER_CC3       = 0x54C,
-};
+    /* Pairs with the receiver's store to cons after reading a record */
+    if (prod - atomic_load_acquire(&hdr->cons) >= s->depth) {
+        atomic_set(&hdr->dropped, hdr->dropped + 1);
+        return;
+    }
+    r = &s->ring[prod & (s->depth - 1)];
+    r->time = time;
+    r->level = level;
+    atomic_store_release(&hdr->prod, prod + 1);
+}
 
-static uint64_t nrf51_timer_read(void *opaque, hwaddr offset,
-                                 unsigned size)
+static void microbit_wire_levels(Notifier *n, void *data)
 {
-    NRF51TimerState *s = (NRF51TimerState *)opaque;
+    MICROBITWireState *s = container_of(n, MICROBITWireState,
+                                        level_notifier);
+    NRF51GPIOLevels *l = data;
+    int64_t time;
+    int level;
 
-    switch (offset) {
-        case NRF51_TIMER_START:
-            return s->start;
-        case NRF51_TIMER_STOP:
-            return s->stop;
-        case NRF51_TIMER_COUNT:
-            return s->count;
-        case NRF51_TIMER_CLEAR:
-            return s->clear;
-        case NRF51_TIMER_SHUTDOWN:
-            return s->shutdown;
-        case NRF51_TIMER_CAPTURE0:
-        case NRF51_TIMER_CAPTURE1:
-        case NRF51_TIMER_CAPTURE2:
-        case NRF51_TIMER_CAPTURE3:
-            return s->capture[(offset >> 2) & 3];
-        case NRF51_TIMER_COMPARE0:
-        case NRF51_TIMER_COMPARE1:
-        case NRF51_TIMER_COMPARE2:
-        case NRF51_TIMER_COMPARE3:
-            return s->compare[(offset >> 2) & 3];
-        case NRF51_TIMER_SHORTS:
-            return s->shorts;
-        case NRF51_TIMER_INTENSET:
-        case NRF51_TIMER_INTENCLR:
-            qemu_log_mask(LOG_UNIMP,
-                          "%s: `INTEN` not implemented when reading 0x%x\n",
-                          __func__,
-                          (int)offset);
-            return 0;
-        case NRF51_TIMER_MODE:
-            return s->mode;
-        case NRF51_TIMER_BITMODE:
-            return s->bitmode;
-        case NRF51_TIMER_PRESCALER:
-            return s->prescaler;
-        case NRF51_TIMER_CC0:
-        case NRF51_TIMER_CC1:
-        case NRF51_TIMER_CC2:
-        case NRF51_TIMER_CC3:
-            return s->cc[(offset >> 2) & 3];
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                          "%s: reading a bad offset 0x%x\n",
-                          __func__,
-                          (int)offset);
-            return 0;
-    };
+    if (!extract32(l->mask, s->src_pin, 1)) {
+        return;
+    }
+    level = extract32(l->value, s->src_pin, 1);
+    if (level == s->level) {
+        return;
+    }
+    s->level = level;
+    time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->latency_ns;
+    if (s->hdr) {
+        microbit_wire_send(s, time, level);
+    } else {
+        microbit_wire_deliver(s, time, level);
+    }
+}
+
+static void microbit_wire_poll(void *opaque)
+{
+    MICROBITWireState *s = opaque;
+    MICROBITWireHeader *hdr = s->hdr;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t prod, cons;
+
+    timer_mod(s->poll_timer, now + s->poll_ns);
+    /* Nothing to read until the sender has set the header up */
+    if (atomic_load_acquire(&hdr->magic) != MICROBIT_WIRE_MAGIC) {
+        return;
+    }
+    prod = atomic_load_acquire(&hdr->prod);
+    cons = hdr->cons;
+    if (prod == cons) {
+        return;
+    }
+    for (; cons != prod; cons++) {
+        MICROBITWireRecord *r = &s->ring[cons & (s->depth - 1)];
+
+        /* The other process has its own clock: never rewrite the past */
+        nrf51_gpio_queue_input(s->dst, MAX(r->time, now),
+                               1u << s->dst_pin, r->level);
+    }
+    atomic_store_release(&hdr->cons, cons);
+    nrf51_gpio_inject_commit(s->dst);
+}
+
+static bool microbit_wire_map(MICROBITWireState *s, Error **errp)
+{
+    void *map;
+    int fd;
+
+    TFR(fd = qemu_open(s->shm, O_RDWR | O_CREAT, 0600));
+    if (fd < 0) {
+        error_setg_file_open(errp, errno, s->shm);
+        return false;
+    }
+    /* Either end may come first; both size the file the same */
+    s->map_size = sizeof(MICROBITWireHeader) +
+                  s->depth * sizeof(MICROBITWireRecord);
+    if (ftruncate(fd, s->map_size) < 0) {
+        error_setg_errno(errp, errno, "%s: could not resize '%s'",
+                         __func__, s->shm);
+        qemu_close(fd);
+        return false;
+    }
+    map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    qemu_close(fd);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "%s: could not map '%s'",
+                         __func__, s->shm);
+        return false;
+    }
+    s->hdr = map;
+    s->ring = map + sizeof(MICROBITWireHeader);
+    if (s->src) {
+        /* The sender (re)starts the stream; magic last */
+        atomic_set(&s->hdr->magic, 0);
+        smp_wmb();
+        s->hdr->version = MICROBIT_WIRE_VERSION;
+        s->hdr->size = s->depth;
+        s->hdr->prod = 0;
+        s->hdr->cons = 0;
+        s->hdr->dropped = 0;
+        smp_wmb();
+        atomic_set(&s->hdr->magic, MICROBIT_WIRE_MAGIC);
+    }
+    return true;
 }
 
-static void nrf51_timer_recalibrate(NRF51TimerState *s, int reload)
+static void microbit_wire_realize(DeviceState *dev, Error **errp)
 {
-    uint32_t limit = 0xffff;
-    if (s->mode & 1) {
-        /* Counter mode */
-        limit = s->count;
+    MICROBITWireState *s = MICROBIT_WIRE(dev);
+
+    if (s->shm) {
+        if (!s->src == !s->dst) {
+            error_setg(errp, "%s: with shm, exactly one of src and dst is "
+                       "required", __func__);
+            return;
+        }
+        if (!s->depth || (s->depth & (s->depth - 1))) {
+            error_setg(errp, "%s: depth must be a power of two", __func__);
+            return;
+        }
+        if (!s->poll_ns) {
+            error_setg(errp, "%s: poll-ns must not be 0", __func__);
+            return;
+        }
+    } else if (!s->src || !s->dst) {
+        error_setg(errp, "%s: src and dst are required", __func__);
+        return;
+    }
+    if (s->src_pin >= 32 || s->dst_pin >= 32) {
+        error_setg(errp, "%s: pins must be 0..31", __func__);
+        return;
+    }
+    if (s->shm && !microbit_wire_map(s, errp)) {
+        return;
+    }
+
+    s->level = -1;
+    if (s->src) {
+        s->level_notifier.notify = microbit_wire_levels;
+        notifier_list_add(&s->src->level_notifiers, &s->level_notifier);
     } else {
-        /* Timer mode */
-        limit = 0;
+        s->poll_timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                               microbit_wire_poll, s);
+        timer_mod(s->poll_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->poll_ns);
     }
-    ptimer_set_limit(s->timer, (uint64_t)limit, reload);
 }
 
-static void nrf51_timer_write(void *opaque, hwaddr offset,
-                              uint64_t value, unsigned size)
+static Property microbit_wire_properties[] = {
+    DEFINE_PROP_LINK("src", MICROBITWireState, src,
+                     TYPE_NRF51_GPIO, NRF51GPIOState *),
+    DEFINE_PROP_UINT32("src-pin", MICROBITWireState, src_pin, 0),
+    DEFINE_PROP_LINK("dst", MICROBITWireState, dst,
+                     TYPE_NRF51_GPIO, NRF51GPIOState *),
+    DEFINE_PROP_UINT32("dst-pin", MICROBITWireState, dst_pin, 0),
+    DEFINE_PROP_UINT32("latency-ns", MICROBITWireState, latency_ns, 0),
+    DEFINE_PROP_STRING("shm", MICROBITWireState, shm),
+    DEFINE_PROP_UINT32("depth", MICROBITWireState, depth, 4096),
+    DEFINE_PROP_UINT32("poll-ns", MICROBITWireState, poll_ns, 10000),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void microbit_wire_class_init(ObjectClass *klass, void *data)
 {
-    NRF51TimerState *s = (NRF51TimerState *)opaque;
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->desc = "Wire between nrf51_gpio pins of two boards";
+    dc->realize = microbit_wire_realize;
+    dc->props = microbit_wire_properties;
+}
+
+static const TypeInfo microbit_wire_info = {
+    .name          = TYPE_MICROBIT_WIRE,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(MICROBITWireState),
+    .class_init    = microbit_wire_class_init,
+};
+
+/**
+ * NRF51 NVMC
+ *   Non-Volatile Memory Controller, which also owns code flash and UICR
+ *   NOTE: code flash and UICR are plain RAM, writable while CONFIG.WEN is
+ *         set; pages of code flash dirtied by stores or erases are written
+ *         back to the drive from a timer, as asynchronous requests covering
+ *         contiguous runs. With "backing", both live in a host file
+ *         instead, code flash followed by UICR, mapped MAP_SHARED so that
+ *         guest stores land in the page cache with nothing on the write
+ *         path, or MAP_PRIVATE with "scratch". The mapping is synced at
+ *         exit and by the microbit-flash-sync command.
+ *         With "latency", erases take the time they take on the chip:
+ *         READY reads 0 and the CPU is stalled until a QEMU_CLOCK_VIRTUAL
+ *         timer ends the operation, so that idle-skip jumps over it.
+ *         Word writes are plain stores to RAM and complete at once.
+ *         SIMPLIFICATION: so a store keeps the new value, where the chip
+ *         can only clear bits and would keep old & new. Firmware that
+ *         clears flags one bit at a time without an erase in between
+ *         must store the cleared word itself; trapping every store to
+ *         flash to AND it in would cost the direct store path.
+ */
+
+#define TYPE_NRF51_NVMC "nrf51_nvmc"
+#define NRF51_NVMC(obj) \
+    OBJECT_CHECK(NRF51NVMCState, (obj), TYPE_NRF51_NVMC)
+
+#define NRF51_NVMC_PAGE_SIZE    1024
+#define NRF51_NVMC_WRITEBACK_MS 100
+/* Page, all and UICR erase time, nRF51 Product Specification */
+#define NRF51_NVMC_ERASE_NS     (20 * SCALE_MS)
+#define NRF51_UICR_SIZE         0x400
+
+enum{
+    NRF51_NVMC_READY     = 0x400,
+    NRF51_NVMC_CONFIG    = 0x504,
+    NRF51_NVMC_ERASEPAGE = 0x508,
+    NRF51_NVMC_ERASEPCR1 = 0x508,
+    NRF51_NVMC_ERASEALL  = 0x50C,
+    NRF51_NVMC_ERASEPCR0 = 0x510,
+    NRF51_NVMC_ERASEUICR = 0x514,
+};
+
+enum {
+    NRF51_NVMC_CONFIG_REN  = 0,
+    NRF51_NVMC_CONFIG_WEN  = 1,
+    NRF51_NVMC_CONFIG_EEN  = 2,
+    NRF51_NVMC_CONFIG_MASK = 3,
+};
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    MemoryRegion flash;
+    MemoryRegion uicr;
+    BlockBackend *blk;
+    QEMUTimer *writeback_timer;
+    VMChangeStateEntry *vmstate_change;
+    /* Ends the erase in progress, with latency */
+    QEMUTimer *busy_timer;
+    /* CPU held off during erases, and whether it is now */
+    CPUState *cpu;
+    bool stalled;
+    bool latency;
+    uint32_t flash_base;
+    uint32_t flash_size;
+    uint32_t uicr_base;
+    uint32_t ready;
+    uint32_t config;
+    /* RAM block names of the flash and UICR, unique per board */
+    char *flash_name;
+    char *uicr_name;
+    /* Flash contents mapped copy-on-write from this file, if set */
+    char *image;
+    /* Flash and UICR mapped from this file, if set */
+    char *backing;
+    /* ... privately, so that the file is never written */
+    bool scratch;
+    void *backing_map;
+    size_t backing_len;
+    Notifier exit_notifier;
+    /* Bus seen by the device's own accesses, the system bus by default */
+    MemoryRegion *memory;
+    AddressSpace as;
+} NRF51NVMCState;
+
+typedef struct {
+    QEMUIOVector qiov;
+    struct iovec iov;
+} NRF51NVMCWriteback;
+
+static void nrf51_nvmc_writeback_done(void *opaque, int ret)
+{
+    NRF51NVMCWriteback *wb = opaque;
+
+    if (ret < 0) {
+        error_report("%s: failed to write back flash: %s", __func__,
+                     strerror(-ret));
+    }
+    qemu_vfree(wb->iov.iov_base);
+    g_free(wb);
+}
+
+/* Queue one contiguous run of flash; the data is copied so the guest can
+ * keep writing while the request is in flight */
+static void nrf51_nvmc_writeback_range(NRF51NVMCState *s,
+                                       hwaddr offset, hwaddr len)
+{
+    NRF51NVMCWriteback *wb = g_new(NRF51NVMCWriteback, 1);
+    uint8_t *storage = memory_region_get_ram_ptr(&s->flash);
+
+    wb->iov.iov_base = blk_blockalign(s->blk, len);
+    wb->iov.iov_len = len;
+    memcpy(wb->iov.iov_base, storage + offset, len);
+    qemu_iovec_init_external(&wb->qiov, &wb->iov, 1);
+    blk_aio_pwritev(s->blk, offset, &wb->qiov, 0,
+                    nrf51_nvmc_writeback_done, wb);
+}
+
+static void nrf51_nvmc_writeback(NRF51NVMCState *s)
+{
+    DirtyBitmapSnapshot *snap;
+    hwaddr start, end;
+
+    snap = memory_region_snapshot_and_clear_dirty(&s->flash, 0,
+                                                  s->flash_size,
+                                                  DIRTY_MEMORY_VGA);
+    for (start = 0; start < s->flash_size; start = end) {
+        end = start + NRF51_NVMC_PAGE_SIZE;
+        if (!memory_region_snapshot_get_dirty(&s->flash, snap, start,
+                                              NRF51_NVMC_PAGE_SIZE)) {
+            continue;
+        }
+        while (end < s->flash_size &&
+               memory_region_snapshot_get_dirty(&s->flash, snap, end,
+                                                NRF51_NVMC_PAGE_SIZE)) {
+            end += NRF51_NVMC_PAGE_SIZE;
+        }
+        nrf51_nvmc_writeback_range(s, start, end - start);
+    }
+    g_free(snap);
+}
+
+static bool nrf51_nvmc_writeback_enabled(NRF51NVMCState *s)
+{
+    return s->blk && !blk_is_read_only(s->blk);
+}
+
+static void nrf51_nvmc_writeback_expire(void *opaque)
+{
+    NRF51NVMCState *s = opaque;
+
+    nrf51_nvmc_writeback(s);
+    /* Keep flushing periodically during long write/erase sessions */
+    if (s->config != NRF51_NVMC_CONFIG_REN) {
+        timer_mod(s->writeback_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  NRF51_NVMC_WRITEBACK_MS);
+    }
+}
+
+static void nrf51_nvmc_schedule_writeback(NRF51NVMCState *s)
+{
+    if (nrf51_nvmc_writeback_enabled(s) &&
+        !timer_pending(s->writeback_timer)) {
+        timer_mod(s->writeback_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  NRF51_NVMC_WRITEBACK_MS);
+    }
+}
+
+/* Flush whatever is left when the VM stops; the block layer drains it */
+static void nrf51_nvmc_vm_state_change(void *opaque, int running,
+                                       RunState state)
+{
+    NRF51NVMCState *s = opaque;
+
+    if (!running) {
+        timer_del(s->writeback_timer);
+        nrf51_nvmc_writeback(s);
+    }
+}
+
+static void nrf51_nvmc_update_config(NRF51NVMCState *s)
+{
+    memory_region_set_readonly(&s->flash,
+                               s->config != NRF51_NVMC_CONFIG_WEN);
+    memory_region_set_readonly(&s->uicr,
+                               s->config != NRF51_NVMC_CONFIG_WEN);
+}
+
+/* Push guest writes to a shared backing file down to the disk */
+static bool nrf51_nvmc_sync(NRF51NVMCState *s, Error **errp)
+{
+    if (!s->backing_map || s->scratch) {
+        return true;
+    }
+    if (msync(s->backing_map, s->backing_len, MS_SYNC) < 0) {
+        error_setg_errno(errp, errno, "%s: cannot sync '%s'", __func__,
+                         s->backing);
+        return false;
+    }
+    return true;
+}
+
+static void nrf51_nvmc_exit(Notifier *notifier, void *data)
+{
+    NRF51NVMCState *s = container_of(notifier, NRF51NVMCState,
+                                     exit_notifier);
+    Error *local_err = NULL;
+
+    if (!nrf51_nvmc_sync(s, &local_err)) {
+        error_report_err(local_err);
+    }
+}
+
+static void nrf51_nvmc_erase(NRF51NVMCState *s, hwaddr offset, hwaddr len)
+{
+    uint8_t erased[NRF51_NVMC_PAGE_SIZE];
+
+    /* Through the ROM path, so stale translations of the page are dropped */
+    memset(erased, 0xFF, sizeof(erased));
+    for (hwaddr addr = offset; addr < offset + len;
+         addr += NRF51_NVMC_PAGE_SIZE) {
+        cpu_physical_memory_write_rom(&s->as, s->flash_base + addr, erased,
+                                      sizeof(erased));
+    }
+}
+
+static void nrf51_nvmc_erase_uicr(NRF51NVMCState *s)
+{
+    uint8_t erased[NRF51_UICR_SIZE];
+
+    memset(erased, 0xFF, sizeof(erased));
+    cpu_physical_memory_write_rom(&s->as, s->uicr_base, erased,
+                                  sizeof(erased));
+}
+
+static void nrf51_nvmc_erase_page(NRF51NVMCState *s, uint32_t addr)
+{
+    hwaddr offset = addr - s->flash_base;
+
+    if (addr < s->flash_base || offset >= s->flash_size) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: erasing a bad page 0x%x\n",
+                      __func__,
+                      addr);
+        return;
+    }
+    nrf51_nvmc_erase(s, QEMU_ALIGN_DOWN(offset, NRF51_NVMC_PAGE_SIZE),
+                     NRF51_NVMC_PAGE_SIZE);
+}
+
+/* Start an operation that keeps the NVMC busy for @ns */
+static void nrf51_nvmc_busy(NRF51NVMCState *s, int64_t ns)
+{
+    if (!s->latency) {
+        return;
+    }
+    s->ready = 0;
+    if (s->cpu && !s->stalled) {
+        s->stalled = true;
+        arm_cpu_set_stalled(ARM_CPU(s->cpu), true);
+    }
+    timer_mod(s->busy_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ns);
+}
+
+static void nrf51_nvmc_done(NRF51NVMCState *s)
+{
+    s->ready = 1;
+    if (s->stalled) {
+        s->stalled = false;
+        arm_cpu_set_stalled(ARM_CPU(s->cpu), false);
+    }
+}
+
+static void nrf51_nvmc_busy_expire(void *opaque)
+{
+    nrf51_nvmc_done(opaque);
+}
+
+static void nrf51_nvmc_config_write(void *opaque, hwaddr offset,
+                                    uint64_t value)
+{
+    NRF51NVMCState *s = (NRF51NVMCState *)opaque;
+
+    s->config = value & NRF51_NVMC_CONFIG_MASK;
+    nrf51_nvmc_update_config(s);
+    nrf51_nvmc_schedule_writeback(s);
+}
+
+static void nrf51_nvmc_erase_write(void *opaque, hwaddr offset,
+                                   uint64_t value)
+{
+    NRF51NVMCState *s = (NRF51NVMCState *)opaque;
 
+    if (s->config != NRF51_NVMC_CONFIG_EEN) {
+        return;
+    }
     switch (offset) {
-        case NRF51_TIMER_START: /* Start */
-            if (value & 1) {
-                ptimer_set_freq(s->timer, s->freq);
-                switch (s->bitmode) {
-                    case 0:
-                        s->limit_mask = 0xffff;
-                        break;
-                    case 1:
-                        s->limit_mask = 0xff;
-                        break;
-                    case 2:
-                        s->limit_mask = 0xffffff;
-                        break;
-                    case 3:
-                        s->limit_mask = 0xffffffff;
-                        break;
-                    default:
-                        g_assert_not_reached();
-                        break;
-                }
-                if (s->pulsed)
-                    s->pulsed = false;
-                else
-                    nrf51_timer_recalibrate(s, 1);
-                ptimer_run(s->timer, 0);
-            }
-            break;
-        case NRF51_TIMER_STOP: /* Stop */
-            if (value & 1) {
-                ptimer_stop(s->timer);
-                s->pulsed = true;
-            }
-            break;
-        case NRF51_TIMER_COUNT: /* Count */
-            printf("%s: set count to %d\n", __func__, s->count);
-            if (s->mode & 1) {
-                s->count = value;
-                nrf51_timer_recalibrate(s, 1);
-            }
+        case NRF51_NVMC_ERASEPAGE:
+        /* case NRF51_NVMC_ERASEPCR1: OVERLAPPED */
+        case NRF51_NVMC_ERASEPCR0:
+            nrf51_nvmc_erase_page(s, value);
             break;
-        case NRF51_TIMER_CLEAR: /* Clear */
-            if (value & 1) {
-                s->internal_counter = 0;
-                nrf51_timer_recalibrate(s, 1);
+        case NRF51_NVMC_ERASEALL:
+            if (!(value & 1)) {
+                return;
             }
+            nrf51_nvmc_erase(s, 0, s->flash_size);
+            nrf51_nvmc_erase_uicr(s);
             break;
-        case NRF51_TIMER_SHUTDOWN: /* Shutdown */
-            if (value & 1) {
-                ptimer_stop(s->timer);
-                s->internal_counter = 0;
-                nrf51_timer_recalibrate(s, 1);
-                s->pulsed = false;
+        case NRF51_NVMC_ERASEUICR:
+            if (!(value & 1)) {
+                return;
             }
+            nrf51_nvmc_erase_uicr(s);
             break;
-        case NRF51_TIMER_CAPTURE0:
-        case NRF51_TIMER_CAPTURE1:
-        case NRF51_TIMER_CAPTURE2:
-        case NRF51_TIMER_CAPTURE3:
-            s->cc[(offset >> 2) & 0x3] = s->internal_counter;
-            break;
-        case NRF51_TIMER_COMPARE0:
-        case NRF51_TIMER_COMPARE1:
-        case NRF51_TIMER_COMPARE2:
-        case NRF51_TIMER_COMPARE3:
-            s->compare[(offset >> 2) & 0x3] = value;
-            break;
-        case NRF51_TIMER_SHORTS: /* Shorts */
-            qemu_log_mask(LOG_UNIMP,
-                          "%s: `SHORTS` not implemented when writing 0x%x\n",
-                          __func__,
-                          (int)offset);
-            break;
-        case NRF51_TIMER_INTENSET: /* Intenset */
-            s->inten |= (value >> 16) & 0xf;
-            break;
-        case NRF51_TIMER_INTENCLR:
-            /* TODO: verify this formula */
-            s->inten &= (~(value >> 16)) & 0xf;
-            break;
-        case NRF51_TIMER_MODE:
-            s->mode = value & 1;
-            nrf51_timer_recalibrate(s, 1);
-            break;
-        case NRF51_TIMER_BITMODE:
-            s->bitmode = value & 0x3;
-            break;
-        case NRF51_TIMER_PRESCALER:
-            s->prescaler = value & 0xf;
-            nrf51_timer_recalibrate(s, 1);
-            break;
-        case NRF51_TIMER_CC0:
-        case NRF51_TIMER_CC1:
-        case NRF51_TIMER_CC2:
-        case NRF51_TIMER_CC3:
-            s->cc[(offset >> 2) & 0x3] = value;
-            break;
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                          "%s: writing a bad offset 0x%x\n",
-                          __func__,
-                          (int)offset);
-            break;
-    };
+    }
+    nrf51_nvmc_busy(s, NRF51_NVMC_ERASE_NS);
+}
+
+static const NRF51Reg nrf51_nvmc_regs[] = {
+    NRF51_REG(NRF51_NVMC_READY) = {
+        NRF51_FIELD(NRF51NVMCState, ready, 0),
+    },
+    NRF51_REG(NRF51_NVMC_CONFIG) = {
+        NRF51_FIELD(NRF51NVMCState, config, 0),
+        .write = nrf51_nvmc_config_write,
+    },
+    NRF51_REG_ARRAY(NRF51_NVMC_ERASEPAGE, NRF51_NVMC_ERASEUICR) = {
+        .write = nrf51_nvmc_erase_write,
+    },
+};
+
+static uint64_t nrf51_nvmc_read(void *opaque, hwaddr offset,
+                                unsigned size)
+{
+    return nrf51_regs_read(opaque, nrf51_nvmc_regs,
+                           ARRAY_SIZE(nrf51_nvmc_regs), 0, offset);
+}
+
+static void nrf51_nvmc_write(void *opaque, hwaddr offset,
+                             uint64_t value, unsigned size)
+{
+    nrf51_regs_write(opaque, nrf51_nvmc_regs,
+                     ARRAY_SIZE(nrf51_nvmc_regs), 0, offset, value);
+}
+
+static const MemoryRegionOps nrf51_nvmc_ops = {
+    .read = nrf51_nvmc_read,
+    .write = nrf51_nvmc_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static int nrf51_nvmc_post_load(void *opaque, int version_id)
+{
+    NRF51NVMCState *s = opaque;
+
+    nrf51_nvmc_update_config(s);
+    if (s->cpu) {
+        ARM_CPU(s->cpu)->stalled = s->stalled;
+    }
+    return 0;
+}
+
+static void nrf51_nvmc_reset(DeviceState *dev)
+{
+    NRF51NVMCState *s = NRF51_NVMC(dev);
+
+    if (s->busy_timer) {
+        timer_del(s->busy_timer);
+        nrf51_nvmc_done(s);
+    }
+}
+
+static bool nrf51_nvmc_busy_needed(void *opaque)
+{
+    NRF51NVMCState *s = opaque;
+
+    return s->busy_timer && timer_pending(s->busy_timer);
+}
+
+static const VMStateDescription vmstate_nrf51_nvmc_busy = {
+    .name = TYPE_NRF51_NVMC "/busy",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nrf51_nvmc_busy_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER_PTR(busy_timer, NRF51NVMCState),
+        VMSTATE_BOOL(stalled, NRF51NVMCState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_nrf51_nvmc = {
+    .name = TYPE_NRF51_NVMC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = nrf51_nvmc_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ready, NRF51NVMCState),
+        VMSTATE_UINT32(config, NRF51NVMCState),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_nrf51_nvmc_busy,
+        NULL
+    }
+};
+
+static Property nrf51_nvmc_properties[] = {
+    DEFINE_PROP_UINT32("ready", NRF51NVMCState, ready, 1),
+    DEFINE_PROP_UINT32("config", NRF51NVMCState, config, 0),
+    DEFINE_PROP_UINT32("flash-base", NRF51NVMCState, flash_base, 0),
+    DEFINE_PROP_UINT32("flash-size", NRF51NVMCState, flash_size, 0),
+    DEFINE_PROP_UINT32("uicr-base", NRF51NVMCState, uicr_base, 0),
+    DEFINE_PROP_DRIVE("drive", NRF51NVMCState, blk),
+    DEFINE_PROP_STRING("flash-name", NRF51NVMCState, flash_name),
+    DEFINE_PROP_STRING("uicr-name", NRF51NVMCState, uicr_name),
+    DEFINE_PROP_STRING("image", NRF51NVMCState, image),
+    DEFINE_PROP_STRING("backing", NRF51NVMCState, backing),
+    DEFINE_PROP_BOOL("scratch", NRF51NVMCState, scratch, false),
+    DEFINE_PROP_BOOL("latency", NRF51NVMCState, latency, false),
+    DEFINE_PROP_LINK("memory", NRF51NVMCState, memory, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_LINK("cpu", NRF51NVMCState, cpu, TYPE_CPU, CPUState *),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+/**
+ * Map the flash MAP_PRIVATE from `image`, a raw dump of the whole flash.
+ * Every instance booting the same file shares its page cache until it
+ * writes a page, so the file, say a memfd under /proc/<pid>/fd, is
+ * never modified.
+ */
+static bool nrf51_nvmc_init_image(NRF51NVMCState *s, Error **errp)
+{
+    Error *local_err = NULL;
+    struct stat st;
+
+    if (s->blk) {
+        error_setg(errp, "%s: image and drive are mutually exclusive",
+                   __func__);
+        return false;
+    }
+    /* The RAM backend would create or resize a missing or short file */
+    if (stat(s->image, &st) < 0) {
+        error_setg_errno(errp, errno, "%s: cannot open image '%s'",
+                         __func__, s->image);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size < s->flash_size) {
+        error_setg(errp, "%s: image '%s' must be a file of at least %"
+                   PRIu32 " bytes", __func__, s->image, s->flash_size);
+        return false;
+    }
+
+    memory_region_init_ram_from_file(&s->flash, OBJECT(s),
+                                     s->flash_name ? s->flash_name
+                                                   : "nrf51_nvmc.flash",
+                                     s->flash_size, 0, false, s->image,
+                                     &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Map flash and UICR from `backing`, which holds flash_size bytes of code
+ * flash followed by NRF51_UICR_SIZE bytes of UICR. A shared file is
+ * created or extended as needed, the new part erased; a scratch file
+ * must already be whole, as it is never written.
+ */
+static bool nrf51_nvmc_init_backing(NRF51NVMCState *s, Error **errp)
+{
+    off_t size = (off_t)s->flash_size + NRF51_UICR_SIZE;
+    uint8_t *map;
+    struct stat st;
+    int fd;
+
+    if (s->blk || s->image) {
+        error_setg(errp, "%s: backing excludes image and drive", __func__);
+        return false;
+    }
+    fd = qemu_open(s->backing, s->scratch ? O_RDONLY : O_RDWR | O_CREAT,
+                   0644);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "%s: cannot open backing '%s'",
+                         __func__, s->backing);
+        return false;
+    }
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size < size && !s->scratch && ftruncate(fd, size) < 0)) {
+        error_setg_errno(errp, errno, "%s: cannot size backing '%s'",
+                         __func__, s->backing);
+        qemu_close(fd);
+        return false;
+    }
+    if (st.st_size < size && s->scratch) {
+        error_setg(errp, "%s: scratch backing '%s' must hold at least %"
+                   PRId64 " bytes", __func__, s->backing, (int64_t)size);
+        qemu_close(fd);
+        return false;
+    }
+
+    /* RAM blocks are whole host pages; the last one is backed in part */
+    s->backing_len = QEMU_ALIGN_UP(size, qemu_real_host_page_size);
+    map = mmap(NULL, s->backing_len, PROT_READ | PROT_WRITE,
+               s->scratch ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    qemu_close(fd);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "%s: cannot map backing '%s'",
+                         __func__, s->backing);
+        return false;
+    }
+    if (st.st_size < size) {
+        memset(map + st.st_size, 0xFF, size - st.st_size);
+    }
+    s->backing_map = map;
+
+    memory_region_init_ram_ptr(&s->flash, OBJECT(s),
+                               s->flash_name ? s->flash_name
+                                             : "nrf51_nvmc.flash",
+                               s->flash_size, map);
+    vmstate_register_ram(&s->flash, DEVICE(s));
+    memory_region_init_ram_ptr(&s->uicr, OBJECT(s),
+                               s->uicr_name ? s->uicr_name
+                                            : "nrf51_nvmc.uicr",
+                               NRF51_UICR_SIZE, map + s->flash_size);
+    vmstate_register_ram(&s->uicr, DEVICE(s));
+    s->exit_notifier.notify = nrf51_nvmc_exit;
+    qemu_add_exit_notifier(&s->exit_notifier);
+    return true;
+}
+
+static void nrf51_nvmc_realize(DeviceState *dev, Error **errp)
+{
+    NRF51NVMCState *s = NRF51_NVMC(dev);
+    Error *local_err = NULL;
+    uint64_t perm;
+    int ret;
+
+    if (s->flash_size == 0 || s->flash_size % NRF51_NVMC_PAGE_SIZE) {
+        error_setg(errp, "%s: flash-size must be a multiple of %d",
+                   __func__, NRF51_NVMC_PAGE_SIZE);
+        return;
+    }
+
+    if (s->backing) {
+        if (!nrf51_nvmc_init_backing(s, errp)) {
+            return;
+        }
+    } else if (s->image) {
+        if (!nrf51_nvmc_init_image(s, errp)) {
+            return;
+        }
+    } else {
+        memory_region_init_ram(&s->flash, OBJECT(dev),
+                               s->flash_name ? s->flash_name
+                                             : "nrf51_nvmc.flash",
+                               s->flash_size, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+        memset(memory_region_get_ram_ptr(&s->flash), 0xFF, s->flash_size);
+    }
+    if (!s->backing) {
+        memory_region_init_ram(&s->uicr, OBJECT(dev),
+                               s->uicr_name ? s->uicr_name
+                                            : "nrf51_nvmc.uicr",
+                               NRF51_UICR_SIZE, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+        memset(memory_region_get_ram_ptr(&s->uicr), 0xFF, NRF51_UICR_SIZE);
+    }
+    sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->flash);
+    sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->uicr);
+    address_space_init(&s->as, s->memory ? s->memory : get_system_memory(),
+                       TYPE_NRF51_NVMC);
+    nrf51_nvmc_update_config(s);
+
+    if (s->blk) {
+        perm = BLK_PERM_CONSISTENT_READ |
+               (blk_is_read_only(s->blk) ? 0 : BLK_PERM_WRITE);
+        ret = blk_set_perm(s->blk, perm, BLK_PERM_ALL, errp);
+        if (ret < 0) {
+            return;
+        }
+        ret = blk_pread(s->blk, 0, memory_region_get_ram_ptr(&s->flash),
+                        MIN(blk_getlength(s->blk), s->flash_size));
+        if (ret < 0) {
+            error_setg(errp, "%s: failed to read the flash image", __func__);
+            return;
+        }
+    }
+
+    if (nrf51_nvmc_writeback_enabled(s)) {
+        /* Pages are tracked with the dirty log; no hook in the store path */
+        memory_region_set_log(&s->flash, true, DIRTY_MEMORY_VGA);
+        s->writeback_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                          nrf51_nvmc_writeback_expire, s);
+        s->vmstate_change =
+            qemu_add_vm_change_state_handler(nrf51_nvmc_vm_state_change, s);
+    }
+    if (s->latency) {
+        s->busy_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                     nrf51_nvmc_busy_expire, s);
+    }
+}
+
+static void nrf51_nvmc_init(Object *obj)
+{
+    NRF51NVMCState *s = NRF51_NVMC(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    nrf51_init_io(&s->iomem, obj, &nrf51_nvmc_ops, s,
+                  TYPE_NRF51_NVMC, 0x1000);
+    memory_region_set_pollable(&s->iomem, true);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void nrf51_nvmc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    dc->realize = nrf51_nvmc_realize;
+    dc->reset = nrf51_nvmc_reset;
+    dc->props = nrf51_nvmc_properties;
+    dc->vmsd = &vmstate_nrf51_nvmc;
+}
+
+static const TypeInfo nrf51_nvmc_info = {
+    .name          = TYPE_NRF51_NVMC,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51NVMCState),
+    .instance_init = nrf51_nvmc_init,
+    .class_init    = nrf51_nvmc_class_init,
+};
+
+static int nrf51_nvmc_sync_child(Object *obj, void *opaque)
+{
+    Object *nvmc = object_dynamic_cast(obj, TYPE_NRF51_NVMC);
+
+    return nvmc && !nrf51_nvmc_sync(NRF51_NVMC(nvmc), opaque);
+}
+
+/* Every board's backing file, for the fleet */
+void qmp_microbit_flash_sync(Error **errp)
+{
+    object_child_foreach_recursive(object_get_root(), nrf51_nvmc_sync_child,
+                                   errp);
+}
+
+/**
+ * Register blocks kept in RAM (register_init_block32_romd())
+ *
+ * Guest reads of these registers are plain RAM reads; only writes call
+ * into the device, through the register API.
+ */
+
+static const MemoryRegionOps nrf51_regs_ops = {
+    .read = register_read_memory,
+    .write = register_write_memory,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+/**
+ * NRF51 FICR
+ */
+
+#define TYPE_NRF51_FICR "nrf51_ficr"
+#define NRF51_FICR(obj) \
+    OBJECT_CHECK(NRF51FICRState, (obj), TYPE_NRF51_FICR)
+
+enum{
+    NRF51_FICR_CODEPAGESIZE = 0x010,
+    NRF51_FICR_CODESIZE = 0x014,
+    NRF51_FICR_CLENR0 = 0x028,
+    NRF51_FICR_PPFC = 0x02C,
+    NRF51_FICR_NUMRAMBLOCK = 0x034,
+    NRF51_FICR_SIZERAMBLOCKS = 0x038,
+    NRF51_FICR_SIZERAMBLOCK0 = 0x038,
+    NRF51_FICR_SIZERAMBLOCK1 = 0x03C,
+    NRF51_FICR_SIZERAMBLOCK2 = 0x040,
+    NRF51_FICR_SIZERAMBLOCK3 = 0x044,
+    NRF51_FICR_CONFIGID = 0x05C,
+    NRF51_FICR_DEVICEID0 = 0x060,
+    NRF51_FICR_DEVICEID1 = 0x064,
+    NRF51_FICR_ER0 = 0x080,
+    NRF51_FICR_ER1 = 0x084,
+    NRF51_FICR_ER2 = 0x088,
+    NRF51_FICR_ER3 = 0x08C,
+    NRF51_FICR_IR0 = 0x090,
+    NRF51_FICR_IR1 = 0x094,
+    NRF51_FICR_IR2 = 0x098,
+    NRF51_FICR_IR3 = 0x09C,
+    NRF51_FICR_DEVICEADDRTYPE = 0x0A0,
+    NRF51_FICR_DEVICEADDR0 = 0x0A4,
+    NRF51_FICR_DEVICEADDR1 = 0x0A8,
+    NRF51_FICR_OVERRIDEEN = 0x0AC,
+    NRF51_FICR_NRF_1MBIT0 = 0x0B0,
+    NRF51_FICR_NRF_1MBIT1 = 0x0B4,
+    NRF51_FICR_NRF_1MBIT2 = 0x0B8,
+    NRF51_FICR_NRF_1MBIT3 = 0x0BC,
+    NRF51_FICR_NRF_1MBIT4 = 0x0C0,
+    NRF51_FICR_BLE_1MBIT0 = 0x0EC,
+    NRF51_FICR_BLE_1MBIT1 = 0x0F0,
+    NRF51_FICR_BLE_1MBIT2 = 0x0F4,
+    NRF51_FICR_BLE_1MBIT3 = 0x0F8,
+    NRF51_FICR_BLE_1MBIT4 = 0x0FC,
+};
+
+#define NRF51_FICR_NUM_REGS (NRF51_FICR_CODESIZE / 4 + 1)
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    RegisterInfoArray *reg_array;
+    RegisterInfo regs_info[NRF51_FICR_NUM_REGS];
+    /* The register values, in reg_array's RAM */
+    uint32_t *regs;
+    uint32_t codepagesize;
+    uint32_t codesize;
+
+} NRF51FICRState;
+
+static const RegisterAccessInfo nrf51_ficr_regs_info[] = {
+    {   .name = "CODEPAGESIZE", .addr = NRF51_FICR_CODEPAGESIZE,
+    },{ .name = "CODESIZE", .addr = NRF51_FICR_CODESIZE,
+    }
+};
+
+static Property nrf51_ficr_properties[] = {
+    DEFINE_PROP_UINT32("codepagesize", NRF51FICRState, codepagesize, 4096),
+    DEFINE_PROP_UINT32("codesize", NRF51FICRState, codesize, 64),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void nrf51_ficr_realize(DeviceState *dev, Error **errp)
+{
+    NRF51FICRState *s = NRF51_FICR(dev);
+
+    s->reg_array =
+        register_init_block32_romd(dev, nrf51_ficr_regs_info,
+                                   ARRAY_SIZE(nrf51_ficr_regs_info),
+                                   s->regs_info, &nrf51_regs_ops, false,
+                                   0x1000, errp);
+    if (!s->reg_array) {
+        return;
+    }
+    s->regs = memory_region_get_ram_ptr(&s->reg_array->mem);
+    sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->reg_array->mem);
+}
+
+static void nrf51_ficr_reset(DeviceState *dev)
+{
+    NRF51FICRState *s = NRF51_FICR(dev);
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(s->regs_info); i++) {
+        register_reset(&s->regs_info[i]);
+    }
+    s->regs[NRF51_FICR_CODEPAGESIZE / 4] = s->codepagesize;
+    s->regs[NRF51_FICR_CODESIZE / 4] = s->codesize;
+}
+
+static void nrf51_ficr_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    dc->props = nrf51_ficr_properties;
+    dc->realize = nrf51_ficr_realize;
+    dc->reset = nrf51_ficr_reset;
+}
+
+static const TypeInfo nrf51_ficr_info = {
+    .name          = TYPE_NRF51_FICR,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51FICRState),
+    .class_init    = nrf51_ficr_class_init,
+};
+
+/**
+ * NRF51 CLOCK & POWER & MPU
+ *   With respect to nRF51822 Reference Manual
+ *   NOTE: incomplete implementation
+ *         timer does not need clock input,
+ *         so the clock is a fake one
+ *         HFCLK and LFCLK state is driven on the "hfclk" and "lfclk" gpio
+ *         outputs, high while the clock runs
+ *         SYSTEMOFF suspends the machine with every peripheral but GPIO
+ *         reset, so neither the vCPU nor a peripheral timer runs; GPIO
+ *         DETECT or a reset wakes it through a system reset. RAM banks
+ *         switched off, or not retained in System OFF, are given back to
+ *         the host and read as zero. Only a single board can be suspended.
+ */
+
+#define TYPE_NRF51_CPM "nrf51_clock_power_mpu"
+#define NRF51_CPM(obj) \
+    OBJECT_CHECK_HOT(NRF51CPMState, (obj), TYPE_NRF51_CPM)
+
+enum {
+    NRF51_CLK_HFCLKSTART   = 0x000,
+    NRF51_CLK_HFCLKSTOP    = 0x004,
+    NRF51_CLK_LFCLKSTART   = 0x008,
+    NRF51_CLK_LFCLKSTOP    = 0x00C,
+    NRF51_CLK_HFCLKSTARTED = 0x100,
+    NRF51_CLK_LFCLKSTARTED = 0x104,
+    NRF51_CLK_CAL          = 0x010,
+    NRF51_CLK_CTSTART      = 0x014,
+    NRF51_CLK_CTSTOP       = 0x018,
+    NRF51_CLK_INTENSET     = 0x304,
+    NRF51_CLK_INTENCLR     = 0x308,
+    NRF51_CLK_HFCLKRUN     = 0x408,
+    NRF51_CLK_HFCLKSTAT    = 0x40c,
+    NRF51_CLK_LFCLKRUN     = 0x414,
+    NRF51_CLK_LFCLKSTAT    = 0x418,
+    NRF51_CLK_LFCLKSRCCOPY = 0x41c,
+    NRF51_CLK_LFCLKSRC     = 0x518,
+    NRF51_CLK_CTIV         = 0x538,
+    NRF51_CLK_XTALFREQ     = 0x550,
+    NRF51_PWR_RESETREAS    = 0x400,
+    NRF51_PWR_SYSTEMOFF    = 0x500,
+    NRF51_PWR_GPREGRET     = 0x51c,
+    NRF51_PWR_RAMON        = 0x524,
+    NRF51_PWR_RAMONB       = 0x554,
+    NRF51_UNKNOWN_VAL      = 0,
+};
+
+#define NRF51_CPM_NUM_REGS (NRF51_PWR_RAMONB / 4 + 1)
+
+#define NRF51_PWR_RESETREAS_MASK     0x0007000f
+#define NRF51_PWR_RESETREAS_RESETPIN (1 << 0)
+#define NRF51_PWR_RESETREAS_OFF      (1 << 16)
+#define NRF51_PWR_RESETREAS_LPCOMP   (1 << 17)
+
+/* RAMON and RAMONB each power two 8KB banks: ONRAMn in bit n, OFFRAMn in
+ * bit n + 16 */
+#define NRF51_PWR_RAMON_MASK         0x00030003
+#define NRF51_PWR_OFFRAM_SHIFT       16
+#define NRF51_RAM_BANK_SIZE          0x2000
+#define NRF51_RAM_NUM_BANKS          4
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    RegisterInfoArray *reg_array;
+    RegisterInfo regs_info[NRF51_CPM_NUM_REGS];
+    /* The register values, in reg_array's RAM */
+    uint32_t *regs;
+
+    /* Clock state out of reset */
+    bool hfclk_enabled;
+    bool lfclk_enabled;
+    qemu_irq hfclk_out;
+    qemu_irq lfclk_out;
+    /* High while in System OFF */
+    qemu_irq off_out;
+
+    /* Banks of this RAM are powered by RAMON and RAMONB */
+    MemoryRegion *ram;
+    /* DETECT wakes us from System OFF */
+    NRF51GPIOState *gpio;
+    Notifier pin_notifier;
+    /* So does an ANADETECT crossing of this comparator, kept running */
+    DeviceState *lpcomp;
+    bool anadetect;
+    /* SYSTEMOFF may suspend the machine, which holds only this board */
+    bool system_off;
+    Notifier suspend_notifier;
+    QEMUBH *wake_bh;
+    /* In System OFF */
+    bool off;
+} NRF51CPMState;
+
+/* Bank @bank loses its contents: give its pages back to the host */
+static void nrf51_cpm_ram_discard(NRF51CPMState *s, int bank)
+{
+    hwaddr offset = bank * NRF51_RAM_BANK_SIZE;
+
+    if (!s->ram || offset >= memory_region_size(s->ram)) {
+        return;
+    }
+    /* A discarded page reads as zero; hosts with larger pages get a
+       memset instead */
+    if (!QEMU_IS_ALIGNED(offset | NRF51_RAM_BANK_SIZE,
+                         qemu_ram_pagesize(s->ram->ram_block)) ||
+        ram_block_discard_range(s->ram->ram_block, offset,
+                                NRF51_RAM_BANK_SIZE)) {
+        memset((uint8_t *)memory_region_get_ram_ptr(s->ram) + offset, 0,
+               NRF51_RAM_BANK_SIZE);
+    }
+    memory_region_set_dirty(s->ram, offset, NRF51_RAM_BANK_SIZE);
+}
+
+/* The banks whose bits are set in @mask, for RAMON or RAMONB at @addr */
+static void nrf51_cpm_ram_discard_mask(NRF51CPMState *s, hwaddr addr,
+                                       uint32_t mask)
+{
+    int first = addr == NRF51_PWR_RAMON ? 0 : 2;
+
+    for (int i = 0; i < 2; i++) {
+        if (mask & (1 << i)) {
+            nrf51_cpm_ram_discard(s, first + i);
+        }
+    }
+}
+
+/* Switching a bank off in System ON loses its contents */
+static uint64_t nrf51_cpm_ramon_prew(RegisterInfo *reg, uint64_t val)
+{
+    NRF51CPMState *s = NRF51_CPM(reg->opaque);
+    uint32_t old = s->regs[reg->access->addr / 4];
+
+    nrf51_cpm_ram_discard_mask(s, reg->access->addr, old & ~val);
+    return val;
+}
+
+static uint64_t nrf51_cpm_systemoff_prew(RegisterInfo *reg, uint64_t val)
+{
+    NRF51CPMState *s = NRF51_CPM(reg->opaque);
+
+    if (!(val & 1)) {
+        return 0;
+    }
+    if (!s->system_off) {
+        qemu_log_mask_ratelimited(LOG_UNIMP, 0,
+                                  "%s: SYSTEMOFF needs a single board\n",
+                                  __func__);
+        return 0;
+    }
+    s->off = true;
+    s->anadetect = false;
+    qemu_irq_raise(s->off_out);
+    qemu_system_suspend_request();
+    return 0;
+}
+
+/* Leaves System OFF through a reset if DETECT is high or LPCOMP fired */
+static void nrf51_cpm_wake(void *opaque)
+{
+    NRF51CPMState *s = NRF51_CPM(opaque);
+    bool detect;
+
+    if (!s->off || !runstate_check(RUN_STATE_SUSPENDED)) {
+        return;
+    }
+    detect = nrf51_gpio_detect(s->gpio);
+    if (!detect && !s->anadetect) {
+        return;
+    }
+    s->off = false;
+    qemu_irq_lower(s->off_out);
+    s->regs[NRF51_PWR_RESETREAS / 4] |= detect ? NRF51_PWR_RESETREAS_OFF :
+                                                 NRF51_PWR_RESETREAS_LPCOMP;
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+}
+
+static void nrf51_cpm_set_anadetect(void *opaque, int n, int level)
+{
+    NRF51CPMState *s = NRF51_CPM(opaque);
+
+    if (s->off && level) {
+        s->anadetect = true;
+        qemu_bh_schedule(s->wake_bh);
+    }
+}
+
+static void nrf51_cpm_pin_changed(Notifier *notifier, void *data)
+{
+    NRF51CPMState *s = container_of(notifier, NRF51CPMState, pin_notifier);
+
+    if (s->off) {
+        qemu_bh_schedule(s->wake_bh);
+    }
+}
+
+/* The vCPU is paused: power down the rest of the board */
+static void nrf51_cpm_suspend(Notifier *notifier, void *data)
+{
+    NRF51CPMState *s = container_of(notifier, NRF51CPMState,
+                                    suspend_notifier);
+    BusState *bus = sysbus_get_default();
+    BusChild *kid;
+
+    if (!s->off) {
+        return;
+    }
+    for (int i = 0; i < NRF51_RAM_NUM_BANKS; i++) {
+        hwaddr addr = i < 2 ? NRF51_PWR_RAMON : NRF51_PWR_RAMONB;
+        uint32_t ramon = s->regs[addr / 4] >> (i & 1);
+
+        if (!(ramon & (1 << NRF51_PWR_OFFRAM_SHIFT))) {
+            nrf51_cpm_ram_discard(s, i);
+        }
+    }
+    /* A reset cancels every peripheral's timers; the GPIO keeps SENSE and
+       LPCOMP keeps comparing */
+    QTAILQ_FOREACH(kid, &bus->children, sibling) {
+        DeviceState *dev = kid->child;
+
+        if (dev != DEVICE(s) && dev != DEVICE(s->gpio) && dev != s->lpcomp) {
+            qdev_reset_all(dev);
+        }
+    }
+    /* DETECT may already be high; the runstate is SUSPENDED by then */
+    qemu_bh_schedule(s->wake_bh);
+}
+
+static void nrf51_cpm_update_clocks(NRF51CPMState *s)
+{
+    qemu_set_irq(s->hfclk_out, s->regs[NRF51_CLK_HFCLKSTARTED / 4]);
+    qemu_set_irq(s->lfclk_out, s->regs[NRF51_CLK_LFCLKSTARTED / 4]);
+}
+
+/* The clock tasks start or stop the clock at once, and read back as 0 */
+static uint64_t nrf51_cpm_clk_task_prew(RegisterInfo *reg, uint64_t val)
+{
+    NRF51CPMState *s = NRF51_CPM(reg->opaque);
+
+    switch (reg->access->addr) {
+    case NRF51_CLK_HFCLKSTART:
+        s->regs[NRF51_CLK_HFCLKSTARTED / 4] = val & 1;
+        break;
+    case NRF51_CLK_HFCLKSTOP:
+        s->regs[NRF51_CLK_HFCLKSTARTED / 4] = !(val & 1);
+        break;
+    case NRF51_CLK_LFCLKSTART:
+        s->regs[NRF51_CLK_LFCLKSTARTED / 4] = val & 1;
+        break;
+    case NRF51_CLK_LFCLKSTOP:
+        s->regs[NRF51_CLK_LFCLKSTARTED / 4] = !(val & 1);
+        break;
+    }
+    nrf51_cpm_update_clocks(s);
+    return 0;
+}
+
+static const RegisterAccessInfo nrf51_cpm_regs_info[] = {
+    {   .name = "HFCLKSTART", .addr = NRF51_CLK_HFCLKSTART,
+        .pre_write = nrf51_cpm_clk_task_prew,
+    },{ .name = "HFCLKSTOP", .addr = NRF51_CLK_HFCLKSTOP,
+        .pre_write = nrf51_cpm_clk_task_prew,
+    },{ .name = "LFCLKSTART", .addr = NRF51_CLK_LFCLKSTART,
+        .pre_write = nrf51_cpm_clk_task_prew,
+    },{ .name = "LFCLKSTOP", .addr = NRF51_CLK_LFCLKSTOP,
+        .pre_write = nrf51_cpm_clk_task_prew,
+    },{ .name = "HFCLKSTARTED", .addr = NRF51_CLK_HFCLKSTARTED,
+        .ro = 0xffffffff,
+    },{ .name = "LFCLKSTARTED", .addr = NRF51_CLK_LFCLKSTARTED,
+        .ro = 0xffffffff,
+    },{ .name = "LFCLKSRC", .addr = NRF51_CLK_LFCLKSRC,
+        .reset = NRF51_UNKNOWN_VAL,
+        .ro = 0xffffffff,
+    },{ .name = "RESETREAS", .addr = NRF51_PWR_RESETREAS,
+        .ro = ~NRF51_PWR_RESETREAS_MASK,
+        .w1c = NRF51_PWR_RESETREAS_MASK,
+    },{ .name = "SYSTEMOFF", .addr = NRF51_PWR_SYSTEMOFF,
+        .pre_write = nrf51_cpm_systemoff_prew,
+    },{ .name = "GPREGRET", .addr = NRF51_PWR_GPREGRET,
+        .ro = ~0xff,
+    },{ .name = "RAMON", .addr = NRF51_PWR_RAMON,
+        .reset = 0x00000003,
+        .ro = ~NRF51_PWR_RAMON_MASK,
+        .pre_write = nrf51_cpm_ramon_prew,
+    },{ .name = "RAMONB", .addr = NRF51_PWR_RAMONB,
+        .reset = 0x00000003,
+        .ro = ~NRF51_PWR_RAMON_MASK,
+        .pre_write = nrf51_cpm_ramon_prew,
+    }
+};
+
+static const VMStateDescription vmstate_nrf51_cpm = {
+    .name = TYPE_NRF51_CPM,
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(off, NRF51CPMState),
+        VMSTATE_BOOL_V(anadetect, NRF51CPMState, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_cpm_properties[] = {
+    DEFINE_PROP_BOOL("hfclk_enabled", NRF51CPMState, hfclk_enabled, false),
+    DEFINE_PROP_BOOL("lfclk_enabled", NRF51CPMState, lfclk_enabled, false),
+    DEFINE_PROP_LINK("ram", NRF51CPMState, ram, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_LINK("gpio", NRF51CPMState, gpio, TYPE_NRF51_GPIO,
+                     NRF51GPIOState *),
+    DEFINE_PROP_LINK("lpcomp", NRF51CPMState, lpcomp, TYPE_DEVICE,
+                     DeviceState *),
+    DEFINE_PROP_BOOL("system-off", NRF51CPMState, system_off, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_cpm_realize(DeviceState *dev, Error **errp)
+{
+    NRF51CPMState *s = NRF51_CPM(dev);
+
+    s->reg_array =
+        register_init_block32_romd(dev, nrf51_cpm_regs_info,
+                                   ARRAY_SIZE(nrf51_cpm_regs_info),
+                                   s->regs_info, &nrf51_regs_ops, false,
+                                   0x1000, errp);
+    if (!s->reg_array) {
+        return;
+    }
+    s->regs = memory_region_get_ram_ptr(&s->reg_array->mem);
+    sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->reg_array->mem);
+    qdev_init_gpio_out_named(dev, &s->hfclk_out, "hfclk", 1);
+    qdev_init_gpio_out_named(dev, &s->lfclk_out, "lfclk", 1);
+    qdev_init_gpio_out_named(dev, &s->off_out, "system-off", 1);
+    qdev_init_gpio_in_named(dev, nrf51_cpm_set_anadetect, "anadetect", 1);
+
+    if (s->system_off) {
+        if (!s->gpio) {
+            error_setg(errp, "%s: gpio link is required", __func__);
+            return;
+        }
+        s->pin_notifier.notify = nrf51_cpm_pin_changed;
+        notifier_list_add(&s->gpio->pin_notifiers, &s->pin_notifier);
+        s->suspend_notifier.notify = nrf51_cpm_suspend;
+        qemu_register_suspend_notifier(&s->suspend_notifier);
+        s->wake_bh = nrf51_locked_bh_new(nrf51_cpm_wake, s);
+    }
+}
+
+static void nrf51_cpm_reset(DeviceState *dev)
+{
+    NRF51CPMState *s = NRF51_CPM(dev);
+    /* Only a power-on reset clears these */
+    uint32_t resetreas = s->regs[NRF51_PWR_RESETREAS / 4];
+    uint32_t gpregret = s->regs[NRF51_PWR_GPREGRET / 4];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(s->regs_info); i++) {
+        register_reset(&s->regs_info[i]);
+    }
+    s->regs[NRF51_CLK_HFCLKSTARTED / 4] = s->hfclk_enabled;
+    s->regs[NRF51_CLK_LFCLKSTARTED / 4] = s->lfclk_enabled;
+    nrf51_cpm_update_clocks(s);
+    s->regs[NRF51_PWR_RESETREAS / 4] = resetreas;
+    s->regs[NRF51_PWR_GPREGRET / 4] = gpregret;
+    s->anadetect = false;
+
+    /* A reset in System OFF, from the monitor, is a pin reset */
+    if (s->off) {
+        s->off = false;
+        qemu_irq_lower(s->off_out);
+        s->regs[NRF51_PWR_RESETREAS / 4] |= NRF51_PWR_RESETREAS_RESETPIN;
+        qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    }
+}
+
+static void nrf51_cpm_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    dc->props = nrf51_cpm_properties;
+    dc->realize = nrf51_cpm_realize;
+    dc->reset = nrf51_cpm_reset;
+    dc->vmsd = &vmstate_nrf51_cpm;
+}
+
+static const TypeInfo nrf51_cpm_info = {
+    .name          = TYPE_NRF51_CPM,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51CPMState),
+    .class_init    = nrf51_cpm_class_init,
+};
+
+/**
+ * NRF51 activity
+ *   Not a peripheral: integrates, in virtual time, how long the CPU, the
+ *   RADIO and the HFCLK crystal spend in each power-relevant state, for
+ *   query-microbit-activity.  The times add up from power-on; a reset
+ *   does not clear them.
+ */
+
+#define TYPE_NRF51_ACTIVITY "nrf51_activity"
+#define NRF51_ACTIVITY(obj) \
+    OBJECT_CHECK_HOT(NRF51ActivityState, (obj), TYPE_NRF51_ACTIVITY)
+
+enum {
+    NRF51_ACTIVITY_HFCLK,
+    NRF51_ACTIVITY_RADIO,
+    NRF51_ACTIVITY_OFF,
+    NRF51_ACTIVITY_NUM,
+};
+
+static const char *const nrf51_activity_names[NRF51_ACTIVITY_NUM] = {
+    [NRF51_ACTIVITY_HFCLK] = "hfclk",
+    [NRF51_ACTIVITY_RADIO] = "radio",
+    [NRF51_ACTIVITY_OFF]   = "system-off",
+};
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    CPUState *cpu;
+    uint32_t board;
+
+    int64_t start;
+    bool level[NRF51_ACTIVITY_NUM];
+    /* When each input last rose, and its time high before that */
+    int64_t since[NRF51_ACTIVITY_NUM];
+    int64_t total[NRF51_ACTIVITY_NUM];
+} NRF51ActivityState;
+
+static void nrf51_activity_set(void *opaque, int n, int level)
+{
+    NRF51ActivityState *s = NRF51_ACTIVITY(opaque);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (s->level[n] == !!level) {
+        return;
+    }
+    s->level[n] = level;
+    if (level) {
+        s->since[n] = now;
+    } else {
+        s->total[n] += now - s->since[n];
+    }
+}
+
+/* Time input @n has been high, up to @now */
+static int64_t nrf51_activity_total(NRF51ActivityState *s, int n,
+                                    int64_t now)
+{
+    return s->total[n] + (s->level[n] ? now - s->since[n] : 0);
+}
+
+static MicrobitActivity *nrf51_activity_query(NRF51ActivityState *s)
+{
+    MicrobitActivity *info = g_new0(MicrobitActivity, 1);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    info->board = s->board;
+    info->elapsed = now - s->start;
+    info->system_off = nrf51_activity_total(s, NRF51_ACTIVITY_OFF, now);
+    info->radio_on = nrf51_activity_total(s, NRF51_ACTIVITY_RADIO, now);
+    info->hfclk_on = nrf51_activity_total(s, NRF51_ACTIVITY_HFCLK, now);
+    /* System OFF pauses the CPU rather than halting it */
+    info->cpu_sleep = MIN(cpu_halted_ns(s->cpu), info->elapsed);
+    info->cpu_active = MAX(info->elapsed - info->cpu_sleep -
+                           info->system_off, 0);
+    return info;
+}
+
+static const VMStateDescription vmstate_nrf51_activity = {
+    .name = TYPE_NRF51_ACTIVITY,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT64(start, NRF51ActivityState),
+        VMSTATE_BOOL_ARRAY(level, NRF51ActivityState, NRF51_ACTIVITY_NUM),
+        VMSTATE_INT64_ARRAY(since, NRF51ActivityState, NRF51_ACTIVITY_NUM),
+        VMSTATE_INT64_ARRAY(total, NRF51ActivityState, NRF51_ACTIVITY_NUM),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_activity_properties[] = {
+    DEFINE_PROP_LINK("cpu", NRF51ActivityState, cpu, TYPE_CPU, CPUState *),
+    DEFINE_PROP_UINT32("board", NRF51ActivityState, board, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_activity_realize(DeviceState *dev, Error **errp)
+{
+    NRF51ActivityState *s = NRF51_ACTIVITY(dev);
+
+    if (!s->cpu) {
+        error_setg(errp, "%s: cpu link is required", __func__);
+        return;
+    }
+    s->start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    for (int i = 0; i < NRF51_ACTIVITY_NUM; i++) {
+        qdev_init_gpio_in_named(dev, nrf51_activity_set,
+                                nrf51_activity_names[i], 1);
+    }
+}
+
+static void nrf51_activity_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    dc->props = nrf51_activity_properties;
+    dc->realize = nrf51_activity_realize;
+    dc->vmsd = &vmstate_nrf51_activity;
+}
+
+static const TypeInfo nrf51_activity_info = {
+    .name          = TYPE_NRF51_ACTIVITY,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51ActivityState),
+    .class_init    = nrf51_activity_class_init,
+};
+
+static int nrf51_activity_query_child(Object *obj, void *opaque)
+{
+    Object *activity = object_dynamic_cast(obj, TYPE_NRF51_ACTIVITY);
+    MicrobitActivityList ***tail = opaque;
+
+    if (activity) {
+        **tail = g_new0(MicrobitActivityList, 1);
+        (**tail)->value = nrf51_activity_query(NRF51_ACTIVITY(activity));
+        *tail = &(**tail)->next;
+    }
+    return 0;
+}
+
+/* One entry per board, for the fleet */
+MicrobitActivityList *qmp_query_microbit_activity(Error **errp)
+{
+    MicrobitActivityList *head = NULL;
+    MicrobitActivityList **tail = &head;
+
+    object_child_foreach_recursive(object_get_root(),
+                                   nrf51_activity_query_child, &tail);
+    return head;
+}
+
+/**
+ * NRF51 PPI
+ *   Programmable Peripheral Interconnect
+ *   NOTE: events are routed through a table indexed by peripheral slot and
+ *         event number, and each channel's task is resolved to its
+ *         MemoryRegion when TEP is written, so a routed event triggers the
+ *         task within the same host call, without any guest interrupt.
+ *         The pre-programmed channels 20-31 are not routed.
+ */
+
+#define TYPE_NRF51_PPI "nrf51_ppi"
+#define NRF51_PPI(obj) \
+    OBJECT_CHECK(NRF51PPIState, (obj), TYPE_NRF51_PPI)
+
+#define NRF51_PPI_NUM_CH     16
+#define NRF51_PPI_NUM_GROUPS 4
+#define NRF51_PPI_NUM_SLOTS  32
+#define NRF51_PPI_NUM_EVENTS 32
+#define NRF51_PPI_MAX_DEPTH  8
+
+enum {
+    NRF51_PPI_CHG0EN  = 0x000,
+    NRF51_PPI_CHG3DIS = 0x01C,
+    NRF51_PPI_CHEN    = 0x500,
+    NRF51_PPI_CHENSET = 0x504,
+    NRF51_PPI_CHENCLR = 0x508,
+    NRF51_PPI_CH0_EEP = 0x510,
+    NRF51_PPI_CH15_TEP = 0x58C,
+    NRF51_PPI_CHG0    = 0x800,
+    NRF51_PPI_CHG3    = 0x80C,
+
+    /* Peripherals with events live in 4K slots from 0x40000000 */
+    NRF51_PPI_PERI_BASE   = 0x40000000,
+    NRF51_PPI_EVENTS_BASE = 0x100,
+};
+
+typedef struct {
+    MemoryRegion *mr;
+    hwaddr offset;
+} NRF51PPITask;
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    NotifierList routing_notifiers;
+
+    /* Public Regs */
+    uint32_t chen;
+    uint32_t chg[NRF51_PPI_NUM_GROUPS];
+    uint32_t eep[NRF51_PPI_NUM_CH];
+    uint32_t tep[NRF51_PPI_NUM_CH];
+
+    /* Routing tables, rebuilt from the registers above */
+    uint16_t event_map[NRF51_PPI_NUM_SLOTS][NRF51_PPI_NUM_EVENTS];
+    NRF51PPITask task[NRF51_PPI_NUM_CH];
+    int depth;
+    /* Bus seen by the device's own accesses, the system bus by default */
+    MemoryRegion *memory;
+    AddressSpace as;
+} NRF51PPIState;
+
+/* Guest address of the register at `offset` in a peripheral's window */
+static hwaddr nrf51_periph_addr(SysBusDevice *sbd, hwaddr offset)
+{
+    return sysbus_mmio_get_region(sbd, 0)->addr + offset;
+}
+
+/* ENABLE values of the peripherals that share an ID, e.g. SPI0 and TWI0 */
+enum {
+    NRF51_PERIPH_ENABLE = 0x500,
+    NRF51_ENABLE_SPI    = 1,
+    NRF51_ENABLE_CCM    = 2,
+    NRF51_ENABLE_AAR    = 3,
+    NRF51_ENABLE_TWI    = 5,
+};
+
+/* Make `sbd` the owner of the register window it shares with `peer` */
+static void nrf51_periph_claim(SysBusDevice *sbd, SysBusDevice *peer)
+{
+    if (peer) {
+        memory_region_set_enabled(sysbus_mmio_get_region(peer, 0), false);
+    }
+    memory_region_set_enabled(sysbus_mmio_get_region(sbd, 0), true);
+}
+
+/**
+ * Peripherals sharing an ID are mapped at the same address and only the
+ * owner's MemoryRegion is enabled. Writing ENABLE with the value of
+ * `peer` hands it the window, and the write itself.
+ */
+static bool nrf51_periph_hand_over(SysBusDevice *sbd, SysBusDevice *peer,
+                                   uint64_t value)
+{
+    if (!peer) {
+        return false;
+    }
+    nrf51_periph_claim(peer, sbd);
+    memory_region_dispatch_write(sysbus_mmio_get_region(peer, 0),
+                                 NRF51_PERIPH_ENABLE, value, 4,
+                                 MEMTXATTRS_UNSPECIFIED);
+    return true;
+}
+
+static uint16_t *nrf51_ppi_event_slot(NRF51PPIState *s, hwaddr eep)
+{
+    hwaddr slot = (eep - NRF51_PPI_PERI_BASE) >> 12;
+    hwaddr event = ((eep & 0xfff) - NRF51_PPI_EVENTS_BASE) >> 2;
+
+    if (eep < NRF51_PPI_PERI_BASE || slot >= NRF51_PPI_NUM_SLOTS ||
+        (eep & 0xfff) < NRF51_PPI_EVENTS_BASE ||
+        event >= NRF51_PPI_NUM_EVENTS) {
+        return NULL;
+    }
+    return &s->event_map[slot][event];
+}
+
+/* Enabled channels whose EEP is `eep` */
+static uint32_t nrf51_ppi_channels(NRF51PPIState *s, hwaddr eep)
+{
+    uint16_t *entry;
+
+    if (!s) {
+        return 0;
+    }
+    entry = nrf51_ppi_event_slot(s, eep);
+    return entry ? *entry : 0;
+}
+
+/* Whether an event triggers any task, i.e. needs to be delivered on time */
+static bool nrf51_ppi_event_routed(NRF51PPIState *s, hwaddr eep)
+{
+    return nrf51_ppi_channels(s, eep) != 0;
+}
+
+/* Triggers the task at @offset of region @opaque */
+static void nrf51_ppi_task_write(void *opaque, uint64_t offset, uint64_t b,
+                                 uint64_t c)
+{
+    memory_region_dispatch_write(opaque, offset, 1, 4,
+                                 MEMTXATTRS_UNSPECIFIED);
+}
+
+/* Called by peripherals each time an event is generated */
+static void nrf51_ppi_event(NRF51PPIState *s, hwaddr eep)
+{
+    uint32_t channels = nrf51_ppi_channels(s, eep);
+    NRF51PPITask *task;
+    int ch;
+
+    if (!channels) {
+        return;
+    }
+
+    /* Event/task loops would otherwise recurse without bound */
+    if (s->depth >= NRF51_PPI_MAX_DEPTH) {
+        qemu_log_mask_ratelimited(LOG_GUEST_ERROR, eep,
+                                  "%s: event 0x%" HWADDR_PRIx
+                                  " loops through PPI\n", __func__, eep);
+        return;
+    }
+
+    s->depth++;
+    while (channels) {
+        ch = ctz32(channels);
+        channels &= channels - 1;
+        task = &s->task[ch];
+        if (!task->mr) {
+            continue;
+        }
+        /* A task of a region that needs the BQL, from a device without */
+        if (task->mr->global_locking && !qemu_mutex_iothread_locked()) {
+            nrf51_with_bql(nrf51_ppi_task_write, task->mr, task->offset,
+                           0, 0);
+        } else {
+            nrf51_ppi_task_write(task->mr, task->offset, 0, 0);
+        }
+    }
+    s->depth--;
+}
+
+static void nrf51_ppi_rebuild_events(NRF51PPIState *s)
+{
+    uint16_t old[NRF51_PPI_NUM_SLOTS][NRF51_PPI_NUM_EVENTS];
+    uint16_t *entry;
+
+    memcpy(old, s->event_map, sizeof(old));
+    memset(s->event_map, 0, sizeof(s->event_map));
+    for (int ch = 0; ch < NRF51_PPI_NUM_CH; ch++) {
+        entry = nrf51_ppi_event_slot(s, s->eep[ch]);
+        if ((s->chen & (1 << ch)) && entry) {
+            *entry |= 1 << ch;
+        }
+    }
+
+    /* Event sources arm their timers according to the routing */
+    if (memcmp(old, s->event_map, sizeof(old))) {
+        notifier_list_notify(&s->routing_notifiers, s);
+    }
+}
+
+static void nrf51_ppi_resolve_task(NRF51PPIState *s, int ch)
+{
+    MemoryRegionSection section;
+
+    s->task[ch].mr = NULL;
+    if (!s->tep[ch]) {
+        return;
+    }
+
+    section = memory_region_find(s->as.root, s->tep[ch], 4);
+    if (!section.mr) {
+        qemu_log_mask_ratelimited(LOG_GUEST_ERROR, ch,
+                                  "%s: TEP 0x%08x of channel %d is unmapped\n",
+                                  __func__, s->tep[ch], ch);
+        return;
+    }
+    if (!memory_region_is_ram(section.mr)) {
+        s->task[ch].mr = section.mr;
+        s->task[ch].offset = section.offset_within_region;
+    }
+    memory_region_unref(section.mr);
+}
+
+static void nrf51_ppi_chg_task_write(void *opaque, hwaddr offset,
+                                     uint64_t value)
+{
+    NRF51PPIState *s = (NRF51PPIState *)opaque;
+    int group = offset >> 3;
+
+    if (value & 1) {
+        if (offset & 4) {
+            s->chen &= ~s->chg[group];
+        } else {
+            s->chen |= s->chg[group];
+        }
+        nrf51_ppi_rebuild_events(s);
+    }
+}
+
+static void nrf51_ppi_chen_write(void *opaque, hwaddr offset,
+                                 uint64_t value)
+{
+    NRF51PPIState *s = (NRF51PPIState *)opaque;
+
+    switch (offset) {
+        case NRF51_PPI_CHEN:
+            s->chen = value;
+            break;
+        case NRF51_PPI_CHENSET:
+            s->chen |= value;
+            break;
+        case NRF51_PPI_CHENCLR:
+            s->chen &= ~((uint32_t)value);
+            break;
+    }
+    nrf51_ppi_rebuild_events(s);
+}
+
+static uint64_t nrf51_ppi_ch_read(void *opaque, hwaddr offset)
+{
+    NRF51PPIState *s = (NRF51PPIState *)opaque;
+    int ch = (offset - NRF51_PPI_CH0_EEP) >> 3;
+
+    return (offset & 4) ? s->tep[ch] : s->eep[ch];
+}
+
+static void nrf51_ppi_ch_write(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51PPIState *s = (NRF51PPIState *)opaque;
+    int ch = (offset - NRF51_PPI_CH0_EEP) >> 3;
+
+    if (offset & 4) {
+        s->tep[ch] = value;
+        nrf51_ppi_resolve_task(s, ch);
+    } else {
+        s->eep[ch] = value;
+        nrf51_ppi_rebuild_events(s);
+    }
+}
+
+static uint64_t nrf51_ppi_chg_read(void *opaque, hwaddr offset)
+{
+    NRF51PPIState *s = (NRF51PPIState *)opaque;
+
+    return s->chg[(offset - NRF51_PPI_CHG0) >> 2];
+}
+
+static void nrf51_ppi_chg_write(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51PPIState *s = (NRF51PPIState *)opaque;
+
+    s->chg[(offset - NRF51_PPI_CHG0) >> 2] = value;
+}
+
+static const NRF51Reg nrf51_ppi_regs[] = {
+    NRF51_REG_ARRAY(NRF51_PPI_CHG0EN, NRF51_PPI_CHG3DIS) = {
+        .read = nrf51_reg_read_zero,
+        .write = nrf51_ppi_chg_task_write,
+    },
+    NRF51_REG_ARRAY(NRF51_PPI_CHEN, NRF51_PPI_CHENCLR) = {
+        NRF51_FIELD(NRF51PPIState, chen, 0),
+        .write = nrf51_ppi_chen_write,
+    },
+    NRF51_REG_ARRAY(NRF51_PPI_CH0_EEP, NRF51_PPI_CH15_TEP) = {
+        .read = nrf51_ppi_ch_read,
+        .write = nrf51_ppi_ch_write,
+    },
+    NRF51_REG_ARRAY(NRF51_PPI_CHG0, NRF51_PPI_CHG3) = {
+        .read = nrf51_ppi_chg_read,
+        .write = nrf51_ppi_chg_write,
+    },
+};
+
+static uint64_t nrf51_ppi_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    return nrf51_regs_read(opaque, nrf51_ppi_regs,
+                           ARRAY_SIZE(nrf51_ppi_regs), 0, offset);
+}
+
+static void nrf51_ppi_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    nrf51_regs_write(opaque, nrf51_ppi_regs,
+                     ARRAY_SIZE(nrf51_ppi_regs), 0, offset, value);
+}
+
+static const MemoryRegionOps nrf51_ppi_ops = {
+    .read = nrf51_ppi_read,
+    .write = nrf51_ppi_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static int nrf51_ppi_post_load(void *opaque, int version_id)
+{
+    NRF51PPIState *s = (NRF51PPIState *)opaque;
+
+    for (int ch = 0; ch < NRF51_PPI_NUM_CH; ch++) {
+        nrf51_ppi_resolve_task(s, ch);
+    }
+    nrf51_ppi_rebuild_events(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_nrf51_ppi = {
+    .name = TYPE_NRF51_PPI,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = nrf51_ppi_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(chen, NRF51PPIState),
+        VMSTATE_UINT32_ARRAY(chg, NRF51PPIState, NRF51_PPI_NUM_GROUPS),
+        VMSTATE_UINT32_ARRAY(eep, NRF51PPIState, NRF51_PPI_NUM_CH),
+        VMSTATE_UINT32_ARRAY(tep, NRF51PPIState, NRF51_PPI_NUM_CH),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void nrf51_ppi_reset(DeviceState *dev)
+{
+    NRF51PPIState *s = NRF51_PPI(dev);
+
+    s->chen = 0;
+    memset(s->chg, 0, sizeof(s->chg));
+    memset(s->eep, 0, sizeof(s->eep));
+    memset(s->tep, 0, sizeof(s->tep));
+    memset(s->task, 0, sizeof(s->task));
+    nrf51_ppi_rebuild_events(s);
+}
+
+static void nrf51_ppi_init(Object *obj)
+{
+    NRF51PPIState *s = NRF51_PPI(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    notifier_list_init(&s->routing_notifiers);
+    nrf51_init_io(&s->iomem, obj, &nrf51_ppi_ops, s,
+                  TYPE_NRF51_PPI, 0x1000);
+    nrf51_io_set_bql_free(&s->iomem);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static Property nrf51_ppi_properties[] = {
+    DEFINE_PROP_LINK("memory", NRF51PPIState, memory, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_ppi_realize(DeviceState *dev, Error **errp)
+{
+    NRF51PPIState *s = NRF51_PPI(dev);
+
+    address_space_init(&s->as, s->memory ? s->memory : get_system_memory(),
+                       TYPE_NRF51_PPI);
+}
+
+static void nrf51_ppi_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = nrf51_ppi_realize;
+    dc->props = nrf51_ppi_properties;
+    dc->reset = nrf51_ppi_reset;
+    dc->vmsd = &vmstate_nrf51_ppi;
+}
+
+static const TypeInfo nrf51_ppi_info = {
+    .name          = TYPE_NRF51_PPI,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51PPIState),
+    .instance_init = nrf51_ppi_init,
+    .class_init    = nrf51_ppi_class_init,
+};
+
+/**
+ * NRF51 peripheral base
+ *   The register layout all nRF51 peripherals share: TASKS_* from 0x000,
+ *   EVENTS_* from 0x100, SHORTS at 0x200 and INTEN, INTENSET and INTENCLR
+ *   from 0x300. INTEN bit n enables the interrupt of the event at
+ *   0x100 + 4 * n. Subclasses list their tasks, events and shorts in
+ *   their class; registers from 0x400 on are looked up in the class's
+ *   table of them, indexed by offset, or else go to its read and write.
+ */
+
+#define TYPE_NRF51_PERIPH "nrf51_periph"
+#define NRF51_PERIPH(obj) \
+    OBJECT_CHECK_HOT(NRF51PeriphState, (obj), TYPE_NRF51_PERIPH)
+#define NRF51_PERIPH_CLASS(klass) \
+    OBJECT_CLASS_CHECK(NRF51PeriphClass, (klass), TYPE_NRF51_PERIPH)
+#define NRF51_PERIPH_GET_CLASS(obj) \
+    OBJECT_GET_CLASS(NRF51PeriphClass, (obj), TYPE_NRF51_PERIPH)
+
+#define NRF51_PERIPH_NUM_EVENTS 32
+
+enum {
+    NRF51_PERIPH_TASKS    = 0x000,
+    NRF51_PERIPH_EVENTS   = 0x100,
+    NRF51_PERIPH_SHORTS   = 0x200,
+    NRF51_PERIPH_INTEN    = 0x300,
+    NRF51_PERIPH_INTENSET = 0x304,
+    NRF51_PERIPH_INTENCLR = 0x308,
+    NRF51_PERIPH_REGS     = 0x400,
+};
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    qemu_irq irq;
+    NRF51PPIState *ppi;
+
+    /* Public Regs */
+    uint32_t events[NRF51_PERIPH_NUM_EVENTS];
+    uint32_t shorts;
+    uint32_t inten;
+} NRF51PeriphState;
+
+typedef void NRF51PeriphTaskFn(NRF51PeriphState *s);
+
+/* SHORTS bit `bit` triggers task `task` each time event `event` occurs */
+typedef struct {
+    int bit;
+    int event;
+    int task;
+} NRF51PeriphShort;
+
+/* A register table entry for the registers from NRF51_PERIPH_REGS on */
+#define NRF51_PERIPH_REG(offset) NRF51_REG((offset) - NRF51_PERIPH_REGS)
+#define NRF51_PERIPH_REG_ARRAY(first, last) \
+    NRF51_REG_ARRAY((first) - NRF51_PERIPH_REGS, (last) - NRF51_PERIPH_REGS)
+
+typedef struct {
+    /* Private */
+    SysBusDeviceClass parent_class;
+
+    /* Public */
+    /* Handlers of the tasks, by (offset - TASKS) / 4 */
+    NRF51PeriphTaskFn * const *tasks;
+    int num_tasks;
+    /* The events that exist, one bit per (offset - EVENTS) / 4 */
+    uint32_t events;
+    const NRF51PeriphShort *shorts;
+    int num_shorts;
+    /* Registers from NRF51_PERIPH_REGS on, by (offset - REGS) / 4 */
+    const NRF51Reg *regs;
+    int num_regs;
+    /* Called before each access to those, e.g. to catch up on time */
+    void (*access)(NRF51PeriphState *s, bool is_write);
+    /* Called after each register write, with the IRQ up to date */
+    void (*update)(NRF51PeriphState *s);
+} NRF51PeriphClass;
+
+static void nrf51_periph_update_irq(NRF51PeriphState *s)
+{
+    bool level = false;
+    int n;
+
+    for (n = 0; n < NRF51_PERIPH_NUM_EVENTS; n++) {
+        if ((s->inten & (1 << n)) && s->events[n]) {
+            level = true;
+        }
+    }
+    qemu_set_irq(s->irq, level);
+}
+
+static void nrf51_periph_task(NRF51PeriphState *s, int task)
+{
+    NRF51PeriphClass *pc = NRF51_PERIPH_GET_CLASS(s);
+
+    if (task >= pc->num_tasks || !pc->tasks[task]) {
+        qemu_log_mask_ratelimited(LOG_GUEST_ERROR, task,
+                                  "%s: %s has no task 0x%x\n",
+                                  __func__, object_get_typename(OBJECT(s)),
+                                  NRF51_PERIPH_TASKS + task * 4);
+        return;
+    }
+    pc->tasks[task](s);
+}
+
+/* Generate `event`: EVENTS_*, PPI, then SHORTS, and the IRQ line */
+static void nrf51_periph_event(NRF51PeriphState *s, int event)
+{
+    NRF51PeriphClass *pc = NRF51_PERIPH_GET_CLASS(s);
+    int i;
+
+    s->events[event] = 1;
+    nrf51_ppi_event(s->ppi, nrf51_periph_addr(SYS_BUS_DEVICE(s),
+                                              NRF51_PERIPH_EVENTS +
+                                              event * 4));
+    for (i = 0; i < pc->num_shorts; i++) {
+        if (pc->shorts[i].event == event &&
+            (s->shorts & (1 << pc->shorts[i].bit))) {
+            nrf51_periph_task(s, pc->shorts[i].task);
+        }
+    }
+    nrf51_periph_update_irq(s);
+}
+
+static uint32_t nrf51_periph_shorts_mask(NRF51PeriphClass *pc)
+{
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 0; i < pc->num_shorts; i++) {
+        mask |= 1 << pc->shorts[i].bit;
+    }
+    return mask;
+}
+
+static uint64_t nrf51_periph_read(void *opaque, hwaddr offset,
+                                  unsigned size)
+{
+    NRF51PeriphState *s = NRF51_PERIPH(opaque);
+    NRF51PeriphClass *pc = NRF51_PERIPH_GET_CLASS(s);
+    int n;
+
+    if (offset >= NRF51_PERIPH_REGS) {
+        if (pc->access) {
+            pc->access(s, false);
+        }
+        return nrf51_regs_read(s, pc->regs, pc->num_regs,
+                               NRF51_PERIPH_REGS, offset);
+    }
+    if (offset < NRF51_PERIPH_EVENTS) {
+        /* Tasks are write-only */
+        return 0;
+    }
+    if (offset < NRF51_PERIPH_SHORTS) {
+        n = (offset - NRF51_PERIPH_EVENTS) >> 2;
+        if (pc->events & (1 << n)) {
+            return s->events[n];
+        }
+    }
+
+    switch (offset) {
+        case NRF51_PERIPH_SHORTS:
+            return s->shorts;
+        case NRF51_PERIPH_INTEN:
+        case NRF51_PERIPH_INTENSET:
+        case NRF51_PERIPH_INTENCLR:
+            return s->inten;
+    }
+
+    qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                              "%s: reading a bad offset 0x%x\n",
+                              __func__,
+                              (int)offset);
+    return 0;
+}
+
+static void nrf51_periph_write(void *opaque, hwaddr offset,
+                               uint64_t value, unsigned size)
+{
+    NRF51PeriphState *s = NRF51_PERIPH(opaque);
+    NRF51PeriphClass *pc = NRF51_PERIPH_GET_CLASS(s);
+    int n;
+
+    if (offset >= NRF51_PERIPH_REGS) {
+        if (pc->access) {
+            pc->access(s, true);
+        }
+        nrf51_regs_write(s, pc->regs, pc->num_regs, NRF51_PERIPH_REGS,
+                         offset, value);
+    } else if (offset < NRF51_PERIPH_EVENTS) {
+        if (value & 1) {
+            nrf51_periph_task(s, offset >> 2);
+        }
+    } else if (offset < NRF51_PERIPH_SHORTS &&
+               (pc->events & (1 << ((offset - NRF51_PERIPH_EVENTS) >> 2)))) {
+        n = (offset - NRF51_PERIPH_EVENTS) >> 2;
+        s->events[n] = value & 1;
+    } else if (offset == NRF51_PERIPH_SHORTS) {
+        s->shorts = value & nrf51_periph_shorts_mask(pc);
+    } else if (offset == NRF51_PERIPH_INTEN) {
+        s->inten = value & pc->events;
+    } else if (offset == NRF51_PERIPH_INTENSET) {
+        s->inten |= value & pc->events;
+    } else if (offset == NRF51_PERIPH_INTENCLR) {
+        s->inten &= ~(value & pc->events);
+    } else {
+        qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                  "%s: writing a bad offset 0x%x\n",
+                                  __func__,
+                                  (int)offset);
+    }
+
+    nrf51_periph_update_irq(s);
+    if (pc->update) {
+        pc->update(s);
+    }
+}
+
+static const MemoryRegionOps nrf51_periph_ops = {
+    .read = nrf51_periph_read,
+    .write = nrf51_periph_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static const VMStateDescription vmstate_nrf51_periph = {
+    .name = TYPE_NRF51_PERIPH,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(events, NRF51PeriphState,
+                             NRF51_PERIPH_NUM_EVENTS),
+        VMSTATE_UINT32(shorts, NRF51PeriphState),
+        VMSTATE_UINT32(inten, NRF51PeriphState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_periph_properties[] = {
+    DEFINE_PROP_LINK("ppi", NRF51PeriphState, ppi, TYPE_NRF51_PPI,
+                     NRF51PPIState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+/* Subclasses call this from their own reset */
+static void nrf51_periph_reset(DeviceState *dev)
+{
+    NRF51PeriphState *s = NRF51_PERIPH(dev);
+
+    memset(s->events, 0, sizeof(s->events));
+    s->shorts = 0;
+    s->inten = 0;
+    qemu_irq_lower(s->irq);
+}
+
+static void nrf51_periph_init(Object *obj)
+{
+    NRF51PeriphState *s = NRF51_PERIPH(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    sysbus_init_irq(sdb, &s->irq);
+    nrf51_init_io(&s->iomem, obj, &nrf51_periph_ops, s,
+                  object_get_typename(obj), 0x1000);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void nrf51_periph_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->reset = nrf51_periph_reset;
+    dc->props = nrf51_periph_properties;
+}
+
+static const TypeInfo nrf51_periph_info = {
+    .name          = TYPE_NRF51_PERIPH,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .abstract      = true,
+    .instance_size = sizeof(NRF51PeriphState),
+    .instance_init = nrf51_periph_init,
+    .class_size    = sizeof(NRF51PeriphClass),
+    .class_init    = nrf51_periph_class_init,
+};
+
+/**
+ * NRF51 RNG
+ *   Random Number Generator, with respect to nRF51822 Reference Manual
+ *   NOTE: values are drawn from a per-device pool refilled in large chunks,
+ *         either from the host (qcrypto) or, when property "seed" is
+ *         non-zero, from a deterministic splitmix64 sequence so that runs
+ *         are reproducible. A QEMUTimer raises VALRDY after the datasheet
+ *         generation time, and stops generating while VALRDY is pending.
+ */
+
+#define TYPE_NRF51_RNG "nrf51_rng"
+#define NRF51_RNG(obj) \
+    OBJECT_CHECK(NRF51RNGState, (obj), TYPE_NRF51_RNG)
+
+#define NRF51_RNG_POOL_SIZE 256
+/* Typical time to generate one byte, without and with bias correction */
+#define NRF51_RNG_RAW_NS    (167 * SCALE_US)
+#define NRF51_RNG_DERCEN_NS (677 * SCALE_US)
+
+enum {
+    NRF51_RNG_CONFIG   = 0x504,
+    NRF51_RNG_VALUE    = 0x508,
+};
+
+enum {
+    NRF51_RNG_TASK_START = 0,
+    NRF51_RNG_TASK_STOP  = 1,
+    NRF51_RNG_EVENT_VALRDY = 0,
+    NRF51_RNG_CONFIG_DERCEN = 1 << 0,
+};
+
+typedef struct {
+    /* Private */
+    NRF51PeriphState parent;
+
+    /* Public */
+    QEMUTimer *timer;
+    uint64_t seed;
+    uint8_t value;
+    uint32_t config;
+    bool started;
+
+    /* Internal state */
+    uint64_t prng;
+    uint8_t pool[NRF51_RNG_POOL_SIZE];
+    uint32_t pool_pos;
+} NRF51RNGState;
+
+static const VMStateDescription vmstate_nrf51_rng = {
+    .name = TYPE_NRF51_RNG,
+    .version_id = 3,
+    .minimum_version_id = 3,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(parent, NRF51RNGState, 3, vmstate_nrf51_periph,
+                       NRF51PeriphState),
+        VMSTATE_UINT8(value, NRF51RNGState),
+        VMSTATE_UINT32(config, NRF51RNGState),
+        VMSTATE_BOOL(started, NRF51RNGState),
+        VMSTATE_TIMER_PTR(timer, NRF51RNGState),
+        VMSTATE_UINT64(prng, NRF51RNGState),
+        VMSTATE_UINT8_ARRAY(pool, NRF51RNGState, NRF51_RNG_POOL_SIZE),
+        VMSTATE_UINT32(pool_pos, NRF51RNGState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_rng_properties[] = {
+    DEFINE_PROP_UINT8("value", NRF51RNGState, value, 0),
+    DEFINE_PROP_UINT32("config", NRF51RNGState, config, 0),
+    DEFINE_PROP_BOOL("started", NRF51RNGState, started, false),
+    DEFINE_PROP_UINT64("seed", NRF51RNGState, seed, 0),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static uint64_t nrf51_rng_splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void nrf51_rng_refill(NRF51RNGState *s)
+{
+    if (s->seed) {
+        for (int i = 0; i < NRF51_RNG_POOL_SIZE; i += 8) {
+            stq_le_p(&s->pool[i], nrf51_rng_splitmix64(&s->prng));
+        }
+    } else {
+        if (replay_mode != REPLAY_MODE_PLAY) {
+            qcrypto_random_bytes(s->pool, sizeof(s->pool), &error_fatal);
+        }
+        /* Host entropy is logged so that a recording replays exactly */
+        replay_device_data(s->pool, sizeof(s->pool));
+    }
+    s->pool_pos = 0;
+}
+
+static uint8_t nrf51_rng_next(NRF51RNGState *s)
+{
+    if (s->pool_pos >= NRF51_RNG_POOL_SIZE) {
+        nrf51_rng_refill(s);
+    }
+    return s->pool[s->pool_pos++];
+}
+
+/* Schedule the next value, unless the last one has not been taken yet */
+static void nrf51_rng_rearm(NRF51RNGState *s)
+{
+    if (!s->started || s->parent.events[NRF51_RNG_EVENT_VALRDY]) {
+        timer_del(s->timer);
+        return;
+    }
+    if (!timer_pending(s->timer)) {
+        timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                     ((s->config & NRF51_RNG_CONFIG_DERCEN) ?
+                      NRF51_RNG_DERCEN_NS : NRF51_RNG_RAW_NS));
+    }
+}
+
+static void nrf51_rng_expire(void *opaque)
+{
+    NRF51RNGState *s = (NRF51RNGState *)opaque;
+
+    s->value = nrf51_rng_next(s);
+    nrf51_periph_event(&s->parent, NRF51_RNG_EVENT_VALRDY);
+    nrf51_rng_rearm(s);
+}
+
+static void nrf51_rng_start(NRF51PeriphState *p)
+{
+    NRF51_RNG(p)->started = true;
+}
+
+static void nrf51_rng_stop(NRF51PeriphState *p)
+{
+    NRF51_RNG(p)->started = false;
+}
+
+static NRF51PeriphTaskFn * const nrf51_rng_tasks[] = {
+    [NRF51_RNG_TASK_START] = nrf51_rng_start,
+    [NRF51_RNG_TASK_STOP]  = nrf51_rng_stop,
+};
+
+static const NRF51PeriphShort nrf51_rng_shorts[] = {
+    { 0, NRF51_RNG_EVENT_VALRDY, NRF51_RNG_TASK_STOP },
+};
+
+static uint64_t nrf51_rng_value_read(void *opaque, hwaddr offset)
+{
+    return NRF51_RNG(opaque)->value;
+}
+
+static const NRF51Reg nrf51_rng_regs[] = {
+    NRF51_PERIPH_REG(NRF51_RNG_CONFIG) = {
+        NRF51_FIELD(NRF51RNGState, config, NRF51_RNG_CONFIG_DERCEN),
+    },
+    NRF51_PERIPH_REG(NRF51_RNG_VALUE) = {
+        .read = nrf51_rng_value_read,
+    },
+};
+
+static void nrf51_rng_update(NRF51PeriphState *p)
+{
+    nrf51_rng_rearm(NRF51_RNG(p));
+}
+
+static void nrf51_rng_realize(DeviceState *dev, Error **errp)
+{
+    NRF51RNGState *s = NRF51_RNG(dev);
+
+    s->timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nrf51_rng_expire, s);
+}
+
+static void nrf51_rng_reset(DeviceState *dev)
+{
+    NRF51RNGState *s = NRF51_RNG(dev);
+
+    nrf51_periph_reset(dev);
+    timer_del(s->timer);
+    s->started = false;
+    s->config = 0;
+    /* A seeded device replays the same sequence after every reset */
+    s->prng = s->seed;
+    s->pool_pos = NRF51_RNG_POOL_SIZE;
+}
+
+static void nrf51_rng_init(Object *obj)
+{
+    NRF51RNGState *s = NRF51_RNG(obj);
+
+    memory_region_set_pollable(&s->parent.iomem, true);
+}
+
+static void nrf51_rng_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    NRF51PeriphClass *pc = NRF51_PERIPH_CLASS(klass);
+
+    dc->realize = nrf51_rng_realize;
+    dc->reset = nrf51_rng_reset;
+    dc->props = nrf51_rng_properties;
+    dc->vmsd = &vmstate_nrf51_rng;
+    pc->tasks = nrf51_rng_tasks;
+    pc->num_tasks = ARRAY_SIZE(nrf51_rng_tasks);
+    pc->events = 1 << NRF51_RNG_EVENT_VALRDY;
+    pc->shorts = nrf51_rng_shorts;
+    pc->num_shorts = ARRAY_SIZE(nrf51_rng_shorts);
+    pc->regs = nrf51_rng_regs;
+    pc->num_regs = ARRAY_SIZE(nrf51_rng_regs);
+    pc->update = nrf51_rng_update;
+}
+
+static const TypeInfo nrf51_rng_info = {
+    .name          = TYPE_NRF51_RNG,
+    .parent        = TYPE_NRF51_PERIPH,
+    .instance_size = sizeof(NRF51RNGState),
+    .instance_init = nrf51_rng_init,
+    .class_init    = nrf51_rng_class_init,
+};
+
+/**
+ * NRF51 TEMP
+ *   Temperature sensor, with respect to nRF51822 Reference Manual
+ *   NOTE: a conversion completes on a single QEMUTimer after the datasheet
+ *         conversion time. The die temperature is the QOM property
+ *         "temperature", in 0.001 C, which can be changed at run time,
+ *         e.g. with qom-set
+ */
+
+#define TYPE_NRF51_TEMP "nrf51_temp"
+#define NRF51_TEMP(obj) \
+    OBJECT_CHECK(NRF51TempState, (obj), TYPE_NRF51_TEMP)
+
+#define NRF51_TEMP_CONVERSION_NS (36 * SCALE_US)
+
+enum {
+    NRF51_TEMP_TEMP     = 0x508,
+};
+
+enum {
+    NRF51_TEMP_TASK_START = 0,
+    NRF51_TEMP_TASK_STOP  = 1,
+    NRF51_TEMP_EVENT_DATARDY = 0,
+};
+
+typedef struct {
+    /* Private */
+    NRF51PeriphState parent;
+
+    /* Public */
+    QEMUTimer *timer;
+    /* Die temperature in 0.001 C */
+    int64_t temperature;
+
+    /* Public Regs */
+    uint32_t temp;
+} NRF51TempState;
+
+static void nrf51_temp_expire(void *opaque)
+{
+    NRF51TempState *s = (NRF51TempState *)opaque;
+    int64_t t = s->temperature;
+
+    /* TEMP counts 0.25 C steps */
+    s->temp = (t * 4 + (t < 0 ? -500 : 500)) / 1000;
+    nrf51_periph_event(&s->parent, NRF51_TEMP_EVENT_DATARDY);
+}
+
+static void nrf51_temp_start(NRF51PeriphState *p)
+{
+    NRF51TempState *s = NRF51_TEMP(p);
+
+    if (!timer_pending(s->timer)) {
+        timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                     NRF51_TEMP_CONVERSION_NS);
+    }
+}
+
+static void nrf51_temp_stop(NRF51PeriphState *p)
+{
+    timer_del(NRF51_TEMP(p)->timer);
+}
+
+static NRF51PeriphTaskFn * const nrf51_temp_tasks[] = {
+    [NRF51_TEMP_TASK_START] = nrf51_temp_start,
+    [NRF51_TEMP_TASK_STOP]  = nrf51_temp_stop,
+};
+
+static const NRF51Reg nrf51_temp_regs[] = {
+    NRF51_PERIPH_REG(NRF51_TEMP_TEMP) = {
+        NRF51_FIELD(NRF51TempState, temp, 0),
+    },
+};
+
+static const VMStateDescription vmstate_nrf51_temp = {
+    .name = TYPE_NRF51_TEMP,
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(parent, NRF51TempState, 2, vmstate_nrf51_periph,
+                       NRF51PeriphState),
+        VMSTATE_TIMER_PTR(timer, NRF51TempState),
+        VMSTATE_INT64(temperature, NRF51TempState),
+        VMSTATE_UINT32(temp, NRF51TempState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void nrf51_temp_get_temperature(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    NRF51TempState *s = NRF51_TEMP(obj);
+
+    visit_type_int(v, name, &s->temperature, errp);
+}
+
+/* The hardware range is -25 C to 75 C, TEMP itself holds much more */
+static void nrf51_temp_set_temperature(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    NRF51TempState *s = NRF51_TEMP(obj);
+    Error *local_err = NULL;
+    int64_t temp;
+
+    visit_type_int(v, name, &temp, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (temp < -128000 || temp > 128000) {
+        error_setg(errp, "value %" PRId64 ".%03" PRIu64 " C is out of range",
+                   temp / 1000, (uint64_t)ABS(temp) % 1000);
+        return;
+    }
+    s->temperature = temp;
+}
+
+static void nrf51_temp_realize(DeviceState *dev, Error **errp)
+{
+    NRF51TempState *s = NRF51_TEMP(dev);
+
+    s->timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nrf51_temp_expire, s);
+}
+
+static void nrf51_temp_reset(DeviceState *dev)
+{
+    NRF51TempState *s = NRF51_TEMP(dev);
+
+    nrf51_periph_reset(dev);
+    timer_del(s->timer);
+    s->temp = 0;
+}
+
+static void nrf51_temp_init(Object *obj)
+{
+    NRF51TempState *s = NRF51_TEMP(obj);
+
+    memory_region_set_pollable(&s->parent.iomem, true);
+    s->temperature = 25000;
+    object_property_add(obj, "temperature", "int",
+                        nrf51_temp_get_temperature,
+                        nrf51_temp_set_temperature, NULL, NULL, NULL);
+}
+
+static void nrf51_temp_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    NRF51PeriphClass *pc = NRF51_PERIPH_CLASS(klass);
+
+    dc->realize = nrf51_temp_realize;
+    dc->reset = nrf51_temp_reset;
+    dc->vmsd = &vmstate_nrf51_temp;
+    pc->tasks = nrf51_temp_tasks;
+    pc->num_tasks = ARRAY_SIZE(nrf51_temp_tasks);
+    pc->events = 1 << NRF51_TEMP_EVENT_DATARDY;
+    pc->regs = nrf51_temp_regs;
+    pc->num_regs = ARRAY_SIZE(nrf51_temp_regs);
+}
+
+static const TypeInfo nrf51_temp_info = {
+    .name          = TYPE_NRF51_TEMP,
+    .parent        = TYPE_NRF51_PERIPH,
+    .instance_size = sizeof(NRF51TempState),
+    .instance_init = nrf51_temp_init,
+    .class_init    = nrf51_temp_class_init,
+};
+
+/**
+ * NRF51 ECB
+ *   AES electronic codebook encryption, with respect to nRF51822
+ *   Reference Manual
+ *   NOTE: STARTECB reads the key and cleartext through ECBDATAPTR and
+ *         encrypts them at once on the host through qcrypto, which keeps
+ *         the cipher for as long as the key stays the same. The ciphertext
+ *         is written back, and ENDECB raised, after the datasheet run time.
+ */
+
+#define TYPE_NRF51_ECB "nrf51_ecb"
+#define NRF51_ECB(obj) \
+    OBJECT_CHECK(NRF51ECBState, (obj), TYPE_NRF51_ECB)
+
+#define NRF51_AES_BLOCK  16
+#define NRF51_ECB_BLOCK  NRF51_AES_BLOCK
+#define NRF51_ECB_RUN_NS 7200
+
+/* A host AES-128 cipher, rebuilt only when its key changes */
+typedef struct {
+    QCryptoCipher *cipher;
+    uint8_t key[NRF51_AES_BLOCK];
+} NRF51AESKey;
+
+/* Encrypt `len` bytes, a whole number of blocks, with `key` */
+static bool nrf51_aes_encrypt(NRF51AESKey *k, const uint8_t *key,
+                              const uint8_t *in, uint8_t *out, size_t len)
+{
+    Error *local_err = NULL;
+
+    if (!k->cipher || memcmp(k->key, key, NRF51_AES_BLOCK)) {
+        qcrypto_cipher_free(k->cipher);
+        k->cipher = qcrypto_cipher_new(QCRYPTO_CIPHER_ALG_AES_128,
+                                       QCRYPTO_CIPHER_MODE_ECB,
+                                       key, NRF51_AES_BLOCK, &local_err);
+        if (!k->cipher) {
+            error_report_err(local_err);
+            return false;
+        }
+        memcpy(k->key, key, NRF51_AES_BLOCK);
+    }
+    if (qcrypto_cipher_encrypt(k->cipher, in, out, len, &local_err) < 0) {
+        error_report_err(local_err);
+        return false;
+    }
+    return true;
+}
+
+enum {
+    NRF51_ECB_ECBDATAPTR = 0x504,
+};
+
+enum {
+    NRF51_ECB_TASK_STARTECB = 0,
+    NRF51_ECB_TASK_STOPECB  = 1,
+    NRF51_ECB_EVENT_ENDECB   = 0,
+    NRF51_ECB_EVENT_ERRORECB = 1,
+};
+
+/* What ECBDATAPTR points to */
+typedef struct {
+    uint8_t key[NRF51_ECB_BLOCK];
+    uint8_t cleartext[NRF51_ECB_BLOCK];
+    uint8_t ciphertext[NRF51_ECB_BLOCK];
+} NRF51ECBData;
+
+typedef struct {
+    /* Private */
+    NRF51PeriphState parent;
+
+    /* Public */
+    QEMUTimer *timer;
+    /* Bus seen by the EasyDMA accesses, the system bus by default */
+    MemoryRegion *memory;
+    AddressSpace as;
+
+    /* Internal state */
+    /* Where the run in progress writes its ciphertext */
+    uint32_t outptr;
+    uint8_t ciphertext[NRF51_ECB_BLOCK];
+    NRF51AESKey aes;
+
+    /* Public Regs */
+    uint32_t ecbdataptr;
+} NRF51ECBState;
+
+static void nrf51_ecb_expire(void *opaque)
+{
+    NRF51ECBState *s = NRF51_ECB(opaque);
+
+    address_space_write(&s->as, s->outptr, MEMTXATTRS_UNSPECIFIED,
+                        s->ciphertext, NRF51_ECB_BLOCK);
+    nrf51_periph_event(&s->parent, NRF51_ECB_EVENT_ENDECB);
+}
+
+static void nrf51_ecb_start(NRF51PeriphState *p)
+{
+    NRF51ECBState *s = NRF51_ECB(p);
+    NRF51ECBData data;
+
+    if (timer_pending(s->timer)) {
+        return;
+    }
+    if (address_space_read(&s->as, s->ecbdataptr, MEMTXATTRS_UNSPECIFIED,
+                           (uint8_t *)&data,
+                           offsetof(NRF51ECBData, ciphertext)) != MEMTX_OK ||
+        !nrf51_aes_encrypt(&s->aes, data.key, data.cleartext, s->ciphertext,
+                           NRF51_ECB_BLOCK)) {
+        nrf51_periph_event(p, NRF51_ECB_EVENT_ERRORECB);
+        return;
+    }
+    s->outptr = s->ecbdataptr + offsetof(NRF51ECBData, ciphertext);
+    timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                 NRF51_ECB_RUN_NS);
+}
+
+/* Aborting a run is an error; the ciphertext is not written */
+static void nrf51_ecb_stop(NRF51PeriphState *p)
+{
+    NRF51ECBState *s = NRF51_ECB(p);
+
+    if (timer_pending(s->timer)) {
+        timer_del(s->timer);
+        nrf51_periph_event(p, NRF51_ECB_EVENT_ERRORECB);
+    }
+}
+
+static NRF51PeriphTaskFn * const nrf51_ecb_tasks[] = {
+    [NRF51_ECB_TASK_STARTECB] = nrf51_ecb_start,
+    [NRF51_ECB_TASK_STOPECB]  = nrf51_ecb_stop,
+};
+
+static const NRF51Reg nrf51_ecb_regs[] = {
+    NRF51_PERIPH_REG(NRF51_ECB_ECBDATAPTR) = {
+        NRF51_FIELD(NRF51ECBState, ecbdataptr, UINT32_MAX),
+    },
+};
+
+static const VMStateDescription vmstate_nrf51_ecb = {
+    .name = TYPE_NRF51_ECB,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(parent, NRF51ECBState, 1, vmstate_nrf51_periph,
+                       NRF51PeriphState),
+        VMSTATE_TIMER_PTR(timer, NRF51ECBState),
+        VMSTATE_UINT32(outptr, NRF51ECBState),
+        VMSTATE_UINT8_ARRAY(ciphertext, NRF51ECBState, NRF51_ECB_BLOCK),
+        VMSTATE_UINT32(ecbdataptr, NRF51ECBState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_ecb_properties[] = {
+    DEFINE_PROP_LINK("memory", NRF51ECBState, memory, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_ecb_realize(DeviceState *dev, Error **errp)
+{
+    NRF51ECBState *s = NRF51_ECB(dev);
+
+    address_space_init(&s->as, s->memory ? s->memory : get_system_memory(),
+                       TYPE_NRF51_ECB);
+    s->timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nrf51_ecb_expire, s);
+}
+
+static void nrf51_ecb_reset(DeviceState *dev)
+{
+    NRF51ECBState *s = NRF51_ECB(dev);
+
+    nrf51_periph_reset(dev);
+    timer_del(s->timer);
+    s->ecbdataptr = 0;
+}
+
+static void nrf51_ecb_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    NRF51PeriphClass *pc = NRF51_PERIPH_CLASS(klass);
+
+    dc->realize = nrf51_ecb_realize;
+    dc->reset = nrf51_ecb_reset;
+    dc->props = nrf51_ecb_properties;
+    dc->vmsd = &vmstate_nrf51_ecb;
+    pc->tasks = nrf51_ecb_tasks;
+    pc->num_tasks = ARRAY_SIZE(nrf51_ecb_tasks);
+    pc->events = 1 << NRF51_ECB_EVENT_ENDECB | 1 << NRF51_ECB_EVENT_ERRORECB;
+    pc->regs = nrf51_ecb_regs;
+    pc->num_regs = ARRAY_SIZE(nrf51_ecb_regs);
+}
+
+static const TypeInfo nrf51_ecb_info = {
+    .name          = TYPE_NRF51_ECB,
+    .parent        = TYPE_NRF51_PERIPH,
+    .instance_size = sizeof(NRF51ECBState),
+    .class_init    = nrf51_ecb_class_init,
+};
+
+/**
+ * NRF51 CCM and AAR
+ *   AES CCM mode encryption and accelerated address resolver, with
+ *   respect to nRF51822 Reference Manual. They share an ID: both are
+ *   mapped at the same address behind one interrupt, and CCM owns the
+ *   window until AAR is enabled.
+ *   NOTE: CRYPT en- or decrypts the whole packet at INPTR at once, with
+ *         the CTR keystream computed in a single host cipher call, so it
+ *         must be triggered once the packet is in RAM; the radio's
+ *         pre-programmed PPI channels are not routed. START of AAR tries
+ *         every IRK at once. Neither needs SCRATCHPTR.
+ */
+
+#define TYPE_NRF51_CCM "nrf51_ccm"
+#define NRF51_CCM(obj) \
+    OBJECT_CHECK(NRF51CCMState, (obj), TYPE_NRF51_CCM)
+
+#define NRF51_CCM_MAX_PAYLOAD 27
+#define NRF51_CCM_MIC_SIZE    4
+#define NRF51_CCM_NONCE_SIZE  13
+/* S0, LENGTH and S1 come before the payload */
+#define NRF51_CCM_HEADER_SIZE 3
+
+enum {
+    NRF51_CCM_MICSTATUS  = 0x400,
+    NRF51_CCM_ENABLE     = 0x500,
+    NRF51_CCM_MODE       = 0x504,
+    NRF51_CCM_CNFPTR     = 0x508,
+    NRF51_CCM_INPTR      = 0x50C,
+    NRF51_CCM_OUTPTR     = 0x510,
+    NRF51_CCM_SCRATCHPTR = 0x514,
+};
+
+enum {
+    NRF51_CCM_TASK_KSGEN = 0,
+    NRF51_CCM_TASK_CRYPT = 1,
+    NRF51_CCM_TASK_STOP  = 2,
+    NRF51_CCM_EVENT_ENDKSGEN = 0,
+    NRF51_CCM_EVENT_ENDCRYPT = 1,
+    NRF51_CCM_EVENT_ERROR    = 2,
+    NRF51_CCM_SHORT_ENDKSGEN_CRYPT = 0,
+    NRF51_CCM_MODE_DECRYPTION = 1 << 0,
+};
+
+/* What CNFPTR points to */
+typedef struct QEMU_PACKED {
+    uint8_t key[NRF51_AES_BLOCK];
+    /* 39-bit packet counter, least significant byte first */
+    uint8_t pktctr[5];
+    uint8_t reserved[3];
+    uint8_t direction;
+    uint8_t iv[8];
+} NRF51CCMConfig;
+
+typedef struct {
+    /* Private */
+    NRF51PeriphState parent;
+
+    /* Public */
+    /* AAR, which shares our ID */
+    SysBusDevice *peer;
+    /* Bus seen by the EasyDMA accesses, the system bus by default */
+    MemoryRegion *memory;
+    AddressSpace as;
+
+    /* Internal state */
+    /* KSGEN read the configuration: the nonce is ready */
+    bool ready;
+    uint8_t key[NRF51_AES_BLOCK];
+    uint8_t nonce[NRF51_CCM_NONCE_SIZE];
+    NRF51AESKey aes;
+
+    /* Public Regs */
+    uint32_t micstatus;
+    uint32_t enable;
+    uint32_t mode;
+    uint32_t cnfptr;
+    uint32_t inptr;
+    uint32_t outptr;
+    uint32_t scratchptr;
+} NRF51CCMState;
+
+static void nrf51_ccm_ksgen(NRF51PeriphState *p)
+{
+    NRF51CCMState *s = NRF51_CCM(p);
+    NRF51CCMConfig cnf;
+
+    if (s->enable != NRF51_ENABLE_CCM) {
+        return;
+    }
+    if (address_space_read(&s->as, s->cnfptr, MEMTXATTRS_UNSPECIFIED,
+                           (uint8_t *)&cnf, sizeof(cnf)) != MEMTX_OK) {
+        nrf51_periph_event(p, NRF51_CCM_EVENT_ERROR);
+        return;
+    }
+    /* The direction bit takes the counter's unused most significant bit */
+    memcpy(s->key, cnf.key, sizeof(s->key));
+    memcpy(s->nonce, cnf.pktctr, sizeof(cnf.pktctr));
+    s->nonce[4] = (s->nonce[4] & 0x7f) | (cnf.direction & 1) << 7;
+    memcpy(s->nonce + sizeof(cnf.pktctr), cnf.iv, sizeof(cnf.iv));
+    s->ready = true;
+    nrf51_periph_event(p, NRF51_CCM_EVENT_ENDKSGEN);
+}
+
+/* A CCM block: `flags`, the nonce and a 16-bit big-endian `value` */
+static void nrf51_ccm_block(NRF51CCMState *s, uint8_t *block, uint8_t flags,
+                            uint16_t value)
+{
+    block[0] = flags;
+    memcpy(block + 1, s->nonce, NRF51_CCM_NONCE_SIZE);
+    stw_be_p(block + 1 + NRF51_CCM_NONCE_SIZE, value);
+}
+
+/**
+ * The MIC of `len` bytes of cleartext, per the Bluetooth specification:
+ * CBC-MAC with 4 byte tag, 2 byte length and the masked header as only
+ * additional data, then encrypted with the first keystream block.
+ */
+static bool nrf51_ccm_mic(NRF51CCMState *s, uint8_t header,
+                          const uint8_t *data, int len, const uint8_t *s0,
+                          uint8_t *mic)
+{
+    uint8_t x[NRF51_AES_BLOCK], b[NRF51_AES_BLOCK];
+    int i, j;
+
+    nrf51_ccm_block(s, b, 0x49, len);
+    if (!nrf51_aes_encrypt(&s->aes, s->key, b, x, sizeof(x))) {
+        return false;
+    }
+    /* B1: the additional data, then B2 on: the cleartext */
+    memset(b, 0, sizeof(b));
+    b[1] = 1;
+    b[2] = header & 0xe3;
+    for (i = 0; ; i += NRF51_AES_BLOCK) {
+        for (j = 0; j < NRF51_AES_BLOCK; j++) {
+            b[j] ^= x[j];
+        }
+        if (!nrf51_aes_encrypt(&s->aes, s->key, b, x, sizeof(x))) {
+            return false;
+        }
+        if (i >= len) {
+            break;
+        }
+        memset(b, 0, sizeof(b));
+        memcpy(b, data + i, MIN(NRF51_AES_BLOCK, len - i));
+    }
+    for (j = 0; j < NRF51_CCM_MIC_SIZE; j++) {
+        mic[j] = x[j] ^ s0[j];
+    }
+    return true;
+}
+
+/* En- or decrypt the packet at INPTR to OUTPTR */
+static bool nrf51_ccm_packet(NRF51CCMState *s)
+{
+    bool decrypt = s->mode & NRF51_CCM_MODE_DECRYPTION;
+    uint8_t packet[NRF51_CCM_HEADER_SIZE + NRF51_CCM_MAX_PAYLOAD +
+                   NRF51_CCM_MIC_SIZE];
+    /* Counter blocks A0 to A2, and the keystream S0 to S2 */
+    uint8_t a[3 * NRF51_AES_BLOCK], ks[3 * NRF51_AES_BLOCK];
+    uint8_t *payload = packet + NRF51_CCM_HEADER_SIZE;
+    uint8_t mic[NRF51_CCM_MIC_SIZE];
+    int len, i;
+
+    if (address_space_read(&s->as, s->inptr, MEMTXATTRS_UNSPECIFIED,
+                           packet, NRF51_CCM_HEADER_SIZE) != MEMTX_OK) {
+        return false;
+    }
+    len = packet[1];
+    if (decrypt) {
+        len -= len ? NRF51_CCM_MIC_SIZE : 0;
+    }
+    if (len < 0 || len > NRF51_CCM_MAX_PAYLOAD ||
+        address_space_read(&s->as, s->inptr + NRF51_CCM_HEADER_SIZE,
+                           MEMTXATTRS_UNSPECIFIED, payload,
+                           packet[1]) != MEMTX_OK) {
+        return false;
+    }
+
+    /* An empty packet carries no MIC and is copied as it is */
+    s->micstatus = 1;
+    if (packet[1]) {
+        for (i = 0; i < 3; i++) {
+            nrf51_ccm_block(s, a + i * NRF51_AES_BLOCK, 0x01, i);
+        }
+        if (!nrf51_aes_encrypt(&s->aes, s->key, a, ks, sizeof(ks))) {
+            return false;
+        }
+        if (decrypt) {
+            for (i = 0; i < len; i++) {
+                payload[i] ^= ks[NRF51_AES_BLOCK + i];
+            }
+        }
+        if (!nrf51_ccm_mic(s, packet[0], payload, len, ks, mic)) {
+            return false;
+        }
+        if (decrypt) {
+            s->micstatus = !memcmp(mic, payload + len, sizeof(mic));
+        } else {
+            for (i = 0; i < len; i++) {
+                payload[i] ^= ks[NRF51_AES_BLOCK + i];
+            }
+            memcpy(payload + len, mic, sizeof(mic));
+            len += NRF51_CCM_MIC_SIZE;
+        }
+        packet[1] = len;
+    }
+    return address_space_write(&s->as, s->outptr, MEMTXATTRS_UNSPECIFIED,
+                               packet, NRF51_CCM_HEADER_SIZE + len) ==
+           MEMTX_OK;
+}
+
+static void nrf51_ccm_crypt(NRF51PeriphState *p)
+{
+    NRF51CCMState *s = NRF51_CCM(p);
+
+    if (s->enable != NRF51_ENABLE_CCM) {
+        return;
+    }
+    if (!s->ready || !nrf51_ccm_packet(s)) {
+        nrf51_periph_event(p, NRF51_CCM_EVENT_ERROR);
+        return;
+    }
+    nrf51_periph_event(p, NRF51_CCM_EVENT_ENDCRYPT);
+}
+
+static void nrf51_ccm_stop(NRF51PeriphState *p)
+{
+    NRF51_CCM(p)->ready = false;
+}
+
+static NRF51PeriphTaskFn * const nrf51_ccm_tasks[] = {
+    [NRF51_CCM_TASK_KSGEN] = nrf51_ccm_ksgen,
+    [NRF51_CCM_TASK_CRYPT] = nrf51_ccm_crypt,
+    [NRF51_CCM_TASK_STOP]  = nrf51_ccm_stop,
+};
+
+static const NRF51PeriphShort nrf51_ccm_shorts[] = {
+    { NRF51_CCM_SHORT_ENDKSGEN_CRYPT, NRF51_CCM_EVENT_ENDKSGEN,
+      NRF51_CCM_TASK_CRYPT },
+};
+
+static void nrf51_ccm_enable_write(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51CCMState *s = NRF51_CCM(opaque);
+
+    if (value == NRF51_ENABLE_AAR &&
+        nrf51_periph_hand_over(SYS_BUS_DEVICE(s), s->peer, value)) {
+        return;
+    }
+    s->enable = value & 3;
+}
+
+static const NRF51Reg nrf51_ccm_regs[] = {
+    NRF51_PERIPH_REG(NRF51_CCM_MICSTATUS) = {
+        NRF51_FIELD(NRF51CCMState, micstatus, 0),
+    },
+    NRF51_PERIPH_REG(NRF51_CCM_ENABLE) = {
+        NRF51_FIELD(NRF51CCMState, enable, 0),
+        .write = nrf51_ccm_enable_write,
+    },
+    NRF51_PERIPH_REG(NRF51_CCM_MODE) = {
+        NRF51_FIELD(NRF51CCMState, mode, NRF51_CCM_MODE_DECRYPTION),
+    },
+    NRF51_PERIPH_REG(NRF51_CCM_CNFPTR) = {
+        NRF51_FIELD(NRF51CCMState, cnfptr, UINT32_MAX),
+    },
+    NRF51_PERIPH_REG(NRF51_CCM_INPTR) = {
+        NRF51_FIELD(NRF51CCMState, inptr, UINT32_MAX),
+    },
+    NRF51_PERIPH_REG(NRF51_CCM_OUTPTR) = {
+        NRF51_FIELD(NRF51CCMState, outptr, UINT32_MAX),
+    },
+    NRF51_PERIPH_REG(NRF51_CCM_SCRATCHPTR) = {
+        NRF51_FIELD(NRF51CCMState, scratchptr, UINT32_MAX),
+    },
+};
+
+static int nrf51_ccm_post_load(void *opaque, int version_id)
+{
+    NRF51CCMState *s = NRF51_CCM(opaque);
+
+    if (s->enable == NRF51_ENABLE_CCM) {
+        nrf51_periph_claim(SYS_BUS_DEVICE(s), s->peer);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_nrf51_ccm = {
+    .name = TYPE_NRF51_CCM,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = nrf51_ccm_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(parent, NRF51CCMState, 1, vmstate_nrf51_periph,
+                       NRF51PeriphState),
+        VMSTATE_BOOL(ready, NRF51CCMState),
+        VMSTATE_UINT8_ARRAY(key, NRF51CCMState, NRF51_AES_BLOCK),
+        VMSTATE_UINT8_ARRAY(nonce, NRF51CCMState, NRF51_CCM_NONCE_SIZE),
+        VMSTATE_UINT32(micstatus, NRF51CCMState),
+        VMSTATE_UINT32(enable, NRF51CCMState),
+        VMSTATE_UINT32(mode, NRF51CCMState),
+        VMSTATE_UINT32(cnfptr, NRF51CCMState),
+        VMSTATE_UINT32(inptr, NRF51CCMState),
+        VMSTATE_UINT32(outptr, NRF51CCMState),
+        VMSTATE_UINT32(scratchptr, NRF51CCMState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_ccm_properties[] = {
+    DEFINE_PROP_LINK("peer", NRF51CCMState, peer, TYPE_SYS_BUS_DEVICE,
+                     SysBusDevice *),
+    DEFINE_PROP_LINK("memory", NRF51CCMState, memory, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_ccm_realize(DeviceState *dev, Error **errp)
+{
+    NRF51CCMState *s = NRF51_CCM(dev);
+
+    address_space_init(&s->as, s->memory ? s->memory : get_system_memory(),
+                       TYPE_NRF51_CCM);
+}
+
+static void nrf51_ccm_reset(DeviceState *dev)
+{
+    NRF51CCMState *s = NRF51_CCM(dev);
+
+    nrf51_periph_reset(dev);
+    s->ready = false;
+    s->micstatus = 0;
+    s->enable = 0;
+    s->mode = 0;
+    s->cnfptr = 0;
+    s->inptr = 0;
+    s->outptr = 0;
+    s->scratchptr = 0;
+}
+
+static void nrf51_ccm_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    NRF51PeriphClass *pc = NRF51_PERIPH_CLASS(klass);
+
+    dc->realize = nrf51_ccm_realize;
+    dc->reset = nrf51_ccm_reset;
+    dc->props = nrf51_ccm_properties;
+    dc->vmsd = &vmstate_nrf51_ccm;
+    pc->tasks = nrf51_ccm_tasks;
+    pc->num_tasks = ARRAY_SIZE(nrf51_ccm_tasks);
+    pc->events = 1 << NRF51_CCM_EVENT_ENDKSGEN |
+                 1 << NRF51_CCM_EVENT_ENDCRYPT |
+                 1 << NRF51_CCM_EVENT_ERROR;
+    pc->shorts = nrf51_ccm_shorts;
+    pc->num_shorts = ARRAY_SIZE(nrf51_ccm_shorts);
+    pc->regs = nrf51_ccm_regs;
+    pc->num_regs = ARRAY_SIZE(nrf51_ccm_regs);
+}
+
+static const TypeInfo nrf51_ccm_info = {
+    .name          = TYPE_NRF51_CCM,
+    .parent        = TYPE_NRF51_PERIPH,
+    .instance_size = sizeof(NRF51CCMState),
+    .class_init    = nrf51_ccm_class_init,
+};
+
+#define TYPE_NRF51_AAR "nrf51_aar"
+#define NRF51_AAR(obj) \
+    OBJECT_CHECK(NRF51AARState, (obj), TYPE_NRF51_AAR)
+
+#define NRF51_AAR_MAX_IRK   16
+#define NRF51_AAR_ADDR_SIZE 6
+
+enum {
+    NRF51_AAR_STATUS     = 0x400,
+    NRF51_AAR_ENABLE     = 0x500,
+    NRF51_AAR_NIRK       = 0x504,
+    NRF51_AAR_IRKPTR     = 0x508,
+    NRF51_AAR_ADDRPTR    = 0x510,
+    NRF51_AAR_SCRATCHPTR = 0x514,
+};
+
+enum {
+    NRF51_AAR_TASK_START = 0,
+    NRF51_AAR_TASK_STOP  = 2,
+    NRF51_AAR_EVENT_END         = 0,
+    NRF51_AAR_EVENT_RESOLVED    = 1,
+    NRF51_AAR_EVENT_NOTRESOLVED = 2,
+};
+
+typedef struct {
+    /* Private */
+    NRF51PeriphState parent;
+
+    /* Public */
+    /* CCM, which shares our ID */
+    SysBusDevice *peer;
+    /* Bus seen by the EasyDMA accesses, the system bus by default */
+    MemoryRegion *memory;
+    AddressSpace as;
+
+    /* Internal state */
+    /* One cipher per IRK, kept while the IRK list does not change */
+    NRF51AESKey aes[NRF51_AAR_MAX_IRK];
+
+    /* Public Regs */
+    uint32_t status;
+    uint32_t enable;
+    uint32_t nirk;
+    uint32_t irkptr;
+    uint32_t addrptr;
+    uint32_t scratchptr;
+} NRF51AARState;
+
+/**
+ * Index of the IRK that generated the resolvable private address `addr`,
+ * least significant byte first, or -1. The hash is ah(IRK, prand), the
+ * low 24 bits of AES with the IRK on the zero-padded prand; IRKs and AES
+ * blocks are most significant byte first.
+ */
+static int nrf51_aar_resolve(NRF51AARState *s, const uint8_t *addr,
+                             const uint8_t *irk, int nirk, bool *error)
+{
+    uint8_t r[NRF51_AES_BLOCK] = { 0 }, h[NRF51_AES_BLOCK];
+
+    r[13] = addr[5];
+    r[14] = addr[4];
+    r[15] = addr[3];
+    for (int i = 0; i < nirk; i++) {
+        if (!nrf51_aes_encrypt(&s->aes[i], irk + i * NRF51_AES_BLOCK,
+                               r, h, sizeof(h))) {
+            *error = true;
+            return -1;
+        }
+        if (h[15] == addr[0] && h[14] == addr[1] && h[13] == addr[2]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void nrf51_aar_start(NRF51PeriphState *p)
+{
+    NRF51AARState *s = NRF51_AAR(p);
+    uint8_t irk[NRF51_AAR_MAX_IRK * NRF51_AES_BLOCK];
+    uint8_t addr[NRF51_AAR_ADDR_SIZE];
+    int nirk = MIN(s->nirk, NRF51_AAR_MAX_IRK);
+    bool error = false;
+    int match = -1;
+
+    if (s->enable != NRF51_ENABLE_AAR) {
+        return;
+    }
+    /* The address follows the S0, LENGTH and S1 bytes of the packet */
+    if (address_space_read(&s->as, s->addrptr + 3, MEMTXATTRS_UNSPECIFIED,
+                           addr, sizeof(addr)) == MEMTX_OK &&
+        address_space_read(&s->as, s->irkptr, MEMTXATTRS_UNSPECIFIED,
+                           irk, nirk * NRF51_AES_BLOCK) == MEMTX_OK) {
+        match = nrf51_aar_resolve(s, addr, irk, nirk, &error);
+    }
+    if (match >= 0) {
+        s->status = match;
+        nrf51_periph_event(p, NRF51_AAR_EVENT_RESOLVED);
+    } else {
+        nrf51_periph_event(p, NRF51_AAR_EVENT_NOTRESOLVED);
+    }
+    nrf51_periph_event(p, NRF51_AAR_EVENT_END);
+}
+
+static void nrf51_aar_stop(NRF51PeriphState *p)
+{
+    /* START completes at once, there is nothing to stop */
+}
+
+static NRF51PeriphTaskFn * const nrf51_aar_tasks[] = {
+    [NRF51_AAR_TASK_START] = nrf51_aar_start,
+    [NRF51_AAR_TASK_STOP]  = nrf51_aar_stop,
+};
+
+static void nrf51_aar_enable_write(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51AARState *s = NRF51_AAR(opaque);
+
+    if (value == NRF51_ENABLE_CCM &&
+        nrf51_periph_hand_over(SYS_BUS_DEVICE(s), s->peer, value)) {
+        return;
+    }
+    s->enable = value & 3;
+}
+
+static const NRF51Reg nrf51_aar_regs[] = {
+    NRF51_PERIPH_REG(NRF51_AAR_STATUS) = {
+        NRF51_FIELD(NRF51AARState, status, 0),
+    },
+    NRF51_PERIPH_REG(NRF51_AAR_ENABLE) = {
+        NRF51_FIELD(NRF51AARState, enable, 0),
+        .write = nrf51_aar_enable_write,
+    },
+    NRF51_PERIPH_REG(NRF51_AAR_NIRK) = {
+        NRF51_FIELD(NRF51AARState, nirk, 0x1f),
+    },
+    NRF51_PERIPH_REG(NRF51_AAR_IRKPTR) = {
+        NRF51_FIELD(NRF51AARState, irkptr, UINT32_MAX),
+    },
+    NRF51_PERIPH_REG(NRF51_AAR_ADDRPTR) = {
+        NRF51_FIELD(NRF51AARState, addrptr, UINT32_MAX),
+    },
+    NRF51_PERIPH_REG(NRF51_AAR_SCRATCHPTR) = {
+        NRF51_FIELD(NRF51AARState, scratchptr, UINT32_MAX),
+    },
+};
+
+static int nrf51_aar_post_load(void *opaque, int version_id)
+{
+    NRF51AARState *s = NRF51_AAR(opaque);
+
+    if (s->enable == NRF51_ENABLE_AAR) {
+        nrf51_periph_claim(SYS_BUS_DEVICE(s), s->peer);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_nrf51_aar = {
+    .name = TYPE_NRF51_AAR,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = nrf51_aar_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(parent, NRF51AARState, 1, vmstate_nrf51_periph,
+                       NRF51PeriphState),
+        VMSTATE_UINT32(status, NRF51AARState),
+        VMSTATE_UINT32(enable, NRF51AARState),
+        VMSTATE_UINT32(nirk, NRF51AARState),
+        VMSTATE_UINT32(irkptr, NRF51AARState),
+        VMSTATE_UINT32(addrptr, NRF51AARState),
+        VMSTATE_UINT32(scratchptr, NRF51AARState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_aar_properties[] = {
+    DEFINE_PROP_LINK("peer", NRF51AARState, peer, TYPE_SYS_BUS_DEVICE,
+                     SysBusDevice *),
+    DEFINE_PROP_LINK("memory", NRF51AARState, memory, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_aar_realize(DeviceState *dev, Error **errp)
+{
+    NRF51AARState *s = NRF51_AAR(dev);
+
+    address_space_init(&s->as, s->memory ? s->memory : get_system_memory(),
+                       TYPE_NRF51_AAR);
+}
+
+static void nrf51_aar_reset(DeviceState *dev)
+{
+    NRF51AARState *s = NRF51_AAR(dev);
+
+    nrf51_periph_reset(dev);
+    s->status = 0;
+    s->enable = 0;
+    s->nirk = 1;
+    s->irkptr = 0;
+    s->addrptr = 0;
+    s->scratchptr = 0;
+}
+
+static void nrf51_aar_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    NRF51PeriphClass *pc = NRF51_PERIPH_CLASS(klass);
+
+    dc->realize = nrf51_aar_realize;
+    dc->reset = nrf51_aar_reset;
+    dc->props = nrf51_aar_properties;
+    dc->vmsd = &vmstate_nrf51_aar;
+    pc->tasks = nrf51_aar_tasks;
+    pc->num_tasks = ARRAY_SIZE(nrf51_aar_tasks);
+    pc->events = 1 << NRF51_AAR_EVENT_END |
+                 1 << NRF51_AAR_EVENT_RESOLVED |
+                 1 << NRF51_AAR_EVENT_NOTRESOLVED;
+    pc->regs = nrf51_aar_regs;
+    pc->num_regs = ARRAY_SIZE(nrf51_aar_regs);
+}
+
+static const TypeInfo nrf51_aar_info = {
+    .name          = TYPE_NRF51_AAR,
+    .parent        = TYPE_NRF51_PERIPH,
+    .instance_size = sizeof(NRF51AARState),
+    .class_init    = nrf51_aar_class_init,
+};
+
+/**
+ * NRF51 WDT
+ *   Watchdog Timer, with respect to nRF51822 Reference Manual
+ *   NOTE: the timeout is a single QEMUTimer on virtual time, re-armed when
+ *         all enabled RR registers have been written. On timeout the board
+ *         is reset two LFCLK cycles after the TIMEOUT event, through the
+ *         -watchdog-action policy, or, with property "fail-fast", QEMU
+ *         exits at once with status NRF51_WDT_FAIL_FAST_STATUS so a hung
+ *         test frees its host core.
+ */
+
+#define TYPE_NRF51_WDT "nrf51_wdt"
+#define NRF51_WDT(obj) \
+    OBJECT_CHECK(NRF51WDTState, (obj), TYPE_NRF51_WDT)
+
+#define NRF51_WDT_LFCLK_FREQ      32768
+#define NRF51_WDT_NUM_RR          8
+#define NRF51_WDT_RELOAD          0x6E524635
+/* ASCII 'W', which stands out from QEMU's own exit statuses */
+#define NRF51_WDT_FAIL_FAST_STATUS 0x57
+
+enum {
+    NRF51_WDT_START     = 0x000,
+    NRF51_WDT_TIMEOUT   = 0x100,
+    NRF51_WDT_INTENSET  = 0x304,
+    NRF51_WDT_INTENCLR  = 0x308,
+    NRF51_WDT_RUNSTATUS = 0x400,
+    NRF51_WDT_REQSTATUS = 0x404,
+    NRF51_WDT_CRV       = 0x504,
+    NRF51_WDT_RREN      = 0x508,
+    NRF51_WDT_CONFIG    = 0x50C,
+    NRF51_WDT_RR0       = 0x600,
+    NRF51_WDT_RR7       = 0x61C,
+};
+
+enum {
+    NRF51_WDT_INT_TIMEOUT = 1 << 0,
+    NRF51_WDT_RREN_MASK   = 0xFF,
+    NRF51_WDT_CONFIG_MASK = 0x9,
+};
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    qemu_irq irq;
+    QEMUTimer *timer;
+    NRF51PPIState *ppi;
+    bool fail_fast;
+
+    /* Internal state */
+    bool running;
+    /* TIMEOUT was raised and the reset is due */
+    bool expired;
+
+    /* Public Regs */
+    uint32_t events_timeout;
+    uint32_t inten;
+    uint32_t reqstatus;
+    uint32_t crv;
+    uint32_t rren;
+    uint32_t config;
+} NRF51WDTState;
+
+static void nrf51_wdt_update_irq(NRF51WDTState *s)
+{
+    qemu_set_irq(s->irq,
+                 s->events_timeout && (s->inten & NRF51_WDT_INT_TIMEOUT));
+}
+
+static void nrf51_wdt_reload(NRF51WDTState *s)
+{
+    int64_t ns = muldiv64((uint64_t)s->crv + 1, NANOSECONDS_PER_SECOND,
+                          NRF51_WDT_LFCLK_FREQ);
+
+    s->reqstatus = s->rren;
+    timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ns);
+}
+
+static void nrf51_wdt_expire(void *opaque)
+{
+    NRF51WDTState *s = (NRF51WDTState *)opaque;
+
+    if (s->fail_fast) {
+        error_report("%s: watchdog timeout, exiting", TYPE_NRF51_WDT);
+        exit(NRF51_WDT_FAIL_FAST_STATUS);
+    }
+
+    if (s->expired) {
+        s->expired = false;
+        watchdog_perform_action();
+        return;
+    }
+
+    s->expired = true;
+    s->events_timeout = 1;
+    nrf51_ppi_event(s->ppi, nrf51_periph_addr(SYS_BUS_DEVICE(s),
+                                              NRF51_WDT_TIMEOUT));
+    nrf51_wdt_update_irq(s);
+    timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                 muldiv64(2, NANOSECONDS_PER_SECOND, NRF51_WDT_LFCLK_FREQ));
+}
+
+static uint64_t nrf51_wdt_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    NRF51WDTState *s = (NRF51WDTState *)opaque;
+
+    if (offset >= NRF51_WDT_RR0 && offset <= NRF51_WDT_RR7) {
+        /* RR registers are write-only */
+        return 0;
+    }
+
+    switch (offset) {
+        case NRF51_WDT_START:
+            /* Tasks are write-only */
+            return 0;
+        case NRF51_WDT_TIMEOUT:
+            return s->events_timeout;
+        case NRF51_WDT_INTENSET:
+        case NRF51_WDT_INTENCLR:
+            return s->inten;
+        case NRF51_WDT_RUNSTATUS:
+            return s->running;
+        case NRF51_WDT_REQSTATUS:
+            return s->reqstatus;
+        case NRF51_WDT_CRV:
+            return s->crv;
+        case NRF51_WDT_RREN:
+            return s->rren;
+        case NRF51_WDT_CONFIG:
+            return s->config;
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: reading a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            return 0;
+    }
+}
+
+static void nrf51_wdt_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    NRF51WDTState *s = (NRF51WDTState *)opaque;
+
+    if (offset >= NRF51_WDT_RR0 && offset <= NRF51_WDT_RR7) {
+        int n = (offset - NRF51_WDT_RR0) >> 2;
+
+        if (s->running && value == NRF51_WDT_RELOAD && !s->expired) {
+            s->reqstatus &= ~(1 << n);
+            if (!s->reqstatus) {
+                nrf51_wdt_reload(s);
+            }
+        }
+        return;
+    }
+
+    switch (offset) {
+        case NRF51_WDT_START:
+            if ((value & 1) && !s->running) {
+                s->running = true;
+                nrf51_wdt_reload(s);
+            }
+            break;
+        case NRF51_WDT_TIMEOUT:
+            s->events_timeout = value & 1;
+            break;
+        case NRF51_WDT_INTENSET:
+            s->inten |= value & NRF51_WDT_INT_TIMEOUT;
+            break;
+        case NRF51_WDT_INTENCLR:
+            s->inten &= ~(value & NRF51_WDT_INT_TIMEOUT);
+            break;
+        case NRF51_WDT_CRV:
+        case NRF51_WDT_RREN:
+        case NRF51_WDT_CONFIG:
+            if (s->running) {
+                qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                          "%s: offset 0x%x is locked "
+                                          "while running\n",
+                                          __func__, (int)offset);
+                break;
+            }
+            if (offset == NRF51_WDT_CRV) {
+                s->crv = value;
+            } else if (offset == NRF51_WDT_RREN) {
+                s->rren = value & NRF51_WDT_RREN_MASK;
+            } else {
+                s->config = value & NRF51_WDT_CONFIG_MASK;
+            }
+            break;
+        case NRF51_WDT_RUNSTATUS:
+        case NRF51_WDT_REQSTATUS:
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: writing a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            break;
+    }
+
+    nrf51_wdt_update_irq(s);
+}
+
+static const MemoryRegionOps nrf51_wdt_ops = {
+    .read = nrf51_wdt_read,
+    .write = nrf51_wdt_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static const VMStateDescription vmstate_nrf51_wdt = {
+    .name = TYPE_NRF51_WDT,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER_PTR(timer, NRF51WDTState),
+        VMSTATE_BOOL(running, NRF51WDTState),
+        VMSTATE_BOOL(expired, NRF51WDTState),
+        VMSTATE_UINT32(events_timeout, NRF51WDTState),
+        VMSTATE_UINT32(inten, NRF51WDTState),
+        VMSTATE_UINT32(reqstatus, NRF51WDTState),
+        VMSTATE_UINT32(crv, NRF51WDTState),
+        VMSTATE_UINT32(rren, NRF51WDTState),
+        VMSTATE_UINT32(config, NRF51WDTState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_wdt_properties[] = {
+    DEFINE_PROP_BOOL("fail-fast", NRF51WDTState, fail_fast, false),
+    DEFINE_PROP_LINK("ppi", NRF51WDTState, ppi, TYPE_NRF51_PPI,
+                     NRF51PPIState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_wdt_realize(DeviceState *dev, Error **errp)
+{
+    NRF51WDTState *s = NRF51_WDT(dev);
+
+    s->timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nrf51_wdt_expire, s);
+}
+
+static void nrf51_wdt_reset(DeviceState *dev)
+{
+    NRF51WDTState *s = NRF51_WDT(dev);
+
+    timer_del(s->timer);
+    s->running = false;
+    s->expired = false;
+    s->events_timeout = 0;
+    s->inten = 0;
+    s->reqstatus = 1;
+    s->crv = 0xFFFFFFFF;
+    s->rren = 1;
+    s->config = 1;
+}
+
+static void nrf51_wdt_init(Object *obj)
+{
+    NRF51WDTState *s = NRF51_WDT(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    sysbus_init_irq(sdb, &s->irq);
+    nrf51_init_io(&s->iomem, obj, &nrf51_wdt_ops, s,
+                  TYPE_NRF51_WDT, 0x1000);
+    memory_region_set_pollable(&s->iomem, true);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void nrf51_wdt_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = nrf51_wdt_realize;
+    dc->reset = nrf51_wdt_reset;
+    dc->props = nrf51_wdt_properties;
+    dc->vmsd = &vmstate_nrf51_wdt;
+}
+
+static const TypeInfo nrf51_wdt_info = {
+    .name          = TYPE_NRF51_WDT,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51WDTState),
+    .instance_init = nrf51_wdt_init,
+    .class_init    = nrf51_wdt_class_init,
+};
+
+/**
+ * NRF51 Timer
+ *   With respect to nRF51822 Reference Manual
+ *   NOTE: the counter is not ticked, it is derived from QEMU_CLOCK_VIRTUAL
+ *         whenever it is observed, and a single QEMUTimer is armed for the
+ *         next COMPARE event that has its interrupt enabled
+ */
+
+#define TYPE_NRF51_TIMER "nrf51_timer"
+#define NRF51_TIMER(obj) \
+    OBJECT_CHECK(NRF51TimerState, (obj), TYPE_NRF51_TIMER)
+
+#define NRF51_TIMER_BASE_FREQ 0x01000000
+#define NRF51_TIMER_NUM_CC    4
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    qemu_irq irq;
+    QEMUTimer *timer;
+    NRF51PPIState *ppi;
+    Notifier ppi_notifier;
+
+    /**
+     * freq = 16MHz / (2 ^ prescaler)
+     * 0 <= prescaler <= 9
+     * i.e:
+     *   16MHz  <= freq <= 32KHz
+     *   62.5ns <= tick <= 31.25us
+     */
+    uint32_t freq;
+
+    /* Internal state */
+    bool running;
+    uint32_t counter;
+    /* Virtual time the current tick count is measured from */
+    int64_t anchor_ns;
+    /* Ticks since anchor_ns already folded into counter */
+    uint64_t anchor_ticks;
+
+    /* Public Regs */
+    uint32_t events_compare[NRF51_TIMER_NUM_CC];
+    uint32_t shorts;
+    uint32_t inten;
+    uint32_t mode;
+    uint32_t bitmode;
+    uint32_t prescaler;
+    uint32_t cc[NRF51_TIMER_NUM_CC];
+} NRF51TimerState;
+
+enum {
+    NRF51_TIMER_START     = 0x000,
+    NRF51_TIMER_STOP      = 0x004,
+    NRF51_TIMER_COUNT     = 0x008,
+    NRF51_TIMER_CLEAR     = 0x00C,
+    NRF51_TIMER_SHUTDOWN  = 0x010,
+    NRF51_TIMER_CAPTURE0  = 0x040,
+    NRF51_TIMER_CAPTURE1  = 0x044,
+    NRF51_TIMER_CAPTURE2  = 0x048,
+    NRF51_TIMER_CAPTURE3  = 0x04C,
+    NRF51_TIMER_COMPARE0  = 0x140,
+    NRF51_TIMER_COMPARE1  = 0x144,
+    NRF51_TIMER_COMPARE2  = 0x148,
+    NRF51_TIMER_COMPARE3  = 0x14C,
+    NRF51_TIMER_SHORTS    = 0x200,
+    NRF51_TIMER_INTENSET  = 0x304,
+    NRF51_TIMER_INTENCLR  = 0x308,
+    NRF51_TIMER_MODE      = 0x504,
+    NRF51_TIMER_BITMODE   = 0x508,
+    NRF51_TIMER_PRESCALER = 0x510,
+    NRF51_TIMER_CC0       = 0x540,
+    NRF51_TIMER_CC1       = 0x544,
+    NRF51_TIMER_CC2       = 0x548,
+    NRF51_TIMER_CC3       = 0x54C,
+};
+
+enum {
+    NRF51_TIMER_MODE_TIMER   = 0,
+    NRF51_TIMER_MODE_COUNTER = 1,
+
+    NRF51_TIMER_SHORTS_CLEAR_SHIFT = 0,
+    NRF51_TIMER_SHORTS_STOP_SHIFT  = 8,
+    /* COMPARE[n]_CLEAR and COMPARE[n]_STOP */
+    NRF51_TIMER_SHORTS_CLEAR_MASK  = 0x000f,
+    NRF51_TIMER_SHORTS_STOP_MASK   = 0x0f00,
+
+    NRF51_TIMER_INTEN_COMPARE_SHIFT = 16,
+    NRF51_TIMER_INTEN_MASK          = 0xf,
+};
+
+static uint32_t nrf51_timer_mask(NRF51TimerState *s)
+{
+    switch (s->bitmode) {
+        case 0:
+            return 0xffff;
+        case 1:
+            return 0xff;
+        case 2:
+            return 0xffffff;
+        case 3:
+            return 0xffffffff;
+        default:
+            g_assert_not_reached();
+    }
+}
+
+static uint32_t nrf51_timer_tick_freq(NRF51TimerState *s)
+{
+    return s->freq >> MIN(s->prescaler, 9);
+}
+
+/* The counter follows virtual time only when started in timer mode */
+static bool nrf51_timer_is_ticking(NRF51TimerState *s)
+{
+    return s->running && s->mode == NRF51_TIMER_MODE_TIMER;
+}
+
+static uint64_t nrf51_timer_ns_to_ticks(NRF51TimerState *s, int64_t ns)
+{
+    return muldiv64(ns, nrf51_timer_tick_freq(s), NANOSECONDS_PER_SECOND);
+}
+
+/* Smallest delay after which at least `ticks` ticks have elapsed */
+static int64_t nrf51_timer_ticks_to_ns(NRF51TimerState *s, uint64_t ticks)
+{
+    uint32_t freq = nrf51_timer_tick_freq(s);
+    uint64_t ns = muldiv64(ticks, NANOSECONDS_PER_SECOND, freq);
+
+    if (muldiv64(ns, freq, NANOSECONDS_PER_SECOND) < ticks) {
+        ns++;
+    }
+    return ns;
+}
+
+/* Ticks until the counter next becomes equal to CC[n] */
+static uint64_t nrf51_timer_distance(NRF51TimerState *s, uint32_t from, int n)
+{
+    uint32_t mask = nrf51_timer_mask(s);
+    uint64_t d = (s->cc[n] - from) & mask;
+
+    return d ? d : (uint64_t)mask + 1;
+}
+
+static void nrf51_timer_anchor(NRF51TimerState *s)
+{
+    s->anchor_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    s->anchor_ticks = 0;
+}
+
+static hwaddr nrf51_timer_compare_addr(NRF51TimerState *s, int n)
+{
+    return nrf51_periph_addr(SYS_BUS_DEVICE(s), NRF51_TIMER_COMPARE0 + 4 * n);
+}
+
+static bool nrf51_timer_compare_routed(NRF51TimerState *s, int n)
+{
+    return nrf51_ppi_event_routed(s->ppi, nrf51_timer_compare_addr(s, n));
+}
+
+static void nrf51_timer_compare_match(NRF51TimerState *s, int n)
+{
+    s->events_compare[n] = 1;
+    if (s->shorts & (1 << (NRF51_TIMER_SHORTS_CLEAR_SHIFT + n))) {
+        s->counter = 0;
+    }
+    if (s->shorts & (1 << (NRF51_TIMER_SHORTS_STOP_SHIFT + n))) {
+        s->running = false;
+    }
+    nrf51_ppi_event(s->ppi, nrf51_timer_compare_addr(s, n));
+}
+
+/**
+ * Advance the counter by `ticks` increments, raising every COMPARE event
+ * the counter passes on the way and applying SHORTS. Once a CLEAR short
+ * has wrapped the counter the sequence is periodic, so whole periods are
+ * skipped at once instead of being stepped through, unless some COMPARE
+ * event is routed through PPI and must be delivered each time.
+ */
+static void nrf51_timer_advance(NRF51TimerState *s, uint64_t ticks)
+{
+    uint32_t mask = nrf51_timer_mask(s);
+    uint64_t next, period;
+    bool cleared, routed = false;
+    int n;
+
+    for (n = 0; n < NRF51_TIMER_NUM_CC; n++) {
+        routed |= nrf51_timer_compare_routed(s, n);
+    }
+
+    while (ticks && s->running) {
+        next = UINT64_MAX;
+        for (n = 0; n < NRF51_TIMER_NUM_CC; n++) {
+            next = MIN(next, nrf51_timer_distance(s, s->counter, n));
+        }
+
+        if (ticks < next) {
+            s->counter = (s->counter + ticks) & mask;
+            return;
+        }
+
+        ticks -= next;
+        s->counter = (s->counter + next) & mask;
+        cleared = false;
+        for (n = 0; n < NRF51_TIMER_NUM_CC; n++) {
+            if ((s->cc[n] & mask) == s->counter) {
+                cleared |= !!(s->shorts &
+                              (1 << (NRF51_TIMER_SHORTS_CLEAR_SHIFT + n)));
+                nrf51_timer_compare_match(s, n);
+            }
+        }
+
+        if (!cleared || !s->running || routed ||
+            (s->shorts & NRF51_TIMER_SHORTS_STOP_MASK)) {
+            continue;
+        }
+
+        /* Counter restarts from zero until the first clearing channel */
+        period = (uint64_t)mask + 1;
+        for (n = 0; n < NRF51_TIMER_NUM_CC; n++) {
+            if (s->shorts & (1 << (NRF51_TIMER_SHORTS_CLEAR_SHIFT + n))) {
+                period = MIN(period, nrf51_timer_distance(s, 0, n));
+            }
+        }
+        if (ticks >= period) {
+            for (n = 0; n < NRF51_TIMER_NUM_CC; n++) {
+                if (nrf51_timer_distance(s, 0, n) <= period) {
+                    s->events_compare[n] = 1;
+                }
+            }
+            ticks %= period;
+        }
+    }
+}
+
+/* Fold the virtual time elapsed since the last sync into the counter */
+static void nrf51_timer_sync(NRF51TimerState *s)
+{
+    uint64_t ticks, delta;
+
+    if (!nrf51_timer_is_ticking(s)) {
+        return;
+    }
+
+    ticks = nrf51_timer_ns_to_ticks(s,
+                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - s->anchor_ns);
+    delta = ticks - s->anchor_ticks;
+    /* Account first: PPI tasks may re-enter this device while advancing */
+    s->anchor_ticks = ticks;
+    nrf51_timer_advance(s, delta);
+}
+
+static void nrf51_timer_update_irq(NRF51TimerState *s)
+{
+    bool level = false;
+
+    for (int n = 0; n < NRF51_TIMER_NUM_CC; n++) {
+        if ((s->inten & (1 << n)) && s->events_compare[n]) {
+            level = true;
+        }
+    }
+    qemu_set_irq(s->irq, level);
+}
+
+/**
+ * Arm the QEMUTimer for the nearest COMPARE match that could change the
+ * interrupt line or trigger a PPI task. Matches on other channels, or on
+ * interrupt-only channels whose event is still pending, are accounted
+ * lazily by nrf51_timer_sync().
+ * There is no overflow event on nRF51, so a wrap never needs a deadline.
+ */
+static void nrf51_timer_rearm(NRF51TimerState *s)
+{
+    uint64_t next = UINT64_MAX;
+
+    if (nrf51_timer_is_ticking(s)) {
+        for (int n = 0; n < NRF51_TIMER_NUM_CC; n++) {
+            if (((s->inten & (1 << n)) && !s->events_compare[n]) ||
+                nrf51_timer_compare_routed(s, n)) {
+                next = MIN(next, nrf51_timer_distance(s, s->counter, n));
+            }
+        }
+    }
+
+    if (next == UINT64_MAX) {
+        timer_del(s->timer);
+        return;
+    }
+
+    timer_mod_ns(s->timer, s->anchor_ns +
+                 nrf51_timer_ticks_to_ns(s, s->anchor_ticks + next));
+}
+
+static void nrf51_timer_expire(void *opaque)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    nrf51_timer_sync(s);
+    nrf51_timer_update_irq(s);
+    nrf51_timer_rearm(s);
+}
+
+static void nrf51_timer_start(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    if ((value & 1) && !s->running) {
+        s->running = true;
+        nrf51_timer_anchor(s);
+    }
+}
+
+static void nrf51_timer_stop(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    if (value & 1) {
+        s->running = false;
+    }
+}
+
+static void nrf51_timer_count(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    if ((value & 1) && s->running && s->mode == NRF51_TIMER_MODE_COUNTER) {
+        nrf51_timer_advance(s, 1);
+    }
+}
+
+static void nrf51_timer_clear(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    if (value & 1) {
+        s->counter = 0;
+    }
+}
+
+static void nrf51_timer_shutdown(void *opaque, hwaddr offset,
+                                 uint64_t value)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    if (value & 1) {
+        s->running = false;
+        s->counter = 0;
+    }
+}
+
+static void nrf51_timer_capture(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    if (value & 1) {
+        s->cc[(offset >> 2) & 0x3] = s->counter;
+    }
+}
+
+static uint64_t nrf51_timer_compare_read(void *opaque, hwaddr offset)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    nrf51_timer_sync(s);
+    return s->events_compare[(offset >> 2) & 3];
+}
+
+static uint64_t nrf51_timer_inten_read(void *opaque, hwaddr offset)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    return s->inten << NRF51_TIMER_INTEN_COMPARE_SHIFT;
+}
+
+static void nrf51_timer_inten_write(void *opaque, hwaddr offset,
+                                    uint64_t value)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+    uint32_t bits = (value >> NRF51_TIMER_INTEN_COMPARE_SHIFT) &
+                    NRF51_TIMER_INTEN_MASK;
+
+    if (offset == NRF51_TIMER_INTENSET) {
+        s->inten |= bits;
+    } else {
+        s->inten &= ~bits;
+    }
+}
+
+static void nrf51_timer_mode_write(void *opaque, hwaddr offset,
+                                   uint64_t value)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    s->mode = value & 1;
+    nrf51_timer_anchor(s);
+}
+
+static void nrf51_timer_bitmode_write(void *opaque, hwaddr offset,
+                                      uint64_t value)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    s->bitmode = value & 0x3;
+    s->counter &= nrf51_timer_mask(s);
+}
+
+static void nrf51_timer_prescaler_write(void *opaque, hwaddr offset,
+                                        uint64_t value)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    s->prescaler = value & 0xf;
+    nrf51_timer_anchor(s);
+}
+
+static const NRF51Reg nrf51_timer_regs[] = {
+    /* Tasks are write-only */
+    NRF51_REG(NRF51_TIMER_START) = {
+        .read = nrf51_reg_read_zero,
+        .write = nrf51_timer_start,
+    },
+    NRF51_REG(NRF51_TIMER_STOP) = {
+        .read = nrf51_reg_read_zero,
+        .write = nrf51_timer_stop,
+    },
+    NRF51_REG(NRF51_TIMER_COUNT) = {
+        .read = nrf51_reg_read_zero,
+        .write = nrf51_timer_count,
+    },
+    NRF51_REG(NRF51_TIMER_CLEAR) = {
+        .read = nrf51_reg_read_zero,
+        .write = nrf51_timer_clear,
+    },
+    NRF51_REG(NRF51_TIMER_SHUTDOWN) = {
+        .read = nrf51_reg_read_zero,
+        .write = nrf51_timer_shutdown,
+    },
+    NRF51_REG_ARRAY(NRF51_TIMER_CAPTURE0, NRF51_TIMER_CAPTURE3) = {
+        .read = nrf51_reg_read_zero,
+        .write = nrf51_timer_capture,
+    },
+    NRF51_REG(NRF51_TIMER_COMPARE0) = {
+        NRF51_FIELD(NRF51TimerState, events_compare[0], 1),
+        .read = nrf51_timer_compare_read,
+    },
+    NRF51_REG(NRF51_TIMER_COMPARE1) = {
+        NRF51_FIELD(NRF51TimerState, events_compare[1], 1),
+        .read = nrf51_timer_compare_read,
+    },
+    NRF51_REG(NRF51_TIMER_COMPARE2) = {
+        NRF51_FIELD(NRF51TimerState, events_compare[2], 1),
+        .read = nrf51_timer_compare_read,
+    },
+    NRF51_REG(NRF51_TIMER_COMPARE3) = {
+        NRF51_FIELD(NRF51TimerState, events_compare[3], 1),
+        .read = nrf51_timer_compare_read,
+    },
+    NRF51_REG(NRF51_TIMER_SHORTS) = {
+        NRF51_FIELD(NRF51TimerState, shorts,
+                    NRF51_TIMER_SHORTS_CLEAR_MASK |
+                    NRF51_TIMER_SHORTS_STOP_MASK),
+    },
+    NRF51_REG_ARRAY(NRF51_TIMER_INTENSET, NRF51_TIMER_INTENCLR) = {
+        .read = nrf51_timer_inten_read,
+        .write = nrf51_timer_inten_write,
+    },
+    NRF51_REG(NRF51_TIMER_MODE) = {
+        NRF51_FIELD(NRF51TimerState, mode, 0),
+        .write = nrf51_timer_mode_write,
+    },
+    NRF51_REG(NRF51_TIMER_BITMODE) = {
+        NRF51_FIELD(NRF51TimerState, bitmode, 0),
+        .write = nrf51_timer_bitmode_write,
+    },
+    NRF51_REG(NRF51_TIMER_PRESCALER) = {
+        NRF51_FIELD(NRF51TimerState, prescaler, 0),
+        .write = nrf51_timer_prescaler_write,
+    },
+    NRF51_REG(NRF51_TIMER_CC0) = {
+        NRF51_FIELD(NRF51TimerState, cc[0], UINT32_MAX),
+    },
+    NRF51_REG(NRF51_TIMER_CC1) = {
+        NRF51_FIELD(NRF51TimerState, cc[1], UINT32_MAX),
+    },
+    NRF51_REG(NRF51_TIMER_CC2) = {
+        NRF51_FIELD(NRF51TimerState, cc[2], UINT32_MAX),
+    },
+    NRF51_REG(NRF51_TIMER_CC3) = {
+        NRF51_FIELD(NRF51TimerState, cc[3], UINT32_MAX),
+    },
+};
+
+static uint64_t nrf51_timer_read(void *opaque, hwaddr offset,
+                                 unsigned size)
+{
+    return nrf51_regs_read(opaque, nrf51_timer_regs,
+                           ARRAY_SIZE(nrf51_timer_regs), 0, offset);
+}
+
+static void nrf51_timer_write(void *opaque, hwaddr offset,
+                              uint64_t value, unsigned size)
+{
+    NRF51TimerState *s = (NRF51TimerState *)opaque;
+
+    nrf51_timer_sync(s);
+    nrf51_regs_write(s, nrf51_timer_regs, ARRAY_SIZE(nrf51_timer_regs), 0,
+                     offset, value);
+    nrf51_timer_update_irq(s);
+    nrf51_timer_rearm(s);
+}
+
+static const MemoryRegionOps nrf51_timer_ops = {
+    .read = nrf51_timer_read,
+    .write = nrf51_timer_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static const VMStateDescription vmstate_nrf51_timer = {
+    .name = TYPE_NRF51_TIMER,
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER_PTR(timer, NRF51TimerState),
+        VMSTATE_BOOL(running, NRF51TimerState),
+        VMSTATE_UINT32(counter, NRF51TimerState),
+        VMSTATE_INT64(anchor_ns, NRF51TimerState),
+        VMSTATE_UINT64(anchor_ticks, NRF51TimerState),
+        VMSTATE_UINT32_ARRAY(events_compare, NRF51TimerState,
+                             NRF51_TIMER_NUM_CC),
+        VMSTATE_UINT32(shorts, NRF51TimerState),
+        VMSTATE_UINT32(inten, NRF51TimerState),
+        VMSTATE_UINT32(mode, NRF51TimerState),
+        VMSTATE_UINT32(bitmode, NRF51TimerState),
+        VMSTATE_UINT32(prescaler, NRF51TimerState),
+        VMSTATE_UINT32_ARRAY(cc, NRF51TimerState, NRF51_TIMER_NUM_CC),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_timer_properties[] = {
+    DEFINE_PROP_UINT32("freq", NRF51TimerState, freq, NRF51_TIMER_BASE_FREQ),
+    DEFINE_PROP_LINK("ppi", NRF51TimerState, ppi, TYPE_NRF51_PPI,
+                     NRF51PPIState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_timer_ppi_changed(Notifier *notifier, void *data)
+{
+    NRF51TimerState *s = container_of(notifier, NRF51TimerState,
+                                      ppi_notifier);
+
+    nrf51_timer_sync(s);
+    nrf51_timer_rearm(s);
+}
+
+static void nrf51_timer_realize(DeviceState *dev, Error **errp)
+{
+    NRF51TimerState *s = NRF51_TIMER(dev);
+
+    if (s->freq < (1 << 9)) {
+        error_setg(errp, "%s: freq must be at least 512 Hz", __func__);
+        return;
+    }
+    s->timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nrf51_timer_expire, s);
+    if (s->ppi) {
+        s->ppi_notifier.notify = nrf51_timer_ppi_changed;
+        notifier_list_add(&s->ppi->routing_notifiers, &s->ppi_notifier);
+    }
+}
+
+static void nrf51_timer_reset(DeviceState *dev)
+{
+    NRF51TimerState *s = NRF51_TIMER(dev);
+
+    timer_del(s->timer);
+    s->running = false;
+    s->counter = 0;
+    s->anchor_ns = 0;
+    s->anchor_ticks = 0;
+    memset(s->events_compare, 0, sizeof(s->events_compare));
+    s->shorts = 0;
+    s->inten = 0;
+    s->mode = NRF51_TIMER_MODE_TIMER;
+    s->bitmode = 0;
+    s->prescaler = 4;
+    memset(s->cc, 0, sizeof(s->cc));
+}
+
+static void nrf51_timer_init(Object *obj)
+{
+    NRF51TimerState *s = NRF51_TIMER(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    sysbus_init_irq(sdb, &s->irq);
+    nrf51_init_io(&s->iomem, obj, &nrf51_timer_ops, s,
+                  TYPE_NRF51_TIMER, 0x1000);
+    nrf51_io_set_bql_free(&s->iomem);
+    memory_region_set_pollable(&s->iomem, true);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void nrf51_timer_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = nrf51_timer_realize;
+    dc->reset = nrf51_timer_reset;
+    dc->props = nrf51_timer_properties;
+    dc->vmsd = &vmstate_nrf51_timer;
+}
+
+static const TypeInfo nrf51_timer_info = {
+    .name          = TYPE_NRF51_TIMER,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51TimerState),
+    .instance_init = nrf51_timer_init,
+    .class_init    = nrf51_timer_class_init,
+};
+
+/**
+ * NRF51 RTC
+ *   Real Time Counter, with respect to nRF51822 Reference Manual
+ *   NOTE: COUNTER is derived from QEMU_CLOCK_VIRTUAL when it is observed,
+ *         a QEMUTimer is armed only for the next enabled TICK/OVRFLW/COMPARE
+ *         COUNTER freezes, and no QEMUTimer is armed, while the "lfclk"
+ *         gpio input is low
+ */
+
+#define TYPE_NRF51_RTC "nrf51_rtc"
+#define NRF51_RTC(obj) \
+    OBJECT_CHECK(NRF51RTCState, (obj), TYPE_NRF51_RTC)
+
+#define NRF51_RTC_LFCLK_FREQ 32768
+#define NRF51_RTC_NUM_CC     4
+#define NRF51_RTC_COUNTER_MASK 0x00FFFFFF
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    qemu_irq irq;
+    QEMUTimer *timer;
+    NRF51PPIState *ppi;
+    Notifier ppi_notifier;
+    uint32_t freq;
+
+    /* Internal state */
+    bool running;
+    /* LFCLK runs; true while the lfclk input is not connected */
+    bool lfclk;
+    /* Virtual time the current tick count is measured from */
+    int64_t anchor_ns;
+    /* Ticks since anchor_ns already folded into counter */
+    uint64_t anchor_ticks;
+
+    /* Public Regs */
+    uint32_t events_tick;
+    uint32_t events_ovrflw;
+    uint32_t events_compare[NRF51_RTC_NUM_CC];
+    uint32_t inten;
+    uint32_t evten;
+    uint32_t counter;
+    uint32_t prescaler;
+    uint32_t cc[NRF51_RTC_NUM_CC];
+} NRF51RTCState;
+
+enum {
+    NRF51_RTC_START      = 0x000,
+    NRF51_RTC_STOP       = 0x004,
+    NRF51_RTC_CLEAR      = 0x008,
+    NRF51_RTC_TRIGOVRFLW = 0x00C,
+    NRF51_RTC_TICK       = 0x100,
+    NRF51_RTC_OVRFLW     = 0x104,
+    NRF51_RTC_COMPARE0   = 0x140,
+    NRF51_RTC_COMPARE1   = 0x144,
+    NRF51_RTC_COMPARE2   = 0x148,
+    NRF51_RTC_COMPARE3   = 0x14C,
+    NRF51_RTC_INTENSET   = 0x304,
+    NRF51_RTC_INTENCLR   = 0x308,
+    NRF51_RTC_EVTEN      = 0x340,
+    NRF51_RTC_EVTENSET   = 0x344,
+    NRF51_RTC_EVTENCLR   = 0x348,
+    NRF51_RTC_COUNTER    = 0x504,
+    NRF51_RTC_PRESCALER  = 0x508,
+    NRF51_RTC_CC0        = 0x540,
+    NRF51_RTC_CC1        = 0x544,
+    NRF51_RTC_CC2        = 0x548,
+    NRF51_RTC_CC3        = 0x54C,
+};
+
+/* Bit layout shared by INTEN and EVTEN */
+enum {
+    NRF51_RTC_EN_TICK          = 1 << 0,
+    NRF51_RTC_EN_OVRFLW        = 1 << 1,
+    NRF51_RTC_EN_COMPARE_SHIFT = 16,
+    NRF51_RTC_EN_MASK          = 0x000F0003,
+};
+
+static uint64_t nrf51_rtc_ns_to_ticks(NRF51RTCState *s, int64_t ns)
+{
+    return muldiv64(ns, s->freq, NANOSECONDS_PER_SECOND) /
+           (s->prescaler + 1);
+}
+
+/* Smallest delay after which at least `ticks` ticks have elapsed */
+static int64_t nrf51_rtc_ticks_to_ns(NRF51RTCState *s, uint64_t ticks)
+{
+    uint64_t lfclk = ticks * (s->prescaler + 1);
+    uint64_t ns = muldiv64(lfclk, NANOSECONDS_PER_SECOND, s->freq);
+
+    if (muldiv64(ns, s->freq, NANOSECONDS_PER_SECOND) < lfclk) {
+        ns++;
+    }
+    return ns;
+}
+
+/* Ticks until COUNTER next becomes equal to `target` */
+static uint64_t nrf51_rtc_distance(NRF51RTCState *s, uint32_t target)
+{
+    uint64_t d = (target - s->counter) & NRF51_RTC_COUNTER_MASK;
+
+    return d ? d : NRF51_RTC_COUNTER_MASK + 1ULL;
+}
+
+static void nrf51_rtc_anchor(NRF51RTCState *s)
+{
+    s->anchor_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    s->anchor_ticks = 0;
+}
+
+/* Event register offset for an INTEN/EVTEN bit */
+static hwaddr nrf51_rtc_event_offset(int bit)
+{
+    switch (bit) {
+        case 0:
+            return NRF51_RTC_TICK;
+        case 1:
+            return NRF51_RTC_OVRFLW;
+        default:
+            return NRF51_RTC_COMPARE0 + 4 * (bit - NRF51_RTC_EN_COMPARE_SHIFT);
+    }
+}
+
+/* Events that are enabled in EVTEN and connected to a PPI channel */
+static uint32_t nrf51_rtc_routed(NRF51RTCState *s)
+{
+    uint32_t evten = s->evten, routed = 0;
+    int bit;
+
+    while (evten) {
+        bit = ctz32(evten);
+        evten &= evten - 1;
+        if (nrf51_ppi_event_routed(s->ppi,
+                nrf51_periph_addr(SYS_BUS_DEVICE(s),
+                                  nrf51_rtc_event_offset(bit)))) {
+            routed |= 1 << bit;
+        }
+    }
+    return routed;
+}
+
+/**
+ * Advance COUNTER by `ticks`. An event is only recorded when it is
+ * enabled in either INTEN or EVTEN, as on hardware, and is signalled to
+ * PPI when enabled in EVTEN.
+ */
+static void nrf51_rtc_advance(NRF51RTCState *s, uint64_t ticks)
+{
+    uint32_t enabled = s->inten | s->evten;
+    uint32_t fired = 0;
+    int bit;
+
+    if (ticks == 0) {
+        return;
+    }
+
+    if (enabled & NRF51_RTC_EN_TICK) {
+        s->events_tick = 1;
+        fired |= NRF51_RTC_EN_TICK;
+    }
+    if ((enabled & NRF51_RTC_EN_OVRFLW) &&
+        ticks >= nrf51_rtc_distance(s, 0)) {
+        s->events_ovrflw = 1;
+        fired |= NRF51_RTC_EN_OVRFLW;
+    }
+    for (int n = 0; n < NRF51_RTC_NUM_CC; n++) {
+        if ((enabled & (1 << (NRF51_RTC_EN_COMPARE_SHIFT + n))) &&
+            ticks >= nrf51_rtc_distance(s, s->cc[n])) {
+            s->events_compare[n] = 1;
+            fired |= 1 << (NRF51_RTC_EN_COMPARE_SHIFT + n);
+        }
+    }
+
+    s->counter = (s->counter + ticks) & NRF51_RTC_COUNTER_MASK;
+
+    fired &= s->evten;
+    while (fired) {
+        bit = ctz32(fired);
+        fired &= fired - 1;
+        nrf51_ppi_event(s->ppi, nrf51_periph_addr(SYS_BUS_DEVICE(s),
+                                                  nrf51_rtc_event_offset(bit)));
+    }
+}
+
+/* Fold the virtual time elapsed since the last sync into COUNTER */
+static void nrf51_rtc_sync(NRF51RTCState *s)
+{
+    uint64_t ticks, delta;
+
+    if (!s->running || !s->lfclk) {
+        return;
+    }
+
+    ticks = nrf51_rtc_ns_to_ticks(s,
+                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - s->anchor_ns);
+    delta = ticks - s->anchor_ticks;
+    /* Account first: PPI tasks may re-enter this device while advancing */
+    s->anchor_ticks = ticks;
+    nrf51_rtc_advance(s, delta);
+}
+
+static void nrf51_rtc_update_irq(NRF51RTCState *s)
+{
+    uint32_t pending = 0;
+
+    pending |= s->events_tick ? NRF51_RTC_EN_TICK : 0;
+    pending |= s->events_ovrflw ? NRF51_RTC_EN_OVRFLW : 0;
+    for (int n = 0; n < NRF51_RTC_NUM_CC; n++) {
+        if (s->events_compare[n]) {
+            pending |= 1 << (NRF51_RTC_EN_COMPARE_SHIFT + n);
+        }
+    }
+    qemu_set_irq(s->irq, !!(pending & s->inten));
+}
+
+/**
+ * Arm the QEMUTimer for the nearest event that can change the interrupt
+ * line or trigger a PPI task. An interrupt source whose event is already
+ * pending needs no deadline until the guest clears it.
+ */
+static void nrf51_rtc_rearm(NRF51RTCState *s)
+{
+    uint64_t next = UINT64_MAX;
+    uint32_t routed;
+
+    if (s->running && s->lfclk) {
+        routed = nrf51_rtc_routed(s);
+        if (((s->inten & NRF51_RTC_EN_TICK) && !s->events_tick) ||
+            (routed & NRF51_RTC_EN_TICK)) {
+            next = 1;
+        }
+        if (((s->inten & NRF51_RTC_EN_OVRFLW) && !s->events_ovrflw) ||
+            (routed & NRF51_RTC_EN_OVRFLW)) {
+            next = MIN(next, nrf51_rtc_distance(s, 0));
+        }
+        for (int n = 0; n < NRF51_RTC_NUM_CC; n++) {
+            uint32_t bit = 1 << (NRF51_RTC_EN_COMPARE_SHIFT + n);
+            if (((s->inten & bit) && !s->events_compare[n]) ||
+                (routed & bit)) {
+                next = MIN(next, nrf51_rtc_distance(s, s->cc[n]));
+            }
+        }
+    }
+
+    if (next == UINT64_MAX) {
+        timer_del(s->timer);
+        return;
+    }
+
+    timer_mod_ns(s->timer, s->anchor_ns +
+                 nrf51_rtc_ticks_to_ns(s, s->anchor_ticks + next));
+}
+
+static void nrf51_rtc_expire(void *opaque)
+{
+    NRF51RTCState *s = (NRF51RTCState *)opaque;
+
+    nrf51_rtc_sync(s);
+    nrf51_rtc_update_irq(s);
+    nrf51_rtc_rearm(s);
+}
+
+static void nrf51_rtc_start(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51RTCState *s = (NRF51RTCState *)opaque;
+
+    if ((value & 1) && !s->running) {
+        s->running = true;
+        nrf51_rtc_anchor(s);
+    }
+}
+
+static void nrf51_rtc_stop(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51RTCState *s = (NRF51RTCState *)opaque;
+
+    if (value & 1) {
+        s->running = false;
+    }
+}
+
+static void nrf51_rtc_clear(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51RTCState *s = (NRF51RTCState *)opaque;
+
+    if (value & 1) {
+        s->counter = 0;
+    }
+}
+
+static void nrf51_rtc_trigovrflw(void *opaque, hwaddr offset,
+                                 uint64_t value)
+{
+    NRF51RTCState *s = (NRF51RTCState *)opaque;
+
+    if (value & 1) {
+        s->counter = 0x00FFFFF0;
+    }
+}
+
+static uint64_t nrf51_rtc_tick_read(void *opaque, hwaddr offset)
+{
+    NRF51RTCState *s = (NRF51RTCState *)opaque;
+
+    nrf51_rtc_sync(s);
+    return s->events_tick;
+}
+
+static uint64_t nrf51_rtc_ovrflw_read(void *opaque, hwaddr offset)
+{
+    NRF51RTCState *s = (NRF51RTCState *)opaque;
+
+    nrf51_rtc_sync(s);
+    return s->events_ovrflw;
+}
+
+static uint64_t nrf51_rtc_compare_read(void *opaque, hwaddr offset)
+{
+    NRF51RTCState *s = (NRF51RTCState *)opaque;
+
+    nrf51_rtc_sync(s);
+    return s->events_compare[(offset >> 2) & 3];
+}
+
+static uint64_t nrf51_rtc_counter_read(void *opaque, hwaddr offset)
+{
+    NRF51RTCState *s = (NRF51RTCState *)opaque;
+
+    nrf51_rtc_sync(s);
+    return s->counter;
+}
+
+static void nrf51_rtc_prescaler_write(void *opaque, hwaddr offset,
+                                      uint64_t value)
+{
+    NRF51RTCState *s = (NRF51RTCState *)opaque;
+
+    if (s->running) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: PRESCALER written while running\n",
+                      __func__);
+        return;
+    }
+    s->prescaler = value & 0xFFF;
+}
+
+static const NRF51Reg nrf51_rtc_regs[] = {
+    /* Tasks are write-only */
+    NRF51_REG(NRF51_RTC_START) = {
+        .read = nrf51_reg_read_zero,
+        .write = nrf51_rtc_start,
+    },
+    NRF51_REG(NRF51_RTC_STOP) = {
+        .read = nrf51_reg_read_zero,
+        .write = nrf51_rtc_stop,
+    },
+    NRF51_REG(NRF51_RTC_CLEAR) = {
+        .read = nrf51_reg_read_zero,
+        .write = nrf51_rtc_clear,
+    },
+    NRF51_REG(NRF51_RTC_TRIGOVRFLW) = {
+        .read = nrf51_reg_read_zero,
+        .write = nrf51_rtc_trigovrflw,
+    },
+    NRF51_REG(NRF51_RTC_TICK) = {
+        NRF51_FIELD(NRF51RTCState, events_tick, 1),
+        .read = nrf51_rtc_tick_read,
+    },
+    NRF51_REG(NRF51_RTC_OVRFLW) = {
+        NRF51_FIELD(NRF51RTCState, events_ovrflw, 1),
+        .read = nrf51_rtc_ovrflw_read,
+    },
+    NRF51_REG(NRF51_RTC_COMPARE0) = {
+        NRF51_FIELD(NRF51RTCState, events_compare[0], 1),
+        .read = nrf51_rtc_compare_read,
+    },
+    NRF51_REG(NRF51_RTC_COMPARE1) = {
+        NRF51_FIELD(NRF51RTCState, events_compare[1], 1),
+        .read = nrf51_rtc_compare_read,
+    },
+    NRF51_REG(NRF51_RTC_COMPARE2) = {
+        NRF51_FIELD(NRF51RTCState, events_compare[2], 1),
+        .read = nrf51_rtc_compare_read,
+    },
+    NRF51_REG(NRF51_RTC_COMPARE3) = {
+        NRF51_FIELD(NRF51RTCState, events_compare[3], 1),
+        .read = nrf51_rtc_compare_read,
+    },
+    NRF51_REG(NRF51_RTC_INTENSET) = {
+        NRF51_FIELD_SET(NRF51RTCState, inten, NRF51_RTC_EN_MASK),
+    },
+    NRF51_REG(NRF51_RTC_INTENCLR) = {
+        NRF51_FIELD_CLEAR(NRF51RTCState, inten, NRF51_RTC_EN_MASK),
+    },
+    NRF51_REG(NRF51_RTC_EVTEN) = {
+        NRF51_FIELD(NRF51RTCState, evten, NRF51_RTC_EN_MASK),
+    },
+    NRF51_REG(NRF51_RTC_EVTENSET) = {
+        NRF51_FIELD_SET(NRF51RTCState, evten, NRF51_RTC_EN_MASK),
+    },
+    NRF51_REG(NRF51_RTC_EVTENCLR) = {
+        NRF51_FIELD_CLEAR(NRF51RTCState, evten, NRF51_RTC_EN_MASK),
+    },
+    NRF51_REG(NRF51_RTC_COUNTER) = {
+        .read = nrf51_rtc_counter_read,
+    },
+    NRF51_REG(NRF51_RTC_PRESCALER) = {
+        NRF51_FIELD(NRF51RTCState, prescaler, 0),
+        .write = nrf51_rtc_prescaler_write,
+    },
+    NRF51_REG(NRF51_RTC_CC0) = {
+        NRF51_FIELD(NRF51RTCState, cc[0], NRF51_RTC_COUNTER_MASK),
+    },
+    NRF51_REG(NRF51_RTC_CC1) = {
+        NRF51_FIELD(NRF51RTCState, cc[1], NRF51_RTC_COUNTER_MASK),
+    },
+    NRF51_REG(NRF51_RTC_CC2) = {
+        NRF51_FIELD(NRF51RTCState, cc[2], NRF51_RTC_COUNTER_MASK),
+    },
+    NRF51_REG(NRF51_RTC_CC3) = {
+        NRF51_FIELD(NRF51RTCState, cc[3], NRF51_RTC_COUNTER_MASK),
+    },
+};
+
+static uint64_t nrf51_rtc_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    return nrf51_regs_read(opaque, nrf51_rtc_regs,
+                           ARRAY_SIZE(nrf51_rtc_regs), 0, offset);
+}
+
+static void nrf51_rtc_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    NRF51RTCState *s = (NRF51RTCState *)opaque;
+
+    nrf51_rtc_sync(s);
+    nrf51_regs_write(s, nrf51_rtc_regs, ARRAY_SIZE(nrf51_rtc_regs), 0,
+                     offset, value);
+    nrf51_rtc_update_irq(s);
+    nrf51_rtc_rearm(s);
+}
+
+static const MemoryRegionOps nrf51_rtc_ops = {
+    .read = nrf51_rtc_read,
+    .write = nrf51_rtc_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+/* LFCLK gating: COUNTER restarts from where it stopped */
+static void nrf51_rtc_set_lfclk(void *opaque, int n, int level)
+{
+    NRF51RTCState *s = NRF51_RTC(opaque);
+
+    if (s->lfclk == !!level) {
+        return;
+    }
+    nrf51_rtc_sync(s);
+    s->lfclk = level;
+    nrf51_rtc_anchor(s);
+    nrf51_rtc_rearm(s);
+}
+
+static const VMStateDescription vmstate_nrf51_rtc = {
+    .name = TYPE_NRF51_RTC,
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER_PTR(timer, NRF51RTCState),
+        VMSTATE_BOOL(running, NRF51RTCState),
+        VMSTATE_INT64(anchor_ns, NRF51RTCState),
+        VMSTATE_UINT64(anchor_ticks, NRF51RTCState),
+        VMSTATE_UINT32(events_tick, NRF51RTCState),
+        VMSTATE_UINT32(events_ovrflw, NRF51RTCState),
+        VMSTATE_UINT32_ARRAY(events_compare, NRF51RTCState,
+                             NRF51_RTC_NUM_CC),
+        VMSTATE_UINT32(inten, NRF51RTCState),
+        VMSTATE_UINT32(evten, NRF51RTCState),
+        VMSTATE_UINT32(counter, NRF51RTCState),
+        VMSTATE_UINT32(prescaler, NRF51RTCState),
+        VMSTATE_UINT32_ARRAY(cc, NRF51RTCState, NRF51_RTC_NUM_CC),
+        VMSTATE_BOOL_V(lfclk, NRF51RTCState, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_rtc_properties[] = {
+    DEFINE_PROP_UINT32("freq", NRF51RTCState, freq, NRF51_RTC_LFCLK_FREQ),
+    DEFINE_PROP_LINK("ppi", NRF51RTCState, ppi, TYPE_NRF51_PPI,
+                     NRF51PPIState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_rtc_ppi_changed(Notifier *notifier, void *data)
+{
+    NRF51RTCState *s = container_of(notifier, NRF51RTCState, ppi_notifier);
+
+    nrf51_rtc_sync(s);
+    nrf51_rtc_rearm(s);
+}
+
+static void nrf51_rtc_realize(DeviceState *dev, Error **errp)
+{
+    NRF51RTCState *s = NRF51_RTC(dev);
+
+    if (s->freq == 0) {
+        error_setg(errp, "%s: freq must not be zero", __func__);
+        return;
+    }
+    s->timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nrf51_rtc_expire, s);
+    if (s->ppi) {
+        s->ppi_notifier.notify = nrf51_rtc_ppi_changed;
+        notifier_list_add(&s->ppi->routing_notifiers, &s->ppi_notifier);
+    }
+}
+
+static void nrf51_rtc_reset(DeviceState *dev)
+{
+    NRF51RTCState *s = NRF51_RTC(dev);
+
+    timer_del(s->timer);
+    s->running = false;
+    s->anchor_ns = 0;
+    s->anchor_ticks = 0;
+    s->events_tick = 0;
+    s->events_ovrflw = 0;
+    memset(s->events_compare, 0, sizeof(s->events_compare));
+    s->inten = 0;
+    s->evten = 0;
+    s->counter = 0;
+    s->prescaler = 0;
+    memset(s->cc, 0, sizeof(s->cc));
+}
+
+static void nrf51_rtc_init(Object *obj)
+{
+    NRF51RTCState *s = NRF51_RTC(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    sysbus_init_irq(sdb, &s->irq);
+    qdev_init_gpio_in_named(DEVICE(obj), nrf51_rtc_set_lfclk, "lfclk", 1);
+    s->lfclk = true;
+    nrf51_init_io(&s->iomem, obj, &nrf51_rtc_ops, s,
+                  TYPE_NRF51_RTC, 0x1000);
+    nrf51_io_set_bql_free(&s->iomem);
+    memory_region_set_pollable(&s->iomem, true);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void nrf51_rtc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = nrf51_rtc_realize;
+    dc->reset = nrf51_rtc_reset;
+    dc->props = nrf51_rtc_properties;
+    dc->vmsd = &vmstate_nrf51_rtc;
+}
+
+static const TypeInfo nrf51_rtc_info = {
+    .name          = TYPE_NRF51_RTC,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51RTCState),
+    .instance_init = nrf51_rtc_init,
+    .class_init    = nrf51_rtc_class_init,
+};
+
+/**
+ * NRF51 GPIOTE
+ *   GPIO Tasks and Events, with respect to nRF51822 Reference Manual
+ *   NOTE: IN and PORT events are raised from the GPIO pin change notifier,
+ *         so only real edges produce events and nothing is polled
+ */
+
+#define TYPE_NRF51_GPIOTE "nrf51_gpiote"
+#define NRF51_GPIOTE(obj) \
+    OBJECT_CHECK(NRF51GPIOTEState, (obj), TYPE_NRF51_GPIOTE)
+
+#define NRF51_GPIOTE_NUM_CH 4
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    qemu_irq irq;
+    NRF51PPIState *ppi;
+    NRF51GPIOState *gpio;
+    Notifier pin_notifier;
+
+    /* Internal state */
+    bool detect;
+
+    /* Public Regs */
+    uint32_t events_in[NRF51_GPIOTE_NUM_CH];
+    uint32_t events_port;
+    uint32_t inten;
+    uint32_t config[NRF51_GPIOTE_NUM_CH];
+} NRF51GPIOTEState;
+
+enum {
+    NRF51_GPIOTE_OUT0     = 0x000,
+    NRF51_GPIOTE_OUT1     = 0x004,
+    NRF51_GPIOTE_OUT2     = 0x008,
+    NRF51_GPIOTE_OUT3     = 0x00C,
+    NRF51_GPIOTE_IN0      = 0x100,
+    NRF51_GPIOTE_IN1      = 0x104,
+    NRF51_GPIOTE_IN2      = 0x108,
+    NRF51_GPIOTE_IN3      = 0x10C,
+    NRF51_GPIOTE_PORT     = 0x17C,
+    NRF51_GPIOTE_INTENSET = 0x304,
+    NRF51_GPIOTE_INTENCLR = 0x308,
+    NRF51_GPIOTE_CONFIG0  = 0x510,
+    NRF51_GPIOTE_CONFIG1  = 0x514,
+    NRF51_GPIOTE_CONFIG2  = 0x518,
+    NRF51_GPIOTE_CONFIG3  = 0x51C,
+};
+
+enum {
+    NRF51_GPIOTE_INT_PORT = 1u << 31,
+    NRF51_GPIOTE_INT_MASK = 0x8000000F,
+
+    NRF51_GPIOTE_MODE_DISABLED = 0,
+    NRF51_GPIOTE_MODE_EVENT    = 1,
+    NRF51_GPIOTE_MODE_TASK     = 3,
+
+    NRF51_GPIOTE_POLARITY_LOTOHI = 1,
+    NRF51_GPIOTE_POLARITY_HITOLO = 2,
+    NRF51_GPIOTE_POLARITY_TOGGLE = 3,
+
+    NRF51_GPIOTE_CONFIG_MASK = 0x00131F03,
+};
+
+static uint32_t nrf51_gpiote_mode(NRF51GPIOTEState *s, int n)
+{
+    return extract32(s->config[n], 0, 2);
+}
+
+static uint32_t nrf51_gpiote_psel(NRF51GPIOTEState *s, int n)
+{
+    return extract32(s->config[n], 8, 5);
+}
+
+static uint32_t nrf51_gpiote_polarity(NRF51GPIOTEState *s, int n)
+{
+    return extract32(s->config[n], 16, 2);
+}
+
+static void nrf51_gpiote_update_irq(NRF51GPIOTEState *s)
+{
+    uint32_t pending = 0;
+
+    for (int n = 0; n < NRF51_GPIOTE_NUM_CH; n++) {
+        pending |= s->events_in[n] ? 1 << n : 0;
+    }
+    pending |= s->events_port ? NRF51_GPIOTE_INT_PORT : 0;
+    qemu_set_irq(s->irq, !!(pending & s->inten));
+}
+
+static void nrf51_gpiote_event(NRF51GPIOTEState *s, uint32_t *event,
+                               hwaddr offset)
+{
+    *event = 1;
+    nrf51_ppi_event(s->ppi, nrf51_periph_addr(SYS_BUS_DEVICE(s), offset));
+}
+
+static void nrf51_gpiote_pin_changed(Notifier *notifier, void *data)
+{
+    NRF51GPIOTEState *s = container_of(notifier, NRF51GPIOTEState,
+                                       pin_notifier);
+    uint32_t changed = *(uint32_t *)data;
+    bool detect;
+
+    for (int n = 0; n < NRF51_GPIOTE_NUM_CH; n++) {
+        uint32_t pin = nrf51_gpiote_psel(s, n);
+        bool level = extract32(s->gpio->in, pin, 1);
+
+        if (nrf51_gpiote_mode(s, n) != NRF51_GPIOTE_MODE_EVENT ||
+            !(changed & (1 << pin))) {
+            continue;
+        }
+        switch (nrf51_gpiote_polarity(s, n)) {
+            case NRF51_GPIOTE_POLARITY_LOTOHI:
+                if (!level) {
+                    continue;
+                }
+                break;
+            case NRF51_GPIOTE_POLARITY_HITOLO:
+                if (level) {
+                    continue;
+                }
+                break;
+            case NRF51_GPIOTE_POLARITY_TOGGLE:
+                break;
+            default:
+                continue;
+        }
+        nrf51_gpiote_event(s, &s->events_in[n], NRF51_GPIOTE_IN0 + 4 * n);
+    }
+
+    /* PORT fires on the rising edge of DETECT */
+    detect = nrf51_gpio_detect(s->gpio);
+    if (detect && !s->detect) {
+        nrf51_gpiote_event(s, &s->events_port, NRF51_GPIOTE_PORT);
+    }
+    s->detect = detect;
+    nrf51_gpiote_update_irq(s);
+}
+
+static void nrf51_gpiote_out(NRF51GPIOTEState *s, int n)
+{
+    uint32_t pin = nrf51_gpiote_psel(s, n);
+    bool level = extract32(s->gpio->out, pin, 1);
+
+    if (nrf51_gpiote_mode(s, n) != NRF51_GPIOTE_MODE_TASK) {
+        return;
+    }
+    switch (nrf51_gpiote_polarity(s, n)) {
+        case NRF51_GPIOTE_POLARITY_LOTOHI:
+            level = true;
+            break;
+        case NRF51_GPIOTE_POLARITY_HITOLO:
+            level = false;
+            break;
+        case NRF51_GPIOTE_POLARITY_TOGGLE:
+            level = !level;
+            break;
+        default:
+            return;
+    }
+    nrf51_gpio_drive_pin(s->gpio, pin, level);
+}
+
+static void nrf51_gpiote_write_config(NRF51GPIOTEState *s, int n,
+                                      uint32_t value)
+{
+    s->config[n] = value & NRF51_GPIOTE_CONFIG_MASK;
+    if (nrf51_gpiote_mode(s, n) == NRF51_GPIOTE_MODE_TASK) {
+        /* The channel takes the pin over at its OUTINIT level */
+        nrf51_gpio_drive_pin(s->gpio, nrf51_gpiote_psel(s, n),
+                             extract32(s->config[n], 20, 1));
+    }
+}
+
+static void nrf51_gpiote_out_write(void *opaque, hwaddr offset,
+                                   uint64_t value)
+{
+    NRF51GPIOTEState *s = (NRF51GPIOTEState *)opaque;
+
+    if (value) {
+        nrf51_gpiote_out(s, offset / 4);
+    }
+}
+
+static uint64_t nrf51_gpiote_config_read(void *opaque, hwaddr offset)
+{
+    NRF51GPIOTEState *s = (NRF51GPIOTEState *)opaque;
+
+    return s->config[(offset - NRF51_GPIOTE_CONFIG0) / 4];
+}
+
+static void nrf51_gpiote_config_write(void *opaque, hwaddr offset,
+                                      uint64_t value)
+{
+    NRF51GPIOTEState *s = (NRF51GPIOTEState *)opaque;
+
+    nrf51_gpiote_write_config(s, (offset - NRF51_GPIOTE_CONFIG0) / 4, value);
+}
+
+static const NRF51Reg nrf51_gpiote_regs[] = {
+    NRF51_REG_ARRAY(NRF51_GPIOTE_OUT0, NRF51_GPIOTE_OUT3) = {
+        .write = nrf51_gpiote_out_write,
+    },
+    NRF51_REG(NRF51_GPIOTE_IN0) = {
+        NRF51_FIELD(NRF51GPIOTEState, events_in[0], UINT32_MAX),
+    },
+    NRF51_REG(NRF51_GPIOTE_IN1) = {
+        NRF51_FIELD(NRF51GPIOTEState, events_in[1], UINT32_MAX),
+    },
+    NRF51_REG(NRF51_GPIOTE_IN2) = {
+        NRF51_FIELD(NRF51GPIOTEState, events_in[2], UINT32_MAX),
+    },
+    NRF51_REG(NRF51_GPIOTE_IN3) = {
+        NRF51_FIELD(NRF51GPIOTEState, events_in[3], UINT32_MAX),
+    },
+    NRF51_REG(NRF51_GPIOTE_PORT) = {
+        NRF51_FIELD(NRF51GPIOTEState, events_port, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_GPIOTE_INTENSET) = {
+        NRF51_FIELD_SET(NRF51GPIOTEState, inten, NRF51_GPIOTE_INT_MASK),
+    },
+    NRF51_REG(NRF51_GPIOTE_INTENCLR) = {
+        NRF51_FIELD_CLEAR(NRF51GPIOTEState, inten, UINT32_MAX),
+    },
+    NRF51_REG_ARRAY(NRF51_GPIOTE_CONFIG0, NRF51_GPIOTE_CONFIG3) = {
+        .read = nrf51_gpiote_config_read,
+        .write = nrf51_gpiote_config_write,
+    },
+};
+
+static uint64_t nrf51_gpiote_read(void *opaque, hwaddr offset,
+                                  unsigned size)
+{
+    return nrf51_regs_read(opaque, nrf51_gpiote_regs,
+                           ARRAY_SIZE(nrf51_gpiote_regs), 0, offset);
+}
+
+static void nrf51_gpiote_write(void *opaque, hwaddr offset,
+                               uint64_t value, unsigned size)
+{
+    NRF51GPIOTEState *s = (NRF51GPIOTEState *)opaque;
+
+    nrf51_regs_write(s, nrf51_gpiote_regs, ARRAY_SIZE(nrf51_gpiote_regs), 0,
+                     offset, value);
+    nrf51_gpiote_update_irq(s);
+}
+
+static const MemoryRegionOps nrf51_gpiote_ops = {
+    .read = nrf51_gpiote_read,
+    .write = nrf51_gpiote_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static const VMStateDescription vmstate_nrf51_gpiote = {
+    .name = TYPE_NRF51_GPIOTE,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(detect, NRF51GPIOTEState),
+        VMSTATE_UINT32_ARRAY(events_in, NRF51GPIOTEState,
+                             NRF51_GPIOTE_NUM_CH),
+        VMSTATE_UINT32(events_port, NRF51GPIOTEState),
+        VMSTATE_UINT32(inten, NRF51GPIOTEState),
+        VMSTATE_UINT32_ARRAY(config, NRF51GPIOTEState, NRF51_GPIOTE_NUM_CH),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_gpiote_properties[] = {
+    DEFINE_PROP_LINK("ppi", NRF51GPIOTEState, ppi, TYPE_NRF51_PPI,
+                     NRF51PPIState *),
+    DEFINE_PROP_LINK("gpio", NRF51GPIOTEState, gpio, TYPE_NRF51_GPIO,
+                     NRF51GPIOState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_gpiote_realize(DeviceState *dev, Error **errp)
+{
+    NRF51GPIOTEState *s = NRF51_GPIOTE(dev);
+
+    if (!s->gpio) {
+        error_setg(errp, "%s: gpio link is required", __func__);
+        return;
+    }
+    s->pin_notifier.notify = nrf51_gpiote_pin_changed;
+    notifier_list_add(&s->gpio->pin_notifiers, &s->pin_notifier);
+}
+
+static void nrf51_gpiote_reset(DeviceState *dev)
+{
+    NRF51GPIOTEState *s = NRF51_GPIOTE(dev);
+
+    s->detect = false;
+    memset(s->events_in, 0, sizeof(s->events_in));
+    s->events_port = 0;
+    s->inten = 0;
+    memset(s->config, 0, sizeof(s->config));
+}
+
+static void nrf51_gpiote_init(Object *obj)
+{
+    NRF51GPIOTEState *s = NRF51_GPIOTE(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    sysbus_init_irq(sdb, &s->irq);
+    nrf51_init_io(&s->iomem, obj, &nrf51_gpiote_ops, s,
+                  TYPE_NRF51_GPIOTE, 0x1000);
+    nrf51_io_set_bql_free(&s->iomem);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void nrf51_gpiote_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = nrf51_gpiote_realize;
+    dc->reset = nrf51_gpiote_reset;
+    dc->props = nrf51_gpiote_properties;
+    dc->vmsd = &vmstate_nrf51_gpiote;
+}
+
+static const TypeInfo nrf51_gpiote_info = {
+    .name          = TYPE_NRF51_GPIOTE,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51GPIOTEState),
+    .instance_init = nrf51_gpiote_init,
+    .class_init    = nrf51_gpiote_class_init,
+};
+
+/**
+ * NRF51 UART
+ *   Universal Asynchronous Receiver/Transmitter, with respect to nRF51822
+ *   Reference Manual
+ *   NOTE: TXD bytes are queued and flushed to the chardev by a bottom half,
+ *         RXD is backed by a FIFO deeper than the hardware's 6 bytes so the
+ *         backend can hand over bursts
+ */
+
+#define TYPE_NRF51_UART "nrf51_uart"
+#define NRF51_UART(obj) \
+    OBJECT_CHECK(NRF51UARTState, (obj), TYPE_NRF51_UART)
+
+#define NRF51_UART_TX_FIFO_SIZE 256
+#define NRF51_UART_RX_FIFO_SIZE 64
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    qemu_irq irq;
+    CharBackend chr;
+    QEMUBH *tx_bh;
+
+    /* Internal state */
+    Fifo8 tx_fifo;
+    Fifo8 rx_fifo;
+    bool tx_started;
+    bool rx_started;
+    /* RXD holds a byte the guest has not read yet */
+    bool rxd_loaded;
+
+    /* Public Regs */
+    uint32_t events_rxdrdy;
+    uint32_t events_txdrdy;
+    uint32_t events_error;
+    uint32_t events_rxto;
+    uint32_t inten;
+    uint32_t errorsrc;
+    uint32_t enable;
+    uint32_t pselrts;
+    uint32_t pseltxd;
+    uint32_t pselcts;
+    uint32_t pselrxd;
+    uint32_t rxd;
+    uint32_t baudrate;
+    uint32_t config;
+} NRF51UARTState;
+
+enum {
+    NRF51_UART_STARTRX  = 0x000,
+    NRF51_UART_STOPRX   = 0x004,
+    NRF51_UART_STARTTX  = 0x008,
+    NRF51_UART_STOPTX   = 0x00C,
+    NRF51_UART_SUSPEND  = 0x01C,
+    NRF51_UART_CTS      = 0x100,
+    NRF51_UART_NCTS     = 0x104,
+    NRF51_UART_RXDRDY   = 0x108,
+    NRF51_UART_TXDRDY   = 0x11C,
+    NRF51_UART_ERROR    = 0x124,
+    NRF51_UART_RXTO     = 0x144,
+    NRF51_UART_INTEN    = 0x300,
+    NRF51_UART_INTENSET = 0x304,
+    NRF51_UART_INTENCLR = 0x308,
+    NRF51_UART_ERRORSRC = 0x480,
+    NRF51_UART_ENABLE   = 0x500,
+    NRF51_UART_PSELRTS  = 0x508,
+    NRF51_UART_PSELTXD  = 0x50C,
+    NRF51_UART_PSELCTS  = 0x510,
+    NRF51_UART_PSELRXD  = 0x514,
+    NRF51_UART_RXD      = 0x518,
+    NRF51_UART_TXD      = 0x51C,
+    NRF51_UART_BAUDRATE = 0x524,
+    NRF51_UART_CONFIG   = 0x56C,
+};
+
+enum {
+    NRF51_UART_INT_RXDRDY = 1 << 2,
+    NRF51_UART_INT_TXDRDY = 1 << 7,
+    NRF51_UART_INT_ERROR  = 1 << 9,
+    NRF51_UART_INT_RXTO   = 1 << 17,
+    NRF51_UART_INT_MASK   = 0x00020287,
+
+    NRF51_UART_ENABLE_ON  = 4,
+};
+
+static bool nrf51_uart_enabled(NRF51UARTState *s)
+{
+    return s->enable == NRF51_UART_ENABLE_ON;
+}
+
+static void nrf51_uart_update_irq(NRF51UARTState *s)
+{
+    uint32_t pending = 0;
+
+    pending |= s->events_rxdrdy ? NRF51_UART_INT_RXDRDY : 0;
+    pending |= s->events_txdrdy ? NRF51_UART_INT_TXDRDY : 0;
+    pending |= s->events_error ? NRF51_UART_INT_ERROR : 0;
+    pending |= s->events_rxto ? NRF51_UART_INT_RXTO : 0;
+    qemu_set_irq(s->irq, !!(pending & s->inten));
+}
+
+/* Hand everything queued so far to the backend in contiguous chunks */
+static void nrf51_uart_tx_flush(void *opaque)
+{
+    NRF51UARTState *s = opaque;
+    const uint8_t *buf;
+    uint32_t num;
+
+    while (!fifo8_is_empty(&s->tx_fifo)) {
+        buf = fifo8_pop_buf(&s->tx_fifo, fifo8_num_used(&s->tx_fifo), &num);
+        /* Blocks on a busy backend rather than dropping log output */
+        qemu_chr_fe_write_all(&s->chr, buf, num);
+    }
+}
+
+static void nrf51_uart_tx(NRF51UARTState *s, uint8_t byte)
+{
+    if (fifo8_is_full(&s->tx_fifo)) {
+        nrf51_uart_tx_flush(s);
+    }
+    fifo8_push(&s->tx_fifo, byte);
+    qemu_bh_schedule(s->tx_bh);
+
+    /* The byte has left TXD as far as the guest can tell */
+    s->events_txdrdy = 1;
+}
+
+/* Move the next received byte into RXD once the previous one was read */
+static void nrf51_uart_rx_next(NRF51UARTState *s)
+{
+    if (!s->rx_started || s->rxd_loaded || fifo8_is_empty(&s->rx_fifo)) {
+        return;
+    }
+    s->rxd = fifo8_pop(&s->rx_fifo);
+    s->rxd_loaded = true;
+    s->events_rxdrdy = 1;
+    nrf51_uart_update_irq(s);
+}
+
+static int nrf51_uart_can_receive(void *opaque)
+{
+    NRF51UARTState *s = opaque;
+    int ret = 0;
+
+    nrf51_lock();
+    if (s->rx_started) {
+        ret = fifo8_num_free(&s->rx_fifo);
+    }
+    nrf51_unlock();
+    return ret;
+}
+
+static void nrf51_uart_receive(void *opaque, const uint8_t *buf, int size)
+{
+    NRF51UARTState *s = opaque;
+
+    nrf51_lock();
+    fifo8_push_all(&s->rx_fifo, buf, size);
+    nrf51_uart_rx_next(s);
+    nrf51_unlock();
+}
+
+static void nrf51_uart_startrx(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51UARTState *s = (NRF51UARTState *)opaque;
+
+    if (value && nrf51_uart_enabled(s)) {
+        s->rx_started = true;
+        nrf51_uart_rx_next(s);
+        qemu_chr_fe_accept_input(&s->chr);
+    }
+}
+
+static void nrf51_uart_stoprx(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51UARTState *s = (NRF51UARTState *)opaque;
+
+    if (value && s->rx_started) {
+        s->rx_started = false;
+        s->events_rxto = 1;
+    }
+}
+
+static void nrf51_uart_starttx(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51UARTState *s = (NRF51UARTState *)opaque;
+
+    if (value && nrf51_uart_enabled(s)) {
+        s->tx_started = true;
+    }
+}
+
+static void nrf51_uart_stoptx(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51UARTState *s = (NRF51UARTState *)opaque;
+
+    if (value) {
+        s->tx_started = false;
+    }
+}
+
+static void nrf51_uart_suspend(void *opaque, hwaddr offset, uint64_t value)
+{
+    NRF51UARTState *s = (NRF51UARTState *)opaque;
+
+    if (value) {
+        s->tx_started = false;
+        s->rx_started = false;
+    }
+}
+
+static void nrf51_uart_enable_write(void *opaque, hwaddr offset,
+                                    uint64_t value)
+{
+    NRF51UARTState *s = (NRF51UARTState *)opaque;
+
+    s->enable = value & 0x7;
+    if (!nrf51_uart_enabled(s)) {
+        s->tx_started = false;
+        s->rx_started = false;
+    }
+}
+
+static uint64_t nrf51_uart_rxd_read(void *opaque, hwaddr offset)
+{
+    NRF51UARTState *s = (NRF51UARTState *)opaque;
+    uint32_t value = s->rxd;
+
+    /* Reading RXD lets the next queued byte in */
+    s->rxd_loaded = false;
+    nrf51_uart_rx_next(s);
+    qemu_chr_fe_accept_input(&s->chr);
+    return value;
+}
+
+static void nrf51_uart_txd_write(void *opaque, hwaddr offset,
+                                 uint64_t value)
+{
+    NRF51UARTState *s = (NRF51UARTState *)opaque;
+
+    if (s->tx_started) {
+        nrf51_uart_tx(s, value);
+    }
+}
+
+static const NRF51Reg nrf51_uart_regs[] = {
+    NRF51_REG(NRF51_UART_STARTRX) = {
+        .write = nrf51_uart_startrx,
+    },
+    NRF51_REG(NRF51_UART_STOPRX) = {
+        .write = nrf51_uart_stoprx,
+    },
+    NRF51_REG(NRF51_UART_STARTTX) = {
+        .write = nrf51_uart_starttx,
+    },
+    NRF51_REG(NRF51_UART_STOPTX) = {
+        .write = nrf51_uart_stoptx,
+    },
+    NRF51_REG(NRF51_UART_SUSPEND) = {
+        .write = nrf51_uart_suspend,
+    },
+    NRF51_REG_ARRAY(NRF51_UART_CTS, NRF51_UART_NCTS) = {
+        .write = nrf51_reg_write_ignore,
+    },
+    NRF51_REG(NRF51_UART_RXDRDY) = {
+        NRF51_FIELD(NRF51UARTState, events_rxdrdy, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_UART_TXDRDY) = {
+        NRF51_FIELD(NRF51UARTState, events_txdrdy, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_UART_ERROR) = {
+        NRF51_FIELD(NRF51UARTState, events_error, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_UART_RXTO) = {
+        NRF51_FIELD(NRF51UARTState, events_rxto, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_UART_INTEN) = {
+        NRF51_FIELD(NRF51UARTState, inten, NRF51_UART_INT_MASK),
+    },
+    NRF51_REG(NRF51_UART_INTENSET) = {
+        NRF51_FIELD_SET(NRF51UARTState, inten, NRF51_UART_INT_MASK),
+    },
+    NRF51_REG(NRF51_UART_INTENCLR) = {
+        NRF51_FIELD_CLEAR(NRF51UARTState, inten, UINT32_MAX),
+    },
+    /* Write one to clear */
+    NRF51_REG(NRF51_UART_ERRORSRC) = {
+        NRF51_FIELD_CLEAR(NRF51UARTState, errorsrc, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_UART_ENABLE) = {
+        NRF51_FIELD(NRF51UARTState, enable, 0),
+        .write = nrf51_uart_enable_write,
+    },
+    NRF51_REG(NRF51_UART_PSELRTS) = {
+        NRF51_FIELD(NRF51UARTState, pselrts, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_UART_PSELTXD) = {
+        NRF51_FIELD(NRF51UARTState, pseltxd, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_UART_PSELCTS) = {
+        NRF51_FIELD(NRF51UARTState, pselcts, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_UART_PSELRXD) = {
+        NRF51_FIELD(NRF51UARTState, pselrxd, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_UART_RXD) = {
+        .read = nrf51_uart_rxd_read,
+    },
+    NRF51_REG(NRF51_UART_TXD) = {
+        .write = nrf51_uart_txd_write,
+    },
+    NRF51_REG(NRF51_UART_BAUDRATE) = {
+        NRF51_FIELD(NRF51UARTState, baudrate, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_UART_CONFIG) = {
+        NRF51_FIELD(NRF51UARTState, config, 0xF),
+    },
+};
+
+static uint64_t nrf51_uart_read(void *opaque, hwaddr offset,
+                                unsigned size)
+{
+    return nrf51_regs_read(opaque, nrf51_uart_regs,
+                           ARRAY_SIZE(nrf51_uart_regs), 0, offset);
+}
+
+static void nrf51_uart_write(void *opaque, hwaddr offset,
+                             uint64_t value, unsigned size)
+{
+    NRF51UARTState *s = (NRF51UARTState *)opaque;
+
+    nrf51_regs_write(s, nrf51_uart_regs, ARRAY_SIZE(nrf51_uart_regs), 0,
+                     offset, value);
+    nrf51_uart_update_irq(s);
+}
+
+static const MemoryRegionOps nrf51_uart_ops = {
+    .read = nrf51_uart_read,
+    .write = nrf51_uart_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static int nrf51_uart_post_load(void *opaque, int version_id)
+{
+    NRF51UARTState *s = opaque;
+
+    if (!fifo8_is_empty(&s->tx_fifo)) {
+        qemu_bh_schedule(s->tx_bh);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_nrf51_uart = {
+    .name = TYPE_NRF51_UART,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = nrf51_uart_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_FIFO8(tx_fifo, NRF51UARTState),
+        VMSTATE_FIFO8(rx_fifo, NRF51UARTState),
+        VMSTATE_BOOL(tx_started, NRF51UARTState),
+        VMSTATE_BOOL(rx_started, NRF51UARTState),
+        VMSTATE_BOOL(rxd_loaded, NRF51UARTState),
+        VMSTATE_UINT32(events_rxdrdy, NRF51UARTState),
+        VMSTATE_UINT32(events_txdrdy, NRF51UARTState),
+        VMSTATE_UINT32(events_error, NRF51UARTState),
+        VMSTATE_UINT32(events_rxto, NRF51UARTState),
+        VMSTATE_UINT32(inten, NRF51UARTState),
+        VMSTATE_UINT32(errorsrc, NRF51UARTState),
+        VMSTATE_UINT32(enable, NRF51UARTState),
+        VMSTATE_UINT32(pselrts, NRF51UARTState),
+        VMSTATE_UINT32(pseltxd, NRF51UARTState),
+        VMSTATE_UINT32(pselcts, NRF51UARTState),
+        VMSTATE_UINT32(pselrxd, NRF51UARTState),
+        VMSTATE_UINT32(rxd, NRF51UARTState),
+        VMSTATE_UINT32(baudrate, NRF51UARTState),
+        VMSTATE_UINT32(config, NRF51UARTState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_uart_properties[] = {
+    DEFINE_PROP_CHR("chardev", NRF51UARTState, chr),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_uart_realize(DeviceState *dev, Error **errp)
+{
+    NRF51UARTState *s = NRF51_UART(dev);
+
+    s->tx_bh = nrf51_locked_bh_new(nrf51_uart_tx_flush, s);
+    qemu_chr_fe_set_handlers(&s->chr, nrf51_uart_can_receive,
+                             nrf51_uart_receive, NULL, NULL,
+                             s, NULL, true);
+}
+
+static void nrf51_uart_reset(DeviceState *dev)
+{
+    NRF51UARTState *s = NRF51_UART(dev);
+
+    /* Output already written by the guest is not discarded */
+    nrf51_uart_tx_flush(s);
+    fifo8_reset(&s->rx_fifo);
+    s->tx_started = false;
+    s->rx_started = false;
+    s->rxd_loaded = false;
+    s->events_rxdrdy = 0;
+    s->events_txdrdy = 0;
+    s->events_error = 0;
+    s->events_rxto = 0;
+    s->inten = 0;
+    s->errorsrc = 0;
+    s->enable = 0;
+    s->pselrts = 0xFFFFFFFF;
+    s->pseltxd = 0xFFFFFFFF;
+    s->pselcts = 0xFFFFFFFF;
+    s->pselrxd = 0xFFFFFFFF;
+    s->rxd = 0;
+    s->baudrate = 0x04000000;
+    s->config = 0;
+}
+
+static void nrf51_uart_init(Object *obj)
+{
+    NRF51UARTState *s = NRF51_UART(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    fifo8_create(&s->tx_fifo, NRF51_UART_TX_FIFO_SIZE);
+    fifo8_create(&s->rx_fifo, NRF51_UART_RX_FIFO_SIZE);
+    sysbus_init_irq(sdb, &s->irq);
+    nrf51_init_io(&s->iomem, obj, &nrf51_uart_ops, s,
+                  TYPE_NRF51_UART, 0x1000);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void nrf51_uart_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = nrf51_uart_realize;
+    dc->reset = nrf51_uart_reset;
+    dc->props = nrf51_uart_properties;
+    dc->vmsd = &vmstate_nrf51_uart;
+}
+
+static const TypeInfo nrf51_uart_info = {
+    .name          = TYPE_NRF51_UART,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51UARTState),
+    .instance_init = nrf51_uart_init,
+    .class_init    = nrf51_uart_class_init,
+};
+
+/**
+ * NRF51 RADIO
+ *   2.4 GHz radio, with respect to nRF51822 Reference Manual
+ *   NOTE: packets are exchanged with other QEMU processes through a shared
+ *         memory medium (property "medium", a file such as one in /dev/shm)
+ *         holding one ring per FREQUENCY channel; senders stamp each packet
+ *         with their virtual time at the end of air time, and receivers
+ *         hold a packet until their own virtual clock has caught up.
+ *         With property "lookahead" (ns, needs -icount), every radio on
+ *         the medium also publishes its virtual time there and waits for
+ *         the slowest one whenever it would get more than that far ahead,
+ *         so that no packet arrives after its timestamp has passed and
+ *         delivery is deterministic.  Pick at most the shortest air time
+ *         of a packet; boards should start together, and a paused one
+ *         holds up all the others.
+ *         Across hosts, property "multicast" (group:port) replaces the
+ *         medium file with a UDP multicast group.  The packets a radio
+ *         sends are batched, and one datagram per period carries them
+ *         together with the virtual time window they were sent in: every
+ *         1 ms of virtual time, or every lookahead / 2 where it doubles as
+ *         the barrier's time announcement, waiting for the other radios'
+ *         datagrams instead of shared memory.  A radio silent for 5 s of
+ *         host time is no longer waited for.  Datagrams lost on the
+ *         network are lost packets; the multicast TTL is 1.
+ *         Ramp-up and ramp-down are instantaneous, DAB/DAP matching and
+ *         data whitening are not modelled.
+ */
+
+#define TYPE_NRF51_RADIO "nrf51_radio"
+#define NRF51_RADIO(obj) \
+    OBJECT_CHECK(NRF51RadioState, (obj), TYPE_NRF51_RADIO)
+
+#define NRF51_RADIO_NUM_CHANNELS 101
+#define NRF51_RADIO_RING_SLOTS   64
+#define NRF51_RADIO_MAX_PACKET   260
+#define NRF51_RADIO_MEDIUM_MAGIC 0x4f494452 /* "RDIO" */
+#define NRF51_RADIO_SLOT_BUSY    UINT64_MAX
+/* How often a listening radio looks at the medium, in virtual time */
+#define NRF51_RADIO_POLL_NS      (20 * SCALE_US)
+#define NRF51_RADIO_MAX_PEERS    64
+#define NRF51_RADIO_BATCH_MAGIC  0x48435442 /* "BTCH" */
+/* Fits an Ethernet frame, and at least one packet of any length */
+#define NRF51_RADIO_BATCH_MAX    1400
+#define NRF51_RADIO_BATCH_NS     SCALE_MS
+#define NRF51_RADIO_REMOTE_MS    5000
+
+typedef struct {
+    uint64_t seq;
+    int64_t timestamp;
+    uint32_t sender;
+    uint32_t crc;
+    uint64_t address;
+    uint32_t len;
+    uint8_t data[NRF51_RADIO_MAX_PACKET];
+} NRF51RadioSlot;
+
+typedef struct {
+    uint64_t head;
+    NRF51RadioSlot slot[NRF51_RADIO_RING_SLOTS];
+} NRF51RadioRing;
+
+/* A radio synchronising its virtual time with the others on the medium */
+typedef struct {
+    uint32_t sender;    /* 0 if the entry is free */
+    uint32_t pid;
+    int64_t now;        /* virtual time when last at the barrier */
+} NRF51RadioPeer;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    NRF51RadioRing ring[NRF51_RADIO_NUM_CHANNELS];
+    NRF51RadioPeer peer[NRF51_RADIO_MAX_PEERS];
+} NRF51RadioMedium;
+
+/*
+ * A multicast datagram: the sender's packets with a start of air time in
+ * [start, now), little endian.  Once it is out, the sender will not send
+ * anything before virtual time now.
+ */
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t sender;
+    int64_t start;
+    int64_t now;
+    uint32_t count;
+} NRF51RadioBatchHeader;
+
+/* Each of the count packets, followed by len bytes of data */
+typedef struct QEMU_PACKED {
+    int64_t timestamp;
+    uint64_t address;
+    uint32_t crc;
+    uint16_t channel;
+    uint16_t len;
+} NRF51RadioBatchPacket;
+
+/* A radio on another host, as last heard from */
+typedef struct {
+    uint32_t sender;    /* 0 if the entry is free */
+    int64_t now;
+    int64_t heard;      /* QEMU_CLOCK_REALTIME, ms */
+} NRF51RadioRemote;
+
+typedef enum {
+    NRF51_RADIO_STATE_DISABLED = 0,
+    NRF51_RADIO_STATE_RXIDLE   = 2,
+    NRF51_RADIO_STATE_RX       = 3,
+    NRF51_RADIO_STATE_TXIDLE   = 10,
+    NRF51_RADIO_STATE_TX       = 11,
+} NRF51RadioRunState;
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    qemu_irq irq;
+    /* High unless DISABLED, i.e. while the radio draws current */
+    qemu_irq on_out;
+    QEMUTimer *timer;
+    NRF51PPIState *ppi;
+    char *medium_path;
+    uint32_t lookahead;
+    char *multicast;
+
+    /* Internal state */
+    NRF51RadioMedium *medium;
+    uint32_t sender;
+    /* With a lookahead, our entry in the medium and the barrier timer */
+    NRF51RadioPeer *peer;
+    QEMUTimer *sync_timer;
+    Notifier exit_notifier;
+    /* Next sequence number to look at in the listened-to ring */
+    uint64_t cursor;
+    /* With multicast: the socket, the batch being filled and the others */
+    int mcast_fd;
+    struct sockaddr_in mcast_addr;
+    uint8_t batch[NRF51_RADIO_BATCH_MAX];
+    uint32_t batch_len;
+    uint32_t batch_count;
+    int64_t batch_start;
+    NRF51RadioRemote remote[NRF51_RADIO_MAX_PEERS];
+
+    /* Public Regs */
+    uint32_t events_ready;
+    uint32_t events_address;
+    uint32_t events_payload;
+    uint32_t events_end;
+    uint32_t events_disabled;
+    uint32_t events_devmatch;
+    uint32_t events_devmiss;
+    uint32_t events_rssiend;
+    uint32_t events_bcmatch;
+    uint32_t shorts;
+    uint32_t inten;
+    uint32_t crcstatus;
+    uint32_t rxmatch;
+    uint32_t rxcrc;
+    uint32_t packetptr;
+    uint32_t frequency;
+    uint32_t txpower;
+    uint32_t mode;
+    uint32_t pcnf0;
+    uint32_t pcnf1;
+    uint32_t base0;
+    uint32_t base1;
+    uint32_t prefix0;
+    uint32_t prefix1;
+    uint32_t txaddress;
+    uint32_t rxaddresses;
+    uint32_t crccnf;
+    uint32_t crcpoly;
+    uint32_t crcinit;
+    uint32_t tifs;
+    uint32_t state;
+    uint32_t datawhiteiv;
+    uint32_t bcc;
+    uint32_t power;
+    /* Bus seen by the device's own accesses, the system bus by default */
+    MemoryRegion *memory;
+    AddressSpace as;
+} NRF51RadioState;
+
+enum {
+    NRF51_RADIO_TXEN        = 0x000,
+    NRF51_RADIO_RXEN        = 0x004,
+    NRF51_RADIO_START       = 0x008,
+    NRF51_RADIO_STOP        = 0x00C,
+    NRF51_RADIO_DISABLE     = 0x010,
+    NRF51_RADIO_RSSISTART   = 0x014,
+    NRF51_RADIO_RSSISTOP    = 0x018,
+    NRF51_RADIO_BCSTART     = 0x01C,
+    NRF51_RADIO_BCSTOP      = 0x020,
+    NRF51_RADIO_READY       = 0x100,
+    NRF51_RADIO_ADDRESS     = 0x104,
+    NRF51_RADIO_PAYLOAD     = 0x108,
+    NRF51_RADIO_END         = 0x10C,
+    NRF51_RADIO_DISABLED    = 0x110,
+    NRF51_RADIO_DEVMATCH    = 0x114,
+    NRF51_RADIO_DEVMISS     = 0x118,
+    NRF51_RADIO_RSSIEND     = 0x11C,
+    NRF51_RADIO_BCMATCH     = 0x128,
+    NRF51_RADIO_SHORTS      = 0x200,
+    NRF51_RADIO_INTENSET    = 0x304,
+    NRF51_RADIO_INTENCLR    = 0x308,
+    NRF51_RADIO_CRCSTATUS   = 0x400,
+    NRF51_RADIO_RXMATCH     = 0x408,
+    NRF51_RADIO_RXCRC       = 0x40C,
+    NRF51_RADIO_DAI         = 0x410,
+    NRF51_RADIO_PACKETPTR   = 0x504,
+    NRF51_RADIO_FREQUENCY   = 0x508,
+    NRF51_RADIO_TXPOWER     = 0x50C,
+    NRF51_RADIO_MODE        = 0x510,
+    NRF51_RADIO_PCNF0       = 0x514,
+    NRF51_RADIO_PCNF1       = 0x518,
+    NRF51_RADIO_BASE0       = 0x51C,
+    NRF51_RADIO_BASE1       = 0x520,
+    NRF51_RADIO_PREFIX0     = 0x524,
+    NRF51_RADIO_PREFIX1     = 0x528,
+    NRF51_RADIO_TXADDRESS   = 0x52C,
+    NRF51_RADIO_RXADDRESSES = 0x530,
+    NRF51_RADIO_CRCCNF      = 0x534,
+    NRF51_RADIO_CRCPOLY     = 0x538,
+    NRF51_RADIO_CRCINIT     = 0x53C,
+    NRF51_RADIO_TIFS        = 0x544,
+    NRF51_RADIO_RSSISAMPLE  = 0x548,
+    NRF51_RADIO_STATE       = 0x550,
+    NRF51_RADIO_DATAWHITEIV = 0x554,
+    NRF51_RADIO_BCC         = 0x560,
+    NRF51_RADIO_POWER       = 0xFFC,
+};
+
+/* Bit layout shared by SHORTS */
+enum {
+    NRF51_RADIO_SHORTS_READY_START       = 1 << 0,
+    NRF51_RADIO_SHORTS_END_DISABLE       = 1 << 1,
+    NRF51_RADIO_SHORTS_DISABLED_TXEN     = 1 << 2,
+    NRF51_RADIO_SHORTS_DISABLED_RXEN     = 1 << 3,
+    NRF51_RADIO_SHORTS_ADDRESS_RSSISTART = 1 << 4,
+    NRF51_RADIO_SHORTS_END_START         = 1 << 5,
+    NRF51_RADIO_SHORTS_DISABLED_RSSISTOP = 1 << 8,
+    NRF51_RADIO_SHORTS_MASK              = 0x0000017F,
+};
+
+/* Bit layout shared by INTEN */
+enum {
+    NRF51_RADIO_INT_READY    = 1 << 0,
+    NRF51_RADIO_INT_ADDRESS  = 1 << 1,
+    NRF51_RADIO_INT_PAYLOAD  = 1 << 2,
+    NRF51_RADIO_INT_END      = 1 << 3,
+    NRF51_RADIO_INT_DISABLED = 1 << 4,
+    NRF51_RADIO_INT_DEVMATCH = 1 << 5,
+    NRF51_RADIO_INT_DEVMISS  = 1 << 6,
+    NRF51_RADIO_INT_RSSIEND  = 1 << 7,
+    NRF51_RADIO_INT_BCMATCH  = 1 << 10,
+    NRF51_RADIO_INT_MASK     = 0x000004FF,
+};
+
+/* Constant RSSISAMPLE, i.e. -60 dBm */
+#define NRF51_RADIO_RSSI 60
+
+static void nrf51_radio_update_irq(NRF51RadioState *s)
+{
+    uint32_t pending = 0;
+
+    pending |= s->events_ready ? NRF51_RADIO_INT_READY : 0;
+    pending |= s->events_address ? NRF51_RADIO_INT_ADDRESS : 0;
+    pending |= s->events_payload ? NRF51_RADIO_INT_PAYLOAD : 0;
+    pending |= s->events_end ? NRF51_RADIO_INT_END : 0;
+    pending |= s->events_disabled ? NRF51_RADIO_INT_DISABLED : 0;
+    pending |= s->events_devmatch ? NRF51_RADIO_INT_DEVMATCH : 0;
+    pending |= s->events_devmiss ? NRF51_RADIO_INT_DEVMISS : 0;
+    pending |= s->events_rssiend ? NRF51_RADIO_INT_RSSIEND : 0;
+    pending |= s->events_bcmatch ? NRF51_RADIO_INT_BCMATCH : 0;
+    qemu_set_irq(s->irq, !!(pending & s->inten));
+    qemu_set_irq(s->on_out, s->state != NRF51_RADIO_STATE_DISABLED);
+}
+
+static void nrf51_radio_event(NRF51RadioState *s, uint32_t *event,
+                              hwaddr offset)
+{
+    *event = 1;
+    nrf51_ppi_event(s->ppi, nrf51_periph_addr(SYS_BUS_DEVICE(s), offset));
+}
+
+/* On-air address of logical address `n`, BALEN base bytes plus prefix */
+static uint64_t nrf51_radio_address(NRF51RadioState *s, int n)
+{
+    uint32_t balen = extract32(s->pcnf1, 16, 3);
+    uint32_t base = n == 0 ? s->base0 : s->base1;
+    uint32_t prefix = n < 4 ? s->prefix0 : s->prefix1;
+
+    balen = MAX(balen, 2);
+    base = balen >= 4 ? base : base >> (8 * (4 - balen));
+    return ((uint64_t)extract32(prefix, (n % 4) * 8, 8) << 32) | base;
+}
+
+/* Length in bytes of S0, LENGTH and S1 as laid out in RAM */
+static uint32_t nrf51_radio_header_len(NRF51RadioState *s)
+{
+    return extract32(s->pcnf0, 8, 1) +
+           DIV_ROUND_UP(extract32(s->pcnf0, 0, 4), 8) +
+           DIV_ROUND_UP(extract32(s->pcnf0, 16, 4), 8);
+}
+
+static uint32_t nrf51_radio_payload_len(NRF51RadioState *s,
+                                        const uint8_t *packet)
+{
+    uint32_t lflen = extract32(s->pcnf0, 0, 4);
+    uint32_t len = 0;
+
+    if (lflen) {
+        len = packet[extract32(s->pcnf0, 8, 1)] & MAKE_64BIT_MASK(0, lflen);
+    }
+    /* STATLEN extends the payload, MAXLEN bounds it */
+    len += extract32(s->pcnf1, 8, 8);
+    return MIN(len, extract32(s->pcnf1, 0, 8));
+}
+
+/* CRC configuration both ends must agree on for CRCSTATUS to be OK */
+static uint32_t nrf51_radio_crc_config(uint32_t crccnf, uint32_t crcpoly,
+                                       uint32_t crcinit)
+{
+    return (crccnf & 0x103) ^ crcpoly ^ (crcinit << 9);
+}
+
+static uint32_t nrf51_radio_crc_id(NRF51RadioState *s)
+{
+    return nrf51_radio_crc_config(s->crccnf, s->crcpoly, s->crcinit);
+}
+
+static int64_t nrf51_radio_air_ns(NRF51RadioState *s, uint32_t len)
+{
+    static const uint32_t rate[] = {
+        1000000, 2000000, 250000, 1000000,
+    };
+    uint32_t bits;
+
+    /* Preamble, address, packet and CRC */
+    bits = 8 * (1 + extract32(s->pcnf1, 16, 3) + 1 + len +
+                extract32(s->crccnf, 0, 2));
+    return muldiv64(bits, NANOSECONDS_PER_SECOND, rate[s->mode & 3]);
+}
+
+static uint32_t nrf51_radio_channel(uint32_t frequency)
+{
+    return MIN(frequency, NRF51_RADIO_NUM_CHANNELS - 1);
+}
+
+static NRF51RadioRing *nrf51_radio_ring(NRF51RadioState *s)
+{
+    if (!s->medium) {
+        return NULL;
+    }
+    return &s->medium->ring[nrf51_radio_channel(s->frequency)];
+}
+
+static void nrf51_radio_ring_put(NRF51RadioRing *ring, int64_t timestamp,
+                                 uint32_t sender, uint32_t crc,
+                                 uint64_t address, const uint8_t *packet,
+                                 uint32_t len)
+{
+    NRF51RadioSlot *slot;
+    uint64_t seq;
+
+    seq = atomic_fetch_inc(&ring->head);
+    slot = &ring->slot[seq % NRF51_RADIO_RING_SLOTS];
+    atomic_set(&slot->seq, NRF51_RADIO_SLOT_BUSY);
+    smp_wmb();
+    slot->timestamp = timestamp;
+    slot->sender = sender;
+    slot->crc = crc;
+    slot->address = address;
+    slot->len = len;
+    memcpy(slot->data, packet, len);
+    smp_wmb();
+    atomic_set(&slot->seq, seq);
+}
+
+/* Send the batch, announcing that we got to virtual time @now */
+static void nrf51_radio_batch_flush(NRF51RadioState *s, int64_t now)
+{
+    NRF51RadioBatchHeader *hdr = (NRF51RadioBatchHeader *)s->batch;
+    ssize_t ret;
+
+    hdr->magic = cpu_to_le32(NRF51_RADIO_BATCH_MAGIC);
+    hdr->sender = cpu_to_le32(s->sender);
+    hdr->start = cpu_to_le64(s->batch_start);
+    hdr->now = cpu_to_le64(now);
+    hdr->count = cpu_to_le32(s->batch_count);
+    do {
+        ret = sendto(s->mcast_fd, s->batch, s->batch_len, 0,
+                     (struct sockaddr *)&s->mcast_addr,
+                     sizeof(s->mcast_addr));
+    } while (ret < 0 && errno == EINTR);
+    /* A full socket buffer drops the datagram, as the network could */
+
+    s->batch_len = sizeof(*hdr);
+    s->batch_count = 0;
+    s->batch_start = now;
+}
+
+static void nrf51_radio_batch_add(NRF51RadioState *s, uint32_t channel,
+                                  uint64_t address, uint32_t crc,
+                                  const uint8_t *packet, uint32_t len,
+                                  int64_t timestamp)
+{
+    NRF51RadioBatchPacket bp;
+
+    if (s->batch_len + sizeof(bp) + len > NRF51_RADIO_BATCH_MAX) {
+        nrf51_radio_batch_flush(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    }
+    bp.timestamp = cpu_to_le64(timestamp);
+    bp.address = cpu_to_le64(address);
+    bp.crc = cpu_to_le32(crc);
+    bp.channel = cpu_to_le16(channel);
+    bp.len = cpu_to_le16(len);
+    memcpy(s->batch + s->batch_len, &bp, sizeof(bp));
+    memcpy(s->batch + s->batch_len + sizeof(bp), packet, len);
+    s->batch_len += sizeof(bp) + len;
+    s->batch_count++;
+}
+
+/*
+ * Put a packet on the medium as this radio, whatever its registers say:
+ * on FREQUENCY @channel, with on-air @address and CRC configuration @crc
+ * as nrf51_radio_crc_config() gives it, ending at @timestamp.
+ */
+static void nrf51_radio_send(NRF51RadioState *s, uint32_t channel,
+                             uint64_t address, uint32_t crc,
+                             const uint8_t *packet, uint32_t len,
+                             int64_t timestamp)
+{
+    if (!s->medium) {
+        return;
+    }
+    channel = nrf51_radio_channel(channel);
+    if (s->mcast_fd >= 0) {
+        nrf51_radio_batch_add(s, channel, address, crc, packet, len,
+                              timestamp);
+        return;
+    }
+    nrf51_radio_ring_put(&s->medium->ring[channel], timestamp, s->sender,
+                         crc, address, packet, len);
+}
+
+static void nrf51_radio_publish(NRF51RadioState *s, const uint8_t *packet,
+                                uint32_t len, int64_t timestamp)
+{
+    nrf51_radio_send(s, s->frequency, nrf51_radio_address(s, s->txaddress & 7),
+                     nrf51_radio_crc_id(s), packet, len, timestamp);
+}
+
+static void nrf51_radio_end(NRF51RadioState *s);
+
+static void nrf51_radio_start_tx(NRF51RadioState *s)
+{
+    uint8_t packet[NRF51_RADIO_MAX_PACKET];
+    uint32_t header = nrf51_radio_header_len(s);
+    int64_t end_ns;
+    uint32_t len;
+
+    address_space_read(&s->as, s->packetptr,
+                       MEMTXATTRS_UNSPECIFIED, packet, header);
+    len = header + nrf51_radio_payload_len(s, packet);
+    address_space_read(&s->as, s->packetptr + header,
+                       MEMTXATTRS_UNSPECIFIED, packet + header, len - header);
+
+    s->state = NRF51_RADIO_STATE_TX;
+    end_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + nrf51_radio_air_ns(s, len);
+    nrf51_radio_publish(s, packet, len, end_ns);
+    timer_mod_ns(s->timer, end_ns);
+}
+
+/* Does any enabled logical RX address match the on-air address? */
+static int nrf51_radio_rx_match(NRF51RadioState *s, uint64_t address)
+{
+    for (int n = 0; n < 8; n++) {
+        if ((s->rxaddresses & (1 << n)) &&
+            nrf51_radio_address(s, n) == address) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+static void nrf51_radio_receive(NRF51RadioState *s, NRF51RadioSlot *slot,
+                                int match)
+{
+    uint32_t header = nrf51_radio_header_len(s);
+    uint32_t len = MIN(slot->len, header + nrf51_radio_payload_len(s,
+                                                                slot->data));
+
+    address_space_write(&s->as, s->packetptr,
+                        MEMTXATTRS_UNSPECIFIED, slot->data, len);
+    s->rxmatch = match;
+    s->crcstatus = slot->crc == nrf51_radio_crc_id(s) && len == slot->len;
+    s->rxcrc = 0;
+    nrf51_radio_end(s);
+}
+
+/**
+ * Look for the next packet addressed to us on the listened-to channel.
+ * Slots are validated against their sequence number before and after they
+ * are copied, since a writer in another process may overtake the reader.
+ */
+static void nrf51_radio_poll(NRF51RadioState *s)
+{
+    NRF51RadioRing *ring = nrf51_radio_ring(s);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t next = now + NRF51_RADIO_POLL_NS;
+    NRF51RadioSlot slot;
+    uint64_t head;
+    int match;
+
+    if (!ring) {
+        return;
+    }
+
+    head = atomic_read(&ring->head);
+    if (head - s->cursor > NRF51_RADIO_RING_SLOTS) {
+        /* Overrun: the oldest packets have already been replaced */
+        s->cursor = head - NRF51_RADIO_RING_SLOTS;
+    }
+    while (s->cursor < head) {
+        NRF51RadioSlot *shared = &ring->slot[s->cursor % NRF51_RADIO_RING_SLOTS];
+        uint64_t seq = atomic_read(&shared->seq);
+
+        smp_rmb();
+        if (seq == NRF51_RADIO_SLOT_BUSY || seq < s->cursor) {
+            /* Still being written, look again on the next poll */
+            break;
+        }
+        memcpy(&slot, shared, sizeof(slot));
+        smp_rmb();
+        if (seq != s->cursor || atomic_read(&shared->seq) != seq) {
+            s->cursor++;
+            continue;
+        }
+        if (slot.timestamp > now) {
+            next = slot.timestamp;
+            break;
+        }
+        s->cursor++;
+        if (slot.sender == s->sender || slot.len > NRF51_RADIO_MAX_PACKET) {
+            continue;
+        }
+        match = nrf51_radio_rx_match(s, slot.address);
+        if (match >= 0) {
+            nrf51_radio_receive(s, &slot, match);
+            return;
+        }
+    }
+    timer_mod_ns(s->timer, next);
+}
+
+static void nrf51_radio_start(NRF51RadioState *s)
+{
+    switch (s->state) {
+        case NRF51_RADIO_STATE_TXIDLE:
+            nrf51_radio_start_tx(s);
+            break;
+        case NRF51_RADIO_STATE_RXIDLE:
+            s->state = NRF51_RADIO_STATE_RX;
+            nrf51_radio_poll(s);
+            break;
+        default:
+            break;
+    }
+}
+
+static void nrf51_radio_disable(NRF51RadioState *s);
+
+static void nrf51_radio_ready(NRF51RadioState *s)
+{
+    nrf51_radio_event(s, &s->events_ready, NRF51_RADIO_READY);
+    if (s->shorts & NRF51_RADIO_SHORTS_READY_START) {
+        nrf51_radio_start(s);
+    }
+}
+
+static void nrf51_radio_rampup(NRF51RadioState *s, NRF51RadioRunState idle)
+{
+    if (s->state != NRF51_RADIO_STATE_DISABLED) {
+        return;
+    }
+    s->state = idle;
+    if (idle == NRF51_RADIO_STATE_RXIDLE) {
+        /* Only packets sent from now on can be heard */
+        NRF51RadioRing *ring = nrf51_radio_ring(s);
+        s->cursor = ring ? atomic_read(&ring->head) : 0;
+    }
+    nrf51_radio_ready(s);
+}
+
+static void nrf51_radio_end(NRF51RadioState *s)
+{
+    timer_del(s->timer);
+    s->state = s->state == NRF51_RADIO_STATE_TX ? NRF51_RADIO_STATE_TXIDLE
+                                                : NRF51_RADIO_STATE_RXIDLE;
+    nrf51_radio_event(s, &s->events_address, NRF51_RADIO_ADDRESS);
+    nrf51_radio_event(s, &s->events_payload, NRF51_RADIO_PAYLOAD);
+    nrf51_radio_event(s, &s->events_end, NRF51_RADIO_END);
+    if (s->shorts & NRF51_RADIO_SHORTS_ADDRESS_RSSISTART) {
+        nrf51_radio_event(s, &s->events_rssiend, NRF51_RADIO_RSSIEND);
+    }
+    if (s->shorts & NRF51_RADIO_SHORTS_END_DISABLE) {
+        nrf51_radio_disable(s);
+    } else if (s->shorts & NRF51_RADIO_SHORTS_END_START) {
+        nrf51_radio_start(s);
+    }
+}
+
+static void nrf51_radio_disable(NRF51RadioState *s)
+{
+    timer_del(s->timer);
+    s->state = NRF51_RADIO_STATE_DISABLED;
+    nrf51_radio_event(s, &s->events_disabled, NRF51_RADIO_DISABLED);
+    if (s->shorts & NRF51_RADIO_SHORTS_DISABLED_TXEN) {
+        nrf51_radio_rampup(s, NRF51_RADIO_STATE_TXIDLE);
+    } else if (s->shorts & NRF51_RADIO_SHORTS_DISABLED_RXEN) {
+        nrf51_radio_rampup(s, NRF51_RADIO_STATE_RXIDLE);
+    }
+}
+
+static void nrf51_radio_expire(void *opaque)
+{
+    NRF51RadioState *s = opaque;
+
+    if (s->state == NRF51_RADIO_STATE_TX) {
+        nrf51_radio_end(s);
+    } else if (s->state == NRF51_RADIO_STATE_RX) {
+        nrf51_radio_poll(s);
+    }
+    nrf51_radio_update_irq(s);
+}
+
+static void nrf51_radio_txen_task(void *opaque, hwaddr offset,
+                                  uint64_t value)
+{
+    NRF51RadioState *s = (NRF51RadioState *)opaque;
+
+    if (value) {
+        nrf51_radio_rampup(s, NRF51_RADIO_STATE_TXIDLE);
+    }
+}
+
+static void nrf51_radio_rxen_task(void *opaque, hwaddr offset,
+                                  uint64_t value)
+{
+    NRF51RadioState *s = (NRF51RadioState *)opaque;
+
+    if (value) {
+        nrf51_radio_rampup(s, NRF51_RADIO_STATE_RXIDLE);
+    }
+}
+
+static void nrf51_radio_start_task(void *opaque, hwaddr offset,
+                                   uint64_t value)
+{
+    NRF51RadioState *s = (NRF51RadioState *)opaque;
+
+    if (value) {
+        nrf51_radio_start(s);
+    }
+}
+
+static void nrf51_radio_stop_task(void *opaque, hwaddr offset,
+                                  uint64_t value)
+{
+    NRF51RadioState *s = (NRF51RadioState *)opaque;
+
+    if (value && (s->state == NRF51_RADIO_STATE_TX ||
+                  s->state == NRF51_RADIO_STATE_RX)) {
+        /* Abort the packet in flight without END */
+        timer_del(s->timer);
+        s->state = s->state == NRF51_RADIO_STATE_TX ?
+                   NRF51_RADIO_STATE_TXIDLE : NRF51_RADIO_STATE_RXIDLE;
+    }
+}
+
+static void nrf51_radio_disable_task(void *opaque, hwaddr offset,
+                                     uint64_t value)
+{
+    NRF51RadioState *s = (NRF51RadioState *)opaque;
+
+    if (value && s->state != NRF51_RADIO_STATE_DISABLED) {
+        nrf51_radio_disable(s);
+    }
+}
+
+static void nrf51_radio_rssistart_task(void *opaque, hwaddr offset,
+                                       uint64_t value)
+{
+    NRF51RadioState *s = (NRF51RadioState *)opaque;
+
+    if (value) {
+        nrf51_radio_event(s, &s->events_rssiend, NRF51_RADIO_RSSIEND);
+    }
+}
+
+static uint64_t nrf51_radio_rssisample_read(void *opaque, hwaddr offset)
+{
+    return NRF51_RADIO_RSSI;
+}
+
+static const NRF51Reg nrf51_radio_regs[] = {
+    NRF51_REG(NRF51_RADIO_TXEN) = {
+        .write = nrf51_radio_txen_task,
+    },
+    NRF51_REG(NRF51_RADIO_RXEN) = {
+        .write = nrf51_radio_rxen_task,
+    },
+    NRF51_REG(NRF51_RADIO_START) = {
+        .write = nrf51_radio_start_task,
+    },
+    NRF51_REG(NRF51_RADIO_STOP) = {
+        .write = nrf51_radio_stop_task,
+    },
+    NRF51_REG(NRF51_RADIO_DISABLE) = {
+        .write = nrf51_radio_disable_task,
+    },
+    NRF51_REG(NRF51_RADIO_RSSISTART) = {
+        .write = nrf51_radio_rssistart_task,
+    },
+    NRF51_REG(NRF51_RADIO_RSSISTOP) = {
+        .write = nrf51_reg_write_ignore,
+    },
+    NRF51_REG(NRF51_RADIO_BCSTART) = {
+        .write = nrf51_reg_write_ignore,
+    },
+    NRF51_REG(NRF51_RADIO_BCSTOP) = {
+        .write = nrf51_reg_write_ignore,
+    },
+    NRF51_REG(NRF51_RADIO_READY) = {
+        NRF51_FIELD(NRF51RadioState, events_ready, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_ADDRESS) = {
+        NRF51_FIELD(NRF51RadioState, events_address, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_PAYLOAD) = {
+        NRF51_FIELD(NRF51RadioState, events_payload, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_END) = {
+        NRF51_FIELD(NRF51RadioState, events_end, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_DISABLED) = {
+        NRF51_FIELD(NRF51RadioState, events_disabled, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_DEVMATCH) = {
+        NRF51_FIELD(NRF51RadioState, events_devmatch, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_DEVMISS) = {
+        NRF51_FIELD(NRF51RadioState, events_devmiss, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_RSSIEND) = {
+        NRF51_FIELD(NRF51RadioState, events_rssiend, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_BCMATCH) = {
+        NRF51_FIELD(NRF51RadioState, events_bcmatch, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_SHORTS) = {
+        NRF51_FIELD(NRF51RadioState, shorts, NRF51_RADIO_SHORTS_MASK),
+    },
+    NRF51_REG(NRF51_RADIO_INTENSET) = {
+        NRF51_FIELD_SET(NRF51RadioState, inten, NRF51_RADIO_INT_MASK),
+    },
+    NRF51_REG(NRF51_RADIO_INTENCLR) = {
+        NRF51_FIELD_CLEAR(NRF51RadioState, inten, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_CRCSTATUS) = {
+        NRF51_FIELD(NRF51RadioState, crcstatus, 0),
+    },
+    NRF51_REG(NRF51_RADIO_RXMATCH) = {
+        NRF51_FIELD(NRF51RadioState, rxmatch, 0),
+    },
+    NRF51_REG(NRF51_RADIO_RXCRC) = {
+        NRF51_FIELD(NRF51RadioState, rxcrc, 0),
+    },
+    NRF51_REG(NRF51_RADIO_DAI) = {
+        .read = nrf51_reg_read_zero,
+    },
+    NRF51_REG(NRF51_RADIO_PACKETPTR) = {
+        NRF51_FIELD(NRF51RadioState, packetptr, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_FREQUENCY) = {
+        NRF51_FIELD(NRF51RadioState, frequency, 0x7F),
+    },
+    NRF51_REG(NRF51_RADIO_TXPOWER) = {
+        NRF51_FIELD(NRF51RadioState, txpower, 0xFF),
+    },
+    NRF51_REG(NRF51_RADIO_MODE) = {
+        NRF51_FIELD(NRF51RadioState, mode, 0x3),
+    },
+    NRF51_REG(NRF51_RADIO_PCNF0) = {
+        NRF51_FIELD(NRF51RadioState, pcnf0, 0x000F010F),
+    },
+    NRF51_REG(NRF51_RADIO_PCNF1) = {
+        NRF51_FIELD(NRF51RadioState, pcnf1, 0x0307FFFF),
+    },
+    NRF51_REG(NRF51_RADIO_BASE0) = {
+        NRF51_FIELD(NRF51RadioState, base0, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_BASE1) = {
+        NRF51_FIELD(NRF51RadioState, base1, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_PREFIX0) = {
+        NRF51_FIELD(NRF51RadioState, prefix0, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_PREFIX1) = {
+        NRF51_FIELD(NRF51RadioState, prefix1, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_TXADDRESS) = {
+        NRF51_FIELD(NRF51RadioState, txaddress, 0x7),
+    },
+    NRF51_REG(NRF51_RADIO_RXADDRESSES) = {
+        NRF51_FIELD(NRF51RadioState, rxaddresses, 0xFF),
+    },
+    NRF51_REG(NRF51_RADIO_CRCCNF) = {
+        NRF51_FIELD(NRF51RadioState, crccnf, 0x103),
+    },
+    NRF51_REG(NRF51_RADIO_CRCPOLY) = {
+        NRF51_FIELD(NRF51RadioState, crcpoly, 0x00FFFFFF),
+    },
+    NRF51_REG(NRF51_RADIO_CRCINIT) = {
+        NRF51_FIELD(NRF51RadioState, crcinit, 0x00FFFFFF),
+    },
+    NRF51_REG(NRF51_RADIO_TIFS) = {
+        NRF51_FIELD(NRF51RadioState, tifs, 0xFF),
+    },
+    NRF51_REG(NRF51_RADIO_RSSISAMPLE) = {
+        .read = nrf51_radio_rssisample_read,
+    },
+    NRF51_REG(NRF51_RADIO_STATE) = {
+        NRF51_FIELD(NRF51RadioState, state, 0),
+    },
+    NRF51_REG(NRF51_RADIO_DATAWHITEIV) = {
+        NRF51_FIELD(NRF51RadioState, datawhiteiv, 0x7F),
+    },
+    NRF51_REG(NRF51_RADIO_BCC) = {
+        NRF51_FIELD(NRF51RadioState, bcc, UINT32_MAX),
+    },
+    NRF51_REG(NRF51_RADIO_POWER) = {
+        NRF51_FIELD(NRF51RadioState, power, 1),
+    },
+};
+
+static uint64_t nrf51_radio_read(void *opaque, hwaddr offset,
+                                 unsigned size)
+{
+    return nrf51_regs_read(opaque, nrf51_radio_regs,
+                           ARRAY_SIZE(nrf51_radio_regs), 0, offset);
+}
+
+static void nrf51_radio_write(void *opaque, hwaddr offset,
+                              uint64_t value, unsigned size)
+{
+    NRF51RadioState *s = (NRF51RadioState *)opaque;
+
+    nrf51_regs_write(s, nrf51_radio_regs, ARRAY_SIZE(nrf51_radio_regs), 0,
+                     offset, value);
+    nrf51_radio_update_irq(s);
+}
+
+static const MemoryRegionOps nrf51_radio_ops = {
+    .read = nrf51_radio_read,
+    .write = nrf51_radio_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static int nrf51_radio_post_load(void *opaque, int version_id)
+{
+    NRF51RadioState *s = opaque;
+    NRF51RadioRing *ring = nrf51_radio_ring(s);
+
+    /* The medium has moved on independently; listen from its head */
+    s->cursor = ring ? atomic_read(&ring->head) : 0;
+    return 0;
+}
+
+static const VMStateDescription vmstate_nrf51_radio = {
+    .name = TYPE_NRF51_RADIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = nrf51_radio_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER_PTR(timer, NRF51RadioState),
+        VMSTATE_UINT32(events_ready, NRF51RadioState),
+        VMSTATE_UINT32(events_address, NRF51RadioState),
+        VMSTATE_UINT32(events_payload, NRF51RadioState),
+        VMSTATE_UINT32(events_end, NRF51RadioState),
+        VMSTATE_UINT32(events_disabled, NRF51RadioState),
+        VMSTATE_UINT32(events_devmatch, NRF51RadioState),
+        VMSTATE_UINT32(events_devmiss, NRF51RadioState),
+        VMSTATE_UINT32(events_rssiend, NRF51RadioState),
+        VMSTATE_UINT32(events_bcmatch, NRF51RadioState),
+        VMSTATE_UINT32(shorts, NRF51RadioState),
+        VMSTATE_UINT32(inten, NRF51RadioState),
+        VMSTATE_UINT32(crcstatus, NRF51RadioState),
+        VMSTATE_UINT32(rxmatch, NRF51RadioState),
+        VMSTATE_UINT32(rxcrc, NRF51RadioState),
+        VMSTATE_UINT32(packetptr, NRF51RadioState),
+        VMSTATE_UINT32(frequency, NRF51RadioState),
+        VMSTATE_UINT32(txpower, NRF51RadioState),
+        VMSTATE_UINT32(mode, NRF51RadioState),
+        VMSTATE_UINT32(pcnf0, NRF51RadioState),
+        VMSTATE_UINT32(pcnf1, NRF51RadioState),
+        VMSTATE_UINT32(base0, NRF51RadioState),
+        VMSTATE_UINT32(base1, NRF51RadioState),
+        VMSTATE_UINT32(prefix0, NRF51RadioState),
+        VMSTATE_UINT32(prefix1, NRF51RadioState),
+        VMSTATE_UINT32(txaddress, NRF51RadioState),
+        VMSTATE_UINT32(rxaddresses, NRF51RadioState),
+        VMSTATE_UINT32(crccnf, NRF51RadioState),
+        VMSTATE_UINT32(crcpoly, NRF51RadioState),
+        VMSTATE_UINT32(crcinit, NRF51RadioState),
+        VMSTATE_UINT32(tifs, NRF51RadioState),
+        VMSTATE_UINT32(state, NRF51RadioState),
+        VMSTATE_UINT32(datawhiteiv, NRF51RadioState),
+        VMSTATE_UINT32(bcc, NRF51RadioState),
+        VMSTATE_UINT32(power, NRF51RadioState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_radio_properties[] = {
+    DEFINE_PROP_STRING("medium", NRF51RadioState, medium_path),
+    DEFINE_PROP_UINT32("lookahead", NRF51RadioState, lookahead, 0),
+    DEFINE_PROP_STRING("multicast", NRF51RadioState, multicast),
+    DEFINE_PROP_LINK("ppi", NRF51RadioState, ppi, TYPE_NRF51_PPI,
+                     NRF51PPIState *),
+    DEFINE_PROP_LINK("memory", NRF51RadioState, memory, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+/* Map the medium file, creating and sizing it if this is the first user */
+static NRF51RadioMedium *nrf51_radio_map_medium(const char *path,
+                                                Error **errp)
+{
+    NRF51RadioMedium *medium;
+    struct stat st;
+    int fd;
+
+    fd = qemu_open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "%s: cannot open medium %s",
+                         __func__, path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size < sizeof(*medium) && ftruncate(fd, sizeof(*medium)) < 0)) {
+        error_setg_errno(errp, errno, "%s: cannot size medium %s",
+                         __func__, path);
+        qemu_close(fd);
+        return NULL;
+    }
+    medium = mmap(NULL, sizeof(*medium), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+    qemu_close(fd);
+    if (medium == MAP_FAILED) {
+        error_setg_errno(errp, errno, "%s: cannot map medium %s",
+                         __func__, path);
+        return NULL;
+    }
+
+    /* A fresh file is all zeroes, which is already an empty medium */
+    if (atomic_cmpxchg(&medium->magic, 0, NRF51_RADIO_MEDIUM_MAGIC) == 0) {
+        atomic_set(&medium->size, sizeof(*medium));
+    } else if (atomic_read(&medium->magic) != NRF51_RADIO_MEDIUM_MAGIC ||
+               atomic_read(&medium->size) != sizeof(*medium)) {
+        error_setg(errp, "%s: %s is not a compatible medium",
+                   __func__, path);
+        munmap(medium, sizeof(*medium));
+        return NULL;
+    }
+    return medium;
+}
+
+/*
+ * The lookahead barrier.  Every lookahead / 2 of virtual time, publish
+ * our clock and wait until every other process on the medium is at most
+ * half a lookahead behind, so that we stay within a lookahead of all of
+ * them until the next barrier.  Waiting here holds up the vCPU, and with
+ * -icount virtual time with it.  The radio with the lowest time never
+ * waits, so the group always makes progress.
+ */
+static void nrf51_radio_sync(void *opaque)
+{
+    NRF51RadioState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t period = s->lookahead / 2 ?: 1;
+    uint32_t pid = getpid();
+    int spins = 0;
+
+    atomic_set__nocheck(&s->peer->now, now);
+    smp_mb();
+
+    for (int i = 0; i < NRF51_RADIO_MAX_PEERS; i++) {
+        NRF51RadioPeer *peer = &s->medium->peer[i];
+        uint32_t peer_pid;
+
+        while (atomic_read(&peer->sender) &&
+               (peer_pid = atomic_read(&peer->pid)) != pid &&
+               atomic_read__nocheck(&peer->now) <
+                   now + period - (int64_t)s->lookahead) {
+            if (++spins < 1000) {
+                cpu_relax();
+                continue;
+            }
+            /* Do not wait forever for a process that died */
+            if (peer_pid && kill(peer_pid, 0) < 0 && errno == ESRCH) {
+                atomic_set(&peer->sender, 0);
+                break;
+            }
+            g_usleep(20);
+        }
+    }
+    timer_mod_ns(s->sync_timer, now + period);
+}
+
+static void nrf51_radio_exit(Notifier *notifier, void *data)
+{
+    NRF51RadioState *s = container_of(notifier, NRF51RadioState,
+                                      exit_notifier);
+
+    atomic_set(&s->peer->sender, 0);
+}
+
+static void nrf51_radio_join(NRF51RadioState *s, Error **errp)
+{
+    if (!use_icount) {
+        error_setg(errp, "%s: lookahead needs -icount", __func__);
+        return;
+    }
+    for (int i = 0; i < NRF51_RADIO_MAX_PEERS; i++) {
+        NRF51RadioPeer *peer = &s->medium->peer[i];
+
+        if (atomic_cmpxchg(&peer->sender, 0, s->sender) == 0) {
+            atomic_set__nocheck(&peer->now, 0);
+            atomic_set(&peer->pid, getpid());
+            s->peer = peer;
+            break;
+        }
+    }
+    if (!s->peer) {
+        error_setg(errp, "%s: medium %s already has %d radios in sync",
+                   __func__, s->medium_path, NRF51_RADIO_MAX_PEERS);
+        return;
+    }
+    s->exit_notifier.notify = nrf51_radio_exit;
+    qemu_add_exit_notifier(&s->exit_notifier);
+    s->sync_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nrf51_radio_sync, s);
+    timer_mod_ns(s->sync_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+}
+
+/* Queue the packets of a datagram from another radio on their channels */
+static void nrf51_radio_batch_receive(NRF51RadioState *s, const uint8_t *buf,
+                                      size_t len)
+{
+    NRF51RadioRemote *r = NULL, *empty = NULL;
+    NRF51RadioBatchHeader hdr;
+    size_t off = sizeof(hdr);
+    uint32_t sender, count;
+
+    if (len < sizeof(hdr)) {
+        return;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    sender = le32_to_cpu(hdr.sender);
+    if (le32_to_cpu(hdr.magic) != NRF51_RADIO_BATCH_MAGIC || !sender ||
+        sender == s->sender) {
+        return;
+    }
+
+    for (int i = 0; i < NRF51_RADIO_MAX_PEERS && !r; i++) {
+        if (s->remote[i].sender == sender) {
+            r = &s->remote[i];
+        } else if (!s->remote[i].sender && !empty) {
+            empty = &s->remote[i];
+        }
+    }
+    if (!r && empty) {
+        r = empty;
+        r->sender = sender;
+        r->now = INT64_MIN;
+    }
+    /* Beyond NRF51_RADIO_MAX_PEERS, radios are heard but not waited for */
+    if (r) {
+        r->now = MAX(r->now, (int64_t)le64_to_cpu(hdr.now));
+        r->heard = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    }
+
+    for (count = le32_to_cpu(hdr.count); count; count--) {
+        NRF51RadioBatchPacket bp;
+        uint32_t plen, channel;
+
+        if (off + sizeof(bp) > len) {
+            break;
+        }
+        memcpy(&bp, buf + off, sizeof(bp));
+        off += sizeof(bp);
+        plen = le16_to_cpu(bp.len);
+        channel = le16_to_cpu(bp.channel);
+        if (plen > NRF51_RADIO_MAX_PACKET || off + plen > len ||
+            channel >= NRF51_RADIO_NUM_CHANNELS) {
+            break;
+        }
+        nrf51_radio_ring_put(&s->medium->ring[channel],
+                             le64_to_cpu(bp.timestamp), sender,
+                             le32_to_cpu(bp.crc), le64_to_cpu(bp.address),
+                             buf + off, plen);
+        off += plen;
+    }
+}
+
+static void nrf51_radio_mcast_recv(NRF51RadioState *s)
+{
+    uint8_t buf[NRF51_RADIO_BATCH_MAX];
+    ssize_t len;
+
+    for (;;) {
+        len = recv(s->mcast_fd, buf, sizeof(buf), 0);
+        if (len >= 0) {
+            nrf51_radio_batch_receive(s, buf, len);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+}
+
+static void nrf51_radio_mcast_read(void *opaque)
+{
+    nrf51_lock();
+    nrf51_radio_mcast_recv(opaque);
+    nrf51_unlock();
+}
+
+/* Is a radio heard from recently still short of virtual time @until? */
+static bool nrf51_radio_remote_behind(NRF51RadioState *s, int64_t until)
+{
+    int64_t host_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    for (int i = 0; i < NRF51_RADIO_MAX_PEERS; i++) {
+        NRF51RadioRemote *r = &s->remote[i];
+
+        if (!r->sender) {
+            continue;
+        }
+        if (host_ms - r->heard > NRF51_RADIO_REMOTE_MS) {
+            r->sender = 0;
+            continue;
+        }
+        if (r->now < until) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * The multicast period.  Send the batch, and with a lookahead use it as
+ * the barrier of nrf51_radio_sync(): the datagram announces our time,
+ * and we read the others' until none is more than half a lookahead
+ * behind.  Without one, an empty batch is not worth a datagram.
+ */
+static void nrf51_radio_mcast_sync(void *opaque)
+{
+    NRF51RadioState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t period = s->lookahead ? s->lookahead / 2 ?: 1
+                                  : NRF51_RADIO_BATCH_NS;
+
+    if (s->batch_count || s->lookahead) {
+        nrf51_radio_batch_flush(s, now);
+    }
+    while (s->lookahead &&
+           nrf51_radio_remote_behind(s, now + period -
+                                        (int64_t)s->lookahead)) {
+        GPollFD pfd = { .fd = s->mcast_fd, .events = G_IO_IN };
+
+        qemu_poll_ns(&pfd, 1, 10 * SCALE_MS);
+        nrf51_radio_mcast_recv(s);
+    }
+    timer_mod_ns(s->sync_timer, now + period);
+}
+
+/* Join the multicast group, with a non-blocking socket */
+static int nrf51_radio_mcast_open(NRF51RadioState *s, Error **errp)
+{
+    struct ip_mreq mreq;
+    uint8_t loop = 1;
+    int val = 1;
+    int fd;
+
+    if (parse_host_port(&s->mcast_addr, s->multicast, errp) < 0) {
+        return -1;
+    }
+    if (!IN_MULTICAST(ntohl(s->mcast_addr.sin_addr.s_addr))) {
+        error_setg(errp, "%s: %s is not a multicast group", __func__,
+                   s->multicast);
+        return -1;
+    }
+    fd = qemu_socket(PF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "%s: cannot create socket", __func__);
+        return -1;
+    }
+    mreq.imr_multiaddr = s->mcast_addr.sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    /* Boards on the same host share the group's port */
+    if (qemu_setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val,
+                        sizeof(val)) < 0 ||
+        bind(fd, (struct sockaddr *)&s->mcast_addr,
+             sizeof(s->mcast_addr)) < 0 ||
+        qemu_setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                        sizeof(mreq)) < 0 ||
+        qemu_setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                        sizeof(loop)) < 0) {
+        error_setg_errno(errp, errno, "%s: cannot join %s", __func__,
+                         s->multicast);
+        closesocket(fd);
+        return -1;
+    }
+    qemu_set_nonblock(fd);
+    return fd;
+}
+
+static void nrf51_radio_mcast_init(NRF51RadioState *s, Error **errp)
+{
+    if (s->lookahead && !use_icount) {
+        error_setg(errp, "%s: lookahead needs -icount", __func__);
+        return;
+    }
+    s->mcast_fd = nrf51_radio_mcast_open(s, errp);
+    if (s->mcast_fd < 0) {
+        return;
+    }
+    /* A medium of our own, fed from the group */
+    s->medium = g_new0(NRF51RadioMedium, 1);
+    /* Radios on other hosts may have the same PID */
+    s->sender = g_random_int() | 1;
+    s->batch_len = sizeof(NRF51RadioBatchHeader);
+    qemu_set_fd_handler(s->mcast_fd, nrf51_radio_mcast_read, NULL, s);
+    s->sync_timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                           nrf51_radio_mcast_sync, s);
+    timer_mod_ns(s->sync_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+}
+
+static uint32_t nrf51_radio_instances;
+
+static void nrf51_radio_realize(DeviceState *dev, Error **errp)
+{
+    NRF51RadioState *s = NRF51_RADIO(dev);
+
+    if (s->medium_path && s->multicast) {
+        error_setg(errp, "%s: medium and multicast are mutually exclusive",
+                   __func__);
+        return;
+    }
+    if (s->medium_path) {
+        s->medium = nrf51_radio_map_medium(s->medium_path, errp);
+        if (!s->medium) {
+            return;
+        }
+    }
+    address_space_init(&s->as, s->memory ? s->memory : get_system_memory(),
+                       TYPE_NRF51_RADIO);
+    /* Radios of one process only hear each other if their IDs differ */
+    s->sender = getpid() ^ (nrf51_radio_instances++ << 24);
+    s->timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nrf51_radio_expire, s);
+    if (s->lookahead && s->medium_path) {
+        nrf51_radio_join(s, errp);
+    }
+    if (s->multicast) {
+        nrf51_radio_mcast_init(s, errp);
+    }
+}
+
+static void nrf51_radio_reset(DeviceState *dev)
+{
+    NRF51RadioState *s = NRF51_RADIO(dev);
+    NRF51RadioRing *ring = nrf51_radio_ring(s);
+
+    timer_del(s->timer);
+    /* Packets sent before the reset are not replayed to it */
+    s->cursor = ring ? atomic_read(&ring->head) : 0;
+    s->events_ready = 0;
+    s->events_address = 0;
+    s->events_payload = 0;
+    s->events_end = 0;
+    s->events_disabled = 0;
+    s->events_devmatch = 0;
+    s->events_devmiss = 0;
+    s->events_rssiend = 0;
+    s->events_bcmatch = 0;
+    s->shorts = 0;
+    s->inten = 0;
+    s->crcstatus = 0;
+    s->rxmatch = 0;
+    s->rxcrc = 0;
+    s->packetptr = 0;
+    s->frequency = 2;
+    s->txpower = 0;
+    s->mode = 0;
+    s->pcnf0 = 0;
+    s->pcnf1 = 0;
+    s->base0 = 0;
+    s->base1 = 0;
+    s->prefix0 = 0;
+    s->prefix1 = 0;
+    s->txaddress = 0;
+    s->rxaddresses = 0;
+    s->crccnf = 0;
+    s->crcpoly = 0;
+    s->crcinit = 0;
+    s->tifs = 0;
+    s->state = NRF51_RADIO_STATE_DISABLED;
+    s->datawhiteiv = 0x40;
+    s->bcc = 0;
+    s->power = 1;
+    qemu_irq_lower(s->on_out);
+}
+
+static void nrf51_radio_init(Object *obj)
+{
+    NRF51RadioState *s = NRF51_RADIO(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    s->mcast_fd = -1;
+    sysbus_init_irq(sdb, &s->irq);
+    qdev_init_gpio_out_named(DEVICE(obj), &s->on_out, "on", 1);
+    nrf51_init_io(&s->iomem, obj, &nrf51_radio_ops, s,
+                  TYPE_NRF51_RADIO, 0x1000);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void nrf51_radio_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = nrf51_radio_realize;
+    dc->reset = nrf51_radio_reset;
+    dc->props = nrf51_radio_properties;
+    dc->vmsd = &vmstate_nrf51_radio;
+}
+
+static const TypeInfo nrf51_radio_info = {
+    .name          = TYPE_NRF51_RADIO,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51RadioState),
+    .instance_init = nrf51_radio_init,
+    .class_init    = nrf51_radio_class_init,
+};
+
+/**
+ * NRF51 ADC
+ *   Analog to Digital Converter, with respect to nRF51822 Reference Manual
+ *   NOTE: samples come from a read-only memory-mapped file (property
+ *         "samples") holding frames of 8 little-endian 16-bit values, one
+ *         per AIN pin, each frame covering "period" ns of virtual time
+ *         and the last frame holding forever. Values are 10-bit results
+ *         and are truncated to the configured resolution; input prescaling
+ *         and reference selection are not modelled. Without a file every
+ *         conversion reads 0.
+ */
+
+#define TYPE_NRF51_ADC "nrf51_adc"
+#define NRF51_ADC(obj) \
+    OBJECT_CHECK(NRF51ADCState, (obj), TYPE_NRF51_ADC)
+
+#define NRF51_ADC_NUM_AIN     8
+#define NRF51_ADC_FRAME_SIZE  (NRF51_ADC_NUM_AIN * sizeof(uint16_t))
+
+enum {
+    NRF51_ADC_START    = 0x000,
+    NRF51_ADC_STOP     = 0x004,
+    NRF51_ADC_END      = 0x100,
+    NRF51_ADC_INTEN    = 0x300,
+    NRF51_ADC_INTENSET = 0x304,
+    NRF51_ADC_INTENCLR = 0x308,
+    NRF51_ADC_BUSY     = 0x400,
+    NRF51_ADC_ENABLE   = 0x500,
+    NRF51_ADC_CONFIG   = 0x504,
+    NRF51_ADC_RESULT   = 0x508,
+    NRF51_ADC_POWER    = 0xFFC,
+};
+
+enum {
+    NRF51_ADC_CONFIG_RES_MASK = 0x3,
+    NRF51_ADC_CONFIG_PSEL_SHIFT = 8,
+    NRF51_ADC_CONFIG_MASK = 0x0003FF7F,
+};
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    qemu_irq irq;
+    QEMUTimer *timer;
+    NRF51PPIState *ppi;
+    char *samples_path;
+    uint64_t period;
+
+    /* Read-only mapping of the sample file */
+    const uint8_t *samples;
+    size_t num_frames;
+
+    /* Internal state */
+    /* Result latched when the running conversion completes */
+    uint32_t pending;
+
+    /* Public Regs */
+    uint32_t events_end;
+    uint32_t inten;
+    uint32_t busy;
+    uint32_t enable;
+    uint32_t config;
+    uint32_t result;
+    uint32_t power;
+} NRF51ADCState;
+
+/* Conversion time in ns for a CONFIG.RES value, from the datasheet */
+static int64_t nrf51_adc_conversion_ns(uint32_t res)
+{
+    static const int64_t us[] = { 20, 36, 68, 68 };
+
+    return us[res & NRF51_ADC_CONFIG_RES_MASK] * SCALE_US;
+}
+
+/* Frame of the sample file in effect at virtual time `now` */
+static uint64_t nrf51_adc_frame(NRF51ADCState *s, int64_t now)
+{
+    return s->samples ? MIN(now / s->period, s->num_frames - 1) : 0;
+}
+
+/* 10-bit value of AIN pin `ain` in frame `frame`, 0 without a file */
+static uint32_t nrf51_adc_ain(NRF51ADCState *s, uint64_t frame, int ain)
+{
+    if (!s->samples) {
+        return 0;
+    }
+    return MIN(lduw_le_p(s->samples + frame * NRF51_ADC_FRAME_SIZE +
+                         ain * sizeof(uint16_t)), 0x3FF);
+}
+
+/* Sample of the pin selected by CONFIG.PSEL at virtual time `now` */
+static uint32_t nrf51_adc_sample(NRF51ADCState *s, int64_t now)
+{
+    uint32_t psel = extract32(s->config, NRF51_ADC_CONFIG_PSEL_SHIFT, 8);
+    uint32_t res = s->config & NRF51_ADC_CONFIG_RES_MASK;
+    uint32_t value;
+
+    if (ctpop32(psel) != 1) {
+        return 0;
+    }
+
+    value = nrf51_adc_ain(s, nrf51_adc_frame(s, now), ctz32(psel));
+    return value >> (2 - MIN(res, 2));
+}
+
+static void nrf51_adc_update_irq(NRF51ADCState *s)
+{
+    qemu_set_irq(s->irq, s->events_end && (s->inten & 1));
+}
+
+static void nrf51_adc_expire(void *opaque)
+{
+    NRF51ADCState *s = (NRF51ADCState *)opaque;
+
+    s->busy = 0;
+    s->result = s->pending;
+    s->events_end = 1;
+    nrf51_ppi_event(s->ppi, nrf51_periph_addr(SYS_BUS_DEVICE(s),
+                                              NRF51_ADC_END));
+    nrf51_adc_update_irq(s);
+}
+
+static void nrf51_adc_start(NRF51ADCState *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint8_t sample[4];
+
+    if (!(s->enable & 1) || s->busy) {
+        return;
+    }
+    s->busy = 1;
+    /* The sample file may differ between recording and replay */
+    stl_le_p(sample, nrf51_adc_sample(s, now));
+    replay_device_data(sample, sizeof(sample));
+    s->pending = ldl_le_p(sample);
+    timer_mod_ns(s->timer, now + nrf51_adc_conversion_ns(s->config));
+}
+
+static uint64_t nrf51_adc_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    NRF51ADCState *s = (NRF51ADCState *)opaque;
+
+    switch (offset) {
+        case NRF51_ADC_START:
+        case NRF51_ADC_STOP:
+            /* Tasks are write-only */
+            return 0;
+        case NRF51_ADC_END:
+            return s->events_end;
+        case NRF51_ADC_INTEN:
+        case NRF51_ADC_INTENSET:
+        case NRF51_ADC_INTENCLR:
+            return s->inten;
+        case NRF51_ADC_BUSY:
+            return s->busy;
+        case NRF51_ADC_ENABLE:
+            return s->enable;
+        case NRF51_ADC_CONFIG:
+            return s->config;
+        case NRF51_ADC_RESULT:
+            return s->result;
+        case NRF51_ADC_POWER:
+            return s->power;
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: reading a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            return 0;
+    }
+}
+
+static void nrf51_adc_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    NRF51ADCState *s = (NRF51ADCState *)opaque;
+
+    switch (offset) {
+        case NRF51_ADC_START:
+            if (value & 1) {
+                nrf51_adc_start(s);
+            }
+            break;
+        case NRF51_ADC_STOP:
+            if (value & 1) {
+                timer_del(s->timer);
+                s->busy = 0;
+            }
+            break;
+        case NRF51_ADC_END:
+            s->events_end = value & 1;
+            break;
+        case NRF51_ADC_INTEN:
+            s->inten = value & 1;
+            break;
+        case NRF51_ADC_INTENSET:
+            s->inten |= value & 1;
+            break;
+        case NRF51_ADC_INTENCLR:
+            s->inten &= ~(value & 1);
+            break;
+        case NRF51_ADC_ENABLE:
+            s->enable = value & 3;
+            break;
+        case NRF51_ADC_CONFIG:
+            if (s->busy) {
+                qemu_log_mask(LOG_GUEST_ERROR,
+                              "%s: CONFIG written while busy\n",
+                              __func__);
+            }
+            s->config = value & NRF51_ADC_CONFIG_MASK;
+            break;
+        case NRF51_ADC_POWER:
+            s->power = value & 1;
+            break;
+        case NRF51_ADC_BUSY:
+        case NRF51_ADC_RESULT:
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: writing a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            break;
+    }
+
+    nrf51_adc_update_irq(s);
+}
+
+static const MemoryRegionOps nrf51_adc_ops = {
+    .read = nrf51_adc_read,
+    .write = nrf51_adc_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static const VMStateDescription vmstate_nrf51_adc = {
+    .name = TYPE_NRF51_ADC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER_PTR(timer, NRF51ADCState),
+        VMSTATE_UINT32(pending, NRF51ADCState),
+        VMSTATE_UINT32(events_end, NRF51ADCState),
+        VMSTATE_UINT32(inten, NRF51ADCState),
+        VMSTATE_UINT32(busy, NRF51ADCState),
+        VMSTATE_UINT32(enable, NRF51ADCState),
+        VMSTATE_UINT32(config, NRF51ADCState),
+        VMSTATE_UINT32(result, NRF51ADCState),
+        VMSTATE_UINT32(power, NRF51ADCState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_adc_properties[] = {
+    DEFINE_PROP_STRING("samples", NRF51ADCState, samples_path),
+    DEFINE_PROP_UINT64("period", NRF51ADCState, period, SCALE_MS),
+    DEFINE_PROP_LINK("ppi", NRF51ADCState, ppi, TYPE_NRF51_PPI,
+                     NRF51PPIState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+/* Map the sample file read-only, so that many instances share its pages */
+static bool nrf51_adc_map_samples(NRF51ADCState *s, Error **errp)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = qemu_open(s->samples_path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "%s: cannot open samples %s",
+                         __func__, s->samples_path);
+        return false;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "%s: cannot size samples %s",
+                         __func__, s->samples_path);
+        qemu_close(fd);
+        return false;
+    }
+    if (st.st_size < NRF51_ADC_FRAME_SIZE ||
+        st.st_size % NRF51_ADC_FRAME_SIZE) {
+        error_setg(errp, "%s: %s must hold whole frames of %zu bytes",
+                   __func__, s->samples_path, NRF51_ADC_FRAME_SIZE);
+        qemu_close(fd);
+        return false;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    qemu_close(fd);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "%s: cannot map samples %s",
+                         __func__, s->samples_path);
+        return false;
+    }
+    s->samples = map;
+    s->num_frames = st.st_size / NRF51_ADC_FRAME_SIZE;
+    return true;
+}
+
+static void nrf51_adc_realize(DeviceState *dev, Error **errp)
+{
+    NRF51ADCState *s = NRF51_ADC(dev);
+
+    if (s->period == 0) {
+        error_setg(errp, "%s: period must not be zero", __func__);
+        return;
+    }
+    if (s->samples_path && !nrf51_adc_map_samples(s, errp)) {
+        return;
+    }
+    s->timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nrf51_adc_expire, s);
+}
+
+static void nrf51_adc_reset(DeviceState *dev)
+{
+    NRF51ADCState *s = NRF51_ADC(dev);
+
+    timer_del(s->timer);
+    s->pending = 0;
+    s->events_end = 0;
+    s->inten = 0;
+    s->busy = 0;
+    s->enable = 0;
+    s->config = 0x00000018;
+    s->result = 0;
+    s->power = 1;
+}
+
+static void nrf51_adc_init(Object *obj)
+{
+    NRF51ADCState *s = NRF51_ADC(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    sysbus_init_irq(sdb, &s->irq);
+    nrf51_init_io(&s->iomem, obj, &nrf51_adc_ops, s,
+                  TYPE_NRF51_ADC, 0x1000);
+    memory_region_set_pollable(&s->iomem, true);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void nrf51_adc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = nrf51_adc_realize;
+    dc->reset = nrf51_adc_reset;
+    dc->props = nrf51_adc_properties;
+    dc->vmsd = &vmstate_nrf51_adc;
+}
+
+static const TypeInfo nrf51_adc_info = {
+    .name          = TYPE_NRF51_ADC,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51ADCState),
+    .instance_init = nrf51_adc_init,
+    .class_init    = nrf51_adc_class_init,
+};
+
+/**
+ * NRF51 LPCOMP
+ *   Low power comparator, with respect to nRF51822 Reference Manual
+ *   NOTE: the input is the ADC's sample file (see NRF51 ADC), read through
+ *         the "adc" link, so both see the same voltages. As frames hold
+ *         their value for a whole period, the next UP, DOWN or CROSS is
+ *         found by looking ahead for the first frame on the other side
+ *         of the reference, and one timer is armed for it. The external
+ *         reference (REFSEL ARef) is not modelled and taken as half the
+ *         supply. ANADETECT crossings are signalled on the "anadetect"
+ *         line, which wakes the CPM from System OFF.
+ */
+
+#define TYPE_NRF51_LPCOMP "nrf51_lpcomp"
+#define NRF51_LPCOMP(obj) \
+    OBJECT_CHECK(NRF51LPCOMPState, (obj), TYPE_NRF51_LPCOMP)
+
+enum {
+    NRF51_LPCOMP_RESULT    = 0x400,
+    NRF51_LPCOMP_ENABLE    = 0x500,
+    NRF51_LPCOMP_PSEL      = 0x504,
+    NRF51_LPCOMP_REFSEL    = 0x508,
+    NRF51_LPCOMP_EXTREFSEL = 0x50C,
+    NRF51_LPCOMP_ANADETECT = 0x520,
+    NRF51_LPCOMP_POWER     = 0xFFC,
+};
+
+enum {
+    NRF51_LPCOMP_TASK_START  = 0,
+    NRF51_LPCOMP_TASK_STOP   = 1,
+    NRF51_LPCOMP_TASK_SAMPLE = 2,
+    NRF51_LPCOMP_EVENT_READY = 0,
+    NRF51_LPCOMP_EVENT_DOWN  = 1,
+    NRF51_LPCOMP_EVENT_UP    = 2,
+    NRF51_LPCOMP_EVENT_CROSS = 3,
+    NRF51_LPCOMP_SHORT_READY_SAMPLE = 0,
+    NRF51_LPCOMP_SHORT_READY_STOP   = 1,
+    NRF51_LPCOMP_SHORT_DOWN_STOP    = 2,
+    NRF51_LPCOMP_SHORT_UP_STOP      = 3,
+    NRF51_LPCOMP_SHORT_CROSS_STOP   = 4,
+    NRF51_LPCOMP_REFSEL_AREF = 7,
+    NRF51_LPCOMP_ANADETECT_CROSS = 0,
+    NRF51_LPCOMP_ANADETECT_UP    = 1,
+    NRF51_LPCOMP_ANADETECT_DOWN  = 2,
+};
+
+typedef struct {
+    /* Private */
+    NRF51PeriphState parent;
+
+    /* Public */
+    QEMUTimer *timer;
+    NRF51ADCState *adc;
+    qemu_irq anadetect_out;
+
+    /* Internal state */
+    bool running;
+    /* The input is above the reference */
+    bool above;
+
+    /* Public Regs */
+    uint32_t result;
+    uint32_t enable;
+    uint32_t psel;
+    uint32_t refsel;
+    uint32_t extrefsel;
+    uint32_t anadetect;
+    uint32_t power;
+} NRF51LPCOMPState;
+
+/* Whether the input is above the reference in frame `frame` */
+static bool nrf51_lpcomp_above(NRF51LPCOMPState *s, uint64_t frame)
+{
+    /* Eighths of the supply, in 10-bit ADC counts */
+    uint32_t ref = s->refsel == NRF51_LPCOMP_REFSEL_AREF ? 4 * 0x80 :
+                   (s->refsel + 1) * 0x80;
+
+    return nrf51_adc_ain(s->adc, frame, s->psel) > ref;
+}
+
+/* Arm the timer for the first frame on the other side of the reference */
+static void nrf51_lpcomp_rearm(NRF51LPCOMPState *s, int64_t now)
+{
+    NRF51ADCState *adc = s->adc;
+    uint64_t frame;
+
+    timer_del(s->timer);
+    if (!s->running || !adc->samples) {
+        return;
+    }
+    for (frame = nrf51_adc_frame(adc, now) + 1; frame < adc->num_frames;
+         frame++) {
+        if (nrf51_lpcomp_above(s, frame) != s->above) {
+            timer_mod_ns(s->timer, frame * adc->period);
+            return;
+        }
+    }
+}
+
+/* Compare the input at `now`, raising the events of a crossing */
+static void nrf51_lpcomp_compare(NRF51LPCOMPState *s, int64_t now)
+{
+    bool above = nrf51_lpcomp_above(s, nrf51_adc_frame(s->adc, now));
+    bool detect;
+
+    if (s->running && above != s->above) {
+        s->above = above;
+        switch (s->anadetect) {
+        case NRF51_LPCOMP_ANADETECT_UP:
+            detect = above;
+            break;
+        case NRF51_LPCOMP_ANADETECT_DOWN:
+            detect = !above;
+            break;
+        default:
+            detect = true;
+            break;
+        }
+        if (detect) {
+            qemu_irq_pulse(s->anadetect_out);
+        }
+        nrf51_periph_event(&s->parent, above ? NRF51_LPCOMP_EVENT_UP :
+                                               NRF51_LPCOMP_EVENT_DOWN);
+        nrf51_periph_event(&s->parent, NRF51_LPCOMP_EVENT_CROSS);
+    }
+    nrf51_lpcomp_rearm(s, now);
+}
+
+static void nrf51_lpcomp_expire(void *opaque)
+{
+    NRF51LPCOMPState *s = NRF51_LPCOMP(opaque);
+
+    nrf51_lpcomp_compare(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+}
+
+static void nrf51_lpcomp_start(NRF51PeriphState *p)
+{
+    NRF51LPCOMPState *s = NRF51_LPCOMP(p);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (!(s->enable & 1) || s->running) {
+        return;
+    }
+    s->running = true;
+    s->above = nrf51_lpcomp_above(s, nrf51_adc_frame(s->adc, now));
+    nrf51_lpcomp_rearm(s, now);
+    nrf51_periph_event(p, NRF51_LPCOMP_EVENT_READY);
+}
+
+static void nrf51_lpcomp_stop(NRF51PeriphState *p)
+{
+    NRF51LPCOMPState *s = NRF51_LPCOMP(p);
+
+    s->running = false;
+    timer_del(s->timer);
+}
+
+static void nrf51_lpcomp_sample(NRF51PeriphState *p)
+{
+    NRF51LPCOMPState *s = NRF51_LPCOMP(p);
+
+    if (s->running) {
+        s->result = s->above;
+    }
+}
+
+static NRF51PeriphTaskFn * const nrf51_lpcomp_tasks[] = {
+    [NRF51_LPCOMP_TASK_START]  = nrf51_lpcomp_start,
+    [NRF51_LPCOMP_TASK_STOP]   = nrf51_lpcomp_stop,
+    [NRF51_LPCOMP_TASK_SAMPLE] = nrf51_lpcomp_sample,
+};
+
+static const NRF51PeriphShort nrf51_lpcomp_shorts[] = {
+    { NRF51_LPCOMP_SHORT_READY_SAMPLE, NRF51_LPCOMP_EVENT_READY,
+      NRF51_LPCOMP_TASK_SAMPLE },
+    { NRF51_LPCOMP_SHORT_READY_STOP, NRF51_LPCOMP_EVENT_READY,
+      NRF51_LPCOMP_TASK_STOP },
+    { NRF51_LPCOMP_SHORT_DOWN_STOP, NRF51_LPCOMP_EVENT_DOWN,
+      NRF51_LPCOMP_TASK_STOP },
+    { NRF51_LPCOMP_SHORT_UP_STOP, NRF51_LPCOMP_EVENT_UP,
+      NRF51_LPCOMP_TASK_STOP },
+    { NRF51_LPCOMP_SHORT_CROSS_STOP, NRF51_LPCOMP_EVENT_CROSS,
+      NRF51_LPCOMP_TASK_STOP },
+};
+
+static void nrf51_lpcomp_enable_write(void *opaque, hwaddr offset,
+                                      uint64_t value)
+{
+    NRF51LPCOMPState *s = NRF51_LPCOMP(opaque);
+
+    s->enable = value & 3;
+    if (!(s->enable & 1)) {
+        nrf51_lpcomp_stop(&s->parent);
+    }
+}
+
+/* PSEL and REFSEL */
+static void nrf51_lpcomp_input_write(void *opaque, hwaddr offset,
+                                     uint64_t value)
+{
+    NRF51LPCOMPState *s = NRF51_LPCOMP(opaque);
+
+    if (offset == NRF51_LPCOMP_PSEL) {
+        s->psel = value & 7;
+    } else {
+        s->refsel = value & 7;
+    }
+    if (s->refsel == NRF51_LPCOMP_REFSEL_AREF) {
+        qemu_log_mask(LOG_UNIMP, "%s: external reference taken as "
+                      "half the supply\n", __func__);
+    }
+    /* A new input or reference may already be across */
+    nrf51_lpcomp_compare(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+}
+
+static const NRF51Reg nrf51_lpcomp_regs[] = {
+    NRF51_PERIPH_REG(NRF51_LPCOMP_RESULT) = {
+        NRF51_FIELD(NRF51LPCOMPState, result, 0),
+    },
+    NRF51_PERIPH_REG(NRF51_LPCOMP_ENABLE) = {
+        NRF51_FIELD(NRF51LPCOMPState, enable, 0),
+        .write = nrf51_lpcomp_enable_write,
+    },
+    NRF51_PERIPH_REG(NRF51_LPCOMP_PSEL) = {
+        NRF51_FIELD(NRF51LPCOMPState, psel, 0),
+        .write = nrf51_lpcomp_input_write,
+    },
+    NRF51_PERIPH_REG(NRF51_LPCOMP_REFSEL) = {
+        NRF51_FIELD(NRF51LPCOMPState, refsel, 0),
+        .write = nrf51_lpcomp_input_write,
+    },
+    NRF51_PERIPH_REG(NRF51_LPCOMP_EXTREFSEL) = {
+        NRF51_FIELD(NRF51LPCOMPState, extrefsel, 1),
+    },
+    NRF51_PERIPH_REG(NRF51_LPCOMP_ANADETECT) = {
+        NRF51_FIELD(NRF51LPCOMPState, anadetect, 3),
+    },
+    NRF51_PERIPH_REG(NRF51_LPCOMP_POWER) = {
+        NRF51_FIELD(NRF51LPCOMPState, power, 1),
+    },
+};
+
+static const VMStateDescription vmstate_nrf51_lpcomp = {
+    .name = TYPE_NRF51_LPCOMP,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(parent, NRF51LPCOMPState, 1, vmstate_nrf51_periph,
+                       NRF51PeriphState),
+        VMSTATE_TIMER_PTR(timer, NRF51LPCOMPState),
+        VMSTATE_BOOL(running, NRF51LPCOMPState),
+        VMSTATE_BOOL(above, NRF51LPCOMPState),
+        VMSTATE_UINT32(result, NRF51LPCOMPState),
+        VMSTATE_UINT32(enable, NRF51LPCOMPState),
+        VMSTATE_UINT32(psel, NRF51LPCOMPState),
+        VMSTATE_UINT32(refsel, NRF51LPCOMPState),
+        VMSTATE_UINT32(extrefsel, NRF51LPCOMPState),
+        VMSTATE_UINT32(anadetect, NRF51LPCOMPState),
+        VMSTATE_UINT32(power, NRF51LPCOMPState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_lpcomp_properties[] = {
+    DEFINE_PROP_LINK("adc", NRF51LPCOMPState, adc, TYPE_NRF51_ADC,
+                     NRF51ADCState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_lpcomp_realize(DeviceState *dev, Error **errp)
+{
+    NRF51LPCOMPState *s = NRF51_LPCOMP(dev);
+
+    if (!s->adc) {
+        error_setg(errp, "%s: adc link is required", __func__);
+        return;
+    }
+    qdev_init_gpio_out_named(dev, &s->anadetect_out, "anadetect", 1);
+    s->timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nrf51_lpcomp_expire, s);
+}
+
+static void nrf51_lpcomp_reset(DeviceState *dev)
+{
+    NRF51LPCOMPState *s = NRF51_LPCOMP(dev);
+
+    nrf51_periph_reset(dev);
+    timer_del(s->timer);
+    s->running = false;
+    s->above = false;
+    s->result = 0;
+    s->enable = 0;
+    s->psel = 0;
+    s->refsel = 0;
+    s->extrefsel = 0;
+    s->anadetect = 0;
+    s->power = 1;
+}
+
+static void nrf51_lpcomp_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    NRF51PeriphClass *pc = NRF51_PERIPH_CLASS(klass);
+
+    dc->realize = nrf51_lpcomp_realize;
+    dc->reset = nrf51_lpcomp_reset;
+    dc->props = nrf51_lpcomp_properties;
+    dc->vmsd = &vmstate_nrf51_lpcomp;
+    pc->tasks = nrf51_lpcomp_tasks;
+    pc->num_tasks = ARRAY_SIZE(nrf51_lpcomp_tasks);
+    pc->events = 1 << NRF51_LPCOMP_EVENT_READY |
+                 1 << NRF51_LPCOMP_EVENT_DOWN |
+                 1 << NRF51_LPCOMP_EVENT_UP |
+                 1 << NRF51_LPCOMP_EVENT_CROSS;
+    pc->shorts = nrf51_lpcomp_shorts;
+    pc->num_shorts = ARRAY_SIZE(nrf51_lpcomp_shorts);
+    pc->regs = nrf51_lpcomp_regs;
+    pc->num_regs = ARRAY_SIZE(nrf51_lpcomp_regs);
+}
+
+static const TypeInfo nrf51_lpcomp_info = {
+    .name          = TYPE_NRF51_LPCOMP,
+    .parent        = TYPE_NRF51_PERIPH,
+    .instance_size = sizeof(NRF51LPCOMPState),
+    .class_init    = nrf51_lpcomp_class_init,
+};
+
+/**
+ * NRF51 TWI
+ *   I2C compatible Two-Wire Interface master, with respect to nRF51822
+ *   Reference Manual
+ *   NOTE: transfers run on a QEMU I2CBus and complete immediately, so
+ *         every event of a byte is raised within the register access that
+ *         started it. Without the BB_SUSPEND short, the next byte is
+ *         clocked in once RXD has been read and RXDREADY cleared, in
+ *         either order.
+ */
+
+#define TYPE_NRF51_TWI "nrf51_twi"
+#define NRF51_TWI(obj) \
+    OBJECT_CHECK(NRF51TWIState, (obj), TYPE_NRF51_TWI)
+
+enum {
+    NRF51_TWI_STARTRX   = 0x000,
+    NRF51_TWI_STARTTX   = 0x008,
+    NRF51_TWI_STOP      = 0x014,
+    NRF51_TWI_SUSPEND   = 0x01C,
+    NRF51_TWI_RESUME    = 0x020,
+    NRF51_TWI_STOPPED   = 0x104,
+    NRF51_TWI_RXDREADY  = 0x108,
+    NRF51_TWI_TXDSENT   = 0x11C,
+    NRF51_TWI_ERROR     = 0x124,
+    NRF51_TWI_BB        = 0x138,
+    NRF51_TWI_SUSPENDED = 0x148,
+    NRF51_TWI_SHORTS    = 0x200,
+    NRF51_TWI_INTEN     = 0x300,
+    NRF51_TWI_INTENSET  = 0x304,
+    NRF51_TWI_INTENCLR  = 0x308,
+    NRF51_TWI_ERRORSRC  = 0x4C4,
+    NRF51_TWI_ENABLE    = 0x500,
+    NRF51_TWI_PSELSCL   = 0x508,
+    NRF51_TWI_PSELSDA   = 0x50C,
+    NRF51_TWI_RXD       = 0x518,
+    NRF51_TWI_TXD       = 0x51C,
+    NRF51_TWI_FREQUENCY = 0x524,
+    NRF51_TWI_ADDRESS   = 0x588,
+    NRF51_TWI_POWER     = 0xFFC,
+};
+
+enum {
+    NRF51_TWI_INT_STOPPED   = 1 << 1,
+    NRF51_TWI_INT_RXDREADY  = 1 << 2,
+    NRF51_TWI_INT_TXDSENT   = 1 << 7,
+    NRF51_TWI_INT_ERROR     = 1 << 9,
+    NRF51_TWI_INT_BB        = 1 << 14,
+    NRF51_TWI_INT_SUSPENDED = 1 << 18,
+    NRF51_TWI_INT_MASK      = 0x00044286,
+
+    NRF51_TWI_SHORTS_BB_SUSPEND = 1 << 0,
+    NRF51_TWI_SHORTS_BB_STOP    = 1 << 1,
+
+    NRF51_TWI_ERRORSRC_OVERRUN = 1 << 0,
+    NRF51_TWI_ERRORSRC_ANACK   = 1 << 1,
+    NRF51_TWI_ERRORSRC_DNACK   = 1 << 2,
+};
+
+enum {
+    NRF51_TWI_IDLE,
+    NRF51_TWI_TX,
+    NRF51_TWI_RX,
+};
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    qemu_irq irq;
+    I2CBus *bus;
+    NRF51PPIState *ppi;
+    SysBusDevice *peer;
+
+    /* Internal state */
+    uint32_t phase;
+    bool suspended;
+    /* TXD was written and has not been sent yet */
+    bool txd_loaded;
+    /* RXD holds a byte the guest has not read yet */
+    bool rxd_loaded;
+
+    /* Public Regs */
+    uint32_t events_stopped;
+    uint32_t events_rxdready;
+    uint32_t events_txdsent;
+    uint32_t events_error;
+    uint32_t events_bb;
+    uint32_t events_suspended;
+    uint32_t shorts;
+    uint32_t inten;
+    uint32_t errorsrc;
+    uint32_t enable;
+    uint32_t pselscl;
+    uint32_t pselsda;
+    uint32_t rxd;
+    uint32_t txd;
+    uint32_t frequency;
+    uint32_t address;
+    uint32_t power;
+} NRF51TWIState;
+
+static void nrf51_twi_update_irq(NRF51TWIState *s)
+{
+    uint32_t pending = 0;
+
+    pending |= s->events_stopped ? NRF51_TWI_INT_STOPPED : 0;
+    pending |= s->events_rxdready ? NRF51_TWI_INT_RXDREADY : 0;
+    pending |= s->events_txdsent ? NRF51_TWI_INT_TXDSENT : 0;
+    pending |= s->events_error ? NRF51_TWI_INT_ERROR : 0;
+    pending |= s->events_bb ? NRF51_TWI_INT_BB : 0;
+    pending |= s->events_suspended ? NRF51_TWI_INT_SUSPENDED : 0;
+    qemu_set_irq(s->irq, !!(pending & s->inten));
+}
+
+static void nrf51_twi_event(NRF51TWIState *s, uint32_t *event, hwaddr offset)
+{
+    *event = 1;
+    nrf51_ppi_event(s->ppi, nrf51_periph_addr(SYS_BUS_DEVICE(s), offset));
+}
+
+static void nrf51_twi_error(NRF51TWIState *s, uint32_t src)
+{
+    s->errorsrc |= src;
+    nrf51_twi_event(s, &s->events_error, NRF51_TWI_ERROR);
+}
+
+static void nrf51_twi_stop(NRF51TWIState *s)
+{
+    if (s->phase != NRF51_TWI_IDLE) {
+        i2c_end_transfer(s->bus);
+    }
+    s->phase = NRF51_TWI_IDLE;
+    s->suspended = false;
+    nrf51_twi_event(s, &s->events_stopped, NRF51_TWI_STOPPED);
+}
+
+/**
+ * Signal a byte boundary and apply the BB shorts. Returns true when the
+ * transfer has to stop after the coming byte.
+ */
+static bool nrf51_twi_byte_boundary(NRF51TWIState *s)
+{
+    nrf51_twi_event(s, &s->events_bb, NRF51_TWI_BB);
+    return s->shorts & NRF51_TWI_SHORTS_BB_STOP;
+}
+
+static void nrf51_twi_suspend(NRF51TWIState *s)
+{
+    s->suspended = true;
+    nrf51_twi_event(s, &s->events_suspended, NRF51_TWI_SUSPENDED);
+}
+
+static void nrf51_twi_send(NRF51TWIState *s)
+{
+    bool stop = nrf51_twi_byte_boundary(s);
+
+    s->txd_loaded = false;
+    if (i2c_send(s->bus, s->txd)) {
+        nrf51_twi_error(s, NRF51_TWI_ERRORSRC_DNACK);
+    } else {
+        nrf51_twi_event(s, &s->events_txdsent, NRF51_TWI_TXDSENT);
+    }
+    if (stop) {
+        nrf51_twi_stop(s);
+    } else if (s->shorts & NRF51_TWI_SHORTS_BB_SUSPEND) {
+        nrf51_twi_suspend(s);
+    }
+}
+
+static void nrf51_twi_recv(NRF51TWIState *s)
+{
+    bool stop = nrf51_twi_byte_boundary(s);
+
+    if (s->rxd_loaded) {
+        nrf51_twi_error(s, NRF51_TWI_ERRORSRC_OVERRUN);
+    }
+    s->rxd = i2c_recv(s->bus) & 0xFF;
+    s->rxd_loaded = true;
+    nrf51_twi_event(s, &s->events_rxdready, NRF51_TWI_RXDREADY);
+    if (stop) {
+        i2c_nack(s->bus);
+        nrf51_twi_stop(s);
+    } else if (s->shorts & NRF51_TWI_SHORTS_BB_SUSPEND) {
+        nrf51_twi_suspend(s);
+    }
+}
+
+/* Clock in the next byte once the guest has consumed the previous one */
+static void nrf51_twi_rx_continue(NRF51TWIState *s)
+{
+    if (s->phase == NRF51_TWI_RX && !s->suspended &&
+        !(s->shorts & NRF51_TWI_SHORTS_BB_SUSPEND) &&
+        !s->rxd_loaded && !s->events_rxdready) {
+        nrf51_twi_recv(s);
+    }
+}
+
+/* Address phase, also used for a repeated start */
+static bool nrf51_twi_start(NRF51TWIState *s, int recv)
+{
+    if (s->phase != NRF51_TWI_IDLE) {
+        i2c_end_transfer(s->bus);
+        s->phase = NRF51_TWI_IDLE;
+    }
+    s->suspended = false;
+    s->rxd_loaded = false;
+    if (i2c_start_transfer(s->bus, s->address & 0x7F, recv)) {
+        nrf51_twi_error(s, NRF51_TWI_ERRORSRC_ANACK);
+        return false;
+    }
+    s->phase = recv ? NRF51_TWI_RX : NRF51_TWI_TX;
+    return true;
+}
+
+static void nrf51_twi_task(NRF51TWIState *s, hwaddr offset)
+{
+    if (s->enable != NRF51_ENABLE_TWI) {
+        return;
+    }
+
+    switch (offset) {
+        case NRF51_TWI_STARTRX:
+            if (nrf51_twi_start(s, 1)) {
+                nrf51_twi_recv(s);
+            }
+            break;
+        case NRF51_TWI_STARTTX:
+            if (nrf51_twi_start(s, 0) && s->txd_loaded) {
+                nrf51_twi_send(s);
+            }
+            break;
+        case NRF51_TWI_STOP:
+            nrf51_twi_stop(s);
+            break;
+        case NRF51_TWI_SUSPEND:
+            nrf51_twi_suspend(s);
+            break;
+        case NRF51_TWI_RESUME:
+            if (!s->suspended) {
+                break;
+            }
+            s->suspended = false;
+            if (s->phase == NRF51_TWI_RX) {
+                nrf51_twi_recv(s);
+            } else if (s->phase == NRF51_TWI_TX && s->txd_loaded) {
+                nrf51_twi_send(s);
+            }
+            break;
+    }
+}
+
+static uint64_t nrf51_twi_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    NRF51TWIState *s = (NRF51TWIState *)opaque;
+    uint32_t rxd;
+
+    switch (offset) {
+        case NRF51_TWI_STARTRX:
+        case NRF51_TWI_STARTTX:
+        case NRF51_TWI_STOP:
+        case NRF51_TWI_SUSPEND:
+        case NRF51_TWI_RESUME:
+            /* Tasks are write-only */
+            return 0;
+        case NRF51_TWI_STOPPED:
+            return s->events_stopped;
+        case NRF51_TWI_RXDREADY:
+            return s->events_rxdready;
+        case NRF51_TWI_TXDSENT:
+            return s->events_txdsent;
+        case NRF51_TWI_ERROR:
+            return s->events_error;
+        case NRF51_TWI_BB:
+            return s->events_bb;
+        case NRF51_TWI_SUSPENDED:
+            return s->events_suspended;
+        case NRF51_TWI_SHORTS:
+            return s->shorts;
+        case NRF51_TWI_INTEN:
+        case NRF51_TWI_INTENSET:
+        case NRF51_TWI_INTENCLR:
+            return s->inten;
+        case NRF51_TWI_ERRORSRC:
+            return s->errorsrc;
+        case NRF51_TWI_ENABLE:
+            return s->enable;
+        case NRF51_TWI_PSELSCL:
+            return s->pselscl;
+        case NRF51_TWI_PSELSDA:
+            return s->pselsda;
+        case NRF51_TWI_RXD:
+            rxd = s->rxd;
+            s->rxd_loaded = false;
+            nrf51_twi_rx_continue(s);
+            nrf51_twi_update_irq(s);
+            return rxd;
+        case NRF51_TWI_TXD:
+            return s->txd;
+        case NRF51_TWI_FREQUENCY:
+            return s->frequency;
+        case NRF51_TWI_ADDRESS:
+            return s->address;
+        case NRF51_TWI_POWER:
+            return s->power;
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: reading a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            return 0;
+    }
+}
+
+static void nrf51_twi_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    NRF51TWIState *s = (NRF51TWIState *)opaque;
+
+    switch (offset) {
+        case NRF51_TWI_STARTRX:
+        case NRF51_TWI_STARTTX:
+        case NRF51_TWI_STOP:
+        case NRF51_TWI_SUSPEND:
+        case NRF51_TWI_RESUME:
+            if (value & 1) {
+                nrf51_twi_task(s, offset);
+            }
+            break;
+        case NRF51_TWI_STOPPED:
+            s->events_stopped = value & 1;
+            break;
+        case NRF51_TWI_RXDREADY:
+            s->events_rxdready = value & 1;
+            nrf51_twi_rx_continue(s);
+            break;
+        case NRF51_TWI_TXDSENT:
+            s->events_txdsent = value & 1;
+            break;
+        case NRF51_TWI_ERROR:
+            s->events_error = value & 1;
+            break;
+        case NRF51_TWI_BB:
+            s->events_bb = value & 1;
+            break;
+        case NRF51_TWI_SUSPENDED:
+            s->events_suspended = value & 1;
+            break;
+        case NRF51_TWI_SHORTS:
+            s->shorts = value & (NRF51_TWI_SHORTS_BB_SUSPEND |
+                                 NRF51_TWI_SHORTS_BB_STOP);
+            break;
+        case NRF51_TWI_INTEN:
+            s->inten = value & NRF51_TWI_INT_MASK;
+            break;
+        case NRF51_TWI_INTENSET:
+            s->inten |= value & NRF51_TWI_INT_MASK;
+            break;
+        case NRF51_TWI_INTENCLR:
+            s->inten &= ~(value & NRF51_TWI_INT_MASK);
+            break;
+        case NRF51_TWI_ERRORSRC:
+            /* Write one to clear */
+            s->errorsrc &= ~value;
+            break;
+        case NRF51_TWI_ENABLE:
+            if (value == NRF51_ENABLE_SPI &&
+                nrf51_periph_hand_over(SYS_BUS_DEVICE(s), s->peer, value)) {
+                break;
+            }
+            s->enable = value & 7;
+            if (s->enable != NRF51_ENABLE_TWI &&
+                s->phase != NRF51_TWI_IDLE) {
+                i2c_end_transfer(s->bus);
+                s->phase = NRF51_TWI_IDLE;
+            }
+            break;
+        case NRF51_TWI_PSELSCL:
+            s->pselscl = value;
+            break;
+        case NRF51_TWI_PSELSDA:
+            s->pselsda = value;
+            break;
+        case NRF51_TWI_TXD:
+            s->txd = value & 0xFF;
+            s->txd_loaded = true;
+            if (s->phase == NRF51_TWI_TX && !s->suspended) {
+                nrf51_twi_send(s);
+            }
+            break;
+        case NRF51_TWI_FREQUENCY:
+            s->frequency = value;
+            break;
+        case NRF51_TWI_ADDRESS:
+            s->address = value & 0x7F;
+            break;
+        case NRF51_TWI_POWER:
+            s->power = value & 1;
+            break;
+        case NRF51_TWI_RXD:
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: writing a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            break;
+    }
+
+    nrf51_twi_update_irq(s);
+}
+
+static const MemoryRegionOps nrf51_twi_ops = {
+    .read = nrf51_twi_read,
+    .write = nrf51_twi_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static int nrf51_twi_post_load(void *opaque, int version_id)
+{
+    NRF51TWIState *s = (NRF51TWIState *)opaque;
+
+    if (s->enable == NRF51_ENABLE_TWI) {
+        nrf51_periph_claim(SYS_BUS_DEVICE(s), s->peer);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_nrf51_twi = {
+    .name = TYPE_NRF51_TWI,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = nrf51_twi_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(phase, NRF51TWIState),
+        VMSTATE_BOOL(suspended, NRF51TWIState),
+        VMSTATE_BOOL(txd_loaded, NRF51TWIState),
+        VMSTATE_BOOL(rxd_loaded, NRF51TWIState),
+        VMSTATE_UINT32(events_stopped, NRF51TWIState),
+        VMSTATE_UINT32(events_rxdready, NRF51TWIState),
+        VMSTATE_UINT32(events_txdsent, NRF51TWIState),
+        VMSTATE_UINT32(events_error, NRF51TWIState),
+        VMSTATE_UINT32(events_bb, NRF51TWIState),
+        VMSTATE_UINT32(events_suspended, NRF51TWIState),
+        VMSTATE_UINT32(shorts, NRF51TWIState),
+        VMSTATE_UINT32(inten, NRF51TWIState),
+        VMSTATE_UINT32(errorsrc, NRF51TWIState),
+        VMSTATE_UINT32(enable, NRF51TWIState),
+        VMSTATE_UINT32(pselscl, NRF51TWIState),
+        VMSTATE_UINT32(pselsda, NRF51TWIState),
+        VMSTATE_UINT32(rxd, NRF51TWIState),
+        VMSTATE_UINT32(txd, NRF51TWIState),
+        VMSTATE_UINT32(frequency, NRF51TWIState),
+        VMSTATE_UINT32(address, NRF51TWIState),
+        VMSTATE_UINT32(power, NRF51TWIState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_twi_properties[] = {
+    DEFINE_PROP_LINK("ppi", NRF51TWIState, ppi, TYPE_NRF51_PPI,
+                     NRF51PPIState *),
+    DEFINE_PROP_LINK("peer", NRF51TWIState, peer, TYPE_SYS_BUS_DEVICE,
+                     SysBusDevice *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_twi_reset(DeviceState *dev)
+{
+    NRF51TWIState *s = NRF51_TWI(dev);
+
+    if (s->phase != NRF51_TWI_IDLE) {
+        i2c_end_transfer(s->bus);
+    }
+    s->phase = NRF51_TWI_IDLE;
+    s->suspended = false;
+    s->txd_loaded = false;
+    s->rxd_loaded = false;
+    s->events_stopped = 0;
+    s->events_rxdready = 0;
+    s->events_txdsent = 0;
+    s->events_error = 0;
+    s->events_bb = 0;
+    s->events_suspended = 0;
+    s->shorts = 0;
+    s->inten = 0;
+    s->errorsrc = 0;
+    s->enable = 0;
+    s->pselscl = 0xFFFFFFFF;
+    s->pselsda = 0xFFFFFFFF;
+    s->rxd = 0;
+    s->txd = 0;
+    s->frequency = 0x04000000;
+    s->address = 0;
+    s->power = 1;
+}
+
+static void nrf51_twi_init(Object *obj)
+{
+    NRF51TWIState *s = NRF51_TWI(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    sysbus_init_irq(sdb, &s->irq);
+    nrf51_init_io(&s->iomem, obj, &nrf51_twi_ops, s,
+                  TYPE_NRF51_TWI, 0x1000);
+    sysbus_init_mmio(sdb, &s->iomem);
+    s->bus = i2c_init_bus(DEVICE(obj), "i2c");
+}
+
+static void nrf51_twi_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->reset = nrf51_twi_reset;
+    dc->props = nrf51_twi_properties;
+    dc->vmsd = &vmstate_nrf51_twi;
+}
+
+static const TypeInfo nrf51_twi_info = {
+    .name          = TYPE_NRF51_TWI,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51TWIState),
+    .instance_init = nrf51_twi_init,
+    .class_init    = nrf51_twi_class_init,
+};
+
+/**
+ * MICROBIT SENSOR TRACE
+ *   Host trace shared by the accelerometer, compass and quadrature decoder
+ *   models: a text file of "<time-ns> <x> [<y> <z>]" lines in ascending
+ *   virtual time, with as many values per line as the model takes, loaded
+ *   once at realize. Blank lines and lines starting with '#' are skipped.
+ *   Each sample holds until the next one.
+ */
+
+typedef struct {
+    int64_t time;
+    int32_t xyz[3];
+} MICROBITTraceSample;
+
+static GArray *microbit_trace_load(const char *path, int nvalues,
+                                   Error **errp)
+{
+    GArray *trace = g_array_new(FALSE, FALSE, sizeof(MICROBITTraceSample));
+    GError *gerr = NULL;
+    gchar *contents;
+    gchar **lines;
+    int64_t last = INT64_MIN;
+    int i;
+
+    if (!g_file_get_contents(path, &contents, NULL, &gerr)) {
+        error_setg(errp, "%s: cannot read trace %s: %s",
+                   __func__, path, gerr->message);
+        g_error_free(gerr);
+        g_array_free(trace, TRUE);
+        return NULL;
+    }
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        char *line = g_strstrip(lines[i]);
+        MICROBITTraceSample sample = { 0 };
+
+        if (*line == '\0' || *line == '#') {
+            continue;
+        }
+        if (sscanf(line, "%" SCNi64 " %" SCNi32 " %" SCNi32 " %" SCNi32,
+                   &sample.time, &sample.xyz[0], &sample.xyz[1],
+                   &sample.xyz[2]) != 1 + nvalues || sample.time < last) {
+            error_setg(errp, "%s: %s:%d: expected <time-ns> and %d values "
+                       "in ascending time", __func__, path, i + 1, nvalues);
+            g_array_free(trace, TRUE);
+            trace = NULL;
+            break;
+        }
+        last = sample.time;
+        g_array_append_val(trace, sample);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return trace;
+}
+
+/* Number of samples at or before virtual time `now` */
+static guint microbit_trace_index(GArray *trace, int64_t now)
+{
+    guint lo = 0, hi = trace ? trace->len : 0;
+
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        if (g_array_index(trace, MICROBITTraceSample, mid).time <= now) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Sample in effect at virtual time `now`, or `dflt` before the first one */
+static const int32_t *microbit_trace_lookup(GArray *trace, int64_t now,
+                                            const int32_t *dflt)
+{
+    guint lo = microbit_trace_index(trace, now);
+
+    return lo ? g_array_index(trace, MICROBITTraceSample, lo - 1).xyz : dflt;
+}
+
+/**
+ * MMA8653
+ *   3-axis accelerometer on the micro:bit I2C bus, with respect to the
+ *   NXP MMA8653FC datasheet
+ *   NOTE: trace values are in milli-g. A sample is latched into the output
+ *         registers when a read starts, so a burst read returns one
+ *         consistent sample from register lookups alone. Offsets,
+ *         interrupts and the motion/orientation engines are not modelled.
+ */
+
+#define TYPE_MMA8653 "mma8653"
+#define MMA8653(obj) \
+    OBJECT_CHECK(MMA8653State, (obj), TYPE_MMA8653)
+
+#define MMA8653_I2C_ADDR 0x1D
+
+enum {
+    MMA8653_STATUS       = 0x00,
+    MMA8653_OUT_X_MSB    = 0x01,
+    MMA8653_OUT_Z_LSB    = 0x06,
+    MMA8653_SYSMOD       = 0x0B,
+    MMA8653_INT_SOURCE   = 0x0C,
+    MMA8653_WHO_AM_I     = 0x0D,
+    MMA8653_XYZ_DATA_CFG = 0x0E,
+    MMA8653_CTRL_REG1    = 0x2A,
+    MMA8653_CTRL_REG4    = 0x2D,
+    MMA8653_NUM_REGS     = 0x32,
+
+    MMA8653_DEVICE_ID    = 0x5A,
+    MMA8653_CTRL_REG1_ACTIVE = 1 << 0,
+    MMA8653_CTRL_REG1_F_READ = 1 << 1,
+};
+
+typedef struct {
+    /* Private */
+    I2CSlave parent;
+
+    /* Public */
+    char *trace_path;
+    GArray *trace;
+
+    /* Internal state */
+    bool addr_phase;
+    uint8_t pointer;
+    uint8_t out[6];
+    uint8_t regs[MMA8653_NUM_REGS];
+} MMA8653State;
+
+/* Facing up, at rest */
+static const int32_t mma8653_default_sample[3] = { 0, 0, -1000 };
+
+static void mma8653_latch(MMA8653State *s)
+{
+    const int32_t *mg = microbit_trace_lookup(s->trace,
+                            qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL),
+                            mma8653_default_sample);
+    /* 10-bit results: 256 counts per g at 2g full scale */
+    int fs = s->regs[MMA8653_XYZ_DATA_CFG] & 3;
+    int32_t counts;
+
+    for (int i = 0; i < 3; i++) {
+        counts = (int64_t)mg[i] * (256 >> MIN(fs, 2)) / 1000;
+        counts = MAX(-512, MIN(511, counts));
+        s->out[2 * i] = (counts >> 2) & 0xFF;
+        s->out[2 * i + 1] = (counts & 3) << 6;
+    }
+}
+
+static uint8_t mma8653_read_reg(MMA8653State *s, uint8_t reg)
+{
+    bool active = s->regs[MMA8653_CTRL_REG1] & MMA8653_CTRL_REG1_ACTIVE;
+
+    switch (reg) {
+        case MMA8653_STATUS:
+            return active ? 0x0F : 0;
+        case MMA8653_OUT_X_MSB ... MMA8653_OUT_Z_LSB:
+            return s->out[reg - MMA8653_OUT_X_MSB];
+        case MMA8653_SYSMOD:
+            return active ? 1 : 0;
+        case MMA8653_INT_SOURCE:
+            return active && (s->regs[MMA8653_CTRL_REG4] & 1) ? 1 : 0;
+        case MMA8653_WHO_AM_I:
+            return MMA8653_DEVICE_ID;
+        default:
+            return reg < MMA8653_NUM_REGS ? s->regs[reg] : 0;
+    }
+}
+
+/* Auto-increment, which wraps over the data block and skips LSBs in F_READ */
+static uint8_t mma8653_next(MMA8653State *s, uint8_t reg)
+{
+    bool fast = s->regs[MMA8653_CTRL_REG1] & MMA8653_CTRL_REG1_F_READ;
+
+    if (reg <= MMA8653_OUT_Z_LSB) {
+        if (fast) {
+            return reg == 0 ? 1 : (reg >= 5 ? 0 : reg + 2);
+        }
+        return reg == MMA8653_OUT_Z_LSB ? 0 : reg + 1;
+    }
+    return reg + 1 >= MMA8653_NUM_REGS ? 0 : reg + 1;
+}
+
+static int mma8653_event(I2CSlave *i2c, enum i2c_event event)
+{
+    MMA8653State *s = MMA8653(i2c);
+
+    switch (event) {
+        case I2C_START_SEND:
+            s->addr_phase = true;
+            break;
+        case I2C_START_RECV:
+            mma8653_latch(s);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static int mma8653_recv(I2CSlave *i2c)
+{
+    MMA8653State *s = MMA8653(i2c);
+    uint8_t value = mma8653_read_reg(s, s->pointer);
+
+    s->pointer = mma8653_next(s, s->pointer);
+    return value;
+}
+
+static int mma8653_send(I2CSlave *i2c, uint8_t data)
+{
+    MMA8653State *s = MMA8653(i2c);
+
+    if (s->addr_phase) {
+        s->pointer = data;
+        s->addr_phase = false;
+        return 0;
+    }
+    if (s->pointer < MMA8653_NUM_REGS && s->pointer > MMA8653_WHO_AM_I) {
+        s->regs[s->pointer] = data;
+    }
+    s->pointer = mma8653_next(s, s->pointer);
+    return 0;
+}
+
+static const VMStateDescription vmstate_mma8653 = {
+    .name = TYPE_MMA8653,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_I2C_SLAVE(parent, MMA8653State),
+        VMSTATE_BOOL(addr_phase, MMA8653State),
+        VMSTATE_UINT8(pointer, MMA8653State),
+        VMSTATE_UINT8_ARRAY(out, MMA8653State, 6),
+        VMSTATE_UINT8_ARRAY(regs, MMA8653State, MMA8653_NUM_REGS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property mma8653_properties[] = {
+    DEFINE_PROP_STRING("trace", MMA8653State, trace_path),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void mma8653_realize(DeviceState *dev, Error **errp)
+{
+    MMA8653State *s = MMA8653(dev);
+
+    if (s->trace_path) {
+        s->trace = microbit_trace_load(s->trace_path, 3, errp);
+    }
+}
+
+static void mma8653_reset(DeviceState *dev)
+{
+    MMA8653State *s = MMA8653(dev);
+
+    s->addr_phase = false;
+    s->pointer = 0;
+    memset(s->out, 0, sizeof(s->out));
+    memset(s->regs, 0, sizeof(s->regs));
+}
+
+static void mma8653_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    I2CSlaveClass *k = I2C_SLAVE_CLASS(klass);
+
+    dc->realize = mma8653_realize;
+    dc->reset = mma8653_reset;
+    dc->props = mma8653_properties;
+    dc->vmsd = &vmstate_mma8653;
+    k->event = mma8653_event;
+    k->recv = mma8653_recv;
+    k->send = mma8653_send;
+}
+
+static const TypeInfo mma8653_info = {
+    .name          = TYPE_MMA8653,
+    .parent        = TYPE_I2C_SLAVE,
+    .instance_size = sizeof(MMA8653State),
+    .class_init    = mma8653_class_init,
+};
+
+/**
+ * MAG3110
+ *   3-axis magnetometer on the micro:bit I2C bus, with respect to the
+ *   NXP MAG3110 datasheet
+ *   NOTE: trace values are raw counts of 0.1 uT. As for the MMA8653, a
+ *         sample is latched when a read starts. User offsets are stored
+ *         but not applied, and the die temperature reads a fixed 25 C.
+ */
+
+#define TYPE_MAG3110 "mag3110"
+#define MAG3110(obj) \
+    OBJECT_CHECK(MAG3110State, (obj), TYPE_MAG3110)
+
+#define MAG3110_I2C_ADDR 0x0E
+
+enum {
+    MAG3110_DR_STATUS = 0x00,
+    MAG3110_OUT_X_MSB = 0x01,
+    MAG3110_OUT_Z_LSB = 0x06,
+    MAG3110_WHO_AM_I  = 0x07,
+    MAG3110_SYSMOD    = 0x08,
+    MAG3110_DIE_TEMP  = 0x0F,
+    MAG3110_CTRL_REG1 = 0x10,
+    MAG3110_CTRL_REG2 = 0x11,
+    MAG3110_NUM_REGS  = 0x12,
+
+    MAG3110_DEVICE_ID = 0xC4,
+    MAG3110_CTRL_REG1_AC = 1 << 0,
+    MAG3110_CTRL_REG1_TM = 1 << 1,
+    MAG3110_CTRL_REG1_FR = 1 << 2,
+};
+
+typedef struct {
+    /* Private */
+    I2CSlave parent;
+
+    /* Public */
+    char *trace_path;
+    GArray *trace;
+
+    /* Internal state */
+    bool addr_phase;
+    uint8_t pointer;
+    uint8_t out[6];
+    uint8_t regs[MAG3110_NUM_REGS];
+} MAG3110State;
+
+static const int32_t mag3110_default_sample[3] = { 0, 0, 0 };
+
+static void mag3110_latch(MAG3110State *s)
+{
+    const int32_t *counts = microbit_trace_lookup(s->trace,
+                                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL),
+                                mag3110_default_sample);
+
+    for (int i = 0; i < 3; i++) {
+        stw_be_p(&s->out[2 * i], MAX(-30000, MIN(30000, counts[i])));
+    }
+}
+
+static uint8_t mag3110_read_reg(MAG3110State *s, uint8_t reg)
+{
+    bool active = s->regs[MAG3110_CTRL_REG1] &
+                  (MAG3110_CTRL_REG1_AC | MAG3110_CTRL_REG1_TM);
+
+    switch (reg) {
+        case MAG3110_DR_STATUS:
+            return active ? 0x0F : 0;
+        case MAG3110_OUT_X_MSB ... MAG3110_OUT_Z_LSB:
+            return s->out[reg - MAG3110_OUT_X_MSB];
+        case MAG3110_WHO_AM_I:
+            return MAG3110_DEVICE_ID;
+        case MAG3110_SYSMOD:
+            return active ? 1 : 0;
+        case MAG3110_DIE_TEMP:
+            return 25;
+        default:
+            return reg < MAG3110_NUM_REGS ? s->regs[reg] : 0;
+    }
+}
+
+static uint8_t mag3110_next(MAG3110State *s, uint8_t reg)
+{
+    bool fast = s->regs[MAG3110_CTRL_REG1] & MAG3110_CTRL_REG1_FR;
+
+    if (fast && reg <= MAG3110_OUT_Z_LSB) {
+        return reg == 0 ? 1 : (reg >= 5 ? 0 : reg + 2);
+    }
+    return reg + 1 >= MAG3110_NUM_REGS ? 0 : reg + 1;
+}
+
+static int mag3110_event(I2CSlave *i2c, enum i2c_event event)
+{
+    MAG3110State *s = MAG3110(i2c);
+
+    switch (event) {
+        case I2C_START_SEND:
+            s->addr_phase = true;
+            break;
+        case I2C_START_RECV:
+            mag3110_latch(s);
+            /* A triggered measurement completes at once */
+            s->regs[MAG3110_CTRL_REG1] &= ~MAG3110_CTRL_REG1_TM;
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static int mag3110_recv(I2CSlave *i2c)
+{
+    MAG3110State *s = MAG3110(i2c);
+    uint8_t value = mag3110_read_reg(s, s->pointer);
+
+    s->pointer = mag3110_next(s, s->pointer);
+    return value;
+}
+
+static int mag3110_send(I2CSlave *i2c, uint8_t data)
+{
+    MAG3110State *s = MAG3110(i2c);
+
+    if (s->addr_phase) {
+        s->pointer = data;
+        s->addr_phase = false;
+        return 0;
+    }
+    if (s->pointer < MAG3110_NUM_REGS && s->pointer > MAG3110_SYSMOD &&
+        s->pointer != MAG3110_DIE_TEMP) {
+        s->regs[s->pointer] = data;
+    }
+    s->pointer = mag3110_next(s, s->pointer);
+    return 0;
+}
+
+static const VMStateDescription vmstate_mag3110 = {
+    .name = TYPE_MAG3110,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_I2C_SLAVE(parent, MAG3110State),
+        VMSTATE_BOOL(addr_phase, MAG3110State),
+        VMSTATE_UINT8(pointer, MAG3110State),
+        VMSTATE_UINT8_ARRAY(out, MAG3110State, 6),
+        VMSTATE_UINT8_ARRAY(regs, MAG3110State, MAG3110_NUM_REGS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property mag3110_properties[] = {
+    DEFINE_PROP_STRING("trace", MAG3110State, trace_path),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void mag3110_realize(DeviceState *dev, Error **errp)
+{
+    MAG3110State *s = MAG3110(dev);
+
+    if (s->trace_path) {
+        s->trace = microbit_trace_load(s->trace_path, 3, errp);
+    }
+}
+
+static void mag3110_reset(DeviceState *dev)
+{
+    MAG3110State *s = MAG3110(dev);
+
+    s->addr_phase = false;
+    s->pointer = 0;
+    memset(s->out, 0, sizeof(s->out));
+    memset(s->regs, 0, sizeof(s->regs));
+}
+
+static void mag3110_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    I2CSlaveClass *k = I2C_SLAVE_CLASS(klass);
+
+    dc->realize = mag3110_realize;
+    dc->reset = mag3110_reset;
+    dc->props = mag3110_properties;
+    dc->vmsd = &vmstate_mag3110;
+    k->event = mag3110_event;
+    k->recv = mag3110_recv;
+    k->send = mag3110_send;
+}
+
+static const TypeInfo mag3110_info = {
+    .name          = TYPE_MAG3110,
+    .parent        = TYPE_I2C_SLAVE,
+    .instance_size = sizeof(MAG3110State),
+    .class_init    = mag3110_class_init,
+};
+
+/**
+ * NRF51 QDEC
+ *   Quadrature decoder, with respect to nRF51822 Reference Manual
+ *   NOTE: the encoder is not sampled through PSELA and PSELB; its position
+ *         integrates a rotation rate trace (property "trace", see
+ *         MICROBIT SENSOR TRACE) of "<time-ns> <counts-per-second>" lines,
+ *         0 before the first one. Samples are taken analytically whenever
+ *         a register is read and at the end of each report period, which
+ *         is all the timer wakes up for unless SAMPLERDY interrupts or
+ *         stops us. When the encoder moves by more transitions than there
+ *         are samples, the excess is counted as double transitions spread
+ *         over the samples. Debouncing and the LED are not modelled.
+ */
+
+#define TYPE_NRF51_QDEC "nrf51_qdec"
+#define NRF51_QDEC(obj) \
+    OBJECT_CHECK(NRF51QDECState, (obj), TYPE_NRF51_QDEC)
+
+#define NRF51_QDEC_ACC_MIN    (-1024)
+#define NRF51_QDEC_ACC_MAX    1023
+#define NRF51_QDEC_ACCDBL_MAX 15
+
+enum {
+    NRF51_QDEC_ENABLE     = 0x500,
+    NRF51_QDEC_LEDPOL     = 0x504,
+    NRF51_QDEC_SAMPLEPER  = 0x508,
+    NRF51_QDEC_SAMPLE     = 0x50C,
+    NRF51_QDEC_REPORTPER  = 0x510,
+    NRF51_QDEC_ACC        = 0x514,
+    NRF51_QDEC_ACCREAD    = 0x518,
+    NRF51_QDEC_PSELLED    = 0x51C,
+    NRF51_QDEC_PSELA      = 0x520,
+    NRF51_QDEC_PSELB      = 0x524,
+    NRF51_QDEC_DBFEN      = 0x528,
+    NRF51_QDEC_LEDPRE     = 0x540,
+    NRF51_QDEC_ACCDBL     = 0x544,
+    NRF51_QDEC_ACCDBLREAD = 0x548,
+    NRF51_QDEC_POWER      = 0xFFC,
+};
+
+enum {
+    NRF51_QDEC_TASK_START      = 0,
+    NRF51_QDEC_TASK_STOP       = 1,
+    NRF51_QDEC_TASK_READCLRACC = 2,
+    NRF51_QDEC_EVENT_SAMPLERDY = 0,
+    NRF51_QDEC_EVENT_REPORTRDY = 1,
+    NRF51_QDEC_EVENT_ACCOF     = 2,
+    NRF51_QDEC_SHORT_REPORTRDY_READCLRACC = 0,
+    NRF51_QDEC_SHORT_SAMPLERDY_STOP       = 1,
+};
+
+/* Encoder position at a trace sample: `count` plus `rem` / 1e9 */
+typedef struct {
+    int64_t count;
+    int64_t rem;
+} NRF51QDECPosition;
+
+typedef struct {
+    /* Private */
+    NRF51PeriphState parent;
+
+    /* Public */
+    QEMUTimer *timer;
+    char *trace_path;
+    GArray *trace;
+    /* Position at each trace sample, computed at realize */
+    NRF51QDECPosition *positions;
+
+    /* Internal state */
+    bool running;
+    /* Virtual time of START, which sample n is taken SAMPLEPER after */
+    int64_t start;
+    /* Samples taken since START */
+    uint64_t taken;
+    /* A sample in this report period was not zero */
+    bool moved;
+    /* Sampling on behalf of a read or the timer */
+    bool syncing;
+
+    /* Public Regs */
+    uint32_t enable;
+    uint32_t ledpol;
+    uint32_t sampleper;
+    int32_t sample;
+    uint32_t reportper;
+    int32_t acc;
+    int32_t accread;
+    uint32_t pselled;
+    uint32_t psela;
+    uint32_t pselb;
+    uint32_t dbfen;
+    uint32_t ledpre;
+    uint32_t accdbl;
+    uint32_t accdblread;
+    uint32_t power;
+} NRF51QDECState;
+
+/* Move `pos` on by `dt` ns at `rate` counts per second */
+static void nrf51_qdec_advance(NRF51QDECPosition *pos, int32_t rate,
+                               int64_t dt)
+{
+    int64_t rem = pos->rem + (int64_t)rate * (dt % NANOSECONDS_PER_SECOND);
+
+    pos->count += (int64_t)rate * (dt / NANOSECONDS_PER_SECOND) +
+                  rem / NANOSECONDS_PER_SECOND;
+    pos->rem = rem % NANOSECONDS_PER_SECOND;
+    if (pos->rem < 0) {
+        pos->rem += NANOSECONDS_PER_SECOND;
+        pos->count--;
+    }
+}
+
+/* Whole counts the encoder has moved by at virtual time `now` */
+static int64_t nrf51_qdec_position(NRF51QDECState *s, int64_t now)
+{
+    guint i = microbit_trace_index(s->trace, now);
+    const MICROBITTraceSample *sample;
+    NRF51QDECPosition pos;
+
+    if (!i) {
+        return 0;
+    }
+    sample = &g_array_index(s->trace, MICROBITTraceSample, i - 1);
+    pos = s->positions[i - 1];
+    nrf51_qdec_advance(&pos, sample->xyz[0], now - sample->time);
+    return pos.count;
+}
+
+static int64_t nrf51_qdec_sampleper_ns(NRF51QDECState *s)
+{
+    return (128 << s->sampleper) * SCALE_US;
+}
+
+static uint64_t nrf51_qdec_reportper(NRF51QDECState *s)
+{
+    static const uint64_t samples[] = { 10, 40, 80, 120, 160 };
+
+    return samples[MIN(s->reportper, ARRAY_SIZE(samples) - 1)];
+}
+
+static int64_t nrf51_qdec_sample_time(NRF51QDECState *s, uint64_t n)
+{
+    return s->start + n * nrf51_qdec_sampleper_ns(s);
+}
+
+/* Whether SAMPLERDY has to be raised at each sample */
+static bool nrf51_qdec_per_sample(NRF51QDECState *s)
+{
+    NRF51PeriphState *p = &s->parent;
+
+    return (p->inten & (1 << NRF51_QDEC_EVENT_SAMPLERDY)) ||
+           (p->shorts & (1 << NRF51_QDEC_SHORT_SAMPLERDY_STOP));
+}
+
+/* Account samples `from` to `to` into ACC and ACCDBL */
+static void nrf51_qdec_take(NRF51QDECState *s, uint64_t from, uint64_t to)
+{
+    int64_t before = nrf51_qdec_position(s, nrf51_qdec_sample_time(s, from));
+    int64_t last = nrf51_qdec_position(s, nrf51_qdec_sample_time(s, to - 1));
+    int64_t after = nrf51_qdec_position(s, nrf51_qdec_sample_time(s, to));
+    int64_t delta = after - before, moves = ABS(delta), n = to - from;
+    int64_t doubles = 0, acc, accdbl;
+
+    if (moves > n) {
+        doubles = MIN(moves - n, n);
+        moves = MAX(moves - 2 * doubles, 0);
+    }
+    if (moves || doubles) {
+        s->moved = true;
+    }
+    acc = s->acc + (delta < 0 ? -moves : moves);
+    accdbl = s->accdbl + doubles;
+    if (acc < NRF51_QDEC_ACC_MIN || acc > NRF51_QDEC_ACC_MAX ||
+        accdbl > NRF51_QDEC_ACCDBL_MAX) {
+        nrf51_periph_event(&s->parent, NRF51_QDEC_EVENT_ACCOF);
+    }
+    s->acc = MIN(MAX(acc, NRF51_QDEC_ACC_MIN), NRF51_QDEC_ACC_MAX);
+    s->accdbl = MIN(accdbl, NRF51_QDEC_ACCDBL_MAX);
+
+    delta = after - last;
+    s->sample = ABS(delta) >= 2 ? 2 : delta;
+    s->taken = to;
+}
+
+/* Take the samples due by `now`, raising events as they come */
+static void nrf51_qdec_sync(NRF51QDECState *s, int64_t now)
+{
+    uint64_t due, report, to;
+
+    if (!s->running || now < s->start) {
+        return;
+    }
+    due = (now - s->start) / nrf51_qdec_sampleper_ns(s);
+    s->syncing = true;
+    while (s->running && s->taken < due) {
+        report = nrf51_qdec_reportper(s);
+        report = QEMU_ALIGN_DOWN(s->taken, report) + report;
+        to = nrf51_qdec_per_sample(s) ? s->taken + 1 : MIN(due, report);
+        nrf51_qdec_take(s, s->taken, to);
+        nrf51_periph_event(&s->parent, NRF51_QDEC_EVENT_SAMPLERDY);
+        if (s->running && to == report) {
+            if (s->moved) {
+                nrf51_periph_event(&s->parent, NRF51_QDEC_EVENT_REPORTRDY);
+            }
+            s->moved = false;
+        }
+    }
+    s->syncing = false;
+}
+
+static void nrf51_qdec_rearm(NRF51QDECState *s)
+{
+    uint64_t next, report = nrf51_qdec_reportper(s);
+
+    if (!s->running) {
+        timer_del(s->timer);
+        return;
+    }
+    next = nrf51_qdec_per_sample(s) ? s->taken + 1 :
+           QEMU_ALIGN_DOWN(s->taken, report) + report;
+    timer_mod_ns(s->timer, nrf51_qdec_sample_time(s, next));
+}
+
+static void nrf51_qdec_expire(void *opaque)
+{
+    NRF51QDECState *s = NRF51_QDEC(opaque);
+
+    nrf51_qdec_sync(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    nrf51_qdec_rearm(s);
+}
+
+static void nrf51_qdec_start(NRF51PeriphState *p)
+{
+    NRF51QDECState *s = NRF51_QDEC(p);
+
+    if (!(s->enable & 1) || s->running) {
+        return;
+    }
+    s->running = true;
+    s->start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    s->taken = 0;
+    s->moved = false;
+    nrf51_qdec_rearm(s);
+}
+
+static void nrf51_qdec_stop(NRF51PeriphState *p)
+{
+    NRF51QDECState *s = NRF51_QDEC(p);
+
+    if (!s->syncing) {
+        nrf51_qdec_sync(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    }
+    s->running = false;
+    nrf51_qdec_rearm(s);
+}
+
+static void nrf51_qdec_readclracc(NRF51PeriphState *p)
+{
+    NRF51QDECState *s = NRF51_QDEC(p);
+
+    if (!s->syncing) {
+        nrf51_qdec_sync(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    }
+    s->accread = s->acc;
+    s->accdblread = s->accdbl;
+    s->acc = 0;
+    s->accdbl = 0;
+}
+
+static NRF51PeriphTaskFn * const nrf51_qdec_tasks[] = {
+    [NRF51_QDEC_TASK_START]      = nrf51_qdec_start,
+    [NRF51_QDEC_TASK_STOP]       = nrf51_qdec_stop,
+    [NRF51_QDEC_TASK_READCLRACC] = nrf51_qdec_readclracc,
+};
+
+static const NRF51PeriphShort nrf51_qdec_shorts[] = {
+    { NRF51_QDEC_SHORT_REPORTRDY_READCLRACC, NRF51_QDEC_EVENT_REPORTRDY,
+      NRF51_QDEC_TASK_READCLRACC },
+    { NRF51_QDEC_SHORT_SAMPLERDY_STOP, NRF51_QDEC_EVENT_SAMPLERDY,
+      NRF51_QDEC_TASK_STOP },
+};
+
+/* Registers read and written as of now */
+static void nrf51_qdec_access(NRF51PeriphState *p, bool is_write)
+{
+    NRF51QDECState *s = NRF51_QDEC(p);
+
+    nrf51_qdec_sync(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    if (!is_write) {
+        nrf51_qdec_rearm(s);
+    }
+}
+
+static void nrf51_qdec_enable_write(void *opaque, hwaddr offset,
+                                    uint64_t value)
+{
+    NRF51QDECState *s = NRF51_QDEC(opaque);
+
+    s->enable = value & 1;
+    if (!s->enable) {
+        s->running = false;
+    }
+}
+
+/* SAMPLEPER and REPORTPER */
+static void nrf51_qdec_period_write(void *opaque, hwaddr offset,
+                                    uint64_t value)
+{
+    NRF51QDECState *s = NRF51_QDEC(opaque);
+
+    /* Sampling goes on from the last sample at the new rate */
+    if (s->running) {
+        s->start = nrf51_qdec_sample_time(s, s->taken);
+        s->taken = 0;
+    }
+    if (offset == NRF51_QDEC_SAMPLEPER) {
+        s->sampleper = value & 7;
+    } else {
+        s->reportper = value & 7;
+    }
+}
+
+static const NRF51Reg nrf51_qdec_regs[] = {
+    NRF51_PERIPH_REG(NRF51_QDEC_ENABLE) = {
+        NRF51_FIELD(NRF51QDECState, enable, 0),
+        .write = nrf51_qdec_enable_write,
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_LEDPOL) = {
+        NRF51_FIELD(NRF51QDECState, ledpol, 1),
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_SAMPLEPER) = {
+        NRF51_FIELD(NRF51QDECState, sampleper, 0),
+        .write = nrf51_qdec_period_write,
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_SAMPLE) = {
+        NRF51_FIELD(NRF51QDECState, sample, 0),
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_REPORTPER) = {
+        NRF51_FIELD(NRF51QDECState, reportper, 0),
+        .write = nrf51_qdec_period_write,
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_ACC) = {
+        NRF51_FIELD(NRF51QDECState, acc, 0),
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_ACCREAD) = {
+        NRF51_FIELD(NRF51QDECState, accread, 0),
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_PSELLED) = {
+        NRF51_FIELD(NRF51QDECState, pselled, UINT32_MAX),
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_PSELA) = {
+        NRF51_FIELD(NRF51QDECState, psela, UINT32_MAX),
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_PSELB) = {
+        NRF51_FIELD(NRF51QDECState, pselb, UINT32_MAX),
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_DBFEN) = {
+        NRF51_FIELD(NRF51QDECState, dbfen, 1),
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_LEDPRE) = {
+        NRF51_FIELD(NRF51QDECState, ledpre, 0x1FF),
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_ACCDBL) = {
+        NRF51_FIELD(NRF51QDECState, accdbl, 0),
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_ACCDBLREAD) = {
+        NRF51_FIELD(NRF51QDECState, accdblread, 0),
+    },
+    NRF51_PERIPH_REG(NRF51_QDEC_POWER) = {
+        NRF51_FIELD(NRF51QDECState, power, 1),
+    },
+};
+
+/* INTEN and SHORTS decide how often the timer has to fire */
+static void nrf51_qdec_update(NRF51PeriphState *p)
+{
+    nrf51_qdec_rearm(NRF51_QDEC(p));
+}
+
+static const VMStateDescription vmstate_nrf51_qdec = {
+    .name = TYPE_NRF51_QDEC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(parent, NRF51QDECState, 1, vmstate_nrf51_periph,
+                       NRF51PeriphState),
+        VMSTATE_TIMER_PTR(timer, NRF51QDECState),
+        VMSTATE_BOOL(running, NRF51QDECState),
+        VMSTATE_INT64(start, NRF51QDECState),
+        VMSTATE_UINT64(taken, NRF51QDECState),
+        VMSTATE_BOOL(moved, NRF51QDECState),
+        VMSTATE_UINT32(enable, NRF51QDECState),
+        VMSTATE_UINT32(ledpol, NRF51QDECState),
+        VMSTATE_UINT32(sampleper, NRF51QDECState),
+        VMSTATE_INT32(sample, NRF51QDECState),
+        VMSTATE_UINT32(reportper, NRF51QDECState),
+        VMSTATE_INT32(acc, NRF51QDECState),
+        VMSTATE_INT32(accread, NRF51QDECState),
+        VMSTATE_UINT32(pselled, NRF51QDECState),
+        VMSTATE_UINT32(psela, NRF51QDECState),
+        VMSTATE_UINT32(pselb, NRF51QDECState),
+        VMSTATE_UINT32(dbfen, NRF51QDECState),
+        VMSTATE_UINT32(ledpre, NRF51QDECState),
+        VMSTATE_UINT32(accdbl, NRF51QDECState),
+        VMSTATE_UINT32(accdblread, NRF51QDECState),
+        VMSTATE_UINT32(power, NRF51QDECState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_qdec_properties[] = {
+    DEFINE_PROP_STRING("trace", NRF51QDECState, trace_path),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_qdec_realize(DeviceState *dev, Error **errp)
+{
+    NRF51QDECState *s = NRF51_QDEC(dev);
+    guint i;
+
+    if (s->trace_path) {
+        s->trace = microbit_trace_load(s->trace_path, 1, errp);
+        if (!s->trace) {
+            return;
+        }
+        s->positions = g_new0(NRF51QDECPosition, MAX(s->trace->len, 1));
+        for (i = 1; i < s->trace->len; i++) {
+            const MICROBITTraceSample *prev =
+                &g_array_index(s->trace, MICROBITTraceSample, i - 1);
+
+            s->positions[i] = s->positions[i - 1];
+            nrf51_qdec_advance(&s->positions[i], prev->xyz[0],
+                               g_array_index(s->trace, MICROBITTraceSample,
+                                             i).time - prev->time);
+        }
+    }
+    s->timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nrf51_qdec_expire, s);
+}
+
+static void nrf51_qdec_reset(DeviceState *dev)
+{
+    NRF51QDECState *s = NRF51_QDEC(dev);
+
+    nrf51_periph_reset(dev);
+    timer_del(s->timer);
+    s->running = false;
+    s->start = 0;
+    s->taken = 0;
+    s->moved = false;
+    s->enable = 0;
+    s->ledpol = 0;
+    s->sampleper = 0;
+    s->sample = 0;
+    s->reportper = 0;
+    s->acc = 0;
+    s->accread = 0;
+    s->pselled = 0xFFFFFFFF;
+    s->psela = 0xFFFFFFFF;
+    s->pselb = 0xFFFFFFFF;
+    s->dbfen = 0;
+    s->ledpre = 0x10;
+    s->accdbl = 0;
+    s->accdblread = 0;
+    s->power = 1;
+}
+
+static void nrf51_qdec_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    NRF51PeriphClass *pc = NRF51_PERIPH_CLASS(klass);
+
+    dc->realize = nrf51_qdec_realize;
+    dc->reset = nrf51_qdec_reset;
+    dc->props = nrf51_qdec_properties;
+    dc->vmsd = &vmstate_nrf51_qdec;
+    pc->tasks = nrf51_qdec_tasks;
+    pc->num_tasks = ARRAY_SIZE(nrf51_qdec_tasks);
+    pc->events = 1 << NRF51_QDEC_EVENT_SAMPLERDY |
+                 1 << NRF51_QDEC_EVENT_REPORTRDY |
+                 1 << NRF51_QDEC_EVENT_ACCOF;
+    pc->shorts = nrf51_qdec_shorts;
+    pc->num_shorts = ARRAY_SIZE(nrf51_qdec_shorts);
+    pc->regs = nrf51_qdec_regs;
+    pc->num_regs = ARRAY_SIZE(nrf51_qdec_regs);
+    pc->access = nrf51_qdec_access;
+    pc->update = nrf51_qdec_update;
+}
+
+static const TypeInfo nrf51_qdec_info = {
+    .name          = TYPE_NRF51_QDEC,
+    .parent        = TYPE_NRF51_PERIPH,
+    .instance_size = sizeof(NRF51QDECState),
+    .class_init    = nrf51_qdec_class_init,
+};
+
+/**
+ * NRF51 SPI
+ *   SPI master, with respect to nRF51822 Reference Manual
+ *   NOTE: each TXD write is exchanged with the SSIBus at once and the
+ *         received byte is queued in a FIFO deeper than the hardware's
+ *         double buffer, so a chain of TXD writes never stalls. READY is
+ *         only raised, and signalled to PPI, when it is not already
+ *         pending, so a chain costs one interrupt rather than one per
+ *         byte. Slave select is left to GPIO.
+ */
+
+#define TYPE_NRF51_SPI "nrf51_spi"
+#define NRF51_SPI(obj) \
+    OBJECT_CHECK(NRF51SPIState, (obj), TYPE_NRF51_SPI)
+
+#define NRF51_SPI_RX_FIFO_SIZE 64
+
+enum {
+    NRF51_SPI_READY     = 0x108,
+    NRF51_SPI_INTEN     = 0x300,
+    NRF51_SPI_INTENSET  = 0x304,
+    NRF51_SPI_INTENCLR  = 0x308,
+    NRF51_SPI_ENABLE    = 0x500,
+    NRF51_SPI_PSELSCK   = 0x508,
+    NRF51_SPI_PSELMOSI  = 0x50C,
+    NRF51_SPI_PSELMISO  = 0x510,
+    NRF51_SPI_RXD       = 0x518,
+    NRF51_SPI_TXD       = 0x51C,
+    NRF51_SPI_FREQUENCY = 0x524,
+    NRF51_SPI_CONFIG    = 0x554,
+    NRF51_SPI_POWER     = 0xFFC,
+};
+
+enum {
+    NRF51_SPI_INT_READY = 1 << 2,
+    NRF51_SPI_CONFIG_ORDER_LSB = 1 << 0,
+    NRF51_SPI_CONFIG_MASK = 0x7,
+};
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    qemu_irq irq;
+    SSIBus *bus;
+    NRF51PPIState *ppi;
+    SysBusDevice *peer;
+
+    /* Internal state */
+    Fifo8 rx_fifo;
+
+    /* Public Regs */
+    uint32_t events_ready;
+    uint32_t inten;
+    uint32_t enable;
+    uint32_t pselsck;
+    uint32_t pselmosi;
+    uint32_t pselmiso;
+    uint32_t rxd;
+    uint32_t txd;
+    uint32_t frequency;
+    uint32_t config;
+    uint32_t power;
+} NRF51SPIState;
+
+static void nrf51_spi_update_irq(NRF51SPIState *s)
+{
+    qemu_set_irq(s->irq, s->events_ready && (s->inten & NRF51_SPI_INT_READY));
+}
+
+/* A byte is available in RXD */
+static void nrf51_spi_ready(NRF51SPIState *s)
+{
+    if (s->events_ready) {
+        return;
+    }
+    s->events_ready = 1;
+    nrf51_ppi_event(s->ppi, nrf51_periph_addr(SYS_BUS_DEVICE(s),
+                                              NRF51_SPI_READY));
+}
+
+static void nrf51_spi_transfer(NRF51SPIState *s)
+{
+    bool lsb = s->config & NRF51_SPI_CONFIG_ORDER_LSB;
+    uint8_t tx = lsb ? revbit8(s->txd) : s->txd;
+    uint8_t rx = ssi_transfer(s->bus, tx);
+
+    if (fifo8_is_full(&s->rx_fifo)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: RXD overrun\n", __func__);
+        return;
+    }
+    fifo8_push(&s->rx_fifo, lsb ? revbit8(rx) : rx);
+    nrf51_spi_ready(s);
+}
+
+static uint64_t nrf51_spi_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    NRF51SPIState *s = (NRF51SPIState *)opaque;
+
+    switch (offset) {
+        case NRF51_SPI_READY:
+            return s->events_ready;
+        case NRF51_SPI_INTEN:
+        case NRF51_SPI_INTENSET:
+        case NRF51_SPI_INTENCLR:
+            return s->inten;
+        case NRF51_SPI_ENABLE:
+            return s->enable;
+        case NRF51_SPI_PSELSCK:
+            return s->pselsck;
+        case NRF51_SPI_PSELMOSI:
+            return s->pselmosi;
+        case NRF51_SPI_PSELMISO:
+            return s->pselmiso;
+        case NRF51_SPI_RXD:
+            if (!fifo8_is_empty(&s->rx_fifo)) {
+                s->rxd = fifo8_pop(&s->rx_fifo);
+                /* The next queued byte moves into RXD */
+                if (!fifo8_is_empty(&s->rx_fifo)) {
+                    nrf51_spi_ready(s);
+                    nrf51_spi_update_irq(s);
+                }
+            }
+            return s->rxd;
+        case NRF51_SPI_TXD:
+            return s->txd;
+        case NRF51_SPI_FREQUENCY:
+            return s->frequency;
+        case NRF51_SPI_CONFIG:
+            return s->config;
+        case NRF51_SPI_POWER:
+            return s->power;
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: reading a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            return 0;
+    }
+}
+
+static void nrf51_spi_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    NRF51SPIState *s = (NRF51SPIState *)opaque;
+
+    switch (offset) {
+        case NRF51_SPI_READY:
+            s->events_ready = value & 1;
+            break;
+        case NRF51_SPI_INTEN:
+            s->inten = value & NRF51_SPI_INT_READY;
+            break;
+        case NRF51_SPI_INTENSET:
+            s->inten |= value & NRF51_SPI_INT_READY;
+            break;
+        case NRF51_SPI_INTENCLR:
+            s->inten &= ~(value & NRF51_SPI_INT_READY);
+            break;
+        case NRF51_SPI_ENABLE:
+            if (value == NRF51_ENABLE_TWI &&
+                nrf51_periph_hand_over(SYS_BUS_DEVICE(s), s->peer, value)) {
+                break;
+            }
+            s->enable = value & 7;
+            if (s->enable != NRF51_ENABLE_SPI) {
+                fifo8_reset(&s->rx_fifo);
+            }
+            break;
+        case NRF51_SPI_PSELSCK:
+            s->pselsck = value;
+            break;
+        case NRF51_SPI_PSELMOSI:
+            s->pselmosi = value;
+            break;
+        case NRF51_SPI_PSELMISO:
+            s->pselmiso = value;
+            break;
+        case NRF51_SPI_TXD:
+            s->txd = value & 0xFF;
+            if (s->enable == NRF51_ENABLE_SPI) {
+                nrf51_spi_transfer(s);
+            }
+            break;
+        case NRF51_SPI_FREQUENCY:
+            s->frequency = value;
+            break;
+        case NRF51_SPI_CONFIG:
+            s->config = value & NRF51_SPI_CONFIG_MASK;
+            break;
+        case NRF51_SPI_POWER:
+            s->power = value & 1;
+            break;
+        case NRF51_SPI_RXD:
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: writing a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            break;
+    }
+
+    nrf51_spi_update_irq(s);
+}
+
+static const MemoryRegionOps nrf51_spi_ops = {
+    .read = nrf51_spi_read,
+    .write = nrf51_spi_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static int nrf51_spi_post_load(void *opaque, int version_id)
+{
+    NRF51SPIState *s = (NRF51SPIState *)opaque;
+
+    if (s->enable == NRF51_ENABLE_SPI) {
+        nrf51_periph_claim(SYS_BUS_DEVICE(s), s->peer);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_nrf51_spi = {
+    .name = TYPE_NRF51_SPI,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = nrf51_spi_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_FIFO8(rx_fifo, NRF51SPIState),
+        VMSTATE_UINT32(events_ready, NRF51SPIState),
+        VMSTATE_UINT32(inten, NRF51SPIState),
+        VMSTATE_UINT32(enable, NRF51SPIState),
+        VMSTATE_UINT32(pselsck, NRF51SPIState),
+        VMSTATE_UINT32(pselmosi, NRF51SPIState),
+        VMSTATE_UINT32(pselmiso, NRF51SPIState),
+        VMSTATE_UINT32(rxd, NRF51SPIState),
+        VMSTATE_UINT32(txd, NRF51SPIState),
+        VMSTATE_UINT32(frequency, NRF51SPIState),
+        VMSTATE_UINT32(config, NRF51SPIState),
+        VMSTATE_UINT32(power, NRF51SPIState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property nrf51_spi_properties[] = {
+    DEFINE_PROP_LINK("ppi", NRF51SPIState, ppi, TYPE_NRF51_PPI,
+                     NRF51PPIState *),
+    DEFINE_PROP_LINK("peer", NRF51SPIState, peer, TYPE_SYS_BUS_DEVICE,
+                     SysBusDevice *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_spi_reset(DeviceState *dev)
+{
+    NRF51SPIState *s = NRF51_SPI(dev);
+
+    fifo8_reset(&s->rx_fifo);
+    s->events_ready = 0;
+    s->inten = 0;
+    s->enable = 0;
+    s->pselsck = 0xFFFFFFFF;
+    s->pselmosi = 0xFFFFFFFF;
+    s->pselmiso = 0xFFFFFFFF;
+    s->rxd = 0;
+    s->txd = 0;
+    s->frequency = 0x04000000;
+    s->config = 0;
+    s->power = 1;
+}
+
+static void nrf51_spi_init(Object *obj)
+{
+    NRF51SPIState *s = NRF51_SPI(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    sysbus_init_irq(sdb, &s->irq);
+    nrf51_init_io(&s->iomem, obj, &nrf51_spi_ops, s,
+                  TYPE_NRF51_SPI, 0x1000);
+    sysbus_init_mmio(sdb, &s->iomem);
+    s->bus = ssi_create_bus(DEVICE(obj), "ssi");
+    fifo8_create(&s->rx_fifo, NRF51_SPI_RX_FIFO_SIZE);
+}
+
+static void nrf51_spi_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->reset = nrf51_spi_reset;
+    dc->props = nrf51_spi_properties;
+    dc->vmsd = &vmstate_nrf51_spi;
+}
+
+static const TypeInfo nrf51_spi_info = {
+    .name          = TYPE_NRF51_SPI,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51SPIState),
+    .instance_init = nrf51_spi_init,
+    .class_init    = nrf51_spi_class_init,
+};
+
+/**
+ * micro:bit fork server
+ *   Runs the firmware up to a marker store, checkpoints the whole machine
+ *   once and replays that checkpoint for every test case requested on the
+ *   control chardev: each received byte queues one case, and a 32-bit
+ *   little-endian exit status is sent back when the case writes EXIT
+ *   NOTE: QEMU's vCPU and I/O threads do not survive fork(), so a case is
+ *         started by reloading an in-memory snapshot instead, which only
+ *         copies back the RAM pages the last case dirtied
+ *   NOTE: if the checkpoint cannot be taken or restored, every pending
+ *         and later case is answered with MICROBIT_FORKSERVER_FAILED
+ */
+
+#define TYPE_MICROBIT_FORKSERVER "microbit_forkserver"
+#define MICROBIT_FORKSERVER(obj) \
+    OBJECT_CHECK(MICROBITForkserverState, (obj), TYPE_MICROBIT_FORKSERVER)
+
+#define MICROBIT_FORKSERVER_FAILED 0xffffffff
+
+enum {
+    MICROBIT_FORKSERVER_MARKER = 0x000,
+    MICROBIT_FORKSERVER_EXIT   = 0x004,
+};
+
+typedef enum {
+    /* Running towards the marker */
+    FORKSERVER_BOOTING,
+    /* Stopped at the marker, checkpoint not taken yet */
+    FORKSERVER_CHECKPOINT,
+    /* Stopped, waiting for a request */
+    FORKSERVER_IDLE,
+    /* Running a test case */
+    FORKSERVER_RUNNING,
+    /* Stopped after a test case, status not sent yet */
+    FORKSERVER_EXITING,
+    /* Stopped for good, the checkpoint is unusable */
+    FORKSERVER_FAILED,
+} MICROBITForkserverPhase;
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    CharBackend chr;
+    QEMUBH *bh;
+    VMChangeStateEntry *vmstate_change;
+    MemSnapshot *checkpoint;
+
+    /* Internal state, deliberately not part of the checkpoint */
+    MICROBITForkserverPhase phase;
+    uint32_t requests;
+    uint32_t status;
+} MICROBITForkserverState;
+
+static void microbit_forkserver_stop(MICROBITForkserverState *s,
+                                     MICROBITForkserverPhase phase)
+{
+    s->phase = phase;
+    qemu_system_vmstop_request_prepare();
+    qemu_system_vmstop_request(RUN_STATE_PAUSED);
+}
+
+static void microbit_forkserver_reply(MICROBITForkserverState *s,
+                                      uint32_t status)
+{
+    status = cpu_to_le32(status);
+    qemu_chr_fe_write_all(&s->chr, (const uint8_t *)&status, sizeof(status));
+}
+
+static void microbit_forkserver_fail(MICROBITForkserverState *s, Error *err)
+{
+    error_reportf_err(err, "microbit fork server: ");
+    s->phase = FORKSERVER_FAILED;
+}
+
+static void microbit_forkserver_bh(void *opaque)
+{
+    MICROBITForkserverState *s = opaque;
+    Error *err = NULL;
+
+    switch (s->phase) {
+    case FORKSERVER_CHECKPOINT:
+        s->checkpoint = mem_snapshot_save(true, &err);
+        if (!s->checkpoint) {
+            microbit_forkserver_fail(s, err);
+            break;
+        }
+        s->phase = FORKSERVER_IDLE;
+        break;
+    case FORKSERVER_EXITING:
+        microbit_forkserver_reply(s, s->status);
+        s->phase = FORKSERVER_IDLE;
+        break;
+    default:
+        break;
+    }
+
+    if (s->phase == FORKSERVER_FAILED) {
+        for (; s->requests; s->requests--) {
+            microbit_forkserver_reply(s, MICROBIT_FORKSERVER_FAILED);
+        }
+        return;
+    }
+
+    if (s->phase == FORKSERVER_IDLE && s->requests) {
+        s->requests--;
+        if (mem_snapshot_load(s->checkpoint, &err) < 0) {
+            microbit_forkserver_reply(s, MICROBIT_FORKSERVER_FAILED);
+            microbit_forkserver_fail(s, err);
+            qemu_bh_schedule(s->bh);
+            return;
+        }
+        /* No edge from where the last case stopped into this one */
+        if (tcg_tb_coverage == TB_COVERAGE_EDGES) {
+            tb_coverage_edge_reset();
+        }
+        s->phase = FORKSERVER_RUNNING;
+        vm_start();
+    }
+}
+
+static void microbit_forkserver_vm_state_change(void *opaque, int running,
+                                                RunState state)
+{
+    MICROBITForkserverState *s = opaque;
+
+    /* Snapshots cannot be taken from within the stop notification */
+    if (!running && (s->phase == FORKSERVER_CHECKPOINT ||
+                     s->phase == FORKSERVER_EXITING)) {
+        qemu_bh_schedule(s->bh);
+    }
+}
+
+static int microbit_forkserver_can_receive(void *opaque)
+{
+    return 1;
+}
+
+static void microbit_forkserver_receive(void *opaque, const uint8_t *buf,
+                                        int size)
+{
+    MICROBITForkserverState *s = opaque;
+
+    s->requests += size;
+    if (s->phase == FORKSERVER_IDLE || s->phase == FORKSERVER_FAILED) {
+        qemu_bh_schedule(s->bh);
+    }
+}
+
+static uint64_t microbit_forkserver_read(void *opaque, hwaddr offset,
+                                         unsigned size)
+{
+    switch (offset) {
+    case MICROBIT_FORKSERVER_MARKER:
+    case MICROBIT_FORKSERVER_EXIT:
+        return 0;
+    default:
+        qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                  "%s: reading a bad offset 0x%x\n",
+                                  __func__,
+                                  (int)offset);
+        return 0;
+    }
+}
+
+static void microbit_forkserver_write(void *opaque, hwaddr offset,
+                                      uint64_t value, unsigned size)
+{
+    MICROBITForkserverState *s = (MICROBITForkserverState *)opaque;
+
+    switch (offset) {
+    case MICROBIT_FORKSERVER_MARKER:
+        if (s->phase == FORKSERVER_BOOTING) {
+            microbit_forkserver_stop(s, FORKSERVER_CHECKPOINT);
+        }
+        break;
+    case MICROBIT_FORKSERVER_EXIT:
+        if (s->phase == FORKSERVER_RUNNING) {
+            s->status = value;
+            microbit_forkserver_stop(s, FORKSERVER_EXITING);
+        }
+        break;
+    default:
+        qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                  "%s: writing a bad offset 0x%x\n",
+                                  __func__,
+                                  (int)offset);
+        break;
+    }
+}
+
+static const MemoryRegionOps microbit_forkserver_ops = {
+    .read = microbit_forkserver_read,
+    .write = microbit_forkserver_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static Property microbit_forkserver_properties[] = {
+    DEFINE_PROP_CHR("chardev", MICROBITForkserverState, chr),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void microbit_forkserver_realize(DeviceState *dev, Error **errp)
+{
+    MICROBITForkserverState *s = MICROBIT_FORKSERVER(dev);
+
+    if (!qemu_chr_fe_backend_connected(&s->chr)) {
+        error_setg(errp, "%s: chardev is required", __func__);
+        return;
+    }
+    s->bh = qemu_bh_new(microbit_forkserver_bh, s);
+    s->vmstate_change = qemu_add_vm_change_state_handler(
+        microbit_forkserver_vm_state_change, s);
+    qemu_chr_fe_set_handlers(&s->chr, microbit_forkserver_can_receive,
+                             microbit_forkserver_receive, NULL, NULL,
+                             s, NULL, true);
+}
+
+static void microbit_forkserver_init(Object *obj)
+{
+    MICROBITForkserverState *s = MICROBIT_FORKSERVER(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    mmio_stats_init_io(&s->iomem, obj, &microbit_forkserver_ops, s,
+                       TYPE_MICROBIT_FORKSERVER, 0x1000);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void microbit_forkserver_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = microbit_forkserver_realize;
+    dc->props = microbit_forkserver_properties;
+}
+
+static const TypeInfo microbit_forkserver_info = {
+    .name          = TYPE_MICROBIT_FORKSERVER,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(MICROBITForkserverState),
+    .instance_init = microbit_forkserver_init,
+    .class_init    = microbit_forkserver_class_init,
+};
+
+/**
+ * micro:bit test device
+ *   Lets test firmware finish in one store: the firmware points REPORT at
+ *   a buffer of REPORT_LEN bytes holding its results, then writes its
+ *   status to EXIT.  The report is copied to the chardev and QEMU exits
+ *   with that status.
+ */
+
+#define TYPE_MICROBIT_TESTDEV "microbit_testdev"
+#define MICROBIT_TESTDEV(obj) \
+    OBJECT_CHECK(MICROBITTestdevState, (obj), TYPE_MICROBIT_TESTDEV)
+
+/* Larger than all of RAM, so any sensible report fits */
+#define MICROBIT_TESTDEV_MAX_REPORT (64 * 1024)
+
+enum {
+    MICROBIT_TESTDEV_REPORT     = 0x000,
+    MICROBIT_TESTDEV_REPORT_LEN = 0x004,
+    MICROBIT_TESTDEV_EXIT       = 0x008,
+};
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    MemoryRegion *memory;
+    AddressSpace as;
+    CharBackend chr;
+    uint32_t report;
+    uint32_t report_len;
+} MICROBITTestdevState;
+
+static void microbit_testdev_exit(MICROBITTestdevState *s, uint32_t status)
+{
+    uint32_t len = s->report_len;
+    uint8_t *buf;
+
+    if (len > MICROBIT_TESTDEV_MAX_REPORT) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: report of %" PRIu32 " bytes truncated\n",
+                      __func__, len);
+        len = MICROBIT_TESTDEV_MAX_REPORT;
+    }
+    buf = g_malloc(len);
+    if (address_space_read(&s->as, s->report, MEMTXATTRS_UNSPECIFIED,
+                           buf, len) != MEMTX_OK) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: report at 0x%" PRIx32 " is not readable\n",
+                      __func__, s->report);
+        len = 0;
+    }
+    qemu_chr_fe_write_all(&s->chr, buf, len);
+    g_free(buf);
+    exit(status);
+}
+
+static uint64_t microbit_testdev_read(void *opaque, hwaddr offset,
+                                      unsigned size)
+{
+    MICROBITTestdevState *s = (MICROBITTestdevState *)opaque;
+
+    switch (offset) {
+        case MICROBIT_TESTDEV_REPORT:
+            return s->report;
+        case MICROBIT_TESTDEV_REPORT_LEN:
+            return s->report_len;
+        case MICROBIT_TESTDEV_EXIT:
+            return 0;
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: reading a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            return 0;
+    }
+}
+
+static void microbit_testdev_write(void *opaque, hwaddr offset,
+                                   uint64_t value, unsigned size)
+{
+    MICROBITTestdevState *s = (MICROBITTestdevState *)opaque;
+
+    switch (offset) {
+        case MICROBIT_TESTDEV_REPORT:
+            s->report = value;
+            break;
+        case MICROBIT_TESTDEV_REPORT_LEN:
+            s->report_len = value;
+            break;
+        case MICROBIT_TESTDEV_EXIT:
+            microbit_testdev_exit(s, value);
+            break;
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: writing a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            break;
+    }
+}
+
+static const MemoryRegionOps microbit_testdev_ops = {
+    .read = microbit_testdev_read,
+    .write = microbit_testdev_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static const VMStateDescription vmstate_microbit_testdev = {
+    .name = TYPE_MICROBIT_TESTDEV,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(report, MICROBITTestdevState),
+        VMSTATE_UINT32(report_len, MICROBITTestdevState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property microbit_testdev_properties[] = {
+    DEFINE_PROP_CHR("chardev", MICROBITTestdevState, chr),
+    DEFINE_PROP_LINK("memory", MICROBITTestdevState, memory,
+                     TYPE_MEMORY_REGION, MemoryRegion *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void microbit_testdev_realize(DeviceState *dev, Error **errp)
+{
+    MICROBITTestdevState *s = MICROBIT_TESTDEV(dev);
+
+    if (!qemu_chr_fe_backend_connected(&s->chr)) {
+        error_setg(errp, "%s: chardev is required", __func__);
+        return;
+    }
+    address_space_init(&s->as, s->memory ? s->memory : get_system_memory(),
+                       TYPE_MICROBIT_TESTDEV);
+}
+
+static void microbit_testdev_reset(DeviceState *dev)
+{
+    MICROBITTestdevState *s = MICROBIT_TESTDEV(dev);
+
+    s->report = 0;
+    s->report_len = 0;
+}
+
+static void microbit_testdev_init(Object *obj)
+{
+    MICROBITTestdevState *s = MICROBIT_TESTDEV(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    mmio_stats_init_io(&s->iomem, obj, &microbit_testdev_ops, s,
+                       TYPE_MICROBIT_TESTDEV, 0x1000);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void microbit_testdev_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = microbit_testdev_realize;
+    dc->reset = microbit_testdev_reset;
+    dc->vmsd = &vmstate_microbit_testdev;
+    dc->props = microbit_testdev_properties;
+}
+
+static const TypeInfo microbit_testdev_info = {
+    .name          = TYPE_MICROBIT_TESTDEV,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(MICROBITTestdevState),
+    .instance_init = microbit_testdev_init,
+    .class_init    = microbit_testdev_class_init,
+};
+
+/**
+ * micro:bit mailbox
+ *   Moves bulk test data in and out with one store per batch.  The
+ *   harness connects to the chardev, a UNIX socket, and is passed a memfd
+ *   of `size` bytes along with that size as a little-endian uint32.  The
+ *   firmware keeps a ring of RING_SIZE descriptors at RING, each four
+ *   little-endian words:
+ *     addr    its buffer
+ *     len     the buffer's length in bytes
+ *     offset  where the data goes to or comes from in the memfd
+ *     flags   TO_HOST to copy the buffer to the memfd, else the other way
+ *             round; DONE, and ERROR if the copy did not fit either side,
+ *             are set once served
+ *   It writes the number of descriptors it has posted so far to DOORBELL.
+ *   The device serves the descriptors up to that one in order, then
+ *   sends the harness the number served so far, which DONE also reads.
+ *   NOTE: the memfd is not migrated; what goes where in it is up to the
+ *         harness and the firmware
+ */
+
+#define TYPE_MICROBIT_MAILBOX "microbit_mailbox"
+#define MICROBIT_MAILBOX(obj) \
+    OBJECT_CHECK(MICROBITMailboxState, (obj), TYPE_MICROBIT_MAILBOX)
+
+enum {
+    MICROBIT_MAILBOX_RING      = 0x000,
+    MICROBIT_MAILBOX_RING_SIZE = 0x004,
+    MICROBIT_MAILBOX_DOORBELL  = 0x008,
+    MICROBIT_MAILBOX_DONE      = 0x00C,
+    MICROBIT_MAILBOX_SHM_SIZE  = 0x010,
+};
+
+enum {
+    MICROBIT_MAILBOX_DESC_SIZE = 16,
+    MICROBIT_MAILBOX_TO_HOST   = 1u << 0,
+    MICROBIT_MAILBOX_ERROR     = 1u << 30,
+    MICROBIT_MAILBOX_DONE_FLAG = 1u << 31,
+};
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    MemoryRegion iomem;
+    MemoryRegion *memory;
+    AddressSpace as;
+    CharBackend chr;
+    uint32_t size;
+    int fd;
+    uint8_t *shm;
+    uint32_t ring;
+    uint32_t ring_size;
+    /* Descriptors served since the ring was set up */
+    uint32_t done;
+} MICROBITMailboxState;
+
+/* Copy between guest memory at @addr and the memfd at @offset */
+static bool microbit_mailbox_copy(MICROBITMailboxState *s, hwaddr addr,
+                                  uint32_t len, uint32_t offset, bool to_host)
+{
+    if (offset > s->size || len > s->size - offset) {
+        return false;
+    }
+    while (len) {
+        hwaddr plen = len;
+        void *buf = address_space_map(&s->as, addr, &plen, !to_host);
+
+        if (!buf) {
+            return false;
+        }
+        if (to_host) {
+            memcpy(s->shm + offset, buf, plen);
+        } else {
+            memcpy(buf, s->shm + offset, plen);
+        }
+        address_space_unmap(&s->as, buf, plen, !to_host, plen);
+        addr += plen;
+        offset += plen;
+        len -= plen;
+    }
+    return true;
+}
+
+static void microbit_mailbox_doorbell(MICROBITMailboxState *s,
+                                      uint32_t posted)
+{
+    uint32_t done;
+
+    if (!s->ring_size || posted - s->done > s->ring_size) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: %" PRIu32 " descriptors posted on a ring of %"
+                      PRIu32 "\n", __func__, posted - s->done, s->ring_size);
+        return;
+    }
+    while (s->done != posted) {
+        hwaddr addr = s->ring + (hwaddr)(s->done % s->ring_size) *
+                                MICROBIT_MAILBOX_DESC_SIZE;
+        hwaddr len = MICROBIT_MAILBOX_DESC_SIZE;
+        uint32_t *desc = address_space_map(&s->as, addr, &len, true);
+        uint32_t flags;
+
+        if (!desc || len < MICROBIT_MAILBOX_DESC_SIZE) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "%s: descriptor at 0x%" HWADDR_PRIx
+                          " is not in RAM\n", __func__, addr);
+            if (desc) {
+                address_space_unmap(&s->as, desc, len, true, 0);
+            }
+            break;
+        }
+        flags = le32_to_cpu(desc[3]);
+        if (!microbit_mailbox_copy(s, le32_to_cpu(desc[0]),
+                                   le32_to_cpu(desc[1]), le32_to_cpu(desc[2]),
+                                   flags & MICROBIT_MAILBOX_TO_HOST)) {
+            flags |= MICROBIT_MAILBOX_ERROR;
+        }
+        desc[3] = cpu_to_le32(flags | MICROBIT_MAILBOX_DONE_FLAG);
+        address_space_unmap(&s->as, desc, len, true, len);
+        s->done++;
+    }
+
+    done = cpu_to_le32(s->done);
+    qemu_chr_fe_write_all(&s->chr, (const uint8_t *)&done, sizeof(done));
+}
+
+/* Hands each harness that connects the memfd */
+static void microbit_mailbox_event(void *opaque, int event)
+{
+    MICROBITMailboxState *s = opaque;
+    uint32_t size = cpu_to_le32(s->size);
+
+    if (event != CHR_EVENT_OPENED) {
+        return;
+    }
+    qemu_chr_fe_set_msgfds(&s->chr, &s->fd, 1);
+    qemu_chr_fe_write_all(&s->chr, (const uint8_t *)&size, sizeof(size));
+}
+
+static uint64_t microbit_mailbox_read(void *opaque, hwaddr offset,
+                                      unsigned size)
+{
+    MICROBITMailboxState *s = (MICROBITMailboxState *)opaque;
+
+    switch (offset) {
+        case MICROBIT_MAILBOX_RING:
+            return s->ring;
+        case MICROBIT_MAILBOX_RING_SIZE:
+            return s->ring_size;
+        case MICROBIT_MAILBOX_DOORBELL:
+        case MICROBIT_MAILBOX_DONE:
+            return s->done;
+        case MICROBIT_MAILBOX_SHM_SIZE:
+            return s->size;
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: reading a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            return 0;
+    }
+}
+
+static void microbit_mailbox_write(void *opaque, hwaddr offset,
+                                   uint64_t value, unsigned size)
+{
+    MICROBITMailboxState *s = (MICROBITMailboxState *)opaque;
+
+    switch (offset) {
+        /* A new ring starts out empty */
+        case MICROBIT_MAILBOX_RING:
+            s->ring = value;
+            s->done = 0;
+            break;
+        case MICROBIT_MAILBOX_RING_SIZE:
+            s->ring_size = value;
+            s->done = 0;
+            break;
+        case MICROBIT_MAILBOX_DOORBELL:
+            microbit_mailbox_doorbell(s, value);
+            break;
+        default:
+            qemu_log_mask_ratelimited(LOG_GUEST_ERROR, offset,
+                                      "%s: writing a bad offset 0x%x\n",
+                                      __func__,
+                                      (int)offset);
+            break;
+    }
+}
+
+static const MemoryRegionOps microbit_mailbox_ops = {
+    .read = microbit_mailbox_read,
+    .write = microbit_mailbox_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static const VMStateDescription vmstate_microbit_mailbox = {
+    .name = TYPE_MICROBIT_MAILBOX,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ring, MICROBITMailboxState),
+        VMSTATE_UINT32(ring_size, MICROBITMailboxState),
+        VMSTATE_UINT32(done, MICROBITMailboxState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property microbit_mailbox_properties[] = {
+    DEFINE_PROP_CHR("chardev", MICROBITMailboxState, chr),
+    DEFINE_PROP_UINT32("size", MICROBITMailboxState, size, 1024 * 1024),
+    DEFINE_PROP_LINK("memory", MICROBITMailboxState, memory,
+                     TYPE_MEMORY_REGION, MemoryRegion *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void microbit_mailbox_realize(DeviceState *dev, Error **errp)
+{
+    MICROBITMailboxState *s = MICROBIT_MAILBOX(dev);
+    Chardev *chr = qemu_chr_fe_get_driver(&s->chr);
+
+    if (!chr || !qemu_chr_has_feature(chr, QEMU_CHAR_FEATURE_FD_PASS)) {
+        error_setg(errp, "%s: chardev must be a UNIX socket", __func__);
+        return;
+    }
+    if (!s->size) {
+        error_setg(errp, "%s: size must not be 0", __func__);
+        return;
+    }
+    s->shm = qemu_memfd_alloc(TYPE_MICROBIT_MAILBOX, s->size,
+                              F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL,
+                              &s->fd, errp);
+    if (!s->shm) {
+        return;
+    }
+    address_space_init(&s->as, s->memory ? s->memory : get_system_memory(),
+                       TYPE_MICROBIT_MAILBOX);
+    qemu_chr_fe_set_handlers(&s->chr, NULL, NULL, microbit_mailbox_event,
+                             NULL, s, NULL, true);
+}
+
+static void microbit_mailbox_reset(DeviceState *dev)
+{
+    MICROBITMailboxState *s = MICROBIT_MAILBOX(dev);
+
+    s->ring = 0;
+    s->ring_size = 0;
+    s->done = 0;
+}
+
+static void microbit_mailbox_init(Object *obj)
+{
+    MICROBITMailboxState *s = MICROBIT_MAILBOX(obj);
+    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+
+    s->fd = -1;
+    mmio_stats_init_io(&s->iomem, obj, &microbit_mailbox_ops, s,
+                       TYPE_MICROBIT_MAILBOX, 0x1000);
+    sysbus_init_mmio(sdb, &s->iomem);
+}
+
+static void microbit_mailbox_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = microbit_mailbox_realize;
+    dc->reset = microbit_mailbox_reset;
+    dc->vmsd = &vmstate_microbit_mailbox;
+    dc->props = microbit_mailbox_properties;
+}
+
+static const TypeInfo microbit_mailbox_info = {
+    .name          = TYPE_MICROBIT_MAILBOX,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(MICROBITMailboxState),
+    .instance_init = microbit_mailbox_init,
+    .class_init    = microbit_mailbox_class_init,
+};
+
+static void nrf51_peri_init_types(void)
+{
+    type_register_static(&microbit_led_matrix_info);
+    type_register_static(&microbit_dashboard_info);
+    type_register_static(&nrf51_gpio_info);
+    type_register_static(&microbit_neopixel_info);
+    type_register_static(&microbit_wire_info);
+    type_register_static(&nrf51_periph_info);
+    type_register_static(&nrf51_rng_info);
+    type_register_static(&nrf51_temp_info);
+    type_register_static(&nrf51_ecb_info);
+    type_register_static(&nrf51_ccm_info);
+    type_register_static(&nrf51_aar_info);
+    type_register_static(&nrf51_wdt_info);
+    type_register_static(&nrf51_nvmc_info);
+    type_register_static(&nrf51_ficr_info);
+    type_register_static(&nrf51_cpm_info);
+    type_register_static(&nrf51_activity_info);
+    type_register_static(&nrf51_ppi_info);
+    type_register_static(&nrf51_timer_info);
+    type_register_static(&nrf51_rtc_info);
+    type_register_static(&nrf51_gpiote_info);
+    type_register_static(&nrf51_uart_info);
+    type_register_static(&nrf51_radio_info);
+    type_register_static(&nrf51_adc_info);
+    type_register_static(&nrf51_lpcomp_info);
+    type_register_static(&nrf51_qdec_info);
+    type_register_static(&nrf51_twi_info);
+    type_register_static(&mma8653_info);
+    type_register_static(&mag3110_info);
+    type_register_static(&nrf51_spi_info);
+    type_register_static(&microbit_forkserver_info);
+    type_register_static(&microbit_testdev_info);
+    type_register_static(&microbit_mailbox_info);
+}
+
+type_init(nrf51_peri_init_types)
+
+
+/**
+ * MICROBIT WEBSOCKET
+ *   NOTE: a browser front end for the board, without a framebuffer. A
+ *         single client connects with the "binary" subprotocol and gets
+ *         the board's state pushed as small binary messages, at most
+ *         MICROBIT_WEBSOCKET_PERIOD_MS apart and only when it changed,
+ *         so pin activity faster than that is coalesced. Every message
+ *         carries the whole state, which lets a client that falls
+ *         behind simply be dropped. A new client replaces the old one.
+ *
+ * Messages to the client, little-endian:
+ *   0x01 LED      u32 LED state, bit (x + 5 * y) for column x, row y,
+ *                 then 25 brightness levels 0..15 in the same order
+ *   0x02 PINS     u32 IN, u32 last OUT written, u32 DIR
+ * Messages from the client:
+ *   0x81 INPUT    u8 pin, u8 level; button A is P0.17, button B P0.26,
+ *                 both active low
+ *
+ * Input goes through the GPIO's record/replay path, as with the
+ * microbit-gpio-inject command.
+ */
+
+#define TYPE_MICROBIT_WEBSOCKET "microbit_websocket"
+#define MICROBIT_WEBSOCKET(obj) \
+    OBJECT_CHECK(MICROBITWebsocketState, (obj), TYPE_MICROBIT_WEBSOCKET)
+
+#define MICROBIT_WEBSOCKET_PERIOD_MS    33
+
+enum {
+    MICROBIT_WEBSOCKET_LED   = 0x01,
+    MICROBIT_WEBSOCKET_PINS  = 0x02,
+    MICROBIT_WEBSOCKET_INPUT = 0x81,
+    MICROBIT_WEBSOCKET_LED_SIZE = 1 + 4 + MICROBIT_LED_NUM,
+    MICROBIT_WEBSOCKET_PINS_SIZE = 1 + 3 * 4,
+    MICROBIT_WEBSOCKET_INPUT_SIZE = 3,
+};
+
+typedef struct {
+    /* Private */
+    DeviceState parent;
+
+    /* Public */
+    char *addr;
+    MICROBITLedMatrixState *led;
+    NRF51GPIOState *gpio;
+    QIONetListener *listener;
+    /* The client, once its handshake is done */
+    QIOChannel *ioc;
+    bool ready;
+    guint watch;
+    QEMUTimer *timer;
+    Notifier out_notifier;
+    uint32_t out;
+
+    MICROBITLedWindow window;
+    uint8_t level[MICROBIT_LED_NUM];
+    /* What the client was last sent */
+    uint32_t sent_state;
+    uint8_t sent_level[MICROBIT_LED_NUM];
+    uint32_t sent_pins[3];
+
+    uint8_t rx[MICROBIT_WEBSOCKET_INPUT_SIZE];
+    size_t rx_len;
+} MICROBITWebsocketState;
+
+static void microbit_websocket_close(MICROBITWebsocketState *s)
+{
+    if (!s->ioc) {
+        return;
+    }
+    if (s->watch) {
+        g_source_remove(s->watch);
+        s->watch = 0;
+    }
+    timer_del(s->timer);
+    qio_channel_close(s->ioc, NULL);
+    object_unref(OBJECT(s->ioc));
+    s->ioc = NULL;
+    s->ready = false;
+}
+
+/* False, with the client gone, if it could not take the whole message */
+static bool microbit_websocket_send(MICROBITWebsocketState *s,
+                                    const uint8_t *buf, size_t len)
+{
+    if (qio_channel_write(s->ioc, (const char *)buf, len, NULL) != len) {
+        microbit_websocket_close(s);
+        return false;
+    }
+    return true;
+}
+
+static void microbit_websocket_push(MICROBITWebsocketState *s, bool all)
+{
+    uint8_t buf[MAX(MICROBIT_WEBSOCKET_LED_SIZE,
+                    MICROBIT_WEBSOCKET_PINS_SIZE)];
+    uint32_t state;
+    uint32_t pins[3];
+
+    nrf51_lock();
+    state = s->led->led_state;
+    pins[0] = s->gpio->in;
+    pins[1] = s->out;
+    pins[2] = s->gpio->dir;
+    microbit_led_matrix_levels(s->led, &s->window, s->level);
+    nrf51_unlock();
+    if (all || state != s->sent_state ||
+        memcmp(s->level, s->sent_level, sizeof(s->level))) {
+        buf[0] = MICROBIT_WEBSOCKET_LED;
+        stl_le_p(buf + 1, state);
+        memcpy(buf + 5, s->level, sizeof(s->level));
+        if (!microbit_websocket_send(s, buf, MICROBIT_WEBSOCKET_LED_SIZE)) {
+            return;
+        }
+        s->sent_state = state;
+        memcpy(s->sent_level, s->level, sizeof(s->level));
+    }
+
+    if (all || memcmp(pins, s->sent_pins, sizeof(pins))) {
+        buf[0] = MICROBIT_WEBSOCKET_PINS;
+        for (int i = 0; i < 3; i++) {
+            stl_le_p(buf + 1 + 4 * i, pins[i]);
+        }
+        if (!microbit_websocket_send(s, buf, MICROBIT_WEBSOCKET_PINS_SIZE)) {
+            return;
+        }
+        memcpy(s->sent_pins, pins, sizeof(pins));
+    }
+}
+
+static void microbit_websocket_tick(void *opaque)
+{
+    MICROBITWebsocketState *s = MICROBIT_WEBSOCKET(opaque);
+
+    if (!s->ready) {
+        return;
+    }
+    microbit_websocket_push(s, false);
+    if (s->ready) {
+        timer_mod(s->timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  MICROBIT_WEBSOCKET_PERIOD_MS);
+    }
+}
+
+/* Drive input pin `pin` to `level` now, as the monitor would */
+static void microbit_websocket_input(MICROBITWebsocketState *s,
+                                     unsigned int pin, bool level)
+{
+    uint8_t buf[1 + NRF51_GPIO_REPLAY_EVENT_SIZE];
+
+    if (pin >= 32 || replay_mode == REPLAY_MODE_PLAY) {
+        return;
+    }
+    buf[0] = 1;
+    stq_le_p(buf + 1, 0);
+    stl_le_p(buf + 9, 1u << pin);
+    buf[13] = level;
+    replay_device_event(s->gpio->replay, buf, sizeof(buf));
+}
+
+static gboolean microbit_websocket_readable(QIOChannel *ioc,
+                                            GIOCondition condition,
+                                            gpointer opaque)
+{
+    MICROBITWebsocketState *s = MICROBIT_WEBSOCKET(opaque);
+    ssize_t n;
+
+    for (;;) {
+        n = qio_channel_read(ioc, (char *)s->rx + s->rx_len,
+                             sizeof(s->rx) - s->rx_len, NULL);
+        if (n == QIO_CHANNEL_ERR_BLOCK) {
+            return TRUE;
+        }
+        if (n <= 0) {
+            /* The source goes away with this return */
+            s->watch = 0;
+            microbit_websocket_close(s);
+            return FALSE;
+        }
+        s->rx_len += n;
+        if (s->rx_len < sizeof(s->rx)) {
+            continue;
+        }
+        s->rx_len = 0;
+        if (s->rx[0] == MICROBIT_WEBSOCKET_INPUT) {
+            microbit_websocket_input(s, s->rx[1], s->rx[2]);
+        }
+    }
+}
+
+static void microbit_websocket_handshake_done(QIOTask *task, gpointer opaque)
+{
+    MICROBITWebsocketState *s = MICROBIT_WEBSOCKET(opaque);
+    Error *err = NULL;
+
+    /* Replaced by a newer client meanwhile */
+    if (qio_task_get_source(task) != OBJECT(s->ioc)) {
+        return;
+    }
+    if (qio_task_propagate_error(task, &err)) {
+        warn_report_err(err);
+        microbit_websocket_close(s);
+        return;
+    }
+
+    s->ready = true;
+    s->rx_len = 0;
+    s->watch = qio_channel_add_watch(s->ioc, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                     microbit_websocket_readable, s, NULL);
+    nrf51_lock();
+    microbit_led_matrix_restart(s->led, &s->window,
+                                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    nrf51_unlock();
+    microbit_websocket_push(s, true);
+    if (s->ready) {
+        timer_mod(s->timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  MICROBIT_WEBSOCKET_PERIOD_MS);
+    }
+}
+
+static void microbit_websocket_accept(QIONetListener *listener,
+                                      QIOChannelSocket *sioc,
+                                      gpointer opaque)
+{
+    MICROBITWebsocketState *s = MICROBIT_WEBSOCKET(opaque);
+    QIOChannelWebsock *wioc;
+
+    microbit_websocket_close(s);
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
+    wioc = qio_channel_websock_new_server(QIO_CHANNEL(sioc));
+    qio_channel_set_name(QIO_CHANNEL(wioc), "microbit-websocket");
+    s->ioc = QIO_CHANNEL(wioc);
+    qio_channel_websock_handshake(wioc, microbit_websocket_handshake_done,
+                                  s, NULL);
+}
+
+static void microbit_websocket_out_written(Notifier *n, void *data)
+{
+    MICROBITWebsocketState *s = container_of(n, MICROBITWebsocketState,
+                                             out_notifier);
+
+    s->out = *(uint32_t *)data;
+}
+
+static void microbit_websocket_realize(DeviceState *dev, Error **errp)
+{
+    MICROBITWebsocketState *s = MICROBIT_WEBSOCKET(dev);
+    SocketAddress *addr;
+
+    if (!s->addr || !s->led || !s->gpio) {
+        error_setg(errp, "%s: addr, led-matrix and gpio are required",
+                   __func__);
+        return;
+    }
+    addr = socket_parse(s->addr, errp);
+    if (!addr) {
+        return;
+    }
+    s->listener = qio_net_listener_new();
+    qio_net_listener_set_name(s->listener, "microbit-websocket-listen");
+    if (qio_net_listener_open_sync(s->listener, addr, errp) < 0) {
+        qapi_free_SocketAddress(addr);
+        object_unref(OBJECT(s->listener));
+        s->listener = NULL;
+        return;
+    }
+    qapi_free_SocketAddress(addr);
+    qio_net_listener_set_client_func(s->listener, microbit_websocket_accept,
+                                     s, NULL);
+
+    s->timer = timer_new_ms(QEMU_CLOCK_REALTIME, microbit_websocket_tick, s);
+    s->out_notifier.notify = microbit_websocket_out_written;
+    notifier_list_add(&s->gpio->out_notifiers, &s->out_notifier);
+}
+
+static Property microbit_websocket_properties[] = {
+    DEFINE_PROP_STRING("addr", MICROBITWebsocketState, addr),
+    DEFINE_PROP_LINK("led-matrix", MICROBITWebsocketState, led,
+                     TYPE_MICROBIT_LED_MATRIX, MICROBITLedMatrixState *),
+    DEFINE_PROP_LINK("gpio", MICROBITWebsocketState, gpio,
+                     TYPE_NRF51_GPIO, NRF51GPIOState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void microbit_websocket_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = microbit_websocket_realize;
+    dc->props = microbit_websocket_properties;
+    /* Only the board creates it, from its websocket option */
+    dc->user_creatable = false;
+}
+
+static const TypeInfo microbit_websocket_info = {
+    .name          = TYPE_MICROBIT_WEBSOCKET,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(MICROBITWebsocketState),
+    .class_init    = microbit_websocket_class_init,
+};
+
+
+/**
+ * micro:bit machine type
+ */
+
+
+/* A device or bus whose reset method a fast reset calls */
+typedef struct {
+    DeviceState *dev;
+    BusState *bus;
+} MicrobitResetEntry;
+
+/* Memory as the first reset left it, restored by a fast reset */
+typedef struct {
+    hwaddr addr;
+    uint64_t size;
+    uint8_t *data;
+} MicrobitResetImage;
+
+typedef struct {
+    /* Private */
+    MachineState parent;
+
+    /* Public */
+    /* Chardev id of the fork server control channel, if any */
+    char *forkserver;
+    /* Chardev id the test device writes its report to, if any */
+    char *testdev;
+    /* UNIX socket chardev id the mailbox passes its memfd on, if any */
+    char *mailbox;
+    /* Jump virtual time to the next deadline while the CPU sleeps */
+    bool idle_skip;
+    /* ... or while it spins on a timer-driven peripheral register */
+    bool poll_skip;
+    /* The vCPU thread runs the device timers between TBs */
+    bool vcpu_timers;
+    /* Path prefix of the per-thread MMIO trace rings, if any */
+    char *mmio_ring;
+    /* Raw flash dump mapped copy-on-write instead of loading -kernel */
+    char *flash_image;
+    /* Flash and UICR kept in this file, mapped shared unless scratch */
+    char *flash_backing;
+    bool flash_scratch;
+    /* NVMC erases take real time, spent with the CPU stalled */
+    bool flash_latency;
+    /* Translate the firmware's reachable code before it runs */
+    bool pretranslate;
+    /* File of the flash blocks to translate at reset, saved at exit */
+    char *tb_cache;
+    Notifier tb_cache_exit;
+    /* Let translated code access RAM without the softmmu TLB */
+    bool flat_ram;
+    /* Track which RAM pages the firmware writes */
+    bool ram_usage;
+    /* Address the LED/pin push server listens on, if any */
+    char *websocket;
+    /* Run the firmware's division, soft-float and memcpy/memset as host code */
+    bool hle;
+    /* Sample the MicroPython VM's bytecode position at each dispatch */
+    bool mpy_profile;
+    /* Emulate the SoftDevice the application calls through SVCs */
+    bool softdevice_hle;
+    /* One console for the LED matrices of all the boards */
+    bool dashboard;
+    /* Reset from a list taken at the first reset, see microbit_reset() */
+    bool fast_reset;
+    GArray *reset_list;
+    MicrobitResetImage reset_images[2];
+
+} MICROBITMachineState;
+
+typedef struct {
+    /* Private */
+    MachineClass parent;
+
+    /* Public */
+    /* The RAM sizes the board came with */
+    uint64_t ram_sizes[2];
+    /* Universal hex board IDs whose blocks it runs */
+    uint16_t hex_board_min;
+    uint16_t hex_board_max;
+} MICROBITMachineClass;
+
+#define TYPE_MICROBIT_MACHINE "micro:bit"
+#define MICROBIT_MACHINE(obj) \
+    OBJECT_CHECK(MICROBITMachineState, (obj), TYPE_MICROBIT_MACHINE)
+
+#define MICROBIT_MACHINE_GET_CLASS(obj) \
+    OBJECT_GET_CLASS(MICROBITMachineClass, (obj), TYPE_MICROBIT_MACHINE)
+
+#define MICROBIT_MACHINE_CLASS(klass) \
+    OBJECT_CLASS_CHECK(MICROBITMachineClass, (klass), TYPE_MICROBIT_MACHINE)
+
+enum {
+    STARTUP_ADDR = 0x00018000,
+    VECTOR_SIZE  = 0xC0,
+    NUM_IRQ      = 64,
+
+    /* Memory regions */
+    CODE_LOADER_BASE = 0x00000000,
+    CODE_LOADER_SIZE = 0x00018000,
+    CODE_KERNEL_BASE = 0x00018000,
+    CODE_KERNEL_SIZE = 0x00028000,
+    RAM_BASE         = 0x20000000,
+
+    /* ABP Peripherals */
+    ABP_PERI_BASE = 0x40000000,
+    ABP_PERI_SIZE = 0x00080000,
+    POWER_BASE    = 0x40000000,
+    CLOCK_BASE    = 0x40000000,
+    MPU_BASE      = 0x40000000,
+    AMLI_BASE     = 0x40000000,
+    RADIO_BASE    = 0x40001000,
+    UART0_BASE    = 0x40002000,
+    SPI0_BASE     = 0x40003000,
+    TWI0_BASE     = 0x40003000,
+    SPI1_BASE     = 0x40004000,
+    TWI1_BASE     = 0x40004000,
+    SPIS1_BASE    = 0x40004000,
+    SPIM1_BASE    = 0x40004000,
+    GPIOTE_BASE   = 0x40006000,
+    ADC_BASE      = 0x40007000,
+    TIMER0_BASE   = 0x40008000,
+    TIMER1_BASE   = 0x40009000,
+    TIMER2_BASE   = 0x4000A000,
+    RTC0_BASE     = 0x4000B000,
+    TEMP_BASE     = 0x4000C000,
+    RNG_BASE      = 0x4000D000,
+    ECB_BASE      = 0x4000E000,
+    AAR_BASE      = 0x4000F000,
+    CCM_BASE      = 0x4000F000,
+    WDT_BASE      = 0x40010000,
+    RTC1_BASE     = 0x40011000,
+    QDEC_BASE     = 0x40012000,
+    LPCOMP_BASE   = 0x40013000,
+    SWI_BASE      = 0x40014000,
+    NVMC_BASE     = 0x4001E000,
+    PPI_BASE      = 0x4001F000,
+    GPIO_BASE     = 0x50000000,
+    FICR_BASE     = 0x10000000,
+    UICR_BASE     = 0x10001000,
+    MAILBOX_BASE  = 0x400FD000,
+    TESTDEV_BASE  = 0x400FE000,
+    FORKSERVER_BASE = 0x400FF000,
+
+    /* Boards a microbit-fleet machine runs at most */
+    MICROBIT_FLEET_MAX_BOARDS = 64,
+};
+
+static void microbit_cpu_reset(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+
+    cpu_reset(CPU(cpu));
+}
+
+/* Intel HEX record types, including the micro:bit universal hex ones */
+enum {
+    HEX_REC_DATA          = 0x00,
+    HEX_REC_EOF           = 0x01,
+    HEX_REC_EXT_SEG_ADDR  = 0x02,
+    HEX_REC_START_SEG     = 0x03,
+    HEX_REC_EXT_LIN_ADDR  = 0x04,
+    HEX_REC_START_LIN     = 0x05,
+    HEX_REC_BLOCK_START   = 0x0A,
+    HEX_REC_BLOCK_END     = 0x0B,
+    HEX_REC_PADDING       = 0x0C,
+    HEX_REC_CUSTOM_DATA   = 0x0D,
+    HEX_REC_OTHER_DATA    = 0x0E,
+
+    HEX_MAX_RECORD = 255,
+    HEX_BOARD_ANY  = -1,
+};
+
+/* Board IDs of the machine's micro:bit in universal hex block start
+ * records: 0x9900 and 0x9901 for the nRF51 boards, 0x9903 to 0x9906 for
+ * the V2.  Set by microbit_check_config().
+ */
+static int microbit_hex_board_min = 0x9900;
+static int microbit_hex_board_max = 0x9901;
+
+static bool microbit_hex_board_matches(int board_id)
+{
+    return board_id == HEX_BOARD_ANY ||
+           (board_id >= microbit_hex_board_min &&
+            board_id <= microbit_hex_board_max);
+}
+
+typedef struct {
+    const char *filename;
+    AddressSpace *as;
+    /* If set, the data goes here instead of into ROM blobs */
+    uint8_t *image;
+    hwaddr image_base;
+    GByteArray *data;
+    hwaddr base;
+    hwaddr low;
+    int size;
+} MicrobitHexChunk;
+
+/* Register the contiguous run collected so far as one ROM blob */
+static void microbit_hex_flush(MicrobitHexChunk *chunk)
+{
+    if (chunk->data->len) {
+        if (chunk->image) {
+            memcpy(chunk->image + chunk->base - chunk->image_base,
+                   chunk->data->data, chunk->data->len);
+        } else {
+            rom_add_blob_fixed_as(chunk->filename, chunk->data->data,
+                                  chunk->data->len, chunk->base, chunk->as);
+        }
+        chunk->low = MIN(chunk->low, chunk->base);
+        chunk->size += chunk->data->len;
+        g_byte_array_set_size(chunk->data, 0);
+    }
+}
+
+static void microbit_hex_append(MicrobitHexChunk *chunk, hwaddr addr,
+                                const uint8_t *buf, int len)
+{
+    if (addr != chunk->base + chunk->data->len) {
+        microbit_hex_flush(chunk);
+        chunk->base = addr;
+    }
+    g_byte_array_append(chunk->data, buf, len);
+}
+
+static int microbit_hex_parse_line(const char *line, uint8_t *rec)
+{
+    uint8_t sum = 0;
+    int len = 0;
+
+    if (line[0] != ':') {
+        return -1;
+    }
+    for (line++; qemu_isxdigit(line[0]) && qemu_isxdigit(line[1]);
+         line += 2) {
+        if (len == HEX_MAX_RECORD + 5) {
+            return -1;
+        }
+        rec[len] = (g_ascii_xdigit_value(line[0]) << 4) |
+                   g_ascii_xdigit_value(line[1]);
+        sum += rec[len++];
+    }
+    /* count, address, type, data, checksum */
+    if (len < 5 || len != rec[0] + 5 || sum != 0) {
+        return -1;
+    }
+    return rec[0];
+}
+
+/**
+ * Load an Intel HEX file in a single pass, registering each contiguous run
+ * of data as a ROM blob, or copying it to @image, which covers [lo, hi).
+ * Universal hex blocks meant for other boards are skipped, as is data
+ * outside [lo, hi) such as UICR.  *@low is the lowest address loaded.
+ */
+static int microbit_load_hex(const char *filename, hwaddr lo, hwaddr hi,
+                             AddressSpace *as, uint8_t *image, hwaddr *low)
+{
+    MicrobitHexChunk chunk = {
+        .filename = filename, .as = as,
+        .image = image, .image_base = lo, .low = -1,
+    };
+    uint8_t rec[HEX_MAX_RECORD + 5];
+    char line[2 * sizeof(rec) + 4];
+    uint32_t ext_addr = 0;
+    int board_id = HEX_BOARD_ANY;
+    int lineno = 0;
+    bool eof = false;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        return -1;
+    }
+    chunk.data = g_byte_array_new();
+
+    while (!eof && fgets(line, sizeof(line), f)) {
+        hwaddr addr;
+        int len;
+
+        lineno++;
+        g_strchomp(line);
+        if (!line[0]) {
+            continue;
+        }
+        len = microbit_hex_parse_line(line, rec);
+        if (len < 0) {
+            error_report("%s:%d: malformed record", filename, lineno);
+            chunk.size = -1;
+            break;
+        }
+
+        switch (rec[3]) {
+        case HEX_REC_DATA:
+        case HEX_REC_CUSTOM_DATA:
+            addr = ext_addr + lduw_be_p(&rec[1]);
+            if (!microbit_hex_board_matches(board_id) ||
+                addr < lo || addr + len > hi) {
+                break;
+            }
+            microbit_hex_append(&chunk, addr, &rec[4], len);
+            break;
+        case HEX_REC_EOF:
+            eof = true;
+            break;
+        case HEX_REC_EXT_SEG_ADDR:
+            ext_addr = lduw_be_p(&rec[4]) << 4;
+            break;
+        case HEX_REC_EXT_LIN_ADDR:
+            ext_addr = lduw_be_p(&rec[4]) << 16;
+            break;
+        case HEX_REC_BLOCK_START:
+            board_id = len >= 2 ? lduw_be_p(&rec[4]) : HEX_BOARD_ANY;
+            break;
+        case HEX_REC_BLOCK_END:
+            /* Data outside any block belongs to every board */
+            board_id = HEX_BOARD_ANY;
+            break;
+        case HEX_REC_START_SEG:
+        case HEX_REC_START_LIN:
+        case HEX_REC_PADDING:
+        case HEX_REC_OTHER_DATA:
+        default:
+            /* The reset vector is taken from the vector table */
+            break;
+        }
+    }
+
+    if (chunk.size >= 0) {
+        microbit_hex_flush(&chunk);
+    }
+    g_byte_array_free(chunk.data, true);
+    fclose(f);
+    if (low) {
+        *low = chunk.low;
+    }
+    return chunk.size;
+}
+
+static bool microbit_is_hex(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    bool ret;
+
+    if (!f) {
+        return false;
+    }
+    ret = fgetc(f) == ':';
+    fclose(f);
+    return ret;
+}
+
+/**
+ * NRF51 SOFTDEVICE
+ *   High-level emulation of Nordic's S110 SoftDevice, version 8 API, for
+ *   applications built to run on it but loaded without it: flash below
+ *   STARTUP_ADDR stays empty and the application's sd_* calls are served
+ *   on the host, from the SVC hook of the CPU.
+ *   NOTE: calls are found by name, not by SVC number. The SDK's SVCALL()
+ *         makes each sd_* function a naked "svc; bx lr" stub, whose ELF
+ *         symbols are handed over with nrf51_sd_add_stub(); an SVC taken
+ *         in any other place is left to the guest. Intel HEX images have
+ *         no symbols and get no emulation. Known stubs the model does not
+ *         implement return NRF_ERROR_NOT_SUPPORTED.
+ *         BLE: the GAP address, device name, appearance and connection
+ *         parameters are kept, and advertising sends its ADV_*_IND PDUs
+ *         on channels 37, 38 and 39 through the radio's medium, laid out
+ *         as a radio set up for BLE would receive them: S0 of 1 byte, an
+ *         8-bit LENGTH, the advertising access address and CRC. Scan
+ *         requests and connections are not modelled, so the only GAP
+ *         event is the advertising timeout. GATTS keeps a local table of
+ *         handles and values; notifications never find a connection.
+ *         SoC: NVIC, PPI, critical regions, mutexes, random numbers, ECB,
+ *         flash writes and erases through the NVMC, POWER and CLOCK
+ *         requests, app_evt_wait and system reset. The temperature is a
+ *         constant 25 degrees. Radio timeslot sessions open, but every
+ *         request is blocked: the SoftDevice's radio interrupt routing is
+ *         not modelled.
+ *         Events are signalled on SWI2, held pending until both queues
+ *         are drained, as by the SoftDevice.
+ */
+
+#define TYPE_NRF51_SOFTDEVICE "nrf51_softdevice"
+#define NRF51_SOFTDEVICE(obj) \
+    OBJECT_CHECK(NRF51SoftDeviceState, (obj), TYPE_NRF51_SOFTDEVICE)
+
+/* SWI2, the SoftDevice's event interrupt */
+#define NRF51_SD_EVT_IRQ        22
+
+#define NRF51_SD_ADV_DATA_MAX   31
+#define NRF51_SD_DEVNAME_MAX    31
+#define NRF51_SD_VS_UUID_MAX    10
+#define NRF51_SD_ATTR_MAX_LEN   512
+/* Advertising intervals and the random advDelay, in 0.625 ms units */
+#define NRF51_SD_ADV_UNIT_NS    625000
+#define NRF51_SD_ADV_DELAY_NS   (10 * SCALE_MS)
+/* Between the PDUs of one advertising event */
+#define NRF51_SD_ADV_GAP_NS     (150 * SCALE_US)
+#define NRF51_SD_DIRECT_NS      1280000000LL
+/* Advertising access address as a radio with BALEN 3 sees it */
+#define NRF51_SD_ADV_ADDRESS    ((0x8EULL << 32) | 0x89BED6)
+
+enum {
+    NRF_SUCCESS                         = 0,
+    NRF_ERROR_SOFTDEVICE_NOT_ENABLED    = 2,
+    NRF_ERROR_INTERNAL                  = 3,
+    NRF_ERROR_NO_MEM                    = 4,
+    NRF_ERROR_NOT_FOUND                 = 5,
+    NRF_ERROR_NOT_SUPPORTED             = 6,
+    NRF_ERROR_INVALID_PARAM             = 7,
+    NRF_ERROR_INVALID_STATE             = 8,
+    NRF_ERROR_INVALID_LENGTH            = 9,
+    NRF_ERROR_DATA_SIZE                 = 12,
+    NRF_ERROR_INVALID_ADDR              = 16,
+    NRF_ERROR_SOC_MUTEX_ALREADY_TAKEN   = 0x2000,
+    NRF_ERROR_SOC_NVIC_INTERRUPT_NOT_AVAILABLE = 0x2001,
+    NRF_ERROR_SOC_NVIC_INTERRUPT_PRIORITY_NOT_ALLOWED = 0x2002,
+    NRF_ERROR_SOC_RAND_NOT_ENOUGH_VALUES = 0x2007,
+    NRF_ERROR_SOC_PPI_INVALID_CHANNEL   = 0x2008,
+    NRF_ERROR_SOC_PPI_INVALID_GROUP     = 0x2009,
+    BLE_ERROR_NOT_ENABLED               = 0x3001,
+    BLE_ERROR_INVALID_CONN_HANDLE       = 0x3002,
+    BLE_ERROR_INVALID_ATTR_HANDLE       = 0x3003,
+};
+
+/* nrf_soc.h NRF_SOC_EVTS */
+enum {
+    NRF_EVT_HFCLKSTARTED            = 0,
+    NRF_EVT_FLASH_OPERATION_SUCCESS = 2,
+    NRF_EVT_FLASH_OPERATION_ERROR   = 3,
+    NRF_EVT_RADIO_BLOCKED           = 4,
+    NRF_EVT_RADIO_SESSION_CLOSED    = 8,
+};
+
+enum {
+    BLE_GAP_EVT_TIMEOUT             = 0x19,
+    BLE_GAP_TIMEOUT_SRC_ADVERTISING = 0,
+    BLE_CONN_HANDLE_INVALID         = 0xFFFF,
+    BLE_UUID_TYPE_BLE               = 1,
+    BLE_UUID_TYPE_VENDOR_BEGIN      = 2,
+    BLE_GATTS_SRVC_TYPE_PRIMARY     = 1,
+    BLE_GATTS_SRVC_TYPE_SECONDARY   = 2,
+    BLE_GATTS_VLOC_USER             = 2,
+    BLE_GAP_ADDR_TYPE_PUBLIC        = 0,
+    BLE_GAP_ADDR_TYPE_RANDOM_STATIC = 1,
+};
+
+/* ble_gap_adv_params_t types, and the PDU types they send */
+enum {
+    BLE_GAP_ADV_TYPE_ADV_IND         = 0,
+    BLE_GAP_ADV_TYPE_ADV_DIRECT_IND  = 1,
+    BLE_GAP_ADV_TYPE_ADV_SCAN_IND    = 2,
+    BLE_GAP_ADV_TYPE_ADV_NONCONN_IND = 3,
+};
+
+static const uint8_t nrf51_sd_adv_pdu_type[] = {
+    [BLE_GAP_ADV_TYPE_ADV_IND]         = 0,
+    [BLE_GAP_ADV_TYPE_ADV_DIRECT_IND]  = 1,
+    [BLE_GAP_ADV_TYPE_ADV_SCAN_IND]    = 6,
+    [BLE_GAP_ADV_TYPE_ADV_NONCONN_IND] = 2,
+};
+
+/* FREQUENCY of advertising channels 37, 38 and 39 */
+static const uint8_t nrf51_sd_adv_freq[] = { 2, 26, 80 };
+
+/* The S110 structures the calls take, as laid out by arm-none-eabi-gcc */
+enum {
+    SD_GAP_ADDR_SIZE            = 7,    /* ble_gap_addr_t */
+    SD_ADV_PARAMS_TYPE          = 0,    /* ble_gap_adv_params_t */
+    SD_ADV_PARAMS_PEER_ADDR     = 4,
+    SD_ADV_PARAMS_INTERVAL      = 16,
+    SD_ADV_PARAMS_TIMEOUT       = 18,
+    SD_ADV_PARAMS_CHANNEL_MASK  = 20,
+    SD_UUID_UUID                = 0,    /* ble_uuid_t */
+    SD_UUID_TYPE                = 2,
+    SD_ATTR_UUID                = 0,    /* ble_gatts_attr_t */
+    SD_ATTR_MD                  = 4,
+    SD_ATTR_INIT_LEN            = 8,
+    SD_ATTR_INIT_OFFS           = 10,
+    SD_ATTR_MAX_LEN             = 12,
+    SD_ATTR_VALUE               = 16,
+    SD_ATTR_MD_FLAGS            = 2,    /* ble_gatts_attr_md_t */
+    SD_CHAR_MD_PROPS            = 0,    /* ble_gatts_char_md_t */
+    SD_CHAR_MD_USER_DESC        = 4,
+    SD_CHAR_MD_USER_DESC_MAX    = 8,
+    SD_CHAR_MD_USER_DESC_SIZE   = 10,
+    SD_CHAR_MD_CCCD_MD          = 20,
+    SD_CHAR_MD_SCCD_MD          = 24,
+    SD_VALUE_LEN                = 0,    /* ble_gatts_value_t */
+    SD_VALUE_OFFSET             = 2,
+    SD_VALUE_P_VALUE            = 4,
+};
+
+/* Characteristic properties that make the SoftDevice add descriptors */
+#define SD_CHAR_PROP_BROADCAST  0x01
+#define SD_CHAR_PROP_NOTIFY     0x10
+#define SD_CHAR_PROP_INDICATE   0x20
+
+/* One GATT attribute, at index handle - 1 of the table */
+typedef struct {
+    uint16_t max_len;
+    uint16_t len;
+    bool variable;
+    /* BLE_GATTS_VLOC_USER: the value lives in guest memory at user_ptr */
+    uint32_t user_ptr;
+    uint8_t *value;
+} NRF51SDAttr;
+
+typedef struct NRF51SoftDeviceState NRF51SoftDeviceState;
+
+/* A call, with its arguments in r0-r3; returns what goes in r0 */
+typedef uint32_t NRF51SDCallFn(NRF51SoftDeviceState *s, const uint32_t *a);
+
+typedef struct {
+    const char *name;
+    NRF51SDCallFn *fn;
+} NRF51SDCall;
+
+struct NRF51SoftDeviceState {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    qemu_irq irq;
+    ARMCPU *cpu;
+    NRF51RadioState *radio;
+    QEMUTimer *adv_timer;
+    /* Bus the peripherals are on, the system bus by default */
+    MemoryRegion *memory;
+    AddressSpace as;
+    /* Static random address unless the application sets one */
+    uint64_t address;
+
+    /* Internal state */
+    /* Stub address to NRF51SDCall, filled in as the ELF loads */
+    GHashTable *stubs;
+    bool enabled;
+    bool ble_enabled;
+    GQueue soc_evts;
+    /* Of GByteArray, each a whole ble_evt_t */
+    GQueue ble_evts;
+    uint8_t gap_addr[SD_GAP_ADDR_SIZE];
+    uint8_t dev_name[NRF51_SD_DEVNAME_MAX];
+    uint16_t dev_name_len;
+    uint16_t appearance;
+    uint8_t ppcp[8];
+    uint8_t adv_data[NRF51_SD_ADV_DATA_MAX];
+    uint8_t adv_data_len;
+    bool advertising;
+    uint8_t adv_type;
+    uint8_t adv_peer[SD_GAP_ADDR_SIZE];
+    uint8_t adv_channel_mask;
+    int64_t adv_interval_ns;
+    int64_t adv_deadline;
+    uint8_t vs_uuid[NRF51_SD_VS_UUID_MAX][16];
+    int vs_uuid_count;
+    GArray *attrs;
+    bool critical;
+    bool critical_primask;
+    bool radio_session;
+    NRF51AESKey aes;
+};
+
+static void nrf51_sd_update_irq(NRF51SoftDeviceState *s)
+{
+    qemu_set_irq(s->irq, !g_queue_is_empty(&s->soc_evts) ||
+                         !g_queue_is_empty(&s->ble_evts));
+}
+
+static void nrf51_sd_soc_evt(NRF51SoftDeviceState *s, uint32_t evt)
+{
+    g_queue_push_tail(&s->soc_evts, GUINT_TO_POINTER(evt));
+    nrf51_sd_update_irq(s);
+}
+
+/* Queue a ble_evt_t: its header, then @len bytes of @body */
+static void nrf51_sd_ble_evt(NRF51SoftDeviceState *s, uint16_t id,
+                             const uint8_t *body, uint16_t len)
+{
+    GByteArray *evt = g_byte_array_sized_new(4 + len);
+    uint8_t hdr[4];
+
+    stw_le_p(hdr, id);
+    stw_le_p(hdr + 2, len);
+    g_byte_array_append(evt, hdr, sizeof(hdr));
+    g_byte_array_append(evt, body, len);
+    g_queue_push_tail(&s->ble_evts, evt);
+    nrf51_sd_update_irq(s);
+}
+
+/* Guest memory, through the arguments' pointers; NULL is never valid */
+static bool nrf51_sd_read(NRF51SoftDeviceState *s, uint32_t addr,
+                          void *buf, uint32_t len)
+{
+    return addr && address_space_read(&s->as, addr, MEMTXATTRS_UNSPECIFIED,
+                                      buf, len) == MEMTX_OK;
+}
+
+static bool nrf51_sd_write(NRF51SoftDeviceState *s, uint32_t addr,
+                           const void *buf, uint32_t len)
+{
+    return addr && address_space_write(&s->as, addr, MEMTXATTRS_UNSPECIFIED,
+                                       buf, len) == MEMTX_OK;
+}
+
+static uint32_t nrf51_sd_ld(NRF51SoftDeviceState *s, uint32_t addr, int size)
+{
+    uint8_t buf[4] = { };
+
+    nrf51_sd_read(s, addr, buf, size);
+    return size == 1 ? buf[0] : size == 2 ? lduw_le_p(buf) : ldl_le_p(buf);
+}
+
+static bool nrf51_sd_st(NRF51SoftDeviceState *s, uint32_t addr,
+                        uint32_t val, int size)
+{
+    uint8_t buf[4];
+
+    stl_le_p(buf, val);
+    return nrf51_sd_write(s, addr, buf, size);
+}
+
+/* A peripheral register, as the SoftDevice would access it */
+static uint32_t nrf51_sd_reg_read(NRF51SoftDeviceState *s, hwaddr addr)
+{
+    return address_space_ldl_le(&s->as, addr, MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static void nrf51_sd_reg_write(NRF51SoftDeviceState *s, hwaddr addr,
+                               uint32_t val)
+{
+    address_space_stl_le(&s->as, addr, val, MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+/* The NVIC is on the CPU's bus, not on the SoC's */
+static void nrf51_sd_nvic_write(NRF51SoftDeviceState *s, hwaddr addr,
+                                uint32_t val, int size)
+{
+    uint8_t buf[4];
+
+    stl_le_p(buf, val);
+    address_space_write(CPU(s->cpu)->as, addr, MEMTXATTRS_UNSPECIFIED,
+                        buf, size);
+}
+
+static uint32_t nrf51_sd_nvic_read(NRF51SoftDeviceState *s, hwaddr addr)
+{
+    return address_space_ldl_le(CPU(s->cpu)->as, addr,
+                                MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+/*
+ * SoC library
+ */
+
+static uint32_t nrf51_sd_softdevice_enable(NRF51SoftDeviceState *s,
+                                           const uint32_t *a)
+{
+    if (s->enabled) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    s->enabled = true;
+    return NRF_SUCCESS;
+}
+
+static void nrf51_sd_adv_stop(NRF51SoftDeviceState *s)
+{
+    s->advertising = false;
+    timer_del(s->adv_timer);
+}
+
+static uint32_t nrf51_sd_softdevice_disable(NRF51SoftDeviceState *s,
+                                            const uint32_t *a)
+{
+    nrf51_sd_adv_stop(s);
+    s->enabled = false;
+    s->ble_enabled = false;
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_softdevice_is_enabled(NRF51SoftDeviceState *s,
+                                               const uint32_t *a)
+{
+    return nrf51_sd_st(s, a[0], s->enabled, 1) ? NRF_SUCCESS
+                                               : NRF_ERROR_INVALID_ADDR;
+}
+
+/* Settings the model has no use for */
+static uint32_t nrf51_sd_success(NRF51SoftDeviceState *s, const uint32_t *a)
+{
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_evt_get(NRF51SoftDeviceState *s, const uint32_t *a)
+{
+    uint32_t evt;
+
+    if (g_queue_is_empty(&s->soc_evts)) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    evt = GPOINTER_TO_UINT(g_queue_peek_head(&s->soc_evts));
+    if (!nrf51_sd_st(s, a[0], evt, 4)) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    g_queue_pop_head(&s->soc_evts);
+    nrf51_sd_update_irq(s);
+    return NRF_SUCCESS;
+}
+
+/* Interrupts the SoftDevice keeps for itself, and the priorities it
+   leaves to the application */
+#define NRF51_SD_IRQ_RESERVED   ((1 << 0) | (1 << 1) | (1 << 8) | \
+                                 (1 << 11) | (1 << 12) | (1 << 13) | \
+                                 (1 << 14) | (1 << 15) | (1 << 24) | \
+                                 (1 << 25))
+#define NRF51_SD_PRIO_APP       ((1 << 1) | (1 << 3))
+
+#define NRF51_NVIC_ISER         0xE000E100
+#define NRF51_NVIC_ICER         0xE000E180
+#define NRF51_NVIC_ISPR         0xE000E200
+#define NRF51_NVIC_ICPR         0xE000E280
+#define NRF51_NVIC_IPR          0xE000E400
+
+/* The nRF51 has 32 peripheral interrupts */
+static bool nrf51_sd_irq_ok(uint32_t irq)
+{
+    return irq < 32 && !(NRF51_SD_IRQ_RESERVED & (1u << irq));
+}
+
+static uint32_t nrf51_sd_nvic_set(NRF51SoftDeviceState *s,
+                                  const uint32_t *a, hwaddr reg)
+{
+    if (!nrf51_sd_irq_ok(a[0])) {
+        return NRF_ERROR_SOC_NVIC_INTERRUPT_NOT_AVAILABLE;
+    }
+    nrf51_sd_nvic_write(s, reg, 1u << a[0], 4);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_nvic_enable(NRF51SoftDeviceState *s,
+                                     const uint32_t *a)
+{
+    return nrf51_sd_nvic_set(s, a, NRF51_NVIC_ISER);
+}
+
+static uint32_t nrf51_sd_nvic_disable(NRF51SoftDeviceState *s,
+                                      const uint32_t *a)
+{
+    return nrf51_sd_nvic_set(s, a, NRF51_NVIC_ICER);
+}
+
+static uint32_t nrf51_sd_nvic_set_pending(NRF51SoftDeviceState *s,
+                                          const uint32_t *a)
+{
+    return nrf51_sd_nvic_set(s, a, NRF51_NVIC_ISPR);
+}
+
+static uint32_t nrf51_sd_nvic_clear_pending(NRF51SoftDeviceState *s,
+                                            const uint32_t *a)
+{
+    return nrf51_sd_nvic_set(s, a, NRF51_NVIC_ICPR);
+}
+
+static uint32_t nrf51_sd_nvic_get_pending(NRF51SoftDeviceState *s,
+                                          const uint32_t *a)
+{
+    uint32_t pending;
+
+    if (!nrf51_sd_irq_ok(a[0])) {
+        return NRF_ERROR_SOC_NVIC_INTERRUPT_NOT_AVAILABLE;
+    }
+    pending = extract32(nrf51_sd_nvic_read(s, NRF51_NVIC_ISPR), a[0], 1);
+    return nrf51_sd_st(s, a[1], pending, 4) ? NRF_SUCCESS
+                                            : NRF_ERROR_INVALID_ADDR;
+}
+
+/* nRF51 priorities are 2 bits, the top ones of each IPR byte */
+static uint32_t nrf51_sd_nvic_set_priority(NRF51SoftDeviceState *s,
+                                           const uint32_t *a)
+{
+    if (!nrf51_sd_irq_ok(a[0])) {
+        return NRF_ERROR_SOC_NVIC_INTERRUPT_NOT_AVAILABLE;
+    }
+    if (a[1] > 3 || !(NRF51_SD_PRIO_APP & (1 << a[1]))) {
+        return NRF_ERROR_SOC_NVIC_INTERRUPT_PRIORITY_NOT_ALLOWED;
+    }
+    nrf51_sd_nvic_write(s, NRF51_NVIC_IPR + a[0], a[1] << 6, 1);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_nvic_get_priority(NRF51SoftDeviceState *s,
+                                           const uint32_t *a)
+{
+    uint32_t ipr;
+
+    if (!nrf51_sd_irq_ok(a[0])) {
+        return NRF_ERROR_SOC_NVIC_INTERRUPT_NOT_AVAILABLE;
+    }
+    ipr = nrf51_sd_nvic_read(s, NRF51_NVIC_IPR + (a[0] & ~3));
+    return nrf51_sd_st(s, a[1], extract32(ipr, (a[0] & 3) * 8 + 6, 2), 4)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+static uint32_t nrf51_sd_nvic_system_reset(NRF51SoftDeviceState *s,
+                                           const uint32_t *a)
+{
+    qemu_system_reset_request(SHUTDOWN_CAUSE_GUEST_RESET);
+    return NRF_SUCCESS;
+}
+
+/* Critical regions mask everything with PRIMASK, there being no
+   SoftDevice interrupts to let through */
+static uint32_t nrf51_sd_critical_enter(NRF51SoftDeviceState *s,
+                                        const uint32_t *a)
+{
+    CPUARMState *env = &s->cpu->env;
+
+    if (!nrf51_sd_st(s, a[0], s->critical, 1)) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    if (!s->critical) {
+        s->critical = true;
+        s->critical_primask = env->v7m.primask[env->v7m.secure];
+        env->v7m.primask[env->v7m.secure] = 1;
+    }
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_critical_exit(NRF51SoftDeviceState *s,
+                                       const uint32_t *a)
+{
+    CPUARMState *env = &s->cpu->env;
+
+    if (!(a[0] & 0xff) && s->critical) {
+        s->critical = false;
+        env->v7m.primask[env->v7m.secure] = s->critical_primask;
+    }
+    return NRF_SUCCESS;
+}
+
+/* A nrf_mutex_t is one byte, 0 when free */
+static uint32_t nrf51_sd_mutex_new(NRF51SoftDeviceState *s,
+                                   const uint32_t *a)
+{
+    return nrf51_sd_st(s, a[0], 0, 1) ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+static uint32_t nrf51_sd_mutex_acquire(NRF51SoftDeviceState *s,
+                                       const uint32_t *a)
+{
+    if (nrf51_sd_ld(s, a[0], 1)) {
+        return NRF_ERROR_SOC_MUTEX_ALREADY_TAKEN;
+    }
+    return nrf51_sd_st(s, a[0], 1, 1) ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+#define NRF51_SD_RAND_POOL      64
+
+static uint32_t nrf51_sd_rand_pool(NRF51SoftDeviceState *s,
+                                   const uint32_t *a)
+{
+    return nrf51_sd_st(s, a[0], NRF51_SD_RAND_POOL, 1)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+static uint32_t nrf51_sd_rand_get(NRF51SoftDeviceState *s, const uint32_t *a)
+{
+    uint8_t buf[NRF51_SD_RAND_POOL];
+    uint32_t len = a[1] & 0xff;
+
+    if (len > NRF51_SD_RAND_POOL) {
+        return NRF_ERROR_SOC_RAND_NOT_ENOUGH_VALUES;
+    }
+    for (int i = 0; i < len; i++) {
+        buf[i] = g_random_int();
+    }
+    return !len || nrf51_sd_write(s, a[0], buf, len)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+/* In units of 0.25 degrees Celsius */
+static uint32_t nrf51_sd_temp_get(NRF51SoftDeviceState *s, const uint32_t *a)
+{
+    return nrf51_sd_st(s, a[0], 25 * 4, 4) ? NRF_SUCCESS
+                                           : NRF_ERROR_INVALID_ADDR;
+}
+
+static uint32_t nrf51_sd_ecb_block_encrypt(NRF51SoftDeviceState *s,
+                                           const uint32_t *a)
+{
+    NRF51ECBData data;
+
+    if (!nrf51_sd_read(s, a[0], &data, offsetof(NRF51ECBData, ciphertext))) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    if (!nrf51_aes_encrypt(&s->aes, data.key, data.cleartext,
+                           data.ciphertext, NRF51_ECB_BLOCK)) {
+        return NRF_ERROR_INTERNAL;
+    }
+    nrf51_sd_write(s, a[0] + offsetof(NRF51ECBData, ciphertext),
+                   data.ciphertext, NRF51_ECB_BLOCK);
+    return NRF_SUCCESS;
+}
+
+/* Flash operations complete at once; the NVMC does the work and applies
+   its own latency, if any */
+static bool nrf51_sd_flash_ok(uint32_t addr, uint32_t len)
+{
+    return addr >= CODE_KERNEL_BASE &&
+           addr + len <= CODE_KERNEL_BASE + CODE_KERNEL_SIZE;
+}
+
+static uint32_t nrf51_sd_flash_write(NRF51SoftDeviceState *s,
+                                     const uint32_t *a)
+{
+    uint32_t dst = a[0], src = a[1], words = a[2];
+
+    if ((dst | src) & 3) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    if (!words || words > NRF51_NVMC_PAGE_SIZE / 4) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    if (!nrf51_sd_flash_ok(dst, words * 4)) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    nrf51_sd_reg_write(s, NVMC_BASE + NRF51_NVMC_CONFIG,
+                       NRF51_NVMC_CONFIG_WEN);
+    for (uint32_t i = 0; i < words; i++) {
+        nrf51_sd_st(s, dst + i * 4, nrf51_sd_ld(s, src + i * 4, 4), 4);
+    }
+    nrf51_sd_reg_write(s, NVMC_BASE + NRF51_NVMC_CONFIG,
+                       NRF51_NVMC_CONFIG_REN);
+    nrf51_sd_soc_evt(s, NRF_EVT_FLASH_OPERATION_SUCCESS);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_flash_page_erase(NRF51SoftDeviceState *s,
+                                          const uint32_t *a)
+{
+    uint32_t addr = a[0] * NRF51_NVMC_PAGE_SIZE;
+
+    if (a[0] >= (CODE_KERNEL_BASE + CODE_KERNEL_SIZE) / NRF51_NVMC_PAGE_SIZE ||
+        !nrf51_sd_flash_ok(addr, NRF51_NVMC_PAGE_SIZE)) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    nrf51_sd_reg_write(s, NVMC_BASE + NRF51_NVMC_CONFIG,
+                       NRF51_NVMC_CONFIG_EEN);
+    nrf51_sd_reg_write(s, NVMC_BASE + NRF51_NVMC_ERASEPAGE, addr);
+    nrf51_sd_reg_write(s, NVMC_BASE + NRF51_NVMC_CONFIG,
+                       NRF51_NVMC_CONFIG_REN);
+    nrf51_sd_soc_evt(s, NRF_EVT_FLASH_OPERATION_SUCCESS);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_power_system_off(NRF51SoftDeviceState *s,
+                                          const uint32_t *a)
+{
+    nrf51_sd_reg_write(s, CLOCK_BASE + NRF51_PWR_SYSTEMOFF, 1);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_power_get(NRF51SoftDeviceState *s,
+                                   const uint32_t *a, hwaddr reg)
+{
+    return nrf51_sd_st(s, a[0], nrf51_sd_reg_read(s, CLOCK_BASE + reg), 4)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+static uint32_t nrf51_sd_power_reset_reason_get(NRF51SoftDeviceState *s,
+                                                const uint32_t *a)
+{
+    return nrf51_sd_power_get(s, a, NRF51_PWR_RESETREAS);
+}
+
+/* RESETREAS bits are cleared by writing 1 */
+static uint32_t nrf51_sd_power_reset_reason_clr(NRF51SoftDeviceState *s,
+                                                const uint32_t *a)
+{
+    nrf51_sd_reg_write(s, CLOCK_BASE + NRF51_PWR_RESETREAS, a[0]);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_power_gpregret_get(NRF51SoftDeviceState *s,
+                                            const uint32_t *a)
+{
+    return nrf51_sd_power_get(s, a, NRF51_PWR_GPREGRET);
+}
+
+static uint32_t nrf51_sd_power_gpregret_set(NRF51SoftDeviceState *s,
+                                            const uint32_t *a)
+{
+    hwaddr reg = CLOCK_BASE + NRF51_PWR_GPREGRET;
+
+    nrf51_sd_reg_write(s, reg, nrf51_sd_reg_read(s, reg) | (a[0] & 0xff));
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_power_gpregret_clr(NRF51SoftDeviceState *s,
+                                            const uint32_t *a)
+{
+    hwaddr reg = CLOCK_BASE + NRF51_PWR_GPREGRET;
+
+    nrf51_sd_reg_write(s, reg, nrf51_sd_reg_read(s, reg) & ~a[0]);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_clock_hfclk_request(NRF51SoftDeviceState *s,
+                                             const uint32_t *a)
+{
+    nrf51_sd_reg_write(s, CLOCK_BASE + NRF51_CLK_HFCLKSTART, 1);
+    nrf51_sd_soc_evt(s, NRF_EVT_HFCLKSTARTED);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_clock_hfclk_release(NRF51SoftDeviceState *s,
+                                             const uint32_t *a)
+{
+    nrf51_sd_reg_write(s, CLOCK_BASE + NRF51_CLK_HFCLKSTOP, 1);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_clock_hfclk_is_running(NRF51SoftDeviceState *s,
+                                                const uint32_t *a)
+{
+    uint32_t stat = nrf51_sd_reg_read(s, CLOCK_BASE + NRF51_CLK_HFCLKSTAT);
+
+    return nrf51_sd_st(s, a[0], extract32(stat, 16, 1), 4)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+/* WFE: the CPU sleeps until there is an interrupt to take */
+static uint32_t nrf51_sd_app_evt_wait(NRF51SoftDeviceState *s,
+                                      const uint32_t *a)
+{
+    cpu_interrupt(CPU(s->cpu), CPU_INTERRUPT_HALT);
+    return NRF_SUCCESS;
+}
+
+/* PPI channels 0-7 and groups 0-1 are the application's */
+#define NRF51_SD_PPI_APP_CHANNELS   0xff
+#define NRF51_SD_PPI_APP_NUM        8
+#define NRF51_SD_PPI_APP_GROUPS     2
+
+static uint32_t nrf51_sd_ppi_channel_enable_get(NRF51SoftDeviceState *s,
+                                                const uint32_t *a)
+{
+    uint32_t chen = nrf51_sd_reg_read(s, PPI_BASE + NRF51_PPI_CHEN);
+
+    return nrf51_sd_st(s, a[0], chen & NRF51_SD_PPI_APP_CHANNELS, 4)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+static uint32_t nrf51_sd_ppi_channel_enable_set(NRF51SoftDeviceState *s,
+                                                const uint32_t *a)
+{
+    if (a[0] & ~NRF51_SD_PPI_APP_CHANNELS) {
+        return NRF_ERROR_SOC_PPI_INVALID_CHANNEL;
+    }
+    nrf51_sd_reg_write(s, PPI_BASE + NRF51_PPI_CHENSET, a[0]);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_ppi_channel_enable_clr(NRF51SoftDeviceState *s,
+                                                const uint32_t *a)
+{
+    if (a[0] & ~NRF51_SD_PPI_APP_CHANNELS) {
+        return NRF_ERROR_SOC_PPI_INVALID_CHANNEL;
+    }
+    nrf51_sd_reg_write(s, PPI_BASE + NRF51_PPI_CHENCLR, a[0]);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_ppi_channel_assign(NRF51SoftDeviceState *s,
+                                            const uint32_t *a)
+{
+    if (a[0] >= NRF51_SD_PPI_APP_NUM) {
+        return NRF_ERROR_SOC_PPI_INVALID_CHANNEL;
+    }
+    nrf51_sd_reg_write(s, PPI_BASE + NRF51_PPI_CH0_EEP + a[0] * 8, a[1]);
+    nrf51_sd_reg_write(s, PPI_BASE + NRF51_PPI_CH0_EEP + a[0] * 8 + 4, a[2]);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_ppi_group_assign(NRF51SoftDeviceState *s,
+                                          const uint32_t *a)
+{
+    if (a[0] >= NRF51_SD_PPI_APP_GROUPS) {
+        return NRF_ERROR_SOC_PPI_INVALID_GROUP;
+    }
+    if (a[1] & ~NRF51_SD_PPI_APP_CHANNELS) {
+        return NRF_ERROR_SOC_PPI_INVALID_CHANNEL;
+    }
+    nrf51_sd_reg_write(s, PPI_BASE + NRF51_PPI_CHG0 + a[0] * 4, a[1]);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_ppi_group_get(NRF51SoftDeviceState *s,
+                                       const uint32_t *a)
+{
+    if (a[0] >= NRF51_SD_PPI_APP_GROUPS) {
+        return NRF_ERROR_SOC_PPI_INVALID_GROUP;
+    }
+    return nrf51_sd_st(s, a[1], nrf51_sd_reg_read(s, PPI_BASE +
+                                                  NRF51_PPI_CHG0 + a[0] * 4),
+                       4) ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+/* TASKS_CHG[n].EN and .DIS */
+static uint32_t nrf51_sd_ppi_group_task(NRF51SoftDeviceState *s,
+                                        const uint32_t *a, int dis)
+{
+    if (a[0] >= NRF51_SD_PPI_APP_GROUPS) {
+        return NRF_ERROR_SOC_PPI_INVALID_GROUP;
+    }
+    nrf51_sd_reg_write(s, PPI_BASE + NRF51_PPI_CHG0EN + a[0] * 8 + dis * 4,
+                       1);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_ppi_group_task_enable(NRF51SoftDeviceState *s,
+                                               const uint32_t *a)
+{
+    return nrf51_sd_ppi_group_task(s, a, 0);
+}
+
+static uint32_t nrf51_sd_ppi_group_task_disable(NRF51SoftDeviceState *s,
+                                                const uint32_t *a)
+{
+    return nrf51_sd_ppi_group_task(s, a, 1);
+}
+
+static uint32_t nrf51_sd_radio_session_open(NRF51SoftDeviceState *s,
+                                            const uint32_t *a)
+{
+    if (s->radio_session) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    s->radio_session = true;
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_radio_session_close(NRF51SoftDeviceState *s,
+                                             const uint32_t *a)
+{
+    if (!s->radio_session) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    s->radio_session = false;
+    nrf51_sd_soc_evt(s, NRF_EVT_RADIO_SESSION_CLOSED);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_radio_request(NRF51SoftDeviceState *s,
+                                       const uint32_t *a)
+{
+    if (!s->radio_session) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    nrf51_sd_soc_evt(s, NRF_EVT_RADIO_BLOCKED);
+    return NRF_SUCCESS;
+}
+
+/*
+ * BLE: common
+ */
+
+static uint32_t nrf51_sd_ble_enable(NRF51SoftDeviceState *s,
+                                    const uint32_t *a)
+{
+    if (s->ble_enabled) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    s->ble_enabled = true;
+    return NRF_SUCCESS;
+}
+
+/* With a NULL buffer, only the length of the next event is returned */
+static uint32_t nrf51_sd_ble_evt_get(NRF51SoftDeviceState *s,
+                                     const uint32_t *a)
+{
+    GByteArray *evt = g_queue_peek_head(&s->ble_evts);
+
+    if (!evt) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    if (!a[0]) {
+        return nrf51_sd_st(s, a[1], evt->len, 2) ? NRF_SUCCESS
+                                                 : NRF_ERROR_INVALID_ADDR;
+    }
+    if (nrf51_sd_ld(s, a[1], 2) < evt->len) {
+        return NRF_ERROR_DATA_SIZE;
+    }
+    if (!nrf51_sd_write(s, a[0], evt->data, evt->len) ||
+        !nrf51_sd_st(s, a[1], evt->len, 2)) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    g_byte_array_free(g_queue_pop_head(&s->ble_evts), true);
+    nrf51_sd_update_irq(s);
+    return NRF_SUCCESS;
+}
+
+/* Link layer version 4.1, Nordic, S110 8.0.0 */
+static uint32_t nrf51_sd_ble_version_get(NRF51SoftDeviceState *s,
+                                         const uint32_t *a)
+{
+    uint8_t version[6] = { 7, 0, 0x59, 0x00, 0x64, 0x00 };
+
+    return nrf51_sd_write(s, a[0], version, sizeof(version))
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+static uint32_t nrf51_sd_ble_tx_buffer_count_get(NRF51SoftDeviceState *s,
+                                                 const uint32_t *a)
+{
+    return nrf51_sd_st(s, a[0], 7, 1) ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+/* Vendor bases leave out bytes 12-13, where the 16-bit UUID goes */
+static bool nrf51_sd_vs_uuid_equal(const uint8_t *a, const uint8_t *b)
+{
+    return !memcmp(a, b, 12) && !memcmp(a + 14, b + 14, 2);
+}
+
+static uint32_t nrf51_sd_ble_uuid_vs_add(NRF51SoftDeviceState *s,
+                                         const uint32_t *a)
+{
+    uint8_t base[16];
+    int i;
+
+    if (!nrf51_sd_read(s, a[0], base, sizeof(base))) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    for (i = 0; i < s->vs_uuid_count; i++) {
+        if (nrf51_sd_vs_uuid_equal(s->vs_uuid[i], base)) {
+            break;
+        }
+    }
+    if (i == NRF51_SD_VS_UUID_MAX) {
+        return NRF_ERROR_NO_MEM;
+    }
+    if (i == s->vs_uuid_count) {
+        memcpy(s->vs_uuid[s->vs_uuid_count++], base, sizeof(base));
+    }
+    return nrf51_sd_st(s, a[1], BLE_UUID_TYPE_VENDOR_BEGIN + i, 1)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+/* The little endian encoding of a ble_uuid_t; returns its length or 0 */
+static int nrf51_sd_uuid_encode(NRF51SoftDeviceState *s, uint32_t p_uuid,
+                                uint8_t *out)
+{
+    uint16_t uuid = nrf51_sd_ld(s, p_uuid + SD_UUID_UUID, 2);
+    uint8_t type = nrf51_sd_ld(s, p_uuid + SD_UUID_TYPE, 1);
+
+    if (type == BLE_UUID_TYPE_BLE) {
+        stw_le_p(out, uuid);
+        return 2;
+    }
+    if (type < BLE_UUID_TYPE_VENDOR_BEGIN ||
+        type >= BLE_UUID_TYPE_VENDOR_BEGIN + s->vs_uuid_count) {
+        return 0;
+    }
+    memcpy(out, s->vs_uuid[type - BLE_UUID_TYPE_VENDOR_BEGIN], 16);
+    stw_le_p(out + 12, uuid);
+    return 16;
+}
+
+static uint32_t nrf51_sd_ble_uuid_encode(NRF51SoftDeviceState *s,
+                                         const uint32_t *a)
+{
+    uint8_t le[16];
+    int len = nrf51_sd_uuid_encode(s, a[0], le);
+
+    if (!len) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if (!nrf51_sd_st(s, a[1], len, 1) ||
+        (a[2] && !nrf51_sd_write(s, a[2], le, len))) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_ble_uuid_decode(NRF51SoftDeviceState *s,
+                                         const uint32_t *a)
+{
+    uint8_t le[16];
+    uint32_t len = a[0] & 0xff;
+    uint8_t type = BLE_UUID_TYPE_BLE;
+    int i;
+
+    if (len != 2 && len != 16) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    if (!nrf51_sd_read(s, a[1], le, len)) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    if (len == 16) {
+        for (i = 0; i < s->vs_uuid_count; i++) {
+            if (nrf51_sd_vs_uuid_equal(s->vs_uuid[i], le)) {
+                break;
+            }
+        }
+        if (i == s->vs_uuid_count) {
+            return NRF_ERROR_NOT_FOUND;
+        }
+        type = BLE_UUID_TYPE_VENDOR_BEGIN + i;
+    }
+    /* A vendor UUID's 16 bits are bytes 12-13 */
+    if (!nrf51_sd_st(s, a[2] + SD_UUID_UUID,
+                     lduw_le_p(len == 16 ? le + 12 : le), 2) ||
+        !nrf51_sd_st(s, a[2] + SD_UUID_TYPE, type, 1)) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    return NRF_SUCCESS;
+}
+
+/* There never is a connection to use */
+static uint32_t nrf51_sd_no_conn(NRF51SoftDeviceState *s, const uint32_t *a)
+{
+    return BLE_ERROR_INVALID_CONN_HANDLE;
+}
+
+/*
+ * BLE: GAP
+ */
+
+static uint32_t nrf51_sd_gap_address_set(NRF51SoftDeviceState *s,
+                                         const uint32_t *a)
+{
+    uint8_t addr[SD_GAP_ADDR_SIZE];
+
+    if (s->advertising) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (!nrf51_sd_read(s, a[1], addr, sizeof(addr))) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    if (addr[0] > 3) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    memcpy(s->gap_addr, addr, sizeof(addr));
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_gap_address_get(NRF51SoftDeviceState *s,
+                                         const uint32_t *a)
+{
+    return nrf51_sd_write(s, a[0], s->gap_addr, sizeof(s->gap_addr))
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+/* The scan response data is accepted, but nobody ever asks for it */
+static uint32_t nrf51_sd_gap_adv_data_set(NRF51SoftDeviceState *s,
+                                          const uint32_t *a)
+{
+    uint8_t len = a[1], sr_len = a[3];
+
+    if (len > NRF51_SD_ADV_DATA_MAX || sr_len > NRF51_SD_ADV_DATA_MAX) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    if ((len && !nrf51_sd_read(s, a[0], s->adv_data, len)) ||
+        (sr_len && !a[2])) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    s->adv_data_len = len;
+    return NRF_SUCCESS;
+}
+
+/* One advertising event: the PDU on each channel left in the mask */
+static void nrf51_sd_adv_event(NRF51SoftDeviceState *s, int64_t now)
+{
+    uint8_t pdu[2 + 12 + NRF51_SD_ADV_DATA_MAX];
+    uint32_t crc = nrf51_radio_crc_config(0x103, 0x65B, 0x555555);
+    int64_t t = now;
+    uint32_t len;
+
+    pdu[0] = nrf51_sd_adv_pdu_type[s->adv_type];
+    if (s->gap_addr[0] != BLE_GAP_ADDR_TYPE_PUBLIC) {
+        pdu[0] |= 1 << 6;
+    }
+    memcpy(pdu + 2, s->gap_addr + 1, 6);
+    if (s->adv_type == BLE_GAP_ADV_TYPE_ADV_DIRECT_IND) {
+        if (s->adv_peer[0] != BLE_GAP_ADDR_TYPE_PUBLIC) {
+            pdu[0] |= 1 << 7;
+        }
+        memcpy(pdu + 8, s->adv_peer + 1, 6);
+        len = 12;
+    } else {
+        memcpy(pdu + 8, s->adv_data, s->adv_data_len);
+        len = 6 + s->adv_data_len;
+    }
+    pdu[1] = len;
+
+    for (int ch = 0; ch < ARRAY_SIZE(nrf51_sd_adv_freq); ch++) {
+        if (s->adv_channel_mask & (1 << ch)) {
+            continue;
+        }
+        /* Preamble, access address, header, payload and CRC at 1 Mbit */
+        t += (1 + 4 + 2 + len + 3) * 8 * SCALE_US;
+        nrf51_radio_send(s->radio, nrf51_sd_adv_freq[ch],
+                         NRF51_SD_ADV_ADDRESS, crc, pdu, 2 + len, t);
+        t += NRF51_SD_ADV_GAP_NS;
+    }
+}
+
+static void nrf51_sd_adv_expire(void *opaque)
+{
+    NRF51SoftDeviceState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint8_t timeout[3];
+
+    if (!s->advertising) {
+        return;
+    }
+    if (s->adv_deadline && now >= s->adv_deadline) {
+        nrf51_sd_adv_stop(s);
+        stw_le_p(timeout, BLE_CONN_HANDLE_INVALID);
+        timeout[2] = BLE_GAP_TIMEOUT_SRC_ADVERTISING;
+        nrf51_sd_ble_evt(s, BLE_GAP_EVT_TIMEOUT, timeout, sizeof(timeout));
+        return;
+    }
+    nrf51_sd_adv_event(s, now);
+    timer_mod_ns(s->adv_timer, now + s->adv_interval_ns +
+                 g_random_int_range(0, NRF51_SD_ADV_DELAY_NS));
+}
+
+static uint32_t nrf51_sd_gap_adv_start(NRF51SoftDeviceState *s,
+                                       const uint32_t *a)
+{
+    uint32_t type, peer, interval, timeout, mask;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (s->advertising) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (!a[0]) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    type = nrf51_sd_ld(s, a[0] + SD_ADV_PARAMS_TYPE, 1);
+    peer = nrf51_sd_ld(s, a[0] + SD_ADV_PARAMS_PEER_ADDR, 4);
+    interval = nrf51_sd_ld(s, a[0] + SD_ADV_PARAMS_INTERVAL, 2);
+    timeout = nrf51_sd_ld(s, a[0] + SD_ADV_PARAMS_TIMEOUT, 2);
+    mask = nrf51_sd_ld(s, a[0] + SD_ADV_PARAMS_CHANNEL_MASK, 1) & 7;
+
+    if (type > BLE_GAP_ADV_TYPE_ADV_NONCONN_IND || mask == 7) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if (type == BLE_GAP_ADV_TYPE_ADV_DIRECT_IND) {
+        /* High duty cycle, for 1.28 s */
+        if (!nrf51_sd_read(s, peer, s->adv_peer, sizeof(s->adv_peer))) {
+            return NRF_ERROR_INVALID_ADDR;
+        }
+        interval = 6;
+        s->adv_deadline = now + NRF51_SD_DIRECT_NS;
+    } else {
+        if (interval < (type == BLE_GAP_ADV_TYPE_ADV_IND ? 0x20 : 0xA0) ||
+            interval > 0x4000) {
+            return NRF_ERROR_INVALID_PARAM;
+        }
+        s->adv_deadline = timeout ? now + timeout * NANOSECONDS_PER_SECOND
+                                  : 0;
+    }
+    s->adv_type = type;
+    s->adv_channel_mask = mask;
+    s->adv_interval_ns = (int64_t)interval * NRF51_SD_ADV_UNIT_NS;
+    s->advertising = true;
+    nrf51_sd_adv_expire(s);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_gap_adv_stop(NRF51SoftDeviceState *s,
+                                      const uint32_t *a)
+{
+    if (!s->advertising) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    nrf51_sd_adv_stop(s);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_gap_device_name_set(NRF51SoftDeviceState *s,
+                                             const uint32_t *a)
+{
+    uint16_t len = a[2];
+
+    if (len > NRF51_SD_DEVNAME_MAX) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    if (len && !nrf51_sd_read(s, a[1], s->dev_name, len)) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    s->dev_name_len = len;
+    return NRF_SUCCESS;
+}
+
+/* With a NULL buffer, only the length is returned */
+static uint32_t nrf51_sd_gap_device_name_get(NRF51SoftDeviceState *s,
+                                             const uint32_t *a)
+{
+    if (a[0]) {
+        if (nrf51_sd_ld(s, a[1], 2) < s->dev_name_len) {
+            return NRF_ERROR_DATA_SIZE;
+        }
+        if (!nrf51_sd_write(s, a[0], s->dev_name, s->dev_name_len)) {
+            return NRF_ERROR_INVALID_ADDR;
+        }
+    }
+    return nrf51_sd_st(s, a[1], s->dev_name_len, 2)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+static uint32_t nrf51_sd_gap_appearance_set(NRF51SoftDeviceState *s,
+                                            const uint32_t *a)
+{
+    s->appearance = a[0];
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_gap_appearance_get(NRF51SoftDeviceState *s,
+                                            const uint32_t *a)
+{
+    return nrf51_sd_st(s, a[0], s->appearance, 2)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+static uint32_t nrf51_sd_gap_ppcp_set(NRF51SoftDeviceState *s,
+                                      const uint32_t *a)
+{
+    return nrf51_sd_read(s, a[0], s->ppcp, sizeof(s->ppcp))
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+static uint32_t nrf51_sd_gap_ppcp_get(NRF51SoftDeviceState *s,
+                                      const uint32_t *a)
+{
+    return nrf51_sd_write(s, a[0], s->ppcp, sizeof(s->ppcp))
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+/* The power levels the radio has, in dBm */
+static uint32_t nrf51_sd_gap_tx_power_set(NRF51SoftDeviceState *s,
+                                          const uint32_t *a)
+{
+    static const int8_t levels[] = { -40, -30, -20, -16, -12, -8, -4, 0, 4 };
+
+    for (int i = 0; i < ARRAY_SIZE(levels); i++) {
+        if ((int8_t)a[0] == levels[i]) {
+            return NRF_SUCCESS;
+        }
+    }
+    return NRF_ERROR_INVALID_PARAM;
+}
+
+/*
+ * BLE: GATT server
+ */
+
+static NRF51SDAttr *nrf51_sd_attr(NRF51SoftDeviceState *s, uint32_t handle)
+{
+    if (!handle || handle > s->attrs->len) {
+        return NULL;
+    }
+    return &g_array_index(s->attrs, NRF51SDAttr, handle - 1);
+}
+
+/* A new attribute holding @len bytes of @value, out of @max_len */
+static uint16_t nrf51_sd_attr_add(NRF51SoftDeviceState *s,
+                                  const uint8_t *value, uint16_t len,
+                                  uint16_t max_len)
+{
+    NRF51SDAttr attr = {
+        .max_len = max_len,
+        .len = len,
+        .value = g_malloc0(max_len ?: 1),
+    };
+
+    if (len) {
+        memcpy(attr.value, value, len);
+    }
+    g_array_append_val(s->attrs, attr);
+    return s->attrs->len;
+}
+
+/*
+ * An attribute from a ble_gatts_attr_t, or 0.  Values the application
+ * keeps itself (BLE_GATTS_VLOC_USER) stay in guest memory.
+ */
+static uint16_t nrf51_sd_attr_add_guest(NRF51SoftDeviceState *s,
+                                        uint32_t p_attr)
+{
+    uint32_t md = nrf51_sd_ld(s, p_attr + SD_ATTR_MD, 4);
+    uint16_t init_len = nrf51_sd_ld(s, p_attr + SD_ATTR_INIT_LEN, 2);
+    uint16_t init_offs = nrf51_sd_ld(s, p_attr + SD_ATTR_INIT_OFFS, 2);
+    uint16_t max_len = nrf51_sd_ld(s, p_attr + SD_ATTR_MAX_LEN, 2);
+    uint32_t p_value = nrf51_sd_ld(s, p_attr + SD_ATTR_VALUE, 4);
+    uint8_t flags = nrf51_sd_ld(s, md + SD_ATTR_MD_FLAGS, 1);
+    uint8_t value[NRF51_SD_ATTR_MAX_LEN] = { };
+    NRF51SDAttr *attr;
+    uint16_t handle;
+
+    if (!md || !max_len || max_len > NRF51_SD_ATTR_MAX_LEN ||
+        init_offs + init_len > max_len) {
+        return 0;
+    }
+    if (p_value && init_len) {
+        nrf51_sd_read(s, p_value, value + init_offs, init_len);
+    }
+    handle = nrf51_sd_attr_add(s, value, init_offs + init_len, max_len);
+    attr = nrf51_sd_attr(s, handle);
+    attr->variable = flags & 1;
+    if (!attr->variable) {
+        attr->len = max_len;
+    }
+    if (extract32(flags, 1, 2) == BLE_GATTS_VLOC_USER) {
+        attr->user_ptr = p_value;
+    }
+    return handle;
+}
+
+static uint32_t nrf51_sd_gatts_service_add(NRF51SoftDeviceState *s,
+                                           const uint32_t *a)
+{
+    uint8_t uuid[16];
+    int len;
+
+    if (a[0] != BLE_GATTS_SRVC_TYPE_PRIMARY &&
+        a[0] != BLE_GATTS_SRVC_TYPE_SECONDARY) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    len = a[1] ? nrf51_sd_uuid_encode(s, a[1], uuid) : 0;
+    if (!len) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    return nrf51_sd_st(s, a[2], nrf51_sd_attr_add(s, uuid, len, len), 2)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+static uint32_t nrf51_sd_gatts_include_add(NRF51SoftDeviceState *s,
+                                           const uint32_t *a)
+{
+    uint8_t decl[4];
+
+    if (!nrf51_sd_attr(s, a[0]) || !nrf51_sd_attr(s, a[1])) {
+        return BLE_ERROR_INVALID_ATTR_HANDLE;
+    }
+    stw_le_p(decl, a[1]);
+    stw_le_p(decl + 2, a[1]);
+    return nrf51_sd_st(s, a[2], nrf51_sd_attr_add(s, decl, 4, 4), 2)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+/*
+ * The declaration, value, then the descriptors the metadata asks for:
+ * user description, CCCD and SCCD, in this order.
+ */
+static uint32_t nrf51_sd_gatts_characteristic_add(NRF51SoftDeviceState *s,
+                                                  const uint32_t *a)
+{
+    uint32_t md = a[1], p_attr = a[2];
+    uint8_t props = nrf51_sd_ld(s, md + SD_CHAR_MD_PROPS, 1);
+    uint32_t user_desc = nrf51_sd_ld(s, md + SD_CHAR_MD_USER_DESC, 4);
+    uint16_t handles[4] = { };
+    uint8_t decl[3 + 16], buf[NRF51_SD_ATTR_MAX_LEN] = { };
+    uint16_t decl_handle, desc_max, desc_len;
+    int len;
+
+    if (!nrf51_sd_attr(s, a[0])) {
+        return BLE_ERROR_INVALID_ATTR_HANDLE;
+    }
+    if (!md || !p_attr) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    len = nrf51_sd_uuid_encode(s, nrf51_sd_ld(s, p_attr + SD_ATTR_UUID, 4),
+                               decl + 3);
+    if (!len) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+
+    decl_handle = nrf51_sd_attr_add(s, NULL, 0, 3 + len);
+    handles[0] = nrf51_sd_attr_add_guest(s, p_attr);
+    if (!handles[0]) {
+        g_free(nrf51_sd_attr(s, decl_handle)->value);
+        g_array_set_size(s->attrs, decl_handle - 1);
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    decl[0] = props;
+    stw_le_p(decl + 1, handles[0]);
+    memcpy(nrf51_sd_attr(s, decl_handle)->value, decl, 3 + len);
+    nrf51_sd_attr(s, decl_handle)->len = 3 + len;
+
+    if (user_desc) {
+        desc_max = nrf51_sd_ld(s, md + SD_CHAR_MD_USER_DESC_MAX, 2);
+        desc_len = nrf51_sd_ld(s, md + SD_CHAR_MD_USER_DESC_SIZE, 2);
+        desc_max = MIN(MAX(desc_max, desc_len), NRF51_SD_ATTR_MAX_LEN);
+        desc_len = MIN(desc_len, desc_max);
+        nrf51_sd_read(s, user_desc, buf, desc_len);
+        handles[1] = nrf51_sd_attr_add(s, buf, desc_len, desc_max);
+    }
+    memset(buf, 0, 2);
+    if ((props & (SD_CHAR_PROP_NOTIFY | SD_CHAR_PROP_INDICATE)) ||
+        nrf51_sd_ld(s, md + SD_CHAR_MD_CCCD_MD, 4)) {
+        handles[2] = nrf51_sd_attr_add(s, buf, 2, 2);
+    }
+    if ((props & SD_CHAR_PROP_BROADCAST) ||
+        nrf51_sd_ld(s, md + SD_CHAR_MD_SCCD_MD, 4)) {
+        handles[3] = nrf51_sd_attr_add(s, buf, 2, 2);
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(handles); i++) {
+        if (!nrf51_sd_st(s, a[3] + i * 2, handles[i], 2)) {
+            return NRF_ERROR_INVALID_ADDR;
+        }
+    }
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_gatts_descriptor_add(NRF51SoftDeviceState *s,
+                                              const uint32_t *a)
+{
+    uint16_t handle;
+
+    if (!nrf51_sd_attr(s, a[0])) {
+        return BLE_ERROR_INVALID_ATTR_HANDLE;
+    }
+    handle = nrf51_sd_attr_add_guest(s, a[1]);
+    if (!handle) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    return nrf51_sd_st(s, a[2], handle, 2) ? NRF_SUCCESS
+                                           : NRF_ERROR_INVALID_ADDR;
+}
+
+/* ble_gatts_value_t in and out: len bytes at offset, len updated */
+static uint32_t nrf51_sd_gatts_value(NRF51SoftDeviceState *s,
+                                     const uint32_t *a, bool set)
+{
+    NRF51SDAttr *attr = nrf51_sd_attr(s, a[1]);
+    uint32_t p = a[2];
+    uint16_t len = nrf51_sd_ld(s, p + SD_VALUE_LEN, 2);
+    uint16_t offset = nrf51_sd_ld(s, p + SD_VALUE_OFFSET, 2);
+    uint32_t p_value = nrf51_sd_ld(s, p + SD_VALUE_P_VALUE, 4);
+    uint8_t *value;
+
+    if (!attr) {
+        return BLE_ERROR_INVALID_ATTR_HANDLE;
+    }
+    if (!p) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    if (offset > (set ? attr->max_len : attr->len)) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    len = MIN(len, (set ? attr->max_len : attr->len) - offset);
+
+    /* Values the application keeps are read and written in place */
+    value = attr->value;
+    if (attr->user_ptr) {
+        nrf51_sd_read(s, attr->user_ptr, value, attr->max_len);
+    }
+    if (set) {
+        if (p_value && !nrf51_sd_read(s, p_value, value + offset, len)) {
+            return NRF_ERROR_INVALID_ADDR;
+        }
+        if (attr->variable) {
+            attr->len = offset + len;
+        }
+        if (attr->user_ptr) {
+            nrf51_sd_write(s, attr->user_ptr, value, attr->max_len);
+        }
+    } else if (p_value && !nrf51_sd_write(s, p_value, value + offset, len)) {
+        return NRF_ERROR_INVALID_ADDR;
+    } else if (!p_value) {
+        /* A NULL buffer asks for the whole length */
+        len = attr->len;
+    }
+    nrf51_sd_st(s, p + SD_VALUE_LEN, len, 2);
+    return NRF_SUCCESS;
+}
+
+static uint32_t nrf51_sd_gatts_value_set(NRF51SoftDeviceState *s,
+                                         const uint32_t *a)
+{
+    return nrf51_sd_gatts_value(s, a, true);
+}
+
+static uint32_t nrf51_sd_gatts_value_get(NRF51SoftDeviceState *s,
+                                         const uint32_t *a)
+{
+    return nrf51_sd_gatts_value(s, a, false);
+}
+
+static uint32_t nrf51_sd_gatts_first_handle_get(NRF51SoftDeviceState *s,
+                                                const uint32_t *a)
+{
+    return nrf51_sd_st(s, a[0], s->attrs->len + 1, 2)
+           ? NRF_SUCCESS : NRF_ERROR_INVALID_ADDR;
+}
+
+static const NRF51SDCall nrf51_sd_calls[] = {
+    { "sd_softdevice_enable", nrf51_sd_softdevice_enable },
+    { "sd_softdevice_disable", nrf51_sd_softdevice_disable },
+    { "sd_softdevice_is_enabled", nrf51_sd_softdevice_is_enabled },
+    { "sd_softdevice_vector_table_base_set", nrf51_sd_success },
+    { "sd_evt_get", nrf51_sd_evt_get },
+    { "sd_app_evt_wait", nrf51_sd_app_evt_wait },
+    { "sd_nvic_EnableIRQ", nrf51_sd_nvic_enable },
+    { "sd_nvic_DisableIRQ", nrf51_sd_nvic_disable },
+    { "sd_nvic_GetPendingIRQ", nrf51_sd_nvic_get_pending },
+    { "sd_nvic_SetPendingIRQ", nrf51_sd_nvic_set_pending },
+    { "sd_nvic_ClearPendingIRQ", nrf51_sd_nvic_clear_pending },
+    { "sd_nvic_SetPriority", nrf51_sd_nvic_set_priority },
+    { "sd_nvic_GetPriority", nrf51_sd_nvic_get_priority },
+    { "sd_nvic_SystemReset", nrf51_sd_nvic_system_reset },
+    { "sd_nvic_critical_region_enter", nrf51_sd_critical_enter },
+    { "sd_nvic_critical_region_exit", nrf51_sd_critical_exit },
+    { "sd_mutex_new", nrf51_sd_mutex_new },
+    { "sd_mutex_acquire", nrf51_sd_mutex_acquire },
+    { "sd_mutex_release", nrf51_sd_mutex_new },
+    { "sd_rand_application_pool_capacity_get", nrf51_sd_rand_pool },
+    { "sd_rand_application_bytes_available_get", nrf51_sd_rand_pool },
+    { "sd_rand_application_vector_get", nrf51_sd_rand_get },
+    { "sd_temp_get", nrf51_sd_temp_get },
+    { "sd_ecb_block_encrypt", nrf51_sd_ecb_block_encrypt },
+    { "sd_flash_write", nrf51_sd_flash_write },
+    { "sd_flash_page_erase", nrf51_sd_flash_page_erase },
+    { "sd_power_system_off", nrf51_sd_power_system_off },
+    { "sd_power_reset_reason_get", nrf51_sd_power_reset_reason_get },
+    { "sd_power_reset_reason_clr", nrf51_sd_power_reset_reason_clr },
+    { "sd_power_gpregret_get", nrf51_sd_power_gpregret_get },
+    { "sd_power_gpregret_set", nrf51_sd_power_gpregret_set },
+    { "sd_power_gpregret_clr", nrf51_sd_power_gpregret_clr },
+    { "sd_power_mode_set", nrf51_sd_success },
+    { "sd_power_dcdc_mode_set", nrf51_sd_success },
+    { "sd_power_pof_enable", nrf51_sd_success },
+    { "sd_power_pof_threshold_set", nrf51_sd_success },
+    { "sd_clock_hfclk_request", nrf51_sd_clock_hfclk_request },
+    { "sd_clock_hfclk_release", nrf51_sd_clock_hfclk_release },
+    { "sd_clock_hfclk_is_running", nrf51_sd_clock_hfclk_is_running },
+    { "sd_ppi_channel_enable_get", nrf51_sd_ppi_channel_enable_get },
+    { "sd_ppi_channel_enable_set", nrf51_sd_ppi_channel_enable_set },
+    { "sd_ppi_channel_enable_clr", nrf51_sd_ppi_channel_enable_clr },
+    { "sd_ppi_channel_assign", nrf51_sd_ppi_channel_assign },
+    { "sd_ppi_group_assign", nrf51_sd_ppi_group_assign },
+    { "sd_ppi_group_get", nrf51_sd_ppi_group_get },
+    { "sd_ppi_group_task_enable", nrf51_sd_ppi_group_task_enable },
+    { "sd_ppi_group_task_disable", nrf51_sd_ppi_group_task_disable },
+    { "sd_radio_notification_cfg_set", nrf51_sd_success },
+    { "sd_radio_session_open", nrf51_sd_radio_session_open },
+    { "sd_radio_session_close", nrf51_sd_radio_session_close },
+    { "sd_radio_request", nrf51_sd_radio_request },
+    { "sd_ble_enable", nrf51_sd_ble_enable },
+    { "sd_ble_evt_get", nrf51_sd_ble_evt_get },
+    { "sd_ble_version_get", nrf51_sd_ble_version_get },
+    { "sd_ble_tx_buffer_count_get", nrf51_sd_ble_tx_buffer_count_get },
+    { "sd_ble_uuid_vs_add", nrf51_sd_ble_uuid_vs_add },
+    { "sd_ble_uuid_encode", nrf51_sd_ble_uuid_encode },
+    { "sd_ble_uuid_decode", nrf51_sd_ble_uuid_decode },
+    { "sd_ble_opt_set", nrf51_sd_success },
+    { "sd_ble_user_mem_reply", nrf51_sd_no_conn },
+    { "sd_ble_gap_address_set", nrf51_sd_gap_address_set },
+    { "sd_ble_gap_address_get", nrf51_sd_gap_address_get },
+    { "sd_ble_gap_adv_data_set", nrf51_sd_gap_adv_data_set },
+    { "sd_ble_gap_adv_start", nrf51_sd_gap_adv_start },
+    { "sd_ble_gap_adv_stop", nrf51_sd_gap_adv_stop },
+    { "sd_ble_gap_device_name_set", nrf51_sd_gap_device_name_set },
+    { "sd_ble_gap_device_name_get", nrf51_sd_gap_device_name_get },
+    { "sd_ble_gap_appearance_set", nrf51_sd_gap_appearance_set },
+    { "sd_ble_gap_appearance_get", nrf51_sd_gap_appearance_get },
+    { "sd_ble_gap_ppcp_set", nrf51_sd_gap_ppcp_set },
+    { "sd_ble_gap_ppcp_get", nrf51_sd_gap_ppcp_get },
+    { "sd_ble_gap_tx_power_set", nrf51_sd_gap_tx_power_set },
+    { "sd_ble_gap_disconnect", nrf51_sd_no_conn },
+    { "sd_ble_gap_conn_param_update", nrf51_sd_no_conn },
+    { "sd_ble_gap_authenticate", nrf51_sd_no_conn },
+    { "sd_ble_gap_sec_params_reply", nrf51_sd_no_conn },
+    { "sd_ble_gap_auth_key_reply", nrf51_sd_no_conn },
+    { "sd_ble_gap_sec_info_reply", nrf51_sd_no_conn },
+    { "sd_ble_gap_conn_sec_get", nrf51_sd_no_conn },
+    { "sd_ble_gap_rssi_start", nrf51_sd_no_conn },
+    { "sd_ble_gap_rssi_stop", nrf51_sd_no_conn },
+    { "sd_ble_gatts_service_add", nrf51_sd_gatts_service_add },
+    { "sd_ble_gatts_include_add", nrf51_sd_gatts_include_add },
+    { "sd_ble_gatts_characteristic_add", nrf51_sd_gatts_characteristic_add },
+    { "sd_ble_gatts_descriptor_add", nrf51_sd_gatts_descriptor_add },
+    { "sd_ble_gatts_value_set", nrf51_sd_gatts_value_set },
+    { "sd_ble_gatts_value_get", nrf51_sd_gatts_value_get },
+    { "sd_ble_gatts_initial_user_handle_get",
+      nrf51_sd_gatts_first_handle_get },
+    { "sd_ble_gatts_hvx", nrf51_sd_no_conn },
+    { "sd_ble_gatts_service_changed", nrf51_sd_no_conn },
+    { "sd_ble_gatts_rw_authorize_reply", nrf51_sd_no_conn },
+    { "sd_ble_gatts_sys_attr_set", nrf51_sd_no_conn },
+    { "sd_ble_gatts_sys_attr_get", nrf51_sd_no_conn },
+};
+
+static uint32_t nrf51_sd_unsupported(NRF51SoftDeviceState *s,
+                                     const uint32_t *a)
+{
+    return NRF_ERROR_NOT_SUPPORTED;
+}
+
+/*
+ * An ELF symbol of the application: if it is an sd_* SVC stub, its SVC
+ * calls the model.  Local symbols may carry a suffix, as ".lto_priv.0".
+ */
+static void nrf51_sd_add_stub(NRF51SoftDeviceState *s, const char *name,
+                              uint32_t addr)
+{
+    size_t len = strcspn(name, ".");
+    NRF51SDCall *unknown;
+
+    if (strncmp(name, "sd_", 3)) {
+        return;
+    }
+    for (int i = 0; i < ARRAY_SIZE(nrf51_sd_calls); i++) {
+        if (strlen(nrf51_sd_calls[i].name) == len &&
+            !strncmp(nrf51_sd_calls[i].name, name, len)) {
+            g_hash_table_insert(s->stubs, GUINT_TO_POINTER(addr & ~1),
+                                (gpointer)&nrf51_sd_calls[i]);
+            return;
+        }
+    }
+    unknown = g_new(NRF51SDCall, 1);
+    unknown->name = g_strndup(name, len);
+    unknown->fn = nrf51_sd_unsupported;
+    g_hash_table_insert(s->stubs, GUINT_TO_POINTER(addr & ~1), unknown);
+}
+
+static bool nrf51_sd_has_stubs(NRF51SoftDeviceState *s)
+{
+    return g_hash_table_size(s->stubs);
+}
+
+/* Under the BQL, from arm_v7m_cpu_do_interrupt() */
+static bool nrf51_sd_svc(ARMCPU *cpu, uint32_t imm, void *opaque)
+{
+    NRF51SoftDeviceState *s = opaque;
+    CPUARMState *env = &cpu->env;
+    const NRF51SDCall *call;
+    uint32_t ret;
+
+    /* The stub's first insn is the SVC */
+    call = g_hash_table_lookup(s->stubs, GUINT_TO_POINTER(env->regs[15] - 2));
+    if (!call) {
+        return false;
+    }
+
+    nrf51_lock();
+    if (call->fn == nrf51_sd_unsupported) {
+        qemu_log_mask(LOG_UNIMP, "%s: %s (SVC 0x%02x) is not implemented\n",
+                      __func__, call->name, imm);
+    }
+    if (!strncmp(call->name, "sd_ble_", 7) && !s->enabled) {
+        ret = NRF_ERROR_SOFTDEVICE_NOT_ENABLED;
+    } else if (!strncmp(call->name, "sd_ble_", 7) && !s->ble_enabled &&
+               call->fn != nrf51_sd_ble_enable) {
+        ret = BLE_ERROR_NOT_ENABLED;
+    } else {
+        ret = call->fn(s, env->regs);
+    }
+    env->regs[0] = ret;
+    nrf51_unlock();
+    return true;
+}
+
+static Property nrf51_softdevice_properties[] = {
+    DEFINE_PROP_LINK("cpu", NRF51SoftDeviceState, cpu, TYPE_ARM_CPU,
+                     ARMCPU *),
+    DEFINE_PROP_LINK("radio", NRF51SoftDeviceState, radio, TYPE_NRF51_RADIO,
+                     NRF51RadioState *),
+    DEFINE_PROP_LINK("memory", NRF51SoftDeviceState, memory,
+                     TYPE_MEMORY_REGION, MemoryRegion *),
+    DEFINE_PROP_UINT64("address", NRF51SoftDeviceState, address,
+                       0xC04D42000000ULL),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_softdevice_realize(DeviceState *dev, Error **errp)
+{
+    NRF51SoftDeviceState *s = NRF51_SOFTDEVICE(dev);
+
+    if (!s->cpu || !s->radio) {
+        error_setg(errp, "%s: needs the cpu and radio links", __func__);
+        return;
+    }
+    address_space_init(&s->as, s->memory ? s->memory : get_system_memory(),
+                       TYPE_NRF51_SOFTDEVICE);
+    s->adv_timer = nrf51_locked_timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                          nrf51_sd_adv_expire, s);
+    arm_cpu_set_svc_hook(s->cpu, nrf51_sd_svc, s);
+}
+
+static void nrf51_softdevice_reset(DeviceState *dev)
+{
+    NRF51SoftDeviceState *s = NRF51_SOFTDEVICE(dev);
+
+    nrf51_sd_adv_stop(s);
+    g_queue_clear(&s->soc_evts);
+    while (!g_queue_is_empty(&s->ble_evts)) {
+        g_byte_array_free(g_queue_pop_head(&s->ble_evts), true);
+    }
+    for (int i = 0; i < s->attrs->len; i++) {
+        g_free(g_array_index(s->attrs, NRF51SDAttr, i).value);
+    }
+    g_array_set_size(s->attrs, 0);
+    s->enabled = false;
+    s->ble_enabled = false;
+    s->gap_addr[0] = BLE_GAP_ADDR_TYPE_RANDOM_STATIC;
+    for (int i = 0; i < 6; i++) {
+        s->gap_addr[1 + i] = s->address >> (8 * i);
+    }
+    s->dev_name_len = 0;
+    s->appearance = 0;
+    memset(s->ppcp, 0, sizeof(s->ppcp));
+    s->adv_data_len = 0;
+    s->vs_uuid_count = 0;
+    s->critical = false;
+    s->radio_session = false;
+    qemu_irq_lower(s->irq);
+}
+
+static void nrf51_softdevice_init(Object *obj)
+{
+    NRF51SoftDeviceState *s = NRF51_SOFTDEVICE(obj);
+
+    s->stubs = g_hash_table_new(NULL, NULL);
+    s->attrs = g_array_new(FALSE, TRUE, sizeof(NRF51SDAttr));
+    g_queue_init(&s->soc_evts);
+    g_queue_init(&s->ble_evts);
+    sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
+}
+
+/* The GATT table and the event queues live on the host only */
+static const VMStateDescription vmstate_nrf51_softdevice = {
+    .name = TYPE_NRF51_SOFTDEVICE,
+    .unmigratable = 1,
+};
+
+static void nrf51_softdevice_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = nrf51_softdevice_realize;
+    dc->reset = nrf51_softdevice_reset;
+    dc->props = nrf51_softdevice_properties;
+    dc->vmsd = &vmstate_nrf51_softdevice;
+}
+
+static const TypeInfo nrf51_softdevice_info = {
+    .name          = TYPE_NRF51_SOFTDEVICE,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51SoftDeviceState),
+    .instance_init = nrf51_softdevice_init,
+    .class_init    = nrf51_softdevice_class_init,
+};
+
+/**
+ * MicroPython VM profiler
+ *
+ * Guest PC profiles of MicroPython firmware all land in
+ * mp_execute_bytecode.  With the mpy-profile option, every TB in that
+ * function calls microbit_mpy_hook on entry:
+ *
+ * - At the function's first insn, r0 is the mp_code_state_t of the
+ *   Python function about to run.  It is pushed with the SP, and popped
+ *   again once the SP is back at or above that value.
+ * - Until the opcode dispatch is known, the hook counts entries per TB.
+ *   Every opcode handler jumps back to the dispatch, so after a warm-up
+ *   it is the hottest TB after the entry.
+ * - Each entry to the dispatch then reads the first two words of the
+ *   innermost code state from guest memory: the function (fun_bc, or
+ *   code_info in older ports) and ip, which the VM stores there on the
+ *   way to the dispatch.  Both are counted.
+ *
+ * The counts come back from query-microbit-mpy-profile as guest
+ * pointers; mapping them to source lines needs the bytecode's line
+ * number table and is left to the host tools.
+ */
+#define MPY_PROFILE_WARMUP      10000
+#define MPY_PROFILE_MAX_FRAMES  64
+#define MPY_PROFILE_DEFAULT_MAX 20
+
+typedef struct MicrobitMpyFrame {
+    uint32_t code_state;
+    uint32_t sp;
+} MicrobitMpyFrame;
+
+typedef struct MicrobitMpyProfile {
+    uint32_t board;
+    uint32_t vm_entry;
+    uint32_t dispatch;
+    /* Held by the vCPU for each hook, and by the monitor to read */
+    QemuMutex lock;
+    GHashTable *tb_hits;
+    uint64_t warmup;
+    GArray *frames;
+    GHashTable *ips;
+    GHashTable *funcs;
+    uint64_t samples;
+} MicrobitMpyProfile;
+
+static GSList *microbit_mpy_profiles;
+
+static void microbit_mpy_count(GHashTable *table, uint32_t key)
+{
+    gpointer k = GUINT_TO_POINTER(key);
+    uint64_t *count = g_hash_table_lookup(table, k);
+
+    if (!count) {
+        count = g_new0(uint64_t, 1);
+        g_hash_table_insert(table, k, count);
+    }
+    (*count)++;
+}
+
+static void microbit_mpy_find_dispatch(MicrobitMpyProfile *p)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    uint64_t best = 0;
+
+    g_hash_table_iter_init(&iter, p->tb_hits);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (GPOINTER_TO_UINT(key) != p->vm_entry &&
+            *(uint64_t *)value > best) {
+            best = *(uint64_t *)value;
+            p->dispatch = GPOINTER_TO_UINT(key);
+        }
+    }
+    g_hash_table_destroy(p->tb_hits);
+    p->tb_hits = NULL;
+}
+
+static void microbit_mpy_hook(ARMCPU *cpu, uint32_t pc, void *opaque)
+{
+    MicrobitMpyProfile *p = opaque;
+    uint32_t sp = cpu->env.regs[13];
+    MicrobitMpyFrame frame;
+    uint8_t buf[8];
+
+    qemu_mutex_lock(&p->lock);
+    /* Frames left by a return or a longjmp out of the VM */
+    while (p->frames->len &&
+           g_array_index(p->frames, MicrobitMpyFrame,
+                         p->frames->len - 1).sp <= sp) {
+        g_array_set_size(p->frames, p->frames->len - 1);
+    }
+
+    if (pc == p->vm_entry) {
+        frame.code_state = cpu->env.regs[0];
+        frame.sp = sp;
+        /* Deeper recursion than this only loses the innermost frames */
+        if (p->frames->len == MPY_PROFILE_MAX_FRAMES) {
+            g_array_remove_index(p->frames, 0);
+        }
+        g_array_append_val(p->frames, frame);
+    } else if (!p->dispatch) {
+        microbit_mpy_count(p->tb_hits, pc);
+        if (++p->warmup == MPY_PROFILE_WARMUP) {
+            microbit_mpy_find_dispatch(p);
+        }
+    } else if (pc == p->dispatch && p->frames->len) {
+        frame = g_array_index(p->frames, MicrobitMpyFrame,
+                              p->frames->len - 1);
+        if (!cpu_memory_rw_debug(CPU(cpu), frame.code_state, buf,
+                                 sizeof(buf), 0)) {
+            microbit_mpy_count(p->funcs, ldl_le_p(buf));
+            microbit_mpy_count(p->ips, ldl_le_p(buf + 4));
+            p->samples++;
+        }
+    }
+    qemu_mutex_unlock(&p->lock);
+}
+
+static void microbit_mpy_profile_init(ARMCPU *cpu, uint32_t board,
+                                      uint32_t addr, uint32_t size)
+{
+    MicrobitMpyProfile *p = g_new0(MicrobitMpyProfile, 1);
+
+    p->board = board;
+    p->vm_entry = addr & ~1;
+    qemu_mutex_init(&p->lock);
+    p->tb_hits = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    p->frames = g_array_new(false, false, sizeof(MicrobitMpyFrame));
+    p->ips = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    p->funcs = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    microbit_mpy_profiles = g_slist_append(microbit_mpy_profiles, p);
+    arm_cpu_set_pc_hook(cpu, p->vm_entry, p->vm_entry + size,
+                        microbit_mpy_hook, p);
+}
+
+static gint microbit_mpy_sample_cmp(gconstpointer a, gconstpointer b)
+{
+    const MicrobitMpySample *sa = *(MicrobitMpySample * const *)a;
+    const MicrobitMpySample *sb = *(MicrobitMpySample * const *)b;
+
+    if (sa->count != sb->count) {
+        return sa->count < sb->count ? 1 : -1;
+    }
+    return sa->address < sb->address ? -1 : sa->address > sb->address;
+}
+
+/* The @max most sampled keys of @table, most sampled first */
+static MicrobitMpySampleList *microbit_mpy_top(GHashTable *table,
+                                               int64_t max)
+{
+    MicrobitMpySampleList *head = NULL, **tail = &head;
+    GPtrArray *samples = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer key, value;
+    int i;
+
+    g_hash_table_iter_init(&iter, table);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        MicrobitMpySample *sample = g_new0(MicrobitMpySample, 1);
+
+        sample->address = GPOINTER_TO_UINT(key);
+        sample->count = *(uint64_t *)value;
+        g_ptr_array_add(samples, sample);
+    }
+    g_ptr_array_sort(samples, microbit_mpy_sample_cmp);
+
+    for (i = 0; i < samples->len; i++) {
+        if (i < max) {
+            *tail = g_new0(MicrobitMpySampleList, 1);
+            (*tail)->value = g_ptr_array_index(samples, i);
+            tail = &(*tail)->next;
+        } else {
+            g_free(g_ptr_array_index(samples, i));
+        }
+    }
+    g_ptr_array_free(samples, true);
+    return head;
+}
+
+MicrobitMpyProfileInfoList *qmp_query_microbit_mpy_profile(bool has_max,
+                                                           int64_t max,
+                                                           Error **errp)
+{
+    MicrobitMpyProfileInfoList *head = NULL, **tail = &head;
+    GSList *l;
+
+    if (!microbit_mpy_profiles) {
+        error_setg(errp, "MicroPython profiling is disabled, start with "
+                   "-machine mpy-profile=on and an ELF -kernel");
+        return NULL;
+    }
+    if (!has_max) {
+        max = MPY_PROFILE_DEFAULT_MAX;
+    } else if (max <= 0) {
+        error_setg(errp, "Parameter 'max' expects a positive number");
+        return NULL;
+    }
+
+    for (l = microbit_mpy_profiles; l; l = l->next) {
+        MicrobitMpyProfile *p = l->data;
+        MicrobitMpyProfileInfo *info = g_new0(MicrobitMpyProfileInfo, 1);
+
+        qemu_mutex_lock(&p->lock);
+        info->board = p->board;
+        info->vm_entry = p->vm_entry;
+        if (p->dispatch) {
+            info->has_dispatch = true;
+            info->dispatch = p->dispatch;
+        }
+        info->samples = p->samples;
+        info->ips = microbit_mpy_top(p->ips, max);
+        info->functions = microbit_mpy_top(p->funcs, max);
+        qemu_mutex_unlock(&p->lock);
+
+        *tail = g_new0(MicrobitMpyProfileInfoList, 1);
+        (*tail)->value = info;
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+/* The ELF symbol callback has no opaque: the load in progress */
+static struct {
+    ARMCPU *cpu;
+    bool hle;
+    NRF51SoftDeviceState *sd;
+    uint32_t vm_addr;
+    uint32_t vm_size;
+} microbit_elf_load;
+
+static void microbit_elf_symbol(const char *st_name, int st_info,
+                                uint64_t st_value, uint64_t st_size)
+{
+    if (ELF_ST_TYPE(st_info) != STT_FUNC) {
+        return;
+    }
+    if (microbit_elf_load.hle) {
+        arm_cpu_add_hle(microbit_elf_load.cpu, st_name, st_value);
+    }
+    if (microbit_elf_load.sd) {
+        nrf51_sd_add_stub(microbit_elf_load.sd, st_name, st_value);
+    }
+    if (!strcmp(st_name, "mp_execute_bytecode")) {
+        microbit_elf_load.vm_addr = st_value;
+        microbit_elf_load.vm_size = st_size;
+    }
+}
+
+/**
+ * Accepts ELF (keeping its symbols), Intel HEX addressed at the nRF51 flash,
+ * or a flat binary placed at STARTUP_ADDR. Returns true when the image does
+ * not provide its own vector table at address 0. With @hle, the library
+ * routines an ELF defines run as host code; with @mpy_profile, its
+ * MicroPython VM is profiled as board @board. With @sd, the ELF's SoftDevice
+ * calls go to that model.
+ */
+static bool microbit_load_kernel(ARMCPU *cpu, AddressSpace *as,
+                                 const char *kernel_filename, int mem_size,
+                                 bool hle, bool mpy_profile, uint32_t board,
+                                 NRF51SoftDeviceState *sd)
+{
+    uint64_t lowaddr;
+    int ret;
+
+    microbit_elf_load.cpu = cpu;
+    microbit_elf_load.hle = hle;
+    microbit_elf_load.sd = sd;
+    microbit_elf_load.vm_addr = 0;
+    microbit_elf_load.vm_size = 0;
+    ret = load_elf_ram_sym(kernel_filename, NULL, NULL, NULL, &lowaddr, NULL,
+                           0, EM_ARM, 1, 0, as, true,
+                           hle || mpy_profile || sd ? microbit_elf_symbol
+                                                    : NULL);
+    if (sd && !nrf51_sd_has_stubs(sd)) {
+        warn_report("microbit: softdevice-hle needs an ELF -kernel that "
+                    "defines the sd_* SVC stubs");
+    }
+    if (mpy_profile) {
+        if (microbit_elf_load.vm_size) {
+            microbit_mpy_profile_init(cpu, board, microbit_elf_load.vm_addr,
+                                      microbit_elf_load.vm_size);
+        } else {
+            warn_report("microbit: mpy-profile needs an ELF -kernel that "
+                        "defines mp_execute_bytecode");
+        }
+    }
+    if (ret == ELF_LOAD_NOT_ELF) {
+        if (microbit_is_hex(kernel_filename)) {
+            ret = microbit_load_hex(kernel_filename, CODE_LOADER_BASE,
+                                    STARTUP_ADDR + mem_size, as, NULL, NULL);
+            lowaddr = rom_ptr(CODE_LOADER_BASE) ? CODE_LOADER_BASE
+                                                : STARTUP_ADDR;
+        } else {
+            ret = load_image_targphys_as(kernel_filename, STARTUP_ADDR,
+                                         mem_size, as);
+            lowaddr = STARTUP_ADDR;
+        }
+    }
+
+    if (ret < 0) {
+        error_report("%s: Failed to load file %s", __func__,
+                     kernel_filename);
+        exit(1);
+    }
+
+    qemu_register_reset(microbit_cpu_reset, cpu);
+    return lowaddr >= STARTUP_ADDR;
+}
+
+static void microbit_copy_vector(MemoryRegion *dest_mem, hwaddr src_base,
+                                 size_t vec_size)
+{
+    uint32_t* dest = (uint32_t *)memory_region_get_ram_ptr(dest_mem);
+
+    for(int i = 0; i < vec_size / 4; i++) {
+        dest[i] = ldl_p(rom_ptr(src_base + i * 4));
+    }
+}
+
+/**
+ * NRF51 SOC
+ */
+
+/*
+ * One nRF51822 with its Cortex-M0, memories and peripherals. The SoC
+ * builds everything on the bus given by its "memory" link. The
+ * micro:bit machine passes the system bus; without a link, the SoC
+ * builds its own bus, so several can share one process.
+ */
+
+#define TYPE_NRF51_SOC "nrf51_soc"
+#define NRF51_SOC(obj) \
+    OBJECT_CHECK(NRF51SoCState, (obj), TYPE_NRF51_SOC)
+
+typedef struct {
+    /* Private */
+    SysBusDevice parent;
+
+    /* Public */
+    ARMv7MState armv7m;
+    /* Bus the CPU and the peripherals live on */
+    MemoryRegion *memory;
+    MemoryRegion container;
+    AddressSpace as;
+    MemoryRegion ram;
+    MemoryRegion code_loader;
+    /* Vector table at 0, shared with the mapped flash's first page */
+    MemoryRegion vectors;
+    /* Code flash, owned by the NVMC */
+    MemoryRegion *flash;
+    char *flash_image;
+    char *flash_backing;
+    bool flash_scratch;
+    /* Stall the CPU for the duration of NVMC erases */
+    bool flash_latency;
+    /* Board number: picks the serial port and the -pflash unit */
+    uint32_t index;
+    uint64_t ram_size;
+    char *cpu_type;
+    /* Log the RAM pages the guest writes, for query-microbit-ram-usage */
+    bool ram_usage;
+    /* Serve the SoftDevice calls on the host */
+    bool softdevice_hle;
+    NRF51SoftDeviceState *softdevice;
+    /* Give the LED matrix a console, unless the dashboard shows it */
+    bool led_console;
+
+} NRF51SoCState;
+
+typedef enum {
+    DEVICE_UNIMPL,
+    DEVICE_SIMPLE,
+} microbit_device_type_t;
+
+typedef struct {
+    const char *           name;
+    uint32_t               base_addr;
+    uint32_t               size;
+    microbit_device_type_t type;
+} microbit_device_info_t;
+
+static const microbit_device_info_t microbit_devices[] = {
+    {"spis1",                 SPIS1_BASE,  0x1000, DEVICE_UNIMPL},
+    {"spim1",                 SPIM1_BASE,  0x1000, DEVICE_UNIMPL},
+    {"swi",                   SWI_BASE,    0x1000, DEVICE_UNIMPL},
+    {"unknown",               0xF0000000,  0x1000, DEVICE_UNIMPL},
+    {"nrf51_ficr",            FICR_BASE,   0x1000, DEVICE_SIMPLE},
+};
+
+/* Loader address space: NULL, the loader's default, on the system bus */
+static AddressSpace *nrf51_soc_address_space(NRF51SoCState *s)
+{
+    return s->memory == get_system_memory() ? NULL : &s->as;
+}
+
+/* RAM block names must be unique; board 0 keeps the single board's */
+static char *nrf51_soc_name(NRF51SoCState *s, const char *name)
+{
+    return s->index ? g_strdup_printf("%s.%" PRIu32, name, s->index)
+                    : g_strdup(name);
+}
+
+/* sysbus_mmio_map() onto the SoC's bus */
+static void nrf51_soc_map(NRF51SoCState *s, DeviceState *dev, int n,
+                          hwaddr base, int priority)
+{
+    if (s->memory == get_system_memory()) {
+        sysbus_mmio_map_overlap(SYS_BUS_DEVICE(dev), n, base, priority);
+        return;
+    }
+    memory_region_add_subregion_overlap(s->memory, base,
+        sysbus_mmio_get_region(SYS_BUS_DEVICE(dev), n), priority);
+}
+
+/* NVIC input `irq`, which devices may set without the BQL */
+static qemu_irq nrf51_soc_nvic_in(NRF51SoCState *s, int irq)
+{
+    return nrf51_bql_irq_new(qdev_get_gpio_in(DEVICE(&s->armv7m), irq));
+}
+
+/* Create a peripheral that signals its events to the PPI */
+static DeviceState *microbit_create_ppi_client(NRF51SoCState *s,
+                                               const char *type,
+                                               hwaddr base, int irq,
+                                               DeviceState *ppi)
+{
+    DeviceState *dev = qdev_create(NULL, type);
+
+    object_property_set_link(OBJECT(dev), OBJECT(ppi), "ppi", &error_abort);
+    if (object_property_find(OBJECT(dev), "memory", NULL)) {
+        object_property_set_link(OBJECT(dev), OBJECT(s->memory), "memory",
+                                 &error_abort);
+    }
+    qdev_init_nofail(dev);
+    nrf51_soc_map(s, dev, 0, base, 0);
+    sysbus_connect_irq(SYS_BUS_DEVICE(dev), 0, nrf51_soc_nvic_in(s, irq));
+    return dev;
+}
+
+/**
+ * Two peripherals sharing one ID: both are mapped at `base` behind one
+ * interrupt, and `owner_type` owns the window until its peer is enabled.
+ * Returns the owner.
+ */
+static DeviceState *microbit_create_shared(NRF51SoCState *s,
+                                           const char *owner_type,
+                                           const char *peer_type,
+                                           const char *irq_name,
+                                           hwaddr base, int irq,
+                                           DeviceState *ppi)
+{
+    DeviceState *dev[2] = {
+        qdev_create(NULL, owner_type), qdev_create(NULL, peer_type)
+    };
+    Object *orgate = object_new(TYPE_OR_IRQ);
+
+    for (int i = 0; i < 2; i++) {
+        object_property_set_link(OBJECT(dev[i]), OBJECT(ppi), "ppi",
+                                 &error_abort);
+        object_property_set_link(OBJECT(dev[i]), OBJECT(dev[!i]), "peer",
+                                 &error_abort);
+        if (object_property_find(OBJECT(dev[i]), "memory", NULL)) {
+            object_property_set_link(OBJECT(dev[i]), OBJECT(s->memory),
+                                     "memory", &error_abort);
+        }
+    }
+    qdev_init_nofail(dev[0]);
+    qdev_init_nofail(dev[1]);
+    object_property_add_child(OBJECT(s), irq_name, orgate, &error_abort);
+    object_unref(orgate);
+    object_property_set_int(orgate, 2, "num-lines", &error_abort);
+    object_property_set_bool(orgate, true, "realized", &error_abort);
+    qdev_connect_gpio_out(DEVICE(orgate), 0, nrf51_soc_nvic_in(s, irq));
+
+    for (int i = 0; i < 2; i++) {
+        nrf51_soc_map(s, dev[i], 0, base, 0);
+        sysbus_connect_irq(SYS_BUS_DEVICE(dev[i]), 0,
+                           qdev_get_gpio_in(DEVICE(orgate), i));
+    }
+    nrf51_periph_claim(SYS_BUS_DEVICE(dev[0]), SYS_BUS_DEVICE(dev[1]));
+    return dev[0];
+}
+
+/* SPIn and TWIn share one ID and TWI owns the window first. Returns TWI. */
+static DeviceState *microbit_create_spi_twi(NRF51SoCState *s, hwaddr base,
+                                            int irq, DeviceState *ppi)
+{
+    return microbit_create_shared(s, TYPE_NRF51_TWI, TYPE_NRF51_SPI,
+                                  "spi-twi-irq[*]", base, irq, ppi);
+}
+
+static void microbit_create_devices(NRF51SoCState *s)
+{
+    const microbit_device_info_t *dev = microbit_devices;
+    for (int i = 0; i < ARRAY_SIZE(microbit_devices); i++) {
+        DeviceState *d;
+
+        switch (dev->type) {
+            case DEVICE_UNIMPL:
+                /* create_unimplemented_device(), on our bus */
+                d = qdev_create(NULL, TYPE_UNIMPLEMENTED_DEVICE);
+                qdev_prop_set_string(d, "name", dev->name);
+                qdev_prop_set_uint64(d, "size", dev->size);
+                qdev_init_nofail(d);
+                nrf51_soc_map(s, d, 0, dev->base_addr, -1000);
+                break;
+            case DEVICE_SIMPLE:
+                d = qdev_create(NULL, dev->name);
+                qdev_init_nofail(d);
+                nrf51_soc_map(s, d, 0, dev->base_addr, 0);
+                break;
+            default:
+                g_assert_not_reached();
+                break;
+        }
+        dev ++;
+    }
+}
+
+static void nrf51_soc_init(Object *obj)
+{
+    NRF51SoCState *s = NRF51_SOC(obj);
+
+    object_initialize(&s->armv7m, sizeof(s->armv7m), TYPE_ARMV7M);
+    object_property_add_child(obj, "armv7m", OBJECT(&s->armv7m),
+                              &error_abort);
+    qdev_set_parent_bus(DEVICE(&s->armv7m), sysbus_get_default());
+}
+
+static void nrf51_soc_realize(DeviceState *dev, Error **errp)
+{
+    NRF51SoCState *s = NRF51_SOC(dev);
+    DeviceState *armv7m = DEVICE(&s->armv7m);
+    Error *local_err = NULL;
+    DriveInfo *dinfo;
+    DeviceState *nvmc;
+    DeviceState *ppi;
+    DeviceState *uart;
+    DeviceState *gpio;
+    DeviceState *gpiote;
+    DeviceState *led;
+    DeviceState *cpm;
+    DeviceState *radio;
+    DeviceState *activity;
+    DeviceState *adc;
+    DeviceState *lpcomp;
+    DeviceState *rtc[2];
+    Object *lfclk;
+    DeviceState *twi;
+    I2CBus *i2c;
+    char *name;
+
+    if (!s->memory) {
+        memory_region_init(&s->container, OBJECT(s), "nrf51.container",
+                           UINT64_MAX);
+        s->memory = &s->container;
+    }
+    address_space_init(&s->as, s->memory, TYPE_NRF51_SOC);
+
+    /* Initial architecture */
+    qdev_prop_set_uint32(armv7m, "num-irq", NUM_IRQ);
+    qdev_prop_set_string(armv7m, "cpu-type", s->cpu_type);
+    /* ARMv6-M has no bitband alias regions */
+    qdev_prop_set_bit(armv7m, "enable-bitband", false);
+    object_property_set_link(OBJECT(armv7m), OBJECT(s->memory),
+                                     "memory", &error_abort);
+    object_property_set_bool(OBJECT(armv7m), true, "realized", &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* RAM */
+    name = nrf51_soc_name(s, "microbit.ram");
+    memory_region_init_ram(&s->ram, OBJECT(s), name, s->ram_size,
+                           &error_fatal);
+    g_free(name);
+    memory_region_add_subregion(s->memory, RAM_BASE, &s->ram);
+    /* Only the first write to each page since reset takes the slow path */
+    if (s->ram_usage) {
+        memory_region_set_log(&s->ram, true, DIRTY_MEMORY_VGA);
+    }
+
+    /* CODE: ROM */
+    name = nrf51_soc_name(s, "microbit.code_loader");
+    memory_region_init_ram(&s->code_loader, OBJECT(s), name,
+                           CODE_LOADER_SIZE, &error_fatal);
+    g_free(name);
+    memory_region_set_readonly(&s->code_loader, true);
+    memory_region_add_subregion(s->memory, CODE_LOADER_BASE,
+                                &s->code_loader);
+
+    /* CODE: FLASH and UICR, owned by the NVMC */
+    dinfo = drive_get(IF_PFLASH, 0, s->index);
+    nvmc = qdev_create(NULL, TYPE_NRF51_NVMC);
+    qdev_prop_set_uint32(nvmc, "flash-base", CODE_KERNEL_BASE);
+    qdev_prop_set_uint32(nvmc, "flash-size", CODE_KERNEL_SIZE);
+    name = nrf51_soc_name(s, "nrf51_nvmc.flash");
+    qdev_prop_set_string(nvmc, "flash-name", name);
+    g_free(name);
+    qdev_prop_set_uint32(nvmc, "uicr-base", UICR_BASE);
+    name = nrf51_soc_name(s, "nrf51_nvmc.uicr");
+    qdev_prop_set_string(nvmc, "uicr-name", name);
+    g_free(name);
+    object_property_set_link(OBJECT(nvmc), OBJECT(s->memory), "memory",
+                             &error_abort);
+    object_property_set_link(OBJECT(nvmc), OBJECT(s->armv7m.cpu), "cpu",
+                             &error_abort);
+    qdev_prop_set_bit(nvmc, "latency", s->flash_latency);
+    if (s->flash_image) {
+        qdev_prop_set_string(nvmc, "image", s->flash_image);
+    }
+    if (s->flash_backing) {
+        qdev_prop_set_string(nvmc, "backing", s->flash_backing);
+        qdev_prop_set_bit(nvmc, "scratch", s->flash_scratch);
+    }
+    if (dinfo) {
+        qdev_prop_set_drive(nvmc, "drive", blk_by_legacy_dinfo(dinfo),
+                            &error_fatal);
+    }
+    qdev_init_nofail(nvmc);
+    s->flash = sysbus_mmio_get_region(SYS_BUS_DEVICE(nvmc), 1);
+    nrf51_soc_map(s, nvmc, 0, NVMC_BASE, 0);
+    nrf51_soc_map(s, nvmc, 1, CODE_KERNEL_BASE, 0);
+    nrf51_soc_map(s, nvmc, 2, UICR_BASE, 0);
+    if (s->flash_image || s->flash_backing) {
+        /* Instead of microbit_copy_vector(), which would dirty a page */
+        memory_region_init_alias(&s->vectors, OBJECT(s), "microbit.vectors",
+            sysbus_mmio_get_region(SYS_BUS_DEVICE(nvmc), 1), 0,
+            VECTOR_SIZE);
+        memory_region_set_readonly(&s->vectors, true);
+        memory_region_add_subregion_overlap(s->memory, CODE_LOADER_BASE,
+                                            &s->vectors, 1);
+    }
+
+    /* Peripherals */
+    microbit_create_devices(s);
+    ppi = qdev_create(NULL, TYPE_NRF51_PPI);
+    object_property_set_link(OBJECT(ppi), OBJECT(s->memory), "memory",
+                             &error_abort);
+    qdev_init_nofail(ppi);
+    nrf51_soc_map(s, ppi, 0, PPI_BASE, 0);
+    microbit_create_ppi_client(s, TYPE_NRF51_TIMER, TIMER0_BASE, 8, ppi);
+    microbit_create_ppi_client(s, TYPE_NRF51_TIMER, TIMER1_BASE, 9, ppi);
+    microbit_create_ppi_client(s, TYPE_NRF51_TIMER, TIMER2_BASE, 10, ppi);
+    rtc[0] = microbit_create_ppi_client(s, TYPE_NRF51_RTC, RTC0_BASE, 11,
+                                        ppi);
+    rtc[1] = microbit_create_ppi_client(s, TYPE_NRF51_RTC, RTC1_BASE, 17,
+                                        ppi);
+    radio = microbit_create_ppi_client(s, TYPE_NRF51_RADIO, RADIO_BASE, 1,
+                                       ppi);
+    adc = microbit_create_ppi_client(s, TYPE_NRF51_ADC, ADC_BASE, 7, ppi);
+    microbit_create_ppi_client(s, TYPE_NRF51_QDEC, QDEC_BASE, 18, ppi);
+    microbit_create_ppi_client(s, TYPE_NRF51_RNG, RNG_BASE, 13, ppi);
+    microbit_create_ppi_client(s, TYPE_NRF51_TEMP, TEMP_BASE, 12, ppi);
+    microbit_create_ppi_client(s, TYPE_NRF51_ECB, ECB_BASE, 14, ppi);
+    microbit_create_shared(s, TYPE_NRF51_CCM, TYPE_NRF51_AAR, "ccm-aar-irq",
+                           CCM_BASE, 15, ppi);
+    microbit_create_ppi_client(s, TYPE_NRF51_WDT, WDT_BASE, 16, ppi);
+
+    /* The accelerometer and compass sit on TWI0 */
+    twi = microbit_create_spi_twi(s, SPI0_BASE, 3, ppi);
+    i2c = (I2CBus *)qdev_get_child_bus(twi, "i2c");
+    i2c_create_slave(i2c, TYPE_MMA8653, MMA8653_I2C_ADDR);
+    i2c_create_slave(i2c, TYPE_MAG3110, MAG3110_I2C_ADDR);
+    microbit_create_spi_twi(s, SPI1_BASE, 4, ppi);
+
+    gpio = qdev_create(NULL, TYPE_NRF51_GPIO);
+    /* At soc[N]/gpio, for wires between the boards of a fleet */
+    object_property_add_child(OBJECT(s), "gpio", OBJECT(gpio), &error_abort);
+    qdev_init_nofail(gpio);
+    nrf51_soc_map(s, gpio, 0, GPIO_BASE, 0);
+    led = qdev_create(NULL, TYPE_MICROBIT_LED_MATRIX);
+    object_property_add_child(OBJECT(s), "led-matrix", OBJECT(led),
+                              &error_abort);
+    object_property_set_link(OBJECT(led), OBJECT(gpio), "gpio",
+                             &error_abort);
+    qdev_prop_set_bit(led, "console", s->led_console);
+    qdev_init_nofail(led);
+    gpiote = qdev_create(NULL, TYPE_NRF51_GPIOTE);
+    object_property_set_link(OBJECT(gpiote), OBJECT(ppi), "ppi",
+                             &error_abort);
+    object_property_set_link(OBJECT(gpiote), OBJECT(gpio), "gpio",
+                             &error_abort);
+    qdev_init_nofail(gpiote);
+    nrf51_soc_map(s, gpiote, 0, GPIOTE_BASE, 0);
+    sysbus_connect_irq(SYS_BUS_DEVICE(gpiote), 0, nrf51_soc_nvic_in(s, 6));
+
+    /* LPCOMP compares the ADC's inputs */
+    lpcomp = qdev_create(NULL, TYPE_NRF51_LPCOMP);
+    object_property_set_link(OBJECT(lpcomp), OBJECT(ppi), "ppi",
+                             &error_abort);
+    object_property_set_link(OBJECT(lpcomp), OBJECT(adc), "adc",
+                             &error_abort);
+    qdev_init_nofail(lpcomp);
+    nrf51_soc_map(s, lpcomp, 0, LPCOMP_BASE, 0);
+    sysbus_connect_irq(SYS_BUS_DEVICE(lpcomp), 0, nrf51_soc_nvic_in(s, 19));
+
+    /* System OFF suspends the whole machine, so only a lone board has it */
+    cpm = qdev_create(NULL, TYPE_NRF51_CPM);
+    object_property_set_link(OBJECT(cpm), OBJECT(&s->ram), "ram",
+                             &error_abort);
+    object_property_set_link(OBJECT(cpm), OBJECT(gpio), "gpio",
+                             &error_abort);
+    object_property_set_link(OBJECT(cpm), OBJECT(lpcomp), "lpcomp",
+                             &error_abort);
+    qdev_prop_set_bit(cpm, "system-off", s->memory == get_system_memory());
+    qdev_init_nofail(cpm);
+    nrf51_soc_map(s, cpm, 0, CLOCK_BASE, 0);
+    qdev_connect_gpio_out_named(lpcomp, "anadetect", 0,
+                                qdev_get_gpio_in_named(cpm, "anadetect", 0));
+
+    activity = qdev_create(NULL, TYPE_NRF51_ACTIVITY);
+    object_property_set_link(OBJECT(activity), OBJECT(s->armv7m.cpu), "cpu",
+                             &error_abort);
+    qdev_prop_set_uint32(activity, "board", s->index);
+    qdev_init_nofail(activity);
+    qdev_connect_gpio_out_named(cpm, "hfclk", 0,
+                                qdev_get_gpio_in_named(activity, "hfclk", 0));
+    qdev_connect_gpio_out_named(cpm, "system-off", 0,
+        qdev_get_gpio_in_named(activity, "system-off", 0));
+    qdev_connect_gpio_out_named(radio, "on", 0,
+                                qdev_get_gpio_in_named(activity, "radio", 0));
+
+    /* The RTCs count LFCLK; TIMER and RNG fall back to the internal
+       HFCLK oscillator, so they never stop with it */
+    lfclk = object_new(TYPE_SPLIT_IRQ);
+    object_property_add_child(OBJECT(s), "lfclk-split", lfclk, &error_abort);
+    object_unref(lfclk);
+    object_property_set_int(lfclk, ARRAY_SIZE(rtc), "num-lines",
+                            &error_abort);
+    object_property_set_bool(lfclk, true, "realized", &error_abort);
+    qdev_connect_gpio_out_named(cpm, "lfclk", 0,
+                                qdev_get_gpio_in(DEVICE(lfclk), 0));
+    for (int i = 0; i < ARRAY_SIZE(rtc); i++) {
+        qdev_connect_gpio_out(DEVICE(lfclk), i,
+                              qdev_get_gpio_in_named(rtc[i], "lfclk", 0));
+    }
+
+    uart = qdev_create(NULL, TYPE_NRF51_UART);
+    qdev_prop_set_chr(uart, "chardev", serial_hd(s->index));
+    qdev_init_nofail(uart);
+    nrf51_soc_map(s, uart, 0, UART0_BASE, 0);
+    sysbus_connect_irq(SYS_BUS_DEVICE(uart), 0, nrf51_soc_nvic_in(s, 2));
+
+    if (s->softdevice_hle) {
+        DeviceState *sd = qdev_create(NULL, TYPE_NRF51_SOFTDEVICE);
+
+        object_property_add_child(OBJECT(s), "softdevice", OBJECT(sd),
+                                  &error_abort);
+        object_property_set_link(OBJECT(sd), OBJECT(s->armv7m.cpu), "cpu",
+                                 &error_abort);
+        object_property_set_link(OBJECT(sd), OBJECT(radio), "radio",
+                                 &error_abort);
+        object_property_set_link(OBJECT(sd), OBJECT(s->memory), "memory",
+                                 &error_abort);
+        /* Boards of a fleet advertise with addresses of their own */
+        qdev_prop_set_uint64(sd, "address", 0xC04D42000000ULL + s->index);
+        qdev_init_nofail(sd);
+        sysbus_connect_irq(SYS_BUS_DEVICE(sd), 0,
+                           nrf51_soc_nvic_in(s, NRF51_SD_EVT_IRQ));
+        s->softdevice = NRF51_SOFTDEVICE(sd);
+    }
+}
+
+static Property nrf51_soc_properties[] = {
+    DEFINE_PROP_LINK("memory", NRF51SoCState, memory, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_UINT32("index", NRF51SoCState, index, 0),
+    DEFINE_PROP_UINT64("ram-size", NRF51SoCState, ram_size, 32 * 1024),
+    DEFINE_PROP_STRING("cpu-type", NRF51SoCState, cpu_type),
+    DEFINE_PROP_STRING("flash-image", NRF51SoCState, flash_image),
+    DEFINE_PROP_STRING("flash-backing", NRF51SoCState, flash_backing),
+    DEFINE_PROP_BOOL("flash-scratch", NRF51SoCState, flash_scratch, false),
+    DEFINE_PROP_BOOL("flash-latency", NRF51SoCState, flash_latency, false),
+    DEFINE_PROP_BOOL("ram-usage", NRF51SoCState, ram_usage, false),
+    DEFINE_PROP_BOOL("softdevice-hle", NRF51SoCState, softdevice_hle, false),
+    DEFINE_PROP_BOOL("led-console", NRF51SoCState, led_console, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nrf51_soc_reset(DeviceState *dev)
+{
+    NRF51SoCState *s = NRF51_SOC(dev);
+
+    /* RAM starts out all dirty; count from reset */
+    if (s->ram_usage) {
+        memory_region_reset_dirty(&s->ram, 0, s->ram_size, DIRTY_MEMORY_VGA);
+    }
+}
+
+static void nrf51_soc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = nrf51_soc_realize;
+    dc->reset = nrf51_soc_reset;
+    dc->props = nrf51_soc_properties;
+}
+
+static const TypeInfo nrf51_soc_info = {
+    .name          = TYPE_NRF51_SOC,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(NRF51SoCState),
+    .instance_init = nrf51_soc_init,
+    .class_init    = nrf51_soc_class_init,
+};
+
+static MicrobitRamUsage *nrf51_soc_ram_usage(NRF51SoCState *s)
+{
+    MicrobitRamUsage *info = g_new0(MicrobitRamUsage, 1);
+    ARMCPU *cpu = s->armv7m.cpu;
+    uint32List **tail = &info->touched_pages;
+    hwaddr page;
+
+    info->board = s->index;
+    info->ram_base = RAM_BASE;
+    info->ram_size = s->ram_size;
+    if (cpu->sp_min[0] != UINT32_MAX) {
+        info->has_msp_min = true;
+        info->msp_min = cpu->sp_min[0];
+    }
+    if (cpu->sp_min[1] != UINT32_MAX) {
+        info->has_psp_min = true;
+        info->psp_min = cpu->sp_min[1];
+    }
+    if (!s->ram_usage) {
+        return info;
+    }
+
+    info->has_page_size = true;
+    info->page_size = TARGET_PAGE_SIZE;
+    info->has_touched_pages = true;
+    for (page = 0; page < s->ram_size; page += TARGET_PAGE_SIZE) {
+        if (memory_region_get_dirty(&s->ram, page, TARGET_PAGE_SIZE,
+                                    DIRTY_MEMORY_VGA)) {
+            *tail = g_new0(uint32List, 1);
+            (*tail)->value = page / TARGET_PAGE_SIZE;
+            tail = &(*tail)->next;
+        }
+    }
+    return info;
+}
+
+static int nrf51_soc_ram_usage_child(Object *obj, void *opaque)
+{
+    Object *soc = object_dynamic_cast(obj, TYPE_NRF51_SOC);
+    MicrobitRamUsageList ***tail = opaque;
+
+    if (soc) {
+        **tail = g_new0(MicrobitRamUsageList, 1);
+        (**tail)->value = nrf51_soc_ram_usage(NRF51_SOC(soc));
+        *tail = &(**tail)->next;
+    }
+    return 0;
+}
+
+MicrobitRamUsageList *qmp_query_microbit_ram_usage(Error **errp)
+{
+    MicrobitRamUsageList *head = NULL;
+    MicrobitRamUsageList **tail = &head;
+
+    object_child_foreach_recursive(object_get_root(),
+                                   nrf51_soc_ram_usage_child, &tail);
+    return head;
+}
+
+/**
+ * micro:bit ahead-of-time translation
+ */
+
+/*
+ * With "pretranslate", the blocks reachable from the vector table are
+ * translated before the guest runs, so boot and the first call of each
+ * handler do not pay for translation. The walk follows Thumb-1 control
+ * flow statically: it finds every direct branch target and every block
+ * a call or a page boundary splits, and gives up on indirect branches.
+ * Code it misses is translated on demand as usual.
+ */
+
+#define MICROBIT_PRETRANSLATE_END   (CODE_KERNEL_BASE + CODE_KERNEL_SIZE)
+#define MICROBIT_PRETRANSLATE_MAX_BLOCKS 8192
+/* Reset, NMI, HardFault, the reserved words, SVC, PendSV, SysTick, IRQs */
+#define MICROBIT_VECTORS            48
+
+typedef struct {
+    uint32_t pc;
+    bool handler;
+} MicrobitPretranslateBlock;
+
+typedef struct {
+    AddressSpace *as;
+    GArray *todo;
+    /* One bit per halfword: [handler] block start found, already walked */
+    unsigned long *starts[2];
+    unsigned long *walked[2];
+} MicrobitPretranslate;
+
+static void microbit_pretranslate_add(MicrobitPretranslate *pt, uint32_t pc,
+                                      bool handler)
+{
+    MicrobitPretranslateBlock block = { .pc = pc, .handler = handler };
+
+    if (pc >= MICROBIT_PRETRANSLATE_END - 4 ||
+        test_and_set_bit(pc / 2, pt->starts[handler])) {
+        return;
+    }
+    g_array_append_val(pt->todo, block);
+}
+
+/* Record the blocks the code from @block.pc to its first branch leads to */
+static void microbit_pretranslate_walk(MicrobitPretranslate *pt,
+                                       MicrobitPretranslateBlock block)
+{
+    AddressSpace *as = pt->as ? pt->as : &address_space_memory;
+    bool handler = block.handler;
+    uint32_t pc = block.pc;
+
+    while (pc < MICROBIT_PRETRANSLATE_END - 4 &&
+           !test_and_set_bit(pc / 2, pt->walked[handler])) {
+        uint16_t insn = lduw_le_phys(as, pc);
+        int32_t offset;
+
+        if ((insn & 0xf800) >= 0xe800) {
+            uint16_t insn2 = lduw_le_phys(as, pc + 2);
+
+            if ((insn & 0xf800) == 0xf000 && (insn2 & 0xd000) == 0xd000) {
+                /* BL: the callee, and the return point after it */
+                offset = sextract32(insn, 0, 11) << 12 |
+                         extract32(insn2, 0, 11) << 1;
+                offset ^= !extract32(insn2, 13, 1) << 23;
+                offset ^= !extract32(insn2, 11, 1) << 22;
+                microbit_pretranslate_add(pt, pc + 4 + offset, handler);
+                microbit_pretranslate_add(pt, pc + 4, handler);
+                return;
+            }
+            pc += 4;
+        } else if ((insn & 0xf000) == 0xd000) {
+            switch (extract32(insn, 8, 4)) {
+            case 0xe:
+                /* UDF */
+                return;
+            case 0xf:
+                /* SVC returns to the next instruction */
+                microbit_pretranslate_add(pt, pc + 2, handler);
+                return;
+            default:
+                offset = sextract32(insn, 0, 8) << 1;
+                microbit_pretranslate_add(pt, pc + 4 + offset, handler);
+                microbit_pretranslate_add(pt, pc + 2, handler);
+                return;
+            }
+        } else if ((insn & 0xf800) == 0xe000) {
+            offset = sextract32(insn, 0, 11) << 1;
+            microbit_pretranslate_add(pt, pc + 4 + offset, handler);
+            return;
+        } else if ((insn & 0xff00) == 0x4700) {
+            /* BX and BLX: only the return point of BLX is known */
+            if (insn & 0x80) {
+                microbit_pretranslate_add(pt, pc + 2, handler);
+            }
+            return;
+        } else if ((insn & 0xff00) == 0xbd00 ||
+                   (insn & 0xff87) == 0x4687 || (insn & 0xff87) == 0x4487) {
+            /* POP {..., pc}, MOV pc and ADD pc */
+            return;
+        } else {
+            pc += 2;
+        }
+
+        /* Blocks end at a page boundary */
+        if ((pc & TARGET_PAGE_MASK) != (block.pc & TARGET_PAGE_MASK)) {
+            microbit_pretranslate_add(pt, pc, handler);
+            return;
+        }
+    }
+}
+
+static void microbit_pretranslate_work(CPUState *cs, run_on_cpu_data data)
+{
+    NRF51SoCState *soc = data.host_ptr;
+    CPUARMState *env = cs->env_ptr;
+    size_t bits = MICROBIT_PRETRANSLATE_END / 2;
+    MicrobitPretranslate pt = { .as = nrf51_soc_address_space(soc) };
+    AddressSpace *as = pt.as ? pt.as : &address_space_memory;
+    target_ulong pc, cs_base;
+    uint32_t flags;
+    unsigned blocks = 0;
+    int i;
+
+    pt.todo = g_array_new(false, false, sizeof(MicrobitPretranslateBlock));
+    for (i = 0; i < 2; i++) {
+        pt.starts[i] = bitmap_new(bits);
+        pt.walked[i] = bitmap_new(bits);
+    }
+
+    /* Entry 0 is the initial stack pointer, entry 1 the thread-mode reset */
+    for (i = 1; i < MICROBIT_VECTORS; i++) {
+        uint32_t vector = ldl_le_phys(as, i * 4);
+
+        if (vector & 1) {
+            microbit_pretranslate_add(&pt, vector & ~1, i != 1);
+        }
+    }
+
+    /*
+     * Blocks are entered with the reset state's flags, tagged with the
+     * mode they run in; a guest that changes other state on the way only
+     * translates those blocks again.
+     */
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    for (i = 0; i < pt.todo->len &&
+                i < MICROBIT_PRETRANSLATE_MAX_BLOCKS; i++) {
+        MicrobitPretranslateBlock block =
+            g_array_index(pt.todo, MicrobitPretranslateBlock, i);
+        uint32_t block_flags = block.handler ?
+            flags | ARM_TBFLAG_HANDLER_MASK : flags & ~ARM_TBFLAG_HANDLER_MASK;
+
+        microbit_pretranslate_walk(&pt, block);
+        if (!tb_pretranslate(cs, block.pc, cs_base, block_flags)) {
+            break;
+        }
+        blocks++;
+    }
+    trace_microbit_pretranslate(blocks);
+
+    for (i = 0; i < 2; i++) {
+        g_free(pt.starts[i]);
+        g_free(pt.walked[i]);
+    }
+    g_array_free(pt.todo, true);
+}
+
+/* Runs after the ROM reset has put the firmware in place */
+static void microbit_pretranslate_reset(void *opaque)
+{
+    NRF51SoCState *soc = opaque;
+
+    async_run_on_cpu(CPU(soc->armv7m.cpu), microbit_pretranslate_work,
+                     RUN_ON_CPU_HOST_PTR(soc));
+}
+
+/**
+ * micro:bit translation cache
+ */
+
+/*
+ * With "tb-cache", the machine writes at exit which flash blocks were
+ * translated and with which TB flags, keyed by a SHA-256 of the CPU model
+ * and the flash contents; a later boot of the same image translates
+ * those blocks again at reset, before the guest runs.
+ * NOTE: the host code itself is not kept: it holds absolute host
+ *       addresses (helpers, the epilogue, chained TBs) that do not carry
+ *       over to another process, so the file only saves the work of
+ *       finding the blocks and their entry state, not of translating
+ */
+
+#define MICROBIT_TB_CACHE_MAGIC     "MBTBC001"
+
+typedef struct {
+    char magic[8];
+    uint8_t key[32];
+    uint32_t count;
+} QEMU_PACKED MicrobitTBCacheHeader;
+
+typedef struct {
+    uint32_t pc;
+    uint32_t flags;
+} QEMU_PACKED MicrobitTBCacheEntry;
+
+static void microbit_tb_cache_key(NRF51SoCState *soc, uint8_t *key)
+{
+    AddressSpace *as = nrf51_soc_address_space(soc);
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    uint8_t *flash = g_malloc(MICROBIT_PRETRANSLATE_END);
+    gsize len = 32;
+
+    address_space_read(as ? as : &address_space_memory, 0,
+                       MEMTXATTRS_UNSPECIFIED, flash,
+                       MICROBIT_PRETRANSLATE_END);
+    g_checksum_update(sum, (const uint8_t *)soc->cpu_type,
+                      strlen(soc->cpu_type) + 1);
+    g_checksum_update(sum, flash, MICROBIT_PRETRANSLATE_END);
+    g_checksum_get_digest(sum, key, &len);
+    g_checksum_free(sum);
+    g_free(flash);
+}
+
+static void microbit_tb_cache_work(CPUState *cs, run_on_cpu_data data)
+{
+    GArray *entries = data.host_ptr;
+    unsigned blocks;
+
+    for (blocks = 0; blocks < entries->len; blocks++) {
+        MicrobitTBCacheEntry *e = &g_array_index(entries,
+                                                 MicrobitTBCacheEntry, blocks);
+
+        if (!tb_pretranslate(cs, le32_to_cpu(e->pc), 0,
+                             le32_to_cpu(e->flags))) {
+            break;
+        }
+    }
+    trace_microbit_tb_cache_load(blocks);
+    g_array_free(entries, true);
+}
+
+/* Runs after the ROM reset has put the firmware in place */
+static void microbit_tb_cache_reset(void *opaque)
+{
+    NRF51SoCState *soc = opaque;
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(current_machine);
+    MicrobitTBCacheHeader *hdr;
+    uint8_t key[32];
+    GArray *entries;
+    gchar *data;
+    gsize len;
+
+    /* A missing file is the first boot of this image */
+    if (!g_file_get_contents(mbs->tb_cache, &data, &len, NULL)) {
+        return;
+    }
+    hdr = (MicrobitTBCacheHeader *)data;
+    microbit_tb_cache_key(soc, key);
+    if (len < sizeof(*hdr) ||
+        memcmp(hdr->magic, MICROBIT_TB_CACHE_MAGIC, sizeof(hdr->magic)) ||
+        memcmp(hdr->key, key, sizeof(key)) ||
+        (len - sizeof(*hdr)) / sizeof(MicrobitTBCacheEntry) <
+        le32_to_cpu(hdr->count)) {
+        g_free(data);
+        return;
+    }
+
+    entries = g_array_sized_new(false, false, sizeof(MicrobitTBCacheEntry),
+                                le32_to_cpu(hdr->count));
+    g_array_append_vals(entries, data + sizeof(*hdr), le32_to_cpu(hdr->count));
+    g_free(data);
+    async_run_on_cpu(CPU(soc->armv7m.cpu), microbit_tb_cache_work,
+                     RUN_ON_CPU_HOST_PTR(entries));
+}
+
+static void microbit_tb_cache_collect(TranslationBlock *tb, void *opaque)
+{
+    MicrobitTBCacheEntry e = {
+        .pc = cpu_to_le32(tb->pc),
+        .flags = cpu_to_le32(tb->flags),
+    };
+
+    /* Without an MMU the PC is the flash address */
+    if (tb->cs_base == 0 && tb->pc + tb->size <= MICROBIT_PRETRANSLATE_END) {
+        g_array_append_val((GArray *)opaque, e);
+    }
+}
+
+static gint microbit_tb_cache_cmp(gconstpointer a, gconstpointer b)
+{
+    const MicrobitTBCacheEntry *ea = a;
+    const MicrobitTBCacheEntry *eb = b;
+
+    if (ea->pc != eb->pc) {
+        return le32_to_cpu(ea->pc) < le32_to_cpu(eb->pc) ? -1 : 1;
+    }
+    return le32_to_cpu(ea->flags) < le32_to_cpu(eb->flags) ? -1 :
+           le32_to_cpu(ea->flags) > le32_to_cpu(eb->flags);
+}
+
+static void microbit_tb_cache_save(Notifier *notifier, void *data)
+{
+    MICROBITMachineState *mbs = container_of(notifier, MICROBITMachineState,
+                                             tb_cache_exit);
+    NRF51SoCState *soc = NRF51_SOC(
+        object_resolve_path_component(OBJECT(mbs), "soc[0]"));
+    MicrobitTBCacheHeader hdr = { .magic = MICROBIT_TB_CACHE_MAGIC };
+    GArray *entries = g_array_new(false, false, sizeof(MicrobitTBCacheEntry));
+    GByteArray *out = g_byte_array_new();
+    GError *gerr = NULL;
+    guint i, n = 0;
+
+    tb_foreach(microbit_tb_cache_collect, entries);
+    /* Superblocks and hot copies repeat a block's key */
+    g_array_sort(entries, microbit_tb_cache_cmp);
+    for (i = 0; i < entries->len; i++) {
+        if (!n || microbit_tb_cache_cmp(
+                &g_array_index(entries, MicrobitTBCacheEntry, i),
+                &g_array_index(entries, MicrobitTBCacheEntry, n - 1))) {
+            g_array_index(entries, MicrobitTBCacheEntry, n++) =
+                g_array_index(entries, MicrobitTBCacheEntry, i);
+        }
+    }
+
+    /* Blocks on flash the guest rewrote are gone, so hash what is there now */
+    microbit_tb_cache_key(soc, hdr.key);
+    hdr.count = cpu_to_le32(n);
+    g_byte_array_append(out, (guint8 *)&hdr, sizeof(hdr));
+    g_byte_array_append(out, (guint8 *)entries->data,
+                        n * sizeof(MicrobitTBCacheEntry));
+    if (!g_file_set_contents(mbs->tb_cache, (gchar *)out->data, out->len,
+                             &gerr)) {
+        warn_report("microbit: cannot write tb-cache: %s", gerr->message);
+        g_error_free(gerr);
+    } else {
+        trace_microbit_tb_cache_save(n);
+    }
+    g_byte_array_free(out, true);
+    g_array_free(entries, true);
+}
+
+/**
+ * Fast reset
+ *
+ * Test harnesses reset the board between cases thousands of times an
+ * hour.  With fast-reset, the first reset is a full one, after which the
+ * machine records the devices it reset, in the order it did, and a copy
+ * of the flash, code loader and RAM.  Later resets call those devices'
+ * reset methods from the list, reset the CPU, and write back only the
+ * memory pages that differ from the copy, instead of walking the qdev
+ * tree, running every reset handler and copying the ROM blobs again.
+ * NOTE: - Unlike a full reset, which leaves RAM alone, a fast reset also
+ *         puts RAM back as the first reset left it
+ *       - Devices added after the first reset are not reset
+ */
+
+static int microbit_reset_list_dev(DeviceState *dev, void *opaque)
+{
+    MicrobitResetEntry entry = { .dev = dev };
+
+    if (DEVICE_GET_CLASS(dev)->reset) {
+        g_array_append_val((GArray *)opaque, entry);
+    }
+    return 0;
+}
+
+static int microbit_reset_list_bus(BusState *bus, void *opaque)
+{
+    MicrobitResetEntry entry = { .bus = bus };
+
+    if (BUS_GET_CLASS(bus)->reset) {
+        g_array_append_val((GArray *)opaque, entry);
+    }
+    return 0;
+}
+
+/* Called after a full reset */
+static void microbit_fast_reset_save(MICROBITMachineState *mbs,
+                                     NRF51SoCState *soc)
+{
+    MicrobitResetImage *img = mbs->reset_images;
+
+    /* The same post-order walk as qbus_reset_all() */
+    mbs->reset_list = g_array_new(false, false, sizeof(MicrobitResetEntry));
+    qbus_walk_children(sysbus_get_default(), NULL, NULL,
+                       microbit_reset_list_dev, microbit_reset_list_bus,
+                       mbs->reset_list);
+
+    img[0].addr = CODE_LOADER_BASE;
+    img[0].size = CODE_KERNEL_BASE + CODE_KERNEL_SIZE - CODE_LOADER_BASE;
+    img[1].addr = RAM_BASE;
+    img[1].size = soc->ram_size;
+    for (int i = 0; i < ARRAY_SIZE(mbs->reset_images); i++) {
+        img[i].data = g_malloc(img[i].size);
+        address_space_read(&soc->as, img[i].addr, MEMTXATTRS_UNSPECIFIED,
+                           img[i].data, img[i].size);
+    }
+}
+
+/* Drop the list and copy, so that the next reset is a full one again */
+static void microbit_fast_reset_forget(MICROBITMachineState *mbs)
+{
+    if (mbs->reset_list) {
+        g_array_free(mbs->reset_list, true);
+        mbs->reset_list = NULL;
+    }
+    for (int i = 0; i < ARRAY_SIZE(mbs->reset_images); i++) {
+        g_free(mbs->reset_images[i].data);
+        mbs->reset_images[i].data = NULL;
+    }
+}
+
+/* Returns the number of pages written back */
+static uint32_t microbit_fast_reset_restore(NRF51SoCState *soc,
+                                            MicrobitResetImage *img)
+{
+    uint8_t page[NRF51_NVMC_PAGE_SIZE];
+    uint32_t pages = 0;
+
+    for (hwaddr off = 0; off < img->size; off += sizeof(page)) {
+        hwaddr len = MIN(sizeof(page), img->size - off);
+
+        address_space_read(&soc->as, img->addr + off, MEMTXATTRS_UNSPECIFIED,
+                           page, len);
+        /* As the ROM reset, through the path that drops stale TBs */
+        if (memcmp(page, img->data + off, len)) {
+            cpu_physical_memory_write_rom(&soc->as, img->addr + off,
+                                          img->data + off, len);
+            pages++;
+        }
+    }
+    return pages;
+}
+
+static void microbit_reset(void)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(current_machine);
+    NRF51SoCState *soc;
+    uint32_t pages = 0;
+    CPUState *cs;
+
+    if (!mbs->fast_reset) {
+        qemu_devices_reset();
+        return;
+    }
+    soc = NRF51_SOC(object_resolve_path_component(OBJECT(mbs), "soc[0]"));
+    if (!mbs->reset_list) {
+        qemu_devices_reset();
+        microbit_fast_reset_save(mbs, soc);
+        return;
+    }
+
+    /* The CPU takes its vectors from the restored flash */
+    for (int i = 0; i < ARRAY_SIZE(mbs->reset_images); i++) {
+        pages += microbit_fast_reset_restore(soc, &mbs->reset_images[i]);
+    }
+    CPU_FOREACH(cs) {
+        cpu_reset(cs);
+    }
+    for (guint i = 0; i < mbs->reset_list->len; i++) {
+        MicrobitResetEntry *entry = &g_array_index(mbs->reset_list,
+                                                   MicrobitResetEntry, i);
+
+        if (entry->dev) {
+            device_reset(entry->dev);
+        } else {
+            BUS_GET_CLASS(entry->bus)->reset(entry->bus);
+        }
+    }
+    if (mbs->pretranslate && tcg_enabled()) {
+        microbit_pretranslate_reset(soc);
+    }
+    if (mbs->tb_cache && tcg_enabled()) {
+        microbit_tb_cache_reset(soc);
+    }
+    trace_microbit_fast_reset(pages);
+}
+
+/**
+ * Hot re-flash
+ *
+ * The new image is built in a buffer, as the loader would place it, and
+ * only the flash pages that differ are written.  They go through the ROM
+ * path, which drops the translations of just those pages, so the rest
+ * of the translation cache survives the machine reset that follows.
+ */
+
+typedef struct {
+    uint32_t board;
+    NRF51SoCState *soc;
+} MicrobitReflashFind;
+
+static int microbit_reflash_find(Object *obj, void *opaque)
+{
+    Object *soc = object_dynamic_cast(obj, TYPE_NRF51_SOC);
+    MicrobitReflashFind *find = opaque;
+
+    if (soc && NRF51_SOC(soc)->index == find->board) {
+        find->soc = NRF51_SOC(soc);
+        return 1;
+    }
+    return 0;
+}
+
+/* Fill @image, which covers [lo, CODE_KERNEL_BASE + CODE_KERNEL_SIZE) */
+static bool microbit_reflash_load(const char *filename, hwaddr lo,
+                                  uint8_t *image, Error **errp)
+{
+    hwaddr end = CODE_KERNEL_BASE + CODE_KERNEL_SIZE;
+    hwaddr low = STARTUP_ADDR;
+    GError *gerr = NULL;
+    gchar *contents;
+    gsize len;
+
+    /* As erased flash, with the code loader region as it starts out */
+    if (lo < CODE_KERNEL_BASE) {
+        memset(image, 0, CODE_KERNEL_BASE - lo);
+    }
+    memset(image + CODE_KERNEL_BASE - lo, 0xFF, CODE_KERNEL_SIZE);
+
+    if (microbit_is_hex(filename)) {
+        if (microbit_load_hex(filename, lo, end, NULL, image, &low) < 0) {
+            error_setg(errp, "Failed to load hex file %s", filename);
+            return false;
+        }
+    } else {
+        if (!g_file_get_contents(filename, &contents, &len, &gerr)) {
+            error_setg(errp, "%s", gerr->message);
+            g_error_free(gerr);
+            return false;
+        }
+        if (len >= SELFMAG && !memcmp(contents, ELFMAG, SELFMAG)) {
+            error_setg(errp, "%s: only hex and binary images can be "
+                       "re-flashed", filename);
+            g_free(contents);
+            return false;
+        }
+        if (len > CODE_KERNEL_SIZE) {
+            error_setg(errp, "%s: image larger than the flash", filename);
+            g_free(contents);
+            return false;
+        }
+        memcpy(image + STARTUP_ADDR - lo, contents, len);
+        g_free(contents);
+    }
+
+    /* See microbit_copy_vector() */
+    if (lo == CODE_LOADER_BASE && low >= STARTUP_ADDR) {
+        memcpy(image, image + CODE_KERNEL_BASE, VECTOR_SIZE);
+    }
+    return true;
+}
+
+MicrobitReflashInfo *qmp_microbit_reflash(const char *filename,
+                                          bool has_board, uint32_t board,
+                                          Error **errp)
+{
+    MicrobitReflashFind find = { .board = has_board ? board : 0 };
+    hwaddr end = CODE_KERNEL_BASE + CODE_KERNEL_SIZE;
+    uint8_t page[NRF51_NVMC_PAGE_SIZE];
+    MicrobitReflashInfo *info;
+    NRF51SoCState *soc;
+    ARMCPU *cpu;
+    uint8_t *image;
+    hwaddr lo;
+
+    object_child_foreach_recursive(object_get_root(), microbit_reflash_find,
+                                   &find);
+    soc = find.soc;
+    if (!soc) {
+        error_setg(errp, "No micro:bit board %" PRIu32, find.board);
+        return NULL;
+    }
+
+    /* With a flash file the vectors are the flash's, not the loader's */
+    lo = soc->flash_image || soc->flash_backing ? CODE_KERNEL_BASE
+                                                : CODE_LOADER_BASE;
+    image = g_malloc(end - lo);
+    if (!microbit_reflash_load(filename, lo, image, errp)) {
+        g_free(image);
+        return NULL;
+    }
+
+    info = g_new0(MicrobitReflashInfo, 1);
+    pause_all_vcpus();
+    for (hwaddr addr = lo; addr < end; addr += sizeof(page)) {
+        address_space_read(&soc->as, addr, MEMTXATTRS_UNSPECIFIED,
+                           page, sizeof(page));
+        if (memcmp(page, image + addr - lo, sizeof(page))) {
+            cpu_physical_memory_write_rom(&soc->as, addr, image + addr - lo,
+                                          sizeof(page));
+            info->changed_pages++;
+        }
+        info->pages++;
+    }
+    g_free(image);
+
+    /* The reset must not put the old firmware back */
+    rom_discard_range(nrf51_soc_address_space(soc), lo, end - lo);
+    microbit_fast_reset_forget(MICROBIT_MACHINE(current_machine));
+
+    /* Library routines may have moved: translations calling them go too */
+    cpu = soc->armv7m.cpu;
+    if (cpu->hle_funcs && g_hash_table_size(cpu->hle_funcs)) {
+        g_hash_table_remove_all(cpu->hle_funcs);
+        tb_flush(CPU(cpu));
+    }
+
+    qemu_system_reset(SHUTDOWN_CAUSE_HOST_QMP);
+    if (!runstate_needs_reset()) {
+        resume_all_vcpus();
+    }
+    return info;
+}
+
+/**
+ * micro:bit machines
+ */
+
+static void microbit_check_config(MachineState *machine)
+{
+    MachineClass *mc = MACHINE_GET_CLASS(machine);
+    MICROBITMachineClass *mmc = MICROBIT_MACHINE_GET_CLASS(machine);
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(machine);
+
+    if (strcmp(machine->cpu_type, mc->default_cpu_type) != 0) {
+        error_report("microbit: This board can only be used with CPU [%s].",
+                     mc->default_cpu_type);
+        exit(1);
+    }
+    if (machine->ram_size != mmc->ram_sizes[0] &&
+        machine->ram_size != mmc->ram_sizes[1]) {
+        if (mmc->ram_sizes[0] == mmc->ram_sizes[1]) {
+            error_report("microbit: RAM size must be %" PRIu64 "KB",
+                         mmc->ram_sizes[0] / 1024);
+        } else {
+            error_report("microbit: RAM size must be %" PRIu64 "KB or %"
+                         PRIu64 "KB", mmc->ram_sizes[0] / 1024,
+                         mmc->ram_sizes[1] / 1024);
+        }
+        exit(1);
+    }
+    microbit_hex_board_min = mmc->hex_board_min;
+    microbit_hex_board_max = mmc->hex_board_max;
+    if (mbs->flash_image && machine->kernel_filename) {
+        error_report("microbit: flash-image and -kernel are mutually "
+                     "exclusive");
+        exit(1);
+    }
+    if (mbs->flash_image && mbs->flash_backing) {
+        error_report("microbit: flash-image and flash-backing are mutually "
+                     "exclusive");
+        exit(1);
+    }
+    /* A fast reset would undo the writes the file is there to keep */
+    if (mbs->fast_reset && mbs->flash_backing && !mbs->flash_scratch) {
+        error_report("microbit: fast-reset needs flash-scratch with "
+                     "flash-backing");
+        exit(1);
+    }
+}
+
+/* Board `index` on `memory`, or on a bus of its own if that is NULL */
+static NRF51SoCState *microbit_create_soc(MachineState *machine,
+                                          uint32_t index, MemoryRegion *memory)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(machine);
+    DeviceState *dev = qdev_create(NULL, TYPE_NRF51_SOC);
+    NRF51SoCState *soc = NRF51_SOC(dev);
+    char *name = g_strdup_printf("soc[%" PRIu32 "]", index);
+
+    object_property_add_child(OBJECT(machine), name, OBJECT(dev),
+                              &error_abort);
+    g_free(name);
+    qdev_prop_set_uint32(dev, "index", index);
+    qdev_prop_set_uint64(dev, "ram-size", machine->ram_size);
+    qdev_prop_set_string(dev, "cpu-type", machine->cpu_type);
+    if (memory) {
+        object_property_set_link(OBJECT(dev), OBJECT(memory), "memory",
+                                 &error_abort);
+    }
+    if (mbs->flash_image) {
+        qdev_prop_set_string(dev, "flash-image", mbs->flash_image);
+    }
+    /* Each board of a fleet persists to a file of its own */
+    if (mbs->flash_backing) {
+        name = index ? g_strdup_printf("%s.%" PRIu32, mbs->flash_backing,
+                                       index)
+                     : g_strdup(mbs->flash_backing);
+        qdev_prop_set_string(dev, "flash-backing", name);
+        g_free(name);
+        qdev_prop_set_bit(dev, "flash-scratch", mbs->flash_scratch);
+    }
+    qdev_prop_set_bit(dev, "flash-latency", mbs->flash_latency);
+    /* Stores to flat RAM do not mark its pages dirty */
+    if (mbs->ram_usage && mbs->flat_ram) {
+        error_report("microbit: ram-usage does not work with flat-ram");
+        exit(1);
+    }
+    qdev_prop_set_bit(dev, "ram-usage", mbs->ram_usage);
+    qdev_prop_set_bit(dev, "softdevice-hle", mbs->softdevice_hle);
+    qdev_prop_set_bit(dev, "led-console", !mbs->dashboard);
+    qdev_init_nofail(dev);
+    startup_profile_mark("microbit: soc realize");
+    /* One gdb inferior per board */
+    CPU(soc->armv7m.cpu)->cluster_index = index;
+
+    if (mbs->flat_ram && tcg_enabled()) {
+        arm_cpu_set_flat_ram(soc->armv7m.cpu, RAM_BASE, soc->ram_size,
+                             memory_region_get_ram_ptr(&soc->ram));
+    }
+
+    /* A flash image already holds the firmware, as does a backing file
+       unless -kernel reprograms it; qtest may run without any */
+    if (mbs->flash_image ||
+        (!machine->kernel_filename && (mbs->flash_backing ||
+                                       qtest_enabled()))) {
+        return soc;
+    }
+
+    /* Load binary image */
+    if (microbit_load_kernel(soc->armv7m.cpu, nrf51_soc_address_space(soc),
+                             machine->kernel_filename, CODE_KERNEL_SIZE,
+                             mbs->hle, mbs->mpy_profile, soc->index,
+                             soc->softdevice)) {
+        microbit_copy_vector(&soc->code_loader, CODE_KERNEL_BASE,
+                             VECTOR_SIZE);
+    }
+    startup_profile_mark("microbit: firmware load");
+    return soc;
+}
+
+/* Options shared by every micro:bit machine */
+static void microbit_apply_options(MICROBITMachineState *mbs)
+{
+    static Error *flat_ram_blocker;
+
+    nrf51_mmio_ring_prefix = g_strdup(mbs->mmio_ring);
+
+    /* Stores to flat RAM do not mark its pages dirty */
+    if (mbs->flat_ram && !flat_ram_blocker) {
+        error_setg(&flat_ram_blocker, "microbit: flat-ram does not support "
+                   "migration");
+        migrate_add_blocker(flat_ram_blocker, &error_fatal);
+    }
+
+    if (mbs->idle_skip) {
+        if (use_icount) {
+            warn_report("microbit: idle-skip has no effect with -icount");
+        }
+        cpu_set_idle_skip(true);
+    }
+    if (mbs->poll_skip) {
+        if (use_icount) {
+            warn_report("microbit: poll-skip has no effect with -icount");
+        }
+        cpu_set_poll_skip(true);
+        if (tcg_enabled()) {
+            CPUState *cs;
+
+            CPU_FOREACH(cs) {
+                ARM_CPU(cs)->spin_skip = true;
+            }
+        }
+    }
+    if (mbs->vcpu_timers) {
+        if (use_icount) {
+            warn_report("microbit: vcpu-timers has no effect with -icount");
+        } else if (qemu_tcg_mttcg_enabled()) {
+            error_report("microbit: vcpu-timers needs thread=single");
+            exit(1);
+        } else {
+            cpu_set_vcpu_timers(true);
+        }
+    }
+
+    /* The boards are all created by now */
+    if (mbs->dashboard) {
+        Object *dashboard = object_new(TYPE_MICROBIT_DASHBOARD);
+
+        object_property_add_child(OBJECT(mbs), "dashboard", dashboard,
+                                  &error_abort);
+        object_unref(dashboard);
+        object_property_set_bool(dashboard, true, "realized", &error_fatal);
+    }
+}
+
+/* The chardev named by machine option @opt, which must exist */
+static Chardev *microbit_find_chardev(const char *opt, const char *id)
+{
+    Chardev *chr = qemu_chr_find(id);
+
+    if (!chr) {
+        error_report("microbit: %s chardev '%s' not found", opt, id);
+        exit(1);
+    }
+    return chr;
+}
+
+static void microbit_init(MachineState *machine)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(machine);
+
+    NRF51SoCState *soc;
+
+    microbit_check_config(machine);
+    soc = microbit_create_soc(machine, 0, get_system_memory());
+
+    if (mbs->forkserver) {
+        DeviceState *forkserver = qdev_create(NULL, TYPE_MICROBIT_FORKSERVER);
+
+        qdev_prop_set_chr(forkserver, "chardev",
+                          microbit_find_chardev("forkserver", mbs->forkserver));
+        qdev_init_nofail(forkserver);
+        sysbus_mmio_map(SYS_BUS_DEVICE(forkserver), 0, FORKSERVER_BASE);
+    }
+
+    if (mbs->testdev) {
+        DeviceState *testdev = qdev_create(NULL, TYPE_MICROBIT_TESTDEV);
+
+        qdev_prop_set_chr(testdev, "chardev",
+                          microbit_find_chardev("testdev", mbs->testdev));
+        qdev_init_nofail(testdev);
+        sysbus_mmio_map(SYS_BUS_DEVICE(testdev), 0, TESTDEV_BASE);
+    }
+
+    if (mbs->mailbox) {
+        DeviceState *mailbox = qdev_create(NULL, TYPE_MICROBIT_MAILBOX);
+
+        qdev_prop_set_chr(mailbox, "chardev",
+                          microbit_find_chardev("mailbox", mbs->mailbox));
+        qdev_init_nofail(mailbox);
+        sysbus_mmio_map(SYS_BUS_DEVICE(mailbox), 0, MAILBOX_BASE);
+    }
+
+    if (mbs->pretranslate && tcg_enabled()) {
+        qemu_register_reset(microbit_pretranslate_reset, soc);
+    }
+
+    if (mbs->tb_cache && tcg_enabled()) {
+        qemu_register_reset(microbit_tb_cache_reset, soc);
+        mbs->tb_cache_exit.notify = microbit_tb_cache_save;
+        qemu_add_exit_notifier(&mbs->tb_cache_exit);
+    }
+
+    if (mbs->websocket) {
+        Object *ws = object_new(TYPE_MICROBIT_WEBSOCKET);
+
+        object_property_add_child(OBJECT(machine), "websocket", ws,
+                                  &error_abort);
+        object_unref(ws);
+        qdev_prop_set_string(DEVICE(ws), "addr", mbs->websocket);
+        object_property_set_link(ws, object_resolve_path_type("",
+                                     TYPE_MICROBIT_LED_MATRIX, NULL),
+                                 "led-matrix", &error_abort);
+        object_property_set_link(ws, object_resolve_path_type("",
+                                     TYPE_NRF51_GPIO, NULL),
+                                 "gpio", &error_abort);
+        object_property_set_bool(ws, true, "realized", &error_fatal);
+    }
+
+    microbit_apply_options(mbs);
+}
+
+/*
+ * -smp N boards running the same -kernel, each SoC on a bus of its own
+ * and, with MTTCG, each vCPU on a thread of its own, or on a shared
+ * pool of them with -accel tcg,thread=pool. Board n uses serial port n
+ * and -pflash unit n.
+ */
+/*
+ * Boards of a fleet with the same CPU model run the first one's TBs for
+ * the code they hold the same copy of, instead of each translating it.
+ * Not with flat-ram, whose TBs have their board's RAM built in.
+ */
+static void microbit_fleet_share_work(CPUState *cs, run_on_cpu_data data)
+{
+    MachineState *machine = data.host_ptr;
+    NRF51SoCState *soc[2];
+    uint32_t i;
+
+    soc[0] = NRF51_SOC(object_resolve_path_component(OBJECT(machine),
+                                                     "soc[0]"));
+    for (i = 1; i < smp_cpus; i++) {
+        char *name = g_strdup_printf("soc[%" PRIu32 "]", i);
+
+        soc[1] = NRF51_SOC(object_resolve_path_component(OBJECT(machine),
+                                                         name));
+        g_free(name);
+        if (strcmp(soc[1]->cpu_type, soc[0]->cpu_type)) {
+            continue;
+        }
+        tb_share_code(memory_region_get_ram_addr(soc[1]->flash),
+                      memory_region_get_ram_addr(soc[0]->flash),
+                      memory_region_size(soc[0]->flash));
+        tb_share_code(memory_region_get_ram_addr(&soc[1]->code_loader),
+                      memory_region_get_ram_addr(&soc[0]->code_loader),
+                      CODE_LOADER_SIZE);
+    }
+}
+
+/* Compares the flash the ROM reset has just written */
+static void microbit_fleet_share_reset(void *opaque)
+{
+    async_safe_run_on_cpu(first_cpu, microbit_fleet_share_work,
+                          RUN_ON_CPU_HOST_PTR(opaque));
+}
+
+static void microbit_fleet_init(MachineState *machine)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(machine);
+
+    microbit_check_config(machine);
+    if (mbs->forkserver || mbs->testdev || mbs->mailbox ||
+        mbs->pretranslate || mbs->tb_cache || mbs->websocket ||
+        mbs->fast_reset) {
+        error_report("microbit-fleet: forkserver, testdev, mailbox, "
+                     "pretranslate, tb-cache, websocket and fast-reset need "
+                     "a single board");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < smp_cpus; i++) {
+        microbit_create_soc(machine, i, NULL);
+    }
+    if (smp_cpus > 1 && tcg_enabled() && !mbs->flat_ram) {
+        qemu_register_reset(microbit_fleet_share_reset, machine);
+    }
+
+    microbit_apply_options(mbs);
+}
+
+static char *microbit_get_forkserver(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    return g_strdup(mbs->forkserver);
+}
+
+static void microbit_set_forkserver(Object *obj, const char *value,
+                                    Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    g_free(mbs->forkserver);
+    mbs->forkserver = g_strdup(value);
+}
+
+static char *microbit_get_mailbox(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    return g_strdup(mbs->mailbox);
+}
+
+static void microbit_set_mailbox(Object *obj, const char *value,
+                                 Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    g_free(mbs->mailbox);
+    mbs->mailbox = g_strdup(value);
+}
+
+static char *microbit_get_testdev(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    return g_strdup(mbs->testdev);
+}
+
+static void microbit_set_testdev(Object *obj, const char *value,
+                                 Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    g_free(mbs->testdev);
+    mbs->testdev = g_strdup(value);
+}
+
+static bool microbit_get_idle_skip(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    return mbs->idle_skip;
+}
+
+static void microbit_set_idle_skip(Object *obj, bool value, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    mbs->idle_skip = value;
+}
+
+static bool microbit_get_poll_skip(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    return mbs->poll_skip;
+}
+
+static void microbit_set_poll_skip(Object *obj, bool value, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    mbs->poll_skip = value;
+}
+
+static bool microbit_get_vcpu_timers(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    return mbs->vcpu_timers;
+}
+
+static void microbit_set_vcpu_timers(Object *obj, bool value, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    mbs->vcpu_timers = value;
+}
+
+static char *microbit_get_mmio_ring(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    return g_strdup(mbs->mmio_ring);
+}
+
+static void microbit_set_mmio_ring(Object *obj, const char *value,
+                                   Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    g_free(mbs->mmio_ring);
+    mbs->mmio_ring = g_strdup(value);
 }
 
-static void nrf51_timer_tick(void *opaque)
+static char *microbit_get_flash_image(Object *obj, Error **errp)
 {
-    NRF51TimerState *s = (NRF51TimerState *)opaque;
-    int i;
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    s->internal_counter = (s->internal_counter + 1) & s->limit_mask;
+    return g_strdup(mbs->flash_image);
+}
 
-    if (s->mode == 1) {
-        /* Counter mode */
-        if (s->internal_counter == s->count){
-            s->internal_counter = 0;
-            qemu_irq_pulse(s->irq);
-        } else {
-            qemu_irq_lower(s->irq);
-        }
-    } else {
-        /* Timer mode */
-        for (i = 0; i < 4; i++) {
-            if (s->inten & (1 << i)) {
-                if (s->cc[i] == s->internal_counter) {
-                    s->compare[i] ++;
-                    qemu_irq_pulse(s->irq);
-                } else {
-                    qemu_irq_lower(s->irq);
-                }
-            }
-        }
-    }
-    
+static void microbit_set_flash_image(Object *obj, const char *value,
+                                     Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    g_free(mbs->flash_image);
+    mbs->flash_image = g_strdup(value);
 }
 
-static const MemoryRegionOps nrf51_timer_ops = {
-    .read = nrf51_timer_read,
-    .write = nrf51_timer_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
+static char *microbit_get_flash_backing(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-static const VMStateDescription vmstate_nrf51_timer = {
-    .name = TYPE_NRF51_TIMER,
-    .version_id = 1,
-    .minimum_version_id = 1,
-    .fields = (VMStateField[]) {
-        VMSTATE_PTIMER(timer, NRF51TimerState),
-        VMSTATE_BOOL(pulsed, NRF51TimerState),
-        VMSTATE_UINT32(inten, NRF51TimerState),
-        VMSTATE_UINT32(limit_mask, NRF51TimerState),
-        VMSTATE_UINT32(start, NRF51TimerState),
-        VMSTATE_UINT32(stop, NRF51TimerState),
-        VMSTATE_UINT32(count, NRF51TimerState),
-        VMSTATE_UINT32(clear, NRF51TimerState),
-        VMSTATE_UINT32(shutdown, NRF51TimerState),
-        VMSTATE_UINT32_ARRAY(capture, NRF51TimerState, 4),
-        VMSTATE_UINT32_ARRAY(compare, NRF51TimerState, 4),
-        VMSTATE_UINT32(shorts, NRF51TimerState),
-        VMSTATE_UINT32(intenset, NRF51TimerState),
-        VMSTATE_UINT32(intenclr, NRF51TimerState),
-        VMSTATE_UINT32(mode, NRF51TimerState),
-        VMSTATE_UINT32(bitmode, NRF51TimerState),
-        VMSTATE_UINT32(prescaler, NRF51TimerState),
-        VMSTATE_UINT32_ARRAY(cc, NRF51TimerState, 4),
-        VMSTATE_UINT32(internal_counter, NRF51TimerState),
-        VMSTATE_END_OF_LIST()
-    }
-};
+    return g_strdup(mbs->flash_backing);
+}
 
-static Property nrf51_timer_properties[] = {
-    DEFINE_PROP_UINT32("freq", NRF51TimerState, freq, NRF51_TIMER_BASE_FREQ),
-    DEFINE_PROP_END_OF_LIST(),
-};
+static void microbit_set_flash_backing(Object *obj, const char *value,
+                                       Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-static void nrf51_timer_realize(DeviceState *dev, Error **errp)
+    g_free(mbs->flash_backing);
+    mbs->flash_backing = g_strdup(value);
+}
+
+static bool microbit_get_flash_scratch(Object *obj, Error **errp)
 {
-    NRF51TimerState *s = NRF51_TIMER(dev);
-    QEMUBH *bh = qemu_bh_new(nrf51_timer_tick, s);
-    s->timer = ptimer_init(bh, PTIMER_POLICY_DEFAULT | PTIMER_POLICY_CONTINUOUS_TRIGGER);
-    s->freq = NRF51_TIMER_BASE_FREQ;
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    return mbs->flash_scratch;
 }
 
-static void nrf51_timer_init(Object *obj)
+static void microbit_set_flash_scratch(Object *obj, bool value, Error **errp)
 {
-    NRF51TimerState *s = NRF51_TIMER(obj);
-    SysBusDevice *sdb = SYS_BUS_DEVICE(obj);
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    sysbus_init_irq(sdb, &s->irq);
-    memory_region_init_io(&s->iomem, obj, &nrf51_timer_ops, s,
-                          TYPE_NRF51_TIMER, 0x1000);
-    sysbus_init_mmio(sdb, &s->iomem);
+    mbs->flash_scratch = value;
 }
 
-static void nrf51_timer_class_init(ObjectClass *klass, void *data)
+static bool microbit_get_flash_latency(Object *obj, Error **errp)
 {
-    DeviceClass *dc = DEVICE_CLASS(klass);
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    dc->realize = nrf51_timer_realize;
-    dc->props = nrf51_timer_properties;
-    dc->vmsd = &vmstate_nrf51_timer;
+    return mbs->flash_latency;
 }
 
-static const TypeInfo nrf51_timer_info = {
-    .name          = TYPE_NRF51_TIMER,
-    .parent        = TYPE_SYS_BUS_DEVICE,
-    .instance_size = sizeof(NRF51TimerState),
-    .instance_init = nrf51_timer_init,
-    .class_init    = nrf51_timer_class_init,
-};
+static void microbit_set_flash_latency(Object *obj, bool value, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-static void nrf51_peri_init_types(void)
+    mbs->flash_latency = value;
+}
+
+static bool microbit_get_pretranslate(Object *obj, Error **errp)
 {
-    type_register_static(&microbit_led_matrix_info);
-    type_register_static(&nrf51_gpio_info);
-    type_register_static(&nrf51_rng_info);
-    type_register_static(&nrf51_nvmc_info);
-    type_register_static(&nrf51_ficr_info);
-    type_register_static(&nrf51_cpm_info);
-    type_register_static(&nrf51_timer_info);    
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    return mbs->pretranslate;
 }
 
-type_init(nrf51_peri_init_types)
+static void microbit_set_pretranslate(Object *obj, bool value, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
+    mbs->pretranslate = value;
+}
 
-/**
- * micro:bit machine type
- */
+static char *microbit_get_tb_cache(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
+    return g_strdup(mbs->tb_cache);
+}
 
-typedef struct {
-    /* Private */
-    MachineState parent;
+static void microbit_set_tb_cache(Object *obj, const char *value,
+                                  Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    /* Public */
-    ARMv7MState armv7m;
+    g_free(mbs->tb_cache);
+    mbs->tb_cache = g_strdup(value);
+}
 
-} MICROBITMachineState;
+static bool microbit_get_flat_ram(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-typedef struct {
-    /* Private */
-    MachineClass parent;
+    return mbs->flat_ram;
+}
 
-    /* Public */
-} MICROBITMachineClass;
+static void microbit_set_flat_ram(Object *obj, bool value, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-#define TYPE_MICROBIT_MACHINE "micro:bit"
-#define MICROBIT_MACHINE(obj) \
-    OBJECT_CHECK(MICROBITMachineState, (obj), TYPE_MICROBIT_MACHINE)
+    mbs->flat_ram = value;
+}
 
-#define MICROBIT_MACHINE_GET_CLASS(obj) \
-    OBJECT_GET_CLASS(MICROBITMachineClass, (obj), TYPE_MICROBIT_MACHINE)
+static bool microbit_get_ram_usage(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-#define MICROBIT_MACHINE_CLASS(klass) \
-    OBJECT_CLASS_CHECK(MICROBITMachineClass, (klass), TYPE_MICROBIT_MACHINE)
+    return mbs->ram_usage;
+}
 
-enum {
-    STARTUP_ADDR = 0x00018000,
-    VECTOR_SIZE  = 0xC0,
-    NUM_IRQ      = 64,
+static void microbit_set_ram_usage(Object *obj, bool value, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    /* Memory regions */
-    CODE_LOADER_BASE = 0x00000000,
-    CODE_LOADER_SIZE = 0x00018000,
-    CODE_KERNEL_BASE = 0x00018000,
-    CODE_KERNEL_SIZE = 0x00028000,
-    FLASH_SEC_SIZE   = 0x00008000,
-    RAM_BASE         = 0x20000000,
+    mbs->ram_usage = value;
+}
 
-    /* ABP Peripherals */
-    ABP_PERI_BASE = 0x40000000,
-    ABP_PERI_SIZE = 0x00080000,
-    POWER_BASE    = 0x40000000,
-    CLOCK_BASE    = 0x40000000,
-    MPU_BASE      = 0x40000000,
-    AMLI_BASE     = 0x40000000,
-    RADIO_BASE    = 0x40001000,
-    UART0_BASE    = 0x40002000,
-    SPI0_BASE     = 0x40003000,
-    TWI0_BASE     = 0x40003000,
-    SPI1_BASE     = 0x40004000,
-    TWI1_BASE     = 0x40004000,
-    SPIS1_BASE    = 0x40004000,
-    SPIM1_BASE    = 0x40004000,
-    GPIOTE_BASE   = 0x40006000,
-    ADC_BASE      = 0x40007000,
-    TIMER0_BASE   = 0x40008000,
-    TIMER1_BASE   = 0x40009000,
-    TIMER2_BASE   = 0x4000A000,
-    RTC0_BASE     = 0x4000B000,
-    TEMP_BASE     = 0x4000C000,
-    RNG_BASE      = 0x4000D000,
-    ECB_BASE      = 0x4000E000,
-    AAR_BASE      = 0x4000F000,
-    CCM_BASE      = 0x4000F000,
-    WDT_BASE      = 0x40010000,
-    RTC1_BASE     = 0x40011000,
-    QDEC_BASE     = 0x40012000,
-    LPCOMP_BASE   = 0x40013000,
-    SWI_BASE      = 0x40014000,
-    NVMC_BASE     = 0x4001E000,
-    PPI_BASE      = 0x4001F000,
-    GPIO_BASE     = 0x50000000,
-    FICR_BASE     = 0x10000000,
-    UICR_BASE     = 0x10001000,
-    LED_BASE      = 0x40020000,
-};
+static bool microbit_get_hle(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-static void microbit_cpu_reset(void *opaque)
+    return mbs->hle;
+}
+
+static void microbit_set_hle(Object *obj, bool value, Error **errp)
 {
-    ARMCPU *cpu = opaque;
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    cpu_reset(CPU(cpu));
+    mbs->hle = value;
 }
 
-static void microbit_load_kernel(ARMCPU *cpu, const char *kernel_filename,
-                                 int mem_size)
+static bool microbit_get_mpy_profile(Object *obj, Error **errp)
 {
-    int ret;
-    ret = load_image_targphys(kernel_filename, STARTUP_ADDR, mem_size);
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    if (ret < 0) {
-        error_report("%s: Failed to load file %s", __func__,
-                     kernel_filename);
-        exit(1);
-    }
+    return mbs->mpy_profile;
+}
 
-    qemu_register_reset(microbit_cpu_reset, cpu);
+static void microbit_set_mpy_profile(Object *obj, bool value, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    mbs->mpy_profile = value;
 }
 
-static void microbit_copy_vector(MemoryRegion *dest_mem, hwaddr src_base,
-                                 size_t vec_size)
+static bool microbit_get_softdevice_hle(Object *obj, Error **errp)
 {
-    uint32_t* dest = (uint32_t *)memory_region_get_ram_ptr(dest_mem);
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    for(int i = 0; i < vec_size / 4; i++) {
-        dest[i] = ldl_p(rom_ptr(src_base + i * 4));
-    }
+    return mbs->softdevice_hle;
 }
 
-typedef enum {
-    DEVICE_UNIMPL,
-    DEVICE_SIMPLE,
-} microbit_device_type_t;
+static void microbit_set_softdevice_hle(Object *obj, bool value,
+                                        Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-typedef struct {
-    const char *           name;
-    uint32_t               base_addr;
-    uint32_t               size;
-    microbit_device_type_t type;
-} microbit_device_info_t;
+    mbs->softdevice_hle = value;
+}
 
-static const microbit_device_info_t microbit_devices[] = {
-    {"radio",                 RADIO_BASE,  0x1000, DEVICE_UNIMPL},
-    {"uart0",                 UART0_BASE,  0x1000, DEVICE_UNIMPL},
-    {"spi0",                  SPI0_BASE,   0x1000, DEVICE_UNIMPL},
-    {"twi0",                  TWI0_BASE,   0x1000, DEVICE_UNIMPL},
-    {"spi1",                  SPI1_BASE,   0x1000, DEVICE_UNIMPL},
-    {"twi1",                  TWI1_BASE,   0x1000, DEVICE_UNIMPL},
-    {"spis1",                 SPIS1_BASE,  0x1000, DEVICE_UNIMPL},
-    {"spim1",                 SPIM1_BASE,  0x1000, DEVICE_UNIMPL},
-    {"gpiote",                GPIOTE_BASE, 0x1000, DEVICE_UNIMPL},
-    {"adc",                   ADC_BASE,    0x1000, DEVICE_UNIMPL},
-    {"rtc0",                  RTC0_BASE,   0x1000, DEVICE_UNIMPL},
-    {"temp",                  TEMP_BASE,   0x1000, DEVICE_UNIMPL},
-    {"ecb",                   ECB_BASE,    0x1000, DEVICE_UNIMPL},
-    {"aar",                   AAR_BASE,    0x1000, DEVICE_UNIMPL},
-    {"ccm",                   CCM_BASE,    0x1000, DEVICE_UNIMPL},
-    {"wdt",                   WDT_BASE,    0x1000, DEVICE_UNIMPL},
-    {"rtc1",                  RTC1_BASE,   0x1000, DEVICE_UNIMPL},
-    {"qdec",                  QDEC_BASE,   0x1000, DEVICE_UNIMPL},
-    {"lpcomp",                LPCOMP_BASE, 0x1000, DEVICE_UNIMPL},
-    {"swi",                   SWI_BASE,    0x1000, DEVICE_UNIMPL},
-    {"ppi",                   PPI_BASE,    0x1000, DEVICE_UNIMPL},
-    {"uicr",                  UICR_BASE,   0x1000, DEVICE_UNIMPL},
-    {"unknown",               0xF0000000,  0x1000, DEVICE_UNIMPL},
-    {"microbit_led_matrix",   LED_BASE,    0x1000, DEVICE_SIMPLE},
-    {"nrf51_gpio",            GPIO_BASE,   0x1000, DEVICE_SIMPLE},
-    {"nrf51_rng",             RNG_BASE,    0x1000, DEVICE_SIMPLE},
-    {"nrf51_nvmc",            NVMC_BASE,   0x1000, DEVICE_SIMPLE},
-    {"nrf51_ficr",            FICR_BASE,   0x1000, DEVICE_SIMPLE},
-    {"nrf51_clock_power_mpu", CLOCK_BASE,  0x1000, DEVICE_SIMPLE},
-};
+static bool microbit_get_fast_reset(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-static void microbit_create_devices(void)
+    return mbs->fast_reset;
+}
+
+static void microbit_set_fast_reset(Object *obj, bool value, Error **errp)
 {
-    const microbit_device_info_t *dev = microbit_devices;
-    for (int i = 0; i < ARRAY_SIZE(microbit_devices); i++) {
-        switch (dev->type) {
-            case DEVICE_UNIMPL:
-                create_unimplemented_device(dev->name, dev->base_addr,
-                                            dev->size);
-                break;
-            case DEVICE_SIMPLE:
-                sysbus_create_simple(dev->name, dev->base_addr, NULL);
-                break;
-            default:
-                g_assert_not_reached();
-                break;
-        }
-        dev ++;
-    }
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
+
+    mbs->fast_reset = value;
 }
 
-static void microbit_init(MachineState *machine)
+static bool microbit_get_dashboard(Object *obj, Error **errp)
 {
-    MemoryRegion *ram = g_new(MemoryRegion, 1);
-    MemoryRegion *code_loader = g_new(MemoryRegion, 1);
-    DriveInfo *dinfo;
-    pflash_t *flash;
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    MachineClass *mc = MACHINE_GET_CLASS(machine);
-    MICROBITMachineState *mbs = MICROBIT_MACHINE(machine);
-    DeviceState *armv7m;
+    return mbs->dashboard;
+}
 
-    /* Check configuration */
-    if (strcmp(machine->cpu_type, mc->default_cpu_type) != 0) {
-        error_report("microbit: This board can only be used with CPU [%s].",
-                     mc->default_cpu_type);
-        exit(1);
-    }
-    if ((machine->ram_size != 32 * 1024) && (machine->ram_size != 16 * 1024)) {
-        error_report("microbit: RAM size must be 16KB or 32KB");
-        exit(1);
-    }
+static void microbit_set_dashboard(Object *obj, bool value, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    /* Initial architecture */
-    object_initialize(&mbs->armv7m, sizeof(mbs->armv7m), TYPE_ARMV7M);
-    armv7m = DEVICE(&mbs->armv7m);
-    qdev_set_parent_bus(armv7m, sysbus_get_default());
-    qdev_prop_set_uint32(armv7m, "num-irq", NUM_IRQ);
-    qdev_prop_set_string(armv7m, "cpu-type", machine->cpu_type);
-    object_property_set_link(OBJECT(armv7m), OBJECT(get_system_memory()),
-                                     "memory", &error_abort);
-    object_property_set_bool(OBJECT(armv7m), true, "realized",
-                             &error_fatal);
+    mbs->dashboard = value;
+}
 
-    /* RAM */
-    memory_region_allocate_system_memory(ram, NULL, "microbit.ram",
-                                         machine->ram_size);
-    memory_region_add_subregion(get_system_memory(), RAM_BASE, ram);
+static char *microbit_get_websocket(Object *obj, Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    /* CODE: ROM */
-    memory_region_allocate_system_memory(code_loader, NULL,
-                                         "microbit.code_loader",
-                                         CODE_LOADER_SIZE);
-    memory_region_set_readonly(code_loader, true);
-    memory_region_add_subregion(get_system_memory(), CODE_LOADER_BASE,
-                                code_loader);
-
-    /* CODE: FLASH */
-    dinfo = drive_get(IF_PFLASH, 0, 0);
-    flash = pflash_cfi01_register(CODE_KERNEL_BASE, NULL, "microbit.code_kernel",
-                                  CODE_KERNEL_SIZE,
-                                  dinfo ? blk_by_legacy_dinfo(dinfo) : NULL,
-                                  FLASH_SEC_SIZE, CODE_KERNEL_SIZE / FLASH_SEC_SIZE,
-                                  4, 0x0000, 0x0000, 0x0000, 0x0000, 0);
-    if(!flash){
-        error_report("%s: Error registering flash memory.\n", __func__);
-        exit(1);
-    }
+    return g_strdup(mbs->websocket);
+}
 
-    /* Peripherals */
-    microbit_create_devices();
-    sysbus_create_simple(TYPE_NRF51_TIMER, TIMER0_BASE,
-                         qdev_get_gpio_in(armv7m, 8));
-    sysbus_create_simple(TYPE_NRF51_TIMER, TIMER1_BASE,
-                         qdev_get_gpio_in(armv7m, 9));
-    sysbus_create_simple(TYPE_NRF51_TIMER, TIMER2_BASE,
-                         qdev_get_gpio_in(armv7m, 10));
+static void microbit_set_websocket(Object *obj, const char *value,
+                                   Error **errp)
+{
+    MICROBITMachineState *mbs = MICROBIT_MACHINE(obj);
 
-    /* Load binary image */
-    microbit_load_kernel(ARM_CPU(first_cpu), machine->kernel_filename,
-                         CODE_KERNEL_SIZE);
-    microbit_copy_vector(code_loader, CODE_KERNEL_BASE, VECTOR_SIZE);
+    g_free(mbs->websocket);
+    mbs->websocket = g_strdup(value);
 }
 
 static void microbit_class_init(ObjectClass *oc, void *data)
 {
     MachineClass *mc = MACHINE_CLASS(oc);
+    MICROBITMachineClass *mmc = MICROBIT_MACHINE_CLASS(oc);
 
     mc->desc = "micro:bit";
     mc->init = microbit_init;
-    /* TODO: use m0 instead */
-    mc->default_cpu_type = ARM_CPU_TYPE_NAME("cortex-m3");
+    mc->reset = microbit_reset;
+    mc->default_cpu_type = ARM_CPU_TYPE_NAME("cortex-m0");
     mc->default_ram_size = 32 * 1024;
+    mc->tcg_code_size_hint = CODE_LOADER_SIZE + CODE_KERNEL_SIZE;
+    /* The Cortex-M0 has no MPU: 4K pages, a quarter of the TLB misses */
+    mc->minimum_page_bits = 12;
+    mmc->ram_sizes[0] = 16 * 1024;
+    mmc->ram_sizes[1] = 32 * 1024;
+    mmc->hex_board_min = 0x9900;
+    mmc->hex_board_max = 0x9901;
+
+    object_class_property_add_str(oc, "forkserver", microbit_get_forkserver,
+                                  microbit_set_forkserver, &error_abort);
+    object_class_property_set_description(oc, "forkserver",
+        "Chardev id of the fork server control channel; the firmware "
+        "checkpoints by storing to 0x400FF000 and ends each test "
+        "case by storing its status to 0x400FF004", &error_abort);
+    object_class_property_add_str(oc, "testdev", microbit_get_testdev,
+                                  microbit_set_testdev, &error_abort);
+    object_class_property_set_description(oc, "testdev",
+        "Chardev id for test reports; the firmware stores the address and "
+        "length of its report to 0x400FE000 and 0x400FE004, then its exit "
+        "status to 0x400FE008", &error_abort);
+    object_class_property_add_str(oc, "mailbox", microbit_get_mailbox,
+                                  microbit_set_mailbox, &error_abort);
+    object_class_property_set_description(oc, "mailbox",
+        "UNIX socket chardev id the harness is passed a shared memfd on; "
+        "the firmware posts copies to and from it on a descriptor ring set "
+        "up at 0x400FD000 and rings 0x400FD008 once per batch",
+        &error_abort);
+    object_class_property_add_bool(oc, "idle-skip", microbit_get_idle_skip,
+                                   microbit_set_idle_skip, &error_abort);
+    object_class_property_set_description(oc, "idle-skip",
+        "Advance virtual time straight to the next timer deadline while "
+        "the CPU is halted in WFI/WFE, instead of waiting in real time",
+        &error_abort);
+    object_class_property_add_bool(oc, "poll-skip", microbit_get_poll_skip,
+                                   microbit_set_poll_skip, &error_abort);
+    object_class_property_set_description(oc, "poll-skip",
+        "Advance virtual time straight to the next timer deadline while "
+        "the CPU spins reading an unchanging NVMC, RNG, TEMP, WDT, TIMER, "
+        "RTC or ADC register, or RAM that only an interrupt handler can "
+        "change", &error_abort);
+    object_class_property_add_bool(oc, "vcpu-timers", microbit_get_vcpu_timers,
+                                   microbit_set_vcpu_timers, &error_abort);
+    object_class_property_set_description(oc, "vcpu-timers",
+        "Run expired TIMER, RTC, SysTick and other virtual clock timers "
+        "on the vCPU thread between translation blocks, instead of in the "
+        "main loop", &error_abort);
+    object_class_property_add_str(oc, "mmio-ring", microbit_get_mmio_ring,
+                                  microbit_set_mmio_ring, &error_abort);
+    object_class_property_set_description(oc, "mmio-ring",
+        "Path prefix of binary MMIO trace rings; each thread that touches "
+        "a peripheral records its accesses in <prefix>.<thread id>",
+        &error_abort);
+    object_class_property_add_str(oc, "flash-image", microbit_get_flash_image,
+                                  microbit_set_flash_image, &error_abort);
+    object_class_property_set_description(oc, "flash-image",
+        "Raw dump of the 160 KiB application flash (0x18000-0x3FFFF), "
+        "mapped copy-on-write so that instances booting the same file "
+        "share its pages; replaces -kernel", &error_abort);
+    object_class_property_add_str(oc, "flash-backing",
+                                  microbit_get_flash_backing,
+                                  microbit_set_flash_backing, &error_abort);
+    object_class_property_set_description(oc, "flash-backing",
+        "File holding the application flash followed by the 1 KiB UICR, "
+        "created if missing and mapped shared so that NVMC writes persist; "
+        "board n > 0 of a fleet uses <file>.n. Holds the firmware unless "
+        "-kernel is given", &error_abort);
+    object_class_property_add_bool(oc, "flash-scratch",
+                                   microbit_get_flash_scratch,
+                                   microbit_set_flash_scratch, &error_abort);
+    object_class_property_set_description(oc, "flash-scratch",
+        "Map flash-backing privately, so that writes are discarded at "
+        "exit", &error_abort);
+    object_class_property_add_bool(oc, "flash-latency",
+                                   microbit_get_flash_latency,
+                                   microbit_set_flash_latency, &error_abort);
+    object_class_property_set_description(oc, "flash-latency",
+        "Stall the CPU for the 20 ms of each NVMC erase, in virtual time; "
+        "use with idle-skip to not wait for it", &error_abort);
+    object_class_property_add_bool(oc, "pretranslate",
+                                   microbit_get_pretranslate,
+                                   microbit_set_pretranslate, &error_abort);
+    object_class_property_set_description(oc, "pretranslate",
+        "Translate the code reachable from the vector table at reset, "
+        "before the firmware runs; single board only", &error_abort);
+    object_class_property_add_str(oc, "tb-cache", microbit_get_tb_cache,
+                                  microbit_set_tb_cache, &error_abort);
+    object_class_property_set_description(oc, "tb-cache",
+        "File listing the flash blocks this image translated, written at "
+        "exit and translated again at reset by the next boot of the same "
+        "image; single board only", &error_abort);
+    object_class_property_add_bool(oc, "flat-ram", microbit_get_flat_ram,
+                                   microbit_set_flat_ram, &error_abort);
+    object_class_property_set_description(oc, "flat-ram",
+        "Let translated code load and store RAM through a bounds check "
+        "instead of the softmmu TLB while the MPU is off; blocks "
+        "migration", &error_abort);
+    object_class_property_add_bool(oc, "ram-usage", microbit_get_ram_usage,
+                                   microbit_set_ram_usage, &error_abort);
+    object_class_property_set_description(oc, "ram-usage",
+        "Track the RAM pages written since reset, for "
+        "query-microbit-ram-usage; not with flat-ram", &error_abort);
+    object_class_property_add_str(oc, "websocket", microbit_get_websocket,
+                                  microbit_set_websocket, &error_abort);
+    object_class_property_set_description(oc, "websocket",
+        "host:port to serve a WebSocket client (subprotocol \"binary\") "
+        "that is pushed the LED levels and pin states and may drive the "
+        "buttons and input pins; single board only", &error_abort);
+    object_class_property_add_bool(oc, "hle", microbit_get_hle,
+                                   microbit_set_hle, &error_abort);
+    object_class_property_set_description(oc, "hle",
+        "Run __aeabi_uidiv, __aeabi_idiv, __aeabi_fadd, __aeabi_fmul, "
+        "memcpy and memset as host code when the -kernel ELF defines them; "
+        "same results, fewer guest instructions", &error_abort);
+    object_class_property_add_bool(oc, "mpy-profile",
+                                   microbit_get_mpy_profile,
+                                   microbit_set_mpy_profile, &error_abort);
+    object_class_property_set_description(oc, "mpy-profile",
+        "Count the MicroPython functions and bytecode the -kernel ELF "
+        "runs, for query-microbit-mpy-profile; slows down the VM",
+        &error_abort);
+    object_class_property_add_bool(oc, "softdevice-hle",
+                                   microbit_get_softdevice_hle,
+                                   microbit_set_softdevice_hle, &error_abort);
+    object_class_property_set_description(oc, "softdevice-hle",
+        "Run an application built for the S110 SoftDevice without it, "
+        "serving its sd_* calls on the host; needs an ELF -kernel. "
+        "Advertising goes out on the radio medium", &error_abort);
+    object_class_property_add_bool(oc, "fast-reset",
+                                   microbit_get_fast_reset,
+                                   microbit_set_fast_reset, &error_abort);
+    object_class_property_set_description(oc, "fast-reset",
+        "After the first reset, reset the devices from a list and write "
+        "back only the flash and RAM pages changed since, so that RAM too "
+        "starts out as after that reset; single board only, not with a "
+        "shared flash-backing", &error_abort);
+    object_class_property_add_bool(oc, "dashboard", microbit_get_dashboard,
+                                   microbit_set_dashboard, &error_abort);
+    object_class_property_set_description(oc, "dashboard",
+        "Show the LED matrices of all the boards in a grid on a single "
+        "console, instead of giving each board a console of its own",
+        &error_abort);
 }
 
 static const TypeInfo microbit_abstract_info = {
@@ -1918,10 +17571,58 @@ static const TypeInfo microbit_info = {
     .parent = TYPE_MICROBIT_MACHINE,
 };
 
+static void microbit_fleet_class_init(ObjectClass *oc, void *data)
+{
+    MachineClass *mc = MACHINE_CLASS(oc);
+
+    mc->desc = "micro:bit fleet (one board per -smp CPU)";
+    mc->init = microbit_fleet_init;
+    mc->max_cpus = MICROBIT_FLEET_MAX_BOARDS;
+    /* The code size depends on -smp, so keep the default buffer */
+    mc->tcg_code_size_hint = 0;
+}
+
+static const TypeInfo microbit_fleet_info = {
+    .name = MACHINE_TYPE_NAME("microbit-fleet"),
+    .parent = TYPE_MICROBIT_MACHINE,
+    .class_init = microbit_fleet_class_init,
+};
+
+/* The V2's Cortex-M4F runs the firmware's float code on its FPU.  The
+ * nRF52833 peripherals are modelled by the nRF51 ones, at the nRF51
+ * addresses, and so is the flash layout.
+ */
+static void microbit_v2_class_init(ObjectClass *oc, void *data)
+{
+    MachineClass *mc = MACHINE_CLASS(oc);
+    MICROBITMachineClass *mmc = MICROBIT_MACHINE_CLASS(oc);
+
+    mc->desc = "micro:bit V2 (Cortex-M4F)";
+    mc->default_cpu_type = ARM_CPU_TYPE_NAME("cortex-m4");
+    mc->default_ram_size = 128 * 1024;
+    /* Its MPU regions go down to 32 bytes */
+    mc->minimum_page_bits = 0;
+    mmc->ram_sizes[0] = 128 * 1024;
+    mmc->ram_sizes[1] = 128 * 1024;
+    mmc->hex_board_min = 0x9903;
+    mmc->hex_board_max = 0x9906;
+}
+
+static const TypeInfo microbit_v2_info = {
+    .name = MACHINE_TYPE_NAME("microbit-v2"),
+    .parent = TYPE_MICROBIT_MACHINE,
+    .class_init = microbit_v2_class_init,
+};
+
 static void microbit_machine_init(void)
 {
+    type_register_static(&nrf51_softdevice_info);
+    type_register_static(&nrf51_soc_info);
     type_register_static(&microbit_abstract_info);
     type_register_static(&microbit_info);
+    type_register_static(&microbit_fleet_info);
+    type_register_static(&microbit_v2_info);
+    type_register_static(&microbit_websocket_info);
 }
 
 type_init(microbit_machine_init)
@@ -43,6 +43,9 @@
 #include "qapi/error.h"
 #include "qemu/timer.h"
 #include "qemu/bitops.h"
+#include "qemu/bitmap.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
 #include "exec/address-spaces.h"
 #include "qemu/host-utils.h"
 #include "qemu/log.h"
@@ -70,6 +73,9 @@ do {                                                        \
 #define PFLASH_BE          0
 #define PFLASH_SECURE      1
 
+/* How long programmed sectors may stay dirty with writeback=async */
+#define PFLASH_WRITEBACK_DELAY_MS 100
+
 struct pflash_t {
     /*< private >*/
     SysBusDevice parent_obj;
@@ -99,6 +105,15 @@ struct pflash_t {
     void *storage;
     VMChangeStateEntry *vmstate;
     bool old_multiple_chip_handling;
+    char *writeback;
+
+    /* writeback=async: sectors of storage not yet written to blk */
+    bool writeback_async;
+    unsigned long *dirty;
+    QEMUTimer *wb_timer;
+    bool wb_busy;
+    Notifier wb_remove_bs;
+    VMChangeStateEntry *wb_vmstate;
 };
 
 static int pflash_post_load(void *opaque, int version_id);
@@ -416,11 +431,120 @@ static void pflash_update(pflash_t *pfl, int offset,
         /* widen to sector boundaries */
         offset = QEMU_ALIGN_DOWN(offset, BDRV_SECTOR_SIZE);
         offset_end = QEMU_ALIGN_UP(offset_end, BDRV_SECTOR_SIZE);
+        if (pfl->writeback_async) {
+            /* Coalesce with other programming; the timer flushes it */
+            bitmap_set(pfl->dirty, offset / BDRV_SECTOR_SIZE,
+                       (offset_end - offset) / BDRV_SECTOR_SIZE);
+            if (!pfl->wb_busy && !timer_pending(pfl->wb_timer)) {
+                timer_mod(pfl->wb_timer,
+                          qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                          PFLASH_WRITEBACK_DELAY_MS);
+            }
+            return;
+        }
         blk_pwrite(pfl->blk, offset, pfl->storage + offset,
                    offset_end - offset, 0);
     }
 }
 
+/* Take the next run of dirty sectors at or after *offset off the bitmap */
+static bool pflash_writeback_next(pflash_t *pfl, uint64_t *offset,
+                                  uint64_t *len)
+{
+    uint64_t total_len = memory_region_size(&pfl->mem);
+    long nb_sectors = DIV_ROUND_UP(total_len, BDRV_SECTOR_SIZE);
+    long start, end;
+
+    start = find_next_bit(pfl->dirty, nb_sectors, *offset / BDRV_SECTOR_SIZE);
+    if (start >= nb_sectors) {
+        return false;
+    }
+    end = find_next_zero_bit(pfl->dirty, nb_sectors, start);
+    bitmap_clear(pfl->dirty, start, end - start);
+
+    *offset = start * BDRV_SECTOR_SIZE;
+    *len = MIN(end * BDRV_SECTOR_SIZE, total_len) - *offset;
+    return true;
+}
+
+static void coroutine_fn pflash_writeback_co(void *opaque)
+{
+    pflash_t *pfl = opaque;
+    uint64_t offset = 0, len;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    long nb_sectors;
+    int ret;
+
+    while (pflash_writeback_next(pfl, &offset, &len)) {
+        /* The guest may program the run again while the write is queued */
+        iov.iov_base = blk_blockalign(pfl->blk, len);
+        iov.iov_len = len;
+        memcpy(iov.iov_base, pfl->storage + offset, len);
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = blk_co_pwritev(pfl->blk, offset, len, &qiov, 0);
+        qemu_vfree(iov.iov_base);
+        if (ret < 0) {
+            error_report("%s: write-back at 0x%" PRIx64 " failed: %s",
+                         pfl->name, offset, strerror(-ret));
+        }
+        offset += len;
+    }
+
+    pfl->wb_busy = false;
+    /* Sectors behind us may have been dirtied while we yielded */
+    nb_sectors = DIV_ROUND_UP(memory_region_size(&pfl->mem), BDRV_SECTOR_SIZE);
+    if (find_first_bit(pfl->dirty, nb_sectors) < nb_sectors) {
+        timer_mod(pfl->wb_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  PFLASH_WRITEBACK_DELAY_MS);
+    }
+}
+
+static void pflash_writeback_timer(void *opaque)
+{
+    pflash_t *pfl = opaque;
+    Coroutine *co;
+
+    pfl->wb_busy = true;
+    co = qemu_coroutine_create(pflash_writeback_co, pfl);
+    aio_co_enter(blk_get_aio_context(pfl->blk), co);
+}
+
+/* Write every dirty sector out before returning */
+static void pflash_writeback_flush(pflash_t *pfl)
+{
+    uint64_t offset = 0, len;
+
+    timer_del(pfl->wb_timer);
+    while (pfl->wb_busy) {
+        aio_poll(blk_get_aio_context(pfl->blk), true);
+    }
+    while (pflash_writeback_next(pfl, &offset, &len)) {
+        blk_pwrite(pfl->blk, offset, pfl->storage + offset, len, 0);
+        offset += len;
+    }
+}
+
+static void pflash_writeback_vm_state(void *opaque, int running,
+                                      RunState state)
+{
+    pflash_t *pfl = opaque;
+
+    /* Migration and savevm read the image once the VM is stopped */
+    if (!running) {
+        pflash_writeback_flush(pfl);
+    }
+}
+
+static void pflash_writeback_remove_bs(Notifier *n, void *data)
+{
+    pflash_t *pfl = container_of(n, pflash_t, wb_remove_bs);
+
+    /* Last chance at shutdown, from bdrv_close_all() */
+    pflash_writeback_flush(pfl);
+    pfl->writeback_async = false;
+}
+
 static inline void pflash_data_write(pflash_t *pfl, hwaddr offset,
                                      uint32_t value, int width, int be)
 {
@@ -719,6 +843,15 @@ static void pflash_cfi01_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "attribute \"name\" not specified.");
         return;
     }
+    if (!pfl->writeback || !strcmp(pfl->writeback, "sync")) {
+        pfl->writeback_async = false;
+    } else if (!strcmp(pfl->writeback, "async")) {
+        pfl->writeback_async = true;
+    } else {
+        error_setg(errp, "attribute \"writeback\" must be \"sync\" or "
+                   "\"async\".");
+        return;
+    }
 
     total_len = pfl->sector_len * pfl->nb_blocs;
 
@@ -785,6 +918,18 @@ static void pflash_cfi01_realize(DeviceState *dev, Error **errp)
         pfl->max_device_width = pfl->device_width;
     }
 
+    if (pfl->blk && !pfl->ro && pfl->writeback_async) {
+        pfl->dirty = bitmap_new(DIV_ROUND_UP(total_len, BDRV_SECTOR_SIZE));
+        pfl->wb_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                     pflash_writeback_timer, pfl);
+        pfl->wb_vmstate =
+            qemu_add_vm_change_state_handler(pflash_writeback_vm_state, pfl);
+        pfl->wb_remove_bs.notify = pflash_writeback_remove_bs;
+        blk_add_remove_bs_notifier(pfl->blk, &pfl->wb_remove_bs);
+    } else {
+        pfl->writeback_async = false;
+    }
+
     pfl->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, pflash_timer, pfl);
     pfl->wcycle = 0;
     pfl->cmd = 0;
@@ -913,6 +1058,12 @@ static Property pflash_cfi01_properties[] = {
     DEFINE_PROP_STRING("name", struct pflash_t, name),
     DEFINE_PROP_BOOL("old-multiple-chip-handling", struct pflash_t,
                      old_multiple_chip_handling, false),
+    /* writeback=sync (the default) writes each programmed word or erased
+     * sector to the drive before the guest continues. writeback=async
+     * marks the sectors dirty and writes them from a coroutine a little
+     * later, when the VM stops, or at shutdown.
+     */
+    DEFINE_PROP_STRING("writeback", struct pflash_t, writeback),
     DEFINE_PROP_END_OF_LIST(),
 };
 
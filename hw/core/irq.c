@@ -33,6 +33,7 @@ struct IRQState {
     Object parent_obj;
 
     qemu_irq_handler handler;
+    qemu_irq_edge_handler edge_handler;
     void *opaque;
     int n;
 };
@@ -45,6 +46,25 @@ void qemu_set_irq(qemu_irq irq, int level)
     irq->handler(irq->opaque, irq->n, level);
 }
 
+void qemu_irq_pulse(qemu_irq irq)
+{
+    if (!irq) {
+        return;
+    }
+
+    if (irq->edge_handler) {
+        irq->edge_handler(irq->opaque, irq->n);
+    } else {
+        irq->handler(irq->opaque, irq->n, 1);
+        irq->handler(irq->opaque, irq->n, 0);
+    }
+}
+
+void qemu_irq_set_edge_handler(qemu_irq irq, qemu_irq_edge_handler handler)
+{
+    irq->edge_handler = handler;
+}
+
 qemu_irq *qemu_extend_irqs(qemu_irq *old, int n_old, qemu_irq_handler handler,
                            void *opaque, int n)
 {
@@ -142,6 +162,7 @@ void qemu_irq_intercept_in(qemu_irq *gpio_in, qemu_irq_handler handler, int n)
     for (i = 0; i < n; i++) {
         *old_irqs[i] = *gpio_in[i];
         gpio_in[i]->handler = handler;
+        gpio_in[i]->edge_handler = NULL;
         gpio_in[i]->opaque = &old_irqs[i];
     }
 }
@@ -834,6 +834,8 @@ struct Rom {
     size_t datasize;
 
     uint8_t *data;
+    /* If not NULL, "data" is this private mapping of the file */
+    GMappedFile *mapped;
     MemoryRegion *mr;
     AddressSpace *as;
     int isrom;
@@ -847,6 +849,17 @@ struct Rom {
 static FWCfgState *fw_cfg;
 static QTAILQ_HEAD(, Rom) roms = QTAILQ_HEAD_INITIALIZER(roms);
 
+static void rom_free_data(Rom *rom)
+{
+    if (rom->mapped) {
+        g_mapped_file_unref(rom->mapped);
+        rom->mapped = NULL;
+    } else {
+        g_free(rom->data);
+    }
+    rom->data = NULL;
+}
+
 static inline bool rom_order_compare(Rom *rom, Rom *item)
 {
     return ((uintptr_t)(void *)rom->as > (uintptr_t)(void *)item->as) ||
@@ -909,8 +922,9 @@ int rom_add_file(const char *file, const char *fw_dir,
 {
     MachineClass *mc = MACHINE_GET_CLASS(qdev_get_machine());
     Rom *rom;
-    int rc, fd = -1;
+    int fd = -1;
     char devpath[100];
+    Error *err = NULL;
 
     if (as && mr) {
         fprintf(stderr, "Specifying an Address Space and Memory Region is " \
@@ -946,16 +960,29 @@ int rom_add_file(const char *file, const char *fw_dir,
         goto err;
     }
 
+    close(fd);
+    fd = -1;
+
+    /* The image stays in the page cache; pages only get copied if
+     * something writes to them through rom_ptr().  This means that the
+     * file must not be rewritten in place while QEMU runs.
+     */
     rom->datasize = rom->romsize;
-    rom->data     = g_malloc0(rom->datasize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->datasize);
-    if (rc != rom->datasize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->datasize);
-        goto err;
+    if (rom->datasize) {
+        rom->mapped = g_mapped_file_new(rom->path, TRUE, &err);
+        if (!rom->mapped) {
+            fprintf(stderr, "rom: file %-20s: map error: %s\n",
+                    rom->name, err->message);
+            g_error_free(err);
+            goto err;
+        }
+        if (g_mapped_file_get_length(rom->mapped) != rom->datasize) {
+            fprintf(stderr, "rom: file %-20s: changed size while loading\n",
+                    rom->name);
+            goto err;
+        }
+        rom->data = (uint8_t *)g_mapped_file_get_contents(rom->mapped);
     }
-    close(fd);
     rom_insert(rom);
     if (rom->fw_file && fw_cfg) {
         const char *basename;
@@ -995,7 +1022,7 @@ err:
     if (fd != -1)
         close(fd);
 
-    g_free(rom->data);
+    rom_free_data(rom);
     g_free(rom->path);
     g_free(rom->name);
     if (fw_dir) {
@@ -1080,9 +1107,38 @@ int rom_add_option(const char *file, int32_t bootindex)
     return rom_add_file(file, "genroms", 0, bootindex, true, NULL, NULL);
 }
 
+/* Granule of the comparison in rom_reset_range() */
+#define ROM_RESET_CHUNK 4096
+
+/* Write the part of @rom's image at @off, @len bytes, to guest memory,
+ * unless the guest memory already holds it.  Writing would dirty the
+ * pages, unshare them between forked instances and throw away the
+ * code translated from them.
+ */
+static void rom_reset_range(Rom *rom, hwaddr off, hwaddr len)
+{
+    MemoryRegionSection section;
+    bool same = false;
+
+    section = memory_region_find(rom->as->root, rom->addr + off, len);
+    if (section.mr && memory_region_is_ram(section.mr) &&
+        int128_eq(section.size, int128_make64(len))) {
+        uint8_t *host = memory_region_get_ram_ptr(section.mr);
+
+        same = !memcmp(host + section.offset_within_region, rom->data + off,
+                       len);
+    }
+    memory_region_unref(section.mr);
+    if (!same) {
+        cpu_physical_memory_write_rom(rom->as, rom->addr + off,
+                                      rom->data + off, len);
+    }
+}
+
 static void rom_reset(void *unused)
 {
     Rom *rom;
+    size_t off;
 
     QTAILQ_FOREACH(rom, &roms, next) {
         if (rom->fw_file) {
@@ -1093,15 +1149,19 @@ static void rom_reset(void *unused)
         }
         if (rom->mr) {
             void *host = memory_region_get_ram_ptr(rom->mr);
-            memcpy(host, rom->data, rom->datasize);
+
+            if (memcmp(host, rom->data, rom->datasize)) {
+                memcpy(host, rom->data, rom->datasize);
+            }
         } else {
-            cpu_physical_memory_write_rom(rom->as, rom->addr, rom->data,
-                                          rom->datasize);
+            for (off = 0; off < rom->datasize; off += ROM_RESET_CHUNK) {
+                rom_reset_range(rom, off,
+                                MIN(ROM_RESET_CHUNK, rom->datasize - off));
+            }
         }
         if (rom->isrom) {
             /* rom needs to be written only once */
-            g_free(rom->data);
-            rom->data = NULL;
+            rom_free_data(rom);
         }
         /*
          * The rom loader is really on the same level as firmware in the guest
@@ -1259,6 +1319,26 @@ void *rom_ptr(hwaddr addr)
     return rom->data + (addr - rom->addr);
 }
 
+/*
+ * Stop restoring the ROMs of @as that overlap [addr, addr + size) at
+ * reset, for a board that has rewritten that memory since, such as a
+ * reflashed flash.  rom_ptr() no longer finds them either.
+ */
+void rom_discard_range(AddressSpace *as, hwaddr addr, size_t size)
+{
+    Rom *rom;
+
+    QTAILQ_FOREACH(rom, &roms, next) {
+        if (rom->fw_file || rom->mr || rom->as != as) {
+            continue;
+        }
+        if (rom->addr >= addr + size || rom->addr + rom->romsize <= addr) {
+            continue;
+        }
+        rom_free_data(rom);
+    }
+}
+
 void hmp_info_roms(Monitor *mon, const QDict *qdict)
 {
     Rom *rom;
@@ -826,7 +826,14 @@ void machine_run_board_init(MachineState *machine)
         }
     }
 
+    if (machine_class->init_unbatched) {
+        machine_class->init(machine);
+        return;
+    }
+
+    memory_region_transaction_begin();
     machine_class->init(machine);
+    memory_region_transaction_commit();
 }
 
 static void machine_class_finalize(ObjectClass *klass, void *data)
@@ -30,6 +30,16 @@ struct ptimer_state
     uint8_t policy_mask;
     QEMUBH *bh;
     QEMUTimer *timer;
+
+    /* Compare channels, see ptimer_set_compare().  */
+    uint8_t compare_armed;
+    uint8_t compare_pending;
+    uint64_t compare[PTIMER_MAX_COMPARE];
+    int64_t compare_next[PTIMER_MAX_COMPARE];
+    ptimer_compare_cb compare_cb;
+    void *compare_opaque;
+    QEMUBH *compare_bh;
+    QEMUTimer *compare_timer;
 };
 
 /* Use a bottom-half routine to avoid reentrancy issues.  */
@@ -40,6 +50,19 @@ static void ptimer_trigger(ptimer_state *s)
     }
 }
 
+/* Trigger from the timer callback, see PTIMER_POLICY_SYNC_TRIGGER */
+static void ptimer_expire_trigger(ptimer_state *s)
+{
+    if (s->bh && (s->policy_mask & PTIMER_POLICY_SYNC_TRIGGER) &&
+        replay_mode == REPLAY_MODE_NONE) {
+        /* A trigger already scheduled is folded into this one */
+        qemu_bh_cancel(s->bh);
+        aio_bh_call(s->bh);
+    } else {
+        ptimer_trigger(s);
+    }
+}
+
 static void ptimer_reload(ptimer_state *s, int delta_adjust)
 {
     uint32_t period_frac = s->period_frac;
@@ -118,6 +141,107 @@ static void ptimer_reload(ptimer_state *s, int delta_adjust)
     timer_mod(s->timer, s->next_event);
 }
 
+/* Time it takes the counter to count down by @ticks.  */
+static int64_t ptimer_ticks_ns(uint64_t ticks, int64_t period,
+                               uint32_t period_frac)
+{
+    return ticks * period + (((int64_t)period_frac * ticks) >> 32);
+}
+
+/* The period a run of @delta ticks really uses, see ptimer_reload().  */
+static void ptimer_run_period(ptimer_state *s, uint64_t delta,
+                              int64_t *period, uint32_t *period_frac)
+{
+    *period = s->period;
+    *period_frac = s->period_frac;
+    if (s->enabled == 1 && (delta * s->period < 10000) && !use_icount) {
+        *period = 10000 / delta;
+        *period_frac = 0;
+    }
+}
+
+/* When, after @now, the counter next counts down to @value; -1 if never.
+   The current run goes from s->delta at last_event to 0 at next_event,
+   and a periodic timer then runs from the limit.  */
+static int64_t ptimer_compare_when(ptimer_state *s, uint64_t value,
+                                   int64_t now)
+{
+    int64_t period, when;
+    uint32_t period_frac;
+
+    if (value < s->delta) {
+        ptimer_run_period(s, s->delta, &period, &period_frac);
+        when = s->next_event - ptimer_ticks_ns(value, period, period_frac);
+        if (when > now) {
+            return when;
+        }
+    }
+    if (s->enabled == 1 && value < s->limit) {
+        ptimer_run_period(s, s->limit, &period, &period_frac);
+        when = s->next_event +
+               ptimer_ticks_ns(s->limit - value, period, period_frac);
+        if (when > now) {
+            return when;
+        }
+    }
+    return -1;
+}
+
+/* Report the compare matches that are due and arm compare_timer for the
+   nearest one to come.  Called whenever the counter is changed.  */
+static void ptimer_compare_update(ptimer_state *s)
+{
+    int64_t now, next = -1;
+    int i;
+
+    if (!s->compare_armed) {
+        timer_del(s->compare_timer);
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    for (i = 0; i < PTIMER_MAX_COMPARE; i++) {
+        if (!(s->compare_armed & (1 << i))) {
+            continue;
+        }
+        if (s->compare_next[i] != -1 && s->compare_next[i] <= now) {
+            s->compare_pending |= 1 << i;
+        }
+        s->compare_next[i] = s->enabled ?
+                             ptimer_compare_when(s, s->compare[i], now) : -1;
+        if (s->compare_next[i] != -1 &&
+            (next == -1 || s->compare_next[i] < next)) {
+            next = s->compare_next[i];
+        }
+    }
+
+    if (next == -1) {
+        timer_del(s->compare_timer);
+    } else {
+        timer_mod(s->compare_timer, next);
+    }
+
+    if (s->compare_pending && s->compare_bh) {
+        replay_bh_schedule_event(s->compare_bh);
+    }
+}
+
+static void ptimer_compare_tick(void *opaque)
+{
+    ptimer_compare_update(opaque);
+}
+
+static void ptimer_compare_trigger(void *opaque)
+{
+    ptimer_state *s = opaque;
+    unsigned channels = s->compare_pending;
+
+    s->compare_pending = 0;
+    if (channels && s->compare_cb) {
+        s->compare_cb(s->compare_opaque, channels);
+    }
+}
+
 static void ptimer_tick(void *opaque)
 {
     ptimer_state *s = (ptimer_state *)opaque;
@@ -148,8 +272,10 @@ static void ptimer_tick(void *opaque)
         ptimer_reload(s, delta_adjust);
     }
 
+    ptimer_compare_update(s);
+
     if (trigger) {
-        ptimer_trigger(s);
+        ptimer_expire_trigger(s);
     }
 }
 
@@ -255,6 +381,7 @@ void ptimer_set_count(ptimer_state *s, uint64_t count)
         s->next_event = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
         ptimer_reload(s, 0);
     }
+    ptimer_compare_update(s);
 }
 
 void ptimer_run(ptimer_state *s, int oneshot)
@@ -272,6 +399,7 @@ void ptimer_run(ptimer_state *s, int oneshot)
         s->next_event = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
         ptimer_reload(s, 0);
     }
+    ptimer_compare_update(s);
 }
 
 /* Pause a timer.  Note that this may cause it to "lose" time, even if it
@@ -284,6 +412,7 @@ void ptimer_stop(ptimer_state *s)
     s->delta = ptimer_get_count(s);
     timer_del(s->timer);
     s->enabled = 0;
+    ptimer_compare_update(s);
 }
 
 /* Set counter increment interval in nanoseconds.  */
@@ -296,6 +425,7 @@ void ptimer_set_period(ptimer_state *s, int64_t period)
         s->next_event = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
         ptimer_reload(s, 0);
     }
+    ptimer_compare_update(s);
 }
 
 /* Set counter frequency in Hz.  */
@@ -308,6 +438,7 @@ void ptimer_set_freq(ptimer_state *s, uint32_t freq)
         s->next_event = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
         ptimer_reload(s, 0);
     }
+    ptimer_compare_update(s);
 }
 
 /* Set the initial countdown value.  If reload is nonzero then also set
@@ -321,6 +452,7 @@ void ptimer_set_limit(ptimer_state *s, uint64_t limit, int reload)
         s->next_event = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
         ptimer_reload(s, 0);
     }
+    ptimer_compare_update(s);
 }
 
 uint64_t ptimer_get_limit(ptimer_state *s)
@@ -328,6 +460,66 @@ uint64_t ptimer_get_limit(ptimer_state *s)
     return s->limit;
 }
 
+void ptimer_set_compare_cb(ptimer_state *s, ptimer_compare_cb cb,
+                           void *opaque)
+{
+    s->compare_cb = cb;
+    s->compare_opaque = opaque;
+    if (!s->compare_bh) {
+        s->compare_bh = qemu_bh_new(ptimer_compare_trigger, s);
+    }
+}
+
+void ptimer_set_compare(ptimer_state *s, unsigned channel, uint64_t value)
+{
+    assert(channel < PTIMER_MAX_COMPARE);
+    s->compare[channel] = value;
+    s->compare_next[channel] = -1;
+    s->compare_armed |= 1 << channel;
+    ptimer_compare_update(s);
+}
+
+void ptimer_clear_compare(ptimer_state *s, unsigned channel)
+{
+    assert(channel < PTIMER_MAX_COMPARE);
+    s->compare_armed &= ~(1 << channel);
+    s->compare_pending &= ~(1 << channel);
+    ptimer_compare_update(s);
+}
+
+static bool ptimer_compare_needed(void *opaque)
+{
+    ptimer_state *s = opaque;
+
+    return s->compare_armed != 0;
+}
+
+static int ptimer_compare_post_load(void *opaque, int version_id)
+{
+    ptimer_state *s = opaque;
+
+    if (s->compare_pending && s->compare_bh) {
+        replay_bh_schedule_event(s->compare_bh);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_ptimer_compare = {
+    .name = "ptimer/compare",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = ptimer_compare_needed,
+    .post_load = ptimer_compare_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(compare_armed, ptimer_state),
+        VMSTATE_UINT8(compare_pending, ptimer_state),
+        VMSTATE_UINT64_ARRAY(compare, ptimer_state, PTIMER_MAX_COMPARE),
+        VMSTATE_INT64_ARRAY(compare_next, ptimer_state, PTIMER_MAX_COMPARE),
+        VMSTATE_TIMER_PTR(compare_timer, ptimer_state),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 const VMStateDescription vmstate_ptimer = {
     .name = "ptimer",
     .version_id = 1,
@@ -342,6 +534,10 @@ const VMStateDescription vmstate_ptimer = {
         VMSTATE_INT64(next_event, ptimer_state),
         VMSTATE_TIMER_PTR(timer, ptimer_state),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_ptimer_compare,
+        NULL
     }
 };
 
@@ -352,6 +548,7 @@ ptimer_state *ptimer_init(QEMUBH *bh, uint8_t policy_mask)
     s = (ptimer_state *)g_malloc0(sizeof(ptimer_state));
     s->bh = bh;
     s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, ptimer_tick, s);
+    s->compare_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, ptimer_compare_tick, s);
     s->policy_mask = policy_mask;
     return s;
 }
@@ -360,5 +557,9 @@ void ptimer_free(ptimer_state *s)
 {
     qemu_bh_delete(s->bh);
     timer_free(s->timer);
+    if (s->compare_bh) {
+        qemu_bh_delete(s->compare_bh);
+    }
+    timer_free(s->compare_timer);
     g_free(s);
 }
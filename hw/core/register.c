@@ -19,6 +19,7 @@
 #include "hw/register.h"
 #include "hw/qdev.h"
 #include "qemu/log.h"
+#include "qapi/error.h"
 
 static inline void register_write_val(RegisterInfo *reg, uint64_t val)
 {
@@ -284,6 +285,64 @@ RegisterInfoArray *register_init_block32(DeviceState *owner,
     return r_array;
 }
 
+RegisterInfoArray *register_init_block32_romd(DeviceState *owner,
+                                              const RegisterAccessInfo *rae,
+                                              int num, RegisterInfo *ri,
+                                              const MemoryRegionOps *ops,
+                                              bool debug_enabled,
+                                              uint64_t memory_size,
+                                              Error **errp)
+{
+    const char *device_prefix = object_get_typename(OBJECT(owner));
+    RegisterInfoArray *r_array;
+    Error *local_err = NULL;
+    uint32_t *data;
+    char *path;
+    int i;
+
+    r_array = g_new0(RegisterInfoArray, 1);
+    memory_region_init_rom_device_nomigrate(&r_array->mem, OBJECT(owner), ops,
+                                            r_array, device_prefix,
+                                            memory_size, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        g_free(r_array);
+        return NULL;
+    }
+    /* Sysbus devices have no dev path, so name the RAM after the QOM path */
+    path = object_get_canonical_path(OBJECT(owner));
+    qemu_ram_set_idstr(r_array->mem.ram_block, path, NULL);
+    g_free(path);
+
+    data = memory_region_get_ram_ptr(&r_array->mem);
+    memset(data, 0, memory_size);
+
+    r_array->r = g_new0(RegisterInfo *, num);
+    r_array->num_elements = num;
+    r_array->debug = debug_enabled;
+    r_array->prefix = device_prefix;
+
+    for (i = 0; i < num; i++) {
+        int index = rae[i].addr / 4;
+        RegisterInfo *r = &ri[index];
+
+        /* Reads never reach us, so there is nothing to clear or fix up */
+        assert(!rae[i].cor && !rae[i].post_read);
+
+        *r = (RegisterInfo) {
+            .data = &data[index],
+            .data_size = sizeof(uint32_t),
+            .access = &rae[i],
+            .opaque = owner,
+        };
+        register_init(r);
+
+        r_array->r[i] = r;
+    }
+
+    return r_array;
+}
+
 void register_finalize_block(RegisterInfoArray *r_array)
 {
     object_unparent(OBJECT(&r_array->mem));
@@ -20,7 +20,10 @@
 #include "hw/intc/armv7m_nvic.h"
 #include "target/arm/cpu.h"
 #include "exec/exec-all.h"
+#include "sysemu/cpus.h"
 #include "qemu/log.h"
+#include "qemu/host-utils.h"
+#include "qapi/qapi-commands-misc.h"
 #include "trace.h"
 
 /* IRQ number counting:
@@ -203,6 +206,74 @@ static int exc_group_prio(NVICState *s, int rawprio, bool targets_secure)
     return rawprio;
 }
 
+static void nvic_prio_count(unsigned long *prios, uint16_t *count, int prio,
+                            int delta)
+{
+    int level = prio + NVIC_PRIO_BIAS;
+
+    count[level] += delta;
+    if (count[level]) {
+        set_bit(level, prios);
+    } else {
+        clear_bit(level, prios);
+    }
+}
+
+/* Drop vector @vec of exception @irq from the cached pending and active
+ * state. Call this before changing the enabled, pending, active or prio
+ * field of a vector and nvic_vec_track() afterwards. Only the vectors[]
+ * entries are tracked; sec_vectors[] ones are ignored.
+ */
+static void nvic_vec_untrack(NVICState *s, int irq, VecInfo *vec)
+{
+    if (vec != &s->vectors[irq]) {
+        return;
+    }
+    if (test_and_clear_bit(irq, s->pending_map)) {
+        nvic_prio_count(s->pending_prios, s->pending_prio_count,
+                        vec->prio, -1);
+    }
+    if (test_and_clear_bit(irq, s->active_map)) {
+        nvic_prio_count(s->active_prios, s->active_prio_count,
+                        vec->prio, -1);
+    }
+}
+
+static void nvic_vec_track(NVICState *s, int irq, VecInfo *vec)
+{
+    if (vec != &s->vectors[irq]) {
+        return;
+    }
+    if (vec->enabled && vec->pending) {
+        set_bit(irq, s->pending_map);
+        nvic_prio_count(s->pending_prios, s->pending_prio_count,
+                        vec->prio, 1);
+    }
+    if (vec->active) {
+        set_bit(irq, s->active_map);
+        nvic_prio_count(s->active_prios, s->active_prio_count,
+                        vec->prio, 1);
+    }
+}
+
+/* Rebuild the cached pending and active state from scratch, after
+ * changes that are too rare to be worth tracking one vector at a time
+ */
+static void nvic_track_all(NVICState *s)
+{
+    int i;
+
+    bitmap_zero(s->pending_map, NVIC_MAX_VECTORS);
+    bitmap_zero(s->active_map, NVIC_MAX_VECTORS);
+    bitmap_zero(s->pending_prios, NVIC_PRIO_LEVELS);
+    bitmap_zero(s->active_prios, NVIC_PRIO_LEVELS);
+    memset(s->pending_prio_count, 0, sizeof(s->pending_prio_count));
+    memset(s->active_prio_count, 0, sizeof(s->active_prio_count));
+    for (i = 1; i < s->num_irq; i++) {
+        nvic_vec_track(s, i, &s->vectors[i]);
+    }
+}
+
 /* Recompute vectpending and exception_prio for a CPU which implements
  * the Security extension
  */
@@ -266,7 +337,7 @@ static void nvic_recompute_state_secure(NVICState *s)
 /* Recompute vectpending and exception_prio */
 static void nvic_recompute_state(NVICState *s)
 {
-    int i;
+    int level;
     int pend_prio = NVIC_NOEXC_PRIO;
     int active_prio = NVIC_NOEXC_PRIO;
     int pend_irq = 0;
@@ -283,18 +354,23 @@ static void nvic_recompute_state(NVICState *s)
         return;
     }
 
-    for (i = 1; i < s->num_irq; i++) {
-        VecInfo *vec = &s->vectors[i];
-
-        if (vec->enabled && vec->pending && vec->prio < pend_prio) {
-            pend_prio = vec->prio;
-            pend_irq = i;
-        }
-        if (vec->active && vec->prio < active_prio) {
-            active_prio = vec->prio;
+    /* The highest priority pending exception is the lowest numbered
+     * one at the lowest raw priority that has any pending.
+     */
+    level = find_first_bit(s->pending_prios, NVIC_PRIO_LEVELS);
+    if (level < NVIC_PRIO_LEVELS) {
+        pend_prio = level - NVIC_PRIO_BIAS;
+        pend_irq = find_first_bit(s->pending_map, s->num_irq);
+        while (s->vectors[pend_irq].prio != pend_prio) {
+            pend_irq = find_next_bit(s->pending_map, s->num_irq, pend_irq + 1);
         }
     }
 
+    level = find_first_bit(s->active_prios, NVIC_PRIO_LEVELS);
+    if (level < NVIC_PRIO_LEVELS) {
+        active_prio = level - NVIC_PRIO_BIAS;
+    }
+
     if (active_prio > 0) {
         active_prio &= nvic_gprio_mask(s, false);
     }
@@ -424,7 +500,9 @@ static void set_prio(NVICState *s, unsigned irq, bool secure, uint8_t prio)
         assert(exc_is_banked(irq));
         s->sec_vectors[irq].prio = prio;
     } else {
+        nvic_vec_untrack(s, irq, &s->vectors[irq]);
         s->vectors[irq].prio = prio;
+        nvic_vec_track(s, irq, &s->vectors[irq]);
     }
 
     trace_nvic_set_prio(irq, secure, prio);
@@ -483,6 +561,48 @@ static void nvic_irq_update(NVICState *s)
  * if @secure is true and @irq does not specify one of the fixed set
  * of architecturally banked exceptions.
  */
+/* Start timing exception @irq, unless it is already pending in a bank */
+static void nvic_latency_start(NVICState *s, int irq)
+{
+    NVICLatency *l = &s->latency[irq];
+
+    if (!l->timing) {
+        l->timing = true;
+        l->pending_vns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        l->pending_hns = get_clock();
+    }
+}
+
+static unsigned nvic_latency_bucket(int64_t ns)
+{
+    return ns <= 0 ? 0 : MIN(64 - clz64(ns), NVIC_LATENCY_BUCKETS - 1);
+}
+
+/* The CPU takes exception @irq: add how long it waited to the histograms */
+static void nvic_latency_end(NVICState *s, int irq)
+{
+    NVICLatency *l = &s->latency[irq];
+
+    if (!l->timing) {
+        return;
+    }
+    l->timing = false;
+    l->count++;
+    l->virt[nvic_latency_bucket(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) -
+                                l->pending_vns)]++;
+    l->host[nvic_latency_bucket(get_clock() - l->pending_hns)]++;
+}
+
+/* Forget the pending times, after reset or when they are from elsewhere */
+static void nvic_latency_clear_timing(NVICState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_irq; i++) {
+        s->latency[i].timing = false;
+    }
+}
+
 static void armv7m_nvic_clear_pending(void *opaque, int irq, bool secure)
 {
     NVICState *s = (NVICState *)opaque;
@@ -498,8 +618,14 @@ static void armv7m_nvic_clear_pending(void *opaque, int irq, bool secure)
     }
     trace_nvic_clear_pending(irq, secure, vec->enabled, vec->prio);
     if (vec->pending) {
+        nvic_vec_untrack(s, irq, vec);
         vec->pending = 0;
+        nvic_vec_track(s, irq, vec);
         nvic_irq_update(s);
+        if (!s->vectors[irq].pending &&
+            !(exc_is_banked(irq) && s->sec_vectors[irq].pending)) {
+            s->latency[irq].timing = false;
+        }
     }
 }
 
@@ -634,8 +760,17 @@ static void do_armv7m_nvic_set_pending(void *opaque, int irq, bool secure,
     }
 
     if (!vec->pending) {
+        nvic_vec_untrack(s, irq, vec);
         vec->pending = 1;
+        nvic_vec_track(s, irq, vec);
+        nvic_latency_start(s, irq);
         nvic_irq_update(s);
+        /* With SEVONPEND any newly pending exception, even a disabled
+         * or low priority one, wakes WFE
+         */
+        if (s->cpu->env.v7m.scr[secure] & R_V7M_SCR_SEVONPEND_MASK) {
+            arm_cpu_set_event(s->cpu);
+        }
     }
 }
 
@@ -673,10 +808,14 @@ void armv7m_nvic_acknowledge_irq(void *opaque)
 
     trace_nvic_acknowledge_irq(pending, s->vectpending_prio);
 
+    nvic_vec_untrack(s, pending, vec);
     vec->active = 1;
     vec->pending = 0;
+    nvic_vec_track(s, pending, vec);
 
     write_v7m_exception(env, s->vectpending);
+    cpu_exec_stats_irq(CPU(s->cpu), pending);
+    nvic_latency_end(s, pending);
 
     nvic_irq_update(s);
 }
@@ -726,6 +865,7 @@ int armv7m_nvic_complete_irq(void *opaque, int irq, bool secure)
 
     ret = nvic_rettobase(s);
 
+    nvic_vec_untrack(s, irq, vec);
     vec->active = 0;
     if (vec->level) {
         /* Re-pend the exception if it's still held high; only
@@ -733,7 +873,9 @@ int armv7m_nvic_complete_irq(void *opaque, int irq, bool secure)
          */
         assert(irq >= NVIC_FIRST_IRQ);
         vec->pending = 1;
+        nvic_latency_start(s, irq);
     }
+    nvic_vec_track(s, irq, vec);
 
     nvic_irq_update(s);
 
@@ -768,6 +910,99 @@ static void set_irq_level(void *opaque, int n, int level)
     }
 }
 
+/* A pulse: a rising edge if the line was low, and the line ends low */
+static void set_irq_edge(void *opaque, int n)
+{
+    NVICState *s = opaque;
+    VecInfo *vec;
+
+    n += NVIC_FIRST_IRQ;
+
+    assert(n >= NVIC_FIRST_IRQ && n < s->num_irq);
+
+    trace_nvic_set_irq_edge(n);
+
+    vec = &s->vectors[n];
+    if (!vec->level) {
+        armv7m_nvic_set_pending(s, n, false);
+    }
+    vec->level = 0;
+}
+
+/* DEMCR and DWT_CTRL bits */
+#define NVIC_DEMCR_TRCENA       (1U << 24)
+#define NVIC_DEMCR_V6M_MASK     0x01000401
+#define NVIC_DEMCR_V7M_MASK     0x010f07f1
+#define DWT_CTRL_CYCCNTENA      (1U << 0)
+#define DWT_CTRL_SLEEPEVTENA    (1U << 19)
+#define DWT_CTRL_NOEXTTRIG      (1U << 26)
+#define DWT_CTRL_NOTRCPKT       (1U << 27)
+#define DWT_CTRL_MASK           0x007f1fff
+
+/* v6M's DWT has no profiling counters, only the (here absent) comparators */
+static bool nvic_dwt_has_counters(NVICState *s)
+{
+    return arm_feature(&s->cpu->env, ARM_FEATURE_V7);
+}
+
+static bool nvic_dwt_counting(NVICState *s, int n)
+{
+    static const uint32_t enable[NVIC_DWT_NUM_COUNTERS] = {
+        [NVIC_DWT_CYCCNT] = DWT_CTRL_CYCCNTENA,
+        [NVIC_DWT_SLEEPCNT] = DWT_CTRL_SLEEPEVTENA,
+    };
+
+    return (s->demcr & NVIC_DEMCR_TRCENA) && (s->dwt_ctrl & enable[n]);
+}
+
+/* The clock counter @n follows, in core cycles.  A cycle is
+ * system_clock_scale ns of virtual time, so that under icount the count
+ * only depends on the instructions executed and the time slept.  Sleep
+ * cycles are only known under icount, as the virtual time that was not
+ * spent executing instructions; with shift=auto they are approximate.
+ */
+static int64_t nvic_dwt_clock(int n)
+{
+    int64_t ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (n == NVIC_DWT_SLEEPCNT) {
+        if (!use_icount) {
+            return 0;
+        }
+        ns -= cpu_icount_to_ns(cpu_get_icount_raw());
+    }
+    return ns / MAX(system_clock_scale, 1);
+}
+
+static uint32_t nvic_dwt_read_counter(NVICState *s, int n)
+{
+    uint32_t val = s->dwt_count[n];
+
+    if (nvic_dwt_counting(s, n)) {
+        val += nvic_dwt_clock(n) - s->dwt_base[n];
+    }
+    /* Only CYCCNT is 32 bits wide */
+    return n == NVIC_DWT_CYCCNT ? val : val & 0xff;
+}
+
+static void nvic_dwt_set_counter(NVICState *s, int n, uint32_t value)
+{
+    s->dwt_count[n] = value;
+    s->dwt_base[n] = nvic_dwt_clock(n);
+}
+
+/* Bring the counters up to date before DEMCR or DWT_CTRL start or
+ * stop them
+ */
+static void nvic_dwt_sync(NVICState *s)
+{
+    int n;
+
+    for (n = 0; n < NVIC_DWT_NUM_COUNTERS; n++) {
+        nvic_dwt_set_counter(s, n, nvic_dwt_read_counter(s, n));
+    }
+}
+
 static uint32_t nvic_readl(NVICState *s, uint32_t offset, MemTxAttrs attrs)
 {
     ARMCPU *cpu = s->cpu;
@@ -1035,6 +1270,8 @@ static uint32_t nvic_readl(NVICState *s, uint32_t offset, MemTxAttrs attrs)
     }
     case 0xd84: /* CSSELR */
         return cpu->env.v7m.csselr[attrs.secure];
+    case 0xd88: /* CPACR */
+        return cpu->env.v7m.cpacr;
     /* TODO: Implement debug registers.  */
     case 0xd90: /* MPU_TYPE */
         /* Unified MPU; if the MPU is not present this value is zero */
@@ -1180,6 +1417,27 @@ static uint32_t nvic_readl(NVICState *s, uint32_t offset, MemTxAttrs attrs)
             return 0;
         }
         return cpu->env.v7m.sfar;
+    case 0xdfc: /* DEMCR */
+        return s->demcr;
+    case 0xf34: /* FPCCR */
+        if (!arm_feature(&cpu->env, ARM_FEATURE_VFP)) {
+            goto bad_offset;
+        }
+        return cpu->env.v7m.fpccr;
+    case 0xf38: /* FPCAR */
+        if (!arm_feature(&cpu->env, ARM_FEATURE_VFP)) {
+            goto bad_offset;
+        }
+        return cpu->env.v7m.fpcar;
+    case 0xf3c: /* FPDSCR */
+        if (!arm_feature(&cpu->env, ARM_FEATURE_VFP)) {
+            goto bad_offset;
+        }
+        return cpu->env.v7m.fpdscr;
+    case 0xf40: /* MVFR0 */
+        return cpu->mvfr0;
+    case 0xf44: /* MVFR1 */
+        return cpu->mvfr1;
     default:
     bad_offset:
         qemu_log_mask(LOG_GUEST_ERROR, "NVIC: Bad read offset 0x%x\n", offset);
@@ -1187,6 +1445,52 @@ static uint32_t nvic_readl(NVICState *s, uint32_t offset, MemTxAttrs attrs)
     }
 }
 
+/* Regions that span more pages than this get a full TLB flush instead */
+#define NVIC_MPU_FLUSH_MAX_PAGES 32
+
+/* Drop the TLB entries that MPU region @region of bank @secure may have
+ * produced as it is currently programmed. A region only affects the
+ * addresses it covers, so reprogramming one does not need a full flush
+ * unless it is large.
+ */
+static void nvic_mpu_flush_region(ARMCPU *cpu, int region, bool secure)
+{
+    CPUARMState *env = &cpu->env;
+    uint64_t base, limit, addr;
+
+    if (arm_feature(env, ARM_FEATURE_V8)) {
+        if (!(env->pmsav8.rlar[secure][region] & 1)) {
+            return;
+        }
+        base = env->pmsav8.rbar[secure][region] & ~0x1f;
+        limit = env->pmsav8.rlar[secure][region] | 0x1f;
+        if (limit < base) {
+            return;
+        }
+    } else {
+        int rsize = extract32(env->pmsav7.drsr[region], 1, 5);
+
+        /* Disabled and malformed regions never match */
+        if (!(env->pmsav7.drsr[region] & 1) || !rsize) {
+            return;
+        }
+        base = env->pmsav7.drbar[region];
+        limit = base + (2ull << rsize) - 1;
+        if (base & ((2ull << rsize) - 1)) {
+            return;
+        }
+    }
+
+    if (limit - base >= NVIC_MPU_FLUSH_MAX_PAGES * TARGET_PAGE_SIZE) {
+        tlb_flush(CPU(cpu));
+        return;
+    }
+    for (addr = base & TARGET_PAGE_MASK; addr <= limit;
+         addr += TARGET_PAGE_SIZE) {
+        tlb_flush_page(CPU(cpu), addr);
+    }
+}
+
 static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
                         MemTxAttrs attrs)
 {
@@ -1280,19 +1584,24 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
                     s->vectors[ARMV7M_EXCP_HARD].enabled = 0;
                 }
             }
+            nvic_track_all(s);
             nvic_irq_update(s);
         }
         break;
     case 0xd10: /* System Control.  */
         /* We don't implement deep-sleep so these bits are RAZ/WI.
-         * The other bits in the register are banked.
-         * QEMU's implementation ignores SEVONPEND and SLEEPONEXIT, which
-         * is architecturally permitted.
+         * The other bits in the register are banked.  SEVONPEND is
+         * honoured when an exception becomes pending, SLEEPONEXIT by
+         * do_v7m_exception_exit().
          */
         value &= ~(R_V7M_SCR_SLEEPDEEP_MASK | R_V7M_SCR_SLEEPDEEPS_MASK);
         cpu->env.v7m.scr[attrs.secure] = value;
         break;
     case 0xd14: /* Configuration Control.  */
+        if (!arm_feature(&cpu->env, ARM_FEATURE_V7)) {
+            /* v6M has a read-only CCR */
+            break;
+        }
         /* Enforce RAZ/WI on reserved and must-RAZ/WI bits */
         value &= (R_V7M_CCR_STKALIGN_MASK |
                   R_V7M_CCR_BFHFNMIGN_MASK |
@@ -1382,6 +1691,7 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
 
         /* TODO: this is RAZ/WI from NS if DEMCR.SDME is set */
         s->vectors[ARMV7M_EXCP_DEBUG].active = (value & (1 << 8)) != 0;
+        nvic_track_all(s);
         nvic_irq_update(s);
         break;
     case 0xd2c: /* Hard Fault Status.  */
@@ -1405,6 +1715,12 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
             cpu->env.v7m.csselr[attrs.secure] = value & R_V7M_CSSELR_INDEX_MASK;
         }
         break;
+    case 0xd88: /* CPACR */
+        /* Only CP10 and CP11, and only with an FPU; the two must match */
+        if (arm_feature(&cpu->env, ARM_FEATURE_VFP)) {
+            cpu->env.v7m.cpacr = value & (0xf << 20);
+        }
+        break;
     case 0xd90: /* MPU_TYPE */
         return; /* RO */
     case 0xd94: /* MPU_CTRL */
@@ -1414,6 +1730,12 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
             qemu_log_mask(LOG_GUEST_ERROR, "MPU_CTRL: HFNMIENA and !ENABLE is "
                           "UNPREDICTABLE\n");
         }
+        if (cpu->flat_ram_size &&
+            ((cpu->env.v7m.mpu_ctrl[attrs.secure] ^ value) &
+             R_V7M_MPU_CTRL_ENABLE_MASK)) {
+            /* Code translated for flat RAM does not look at the TLB */
+            tb_flush(CPU(cpu));
+        }
         cpu->env.v7m.mpu_ctrl[attrs.secure]
             = value & (R_V7M_MPU_CTRL_ENABLE_MASK |
                        R_V7M_MPU_CTRL_HFNMIENA_MASK |
@@ -1451,8 +1773,9 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
             if (region >= cpu->pmsav7_dregion) {
                 return;
             }
+            nvic_mpu_flush_region(cpu, region, attrs.secure);
             cpu->env.pmsav8.rbar[attrs.secure][region] = value;
-            tlb_flush(CPU(cpu));
+            nvic_mpu_flush_region(cpu, region, attrs.secure);
             return;
         }
 
@@ -1476,8 +1799,9 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
             return;
         }
 
+        nvic_mpu_flush_region(cpu, region, attrs.secure);
         cpu->env.pmsav7.drbar[region] = value & ~0x1f;
-        tlb_flush(CPU(cpu));
+        nvic_mpu_flush_region(cpu, region, attrs.secure);
         break;
     }
     case 0xda0: /* MPU_RASR (v7M), MPU_RLAR (v8M) */
@@ -1501,8 +1825,9 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
             if (region >= cpu->pmsav7_dregion) {
                 return;
             }
+            nvic_mpu_flush_region(cpu, region, attrs.secure);
             cpu->env.pmsav8.rlar[attrs.secure][region] = value;
-            tlb_flush(CPU(cpu));
+            nvic_mpu_flush_region(cpu, region, attrs.secure);
             return;
         }
 
@@ -1510,9 +1835,10 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
             return;
         }
 
+        nvic_mpu_flush_region(cpu, region, attrs.secure);
         cpu->env.pmsav7.drsr[region] = value & 0xff3f;
         cpu->env.pmsav7.dracr[region] = (value >> 16) & 0x173f;
-        tlb_flush(CPU(cpu));
+        nvic_mpu_flush_region(cpu, region, attrs.secure);
         break;
     }
     case 0xdc0: /* MPU_MAIR0 */
@@ -1620,6 +1946,11 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
         }
         cpu->env.v7m.sfsr = value;
         break;
+    case 0xdfc: /* DEMCR */
+        nvic_dwt_sync(s);
+        s->demcr = value & (nvic_dwt_has_counters(s) ? NVIC_DEMCR_V7M_MASK
+                                                     : NVIC_DEMCR_V6M_MASK);
+        break;
     case 0xf00: /* Software Triggered Interrupt Register */
     {
         int excnum = (value & 0x1ff) + NVIC_FIRST_IRQ;
@@ -1640,6 +1971,30 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
     case 0xf78: /* BPIALL */
         /* Cache and branch predictor maintenance: for QEMU these always NOP */
         break;
+    case 0xf34: /* FPCCR */
+        if (!arm_feature(&cpu->env, ARM_FEATURE_VFP)) {
+            goto bad_offset;
+        }
+        cpu->env.v7m.fpccr = value &
+            (R_V7M_FPCCR_ASPEN_MASK | R_V7M_FPCCR_LSPEN_MASK |
+             R_V7M_FPCCR_LSPACT_MASK | R_V7M_FPCCR_USER_MASK |
+             R_V7M_FPCCR_THREAD_MASK);
+        break;
+    case 0xf38: /* FPCAR */
+        if (!arm_feature(&cpu->env, ARM_FEATURE_VFP)) {
+            goto bad_offset;
+        }
+        cpu->env.v7m.fpcar = value & ~7;
+        break;
+    case 0xf3c: /* FPDSCR */
+        if (!arm_feature(&cpu->env, ARM_FEATURE_VFP)) {
+            goto bad_offset;
+        }
+        cpu->env.v7m.fpdscr = value & FPDSCR_MASK;
+        break;
+    case 0xf40: /* MVFR0 */
+    case 0xf44: /* MVFR1 */
+        return; /* RO */
     default:
     bad_offset:
         qemu_log_mask(LOG_GUEST_ERROR,
@@ -1837,7 +2192,11 @@ static MemTxResult nvic_sysreg_write(void *opaque, hwaddr addr,
         for (i = 0, end = size * 8; i < end && startvec + i < s->num_irq; i++) {
             if (value & (1 << i) &&
                 (attrs.secure || s->itns[startvec + i])) {
-                s->vectors[startvec + i].enabled = setval;
+                VecInfo *vec = &s->vectors[startvec + i];
+
+                nvic_vec_untrack(s, startvec + i, vec);
+                vec->enabled = setval;
+                nvic_vec_track(s, startvec + i, vec);
             }
         }
         nvic_irq_update(s);
@@ -1855,7 +2214,11 @@ static MemTxResult nvic_sysreg_write(void *opaque, hwaddr addr,
         for (i = 0, end = size * 8; i < end && startvec + i < s->num_irq; i++) {
             if (value & (1 << i) &&
                 (attrs.secure || s->itns[startvec + i])) {
-                s->vectors[startvec + i].pending = setval;
+                VecInfo *vec = &s->vectors[startvec + i];
+
+                nvic_vec_untrack(s, startvec + i, vec);
+                vec->pending = setval;
+                nvic_vec_track(s, startvec + i, vec);
             }
         }
         nvic_irq_update(s);
@@ -1902,6 +2265,8 @@ static MemTxResult nvic_sysreg_write(void *opaque, hwaddr addr,
     }
     if (size == 4) {
         nvic_writel(s, offset, value, attrs);
+        /* MPU_CTRL, CPACR, FPCCR, SHCSR and AIRCR feed the TB flags */
+        arm_rebuild_tb_flags(&s->cpu->env);
         return MEMTX_OK;
     }
     qemu_log_mask(LOG_GUEST_ERROR,
@@ -1991,6 +2356,83 @@ static const MemoryRegionOps nvic_systick_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+/* The DWT at 0xe0001000, with no comparators, trace or external trigger.
+ * CYCCNT and SLEEPCNT count as described at nvic_dwt_clock(); every
+ * instruction is modelled as a single cycle, so CPICNT never counts and
+ * neither do LSUCNT, EXCCNT and FOLDCNT, which read as zero.
+ */
+static MemTxResult nvic_dwt_read(void *opaque, hwaddr addr,
+                                 uint64_t *data, unsigned size,
+                                 MemTxAttrs attrs)
+{
+    NVICState *s = opaque;
+    uint32_t val = 0;
+
+    if (attrs.user) {
+        /* Generate BusFault for unprivileged accesses */
+        return MEMTX_ERROR;
+    }
+
+    if (nvic_dwt_has_counters(s)) {
+        switch (addr) {
+        case 0x0: /* DWT_CTRL */
+            val = s->dwt_ctrl | DWT_CTRL_NOTRCPKT | DWT_CTRL_NOEXTTRIG;
+            break;
+        case 0x4: /* DWT_CYCCNT */
+            val = nvic_dwt_read_counter(s, NVIC_DWT_CYCCNT);
+            break;
+        case 0x8: /* DWT_CPICNT */
+            val = s->dwt_cpicnt;
+            break;
+        case 0x10: /* DWT_SLEEPCNT */
+            val = nvic_dwt_read_counter(s, NVIC_DWT_SLEEPCNT);
+            break;
+        }
+    }
+
+    *data = val;
+    return MEMTX_OK;
+}
+
+static MemTxResult nvic_dwt_write(void *opaque, hwaddr addr,
+                                  uint64_t value, unsigned size,
+                                  MemTxAttrs attrs)
+{
+    NVICState *s = opaque;
+
+    if (attrs.user) {
+        /* Generate BusFault for unprivileged accesses */
+        return MEMTX_ERROR;
+    }
+
+    if (nvic_dwt_has_counters(s)) {
+        switch (addr) {
+        case 0x0: /* DWT_CTRL */
+            nvic_dwt_sync(s);
+            s->dwt_ctrl = value & DWT_CTRL_MASK;
+            break;
+        case 0x4: /* DWT_CYCCNT */
+            nvic_dwt_set_counter(s, NVIC_DWT_CYCCNT, value);
+            break;
+        case 0x8: /* DWT_CPICNT */
+            s->dwt_cpicnt = value & 0xff;
+            break;
+        case 0x10: /* DWT_SLEEPCNT */
+            nvic_dwt_set_counter(s, NVIC_DWT_SLEEPCNT, value & 0xff);
+            break;
+        }
+    }
+    return MEMTX_OK;
+}
+
+static const MemoryRegionOps nvic_dwt_ops = {
+    .read_with_attrs = nvic_dwt_read,
+    .write_with_attrs = nvic_dwt_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+};
+
 static int nvic_post_load(void *opaque, int version_id)
 {
     NVICState *s = opaque;
@@ -2011,7 +2453,10 @@ static int nvic_post_load(void *opaque, int version_id)
         }
     }
 
+    nvic_track_all(s);
     nvic_recompute_state(s);
+    nvic_latency_clear_timing(s);
+    arm_rebuild_tb_flags(&s->cpu->env);
 
     return 0;
 }
@@ -2074,6 +2519,34 @@ static const VMStateDescription vmstate_nvic_security = {
     }
 };
 
+static bool nvic_dwt_needed(void *opaque)
+{
+    NVICState *s = opaque;
+    int n;
+
+    for (n = 0; n < NVIC_DWT_NUM_COUNTERS; n++) {
+        if (s->dwt_count[n]) {
+            return true;
+        }
+    }
+    return s->demcr || s->dwt_ctrl || s->dwt_cpicnt;
+}
+
+static const VMStateDescription vmstate_nvic_dwt = {
+    .name = "nvic/dwt",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvic_dwt_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(demcr, NVICState),
+        VMSTATE_UINT32(dwt_ctrl, NVICState),
+        VMSTATE_UINT32(dwt_cpicnt, NVICState),
+        VMSTATE_UINT32_ARRAY(dwt_count, NVICState, NVIC_DWT_NUM_COUNTERS),
+        VMSTATE_INT64_ARRAY(dwt_base, NVICState, NVIC_DWT_NUM_COUNTERS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_nvic = {
     .name = "armv7m_nvic",
     .version_id = 4,
@@ -2087,6 +2560,7 @@ static const VMStateDescription vmstate_nvic = {
     },
     .subsections = (const VMStateDescription*[]) {
         &vmstate_nvic_security,
+        &vmstate_nvic_dwt,
         NULL
     }
 };
@@ -2141,11 +2615,20 @@ static void armv7m_nvic_reset(DeviceState *dev)
      * So we leave it disabled to catch logic errors.
      */
 
+    nvic_track_all(s);
     s->exception_prio = NVIC_NOEXC_PRIO;
     s->vectpending = 0;
     s->vectpending_is_s_banked = false;
     s->vectpending_prio = NVIC_NOEXC_PRIO;
 
+    nvic_latency_clear_timing(s);
+
+    s->demcr = 0;
+    s->dwt_ctrl = 0;
+    s->dwt_cpicnt = 0;
+    memset(s->dwt_count, 0, sizeof(s->dwt_count));
+    memset(s->dwt_base, 0, sizeof(s->dwt_base));
+
     if (arm_feature(&s->cpu->env, ARM_FEATURE_M_SECURITY)) {
         memset(s->itns, 0, sizeof(s->itns));
     } else {
@@ -2159,6 +2642,9 @@ static void armv7m_nvic_reset(DeviceState *dev)
             s->itns[i] = true;
         }
     }
+
+    /* No exception is active any more, which may change the MMU index */
+    arm_rebuild_tb_flags(&s->cpu->env);
 }
 
 static void nvic_systick_trigger(void *opaque, int n, int level)
@@ -2181,6 +2667,7 @@ static void armv7m_nvic_realize(DeviceState *dev, Error **errp)
     NVICState *s = NVIC(dev);
     Error *err = NULL;
     int regionlen;
+    int i;
 
     s->cpu = ARM_CPU(qemu_get_cpu(0));
     assert(s->cpu);
@@ -2191,9 +2678,13 @@ static void armv7m_nvic_realize(DeviceState *dev, Error **errp)
     }
 
     qdev_init_gpio_in(dev, set_irq_level, s->num_irq);
+    for (i = 0; i < s->num_irq; i++) {
+        qemu_irq_set_edge_handler(qdev_get_gpio_in(dev, i), set_irq_edge);
+    }
 
     /* include space for internal exception vectors */
     s->num_irq += NVIC_FIRST_IRQ;
+    s->latency = g_new0(NVICLatency, s->num_irq);
 
     object_property_set_bool(OBJECT(&s->systick[M_REG_NS]), true,
                              "realized", &err);
@@ -2278,6 +2769,10 @@ static void armv7m_nvic_realize(DeviceState *dev, Error **errp)
     }
 
     sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->container);
+
+    memory_region_init_io(&s->dwtmem, OBJECT(s), &nvic_dwt_ops, s,
+                          "nvic_dwt", 0x1000);
+    sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->dwtmem);
 }
 
 static void armv7m_nvic_instance_init(Object *obj)
@@ -2305,6 +2800,73 @@ static void armv7m_nvic_instance_init(Object *obj)
                             M_REG_NUM_BANKS);
 }
 
+typedef struct NVICLatencyQuery {
+    NvicLatencyList **tail;
+    bool reset;
+} NVICLatencyQuery;
+
+static uint64List *nvic_latency_buckets(const uint64_t *buckets)
+{
+    uint64List *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < NVIC_LATENCY_BUCKETS; i++) {
+        *tail = g_new0(uint64List, 1);
+        (*tail)->value = buckets[i];
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+static int nvic_latency_query(Object *obj, void *opaque)
+{
+    NVICLatencyQuery *q = opaque;
+    NVICState *s = (NVICState *)object_dynamic_cast(obj, TYPE_NVIC);
+    int i;
+
+    if (!s || !s->latency) {
+        return 0;
+    }
+    for (i = 0; i < s->num_irq; i++) {
+        NVICLatency *l = &s->latency[i];
+        NvicLatency *info;
+
+        if (!l->count) {
+            continue;
+        }
+        info = g_new0(NvicLatency, 1);
+        info->cpu = CPU(s->cpu)->cpu_index;
+        info->exception = i;
+        info->count = l->count;
+        info->q_virtual = nvic_latency_buckets(l->virt);
+        info->host = nvic_latency_buckets(l->host);
+        *q->tail = g_new0(NvicLatencyList, 1);
+        (*q->tail)->value = info;
+        q->tail = &(*q->tail)->next;
+
+        if (q->reset) {
+            l->count = 0;
+            memset(l->virt, 0, sizeof(l->virt));
+            memset(l->host, 0, sizeof(l->host));
+        }
+    }
+    return 0;
+}
+
+NvicLatencyList *qmp_query_nvic_latency(bool has_reset, bool reset,
+                                        Error **errp)
+{
+    NvicLatencyList *head = NULL;
+    NVICLatencyQuery q = {
+        .tail = &head,
+        .reset = has_reset && reset,
+    };
+
+    object_child_foreach_recursive(qdev_get_machine(), nvic_latency_query,
+                                   &q);
+    return head;
+}
+
 static void armv7m_nvic_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
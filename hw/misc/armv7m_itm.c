@@ -0,0 +1,289 @@
+/*
+ * ARMv7M Instrumentation Trace Macrocell
+ *
+ * Writes to the stimulus ports become ITM source packets, as they would
+ * come out of SWO in UART mode, on the "chardev" property; any SWO
+ * decoder can read the stream.  Packets are buffered and handed to the
+ * chardev from a bottom half, so a guest printf costs a store per word
+ * rather than a chardev write per byte.  When the buffer is full, the
+ * stimulus ports read as not ready and packets written anyway are
+ * dropped and reported with an overflow packet, as on hardware.
+ *
+ * There are no timestamp, synchronisation or hardware source packets,
+ * and the lock access registers are not implemented.  DEMCR.TRCENA is
+ * not checked: ITMENA and the port enables are enough to trace.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/misc/armv7m_itm.h"
+#include "qemu-common.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "migration/vmstate.h"
+
+#define ITM_TCR_ITMENA  (1U << 0)
+#define ITM_TCR_BUSY    (1U << 23)
+#define ITM_TCR_MASK    0x007f0f1f
+
+#define ITM_PKT_OVERFLOW 0x70
+
+/* PID4..PID7, PID0..PID3, CID0..CID3 */
+static const uint8_t itm_id[] = {
+    0x04, 0x00, 0x00, 0x00, 0x01, 0xb0, 0x3b, 0x00,
+    0x0d, 0xe0, 0x05, 0xb1
+};
+
+static gboolean itm_watch_cb(GIOChannel *chan, GIOCondition cond, void *opaque);
+
+static void itm_flush(void *opaque)
+{
+    ARMv7MITMState *s = opaque;
+    int ret;
+
+    if (s->watch || !s->len) {
+        return;
+    }
+    ret = qemu_chr_fe_write(&s->chr, s->buf, s->len);
+    if (ret > 0) {
+        s->len -= ret;
+        memmove(s->buf, s->buf + ret, s->len);
+    }
+    if (s->len) {
+        s->watch = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
+                                         itm_watch_cb, s);
+        if (!s->watch) {
+            /* The chardev cannot take data, nor tell us when it can */
+            s->len = 0;
+        }
+    }
+}
+
+static gboolean itm_watch_cb(GIOChannel *chan, GIOCondition cond, void *opaque)
+{
+    ARMv7MITMState *s = opaque;
+
+    s->watch = 0;
+    itm_flush(s);
+    return FALSE;
+}
+
+static bool itm_ready(ARMv7MITMState *s)
+{
+    return s->len + 1 + 4 + 1 <= sizeof(s->buf);
+}
+
+/* Queue a source packet of @size bytes for stimulus port @port */
+static void itm_emit(ARMv7MITMState *s, unsigned port, uint32_t value,
+                     unsigned size)
+{
+    unsigned i;
+
+    if (!qemu_chr_fe_backend_connected(&s->chr)) {
+        return;
+    }
+    if (!itm_ready(s)) {
+        s->overflow = true;
+        return;
+    }
+    if (s->overflow) {
+        s->buf[s->len++] = ITM_PKT_OVERFLOW;
+        s->overflow = false;
+    }
+    /* The size field encodes 1, 2 and 4 bytes as 1, 2 and 3 */
+    s->buf[s->len++] = port << 3 | (size == 4 ? 3 : size);
+    for (i = 0; i < size; i++) {
+        s->buf[s->len++] = value >> (i * 8);
+    }
+    qemu_bh_schedule(s->bh);
+}
+
+static MemTxResult itm_read(void *opaque, hwaddr addr, uint64_t *data,
+                            unsigned size, MemTxAttrs attrs)
+{
+    ARMv7MITMState *s = opaque;
+    uint32_t val = 0;
+
+    switch (addr) {
+    case 0x0 ... 0x7f: /* STIM<n>: FIFOREADY */
+        val = (s->tcr & ITM_TCR_ITMENA) && itm_ready(s);
+        break;
+    default:
+        if (attrs.user) {
+            /* Generate BusFault for unprivileged accesses */
+            return MEMTX_ERROR;
+        }
+        switch (addr) {
+        case 0xe00: /* TER */
+            val = s->ter;
+            break;
+        case 0xe40: /* TPR */
+            val = s->tpr;
+            break;
+        case 0xe80: /* TCR */
+            val = s->tcr | (s->len ? ITM_TCR_BUSY : 0);
+            break;
+        case 0xfd0 ... 0xffc: /* ID */
+            val = itm_id[(addr - 0xfd0) >> 2];
+            break;
+        }
+    }
+
+    *data = val;
+    return MEMTX_OK;
+}
+
+static MemTxResult itm_write(void *opaque, hwaddr addr, uint64_t value,
+                             unsigned size, MemTxAttrs attrs)
+{
+    ARMv7MITMState *s = opaque;
+    unsigned port;
+
+    switch (addr) {
+    case 0x0 ... 0x7f: /* STIM<n> */
+        port = addr >> 2;
+        if (!(s->tcr & ITM_TCR_ITMENA) || !(s->ter & (1U << port))) {
+            break;
+        }
+        /* Each TPR bit makes eight ports privileged only */
+        if (attrs.user && (s->tpr & (1U << (port / 8)))) {
+            break;
+        }
+        itm_emit(s, port, value, size);
+        break;
+    default:
+        if (attrs.user) {
+            /* Generate BusFault for unprivileged accesses */
+            return MEMTX_ERROR;
+        }
+        if (size != 4) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "ITM: Bad write of size %d at offset 0x%x\n",
+                          size, (int)addr);
+            break;
+        }
+        switch (addr) {
+        case 0xe00: /* TER */
+            s->ter = value;
+            break;
+        case 0xe40: /* TPR */
+            s->tpr = value & 0xf;
+            break;
+        case 0xe80: /* TCR */
+            s->tcr = value & ITM_TCR_MASK;
+            break;
+        case 0xfb0: /* LAR: there is no lock to open */
+            break;
+        default:
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "ITM: Bad write offset 0x%x\n", (int)addr);
+        }
+    }
+    return MEMTX_OK;
+}
+
+static const MemoryRegionOps itm_ops = {
+    .read_with_attrs = itm_read,
+    .write_with_attrs = itm_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 4,
+};
+
+static void itm_reset(DeviceState *dev)
+{
+    ARMv7MITMState *s = ARMV7M_ITM(dev);
+
+    /* Trace already queued still goes out */
+    s->ter = 0;
+    s->tpr = 0;
+    s->tcr = 0;
+}
+
+static void itm_init(Object *obj)
+{
+    ARMv7MITMState *s = ARMV7M_ITM(obj);
+
+    memory_region_init_io(&s->iomem, obj, &itm_ops, s, "armv7m_itm", 0x1000);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->iomem);
+}
+
+static void itm_realize(DeviceState *dev, Error **errp)
+{
+    ARMv7MITMState *s = ARMV7M_ITM(dev);
+
+    s->bh = qemu_bh_new(itm_flush, s);
+}
+
+static void itm_unrealize(DeviceState *dev, Error **errp)
+{
+    ARMv7MITMState *s = ARMV7M_ITM(dev);
+
+    if (s->watch) {
+        g_source_remove(s->watch);
+        s->watch = 0;
+    }
+    qemu_bh_delete(s->bh);
+}
+
+static int itm_post_load(void *opaque, int version_id)
+{
+    ARMv7MITMState *s = opaque;
+
+    if (s->len > sizeof(s->buf)) {
+        return -EINVAL;
+    }
+    if (s->len) {
+        qemu_bh_schedule(s->bh);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_itm = {
+    .name = "armv7m_itm",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = itm_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ter, ARMv7MITMState),
+        VMSTATE_UINT32(tpr, ARMv7MITMState),
+        VMSTATE_UINT32(tcr, ARMv7MITMState),
+        VMSTATE_BOOL(overflow, ARMv7MITMState),
+        VMSTATE_UINT32(len, ARMv7MITMState),
+        VMSTATE_UINT8_ARRAY(buf, ARMv7MITMState, ARMV7M_ITM_BUF_SIZE),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property itm_properties[] = {
+    DEFINE_PROP_CHR("chardev", ARMv7MITMState, chr),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void itm_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = itm_realize;
+    dc->unrealize = itm_unrealize;
+    dc->reset = itm_reset;
+    dc->vmsd = &vmstate_itm;
+    dc->props = itm_properties;
+}
+
+static const TypeInfo itm_info = {
+    .name = TYPE_ARMV7M_ITM,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(ARMv7MITMState),
+    .instance_init = itm_init,
+    .class_init = itm_class_init,
+};
+
+static void itm_register_types(void)
+{
+    type_register_static(&itm_info);
+}
+
+type_init(itm_register_types)
@@ -0,0 +1,185 @@
+/*
+ * Per-register MMIO access counters
+ *
+ * Regions set up with mmio_stats_init_io() are dispatched through a copy
+ * of their MemoryRegionOps whose read and write callbacks bump a counter
+ * before handing the access on.  Each vCPU owns its own counter array,
+ * allocated on first access, so the fast path is a lock-free load and
+ * store.  The monitor reads, and optionally clears, all the counters.
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "qom/cpu.h"
+#include "sysemu/sysemu.h"
+#include "hw/misc/mmio-stats.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc.h"
+
+/* Regions needing more buckets than this count larger blocks per bucket */
+#define MMIO_STATS_MAX_BUCKETS 1024
+
+typedef struct MMIOStats {
+    /* The region's ops, with our counting read and write */
+    MemoryRegionOps ops;
+    const MemoryRegionOps *inner;
+    void *opaque;
+    MemoryRegion *mr;
+    unsigned shift;
+    uint64_t buckets;
+    unsigned nr_cpus;
+    /* Per vCPU (reads, writes) pairs, one per bucket */
+    uint64_t **counts;
+    QTAILQ_ENTRY(MMIOStats) next;
+} MMIOStats;
+
+static QTAILQ_HEAD(, MMIOStats) mmio_stats_regions =
+    QTAILQ_HEAD_INITIALIZER(mmio_stats_regions);
+
+static void mmio_stats_count(MMIOStats *s, hwaddr offset, bool is_write)
+{
+    /* Accesses from outside a vCPU (DMA, gdbstub) are charged to vCPU 0 */
+    unsigned cpu = current_cpu ? current_cpu->cpu_index : 0;
+    uint64_t *counts, *c;
+
+    if (cpu >= s->nr_cpus) {
+        return;
+    }
+    counts = atomic_rcu_read(&s->counts[cpu]);
+    if (!counts) {
+        counts = g_new0(uint64_t, s->buckets * 2);
+        atomic_rcu_set(&s->counts[cpu], counts);
+    }
+    c = &counts[(offset >> s->shift) * 2 + is_write];
+    atomic_set__nocheck(c, atomic_read__nocheck(c) + 1);
+}
+
+static uint64_t mmio_stats_read(void *opaque, hwaddr offset, unsigned size)
+{
+    MMIOStats *s = opaque;
+
+    mmio_stats_count(s, offset, false);
+    return s->inner->read(s->opaque, offset, size);
+}
+
+static void mmio_stats_write(void *opaque, hwaddr offset, uint64_t value,
+                             unsigned size)
+{
+    MMIOStats *s = opaque;
+
+    mmio_stats_count(s, offset, true);
+    s->inner->write(s->opaque, offset, value, size);
+}
+
+static void mmio_stats_access_burst(void *opaque, hwaddr offset,
+                                    uint32_t *data, unsigned count,
+                                    bool is_write)
+{
+    MMIOStats *s = opaque;
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        mmio_stats_count(s, offset + i * 4, is_write);
+    }
+    s->inner->access_burst(s->opaque, offset, data, count, is_write);
+}
+
+static void mmio_stats_destructor(MemoryRegion *mr)
+{
+    MMIOStats *s = mr->opaque;
+    unsigned cpu;
+
+    QTAILQ_REMOVE(&mmio_stats_regions, s, next);
+    for (cpu = 0; cpu < s->nr_cpus; cpu++) {
+        g_free(s->counts[cpu]);
+    }
+    g_free(s->counts);
+    g_free(s);
+}
+
+void mmio_stats_init_io(MemoryRegion *mr, Object *owner,
+                        const MemoryRegionOps *ops, void *opaque,
+                        const char *name, uint64_t size)
+{
+    MMIOStats *s = g_new0(MMIOStats, 1);
+
+    assert(ops->read && ops->write && !ops->valid.accepts);
+
+    memcpy(&s->ops, ops, sizeof(s->ops));
+    s->ops.read = mmio_stats_read;
+    s->ops.write = mmio_stats_write;
+    if (ops->access_burst) {
+        s->ops.access_burst = mmio_stats_access_burst;
+    }
+    s->inner = ops;
+    s->opaque = opaque;
+    s->mr = mr;
+    s->shift = 2;
+    while (((MAX(size, 1) - 1) >> s->shift) >= MMIO_STATS_MAX_BUCKETS) {
+        s->shift++;
+    }
+    s->buckets = ((MAX(size, 1) - 1) >> s->shift) + 1;
+    s->nr_cpus = MAX(max_cpus, 1);
+    s->counts = g_new0(uint64_t *, s->nr_cpus);
+    QTAILQ_INSERT_TAIL(&mmio_stats_regions, s, next);
+
+    memory_region_init_io(mr, owner, &s->ops, s, name, size);
+    mr->destructor = mmio_stats_destructor;
+}
+
+/* Address of the region in the address space at the root of its tree */
+static hwaddr mmio_stats_region_base(MemoryRegion *mr)
+{
+    hwaddr base = 0;
+
+    for (; mr; mr = mr->container) {
+        base += mr->addr;
+    }
+    return base;
+}
+
+MmioStatsEntryList *qmp_query_mmio_stats(bool has_reset, bool reset,
+                                         Error **errp)
+{
+    MmioStatsEntryList *head = NULL, **tail = &head;
+    MMIOStats *s;
+
+    QTAILQ_FOREACH(s, &mmio_stats_regions, next) {
+        hwaddr base = mmio_stats_region_base(s->mr);
+        unsigned cpu;
+        uint64_t i;
+
+        for (cpu = 0; cpu < s->nr_cpus; cpu++) {
+            uint64_t *counts = atomic_rcu_read(&s->counts[cpu]);
+
+            for (i = 0; counts && i < s->buckets; i++) {
+                uint64_t reads = atomic_read__nocheck(&counts[i * 2]);
+                uint64_t writes = atomic_read__nocheck(&counts[i * 2 + 1]);
+                MmioStatsEntryList *entry;
+
+                if (!reads && !writes) {
+                    continue;
+                }
+                if (has_reset && reset) {
+                    atomic_set__nocheck(&counts[i * 2], 0);
+                    atomic_set__nocheck(&counts[i * 2 + 1], 0);
+                }
+
+                entry = g_new0(MmioStatsEntryList, 1);
+                entry->value = g_new0(MmioStatsEntry, 1);
+                entry->value->region = g_strdup(memory_region_name(s->mr));
+                entry->value->offset = i << s->shift;
+                entry->value->address = base + (i << s->shift);
+                entry->value->cpu = cpu;
+                entry->value->reads = reads;
+                entry->value->writes = writes;
+                *tail = entry;
+                tail = &entry->next;
+            }
+        }
+    }
+    return head;
+}
@@ -15,6 +15,7 @@
 #include "hw/hw.h"
 #include "hw/sysbus.h"
 #include "hw/misc/unimp.h"
+#include "hw/misc/mmio-stats.h"
 #include "qemu/log.h"
 #include "qapi/error.h"
 
@@ -22,9 +23,10 @@ static uint64_t unimp_read(void *opaque, hwaddr offset, unsigned size)
 {
     UnimplementedDeviceState *s = UNIMPLEMENTED_DEVICE(opaque);
 
-    qemu_log_mask(LOG_UNIMP, "%s: unimplemented device read "
-                  "(size %d, offset 0x%" HWADDR_PRIx ")\n",
-                  s->name, size, offset);
+    qemu_log_mask_ratelimited(LOG_UNIMP, offset,
+                              "%s: unimplemented device read "
+                              "(size %d, offset 0x%" HWADDR_PRIx ")\n",
+                              s->name, size, offset);
     return 0;
 }
 
@@ -33,10 +35,11 @@ static void unimp_write(void *opaque, hwaddr offset,
 {
     UnimplementedDeviceState *s = UNIMPLEMENTED_DEVICE(opaque);
 
-    qemu_log_mask(LOG_UNIMP, "%s: unimplemented device write "
-                  "(size %d, value 0x%" PRIx64
-                  ", offset 0x%" HWADDR_PRIx ")\n",
-                  s->name, size, value, offset);
+    qemu_log_mask_ratelimited(LOG_UNIMP, offset,
+                              "%s: unimplemented device write "
+                              "(size %d, value 0x%" PRIx64
+                              ", offset 0x%" HWADDR_PRIx ")\n",
+                              s->name, size, value, offset);
 }
 
 static const MemoryRegionOps unimp_ops = {
@@ -63,8 +66,8 @@ static void unimp_realize(DeviceState *dev, Error **errp)
         return;
     }
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &unimp_ops, s,
-                          s->name, s->size);
+    mmio_stats_init_io(&s->iomem, OBJECT(s), &unimp_ops, s,
+                       s->name, s->size);
     sysbus_init_mmio(SYS_BUS_DEVICE(s), &s->iomem);
 }
 
@@ -37,7 +37,41 @@ static inline int64_t systick_scale(SysTickState *s)
     }
 }
 
-static void systick_reload(SysTickState *s, int reset)
+/* While the counter is enabled, s->tick is the time at which it next
+ * reaches zero. It is only brought up to date when the guest looks at
+ * the counter or changes how it counts, so the timer only needs to run
+ * when reaching zero raises an interrupt.
+ */
+static void systick_rearm(SysTickState *s)
+{
+    if ((s->control & (SYSTICK_ENABLE | SYSTICK_TICKINT)) ==
+        (SYSTICK_ENABLE | SYSTICK_TICKINT)) {
+        timer_mod(s->timer, s->tick);
+    } else {
+        timer_del(s->timer);
+    }
+}
+
+/* Account for the times the counter has reached zero up to @now */
+static void systick_sync(SysTickState *s, int64_t now)
+{
+    int64_t period;
+
+    if ((s->control & SYSTICK_ENABLE) == 0 || now < s->tick) {
+        return;
+    }
+
+    s->control |= SYSTICK_COUNTFLAG;
+    if (s->reload == 0) {
+        s->control &= ~SYSTICK_ENABLE;
+        s->tick = 0;
+        return;
+    }
+    period = (s->reload + 1) * systick_scale(s);
+    s->tick += ((now - s->tick) / period + 1) * period;
+}
+
+static void systick_reload(SysTickState *s)
 {
     /* The Cortex-M3 Devices Generic User Guide says that "When the
      * ENABLE bit is set to 1, the counter loads the RELOAD value from the
@@ -50,11 +84,9 @@ static void systick_reload(SysTickState *s, int reset)
         return;
     }
 
-    if (reset) {
-        s->tick = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-    }
-    s->tick += (s->reload + 1) * systick_scale(s);
-    timer_mod(s->timer, s->tick);
+    s->tick = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+              (s->reload + 1) * systick_scale(s);
+    systick_rearm(s);
 }
 
 static void systick_timer_tick(void *opaque)
@@ -63,23 +95,22 @@ static void systick_timer_tick(void *opaque)
 
     trace_systick_timer_tick();
 
-    s->control |= SYSTICK_COUNTFLAG;
     if (s->control & SYSTICK_TICKINT) {
         /* Tell the NVIC to pend the SysTick exception */
         qemu_irq_pulse(s->irq);
     }
-    if (s->reload == 0) {
-        s->control &= ~SYSTICK_ENABLE;
-    } else {
-        systick_reload(s, 0);
-    }
+    systick_sync(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    systick_rearm(s);
 }
 
 static uint64_t systick_read(void *opaque, hwaddr addr, unsigned size)
 {
     SysTickState *s = opaque;
+    int64_t t = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
     uint32_t val;
 
+    systick_sync(s, t);
+
     switch (addr) {
     case 0x0: /* SysTick Control and Status.  */
         val = s->control;
@@ -89,18 +120,10 @@ static uint64_t systick_read(void *opaque, hwaddr addr, unsigned size)
         val = s->reload;
         break;
     case 0x8: /* SysTick Current Value.  */
-    {
-        int64_t t;
-
         if ((s->control & SYSTICK_ENABLE) == 0) {
             val = 0;
             break;
         }
-        t = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-        if (t >= s->tick) {
-            val = 0;
-            break;
-        }
         val = ((s->tick - (t + 1)) / systick_scale(s)) + 1;
         /* The interrupt in triggered when the timer reaches zero.
            However the counter is not reloaded until the next clock
@@ -109,7 +132,6 @@ static uint64_t systick_read(void *opaque, hwaddr addr, unsigned size)
             val = 0;
         }
         break;
-    }
     case 0xc: /* SysTick Calibration Value.  */
         val = 10000;
         break;
@@ -128,9 +150,13 @@ static void systick_write(void *opaque, hwaddr addr,
                           uint64_t value, unsigned size)
 {
     SysTickState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
 
     trace_systick_write(addr, value, size);
 
+    /* Count down with the old settings up to now */
+    systick_sync(s, now);
+
     switch (addr) {
     case 0x0: /* SysTick Control and Status.  */
     {
@@ -139,16 +165,13 @@ static void systick_write(void *opaque, hwaddr addr,
         s->control &= 0xfffffff8;
         s->control |= value & 7;
         if ((oldval ^ value) & SYSTICK_ENABLE) {
-            int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
             if (value & SYSTICK_ENABLE) {
                 if (s->tick) {
                     s->tick += now;
-                    timer_mod(s->timer, s->tick);
                 } else {
-                    systick_reload(s, 1);
+                    systick_reload(s);
                 }
             } else {
-                timer_del(s->timer);
                 s->tick -= now;
                 if (s->tick < 0) {
                     s->tick = 0;
@@ -157,15 +180,16 @@ static void systick_write(void *opaque, hwaddr addr,
         } else if ((oldval ^ value) & SYSTICK_CLKSOURCE) {
             /* This is a hack. Force the timer to be reloaded
                when the reference clock is changed.  */
-            systick_reload(s, 1);
+            systick_reload(s);
         }
+        systick_rearm(s);
         break;
     }
     case 0x4: /* SysTick Reload Value.  */
         s->reload = value;
         break;
     case 0x8: /* SysTick Current Value.  Writes reload the timer.  */
-        systick_reload(s, 1);
+        systick_reload(s);
         s->control &= ~SYSTICK_COUNTFLAG;
         break;
     default:
@@ -203,10 +227,20 @@ static void systick_instance_init(Object *obj)
     s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, systick_timer_tick, s);
 }
 
+static int systick_pre_save(void *opaque)
+{
+    SysTickState *s = opaque;
+
+    /* Save the next time the counter reaches zero, not a past one */
+    systick_sync(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    return 0;
+}
+
 static const VMStateDescription vmstate_systick = {
     .name = "armv7m_systick",
     .version_id = 1,
     .minimum_version_id = 1,
+    .pre_save = systick_pre_save,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32(control, SysTickState),
         VMSTATE_UINT32(reload, SysTickState),
@@ -203,7 +203,8 @@ static void cmsdk_apb_timer_realize(DeviceState *dev, Error **errp)
                            PTIMER_POLICY_WRAP_AFTER_ONE_PERIOD |
                            PTIMER_POLICY_NO_IMMEDIATE_TRIGGER |
                            PTIMER_POLICY_NO_IMMEDIATE_RELOAD |
-                           PTIMER_POLICY_NO_COUNTER_ROUND_DOWN);
+                           PTIMER_POLICY_NO_COUNTER_ROUND_DOWN |
+                           PTIMER_POLICY_SYNC_TRIGGER);
 
     ptimer_set_freq(s->timer, s->pclk_frq);
 }
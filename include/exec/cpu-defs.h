@@ -32,6 +32,7 @@
 #include "exec/hwaddr.h"
 #endif
 #include "exec/memattrs.h"
+#include "qemu/thread.h"
 
 #ifndef TARGET_LONG_BITS
 #error TARGET_LONG_BITS must be defined before including this header
@@ -66,6 +67,15 @@ typedef uint64_t target_ulong;
 #define CPU_TLB_ENTRY_BITS 5
 #endif
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* With a dynamic TLB the backend loads the table and index mask of the
+ * MMU mode from env, so there is no displacement limit.  Each table
+ * starts at the CPU class's tlb_bits (CPU_TLB_DYN_DEFAULT_BITS if 0) and
+ * doubles at a flush that finds it mostly filled, up to the maximum.
+ */
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+#define CPU_TLB_DYN_MAX_BITS 12
+#else
 /* TCG_TARGET_TLB_DISPLACEMENT_BITS is used in CPU_TLB_BITS to ensure that
  * the TLB is not unnecessarily small, but still small enough for the
  * TLB lookup instruction sequence used by the TCG target.
@@ -97,6 +107,7 @@ typedef uint64_t target_ulong;
          NB_MMU_MODES <= 8 ? 3 : 4))
 
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+#endif
 
 typedef struct CPUTLBEntry {
     /* bit TARGET_LONG_BITS to TARGET_PAGE_BITS : virtual address
@@ -129,13 +140,43 @@ QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) != (1 << CPU_TLB_ENTRY_BITS));
 typedef struct CPUIOTLBEntry {
     hwaddr addr;
     MemTxAttrs attrs;
+    /* For a RAM page that takes the I/O path only because it has
+     * watchpoints: the accesses (PAGE_READ, PAGE_WRITE) that may use
+     * host memory directly when they miss every watched byte, and for
+     * writes the ram_addr of the page
+     */
+    int watch;
+    uint64_t watch_ram;
 } CPUIOTLBEntry;
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+typedef struct CPUTLBDesc {
+    /* Entries filled since the table was last flushed */
+    size_t n_used_entries;
+} CPUTLBDesc;
+
+/* tlb_lock is held by the owning vCPU while it swaps a table for a
+ * bigger one, and by other threads while they walk the tables (see
+ * tlb_reset_dirty), so that they never see a freed table or a mask
+ * that does not match it.
+ */
+#define CPU_COMMON_TLB_TABLES \
+    QemuSpin tlb_lock;                                                  \
+    CPUTLBDesc tlb_desc[NB_MMU_MODES];                                  \
+    /* (n_entries - 1) << CPU_TLB_ENTRY_BITS, for the TCG fast path */  \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];
+#else
+#define CPU_COMMON_TLB_TABLES \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];
+#endif
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPU_COMMON_TLB_TABLES                                               \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
-    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
     CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
     size_t tlb_flush_count;                                             \
     target_ulong tlb_flush_addr;                                        \
@@ -38,6 +38,9 @@ typedef ram_addr_t tb_page_addr_t;
 #define TB_PAGE_ADDR_FMT RAM_ADDR_FMT
 #endif
 
+/* An MMIO access translated code makes itself, see mmio_direct_lookup() */
+typedef struct MMIODirect MMIODirect;
+
 #include "qemu/log.h"
 
 void gen_intermediate_code(CPUState *cpu, struct TranslationBlock *tb);
@@ -61,6 +64,17 @@ void cpu_gen_init(void);
  */
 bool cpu_restore_state(CPUState *cpu, uintptr_t searched_pc, bool will_exit);
 
+/**
+ * cpu_unwind_pc:
+ * @host_pc: a host PC within translated code, such as cpu->mem_io_pc
+ * @pc: set to the guest PC of the instruction at @host_pc
+ * @return: true if @pc was set, false otherwise
+ *
+ * Find the guest instruction executing at @host_pc, like
+ * cpu_restore_state() but without changing any vCPU state.
+ */
+bool cpu_unwind_pc(uintptr_t host_pc, target_ulong *pc);
+
 void QEMU_NORETURN cpu_loop_exit_noexc(CPUState *cpu);
 void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUState *cpu,
@@ -99,6 +113,18 @@ void cpu_address_space_init(CPUState *cpu, int asidx,
 
 #if !defined(CONFIG_USER_ONLY) && defined(CONFIG_TCG)
 /* cputlb.c */
+/**
+ * tlb_init:
+ * @cpu: CPU whose TLB should be initialized
+ *
+ * Allocate the TLB tables of @cpu, at the size its CPUClass asks for.
+ */
+void tlb_init(CPUState *cpu);
+/**
+ * tlb_destroy:
+ * @cpu: CPU whose TLB should be freed
+ */
+void tlb_destroy(CPUState *cpu);
 /**
  * tlb_flush_page:
  * @cpu: CPU whose TLB should be flushed
@@ -256,9 +282,59 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
 void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr);
+/**
+ * tb_share_code:
+ * @start: the RAM to run the TBs of another copy of the code from
+ * @canonical: the RAM the TBs are translated and looked up for
+ * @size: the length of both, a multiple of the target page size
+ *
+ * Let the CPUs that run code from [@start, @start + @size) use the TBs of
+ * the pages of the canonical range that have the same content, instead
+ * of translating them again.  A write to either copy of a page ends its
+ * sharing.  Replaces an earlier call for @start, comparing the pages
+ * anew.  Call it while no vCPU runs, e.g. from async_safe_run_on_cpu().
+ */
+void tb_share_code(ram_addr_t start, ram_addr_t canonical, ram_addr_t size);
 void probe_write(CPUArchState *env, target_ulong addr, int size, int mmu_idx,
                  uintptr_t retaddr);
+/* tlb_access_burst:
+ * Transfer @count 32-bit words at @addr with a single
+ * memory_region_dispatch_burst(), if the TLB already maps @addr to MMIO
+ * and the whole range lies on that page.  Returns false, having done
+ * nothing, if the words must be accessed one by one instead.
+ */
+bool tlb_access_burst(CPUArchState *env, target_ulong addr, uint32_t *data,
+                      unsigned count, bool is_write, int mmu_idx,
+                      uintptr_t retaddr);
+/* mmio_direct_lookup:
+ * If @addr in @as lies in a region that allows direct calls (see
+ * memory_region_set_direct_call()) and an aligned access of @size bytes
+ * there is a plain call of its callback, return a handle for
+ * mmio_direct_access().  Handles live as long as the process, so
+ * translated code may embed them.  Call with tb_lock held.
+ */
+MMIODirect *mmio_direct_lookup(AddressSpace *as, hwaddr addr,
+                               unsigned size, bool is_write);
+/* mmio_direct_access:
+ * Do the access @d was looked up for, reading into or writing *@val, as
+ * the access of @cpu to @addr.  Returns false, having done nothing, if
+ * it needs the slow path after all, e.g. because the memory map changed:
+ * the caller must then do an ordinary load or store.
+ */
+bool mmio_direct_access(CPUState *cpu, MMIODirect *d, target_ulong addr,
+                        uint64_t *val, uintptr_t retaddr);
+/* tb_io_insn:
+ * Whether the insn at @pc did I/O in the middle of a TB under icount,
+ * so that cpu_io_recompile() had to stop it.  Call with tb_lock held.
+ */
+bool tb_io_insn(target_ulong pc);
 #else
+static inline void tlb_init(CPUState *cpu)
+{
+}
+static inline void tlb_destroy(CPUState *cpu)
+{
+}
 static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
 }
@@ -269,6 +345,24 @@ static inline void tlb_flush_page_all_cpus_synced(CPUState *src,
                                                   target_ulong addr)
 {
 }
+static inline bool tlb_access_burst(CPUArchState *env, target_ulong addr,
+                                    uint32_t *data, unsigned count,
+                                    bool is_write, int mmu_idx,
+                                    uintptr_t retaddr)
+{
+    return false;
+}
+static inline MMIODirect *mmio_direct_lookup(AddressSpace *as, hwaddr addr,
+                                             unsigned size, bool is_write)
+{
+    return NULL;
+}
+static inline bool mmio_direct_access(CPUState *cpu, MMIODirect *d,
+                                      target_ulong addr, uint64_t *val,
+                                      uintptr_t retaddr)
+{
+    return false;
+}
 static inline void tlb_flush(CPUState *cpu)
 {
 }
@@ -306,6 +400,10 @@ static inline void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *cpu,
 static inline void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
 {
 }
+static inline bool tb_io_insn(target_ulong pc)
+{
+    return false;
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
@@ -339,6 +437,9 @@ struct TranslationBlock {
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
     uint16_t icount;
+    uint16_t cycles;    /* icount units the TB costs, if not one per insn */
+    bool data_page2;    /* the code read data from the page after pc's, so
+                           that page is linked as a second code page */
     uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x00007fff
 #define CF_LAST_IO     0x00008000 /* Last insn may be an IO access.  */
@@ -346,6 +447,8 @@ struct TranslationBlock {
 #define CF_USE_ICOUNT  0x00020000
 #define CF_INVALID     0x00040000 /* TB is stale. Setters need tb_lock */
 #define CF_PARALLEL    0x00080000 /* Generate code for a parallel context */
+#define CF_SUPERBLOCK  0x00100000 /* Retranslated hot TB, see -tb-superblock */
+#define CF_HOT         0x00200000 /* In the hot region, see -tb-hot-region */
 /* cflags' mask for hashing/comparison */
 #define CF_HASH_MASK   \
     (CF_COUNT_MASK | CF_LAST_IO | CF_USE_ICOUNT | CF_PARALLEL)
@@ -387,6 +490,29 @@ struct TranslationBlock {
      */
     uintptr_t jmp_list_next[2];
     uintptr_t jmp_list_first;
+
+    /* Times the TB was entered, counted with -tb-profile */
+    uint64_t exec_count;
+
+    /* Entries left before -tb-superblock retranslates the TB */
+    uint32_t hot_count;
+#define TB_SUPERBLOCK_THRESHOLD 1024
+/* Entries after which -tb-hot-region moves the TB */
+#define TB_HOT_THRESHOLD 4096
+
+    /* Jump target each goto_tb slot of a TB ending in an indirect jump is
+     * chained for, as keyed by the target's translator; 0 while free.
+     */
+    uint32_t indirect_pc[2];
+
+    /* Translation sequence number, for -exec-trace */
+    uint32_t trace_id;
+
+    /* How the translation went, for info tcg-quality */
+    uint16_t nb_ops;        /* TCG ops before optimization */
+    uint16_t nb_ops_opt;    /* ... and after */
+    uint16_t nb_spills;
+    uint32_t translate_ns;
 };
 
 extern bool parallel_cpus;
@@ -410,6 +536,66 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
                                    target_ulong cs_base, uint32_t flags,
                                    uint32_t cf_mask);
+
+/**
+ * tb_pretranslate:
+ * @cpu: the vCPU that will run the code; must be the calling thread's
+ * @pc, @cs_base, @flags: the CPU state the block will be entered with
+ *
+ * @return: false if translation stopped because the code buffer is full
+ * or the code could not be fetched, true otherwise
+ *
+ * Translate the block at @pc ahead of its first execution, unless it is
+ * already cached, and make it the vCPU's jump cache entry for @pc.  Call
+ * it outside cpu_exec(), e.g. from run_on_cpu work.
+ */
+bool tb_pretranslate(CPUState *cpu, target_ulong pc, target_ulong cs_base,
+                     uint32_t flags);
+
+/**
+ * tb_speculate:
+ * @cpu: the vCPU whose branch targets to translate; must be the calling
+ * thread's
+ *
+ * @return: false if no branch target was left to try
+ *
+ * Take the most recent branch target that translator_note_branch()
+ * remembered for @cpu and pretranslate it, if the TLB maps its page so
+ * that no fault can be raised.  Call it outside cpu_exec(), while @cpu
+ * is idle.
+ */
+bool tb_speculate(CPUState *cpu);
+
+/**
+ * tb_superblock:
+ * @cpu: the vCPU on which helper_tb_hot() found a hot TB
+ *
+ * Replace the hot TB with a superblock, translated with CF_SUPERBLOCK so
+ * that the target may carry on along its direct branches instead of
+ * ending the block at each of them.  Called from cpu_exec() between TBs.
+ */
+void tb_superblock(CPUState *cpu);
+
+/**
+ * tb_relocate_hot:
+ * @cpu: the vCPU that found a TB past TB_HOT_THRESHOLD
+ *
+ * Translate again, into the hot region, every TB that ran at least
+ * TB_HOT_THRESHOLD times and is not there yet, hottest first, for as
+ * long as they fit.  The old copies are invalidated, so the new ones
+ * get chained as they are looked up.  Called from cpu_exec() between
+ * TBs; the TB that was just looked up may be gone afterwards.
+ */
+void tb_relocate_hot(CPUState *cpu);
+
+/**
+ * tb_foreach:
+ * @fn: called for each TB that has not been invalidated
+ * @opaque: passed to @fn
+ *
+ * Walk the translated blocks, in host code order, with tb_lock held.
+ */
+void tb_foreach(void (*fn)(TranslationBlock *tb, void *opaque), void *opaque);
 void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr);
 
 /* GETPC is the true target of the return instruction that we'll execute.  */
@@ -0,0 +1,35 @@
+/*
+ * Binary trace of translation block executions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef EXEC_EXEC_TRACE_H
+#define EXEC_EXEC_TRACE_H
+
+/*
+ * With -exec-trace every TB calls a helper on entry, which appends a
+ * record to a buffer of the vCPU's own, so chained TBs are traced too.
+ * Each record holds the TB's id (a sequence number given at translation,
+ * so retranslations of a PC can be told apart), its guest PC, and the
+ * number of guest instructions of the TB that the vCPU entered before,
+ * i.e. the icount delta if that TB ran to its end.
+ *
+ * Records are varint encoded as deltas from the previous record.  Full
+ * buffers go to a thread that deflates and writes them; see
+ * scripts/exec-trace-decode.py for the file format.
+ */
+
+extern bool tcg_exec_trace;
+
+/* Start the writer thread on @path; exit(1) on failure */
+void exec_trace_start(const char *path);
+
+/* Write out what the vCPUs buffered and wait for the writer */
+void exec_trace_stop(void);
+
+/* The id of a TB being translated */
+uint32_t exec_trace_new_id(void);
+
+#endif
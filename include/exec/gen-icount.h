@@ -43,6 +43,9 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_temp_free_i32(count);
 }
 
+/* @num_insns is what the TB charges to icount: one per instruction,
+ * unless the target models instruction timings (see DisasContextBase).
+ */
 static inline void gen_tb_end(TranslationBlock *tb, int num_insns)
 {
     if (tb_cflags(tb) & CF_USE_ICOUNT) {
@@ -55,6 +58,25 @@ static inline void gen_tb_end(TranslationBlock *tb, int num_insns)
     tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
 }
 
+/* Charge @count more icount units for a runtime-dependent cost, such as
+ * a taken branch.  Saturates at the end of the current budget slice: the
+ * next TB then exits to refill it, and at most @count units are lost.
+ */
+static inline void gen_icount_consume(int count)
+{
+    TCGv_i32 low = tcg_temp_new_i32();
+    TCGv_i32 zero = tcg_const_i32(0);
+
+    tcg_gen_ld16u_i32(low, cpu_env,
+                      -ENV_OFFSET + offsetof(CPUState, icount_decr.u16.low));
+    tcg_gen_subi_i32(low, low, count);
+    tcg_gen_movcond_i32(TCG_COND_LT, low, low, zero, zero, low);
+    tcg_gen_st16_i32(low, cpu_env,
+                     -ENV_OFFSET + offsetof(CPUState, icount_decr.u16.low));
+    tcg_temp_free_i32(zero);
+    tcg_temp_free_i32(low);
+}
+
 static inline void gen_io_start(void)
 {
     TCGv_i32 tmp = tcg_const_i32(1);
@@ -147,6 +147,16 @@ struct MemoryRegionOps {
      */
     void *(*request_ptr)(void *opaque, hwaddr addr, unsigned *size,
                          unsigned *offset);
+    /* Load/store multiple callback, optional:
+     * @addr is the address of the first word relative to the @mr.
+     * @data holds @count 32-bit words, filled in for reads and consumed
+     * for writes.
+     *
+     * Called instead of @count separate 4-byte accesses at @addr,
+     * @addr + 4, ...  The range is word aligned and lies within @mr.
+     */
+    void (*access_burst)(void *opaque, hwaddr addr, uint32_t *data,
+                         unsigned count, bool is_write);
 
     enum device_endian endianness;
     /* Guest-visible constraints: */
@@ -236,6 +246,8 @@ struct MemoryRegion {
     bool rom_device;
     bool flush_coalesced_mmio;
     bool global_locking;
+    bool pollable;
+    bool direct_call;
     uint8_t dirty_log_mask;
     bool is_iommu;
     RAMBlock *ram_block;
@@ -1293,6 +1305,44 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_global_locking(MemoryRegion *mr);
 
+/**
+ * memory_region_set_pollable: Declares that the region's registers only
+ *                             change on guest writes and virtual timers.
+ *
+ * Reads must have no side effects, and the values read must only change
+ * when the guest writes the region or a QEMU_CLOCK_VIRTUAL timer fires.
+ * A vCPU that keeps reading the same value from the same register of
+ * such a region can then jump virtual time to the next timer deadline
+ * instead of spinning until it arrives; see cpu_set_poll_skip().
+ *
+ * @mr: the memory region to be updated.
+ * @pollable: whether the region has these properties.
+ */
+void memory_region_set_pollable(MemoryRegion *mr, bool pollable);
+
+/**
+ * memory_region_set_direct_call: Declares that translated code may call
+ *                                the region's callbacks itself.
+ *
+ * When the TCG translator knows the address of an access and it lies in
+ * such a region, it may call the read or write callback directly with
+ * the offset computed at translation time, instead of going through the
+ * TLB and memory_region_dispatch_read/write.  The callbacks must take
+ * any lock they need other than the BQL, and must not depend on the
+ * accessing CPU's state being synced (cpu_restore_state, mem_io_pc).
+ * Translated calls fall back to the slow path once the memory map has
+ * changed; see memory_map_generation.
+ *
+ * @mr: the memory region to be updated.
+ * @direct_call: whether the region allows this.
+ */
+void memory_region_set_direct_call(MemoryRegion *mr, bool direct_call);
+
+/* Bumped by each change of the memory map, after the new flat views are
+ * in place.  Whatever was looked up under an older value may be stale.
+ */
+extern unsigned memory_map_generation;
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -1600,6 +1650,45 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
                                          unsigned size,
                                          MemTxAttrs attrs);
 
+/**
+ * memory_region_dispatch_burst: perform @count consecutive 32-bit reads
+ * or writes directly to the specified MemoryRegion.
+ *
+ * A region that implements the access_burst callback sees a single call;
+ * any other region sees @count ordinary 4-byte dispatches.
+ *
+ * @mr: #MemoryRegion to access
+ * @addr: address of the first word within that region
+ * @data: the @count words, filled in for reads
+ * @count: number of words
+ * @is_write: true for writes, false for reads
+ * @attrs: memory transaction attributes to use for the access
+ */
+MemTxResult memory_region_dispatch_burst(MemoryRegion *mr,
+                                         hwaddr addr,
+                                         uint32_t *data,
+                                         unsigned count,
+                                         bool is_write,
+                                         MemTxAttrs attrs);
+
+/**
+ * memory_region_direct_sizes: return the access sizes for which a
+ * dispatch to @mr is nothing more than a call to its read or write
+ * callback.
+ *
+ * Such an access needs no validation, no splitting and no byte swap, so
+ * callers that look @mr up often may call mr->ops->read or mr->ops->write
+ * themselves, provided the access is naturally aligned, the matching
+ * memory_region_ops_read/write trace event is disabled and, for writes,
+ * @mr has no ioeventfds.
+ *
+ * The result is a mask in which @size is set for each allowed @size.
+ *
+ * @mr: the #MemoryRegion to query
+ * @is_write: true for writes, false for reads
+ */
+unsigned memory_region_direct_sizes(MemoryRegion *mr, bool is_write);
+
 /**
  * address_space_init: initializes an address space
  *
@@ -1621,6 +1710,21 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name);
  */
 void address_space_destroy(AddressSpace *as);
 
+typedef void AddressSpaceSectionFn(MemoryRegionSection *section, void *opaque);
+
+/**
+ * address_space_foreach_section: walk what is mapped in an address space
+ *
+ * Calls @fn for each #MemoryRegionSection of the flattened view of @as,
+ * in increasing address order.  Gaps, where nothing is mapped, are skipped.
+ *
+ * @as: the #AddressSpace to walk
+ * @fn: the function to call for each section
+ * @opaque: passed to @fn
+ */
+void address_space_foreach_section(AddressSpace *as,
+                                   AddressSpaceSectionFn *fn, void *opaque);
+
 /**
  * address_space_rw: read from or write to an address space.
  *
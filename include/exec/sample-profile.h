@@ -0,0 +1,32 @@
+/*
+ * Statistical sampling profiler for guest code
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef EXEC_SAMPLE_PROFILE_H
+#define EXEC_SAMPLE_PROFILE_H
+
+/*
+ * With -sample-profile a host thread wakes up @hz times a second and asks
+ * each running vCPU for a sample.  The vCPU takes it at its next TB
+ * boundary, through CPUClass::profile_sample, so the generated code is
+ * unchanged.  Halted vCPUs are counted as idle on the spot.
+ *
+ * Identical stacks are counted together, and written out at exit in the
+ * folded format of flamegraph.pl, symbolized from the loaded ELF image:
+ *
+ *   exception 15;caller;function 42
+ */
+
+/* Start sampling into @path; exit(1) on failure */
+void sample_profile_start(const char *path, unsigned int hz);
+
+/* Stop sampling and write out the stacks */
+void sample_profile_stop(void);
+
+/* Called by @cpu between TBs once it was asked for a sample */
+void sample_profile_take(CPUState *cpu);
+
+#endif
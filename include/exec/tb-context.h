@@ -37,7 +37,9 @@ struct TBContext {
     QemuMutex tb_lock;
 
     /* statistics */
+    uint64_t tb_gen_count;
     unsigned tb_flush_count;
+    unsigned tb_evict_count;
     int tb_phys_invalidate_count;
 };
 
@@ -0,0 +1,89 @@
+/*
+ * Guest code coverage from translation blocks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef EXEC_TB_COVERAGE_H
+#define EXEC_TB_COVERAGE_H
+
+/*
+ * With -tb-coverage every guest code block that is translated is noted
+ * by its start address, and keeps the largest size it was translated
+ * with.  The notes outlive the TBs, so a tb_flush loses nothing.
+ *
+ * In "translated" mode that is all, and the generated code is unchanged;
+ * a block counts as covered as soon as it is translated, which includes
+ * blocks translated ahead of time by pretranslate=on or -tb-speculate.
+ * In "executed" mode each TB also stores 1 to a flag of its block on
+ * entry, and only blocks whose flag is set count as covered.
+ *
+ * "edges" mode is AFL's: each TB, on entry, bumps the 8-bit counter of
+ * the edge from the TB run before it on that CPU, in a map shared with
+ * the fuzzer.  The counter is in the TB's own code, so entries through
+ * a chained jump count too.  Blocks are not noted or dumped.
+ */
+
+enum {
+    TB_COVERAGE_OFF,
+    TB_COVERAGE_TRANSLATED,
+    TB_COVERAGE_EXECUTED,
+    TB_COVERAGE_EDGES,
+};
+
+/* Edge counters in the shared map, as AFL's MAP_SIZE */
+#define TB_COVERAGE_EDGE_BITS 16
+#define TB_COVERAGE_EDGE_MAP_SIZE (1 << TB_COVERAGE_EDGE_BITS)
+
+enum {
+    TB_COVERAGE_DRCOV,
+    TB_COVERAGE_LCOV,
+};
+
+extern int tcg_tb_coverage;
+extern uint8_t *tb_coverage_edge_map;
+
+/*
+ * Map the edge counters: @file, created if need be, or without one the
+ * System V shared memory segment named by $__AFL_SHM_ID, as afl-fuzz
+ * sets it up.  Returns false with @errp set on failure.
+ */
+bool tb_coverage_edge_map_open(const char *file, Error **errp);
+
+/*
+ * Forget the TB each CPU ran last, so that a new test case starts
+ * without an edge from wherever the previous one stopped.
+ */
+void tb_coverage_edge_reset(void);
+
+#ifdef NEED_CPU_H
+#include "exec/exec-all.h"
+
+/* The ID of the TB at @pc in edge hashes, TB_COVERAGE_EDGE_BITS wide */
+static inline uint32_t tb_coverage_edge_id(target_ulong pc)
+{
+    uint32_t h = (uint64_t)pc ^ ((uint64_t)pc >> 32);
+
+    return (h * 0x9e3779b1u) >> (32 - TB_COVERAGE_EDGE_BITS);
+}
+
+/* Note @tb once it is translated; call with tb_lock held */
+void tb_coverage_add(TranslationBlock *tb);
+
+/*
+ * The flag that the TB at @pc sets in executed mode.  It stays valid
+ * for the life of the process.  Call with tb_lock held.
+ */
+uint8_t *tb_coverage_hit_flag(target_ulong pc);
+#endif
+
+/*
+ * Write the covered blocks to @f in @format, as blocks of the one
+ * module @image.  lcov has no addresses, so each block is a "line"
+ * numbered by its guest address, and a function is a symbol of the
+ * image that has at least one block translated.
+ */
+void tb_coverage_dump(FILE *f, int format, const char *image);
+
+#endif
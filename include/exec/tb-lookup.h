@@ -27,7 +27,7 @@ tb_lookup__cpu_state(CPUState *cpu, target_ulong *pc, target_ulong *cs_base,
 
     cpu_get_tb_cpu_state(env, pc, cs_base, flags);
     hash = tb_jmp_cache_hash_func(*pc);
-    tb = atomic_rcu_read(&cpu->tb_jmp_cache[hash]);
+    tb = cpu_tb_jmp_cache_get(cpu, hash);
     if (likely(tb &&
                tb->pc == *pc &&
                tb->cs_base == *cs_base &&
@@ -40,7 +40,7 @@ tb_lookup__cpu_state(CPUState *cpu, target_ulong *pc, target_ulong *cs_base,
     if (tb == NULL) {
         return NULL;
     }
-    atomic_set(&cpu->tb_jmp_cache[hash], tb);
+    cpu_tb_jmp_cache_set(cpu, hash, tb);
     return tb;
 }
 
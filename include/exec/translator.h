@@ -20,6 +20,7 @@
 
 
 #include "exec/exec-all.h"
+#include "qemu/queue.h"
 #include "tcg/tcg.h"
 
 
@@ -58,6 +59,10 @@ typedef enum DisasJumpType {
  *           disassembly).
  * @is_jmp: What instruction to disassemble next.
  * @num_insns: Number of translated instructions (including current).
+ * @insn_cycles: icount units the current instruction costs.  Preset to 1
+ *               before each instruction; targets that model instruction
+ *               timings may raise it from their translate_insn hook.
+ * @num_cycles: icount units charged for the instructions translated so far.
  * @singlestep_enabled: "Hardware" single stepping enabled.
  *
  * Architecture-agnostic disassembly context.
@@ -68,6 +73,8 @@ typedef struct DisasContextBase {
     target_ulong pc_next;
     DisasJumpType is_jmp;
     unsigned int num_insns;
+    unsigned int insn_cycles;
+    unsigned int num_cycles;
     bool singlestep_enabled;
 } DisasContextBase;
 
@@ -141,4 +148,84 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
 
 void translator_loop_temp_check(DisasContextBase *db);
 
+/**
+ * translator_note_branch:
+ * @db: Disassembly context.
+ * @dest: Target of a direct branch out of the block being translated.
+ *
+ * With -tb-speculate, remember @dest so that tb_speculate() may translate
+ * it before it runs, for the same CPU state flags as this block.
+ */
+void translator_note_branch(DisasContextBase *db, target_ulong dest);
+
+/**
+ * TranslatorInstrument:
+ * @insn: Called before the code of each guest instruction is generated,
+ *        with its address.  May be NULL.
+ * @mem: Called before the code of each guest memory access is generated,
+ *       with the address of the instruction, the access size and sign in
+ *       @memop, and whether it is a store.  May be NULL.
+ *
+ * An instrumentation client.  The callbacks run at translation time and
+ * decide what the generated code does each time the instruction or access
+ * runs: increment a counter inline with translator_instrument_count(),
+ * call a function with translator_instrument_call(), both, or nothing,
+ * in which case the client costs nothing at run time.
+ */
+typedef struct TranslatorInstrument TranslatorInstrument;
+struct TranslatorInstrument {
+    void (*insn)(TranslatorInstrument *ti, target_ulong pc);
+    void (*mem)(TranslatorInstrument *ti, target_ulong pc, TCGMemOp memop,
+                bool store);
+    QSLIST_ENTRY(TranslatorInstrument) next;
+};
+
+/**
+ * TranslatorInstrumentFn:
+ * @opaque: As passed to translator_instrument_call().
+ * @info: As passed to translator_instrument_call().
+ * @vaddr: The guest virtual address accessed, from a @mem callback, or the
+ *         address of the instruction, from an @insn callback.
+ *
+ * Runs with the guest state partly in host registers, so it must neither
+ * look at the CPU state nor raise exceptions.
+ */
+typedef void TranslatorInstrumentFn(void *opaque, uint64_t info,
+                                    uint64_t vaddr);
+
+extern bool translator_instrumented;
+
+/**
+ * translator_instrument_register:
+ * @ti: The client, which must stay valid for the life of the process.
+ *
+ * Call it before the vCPUs start; code translated earlier is not
+ * instrumented.
+ */
+void translator_instrument_register(TranslatorInstrument *ti);
+
+/**
+ * translator_instrument_count:
+ * @counter: Incremented, without a helper call, each time the instruction
+ *           or access runs.  Not atomic, so with MTTCG concurrent
+ *           increments may be lost.
+ *
+ * Only call it from a #TranslatorInstrument callback.
+ */
+void translator_instrument_count(uint64_t *counter);
+
+/**
+ * translator_instrument_call:
+ * @fn: Called each time the instruction or access runs.
+ * @opaque: Passed to @fn.
+ * @info: Passed to @fn, e.g. the address of the instruction.
+ *
+ * Only call it from a #TranslatorInstrument callback.
+ */
+void translator_instrument_call(TranslatorInstrumentFn *fn, void *opaque,
+                                uint64_t info);
+
+/* For tcg_gen_qemu_ld/st: run the @mem callbacks for an access to @addr */
+void translator_instrument_mem(TCGv addr, TCGMemOp memop, bool store);
+
 #endif  /* EXEC__TRANSLATOR_H */
@@ -12,6 +12,7 @@
 
 #include "hw/sysbus.h"
 #include "hw/intc/armv7m_nvic.h"
+#include "hw/misc/armv7m_itm.h"
 #include "target/arm/idau.h"
 
 #define TYPE_BITBAND "ARM,bitband-memory"
@@ -26,6 +27,15 @@ typedef struct {
     MemoryRegion iomem;
     uint32_t base;
     MemoryRegion *source_memory;
+
+    /* RAM at the start of the source window, accessed directly; host is
+     * NULL until looked up, and again whenever the memory map changes.
+     */
+    MemoryListener listener;
+    uint8_t *host;
+    hwaddr host_len;
+    MemoryRegion *host_mr;
+    ram_addr_t host_ram_addr;
 } BitBandState;
 
 #define TYPE_ARMV7M "armv7m"
@@ -43,6 +53,7 @@ typedef struct {
  *   devices will be automatically layered on top of this view.)
  * + Property "idau": IDAU interface (forwarded to CPU object)
  * + Property "init-svtor": secure VTOR reset value (forwarded to CPU object)
+ * + Property "enable-bitband": expose bitbanded IO (default on)
  */
 typedef struct ARMv7MState {
     /*< private >*/
@@ -50,6 +61,7 @@ typedef struct ARMv7MState {
     /*< public >*/
     NVICState nvic;
     BitBandState bitband[ARMV7M_NUM_BITBANDS];
+    ARMv7MITMState itm;
     ARMCPU *cpu;
 
     /* MemoryRegion we pass to the CPU, with our devices layered on
@@ -63,6 +75,7 @@ typedef struct ARMv7MState {
     MemoryRegion *board_memory;
     Object *idau;
     uint32_t init_svtor;
+    bool enable_bitband;
 } ARMv7MState;
 
 #endif
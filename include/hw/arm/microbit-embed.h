@@ -0,0 +1,81 @@
+/*
+ * In-process control of a micro:bit machine
+ *
+ * With --enable-libqemu, arm-softmmu also builds libqemu-arm.so: the
+ * system emulator without its main(), for a host program to drive one
+ * micro:bit directly instead of over QMP or qtest.  This header is the
+ * whole interface and needs no other QEMU header.
+ *
+ * There is one machine per process.  All functions must be called from
+ * the thread that called microbit_embed_init(); between calls to
+ * microbit_embed_run() the guest is stopped, so its memory and devices
+ * stay as they are.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_ARM_MICROBIT_EMBED_H
+#define HW_ARM_MICROBIT_EMBED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct MicrobitEmbedSnapshot MicrobitEmbedSnapshot;
+
+/* Guest bytes sent by the UART, during microbit_embed_run() */
+typedef void MicrobitEmbedUARTFn(const uint8_t *buf, size_t len,
+                                 void *opaque);
+
+enum {
+    MICROBIT_EMBED_BUDGET,      /* the budget was used up */
+    MICROBIT_EMBED_STOPPED,     /* the guest shut down, panicked or hit
+                                   a gdb breakpoint */
+};
+
+/*
+ * Create the machine, stopped.  @argv holds QEMU options added to the
+ * defaults, e.g. "-kernel", "prog.hex", "-icount", "shift=0"; the UART
+ * is taken.  Invalid options end the process, as they would QEMU.
+ */
+int microbit_embed_init(int argc, const char * const *argv);
+/* Release the machine; it cannot be created again */
+void microbit_embed_exit(void);
+
+/*
+ * Run the guest for @budget_ns of QEMU_CLOCK_VIRTUAL time, or until it
+ * stops by itself.  Returns MICROBIT_EMBED_BUDGET or _STOPPED, with the
+ * time actually run in *@ran_ns if not NULL, or -1 on error.
+ */
+int microbit_embed_run(int64_t budget_ns, int64_t *ran_ns);
+/* QEMU_CLOCK_VIRTUAL now, in nanoseconds */
+int64_t microbit_embed_clock(void);
+/* Reset the board, as the reset button does */
+void microbit_embed_reset(void);
+
+/* Access guest memory and MMIO; -1 if some of it is not mapped */
+int microbit_embed_read(uint32_t addr, void *buf, size_t len);
+int microbit_embed_write(uint32_t addr, const void *buf, size_t len);
+
+/*
+ * Drive @level onto the GPIO input pins in @mask, @delay_ns from now.
+ * Returns -1 if the change cannot be queued.
+ */
+int microbit_embed_gpio_set(uint32_t mask, bool level, int64_t delay_ns);
+/* Feed @buf to the UART receiver; returns how much of it it took */
+size_t microbit_embed_uart_write(const void *buf, size_t len);
+void microbit_embed_uart_set_output(MicrobitEmbedUARTFn *fn, void *opaque);
+
+/*
+ * Snapshots are kept in memory.  RAM written after the latest snapshot
+ * is tracked, so that loading that one copies back only the changes.
+ */
+MicrobitEmbedSnapshot *microbit_embed_snapshot_save(void);
+int microbit_embed_snapshot_load(MicrobitEmbedSnapshot *snap);
+void microbit_embed_snapshot_free(MicrobitEmbedSnapshot *snap);
+
+/* Why the last call failed, until the next failure */
+const char *microbit_embed_error(void);
+
+#endif
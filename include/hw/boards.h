@@ -156,6 +156,17 @@ typedef struct {
  *    should instead use "unimplemented-device" for all memory ranges where
  *    the guest will attempt to probe for a device that QEMU doesn't
  *    implement and a stub device is required.
+ * @tcg_code_size_hint:
+ *    If non-zero, the number of bytes of guest memory the board can execute
+ *    code from.  "-tb-size auto" sizes the TCG translation buffer from it
+ *    instead of reserving the default, which is far larger than small
+ *    boards need.
+ * @init_unbatched:
+ *    The machine core runs @init inside one memory region transaction, so
+ *    that the address spaces are rendered once at the end rather than
+ *    after every subregion the board adds.  Set this if @init needs to
+ *    access guest memory through an address space, which only sees the
+ *    regions added so far once the transaction is committed.
  */
 struct MachineClass {
     /*< private >*/
@@ -199,6 +210,8 @@ struct MachineClass {
     int minimum_page_bits;
     bool has_hotpluggable_cpus;
     bool ignore_memory_transaction_failures;
+    uint64_t tcg_code_size_hint;
+    bool init_unbatched;
     int numa_mem_align_shift;
     const char **valid_cpu_types;
     strList *allowed_dynamic_sysbus_devices;
@@ -12,6 +12,7 @@
 
 #include "target/arm/cpu.h"
 #include "hw/sysbus.h"
+#include "qemu/bitmap.h"
 #include "hw/timer/armv7m_systick.h"
 
 #define TYPE_NVIC "armv7m_nvic"
@@ -23,6 +24,32 @@
 #define NVIC_MAX_VECTORS 512
 /* Number of internal exceptions */
 #define NVIC_INTERNAL_VECTORS 16
+/* Raw priorities range from -4 (v8M Reset) to 255 */
+#define NVIC_PRIO_BIAS 4
+#define NVIC_PRIO_LEVELS (256 + NVIC_PRIO_BIAS)
+
+/* DWT profiling counters, in the order of their enable bits */
+enum {
+    NVIC_DWT_CYCCNT,
+    NVIC_DWT_SLEEPCNT,
+    NVIC_DWT_NUM_COUNTERS
+};
+
+/* Latency histogram buckets: bucket 0 counts latencies of 0 ns, bucket
+ * n those from 2^(n-1) to 2^n - 1 ns, and the last one everything longer.
+ */
+#define NVIC_LATENCY_BUCKETS 32
+
+/* Time from an exception becoming pending to the CPU taking it */
+typedef struct NVICLatency {
+    /* When the exception last became pending, if @timing */
+    bool timing;
+    int64_t pending_vns;
+    int64_t pending_hns;
+    uint64_t count;
+    uint64_t virt[NVIC_LATENCY_BUCKETS];
+    uint64_t host[NVIC_LATENCY_BUCKETS];
+} NVICLatency;
 
 typedef struct VecInfo {
     /* Exception priorities can range from -3 to 255; only the unmodifiable
@@ -76,11 +103,41 @@ typedef struct NVICState {
     int exception_prio; /* group prio of the highest prio active exception */
     int vectpending_prio; /* group prio of the exeception in vectpending */
 
+    /* Cached state for the vectors[] array, updated as vectors change so
+     * that a CPU without the Security extension finds the pending and
+     * active priorities without scanning every vector:
+     *  - pending_map: vectors that are enabled and pending
+     *  - active_map: vectors that are active
+     *  - pending_prios, active_prios: the raw priorities, offset by
+     *    NVIC_PRIO_BIAS, of the vectors in those maps, and how many
+     *    vectors have each
+     */
+    DECLARE_BITMAP(pending_map, NVIC_MAX_VECTORS);
+    DECLARE_BITMAP(active_map, NVIC_MAX_VECTORS);
+    DECLARE_BITMAP(pending_prios, NVIC_PRIO_LEVELS);
+    DECLARE_BITMAP(active_prios, NVIC_PRIO_LEVELS);
+    uint16_t pending_prio_count[NVIC_PRIO_LEVELS];
+    uint16_t active_prio_count[NVIC_PRIO_LEVELS];
+
     MemoryRegion sysregmem;
     MemoryRegion sysreg_ns_mem;
     MemoryRegion systickmem;
     MemoryRegion systick_ns_mem;
     MemoryRegion container;
+    MemoryRegion dwtmem;
+
+    /* DEMCR and the DWT.  A counter that is counting is not updated as
+     * time goes by: dwt_count[] is its value when the clock it follows
+     * read dwt_base[], and reads add what the clock advanced since.
+     */
+    uint32_t demcr;
+    uint32_t dwt_ctrl;
+    uint32_t dwt_cpicnt;
+    uint32_t dwt_count[NVIC_DWT_NUM_COUNTERS];
+    int64_t dwt_base[NVIC_DWT_NUM_COUNTERS];
+
+    /* One per exception number, in virtual and host time; not migrated */
+    NVICLatency *latency;
 
     uint32_t num_irq;
     qemu_irq excpout;
@@ -8,6 +8,7 @@
 typedef struct IRQState *qemu_irq;
 
 typedef void (*qemu_irq_handler)(void *opaque, int n, int level);
+typedef void (*qemu_irq_edge_handler)(void *opaque, int n);
 
 void qemu_set_irq(qemu_irq irq, int level);
 
@@ -21,11 +22,16 @@ static inline void qemu_irq_lower(qemu_irq irq)
     qemu_set_irq(irq, 0);
 }
 
-static inline void qemu_irq_pulse(qemu_irq irq)
-{
-    qemu_set_irq(irq, 1);
-    qemu_set_irq(irq, 0);
-}
+/* Raise and lower the IRQ, in a single call to its edge handler if it
+ * has one.
+ */
+void qemu_irq_pulse(qemu_irq irq);
+
+/* Give an input IRQ a handler for pulses.  It must leave the device as
+ * the handler would with level 1 then 0, for instance latching an
+ * interrupt without a round trip through the level.
+ */
+void qemu_irq_set_edge_handler(qemu_irq irq, qemu_irq_edge_handler handler);
 
 /* Returns an array of N IRQs. Each IRQ is assigned the argument handler and
  * opaque data.
@@ -0,0 +1,40 @@
+/*
+ * ARMv7M Instrumentation Trace Macrocell
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_MISC_ARMV7M_ITM_H
+#define HW_MISC_ARMV7M_ITM_H
+
+#include "hw/sysbus.h"
+#include "chardev/char-fe.h"
+
+#define TYPE_ARMV7M_ITM "armv7m_itm"
+
+#define ARMV7M_ITM(obj) OBJECT_CHECK(ARMv7MITMState, (obj), TYPE_ARMV7M_ITM)
+
+/* Trace bytes waiting for the chardev */
+#define ARMV7M_ITM_BUF_SIZE 4096
+
+typedef struct ARMv7MITMState {
+    /*< private >*/
+    SysBusDevice parent_obj;
+    /*< public >*/
+
+    MemoryRegion iomem;
+    CharBackend chr;
+    QEMUBH *bh;
+    guint watch;
+
+    uint32_t ter;
+    uint32_t tpr;
+    uint32_t tcr;
+    /* An overflow packet is due before the next source packet */
+    bool overflow;
+    uint32_t len;
+    uint8_t buf[ARMV7M_ITM_BUF_SIZE];
+} ARMv7MITMState;
+
+#endif
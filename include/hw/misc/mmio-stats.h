@@ -0,0 +1,32 @@
+/*
+ * Per-register MMIO access counters
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#ifndef HW_MISC_MMIO_STATS_H
+#define HW_MISC_MMIO_STATS_H
+
+#include "exec/memory.h"
+
+/**
+ * mmio_stats_init_io: initialize an I/O region whose accesses are counted
+ * @mr: the #MemoryRegion to be initialized
+ * @owner: the object that tracks the region's reference count
+ * @ops: a structure containing read and write callbacks to be used when
+ *       I/O is performed on the region
+ * @opaque: passed to the read and write callbacks of the @ops structure
+ * @name: used for debugging and reported by query-mmio-stats
+ * @size: size of the region
+ *
+ * Like memory_region_init_io(), but each guest access is first counted
+ * per vCPU and per 4-byte register, for "info mmio-stats".  Counting is
+ * a plain store to a counter only the accessing vCPU writes, so it is
+ * cheap enough to leave on.  @ops must use the plain read and write
+ * callbacks and must not have a valid.accepts hook.
+ */
+void mmio_stats_init_io(MemoryRegion *mr, Object *owner,
+                        const MemoryRegionOps *ops, void *opaque,
+                        const char *name, uint64_t size);
+
+#endif
@@ -69,9 +69,20 @@
  * not the one less.  */
 #define PTIMER_POLICY_NO_COUNTER_ROUND_DOWN (1 << 4)
 
+/* Run the bottom half's callback straight from the expiry of the timer
+ * instead of scheduling it, which saves a main loop iteration per
+ * period.  Only for callbacks that just update state and raise IRQs.
+ * Triggers caused by ptimer_*() calls, and all triggers while record
+ * or replay is active, still go through the bottom half.  */
+#define PTIMER_POLICY_SYNC_TRIGGER          (1 << 5)
+
+/* Number of compare channels, see ptimer_set_compare().  */
+#define PTIMER_MAX_COMPARE                  4
+
 /* ptimer.c */
 typedef struct ptimer_state ptimer_state;
 typedef void (*ptimer_cb)(void *opaque);
+typedef void (*ptimer_compare_cb)(void *opaque, unsigned channels);
 
 /**
  * ptimer_init - Allocate and return a new ptimer
@@ -190,6 +201,45 @@ void ptimer_run(ptimer_state *s, int oneshot);
  */
 void ptimer_stop(ptimer_state *s);
 
+/**
+ * ptimer_set_compare_cb - Set the function called on compare matches
+ * @s: ptimer
+ * @cb: function to call
+ * @opaque: first argument to @cb
+ *
+ * @cb is called from a bottom half with a bitmask of the compare
+ * channels that have matched since it was last called; channels
+ * matching at the same time are reported together.
+ */
+void ptimer_set_compare_cb(ptimer_state *s, ptimer_compare_cb cb,
+                           void *opaque);
+
+/**
+ * ptimer_set_compare - Arm a compare channel
+ * @s: ptimer
+ * @channel: channel number, below PTIMER_MAX_COMPARE
+ * @value: counter value to match
+ *
+ * Make the running down-counter report @channel each time it counts
+ * down to @value, including on runs after a periodic reload.  Loading
+ * the counter with @value is not a match, and neither is a value
+ * that is already behind the counter.  Only one QEMU timer is used,
+ * armed for the nearest match of all channels.
+ *
+ * Matches follow the plain countdown; the extra period of
+ * PTIMER_POLICY_WRAP_AFTER_ONE_PERIOD is not accounted for.
+ */
+void ptimer_set_compare(ptimer_state *s, unsigned channel, uint64_t value);
+
+/**
+ * ptimer_clear_compare - Disarm a compare channel
+ * @s: ptimer
+ * @channel: channel number, below PTIMER_MAX_COMPARE
+ *
+ * Stop matching @channel, dropping a match not yet reported.
+ */
+void ptimer_clear_compare(ptimer_state *s, unsigned channel);
+
 extern const VMStateDescription vmstate_ptimer;
 
 #define VMSTATE_PTIMER(_field, _state) \
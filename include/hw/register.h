@@ -193,6 +193,41 @@ RegisterInfoArray *register_init_block32(DeviceState *owner,
                                          bool debug_enabled,
                                          uint64_t memory_size);
 
+/**
+ * Like register_init_block32(), but keep the register values in the RAM of
+ * a ROM device region instead of an array: guest reads are served straight
+ * from that RAM and never leave TCG, and only writes call into @ops.  The
+ * device's side effects therefore belong in pre_write and post_write.
+ *
+ * Because reads bypass the register API, no register may have clear on read
+ * bits or a post_read hook, and reads of offsets without a register return
+ * whatever the RAM holds (0 unless the device stores there).  The RAM holds
+ * values in host byte order, which must match the guest's.
+ *
+ * Must be called from realize: the RAM is named after the owner's QOM path
+ * and migrates with the guest RAM, not with the device's VMState.
+ *
+ * @owner: device owning the registers
+ * @rae: Register definitions to init
+ * @num: number of registers to init (length of @rae)
+ * @ri: Register array to init, must already be allocated
+ * @ops: Memory region ops to access registers; only @ops->write is used
+ *       while the region is in ROMD mode.
+ * @debug enabled: turn on/off verbose debug information
+ * @memory_size: size of the region, and of its RAM
+ * @errp: pointer to error object
+ * returns: As register_init_block32(); the values are at
+ *          memory_region_get_ram_ptr(&r_array->mem).  NULL on error.
+ */
+
+RegisterInfoArray *register_init_block32_romd(DeviceState *owner,
+                                              const RegisterAccessInfo *rae,
+                                              int num, RegisterInfo *ri,
+                                              const MemoryRegionOps *ops,
+                                              bool debug_enabled,
+                                              uint64_t memory_size,
+                                              Error **errp);
+
 /**
  * This function should be called to cleanup the registers that were initialized
  * when calling register_init_block32(). This function should only be called
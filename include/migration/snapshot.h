@@ -18,4 +18,10 @@
 int save_snapshot(const char *name, Error **errp);
 int load_snapshot(const char *name, Error **errp);
 
+/* Devices and RAM kept in the process; the VM must be stopped */
+typedef struct MemSnapshot MemSnapshot;
+MemSnapshot *mem_snapshot_save(bool track_dirty, Error **errp);
+int mem_snapshot_load(MemSnapshot *ms, Error **errp);
+void mem_snapshot_free(MemSnapshot *ms);
+
 #endif
@@ -1003,6 +1003,15 @@ int vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
 
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque);
 
+/* Flat save/restore within one process, for plain-field devices */
+typedef struct VMStatePlan VMStatePlan;
+
+VMStatePlan *vmstate_plan_get(const VMStateDescription *vmsd);
+size_t vmstate_plan_size(const VMStatePlan *plan);
+int vmstate_plan_save(const VMStatePlan *plan, void *opaque, uint8_t *buf);
+int vmstate_plan_load(const VMStatePlan *plan, void *opaque,
+                      const uint8_t *buf);
+
 /* Returns: 0 on success, -1 on failure */
 int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
                                    const VMStateDescription *vmsd,
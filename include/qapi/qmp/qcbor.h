@@ -0,0 +1,13 @@
+/*
+ * QObject CBOR (RFC 7049) encoding
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#ifndef QCBOR_H
+#define QCBOR_H
+
+void qobject_to_cbor(const QObject *obj, QString *str);
+
+#endif /* QCBOR_H */
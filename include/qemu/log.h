@@ -100,6 +100,31 @@ qemu_log_vprintf(const char *fmt, va_list va)
         }                                               \
     } while (0)
 
+/* log only if a bit is set on the current loglevel mask, and only the
+ * first time this call site is reached with this @id; later calls are
+ * just counted (see "info log-ratelimit"):
+ * @mask: bit to check in the mask
+ * @id: what the message is about at this site, e.g. a register offset
+ * @fmt: printf-style format string
+ * @args: optional arguments for format string
+ */
+#define qemu_log_mask_ratelimited(MASK, ID, FMT, ...)                   \
+    do {                                                                \
+        if (unlikely(qemu_loglevel_mask(MASK)) &&                       \
+            qemu_log_ratelimit(__FILE__ ":" stringify(__LINE__), ID)) { \
+            qemu_log(FMT, ## __VA_ARGS__);                              \
+        }                                                               \
+    } while (0)
+
+/* Count a message from @site about @id; true if it is the first one */
+bool qemu_log_ratelimit(const char *site, uint64_t id);
+
+typedef void QEMULogRateLimitFunc(const char *site, uint64_t id,
+                                  uint64_t count, void *opaque);
+
+/* Call @func for every (site, id) counted so far, in no particular order */
+void qemu_log_ratelimit_foreach(QEMULogRateLimitFunc *func, void *opaque);
+
 /* Maintenance: */
 
 /* define log items */
@@ -0,0 +1,34 @@
+/*
+ * Startup phase timeline
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_STARTUP_PROFILE_H
+#define QEMU_STARTUP_PROFILE_H
+
+/*
+ * The time between exec and the first guest instruction, split into
+ * phases.  Each startup_profile_mark() ends the phase that started at
+ * the previous mark; the first phase starts when the process is loaded.
+ * Times come from the monotonic clock.
+ *
+ * The timeline is closed by startup_profile_finish(), after which marks
+ * are ignored, so that code that also runs later (e.g. on a reset) does
+ * not add to it.
+ */
+
+/* @phase must be a string constant */
+void startup_profile_mark(const char *phase);
+void startup_profile_finish(const char *phase);
+
+/* Call @fn with each phase, its end in ns since exec and its length */
+typedef void StartupProfileFunc(const char *phase, int64_t end_ns,
+                                int64_t len_ns, void *opaque);
+void startup_profile_foreach(StartupProfileFunc *fn, void *opaque);
+
+/* Write the timeline to @f as a JSON object */
+void startup_profile_dump_json(FILE *f);
+
+#endif
@@ -71,6 +71,21 @@ static inline void (qemu_cond_wait)(QemuCond *cond, QemuMutex *mutex)
     qemu_cond_wait(cond, mutex);
 }
 
+/* Like qemu_cond_wait, but give up after @ns nanoseconds.  Returns false
+ * on timeout; spurious wakeups are possible as with qemu_cond_wait.
+ */
+bool qemu_cond_timedwait_impl(QemuCond *cond, QemuMutex *mutex, int64_t ns,
+                              const char *file, const int line);
+
+#define qemu_cond_timedwait(cond, mutex, ns) \
+        qemu_cond_timedwait_impl(cond, mutex, ns, __FILE__, __LINE__)
+
+static inline bool (qemu_cond_timedwait)(QemuCond *cond, QemuMutex *mutex,
+                                         int64_t ns)
+{
+    return qemu_cond_timedwait(cond, mutex, ns);
+}
+
 void qemu_sem_init(QemuSemaphore *sem, int init);
 void qemu_sem_post(QemuSemaphore *sem);
 void qemu_sem_wait(QemuSemaphore *sem);
@@ -66,12 +66,39 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    uint64_t seq;               /* arming order, breaks expire_time ties */
+    int heap_index;             /* position in the timer list's heap */
     int scale;
 };
 
 extern QEMUTimerListGroup main_loop_tlg;
 
+/* Upper bound for qemu_clock_set_virtual_scale() */
+#define MAX_CLOCK_SCALE 1000
+
+/**
+ * qemu_clock_set_virtual_scale:
+ * @scale: how many times faster than host time the virtual clock runs
+ *
+ * Tell the timer code that QEMU_CLOCK_VIRTUAL (and QEMU_CLOCK_VIRTUAL_RT)
+ * advance @scale nanoseconds per host nanosecond, so that the deadlines
+ * used to sleep in the main loop are converted to host time.  Only
+ * cpu_set_clock_scale() should call this.
+ */
+void qemu_clock_set_virtual_scale(int scale);
+
+/**
+ * qemu_clock_set_virtual_on_vcpu:
+ * @enable: whether the vCPU thread runs QEMU_CLOCK_VIRTUAL timers
+ *
+ * With @enable, qemu_clock_run_all_timers() leaves the main loop's
+ * QEMU_CLOCK_VIRTUAL timers to the vCPU thread.  It only notifies the
+ * clock when one of them is overdue, which the vCPU is expected to
+ * take as a request to leave translated code and run them.  Only
+ * cpu_set_vcpu_timers() should call this.
+ */
+void qemu_clock_set_virtual_on_vcpu(bool enable);
+
 /*
  * qemu_clock_get_ns;
  * @type: the clock type
@@ -208,6 +235,14 @@ void qemu_clock_enable(QEMUClockType type, bool enabled);
  */
 void qemu_start_warp_timer(void);
 
+/**
+ * qemu_idle_skip:
+ *
+ * Advance QEMU_CLOCK_VIRTUAL to its next deadline if all vCPUs are
+ * idle and idle skipping was enabled with cpu_set_idle_skip()
+ */
+void qemu_idle_skip(void);
+
 /**
  * qemu_clock_register_reset_notifier:
  * @type: the clock type
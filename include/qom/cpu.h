@@ -102,6 +102,8 @@ struct TranslationBlock;
  * @get_paging_enabled: Callback for inquiring whether paging is enabled.
  * @get_memory_mapping: Callback for obtaining the memory mappings.
  * @set_pc: Callback for setting the Program Counter register.
+ * @get_pc: Callback for getting the Program Counter register, if the
+ *   target supports it.
  * @synchronize_from_tb: Callback for synchronizing state from a TCG
  * #TranslationBlock.
  * @handle_mmu_fault: Callback for handling an MMU fault.
@@ -138,6 +140,14 @@ struct TranslationBlock;
  * @disas_set_info: Setup architecture specific components of disassembly info
  * @adjust_watchpoint_address: Perform a target-specific adjustment to an
  * address before attempting to match it against watchpoints.
+ * @profile_sample: For the sampling profiler, store the guest call stack in
+ * @frames, innermost first, and return how many frames there are; set
+ * @context to the exception being handled, or -1.  Called between TBs.
+ * @tb_exit: Optional callback, run each time execution returns from
+ * translated code to the cpu_exec loop; keep it cheap.
+ * @tlb_bits: log2 of the number of softmmu TLB entries per MMU mode a
+ * vCPU starts with, or 0 for the default.  Only hosts with resizable
+ * TLB tables honour it; the tables then grow at flush time when full.
  *
  * Represents a CPU family or model.
  */
@@ -174,6 +184,7 @@ typedef struct CPUClass {
     void (*get_memory_mapping)(CPUState *cpu, MemoryMappingList *list,
                                Error **errp);
     void (*set_pc)(CPUState *cpu, vaddr value);
+    vaddr (*get_pc)(CPUState *cpu);
     void (*synchronize_from_tb)(CPUState *cpu, struct TranslationBlock *tb);
     int (*handle_mmu_fault)(CPUState *cpu, vaddr address, int size, int rw,
                             int mmu_index);
@@ -206,9 +217,13 @@ typedef struct CPUClass {
     void (*disas_set_info)(CPUState *cpu, disassemble_info *info);
     vaddr (*adjust_watchpoint_address)(CPUState *cpu, vaddr addr, int len);
     void (*tcg_initialize)(void);
+    int (*profile_sample)(CPUState *cpu, vaddr *frames, int max_frames,
+                          int *context);
+    void (*tb_exit)(CPUState *cpu);
 
     /* Keep non-pointer data at the end to minimize holes.  */
     int gdb_num_core_regs;
+    int tlb_bits;
     bool gdb_stop_before_watchpoint;
 } CPUClass;
 
@@ -247,6 +262,28 @@ struct hax_vcpu_state;
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
+/* A tb_jmp_cache slot, only valid while @gen is the CPU's generation */
+typedef struct CPUJumpCacheEntry {
+    struct TranslationBlock *tb;
+    uint32_t gen;
+} CPUJumpCacheEntry;
+
+/* Branch targets remembered for tb_speculate(); a power of 2 */
+#define TB_SPECULATE_SIZE 16
+
+/* MMIO pages whose region io_readx()/io_writex() remember; a power of 2 */
+#define CPU_MMIO_CACHE_SIZE 16
+
+typedef struct CPUMMIOCacheEntry {
+    hwaddr iotlb;
+    MemTxAttrs attrs;
+    MemoryRegion *mr;
+    const struct MemoryRegionOps *ops;
+    void *opaque;
+    uint8_t read_sizes;     /* see memory_region_direct_sizes() */
+    uint8_t write_sizes;
+} CPUMMIOCacheEntry;
+
 /* work queue */
 
 /* The union type allows passing of 64 bit target pointers on 32 bit
@@ -269,12 +306,25 @@ typedef void (*run_on_cpu_func)(CPUState *cpu, run_on_cpu_data data);
 
 struct qemu_work_item;
 
+/* Counters for query-exec-stats, updated under the BQL but for @mmio */
+typedef struct CPUExecStats {
+    uint64_t exceptions;
+    uint64_t irqs;
+    uint64_t mmio;
+    int64_t halted_ns;
+    /* IRQs taken, indexed by vector; grown by cpu_exec_stats_irq() */
+    uint64_t *vector_irqs;
+    unsigned nr_vectors;
+} CPUExecStats;
+
 #define CPU_UNSET_NUMA_NODE_ID -1
 #define CPU_TRACE_DSTATE_MAX_EVENTS 32
 
 /**
  * CPUState:
  * @cpu_index: CPU index (informative).
+ * @cluster_index: Index of the group of CPUs, such as a board, that share
+ *   an address space; the gdbstub shows each group as a process.
  * @nr_cores: Number of cores within this CPU package.
  * @nr_threads: Number of threads within this CPU.
  * @running: #true if CPU is currently running (lockless).
@@ -287,6 +337,9 @@ struct qemu_work_item;
  * @stopped: Indicates the CPU has been artificially stopped.
  * @unplug: Indicates a pending CPU unplug request.
  * @crash_occurred: Indicates the OS reported a crash (panic) for this CPU
+ * @static_mapping: The CPU's virtual to physical mapping can never change,
+ * so TBs spanning two pages may be chained to directly.  Writes to the
+ * code still invalidate them through the physical page.
  * @singlestep_enabled: Flags for single-stepping.
  * @icount_extra: Instructions until next timer event.
  * @icount_decr: Low 16 bits: number of cycles left, only used in icount mode.
@@ -310,6 +363,13 @@ struct qemu_work_item;
  * @opaque: User data.
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
+ * @poll_mr: Pollable #MemoryRegion of the last MMIO read, if any.
+ * @poll_addr: Offset in @poll_mr of the last MMIO read.
+ * @poll_val: Value the last MMIO read returned.
+ * @poll_pc: Host Program Counter of the last MMIO read.
+ * @poll_count: Number of reads in a row that matched all the above.
+ * @mmio_cache: Regions of recently accessed MMIO pages, by iotlb entry.
+ *              Emptied with the TLB, and so on every flatview change.
  * @kvm_fd: vCPU file descriptor for KVM.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
@@ -319,6 +379,17 @@ struct qemu_work_item;
  * @ignore_memory_transaction_failures: Cached copy of the MachineState
  *    flag of the same name: allows the board to suppress calling of the
  *    CPU do_transaction_failed hook function.
+ * @exec_stats: Counters for query-exec-stats.
+ * @exec_insns: Guest instructions executed, counted a whole TB at a time
+ *    on entry, so TBs that exit early count instructions that did not run.
+ * @tb_edge_prev: For -tb-coverage mode=edges, the edge ID of the TB run
+ *    last, halved so that A->B and B->A are different edges.
+ * @quota_insns: For -cpu-quota, the @exec_insns at which this period's
+ *    instructions are used up; checked by every TB.
+ * @quota_cpu_time: Host CPU time spent in cpu_exec(), with -cpu-quota time.
+ * @quota_time: The @quota_cpu_time at which this period's is used up.
+ * @quota_exhausted: The vCPU used up its quota in this period.
+ * @quota_was_exhausted: It did so in the period before, too.
  *
  * State of one CPU core or thread.
  */
@@ -335,6 +406,10 @@ struct CPUState {
     HANDLE hThread;
 #endif
     int thread_id;
+    /* With -accel tcg,thread=pool: how the vCPU is scheduled, and the
+     * cpu->thread of the vCPU while no worker runs it */
+    int pool_state;
+    struct QemuThread *pool_parked;
     bool running, has_waiter;
     struct QemuCond *halt_cond;
     bool thread_kicked;
@@ -343,6 +418,7 @@ struct CPUState {
     bool stopped;
     bool unplug;
     bool crash_occurred;
+    bool static_mapping;
     bool exit_request;
     uint32_t cflags_next_tb;
     /* updates protected by BQL */
@@ -363,7 +439,36 @@ struct CPUState {
     void *env_ptr; /* CPUArchState */
 
     /* Accessed in parallel; all accesses must be atomic */
-    struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    CPUJumpCacheEntry tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    /* Bumped to invalidate every tb_jmp_cache entry at once */
+    uint32_t tb_jmp_cache_gen;
+
+    /* Most recent direct branch targets, for tb_speculate() */
+    struct {
+        vaddr pc;
+        vaddr cs_base;
+        uint32_t flags;
+    } tb_speculate[TB_SPECULATE_SIZE];
+    unsigned int tb_speculate_head;
+    unsigned int tb_speculate_count;
+
+    /* Hot TB to turn into a superblock, for tb_superblock() */
+    bool tb_hot;
+    vaddr tb_hot_pc;
+    vaddr tb_hot_cs_base;
+    uint32_t tb_hot_flags;
+    uint32_t tb_hot_cflags;
+
+    /* Records not yet handed to the -exec-trace writer */
+    struct ExecTraceBuffer *exec_trace;
+
+    /* The -sample-profile timer asked for a sample at the next TB */
+    bool profile_sample;
+
+    /* Virtual time spent halted, see cpu_halted_ns() */
+    int64_t halted_ns;
+    int64_t halted_since;
+    bool halt_accounted;
 
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
@@ -375,6 +480,9 @@ struct CPUState {
 
     QTAILQ_HEAD(watchpoints_head, CPUWatchpoint) watchpoints;
     CPUWatchpoint *watchpoint_hit;
+    /* The bytes of each page that watchpoints cover, see exec.c */
+    GHashTable *watchpoint_pages;
+    unsigned watchpoint_wide;
 
     void *opaque;
 
@@ -384,6 +492,15 @@ struct CPUState {
     uintptr_t mem_io_pc;
     vaddr mem_io_vaddr;
 
+    /* Busy-poll detection, see memory_region_set_pollable() */
+    MemoryRegion *poll_mr;
+    hwaddr poll_addr;
+    uint64_t poll_val;
+    uintptr_t poll_pc;
+    unsigned poll_count;
+
+    CPUMMIOCacheEntry mmio_cache[CPU_MMIO_CACHE_SIZE];
+
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
@@ -394,6 +511,7 @@ struct CPUState {
 
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index;
+    uint32_t cluster_index;
     uint32_t halted;
     uint32_t can_do_io;
     int32_t exception_index;
@@ -408,6 +526,16 @@ struct CPUState {
 
     bool ignore_memory_transaction_failures;
 
+    CPUExecStats exec_stats;
+    /* Also bumped by every TB, kept next to icount_decr for the same reason */
+    uint64_t exec_insns;
+    uint64_t quota_insns;
+    uint32_t tb_edge_prev;
+    int64_t quota_cpu_time;
+    int64_t quota_time;
+    bool quota_exhausted;
+    bool quota_was_exhausted;
+
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
        (absolute value) offset as small as possible.  This reduces code
@@ -440,13 +568,39 @@ extern struct CPUTailQ cpus;
 
 extern __thread CPUState *current_cpu;
 
+/* Only an entry's own CPU reads it, or bumps the generation; other
+ * threads may clear its tb.
+ */
 static inline void cpu_tb_jmp_cache_clear(CPUState *cpu)
 {
+    uint32_t gen = cpu->tb_jmp_cache_gen + 1;
     unsigned int i;
 
-    for (i = 0; i < TB_JMP_CACHE_SIZE; i++) {
-        atomic_set(&cpu->tb_jmp_cache[i], NULL);
+    /* Entries this old could match again: sweep them on wrap-around */
+    if (unlikely(gen == 0)) {
+        for (i = 0; i < TB_JMP_CACHE_SIZE; i++) {
+            atomic_set(&cpu->tb_jmp_cache[i].tb, NULL);
+        }
     }
+    atomic_set(&cpu->tb_jmp_cache_gen, gen);
+}
+
+static inline struct TranslationBlock *
+cpu_tb_jmp_cache_get(CPUState *cpu, unsigned int hash)
+{
+    CPUJumpCacheEntry *e = &cpu->tb_jmp_cache[hash];
+    struct TranslationBlock *tb = atomic_rcu_read(&e->tb);
+
+    return atomic_read(&e->gen) == cpu->tb_jmp_cache_gen ? tb : NULL;
+}
+
+static inline void cpu_tb_jmp_cache_set(CPUState *cpu, unsigned int hash,
+                                        struct TranslationBlock *tb)
+{
+    CPUJumpCacheEntry *e = &cpu->tb_jmp_cache[hash];
+
+    atomic_set(&e->gen, cpu->tb_jmp_cache_gen);
+    atomic_set(&e->tb, tb);
 }
 
 /**
@@ -793,6 +947,26 @@ bool cpu_exists(int64_t id);
  */
 CPUState *cpu_by_arch_id(int64_t id);
 
+/**
+ * cpu_account_halt:
+ * @cpu: The CPU.
+ * @halted: Whether the CPU is now waiting for work.
+ *
+ * Start or stop charging QEMU_CLOCK_VIRTUAL time to cpu_halted_ns().
+ * Called from the execution loop; repeated calls with the same @halted
+ * are cheap.
+ */
+void cpu_account_halt(CPUState *cpu, bool halted);
+
+/**
+ * cpu_halted_ns:
+ * @cpu: The CPU.
+ *
+ * Returns: The QEMU_CLOCK_VIRTUAL nanoseconds @cpu has spent halted
+ * with no work to do, including a halt still in progress.
+ */
+int64_t cpu_halted_ns(CPUState *cpu);
+
 /**
  * cpu_throttle_set:
  * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99.
@@ -1019,7 +1193,7 @@ void cpu_single_step(CPUState *cpu, int enabled);
 #define BP_MEM_WRITE          0x02
 #define BP_MEM_ACCESS         (BP_MEM_READ | BP_MEM_WRITE)
 #define BP_STOP_BEFORE_ACCESS 0x04
-/* 0x08 currently unused */
+#define BP_RUN_UNTIL          0x08
 #define BP_GDB                0x10
 #define BP_CPU                0x20
 #define BP_ANY                (BP_GDB | BP_CPU)
@@ -1055,6 +1229,28 @@ int cpu_watchpoint_remove(CPUState *cpu, vaddr addr,
 void cpu_watchpoint_remove_by_ref(CPUState *cpu, CPUWatchpoint *watchpoint);
 void cpu_watchpoint_remove_all(CPUState *cpu, int mask);
 
+/**
+ * cpu_exec_stats_irq:
+ * @cpu: The CPU that took the interrupt.
+ * @vector: The interrupt's vector number.
+ *
+ * Count an interrupt taken for query-exec-stats.  Interrupt controllers
+ * that know the vector call this as the CPU takes it; the BQL must be held.
+ */
+void cpu_exec_stats_irq(CPUState *cpu, unsigned vector);
+
+/**
+ * cpu_watchpoint_may_hit:
+ * @cpu: The CPU doing the access
+ * @addr: Virtual address of the access, which does not cross a page
+ * @len: Size of the access
+ * @flags: BP_MEM_READ or BP_MEM_WRITE
+ *
+ * Returns false if the access cannot hit a watchpoint, so that it need
+ * not go through the watchpoint checks.
+ */
+bool cpu_watchpoint_may_hit(CPUState *cpu, vaddr addr, vaddr len, int flags);
+
 /**
  * cpu_get_address_space:
  * @cpu: CPU to get address space from
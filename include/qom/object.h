@@ -380,7 +380,8 @@ typedef void (ObjectUnparent)(Object *obj);
  */
 typedef void (ObjectFree)(void *obj);
 
-#define OBJECT_CLASS_CAST_CACHE 4
+/* Slots of the per-class cast caches, a power of two */
+#define OBJECT_CLASS_CAST_CACHE 16
 
 /**
  * ObjectClass:
@@ -394,6 +395,9 @@ struct ObjectClass
     Type type;
     GSList *interfaces;
 
+    /* Type names this class was cast to, in the slot of the name's
+     * address, so that a hit is one pointer compare
+     */
     const char *object_cast_cache[OBJECT_CLASS_CAST_CACHE];
     const char *class_cast_cache[OBJECT_CLASS_CAST_CACHE];
 
@@ -522,6 +526,24 @@ struct TypeInfo
     ((type *)object_dynamic_cast_assert(OBJECT(obj), (name), \
                                         __FILE__, __LINE__, __func__))
 
+/**
+ * OBJECT_CHECK_HOT:
+ * @type: The C type to use for the return value.
+ * @obj: A derivative of @type to cast.
+ * @name: The QOM typename of @type
+ *
+ * Like OBJECT_CHECK(), for the cast macros of types that are cast on
+ * every instruction or device access, such as a CPU in its helpers or a
+ * device in its MMIO callbacks.  The check is only compiled into debug
+ * builds (configure --enable-debug); otherwise this is a plain C cast,
+ * as CPU() always is.
+ */
+#ifdef CONFIG_QOM_CAST_DEBUG_HOT
+#define OBJECT_CHECK_HOT(type, obj, name) OBJECT_CHECK(type, obj, name)
+#else
+#define OBJECT_CHECK_HOT(type, obj, name) ((type *)(obj))
+#endif
+
 /**
  * OBJECT_CLASS_CHECK:
  * @class_type: The C type to use for the return value.
@@ -793,9 +815,11 @@ const char *object_get_typename(const Object *obj);
  * @info: The #TypeInfo of the new type.
  *
  * @info and all of the strings it points to should exist for the life time
- * that the type is registered.
+ * that the type is registered.  The #Type is only created when the type is
+ * first looked up, which spares startup the cost of every type that is
+ * never used.
  *
- * Returns: the new #Type.
+ * Returns: %NULL; look the type up by name instead.
  */
 Type type_register_static(const TypeInfo *info);
 
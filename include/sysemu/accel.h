@@ -65,6 +65,12 @@ typedef struct AccelClass {
     OBJECT_GET_CLASS(AccelClass, (obj), TYPE_ACCEL)
 
 extern unsigned long tcg_tb_size;
+extern bool tcg_tb_size_auto;
+extern bool tcg_tb_profile;
+extern bool tcg_tb_speculate;
+extern bool tcg_tb_superblock;
+extern size_t tcg_tb_hot_size;
+extern bool tcg_cpu_quota;
 
 void configure_accelerator(MachineState *ms);
 /* Register accelerator specific global properties */
@@ -12,8 +12,16 @@ void cpu_stop_current(void);
 void cpu_ticks_init(void);
 
 void configure_icount(QemuOpts *opts, Error **errp);
+void configure_cpu_quota(QemuOpts *opts, Error **errp);
 extern int use_icount;
 extern int icount_align_option;
+void cpu_set_clock_scale(int scale);
+void cpu_set_idle_skip(bool enable);
+void cpu_set_poll_skip(bool enable);
+void cpu_set_vcpu_timers(bool enable);
+extern bool vcpu_timers;
+extern int64_t vcpu_timers_deadline;
+void qemu_poll_skip(CPUState *cpu);
 
 /* drift information for info jit command */
 extern int64_t max_delay;
@@ -18,6 +18,19 @@
 
 extern bool qtest_allowed;
 
+/* Opcodes of the binary "batch" command, shared with libqtest */
+#define QTEST_BATCH_READB       0x01
+#define QTEST_BATCH_READW       0x02
+#define QTEST_BATCH_READL       0x03
+#define QTEST_BATCH_READQ       0x04
+#define QTEST_BATCH_WRITEB      0x11
+#define QTEST_BATCH_WRITEW      0x12
+#define QTEST_BATCH_WRITEL      0x13
+#define QTEST_BATCH_WRITEQ      0x14
+#define QTEST_BATCH_CLOCK_STEP  0x20
+
+#define QTEST_BATCH_MAX_SIZE    (1 << 20)
+
 static inline bool qtest_enabled(void)
 {
     return qtest_allowed;
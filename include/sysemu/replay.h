@@ -42,6 +42,11 @@ enum ReplayCheckpoint {
 typedef enum ReplayCheckpoint ReplayCheckpoint;
 
 typedef struct ReplayNetState ReplayNetState;
+typedef struct ReplayDeviceState ReplayDeviceState;
+
+/* Handler of a device input event, see replay_register_device() */
+typedef void ReplayDeviceEventFn(void *opaque, const uint8_t *data,
+                                 size_t size);
 
 extern ReplayMode replay_mode;
 
@@ -167,6 +172,20 @@ void replay_unregister_net(ReplayNetState *rns);
 void replay_net_packet_event(ReplayNetState *rns, unsigned flags,
                              const struct iovec *iov, int iovcnt);
 
+/* Devices */
+
+/*! Registers a device input handler. Devices must register in the same
+    order when recording and replaying, e.g. from realize. */
+ReplayDeviceState *replay_register_device(ReplayDeviceEventFn *fn,
+                                          void *opaque);
+/*! Passes input from outside the VM (e.g. QMP) to the device handler,
+    through the log. Input is dropped while replaying. */
+void replay_device_event(ReplayDeviceState *rds, const uint8_t *data,
+                         size_t size);
+/*! Saves data a device takes from the host to the log, or replaces
+    it with the logged data while replaying. */
+void replay_device_data(uint8_t *buf, size_t size);
+
 /* Audio */
 
 /*! Saves/restores number of played samples of audio out operation. */
@@ -183,4 +202,18 @@ void replay_vmstate_init(void);
     can be created */
 bool replay_can_snapshot(void);
 
+/* Reverse debugging */
+
+/*! Goes back one instruction, for the gdbstub. Returns false when
+    there is no replay checkpoint to go back from. */
+bool replay_reverse_step(void);
+/*! Goes back to the last breakpoint or watchpoint hit, for the gdbstub.
+    Returns false when there is no replay checkpoint to go back from. */
+bool replay_reverse_continue(void);
+/*! Returns true while re-executing for reverse debugging, when
+    breakpoints must be passed rather than stopped at. */
+bool replay_running_debug(void);
+/*! Notes a breakpoint hit while re-executing for reverse debugging. */
+void replay_breakpoint(void);
+
 #endif
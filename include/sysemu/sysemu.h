@@ -85,6 +85,13 @@ void qemu_system_killed(int signal, pid_t pid);
 void qemu_system_reset(ShutdownCause reason);
 void qemu_system_guest_panicked(GuestPanicInformation *info);
 
+/* vl.c: main() is qemu_init(), qemu_main_loop() then qemu_cleanup() */
+void qemu_init(int argc, char **argv, char **envp);
+void qemu_main_loop(void);
+/* One iteration of qemu_main_loop(); true once QEMU should exit */
+bool qemu_main_loop_step(void);
+void qemu_cleanup(void);
+
 void qemu_add_exit_notifier(Notifier *notify);
 void qemu_remove_exit_notifier(Notifier *notify);
 
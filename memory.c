@@ -38,6 +38,7 @@
 
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
+unsigned memory_map_generation;
 static bool ioeventfd_update_pending;
 static bool global_dirty_log = false;
 
@@ -1062,6 +1063,8 @@ void memory_region_transaction_commit(void)
             }
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
+            /* Orders the new flat views before the bump */
+            atomic_mb_set(&memory_map_generation, memory_map_generation + 1);
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
@@ -1490,6 +1493,62 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
     }
 }
 
+MemTxResult memory_region_dispatch_burst(MemoryRegion *mr,
+                                         hwaddr addr,
+                                         uint32_t *data,
+                                         unsigned count,
+                                         bool is_write,
+                                         MemTxAttrs attrs)
+{
+    MemTxResult r = MEMTX_OK;
+    uint64_t val;
+    unsigned i;
+
+    if (mr->ops->access_burst && !(addr & 3) &&
+        int128_ge(mr->size, int128_make64(addr + count * 4)) &&
+        !memory_region_wrong_endianness(mr) &&
+        !(is_write && mr->ioeventfd_nb) &&
+        !trace_event_get_state_backends(is_write ?
+                                        TRACE_MEMORY_REGION_OPS_WRITE :
+                                        TRACE_MEMORY_REGION_OPS_READ)) {
+        mr->ops->access_burst(mr->opaque, addr, data, count, is_write);
+        return MEMTX_OK;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (is_write) {
+            r |= memory_region_dispatch_write(mr, addr + i * 4, data[i],
+                                              4, attrs);
+        } else {
+            r |= memory_region_dispatch_read(mr, addr + i * 4, &val,
+                                             4, attrs);
+            data[i] = val;
+        }
+    }
+    return r;
+}
+
+unsigned memory_region_direct_sizes(MemoryRegion *mr, bool is_write)
+{
+    const MemoryRegionOps *ops = mr->ops;
+    unsigned min, max, size, sizes = 0;
+
+    if ((is_write ? !ops->write : !ops->read) || ops->valid.accepts ||
+        mr->subpage || mr == &io_mem_notdirty) {
+        return 0;
+    }
+
+    min = ops->impl.min_access_size ? ops->impl.min_access_size : 1;
+    max = ops->impl.max_access_size ? ops->impl.max_access_size : 4;
+    if (memory_region_wrong_endianness(mr)) {
+        max = 1;
+    }
+    for (size = min; size <= max; size <<= 1) {
+        sizes |= size;
+    }
+    return sizes;
+}
+
 void memory_region_init_io(MemoryRegion *mr,
                            Object *owner,
                            const MemoryRegionOps *ops,
@@ -2183,6 +2242,16 @@ void memory_region_clear_global_locking(MemoryRegion *mr)
     mr->global_locking = false;
 }
 
+void memory_region_set_pollable(MemoryRegion *mr, bool pollable)
+{
+    mr->pollable = pollable;
+}
+
+void memory_region_set_direct_call(MemoryRegion *mr, bool direct_call)
+{
+    mr->direct_call = direct_call;
+}
+
 static bool userspace_eventfd_warning;
 
 void memory_region_add_eventfd(MemoryRegion *mr,
@@ -2802,6 +2871,20 @@ void address_space_destroy(AddressSpace *as)
     call_rcu(as, do_address_space_destroy, rcu);
 }
 
+void address_space_foreach_section(AddressSpace *as,
+                                   AddressSpaceSectionFn *fn, void *opaque)
+{
+    FlatView *view = address_space_get_flatview(as);
+    FlatRange *fr;
+
+    FOR_EACH_FLAT_RANGE(fr, view) {
+        MemoryRegionSection section = section_from_flat_range(fr, view);
+
+        fn(&section, opaque);
+    }
+    flatview_unref(view);
+}
+
 static const char *memory_region_type(MemoryRegion *mr)
 {
     if (memory_region_is_ram_device(mr)) {
@@ -0,0 +1,256 @@
+/*
+ * Content addressed page store for RAM migration
+ *
+ * Pages are kept in a file shared by any number of snapshots, keyed by
+ * the SHA-256 of their contents, so that a snapshot stream only has to
+ * carry the digest of a page that some snapshot already put there.
+ * The file is a header followed by records that are only ever appended:
+ *
+ *   magic "QEMUDDUP", be32 version, be32 page size
+ *   digest[DEDUP_DIGEST_LEN], page[page size]
+ *   ...
+ *
+ * Several QEMUs may use one store.  Appending takes an exclusive flock
+ * and first indexes what others appended since; a lookup that misses
+ * does the same under a shared lock.  A record cut short by a crash is
+ * ignored, and overwritten by the next append.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/file.h>
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "crypto/hash.h"
+#include "dedup.h"
+
+#define DEDUP_MAGIC     "QEMUDDUP"
+#define DEDUP_VERSION   1
+
+typedef struct DedupHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+} DedupHeader;
+
+typedef struct DedupRecord {
+    uint8_t digest[DEDUP_DIGEST_LEN];
+    off_t offset;
+} DedupRecord;
+
+struct DedupStore {
+    int fd;
+    size_t page_size;
+    /* File size up to which all records are indexed */
+    off_t indexed;
+    /* digest -> DedupRecord, the key points into the value */
+    GHashTable *index;
+};
+
+static guint dedup_digest_hash(gconstpointer key)
+{
+    guint h;
+
+    /* The digest is uniformly distributed already */
+    memcpy(&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean dedup_digest_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, DEDUP_DIGEST_LEN);
+}
+
+static size_t dedup_record_size(DedupStore *ds)
+{
+    return DEDUP_DIGEST_LEN + ds->page_size;
+}
+
+/* Index the records appended since the last call; the caller holds the
+ * lock.  A trailing partial record is left out.
+ */
+static int dedup_store_scan(DedupStore *ds, Error **errp)
+{
+    struct stat st;
+    DedupRecord *rec;
+
+    if (fstat(ds->fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Could not stat dedup store");
+        return -1;
+    }
+    while (ds->indexed + dedup_record_size(ds) <= st.st_size) {
+        rec = g_new(DedupRecord, 1);
+        if (pread(ds->fd, rec->digest, DEDUP_DIGEST_LEN, ds->indexed) !=
+            DEDUP_DIGEST_LEN) {
+            error_setg_errno(errp, errno, "Could not read dedup store");
+            g_free(rec);
+            return -1;
+        }
+        rec->offset = ds->indexed + DEDUP_DIGEST_LEN;
+        if (!g_hash_table_contains(ds->index, rec->digest)) {
+            g_hash_table_insert(ds->index, rec->digest, rec);
+        } else {
+            g_free(rec);
+        }
+        ds->indexed += dedup_record_size(ds);
+    }
+    return 0;
+}
+
+static int dedup_store_lock(DedupStore *ds, int op, Error **errp)
+{
+    int ret;
+
+    do {
+        ret = flock(ds->fd, op);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        error_setg_errno(errp, errno, "Could not lock dedup store");
+    }
+    return ret;
+}
+
+DedupStore *dedup_store_open(const char *path, size_t page_size,
+                             Error **errp)
+{
+    DedupStore *ds = g_new0(DedupStore, 1);
+    DedupHeader hdr;
+    ssize_t len;
+
+    ds->page_size = page_size;
+    ds->indexed = sizeof(hdr);
+    ds->index = g_hash_table_new_full(dedup_digest_hash, dedup_digest_equal,
+                                      NULL, g_free);
+    ds->fd = qemu_open(path, O_RDWR | O_CREAT, 0644);
+    if (ds->fd < 0) {
+        error_setg_errno(errp, errno, "Could not open dedup store '%s'",
+                         path);
+        goto fail;
+    }
+    if (dedup_store_lock(ds, LOCK_EX, errp) < 0) {
+        goto fail;
+    }
+
+    len = pread(ds->fd, &hdr, sizeof(hdr), 0);
+    if (len == 0) {
+        memcpy(hdr.magic, DEDUP_MAGIC, sizeof(hdr.magic));
+        hdr.version = cpu_to_be32(DEDUP_VERSION);
+        hdr.page_size = cpu_to_be32(page_size);
+        len = pwrite(ds->fd, &hdr, sizeof(hdr), 0);
+        if (len != sizeof(hdr)) {
+            error_setg_errno(errp, errno, "Could not write dedup store '%s'",
+                             path);
+            goto fail_unlock;
+        }
+    } else if (len != sizeof(hdr) ||
+               memcmp(hdr.magic, DEDUP_MAGIC, sizeof(hdr.magic)) ||
+               be32_to_cpu(hdr.version) != DEDUP_VERSION) {
+        error_setg(errp, "'%s' is not a dedup store", path);
+        goto fail_unlock;
+    } else if (be32_to_cpu(hdr.page_size) != page_size) {
+        error_setg(errp, "Dedup store '%s' holds pages of %u bytes, not %zu",
+                   path, be32_to_cpu(hdr.page_size), page_size);
+        goto fail_unlock;
+    }
+
+    if (dedup_store_scan(ds, errp) < 0) {
+        goto fail_unlock;
+    }
+    dedup_store_lock(ds, LOCK_UN, NULL);
+    return ds;
+
+fail_unlock:
+    dedup_store_lock(ds, LOCK_UN, NULL);
+fail:
+    dedup_store_close(ds);
+    return NULL;
+}
+
+void dedup_store_close(DedupStore *ds)
+{
+    if (ds->fd >= 0) {
+        qemu_close(ds->fd);
+    }
+    g_hash_table_destroy(ds->index);
+    g_free(ds);
+}
+
+int dedup_page_digest(const uint8_t *page, size_t page_size,
+                      uint8_t *digest, Error **errp)
+{
+    uint8_t *result = digest;
+    size_t len = DEDUP_DIGEST_LEN;
+
+    return qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, (const char *)page,
+                              page_size, &result, &len, errp);
+}
+
+/* Make sure the page with @digest is in the store.  @page is only
+ * written if neither we nor anyone else has put it there before.
+ */
+int dedup_store_add(DedupStore *ds, const uint8_t *digest,
+                    const uint8_t *page, Error **errp)
+{
+    int ret = -1;
+
+    if (g_hash_table_contains(ds->index, digest)) {
+        return 0;
+    }
+    if (dedup_store_lock(ds, LOCK_EX, errp) < 0) {
+        return -1;
+    }
+    if (dedup_store_scan(ds, errp) < 0) {
+        goto out;
+    }
+    if (g_hash_table_contains(ds->index, digest)) {
+        ret = 0;
+        goto out;
+    }
+
+    /* Behind a partial record, if there is one */
+    if (ftruncate(ds->fd, ds->indexed) < 0 ||
+        lseek(ds->fd, ds->indexed, SEEK_SET) < 0) {
+        error_setg_errno(errp, errno, "Could not extend dedup store");
+        goto out;
+    }
+    if (qemu_write_full(ds->fd, digest, DEDUP_DIGEST_LEN) != DEDUP_DIGEST_LEN ||
+        qemu_write_full(ds->fd, page, ds->page_size) != ds->page_size) {
+        error_setg_errno(errp, errno, "Could not write dedup store");
+        goto out;
+    }
+    ret = dedup_store_scan(ds, errp);
+
+out:
+    dedup_store_lock(ds, LOCK_UN, NULL);
+    return ret;
+}
+
+/* Read the page with @digest into @page */
+int dedup_store_lookup(DedupStore *ds, const uint8_t *digest, uint8_t *page,
+                       Error **errp)
+{
+    DedupRecord *rec = g_hash_table_lookup(ds->index, digest);
+
+    if (!rec) {
+        if (dedup_store_lock(ds, LOCK_SH, errp) < 0) {
+            return -1;
+        }
+        dedup_store_scan(ds, errp);
+        dedup_store_lock(ds, LOCK_UN, NULL);
+        rec = g_hash_table_lookup(ds->index, digest);
+        if (!rec) {
+            if (errp && !*errp) {
+                error_setg(errp, "Page missing from dedup store");
+            }
+            return -1;
+        }
+    }
+    if (pread(ds->fd, page, ds->page_size, rec->offset) != ds->page_size) {
+        error_setg_errno(errp, errno, "Could not read dedup store");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * Content addressed page store for RAM migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_DEDUP_H
+#define QEMU_MIGRATION_DEDUP_H
+
+/* SHA-256 of the page contents */
+#define DEDUP_DIGEST_LEN 32
+
+typedef struct DedupStore DedupStore;
+
+DedupStore *dedup_store_open(const char *path, size_t page_size,
+                             Error **errp);
+void dedup_store_close(DedupStore *ds);
+
+int dedup_page_digest(const uint8_t *page, size_t page_size,
+                      uint8_t *digest, Error **errp);
+int dedup_store_add(DedupStore *ds, const uint8_t *digest,
+                    const uint8_t *page, Error **errp);
+int dedup_store_lookup(DedupStore *ds, const uint8_t *digest, uint8_t *page,
+                       Error **errp);
+#endif
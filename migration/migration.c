@@ -75,6 +75,9 @@
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Largest RAM the x-stop-copy capability sends in one pause by default */
+#define DEFAULT_MIGRATE_X_STOP_COPY_LIMIT (1024 * 1024)
+
 /* The delay time (in ms) between two COLO checkpoints
  * Note: Please change this default value to 10000 when we support hybrid mode.
  */
@@ -556,6 +559,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->x_multifd_page_count = s->parameters.x_multifd_page_count;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
+    params->has_x_dedup_store = true;
+    params->x_dedup_store = g_strdup(s->parameters.x_dedup_store);
+    params->has_x_stop_copy_limit = true;
+    params->x_stop_copy_limit = s->parameters.x_stop_copy_limit;
 
     return params;
 }
@@ -959,6 +966,12 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
+    if (params->has_x_dedup_store) {
+        dest->x_dedup_store = params->x_dedup_store;
+    }
+    if (params->has_x_stop_copy_limit) {
+        dest->x_stop_copy_limit = params->x_stop_copy_limit;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1031,6 +1044,13 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
     }
+    if (params->has_x_dedup_store) {
+        g_free(s->parameters.x_dedup_store);
+        s->parameters.x_dedup_store = g_strdup(params->x_dedup_store);
+    }
+    if (params->has_x_stop_copy_limit) {
+        s->parameters.x_stop_copy_limit = params->x_stop_copy_limit;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -1543,6 +1563,25 @@ bool migrate_release_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_RELEASE_RAM];
 }
 
+bool migrate_snapshot_plans(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_SNAPSHOT_PLANS];
+}
+
+bool migrate_stop_copy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_STOP_COPY] &&
+           ram_bytes_total() <= s->parameters.x_stop_copy_limit;
+}
+
 bool migrate_postcopy_ram(void)
 {
     MigrationState *s;
@@ -1693,6 +1732,15 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->parameters.xbzrle_cache_size;
 }
 
+const char *migrate_dedup_store(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_dedup_store;
+}
+
 bool migrate_use_block(void)
 {
     MigrationState *s;
@@ -2309,6 +2357,13 @@ static MigIterateState migration_iteration_run(MigrationState *s)
     uint64_t pending_size, pend_pre, pend_compat, pend_post;
     bool in_postcopy = s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE;
 
+    if (!in_postcopy && migrate_stop_copy()) {
+        /* Small enough to send in the one pause, with no rounds before */
+        trace_migration_thread_stop_copy(ram_bytes_total());
+        migration_completion(s);
+        return MIG_ITERATE_BREAK;
+    }
+
     qemu_savevm_state_pending(s->to_dst_file, s->threshold_size, &pend_pre,
                               &pend_compat, &pend_post);
     pending_size = pend_pre + pend_compat + pend_post;
@@ -2572,6 +2627,9 @@ static Property migration_properties[] = {
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
+    DEFINE_PROP_SIZE("x-stop-copy-limit", MigrationState,
+                      parameters.x_stop_copy_limit,
+                      DEFAULT_MIGRATE_X_STOP_COPY_LIMIT),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -2586,6 +2644,9 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_X_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-snapshot-plans",
+                        MIGRATION_CAPABILITY_X_SNAPSHOT_PLANS),
+    DEFINE_PROP_MIG_CAP("x-stop-copy", MIGRATION_CAPABILITY_X_STOP_COPY),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -2606,6 +2667,7 @@ static void migration_instance_finalize(Object *obj)
     qemu_mutex_destroy(&ms->error_mutex);
     g_free(params->tls_hostname);
     g_free(params->tls_creds);
+    g_free(params->x_dedup_store);
     qemu_sem_destroy(&ms->pause_sem);
     error_free(ms->error);
 }
@@ -2622,6 +2684,7 @@ static void migration_instance_init(Object *obj)
 
     params->tls_hostname = g_strdup("");
     params->tls_creds = g_strdup("");
+    params->x_dedup_store = g_strdup("");
 
     /* Set has_* up only for parameter checks */
     params->has_compress_level = true;
@@ -2636,6 +2699,7 @@ static void migration_instance_init(Object *obj)
     params->has_x_multifd_channels = true;
     params->has_x_multifd_page_count = true;
     params->has_xbzrle_cache_size = true;
+    params->has_x_stop_copy_limit = true;
 }
 
 /*
@@ -219,6 +219,8 @@ MigrationState *migrate_get_current(void);
 bool migrate_postcopy(void);
 
 bool migrate_release_ram(void);
+bool migrate_snapshot_plans(void);
+bool migrate_stop_copy(void);
 bool migrate_postcopy_ram(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
@@ -231,6 +233,7 @@ int migrate_multifd_page_count(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
+const char *migrate_dedup_store(void);
 bool migrate_colo_enabled(void);
 
 bool migrate_use_block(void);
@@ -34,6 +34,7 @@
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
 #include "xbzrle.h"
+#include "dedup.h"
 #include "ram.h"
 #include "migration.h"
 #include "migration/register.h"
@@ -48,6 +49,7 @@
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "exec/target_page.h"
+#include "exec/exec-all.h"
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
 #include "migration/block.h"
@@ -70,6 +72,8 @@
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* The digest of a page in the dedup store, see dedup.c */
+#define RAM_SAVE_FLAG_DEDUP    0x200
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
@@ -237,6 +241,9 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, RAMSrcPageRequest) src_page_requests;
+    /* Page store for x-dedup-store, and a copy of the page being hashed */
+    DedupStore *dedup;
+    uint8_t *dedup_buf;
 };
 typedef struct RAMState RAMState;
 
@@ -1040,6 +1047,39 @@ static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
     return 1;
 }
 
+/*
+ * send the digest of the page, after putting it in the dedup store
+ *
+ * Returns the number of pages written, -1 to send the page itself.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @buf: the page to be sent
+ */
+static int save_dedup_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
+                           uint8_t *buf)
+{
+    uint8_t digest[DEDUP_DIGEST_LEN];
+    Error *local_err = NULL;
+
+    /* The guest may write the page while we hash it */
+    memcpy(rs->dedup_buf, buf, TARGET_PAGE_SIZE);
+    if (dedup_page_digest(rs->dedup_buf, TARGET_PAGE_SIZE, digest,
+                          &local_err) < 0 ||
+        dedup_store_add(rs->dedup, digest, rs->dedup_buf, &local_err) < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+
+    ram_counters.transferred += save_page_header(rs, rs->f, block,
+                                                 offset | RAM_SAVE_FLAG_DEDUP);
+    qemu_put_buffer(rs->f, digest, DEDUP_DIGEST_LEN);
+    ram_counters.transferred += DEDUP_DIGEST_LEN;
+    ram_counters.normal++;
+    return 1;
+}
+
 /**
  * ram_save_page: send the given page to the stream
  *
@@ -1065,6 +1105,13 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     p = block->host + offset;
     trace_ram_save_page(block->idstr, (uint64_t)offset, p);
 
+    if (rs->dedup && !migration_in_postcopy()) {
+        pages = save_dedup_page(rs, block, offset, p);
+        if (pages >= 0) {
+            return pages;
+        }
+    }
+
     XBZRLE_cache_lock();
     if (!rs->ram_bulk_stage && !migration_in_postcopy() &&
         migrate_use_xbzrle()) {
@@ -1640,6 +1687,10 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        if ((*rsp)->dedup) {
+            dedup_store_close((*rsp)->dedup);
+            g_free((*rsp)->dedup_buf);
+        }
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
@@ -2221,6 +2272,20 @@ static int ram_init_all(RAMState **rsp)
         return -1;
     }
 
+    if (*migrate_dedup_store()) {
+        Error *local_err = NULL;
+
+        (*rsp)->dedup = dedup_store_open(migrate_dedup_store(),
+                                         TARGET_PAGE_SIZE, &local_err);
+        if (!(*rsp)->dedup) {
+            error_report_err(local_err);
+            xbzrle_cleanup();
+            ram_state_cleanup(rsp);
+            return -1;
+        }
+        (*rsp)->dedup_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
     ram_init_bitmaps(*rsp);
 
     return 0;
@@ -2473,6 +2538,35 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
     return 0;
 }
 
+/* The destination's dedup store, opened at the first page from it */
+static DedupStore *dedup_load_store;
+
+static int load_dedup(QEMUFile *f, ram_addr_t addr, void *host)
+{
+    uint8_t digest[DEDUP_DIGEST_LEN];
+    Error *local_err = NULL;
+
+    qemu_get_buffer(f, digest, DEDUP_DIGEST_LEN);
+
+    if (!dedup_load_store) {
+        if (!*migrate_dedup_store()) {
+            error_report("Received a dedup page, but x-dedup-store is not set");
+            return -1;
+        }
+        dedup_load_store = dedup_store_open(migrate_dedup_store(),
+                                            TARGET_PAGE_SIZE, &local_err);
+        if (!dedup_load_store) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+    if (dedup_store_lookup(dedup_load_store, digest, host, &local_err) < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * ram_block_from_stream: read a RAMBlock id from the migration stream
  *
@@ -2748,6 +2842,10 @@ static int ram_load_cleanup(void *opaque)
     RAMBlock *rb;
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
+    if (dedup_load_store) {
+        dedup_store_close(dedup_load_store);
+        dedup_load_store = NULL;
+    }
 
     RAMBLOCK_FOREACH(rb) {
         g_free(rb->receivedmap);
@@ -2983,7 +3081,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
-                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
+                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE |
+                     RAM_SAVE_FLAG_DEDUP)) {
             RAMBlock *block = ram_block_from_stream(f, flags);
 
             host = host_from_ram_block_offset(block, addr);
@@ -3072,6 +3171,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+
+        case RAM_SAVE_FLAG_DEDUP:
+            if (load_dedup(f, addr, host) < 0) {
+                error_report("Failed to load dedup page at " RAM_ADDR_FMT,
+                             addr);
+                ret = -EINVAL;
+            }
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -3095,6 +3202,211 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     return ret;
 }
 
+/*
+ * In-memory RAM snapshots, for snapshot-save-ram/snapshot-load-ram and
+ * replay checkpoints.
+ *
+ * A snapshot keeps a copy of every RAMBlock in the process.  One snapshot
+ * at a time may track dirty pages: the DIRTY_MEMORY_MIGRATION log is kept
+ * running from its save onwards, so that loading it only copies back the
+ * pages written since.  ROM and ROM device blocks are written behind the
+ * dirty log (by MMIO callbacks or the ROM loader) and are compared page
+ * by page instead; so is everything after a migration has used the log,
+ * and so are snapshots that do not track.
+ */
+
+typedef struct {
+    char *idstr;
+    ram_addr_t length;
+    uint8_t *copy;
+    /* Guest writes to the block show up in the dirty log */
+    bool tracked;
+} RAMSnapshotBlock;
+
+struct RAMSnapshot {
+    RAMSnapshotBlock *blocks;
+    int nb_blocks;
+};
+
+static struct {
+    /* The snapshot that owns the dirty log, if any */
+    RAMSnapshot *owner;
+    /* The dirty log has not been touched by anyone else since */
+    bool valid;
+    bool notifier_added;
+    Notifier migration_state;
+} ram_snapshot_tracking;
+
+static bool ram_snapshot_block_tracked(RAMBlock *rb)
+{
+    return memory_region_is_ram(rb->mr) && !rb->mr->readonly &&
+           !rb->mr->rom_device && !memory_region_is_ram_device(rb->mr);
+}
+
+static void ram_snapshot_migration_state(Notifier *notifier, void *data)
+{
+    /* Migration syncs and stops the dirty log behind our back */
+    ram_snapshot_tracking.valid = false;
+}
+
+/* Clear the dirty log of the tracked blocks and make sure it runs */
+static void ram_snapshot_start_tracking(RAMSnapshot *rs)
+{
+    RAMBlock *rb;
+    int i;
+
+    if (!ram_snapshot_tracking.notifier_added) {
+        ram_snapshot_tracking.migration_state.notify =
+            ram_snapshot_migration_state;
+        add_migration_state_change_notifier(
+            &ram_snapshot_tracking.migration_state);
+        ram_snapshot_tracking.notifier_added = true;
+    }
+    if (ram_snapshot_tracking.owner == rs && ram_snapshot_tracking.valid) {
+        return;
+    }
+    if (!ram_snapshot_tracking.owner || !ram_snapshot_tracking.valid) {
+        memory_global_dirty_log_start();
+    }
+    memory_global_dirty_log_sync();
+    for (i = 0; i < rs->nb_blocks; i++) {
+        rb = qemu_ram_block_by_name(rs->blocks[i].idstr);
+        if (rb && rs->blocks[i].tracked) {
+            cpu_physical_memory_test_and_clear_dirty(rb->offset,
+                                                     rb->used_length,
+                                                     DIRTY_MEMORY_MIGRATION);
+        }
+    }
+    ram_snapshot_tracking.owner = rs;
+    ram_snapshot_tracking.valid = true;
+}
+
+static bool ram_snapshot_is_tracking(RAMSnapshot *rs)
+{
+    return ram_snapshot_tracking.owner == rs && ram_snapshot_tracking.valid;
+}
+
+void ram_snapshot_free(RAMSnapshot *rs)
+{
+    int i;
+
+    if (!rs) {
+        return;
+    }
+    if (ram_snapshot_tracking.owner == rs) {
+        if (ram_snapshot_tracking.valid) {
+            memory_global_dirty_log_stop();
+        }
+        ram_snapshot_tracking.owner = NULL;
+        ram_snapshot_tracking.valid = false;
+    }
+    for (i = 0; i < rs->nb_blocks; i++) {
+        g_free(rs->blocks[i].idstr);
+        g_free(rs->blocks[i].copy);
+    }
+    g_free(rs->blocks);
+    g_free(rs);
+}
+
+/*
+ * Take a copy of all guest RAM; the VM must be stopped.  With @track the
+ * snapshot takes over the dirty log from any other one.
+ */
+RAMSnapshot *ram_snapshot_save(bool track)
+{
+    RAMSnapshot *rs = g_new0(RAMSnapshot, 1);
+    RAMSnapshotBlock *sb;
+    RAMBlock *rb;
+    int n = 0;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(rb) {
+        n++;
+    }
+    rs->blocks = g_new0(RAMSnapshotBlock, n);
+    RAMBLOCK_FOREACH(rb) {
+        sb = &rs->blocks[rs->nb_blocks++];
+        sb->idstr = g_strdup(rb->idstr);
+        sb->length = rb->used_length;
+        sb->copy = g_malloc(rb->used_length);
+        memcpy(sb->copy, rb->host, rb->used_length);
+        sb->tracked = ram_snapshot_block_tracked(rb);
+    }
+    if (track) {
+        ram_snapshot_start_tracking(rs);
+    }
+    rcu_read_unlock();
+    return rs;
+}
+
+/*
+ * Copy back the pages that changed since @rs was saved; the VM must be
+ * stopped.  Fails without touching RAM if the blocks have changed.
+ */
+int ram_snapshot_load(RAMSnapshot *rs, Error **errp)
+{
+    RAMSnapshotBlock *sb;
+    RAMBlock *rb;
+    ram_addr_t offset;
+    uint64_t pages = 0, restored = 0;
+    bool tracking = ram_snapshot_is_tracking(rs);
+    bool dirty;
+    int i;
+
+    rcu_read_lock();
+    for (i = 0; i < rs->nb_blocks; i++) {
+        sb = &rs->blocks[i];
+        rb = qemu_ram_block_by_name(sb->idstr);
+        if (!rb || rb->used_length != sb->length) {
+            error_setg(errp, "RAM block '%s' has changed since the snapshot",
+                       sb->idstr);
+            rcu_read_unlock();
+            return -EINVAL;
+        }
+    }
+
+    if (tracking) {
+        memory_global_dirty_log_sync();
+    }
+    for (i = 0; i < rs->nb_blocks; i++) {
+        sb = &rs->blocks[i];
+        rb = qemu_ram_block_by_name(sb->idstr);
+        for (offset = 0; offset < sb->length; offset += TARGET_PAGE_SIZE) {
+            if (sb->tracked && tracking) {
+                dirty = cpu_physical_memory_test_and_clear_dirty(
+                            rb->offset + offset, TARGET_PAGE_SIZE,
+                            DIRTY_MEMORY_MIGRATION);
+            } else {
+                dirty = memcmp(rb->host + offset, sb->copy + offset,
+                               TARGET_PAGE_SIZE) != 0;
+            }
+            if (dirty) {
+                memcpy(rb->host + offset, sb->copy + offset,
+                       TARGET_PAGE_SIZE);
+                if (!tracking) {
+                    /* Let the snapshot that tracks see the change */
+                    cpu_physical_memory_set_dirty_range(rb->offset + offset,
+                                                        TARGET_PAGE_SIZE,
+                                                        DIRTY_CLIENTS_NOCODE);
+                }
+                restored++;
+            }
+            pages++;
+        }
+    }
+    if (ram_snapshot_tracking.owner == rs) {
+        ram_snapshot_start_tracking(rs);
+    }
+    rcu_read_unlock();
+
+    /* Code may have been translated from what was just overwritten */
+    if (restored) {
+        tb_flush(first_cpu);
+    }
+    trace_ram_snapshot_load(restored, pages);
+    return 0;
+}
+
 static bool ram_has_postcopy(void *opaque)
 {
     return migrate_postcopy_ram();
@@ -59,6 +59,11 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
+typedef struct RAMSnapshot RAMSnapshot;
+RAMSnapshot *ram_snapshot_save(bool track);
+int ram_snapshot_load(RAMSnapshot *rs, Error **errp);
+void ram_snapshot_free(RAMSnapshot *rs);
+
 int ramblock_recv_bitmap_test(RAMBlock *rb, void *host_addr);
 bool ramblock_recv_bitmap_test_byte_offset(RAMBlock *rb, uint64_t byte_offset);
 void ramblock_recv_bitmap_set(RAMBlock *rb, void *host_addr);
@@ -1321,12 +1321,21 @@ done:
     return ret;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+/*
+ * Save all non-RAM state, except for the entries in @skip if not NULL.
+ * With @header the stream starts with the same header as a migration,
+ * configuration section included, as qemu_loadvm_state() expects.
+ */
+static int qemu_save_device_state(QEMUFile *f, bool header, GHashTable *skip)
 {
     SaveStateEntry *se;
 
-    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
-    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
+    if (header) {
+        qemu_savevm_state_header(f);
+    } else {
+        qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
+        qemu_put_be32(f, QEMU_VM_FILE_VERSION);
+    }
 
     cpu_synchronize_all_states();
 
@@ -1342,6 +1351,9 @@ static int qemu_save_device_state(QEMUFile *f)
         if (se->vmsd && !vmstate_save_needed(se->vmsd, se->opaque)) {
             continue;
         }
+        if (skip && g_hash_table_contains(skip, se)) {
+            continue;
+        }
 
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
 
@@ -2353,7 +2365,7 @@ void qmp_xen_save_devices_state(const char *filename, bool has_live, bool live,
     qio_channel_set_name(QIO_CHANNEL(ioc), "migration-xen-save-state");
     f = qemu_fopen_channel_output(QIO_CHANNEL(ioc));
     object_unref(OBJECT(ioc));
-    ret = qemu_save_device_state(f);
+    ret = qemu_save_device_state(f, false, NULL);
     if (ret < 0 || qemu_fclose(f) < 0) {
         error_setg(errp, QERR_IO_ERROR);
     } else {
@@ -2409,6 +2421,242 @@ void qmp_xen_load_devices_state(const char *filename, Error **errp)
     migration_incoming_state_destroy();
 }
 
+typedef struct MemSnapshotPlanned {
+    SaveStateEntry *se;
+    VMStatePlan *plan;
+    size_t offset;
+} MemSnapshotPlanned;
+
+struct MemSnapshot {
+    uint8_t *devices;
+    size_t devices_size;
+    RAMSnapshot *ram;
+    /* With x-snapshot-plans, devices copied outside of the stream */
+    GArray *planned;
+    uint8_t *planned_data;
+};
+
+/*
+ * Pick the devices whose state a VMStatePlan can copy, and size their
+ * share of the snapshot.  They are left out of the stream.
+ */
+static GArray *mem_snapshot_plan(GHashTable *skip, size_t *size)
+{
+    GArray *planned = g_array_new(false, false, sizeof(MemSnapshotPlanned));
+    MemSnapshotPlanned p;
+    SaveStateEntry *se;
+
+    *size = 0;
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->is_ram || se->ops || !se->vmsd ||
+            !vmstate_save_needed(se->vmsd, se->opaque)) {
+            continue;
+        }
+        p.plan = vmstate_plan_get(se->vmsd);
+        if (!p.plan) {
+            continue;
+        }
+        p.se = se;
+        p.offset = *size;
+        *size += vmstate_plan_size(p.plan);
+        g_array_append_val(planned, p);
+        g_hash_table_add(skip, se);
+    }
+    return planned;
+}
+
+static bool mem_snapshot_se_registered(SaveStateEntry *se)
+{
+    SaveStateEntry *s;
+
+    QTAILQ_FOREACH(s, &savevm_state.handlers, entry) {
+        if (s == se) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Save device state and RAM in memory.  With @track_dirty, RAM written
+ * from now on is tracked so that loading copies back only those pages;
+ * only the latest snapshot saved that way keeps tracking.
+ */
+MemSnapshot *mem_snapshot_save(bool track_dirty, Error **errp)
+{
+    MemSnapshot *ms = NULL;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    GHashTable *skip = NULL;
+    GArray *planned = NULL;
+    uint8_t *planned_data = NULL;
+    size_t planned_size;
+    int ret;
+    int i;
+
+    if (migrate_snapshot_plans()) {
+        skip = g_hash_table_new(NULL, NULL);
+        planned = mem_snapshot_plan(skip, &planned_size);
+        planned_data = g_malloc(planned_size);
+    }
+
+    bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "mem-snapshot-buffer");
+    f = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    ret = qemu_save_device_state(f, true, skip);
+    qemu_fflush(f);
+    for (i = 0; planned && !ret && i < planned->len; i++) {
+        MemSnapshotPlanned *p = &g_array_index(planned, MemSnapshotPlanned, i);
+
+        ret = vmstate_plan_save(p->plan, p->se->opaque,
+                                planned_data + p->offset);
+    }
+    if (ret < 0 || qemu_file_get_error(f)) {
+        error_setg(errp, QERR_IO_ERROR);
+        if (planned) {
+            g_array_free(planned, true);
+        }
+        g_free(planned_data);
+    } else {
+        ms = g_new0(MemSnapshot, 1);
+        ms->devices_size = bioc->usage;
+        ms->devices = g_memdup(bioc->data, bioc->usage);
+        ms->planned = planned;
+        ms->planned_data = planned_data;
+        ms->ram = ram_snapshot_save(track_dirty);
+    }
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+    if (skip) {
+        g_hash_table_destroy(skip);
+    }
+    return ms;
+}
+
+int mem_snapshot_load(MemSnapshot *ms, Error **errp)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+    int i;
+
+    /* As for loadvm, devices without state start over from reset */
+    qemu_system_reset(SHUTDOWN_CAUSE_NONE);
+    ret = ram_snapshot_load(ms->ram, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; ms->planned && i < ms->planned->len; i++) {
+        MemSnapshotPlanned *p = &g_array_index(ms->planned,
+                                               MemSnapshotPlanned, i);
+
+        if (!mem_snapshot_se_registered(p->se)) {
+            error_setg(errp, "Device '%s' of the snapshot is gone",
+                       p->se->idstr);
+            return -EINVAL;
+        }
+        ret = vmstate_plan_load(p->plan, p->se->opaque,
+                                ms->planned_data + p->offset);
+        if (ret < 0) {
+            error_setg(errp, "Error %d while loading '%s'", ret,
+                       p->se->idstr);
+            return ret;
+        }
+    }
+
+    bioc = qio_channel_buffer_new(ms->devices_size);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "mem-snapshot-buffer");
+    memcpy(bioc->data, ms->devices, ms->devices_size);
+    bioc->usage = ms->devices_size;
+    f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    migration_incoming_state_destroy();
+    if (ret < 0) {
+        error_setg(errp, "Error %d while loading VM state", ret);
+    }
+    return ret;
+}
+
+void mem_snapshot_free(MemSnapshot *ms)
+{
+    if (ms) {
+        ram_snapshot_free(ms->ram);
+        if (ms->planned) {
+            g_array_free(ms->planned, true);
+        }
+        g_free(ms->planned_data);
+        g_free(ms->devices);
+        g_free(ms);
+    }
+}
+
+/* The snapshot of snapshot-save-ram */
+static MemSnapshot *ram_snapshot;
+
+void qmp_snapshot_save_ram(Error **errp)
+{
+    MemSnapshot *ms;
+    int saved_vm_running;
+
+    if (!migration_is_idle()) {
+        error_setg(errp, "Cannot snapshot while a migration is running");
+        return;
+    }
+    if (!replay_can_snapshot()) {
+        error_setg(errp, "Record/replay does not allow making snapshot "
+                   "right now. Try once more later.");
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    ms = mem_snapshot_save(true, errp);
+    if (ms) {
+        mem_snapshot_free(ram_snapshot);
+        ram_snapshot = ms;
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+void qmp_snapshot_load_ram(Error **errp)
+{
+    int saved_vm_running;
+
+    if (!ram_snapshot) {
+        error_setg(errp, "No RAM snapshot has been saved");
+        return;
+    }
+    if (!migration_is_idle()) {
+        error_setg(errp, "Cannot load a snapshot while a migration is "
+                   "running");
+        return;
+    }
+    if (!replay_can_snapshot()) {
+        error_setg(errp, "Record/replay does not allow loading snapshot "
+                   "right now. Try once more later.");
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_RESTORE_VM);
+
+    if (mem_snapshot_load(ram_snapshot, errp) < 0) {
+        return;
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
 int load_snapshot(const char *name, Error **errp)
 {
     BlockDriverState *bs, *bs_vm_state;
@@ -508,3 +508,192 @@ static int vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
 
     return ret;
 }
+
+/*
+ * Copy plans
+ *
+ * A process that saves and restores its own devices, as the in-memory
+ * snapshots do, needs neither the wire format nor field-by-field
+ * interpretation.  For a VMStateDescription made only of fixed-size
+ * plain fields, vmstate_plan_get() compiles the fields once into a list
+ * of byte ranges of the device struct; saving and loading are then a
+ * memcpy per range, between the description's usual hooks.  The saved
+ * bytes are in host layout and must only be loaded by the same binary.
+ */
+
+typedef struct VMStatePlanRun {
+    size_t offset;
+    size_t size;
+} VMStatePlanRun;
+
+struct VMStatePlan {
+    const VMStateDescription *vmsd;
+    size_t size;
+    int nruns;
+    VMStatePlanRun runs[];
+};
+
+/* vmsd -> VMStatePlan, or NULL if it cannot be compiled */
+static GHashTable *vmstate_plans;
+
+static bool vmstate_plan_info_is_plain(const VMStateInfo *info)
+{
+    return info == &vmstate_info_bool ||
+           info == &vmstate_info_int8 || info == &vmstate_info_int16 ||
+           info == &vmstate_info_int32 || info == &vmstate_info_int64 ||
+           info == &vmstate_info_uint8 || info == &vmstate_info_uint16 ||
+           info == &vmstate_info_uint32 || info == &vmstate_info_uint64 ||
+           info == &vmstate_info_float64 || info == &vmstate_info_cpudouble ||
+           info == &vmstate_info_buffer;
+}
+
+static void vmstate_plan_add_run(GArray *runs, size_t offset, size_t size)
+{
+    VMStatePlanRun *last;
+
+    if (!size) {
+        return;
+    }
+    if (runs->len) {
+        last = &g_array_index(runs, VMStatePlanRun, runs->len - 1);
+        if (last->offset + last->size == offset) {
+            last->size += size;
+            return;
+        }
+    }
+    g_array_append_vals(runs, &(VMStatePlanRun) { offset, size }, 1);
+}
+
+/*
+ * Append the ranges of @vmsd, placed at @base, to @runs.  @nested
+ * descriptions, reached through VMS_STRUCT or as subsections, must not
+ * have hooks, since the plan only calls the top-level ones.
+ */
+static bool vmstate_plan_compile(const VMStateDescription *vmsd, size_t base,
+                                 bool nested, GArray *runs)
+{
+    const VMStateDescription **sub;
+    VMStateField *field;
+    int i;
+
+    if (vmsd->unmigratable ||
+        (nested && (vmsd->pre_load || vmsd->post_load || vmsd->pre_save))) {
+        return false;
+    }
+    for (field = vmsd->fields; field->name; field++) {
+        int n_elems = field->flags & VMS_ARRAY ? field->num : 1;
+
+        if (field->field_exists ||
+            (field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_STRUCT |
+                              VMS_BUFFER | VMS_MULTIPLY_ELEMENTS |
+                              VMS_MUST_EXIST))) {
+            return false;
+        }
+        if (field->flags & VMS_MULTIPLY_ELEMENTS) {
+            n_elems *= field->num;
+        }
+        if (field->flags & VMS_STRUCT) {
+            for (i = 0; i < n_elems; i++) {
+                if (!vmstate_plan_compile(field->vmsd,
+                                          base + field->offset +
+                                          field->size * i, true, runs)) {
+                    return false;
+                }
+            }
+        } else if (field->info == &vmstate_info_unused_buffer) {
+            /* Nothing in the struct behind it */
+        } else if (vmstate_plan_info_is_plain(field->info)) {
+            vmstate_plan_add_run(runs, base + field->offset,
+                                 field->size * n_elems);
+        } else {
+            return false;
+        }
+    }
+    /* In process, subsections can be copied whether needed or not */
+    for (sub = vmsd->subsections; sub && *sub; sub++) {
+        if (!vmstate_plan_compile(*sub, base, true, runs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * The copy plan of @vmsd, compiled on first use, or NULL if it has
+ * fields that are pointers, variable-sized or need their own save and
+ * load functions.
+ */
+VMStatePlan *vmstate_plan_get(const VMStateDescription *vmsd)
+{
+    VMStatePlan *plan = NULL;
+    GArray *runs;
+    int i;
+
+    if (!vmstate_plans) {
+        vmstate_plans = g_hash_table_new(NULL, NULL);
+    }
+    if (g_hash_table_lookup_extended(vmstate_plans, vmsd, NULL,
+                                     (gpointer *)&plan)) {
+        return plan;
+    }
+
+    runs = g_array_new(false, false, sizeof(VMStatePlanRun));
+    if (vmstate_plan_compile(vmsd, 0, false, runs)) {
+        plan = g_malloc(sizeof(*plan) + runs->len * sizeof(VMStatePlanRun));
+        plan->vmsd = vmsd;
+        plan->size = 0;
+        plan->nruns = runs->len;
+        for (i = 0; i < runs->len; i++) {
+            plan->runs[i] = g_array_index(runs, VMStatePlanRun, i);
+            plan->size += plan->runs[i].size;
+        }
+    }
+    g_array_free(runs, true);
+    trace_vmstate_plan_compile(vmsd->name, plan ? plan->nruns : -1);
+    g_hash_table_insert(vmstate_plans, (gpointer)vmsd, plan);
+    return plan;
+}
+
+size_t vmstate_plan_size(const VMStatePlan *plan)
+{
+    return plan->size;
+}
+
+/* Save @opaque into the vmstate_plan_size() bytes at @buf */
+int vmstate_plan_save(const VMStatePlan *plan, void *opaque, uint8_t *buf)
+{
+    const VMStateDescription *vmsd = plan->vmsd;
+    int i;
+
+    if (vmsd->pre_save) {
+        int ret = vmsd->pre_save(opaque);
+        if (ret) {
+            error_report("pre-save failed: %s", vmsd->name);
+            return ret;
+        }
+    }
+    for (i = 0; i < plan->nruns; i++) {
+        memcpy(buf, opaque + plan->runs[i].offset, plan->runs[i].size);
+        buf += plan->runs[i].size;
+    }
+    return 0;
+}
+
+int vmstate_plan_load(const VMStatePlan *plan, void *opaque,
+                      const uint8_t *buf)
+{
+    const VMStateDescription *vmsd = plan->vmsd;
+    int i;
+
+    if (vmsd->pre_load) {
+        int ret = vmsd->pre_load(opaque);
+        if (ret) {
+            return ret;
+        }
+    }
+    for (i = 0; i < plan->nruns; i++) {
+        memcpy(opaque + plan->runs[i].offset, buf, plan->runs[i].size);
+        buf += plan->runs[i].size;
+    }
+    return vmsd->post_load ? vmsd->post_load(opaque, vmsd->version_id) : 0;
+}
@@ -58,6 +58,7 @@
 #include "qapi/qmp/qnum.h"
 #include "qapi/qmp/qstring.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qcbor.h"
 #include "qapi/qmp/json-streamer.h"
 #include "qapi/qmp/json-parser.h"
 #include "qapi/qmp/qlist.h"
@@ -182,6 +183,13 @@ typedef struct {
     GQueue *qmp_requests;
     /* Output queue contains all the QMP responses in order */
     GQueue *qmp_responses;
+    /*
+     * With the "cbor" capability and an event-batch-ms, events wait
+     * here to go out together.  Protected by monitor_lock.
+     */
+    int64_t event_batch_ns;
+    QList *event_batch;
+    QEMUTimer *event_batch_timer;
 } MonitorQMP;
 
 /*
@@ -396,8 +404,8 @@ static void monitor_flush_locked(Monitor *mon)
             return;
         }
         if (rc > 0) {
-            /* partial write */
-            QString *tmp = qstring_from_str(buf + rc);
+            /* partial write; CBOR output may contain NUL bytes */
+            QString *tmp = qstring_from_substr(buf, rc, len - 1);
             QDECREF(mon->outbuf);
             mon->outbuf = tmp;
         }
@@ -470,11 +478,22 @@ int monitor_fprintf(FILE *stream, const char *fmt, ...)
     return 0;
 }
 
+static bool qmp_cap_enabled(Monitor *mon, QMPCapability cap);
+
 static void monitor_json_emitter_raw(Monitor *mon,
                                      QObject *data)
 {
     QString *json;
 
+    if (qmp_cap_enabled(mon, QMP_CAPABILITY_CBOR)) {
+        /* Each item is self-delimiting, no newline needed */
+        qemu_mutex_lock(&mon->out_lock);
+        qobject_to_cbor(data, mon->outbuf);
+        monitor_flush_locked(mon);
+        qemu_mutex_unlock(&mon->out_lock);
+        return;
+    }
+
     json = mon->flags & MONITOR_USE_PRETTY ? qobject_to_json_pretty(data) :
                                              qobject_to_json(data);
     assert(json != NULL);
@@ -562,6 +581,37 @@ static MonitorQAPIEventConf monitor_qapi_event_conf[QAPI_EVENT__MAX] = {
 
 GHashTable *monitor_qapi_event_state;
 
+/* Send the events batched on @mon as one { "events": [ ... ] } */
+static void monitor_qmp_event_batch_flush(void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *frame = NULL;
+
+    qemu_mutex_lock(&monitor_lock);
+    if (mon->qmp.event_batch && !qlist_empty(mon->qmp.event_batch)) {
+        frame = qdict_new();
+        qdict_put(frame, "events", mon->qmp.event_batch);
+        mon->qmp.event_batch = qlist_new();
+    }
+    qemu_mutex_unlock(&monitor_lock);
+
+    if (frame) {
+        monitor_json_emitter(mon, QOBJECT(frame));
+        QDECREF(frame);
+    }
+}
+
+/* Called with monitor_lock held */
+static void monitor_qmp_event_batch_reset(Monitor *mon)
+{
+    if (mon->qmp.event_batch_timer) {
+        timer_del(mon->qmp.event_batch_timer);
+    }
+    QDECREF(mon->qmp.event_batch);
+    mon->qmp.event_batch = NULL;
+    mon->qmp.event_batch_ns = 0;
+}
+
 /*
  * Emits the event to every monitor instance, @event is only used for trace
  * Called with monitor_lock held.
@@ -572,8 +622,19 @@ static void monitor_qapi_event_emit(QAPIEvent event, QDict *qdict)
 
     trace_monitor_protocol_event_emit(event, qdict);
     QTAILQ_FOREACH(mon, &mon_list, entry) {
-        if (monitor_is_qmp(mon)
-            && mon->qmp.commands != &qmp_cap_negotiation_commands) {
+        if (!monitor_is_qmp(mon)
+            || mon->qmp.commands == &qmp_cap_negotiation_commands) {
+            continue;
+        }
+        if (mon->qmp.event_batch_ns) {
+            QINCREF(qdict);
+            qlist_append(mon->qmp.event_batch, qdict);
+            if (!timer_pending(mon->qmp.event_batch_timer)) {
+                timer_mod_ns(mon->qmp.event_batch_timer,
+                             qemu_clock_get_ns(event_clock_type) +
+                             mon->qmp.event_batch_ns);
+            }
+        } else {
             monitor_json_emitter(mon, QOBJECT(qdict));
         }
     }
@@ -748,6 +809,10 @@ static void monitor_data_destroy(Monitor *mon)
     }
     readline_free(mon->rs);
     QDECREF(mon->outbuf);
+    QDECREF(mon->qmp.event_batch);
+    if (mon->qmp.event_batch_timer) {
+        timer_free(mon->qmp.event_batch_timer);
+    }
     qemu_mutex_destroy(&mon->out_lock);
     qemu_mutex_destroy(&mon->qmp.qmp_queue_lock);
     monitor_qmp_cleanup_req_queue_locked(mon);
@@ -1156,6 +1221,12 @@ static void qmp_unregister_commands_hack(void)
 #endif
 #ifndef TARGET_ARM
     qmp_unregister_command(&qmp_commands, "query-gic-capabilities");
+    qmp_unregister_command(&qmp_commands, "microbit-gpio-inject");
+    qmp_unregister_command(&qmp_commands, "microbit-flash-sync");
+    qmp_unregister_command(&qmp_commands, "query-microbit-activity");
+    qmp_unregister_command(&qmp_commands, "query-microbit-ram-usage");
+    qmp_unregister_command(&qmp_commands, "query-microbit-mpy-profile");
+    qmp_unregister_command(&qmp_commands, "query-nvic-latency");
 #endif
 #if !defined(TARGET_S390X) && !defined(TARGET_I386)
     qmp_unregister_command(&qmp_commands, "query-cpu-model-expansion");
@@ -1282,9 +1353,12 @@ static bool qmp_cmd_oob_check(Monitor *mon, QDict *req, Error **errp)
 }
 
 void qmp_qmp_capabilities(bool has_enable, QMPCapabilityList *enable,
+                          bool has_event_batch_ms, uint32_t event_batch_ms,
                           Error **errp)
 {
     Error *local_err = NULL;
+    QMPCapabilityList *cap;
+    bool cbor = false;
 
     if (cur_mon->qmp.commands == &qmp_commands) {
         error_set(errp, ERROR_CLASS_COMMAND_NOT_FOUND,
@@ -1305,9 +1379,30 @@ void qmp_qmp_capabilities(bool has_enable, QMPCapabilityList *enable,
             error_propagate(errp, local_err);
             return;
         }
+    }
+    for (cap = has_enable ? enable : NULL; cap; cap = cap->next) {
+        cbor |= cap->value == QMP_CAPABILITY_CBOR;
+    }
+    if (has_event_batch_ms && event_batch_ms && !cbor) {
+        error_setg(errp, "Event batching requires the 'cbor' capability");
+        return;
+    }
+    if (has_enable) {
         qmp_caps_apply(cur_mon, enable);
     }
 
+    if (has_event_batch_ms && event_batch_ms) {
+        qemu_mutex_lock(&monitor_lock);
+        if (!cur_mon->qmp.event_batch_timer) {
+            cur_mon->qmp.event_batch_timer =
+                timer_new_ns(event_clock_type, monitor_qmp_event_batch_flush,
+                             cur_mon);
+        }
+        cur_mon->qmp.event_batch = qlist_new();
+        cur_mon->qmp.event_batch_ns = (int64_t)event_batch_ms * SCALE_MS;
+        qemu_mutex_unlock(&monitor_lock);
+    }
+
     cur_mon->qmp.commands = &qmp_commands;
 }
 
@@ -1407,6 +1502,17 @@ static void hmp_info_opcount(Monitor *mon, const QDict *qdict)
 {
     dump_opcount_info((FILE *)mon, monitor_fprintf);
 }
+
+static void hmp_info_tcg_quality(Monitor *mon, const QDict *qdict)
+{
+    if (!tcg_enabled()) {
+        error_report("JIT information is only available with accel=tcg");
+        return;
+    }
+
+    dump_tcg_quality((FILE *)mon, monitor_fprintf,
+                     qdict_get_try_int(qdict, "max", 0));
+}
 #endif
 
 static void hmp_info_history(Monitor *mon, const QDict *qdict)
@@ -4351,6 +4457,9 @@ static QObject *get_qmp_greeting(Monitor *mon)
 static void monitor_qmp_caps_reset(Monitor *mon)
 {
     memset(mon->qmp.qmp_caps, 0, sizeof(mon->qmp.qmp_caps));
+    qemu_mutex_lock(&monitor_lock);
+    monitor_qmp_event_batch_reset(mon);
+    qemu_mutex_unlock(&monitor_lock);
 }
 
 static void monitor_qmp_event(void *opaque, int event)
@@ -4369,6 +4478,7 @@ static void monitor_qmp_event(void *opaque, int event)
         break;
     case CHR_EVENT_CLOSED:
         monitor_qmp_cleanup_queues(mon);
+        monitor_qmp_caps_reset(mon);
         json_message_parser_destroy(&mon->qmp.parser);
         json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
         mon_refcount--;
@@ -4724,6 +4834,60 @@ GICCapabilityList *qmp_query_gic_capabilities(Error **errp)
     error_setg(errp, QERR_FEATURE_DISABLED, "query-gic-capabilities");
     return NULL;
 }
+
+void qmp_microbit_gpio_inject(MicrobitGpioEventList *events,
+                              bool has_relative, bool relative, Error **errp)
+{
+    error_setg(errp, QERR_FEATURE_DISABLED, "microbit-gpio-inject");
+}
+
+void qmp_microbit_gpio_capture_dump(const char *filename, bool has_format,
+                                    MicrobitGpioCaptureFormat format,
+                                    bool has_samplerate, uint64_t samplerate,
+                                    Error **errp)
+{
+    error_setg(errp, QERR_FEATURE_DISABLED, "microbit-gpio-capture-dump");
+}
+
+void qmp_microbit_flash_sync(Error **errp)
+{
+    error_setg(errp, QERR_FEATURE_DISABLED, "microbit-flash-sync");
+}
+
+MicrobitReflashInfo *qmp_microbit_reflash(const char *filename,
+                                          bool has_board, uint32_t board,
+                                          Error **errp)
+{
+    error_setg(errp, QERR_FEATURE_DISABLED, "microbit-reflash");
+    return NULL;
+}
+
+MicrobitActivityList *qmp_query_microbit_activity(Error **errp)
+{
+    error_setg(errp, QERR_FEATURE_DISABLED, "query-microbit-activity");
+    return NULL;
+}
+
+MicrobitRamUsageList *qmp_query_microbit_ram_usage(Error **errp)
+{
+    error_setg(errp, QERR_FEATURE_DISABLED, "query-microbit-ram-usage");
+    return NULL;
+}
+
+MicrobitMpyProfileInfoList *qmp_query_microbit_mpy_profile(bool has_max,
+                                                           int64_t max,
+                                                           Error **errp)
+{
+    error_setg(errp, QERR_FEATURE_DISABLED, "query-microbit-mpy-profile");
+    return NULL;
+}
+
+NvicLatencyList *qmp_query_nvic_latency(bool has_reset, bool reset,
+                                        Error **errp)
+{
+    error_setg(errp, QERR_FEATURE_DISABLED, "query-nvic-latency");
+    return NULL;
+}
 #endif
 
 HotpluggableCPUList *qmp_query_hotpluggable_cpus(Error **errp)
@@ -128,9 +128,10 @@ Select CPU model (@code{-cpu help} for list and additional feature selection)
 ETEXI
 
 DEF("accel", HAS_ARG, QEMU_OPTION_accel,
-    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "-accel [accel=]accelerator[,thread=single|multi|pool][,pool-size=n]\n"
     "                select accelerator (kvm, xen, hax, hvf, whpx or tcg; use 'help' for a list)\n"
-    "                thread=single|multi (enable multi-threaded TCG)", QEMU_ARCH_ALL)
+    "                thread=single|multi (enable multi-threaded TCG)\n"
+    "                thread=pool (run the vCPUs on pool-size TCG threads)", QEMU_ARCH_ALL)
 STEXI
 @item -accel @var{name}[,prop=@var{value}[,...]]
 @findex -accel
@@ -144,6 +145,12 @@ Controls number of TCG threads. When the TCG is multi-threaded there will be one
 thread per vCPU therefor taking advantage of additional host cores. The default
 is to enable multi-threading where both the back-end and front-ends support it and
 no incompatible TCG features have been enabled (e.g. icount/replay).
+@item thread=pool[,pool-size=@var{n}]
+Like @code{multi}, but the vCPUs are shared by a pool of @var{n} TCG threads,
+by default as many as there are host CPUs.  Each thread runs runnable vCPUs a
+time slice at a time, takes work from other threads when it has none left, and
+halted vCPUs take no thread at all.  This suits many mostly idle vCPUs, such as
+a large @code{microbit-fleet}.
 @end table
 ETEXI
 
@@ -2511,6 +2518,10 @@ DEF("chardev", HAS_ARG, QEMU_OPTION_chardev,
     "-chardev vc,id=id[[,width=width][,height=height]][[,cols=cols][,rows=rows]]\n"
     "         [,mux=on|off][,logfile=PATH][,logappend=on|off]\n"
     "-chardev ringbuf,id=id[,size=size][,logfile=PATH][,logappend=on|off]\n"
+#ifndef _WIN32
+    "-chardev shmring,id=id,path=path[,size=size][,doorbell=fd]\n"
+    "         [,logfile=PATH][,logappend=on|off]\n"
+#endif
     "-chardev file,id=id,path=path[,mux=on|off][,logfile=PATH][,logappend=on|off]\n"
     "-chardev pipe,id=id,path=path[,mux=on|off][,logfile=PATH][,logappend=on|off]\n"
 #ifdef _WIN32
@@ -2552,6 +2563,7 @@ Backend is one of:
 @option{msmouse},
 @option{vc},
 @option{ringbuf},
+@option{shmring},
 @option{file},
 @option{pipe},
 @option{console},
@@ -2725,6 +2737,18 @@ console with the given dimensions.
 Create a ring buffer with fixed size @option{size}.
 @var{size} must be a power of two and defaults to @code{64K}.
 
+@item -chardev shmring,id=@var{id},path=@var{path}[,size=@var{size}][,doorbell=@var{fd}]
+
+Write all traffic received from the guest into a lock-free ring in a shared
+mapping of the file @option{path}, for a collector process to read without a
+system call per write.  The layout and the consumer protocol are described in
+@file{chardev/char-shmring.c}.  Data that does not fit is dropped and counted.
+@var{size} must be a power of two and defaults to @code{64K}.
+
+@option{doorbell} is an eventfd, given by number or by the name of a file
+descriptor passed with @code{getfd}, which is written whenever data arrives in
+an empty ring.  Not available on Windows hosts.
+
 @item -chardev file,id=@var{id},path=@var{path}
 
 Log all traffic received from the guest to a file.
@@ -3515,13 +3539,14 @@ DEF("localtime", 0, QEMU_OPTION_localtime, "", QEMU_ARCH_ALL)
 DEF("startdate", HAS_ARG, QEMU_OPTION_startdate, "", QEMU_ARCH_ALL)
 
 DEF("rtc", HAS_ARG, QEMU_OPTION_rtc, \
-    "-rtc [base=utc|localtime|date][,clock=host|rt|vm][,driftfix=none|slew]\n" \
-    "                set the RTC base and clock, enable drift fix for clock ticks (x86 only)\n",
+    "-rtc [base=utc|localtime|date][,clock=host|rt|vm][,scale=N][,driftfix=none|slew]\n" \
+    "                set the RTC base and clock, enable drift fix for clock ticks (x86 only)\n" \
+    "                with clock=vm, run the virtual clock N times faster than real time\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -rtc [base=utc|localtime|@var{date}][,clock=host|vm][,driftfix=none|slew]
+@item -rtc [base=utc|localtime|@var{date}][,clock=host|vm][,scale=@var{N}][,driftfix=none|slew]
 @findex -rtc
 Specify @option{base} as @code{utc} or @code{localtime} to let the RTC start at the current
 UTC or local time, respectively. @code{localtime} is required for correct date in
@@ -3535,6 +3560,12 @@ If you want to isolate the guest time from the host, you can set @option{clock}
 to @code{rt} instead.  To even prevent it from progressing during suspension,
 you can set it to @code{vm}.
 
+With @option{clock} set to @code{vm}, @option{scale} makes the virtual clock,
+and with it the guest's timers and RTC, advance @var{N} times faster than host
+time (up to 1000).  Unlike @option{-icount} this does not slow down the
+virtual CPU, so time-based tests finish @var{N} times sooner as long as the
+host keeps up with the guest.  It cannot be combined with @option{-icount}.
+
 Enable @option{driftfix} (i386 targets only) if you experience time drift problems,
 specifically with Windows' ACPI HAL. This option will try to figure out how
 many timer interrupts were not processed by the Windows guest and will
@@ -3542,12 +3573,12 @@ re-inject them.
 ETEXI
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [shift=N|auto][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>,rrsnapshot=<snapshot>]\n" \
+    "-icount [shift=N|auto][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>,rrsnapshot=<snapshot>,rrsnapshot-interval=N]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
     "                instruction, enable aligning the host and virtual clocks\n" \
     "                or disable real time cpu sleeping\n", QEMU_ARCH_ALL)
 STEXI
-@item -icount [shift=@var{N}|auto][,rr=record|replay,rrfile=@var{filename},rrsnapshot=@var{snapshot}]
+@item -icount [shift=@var{N}|auto][,rr=record|replay,rrfile=@var{filename},rrsnapshot=@var{snapshot},rrsnapshot-interval=@var{N}]
 @findex -icount
 Enable virtual instruction counter.  The virtual cpu will execute one
 instruction every 2^@var{N} ns of virtual time.  If @code{auto} is specified
@@ -3565,6 +3596,9 @@ Note that while this option can give deterministic behavior, it does not
 provide cycle accurate emulation.  Modern CPUs contain superscalar out of
 order cores with complex cache hierarchies.  The number of instructions
 executed often has little or no correlation with actual performance.
+The exception are ARMv6-M cores such as the Cortex-M0, whose in-order
+pipeline is simple enough that each instruction is counted as the number
+of cycles it takes there.  @code{shift=6} then runs them at about 16 MHz.
 
 @option{align=on} will activate the delay algorithm which will try
 to synchronise the host clock and the virtual clock. The goal is to
@@ -3584,6 +3618,31 @@ read from this file in replay mode.
 Option rrsnapshot is used to create new vm snapshot named @var{snapshot}
 at the start of execution recording. In replay mode this option is used
 to load the initial VM state.
+
+Option rrsnapshot-interval makes replay mode keep an in-memory snapshot
+every @var{N} instructions, which the @code{replay-seek} QMP command
+uses to go back in the replay.
+ETEXI
+
+DEF("cpu-quota", HAS_ARG, QEMU_OPTION_cpu_quota, \
+    "-cpu-quota [insns=n][,time=ms][,period=ms][,action=throttle|stop]\n" \
+    "                limit each vCPU's instructions or host CPU time per period\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -cpu-quota [insns=@var{n}][,time=@var{ms}][,period=@var{ms}][,action=throttle|stop]
+@findex -cpu-quota
+Let each vCPU run at most @var{n} guest instructions, or spend at most
+@var{ms} milliseconds of host CPU time emulating them, per wall-clock
+period of @option{period} milliseconds (100 by default).  This keeps
+firmware spinning in a tight loop from starving other instances, or
+other boards of a fleet, on the same host.
+
+The instruction quota is checked by each translation block as it is
+entered, and the vCPU stops at the next block boundary; the CPU time is
+checked ten times a period.  With @option{action=throttle} (the default)
+a vCPU that reaches its quota waits for the next period; with
+@option{action=stop} the VM stops.  Either way QEMU emits the
+@code{CPU_QUOTA_EXCEEDED} QMP event.  Only TCG supports quotas.
 ETEXI
 
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
@@ -3690,11 +3749,143 @@ Show cursor.
 ETEXI
 
 DEF("tb-size", HAS_ARG, QEMU_OPTION_tb_size, \
-    "-tb-size n      set TB size\n", QEMU_ARCH_ALL)
+    "-tb-size n|auto set TB size in MiB, or size it from the machine\n", QEMU_ARCH_ALL)
 STEXI
 @item -tb-size @var{n}
+@itemx -tb-size auto
 @findex -tb-size
-Set TB size.
+Set TB size, the size in MiB of the buffer holding translated code.
+With @option{auto}, boards that know how much memory they can execute
+code from get a buffer sized to match; other boards keep the default.
+A buffer that fills up is flushed and translation starts over.
+ETEXI
+
+DEF("tb-profile", 0, QEMU_OPTION_tb_profile, \
+    "-tb-profile     count how often each translation block runs\n", QEMU_ARCH_ALL)
+STEXI
+@item -tb-profile
+@findex -tb-profile
+Make every translation block count how often it is entered, for
+@code{info tb-profile}.  This adds a load and a store to each block;
+without the option the generated code is unchanged.
+ETEXI
+
+DEF("tb-superblock", 0, QEMU_OPTION_tb_superblock, \
+    "-tb-superblock  retranslate hot translation blocks as superblocks\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-superblock
+@findex -tb-superblock
+Count the entries into each translation block and, once a block has run
+1024 times, translate it again as a superblock that goes on along its
+forward direct branches, leaving through a side exit where a branch is
+taken, instead of ending at each of them.  Only ARM Thumb code forms
+superblocks so far, and not with @option{-icount}.
+ETEXI
+
+DEF("tb-hot-region", HAS_ARG, QEMU_OPTION_tb_hot_region, \
+    "-tb-hot-region size\n"
+    "                move hot translation blocks into a region of their own\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-hot-region @var{size}
+@findex -tb-hot-region
+Set aside @var{size} bytes (suffixes k, M allowed) at the end of the
+translated code buffer.  Once a translation block has run 4096 times it
+is translated again in there, so that the code of hot loops ends up
+next to each other instead of among the code that ran once at startup.
+When the region is full no more blocks move until the buffer is
+flushed.  Implies @option{-tb-profile}.
+ETEXI
+
+DEF("tb-speculate", 0, QEMU_OPTION_tb_speculate, \
+    "-tb-speculate   translate direct branch targets while the CPU is idle\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-speculate
+@findex -tb-speculate
+Remember the direct branch targets of each new translation block and,
+while the vCPU is halted, translate the ones that are not cached yet, so
+that code first reached from an interrupt or a rarely taken branch does
+not pay for its translation when it runs.
+ETEXI
+
+DEF("tb-coverage", HAS_ARG, QEMU_OPTION_tb_coverage, \
+    "-tb-coverage [file=]file[,format=drcov|lcov][,mode=translated|executed]\n"
+    "                write the guest code that ran to file at exit\n"
+    "-tb-coverage [file=]map,mode=edges\n"
+    "                count the guest's control flow edges in the shared map\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-coverage [file=]@var{file}[,format=drcov|lcov][,mode=translated|executed]
+@findex -tb-coverage
+Note the guest code blocks that are translated, and write them to
+@var{file} when QEMU exits, as drcov (the default) or lcov.  The firmware
+itself is not instrumented.
+
+With @option{mode=translated} (the default) a block is covered once it is
+translated, so the generated code is unchanged; code that was only
+translated ahead of time, e.g. by @option{-tb-speculate}, counts too.
+With @option{mode=executed} every translation block stores a byte on
+entry and only blocks that ran are covered.
+
+drcov lists the blocks as offsets into one module named after the
+@option{-kernel} image.  lcov has no addresses, so each block is a line
+numbered by its guest address, and each ELF symbol with translated
+blocks is a function.
+
+@item -tb-coverage [file=]@var{map},mode=edges
+With @option{mode=edges} coverage is AFL's edge map rather than a file
+written at exit.  Every translation block, on entry, increments the 8-bit
+counter of the edge from the block that ran before it on the same CPU, in
+a 64 KiB map that a fuzzer reads between runs.  This includes entries
+through a chained jump.  The map is @var{map}, created if needed and
+mapped shared, or without a file the System V shared memory segment named
+by the @env{__AFL_SHM_ID} environment variable, as set by afl-fuzz.  With
+the micro:bit's @option{forkserver} each test case starts from no previous
+block.  Edges inside a superblock (@option{-tb-superblock}) are not seen.
+ETEXI
+
+DEF("exec-trace", HAS_ARG, QEMU_OPTION_exec_trace, \
+    "-exec-trace file\n"
+    "                write every translation block entry to file, compressed\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -exec-trace @var{file}
+@findex -exec-trace
+Record each entry into a translation block, with its id, guest PC and
+the instruction count of the block entered before, as a compact binary
+trace in @var{file}.  Unlike @option{-d exec} this also sees chained
+blocks, and costs a helper call per block rather than a formatted log
+line.  Decode the file with @file{scripts/exec-trace-decode.py}.
+ETEXI
+
+DEF("sample-profile", HAS_ARG, QEMU_OPTION_sample_profile, \
+    "-sample-profile [file=]file[,hz=N]\n"
+    "                sample the guest call stack N times a second (default 1000)\n"
+    "                and write the counts to file at exit\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -sample-profile [file=]@var{file}[,hz=@var{n}]
+@findex -sample-profile
+Sample what each vCPU runs @var{n} times a second of host time: the
+active exception, the PC and the link register, or idle when the vCPU is
+halted.  Samples are taken between translation blocks, so the generated
+code is unchanged.  At exit the counts are written to @var{file} as folded
+stacks, one per line, named by the ELF symbols of the guest image, which
+@command{flamegraph.pl} and most profile viewers read.
+ETEXI
+
+DEF("startup-profile", HAS_ARG, QEMU_OPTION_startup_profile, \
+    "-startup-profile file\n"
+    "                write the startup phase timeline to file as JSON at exit\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -startup-profile @var{file}
+@findex -startup-profile
+When QEMU exits, write to @var{file} how long each phase of startup
+took, from exec up to the first guest instruction, as a JSON object.
+The same timeline is shown by @code{info startup-profile}.
 ETEXI
 
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
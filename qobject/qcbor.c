@@ -0,0 +1,136 @@
+/*
+ * QObject CBOR (RFC 7049) encoding
+ *
+ * The same data model as our JSON: null, booleans, numbers, text
+ * strings, arrays and maps with text keys.  Integers are encoded as
+ * CBOR integers and doubles always as 64-bit floats, so a decoder sees
+ * the QNum kind that was encoded.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/qmp/qbool.h"
+#include "qapi/qmp/qcbor.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
+#include "qapi/qmp/qstring.h"
+
+enum {
+    CBOR_UINT = 0,
+    CBOR_NEGINT = 1,
+    CBOR_TEXT = 3,
+    CBOR_ARRAY = 4,
+    CBOR_MAP = 5,
+};
+
+#define CBOR_FALSE      0xf4
+#define CBOR_TRUE       0xf5
+#define CBOR_NULL       0xf6
+#define CBOR_FLOAT64    0xfb
+
+static void cbor_put_be(QString *str, uint64_t val, int bytes)
+{
+    while (bytes--) {
+        qstring_append_chr(str, (uint8_t)(val >> (bytes * 8)));
+    }
+}
+
+/* The initial byte of an item of type @major, and its argument @val */
+static void cbor_put_head(QString *str, int major, uint64_t val)
+{
+    if (val < 24) {
+        qstring_append_chr(str, major << 5 | val);
+    } else if (val <= UINT8_MAX) {
+        qstring_append_chr(str, major << 5 | 24);
+        cbor_put_be(str, val, 1);
+    } else if (val <= UINT16_MAX) {
+        qstring_append_chr(str, major << 5 | 25);
+        cbor_put_be(str, val, 2);
+    } else if (val <= UINT32_MAX) {
+        qstring_append_chr(str, major << 5 | 26);
+        cbor_put_be(str, val, 4);
+    } else {
+        qstring_append_chr(str, major << 5 | 27);
+        cbor_put_be(str, val, 8);
+    }
+}
+
+static void cbor_put_text(QString *str, const char *text)
+{
+    cbor_put_head(str, CBOR_TEXT, strlen(text));
+    qstring_append(str, text);
+}
+
+/*
+ * Append the encoding of @obj to @str.  The result is binary, NUL bytes
+ * included: take its size from qstring_get_length(), not strlen().
+ */
+void qobject_to_cbor(const QObject *obj, QString *str)
+{
+    switch (qobject_type(obj)) {
+    case QTYPE_QNULL:
+        qstring_append_chr(str, CBOR_NULL);
+        break;
+    case QTYPE_QNUM: {
+        QNum *val = qobject_to(QNum, obj);
+        union {
+            double d;
+            uint64_t u;
+        } dbl;
+
+        switch (val->kind) {
+        case QNUM_I64:
+            if (val->u.i64 < 0) {
+                cbor_put_head(str, CBOR_NEGINT, -1 - val->u.i64);
+            } else {
+                cbor_put_head(str, CBOR_UINT, val->u.i64);
+            }
+            break;
+        case QNUM_U64:
+            cbor_put_head(str, CBOR_UINT, val->u.u64);
+            break;
+        case QNUM_DOUBLE:
+            dbl.d = val->u.dbl;
+            qstring_append_chr(str, CBOR_FLOAT64);
+            cbor_put_be(str, dbl.u, 8);
+            break;
+        default:
+            abort();
+        }
+        break;
+    }
+    case QTYPE_QSTRING:
+        cbor_put_text(str, qstring_get_str(qobject_to(QString, obj)));
+        break;
+    case QTYPE_QDICT: {
+        QDict *val = qobject_to(QDict, obj);
+        const QDictEntry *e;
+
+        cbor_put_head(str, CBOR_MAP, qdict_size(val));
+        for (e = qdict_first(val); e; e = qdict_next(val, e)) {
+            cbor_put_text(str, qdict_entry_key(e));
+            qobject_to_cbor(qdict_entry_value(e), str);
+        }
+        break;
+    }
+    case QTYPE_QLIST: {
+        QList *val = qobject_to(QList, obj);
+        const QListEntry *e;
+
+        cbor_put_head(str, CBOR_ARRAY, qlist_size(val));
+        for (e = qlist_first(val); e; e = qlist_next(e)) {
+            qobject_to_cbor(qlist_entry_obj(e), str);
+        }
+        break;
+    }
+    case QTYPE_QBOOL:
+        qstring_append_chr(str, qbool_get_bool(qobject_to(QBool, obj)) ?
+                           CBOR_TRUE : CBOR_FALSE);
+        break;
+    default:
+        abort();
+    }
+}
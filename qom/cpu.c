@@ -28,6 +28,7 @@
 #include "exec/log.h"
 #include "exec/cpu-common.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
 #include "sysemu/sysemu.h"
 #include "hw/boards.h"
 #include "hw/qdev-properties.h"
@@ -241,6 +242,38 @@ void cpu_dump_statistics(CPUState *cpu, FILE *f, fprintf_function cpu_fprintf,
     }
 }
 
+void cpu_account_halt(CPUState *cpu, bool halted)
+{
+    int64_t now;
+
+    if (halted == cpu->halt_accounted) {
+        return;
+    }
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (halted) {
+        cpu->halted_since = now;
+        smp_wmb();
+        atomic_set(&cpu->halt_accounted, true);
+    } else {
+        /* Readers may briefly miss this halt, but never count it twice */
+        atomic_set(&cpu->halt_accounted, false);
+        smp_wmb();
+        atomic_set__nocheck(&cpu->halted_ns,
+                            cpu->halted_ns + now - cpu->halted_since);
+    }
+}
+
+int64_t cpu_halted_ns(CPUState *cpu)
+{
+    int64_t ns = atomic_read__nocheck(&cpu->halted_ns);
+
+    if (atomic_read(&cpu->halt_accounted)) {
+        smp_rmb();
+        ns += qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - cpu->halted_since;
+    }
+    return ns;
+}
+
 void cpu_reset(CPUState *cpu)
 {
     CPUClass *klass = CPU_GET_CLASS(cpu);
@@ -381,6 +414,24 @@ static void cpu_common_initfn(Object *obj)
 
 static void cpu_common_finalize(Object *obj)
 {
+    CPUState *cpu = CPU(obj);
+
+    g_free(cpu->exec_stats.vector_irqs);
+}
+
+void cpu_exec_stats_irq(CPUState *cpu, unsigned vector)
+{
+    CPUExecStats *st = &cpu->exec_stats;
+
+    if (vector >= st->nr_vectors) {
+        unsigned n = MAX(vector + 1, st->nr_vectors * 2);
+
+        st->vector_irqs = g_renew(uint64_t, st->vector_irqs, n);
+        memset(st->vector_irqs + st->nr_vectors, 0,
+               (n - st->nr_vectors) * sizeof(uint64_t));
+        st->nr_vectors = n;
+    }
+    st->vector_irqs[vector]++;
 }
 
 static int64_t cpu_common_get_arch_id(CPUState *cpu)
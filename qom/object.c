@@ -81,8 +81,26 @@ static GHashTable *type_table_get(void)
     return type_table;
 }
 
+/*
+ * TypeInfos passed to type_register_static(), by name.  Their TypeImpl is
+ * only built when the type is first looked up, so that starting QEMU does
+ * not pay for the hundreds of types a machine never uses.
+ */
+static GHashTable *type_info_table_get(void)
+{
+    static GHashTable *type_info_table;
+
+    if (type_info_table == NULL) {
+        type_info_table = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
+    return type_info_table;
+}
+
 static bool enumerating_types;
 
+static TypeImpl *type_register_internal(const TypeInfo *info);
+
 static void type_table_add(TypeImpl *ti)
 {
     assert(!enumerating_types);
@@ -91,7 +109,31 @@ static void type_table_add(TypeImpl *ti)
 
 static TypeImpl *type_table_lookup(const char *name)
 {
-    return g_hash_table_lookup(type_table_get(), name);
+    TypeImpl *ti = g_hash_table_lookup(type_table_get(), name);
+    const TypeInfo *info;
+
+    if (ti == NULL) {
+        info = g_hash_table_lookup(type_info_table_get(), name);
+        if (info != NULL) {
+            g_hash_table_remove(type_info_table_get(), name);
+            ti = type_register_internal(info);
+        }
+    }
+
+    return ti;
+}
+
+/* Build every pending TypeImpl, before walking the whole type table */
+static void type_info_table_flush(void)
+{
+    GHashTableIter iter;
+    gpointer info;
+
+    g_hash_table_iter_init(&iter, type_info_table_get());
+    while (g_hash_table_iter_next(&iter, NULL, &info)) {
+        g_hash_table_iter_remove(&iter);
+        type_register_internal(info);
+    }
 }
 
 static TypeImpl *type_new(const TypeInfo *info)
@@ -148,7 +190,16 @@ TypeImpl *type_register(const TypeInfo *info)
 
 TypeImpl *type_register_static(const TypeInfo *info)
 {
-    return type_register(info);
+    assert(info->parent);
+
+    if (g_hash_table_lookup(type_table_get(), info->name) != NULL ||
+        g_hash_table_lookup(type_info_table_get(), info->name) != NULL) {
+        fprintf(stderr, "Registering `%s' which already exists\n", info->name);
+        abort();
+    }
+    g_hash_table_insert(type_info_table_get(), (void *)info->name,
+                        (void *)info);
+    return NULL;
 }
 
 void type_register_static_array(const TypeInfo *infos, int nr_infos)
@@ -617,6 +668,17 @@ Object *object_dynamic_cast(Object *obj, const char *typename)
     return NULL;
 }
 
+/* Type names are string literals, compared by address: the slot for one
+ * only depends on the address, too.  Distinct literals with the same
+ * text just take two slots.
+ */
+static inline unsigned object_cast_cache_slot(const char *typename)
+{
+    uintptr_t addr = (uintptr_t)typename;
+
+    return (addr ^ (addr >> 4) ^ (addr >> 8)) & (OBJECT_CLASS_CAST_CACHE - 1);
+}
+
 Object *object_dynamic_cast_assert(Object *obj, const char *typename,
                                    const char *file, int line, const char *func)
 {
@@ -624,13 +686,12 @@ Object *object_dynamic_cast_assert(Object *obj, const char *typename,
                                      typename, file, line, func);
 
 #ifdef CONFIG_QOM_CAST_DEBUG
-    int i;
+    unsigned slot = object_cast_cache_slot(typename);
     Object *inst;
 
-    for (i = 0; obj && i < OBJECT_CLASS_CAST_CACHE; i++) {
-        if (atomic_read(&obj->class->object_cast_cache[i]) == typename) {
-            goto out;
-        }
+    if (obj &&
+        atomic_read(&obj->class->object_cast_cache[slot]) == typename) {
+        goto out;
     }
 
     inst = object_dynamic_cast(obj, typename);
@@ -644,11 +705,7 @@ Object *object_dynamic_cast_assert(Object *obj, const char *typename,
     assert(obj == inst);
 
     if (obj && obj == inst) {
-        for (i = 1; i < OBJECT_CLASS_CAST_CACHE; i++) {
-            atomic_set(&obj->class->object_cast_cache[i - 1],
-                       atomic_read(&obj->class->object_cast_cache[i]));
-        }
-        atomic_set(&obj->class->object_cast_cache[i - 1], typename);
+        atomic_set(&obj->class->object_cast_cache[slot], typename);
     }
 
 out:
@@ -715,13 +772,11 @@ ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
                                            typename, file, line, func);
 
 #ifdef CONFIG_QOM_CAST_DEBUG
-    int i;
+    unsigned slot = object_cast_cache_slot(typename);
 
-    for (i = 0; class && i < OBJECT_CLASS_CAST_CACHE; i++) {
-        if (atomic_read(&class->class_cast_cache[i]) == typename) {
-            ret = class;
-            goto out;
-        }
+    if (class && atomic_read(&class->class_cast_cache[slot]) == typename) {
+        ret = class;
+        goto out;
     }
 #else
     if (!class || !class->interfaces) {
@@ -738,11 +793,7 @@ ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
 
 #ifdef CONFIG_QOM_CAST_DEBUG
     if (class && ret == class) {
-        for (i = 1; i < OBJECT_CLASS_CAST_CACHE; i++) {
-            atomic_set(&class->class_cast_cache[i - 1],
-                       atomic_read(&class->class_cast_cache[i]));
-        }
-        atomic_set(&class->class_cast_cache[i - 1], typename);
+        atomic_set(&class->class_cast_cache[slot], typename);
     }
 out:
 #endif
@@ -799,6 +850,8 @@ typedef struct OCFData
 {
     void (*fn)(ObjectClass *klass, void *opaque);
     const char *implements_type;
+    /* implements_type, if a class rather than an interface */
+    TypeImpl *implements_class;
     bool include_abstract;
     void *opaque;
 } OCFData;
@@ -810,6 +863,12 @@ static void object_class_foreach_tramp(gpointer key, gpointer value,
     TypeImpl *type = value;
     ObjectClass *k;
 
+    /* Only the classes returned need to be initialized */
+    if (data->implements_class &&
+        !type_is_ancestor(type, data->implements_class)) {
+        return;
+    }
+
     type_initialize(type);
     k = type->class;
 
@@ -829,7 +888,14 @@ void object_class_foreach(void (*fn)(ObjectClass *klass, void *opaque),
                           const char *implements_type, bool include_abstract,
                           void *opaque)
 {
-    OCFData data = { fn, implements_type, include_abstract, opaque };
+    OCFData data = { fn, implements_type, NULL, include_abstract, opaque };
+    TypeImpl *target;
+
+    type_info_table_flush();
+    target = type_get_by_name(implements_type);
+    if (target && !type_is_ancestor(target, type_interface)) {
+        data.implements_class = target;
+    }
 
     enumerating_types = true;
     g_hash_table_foreach(type_table_get(), object_class_foreach_tramp, &data);
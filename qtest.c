@@ -43,6 +43,8 @@ static GString *inbuf;
 static int irq_levels[MAX_IRQ];
 static qemu_timeval start_time;
 static bool qtest_opened;
+/* Bytes of binary batch still expected after a "batch" command */
+static size_t batch_size;
 
 #define FMT_timeval "%ld.%06ld"
 
@@ -146,6 +148,23 @@ static bool qtest_opened;
  * B64_DATA is an arbitrarily long base64 encoded string.
  * If the sizes do not match, the data will be truncated.
  *
+ * Batched access:
+ *
+ *  > batch SIZE
+ *  > SIZE bytes of binary ops
+ *  < OK RSIZE
+ *  < RSIZE bytes of binary results
+ *
+ *     Run a sequence of memory accesses and clock steps with a single
+ *     round trip.  Each op is an opcode byte (QTEST_BATCH_* in
+ *     sysemu/qtest.h) followed by its little endian 64-bit arguments:
+ *     ADDR for reads, ADDR and VALUE for writes, NS for clock steps
+ *     (negative means the next deadline).  Each read and clock step
+ *     contributes a little endian 64-bit result, in order.  On a
+ *     malformed op the reply is a FAIL line and no binary data; the ops
+ *     before it have been done.  The IRQ messages below may still be
+ *     printed before the OK line.
+ *
  * IRQ management:
  *
  *  > irq_intercept_in QOM-PATH
@@ -258,6 +277,63 @@ static void qtest_irq_handler(void *opaque, int n, int level)
     }
 }
 
+/* Size in bytes of the access named by the b/w/l/q suffix */
+static unsigned qtest_access_size(char suffix)
+{
+    switch (suffix) {
+    case 'b':
+        return 1;
+    case 'w':
+        return 2;
+    case 'l':
+        return 4;
+    default:
+        g_assert(suffix == 'q');
+        return 8;
+    }
+}
+
+static void qtest_mem_write(uint64_t addr, uint64_t value, unsigned size)
+{
+    if (size == 1) {
+        uint8_t data = value;
+        cpu_physical_memory_write(addr, &data, 1);
+    } else if (size == 2) {
+        uint16_t data = value;
+        tswap16s(&data);
+        cpu_physical_memory_write(addr, &data, 2);
+    } else if (size == 4) {
+        uint32_t data = value;
+        tswap32s(&data);
+        cpu_physical_memory_write(addr, &data, 4);
+    } else {
+        uint64_t data = value;
+        tswap64s(&data);
+        cpu_physical_memory_write(addr, &data, 8);
+    }
+}
+
+static uint64_t qtest_mem_read(uint64_t addr, unsigned size)
+{
+    if (size == 1) {
+        uint8_t data;
+        cpu_physical_memory_read(addr, &data, 1);
+        return data;
+    } else if (size == 2) {
+        uint16_t data;
+        cpu_physical_memory_read(addr, &data, 2);
+        return tswap16(data);
+    } else if (size == 4) {
+        uint32_t data;
+        cpu_physical_memory_read(addr, &data, 4);
+        return tswap32(data);
+    } else {
+        uint64_t data;
+        cpu_physical_memory_read(addr, &data, 8);
+        return tswap64(data);
+    }
+}
+
 static void qtest_process_command(CharBackend *chr, gchar **words)
 {
     const gchar *command;
@@ -385,22 +461,7 @@ static void qtest_process_command(CharBackend *chr, gchar **words)
         ret = qemu_strtou64(words[2], NULL, 0, &value);
         g_assert(ret == 0);
 
-        if (words[0][5] == 'b') {
-            uint8_t data = value;
-            cpu_physical_memory_write(addr, &data, 1);
-        } else if (words[0][5] == 'w') {
-            uint16_t data = value;
-            tswap16s(&data);
-            cpu_physical_memory_write(addr, &data, 2);
-        } else if (words[0][5] == 'l') {
-            uint32_t data = value;
-            tswap32s(&data);
-            cpu_physical_memory_write(addr, &data, 4);
-        } else if (words[0][5] == 'q') {
-            uint64_t data = value;
-            tswap64s(&data);
-            cpu_physical_memory_write(addr, &data, 8);
-        }
+        qtest_mem_write(addr, value, qtest_access_size(words[0][5]));
         qtest_send_prefix(chr);
         qtest_send(chr, "OK\n");
     } else if (strcmp(words[0], "readb") == 0 ||
@@ -408,29 +469,14 @@ static void qtest_process_command(CharBackend *chr, gchar **words)
                strcmp(words[0], "readl") == 0 ||
                strcmp(words[0], "readq") == 0) {
         uint64_t addr;
-        uint64_t value = UINT64_C(-1);
+        uint64_t value;
         int ret;
 
         g_assert(words[1]);
         ret = qemu_strtou64(words[1], NULL, 0, &addr);
         g_assert(ret == 0);
 
-        if (words[0][4] == 'b') {
-            uint8_t data;
-            cpu_physical_memory_read(addr, &data, 1);
-            value = data;
-        } else if (words[0][4] == 'w') {
-            uint16_t data;
-            cpu_physical_memory_read(addr, &data, 2);
-            value = tswap16(data);
-        } else if (words[0][4] == 'l') {
-            uint32_t data;
-            cpu_physical_memory_read(addr, &data, 4);
-            value = tswap32(data);
-        } else if (words[0][4] == 'q') {
-            cpu_physical_memory_read(addr, &value, 8);
-            tswap64s(&value);
-        }
+        value = qtest_mem_read(addr, qtest_access_size(words[0][4]));
         qtest_send_prefix(chr);
         qtest_sendf(chr, "OK 0x%016" PRIx64 "\n", value);
     } else if (strcmp(words[0], "read") == 0) {
@@ -616,21 +662,119 @@ static void qtest_process_command(CharBackend *chr, gchar **words)
         qtest_send_prefix(chr);
         qtest_sendf(chr, "OK %"PRIi64"\n",
                     (int64_t)qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    } else if (strcmp(words[0], "batch") == 0) {
+        uint64_t size;
+        int ret;
+
+        g_assert(words[1]);
+        ret = qemu_strtou64(words[1], NULL, 0, &size);
+        g_assert(ret == 0);
+        g_assert(size <= QTEST_BATCH_MAX_SIZE);
+
+        /* The ops follow; qtest_process_inbuf waits for all of them */
+        batch_size = size;
+        if (!batch_size) {
+            qtest_send_prefix(chr);
+            qtest_send(chr, "OK 0\n");
+        }
     } else {
         qtest_send_prefix(chr);
         qtest_sendf(chr, "FAIL Unknown command '%s'\n", words[0]);
     }
 }
 
+static void qtest_process_batch(CharBackend *chr, const uint8_t *ops,
+                                size_t size)
+{
+    GByteArray *results = g_byte_array_new();
+    uint8_t buf[8];
+    size_t i = 0;
+
+    while (i < size) {
+        uint8_t op = ops[i++];
+        uint64_t addr;
+        int64_t ns;
+
+        switch (op) {
+        case QTEST_BATCH_READB:
+        case QTEST_BATCH_READW:
+        case QTEST_BATCH_READL:
+        case QTEST_BATCH_READQ:
+            if (size - i < 8) {
+                goto fail;
+            }
+            addr = ldq_le_p(ops + i);
+            i += 8;
+            stq_le_p(buf, qtest_mem_read(addr, 1 << (op - QTEST_BATCH_READB)));
+            g_byte_array_append(results, buf, 8);
+            break;
+        case QTEST_BATCH_WRITEB:
+        case QTEST_BATCH_WRITEW:
+        case QTEST_BATCH_WRITEL:
+        case QTEST_BATCH_WRITEQ:
+            if (size - i < 16) {
+                goto fail;
+            }
+            addr = ldq_le_p(ops + i);
+            qtest_mem_write(addr, ldq_le_p(ops + i + 8),
+                            1 << (op - QTEST_BATCH_WRITEB));
+            i += 16;
+            break;
+        case QTEST_BATCH_CLOCK_STEP:
+            if (!qtest_enabled() || size - i < 8) {
+                goto fail;
+            }
+            ns = ldq_le_p(ops + i);
+            i += 8;
+            if (ns < 0) {
+                ns = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
+            }
+            qtest_clock_warp(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ns);
+            stq_le_p(buf, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+            g_byte_array_append(results, buf, 8);
+            break;
+        default:
+            goto fail;
+        }
+    }
+
+    qtest_send_prefix(chr);
+    qtest_sendf(chr, "OK %u\n", results->len);
+    qemu_chr_fe_write_all(chr, results->data, results->len);
+    g_byte_array_free(results, TRUE);
+    return;
+
+fail:
+    /* Everything before the bad op has been done, and is not undone */
+    qtest_send_prefix(chr);
+    qtest_sendf(chr, "FAIL bad batch op 0x%02x at offset %zu\n",
+                ops[i - 1], i - 1);
+    g_byte_array_free(results, TRUE);
+}
+
 static void qtest_process_inbuf(CharBackend *chr, GString *inbuf)
 {
     char *end;
 
-    while ((end = strchr(inbuf->str, '\n')) != NULL) {
+    for (;;) {
         size_t offset;
         GString *cmd;
         gchar **words;
 
+        if (batch_size) {
+            if (inbuf->len < batch_size) {
+                break;
+            }
+            qtest_process_batch(chr, (const uint8_t *)inbuf->str, batch_size);
+            g_string_erase(inbuf, 0, batch_size);
+            batch_size = 0;
+            continue;
+        }
+
+        end = memchr(inbuf->str, '\n', inbuf->len);
+        if (!end) {
+            break;
+        }
         offset = end - inbuf->str;
 
         cmd = g_string_new_len(inbuf->str, offset);
@@ -674,6 +818,7 @@ static void qtest_event(void *opaque, int event)
         }
         qemu_gettimeofday(&start_time);
         qtest_opened = true;
+        batch_size = 0;
         if (qtest_log_fp) {
             fprintf(qtest_log_fp, "[I " FMT_timeval "] OPENED\n",
                     (long) start_time.tv_sec, (long) start_time.tv_usec);
@@ -681,6 +826,7 @@ static void qtest_event(void *opaque, int event)
         break;
     case CHR_EVENT_CLOSED:
         qtest_opened = false;
+        batch_size = 0;
         if (qtest_log_fp) {
             qemu_timeval tv;
             qtest_get_time(&tv);
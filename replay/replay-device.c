@@ -0,0 +1,127 @@
+/*
+ * replay-device.c
+ *
+ * Record/replay of device input that does not come from a chardev,
+ * netdev or input backend: host data read by device models (e.g. random
+ * numbers) and input injected from the monitor.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "sysemu/replay.h"
+#include "replay-internal.h"
+
+struct ReplayDeviceState {
+    ReplayDeviceEventFn *fn;
+    void *opaque;
+    int id;
+};
+
+typedef struct DeviceEvent {
+    uint8_t id;
+    uint8_t *data;
+    size_t size;
+} DeviceEvent;
+
+static ReplayDeviceState **replay_devices;
+static int replay_devices_count;
+
+ReplayDeviceState *replay_register_device(ReplayDeviceEventFn *fn,
+                                          void *opaque)
+{
+    ReplayDeviceState *rds = g_new0(ReplayDeviceState, 1);
+
+    rds->fn = fn;
+    rds->opaque = opaque;
+    rds->id = replay_devices_count++;
+    /* Ids are saved as a byte */
+    assert(rds->id <= UINT8_MAX);
+    replay_devices = g_renew(ReplayDeviceState *, replay_devices,
+                             replay_devices_count);
+    replay_devices[rds->id] = rds;
+    return rds;
+}
+
+void replay_device_event(ReplayDeviceState *rds, const uint8_t *data,
+                         size_t size)
+{
+    DeviceEvent *event;
+
+    if (replay_mode == REPLAY_MODE_PLAY) {
+        /* Input comes from the log */
+        return;
+    }
+
+    event = g_new(DeviceEvent, 1);
+    event->id = rds->id;
+    event->data = g_memdup(data, size);
+    event->size = size;
+    replay_add_event(REPLAY_ASYNC_EVENT_DEVICE, event, NULL, 0);
+}
+
+void replay_event_device_run(void *opaque)
+{
+    DeviceEvent *event = opaque;
+    ReplayDeviceState *rds;
+
+    if (event->id >= replay_devices_count) {
+        error_report("Replay: unknown device %d in the replay log", event->id);
+        exit(1);
+    }
+    rds = replay_devices[event->id];
+    rds->fn(rds->opaque, event->data, event->size);
+
+    g_free(event->data);
+    g_free(event);
+}
+
+void replay_event_device_save(void *opaque)
+{
+    DeviceEvent *event = opaque;
+
+    replay_put_byte(event->id);
+    replay_put_array(event->data, event->size);
+}
+
+void *replay_event_device_load(void)
+{
+    DeviceEvent *event = g_new(DeviceEvent, 1);
+
+    event->id = replay_get_byte();
+    replay_get_array_alloc(&event->data, &event->size);
+
+    return event;
+}
+
+void replay_device_data(uint8_t *buf, size_t size)
+{
+    uint8_t *read_buf;
+    size_t read_size;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        g_assert(replay_mutex_locked());
+        replay_save_instructions();
+        replay_put_event(EVENT_DEVICE_DATA);
+        replay_put_array(buf, size);
+    } else if (replay_mode == REPLAY_MODE_PLAY) {
+        g_assert(replay_mutex_locked());
+        replay_account_executed_instructions();
+        if (!replay_next_event_is(EVENT_DEVICE_DATA)) {
+            error_report("Missing device data event in the replay log");
+            exit(1);
+        }
+        replay_get_array_alloc(&read_buf, &read_size);
+        replay_finish_event();
+        if (read_size != size) {
+            error_report("Device data of %zu bytes in the replay log, "
+                         "expected %zu", read_size, size);
+            exit(1);
+        }
+        memcpy(buf, read_buf, size);
+        g_free(read_buf);
+    }
+}
@@ -53,6 +53,9 @@ static void replay_run_event(Event *event)
     case REPLAY_ASYNC_EVENT_NET:
         replay_event_net_run(event->opaque);
         break;
+    case REPLAY_ASYNC_EVENT_DEVICE:
+        replay_event_device_run(event->opaque);
+        break;
     default:
         error_report("Replay: invalid async event ID (%d) in the queue",
                     event->event_kind);
@@ -190,6 +193,9 @@ static void replay_save_event(Event *event, int checkpoint)
         case REPLAY_ASYNC_EVENT_NET:
             replay_event_net_save(event->opaque);
             break;
+        case REPLAY_ASYNC_EVENT_DEVICE:
+            replay_event_device_save(event->opaque);
+            break;
         default:
             error_report("Unknown ID %" PRId64 " of replay event", event->id);
             exit(1);
@@ -257,6 +263,11 @@ static Event *replay_read_event(int checkpoint)
         event->event_kind = replay_state.read_event_kind;
         event->opaque = replay_event_net_load();
         return event;
+    case REPLAY_ASYNC_EVENT_DEVICE:
+        event = g_malloc0(sizeof(Event));
+        event->event_kind = replay_state.read_event_kind;
+        event->opaque = replay_event_device_load();
+        return event;
     default:
         error_report("Unknown ID %d of replay event",
             replay_state.read_event_kind);
@@ -10,7 +10,9 @@
  */
 
 #include "qemu/osdep.h"
+#include <zlib.h>
 #include "qemu-common.h"
+#include "qemu/bswap.h"
 #include "sysemu/replay.h"
 #include "replay-internal.h"
 #include "qemu/error-report.h"
@@ -23,10 +25,67 @@
    written or read to the log. */
 static QemuMutex lock;
 
+/*
+ * The log is a header, chunks of the event stream compressed with zlib,
+ * and an index of the chunks at the end:
+ *
+ *   be32 version, be32 number of chunks, be64 file offset of the index
+ *   ReplayChunk, compressed data
+ *   ...
+ *   ReplayChunk of every chunk
+ *
+ * All ReplayChunk fields are big endian.  Offsets into the event stream
+ * are the ones of the uncompressed stream.  For replay the file is
+ * mapped, and only the chunk that is being read is uncompressed, so
+ * that seeking to a snapshot's position costs one chunk.
+ */
+
+/* Current version of the replay mechanism.
+   Increase it when file format changes. */
+#define REPLAY_VERSION              0xe02009
+/* Uncompressed bytes per chunk */
+#define REPLAY_CHUNK_SIZE           (1 << 20)
+
+typedef struct ReplayLogHeader {
+    uint32_t version;
+    uint32_t nr_chunks;
+    uint64_t index_offset;
+} ReplayLogHeader;
+
+typedef struct ReplayChunk {
+    /* Offset of the chunk in the event stream */
+    uint64_t start;
+    /* Steps at the start and the end of the chunk */
+    uint64_t first_step;
+    uint64_t last_step;
+    /* Stream offset of the first checkpoint in the chunk, or -1 */
+    uint64_t checkpoint;
+    /* File offset of the compressed data */
+    uint64_t file_offset;
+    uint32_t raw_len;
+    uint32_t comp_len;
+} ReplayChunk;
+
 /* File for replay writing */
 static bool write_error;
 FILE *replay_file;
 
+/* Chunks written or mapped so far */
+static GArray *replay_chunks;
+/* The chunk being written or read, uncompressed */
+static ReplayChunk replay_cur;
+static int replay_cur_index = -1;
+static uint8_t *replay_buf;
+static uint32_t replay_buf_pos;
+static uint8_t *replay_comp_buf;
+/* Where the next chunk goes when recording */
+static uint64_t replay_write_offset;
+/* The mapped log when replaying */
+static uint8_t *replay_map;
+static size_t replay_map_size;
+static bool replay_read_eof;
+static bool replay_read_error;
+
 static void replay_write_error(void)
 {
     if (!write_error) {
@@ -35,11 +94,270 @@ static void replay_write_error(void)
     }
 }
 
+static void replay_chunk_to_be(ReplayChunk *dst, const ReplayChunk *src)
+{
+    dst->start = cpu_to_be64(src->start);
+    dst->first_step = cpu_to_be64(src->first_step);
+    dst->last_step = cpu_to_be64(src->last_step);
+    dst->checkpoint = cpu_to_be64(src->checkpoint);
+    dst->file_offset = cpu_to_be64(src->file_offset);
+    dst->raw_len = cpu_to_be32(src->raw_len);
+    dst->comp_len = cpu_to_be32(src->comp_len);
+}
+
+static void replay_chunk_from_be(ReplayChunk *dst, const ReplayChunk *src)
+{
+    dst->start = be64_to_cpu(src->start);
+    dst->first_step = be64_to_cpu(src->first_step);
+    dst->last_step = be64_to_cpu(src->last_step);
+    dst->checkpoint = be64_to_cpu(src->checkpoint);
+    dst->file_offset = be64_to_cpu(src->file_offset);
+    dst->raw_len = be32_to_cpu(src->raw_len);
+    dst->comp_len = be32_to_cpu(src->comp_len);
+}
+
+static void replay_write(const void *buf, size_t size)
+{
+    if (fwrite(buf, 1, size, replay_file) != size) {
+        replay_write_error();
+    }
+    replay_write_offset += size;
+}
+
+static void replay_chunk_begin(void)
+{
+    replay_cur.start += replay_cur.raw_len;
+    replay_cur.first_step = replay_state.current_step;
+    replay_cur.checkpoint = -1ULL;
+    replay_cur.raw_len = 0;
+    replay_buf_pos = 0;
+}
+
+/* Compress and write out the chunk being recorded */
+static void replay_chunk_flush(void)
+{
+    uLongf comp_len = compressBound(REPLAY_CHUNK_SIZE);
+    ReplayChunk be;
+
+    if (!replay_buf_pos) {
+        return;
+    }
+    replay_cur.raw_len = replay_buf_pos;
+    if (compress2(replay_comp_buf, &comp_len, replay_buf, replay_buf_pos,
+                  Z_BEST_SPEED) != Z_OK) {
+        replay_write_error();
+        replay_chunk_begin();
+        return;
+    }
+    replay_cur.last_step = replay_state.current_step;
+    replay_cur.comp_len = comp_len;
+    replay_cur.file_offset = replay_write_offset + sizeof(be);
+    g_array_append_val(replay_chunks, replay_cur);
+
+    replay_chunk_to_be(&be, &replay_cur);
+    replay_write(&be, sizeof(be));
+    replay_write(replay_comp_buf, comp_len);
+    replay_chunk_begin();
+}
+
+/* Uncompress chunk @index into replay_buf and make it current */
+static bool replay_chunk_load(int index)
+{
+    ReplayChunk *c = &g_array_index(replay_chunks, ReplayChunk, index);
+    uLongf raw_len = REPLAY_CHUNK_SIZE;
+    uint8_t *src = replay_comp_buf;
+
+    if (replay_map) {
+        src = replay_map + c->file_offset;
+    } else if (pread(fileno(replay_file), src, c->comp_len,
+                     c->file_offset) != c->comp_len) {
+        return false;
+    }
+    if (uncompress(replay_buf, &raw_len, src, c->comp_len) != Z_OK ||
+        raw_len != c->raw_len) {
+        return false;
+    }
+    replay_cur = *c;
+    replay_cur_index = index;
+    replay_buf_pos = 0;
+    return true;
+}
+
+static void replay_log_open_play(void)
+{
+    ReplayLogHeader hdr;
+    ReplayChunk be;
+    struct stat st;
+    uint64_t start = 0;
+    uint32_t i;
+
+    if (fstat(fileno(replay_file), &st) < 0 || st.st_size < sizeof(hdr)) {
+        error_report("Replay: invalid input log file");
+        exit(1);
+    }
+    replay_map_size = st.st_size;
+    replay_map = mmap(NULL, replay_map_size, PROT_READ, MAP_PRIVATE,
+                      fileno(replay_file), 0);
+    if (replay_map == MAP_FAILED) {
+        error_report("Replay: cannot map log file: %s", strerror(errno));
+        exit(1);
+    }
+
+    memcpy(&hdr, replay_map, sizeof(hdr));
+    if (be32_to_cpu(hdr.version) != REPLAY_VERSION) {
+        error_report("Replay: invalid input log file version");
+        exit(1);
+    }
+    hdr.nr_chunks = be32_to_cpu(hdr.nr_chunks);
+    hdr.index_offset = be64_to_cpu(hdr.index_offset);
+    if (hdr.index_offset > replay_map_size ||
+        (replay_map_size - hdr.index_offset) / sizeof(ReplayChunk) <
+        hdr.nr_chunks) {
+        error_report("Replay: corrupt log file index");
+        exit(1);
+    }
+
+    g_array_set_size(replay_chunks, hdr.nr_chunks);
+    for (i = 0; i < hdr.nr_chunks; i++) {
+        ReplayChunk *c = &g_array_index(replay_chunks, ReplayChunk, i);
+
+        /* Not necessarily aligned */
+        memcpy(&be, replay_map + hdr.index_offset + i * sizeof(be),
+               sizeof(be));
+        replay_chunk_from_be(c, &be);
+        if (c->start != start || c->raw_len > REPLAY_CHUNK_SIZE ||
+            c->file_offset > hdr.index_offset ||
+            c->comp_len > hdr.index_offset - c->file_offset) {
+            error_report("Replay: corrupt log file index");
+            exit(1);
+        }
+        start += c->raw_len;
+    }
+    replay_cur_index = -1;
+    replay_buf_pos = 0;
+    replay_cur.raw_len = 0;
+}
+
+void replay_log_open(void)
+{
+    replay_chunks = g_array_new(false, false, sizeof(ReplayChunk));
+    replay_buf = g_malloc(REPLAY_CHUNK_SIZE);
+    replay_comp_buf = g_malloc(compressBound(REPLAY_CHUNK_SIZE));
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        /* The header is written by replay_log_close */
+        replay_write_offset = sizeof(ReplayLogHeader);
+        fseek(replay_file, replay_write_offset, SEEK_SET);
+        memset(&replay_cur, 0, sizeof(replay_cur));
+        replay_chunk_begin();
+    } else {
+        replay_log_open_play();
+    }
+}
+
+void replay_log_close(void)
+{
+    ReplayLogHeader hdr;
+    ReplayChunk be;
+    uint64_t index_offset;
+    guint i;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        replay_chunk_flush();
+        index_offset = replay_write_offset;
+        for (i = 0; i < replay_chunks->len; i++) {
+            replay_chunk_to_be(&be, &g_array_index(replay_chunks,
+                                                   ReplayChunk, i));
+            replay_write(&be, sizeof(be));
+        }
+
+        hdr.version = cpu_to_be32(REPLAY_VERSION);
+        hdr.nr_chunks = cpu_to_be32(replay_chunks->len);
+        hdr.index_offset = cpu_to_be64(index_offset);
+        fseek(replay_file, 0, SEEK_SET);
+        replay_write(&hdr, sizeof(hdr));
+    }
+
+    if (replay_map) {
+        munmap(replay_map, replay_map_size);
+        replay_map = NULL;
+    }
+    g_array_free(replay_chunks, true);
+    replay_chunks = NULL;
+    g_free(replay_buf);
+    replay_buf = NULL;
+    g_free(replay_comp_buf);
+    replay_comp_buf = NULL;
+}
+
+uint64_t replay_log_tell(void)
+{
+    return replay_cur.start + replay_buf_pos;
+}
+
+static int replay_chunk_find(uint64_t offset)
+{
+    int lo = 0, hi = replay_chunks->len;
+
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+
+        if (g_array_index(replay_chunks, ReplayChunk, mid).start <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void replay_log_seek(uint64_t offset)
+{
+    int index;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        /* Going back in a recording drops what came after */
+        if (offset < replay_cur.start) {
+            fflush(replay_file);
+            index = replay_chunk_find(offset);
+            if (!replay_chunk_load(index)) {
+                replay_write_error();
+                return;
+            }
+            replay_buf_pos = replay_cur.raw_len;
+            if (replay_cur.checkpoint >= offset) {
+                replay_cur.checkpoint = -1ULL;
+            }
+            replay_write_offset = replay_cur.file_offset - sizeof(ReplayChunk);
+            g_array_set_size(replay_chunks, index);
+            if (ftruncate(fileno(replay_file), replay_write_offset) < 0) {
+                replay_write_error();
+            }
+            fseek(replay_file, replay_write_offset, SEEK_SET);
+        }
+        replay_buf_pos = MIN(offset - replay_cur.start, replay_buf_pos);
+        return;
+    }
+
+    replay_read_eof = false;
+    if (!replay_chunks->len) {
+        replay_read_eof = true;
+        return;
+    }
+    index = replay_chunk_find(offset);
+    if (index != replay_cur_index && !replay_chunk_load(index)) {
+        replay_read_error = true;
+        return;
+    }
+    replay_buf_pos = MIN(offset - replay_cur.start, replay_cur.raw_len);
+}
+
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        if (putc(byte, replay_file) == EOF) {
-            replay_write_error();
+        replay_buf[replay_buf_pos++] = byte;
+        if (replay_buf_pos == REPLAY_CHUNK_SIZE) {
+            replay_chunk_flush();
         }
     }
 }
@@ -47,6 +365,10 @@ void replay_put_byte(uint8_t byte)
 void replay_put_event(uint8_t event)
 {
     assert(event < EVENT_COUNT);
+    if (event >= EVENT_CHECKPOINT && event <= EVENT_CHECKPOINT_LAST &&
+        replay_cur.checkpoint == -1ULL) {
+        replay_cur.checkpoint = replay_log_tell();
+    }
     replay_put_byte(event);
 }
 
@@ -71,19 +393,65 @@ void replay_put_qword(int64_t qword)
 
 void replay_put_array(const uint8_t *buf, size_t size)
 {
+    size_t chunk;
+
     if (replay_file) {
         replay_put_dword(size);
-        if (fwrite(buf, 1, size, replay_file) != size) {
-            replay_write_error();
+        while (size) {
+            chunk = MIN(size, REPLAY_CHUNK_SIZE - replay_buf_pos);
+            memcpy(replay_buf + replay_buf_pos, buf, chunk);
+            replay_buf_pos += chunk;
+            buf += chunk;
+            size -= chunk;
+            if (replay_buf_pos == REPLAY_CHUNK_SIZE) {
+                replay_chunk_flush();
+            }
         }
     }
 }
 
+/* Make sure there is something left in replay_buf */
+static bool replay_chunk_fill(void)
+{
+    while (replay_buf_pos == replay_cur.raw_len) {
+        if (replay_read_error || replay_read_eof ||
+            replay_cur_index + 1 >= (int)replay_chunks->len) {
+            replay_read_eof = !replay_read_error;
+            return false;
+        }
+        if (!replay_chunk_load(replay_cur_index + 1)) {
+            replay_read_error = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool replay_read(uint8_t *buf, size_t size)
+{
+    size_t chunk;
+
+    while (size) {
+        if (!replay_chunk_fill()) {
+            return false;
+        }
+        chunk = MIN(size, replay_cur.raw_len - replay_buf_pos);
+        memcpy(buf, replay_buf + replay_buf_pos, chunk);
+        replay_buf_pos += chunk;
+        buf += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
 uint8_t replay_get_byte(void)
 {
     uint8_t byte = 0;
     if (replay_file) {
-        byte = getc(replay_file);
+        if (!replay_read(&byte, 1)) {
+            /* As getc() would */
+            byte = (uint8_t)EOF;
+        }
     }
     return byte;
 }
@@ -125,7 +493,7 @@ void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
+        if (!replay_read(buf, *size)) {
             error_report("replay read error");
         }
     }
@@ -136,7 +504,7 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
+        if (!replay_read(*buf, *size)) {
             error_report("replay read error");
         }
     }
@@ -145,11 +513,11 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
+        if (replay_read_eof) {
             error_report("replay file is over");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_PAUSED);
-        } else if (ferror(replay_file)) {
+        } else if (replay_read_error) {
             error_report("replay file is over or something goes wrong");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
@@ -34,6 +34,8 @@ enum ReplayEvents {
     EVENT_AUDIO_OUT,
     /* for audio in event */
     EVENT_AUDIO_IN,
+    /* for data devices take from the host */
+    EVENT_DEVICE_DATA,
     /* for clock read/writes */
     /* some of greater codes are reserved for clocks */
     EVENT_CLOCK,
@@ -56,6 +58,7 @@ enum ReplayAsyncEventKind {
     REPLAY_ASYNC_EVENT_CHAR_READ,
     REPLAY_ASYNC_EVENT_BLOCK,
     REPLAY_ASYNC_EVENT_NET,
+    REPLAY_ASYNC_EVENT_DEVICE,
     REPLAY_ASYNC_COUNT
 };
 
@@ -92,6 +95,16 @@ extern ReplayState replay_state;
 /* File for replay writing */
 extern FILE *replay_file;
 
+/*! Sets up the chunked log in replay_file, checking its version
+    when replaying. */
+void replay_log_open(void);
+/*! Writes out the last chunk, the index and the header when recording. */
+void replay_log_close(void);
+/*! Returns the position in the uncompressed event stream. */
+uint64_t replay_log_tell(void);
+/*! Continues reading or writing at @offset of the event stream. */
+void replay_log_seek(uint64_t offset);
+
 void replay_put_byte(uint8_t byte);
 void replay_put_event(uint8_t event);
 void replay_put_word(uint16_t word);
@@ -183,6 +196,25 @@ void replay_event_net_save(void *opaque);
 /*! Reads network from the file. */
 void *replay_event_net_load(void);
 
+/* Devices */
+
+/*! Called to run device input event. */
+void replay_event_device_run(void *opaque);
+/*! Writes device input event to the file. */
+void replay_event_device_save(void *opaque);
+/*! Reads device input event from the file. */
+void *replay_event_device_load(void);
+
+/* Snapshots */
+
+/*! Instructions between the in-memory snapshots taken while replaying,
+    0 for none. */
+extern uint64_t replay_snapshot_interval;
+/*! Makes the vCPU stop at the given step, -1 for none. */
+void replay_set_break(uint64_t step);
+/*! Called from the main loop when the vCPU stopped at the break. */
+void replay_break_reached(void);
+
 /* VMState-related functions */
 
 /* Registers replay VMState.
@@ -20,11 +20,39 @@
 #include "qemu/error-report.h"
 #include "migration/vmstate.h"
 #include "migration/snapshot.h"
+#include "qapi/qapi-commands-misc.h"
+#include "sysemu/cpus.h"
+#include "qom/cpu.h"
+
+/* In-memory snapshots taken every so many instructions while replaying */
+typedef struct ReplayAutoSnapshot {
+    uint64_t step;
+    MemSnapshot *ms;
+} ReplayAutoSnapshot;
+
+#define REPLAY_AUTO_SNAPSHOTS_MAX 32
+
+uint64_t replay_snapshot_interval;
+/* Sorted by step */
+static ReplayAutoSnapshot replay_auto_snapshots[REPLAY_AUTO_SNAPSHOTS_MAX];
+static int replay_auto_snapshots_count;
+static uint64_t replay_auto_snapshot_step = -1ULL;
+/* Target of replay-seek, or -1 */
+static uint64_t replay_seek_step = -1ULL;
+/* Run state to stop in at replay_seek_step */
+static RunState replay_seek_stop_state = RUN_STATE_PAUSED;
+
+/* Reverse debugging: set while replaying to where gdb asked to go back to */
+static bool replay_is_debugging;
+/* reverse-continue looks for the last breakpoint hit in [start, end) */
+static uint64_t replay_debug_start_step;
+static uint64_t replay_debug_end_step = -1ULL;
+static uint64_t replay_last_breakpoint = -1ULL;
 
 static int replay_pre_save(void *opaque)
 {
     ReplayState *state = opaque;
-    state->file_offset = ftell(replay_file);
+    state->file_offset = replay_log_tell();
     state->host_clock_last = qemu_clock_get_last(QEMU_CLOCK_HOST);
 
     return 0;
@@ -33,7 +61,7 @@ static int replay_pre_save(void *opaque)
 static int replay_post_load(void *opaque, int version_id)
 {
     ReplayState *state = opaque;
-    fseek(replay_file, state->file_offset, SEEK_SET);
+    replay_log_seek(state->file_offset);
     qemu_clock_set_last(QEMU_CLOCK_HOST, state->host_clock_last);
     /* If this was a vmstate, saved in recording mode,
        we need to initialize replay data fields. */
@@ -69,6 +97,290 @@ void replay_vmstate_register(void)
     vmstate_register(NULL, 0, &vmstate_replay, &replay_state);
 }
 
+static void replay_update_break(void)
+{
+    uint64_t interval = replay_snapshot_interval;
+
+    replay_auto_snapshot_step = -1ULL;
+    if (interval) {
+        replay_auto_snapshot_step =
+            QEMU_ALIGN_DOWN(replay_state.current_step, interval) + interval;
+    }
+    replay_set_break(MIN(replay_auto_snapshot_step, replay_seek_step));
+}
+
+/* Keep every other snapshot, and take them half as often from now on */
+static void replay_thin_auto_snapshots(void)
+{
+    int i;
+
+    for (i = 0; i < replay_auto_snapshots_count; i++) {
+        if (i & 1) {
+            mem_snapshot_free(replay_auto_snapshots[i].ms);
+        } else {
+            replay_auto_snapshots[i / 2] = replay_auto_snapshots[i];
+        }
+    }
+    replay_auto_snapshots_count = (replay_auto_snapshots_count + 1) / 2;
+    replay_snapshot_interval *= 2;
+}
+
+/* Called with the vCPUs stopped */
+static void replay_take_auto_snapshot(void)
+{
+    uint64_t step = replay_state.current_step;
+    Error *err = NULL;
+    MemSnapshot *ms;
+    int i;
+
+    for (i = 0; i < replay_auto_snapshots_count; i++) {
+        if (replay_auto_snapshots[i].step == step) {
+            /* Back here after a seek */
+            return;
+        }
+    }
+    if (!replay_can_snapshot()) {
+        return;
+    }
+    ms = mem_snapshot_save(false, &err);
+    if (!ms) {
+        error_report_err(err);
+        return;
+    }
+
+    if (replay_auto_snapshots_count == REPLAY_AUTO_SNAPSHOTS_MAX) {
+        replay_thin_auto_snapshots();
+    }
+    for (i = replay_auto_snapshots_count; i > 0; i--) {
+        if (replay_auto_snapshots[i - 1].step < step) {
+            break;
+        }
+        replay_auto_snapshots[i] = replay_auto_snapshots[i - 1];
+    }
+    replay_auto_snapshots[i].step = step;
+    replay_auto_snapshots[i].ms = ms;
+    replay_auto_snapshots_count++;
+}
+
+/* Returns the latest snapshot at or before @step, or NULL */
+static ReplayAutoSnapshot *replay_find_snapshot(uint64_t step)
+{
+    ReplayAutoSnapshot *snap = NULL;
+    int i;
+
+    for (i = 0; i < replay_auto_snapshots_count; i++) {
+        if (replay_auto_snapshots[i].step <= step) {
+            snap = &replay_auto_snapshots[i];
+        }
+    }
+    return snap;
+}
+
+/* Called with the VM stopped */
+static int replay_restore_snapshot(ReplayAutoSnapshot *snap, Error **errp)
+{
+    CPUState *cpu;
+
+    /* Drop a step over a breakpoint that the last pass left unfinished */
+    CPU_FOREACH(cpu) {
+        cpu_single_step(cpu, 0);
+    }
+    replay_clear_events();
+    return mem_snapshot_load(snap->ms, errp);
+}
+
+static void replay_seek_reached(void);
+
+/* Replays up to @step and stops there; called with the VM stopped */
+static void replay_run_to(uint64_t step)
+{
+    if (step > replay_state.current_step) {
+        replay_seek_step = step;
+        replay_update_break();
+        vm_start();
+    } else {
+        replay_update_break();
+        replay_seek_reached();
+    }
+}
+
+/* Starts a reverse-continue pass, which replays from the latest snapshot
+   before @end up to @end, noting breakpoint hits on the way.
+   Called with the VM stopped. */
+static bool replay_debug_search(uint64_t end)
+{
+    ReplayAutoSnapshot *snap;
+    Error *err = NULL;
+
+    snap = end ? replay_find_snapshot(end - 1) : NULL;
+    if (!snap) {
+        return false;
+    }
+    replay_debug_start_step = snap->step;
+    if (replay_restore_snapshot(snap, &err) < 0) {
+        error_report_err(err);
+        return false;
+    }
+    replay_debug_end_step = end;
+    replay_last_breakpoint = -1ULL;
+    replay_run_to(end);
+    return true;
+}
+
+/* Called when the replay got to replay_seek_step */
+static void replay_seek_reached(void)
+{
+    ReplayAutoSnapshot *snap;
+    Error *err = NULL;
+    uint64_t step;
+
+    if (replay_debug_end_step != -1ULL) {
+        /* A reverse-continue pass is over */
+        replay_debug_end_step = -1ULL;
+        if (runstate_is_running()) {
+            /* Not a stop the gdbstub reports */
+            vm_stop(RUN_STATE_RESTORE_VM);
+        }
+        if (replay_last_breakpoint == -1ULL &&
+            replay_debug_search(replay_debug_start_step)) {
+            /* Nothing hit here, so look in the interval before */
+            return;
+        }
+        /* Go to the last hit, or to the start of the recording */
+        step = replay_last_breakpoint;
+        if (step == -1ULL) {
+            step = replay_debug_start_step;
+        }
+        snap = replay_find_snapshot(step);
+        if (snap) {
+            if (replay_restore_snapshot(snap, &err) == 0) {
+                replay_run_to(step);
+                return;
+            }
+            error_report_err(err);
+        }
+    }
+
+    replay_is_debugging = false;
+    if (runstate_is_running()) {
+        vm_stop(replay_seek_stop_state);
+    } else if (replay_seek_stop_state == RUN_STATE_DEBUG) {
+        /* vm_stop() does nothing when stopped, but gdb waits for a reply */
+        runstate_set(RUN_STATE_DEBUG);
+        vm_state_notify(0, RUN_STATE_DEBUG);
+    }
+}
+
+void replay_break_reached(void)
+{
+    uint64_t step = replay_state.current_step;
+    bool reached = step >= replay_seek_step;
+
+    if (step >= replay_auto_snapshot_step) {
+        bool running = runstate_is_running();
+
+        if (running) {
+            pause_all_vcpus();
+        }
+        replay_take_auto_snapshot();
+        if (running) {
+            resume_all_vcpus();
+        }
+    }
+    if (reached) {
+        replay_seek_step = -1ULL;
+    }
+    replay_update_break();
+    if (reached) {
+        replay_seek_reached();
+    }
+}
+
+void qmp_replay_seek(int64_t icount, Error **errp)
+{
+    ReplayAutoSnapshot *snap;
+
+    if (replay_mode != REPLAY_MODE_PLAY) {
+        error_setg(errp, "replay-seek requires replay mode");
+        return;
+    }
+    if (icount < 0) {
+        error_setg(errp, "icount must not be negative");
+        return;
+    }
+
+    vm_stop(RUN_STATE_PAUSED);
+    /* This overrides a reverse-debugging command still going on */
+    replay_is_debugging = false;
+    replay_debug_end_step = -1ULL;
+    replay_seek_stop_state = RUN_STATE_PAUSED;
+    if (icount < replay_state.current_step) {
+        snap = replay_find_snapshot(icount);
+        if (!snap) {
+            error_setg(errp, "no snapshot at or before icount %" PRId64,
+                       icount);
+            return;
+        }
+        if (replay_restore_snapshot(snap, errp) < 0) {
+            return;
+        }
+    }
+    replay_run_to(icount);
+}
+
+bool replay_reverse_step(void)
+{
+    uint64_t step = replay_state.current_step;
+    ReplayAutoSnapshot *snap;
+    Error *err = NULL;
+
+    if (replay_mode != REPLAY_MODE_PLAY || step == 0) {
+        return false;
+    }
+    snap = replay_find_snapshot(step - 1);
+    if (!snap) {
+        return false;
+    }
+    if (replay_restore_snapshot(snap, &err) < 0) {
+        error_report_err(err);
+        return false;
+    }
+    replay_is_debugging = true;
+    replay_seek_stop_state = RUN_STATE_DEBUG;
+    replay_run_to(step - 1);
+    return true;
+}
+
+bool replay_reverse_continue(void)
+{
+    if (replay_mode != REPLAY_MODE_PLAY) {
+        return false;
+    }
+    replay_is_debugging = true;
+    replay_seek_stop_state = RUN_STATE_DEBUG;
+    if (!replay_debug_search(replay_state.current_step)) {
+        replay_is_debugging = false;
+        return false;
+    }
+    return true;
+}
+
+bool replay_running_debug(void)
+{
+    return replay_is_debugging;
+}
+
+void replay_breakpoint(void)
+{
+    uint64_t step = replay_get_current_step();
+
+    assert(replay_is_debugging);
+    /* A hit right at the end of a pass is where gdb is already */
+    if (step < replay_debug_end_step) {
+        replay_last_breakpoint = step;
+    }
+}
+
 void replay_vmstate_init(void)
 {
     Error *err = NULL;
@@ -88,6 +400,12 @@ void replay_vmstate_init(void)
             }
         }
     }
+
+    if (replay_mode == REPLAY_MODE_PLAY && replay_snapshot_interval) {
+        /* The first one lets replay-seek go back to the start */
+        replay_take_auto_snapshot();
+        replay_update_break();
+    }
 }
 
 bool replay_can_snapshot(void)
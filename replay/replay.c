@@ -19,12 +19,7 @@
 #include "sysemu/cpus.h"
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
-
-/* Current version of the replay mechanism.
-   Increase it when file format changes. */
-#define REPLAY_VERSION              0xe02007
-/* Size of replay log header */
-#define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
+#include "qapi/qapi-commands-misc.h"
 
 ReplayMode replay_mode = REPLAY_MODE_NONE;
 char *replay_snapshot;
@@ -34,6 +29,10 @@ static char *replay_filename;
 ReplayState replay_state;
 static GSList *replay_blockers;
 
+/* Step at which the vCPU stops for replay_break_reached(), or -1 */
+static uint64_t replay_break_step = -1ULL;
+static QEMUBH *replay_break_bh;
+
 bool replay_next_event_is(int event)
 {
     bool res = false;
@@ -73,11 +72,27 @@ int replay_get_instructions(void)
     replay_mutex_lock();
     if (replay_next_event_is(EVENT_INSTRUCTION)) {
         res = replay_state.instructions_count;
+        if (replay_break_step != -1ULL) {
+            /* Run up to the break and no further */
+            res = MIN(res, replay_break_step > replay_state.current_step ?
+                           replay_break_step - replay_state.current_step : 0);
+        }
     }
     replay_mutex_unlock();
     return res;
 }
 
+static void replay_break_bh_cb(void *opaque)
+{
+    replay_break_reached();
+}
+
+void replay_set_break(uint64_t step)
+{
+    g_assert(replay_mutex_locked());
+    replay_break_step = step;
+}
+
 void replay_account_executed_instructions(void)
 {
     if (replay_mode == REPLAY_MODE_PLAY) {
@@ -91,6 +106,9 @@ void replay_account_executed_instructions(void)
 
             replay_state.instructions_count -= count;
             replay_state.current_step += count;
+            if (replay_state.current_step >= replay_break_step) {
+                qemu_bh_schedule(replay_break_bh);
+            }
             if (replay_state.instructions_count == 0) {
                 assert(replay_state.data_kind == EVENT_INSTRUCTION);
                 replay_finish_event();
@@ -231,7 +249,8 @@ static void replay_enable(const char *fname, int mode)
 
     switch (mode) {
     case REPLAY_MODE_RECORD:
-        fmode = "wb";
+        /* Read back when a snapshot is loaded while recording */
+        fmode = "w+b";
         break;
     case REPLAY_MODE_PLAY:
         fmode = "rb";
@@ -258,17 +277,8 @@ static void replay_enable(const char *fname, int mode)
     replay_state.current_step = 0;
     replay_state.has_unread_data = 0;
 
-    /* skip file header for RECORD and check it for PLAY */
-    if (replay_mode == REPLAY_MODE_RECORD) {
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
-    } else if (replay_mode == REPLAY_MODE_PLAY) {
-        unsigned int version = replay_get_dword();
-        if (version != REPLAY_VERSION) {
-            fprintf(stderr, "Replay: invalid input log file version\n");
-            exit(1);
-        }
-        /* go to the beginning */
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+    replay_log_open();
+    if (replay_mode == REPLAY_MODE_PLAY) {
         replay_fetch_data_kind();
     }
 
@@ -309,6 +319,8 @@ void replay_configure(QemuOpts *opts)
     }
 
     replay_snapshot = g_strdup(qemu_opt_get(opts, "rrsnapshot"));
+    replay_snapshot_interval = qemu_opt_get_number(opts,
+                                                   "rrsnapshot-interval", 0);
     replay_vmstate_register();
     replay_enable(fname, mode);
 
@@ -331,7 +343,7 @@ void replay_start(void)
         exit(1);
     }
 
-    /* Timer for snapshotting will be set up here. */
+    replay_break_bh = qemu_bh_new(replay_break_bh_cb, NULL);
 
     replay_enable_events();
 }
@@ -349,11 +361,9 @@ void replay_finish(void)
         if (replay_mode == REPLAY_MODE_RECORD) {
             /* write end event */
             replay_put_event(EVENT_END);
-
-            /* write header */
-            fseek(replay_file, 0, SEEK_SET);
-            replay_put_dword(REPLAY_VERSION);
         }
+        /* and the index and header */
+        replay_log_close();
 
         fclose(replay_file);
         replay_file = NULL;
@@ -369,6 +379,19 @@ void replay_finish(void)
     replay_finish_events();
 }
 
+ReplayInfo *qmp_query_replay(Error **errp)
+{
+    ReplayInfo *info = g_new0(ReplayInfo, 1);
+
+    info->mode = replay_mode;
+    if (replay_filename) {
+        info->has_filename = true;
+        info->filename = g_strdup(replay_filename);
+    }
+    info->icount = replay_get_current_step();
+    return info;
+}
+
 void replay_add_blocker(Error *reason)
 {
     replay_blockers = g_slist_prepend(replay_blockers, reason);
@@ -0,0 +1,91 @@
+#!/usr/bin/env python
+#
+# Decode a translation block trace written by -exec-trace
+#
+# The file starts with the 8 bytes "QEMUEXT1", followed by chunks.  Each
+# chunk is a header of three 32-bit little endian words (vCPU index,
+# compressed size, raw size) and that many bytes of zlib data.  The raw
+# data is a sequence of records of three LEB128 varints:
+#
+#   TB id delta, zigzag encoded
+#   guest PC delta, zigzag encoded
+#   instructions in the TB that the vCPU entered before this one
+#
+# Deltas are against the previous record of the same chunk, and start
+# from zero in each chunk.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = b'QEMUEXT1'
+
+
+def varints(data):
+    val = shift = 0
+    for byte in bytearray(data):
+        val |= (byte & 0x7f) << shift
+        if byte & 0x80:
+            shift += 7
+        else:
+            yield val
+            val = shift = 0
+
+
+def unzigzag(val):
+    return (val >> 1) ^ -(val & 1)
+
+
+def chunks(f):
+    if f.read(len(MAGIC)) != MAGIC:
+        raise ValueError('not an -exec-trace file')
+    while True:
+        header = f.read(12)
+        if len(header) < 12:
+            return
+        cpu, size, raw_size = struct.unpack('<III', header)
+        data = zlib.decompress(f.read(size))
+        if len(data) != raw_size:
+            raise ValueError('chunk of vCPU %d is truncated' % cpu)
+        yield cpu, data
+
+
+def records(f):
+    """Yield (vCPU, TB id, PC, instructions of the previous TB)"""
+    for cpu, data in chunks(f):
+        tb_id = pc = 0
+        fields = varints(data)
+        for id_delta in fields:
+            tb_id = (tb_id + unzigzag(id_delta)) & 0xffffffff
+            pc = (pc + unzigzag(next(fields))) & 0xffffffffffffffff
+            yield cpu, tb_id, pc, next(fields)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode an -exec-trace file')
+    parser.add_argument('trace', help='file written by -exec-trace')
+    parser.add_argument('--summary', action='store_true',
+                        help='only print per-vCPU TB and instruction counts')
+    args = parser.parse_args()
+
+    tbs = {}
+    insns = {}
+    with open(args.trace, 'rb') as f:
+        for cpu, tb_id, pc, prev_insns in records(f):
+            if args.summary:
+                tbs[cpu] = tbs.get(cpu, 0) + 1
+                insns[cpu] = insns.get(cpu, 0) + prev_insns
+            else:
+                sys.stdout.write('%d %u 0x%x +%d\n' %
+                                 (cpu, tb_id, pc, prev_insns))
+
+    for cpu in sorted(tbs):
+        print('vCPU %d: %d TBs, %d instructions' % (cpu, tbs[cpu], insns[cpu]))
+
+
+if __name__ == '__main__':
+    main()
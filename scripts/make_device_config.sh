@@ -27,4 +27,4 @@ done
 process_includes $src
 
 cat $src $all_includes | grep -v '^include'
-echo "$target: $all_includes" > $dep
+echo "$target: $src $all_includes" > $dep
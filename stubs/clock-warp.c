@@ -6,3 +6,7 @@ void qemu_start_warp_timer(void)
 {
 }
 
+
+void qemu_idle_skip(void)
+{
+}
@@ -0,0 +1,9 @@
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc.h"
+
+ExecStats *qmp_query_exec_stats(Error **errp)
+{
+    error_setg(errp, "Execution statistics require TCG");
+    return NULL;
+}
@@ -0,0 +1,10 @@
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc.h"
+
+TbProfileEntryList *qmp_query_tb_profile(bool has_max, int64_t max,
+                                         Error **errp)
+{
+    error_setg(errp, "TB profiling requires TCG");
+    return NULL;
+}
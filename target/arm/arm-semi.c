@@ -31,6 +31,7 @@
 #include "exec/gdbstub.h"
 #include "hw/arm/arm.h"
 #include "qemu/cutils.h"
+#include "exec/exec-all.h"
 #endif
 
 #define TARGET_SYS_OPEN        0x01
@@ -240,6 +241,196 @@ static target_ulong arm_gdb_syscall(ARMCPU *cpu, gdb_syscall_complete_cb cb,
      put_user_u64(val, args + (n) * 8) :                \
      put_user_u32(val, args + (n) * 4))
 
+/* Output to stdout and stderr, including the debug console, is
+ * buffered: a guest printing with one SYS_WRITEC per character would
+ * otherwise cost a host write() each.  The buffer is line buffered on a
+ * terminal, and is flushed when full, before any other semihosting call
+ * and when QEMU exits.
+ */
+#define ARM_SEMI_OUTBUF_SIZE 4096
+
+static struct {
+    int fd;
+    bool tty;
+    size_t len;
+    char buf[ARM_SEMI_OUTBUF_SIZE];
+} arm_semi_outbuf = { .fd = -1 };
+
+static void arm_semi_outbuf_flush(void)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < arm_semi_outbuf.len) {
+        ret = write(arm_semi_outbuf.fd, arm_semi_outbuf.buf + done,
+                    arm_semi_outbuf.len - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+    arm_semi_outbuf.len = 0;
+}
+
+static bool arm_semi_outbuf_wants(int fd)
+{
+    return fd == STDOUT_FILENO || fd == STDERR_FILENO;
+}
+
+/* Like write(), for a file descriptor arm_semi_outbuf_wants() */
+static ssize_t arm_semi_outbuf_write(int fd, const void *data, size_t len)
+{
+    static bool registered;
+
+    if (!registered) {
+        atexit(arm_semi_outbuf_flush);
+        registered = true;
+    }
+    if (fd != arm_semi_outbuf.fd) {
+        arm_semi_outbuf_flush();
+        arm_semi_outbuf.fd = fd;
+        arm_semi_outbuf.tty = isatty(fd);
+    }
+    if (len > sizeof(arm_semi_outbuf.buf) - arm_semi_outbuf.len) {
+        arm_semi_outbuf_flush();
+        if (len > sizeof(arm_semi_outbuf.buf)) {
+            return write(fd, data, len);
+        }
+    }
+    memcpy(arm_semi_outbuf.buf + arm_semi_outbuf.len, data, len);
+    arm_semi_outbuf.len += len;
+    if (arm_semi_outbuf.tty && memchr(data, '\n', len)) {
+        arm_semi_outbuf_flush();
+    }
+    return len;
+}
+
+static ssize_t arm_semi_write_fd(int fd, const void *data, size_t len)
+{
+    if (arm_semi_outbuf_wants(fd)) {
+        return arm_semi_outbuf_write(fd, data, len);
+    }
+    return write(fd, data, len);
+}
+
+/* SYS_READ and SYS_WRITE: read() @fd into, or write() it from, the @len
+ * bytes of guest memory at @addr.  Returns what was transferred, or -1
+ * with errno set if that was nothing.
+ */
+#ifdef CONFIG_USER_ONLY
+static ssize_t arm_semi_rw(CPUARMState *env, int fd, target_ulong addr,
+                           target_ulong len, bool is_read)
+{
+    void *s;
+    ssize_t ret;
+
+    s = lock_user(is_read ? VERIFY_WRITE : VERIFY_READ, addr, len, !is_read);
+    if (!s) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (is_read) {
+        do {
+            ret = read(fd, s, len);
+        } while (ret == -1 && errno == EINTR);
+    } else {
+        ret = arm_semi_write_fd(fd, s, len);
+    }
+    unlock_user(s, addr, is_read && ret > 0 ? ret : 0);
+    return ret;
+}
+#else
+/* Guest RAM is read and written in place: test vectors and results of
+ * megabytes go straight between the file and the RAMBlock.  Anything
+ * address_space_map() will not map goes through a bounce buffer of at
+ * most ARM_SEMI_BOUNCE_SIZE, so that no transfer, however long, needs a
+ * host copy of its whole length.
+ */
+#define ARM_SEMI_BOUNCE_SIZE (64 * 1024)
+
+static ssize_t arm_semi_rw(CPUARMState *env, int fd, target_ulong addr,
+                           target_ulong len, bool is_read)
+{
+    CPUState *cs = CPU(arm_env_get_cpu(env));
+    uint8_t *bounce = NULL;
+    target_ulong done = 0;
+    ssize_t ret = 0;
+
+    while (done < len) {
+        target_ulong va = addr + done;
+        target_ulong run = TARGET_PAGE_SIZE - (va & ~TARGET_PAGE_MASK);
+        MemTxAttrs attrs, next_attrs;
+        AddressSpace *as;
+        hwaddr pa, plen;
+        void *p;
+
+        pa = cpu_get_phys_page_attrs_debug(cs, va & TARGET_PAGE_MASK, &attrs);
+        if (pa == -1) {
+            errno = EFAULT;
+            ret = -1;
+            break;
+        }
+        /* Take in the following pages as long as they are contiguous */
+        while (run < len - done &&
+               cpu_get_phys_page_attrs_debug(cs, va + run, &next_attrs) ==
+               pa + (va & ~TARGET_PAGE_MASK) + run) {
+            run += TARGET_PAGE_SIZE;
+        }
+        run = MIN(run, len - done);
+        pa += va & ~TARGET_PAGE_MASK;
+
+        as = cpu_get_address_space(cs, cpu_asidx_from_attrs(cs, attrs));
+        plen = run;
+        p = address_space_map(as, pa, &plen, is_read);
+        if (p) {
+            if (is_read) {
+                do {
+                    ret = read(fd, p, plen);
+                } while (ret == -1 && errno == EINTR);
+            } else {
+                ret = arm_semi_write_fd(fd, p, plen);
+            }
+            address_space_unmap(as, p, plen, is_read, ret > 0 ? ret : 0);
+        } else {
+            if (!bounce) {
+                bounce = g_malloc(MIN(len, ARM_SEMI_BOUNCE_SIZE));
+            }
+            plen = MIN(run, ARM_SEMI_BOUNCE_SIZE);
+            if (is_read) {
+                do {
+                    ret = read(fd, bounce, plen);
+                } while (ret == -1 && errno == EINTR);
+                if (ret > 0) {
+                    cpu_memory_rw_debug(cs, va, bounce, ret, 1);
+                }
+            } else if (cpu_memory_rw_debug(cs, va, bounce, plen, 0) < 0) {
+                errno = EFAULT;
+                ret = -1;
+            } else {
+                ret = arm_semi_write_fd(fd, bounce, plen);
+            }
+        }
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+        if (ret < plen) {
+            /* End of file, or a short write */
+            break;
+        }
+    }
+
+    g_free(bounce);
+    if (ret < 0 && !done) {
+        return -1;
+    }
+    return done;
+}
+#endif
+
 target_ulong do_arm_semihosting(CPUARMState *env)
 {
     ARMCPU *cpu = arm_env_get_cpu(env);
@@ -265,6 +456,12 @@ target_ulong do_arm_semihosting(CPUARMState *env)
         args = env->regs[1];
     }
 
+    /* Keep buffered output ordered against everything else */
+    if (nr != TARGET_SYS_WRITEC && nr != TARGET_SYS_WRITE0 &&
+        nr != TARGET_SYS_WRITE) {
+        arm_semi_outbuf_flush();
+    }
+
     switch (nr) {
     case TARGET_SYS_OPEN:
         GET_ARG(0);
@@ -310,7 +507,7 @@ target_ulong do_arm_semihosting(CPUARMState *env)
           if (use_gdb_syscalls()) {
                 return arm_gdb_syscall(cpu, arm_semi_cb, "write,2,%x,1", args);
           } else {
-                return write(STDERR_FILENO, &c, 1);
+                return arm_semi_outbuf_write(STDERR_FILENO, &c, 1);
           }
         }
     case TARGET_SYS_WRITE0:
@@ -322,7 +519,7 @@ target_ulong do_arm_semihosting(CPUARMState *env)
             return arm_gdb_syscall(cpu, arm_semi_cb, "write,2,%x,%x",
                                    args, len);
         } else {
-            ret = write(STDERR_FILENO, s, len);
+            ret = arm_semi_outbuf_write(STDERR_FILENO, s, len);
         }
         unlock_user(s, args, 0);
         return ret;
@@ -336,13 +533,7 @@ target_ulong do_arm_semihosting(CPUARMState *env)
             return arm_gdb_syscall(cpu, arm_semi_cb, "write,%x,%x,%x",
                                    arg0, arg1, len);
         } else {
-            s = lock_user(VERIFY_READ, arg1, len, 1);
-            if (!s) {
-                /* FIXME - should this error code be -TARGET_EFAULT ? */
-                return (uint32_t)-1;
-            }
-            ret = set_swi_errno(ts, write(arg0, s, len));
-            unlock_user(s, arg1, 0);
+            ret = set_swi_errno(ts, arm_semi_rw(env, arg0, arg1, len, false));
             if (ret == (uint32_t)-1)
                 return -1;
             return len - ret;
@@ -357,15 +548,7 @@ target_ulong do_arm_semihosting(CPUARMState *env)
             return arm_gdb_syscall(cpu, arm_semi_cb, "read,%x,%x,%x",
                                    arg0, arg1, len);
         } else {
-            s = lock_user(VERIFY_WRITE, arg1, len, 0);
-            if (!s) {
-                /* FIXME - should this error code be -TARGET_EFAULT ? */
-                return (uint32_t)-1;
-            }
-            do {
-                ret = set_swi_errno(ts, read(arg0, s, len));
-            } while (ret == -1 && errno == EINTR);
-            unlock_user(s, arg1, len);
+            ret = set_swi_errno(ts, arm_semi_rw(env, arg0, arg1, len, true));
             if (ret == (uint32_t)-1)
                 return -1;
             return len - ret;
@@ -37,6 +37,9 @@
 #include "disas/capstone.h"
 #include "fpu/softfloat.h"
 
+/* The registers, flags and M profile interrupt masks fit in 128 bytes */
+QEMU_BUILD_BUG_ON(offsetof(CPUARMState, v7m.control) > 128);
+
 static void arm_cpu_set_pc(CPUState *cs, vaddr value)
 {
     ARMCPU *cpu = ARM_CPU(cs);
@@ -44,15 +47,75 @@ static void arm_cpu_set_pc(CPUState *cs, vaddr value)
     cpu->env.regs[15] = value;
 }
 
+static vaddr arm_cpu_get_pc(CPUState *cs)
+{
+    CPUARMState *env = &ARM_CPU(cs)->env;
+
+    return is_a64(env) ? env->pc : env->regs[15];
+}
+
+/* The PC and, unless it holds an exception return value, the LR */
+static int arm_cpu_profile_sample(CPUState *cs, vaddr *frames, int max_frames,
+                                  int *context)
+{
+    ARMCPU *cpu = ARM_CPU(cs);
+    CPUARMState *env = &cpu->env;
+    vaddr lr;
+
+    *context = -1;
+    if (is_a64(env)) {
+        frames[0] = env->pc;
+        lr = env->xregs[30];
+    } else {
+        frames[0] = env->regs[15];
+        lr = env->regs[14] & ~1;
+        if (arm_feature(env, ARM_FEATURE_M)) {
+            if (env->v7m.exception) {
+                *context = env->v7m.exception;
+            }
+            if (lr >= 0xff000000) {
+                return 1;
+            }
+        }
+    }
+    if (max_frames < 2 || lr == 0) {
+        return 1;
+    }
+    frames[1] = lr;
+    return 2;
+}
+
 static bool arm_cpu_has_work(CPUState *cs)
 {
     ARMCPU *cpu = ARM_CPU(cs);
 
-    return (cpu->power_state != PSCI_OFF)
-        && cs->interrupt_request &
-        (CPU_INTERRUPT_FIQ | CPU_INTERRUPT_HARD
-         | CPU_INTERRUPT_VFIQ | CPU_INTERRUPT_VIRQ
-         | CPU_INTERRUPT_EXITTB);
+    return (cpu->power_state != PSCI_OFF) && !cpu->stalled
+        && ((cs->interrupt_request &
+             (CPU_INTERRUPT_FIQ | CPU_INTERRUPT_HARD
+              | CPU_INTERRUPT_VFIQ | CPU_INTERRUPT_VIRQ
+              | CPU_INTERRUPT_EXITTB))
+            || (cpu->env.v7m.wfe_halted && cpu->env.v7m.event_register));
+}
+
+void arm_cpu_set_event(ARMCPU *cpu)
+{
+    CPUState *cs = CPU(cpu);
+
+    cpu->env.v7m.event_register = 1;
+    if (cpu->env.v7m.wfe_halted) {
+        qemu_cpu_kick(cs);
+    }
+}
+
+void arm_cpu_set_stalled(ARMCPU *cpu, bool stalled)
+{
+    CPUState *cs = CPU(cpu);
+
+    cpu->stalled = stalled;
+    /* Takes effect at the end of the current TB, and the wakeup is
+     * an interrupt that makes the halted CPU have work
+     */
+    cpu_interrupt(cs, stalled ? CPU_INTERRUPT_HALT : CPU_INTERRUPT_EXITTB);
 }
 
 void arm_register_pre_el_change_hook(ARMCPU *cpu, ARMELChangeHookFn *hook,
@@ -202,6 +265,8 @@ static void arm_cpu_reset(CPUState *s)
         uint8_t *rom;
         uint32_t vecbase;
 
+        cpu->sp_min[0] = cpu->sp_min[1] = UINT32_MAX;
+
         if (arm_feature(env, ARM_FEATURE_M_SECURITY)) {
             env->v7m.secure = true;
         } else {
@@ -224,6 +289,16 @@ static void arm_cpu_reset(CPUState *s)
             env->v7m.ccr[M_REG_NS] |= R_V7M_CCR_NONBASETHRDENA_MASK;
             env->v7m.ccr[M_REG_S] |= R_V7M_CCR_NONBASETHRDENA_MASK;
         }
+        if (!arm_feature(env, ARM_FEATURE_V7)) {
+            /* in v6M the UNALIGN_TRP bit [3] is RES1 */
+            env->v7m.ccr[M_REG_NS] |= R_V7M_CCR_UNALIGN_TRP_MASK;
+            env->v7m.ccr[M_REG_S] |= R_V7M_CCR_UNALIGN_TRP_MASK;
+        }
+
+        if (arm_feature(env, ARM_FEATURE_VFP)) {
+            /* Automatic FP state preservation on, CP10/11 access off */
+            env->v7m.fpccr = R_V7M_FPCCR_ASPEN_MASK | R_V7M_FPCCR_LSPEN_MASK;
+        }
 
         /* Unlike A/R profile, M profile defines the reset LR value */
         env->regs[14] = 0xffffffff;
@@ -332,6 +407,7 @@ static void arm_cpu_reset(CPUState *s)
 
     hw_breakpoint_update_all(cpu);
     hw_watchpoint_update_all(cpu);
+    arm_rebuild_tb_flags(env);
 }
 
 bool arm_cpu_exec_interrupt(CPUState *cs, int interrupt_request)
@@ -732,6 +808,9 @@ static void arm_cpu_finalizefn(Object *obj)
     ARMELChangeHook *hook, *next;
 
     g_hash_table_destroy(cpu->cp_regs);
+#ifndef CONFIG_USER_ONLY
+    arm_v7m_vec_cache_free(cpu);
+#endif
 
     QLIST_FOREACH_SAFE(hook, &cpu->pre_el_change_hooks, node, next) {
         QLIST_REMOVE(hook, node);
@@ -838,6 +917,13 @@ static void arm_cpu_realizefn(DeviceState *dev, Error **errp)
          * can use 4K pages.
          */
         pagebits = 12;
+    } else if (arm_feature(env, ARM_FEATURE_M) &&
+               !arm_feature(env, ARM_FEATURE_M_SECURITY) &&
+               (!cpu->has_mpu || !cpu->pmsav7_dregion)) {
+        /* Without an MPU or SAU no M-profile region is smaller than a
+         * 4K page: the default memory map is all 512MB blocks.
+         */
+        pagebits = 12;
     } else {
         /* For CPUs which might have tiny 1K pages, or which have an
          * MPU and might have small region sizes, stick with 1K pages.
@@ -917,6 +1003,14 @@ static void arm_cpu_realizefn(DeviceState *dev, Error **errp)
         cpu->has_mpu = false;
     }
 
+    /* Without an MPU or SAU an M-profile core has one flat, fixed address
+     * map, so the TBs it executes never change translation.
+     */
+    if (arm_feature(env, ARM_FEATURE_M) && !cpu->has_mpu &&
+        !arm_feature(env, ARM_FEATURE_M_SECURITY)) {
+        cs->static_mapping = true;
+    }
+
     if (arm_feature(env, ARM_FEATURE_PMSA) &&
         arm_feature(env, ARM_FEATURE_V7)) {
         uint32_t nr = cpu->pmsav7_dregion;
@@ -979,6 +1073,10 @@ static void arm_cpu_realizefn(DeviceState *dev, Error **errp)
         cs->num_ases = 1;
     }
     cpu_address_space_init(cs, ARMASIdx_NS, "cpu-memory", cs->memory);
+    if (arm_feature(env, ARM_FEATURE_M) &&
+        !arm_feature(env, ARM_FEATURE_M_SECURITY)) {
+        arm_v7m_vec_cache_init(cpu);
+    }
 
     /* No core_count specified, default to smp_cpus. */
     if (cpu->core_count == -1) {
@@ -1215,12 +1313,9 @@ static void arm11mpcore_initfn(Object *obj)
 
 static void cortex_m0_initfn(Object *obj)
 {
-    /* TODO:
-     *  - use ARM V6 ARCH
-     *  - use thumb-2
-     */
+    /* ARMv6-M: Thumb-1 plus BL, MSR, MRS and the barriers, no IT/CBZ */
     ARMCPU *cpu = ARM_CPU(obj);
-    set_feature(&cpu->env, ARM_FEATURE_V7);
+    set_feature(&cpu->env, ARM_FEATURE_V6);
     set_feature(&cpu->env, ARM_FEATURE_M);
     cpu->midr = 0x410cc200; /* r0p0 */
 }
@@ -1255,7 +1350,11 @@ static void cortex_m4_initfn(Object *obj)
     set_feature(&cpu->env, ARM_FEATURE_V7);
     set_feature(&cpu->env, ARM_FEATURE_M);
     set_feature(&cpu->env, ARM_FEATURE_THUMB_DSP);
+    /* The FPv4-SP extension: single precision only, 16 D registers */
+    set_feature(&cpu->env, ARM_FEATURE_VFP4);
     cpu->midr = 0x410fc240; /* r0p0 */
+    cpu->mvfr0 = 0x10110021;
+    cpu->mvfr1 = 0x11000011;
     cpu->pmsav7_dregion = 8;
     cpu->id_pfr0 = 0x00000030;
     cpu->id_pfr1 = 0x00000200;
@@ -1308,9 +1407,12 @@ static void arm_v7m_class_init(ObjectClass *oc, void *data)
 
 #ifndef CONFIG_USER_ONLY
     cc->do_interrupt = arm_v7m_cpu_do_interrupt;
+    cc->tb_exit = arm_v7m_sample_sp;
 #endif
 
     cc->cpu_exec_interrupt = arm_v7m_cpu_exec_interrupt;
+    /* A few hundred KB of flash and RAM: start small, grow if needed */
+    cc->tlb_bits = 6;
 }
 
 static const ARMCPRegInfo cortexr5_cp_reginfo[] = {
@@ -1903,6 +2005,8 @@ static void arm_cpu_class_init(ObjectClass *oc, void *data)
     cc->cpu_exec_interrupt = arm_cpu_exec_interrupt;
     cc->dump_state = arm_cpu_dump_state;
     cc->set_pc = arm_cpu_set_pc;
+    cc->get_pc = arm_cpu_get_pc;
+    cc->profile_sample = arm_cpu_profile_sample;
     cc->gdb_read_register = arm_cpu_gdb_read_register;
     cc->gdb_write_register = arm_cpu_gdb_write_register;
 #ifdef CONFIG_USER_ONLY
@@ -194,11 +194,80 @@ typedef struct ARMPredicateReg {
 } ARMPredicateReg;
 #endif
 
+/* Depth of the return address stack, a power of two */
+#define ARM_RAS_SIZE 8
 
 typedef struct CPUARMState {
+    /* The state that TBs and M profile interrupt delivery touch comes
+     * first, in as few cache lines as possible: the registers, the
+     * flags, then the M profile exception state.
+     */
+
     /* Regs for current mode.  */
     uint32_t regs[16];
 
+    /* cpsr flag cache for faster execution */
+    uint32_t CF; /* 0 or 1 */
+    uint32_t VF; /* V is the bit 31. All other bits are undefined */
+    uint32_t NF; /* N is bit 31. All other bits are undefined.  */
+    uint32_t ZF; /* Z set if zero.  */
+    uint32_t QF; /* 0 or 1 */
+    uint32_t GE; /* cpsr[19:16] */
+    uint32_t thumb; /* cpsr[5]. 0 = arm mode, 1 = thumb mode. */
+    uint32_t condexec_bits; /* IT bits.  cpsr[15:10,26:25].  */
+
+    struct {
+        /* Read by every exception entry, return and interrupt check */
+        int exception;
+        uint32_t secure; /* Is CPU in Secure state? (not guest visible) */
+        uint32_t primask[M_REG_NUM_BANKS];
+        uint32_t basepri[M_REG_NUM_BANKS];
+        uint32_t faultmask[M_REG_NUM_BANKS];
+        uint32_t control[M_REG_NUM_BANKS];
+
+        /* M profile has up to 4 stack pointers:
+         * a Main Stack Pointer and a Process Stack Pointer for each
+         * of the Secure and Non-Secure states. (If the CPU doesn't support
+         * the security extension then it has only two SPs.)
+         * In QEMU we always store the currently active SP in regs[13],
+         * and the non-active SP for the current security state in
+         * v7m.other_sp. The stack pointers for the inactive security state
+         * are stored in other_ss_msp and other_ss_psp.
+         * switch_v7m_security_state() is responsible for rearranging them
+         * when we change security state.
+         */
+        uint32_t other_sp;
+        uint32_t other_ss_msp;
+        uint32_t other_ss_psp;
+        uint32_t vecbase[M_REG_NUM_BANKS];
+        uint32_t ccr[M_REG_NUM_BANKS]; /* Configuration and Control */
+        uint32_t cfsr[M_REG_NUM_BANKS]; /* Configurable Fault Status */
+        uint32_t hfsr; /* HardFault Status */
+        uint32_t dfsr; /* Debug Fault Status Register */
+        uint32_t sfsr; /* Secure Fault Status Register */
+        uint32_t mmfar[M_REG_NUM_BANKS]; /* MemManage Fault Address */
+        uint32_t bfar; /* BusFault Address */
+        uint32_t sfar; /* Secure Fault Address Register */
+        unsigned mpu_ctrl[M_REG_NUM_BANKS]; /* MPU_CTRL */
+        uint32_t aircr; /* only holds r/w state if security extn implemented */
+        uint32_t csselr[M_REG_NUM_BANKS];
+        uint32_t scr[M_REG_NUM_BANKS];
+        uint32_t msplim[M_REG_NUM_BANKS];
+        uint32_t psplim[M_REG_NUM_BANKS];
+        /* The WFE/SEV event register, and whether WFE halted us */
+        uint32_t event_register;
+        uint32_t wfe_halted;
+        /* FPU: coprocessor access, context control, address, defaults */
+        uint32_t cpacr;
+        uint32_t fpccr;
+        uint32_t fpcar;
+        uint32_t fpdscr;
+        /* TB flags other than THUMB and CONDEXEC, kept up to date by
+         * arm_rebuild_tb_flags().  Not migrated: rebuilt on load.
+         */
+        uint32_t tb_flags;
+    } v7m;
+
     /* 32/64 switch only happens when taking and returning from
      * exceptions so the overlap semantics are taken care of then
      * instead of having a complicated union.
@@ -235,15 +304,6 @@ typedef struct CPUARMState {
     uint32_t usr_regs[5];
     uint32_t fiq_regs[5];
 
-    /* cpsr flag cache for faster execution */
-    uint32_t CF; /* 0 or 1 */
-    uint32_t VF; /* V is the bit 31. All other bits are undefined */
-    uint32_t NF; /* N is bit 31. All other bits are undefined.  */
-    uint32_t ZF; /* Z set if zero.  */
-    uint32_t QF; /* 0 or 1 */
-    uint32_t GE; /* cpsr[19:16] */
-    uint32_t thumb; /* cpsr[5]. 0 = arm mode, 1 = thumb mode. */
-    uint32_t condexec_bits; /* IT bits.  cpsr[15:10,26:25].  */
     uint64_t daif; /* exception masks, in the bits they are in PSTATE */
 
     uint64_t elr_el[4]; /* AArch64 exception link regs  */
@@ -463,44 +523,6 @@ typedef struct CPUARMState {
         uint64_t vmpidr_el2; /* Virtualization Multiprocessor ID Register */
     } cp15;
 
-    struct {
-        /* M profile has up to 4 stack pointers:
-         * a Main Stack Pointer and a Process Stack Pointer for each
-         * of the Secure and Non-Secure states. (If the CPU doesn't support
-         * the security extension then it has only two SPs.)
-         * In QEMU we always store the currently active SP in regs[13],
-         * and the non-active SP for the current security state in
-         * v7m.other_sp. The stack pointers for the inactive security state
-         * are stored in other_ss_msp and other_ss_psp.
-         * switch_v7m_security_state() is responsible for rearranging them
-         * when we change security state.
-         */
-        uint32_t other_sp;
-        uint32_t other_ss_msp;
-        uint32_t other_ss_psp;
-        uint32_t vecbase[M_REG_NUM_BANKS];
-        uint32_t basepri[M_REG_NUM_BANKS];
-        uint32_t control[M_REG_NUM_BANKS];
-        uint32_t ccr[M_REG_NUM_BANKS]; /* Configuration and Control */
-        uint32_t cfsr[M_REG_NUM_BANKS]; /* Configurable Fault Status */
-        uint32_t hfsr; /* HardFault Status */
-        uint32_t dfsr; /* Debug Fault Status Register */
-        uint32_t sfsr; /* Secure Fault Status Register */
-        uint32_t mmfar[M_REG_NUM_BANKS]; /* MemManage Fault Address */
-        uint32_t bfar; /* BusFault Address */
-        uint32_t sfar; /* Secure Fault Address Register */
-        unsigned mpu_ctrl[M_REG_NUM_BANKS]; /* MPU_CTRL */
-        int exception;
-        uint32_t primask[M_REG_NUM_BANKS];
-        uint32_t faultmask[M_REG_NUM_BANKS];
-        uint32_t aircr; /* only holds r/w state if security extn implemented */
-        uint32_t secure; /* Is CPU in Secure state? (not guest visible) */
-        uint32_t csselr[M_REG_NUM_BANKS];
-        uint32_t scr[M_REG_NUM_BANKS];
-        uint32_t msplim[M_REG_NUM_BANKS];
-        uint32_t psplim[M_REG_NUM_BANKS];
-    } v7m;
-
     /* Information associated with an exception about to be taken:
      * code which raises an exception must set cs->exception_index and
      * the relevant parts of this structure; the cpu_do_interrupt function
@@ -578,6 +600,12 @@ typedef struct CPUARMState {
         uint32_t cregs[16];
     } iwmmxt;
 
+    /* Return addresses pushed by Thumb BL and BLX, popped by returns
+     * with helper_ras_return().  Only a prediction, not migrated.
+     */
+    uint32_t ras[ARM_RAS_SIZE];
+    uint32_t ras_top;
+
 #if defined(CONFIG_USER_ONLY)
     /* For usermode syscall translation.  */
     int eabi;
@@ -652,6 +680,11 @@ typedef enum ARMPSCIState {
     PSCI_ON_PENDING = 2
 } ARMPSCIState;
 
+/* See arm_cpu_set_pc_hook */
+typedef void ARMPCHookFn(ARMCPU *cpu, uint32_t pc, void *opaque);
+/* See arm_cpu_set_svc_hook */
+typedef bool ARMSVCHookFn(ARMCPU *cpu, uint32_t imm, void *opaque);
+
 /**
  * ARMCPU:
  * @env: #CPUARMState
@@ -699,6 +732,9 @@ struct ARMCPU {
     /* MemoryRegion to use for secure physical accesses */
     MemoryRegion *secure_memory;
 
+    /* M profile vector table mapping, see arm_v7m_vec_cache_init */
+    struct ARMVecCache *vec_cache;
+
     /* For v8M, pointer to the IDAU interface provided by board/SoC */
     Object *idau;
 
@@ -739,6 +775,45 @@ struct ARMCPU {
     /* For v8M, initial value of the Secure VTOR */
     uint32_t init_svtor;
 
+    /* M profile RAM that TCG may access directly; see arm_cpu_set_flat_ram */
+    uint32_t flat_ram_base;
+    uint32_t flat_ram_size;
+    void *flat_ram_host;
+
+    /* M profile: lowest MSP and PSP seen since reset, UINT32_MAX if none;
+     * see arm_v7m_sample_sp
+     */
+    uint32_t sp_min[2];
+
+    /* M profile: look for loops that wait for an interrupt with nothing
+     * but RAM loads; see HELPER(v7m_spin_check).  spin_state holds the
+     * registers and flags of the last iteration.
+     */
+    bool spin_skip;
+    uint32_t spin_state[19];
+    uint64_t spin_mmio;
+    unsigned spin_count;
+
+    /* Halted with no work until released; see arm_cpu_set_stalled */
+    bool stalled;
+
+    /* Guest routines replaced by host code, address to ARMHLEFunc; see
+     * arm_cpu_add_hle.  NULL if there are none.
+     */
+    GHashTable *hle_funcs;
+
+    /* TBs starting in [pc_hook_lo, pc_hook_hi) call pc_hook first; see
+     * arm_cpu_set_pc_hook
+     */
+    uint32_t pc_hook_lo;
+    uint32_t pc_hook_hi;
+    ARMPCHookFn *pc_hook;
+    void *pc_hook_opaque;
+
+    /* Gets first go at M-profile SVCs; see arm_cpu_set_svc_hook */
+    ARMSVCHookFn *svc_hook;
+    void *svc_hook_opaque;
+
     /* [QEMU_]KVM_ARM_TARGET_* constant for this CPU, or
      * QEMU_KVM_ARM_TARGET_NONE if the kernel doesn't support this CPU type.
      */
@@ -857,6 +932,11 @@ extern const struct VMStateDescription vmstate_arm_cpu;
 
 void arm_cpu_do_interrupt(CPUState *cpu);
 void arm_v7m_cpu_do_interrupt(CPUState *cpu);
+void arm_v7m_sample_sp(CPUState *cpu);
+/* Set the M profile event register, waking the CPU from WFE */
+void arm_cpu_set_event(ARMCPU *cpu);
+/* Halt the CPU, interrupts or not, while a bus master holds it off */
+void arm_cpu_set_stalled(ARMCPU *cpu, bool stalled);
 bool arm_cpu_exec_interrupt(CPUState *cpu, int int_req);
 
 void arm_cpu_dump_state(CPUState *cs, FILE *f, fprintf_function cpu_fprintf,
@@ -1236,6 +1316,11 @@ void vfp_set_fpscr(CPUARMState *env, uint32_t val);
 #define FPCR_FZ     (1 << 24)   /* Flush-to-zero enable bit */
 #define FPCR_DN     (1 << 25)   /* Default NaN enable bit */
 
+#define FPSCR_LEN_MASK    (7 << 16)
+#define FPSCR_STRIDE_MASK (3 << 20)
+/* The FPSCR bits an M profile FP context starts from: AHP, DN, FZ, RMode */
+#define FPDSCR_MASK 0x07c00000
+
 static inline uint32_t vfp_get_fpsr(CPUARMState *env)
 {
     return vfp_get_fpscr(env) & FPSR_MASK;
@@ -1290,6 +1375,13 @@ enum arm_cpu_mode {
 #define ARM_IWMMXT_wCGR2	10
 #define ARM_IWMMXT_wCGR3	11
 
+/* V7M FPCCR bits */
+FIELD(V7M_FPCCR, LSPACT, 0, 1)
+FIELD(V7M_FPCCR, USER, 1, 1)
+FIELD(V7M_FPCCR, THREAD, 3, 1)
+FIELD(V7M_FPCCR, LSPEN, 30, 1)
+FIELD(V7M_FPCCR, ASPEN, 31, 1)
+
 /* V7M CCR bits */
 FIELD(V7M_CCR, NONBASETHRDENA, 0, 1)
 FIELD(V7M_CCR, USERSETMPEND, 1, 1)
@@ -1591,6 +1683,80 @@ static inline bool access_secure_reg(CPUARMState *env)
                        (_val))
 
 void arm_cpu_list(FILE *f, fprintf_function cpu_fprintf);
+
+/**
+ * arm_cpu_set_flat_ram:
+ * @cpu: M profile CPU
+ * @base: guest physical address of the RAM
+ * @size: size of the RAM, 0 to stop using it
+ * @host: host address the RAM is mapped at
+ *
+ * Let TCG code access [@base, @base + @size) at @host directly instead
+ * of through the softmmu TLB, while the MPU is disabled and no watchpoint
+ * is set. Stores bypass dirty tracking, so the board must not need it for
+ * this RAM; if code is ever translated from it, the CPU goes back to the
+ * TLB for good.
+ */
+void arm_cpu_set_flat_ram(ARMCPU *cpu, uint32_t base, uint32_t size,
+                          void *host);
+
+/* C library routines that can run as host code, see target/arm/hle.c */
+typedef enum ARMHLEFunc {
+    ARM_HLE_NONE,
+    ARM_HLE_UIDIV,
+    ARM_HLE_IDIV,
+    ARM_HLE_FADD,
+    ARM_HLE_FMUL,
+    ARM_HLE_MEMCPY,
+    ARM_HLE_MEMSET,
+    ARM_HLE_NUM,
+} ARMHLEFunc;
+
+/**
+ * arm_cpu_add_hle:
+ * @cpu: CPU running the code
+ * @name: symbol name of a routine, e.g. "__aeabi_uidiv"
+ * @addr: its address, bit 0 set for Thumb as in ELF symbols
+ *
+ * If @name is one of the routines in ARMHLEFunc, make calls to @addr run
+ * it as host code, returning to LR.  The result is the same as running
+ * the guest routine, but costs one helper call.  Must be called before
+ * code at @addr is translated.  Returns whether @name is known.
+ */
+bool arm_cpu_add_hle(ARMCPU *cpu, const char *name, uint32_t addr);
+
+/**
+ * arm_cpu_set_pc_hook:
+ * @cpu: CPU running the code
+ * @lo: first address of the range, bit 0 ignored
+ * @hi: end of the range
+ * @fn: function to call
+ * @opaque: its last argument
+ *
+ * Make every translation block that starts in [@lo, @hi) call @fn with
+ * the block's address before it runs, with the registers up to date.
+ * Blocks chained to each other still make the call; code that only
+ * falls through into the range from a block starting before it does
+ * not.  Must be called before code in the range is translated.
+ */
+void arm_cpu_set_pc_hook(ARMCPU *cpu, uint32_t lo, uint32_t hi,
+                         ARMPCHookFn *fn, void *opaque);
+
+/**
+ * arm_cpu_set_svc_hook:
+ * @cpu: M-profile CPU
+ * @fn: function to call, or NULL
+ * @opaque: its last argument
+ *
+ * Have every SVC call @fn with the instruction's 8-bit immediate, under
+ * the iothread lock and with the PC already past the SVC.  If @fn
+ * returns true it has done what the supervisor call asks, typically
+ * leaving a result in R0, and execution goes on after the SVC without
+ * taking the SVCall exception.  Lets a board emulate a firmware layer
+ * such as a BLE stack that the guest calls into through SVCs.
+ */
+void arm_cpu_set_svc_hook(ARMCPU *cpu, ARMSVCHookFn *fn, void *opaque);
+
 uint32_t arm_phys_excp_target_el(CPUState *cs, uint32_t excp_idx,
                                  uint32_t cur_el, bool secure);
 
@@ -2750,6 +2916,14 @@ static inline bool arm_cpu_data_is_big_endian(CPUARMState *env)
 /* For M profile only, Handler (ie not Thread) mode */
 #define ARM_TBFLAG_HANDLER_SHIFT    21
 #define ARM_TBFLAG_HANDLER_MASK     (1 << ARM_TBFLAG_HANDLER_SHIFT)
+/* For M profile only, loads and stores may use the flat RAM window */
+#define ARM_TBFLAG_FLAT_RAM_SHIFT   22
+#define ARM_TBFLAG_FLAT_RAM_MASK    (1 << ARM_TBFLAG_FLAT_RAM_SHIFT)
+/* For M profile only, an FP insn must set CONTROL.FPCA or do the
+ * lazy FP state preservation
+ */
+#define ARM_TBFLAG_FPCA_SET_SHIFT   23
+#define ARM_TBFLAG_FPCA_SET_MASK    (1 << ARM_TBFLAG_FPCA_SET_SHIFT)
 
 /* Bit usage when in AArch64 state */
 #define ARM_TBFLAG_TBI0_SHIFT 0        /* TBI0 for EL0/1 or TBI for EL2/3 */
@@ -2792,6 +2966,10 @@ static inline bool arm_cpu_data_is_big_endian(CPUARMState *env)
     (((F) & ARM_TBFLAG_BE_DATA_MASK) >> ARM_TBFLAG_BE_DATA_SHIFT)
 #define ARM_TBFLAG_HANDLER(F) \
     (((F) & ARM_TBFLAG_HANDLER_MASK) >> ARM_TBFLAG_HANDLER_SHIFT)
+#define ARM_TBFLAG_FLAT_RAM(F) \
+    (((F) & ARM_TBFLAG_FLAT_RAM_MASK) >> ARM_TBFLAG_FLAT_RAM_SHIFT)
+#define ARM_TBFLAG_FPCA_SET(F) \
+    (((F) & ARM_TBFLAG_FPCA_SET_MASK) >> ARM_TBFLAG_FPCA_SET_SHIFT)
 #define ARM_TBFLAG_TBI0(F) \
     (((F) & ARM_TBFLAG_TBI0_MASK) >> ARM_TBFLAG_TBI0_SHIFT)
 #define ARM_TBFLAG_TBI1(F) \
@@ -2870,6 +3048,18 @@ static inline uint32_t arm_regime_tbi1(CPUARMState *env, ARMMMUIdx mmu_idx)
 void cpu_get_tb_cpu_state(CPUARMState *env, target_ulong *pc,
                           target_ulong *cs_base, uint32_t *flags);
 
+/**
+ * arm_rebuild_tb_flags:
+ * @env: CPUARMState
+ *
+ * M profile CPUs return cached TB flags from cpu_get_tb_cpu_state().
+ * Anything that changes the state they are built from (MSR, exception
+ * entry and return, security state changes, NVIC writes to the MPU and
+ * FP control registers, reset and migration) must call this afterwards.
+ * A no-op for other profiles, whose flags are recomputed on each lookup.
+ */
+void arm_rebuild_tb_flags(CPUARMState *env);
+
 enum {
     QEMU_PSCI_CONDUIT_DISABLED = 0,
     QEMU_PSCI_CONDUIT_SMC = 1,
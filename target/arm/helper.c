@@ -6419,6 +6419,119 @@ pend_fault:
     return false;
 }
 
+static bool v7m_stack_frame_is_ram(ARMCPU *cpu, uint32_t addr, uint32_t size,
+                                   MMUAccessType access_type,
+                                   ARMMMUIdx mmu_idx, hwaddr *physaddr,
+                                   MemTxAttrs *attrs)
+{
+    /* Return true if the whole @size byte stack frame at @addr passes
+     * the MPU and SAU checks and lies in a single RAM region, so that
+     * it can be transferred with one access. Otherwise the caller
+     * falls back to word accesses, which raise any fault on the right
+     * word. MPU and SAU regions are 32 byte granular, so checking one
+     * word in each granule the frame touches checks all of it.
+     */
+    CPUARMState *env = &cpu->env;
+    bool is_write = access_type == MMU_DATA_STORE;
+    target_ulong page_size;
+    hwaddr phys, xlat, len = size;
+    MemoryRegion *mr;
+    ARMMMUFaultInfo fi = {};
+    MemTxAttrs granule_attrs;
+    uint32_t granule;
+    int prot;
+    bool ok;
+
+    if (addr > UINT32_MAX - size) {
+        return false;
+    }
+    for (granule = addr; granule < addr + size; granule = (granule | 31) + 1) {
+        granule_attrs = (MemTxAttrs) {};
+        if (get_phys_addr(env, granule, access_type, mmu_idx, &phys,
+                          &granule_attrs, &prot, &page_size, &fi, NULL)) {
+            return false;
+        }
+        if (granule == addr) {
+            *physaddr = phys;
+            *attrs = granule_attrs;
+        } else if (phys != *physaddr + (granule - addr) ||
+                   granule_attrs.secure != attrs->secure) {
+            return false;
+        }
+    }
+
+    rcu_read_lock();
+    mr = address_space_translate(arm_addressspace(CPU(cpu), *attrs),
+                                 *physaddr, &xlat, &len, is_write);
+    ok = len == size && memory_access_is_direct(mr, is_write);
+    rcu_read_unlock();
+    return ok;
+}
+
+/* The basic exception frame, then S0-S15, FPSCR and a reserved word */
+#define V7M_FP_FRAME_WORDS 26
+
+static bool v7m_stack_write_frame(ARMCPU *cpu, uint32_t addr,
+                                  const uint32_t *values, int n,
+                                  ARMMMUIdx mmu_idx)
+{
+    /* Write the @n words of @values to the stack at @addr, stopping
+     * at the first word that faults.
+     */
+    MemTxAttrs attrs;
+    hwaddr physaddr;
+    uint32_t frame[V7M_FP_FRAME_WORDS];
+    int i;
+
+    assert(n <= ARRAY_SIZE(frame));
+    if (v7m_stack_frame_is_ram(cpu, addr, n * 4, MMU_DATA_STORE,
+                               mmu_idx, &physaddr, &attrs)) {
+        for (i = 0; i < n; i++) {
+            frame[i] = cpu_to_le32(values[i]);
+        }
+        address_space_write(arm_addressspace(CPU(cpu), attrs), physaddr,
+                            attrs, (uint8_t *)frame, n * 4);
+        return true;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!v7m_stack_write(cpu, addr + i * 4, values[i], mmu_idx, false)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool v7m_stack_read_frame(ARMCPU *cpu, uint32_t * const *dest,
+                                 uint32_t addr, int n, ARMMMUIdx mmu_idx)
+{
+    /* Read @n words from the stack at @addr into @dest[0..n-1],
+     * stopping at the first word that faults.
+     */
+    MemTxAttrs attrs;
+    hwaddr physaddr;
+    uint32_t frame[V7M_FP_FRAME_WORDS];
+    int i;
+
+    assert(n <= ARRAY_SIZE(frame));
+    if (v7m_stack_frame_is_ram(cpu, addr, n * 4, MMU_DATA_LOAD,
+                               mmu_idx, &physaddr, &attrs)) {
+        address_space_read(arm_addressspace(CPU(cpu), attrs), physaddr,
+                           attrs, (uint8_t *)frame, n * 4);
+        for (i = 0; i < n; i++) {
+            *dest[i] = le32_to_cpu(frame[i]);
+        }
+        return true;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!v7m_stack_read(cpu, dest[i], addr + i * 4, mmu_idx)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /* Return true if we're using the process stack pointer (not the MSP) */
 static bool v7m_using_psp(CPUARMState *env)
 {
@@ -6431,6 +6544,21 @@ static bool v7m_using_psp(CPUARMState *env)
         env->v7m.control[env->v7m.secure] & R_V7M_CONTROL_SPSEL_MASK;
 }
 
+/* Stack high-water mark: the stack pointer in use is sampled when
+ * an exception frame is pushed and whenever translated code returns to
+ * the cpu_exec loop.  Deeper excursions between samples go unseen.
+ */
+void arm_v7m_sample_sp(CPUState *cs)
+{
+    ARMCPU *cpu = ARM_CPU(cs);
+    CPUARMState *env = &cpu->env;
+    bool psp = v7m_using_psp(env);
+
+    if (env->regs[13] < cpu->sp_min[psp]) {
+        cpu->sp_min[psp] = env->regs[13];
+    }
+}
+
 /* Write to v7M CONTROL.SPSEL bit for the specified security bank.
  * This may change the current stack pointer between Main and Process
  * stack pointers if it is done for the CONTROL register for the current
@@ -6484,6 +6612,7 @@ void write_v7m_exception(CPUARMState *env, uint32_t new_exc)
         env->v7m.other_sp = env->regs[13];
         env->regs[13] = tmp;
     }
+    arm_rebuild_tb_flags(env);
 }
 
 /* Switch M profile security state between NS and S */
@@ -6518,6 +6647,7 @@ static void switch_v7m_security_state(CPUARMState *env, bool new_secstate)
         env->regs[13] = new_ss_msp;
         env->v7m.other_sp = new_ss_psp;
     }
+    arm_rebuild_tb_flags(env);
 }
 
 void HELPER(v7m_bxns)(CPUARMState *env, uint32_t dest)
@@ -6645,6 +6775,76 @@ static uint32_t *get_v7m_sp_ptr(CPUARMState *env, bool secure, bool threadmode,
     }
 }
 
+/* The vector table of an M profile CPU, such as the micro:bit's copy in
+ * microbit.code_loader, rarely moves.  While it is in ROM, exception
+ * entry reads it through a host pointer instead of address_space_ldl().
+ * The entries are read live, so writing them needs no invalidation; any
+ * change to the memory map drops the pointer.
+ */
+typedef struct ARMVecCache {
+    MemoryListener listener;
+    uint32_t base;          /* VTOR the pointer was set up for */
+    uint32_t len;
+    uint8_t *host;          /* NULL if nothing is cached */
+} ARMVecCache;
+
+static void arm_v7m_vec_cache_commit(MemoryListener *listener)
+{
+    ARMVecCache *c = container_of(listener, ARMVecCache, listener);
+
+    c->host = NULL;
+}
+
+void arm_v7m_vec_cache_init(ARMCPU *cpu)
+{
+    ARMVecCache *c = g_new0(ARMVecCache, 1);
+
+    c->listener.commit = arm_v7m_vec_cache_commit;
+    memory_listener_register(&c->listener, CPU(cpu)->as);
+    cpu->vec_cache = c;
+}
+
+void arm_v7m_vec_cache_free(ARMCPU *cpu)
+{
+    if (cpu->vec_cache) {
+        memory_listener_unregister(&cpu->vec_cache->listener);
+        g_free(cpu->vec_cache);
+        cpu->vec_cache = NULL;
+    }
+}
+
+static bool arm_v7m_vec_cache_load(ARMCPU *cpu, uint32_t addr,
+                                   uint32_t *pvec)
+{
+    ARMVecCache *c = cpu->vec_cache;
+    uint32_t base = cpu->env.v7m.vecbase[M_REG_NS];
+    MemoryRegion *mr;
+    hwaddr xlat, len = 512 * 4;     /* the most vectors there can be */
+
+    if (!c) {
+        return false;
+    }
+    if (!c->host || c->base != base) {
+        c->host = NULL;
+        rcu_read_lock();
+        mr = address_space_translate(CPU(cpu)->as, base, &xlat, &len, false);
+        if (memory_region_is_rom(mr) && len >= 4) {
+            c->host = memory_region_get_ram_ptr(mr) + xlat;
+            c->base = base;
+            c->len = len;
+        }
+        rcu_read_unlock();
+        if (!c->host) {
+            return false;
+        }
+    }
+    if (addr - base > c->len - 4) {
+        return false;
+    }
+    *pvec = ldl_p(c->host + (addr - base));
+    return true;
+}
+
 static bool arm_v7m_load_vector(ARMCPU *cpu, int exc, bool targets_secure,
                                 uint32_t *pvec)
 {
@@ -6657,6 +6857,10 @@ static bool arm_v7m_load_vector(ARMCPU *cpu, int exc, bool targets_secure,
     ARMMMUIdx mmu_idx;
     bool exc_secure;
 
+    if (arm_v7m_vec_cache_load(cpu, addr, pvec)) {
+        return true;
+    }
+
     mmu_idx = arm_v7m_mmu_idx_for_secstate_and_priv(env, targets_secure, true);
 
     /* We don't do a get_phys_addr() here because the rules for vector
@@ -6776,6 +6980,10 @@ static void v7m_exception_taken(ARMCPU *cpu, uint32_t lr, bool dotailchain,
     int exc;
     bool push_failed = false;
 
+    /* Exception entry is a WFE wakeup event */
+    env->v7m.event_register = 1;
+    env->v7m.wfe_halted = 0;
+
     armv7m_nvic_get_pending_irq_info(env->nvic, &exc, &targets_secure);
 
     if (arm_feature(env, ARM_FEATURE_V8)) {
@@ -6869,6 +7077,8 @@ static void v7m_exception_taken(ARMCPU *cpu, uint32_t lr, bool dotailchain,
     /* Switch to target security state -- must do this before writing SPSEL */
     switch_v7m_security_state(env, targets_secure);
     write_v7m_control_spsel(env, 0);
+    /* The handler starts without FP context of its own */
+    env->v7m.control[M_REG_S] &= ~R_V7M_CONTROL_FPCA_MASK;
     arm_clear_exclusive(env);
     /* Clear IT bits */
     env->condexec_bits = 0;
@@ -6890,6 +7100,10 @@ static bool v7m_push_stack(ARMCPU *cpu)
     uint32_t xpsr = xpsr_read(env);
     uint32_t frameptr = env->regs[13];
     ARMMMUIdx mmu_idx = core_to_arm_mmu_idx(env, cpu_mmu_index(env, false));
+    uint32_t frame[V7M_FP_FRAME_WORDS];
+    int nwords = 8;
+    bool lazy = false;
+    int i;
 
     /* Align stack pointer if the guest wants that */
     if ((frameptr & 4) &&
@@ -6898,22 +7112,55 @@ static bool v7m_push_stack(ARMCPU *cpu)
         xpsr |= XPSR_SPREALIGN;
     }
 
-    frameptr -= 0x20;
+    /* An active FP context gets the extended frame.  With FPCCR.LSPEN
+     * only the space is reserved: LSPACT records that the FP registers
+     * still belong to the interrupted code, and the first FP insn of the
+     * handler writes them out to FPCAR (see HELPER(v7m_fp_activate)).
+     */
+    if (env->v7m.control[M_REG_S] & R_V7M_CONTROL_FPCA_MASK) {
+        if (env->v7m.fpccr & R_V7M_FPCCR_LSPEN_MASK) {
+            lazy = true;
+        } else {
+            for (i = 0; i < 16; i++) {
+                frame[8 + i] = extract64(*aa32_vfp_dreg(env, i >> 1),
+                                         (i & 1) * 32, 32);
+            }
+            frame[24] = vfp_get_fpscr(env);
+            frame[25] = 0;
+        }
+        nwords = V7M_FP_FRAME_WORDS;
+    }
+
+    frameptr -= nwords * 4;
+    if (nwords > 8) {
+        env->v7m.fpcar = frameptr + 0x20;
+    }
+    if (lazy) {
+        env->v7m.fpccr &= ~(R_V7M_FPCCR_USER_MASK | R_V7M_FPCCR_THREAD_MASK);
+        env->v7m.fpccr |= R_V7M_FPCCR_LSPACT_MASK;
+        if (!arm_v7m_is_handler_mode(env)) {
+            env->v7m.fpccr |= R_V7M_FPCCR_THREAD_MASK;
+            if (env->v7m.control[env->v7m.secure] & R_V7M_CONTROL_NPRIV_MASK) {
+                env->v7m.fpccr |= R_V7M_FPCCR_USER_MASK;
+            }
+        }
+    }
 
     /* Write as much of the stack frame as we can. If we fail a stack
      * write this will result in a derived exception being pended
      * (which may be taken in preference to the one we started with
      * if it has higher priority).
      */
-    stacked_ok =
-        v7m_stack_write(cpu, frameptr, env->regs[0], mmu_idx, false) &&
-        v7m_stack_write(cpu, frameptr + 4, env->regs[1], mmu_idx, false) &&
-        v7m_stack_write(cpu, frameptr + 8, env->regs[2], mmu_idx, false) &&
-        v7m_stack_write(cpu, frameptr + 12, env->regs[3], mmu_idx, false) &&
-        v7m_stack_write(cpu, frameptr + 16, env->regs[12], mmu_idx, false) &&
-        v7m_stack_write(cpu, frameptr + 20, env->regs[14], mmu_idx, false) &&
-        v7m_stack_write(cpu, frameptr + 24, env->regs[15], mmu_idx, false) &&
-        v7m_stack_write(cpu, frameptr + 28, xpsr, mmu_idx, false);
+    frame[0] = env->regs[0];
+    frame[1] = env->regs[1];
+    frame[2] = env->regs[2];
+    frame[3] = env->regs[3];
+    frame[4] = env->regs[12];
+    frame[5] = env->regs[14];
+    frame[6] = env->regs[15];
+    frame[7] = xpsr;
+    stacked_ok = v7m_stack_write_frame(cpu, frameptr, frame,
+                                       lazy ? 8 : nwords, mmu_idx);
 
     /* Update SP regardless of whether any of the stack accesses failed.
      * When we implement v8M stack limit checking then this attempt to
@@ -7084,6 +7331,20 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
         return;
     }
 
+    /* Tail-chaining: if a pending exception would preempt the code we
+     * are returning to, take it now on the existing stack frame, as the
+     * hardware does, rather than popping the frame here only to push
+     * it again when cpu_exec() takes the interrupt.  The frame's
+     * integrity checks are left for the return from that exception.
+     */
+    if (armv7m_nvic_can_take_pending_exception(env->nvic)) {
+        arm_clear_exclusive(env);
+        v7m_exception_taken(cpu, excret, true, false);
+        qemu_log_mask(CPU_LOG_INT, "...tail-chaining to pending exception "
+                      "%d\n", env->v7m.exception);
+        return;
+    }
+
     /* Set CONTROL.SPSEL from excret.SPSEL. Since we're still in
      * Handler mode (and will be until we write the new XPSR.Interrupt
      * field) this does not switch around the current stack pointer.
@@ -7109,6 +7370,24 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
         uint32_t frameptr = *frame_sp_p;
         bool pop_ok = true;
         ARMMMUIdx mmu_idx;
+        uint32_t fpregs[18];
+        uint32_t * const frame[V7M_FP_FRAME_WORDS] = {
+            &env->regs[0], &env->regs[1], &env->regs[2], &env->regs[3],
+            &env->regs[12], &env->regs[14], &env->regs[15], &xpsr,
+            &fpregs[0], &fpregs[1], &fpregs[2], &fpregs[3],
+            &fpregs[4], &fpregs[5], &fpregs[6], &fpregs[7],
+            &fpregs[8], &fpregs[9], &fpregs[10], &fpregs[11],
+            &fpregs[12], &fpregs[13], &fpregs[14], &fpregs[15],
+            &fpregs[16], &fpregs[17],
+        };
+        bool fp_frame = !(excret & R_V7M_EXCRET_FTYPE_MASK) &&
+            arm_feature(env, ARM_FEATURE_VFP);
+        /* The handler never used FP: the registers were not saved and
+         * still hold the values to return with
+         */
+        bool fp_lazy = fp_frame &&
+            (env->v7m.fpccr & R_V7M_FPCCR_LSPACT_MASK);
+        int i;
 
         mmu_idx = arm_v7m_mmu_idx_for_secstate_and_priv(env, return_to_secure,
                                                         !return_to_handler);
@@ -7156,14 +7435,9 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
 
         /* Pop registers */
         pop_ok = pop_ok &&
-            v7m_stack_read(cpu, &env->regs[0], frameptr, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[1], frameptr + 0x4, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[2], frameptr + 0x8, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[3], frameptr + 0xc, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[12], frameptr + 0x10, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[14], frameptr + 0x14, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[15], frameptr + 0x18, mmu_idx) &&
-            v7m_stack_read(cpu, &xpsr, frameptr + 0x1c, mmu_idx);
+            v7m_stack_read_frame(cpu, frame, frameptr,
+                                 fp_frame && !fp_lazy ?
+                                 V7M_FP_FRAME_WORDS : 8, mmu_idx);
 
         if (!pop_ok) {
             /* v7m_stack_read() pended a fault, so take it (as a tail
@@ -7215,6 +7489,23 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
 
         /* Commit to consuming the stack frame */
         frameptr += 0x20;
+        if (fp_lazy) {
+            env->v7m.fpccr &= ~R_V7M_FPCCR_LSPACT_MASK;
+            frameptr += 0x48;
+        } else if (fp_frame) {
+            for (i = 0; i < 16; i += 2) {
+                *aa32_vfp_dreg(env, i >> 1) =
+                    deposit64(fpregs[i], 32, 32, fpregs[i + 1]);
+            }
+            vfp_set_fpscr(env, fpregs[16]);
+            frameptr += 0x48;
+        }
+        if (arm_feature(env, ARM_FEATURE_VFP)) {
+            env->v7m.control[M_REG_S] &= ~R_V7M_CONTROL_FPCA_MASK;
+            if (fp_frame) {
+                env->v7m.control[M_REG_S] |= R_V7M_CONTROL_FPCA_MASK;
+            }
+        }
         /* Undo stack alignment (the SPREALIGN bit indicates that the original
          * pre-exception SP was not 8-aligned and we added a padding word to
          * align it, so we undo this by ORing in the bit that increases it
@@ -7244,15 +7535,31 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
         armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_USAGE, false);
         env->v7m.cfsr[env->v7m.secure] |= R_V7M_CFSR_INVPC_MASK;
         ignore_stackfaults = v7m_push_stack(cpu);
+        arm_v7m_sample_sp(CPU(cpu));
         v7m_exception_taken(cpu, excret, false, ignore_stackfaults);
         qemu_log_mask(CPU_LOG_INT, "...taking UsageFault on new stackframe: "
                       "failed exception return integrity check\n");
         return;
     }
 
-    /* Otherwise, we have a successful exception exit. */
+    /* Otherwise, we have a successful exception exit, which is also a
+     * WFE wakeup event.
+     */
     arm_clear_exclusive(env);
+    env->v7m.event_register = 1;
     qemu_log_mask(CPU_LOG_INT, "...successful exception return\n");
+
+    /* With SLEEPONEXIT, returning to Thread mode goes straight back to
+     * sleep, as if a WFI were at the return address.  The unstacking
+     * has been done, which the architecture permits.
+     */
+    if (!return_to_handler &&
+        (env->v7m.scr[env->v7m.secure] & R_V7M_SCR_SLEEPONEXIT_MASK) &&
+        !cpu_has_work(CPU(cpu))) {
+        qemu_log_mask(CPU_LOG_INT, "...sleeping on exit\n");
+        CPU(cpu)->halted = 1;
+        cpu_exit(CPU(cpu));
+    }
 }
 
 static bool do_v7m_function_return(ARMCPU *cpu)
@@ -7480,7 +7787,7 @@ gen_invep:
     return false;
 }
 
-void arm_v7m_cpu_do_interrupt(CPUState *cs)
+static void v7m_do_interrupt(CPUState *cs)
 {
     ARMCPU *cpu = ARM_CPU(cs);
     CPUARMState *env = &cpu->env;
@@ -7506,6 +7813,11 @@ void arm_v7m_cpu_do_interrupt(CPUState *cs)
         break;
     case EXCP_SWI:
         /* The PC already points to the next instruction.  */
+        if (cpu->svc_hook &&
+            cpu->svc_hook(cpu, env->exception.syndrome & 0xff,
+                          cpu->svc_hook_opaque)) {
+            return;
+        }
         armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_SVC, env->v7m.secure);
         break;
     case EXCP_PREFETCH_ABORT:
@@ -7656,15 +7968,29 @@ void arm_v7m_cpu_do_interrupt(CPUState *cs)
             lr |= R_V7M_EXCRET_SPSEL_MASK;
         }
     }
+    if (env->v7m.control[M_REG_S] & R_V7M_CONTROL_FPCA_MASK) {
+        /* v7m_push_stack() stacks the extended frame */
+        lr &= ~R_V7M_EXCRET_FTYPE_MASK;
+    }
     if (!arm_v7m_is_handler_mode(env)) {
         lr |= R_V7M_EXCRET_MODE_MASK;
     }
 
     ignore_stackfaults = v7m_push_stack(cpu);
+    arm_v7m_sample_sp(cs);
     v7m_exception_taken(cpu, lr, false, ignore_stackfaults);
     qemu_log_mask(CPU_LOG_INT, "... as %d\n", env->v7m.exception);
 }
 
+void arm_v7m_cpu_do_interrupt(CPUState *cs)
+{
+    v7m_do_interrupt(cs);
+    /* Entry and return change the mode, the NVIC's active exceptions
+     * and possibly FAULTMASK, CONTROL and the security state.
+     */
+    arm_rebuild_tb_flags(&ARM_CPU(cs)->env);
+}
+
 /* Function used to synchronize QEMU's AArch64 register set with AArch32
  * register set.  This is necessary when switching between AArch32 and AArch64
  * execution state.
@@ -10409,7 +10735,9 @@ uint32_t HELPER(v7m_mrs)(CPUARMState *env, uint32_t reg)
         return xpsr_read(env) & mask;
         break;
     case 20: /* CONTROL */
-        return env->v7m.control[env->v7m.secure];
+        /* FPCA is not banked, it lives in the Secure copy */
+        return env->v7m.control[env->v7m.secure] |
+            (env->v7m.control[M_REG_S] & R_V7M_CONTROL_FPCA_MASK);
     case 0x94: /* CONTROL_NS */
         /* We have to handle this here because unprivileged Secure code
          * can read the NS CONTROL register.
@@ -10512,7 +10840,7 @@ uint32_t HELPER(v7m_mrs)(CPUARMState *env, uint32_t reg)
     }
 }
 
-void HELPER(v7m_msr)(CPUARMState *env, uint32_t maskreg, uint32_t val)
+static void v7m_msr(CPUARMState *env, uint32_t maskreg, uint32_t val)
 {
     /* We're passed bits [11..0] of the instruction; extract
      * SYSm and the mask bits.
@@ -10676,6 +11004,10 @@ void HELPER(v7m_msr)(CPUARMState *env, uint32_t maskreg, uint32_t val)
         }
         env->v7m.control[env->v7m.secure] &= ~R_V7M_CONTROL_NPRIV_MASK;
         env->v7m.control[env->v7m.secure] |= val & R_V7M_CONTROL_NPRIV_MASK;
+        if (arm_feature(env, ARM_FEATURE_VFP)) {
+            env->v7m.control[M_REG_S] &= ~R_V7M_CONTROL_FPCA_MASK;
+            env->v7m.control[M_REG_S] |= val & R_V7M_CONTROL_FPCA_MASK;
+        }
         break;
     default:
     bad_reg:
@@ -10685,6 +11017,12 @@ void HELPER(v7m_msr)(CPUARMState *env, uint32_t maskreg, uint32_t val)
     }
 }
 
+void HELPER(v7m_msr)(CPUARMState *env, uint32_t maskreg, uint32_t val)
+{
+    v7m_msr(env, maskreg, val);
+    arm_rebuild_tb_flags(env);
+}
+
 uint32_t HELPER(v7m_tt)(CPUARMState *env, uint32_t addr, uint32_t op)
 {
     /* Implement the TT instruction. op is bits [7:6] of the insn. */
@@ -11170,6 +11508,11 @@ void HELPER(vfp_set_fpscr)(CPUARMState *env, uint32_t val)
     int i;
     uint32_t changed;
 
+    if (arm_feature(env, ARM_FEATURE_M)) {
+        /* No short vectors on M profile: LEN and STRIDE are RES0 */
+        val &= ~(FPSCR_LEN_MASK | FPSCR_STRIDE_MASK);
+    }
+
     changed = env->vfp.xregs[ARM_VFP_FPSCR];
     env->vfp.xregs[ARM_VFP_FPSCR] = (val & 0xffc8ffff);
     env->vfp.vec_len = (val >> 16) & 7;
@@ -11226,6 +11569,50 @@ void vfp_set_fpscr(CPUARMState *env, uint32_t val)
     HELPER(vfp_set_fpscr)(env, val);
 }
 
+/* Lazy FP state preservation: write the interrupted code's FP registers
+ * into the frame space reserved at FPCAR, with the privilege it had.
+ * A stacking fault is pended like one on exception entry.
+ */
+static void v7m_preserve_fp_state(CPUARMState *env)
+{
+    ARMCPU *cpu = arm_env_get_cpu(env);
+    bool priv = !(env->v7m.fpccr & R_V7M_FPCCR_USER_MASK);
+    ARMMMUIdx mmu_idx;
+    uint32_t frame[18];
+    int i;
+
+    mmu_idx = arm_v7m_mmu_idx_for_secstate_and_priv(env, env->v7m.secure,
+                                                    priv);
+    for (i = 0; i < 16; i++) {
+        frame[i] = extract64(*aa32_vfp_dreg(env, i >> 1), (i & 1) * 32, 32);
+    }
+    frame[16] = vfp_get_fpscr(env);
+    frame[17] = 0;
+    v7m_stack_write_frame(cpu, env->v7m.fpcar, frame, 18, mmu_idx);
+    env->v7m.fpccr &= ~R_V7M_FPCCR_LSPACT_MASK;
+}
+
+/* FP insn with lazy preservation pending, or without an FP context
+ * (FPCCR.ASPEN set): save the interrupted code's registers, then create
+ * a context with the FPSCR control bits taken from FPDSCR.
+ */
+void HELPER(v7m_fp_activate)(CPUARMState *env)
+{
+    uint32_t fpscr;
+
+    if (env->v7m.fpccr & R_V7M_FPCCR_LSPACT_MASK) {
+        v7m_preserve_fp_state(env);
+    }
+    if (!(env->v7m.fpccr & R_V7M_FPCCR_ASPEN_MASK) ||
+        (env->v7m.control[M_REG_S] & R_V7M_CONTROL_FPCA_MASK)) {
+        return;
+    }
+    fpscr = vfp_get_fpscr(env) & ~FPDSCR_MASK;
+    env->v7m.control[M_REG_S] |= R_V7M_CONTROL_FPCA_MASK;
+    vfp_set_fpscr(env, fpscr | (env->v7m.fpdscr & FPDSCR_MASK));
+    arm_rebuild_tb_flags(env);
+}
+
 #define VFP_HELPER(name, p) HELPER(glue(glue(vfp_,name),p))
 
 #define VFP_BINOP(name) \
@@ -12117,6 +12504,11 @@ static inline int fp_exception_el(CPUARMState *env)
         return 0;
     }
 
+    /* M profile has its own CPACR, which gives NOCP faults instead */
+    if (arm_feature(env, ARM_FEATURE_M)) {
+        return 0;
+    }
+
     /* The CPACR controls traps to EL1, or PL1 if we're 32 bit:
      * 0, 2 : trap EL0 and EL1/PL1 accesses
      * 1    : trap only EL0 accesses
@@ -12167,8 +12559,37 @@ static inline int fp_exception_el(CPUARMState *env)
     return 0;
 }
 
-void cpu_get_tb_cpu_state(CPUARMState *env, target_ulong *pc,
-                          target_ulong *cs_base, uint32_t *pflags)
+void arm_cpu_set_flat_ram(ARMCPU *cpu, uint32_t base, uint32_t size,
+                          void *host)
+{
+    CPUState *cs = CPU(cpu);
+    bool was_set = cpu->flat_ram_size != 0;
+
+    cpu->flat_ram_base = base;
+    cpu->flat_ram_size = size;
+    cpu->flat_ram_host = host;
+
+    /* Translated code has the old window built in */
+    if (was_set) {
+        tb_flush(cs);
+    }
+    arm_rebuild_tb_flags(&cpu->env);
+}
+
+/* CPACR.CP10 gives the access to the M profile FPU (CP11 must match) */
+static bool v7m_fp_access_ok(CPUARMState *env)
+{
+    switch (extract32(env->v7m.cpacr, 20, 2)) {
+    case 1:
+        return arm_current_el(env) != 0;
+    case 3:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static uint32_t arm_compute_tb_flags(CPUARMState *env)
 {
     ARMMMUIdx mmu_idx = core_to_arm_mmu_idx(env, cpu_mmu_index(env, false));
     int fp_el = fp_exception_el(env);
@@ -12178,7 +12599,6 @@ void cpu_get_tb_cpu_state(CPUARMState *env, target_ulong *pc,
         int sve_el = sve_exception_el(env);
         uint32_t zcr_len;
 
-        *pc = env->pc;
         flags = ARM_TBFLAG_AARCH64_STATE_MASK;
         /* Get control bits for tagged addresses */
         flags |= (arm_regime_tbi0(env, mmu_idx) << ARM_TBFLAG_TBI0_SHIFT);
@@ -12203,7 +12623,6 @@ void cpu_get_tb_cpu_state(CPUARMState *env, target_ulong *pc,
         }
         flags |= zcr_len << ARM_TBFLAG_ZCR_LEN_SHIFT;
     } else {
-        *pc = env->regs[15];
         flags = (env->thumb << ARM_TBFLAG_THUMB_SHIFT)
             | (env->vfp.vec_len << ARM_TBFLAG_VECLEN_SHIFT)
             | (env->vfp.vec_stride << ARM_TBFLAG_VECSTRIDE_SHIFT)
@@ -12212,7 +12631,16 @@ void cpu_get_tb_cpu_state(CPUARMState *env, target_ulong *pc,
         if (!(access_secure_reg(env))) {
             flags |= ARM_TBFLAG_NS_MASK;
         }
-        if (env->vfp.xregs[ARM_VFP_FPEXC] & (1 << 30)
+        if (arm_feature(env, ARM_FEATURE_M)) {
+            if (v7m_fp_access_ok(env)) {
+                flags |= ARM_TBFLAG_VFPEN_MASK;
+            }
+            if (((env->v7m.fpccr & R_V7M_FPCCR_ASPEN_MASK) &&
+                 !(env->v7m.control[M_REG_S] & R_V7M_CONTROL_FPCA_MASK)) ||
+                (env->v7m.fpccr & R_V7M_FPCCR_LSPACT_MASK)) {
+                flags |= ARM_TBFLAG_FPCA_SET_MASK;
+            }
+        } else if (env->vfp.xregs[ARM_VFP_FPEXC] & (1 << 30)
             || arm_el_is_aa64(env, 1)) {
             flags |= ARM_TBFLAG_VFPEN_MASK;
         }
@@ -12250,6 +12678,56 @@ void cpu_get_tb_cpu_state(CPUARMState *env, target_ulong *pc,
         flags |= ARM_TBFLAG_HANDLER_MASK;
     }
 
+    /* Only the default memory map lets RAM accesses skip the TLB;
+     * watchpoints are checked by cpu_get_tb_cpu_state().
+     */
+    if (arm_env_get_cpu(env)->flat_ram_size
+        && arm_feature(env, ARM_FEATURE_M)
+        && !arm_feature(env, ARM_FEATURE_M_SECURITY)
+        && !(env->v7m.mpu_ctrl[env->v7m.secure] & R_V7M_MPU_CTRL_ENABLE_MASK)) {
+        flags |= ARM_TBFLAG_FLAT_RAM_MASK;
+    }
+
+    return flags;
+}
+
+/* THUMB and CONDEXEC change without a helper call (BX, IT blocks), so
+ * they are merged in at lookup time rather than cached.
+ */
+#define ARM_TBFLAG_M_LIVE_MASK (ARM_TBFLAG_THUMB_MASK | \
+                                ARM_TBFLAG_CONDEXEC_MASK)
+
+void arm_rebuild_tb_flags(CPUARMState *env)
+{
+    if (arm_feature(env, ARM_FEATURE_M)) {
+        env->v7m.tb_flags = arm_compute_tb_flags(env)
+            & ~ARM_TBFLAG_M_LIVE_MASK;
+    }
+}
+
+void cpu_get_tb_cpu_state(CPUARMState *env, target_ulong *pc,
+                          target_ulong *cs_base, uint32_t *pflags)
+{
+    uint32_t flags;
+
+    if (arm_feature(env, ARM_FEATURE_M)) {
+        *pc = env->regs[15];
+        flags = env->v7m.tb_flags
+            | (env->thumb << ARM_TBFLAG_THUMB_SHIFT)
+            | (env->condexec_bits << ARM_TBFLAG_CONDEXEC_SHIFT);
+#ifdef CONFIG_DEBUG_TCG
+        /* A missing arm_rebuild_tb_flags() call shows up here */
+        g_assert(flags == arm_compute_tb_flags(env));
+#endif
+    } else {
+        *pc = is_a64(env) ? env->pc : env->regs[15];
+        flags = arm_compute_tb_flags(env);
+    }
+
+    if (!QTAILQ_EMPTY(&ENV_GET_CPU(env)->watchpoints)) {
+        flags &= ~ARM_TBFLAG_FLAT_RAM_MASK;
+    }
+
     *pflags = flags;
     *cs_base = 0;
 }
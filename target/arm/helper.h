@@ -50,12 +50,16 @@ DEF_HELPER_4(exception_with_syndrome, void, env, i32, i32, i32)
 DEF_HELPER_2(exception_bkpt_insn, void, env, i32)
 DEF_HELPER_1(setend, void, env)
 DEF_HELPER_2(wfi, void, env, i32)
-DEF_HELPER_1(wfe, void, env)
+DEF_HELPER_2(wfe, void, env, i32)
 DEF_HELPER_1(yield, void, env)
 DEF_HELPER_1(pre_hvc, void, env)
 DEF_HELPER_2(pre_smc, void, env, i32)
 
 DEF_HELPER_1(check_breakpoints, void, env)
+DEF_HELPER_FLAGS_2(ras_return, TCG_CALL_NO_WG, ptr, env, i32)
+DEF_HELPER_FLAGS_3(indirect_ic_fill, TCG_CALL_NO_RWG, i32, ptr, i32, i32)
+DEF_HELPER_2(hle_call, i32, env, i32)
+DEF_HELPER_2(pc_hook, void, env, i32)
 
 DEF_HELPER_3(cpsr_write, void, env, i32, i32)
 DEF_HELPER_2(cpsr_write_eret, void, env, i32)
@@ -63,6 +67,8 @@ DEF_HELPER_1(cpsr_read, i32, env)
 
 DEF_HELPER_3(v7m_msr, void, env, i32, i32)
 DEF_HELPER_2(v7m_mrs, i32, env, i32)
+DEF_HELPER_1(v7m_fp_activate, void, env)
+DEF_HELPER_1(v7m_spin_check, void, env)
 
 DEF_HELPER_2(v7m_bxns, void, env, i32)
 DEF_HELPER_2(v7m_blxns, void, env, i32)
@@ -88,6 +94,11 @@ DEF_HELPER_4(msr_banked, void, env, i32, i32, i32)
 DEF_HELPER_2(get_user_reg, i32, env, i32)
 DEF_HELPER_3(set_user_reg, void, env, i32, i32)
 
+DEF_HELPER_3(ldm_burst, void, env, i32, i32)
+DEF_HELPER_3(stm_burst, void, env, i32, i32)
+DEF_HELPER_4(mmio_direct_ld, i32, env, ptr, i32, i32)
+DEF_HELPER_5(mmio_direct_st, void, env, ptr, i32, i32, i32)
+
 DEF_HELPER_1(vfp_get_fpscr, i32, env)
 DEF_HELPER_2(vfp_set_fpscr, void, env, i32)
 
@@ -0,0 +1,151 @@
+/*
+ * ARM high-level emulation of C library routines
+ *
+ * A board that knows where the firmware keeps __aeabi_uidiv and friends,
+ * typically from its ELF symbols, registers them with arm_cpu_add_hle().
+ * The translator then calls helper_hle_call() on entry to such a routine
+ * and, if it did the work, returns straight to LR.  Results and memory
+ * contents are the ones the guest routine produces.  Whatever it would
+ * not handle the same way (division by zero, which calls the guest's
+ * __aeabi_idiv0, NaNs, or an LR that is an exception return) is left to
+ * the guest code.
+ *
+ * The same mechanism lets a board watch the entries to a range of code
+ * with arm_cpu_set_pc_hook(), e.g. to profile an interpreter, and
+ * arm_cpu_set_svc_hook() hands it the supervisor calls.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "internals.h"
+#include "exec/exec-all.h"
+#include "exec/cpu_ldst.h"
+#include "exec/helper-proto.h"
+#include "fpu/softfloat.h"
+
+static const char * const arm_hle_names[ARM_HLE_NUM] = {
+    [ARM_HLE_UIDIV]  = "__aeabi_uidiv",
+    [ARM_HLE_IDIV]   = "__aeabi_idiv",
+    [ARM_HLE_FADD]   = "__aeabi_fadd",
+    [ARM_HLE_FMUL]   = "__aeabi_fmul",
+    [ARM_HLE_MEMCPY] = "memcpy",
+    [ARM_HLE_MEMSET] = "memset",
+};
+
+bool arm_cpu_add_hle(ARMCPU *cpu, const char *name, uint32_t addr)
+{
+    int i;
+
+    for (i = ARM_HLE_NONE + 1; i < ARM_HLE_NUM; i++) {
+        if (!strcmp(name, arm_hle_names[i])) {
+            if (!cpu->hle_funcs) {
+                cpu->hle_funcs = g_hash_table_new(NULL, NULL);
+            }
+            g_hash_table_insert(cpu->hle_funcs, GUINT_TO_POINTER(addr & ~1),
+                                GINT_TO_POINTER(i));
+            return true;
+        }
+    }
+    return false;
+}
+
+void arm_cpu_set_pc_hook(ARMCPU *cpu, uint32_t lo, uint32_t hi,
+                         ARMPCHookFn *fn, void *opaque)
+{
+    cpu->pc_hook_lo = lo & ~1;
+    cpu->pc_hook_hi = hi;
+    cpu->pc_hook_opaque = opaque;
+    cpu->pc_hook = fn;
+}
+
+void arm_cpu_set_svc_hook(ARMCPU *cpu, ARMSVCHookFn *fn, void *opaque)
+{
+    cpu->svc_hook_opaque = opaque;
+    cpu->svc_hook = fn;
+}
+
+void HELPER(pc_hook)(CPUARMState *env, uint32_t pc)
+{
+    ARMCPU *cpu = arm_env_get_cpu(env);
+
+    cpu->pc_hook(cpu, pc, cpu->pc_hook_opaque);
+}
+
+/* The AEABI soft-float routines: IEEE round to nearest even, with
+ * denormals.  What a NaN comes out as is up to the library.
+ */
+static bool arm_hle_float(CPUARMState *env, ARMHLEFunc fn)
+{
+    float_status st = { };
+    float32 a = make_float32(env->regs[0]);
+    float32 b = make_float32(env->regs[1]);
+    float32 r;
+
+    if (float32_is_any_nan(a) || float32_is_any_nan(b)) {
+        return false;
+    }
+    set_float_rounding_mode(float_round_nearest_even, &st);
+    r = fn == ARM_HLE_FADD ? float32_add(a, b, &st) : float32_mul(a, b, &st);
+    if (float32_is_any_nan(r)) {
+        return false;
+    }
+    env->regs[0] = float32_val(r);
+    return true;
+}
+
+/* Run routine @fn for a call at the current PC.  Returns 1 if it is done
+ * and the caller must return to LR, 0 to run the guest code instead.
+ * A memory fault unwinds to the routine's first insn, before any
+ * register was written.
+ */
+uint32_t HELPER(hle_call)(CPUARMState *env, uint32_t fn)
+{
+    uintptr_t ra = GETPC();
+    uint32_t dst = env->regs[0];
+    uint32_t n = env->regs[2];
+    uint32_t i;
+
+    if (arm_feature(env, ARM_FEATURE_M) &&
+        env->regs[14] >= FNC_RETURN_MIN_MAGIC) {
+        return 0;
+    }
+
+    switch (fn) {
+    case ARM_HLE_UIDIV:
+        if (!env->regs[1]) {
+            return 0;
+        }
+        env->regs[0] /= env->regs[1];
+        break;
+    case ARM_HLE_IDIV:
+        if (!env->regs[1]) {
+            return 0;
+        }
+        /* INT_MIN / -1 wraps, as in the library */
+        if (env->regs[0] == INT32_MIN && env->regs[1] == -1) {
+            break;
+        }
+        env->regs[0] = (int32_t)env->regs[0] / (int32_t)env->regs[1];
+        break;
+    case ARM_HLE_FADD:
+    case ARM_HLE_FMUL:
+        return arm_hle_float(env, fn);
+    case ARM_HLE_MEMCPY:
+        for (i = 0; i < n; i++) {
+            cpu_stb_data_ra(env, dst + i,
+                            cpu_ldub_data_ra(env, env->regs[1] + i, ra), ra);
+        }
+        break;
+    case ARM_HLE_MEMSET:
+        for (i = 0; i < n; i++) {
+            cpu_stb_data_ra(env, dst + i, env->regs[1], ra);
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    return 1;
+}
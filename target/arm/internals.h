@@ -140,6 +140,14 @@ void switch_mode(CPUARMState *, int);
 void arm_cpu_register_gdb_regs_for_features(ARMCPU *cpu);
 void arm_translate_init(void);
 
+#ifndef CONFIG_USER_ONLY
+/* Let exception entry read the vector table through a host pointer
+ * while it is in ROM; for M profile CPUs without the Security Extension.
+ */
+void arm_v7m_vec_cache_init(ARMCPU *cpu);
+void arm_v7m_vec_cache_free(ARMCPU *cpu);
+#endif
+
 enum arm_fprounding {
     FPROUNDING_TIEEVEN,
     FPROUNDING_POSINF,
@@ -236,6 +236,25 @@ static const VMStateDescription vmstate_m_scr = {
     }
 };
 
+static bool m_event_needed(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+
+    return cpu->env.v7m.event_register || cpu->env.v7m.wfe_halted;
+}
+
+static const VMStateDescription vmstate_m_event = {
+    .name = "cpu/m/event",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = m_event_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(env.v7m.event_register, ARMCPU),
+        VMSTATE_UINT32(env.v7m.wfe_halted, ARMCPU),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_m_other_sp = {
     .name = "cpu/m/other-sp",
     .version_id = 1,
@@ -266,6 +285,30 @@ static const VMStateDescription vmstate_m_v8m = {
     }
 };
 
+static bool m_fp_needed(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+    CPUARMState *env = &cpu->env;
+
+    return arm_feature(env, ARM_FEATURE_M) && arm_feature(env, ARM_FEATURE_VFP);
+}
+
+static const VMStateDescription vmstate_m_fp = {
+    .name = "cpu/m/fp",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = m_fp_needed,
+    .fields = (VMStateField[]) {
+        /* For CONTROL.FPCA, which is kept in the Secure bank */
+        VMSTATE_UINT32(env.v7m.control[M_REG_S], ARMCPU),
+        VMSTATE_UINT32(env.v7m.cpacr, ARMCPU),
+        VMSTATE_UINT32(env.v7m.fpccr, ARMCPU),
+        VMSTATE_UINT32(env.v7m.fpcar, ARMCPU),
+        VMSTATE_UINT32(env.v7m.fpdscr, ARMCPU),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_m = {
     .name = "cpu/m",
     .version_id = 4,
@@ -290,7 +333,9 @@ static const VMStateDescription vmstate_m = {
         &vmstate_m_csselr,
         &vmstate_m_scr,
         &vmstate_m_other_sp,
+        &vmstate_m_event,
         &vmstate_m_v8m,
+        &vmstate_m_fp,
         NULL
     }
 };
@@ -648,6 +693,7 @@ static int cpu_post_load(void *opaque, int version_id)
 
     hw_breakpoint_update_all(cpu);
     hw_watchpoint_update_all(cpu);
+    arm_rebuild_tb_flags(&cpu->env);
 
     return 0;
 }
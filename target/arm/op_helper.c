@@ -24,6 +24,8 @@
 #include "internals.h"
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
+#include "exec/tb-hash.h"
+#include "sysemu/cpus.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -413,6 +415,60 @@ static inline int check_wfx_trap(CPUARMState *env, bool is_wfe)
     return 0;
 }
 
+/* Find the TB a function returns to.  If the return address is the one
+ * the last BL or BLX pushed, trust @flags, the translator's view of the
+ * state after the return, and only check the jump cache: that skips
+ * cpu_get_tb_cpu_state() and the hash table of helper_lookup_tb_ptr().
+ */
+void *HELPER(ras_return)(CPUARMState *env, uint32_t flags)
+{
+    CPUState *cs = CPU(arm_env_get_cpu(env));
+    uint32_t top = env->ras_top;
+    uint32_t pc = env->regs[15];
+    TranslationBlock *tb;
+
+    env->ras_top = (top - 1) & (ARM_RAS_SIZE - 1);
+    if (env->ras[top] == (pc | env->thumb)) {
+        tb = cpu_tb_jmp_cache_get(cs, tb_jmp_cache_hash_func(pc));
+        if (tb && tb->pc == pc && tb->cs_base == 0 && tb->flags == flags &&
+            tb->trace_vcpu_dstate == *cs->trace_dstate &&
+            (tb_cflags(tb) & (CF_HASH_MASK | CF_INVALID)) == curr_cflags()) {
+            return tb->tc.ptr;
+        }
+    }
+    return helper_lookup_tb_ptr(env);
+}
+
+/* Give the jump target @key of @tb's indirect jump one of its first @slots
+ * goto_tb slots, if the target is one the TB may chain to.  Returns the slot
+ * or -1.  A slot keeps its target for the TB's lifetime, so whatever
+ * cpu_exec chains it to stays the right TB.  Only Thumb targets are cached:
+ * their keys have bit 0 set, so none of them is 0, the free slot's value.
+ */
+uint32_t HELPER(indirect_ic_fill)(void *ptr, uint32_t key, uint32_t slots)
+{
+    TranslationBlock *tb = ptr;
+    uint32_t n;
+
+    if (!(key & 1)) {
+        return -1;
+    }
+#ifndef CONFIG_USER_ONLY
+    if (((key ^ tb->pc) & TARGET_PAGE_MASK) &&
+        ((key ^ (tb->pc + tb->size - 1)) & TARGET_PAGE_MASK)) {
+        return -1;
+    }
+#endif
+    for (n = 0; n < slots; n++) {
+        uint32_t old = atomic_cmpxchg(&tb->indirect_pc[n], 0, key);
+
+        if (old == 0 || old == key) {
+            return n;
+        }
+    }
+    return -1;
+}
+
 void HELPER(wfi)(CPUARMState *env, uint32_t insn_len)
 {
     CPUState *cs = CPU(arm_env_get_cpu(env));
@@ -436,8 +492,33 @@ void HELPER(wfi)(CPUARMState *env, uint32_t insn_len)
     cpu_loop_exit(cs);
 }
 
-void HELPER(wfe)(CPUARMState *env)
+void HELPER(wfe)(CPUARMState *env, uint32_t insn_len)
 {
+    CPUState *cs = CPU(arm_env_get_cpu(env));
+
+    if (arm_feature(env, ARM_FEATURE_M)) {
+        /* M profile cores are alone with their event register, so WFE
+         * can halt like WFI until an event or an interrupt arrives.
+         * M profile cores can never trap WFE either.
+         */
+        env->v7m.wfe_halted = 0;
+        if (env->v7m.event_register) {
+            env->v7m.event_register = 0;
+            return;
+        }
+        if (cpu_has_work(cs)) {
+            return;
+        }
+        /* Run the WFE again on wakeup so it consumes the event; an
+         * exception taken in the meantime sets the event register.
+         */
+        env->regs[15] -= insn_len;
+        env->v7m.wfe_halted = 1;
+        cs->exception_index = EXCP_HLT;
+        cs->halted = 1;
+        cpu_loop_exit(cs);
+    }
+
     /* This is a hint instruction that is semantically different
      * from YIELD even though we currently implement it identically.
      * Don't actually halt the CPU, just yield back to top
@@ -461,6 +542,55 @@ void HELPER(yield)(CPUARMState *env)
     cpu_loop_exit(cs);
 }
 
+/* Iterations in a row with the same state before a loop is spinning */
+#define ARM_SPIN_SKIP_LOOPS 64
+
+/* Called on the branch back to the start of a TB that neither stores
+ * nor calls helpers with side effects.  If it keeps going round with
+ * the same registers and flags and without MMIO reads, it waits for an
+ * ISR to change the RAM it loads from: only an interrupt can get it
+ * out, so with interrupts unmasked and none pending the time until the
+ * next timer is skipped as for a pollable register; see qemu_poll_skip.
+ */
+void HELPER(v7m_spin_check)(CPUARMState *env)
+{
+#ifndef CONFIG_USER_ONLY
+    ARMCPU *cpu = arm_env_get_cpu(env);
+    CPUState *cs = CPU(cpu);
+    uint64_t mmio = atomic_read(&cs->exec_stats.mmio);
+    uint32_t state[19];
+
+    memcpy(state, env->regs, 15 * sizeof(uint32_t));
+    state[15] = env->NF;
+    state[16] = env->ZF;
+    state[17] = env->CF;
+    state[18] = env->VF;
+    if (memcmp(state, cpu->spin_state, sizeof(state)) ||
+        mmio != cpu->spin_mmio) {
+        memcpy(cpu->spin_state, state, sizeof(state));
+        cpu->spin_mmio = mmio;
+        cpu->spin_count = 0;
+        return;
+    }
+
+    if (++cpu->spin_count < ARM_SPIN_SKIP_LOOPS) {
+        return;
+    }
+    cpu->spin_count = 0;
+    if (env->v7m.primask[env->v7m.secure] ||
+        env->v7m.faultmask[env->v7m.secure] ||
+        (cs->interrupt_request & CPU_INTERRUPT_HARD)) {
+        return;
+    }
+
+    qemu_mutex_lock_iothread();
+    qemu_poll_skip(cs);
+    qemu_mutex_unlock_iothread();
+    /* Leave the chained loop so that the timers run */
+    cpu_exit(cs);
+#endif
+}
+
 /* Raise an internal-to-QEMU exception. This is limited to only
  * those EXCP values which are special cases for QEMU to interrupt
  * execution and not to be used for exceptions which are passed to
@@ -561,6 +691,97 @@ void HELPER(set_user_reg)(CPUARMState *env, uint32_t regno, uint32_t val)
     }
 }
 
+/* LDM/STM of the registers in @regs, lowest register at @addr.  Where
+ * the words lie on one MMIO page the region sees them in a single
+ * access_burst call; otherwise they are transferred one by one.  Loaded
+ * values are only written back once every load has succeeded.
+ */
+void HELPER(ldm_burst)(CPUARMState *env, uint32_t addr, uint32_t regs)
+{
+    uintptr_t ra = GETPC();
+    unsigned count = ctpop32(regs);
+    uint32_t data[16];
+    unsigned i, n;
+
+    if (!tlb_access_burst(env, addr, data, count, false,
+                          cpu_mmu_index(env, false), ra)) {
+        for (i = 0; i < count; i++) {
+            data[i] = cpu_ldl_data_ra(env, addr + i * 4, ra);
+        }
+    }
+    for (i = 0, n = 0; i < 16; i++) {
+        if (regs & (1 << i)) {
+            env->regs[i] = data[n++];
+        }
+    }
+}
+
+void HELPER(stm_burst)(CPUARMState *env, uint32_t addr, uint32_t regs)
+{
+    uintptr_t ra = GETPC();
+    unsigned count = ctpop32(regs);
+    uint32_t data[16];
+    unsigned i, n;
+
+    for (i = 0, n = 0; i < 16; i++) {
+        if (regs & (1 << i)) {
+            data[n++] = env->regs[i];
+        }
+    }
+    if (!tlb_access_burst(env, addr, data, count, true,
+                          cpu_mmu_index(env, false), ra)) {
+        for (i = 0; i < count; i++) {
+            cpu_stl_data_ra(env, addr + i * 4, data[i], ra);
+        }
+    }
+}
+
+/* Load or store of @size bytes at the constant address @addr, calling
+ * the MMIO callback of handle @d directly when it still may.
+ */
+uint32_t HELPER(mmio_direct_ld)(CPUARMState *env, void *d, uint32_t addr,
+                                uint32_t size)
+{
+    CPUState *cs = CPU(arm_env_get_cpu(env));
+    uintptr_t ra = GETPC();
+    uint64_t val;
+
+    if (mmio_direct_access(cs, d, addr, &val, ra)) {
+        return val;
+    }
+    switch (size) {
+    case 1:
+        return cpu_ldub_data_ra(env, addr, ra);
+    case 2:
+        return cpu_lduw_data_ra(env, addr, ra);
+    default:
+        return cpu_ldl_data_ra(env, addr, ra);
+    }
+}
+
+void HELPER(mmio_direct_st)(CPUARMState *env, void *d, uint32_t addr,
+                            uint32_t val, uint32_t size)
+{
+    CPUState *cs = CPU(arm_env_get_cpu(env));
+    uintptr_t ra = GETPC();
+    uint64_t val64 = val;
+
+    if (mmio_direct_access(cs, d, addr, &val64, ra)) {
+        return;
+    }
+    switch (size) {
+    case 1:
+        cpu_stb_data_ra(env, addr, val, ra);
+        break;
+    case 2:
+        cpu_stw_data_ra(env, addr, val, ra);
+        break;
+    default:
+        cpu_stl_data_ra(env, addr, val, ra);
+        break;
+    }
+}
+
 void HELPER(set_r13_banked)(CPUARMState *env, uint32_t mode, uint32_t val)
 {
     if ((env->uncached_cpsr & CPSR_M) == mode) {
@@ -13405,9 +13405,14 @@ static void aarch64_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
         case DISAS_SWI:
             break;
         case DISAS_WFE:
+        {
+            TCGv_i32 tmp = tcg_const_i32(4);
+
             gen_a64_set_pc_im(dc->pc);
-            gen_helper_wfe(cpu_env);
+            gen_helper_wfe(cpu_env, tmp);
+            tcg_temp_free_i32(tmp);
             break;
+        }
         case DISAS_YIELD:
             gen_a64_set_pc_im(dc->pc);
             gen_helper_yield(cpu_env);
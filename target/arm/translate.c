@@ -24,6 +24,7 @@
 #include "internals.h"
 #include "disas/disas.h"
 #include "exec/exec-all.h"
+#include "exec/memory.h"
 #include "tcg-op.h"
 #include "tcg-op-gvec.h"
 #include "qemu/log.h"
@@ -235,6 +236,7 @@ static void store_reg(DisasContext *s, int reg, TCGv_i32 var)
         tcg_gen_andi_i32(var, var, s->thumb ? ~1 : ~3);
         s->base.is_jmp = DISAS_JUMP;
     }
+    s->const_regs &= ~(1 << reg);
     tcg_gen_mov_i32(cpu_R[reg], var);
     tcg_temp_free_i32(var);
 }
@@ -1071,6 +1073,32 @@ static inline void store_reg_from_load(DisasContext *s, int reg, TCGv_i32 var)
     }
 }
 
+/* M profile LDM/STM of two or more of r0-r12 and lr, as a single helper
+ * call so that a run of peripheral registers is one access_burst dispatch.
+ * Advances @addr past the transferred words, like the per-word loop.
+ * Returns false, having generated nothing, for lists containing SP or PC.
+ */
+static bool gen_ldm_stm_burst(DisasContext *s, TCGv_i32 addr, uint32_t regs,
+                              bool is_load)
+{
+    TCGv_i32 tmp;
+
+    if (!arm_dc_feature(s, ARM_FEATURE_M) || ctpop32(regs) < 2 ||
+        (regs & ((1 << 13) | (1 << 15)))) {
+        return false;
+    }
+    tmp = tcg_const_i32(regs);
+    if (is_load) {
+        s->const_regs &= ~regs;
+        gen_helper_ldm_burst(cpu_env, addr, tmp);
+    } else {
+        gen_helper_stm_burst(cpu_env, addr, tmp);
+    }
+    tcg_temp_free_i32(tmp);
+    tcg_gen_addi_i32(addr, addr, ctpop32(regs) * 4);
+    return true;
+}
+
 #ifdef CONFIG_USER_ONLY
 #define IS_USER_ONLY 1
 #else
@@ -1267,6 +1295,85 @@ static inline void gen_lookup_tb(DisasContext *s)
     s->base.is_jmp = DISAS_EXIT;
 }
 
+/* Offset in CPUARMState of M-profile PRIMASK (16), BASEPRI (17) or
+ * FAULTMASK (19) for the current security state.
+ */
+static int v7m_mask_offset(DisasContext *s, int reg)
+{
+    switch (reg) {
+    case 16:
+        return offsetof(CPUARMState, v7m.primask[s->v8m_secure]);
+    case 17:
+        return offsetof(CPUARMState, v7m.basepri[s->v8m_secure]);
+    case 19:
+        return offsetof(CPUARMState, v7m.faultmask[s->v8m_secure]);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/* After an M-profile write that may have unmasked interrupts: if the NVIC
+ * is asserting an interrupt, leave the TB before the next insn so that
+ * cpu_exec() takes it; otherwise carry on in this TB.  If @masked is
+ * given and non-zero at run time, nothing was unmasked.
+ * Exiting mid-TB loses the IT state and the icount budget of the rest
+ * of the TB, so in those cases, and when single-stepping, the TB just
+ * ends here as it would after the helper.
+ */
+static void gen_v7m_unmask_check(DisasContext *s, TCGv_i32 masked)
+{
+    TCGLabel *skip;
+    TCGv_i32 tmp;
+
+    if (s->condexec_mask || is_singlestepping(s) ||
+        (tb_cflags(s->base.tb) & CF_USE_ICOUNT)) {
+        gen_lookup_tb(s);
+        return;
+    }
+    skip = gen_new_label();
+    if (masked) {
+        tcg_gen_brcondi_i32(TCG_COND_NE, masked, 0, skip);
+    }
+    tmp = tcg_temp_new_i32();
+    tcg_gen_ld_i32(tmp, cpu_env,
+                   -ENV_OFFSET + offsetof(CPUState, interrupt_request));
+    tcg_gen_andi_i32(tmp, tmp, CPU_INTERRUPT_HARD);
+    tcg_gen_brcondi_i32(TCG_COND_EQ, tmp, 0, skip);
+    tcg_temp_free_i32(tmp);
+    gen_set_pc_im(s, s->pc);
+    tcg_gen_exit_tb(0);
+    gen_set_label(skip);
+}
+
+/* Inline MSR to PRIMASK or BASEPRI from privileged code; FAULTMASK
+ * also changes the MMU index, so it stays with the helper.  Returns
+ * false, generating nothing, for anything else.
+ */
+static bool gen_v7m_msr_mask(DisasContext *s, int maskreg, TCGv_i32 val)
+{
+    int reg = maskreg & 0xff;
+
+    if (IS_USER(s) || (reg != 16 && reg != 17)) {
+        return false;
+    }
+    tcg_gen_andi_i32(val, val, reg == 16 ? 1 : 0xff);
+    tcg_gen_st_i32(val, cpu_env, v7m_mask_offset(s, reg));
+    gen_v7m_unmask_check(s, reg == 16 ? val : NULL);
+    return true;
+}
+
+/* Inline MRS of PRIMASK, BASEPRI, BASEPRI_MAX or FAULTMASK from privileged
+ * code.  Returns false, generating nothing, for anything else.
+ */
+static bool gen_v7m_mrs_mask(DisasContext *s, int reg, TCGv_i32 dest)
+{
+    if (IS_USER(s) || reg < 16 || reg > 19) {
+        return false;
+    }
+    tcg_gen_ld_i32(dest, cpu_env, v7m_mask_offset(s, reg == 18 ? 17 : reg));
+    return true;
+}
+
 static inline void gen_hlt(DisasContext *s, int imm)
 {
     /* HLT. This has two purposes.
@@ -2913,7 +3020,8 @@ static int disas_dsp_insn(DisasContext *s, uint32_t insn)
 #define VFP_SREG(insn, bigbit, smallbit) \
   ((VFP_REG_SHR(insn, bigbit - 1) & 0x1e) | (((insn) >> (smallbit)) & 1))
 #define VFP_DREG(reg, insn, bigbit, smallbit) do { \
-    if (arm_dc_feature(s, ARM_FEATURE_VFP3)) { \
+    if (arm_dc_feature(s, ARM_FEATURE_VFP3) && \
+        !arm_dc_feature(s, ARM_FEATURE_M)) { \
         reg = (((insn) >> (bigbit)) & 0x0f) \
               | (((insn) >> ((smallbit) - 4)) & 0x10); \
     } else { \
@@ -3336,6 +3444,10 @@ static int disas_vfp_insn(DisasContext *s, uint32_t insn)
         return disas_vfp_v8_insn(s, insn);
     }
 
+    if (s->v7m_fpca_set) {
+        gen_helper_v7m_fp_activate(cpu_env);
+    }
+
     dp = ((insn & 0xf00) == 0xb00);
     switch ((insn >> 24) & 0xf) {
     case 0xe:
@@ -3440,6 +3552,10 @@ static int disas_vfp_insn(DisasContext *s, uint32_t insn)
                     if (insn & (1 << 21)) {
                         /* system register */
                         rn >>= 1;
+                        if (arm_dc_feature(s, ARM_FEATURE_M) &&
+                            rn != ARM_VFP_FPSCR) {
+                            return 1;
+                        }
 
                         switch (rn) {
                         case ARM_VFP_FPSID:
@@ -3506,6 +3622,10 @@ static int disas_vfp_insn(DisasContext *s, uint32_t insn)
                     /* arm->vfp */
                     if (insn & (1 << 21)) {
                         rn >>= 1;
+                        if (arm_dc_feature(s, ARM_FEATURE_M) &&
+                            rn != ARM_VFP_FPSCR) {
+                            return 1;
+                        }
                         /* system register */
                         switch (rn) {
                         case ARM_VFP_FPSID:
@@ -3552,6 +3672,10 @@ static int disas_vfp_insn(DisasContext *s, uint32_t insn)
             /* The opcode is in bits 23, 21, 20 and 6.  */
             op = ((insn >> 20) & 8) | ((insn >> 19) & 6) | ((insn >> 6) & 1);
             if (dp) {
+                if (arm_dc_feature(s, ARM_FEATURE_M)) {
+                    /* The M profile FPU is single precision only */
+                    return 1;
+                }
                 if (op == 15) {
                     /* rn is opcode */
                     rn = ((insn >> 15) & 0x1e) | ((insn >> 7) & 1);
@@ -3582,6 +3706,9 @@ static int disas_vfp_insn(DisasContext *s, uint32_t insn)
                 rn = VFP_SREG_N(insn);
                 if (op == 15 && rn == 15) {
                     /* Double precision destination.  */
+                    if (arm_dc_feature(s, ARM_FEATURE_M)) {
+                        return 1;
+                    }
                     VFP_DREG_D(rd, insn);
                 } else {
                     rd = VFP_SREG_D(insn);
@@ -4229,13 +4356,164 @@ static void gen_goto_ptr(void)
     tcg_gen_lookup_and_goto_ptr();
 }
 
+/* Push the return address of a Thumb BL or BLX on the return stack */
+static void gen_ras_push(DisasContext *s)
+{
+    TCGv_i32 top = tcg_temp_new_i32();
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+    TCGv_i32 tmp;
+
+    tcg_gen_ld_i32(top, cpu_env, offsetof(CPUARMState, ras_top));
+    tcg_gen_addi_i32(top, top, 1);
+    tcg_gen_andi_i32(top, top, ARM_RAS_SIZE - 1);
+    tcg_gen_st_i32(top, cpu_env, offsetof(CPUARMState, ras_top));
+    tcg_gen_shli_i32(top, top, 2);
+    tcg_gen_ext_i32_ptr(ptr, top);
+    tcg_gen_add_ptr(ptr, ptr, cpu_env);
+    tmp = tcg_const_i32(s->pc | 1);
+    tcg_gen_st_i32(tmp, ptr, offsetof(CPUARMState, ras));
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_ptr(ptr);
+    tcg_temp_free_i32(top);
+}
+
+/* If the routine at the current PC runs as host code, call it and, when
+ * it is done, return to LR as its BX LR would.  Otherwise, and after a
+ * helper that declined, translate the guest routine as usual.
+ */
+static void gen_hle_call(DisasContext *s)
+{
+    gpointer fn = g_hash_table_lookup(s->hle, GUINT_TO_POINTER(s->pc));
+    TCGLabel *label;
+    TCGv_i32 tmp;
+
+    if (!fn) {
+        return;
+    }
+    label = gen_new_label();
+    tmp = tcg_const_i32(GPOINTER_TO_INT(fn));
+    gen_helper_hle_call(tmp, cpu_env, tmp);
+    tcg_gen_brcondi_i32(TCG_COND_EQ, tmp, 0, label);
+    tcg_gen_movi_i32(tmp, 0);
+    store_cpu_field(tmp, condexec_bits);
+    tcg_gen_andi_i32(cpu_R[15], cpu_R[14], ~1);
+    gen_goto_ptr();
+    gen_set_label(label);
+}
+
+/* End the TB with a BX LR or POP {PC}.  After it, the CPU state is the
+ * one of this TB outside an IT block, which helper_ras_return() checks
+ * the predicted TB against.
+ */
+static void gen_ras_return(DisasContext *s)
+{
+    TCGv_i32 flags;
+    TCGv_ptr ptr;
+
+    if (!TCG_TARGET_HAS_goto_ptr || qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
+        gen_goto_ptr();
+        return;
+    }
+    flags = tcg_const_i32(s->base.tb->flags & ~ARM_TBFLAG_CONDEXEC_MASK);
+    ptr = tcg_temp_new_ptr();
+    gen_helper_ras_return(ptr, cpu_env, flags);
+    tcg_gen_goto_ptr(ptr);
+    tcg_temp_free_ptr(ptr);
+    tcg_temp_free_i32(flags);
+}
+
+/* End the TB with a jump through a table: TBB, TBH, LDR PC or MOV/ADD PC.
+ * The TB's free goto_tb slots serve as a small inline cache of its targets,
+ * filled by helper_indirect_ic_fill() in the order they are first seen, so
+ * that a switch chains directly to its usual cases; the others look the
+ * TB up as usual.
+ */
+static void gen_indirect_ic(DisasContext *s)
+{
+    TranslationBlock *tb = s->base.tb;
+    int slots = s->superblock_exits || s->condjmp ? 1 : 2;
+    TCGLabel *hit[2];
+    TCGv_i32 key, tmp, zero, arm;
+    TCGv_ptr ptr;
+    int n;
+
+    if (!TCG_TARGET_HAS_goto_ptr || qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
+        gen_goto_ptr();
+        return;
+    }
+    /* LDR PC interworks, so the Thumb bit is part of the target.  A Thumb
+     * target is keyed PC | 1; an ARM one gets 2, which is never cached, so
+     * that no key is ever 0, the value of a free slot.
+     */
+    key = tcg_temp_local_new_i32();
+    tmp = tcg_temp_local_new_i32();
+    zero = tcg_const_i32(0);
+    arm = tcg_const_i32(2);
+    tcg_gen_ld_i32(tmp, cpu_env, offsetof(CPUARMState, thumb));
+    tcg_gen_ori_i32(key, cpu_R[15], 1);
+    tcg_gen_movcond_i32(TCG_COND_NE, key, tmp, zero, key, arm);
+    tcg_temp_free_i32(arm);
+    tcg_temp_free_i32(zero);
+    for (n = 0; n < slots; n++) {
+        hit[n] = gen_new_label();
+        ptr = tcg_const_ptr(&tb->indirect_pc[n]);
+        tcg_gen_ld_i32(tmp, ptr, 0);
+        tcg_temp_free_ptr(ptr);
+        tcg_gen_brcond_i32(TCG_COND_EQ, tmp, key, hit[n]);
+    }
+    ptr = tcg_const_ptr(tb);
+    tcg_gen_movi_i32(tmp, slots);
+    gen_helper_indirect_ic_fill(tmp, ptr, key, tmp);
+    tcg_temp_free_ptr(ptr);
+    for (n = 0; n < slots; n++) {
+        tcg_gen_brcondi_i32(TCG_COND_EQ, tmp, n, hit[n]);
+    }
+    gen_goto_ptr();
+    for (n = 0; n < slots; n++) {
+        gen_set_label(hit[n]);
+        tcg_gen_goto_tb(n);
+        tcg_gen_exit_tb((uintptr_t)tb + n);
+    }
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_i32(key);
+}
+
+/* Whether the ops of the TB so far can only read guest memory: no
+ * stores, and no helper calls that might have side effects.
+ */
+static bool tb_ops_read_only(void)
+{
+    TCGOp *op;
+
+    QTAILQ_FOREACH(op, &tcg_ctx->ops, link) {
+        switch (op->opc) {
+        case INDEX_op_qemu_st_i32:
+        case INDEX_op_qemu_st_i64:
+            return false;
+        case INDEX_op_call:
+            if (!(op->args[TCGOP_CALLO(op) + TCGOP_CALLI(op) + 1] &
+                  TCG_CALL_NO_SIDE_EFFECTS)) {
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
 /* This will end the TB but doesn't guarantee we'll return to
  * cpu_loop_exec. Any live exit_requests will be processed as we
  * enter the next TB.
  */
 static void gen_goto_tb(DisasContext *s, int n, target_ulong dest)
 {
-    if (use_goto_tb(s, dest)) {
+    if (s->spin_skip && dest == s->base.pc_first && tb_ops_read_only()) {
+        gen_helper_v7m_spin_check(cpu_env);
+    }
+    if (use_goto_tb(s, dest) && !(n == 1 && s->superblock_exits)) {
+        translator_note_branch(&s->base, dest);
         tcg_gen_goto_tb(n);
         gen_set_pc_im(s, dest);
         tcg_gen_exit_tb((uintptr_t)s->base.tb + n);
@@ -4246,6 +4524,34 @@ static void gen_goto_tb(DisasContext *s, int n, target_ulong dest)
     s->base.is_jmp = DISAS_NORETURN;
 }
 
+/* Whether a superblock can go on translating at @dest rather than end with
+ * a branch there.  Only later addresses on the TB's page qualify, so that
+ * [pc_first, pc_next) still covers all of the TB's code for invalidation.
+ */
+static bool superblock_follow(DisasContext *s, uint32_t dest)
+{
+    return s->superblock && !s->condexec_mask && !is_singlestepping(s) &&
+        dest >= s->pc &&
+        (dest & TARGET_PAGE_MASK) == (s->base.pc_first & TARGET_PAGE_MASK);
+}
+
+/* Leave a superblock for @dest, a later address on its page, in the
+ * middle.  The first side exit can chain through goto_tb 1, and the end
+ * of the TB then looks its fallthrough up instead; the others always do.
+ */
+static void gen_superblock_exit(DisasContext *s, uint32_t dest)
+{
+    if (s->superblock_exits++ == 0) {
+        translator_note_branch(&s->base, dest);
+        tcg_gen_goto_tb(1);
+        gen_set_pc_im(s, dest);
+        tcg_gen_exit_tb((uintptr_t)s->base.tb + 1);
+    } else {
+        gen_set_pc_im(s, dest);
+        gen_goto_ptr();
+    }
+}
+
 static inline void gen_jmp (DisasContext *s, uint32_t dest)
 {
     if (unlikely(is_singlestepping(s))) {
@@ -4570,9 +4876,11 @@ static void gen_exception_return(DisasContext *s, TCGv_i32 pc)
  * For WFI we will halt the vCPU until an IRQ. For WFE and YIELD we
  * only call the helper when running single threaded TCG code to ensure
  * the next round-robin scheduled vCPU gets a crack. In MTTCG mode we
- * just skip this instruction. Currently the SEV/SEVL instructions
- * which are *one* of many ways to wake the CPU from WFE are not
- * implemented so we can't sleep like WFI does.
+ * just skip this instruction. Outside M profile the SEV/SEVL
+ * instructions which are *one* of many ways to wake the CPU from WFE
+ * are not implemented so we can't sleep like WFI does.  M profile
+ * has a single core and models the event register, so there WFE
+ * always calls the helper and may halt.
  */
 static void gen_nop_hint(DisasContext *s, int val)
 {
@@ -4593,12 +4901,20 @@ static void gen_nop_hint(DisasContext *s, int val)
         s->base.is_jmp = DISAS_WFI;
         break;
     case 2: /* wfe */
-        if (!(tb_cflags(s->base.tb) & CF_PARALLEL)) {
+        if (!(tb_cflags(s->base.tb) & CF_PARALLEL) ||
+            arm_dc_feature(s, ARM_FEATURE_M)) {
             gen_set_pc_im(s, s->pc);
             s->base.is_jmp = DISAS_WFE;
         }
         break;
     case 4: /* sev */
+        if (arm_dc_feature(s, ARM_FEATURE_M)) {
+            /* The only core to signal is ourselves */
+            TCGv_i32 tmp = tcg_const_i32(1);
+            store_cpu_field(tmp, v7m.event_register);
+            break;
+        }
+        /* fall through */
     case 5: /* sevl */
         /* TODO: Implement SEV, SEVL and WFE.  May help SMP performance.  */
     default: /* nop */
@@ -8177,6 +8493,48 @@ static void gen_clrex(DisasContext *s)
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
 
+/* The store half of gen_store_exclusive() once the address has matched,
+ * for TBs without CF_PARALLEL: with a single vCPU running nothing can
+ * store between the load-exclusive and here, so a plain load and compare
+ * against exclusive_val replaces the cmpxchg, and memory is only written
+ * on success.  Branches to @fail_label on a mismatch.  @addr must be a
+ * local temp, as it is used across the branch.
+ */
+static void gen_store_exclusive_serial(DisasContext *s, int rt, int rt2,
+                                       TCGv_i32 addr, TCGMemOp opc,
+                                       TCGLabel *fail_label)
+{
+    TCGv taddr;
+    TCGv_i64 t64 = tcg_temp_new_i64();
+    TCGv_i32 t1;
+
+    /* A narrower load zero-extends, as gen_load_exclusive() did */
+    taddr = gen_aa32_addr(s, addr, opc);
+    tcg_gen_qemu_ld_i64(t64, taddr, get_mem_index(s), opc);
+    tcg_temp_free(taddr);
+    tcg_gen_brcond_i64(TCG_COND_NE, t64, cpu_exclusive_val, fail_label);
+
+    taddr = gen_aa32_addr(s, addr, opc);
+    t1 = load_reg(s, rt);
+    if ((opc & MO_SIZE) == MO_64) {
+        TCGv_i32 t2 = load_reg(s, rt2);
+
+        /* Rt at the lower address, as in gen_store_exclusive() */
+        if (s->be_data == MO_BE) {
+            tcg_gen_concat_i32_i64(t64, t2, t1);
+        } else {
+            tcg_gen_concat_i32_i64(t64, t1, t2);
+        }
+        tcg_temp_free_i32(t2);
+        tcg_gen_qemu_st_i64(t64, taddr, get_mem_index(s), opc);
+    } else {
+        tcg_gen_qemu_st_i32(t1, taddr, get_mem_index(s), opc);
+    }
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_i64(t64);
+    tcg_temp_free(taddr);
+}
+
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
 {
@@ -8200,6 +8558,13 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     tcg_gen_brcond_i64(TCG_COND_NE, extaddr, cpu_exclusive_addr, fail_label);
     tcg_temp_free_i64(extaddr);
 
+    if (!(tb_cflags(s->base.tb) & CF_PARALLEL)) {
+        gen_store_exclusive_serial(s, rt, rt2, addr, opc, fail_label);
+        tcg_gen_movi_i32(cpu_R[rd], 0);
+        tcg_gen_br(done_label);
+        goto fail;
+    }
+
     taddr = gen_aa32_addr(s, addr, opc);
     t0 = tcg_temp_new_i32();
     t1 = load_reg(s, rt);
@@ -8245,6 +8610,7 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     tcg_temp_free_i32(t0);
     tcg_gen_br(done_label);
 
+ fail:
     gen_set_label(fail_label);
     tcg_gen_movi_i32(cpu_R[rd], 1);
     gen_set_label(done_label);
@@ -10028,6 +10394,79 @@ gen_thumb2_data_op(DisasContext *s, int op, int conds, uint32_t shifter_out,
     return 0;
 }
 
+/* ARMv6-M 32-bit insns */
+
+/* Turn S:J1:J2:imm10:imm11 into the BL offset S:I1:I2:imm10:imm11:'0' */
+static int t32_branch24(int x)
+{
+    /* I1 = NOT(J1 XOR S), I2 = NOT(J2 XOR S) */
+    x ^= !(x < 0) * (3 << 21);
+    return x << 1;
+}
+
+bool disas_t32_v6m(DisasContext *ctx, uint32_t insn);
+bool disas_t16(DisasContext *ctx, uint16_t insn);
+
+#include "decode-t32-v6m.inc.c"
+
+static bool trans_v6m_msr(DisasContext *s, arg_v6m_msr *a, uint32_t insn)
+{
+    TCGv_i32 tmp = load_reg(s, a->rn);
+    TCGv_i32 addr;
+
+    if (gen_v7m_msr_mask(s, a->sysm, tmp)) {
+        tcg_temp_free_i32(tmp);
+        return true;
+    }
+    /* the constant is the mask and SYSm fields */
+    addr = tcg_const_i32(a->sysm);
+    gen_helper_v7m_msr(cpu_env, addr, tmp);
+    tcg_temp_free_i32(addr);
+    tcg_temp_free_i32(tmp);
+    gen_lookup_tb(s);
+    return true;
+}
+
+static bool trans_v6m_mrs(DisasContext *s, arg_v6m_mrs *a, uint32_t insn)
+{
+    TCGv_i32 tmp = tcg_temp_new_i32();
+
+    if (!gen_v7m_mrs_mask(s, a->sysm, tmp)) {
+        TCGv_i32 addr = tcg_const_i32(a->sysm);
+
+        gen_helper_v7m_mrs(tmp, cpu_env, addr);
+        tcg_temp_free_i32(addr);
+    }
+    store_reg(s, a->rd, tmp);
+    return true;
+}
+
+static bool trans_v6m_barrier(DisasContext *s, arg_v6m_barrier *a,
+                              uint32_t insn)
+{
+    switch (a->op) {
+    case 4: /* dsb */
+    case 5: /* dmb */
+        tcg_gen_mb(TCG_MO_ALL | TCG_BAR_SC);
+        break;
+    case 6: /* isb */
+        /* Break the TB, as for v7: self-modifying code and pending
+         * interrupts must be seen by the next insn.
+         */
+        gen_goto_tb(s, 0, s->pc & ~1);
+        break;
+    }
+    return true;
+}
+
+static bool trans_v6m_bl(DisasContext *s, arg_v6m_bl *a, uint32_t insn)
+{
+    tcg_gen_movi_i32(cpu_R[14], s->pc | 1);
+    gen_ras_push(s);
+    gen_jmp(s, s->pc + a->imm);
+    return true;
+}
+
 /* Translate a 32-bit thumb instruction. */
 static void disas_thumb2_insn(DisasContext *s, uint32_t insn)
 {
@@ -10044,8 +10483,16 @@ static void disas_thumb2_insn(DisasContext *s, uint32_t insn)
     int logic_cc;
 
     /* The only 32 bit insn that's allowed for Thumb1 is the combined
-     * BL/BLX prefix and suffix.
+     * BL/BLX prefix and suffix. ARMv6-M additionally has MSR, MRS and the
+     * barriers, but not BLX; its decoder is generated from t32-v6m.decode.
      */
+    if (arm_dc_feature(s, ARM_FEATURE_M) &&
+        !arm_dc_feature(s, ARM_FEATURE_V7)) {
+        if (!disas_t32_v6m(s, insn)) {
+            goto illegal_op;
+        }
+        return;
+    }
     if ((insn & 0xf800e800) != 0xf000e800) {
         ARCH(6T2);
     }
@@ -10205,6 +10652,7 @@ static void disas_thumb2_insn(DisasContext *s, uint32_t insn)
                 tcg_gen_shli_i32(tmp, tmp, 1);
                 tcg_gen_addi_i32(tmp, tmp, s->pc);
                 store_reg(s, 15, tmp);
+                s->indirect_ic = true;
             } else {
                 int op2 = (insn >> 6) & 0x3;
                 op = (insn >> 4) & 0x3;
@@ -10328,28 +10776,32 @@ static void disas_thumb2_insn(DisasContext *s, uint32_t insn)
                 }
 
                 loaded_var = NULL;
-                for (i = 0; i < 16; i++) {
-                    if ((insn & (1 << i)) == 0)
-                        continue;
-                    if (insn & (1 << 20)) {
-                        /* Load.  */
-                        tmp = tcg_temp_new_i32();
-                        gen_aa32_ld32u(s, tmp, addr, get_mem_index(s));
-                        if (i == 15) {
-                            gen_bx_excret(s, tmp);
-                        } else if (i == rn) {
-                            loaded_var = tmp;
-                            loaded_base = 1;
+                if (((insn & (1 << 21)) && (insn & (1 << rn))) ||
+                    !gen_ldm_stm_burst(s, addr, insn & 0xffff,
+                                       insn & (1 << 20))) {
+                    for (i = 0; i < 16; i++) {
+                        if ((insn & (1 << i)) == 0)
+                            continue;
+                        if (insn & (1 << 20)) {
+                            /* Load.  */
+                            tmp = tcg_temp_new_i32();
+                            gen_aa32_ld32u(s, tmp, addr, get_mem_index(s));
+                            if (i == 15) {
+                                gen_bx_excret(s, tmp);
+                            } else if (i == rn) {
+                                loaded_var = tmp;
+                                loaded_base = 1;
+                            } else {
+                                store_reg(s, i, tmp);
+                            }
                         } else {
-                            store_reg(s, i, tmp);
+                            /* Store.  */
+                            tmp = load_reg(s, i);
+                            gen_aa32_st32(s, tmp, addr, get_mem_index(s));
+                            tcg_temp_free_i32(tmp);
                         }
-                    } else {
-                        /* Store.  */
-                        tmp = load_reg(s, i);
-                        gen_aa32_st32(s, tmp, addr, get_mem_index(s));
-                        tcg_temp_free_i32(tmp);
+                        tcg_gen_addi_i32(addr, addr, 4);
                     }
-                    tcg_gen_addi_i32(addr, addr, 4);
                 }
                 if (loaded_base) {
                     store_reg(s, rn, loaded_var);
@@ -10794,11 +11246,19 @@ static void disas_thumb2_insn(DisasContext *s, uint32_t insn)
     case 6: case 7: case 14: case 15:
         /* Coprocessor.  */
         if (arm_dc_feature(s, ARM_FEATURE_M)) {
-            /* We don't currently implement M profile FP support,
-             * so this entire space should give a NOCP fault.
+            /* The only coprocessors are the FPU as CP10 and CP11, and
+             * only once CPACR enables them; the rest of this space gives
+             * a NOCP fault.
              */
-            gen_exception_insn(s, 4, EXCP_NOCP, syn_uncategorized(),
-                               default_exception_el(s));
+            if (!arm_dc_feature(s, ARM_FEATURE_VFP) || !s->vfp_enabled ||
+                ((insn >> 8) & 0xe) != 10) {
+                gen_exception_insn(s, 4, EXCP_NOCP, syn_uncategorized(),
+                                   default_exception_el(s));
+                break;
+            }
+            if (((insn >> 24) & 3) == 3 || disas_vfp_insn(s, insn)) {
+                goto illegal_op;
+            }
             break;
         }
         if ((insn & 0xfe000a00) == 0xfc000800
@@ -10849,6 +11309,7 @@ static void disas_thumb2_insn(DisasContext *s, uint32_t insn)
                 if (insn & (1 << 14)) {
                     /* Branch and link.  */
                     tcg_gen_movi_i32(cpu_R[14], s->pc | 1);
+                    gen_ras_push(s);
                 }
 
                 offset += s->pc;
@@ -10893,6 +11354,10 @@ static void disas_thumb2_insn(DisasContext *s, uint32_t insn)
                     case 0: /* msr cpsr.  */
                         if (arm_dc_feature(s, ARM_FEATURE_M)) {
                             tmp = load_reg(s, rn);
+                            if (gen_v7m_msr_mask(s, insn & 0xfff, tmp)) {
+                                tcg_temp_free_i32(tmp);
+                                break;
+                            }
                             /* the constant is the mask and SYSm fields */
                             addr = tcg_const_i32(insn & 0xfff);
                             gen_helper_v7m_msr(cpu_env, addr, tmp);
@@ -11017,9 +11482,11 @@ static void disas_thumb2_insn(DisasContext *s, uint32_t insn)
                         /* mrs cpsr */
                         tmp = tcg_temp_new_i32();
                         if (arm_dc_feature(s, ARM_FEATURE_M)) {
-                            addr = tcg_const_i32(insn & 0xff);
-                            gen_helper_v7m_mrs(tmp, cpu_env, addr);
-                            tcg_temp_free_i32(addr);
+                            if (!gen_v7m_mrs_mask(s, insn & 0xff, tmp)) {
+                                addr = tcg_const_i32(insn & 0xff);
+                                gen_helper_v7m_mrs(tmp, cpu_env, addr);
+                                tcg_temp_free_i32(addr);
+                            }
                         } else {
                             gen_helper_cpsr_read(tmp, cpu_env);
                         }
@@ -11381,6 +11848,7 @@ static void disas_thumb2_insn(DisasContext *s, uint32_t insn)
             }
             if (rs == 15) {
                 gen_bx_excret(s, tmp);
+                s->indirect_ic = true;
             } else {
                 store_reg(s, rs, tmp);
             }
@@ -11422,690 +11890,812 @@ illegal_op:
                        default_exception_el(s));
 }
 
-static void disas_thumb_insn(DisasContext *s, uint32_t insn)
+/* Remember the operands of a CMP for thumb_gen_test_cc.  A CMP in an IT
+ * block may not set the flags at all, so it cannot be used.
+ */
+static void thumb_note_cmp(DisasContext *s, int rn, int rm, uint32_t imm)
 {
-    uint32_t val, op, rm, rn, rd, shift, cond;
-    int32_t offset;
-    int i;
-    TCGv_i32 tmp;
-    TCGv_i32 tmp2;
-    TCGv_i32 addr;
+    if (!s->condexec_mask && rn != 15 && rm != 15) {
+        s->cmp_end = s->pc;
+        s->cmp_rn = rn;
+        s->cmp_rm = rm;
+        s->cmp_imm = imm;
+        s->cmp_nz = false;
+    }
+}
 
-    switch (insn >> 12) {
-    case 0: case 1:
+/* Likewise for a 16-bit ALU op that set N and Z from its result in @rd */
+static void thumb_note_result(DisasContext *s, int rd)
+{
+    if (!s->condexec_mask) {
+        s->cmp_end = s->pc;
+        s->cmp_rn = rd;
+        s->cmp_rm = -1;
+        s->cmp_imm = 0;
+        s->cmp_nz = true;
+    }
+}
 
-        rd = insn & 7;
-        op = (insn >> 11) & 3;
-        if (op == 3) {
-            /* add/subtract */
-            rn = (insn >> 3) & 7;
-            tmp = load_reg(s, rn);
-            if (insn & (1 << 10)) {
-                /* immediate */
-                tmp2 = tcg_temp_new_i32();
-                tcg_gen_movi_i32(tmp2, (insn >> 6) & 7);
-            } else {
-                /* reg */
-                rm = (insn >> 6) & 7;
-                tmp2 = load_reg(s, rm);
-            }
-            if (insn & (1 << 9)) {
-                if (s->condexec_mask)
-                    tcg_gen_sub_i32(tmp, tmp, tmp2);
-                else
-                    gen_sub_CC(tmp, tmp, tmp2);
-            } else {
-                if (s->condexec_mask)
-                    tcg_gen_add_i32(tmp, tmp, tmp2);
-                else
-                    gen_add_CC(tmp, tmp, tmp2);
-            }
-            tcg_temp_free_i32(tmp2);
-            store_reg(s, rd, tmp);
-        } else {
-            /* shift immediate */
-            rm = (insn >> 3) & 7;
-            shift = (insn >> 6) & 0x1f;
-            tmp = load_reg(s, rm);
-            gen_arm_shift_im(tmp, op, shift, s->condexec_mask == 0);
-            if (!s->condexec_mask)
-                gen_logic_CC(tmp);
-            store_reg(s, rd, tmp);
-        }
-        break;
-    case 2: case 3:
-        /* arithmetic large immediate */
-        op = (insn >> 11) & 3;
-        rd = (insn >> 8) & 0x7;
-        if (op == 0) { /* mov */
-            tmp = tcg_temp_new_i32();
-            tcg_gen_movi_i32(tmp, insn & 0xff);
-            if (!s->condexec_mask)
-                gen_logic_CC(tmp);
-            store_reg(s, rd, tmp);
-        } else {
-            tmp = load_reg(s, rd);
-            tmp2 = tcg_temp_new_i32();
-            tcg_gen_movi_i32(tmp2, insn & 0xff);
-            switch (op) {
-            case 1: /* cmp */
-                gen_sub_CC(tmp, tmp, tmp2);
-                tcg_temp_free_i32(tmp);
-                tcg_temp_free_i32(tmp2);
-                break;
-            case 2: /* add */
-                if (s->condexec_mask)
-                    tcg_gen_add_i32(tmp, tmp, tmp2);
-                else
-                    gen_add_CC(tmp, tmp, tmp2);
-                tcg_temp_free_i32(tmp2);
-                store_reg(s, rd, tmp);
-                break;
-            case 3: /* sub */
-                if (s->condexec_mask)
-                    tcg_gen_sub_i32(tmp, tmp, tmp2);
-                else
-                    gen_sub_CC(tmp, tmp, tmp2);
-                tcg_temp_free_i32(tmp2);
-                store_reg(s, rd, tmp);
-                break;
-            }
-        }
-        break;
-    case 4:
-        if (insn & (1 << 11)) {
-            rd = (insn >> 8) & 7;
-            /* load pc-relative.  Bit 1 of PC is ignored.  */
-            val = s->pc + 2 + ((insn & 0xff) * 4);
-            val &= ~(uint32_t)2;
-            addr = tcg_temp_new_i32();
-            tcg_gen_movi_i32(addr, val);
-            tmp = tcg_temp_new_i32();
-            gen_aa32_ld32u_iss(s, tmp, addr, get_mem_index(s),
-                               rd | ISSIs16Bit);
-            tcg_temp_free_i32(addr);
-            store_reg(s, rd, tmp);
-            break;
-        }
-        if (insn & (1 << 10)) {
-            /* 0b0100_01xx_xxxx_xxxx
-             * - data processing extended, branch and exchange
-             */
-            rd = (insn & 7) | ((insn >> 4) & 8);
-            rm = (insn >> 3) & 0xf;
-            op = (insn >> 8) & 3;
-            switch (op) {
-            case 0: /* add */
-                tmp = load_reg(s, rd);
-                tmp2 = load_reg(s, rm);
-                tcg_gen_add_i32(tmp, tmp, tmp2);
-                tcg_temp_free_i32(tmp2);
-                store_reg(s, rd, tmp);
-                break;
-            case 1: /* cmp */
-                tmp = load_reg(s, rd);
-                tmp2 = load_reg(s, rm);
-                gen_sub_CC(tmp, tmp, tmp2);
-                tcg_temp_free_i32(tmp2);
-                tcg_temp_free_i32(tmp);
-                break;
-            case 2: /* mov/cpy */
-                tmp = load_reg(s, rm);
-                store_reg(s, rd, tmp);
-                break;
-            case 3:
-            {
-                /* 0b0100_0111_xxxx_xxxx
-                 * - branch [and link] exchange thumb register
-                 */
-                bool link = insn & (1 << 7);
+/* Branch to @label if condition @cc holds.  Straight after a CMP the
+ * condition is a comparison of its operands, which is one host compare
+ * where the flags would take several ops to combine; the flags are still
+ * set for whoever else reads them.  After ADDS, SUBS, MOVS and the like,
+ * EQ, NE, MI and PL compare the result with zero the same way.
+ */
+static void thumb_gen_test_cc(DisasContext *s, int cc, TCGLabel *label)
+{
+    static const TCGCond cmp_cond[14] = {
+        [0x0] = TCG_COND_EQ,  [0x1] = TCG_COND_NE,
+        [0x2] = TCG_COND_GEU, [0x3] = TCG_COND_LTU,
+        [0x4 ... 0x7] = TCG_COND_NEVER, /* N and V alone */
+        [0x8] = TCG_COND_GTU, [0x9] = TCG_COND_LEU,
+        [0xa] = TCG_COND_GE,  [0xb] = TCG_COND_LT,
+        [0xc] = TCG_COND_GT,  [0xd] = TCG_COND_LE,
+    };
+    static const TCGCond nz_cond[14] = {
+        [0x0] = TCG_COND_EQ,  [0x1] = TCG_COND_NE,
+        [0x2 ... 0x3] = TCG_COND_NEVER,
+        [0x4] = TCG_COND_LT,  [0x5] = TCG_COND_GE,
+        [0x6 ... 0xd] = TCG_COND_NEVER,
+    };
+    const TCGCond *conds = s->cmp_nz ? nz_cond : cmp_cond;
+
+    if (s->cmp_end != s->pc - 2 || conds[cc] == TCG_COND_NEVER) {
+        arm_gen_test_cc(cc, label);
+    } else if (s->cmp_nz) {
+        tcg_gen_brcondi_i32(conds[cc], cpu_R[s->cmp_rn], 0, label);
+    } else if (s->cmp_rm < 0) {
+        tcg_gen_brcondi_i32(cmp_cond[cc], cpu_R[s->cmp_rn], s->cmp_imm, label);
+    } else {
+        tcg_gen_brcond_i32(cmp_cond[cc], cpu_R[s->cmp_rn], cpu_R[s->cmp_rm],
+                           label);
+    }
+}
 
-                if (insn & 3) {
-                    goto undef;
-                }
-                if (link) {
-                    ARCH(5);
-                }
-                if ((insn & 4)) {
-                    /* BXNS/BLXNS: only exists for v8M with the
-                     * security extensions, and always UNDEF if NonSecure.
-                     * We don't implement these in the user-only mode
-                     * either (in theory you can use them from Secure User
-                     * mode but they are too tied in to system emulation.)
-                     */
-                    if (!s->v8m_secure || IS_USER_ONLY) {
-                        goto undef;
-                    }
-                    if (link) {
-                        gen_blxns(s, rm);
-                    } else {
-                        gen_bxns(s, rm);
-                    }
-                    break;
-                }
-                /* BLX/BX */
-                tmp = load_reg(s, rm);
-                if (link) {
-                    val = (uint32_t)s->pc | 1;
-                    tmp2 = tcg_temp_new_i32();
-                    tcg_gen_movi_i32(tmp2, val);
-                    store_reg(s, 14, tmp2);
-                    gen_bx(s, tmp);
-                } else {
-                    /* Only BX works as exception-return, not BLX */
-                    gen_bx_excret(s, tmp);
-                }
-                break;
-            }
-            }
-            break;
-        }
+/* 16-bit Thumb insns, decoded by the tables generated from t16.decode.
+ * A trans_ function returning false makes the insn UNDEFINED.
+ */
+
+#include "decode-t16.inc.c"
+
+static bool trans_shift_i(DisasContext *s, arg_shift_i *a, uint16_t insn)
+{
+    TCGv_i32 tmp = load_reg(s, a->rm);
 
-        /* data processing register */
-        rd = insn & 7;
-        rm = (insn >> 3) & 7;
-        op = (insn >> 6) & 0xf;
-        if (op == 2 || op == 3 || op == 4 || op == 7) {
-            /* the shift/rotate ops want the operands backwards */
-            val = rm;
-            rm = rd;
-            rd = val;
-            val = 1;
+    gen_arm_shift_im(tmp, a->op, a->imm, s->condexec_mask == 0);
+    if (!s->condexec_mask) {
+        gen_logic_CC(tmp);
+    }
+    store_reg(s, a->rd, tmp);
+    thumb_note_result(s, a->rd);
+    return true;
+}
+
+/* Rd = Rn +/- tmp2, setting the flags outside an IT block */
+static void gen_thumb_addsub(DisasContext *s, int rd, int rn, bool sub,
+                             TCGv_i32 tmp2)
+{
+    TCGv_i32 tmp = load_reg(s, rn);
+
+    if (sub) {
+        if (s->condexec_mask) {
+            tcg_gen_sub_i32(tmp, tmp, tmp2);
         } else {
-            val = 0;
+            gen_sub_CC(tmp, tmp, tmp2);
         }
-
-        if (op == 9) { /* neg */
-            tmp = tcg_temp_new_i32();
-            tcg_gen_movi_i32(tmp, 0);
-        } else if (op != 0xf) { /* mvn doesn't read its first operand */
-            tmp = load_reg(s, rd);
+    } else {
+        if (s->condexec_mask) {
+            tcg_gen_add_i32(tmp, tmp, tmp2);
         } else {
-            tmp = NULL;
+            gen_add_CC(tmp, tmp, tmp2);
         }
+    }
+    tcg_temp_free_i32(tmp2);
+    store_reg(s, rd, tmp);
+    thumb_note_result(s, rd);
+}
 
-        tmp2 = load_reg(s, rm);
-        switch (op) {
-        case 0x0: /* and */
-            tcg_gen_and_i32(tmp, tmp, tmp2);
-            if (!s->condexec_mask)
-                gen_logic_CC(tmp);
-            break;
-        case 0x1: /* eor */
-            tcg_gen_xor_i32(tmp, tmp, tmp2);
-            if (!s->condexec_mask)
-                gen_logic_CC(tmp);
-            break;
-        case 0x2: /* lsl */
-            if (s->condexec_mask) {
-                gen_shl(tmp2, tmp2, tmp);
-            } else {
-                gen_helper_shl_cc(tmp2, cpu_env, tmp2, tmp);
-                gen_logic_CC(tmp2);
-            }
-            break;
-        case 0x3: /* lsr */
-            if (s->condexec_mask) {
-                gen_shr(tmp2, tmp2, tmp);
-            } else {
-                gen_helper_shr_cc(tmp2, cpu_env, tmp2, tmp);
-                gen_logic_CC(tmp2);
-            }
-            break;
-        case 0x4: /* asr */
-            if (s->condexec_mask) {
-                gen_sar(tmp2, tmp2, tmp);
-            } else {
-                gen_helper_sar_cc(tmp2, cpu_env, tmp2, tmp);
-                gen_logic_CC(tmp2);
-            }
-            break;
-        case 0x5: /* adc */
-            if (s->condexec_mask) {
-                gen_adc(tmp, tmp2);
-            } else {
-                gen_adc_CC(tmp, tmp, tmp2);
-            }
-            break;
-        case 0x6: /* sbc */
-            if (s->condexec_mask) {
-                gen_sub_carry(tmp, tmp, tmp2);
-            } else {
-                gen_sbc_CC(tmp, tmp, tmp2);
-            }
-            break;
-        case 0x7: /* ror */
-            if (s->condexec_mask) {
-                tcg_gen_andi_i32(tmp, tmp, 0x1f);
-                tcg_gen_rotr_i32(tmp2, tmp2, tmp);
-            } else {
-                gen_helper_ror_cc(tmp2, cpu_env, tmp2, tmp);
-                gen_logic_CC(tmp2);
-            }
-            break;
-        case 0x8: /* tst */
-            tcg_gen_and_i32(tmp, tmp, tmp2);
+static bool trans_addsub_r(DisasContext *s, arg_addsub_r *a, uint16_t insn)
+{
+    gen_thumb_addsub(s, a->rd, a->rn, a->sub, load_reg(s, a->rm));
+    return true;
+}
+
+static bool trans_addsub_i(DisasContext *s, arg_addsub_i *a, uint16_t insn)
+{
+    gen_thumb_addsub(s, a->rd, a->rn, a->sub, tcg_const_i32(a->imm));
+    return true;
+}
+
+static bool trans_mov_i(DisasContext *s, arg_mov_i *a, uint16_t insn)
+{
+    TCGv_i32 tmp = tcg_const_i32(a->imm);
+
+    if (!s->condexec_mask) {
+        gen_logic_CC(tmp);
+    }
+    store_reg(s, a->rd, tmp);
+    thumb_note_result(s, a->rd);
+    return true;
+}
+
+static bool trans_cmp_i(DisasContext *s, arg_cmp_i *a, uint16_t insn)
+{
+    TCGv_i32 tmp = load_reg(s, a->rd);
+    TCGv_i32 tmp2 = tcg_const_i32(a->imm);
+
+    gen_sub_CC(tmp, tmp, tmp2);
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_i32(tmp2);
+    thumb_note_cmp(s, a->rd, -1, a->imm);
+    return true;
+}
+
+static bool trans_dp_r(DisasContext *s, arg_dp_r *a, uint16_t insn)
+{
+    int op = a->op;
+    int rd = a->rd;
+    int rm = a->rm;
+    /* Whether the result is in tmp2, to be stored to rm */
+    bool to_rm;
+    TCGv_i32 tmp;
+    TCGv_i32 tmp2;
+
+    if (op == 2 || op == 3 || op == 4 || op == 7) {
+        /* the shift/rotate ops want the operands backwards */
+        rm = a->rd;
+        rd = a->rm;
+        to_rm = true;
+    } else {
+        to_rm = false;
+    }
+
+    if (op == 9) { /* neg */
+        tmp = tcg_const_i32(0);
+    } else if (op != 0xf) { /* mvn doesn't read its first operand */
+        tmp = load_reg(s, rd);
+    } else {
+        tmp = NULL;
+    }
+
+    tmp2 = load_reg(s, rm);
+    switch (op) {
+    case 0x0: /* and */
+        tcg_gen_and_i32(tmp, tmp, tmp2);
+        if (!s->condexec_mask)
             gen_logic_CC(tmp);
-            rd = 16;
-            break;
-        case 0x9: /* neg */
-            if (s->condexec_mask)
-                tcg_gen_neg_i32(tmp, tmp2);
-            else
-                gen_sub_CC(tmp, tmp, tmp2);
-            break;
-        case 0xa: /* cmp */
-            gen_sub_CC(tmp, tmp, tmp2);
-            rd = 16;
-            break;
-        case 0xb: /* cmn */
-            gen_add_CC(tmp, tmp, tmp2);
-            rd = 16;
-            break;
-        case 0xc: /* orr */
-            tcg_gen_or_i32(tmp, tmp, tmp2);
-            if (!s->condexec_mask)
-                gen_logic_CC(tmp);
-            break;
-        case 0xd: /* mul */
-            tcg_gen_mul_i32(tmp, tmp, tmp2);
-            if (!s->condexec_mask)
-                gen_logic_CC(tmp);
-            break;
-        case 0xe: /* bic */
-            tcg_gen_andc_i32(tmp, tmp, tmp2);
-            if (!s->condexec_mask)
-                gen_logic_CC(tmp);
-            break;
-        case 0xf: /* mvn */
-            tcg_gen_not_i32(tmp2, tmp2);
-            if (!s->condexec_mask)
-                gen_logic_CC(tmp2);
-            val = 1;
-            rm = rd;
-            break;
-        }
-        if (rd != 16) {
-            if (val) {
-                store_reg(s, rm, tmp2);
-                if (op != 0xf)
-                    tcg_temp_free_i32(tmp);
-            } else {
-                store_reg(s, rd, tmp);
-                tcg_temp_free_i32(tmp2);
-            }
+        break;
+    case 0x1: /* eor */
+        tcg_gen_xor_i32(tmp, tmp, tmp2);
+        if (!s->condexec_mask)
+            gen_logic_CC(tmp);
+        break;
+    case 0x2: /* lsl */
+        if (s->condexec_mask) {
+            gen_shl(tmp2, tmp2, tmp);
         } else {
-            tcg_temp_free_i32(tmp);
-            tcg_temp_free_i32(tmp2);
+            gen_helper_shl_cc(tmp2, cpu_env, tmp2, tmp);
+            gen_logic_CC(tmp2);
         }
         break;
-
-    case 5:
-        /* load/store register offset.  */
-        rd = insn & 7;
-        rn = (insn >> 3) & 7;
-        rm = (insn >> 6) & 7;
-        op = (insn >> 9) & 7;
-        addr = load_reg(s, rn);
-        tmp = load_reg(s, rm);
-        tcg_gen_add_i32(addr, addr, tmp);
-        tcg_temp_free_i32(tmp);
-
-        if (op < 3) { /* store */
-            tmp = load_reg(s, rd);
+    case 0x3: /* lsr */
+        if (s->condexec_mask) {
+            gen_shr(tmp2, tmp2, tmp);
         } else {
-            tmp = tcg_temp_new_i32();
+            gen_helper_shr_cc(tmp2, cpu_env, tmp2, tmp);
+            gen_logic_CC(tmp2);
         }
-
-        switch (op) {
-        case 0: /* str */
-            gen_aa32_st32_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            break;
-        case 1: /* strh */
-            gen_aa32_st16_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            break;
-        case 2: /* strb */
-            gen_aa32_st8_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            break;
-        case 3: /* ldrsb */
-            gen_aa32_ld8s_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            break;
-        case 4: /* ldr */
-            gen_aa32_ld32u_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            break;
-        case 5: /* ldrh */
-            gen_aa32_ld16u_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            break;
-        case 6: /* ldrb */
-            gen_aa32_ld8u_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            break;
-        case 7: /* ldrsh */
-            gen_aa32_ld16s_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            break;
+        break;
+    case 0x4: /* asr */
+        if (s->condexec_mask) {
+            gen_sar(tmp2, tmp2, tmp);
+        } else {
+            gen_helper_sar_cc(tmp2, cpu_env, tmp2, tmp);
+            gen_logic_CC(tmp2);
         }
-        if (op >= 3) { /* load */
-            store_reg(s, rd, tmp);
+        break;
+    case 0x5: /* adc */
+        if (s->condexec_mask) {
+            gen_adc(tmp, tmp2);
         } else {
-            tcg_temp_free_i32(tmp);
+            gen_adc_CC(tmp, tmp, tmp2);
         }
-        tcg_temp_free_i32(addr);
         break;
-
-    case 6:
-        /* load/store word immediate offset */
-        rd = insn & 7;
-        rn = (insn >> 3) & 7;
-        addr = load_reg(s, rn);
-        val = (insn >> 4) & 0x7c;
-        tcg_gen_addi_i32(addr, addr, val);
-
-        if (insn & (1 << 11)) {
-            /* load */
-            tmp = tcg_temp_new_i32();
-            gen_aa32_ld32u(s, tmp, addr, get_mem_index(s));
-            store_reg(s, rd, tmp);
+    case 0x6: /* sbc */
+        if (s->condexec_mask) {
+            gen_sub_carry(tmp, tmp, tmp2);
         } else {
-            /* store */
-            tmp = load_reg(s, rd);
-            gen_aa32_st32(s, tmp, addr, get_mem_index(s));
-            tcg_temp_free_i32(tmp);
+            gen_sbc_CC(tmp, tmp, tmp2);
         }
-        tcg_temp_free_i32(addr);
         break;
-
-    case 7:
-        /* load/store byte immediate offset */
-        rd = insn & 7;
-        rn = (insn >> 3) & 7;
-        addr = load_reg(s, rn);
-        val = (insn >> 6) & 0x1f;
-        tcg_gen_addi_i32(addr, addr, val);
-
-        if (insn & (1 << 11)) {
-            /* load */
-            tmp = tcg_temp_new_i32();
-            gen_aa32_ld8u_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            store_reg(s, rd, tmp);
+    case 0x7: /* ror */
+        if (s->condexec_mask) {
+            tcg_gen_andi_i32(tmp, tmp, 0x1f);
+            tcg_gen_rotr_i32(tmp2, tmp2, tmp);
         } else {
-            /* store */
-            tmp = load_reg(s, rd);
-            gen_aa32_st8_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            tcg_temp_free_i32(tmp);
+            gen_helper_ror_cc(tmp2, cpu_env, tmp2, tmp);
+            gen_logic_CC(tmp2);
         }
-        tcg_temp_free_i32(addr);
         break;
+    case 0x8: /* tst */
+        tcg_gen_and_i32(tmp, tmp, tmp2);
+        gen_logic_CC(tmp);
+        rd = 16;
+        break;
+    case 0x9: /* neg */
+        if (s->condexec_mask)
+            tcg_gen_neg_i32(tmp, tmp2);
+        else
+            gen_sub_CC(tmp, tmp, tmp2);
+        break;
+    case 0xa: /* cmp */
+        gen_sub_CC(tmp, tmp, tmp2);
+        thumb_note_cmp(s, rd, rm, 0);
+        rd = 16;
+        break;
+    case 0xb: /* cmn */
+        gen_add_CC(tmp, tmp, tmp2);
+        rd = 16;
+        break;
+    case 0xc: /* orr */
+        tcg_gen_or_i32(tmp, tmp, tmp2);
+        if (!s->condexec_mask)
+            gen_logic_CC(tmp);
+        break;
+    case 0xd: /* mul */
+        tcg_gen_mul_i32(tmp, tmp, tmp2);
+        if (!s->condexec_mask)
+            gen_logic_CC(tmp);
+        break;
+    case 0xe: /* bic */
+        tcg_gen_andc_i32(tmp, tmp, tmp2);
+        if (!s->condexec_mask)
+            gen_logic_CC(tmp);
+        break;
+    case 0xf: /* mvn */
+        tcg_gen_not_i32(tmp2, tmp2);
+        if (!s->condexec_mask)
+            gen_logic_CC(tmp2);
+        to_rm = true;
+        rm = rd;
+        break;
+    }
+    if (rd != 16) {
+        if (to_rm) {
+            store_reg(s, rm, tmp2);
+            if (op != 0xf)
+                tcg_temp_free_i32(tmp);
+        } else {
+            store_reg(s, rd, tmp);
+            tcg_temp_free_i32(tmp2);
+        }
+        thumb_note_result(s, to_rm ? rm : rd);
+    } else {
+        tcg_temp_free_i32(tmp);
+        tcg_temp_free_i32(tmp2);
+    }
+    return true;
+}
 
-    case 8:
-        /* load/store halfword immediate offset */
-        rd = insn & 7;
-        rn = (insn >> 3) & 7;
-        addr = load_reg(s, rn);
-        val = (insn >> 5) & 0x3e;
-        tcg_gen_addi_i32(addr, addr, val);
+static bool trans_add_hr(DisasContext *s, arg_add_hr *a, uint16_t insn)
+{
+    TCGv_i32 tmp = load_reg(s, a->rd);
+    TCGv_i32 tmp2 = load_reg(s, a->rm);
 
-        if (insn & (1 << 11)) {
-            /* load */
-            tmp = tcg_temp_new_i32();
-            gen_aa32_ld16u_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            store_reg(s, rd, tmp);
+    tcg_gen_add_i32(tmp, tmp, tmp2);
+    tcg_temp_free_i32(tmp2);
+    store_reg(s, a->rd, tmp);
+    s->indirect_ic = a->rd == 15;
+    return true;
+}
+
+static bool trans_cmp_hr(DisasContext *s, arg_cmp_hr *a, uint16_t insn)
+{
+    TCGv_i32 tmp = load_reg(s, a->rd);
+    TCGv_i32 tmp2 = load_reg(s, a->rm);
+
+    gen_sub_CC(tmp, tmp, tmp2);
+    tcg_temp_free_i32(tmp2);
+    tcg_temp_free_i32(tmp);
+    thumb_note_cmp(s, a->rd, a->rm, 0);
+    return true;
+}
+
+static bool trans_mov_hr(DisasContext *s, arg_mov_hr *a, uint16_t insn)
+{
+    store_reg(s, a->rd, load_reg(s, a->rm));
+    s->indirect_ic = a->rd == 15;
+    return true;
+}
+
+/* BX, BLX (register) and their v8M NS variants */
+static bool gen_thumb_bx(DisasContext *s, arg_bx *a, bool link)
+{
+    TCGv_i32 tmp;
+
+    if (link && !ENABLE_ARCH_5) {
+        return false;
+    }
+    if (a->ns) {
+        /* BXNS/BLXNS: only exists for v8M with the
+         * security extensions, and always UNDEF if NonSecure.
+         * We don't implement these in the user-only mode
+         * either (in theory you can use them from Secure User
+         * mode but they are too tied in to system emulation.)
+         */
+        if (!s->v8m_secure || IS_USER_ONLY) {
+            return false;
+        }
+        if (link) {
+            gen_blxns(s, a->rm);
         } else {
-            /* store */
-            tmp = load_reg(s, rd);
-            gen_aa32_st16_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            tcg_temp_free_i32(tmp);
+            gen_bxns(s, a->rm);
         }
-        tcg_temp_free_i32(addr);
-        break;
+        return true;
+    }
+    /* BLX/BX */
+    tmp = load_reg(s, a->rm);
+    if (link) {
+        tcg_gen_movi_i32(cpu_R[14], (uint32_t)s->pc | 1);
+        gen_ras_push(s);
+        gen_bx(s, tmp);
+    } else {
+        /* Only BX works as exception-return, not BLX */
+        gen_bx_excret(s, tmp);
+        s->ras_return = a->rm == 14;
+    }
+    return true;
+}
 
-    case 9:
-        /* load/store from stack */
-        rd = (insn >> 8) & 7;
-        addr = load_reg(s, 13);
-        val = (insn & 0xff) * 4;
-        tcg_gen_addi_i32(addr, addr, val);
+static bool trans_bx(DisasContext *s, arg_bx *a, uint16_t insn)
+{
+    return gen_thumb_bx(s, a, false);
+}
 
-        if (insn & (1 << 11)) {
-            /* load */
-            tmp = tcg_temp_new_i32();
-            gen_aa32_ld32u_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            store_reg(s, rd, tmp);
-        } else {
-            /* store */
-            tmp = load_reg(s, rd);
-            gen_aa32_st32_iss(s, tmp, addr, get_mem_index(s), rd | ISSIs16Bit);
-            tcg_temp_free_i32(tmp);
+static bool trans_blx_r(DisasContext *s, arg_blx_r *a, uint16_t insn)
+{
+    return gen_thumb_bx(s, a, true);
+}
+
+/* Read the literal at @addr while translating, if it lies in ROM or in
+ * flash that is not writable.  Its page must be one of the TB's two, so
+ * that an NVMC write to it (cpu_physical_memory_write_rom) invalidates
+ * the TB, as does a store once flash is made writable.
+ */
+static bool arm_fold_literal(DisasContext *s, uint32_t addr, uint32_t *val)
+{
+#if !defined(CONFIG_USER_ONLY)
+    target_ulong page = addr & TARGET_PAGE_MASK;
+    target_ulong pc_page = s->base.pc_first & TARGET_PAGE_MASK;
+    MemoryRegion *mr;
+    hwaddr xlat, len = 4;
+    bool ret = false;
+
+    if (!s->literal_as ||
+        (page != pc_page && page != pc_page + TARGET_PAGE_SIZE)) {
+        return false;
+    }
+
+    rcu_read_lock();
+    mr = address_space_translate(s->literal_as, addr, &xlat, &len, false);
+    if (memory_region_is_rom(mr) && len >= 4) {
+        void *ptr = memory_region_get_ram_ptr(mr) + xlat;
+
+        *val = s->be_data == MO_BE ? ldl_be_p(ptr) : ldl_le_p(ptr);
+        if (page != pc_page) {
+            s->base.tb->data_page2 = true;
         }
-        tcg_temp_free_i32(addr);
-        break;
+        ret = true;
+    }
+    rcu_read_unlock();
+    return ret;
+#else
+    return false;
+#endif
+}
 
-    case 10:
-        /* add to high reg */
-        rd = (insn >> 8) & 7;
-        if (insn & (1 << 11)) {
-            /* SP */
-            tmp = load_reg(s, 13);
-        } else {
-            /* PC. bit 1 is ignored.  */
-            tmp = tcg_temp_new_i32();
-            tcg_gen_movi_i32(tmp, (s->pc + 2) & ~(uint32_t)2);
+static bool trans_ldr_lit(DisasContext *s, arg_ldr_lit *a, uint16_t insn)
+{
+    /* load pc-relative.  Bit 1 of PC is ignored.  */
+    uint32_t val = (s->pc + 2 + a->imm * 4) & ~(uint32_t)2;
+    uint32_t lit;
+    TCGv_i32 addr, tmp;
+
+    if (arm_fold_literal(s, val, &lit)) {
+        store_reg(s, a->rd, tcg_const_i32(lit));
+        /* Outside IT blocks, the register now holds it for sure */
+        if (!s->condexec_mask) {
+            s->const_regs |= 1 << a->rd;
+            s->const_val[a->rd] = lit;
         }
-        val = (insn & 0xff) * 4;
-        tcg_gen_addi_i32(tmp, tmp, val);
+        return true;
+    }
+
+    addr = tcg_const_i32(val);
+    tmp = tcg_temp_new_i32();
+    gen_aa32_ld32u_iss(s, tmp, addr, get_mem_index(s), a->rd | ISSIs16Bit);
+    tcg_temp_free_i32(addr);
+    store_reg(s, a->rd, tmp);
+    return true;
+}
+
+static bool trans_ldst_r(DisasContext *s, arg_ldst_r *a, uint16_t insn)
+{
+    /* str, strh, strb, ldrsb, ldr, ldrh, ldrb, ldrsh */
+    static const TCGMemOp memop[8] = {
+        MO_UL, MO_UW, MO_UB, MO_SB, MO_UL, MO_UW, MO_UB, MO_SW
+    };
+    int rd = a->rd;
+    TCGv_i32 addr = load_reg(s, a->rn);
+    TCGv_i32 tmp = load_reg(s, a->rm);
+
+    tcg_gen_add_i32(addr, addr, tmp);
+    tcg_temp_free_i32(tmp);
+
+    if (a->op < 3) {
+        tmp = load_reg(s, rd);
+        gen_aa32_st_i32(s, tmp, addr, get_mem_index(s),
+                        memop[a->op] | s->be_data);
+        disas_set_da_iss(s, memop[a->op], rd | ISSIs16Bit | ISSIsWrite);
+        tcg_temp_free_i32(tmp);
+    } else {
+        tmp = tcg_temp_new_i32();
+        gen_aa32_ld_i32(s, tmp, addr, get_mem_index(s),
+                        memop[a->op] | s->be_data);
+        disas_set_da_iss(s, memop[a->op], rd | ISSIs16Bit);
         store_reg(s, rd, tmp);
-        break;
+    }
+    tcg_temp_free_i32(addr);
+    return true;
+}
 
-    case 11:
-        /* misc */
-        op = (insn >> 8) & 0xf;
-        switch (op) {
-        case 0:
-            /* adjust stack pointer */
-            tmp = load_reg(s, 13);
-            val = (insn & 0x7f) * 4;
-            if (insn & (1 << 7))
-                val = -(int32_t)val;
-            tcg_gen_addi_i32(tmp, tmp, val);
-            store_reg(s, 13, tmp);
-            break;
+/* Load or store Rd at the constant address @addr by calling the MMIO
+ * region's callback directly, if the region allows it.  Under icount
+ * the access keeps the TLB path, which ends the TB at I/O.  Returns
+ * false, having generated nothing, for an ordinary access.
+ */
+static bool gen_mmio_direct(DisasContext *s, arg_ldst_i *a, uint32_t addr,
+                            TCGMemOp memop)
+{
+#if !defined(CONFIG_USER_ONLY)
+    unsigned size = 1 << (memop & MO_SIZE);
+    MMIODirect *d;
+    TCGv_ptr ptr;
+    TCGv_i32 taddr, tsize, tmp;
 
-        case 2: /* sign/zero extend.  */
-            ARCH(6);
-            rd = insn & 7;
-            rm = (insn >> 3) & 7;
-            tmp = load_reg(s, rm);
-            switch ((insn >> 6) & 3) {
-            case 0: gen_sxth(tmp); break;
-            case 1: gen_sxtb(tmp); break;
-            case 2: gen_uxth(tmp); break;
-            case 3: gen_uxtb(tmp); break;
-            }
-            store_reg(s, rd, tmp);
-            break;
-        case 4: case 5: case 0xc: case 0xd:
-            /* push/pop */
-            addr = load_reg(s, 13);
-            if (insn & (1 << 8))
-                offset = 4;
-            else
-                offset = 0;
-            for (i = 0; i < 8; i++) {
-                if (insn & (1 << i))
-                    offset += 4;
-            }
-            if ((insn & (1 << 11)) == 0) {
-                tcg_gen_addi_i32(addr, addr, -offset);
-            }
-            for (i = 0; i < 8; i++) {
-                if (insn & (1 << i)) {
-                    if (insn & (1 << 11)) {
-                        /* pop */
-                        tmp = tcg_temp_new_i32();
-                        gen_aa32_ld32u(s, tmp, addr, get_mem_index(s));
-                        store_reg(s, i, tmp);
-                    } else {
-                        /* push */
-                        tmp = load_reg(s, i);
-                        gen_aa32_st32(s, tmp, addr, get_mem_index(s));
-                        tcg_temp_free_i32(tmp);
-                    }
-                    /* advance to the next address.  */
-                    tcg_gen_addi_i32(addr, addr, 4);
-                }
-            }
-            tmp = NULL;
-            if (insn & (1 << 8)) {
-                if (insn & (1 << 11)) {
-                    /* pop pc */
-                    tmp = tcg_temp_new_i32();
-                    gen_aa32_ld32u(s, tmp, addr, get_mem_index(s));
-                    /* don't set the pc until the rest of the instruction
-                       has completed */
-                } else {
-                    /* push lr */
-                    tmp = load_reg(s, 14);
-                    gen_aa32_st32(s, tmp, addr, get_mem_index(s));
-                    tcg_temp_free_i32(tmp);
-                }
-                tcg_gen_addi_i32(addr, addr, 4);
-            }
-            if ((insn & (1 << 11)) == 0) {
-                tcg_gen_addi_i32(addr, addr, -offset);
-            }
-            /* write back the new stack pointer */
-            store_reg(s, 13, addr);
-            /* set the new PC value */
-            if ((insn & 0x0900) == 0x0900) {
-                store_reg_from_load(s, 15, tmp);
+    if (!s->literal_as || s->be_data != MO_TE || (addr & (size - 1)) ||
+        (tb_cflags(s->base.tb) & CF_USE_ICOUNT)) {
+        return false;
+    }
+    d = mmio_direct_lookup(s->literal_as, addr, size, !a->l);
+    if (!d) {
+        return false;
+    }
+
+    ptr = tcg_const_ptr(d);
+    taddr = tcg_const_i32(addr);
+    tsize = tcg_const_i32(size);
+    if (a->l) {
+        tmp = tcg_temp_new_i32();
+        gen_helper_mmio_direct_ld(tmp, cpu_env, ptr, taddr, tsize);
+        store_reg(s, a->rd, tmp);
+    } else {
+        tmp = load_reg(s, a->rd);
+        gen_helper_mmio_direct_st(cpu_env, ptr, taddr, tmp, tsize);
+        tcg_temp_free_i32(tmp);
+    }
+    tcg_temp_free_i32(tsize);
+    tcg_temp_free_i32(taddr);
+    tcg_temp_free_ptr(ptr);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Load or store Rd at Rn + imm, of size @memop */
+static void gen_thumb_ldst_i(DisasContext *s, arg_ldst_i *a, uint32_t imm,
+                             TCGMemOp memop, bool iss)
+{
+    TCGv_i32 addr, tmp;
+
+    /* A peripheral register, with its base from the literal pool */
+    if (a->rn < 8 && (s->const_regs & (1 << a->rn)) &&
+        gen_mmio_direct(s, a, s->const_val[a->rn] + imm, memop)) {
+        return;
+    }
+
+    addr = load_reg(s, a->rn);
+    tcg_gen_addi_i32(addr, addr, imm);
+    if (a->l) {
+        tmp = tcg_temp_new_i32();
+        gen_aa32_ld_i32(s, tmp, addr, get_mem_index(s), memop | s->be_data);
+        if (iss) {
+            disas_set_da_iss(s, memop, a->rd | ISSIs16Bit);
+        }
+        store_reg(s, a->rd, tmp);
+    } else {
+        tmp = load_reg(s, a->rd);
+        gen_aa32_st_i32(s, tmp, addr, get_mem_index(s), memop | s->be_data);
+        if (iss) {
+            disas_set_da_iss(s, memop, a->rd | ISSIs16Bit | ISSIsWrite);
+        }
+        tcg_temp_free_i32(tmp);
+    }
+    tcg_temp_free_i32(addr);
+}
+
+static bool trans_ldst_w_i(DisasContext *s, arg_ldst_w_i *a, uint16_t insn)
+{
+    gen_thumb_ldst_i(s, a, a->imm * 4, MO_UL, false);
+    return true;
+}
+
+static bool trans_ldst_b_i(DisasContext *s, arg_ldst_b_i *a, uint16_t insn)
+{
+    gen_thumb_ldst_i(s, a, a->imm, MO_UB, true);
+    return true;
+}
+
+static bool trans_ldst_h_i(DisasContext *s, arg_ldst_h_i *a, uint16_t insn)
+{
+    gen_thumb_ldst_i(s, a, a->imm * 2, MO_UW, true);
+    return true;
+}
+
+static bool trans_ldst_sp(DisasContext *s, arg_ldst_sp *a, uint16_t insn)
+{
+    gen_thumb_ldst_i(s, a, a->imm * 4, MO_UL, true);
+    return true;
+}
+
+static bool trans_adr(DisasContext *s, arg_adr *a, uint16_t insn)
+{
+    /* PC. bit 1 is ignored.  */
+    s->const_regs &= ~(1 << a->rd);
+    tcg_gen_movi_i32(cpu_R[a->rd], ((s->pc + 2) & ~(uint32_t)2) + a->imm * 4);
+    return true;
+}
+
+static bool trans_add_sp_i(DisasContext *s, arg_add_sp_i *a, uint16_t insn)
+{
+    TCGv_i32 tmp = load_reg(s, 13);
+
+    tcg_gen_addi_i32(tmp, tmp, a->imm * 4);
+    store_reg(s, a->rd, tmp);
+    return true;
+}
+
+static bool trans_adjust_sp(DisasContext *s, arg_adjust_sp *a, uint16_t insn)
+{
+    TCGv_i32 tmp = load_reg(s, 13);
+
+    tcg_gen_addi_i32(tmp, tmp, a->sub ? -a->imm * 4 : a->imm * 4);
+    store_reg(s, 13, tmp);
+    return true;
+}
+
+static bool trans_cbz(DisasContext *s, arg_cbz *a, uint16_t insn)
+{
+    TCGv_i32 tmp;
+
+    if (!ENABLE_ARCH_6T2) {
+        return false;
+    }
+    tmp = load_reg(s, a->rn);
+    s->condlabel = gen_new_label();
+    s->condjmp = 1;
+    tcg_gen_brcondi_i32(a->nz ? TCG_COND_EQ : TCG_COND_NE, tmp, 0,
+                        s->condlabel);
+    tcg_temp_free_i32(tmp);
+    gen_jmp(s, (uint32_t)s->pc + 2 + (a->imm << 1));
+    return true;
+}
+
+static bool trans_extend(DisasContext *s, arg_extend *a, uint16_t insn)
+{
+    TCGv_i32 tmp;
+
+    if (!ENABLE_ARCH_6) {
+        return false;
+    }
+    tmp = load_reg(s, a->rm);
+    switch (a->op) {
+    case 0: gen_sxth(tmp); break;
+    case 1: gen_sxtb(tmp); break;
+    case 2: gen_uxth(tmp); break;
+    case 3: gen_uxtb(tmp); break;
+    }
+    store_reg(s, a->rd, tmp);
+    return true;
+}
+
+static bool trans_push_pop(DisasContext *s, arg_push_pop *a, uint16_t insn)
+{
+    TCGv_i32 addr = load_reg(s, 13);
+    TCGv_i32 tmp;
+    int32_t offset = (ctpop8(a->list) + a->r) * 4;
+    int i;
+
+    if (!a->l) {
+        tcg_gen_addi_i32(addr, addr, -offset);
+    }
+    for (i = 0; i < 8; i++) {
+        if (a->list & (1 << i)) {
+            if (a->l) {
+                /* pop */
+                tmp = tcg_temp_new_i32();
+                gen_aa32_ld32u(s, tmp, addr, get_mem_index(s));
+                store_reg(s, i, tmp);
+            } else {
+                /* push */
+                tmp = load_reg(s, i);
+                gen_aa32_st32(s, tmp, addr, get_mem_index(s));
+                tcg_temp_free_i32(tmp);
             }
-            break;
-
-        case 1: case 3: case 9: case 11: /* czb */
-            rm = insn & 7;
-            tmp = load_reg(s, rm);
-            s->condlabel = gen_new_label();
-            s->condjmp = 1;
-            if (insn & (1 << 11))
-                tcg_gen_brcondi_i32(TCG_COND_EQ, tmp, 0, s->condlabel);
-            else
-                tcg_gen_brcondi_i32(TCG_COND_NE, tmp, 0, s->condlabel);
+            /* advance to the next address.  */
+            tcg_gen_addi_i32(addr, addr, 4);
+        }
+    }
+    tmp = NULL;
+    if (a->r) {
+        if (a->l) {
+            /* pop pc */
+            tmp = tcg_temp_new_i32();
+            gen_aa32_ld32u(s, tmp, addr, get_mem_index(s));
+            /* don't set the pc until the rest of the instruction
+               has completed */
+        } else {
+            /* push lr */
+            tmp = load_reg(s, 14);
+            gen_aa32_st32(s, tmp, addr, get_mem_index(s));
             tcg_temp_free_i32(tmp);
-            offset = ((insn & 0xf8) >> 2) | (insn & 0x200) >> 3;
-            val = (uint32_t)s->pc + 2;
-            val += offset;
-            gen_jmp(s, val);
-            break;
+        }
+        tcg_gen_addi_i32(addr, addr, 4);
+    }
+    if (!a->l) {
+        tcg_gen_addi_i32(addr, addr, -offset);
+    }
+    /* write back the new stack pointer */
+    store_reg(s, 13, addr);
+    /* set the new PC value */
+    if (a->l && a->r) {
+        store_reg_from_load(s, 15, tmp);
+        s->ras_return = true;
+    }
+    return true;
+}
 
-        case 15: /* IT, nop-hint.  */
-            if ((insn & 0xf) == 0) {
-                gen_nop_hint(s, (insn >> 4) & 0xf);
-                break;
-            }
-            /* If Then.  */
-            s->condexec_cond = (insn >> 4) & 0xe;
-            s->condexec_mask = insn & 0x1f;
-            /* No actual code generated for this insn, just setup state.  */
-            break;
+static bool trans_setend(DisasContext *s, arg_setend *a, uint16_t insn)
+{
+    if (!ENABLE_ARCH_6) {
+        return false;
+    }
+    if (a->e != (s->be_data == MO_BE)) {
+        gen_helper_setend(cpu_env);
+        s->base.is_jmp = DISAS_UPDATE;
+    }
+    return true;
+}
 
-        case 0xe: /* bkpt */
-        {
-            int imm8 = extract32(insn, 0, 8);
-            ARCH(5);
-            gen_exception_bkpt_insn(s, 2, syn_aa32_bkpt(imm8, true));
-            break;
+static bool trans_cps(DisasContext *s, arg_cps *a, uint16_t insn)
+{
+    TCGv_i32 tmp;
+    TCGv_i32 addr;
+
+    if (!ENABLE_ARCH_6) {
+        return false;
+    }
+    if (IS_USER(s)) {
+        return true;
+    }
+    if (arm_dc_feature(s, ARM_FEATURE_M)) {
+        tmp = tcg_const_i32(a->im);
+        /* FAULTMASK */
+        if (a->flags & 1) {
+            addr = tcg_const_i32(19);
+            gen_helper_v7m_msr(cpu_env, addr, tmp);
+            tcg_temp_free_i32(addr);
+        }
+        /* PRIMASK */
+        if (a->flags & 2) {
+            tcg_gen_st_i32(tmp, cpu_env, v7m_mask_offset(s, 16));
+        }
+        tcg_temp_free_i32(tmp);
+        if (a->flags & 1) {
+            gen_lookup_tb(s);
+        } else if (!a->im) {
+            gen_v7m_unmask_check(s, NULL);
         }
+    } else {
+        gen_set_psr_im(s, a->flags << 6, 0,
+                       a->im ? CPSR_A | CPSR_I | CPSR_F : 0);
+    }
+    return true;
+}
 
-        case 0xa: /* rev, and hlt */
-        {
-            int op1 = extract32(insn, 6, 2);
+/* REV, REV16 and REVSH */
+static bool gen_thumb_rev(DisasContext *s, arg_rr *a,
+                          void (*gen)(TCGv_i32))
+{
+    TCGv_i32 tmp;
 
-            if (op1 == 2) {
-                /* HLT */
-                int imm6 = extract32(insn, 0, 6);
+    if (!ENABLE_ARCH_6) {
+        return false;
+    }
+    tmp = load_reg(s, a->rm);
+    gen(tmp);
+    store_reg(s, a->rd, tmp);
+    return true;
+}
 
-                gen_hlt(s, imm6);
-                break;
-            }
+static void gen_rev(TCGv_i32 var)
+{
+    tcg_gen_bswap32_i32(var, var);
+}
 
-            /* Otherwise this is rev */
-            ARCH(6);
-            rn = (insn >> 3) & 0x7;
-            rd = insn & 0x7;
-            tmp = load_reg(s, rn);
-            switch (op1) {
-            case 0: tcg_gen_bswap32_i32(tmp, tmp); break;
-            case 1: gen_rev16(tmp); break;
-            case 3: gen_revsh(tmp); break;
-            default:
-                g_assert_not_reached();
-            }
-            store_reg(s, rd, tmp);
-            break;
-        }
+static bool trans_rev(DisasContext *s, arg_rev *a, uint16_t insn)
+{
+    return gen_thumb_rev(s, a, gen_rev);
+}
 
-        case 6:
-            switch ((insn >> 5) & 7) {
-            case 2:
-                /* setend */
-                ARCH(6);
-                if (((insn >> 3) & 1) != !!(s->be_data == MO_BE)) {
-                    gen_helper_setend(cpu_env);
-                    s->base.is_jmp = DISAS_UPDATE;
-                }
-                break;
-            case 3:
-                /* cps */
-                ARCH(6);
-                if (IS_USER(s)) {
-                    break;
-                }
-                if (arm_dc_feature(s, ARM_FEATURE_M)) {
-                    tmp = tcg_const_i32((insn & (1 << 4)) != 0);
-                    /* FAULTMASK */
-                    if (insn & 1) {
-                        addr = tcg_const_i32(19);
-                        gen_helper_v7m_msr(cpu_env, addr, tmp);
-                        tcg_temp_free_i32(addr);
-                    }
-                    /* PRIMASK */
-                    if (insn & 2) {
-                        addr = tcg_const_i32(16);
-                        gen_helper_v7m_msr(cpu_env, addr, tmp);
-                        tcg_temp_free_i32(addr);
-                    }
-                    tcg_temp_free_i32(tmp);
-                    gen_lookup_tb(s);
-                } else {
-                    if (insn & (1 << 4)) {
-                        shift = CPSR_A | CPSR_I | CPSR_F;
-                    } else {
-                        shift = 0;
-                    }
-                    gen_set_psr_im(s, ((insn & 7) << 6), 0, shift);
-                }
-                break;
-            default:
-                goto undef;
-            }
-            break;
+static bool trans_rev16(DisasContext *s, arg_rev16 *a, uint16_t insn)
+{
+    return gen_thumb_rev(s, a, gen_rev16);
+}
 
-        default:
-            goto undef;
-        }
-        break;
+static bool trans_revsh(DisasContext *s, arg_revsh *a, uint16_t insn)
+{
+    return gen_thumb_rev(s, a, gen_revsh);
+}
+
+static bool trans_hlt(DisasContext *s, arg_hlt *a, uint16_t insn)
+{
+    gen_hlt(s, a->imm);
+    return true;
+}
+
+static bool trans_bkpt(DisasContext *s, arg_bkpt *a, uint16_t insn)
+{
+    if (!ENABLE_ARCH_5) {
+        return false;
+    }
+    gen_exception_bkpt_insn(s, 2, syn_aa32_bkpt(a->imm, true));
+    return true;
+}
+
+static bool trans_it(DisasContext *s, arg_it *a, uint16_t insn)
+{
+    /* A zero mask makes it a nop-hint */
+    if ((a->cond_mask & 0xf) == 0) {
+        gen_nop_hint(s, a->cond_mask >> 4);
+        return true;
+    }
+    /* If Then.  */
+    if (!ENABLE_ARCH_6T2) {
+        return false;
+    }
+    s->condexec_cond = (a->cond_mask >> 4) & 0xe;
+    s->condexec_mask = a->cond_mask & 0x1f;
+    /* No actual code generated for this insn, just setup state.  */
+    return true;
+}
+
+static bool trans_ldm_stm(DisasContext *s, arg_ldm_stm *a, uint16_t insn)
+{
+    TCGv_i32 loaded_var = NULL;
+    TCGv_i32 addr = load_reg(s, a->rn);
+    TCGv_i32 tmp;
+    int i;
 
-    case 12:
-    {
-        /* load/store multiple */
-        TCGv_i32 loaded_var = NULL;
-        rn = (insn >> 8) & 0x7;
-        addr = load_reg(s, rn);
+    if (!gen_ldm_stm_burst(s, addr, a->list, a->l)) {
         for (i = 0; i < 8; i++) {
-            if (insn & (1 << i)) {
-                if (insn & (1 << 11)) {
+            if (a->list & (1 << i)) {
+                if (a->l) {
                     /* load */
                     tmp = tcg_temp_new_i32();
                     gen_aa32_ld32u(s, tmp, addr, get_mem_index(s));
-                    if (i == rn) {
+                    if (i == a->rn) {
                         loaded_var = tmp;
                     } else {
                         store_reg(s, i, tmp);
@@ -12120,98 +12710,127 @@ static void disas_thumb_insn(DisasContext *s, uint32_t insn)
                 tcg_gen_addi_i32(addr, addr, 4);
             }
         }
-        if ((insn & (1 << rn)) == 0) {
-            /* base reg not in list: base register writeback */
-            store_reg(s, rn, addr);
-        } else {
-            /* base reg in list: if load, complete it now */
-            if (insn & (1 << 11)) {
-                store_reg(s, rn, loaded_var);
-            }
-            tcg_temp_free_i32(addr);
+    }
+    if ((a->list & (1 << a->rn)) == 0) {
+        /* base reg not in list: base register writeback */
+        store_reg(s, a->rn, addr);
+    } else {
+        /* base reg in list: if load, complete it now */
+        if (loaded_var) {
+            store_reg(s, a->rn, loaded_var);
         }
-        break;
+        tcg_temp_free_i32(addr);
     }
-    case 13:
-        /* conditional branch or swi */
-        cond = (insn >> 8) & 0xf;
-        if (cond == 0xe)
-            goto undef;
+    return true;
+}
 
-        if (cond == 0xf) {
-            /* swi */
-            gen_set_pc_im(s, s->pc);
-            s->svc_imm = extract32(insn, 0, 8);
-            s->base.is_jmp = DISAS_SWI;
-            break;
-        }
-        /* generate a conditional jump to next instruction */
-        s->condlabel = gen_new_label();
-        arm_gen_test_cc(cond ^ 1, s->condlabel);
-        s->condjmp = 1;
+static bool trans_b_cond(DisasContext *s, arg_b_cond *a, uint16_t insn)
+{
+    uint32_t val;
 
-        /* jump to the offset */
-        val = (uint32_t)s->pc + 2;
-        offset = ((int32_t)insn << 24) >> 24;
-        val += offset << 1;
-        gen_jmp(s, val);
-        break;
+    if (a->cond == 0xe) {
+        /* UDF */
+        return false;
+    }
+    if (a->cond == 0xf) {
+        /* swi */
+        gen_set_pc_im(s, s->pc);
+        s->svc_imm = a->imm & 0xff;
+        s->base.is_jmp = DISAS_SWI;
+        return true;
+    }
+    val = (uint32_t)s->pc + 2 + a->imm * 2;
 
-    case 14:
-        if (insn & (1 << 11)) {
-            /* thumb_insn_is_16bit() ensures we can't get here for
-             * a Thumb2 CPU, so this must be a thumb1 split BL/BLX:
-             * 0b1110_1xxx_xxxx_xxxx : BLX suffix (or UNDEF)
-             */
-            assert(!arm_dc_feature(s, ARM_FEATURE_THUMB2));
-            ARCH(5);
-            offset = ((insn & 0x7ff) << 1);
-            tmp = load_reg(s, 14);
-            tcg_gen_addi_i32(tmp, tmp, offset);
-            tcg_gen_andi_i32(tmp, tmp, 0xfffffffc);
+    if (superblock_follow(s, val)) {
+        /* Side exit if taken, then go on with the next insn */
+        TCGLabel *not_taken = gen_new_label();
 
-            tmp2 = tcg_temp_new_i32();
-            tcg_gen_movi_i32(tmp2, s->pc | 1);
-            store_reg(s, 14, tmp2);
-            gen_bx(s, tmp);
-            break;
+        thumb_gen_test_cc(s, a->cond ^ 1, not_taken);
+        if (s->v6m_cycles) {
+            gen_icount_consume(2);
         }
-        /* unconditional branch */
-        val = (uint32_t)s->pc;
-        offset = ((int32_t)insn << 21) >> 21;
-        val += (offset << 1) + 2;
-        gen_jmp(s, val);
-        break;
+        gen_superblock_exit(s, val);
+        gen_set_label(not_taken);
+        return true;
+    }
 
-    case 15:
-        /* thumb_insn_is_16bit() ensures we can't get here for
-         * a Thumb2 CPU, so this must be a thumb1 split BL/BLX.
-         */
-        assert(!arm_dc_feature(s, ARM_FEATURE_THUMB2));
+    /* generate a conditional jump to next instruction */
+    s->condlabel = gen_new_label();
+    thumb_gen_test_cc(s, a->cond ^ 1, s->condlabel);
+    s->condjmp = 1;
+    if (s->v6m_cycles) {
+        /* A taken branch refills the pipeline: 3 cycles, not 1 */
+        gen_icount_consume(2);
+    }
 
-        if (insn & (1 << 11)) {
-            /* 0b1111_1xxx_xxxx_xxxx : BL suffix */
-            offset = ((insn & 0x7ff) << 1) | 1;
-            tmp = load_reg(s, 14);
-            tcg_gen_addi_i32(tmp, tmp, offset);
+    /* jump to the offset */
+    gen_jmp(s, val);
+    return true;
+}
 
-            tmp2 = tcg_temp_new_i32();
-            tcg_gen_movi_i32(tmp2, s->pc | 1);
-            store_reg(s, 14, tmp2);
-            gen_bx(s, tmp);
-        } else {
-            /* 0b1111_0xxx_xxxx_xxxx : BL/BLX prefix */
-            uint32_t uoffset = ((int32_t)insn << 21) >> 9;
+static bool trans_b(DisasContext *s, arg_b *a, uint16_t insn)
+{
+    uint32_t val = (uint32_t)s->pc + 2 + a->imm * 2;
 
-            tcg_gen_movi_i32(cpu_R[14], s->pc + 2 + uoffset);
-        }
-        break;
+    if (superblock_follow(s, val)) {
+        s->pc = val;
+        return true;
+    }
+    gen_jmp(s, val);
+    return true;
+}
+
+/* The suffix of a Thumb-1 split BL (@blx false) or BLX */
+static void gen_thumb_bl_suffix(DisasContext *s, uint32_t offset, bool blx)
+{
+    TCGv_i32 tmp = load_reg(s, 14);
+
+    tcg_gen_addi_i32(tmp, tmp, offset);
+    if (blx) {
+        tcg_gen_andi_i32(tmp, tmp, 0xfffffffc);
+    }
+    tcg_gen_movi_i32(cpu_R[14], s->pc | 1);
+    gen_ras_push(s);
+    gen_bx(s, tmp);
+}
+
+static bool trans_blx_suffix(DisasContext *s, arg_blx_suffix *a,
+                             uint16_t insn)
+{
+    /* thumb_insn_is_16bit() ensures we can't get here for
+     * a Thumb2 CPU, so this must be a thumb1 split BL/BLX:
+     * 0b1110_1xxx_xxxx_xxxx : BLX suffix (or UNDEF)
+     */
+    assert(!arm_dc_feature(s, ARM_FEATURE_THUMB2));
+    if (!ENABLE_ARCH_5) {
+        return false;
+    }
+    gen_thumb_bl_suffix(s, a->imm << 1, true);
+    return true;
+}
+
+static bool trans_bl_prefix(DisasContext *s, arg_bl_prefix *a, uint16_t insn)
+{
+    assert(!arm_dc_feature(s, ARM_FEATURE_THUMB2));
+    /* 0b1111_0xxx_xxxx_xxxx : BL/BLX prefix */
+    tcg_gen_movi_i32(cpu_R[14], s->pc + 2 + ((uint32_t)a->imm << 12));
+    return true;
+}
+
+static bool trans_bl_suffix(DisasContext *s, arg_bl_suffix *a, uint16_t insn)
+{
+    assert(!arm_dc_feature(s, ARM_FEATURE_THUMB2));
+    /* 0b1111_1xxx_xxxx_xxxx : BL suffix */
+    gen_thumb_bl_suffix(s, (a->imm << 1) | 1, false);
+    return true;
+}
+
+static void disas_thumb_insn(DisasContext *s, uint32_t insn)
+{
+    if (!disas_t16(s, insn)) {
+        gen_exception_insn(s, 2, EXCP_UDEF, syn_uncategorized(),
+                           default_exception_el(s));
     }
-    return;
-illegal_op:
-undef:
-    gen_exception_insn(s, 2, EXCP_UDEF, syn_uncategorized(),
-                       default_exception_el(s));
 }
 
 static bool insn_crosses_page(CPUARMState *env, DisasContext *s)
@@ -12228,6 +12847,41 @@ static bool insn_crosses_page(CPUARMState *env, DisasContext *s)
     return !thumb_insn_is_16bit(s, insn);
 }
 
+static bool thumb_it_block_cut(CPUARMState *env, DisasContext *s)
+{
+    /* Return true if the insn at s->pc is an IT whose block lies on
+     * this page but would not fit in what is left of the TB's insn
+     * budget.  Ending the TB before the IT lets the whole block be
+     * translated inline by the next TB, instead of splitting it and
+     * starting a TB with nonzero condexec bits in its flags, which
+     * cannot be shared with the TBs entered outside the block.
+     */
+    uint32_t insn, pc = s->pc;
+    int slots;
+
+    if (!arm_dc_feature(s, ARM_FEATURE_THUMB2) ||
+        pc >= s->next_page_start - 1) {
+        return false;
+    }
+    insn = arm_lduw_code(env, pc, s->sctlr_b);
+    if ((insn & 0xff00) != 0xbf00 || (insn & 0xf) == 0) {
+        return false;
+    }
+    slots = 4 - ctz32(insn & 0xf);
+    if (s->base.num_insns + 1 + slots <= s->max_insns ||
+        1 + slots > s->max_insns) {
+        return false;
+    }
+    for (pc += 2; slots > 0; slots--) {
+        if (pc >= s->next_page_start - 1) {
+            return false;
+        }
+        insn = arm_lduw_code(env, pc, s->sctlr_b);
+        pc += thumb_insn_is_16bit(s, insn) ? 2 : 4;
+    }
+    return pc <= s->next_page_start;
+}
+
 static int arm_tr_init_disas_context(DisasContextBase *dcbase,
                                      CPUState *cs, int max_insns)
 {
@@ -12253,6 +12907,14 @@ static int arm_tr_init_disas_context(DisasContextBase *dcbase,
     dc->current_el = arm_mmu_idx_to_el(dc->mmu_idx);
 #if !defined(CONFIG_USER_ONLY)
     dc->user = (dc->current_el == 0);
+    /* Without an MPU, an M-profile address is its physical address and
+     * the permissions cannot change behind the TB's back.
+     */
+    dc->literal_as = NULL;
+    if (arm_feature(env, ARM_FEATURE_M) && !cpu->pmsav7_dregion &&
+        !arm_feature(env, ARM_FEATURE_M_SECURITY)) {
+        dc->literal_as = cs->as;
+    }
 #endif
     dc->ns = ARM_TBFLAG_NS(dc->base.tb->flags);
     dc->fp_excp_el = ARM_TBFLAG_FPEXC_EL(dc->base.tb->flags);
@@ -12261,6 +12923,7 @@ static int arm_tr_init_disas_context(DisasContextBase *dcbase,
     dc->vec_stride = ARM_TBFLAG_VECSTRIDE(dc->base.tb->flags);
     dc->c15_cpar = ARM_TBFLAG_XSCALE_CPAR(dc->base.tb->flags);
     dc->v7m_handler_mode = ARM_TBFLAG_HANDLER(dc->base.tb->flags);
+    dc->v7m_fpca_set = ARM_TBFLAG_FPCA_SET(dc->base.tb->flags);
     dc->v8m_secure = arm_feature(env, ARM_FEATURE_M_SECURITY) &&
         regime_is_secure(env, dc->mmu_idx);
     dc->cp_regs = cpu->cp_regs;
@@ -12310,6 +12973,31 @@ static int arm_tr_init_disas_context(DisasContextBase *dcbase,
     /* FIXME: cpu_M0 can probably be the same as cpu_V0.  */
     cpu_M0 = tcg_temp_new_i64();
 
+    if (dc->base.pc_first - cpu->flat_ram_base < cpu->flat_ram_size) {
+        /* Stores to code must go through the TLB to invalidate it */
+        arm_cpu_set_flat_ram(cpu, 0, 0, NULL);
+    } else if (ARM_TBFLAG_FLAT_RAM(dc->base.tb->flags)) {
+        tcg_ctx->flat_ram.base = cpu->flat_ram_base;
+        tcg_ctx->flat_ram.size = cpu->flat_ram_size;
+        tcg_ctx->flat_ram.host = cpu->flat_ram_host;
+    }
+
+    dc->cmp_end = -1;
+    dc->const_regs = 0;
+    dc->ras_return = false;
+    dc->indirect_ic = false;
+    dc->hle = is_singlestepping(dc) ? NULL : cpu->hle_funcs;
+    dc->spin_skip = cpu->spin_skip && !is_singlestepping(dc);
+    dc->pc_hook = cpu->pc_hook && !is_singlestepping(dc) &&
+        dc->base.pc_first >= cpu->pc_hook_lo &&
+        dc->base.pc_first < cpu->pc_hook_hi;
+    dc->v6m_cycles = arm_dc_feature(dc, ARM_FEATURE_M) &&
+        !arm_dc_feature(dc, ARM_FEATURE_V7) &&
+        (tb_cflags(dc->base.tb) & CF_USE_ICOUNT);
+    dc->superblock = tb_cflags(dc->base.tb) & CF_SUPERBLOCK;
+    dc->superblock_exits = 0;
+
+    dc->max_insns = max_insns;
     return max_insns;
 }
 
@@ -12354,6 +13042,12 @@ static void arm_tr_tb_start(DisasContextBase *dcbase, CPUState *cpu)
         tcg_gen_movi_i32(tmp, 0);
         store_cpu_field(tmp, condexec_bits);
     }
+    if (dc->pc_hook) {
+        /* regs[15] is stale after a chained jump, pass the PC instead */
+        TCGv_i32 tmp = tcg_const_i32(dc->base.pc_first);
+        gen_helper_pc_hook(cpu_env, tmp);
+        tcg_temp_free_i32(tmp);
+    }
     tcg_clear_temp_count();
 }
 
@@ -12505,6 +13199,65 @@ static bool thumb_insn_is_unconditional(DisasContext *s, uint32_t insn)
     return false;
 }
 
+/* MULS on the Cortex-M0 configured with the fast multiplier, as the nRF51
+ * and most other parts are; the small multiplier takes 32 cycles.
+ */
+#define ARMV6M_MUL_CYCLES 1
+
+/* Cycles an ARMv6-M instruction takes on a Cortex-M0 with zero wait-state
+ * memory (Cortex-M0 TRM, table 3-1).  Conditional branches are charged as
+ * not taken; the taken path adds the difference at run time.
+ */
+static unsigned int armv6m_insn_cycles(uint32_t insn, bool is_16bit)
+{
+    if (!is_16bit) {
+        switch (insn >> 20) {
+        case 0xf38: /* MSR */
+        case 0xf3b: /* DSB, DMB, ISB */
+            return (insn & 0xd000) == 0x8000 ? 4 : 1;
+        case 0xf3e: /* MRS */
+            return (insn & 0xd000) == 0x8000 ? 3 : 1;
+        default:
+            /* BL */
+            return (insn & 0xd000) == 0xd000 ? 4 : 1;
+        }
+    }
+
+    switch (insn >> 12) {
+    case 0x4:
+        if ((insn & 0xffc0) == 0x4340) {
+            return ARMV6M_MUL_CYCLES;
+        }
+        if ((insn & 0xff00) == 0x4700) {
+            return 3; /* BX, BLX */
+        }
+        if ((insn & 0xfc00) == 0x4400 && (insn & 0x0300) != 0x0100 &&
+            (insn & 0x87) == 0x87) {
+            return 3; /* ADD or MOV to the PC */
+        }
+        return (insn & 0xf800) == 0x4800 ? 2 : 1; /* LDR (literal) */
+    case 0x5: case 0x6: case 0x7: case 0x8: case 0x9:
+        return 2; /* loads and stores */
+    case 0xb:
+        switch (insn & 0x0f00) {
+        case 0x400: case 0x500: /* PUSH */
+            return 1 + ctpop32(insn & 0x1ff);
+        case 0xc00: case 0xd00: /* POP */
+            return (insn & 0x100 ? 4 : 1) + ctpop32(insn & 0xff);
+        case 0xf00: /* WFE, WFI */
+            return (insn & 0xffe0) == 0xbf20 ? 2 : 1;
+        default:
+            return 1;
+        }
+    case 0xc:
+        return 1 + ctpop32(insn & 0xff); /* LDM, STM */
+    case 0xe:
+        return 3; /* B */
+    default:
+        return 1;
+    }
+}
+
 static void thumb_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
 {
     DisasContext *dc = container_of(dcbase, DisasContext, base);
@@ -12515,6 +13268,9 @@ static void thumb_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
     if (arm_pre_translate_insn(dc)) {
         return;
     }
+    if (dc->hle && !dc->condexec_mask) {
+        gen_hle_call(dc);
+    }
 
     insn = arm_lduw_code(env, dc->pc, dc->sctlr_b);
     is_16bit = thumb_insn_is_16bit(dc, insn);
@@ -12526,6 +13282,9 @@ static void thumb_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
         dc->pc += 2;
     }
     dc->insn = insn;
+    if (dc->v6m_cycles) {
+        dc->base.insn_cycles = armv6m_insn_cycles(insn, is_16bit);
+    }
 
     if (dc->condexec_mask && !thumb_insn_is_unconditional(dc, insn)) {
         uint32_t cond = dc->condexec_cond;
@@ -12540,6 +13299,8 @@ static void thumb_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
     if (is_16bit) {
         disas_thumb_insn(dc, insn);
     } else {
+        /* Not all of them write registers through store_reg() */
+        dc->const_regs = 0;
         disas_thumb2_insn(dc, insn);
     }
 
@@ -12567,11 +13328,14 @@ static void thumb_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
      * This is to avoid generating a silly TB with a single 16-bit insn
      * in it at the end of this page (which would execute correctly
      * but isn't very efficient).
+     * For the same reason, stop before an IT block that would otherwise
+     * be split by the end of the insn budget.
      */
     if (dc->base.is_jmp == DISAS_NEXT
         && (dc->pc >= dc->next_page_start
             || (dc->pc >= dc->next_page_start - 3
-                && insn_crosses_page(env, dc)))) {
+                && insn_crosses_page(env, dc))
+            || (!dc->condexec_mask && thumb_it_block_cut(env, dc)))) {
         dc->base.is_jmp = DISAS_TOO_MANY;
     }
 }
@@ -12639,7 +13403,13 @@ static void arm_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
             gen_goto_tb(dc, 1, dc->pc);
             break;
         case DISAS_JUMP:
-            gen_goto_ptr();
+            if (dc->ras_return) {
+                gen_ras_return(dc);
+            } else if (dc->indirect_ic) {
+                gen_indirect_ic(dc);
+            } else {
+                gen_goto_ptr();
+            }
             break;
         case DISAS_UPDATE:
             gen_set_pc_im(dc, dc->pc);
@@ -12665,8 +13435,16 @@ static void arm_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
             break;
         }
         case DISAS_WFE:
-            gen_helper_wfe(cpu_env);
+        {
+            TCGv_i32 tmp = tcg_const_i32((dc->thumb &&
+                                          !(dc->insn & (1U << 31))) ? 2 : 4);
+
+            gen_helper_wfe(cpu_env, tmp);
+            tcg_temp_free_i32(tmp);
+            /* As for WFI, the helper may return if an event was pending */
+            tcg_gen_exit_tb(0);
             break;
+        }
         case DISAS_YIELD:
             gen_helper_yield(cpu_env);
             break;
@@ -10,11 +10,40 @@ typedef struct DisasContext {
 
     target_ulong pc;
     target_ulong next_page_start;
+    /* Instruction budget of this TB, as returned by init_disas_context */
+    int max_insns;
+    /* Charge Cortex-M0 instruction timings to icount */
+    bool v6m_cycles;
+    /* Translating a superblock: carry on along forward branches */
+    bool superblock;
+    /* Side exits out of the superblock so far; the first takes goto_tb 1 */
+    int superblock_exits;
+    /* The jump ending the TB is a function return, see gen_ras_return() */
+    bool ras_return;
+    /* The jump ending the TB reads a jump table, see gen_indirect_ic() */
+    bool indirect_ic;
+    /* The CPU's hle_funcs, unless single-stepping */
+    GHashTable *hle;
+    /* Branches back to the TB's start check for spin-waits */
+    bool spin_skip;
+    /* The TB starts in the CPU's pc_hook range */
+    bool pc_hook;
     uint32_t insn;
     /* Nonzero if this instruction has been conditionally skipped.  */
     int condjmp;
     /* The label that will be jumped to when the instruction is skipped.  */
     TCGLabel *condlabel;
+    /* Address just past the last 16-bit CMP, and its operands: cmp_rm is
+     * -1 when the second operand is cmp_imm.  A branch at cmp_end can test
+     * the registers instead of recombining the flags.  With cmp_nz the
+     * insn was a flag-setting ALU op instead, whose N and Z come from its
+     * result in cmp_rn.
+     */
+    target_ulong cmp_end;
+    int cmp_rn;
+    int cmp_rm;
+    uint32_t cmp_imm;
+    bool cmp_nz;
     /* Thumb-2 conditional execution bits.  */
     int condexec_mask;
     int condexec_cond;
@@ -23,7 +52,12 @@ typedef struct DisasContext {
     TCGMemOp be_data;
 #if !defined(CONFIG_USER_ONLY)
     int user;
+    /* Where literal loads may be read at translation time, or NULL */
+    AddressSpace *literal_as;
 #endif
+    /* Low registers that hold const_val[], loaded from folded literals */
+    uint8_t const_regs;
+    uint32_t const_val[8];
     ARMMMUIdx mmu_idx; /* MMU index to use for normal loads/stores */
     bool tbi0;         /* TBI0 for EL0/1 or TBI for EL2/3 */
     bool tbi1;         /* TBI1 for EL0/1, not used for EL2/3 */
@@ -37,6 +71,7 @@ typedef struct DisasContext {
     int vec_len;
     int vec_stride;
     bool v7m_handler_mode;
+    bool v7m_fpca_set; /* M profile: an FP insn calls v7m_fp_activate */
     bool v8m_secure; /* true if v8M and we're in Secure mode */
     /* Immediate value in AArch32 SVC insn; must be set if is_jmp == DISAS_SWI
      * so that top level loop can generate correct syndrome information.
@@ -28,6 +28,7 @@
 #include "exec/exec-all.h"
 #include "tcg.h"
 #include "tcg-op.h"
+#include "exec/translator.h"
 #include "tcg-mo.h"
 #include "trace-tcg.h"
 #include "trace/mem.h"
@@ -2558,6 +2559,12 @@ void tcg_gen_lookup_and_goto_ptr(void)
     }
 }
 
+void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+    tcg_debug_assert(TCG_TARGET_HAS_goto_ptr);
+    tcg_gen_op1i(INDEX_op_goto_ptr, tcgv_ptr_arg(ptr));
+}
+
 static inline TCGMemOp tcg_canonicalize_memop(TCGMemOp op, bool is64, bool st)
 {
     /* Trigger the asserts within as early as possible.  */
@@ -2638,6 +2645,9 @@ void tcg_gen_qemu_ld_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     memop = tcg_canonicalize_memop(memop, 0, 0);
     trace_guest_mem_before_tcg(tcg_ctx->cpu, cpu_env,
                                addr, trace_mem_get_info(memop, 0));
+    if (unlikely(translator_instrumented)) {
+        translator_instrument_mem(addr, memop, false);
+    }
     gen_ldst_i32(INDEX_op_qemu_ld_i32, val, addr, memop, idx);
 }
 
@@ -2647,6 +2657,9 @@ void tcg_gen_qemu_st_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     memop = tcg_canonicalize_memop(memop, 0, 1);
     trace_guest_mem_before_tcg(tcg_ctx->cpu, cpu_env,
                                addr, trace_mem_get_info(memop, 1));
+    if (unlikely(translator_instrumented)) {
+        translator_instrument_mem(addr, memop, true);
+    }
     gen_ldst_i32(INDEX_op_qemu_st_i32, val, addr, memop, idx);
 }
 
@@ -2666,6 +2679,9 @@ void tcg_gen_qemu_ld_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     memop = tcg_canonicalize_memop(memop, 1, 0);
     trace_guest_mem_before_tcg(tcg_ctx->cpu, cpu_env,
                                addr, trace_mem_get_info(memop, 0));
+    if (unlikely(translator_instrumented)) {
+        translator_instrument_mem(addr, memop, false);
+    }
     gen_ldst_i64(INDEX_op_qemu_ld_i64, val, addr, memop, idx);
 }
 
@@ -2680,6 +2696,9 @@ void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     memop = tcg_canonicalize_memop(memop, 1, 1);
     trace_guest_mem_before_tcg(tcg_ctx->cpu, cpu_env,
                                addr, trace_mem_get_info(memop, 1));
+    if (unlikely(translator_instrumented)) {
+        translator_instrument_mem(addr, memop, true);
+    }
     gen_ldst_i64(INDEX_op_qemu_st_i64, val, addr, memop, idx);
 }
 
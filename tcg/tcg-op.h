@@ -805,6 +805,15 @@ void tcg_gen_goto_tb(unsigned idx);
  */
 void tcg_gen_lookup_and_goto_ptr(void);
 
+/**
+ * tcg_gen_goto_ptr() - jump to a TB found by a helper
+ * @ptr: Host code of the TB, or the epilogue
+ *
+ * Like tcg_gen_lookup_and_goto_ptr(), for targets with their own lookup
+ * helper.  The caller checks TCG_TARGET_HAS_goto_ptr.
+ */
+void tcg_gen_goto_ptr(TCGv_ptr ptr);
+
 #if TARGET_LONG_BITS == 32
 #define tcg_temp_new() tcg_temp_new_i32()
 #define tcg_global_reg_new tcg_global_reg_new_i32
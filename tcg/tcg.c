@@ -140,7 +140,26 @@ TCGv_env cpu_env = 0;
  * dynamically allocate from as demand dictates. Given appropriate region
  * sizing, this minimizes flushes even when some TCG threads generate a lot
  * more code than others.
+ *
+ * Once no region is free, the one that filled up first can be evicted
+ * (see tcg_region_evict()) instead of flushing the whole buffer.
+ *
+ * Optionally the end of the buffer is set aside as a hot region, which no
+ * context owns.  Hot TBs are translated again in there, so that they sit
+ * next to each other; see tcg_region_hot_enter().
  */
+enum {
+    TCG_REGION_FREE,
+    TCG_REGION_IN_USE,  /* assigned to a context */
+    TCG_REGION_FULL,
+};
+
+struct tcg_region_info {
+    int state;
+    uint64_t seq;       /* when it filled up, for TCG_REGION_FULL */
+    size_t size_full;   /* code it holds, for TCG_REGION_FULL */
+};
+
 struct tcg_region_state {
     QemuMutex lock;
 
@@ -153,8 +172,15 @@ struct tcg_region_state {
     size_t stride; /* .size + guard size */
 
     /* fields protected by the lock */
-    size_t current; /* current region index */
+    struct tcg_region_info *info;
+    uint64_t full_seq;
     size_t agg_size_full; /* aggregate size of full regions */
+
+    /* the hot region, empty if there is none; the rest is under tb_lock */
+    void *hot_start;
+    void *hot_end;
+    void *hot_ptr;
+    bool hot_full;
 };
 
 static struct tcg_region_state region;
@@ -313,6 +339,14 @@ static void tcg_region_bounds(size_t curr_region, void **pstart, void **pend)
     *pend = end;
 }
 
+static size_t tcg_region_index(void *p)
+{
+    if (p < region.start_aligned) {
+        return 0;
+    }
+    return MIN((p - region.start_aligned) / region.stride, region.n - 1);
+}
+
 static void tcg_region_assign(TCGContext *s, size_t curr_region)
 {
     void *start, *end;
@@ -327,11 +361,18 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
+    size_t i;
+
+    for (i = 0; i < region.n; i++) {
+        if (region.info[i].state == TCG_REGION_FREE) {
+            break;
+        }
+    }
+    if (i == region.n) {
         return true;
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
+    tcg_region_assign(s, i);
+    region.info[i].state = TCG_REGION_IN_USE;
     return false;
 }
 
@@ -342,12 +383,20 @@ static bool tcg_region_alloc__locked(TCGContext *s)
 static bool tcg_region_alloc(TCGContext *s)
 {
     bool err;
-    /* read the region size now; alloc__locked will overwrite it on success */
+
+    /* tcg_tb_alloc() gives up instead in the hot region */
+    g_assert(!s->code_gen_hot);
+    /* read the region now; alloc__locked will overwrite it on success */
     size_t size_full = s->code_gen_buffer_size;
+    size_t full = tcg_region_index(s->code_gen_buffer);
 
     qemu_mutex_lock(&region.lock);
     err = tcg_region_alloc__locked(s);
     if (!err) {
+        /* On failure the context keeps its region until room is made */
+        region.info[full].state = TCG_REGION_FULL;
+        region.info[full].seq = region.full_seq++;
+        region.info[full].size_full = size_full - TCG_HIGHWATER;
         region.agg_size_full += size_full - TCG_HIGHWATER;
     }
     qemu_mutex_unlock(&region.lock);
@@ -367,11 +416,15 @@ static inline bool tcg_region_initial_alloc__locked(TCGContext *s)
 void tcg_region_reset_all(void)
 {
     unsigned int n_ctxs = atomic_read(&n_tcg_ctxs);
-    unsigned int i;
+    size_t i;
 
     qemu_mutex_lock(&region.lock);
-    region.current = 0;
+    for (i = 0; i < region.n; i++) {
+        region.info[i].state = TCG_REGION_FREE;
+    }
     region.agg_size_full = 0;
+    region.hot_ptr = region.hot_start;
+    region.hot_full = false;
 
     for (i = 0; i < n_ctxs; i++) {
         TCGContext *s = atomic_read(&tcg_ctxs[i]);
@@ -382,6 +435,85 @@ void tcg_region_reset_all(void)
     qemu_mutex_unlock(&region.lock);
 }
 
+/*
+ * Free the region that filled up first, so that it can be reused, and
+ * return its bounds in @pstart and @pend.  The caller must drop all the
+ * TBs in there before translating again.  Returns false if no region is
+ * full, in which case only a full flush makes room.
+ *
+ * Call from a safe-work context.
+ */
+bool tcg_region_evict(void **pstart, void **pend)
+{
+    size_t i, oldest = region.n;
+
+    qemu_mutex_lock(&region.lock);
+    for (i = 0; i < region.n; i++) {
+        if (region.info[i].state == TCG_REGION_FULL &&
+            (oldest == region.n ||
+             region.info[i].seq < region.info[oldest].seq)) {
+            oldest = i;
+        }
+    }
+    if (oldest != region.n) {
+        region.info[oldest].state = TCG_REGION_FREE;
+        region.agg_size_full -= region.info[oldest].size_full;
+        tcg_region_bounds(oldest, pstart, pend);
+    }
+    qemu_mutex_unlock(&region.lock);
+    return oldest != region.n;
+}
+
+/*
+ * Make @s translate into the hot region until tcg_region_hot_exit(),
+ * if there is room for @size more bytes.  Returns false otherwise, and
+ * from then on tcg_region_hot_full() is true until the next flush.
+ * @size is only an estimate: a translation that overruns it fails, and
+ * the caller then leaves with tcg_region_hot_exit(s, true).
+ *
+ * Call with tb_lock held, which keeps other contexts out of the region.
+ */
+bool tcg_region_hot_enter(TCGContext *s, size_t size)
+{
+    if (region.hot_ptr + size > region.hot_end - TCG_HIGHWATER) {
+        region.hot_full = true;
+        return false;
+    }
+
+    qemu_mutex_lock(&region.lock);
+    s->code_gen_hot = true;
+    s->hot_saved.buffer = s->code_gen_buffer;
+    s->hot_saved.buffer_size = s->code_gen_buffer_size;
+    s->hot_saved.ptr = s->code_gen_ptr;
+    s->hot_saved.highwater = s->code_gen_highwater;
+    s->code_gen_buffer = region.hot_start;
+    s->code_gen_buffer_size = region.hot_end - region.hot_start;
+    s->code_gen_ptr = region.hot_ptr;
+    s->code_gen_highwater = region.hot_end - TCG_HIGHWATER;
+    qemu_mutex_unlock(&region.lock);
+    return true;
+}
+
+bool tcg_region_hot_full(void)
+{
+    return atomic_read(&region.hot_full);
+}
+
+void tcg_region_hot_exit(TCGContext *s, bool full)
+{
+    qemu_mutex_lock(&region.lock);
+    region.hot_ptr = s->code_gen_ptr;
+    if (full) {
+        region.hot_full = true;
+    }
+    s->code_gen_buffer = s->hot_saved.buffer;
+    s->code_gen_buffer_size = s->hot_saved.buffer_size;
+    s->code_gen_ptr = s->hot_saved.ptr;
+    s->code_gen_highwater = s->hot_saved.highwater;
+    s->code_gen_hot = false;
+    qemu_mutex_unlock(&region.lock);
+}
+
 #ifdef CONFIG_USER_ONLY
 static size_t tcg_n_regions(void)
 {
@@ -398,8 +530,17 @@ static size_t tcg_n_regions(void)
 {
     size_t i;
 
-    /* Use a single region if all we have is one vCPU thread */
+    /*
+     * A single vCPU thread goes through the regions in turn.  Still use a
+     * few of them, so that a full buffer costs one region's worth of
+     * retranslation rather than all of it.
+     */
     if (max_cpus == 1 || !qemu_tcg_mttcg_enabled()) {
+        for (i = 8; i > 1; i--) {
+            if (tcg_init_ctx.code_gen_buffer_size / i >= 256 * 1024u) {
+                return i;
+            }
+        }
         return 1;
     }
 
@@ -456,10 +597,19 @@ void tcg_region_init(void)
     size_t page_size = qemu_real_host_page_size;
     size_t region_size;
     size_t n_regions;
+    size_t hot_size;
     size_t i;
 
     n_regions = tcg_n_regions();
 
+    /* The hot region goes last, followed by its own guard page */
+    hot_size = QEMU_ALIGN_UP(tcg_init_ctx.code_gen_hot_size, page_size);
+    if (hot_size) {
+        hot_size = MIN(hot_size + page_size,
+                       QEMU_ALIGN_DOWN(size / 2, page_size));
+        size -= hot_size;
+    }
+
     /* The first region will be 'aligned - buf' bytes larger than the others */
     aligned = QEMU_ALIGN_PTR_UP(buf, page_size);
     g_assert(aligned < tcg_init_ctx.code_gen_buffer + size);
@@ -477,6 +627,7 @@ void tcg_region_init(void)
     /* init the region struct */
     qemu_mutex_init(&region.lock);
     region.n = n_regions;
+    region.info = g_new0(struct tcg_region_info, n_regions);
     region.size = region_size - page_size;
     region.stride = region_size;
     region.start = buf;
@@ -496,6 +647,16 @@ void tcg_region_init(void)
         g_assert(!rc);
     }
 
+    if (hot_size) {
+        int rc;
+
+        region.hot_start = region.end + page_size;
+        region.hot_end = region.hot_start + hot_size - page_size;
+        rc = qemu_mprotect_none(region.hot_end, page_size);
+        g_assert(!rc);
+    }
+    region.hot_ptr = region.hot_start;
+
     /* In user-mode we support only one ctx, so do the initial allocation now */
 #ifdef CONFIG_USER_ONLY
     {
@@ -765,7 +926,8 @@ TranslationBlock *tcg_tb_alloc(TCGContext *s)
     next = (void *)ROUND_UP((uintptr_t)(tb + 1), align);
 
     if (unlikely(next > s->code_gen_highwater)) {
-        if (tcg_region_alloc(s)) {
+        /* No other region to move to: the hot translation fails */
+        if (s->code_gen_hot || tcg_region_alloc(s)) {
             return NULL;
         }
         goto retry;
@@ -868,6 +1030,7 @@ void tcg_func_start(TCGContext *s)
 
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+    s->flat_ram.size = 0;
 
 #ifdef CONFIG_DEBUG_TCG
     s->goto_tb_issue_mask = 0;
@@ -875,6 +1038,7 @@ void tcg_func_start(TCGContext *s)
 
     QTAILQ_INIT(&s->ops);
     QTAILQ_INIT(&s->free_ops);
+    s->nb_ops = 0;
 }
 
 static inline TCGTemp *tcg_temp_alloc(TCGContext *s)
@@ -1983,6 +2147,7 @@ void tcg_op_remove(TCGContext *s, TCGOp *op)
 {
     QTAILQ_REMOVE(&s->ops, op, link);
     QTAILQ_INSERT_TAIL(&s->free_ops, op, link);
+    s->nb_ops--;
 
 #ifdef CONFIG_PROFILER
     atomic_set(&s->prof.del_op_count, s->prof.del_op_count + 1);
@@ -2002,6 +2167,7 @@ static TCGOp *tcg_op_alloc(TCGOpcode opc)
     }
     memset(op, 0, offsetof(TCGOp, link));
     op->opc = opc;
+    s->nb_ops++;
 
     return op;
 }
@@ -2069,14 +2235,76 @@ static void tcg_la_bb_end(TCGContext *s)
     }
 }
 
+/* liveness analysis: end of basic block at @op, a branch or label.
+   @label_dead holds, for each label already met in this backward walk,
+   the globals that are dead on entry to it.  A global that is dead
+   wherever @op can continue need not go back to memory either, so the
+   op computing it can be removed.  Targets not met yet belong to
+   backward branches and keep every global.  */
+static void tcg_la_bb_end_at(TCGContext *s, TCGOp *op,
+                             TCGTempSet **label_dead)
+{
+    TCGTempSet dead, *target = NULL;
+    int ng = s->nb_globals;
+    int i;
+
+    switch (op->opc) {
+    case INDEX_op_set_label:
+        /* falls through into the label */
+        target = tcg_malloc(sizeof(TCGTempSet));
+        bitmap_zero(target->l, ng);
+        for (i = 0; i < ng; ++i) {
+            if (s->temps[i].state == TS_DEAD) {
+                set_bit(i, target->l);
+            }
+        }
+        label_dead[arg_label(op->args[0])->id] = target;
+        break;
+    case INDEX_op_br:
+        target = label_dead[arg_label(op->args[0])->id];
+        break;
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        target = label_dead[arg_label(op->args[3])->id];
+        break;
+    case INDEX_op_brcond2_i32:
+        target = label_dead[arg_label(op->args[5])->id];
+        break;
+    default:
+        break;
+    }
+
+    bitmap_zero(dead.l, ng);
+    if (target) {
+        bitmap_copy(dead.l, target->l, ng);
+        if (op->opc != INDEX_op_set_label && op->opc != INDEX_op_br) {
+            /* also dead on the fall-through path */
+            for (i = 0; i < ng; ++i) {
+                if (s->temps[i].state != TS_DEAD) {
+                    clear_bit(i, dead.l);
+                }
+            }
+        }
+    }
+
+    tcg_la_bb_end(s);
+    for (i = find_first_bit(dead.l, ng); i < ng;
+         i = find_next_bit(dead.l, ng, i + 1)) {
+        s->temps[i].state = TS_DEAD;
+    }
+}
+
 /* Liveness analysis : update the opc_arg_life array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
 static void liveness_pass_1(TCGContext *s)
 {
     int nb_globals = s->nb_globals;
+    TCGTempSet **label_dead;
     TCGOp *op, *op_prev;
 
+    label_dead = tcg_malloc(s->nb_labels * sizeof(TCGTempSet *));
+    memset(label_dead, 0, s->nb_labels * sizeof(TCGTempSet *));
     tcg_la_func_end(s);
 
     QTAILQ_FOREACH_REVERSE_SAFE(op, &s->ops, TCGOpHead, link, op_prev) {
@@ -2268,7 +2496,7 @@ static void liveness_pass_1(TCGContext *s)
 
                 /* if end of basic block, update */
                 if (def->flags & TCG_OPF_BB_END) {
-                    tcg_la_bb_end(s);
+                    tcg_la_bb_end_at(s, op, label_dead);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
                     for (i = 0; i < nb_globals; i++) {
@@ -2613,6 +2841,7 @@ static void tcg_reg_free(TCGContext *s, TCGReg reg, TCGRegSet allocated_regs)
 {
     TCGTemp *ts = s->reg_to_temp[reg];
     if (ts != NULL) {
+        s->nb_spills++;
         temp_sync(s, ts, allocated_regs, -1);
     }
 }
@@ -3230,6 +3459,25 @@ void tcg_dump_op_count(FILE *f, fprintf_function cpu_fprintf)
 }
 #endif
 
+/* Pass in a zero'ed @q */
+void tcg_quality_snapshot(TCGQualityStats *q)
+{
+    unsigned int n_ctxs = atomic_read(&n_tcg_ctxs);
+    unsigned int i;
+
+    for (i = 0; i < n_ctxs; i++) {
+        const TCGQualityStats *orig = &atomic_read(&tcg_ctxs[i])->quality;
+
+        q->tb_count += atomic_read__nocheck(&orig->tb_count);
+        q->guest_insns += atomic_read__nocheck(&orig->guest_insns);
+        q->ops += atomic_read__nocheck(&orig->ops);
+        q->ops_opt += atomic_read__nocheck(&orig->ops_opt);
+        q->host_bytes += atomic_read__nocheck(&orig->host_bytes);
+        q->spills += atomic_read__nocheck(&orig->spills);
+        q->translate_ns += atomic_read__nocheck(&orig->translate_ns);
+    }
+}
+
 
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 {
@@ -3270,6 +3518,8 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
     }
 #endif
 
+    tb->nb_ops = MIN(s->nb_ops, UINT16_MAX);
+
 #ifdef CONFIG_PROFILER
     atomic_set(&prof->opt_time, prof->opt_time - profile_getclock());
 #endif
@@ -3318,6 +3568,8 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
     }
 #endif
 
+    tb->nb_ops_opt = MIN(s->nb_ops, UINT16_MAX);
+    s->nb_spills = 0;
     tcg_reg_alloc_start(s);
 
     s->code_buf = tb->tc.ptr;
@@ -3396,6 +3648,7 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
     }
     tcg_debug_assert(num_insns >= 0);
     s->gen_insn_end_off[num_insns] = tcg_current_code_size(s);
+    tb->nb_spills = MIN(s->nb_spills, UINT16_MAX);
 
     /* Generate TB finalization at the end of block */
 #ifdef TCG_TARGET_NEED_LDST_LABELS
@@ -648,6 +648,20 @@ typedef struct TCGProfile {
     int64_t table_op_count[NB_OPS];
 } TCGProfile;
 
+/* Translation statistics that are always kept, unlike TCGProfile.  Each
+ * TCGContext's are only written by its own thread; readers sum them up
+ * with tcg_quality_snapshot().
+ */
+typedef struct TCGQualityStats {
+    int64_t tb_count;
+    int64_t guest_insns;
+    int64_t ops;            /* TCG ops before optimization */
+    int64_t ops_opt;        /* ... and after optimization and liveness */
+    int64_t host_bytes;
+    int64_t spills;         /* live registers freed by the allocator */
+    int64_t translate_ns;
+} TCGQualityStats;
+
 struct TCGContext {
     uint8_t *pool_cur, *pool_end;
     TCGPool *pool_first, *pool_current, *pool_first_large;
@@ -664,6 +678,16 @@ struct TCGContext {
 
     TCGRegSet reserved_regs;
     uint32_t tb_cflags; /* cflags of the current TB */
+
+    /* Guest RAM that the current TB may access without the softmmu TLB:
+       guest addresses [base, base + size) map linearly to host.  Set by
+       the front end, and only for TBs it knows are safe; size 0 disables.
+       Backends that do not support it ignore it.  */
+    struct {
+        uint64_t base;
+        uint64_t size;
+        void *host;
+    } flat_ram;
     intptr_t current_frame_offset;
     intptr_t frame_start;
     intptr_t frame_end;
@@ -674,6 +698,9 @@ struct TCGContext {
 #ifdef CONFIG_PROFILER
     TCGProfile prof;
 #endif
+    TCGQualityStats quality;
+    int nb_ops;
+    int nb_spills;
 
 #ifdef CONFIG_DEBUG_TCG
     int temps_in_use;
@@ -688,12 +715,23 @@ struct TCGContext {
     void *code_gen_epilogue;
     void *code_gen_buffer;
     size_t code_gen_buffer_size;
+    size_t code_gen_hot_size;   /* of the hot region, in tcg_init_ctx */
     void *code_gen_ptr;
     void *data_gen_ptr;
 
     /* Threshold to flush the translated code buffer.  */
     void *code_gen_highwater;
 
+    /* Translating into the hot region; the context's own region is kept
+       in hot_saved meanwhile.  */
+    bool code_gen_hot;
+    struct {
+        void *buffer;
+        size_t buffer_size;
+        void *ptr;
+        void *highwater;
+    } hot_saved;
+
     /* Track which vCPU triggers events */
     CPUState *cpu;                      /* *_trans */
 
@@ -717,6 +755,7 @@ struct TCGContext {
     TCGTemp *reg_to_temp[TCG_TARGET_NB_REGS];
 
     uint16_t gen_insn_end_off[TCG_MAX_INSNS];
+    uint16_t gen_insn_cycles[TCG_MAX_INSNS];
     target_ulong gen_insn_data[TCG_MAX_INSNS][TARGET_INSN_START_WORDS];
 };
 
@@ -856,6 +895,10 @@ TranslationBlock *tcg_tb_alloc(TCGContext *s);
 
 void tcg_region_init(void);
 void tcg_region_reset_all(void);
+bool tcg_region_evict(void **pstart, void **pend);
+bool tcg_region_hot_enter(TCGContext *s, size_t size);
+void tcg_region_hot_exit(TCGContext *s, bool full);
+bool tcg_region_hot_full(void);
 
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
@@ -949,6 +992,7 @@ int tcg_check_temp_count(void);
 
 void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf);
 void tcg_dump_op_count(FILE *f, fprintf_function cpu_fprintf);
+void tcg_quality_snapshot(TCGQualityStats *q);
 
 #define TCG_CT_ALIAS  0x80
 #define TCG_CT_IALIAS 0x40
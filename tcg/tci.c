@@ -468,9 +468,179 @@ static bool tci_compare64(uint64_t u0, uint64_t u1, TCGCond condition)
 # define qemu_st_beq(X)  stq_be_p(g2h(taddr), X)
 #endif
 
+/* Each handler gets a label next to its case, so that dispatch can be a
+ * computed goto through a table rather than a switch.  The compiler
+ * duplicates that goto into the tail of every handler, which gives each
+ * opcode its own indirect branch to predict instead of a single shared
+ * one.
+ */
+#define CASE(name)      case INDEX_op_##name: op_##name
+#define CASE_DEFAULT    default: op_default
+#define TCI_OP(name)    [INDEX_op_##name] = &&op_##name
+
 /* Interpret pseudo code in tb. */
 uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 {
+    static const void *const tci_dispatch[NB_OPS] = {
+        [0 ... NB_OPS - 1] = &&op_default,
+        TCI_OP(call),
+        TCI_OP(br),
+        TCI_OP(setcond_i32),
+#if TCG_TARGET_REG_BITS == 32
+        TCI_OP(setcond2_i32),
+#elif TCG_TARGET_REG_BITS == 64
+        TCI_OP(setcond_i64),
+#endif
+        TCI_OP(mov_i32),
+        TCI_OP(movi_i32),
+        TCI_OP(ld8u_i32),
+        TCI_OP(ld8s_i32),
+        TCI_OP(ld16u_i32),
+        TCI_OP(ld16s_i32),
+        TCI_OP(ld_i32),
+        TCI_OP(st8_i32),
+        TCI_OP(st16_i32),
+        TCI_OP(st_i32),
+        TCI_OP(add_i32),
+        TCI_OP(sub_i32),
+        TCI_OP(mul_i32),
+#if TCG_TARGET_HAS_div_i32
+        TCI_OP(div_i32),
+        TCI_OP(divu_i32),
+        TCI_OP(rem_i32),
+        TCI_OP(remu_i32),
+#elif TCG_TARGET_HAS_div2_i32
+        TCI_OP(div2_i32),
+        TCI_OP(divu2_i32),
+#endif
+        TCI_OP(and_i32),
+        TCI_OP(or_i32),
+        TCI_OP(xor_i32),
+        TCI_OP(shl_i32),
+        TCI_OP(shr_i32),
+        TCI_OP(sar_i32),
+#if TCG_TARGET_HAS_rot_i32
+        TCI_OP(rotl_i32),
+        TCI_OP(rotr_i32),
+#endif
+#if TCG_TARGET_HAS_deposit_i32
+        TCI_OP(deposit_i32),
+#endif
+        TCI_OP(brcond_i32),
+#if TCG_TARGET_REG_BITS == 32
+        TCI_OP(add2_i32),
+        TCI_OP(sub2_i32),
+        TCI_OP(brcond2_i32),
+        TCI_OP(mulu2_i32),
+#endif /* TCG_TARGET_REG_BITS == 32 */
+#if TCG_TARGET_HAS_ext8s_i32
+        TCI_OP(ext8s_i32),
+#endif
+#if TCG_TARGET_HAS_ext16s_i32
+        TCI_OP(ext16s_i32),
+#endif
+#if TCG_TARGET_HAS_ext8u_i32
+        TCI_OP(ext8u_i32),
+#endif
+#if TCG_TARGET_HAS_ext16u_i32
+        TCI_OP(ext16u_i32),
+#endif
+#if TCG_TARGET_HAS_bswap16_i32
+        TCI_OP(bswap16_i32),
+#endif
+#if TCG_TARGET_HAS_bswap32_i32
+        TCI_OP(bswap32_i32),
+#endif
+#if TCG_TARGET_HAS_not_i32
+        TCI_OP(not_i32),
+#endif
+#if TCG_TARGET_HAS_neg_i32
+        TCI_OP(neg_i32),
+#endif
+#if TCG_TARGET_REG_BITS == 64
+        TCI_OP(mov_i64),
+        TCI_OP(movi_i64),
+        TCI_OP(ld8u_i64),
+        TCI_OP(ld8s_i64),
+        TCI_OP(ld16u_i64),
+        TCI_OP(ld16s_i64),
+        TCI_OP(ld32u_i64),
+        TCI_OP(ld32s_i64),
+        TCI_OP(ld_i64),
+        TCI_OP(st8_i64),
+        TCI_OP(st16_i64),
+        TCI_OP(st32_i64),
+        TCI_OP(st_i64),
+        TCI_OP(add_i64),
+        TCI_OP(sub_i64),
+        TCI_OP(mul_i64),
+#if TCG_TARGET_HAS_div_i64
+        TCI_OP(div_i64),
+        TCI_OP(divu_i64),
+        TCI_OP(rem_i64),
+        TCI_OP(remu_i64),
+#elif TCG_TARGET_HAS_div2_i64
+        TCI_OP(div2_i64),
+        TCI_OP(divu2_i64),
+#endif
+        TCI_OP(and_i64),
+        TCI_OP(or_i64),
+        TCI_OP(xor_i64),
+        TCI_OP(shl_i64),
+        TCI_OP(shr_i64),
+        TCI_OP(sar_i64),
+#if TCG_TARGET_HAS_rot_i64
+        TCI_OP(rotl_i64),
+        TCI_OP(rotr_i64),
+#endif
+#if TCG_TARGET_HAS_deposit_i64
+        TCI_OP(deposit_i64),
+#endif
+        TCI_OP(brcond_i64),
+#if TCG_TARGET_HAS_ext8u_i64
+        TCI_OP(ext8u_i64),
+#endif
+#if TCG_TARGET_HAS_ext8s_i64
+        TCI_OP(ext8s_i64),
+#endif
+#if TCG_TARGET_HAS_ext16s_i64
+        TCI_OP(ext16s_i64),
+#endif
+#if TCG_TARGET_HAS_ext16u_i64
+        TCI_OP(ext16u_i64),
+#endif
+#if TCG_TARGET_HAS_ext32s_i64
+        TCI_OP(ext32s_i64),
+#endif
+        TCI_OP(ext_i32_i64),
+#if TCG_TARGET_HAS_ext32u_i64
+        TCI_OP(ext32u_i64),
+#endif
+        TCI_OP(extu_i32_i64),
+#if TCG_TARGET_HAS_bswap16_i64
+        TCI_OP(bswap16_i64),
+#endif
+#if TCG_TARGET_HAS_bswap32_i64
+        TCI_OP(bswap32_i64),
+#endif
+#if TCG_TARGET_HAS_bswap64_i64
+        TCI_OP(bswap64_i64),
+#endif
+#if TCG_TARGET_HAS_not_i64
+        TCI_OP(not_i64),
+#endif
+#if TCG_TARGET_HAS_neg_i64
+        TCI_OP(neg_i64),
+#endif
+#endif /* TCG_TARGET_REG_BITS == 64 */
+        TCI_OP(exit_tb),
+        TCI_OP(goto_tb),
+        TCI_OP(qemu_ld_i32),
+        TCI_OP(qemu_ld_i64),
+        TCI_OP(qemu_st_i32),
+        TCI_OP(qemu_st_i64),
+        TCI_OP(mb),
+    };
     tcg_target_ulong regs[TCG_TARGET_NB_REGS];
     long tcg_temps[CPU_TEMP_BUF_NLONGS];
     uintptr_t sp_value = (uintptr_t)(tcg_temps + CPU_TEMP_BUF_NLONGS);
@@ -508,8 +678,11 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
         /* Skip opcode and size entry. */
         tb_ptr += 2;
 
+        /* Jump straight to the handler; the switch below is only there
+           to hold the case bodies, which end by leaving it as usual.  */
+        goto *tci_dispatch[opc];
         switch (opc) {
-        case INDEX_op_call:
+        CASE(call):
             t0 = tci_read_ri(regs, &tb_ptr);
 #if TCG_TARGET_REG_BITS == 32
             tmp64 = ((helper_function)t0)(tci_read_reg(regs, TCG_REG_R0),
@@ -536,12 +709,12 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg(regs, TCG_REG_R0, tmp64);
 #endif
             break;
-        case INDEX_op_br:
+        CASE(br):
             label = tci_read_label(&tb_ptr);
             tci_assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr = (uint8_t *)label;
             continue;
-        case INDEX_op_setcond_i32:
+        CASE(setcond_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
@@ -549,7 +722,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg32(regs, t0, tci_compare32(t1, t2, condition));
             break;
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_setcond2_i32:
+        CASE(setcond2_i32):
             t0 = *tb_ptr++;
             tmp64 = tci_read_r64(regs, &tb_ptr);
             v64 = tci_read_ri64(regs, &tb_ptr);
@@ -557,7 +730,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg32(regs, t0, tci_compare64(tmp64, v64, condition));
             break;
 #elif TCG_TARGET_REG_BITS == 64
-        case INDEX_op_setcond_i64:
+        CASE(setcond_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
@@ -565,12 +738,12 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg64(regs, t0, tci_compare64(t1, t2, condition));
             break;
 #endif
-        case INDEX_op_mov_i32:
+        CASE(mov_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1);
             break;
-        case INDEX_op_movi_i32:
+        CASE(movi_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_i32(&tb_ptr);
             tci_write_reg32(regs, t0, t1);
@@ -578,38 +751,38 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Load/store operations (32 bit). */
 
-        case INDEX_op_ld8u_i32:
+        CASE(ld8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg8(regs, t0, *(uint8_t *)(t1 + t2));
             break;
-        case INDEX_op_ld8s_i32:
-        case INDEX_op_ld16u_i32:
+        CASE(ld8s_i32):
+        CASE(ld16u_i32):
             TODO();
             break;
-        case INDEX_op_ld16s_i32:
+        CASE(ld16s_i32):
             TODO();
             break;
-        case INDEX_op_ld_i32:
+        CASE(ld_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32(regs, t0, *(uint32_t *)(t1 + t2));
             break;
-        case INDEX_op_st8_i32:
+        CASE(st8_i32):
             t0 = tci_read_r8(regs, &tb_ptr);
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
             break;
-        case INDEX_op_st16_i32:
+        CASE(st16_i32):
             t0 = tci_read_r16(regs, &tb_ptr);
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
             break;
-        case INDEX_op_st_i32:
+        CASE(st_i32):
             t0 = tci_read_r32(regs, &tb_ptr);
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
@@ -619,68 +792,68 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Arithmetic operations (32 bit). */
 
-        case INDEX_op_add_i32:
+        CASE(add_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1 + t2);
             break;
-        case INDEX_op_sub_i32:
+        CASE(sub_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1 - t2);
             break;
-        case INDEX_op_mul_i32:
+        CASE(mul_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1 * t2);
             break;
 #if TCG_TARGET_HAS_div_i32
-        case INDEX_op_div_i32:
+        CASE(div_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, (int32_t)t1 / (int32_t)t2);
             break;
-        case INDEX_op_divu_i32:
+        CASE(divu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1 / t2);
             break;
-        case INDEX_op_rem_i32:
+        CASE(rem_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, (int32_t)t1 % (int32_t)t2);
             break;
-        case INDEX_op_remu_i32:
+        CASE(remu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1 % t2);
             break;
 #elif TCG_TARGET_HAS_div2_i32
-        case INDEX_op_div2_i32:
-        case INDEX_op_divu2_i32:
+        CASE(div2_i32):
+        CASE(divu2_i32):
             TODO();
             break;
 #endif
-        case INDEX_op_and_i32:
+        CASE(and_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1 & t2);
             break;
-        case INDEX_op_or_i32:
+        CASE(or_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1 | t2);
             break;
-        case INDEX_op_xor_i32:
+        CASE(xor_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
@@ -689,32 +862,32 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Shift/rotate operations (32 bit). */
 
-        case INDEX_op_shl_i32:
+        CASE(shl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1 << (t2 & 31));
             break;
-        case INDEX_op_shr_i32:
+        CASE(shr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1 >> (t2 & 31));
             break;
-        case INDEX_op_sar_i32:
+        CASE(sar_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, ((int32_t)t1 >> (t2 & 31)));
             break;
 #if TCG_TARGET_HAS_rot_i32
-        case INDEX_op_rotl_i32:
+        CASE(rotl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, rol32(t1, t2 & 31));
             break;
-        case INDEX_op_rotr_i32:
+        CASE(rotr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(regs, &tb_ptr);
             t2 = tci_read_ri32(regs, &tb_ptr);
@@ -722,7 +895,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             break;
 #endif
 #if TCG_TARGET_HAS_deposit_i32
-        case INDEX_op_deposit_i32:
+        CASE(deposit_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(regs, &tb_ptr);
             t2 = tci_read_r32(regs, &tb_ptr);
@@ -732,7 +905,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg32(regs, t0, (t1 & ~tmp32) | ((t2 << tmp16) & tmp32));
             break;
 #endif
-        case INDEX_op_brcond_i32:
+        CASE(brcond_i32):
             t0 = tci_read_r32(regs, &tb_ptr);
             t1 = tci_read_ri32(regs, &tb_ptr);
             condition = *tb_ptr++;
@@ -744,21 +917,21 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             }
             break;
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_add2_i32:
+        CASE(add2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(regs, &tb_ptr);
             tmp64 += tci_read_r64(regs, &tb_ptr);
             tci_write_reg64(regs, t1, t0, tmp64);
             break;
-        case INDEX_op_sub2_i32:
+        CASE(sub2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(regs, &tb_ptr);
             tmp64 -= tci_read_r64(regs, &tb_ptr);
             tci_write_reg64(regs, t1, t0, tmp64);
             break;
-        case INDEX_op_brcond2_i32:
+        CASE(brcond2_i32):
             tmp64 = tci_read_r64(regs, &tb_ptr);
             v64 = tci_read_ri64(regs, &tb_ptr);
             condition = *tb_ptr++;
@@ -769,7 +942,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                 continue;
             }
             break;
-        case INDEX_op_mulu2_i32:
+        CASE(mulu2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             t2 = tci_read_r32(regs, &tb_ptr);
@@ -778,68 +951,68 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             break;
 #endif /* TCG_TARGET_REG_BITS == 32 */
 #if TCG_TARGET_HAS_ext8s_i32
-        case INDEX_op_ext8s_i32:
+        CASE(ext8s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext16s_i32
-        case INDEX_op_ext16s_i32:
+        CASE(ext16s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext8u_i32
-        case INDEX_op_ext8u_i32:
+        CASE(ext8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext16u_i32
-        case INDEX_op_ext16u_i32:
+        CASE(ext16u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(regs, &tb_ptr);
             tci_write_reg32(regs, t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_bswap16_i32
-        case INDEX_op_bswap16_i32:
+        CASE(bswap16_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(regs, &tb_ptr);
             tci_write_reg32(regs, t0, bswap16(t1));
             break;
 #endif
 #if TCG_TARGET_HAS_bswap32_i32
-        case INDEX_op_bswap32_i32:
+        CASE(bswap32_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, bswap32(t1));
             break;
 #endif
 #if TCG_TARGET_HAS_not_i32
-        case INDEX_op_not_i32:
+        CASE(not_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, ~t1);
             break;
 #endif
 #if TCG_TARGET_HAS_neg_i32
-        case INDEX_op_neg_i32:
+        CASE(neg_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(regs, &tb_ptr);
             tci_write_reg32(regs, t0, -t1);
             break;
 #endif
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_mov_i64:
+        CASE(mov_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1);
             break;
-        case INDEX_op_movi_i64:
+        CASE(movi_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_i64(&tb_ptr);
             tci_write_reg64(regs, t0, t1);
@@ -847,54 +1020,54 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Load/store operations (64 bit). */
 
-        case INDEX_op_ld8u_i64:
+        CASE(ld8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg8(regs, t0, *(uint8_t *)(t1 + t2));
             break;
-        case INDEX_op_ld8s_i64:
-        case INDEX_op_ld16u_i64:
-        case INDEX_op_ld16s_i64:
+        CASE(ld8s_i64):
+        CASE(ld16u_i64):
+        CASE(ld16s_i64):
             TODO();
             break;
-        case INDEX_op_ld32u_i64:
+        CASE(ld32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32(regs, t0, *(uint32_t *)(t1 + t2));
             break;
-        case INDEX_op_ld32s_i64:
+        CASE(ld32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32s(regs, t0, *(int32_t *)(t1 + t2));
             break;
-        case INDEX_op_ld_i64:
+        CASE(ld_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg64(regs, t0, *(uint64_t *)(t1 + t2));
             break;
-        case INDEX_op_st8_i64:
+        CASE(st8_i64):
             t0 = tci_read_r8(regs, &tb_ptr);
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
             break;
-        case INDEX_op_st16_i64:
+        CASE(st16_i64):
             t0 = tci_read_r16(regs, &tb_ptr);
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
             break;
-        case INDEX_op_st32_i64:
+        CASE(st32_i64):
             t0 = tci_read_r32(regs, &tb_ptr);
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint32_t *)(t1 + t2) = t0;
             break;
-        case INDEX_op_st_i64:
+        CASE(st_i64):
             t0 = tci_read_r64(regs, &tb_ptr);
             t1 = tci_read_r(regs, &tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
@@ -904,50 +1077,50 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Arithmetic operations (64 bit). */
 
-        case INDEX_op_add_i64:
+        CASE(add_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1 + t2);
             break;
-        case INDEX_op_sub_i64:
+        CASE(sub_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1 - t2);
             break;
-        case INDEX_op_mul_i64:
+        CASE(mul_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1 * t2);
             break;
 #if TCG_TARGET_HAS_div_i64
-        case INDEX_op_div_i64:
-        case INDEX_op_divu_i64:
-        case INDEX_op_rem_i64:
-        case INDEX_op_remu_i64:
+        CASE(div_i64):
+        CASE(divu_i64):
+        CASE(rem_i64):
+        CASE(remu_i64):
             TODO();
             break;
 #elif TCG_TARGET_HAS_div2_i64
-        case INDEX_op_div2_i64:
-        case INDEX_op_divu2_i64:
+        CASE(div2_i64):
+        CASE(divu2_i64):
             TODO();
             break;
 #endif
-        case INDEX_op_and_i64:
+        CASE(and_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1 & t2);
             break;
-        case INDEX_op_or_i64:
+        CASE(or_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1 | t2);
             break;
-        case INDEX_op_xor_i64:
+        CASE(xor_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
@@ -956,32 +1129,32 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Shift/rotate operations (64 bit). */
 
-        case INDEX_op_shl_i64:
+        CASE(shl_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1 << (t2 & 63));
             break;
-        case INDEX_op_shr_i64:
+        CASE(shr_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1 >> (t2 & 63));
             break;
-        case INDEX_op_sar_i64:
+        CASE(sar_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, ((int64_t)t1 >> (t2 & 63)));
             break;
 #if TCG_TARGET_HAS_rot_i64
-        case INDEX_op_rotl_i64:
+        CASE(rotl_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, rol64(t1, t2 & 63));
             break;
-        case INDEX_op_rotr_i64:
+        CASE(rotr_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(regs, &tb_ptr);
             t2 = tci_read_ri64(regs, &tb_ptr);
@@ -989,7 +1162,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             break;
 #endif
 #if TCG_TARGET_HAS_deposit_i64
-        case INDEX_op_deposit_i64:
+        CASE(deposit_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(regs, &tb_ptr);
             t2 = tci_read_r64(regs, &tb_ptr);
@@ -999,7 +1172,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg64(regs, t0, (t1 & ~tmp64) | ((t2 << tmp16) & tmp64));
             break;
 #endif
-        case INDEX_op_brcond_i64:
+        CASE(brcond_i64):
             t0 = tci_read_r64(regs, &tb_ptr);
             t1 = tci_read_ri64(regs, &tb_ptr);
             condition = *tb_ptr++;
@@ -1011,79 +1184,79 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             }
             break;
 #if TCG_TARGET_HAS_ext8u_i64
-        case INDEX_op_ext8u_i64:
+        CASE(ext8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext8s_i64
-        case INDEX_op_ext8s_i64:
+        CASE(ext8s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext16s_i64
-        case INDEX_op_ext16s_i64:
+        CASE(ext16s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext16u_i64
-        case INDEX_op_ext16u_i64:
+        CASE(ext16u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext32s_i64
-        case INDEX_op_ext32s_i64:
+        CASE(ext32s_i64):
 #endif
-        case INDEX_op_ext_i32_i64:
+        CASE(ext_i32_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32s(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1);
             break;
 #if TCG_TARGET_HAS_ext32u_i64
-        case INDEX_op_ext32u_i64:
+        CASE(ext32u_i64):
 #endif
-        case INDEX_op_extu_i32_i64:
+        CASE(extu_i32_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(regs, &tb_ptr);
             tci_write_reg64(regs, t0, t1);
             break;
 #if TCG_TARGET_HAS_bswap16_i64
-        case INDEX_op_bswap16_i64:
+        CASE(bswap16_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(regs, &tb_ptr);
             tci_write_reg64(regs, t0, bswap16(t1));
             break;
 #endif
 #if TCG_TARGET_HAS_bswap32_i64
-        case INDEX_op_bswap32_i64:
+        CASE(bswap32_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(regs, &tb_ptr);
             tci_write_reg64(regs, t0, bswap32(t1));
             break;
 #endif
 #if TCG_TARGET_HAS_bswap64_i64
-        case INDEX_op_bswap64_i64:
+        CASE(bswap64_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, bswap64(t1));
             break;
 #endif
 #if TCG_TARGET_HAS_not_i64
-        case INDEX_op_not_i64:
+        CASE(not_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, ~t1);
             break;
 #endif
 #if TCG_TARGET_HAS_neg_i64
-        case INDEX_op_neg_i64:
+        CASE(neg_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(regs, &tb_ptr);
             tci_write_reg64(regs, t0, -t1);
@@ -1093,11 +1266,11 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* QEMU specific operations. */
 
-        case INDEX_op_exit_tb:
+        CASE(exit_tb):
             ret = *(uint64_t *)tb_ptr;
             goto exit;
             break;
-        case INDEX_op_goto_tb:
+        CASE(goto_tb):
             /* Jump address is aligned */
             tb_ptr = QEMU_ALIGN_PTR_UP(tb_ptr, 4);
             t0 = atomic_read((int32_t *)tb_ptr);
@@ -1105,7 +1278,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr += (int32_t)t0;
             continue;
-        case INDEX_op_qemu_ld_i32:
+        CASE(qemu_ld_i32):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(regs, &tb_ptr);
             oi = tci_read_i(&tb_ptr);
@@ -1139,7 +1312,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             }
             tci_write_reg(regs, t0, tmp32);
             break;
-        case INDEX_op_qemu_ld_i64:
+        CASE(qemu_ld_i64):
             t0 = *tb_ptr++;
             if (TCG_TARGET_REG_BITS == 32) {
                 t1 = *tb_ptr++;
@@ -1191,7 +1364,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                 tci_write_reg(regs, t1, tmp64 >> 32);
             }
             break;
-        case INDEX_op_qemu_st_i32:
+        CASE(qemu_st_i32):
             t0 = tci_read_r(regs, &tb_ptr);
             taddr = tci_read_ulong(regs, &tb_ptr);
             oi = tci_read_i(&tb_ptr);
@@ -1215,7 +1388,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                 tcg_abort();
             }
             break;
-        case INDEX_op_qemu_st_i64:
+        CASE(qemu_st_i64):
             tmp64 = tci_read_r64(regs, &tb_ptr);
             taddr = tci_read_ulong(regs, &tb_ptr);
             oi = tci_read_i(&tb_ptr);
@@ -1245,11 +1418,11 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                 tcg_abort();
             }
             break;
-        case INDEX_op_mb:
+        CASE(mb):
             /* Ensure ordering for all kinds */
             smp_mb();
             break;
-        default:
+        CASE_DEFAULT:
             TODO();
             break;
         }
@@ -0,0 +1,140 @@
+/*
+ * QTest nRF51 peripheral driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "qapi/qmp/qdict.h"
+#include "libqos/nrf51.h"
+
+void nrf51_irq_intercept(QTestState *qts)
+{
+    qtest_irq_intercept_in(qts, "/machine/soc[0]/armv7m");
+}
+
+void nrf51_task(QTestState *qts, uint64_t base, uint32_t task)
+{
+    qtest_writel(qts, base + task, 1);
+}
+
+bool nrf51_event(QTestState *qts, uint64_t base, uint32_t event)
+{
+    return qtest_readl(qts, base + event) & 1;
+}
+
+void nrf51_event_clear(QTestState *qts, uint64_t base, uint32_t event)
+{
+    qtest_writel(qts, base + event, 0);
+}
+
+void nrf51_timer_init(QTestState *qts, uint64_t base, uint32_t prescaler)
+{
+    nrf51_task(qts, base, NRF51_TASK_STOP);
+    nrf51_task(qts, base, NRF51_TIMER_CLEAR);
+    qtest_writel(qts, base + NRF51_TIMER_MODE, 0);
+    qtest_writel(qts, base + NRF51_TIMER_BITMODE, NRF51_TIMER_BITMODE_32);
+    qtest_writel(qts, base + NRF51_TIMER_PRESCALER, prescaler);
+}
+
+uint32_t nrf51_timer_capture(QTestState *qts, uint64_t base, int n)
+{
+    nrf51_task(qts, base, NRF51_TIMER_CAPTURE(n));
+    return qtest_readl(qts, base + NRF51_TIMER_CC(n));
+}
+
+void nrf51_ppi_connect(QTestState *qts, int ch, uint32_t eep, uint32_t tep)
+{
+    qtest_writel(qts, NRF51_PPI_BASE + NRF51_PPI_EEP(ch), eep);
+    qtest_writel(qts, NRF51_PPI_BASE + NRF51_PPI_TEP(ch), tep);
+    qtest_writel(qts, NRF51_PPI_BASE + NRF51_PPI_CHENSET, 1u << ch);
+}
+
+uint8_t nrf51_twi_read_reg(QTestState *qts, uint64_t base, uint8_t addr,
+                           uint8_t reg)
+{
+    nrf51_event_clear(qts, base, NRF51_TWI_TXDSENT);
+    nrf51_event_clear(qts, base, NRF51_TWI_RXDREADY);
+    nrf51_event_clear(qts, base, NRF51_TWI_STOPPED);
+    qtest_writel(qts, base + NRF51_TWI_ADDRESS, addr);
+    qtest_writel(qts, base + NRF51_SHORTS, 0);
+    qtest_writel(qts, base + NRF51_TWI_TXD, reg);
+    nrf51_task(qts, base, NRF51_TWI_STARTTX);
+    g_assert(nrf51_event(qts, base, NRF51_TWI_TXDSENT));
+
+    qtest_writel(qts, base + NRF51_SHORTS, NRF51_TWI_SHORTS_BB_STOP);
+    nrf51_task(qts, base, NRF51_TWI_STARTRX);
+    g_assert(nrf51_event(qts, base, NRF51_TWI_RXDREADY));
+    g_assert(nrf51_event(qts, base, NRF51_TWI_STOPPED));
+    return qtest_readl(qts, base + NRF51_TWI_RXD);
+}
+
+void nrf51_lfclk_start(QTestState *qts)
+{
+    nrf51_task(qts, NRF51_CLOCK_BASE, NRF51_CLOCK_LFCLKSTART);
+    g_assert(nrf51_event(qts, NRF51_CLOCK_BASE, NRF51_CLOCK_LFCLKSTARTED));
+}
+
+int64_t nrf51_rtc_ticks_ns(uint32_t prescaler, uint64_t ticks)
+{
+    uint64_t lfclk = ticks * (prescaler + 1);
+
+    return (lfclk * NANOSECONDS_PER_SECOND + NRF51_RTC_FREQ - 1) /
+           NRF51_RTC_FREQ;
+}
+
+uint8_t nrf51_rng_read(QTestState *qts)
+{
+    nrf51_event_clear(qts, NRF51_RNG_BASE, NRF51_RNG_VALRDY);
+    qtest_writel(qts, NRF51_RNG_BASE + NRF51_RNG_CONFIG, 0);
+    nrf51_task(qts, NRF51_RNG_BASE, NRF51_TASK_START);
+    qtest_clock_step(qts, NRF51_RNG_RAW_NS);
+    g_assert(nrf51_event(qts, NRF51_RNG_BASE, NRF51_RNG_VALRDY));
+    nrf51_task(qts, NRF51_RNG_BASE, NRF51_TASK_STOP);
+    return qtest_readl(qts, NRF51_RNG_BASE + NRF51_RNG_VALUE);
+}
+
+void nrf51_nvmc_config(QTestState *qts, uint32_t config)
+{
+    qtest_writel(qts, NRF51_NVMC_BASE + NRF51_NVMC_CONFIG, config);
+    g_assert_cmphex(qtest_readl(qts, NRF51_NVMC_BASE + NRF51_NVMC_CONFIG),
+                    ==, config);
+}
+
+void nrf51_nvmc_erase_page(QTestState *qts, uint32_t addr)
+{
+    nrf51_nvmc_config(qts, NRF51_NVMC_CONFIG_EEN);
+    qtest_writel(qts, NRF51_NVMC_BASE + NRF51_NVMC_ERASEPAGE, addr);
+    nrf51_nvmc_config(qts, NRF51_NVMC_CONFIG_REN);
+}
+
+void nrf51_nvmc_write(QTestState *qts, uint32_t addr, uint32_t value)
+{
+    nrf51_nvmc_config(qts, NRF51_NVMC_CONFIG_WEN);
+    qtest_writel(qts, addr, value);
+    nrf51_nvmc_config(qts, NRF51_NVMC_CONFIG_REN);
+}
+
+void nrf51_led_drive(QTestState *qts, int row, uint32_t cols)
+{
+    /* Rows are P0.13-P0.15, active high; columns P0.4-P0.12, active low */
+    qtest_writel(qts, NRF51_GPIO_BASE + NRF51_GPIO_DIRSET, 0x0000FFF0);
+    qtest_writel(qts, NRF51_GPIO_BASE + NRF51_GPIO_OUT,
+                 (1u << (13 + row)) | ((~cols & 0x1FF) << 4));
+}
+
+uint32_t nrf51_led_state(QTestState *qts)
+{
+    QDict *resp;
+    uint32_t state;
+
+    resp = qtest_qmp(qts, "{ 'execute': 'qom-get', 'arguments': "
+                     "{ 'path': '/machine/soc[0]/led-matrix', "
+                     "'property': 'led-state' } }");
+    g_assert(qdict_haskey(resp, "return"));
+    state = qdict_get_int(resp, "return");
+    QDECREF(resp);
+    return state;
+}
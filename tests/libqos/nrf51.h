@@ -0,0 +1,336 @@
+/*
+ * QTest nRF51 peripheral driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef LIBQOS_NRF51_H
+#define LIBQOS_NRF51_H
+
+#include "libqtest.h"
+
+/* Peripheral base addresses, as mapped by the microbit machine */
+#define NRF51_FLASH_BASE    0x00018000
+#define NRF51_FLASH_SIZE    0x00028000
+#define NRF51_RAM_BASE      0x20000000
+#define NRF51_CLOCK_BASE    0x40000000
+#define NRF51_RADIO_BASE    0x40001000
+#define NRF51_UART0_BASE    0x40002000
+#define NRF51_TWI0_BASE     0x40003000
+#define NRF51_SPI1_BASE     0x40004000
+#define NRF51_GPIOTE_BASE   0x40006000
+#define NRF51_ADC_BASE      0x40007000
+#define NRF51_TIMER0_BASE   0x40008000
+#define NRF51_TIMER1_BASE   0x40009000
+#define NRF51_TIMER2_BASE   0x4000A000
+#define NRF51_RTC0_BASE     0x4000B000
+#define NRF51_TEMP_BASE     0x4000C000
+#define NRF51_RNG_BASE      0x4000D000
+#define NRF51_ECB_BASE      0x4000E000
+#define NRF51_CCM_BASE      0x4000F000
+#define NRF51_AAR_BASE      0x4000F000
+#define NRF51_WDT_BASE      0x40010000
+#define NRF51_RTC1_BASE     0x40011000
+#define NRF51_QDEC_BASE     0x40012000
+#define NRF51_LPCOMP_BASE   0x40013000
+#define NRF51_NVMC_BASE     0x4001E000
+#define NRF51_PPI_BASE      0x4001F000
+#define NRF51_GPIO_BASE     0x50000000
+
+/* Tasks and events common to every peripheral */
+#define NRF51_TASK_START    0x000
+#define NRF51_TASK_STOP     0x004
+#define NRF51_SHORTS        0x200
+#define NRF51_INTENSET      0x304
+#define NRF51_INTENCLR      0x308
+
+/* NVIC inputs, once nrf51_irq_intercept() has been called */
+#define NRF51_RADIO_IRQ     1
+#define NRF51_UART0_IRQ     2
+#define NRF51_TWI0_IRQ      3
+#define NRF51_SPI1_IRQ      4
+#define NRF51_GPIOTE_IRQ    6
+#define NRF51_ADC_IRQ       7
+#define NRF51_TIMER1_IRQ    9
+#define NRF51_RTC0_IRQ      11
+#define NRF51_TEMP_IRQ      12
+#define NRF51_ECB_IRQ       14
+#define NRF51_CCM_AAR_IRQ   15
+#define NRF51_WDT_IRQ       16
+#define NRF51_RTC1_IRQ      17
+#define NRF51_QDEC_IRQ      18
+#define NRF51_LPCOMP_IRQ    19
+
+#define NRF51_CLOCK_LFCLKSTART      0x008
+#define NRF51_CLOCK_LFCLKSTARTED    0x104
+
+#define NRF51_TIMER_COUNT       0x008
+#define NRF51_TIMER_CLEAR       0x00C
+#define NRF51_TIMER_CAPTURE(n)  (0x040 + 4 * (n))
+#define NRF51_TIMER_COMPARE(n)  (0x140 + 4 * (n))
+#define NRF51_TIMER_MODE        0x504
+#define NRF51_TIMER_BITMODE     0x508
+#define NRF51_TIMER_PRESCALER   0x510
+#define NRF51_TIMER_CC(n)       (0x540 + 4 * (n))
+#define NRF51_TIMER_FREQ        16000000
+#define NRF51_TIMER_BITMODE_32  3
+#define NRF51_TIMER_MODE_COUNTER    1
+
+#define NRF51_RTC_CLEAR         0x008
+#define NRF51_RTC_TRIGOVRFLW    0x00C
+#define NRF51_RTC_TICK          0x100
+#define NRF51_RTC_OVRFLW        0x104
+#define NRF51_RTC_COMPARE(n)    (0x140 + 4 * (n))
+#define NRF51_RTC_EVTEN         0x340
+#define NRF51_RTC_COUNTER       0x504
+#define NRF51_RTC_PRESCALER     0x508
+#define NRF51_RTC_CC(n)         (0x540 + 4 * (n))
+#define NRF51_RTC_FREQ          32768
+#define NRF51_RTC_EN_OVRFLW     (1 << 1)
+#define NRF51_RTC_EN_COMPARE(n) (1 << (16 + (n)))
+
+#define NRF51_PPI_CHG_EN(n)     (8 * (n))
+#define NRF51_PPI_CHG_DIS(n)    (8 * (n) + 4)
+#define NRF51_PPI_CHEN          0x500
+#define NRF51_PPI_CHENSET       0x504
+#define NRF51_PPI_CHENCLR       0x508
+#define NRF51_PPI_EEP(n)        (0x510 + 8 * (n))
+#define NRF51_PPI_TEP(n)        (0x514 + 8 * (n))
+#define NRF51_PPI_CHG(n)        (0x800 + 4 * (n))
+
+#define NRF51_UART_STARTRX      0x000
+#define NRF51_UART_STARTTX      0x008
+#define NRF51_UART_RXDRDY       0x108
+#define NRF51_UART_TXDRDY       0x11C
+#define NRF51_UART_ENABLE       0x500
+#define NRF51_UART_PSELTXD      0x50C
+#define NRF51_UART_RXD          0x518
+#define NRF51_UART_TXD          0x51C
+#define NRF51_UART_BAUDRATE     0x524
+#define NRF51_UART_ENABLE_ON    4
+#define NRF51_UART_INT_RXDRDY   (1 << 2)
+
+#define NRF51_RADIO_TXEN        0x000
+#define NRF51_RADIO_RXEN        0x004
+#define NRF51_RADIO_START       0x008
+#define NRF51_RADIO_DISABLE     0x010
+#define NRF51_RADIO_READY       0x100
+#define NRF51_RADIO_END         0x10C
+#define NRF51_RADIO_DISABLED    0x110
+#define NRF51_RADIO_CRCSTATUS   0x400
+#define NRF51_RADIO_RXMATCH     0x408
+#define NRF51_RADIO_PACKETPTR   0x504
+#define NRF51_RADIO_FREQUENCY   0x508
+#define NRF51_RADIO_PCNF0       0x514
+#define NRF51_RADIO_PCNF1       0x518
+#define NRF51_RADIO_BASE0       0x51C
+#define NRF51_RADIO_PREFIX0     0x524
+#define NRF51_RADIO_TXADDRESS   0x52C
+#define NRF51_RADIO_RXADDRESSES 0x530
+#define NRF51_RADIO_CRCCNF      0x534
+#define NRF51_RADIO_STATE       0x550
+#define NRF51_RADIO_DATAWHITEIV 0x554
+#define NRF51_RADIO_POWER       0xFFC
+#define NRF51_RADIO_STATE_DISABLED  0
+#define NRF51_RADIO_STATE_RXIDLE    2
+#define NRF51_RADIO_STATE_RX        3
+#define NRF51_RADIO_STATE_TXIDLE    10
+#define NRF51_RADIO_STATE_TX        11
+#define NRF51_RADIO_INT_READY   (1 << 0)
+#define NRF51_RADIO_INT_END     (1 << 3)
+
+#define NRF51_LPCOMP_SAMPLE     0x008
+#define NRF51_LPCOMP_READY      0x100
+#define NRF51_LPCOMP_DOWN       0x104
+#define NRF51_LPCOMP_UP         0x108
+#define NRF51_LPCOMP_CROSS      0x10C
+#define NRF51_LPCOMP_RESULT     0x400
+#define NRF51_LPCOMP_ENABLE     0x500
+#define NRF51_LPCOMP_PSEL       0x504
+#define NRF51_LPCOMP_REFSEL     0x508
+#define NRF51_LPCOMP_ANADETECT  0x520
+#define NRF51_LPCOMP_POWER      0xFFC
+#define NRF51_LPCOMP_SHORTS_READY_SAMPLE    (1 << 0)
+#define NRF51_LPCOMP_INT_UP     (1 << 2)
+
+#define NRF51_TWI_STARTRX       0x000
+#define NRF51_TWI_STARTTX       0x008
+#define NRF51_TWI_STOPPED       0x104
+#define NRF51_TWI_RXDREADY      0x108
+#define NRF51_TWI_TXDSENT       0x11C
+#define NRF51_TWI_ERROR         0x124
+#define NRF51_TWI_ERRORSRC      0x4C4
+#define NRF51_TWI_ENABLE        0x500
+#define NRF51_TWI_PSELSCL       0x508
+#define NRF51_TWI_PSELSDA       0x50C
+#define NRF51_TWI_RXD           0x518
+#define NRF51_TWI_TXD           0x51C
+#define NRF51_TWI_FREQUENCY     0x524
+#define NRF51_TWI_ADDRESS       0x588
+#define NRF51_TWI_POWER         0xFFC
+#define NRF51_TWI_ENABLE_ON     5
+#define NRF51_TWI_SHORTS_BB_STOP    (1 << 1)
+#define NRF51_TWI_INT_RXDREADY  (1 << 2)
+#define NRF51_TWI_INT_ERROR     (1 << 9)
+#define NRF51_TWI_ERRORSRC_ANACK    (1 << 1)
+
+#define NRF51_SPI_READY         0x108
+#define NRF51_SPI_ENABLE        0x500
+#define NRF51_SPI_PSELSCK       0x508
+#define NRF51_SPI_PSELMOSI      0x50C
+#define NRF51_SPI_PSELMISO      0x510
+#define NRF51_SPI_RXD           0x518
+#define NRF51_SPI_TXD           0x51C
+#define NRF51_SPI_FREQUENCY     0x524
+#define NRF51_SPI_CONFIG        0x554
+#define NRF51_SPI_ENABLE_ON     1
+#define NRF51_SPI_INT_READY     (1 << 2)
+
+#define NRF51_GPIOTE_OUT(n)     (4 * (n))
+#define NRF51_GPIOTE_IN(n)      (0x100 + 4 * (n))
+#define NRF51_GPIOTE_PORT       0x17C
+#define NRF51_GPIOTE_CONFIG(n)  (0x510 + 4 * (n))
+#define NRF51_GPIOTE_MODE_EVENT 1
+#define NRF51_GPIOTE_MODE_TASK  3
+#define NRF51_GPIOTE_LOTOHI     1
+#define NRF51_GPIOTE_HITOLO     2
+#define NRF51_GPIOTE_TOGGLE     3
+/* CONFIG for a channel in @mode on pin @psel */
+#define NRF51_GPIOTE_CFG(mode, psel, polarity, outinit) \
+    ((mode) | ((psel) << 8) | ((polarity) << 16) | ((outinit) << 20))
+
+#define NRF51_ADC_END           0x100
+#define NRF51_ADC_BUSY          0x400
+#define NRF51_ADC_ENABLE        0x500
+#define NRF51_ADC_CONFIG        0x504
+#define NRF51_ADC_RESULT        0x508
+#define NRF51_ADC_POWER         0xFFC
+/* CONFIG with resolution @res (0-2 for 8-10 bits) on AIN pin @ain */
+#define NRF51_ADC_CFG(res, ain) ((res) | (1 << ((ain) + 8)))
+
+#define NRF51_TEMP_DATARDY      0x100
+#define NRF51_TEMP_TEMP         0x508
+/* Conversion time, from the datasheet */
+#define NRF51_TEMP_NS           36000
+
+#define NRF51_ECB_STARTECB      0x000
+#define NRF51_ECB_STOPECB       0x004
+#define NRF51_ECB_ENDECB        0x100
+#define NRF51_ECB_ERRORECB      0x104
+#define NRF51_ECB_ECBDATAPTR    0x504
+/* Run time of one block */
+#define NRF51_ECB_NS            7200
+
+#define NRF51_CCM_KSGEN         0x000
+#define NRF51_CCM_CRYPT         0x004
+#define NRF51_CCM_STOP          0x008
+#define NRF51_CCM_ENDKSGEN      0x100
+#define NRF51_CCM_ENDCRYPT      0x104
+#define NRF51_CCM_ERROR         0x108
+#define NRF51_CCM_MICSTATUS     0x400
+#define NRF51_CCM_ENABLE        0x500
+#define NRF51_CCM_MODE          0x504
+#define NRF51_CCM_CNFPTR        0x508
+#define NRF51_CCM_INPTR         0x50C
+#define NRF51_CCM_OUTPTR        0x510
+#define NRF51_CCM_ENABLE_ON     2
+#define NRF51_CCM_MODE_DECRYPT  1
+#define NRF51_CCM_SHORTS_ENDKSGEN_CRYPT (1 << 0)
+#define NRF51_CCM_INT_ENDCRYPT  (1 << 1)
+
+#define NRF51_AAR_START         0x000
+#define NRF51_AAR_END           0x100
+#define NRF51_AAR_RESOLVED      0x104
+#define NRF51_AAR_NOTRESOLVED   0x108
+#define NRF51_AAR_STATUS        0x400
+#define NRF51_AAR_ENABLE        0x500
+#define NRF51_AAR_NIRK          0x504
+#define NRF51_AAR_IRKPTR        0x508
+#define NRF51_AAR_ADDRPTR       0x510
+#define NRF51_AAR_ENABLE_ON     3
+
+#define NRF51_WDT_TIMEOUT       0x100
+#define NRF51_WDT_RUNSTATUS     0x400
+#define NRF51_WDT_REQSTATUS     0x404
+#define NRF51_WDT_CRV           0x504
+#define NRF51_WDT_RREN          0x508
+#define NRF51_WDT_CONFIG        0x50C
+#define NRF51_WDT_RR(n)         (0x600 + 4 * (n))
+#define NRF51_WDT_RELOAD        0x6E524635
+
+#define NRF51_QDEC_READCLRACC   0x008
+#define NRF51_QDEC_SAMPLERDY    0x100
+#define NRF51_QDEC_REPORTRDY    0x104
+#define NRF51_QDEC_ENABLE       0x500
+#define NRF51_QDEC_LEDPOL       0x504
+#define NRF51_QDEC_SAMPLEPER    0x508
+#define NRF51_QDEC_SAMPLE       0x50C
+#define NRF51_QDEC_REPORTPER    0x510
+#define NRF51_QDEC_ACC          0x514
+#define NRF51_QDEC_ACCREAD      0x518
+#define NRF51_QDEC_PSELA        0x520
+#define NRF51_QDEC_PSELB        0x524
+#define NRF51_QDEC_LEDPRE       0x540
+#define NRF51_QDEC_ACCDBL       0x544
+#define NRF51_QDEC_SHORTS_REPORTRDY_READCLRACC  (1 << 0)
+#define NRF51_QDEC_INT_REPORTRDY    (1 << 1)
+
+#define NRF51_RNG_VALRDY    0x100
+#define NRF51_RNG_CONFIG    0x504
+#define NRF51_RNG_VALUE     0x508
+/* Time to produce a byte without bias correction */
+#define NRF51_RNG_RAW_NS    167000
+
+#define NRF51_NVMC_READY        0x400
+#define NRF51_NVMC_CONFIG       0x504
+#define NRF51_NVMC_ERASEPAGE    0x508
+#define NRF51_NVMC_CONFIG_REN   0
+#define NRF51_NVMC_CONFIG_WEN   1
+#define NRF51_NVMC_CONFIG_EEN   2
+#define NRF51_NVMC_PAGE_SIZE    1024
+
+#define NRF51_GPIO_OUT      0x504
+#define NRF51_GPIO_DIR      0x514
+#define NRF51_GPIO_DIRSET   0x518
+#define NRF51_GPIO_DIRCLR   0x51C
+#define NRF51_GPIO_PIN_CNF(n)   (0x700 + 4 * (n))
+#define NRF51_GPIO_SENSE_HIGH   (2 << 16)
+
+/* Route the NVIC inputs to qtest_get_irq() */
+void nrf51_irq_intercept(QTestState *qts);
+
+void nrf51_task(QTestState *qts, uint64_t base, uint32_t task);
+bool nrf51_event(QTestState *qts, uint64_t base, uint32_t event);
+void nrf51_event_clear(QTestState *qts, uint64_t base, uint32_t event);
+
+/* Timer mode, 32-bit counter, ticking at 16 MHz >> prescaler */
+void nrf51_timer_init(QTestState *qts, uint64_t base, uint32_t prescaler);
+uint32_t nrf51_timer_capture(QTestState *qts, uint64_t base, int n);
+
+/* Connect the event at @eep to the task at @tep on PPI channel @ch */
+void nrf51_ppi_connect(QTestState *qts, int ch, uint32_t eep, uint32_t tep);
+
+/*
+ * Read register @reg of the I2C device at @addr through an enabled TWI:
+ * write the register pointer, then read one byte after a repeated start
+ */
+uint8_t nrf51_twi_read_reg(QTestState *qts, uint64_t base, uint8_t addr,
+                           uint8_t reg);
+
+/* Start LFCLK, which the RTCs count */
+void nrf51_lfclk_start(QTestState *qts);
+/* Virtual time for @ticks ticks of an RTC, from a tick boundary */
+int64_t nrf51_rtc_ticks_ns(uint32_t prescaler, uint64_t ticks);
+
+/* Start the RNG and advance virtual time until it has a value */
+uint8_t nrf51_rng_read(QTestState *qts);
+
+void nrf51_nvmc_config(QTestState *qts, uint32_t config);
+void nrf51_nvmc_erase_page(QTestState *qts, uint32_t addr);
+void nrf51_nvmc_write(QTestState *qts, uint32_t addr, uint32_t value);
+
+/* Drive the LED matrix row @row (0-2) with the columns in @cols lit */
+void nrf51_led_drive(QTestState *qts, int row, uint32_t cols);
+uint32_t nrf51_led_state(QTestState *qts);
+
+#endif
@@ -21,7 +21,9 @@
 #include <sys/un.h>
 
 #include "libqtest.h"
+#include "qemu/bswap.h"
 #include "qemu/cutils.h"
+#include "sysemu/qtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/json-parser.h"
 #include "qapi/qmp/json-streamer.h"
@@ -45,6 +47,18 @@ struct QTestState
     bool big_endian;
 };
 
+typedef struct QTestBatchResult {
+    uint8_t op;
+    void *value;
+} QTestBatchResult;
+
+struct QTestBatch
+{
+    QTestState *s;
+    GByteArray *ops;
+    GArray *results;    /* QTestBatchResult, for ops that return a value */
+};
+
 static GHookList abrt_hooks;
 static struct sigaction sigact_old;
 
@@ -286,6 +300,11 @@ void qtest_quit(QTestState *s)
     g_free(s);
 }
 
+pid_t qtest_pid(QTestState *s)
+{
+    return s->qemu_pid;
+}
+
 static void socket_send(int fd, const char *buf, size_t size)
 {
     size_t offset;
@@ -324,13 +343,9 @@ static void GCC_FMT_ATTR(2, 3) qtest_sendf(QTestState *s, const char *fmt, ...)
     va_end(ap);
 }
 
-static GString *qtest_recv_line(QTestState *s)
+static void qtest_recv_more(QTestState *s)
 {
-    GString *line;
-    size_t offset;
-    char *eol;
-
-    while ((eol = strchr(s->rx->str, '\n')) == NULL) {
+    for (;;) {
         ssize_t len;
         char buffer[1024];
 
@@ -345,6 +360,18 @@ static GString *qtest_recv_line(QTestState *s)
         }
 
         g_string_append_len(s->rx, buffer, len);
+        return;
+    }
+}
+
+static GString *qtest_recv_line(QTestState *s)
+{
+    GString *line;
+    size_t offset;
+    char *eol;
+
+    while ((eol = memchr(s->rx->str, '\n', s->rx->len)) == NULL) {
+        qtest_recv_more(s);
     }
 
     offset = eol - s->rx->str;
@@ -354,6 +381,17 @@ static GString *qtest_recv_line(QTestState *s)
     return line;
 }
 
+/* Binary data that follows a reply line, as in the "batch" command */
+static void qtest_recv_data(QTestState *s, void *data, size_t size)
+{
+    while (s->rx->len < size) {
+        qtest_recv_more(s);
+    }
+
+    memcpy(data, s->rx->str, size);
+    g_string_erase(s->rx, 0, size);
+}
+
 static gchar **qtest_rsp(QTestState *s, int expected_args)
 {
     GString *line;
@@ -699,6 +737,149 @@ int64_t qtest_clock_set(QTestState *s, int64_t val)
     return qtest_clock_rsp(s);
 }
 
+QTestBatch *qtest_batch_new(QTestState *s)
+{
+    QTestBatch *b = g_new0(QTestBatch, 1);
+
+    b->s = s;
+    b->ops = g_byte_array_new();
+    b->results = g_array_new(FALSE, FALSE, sizeof(QTestBatchResult));
+    return b;
+}
+
+void qtest_batch_free(QTestBatch *b)
+{
+    g_byte_array_free(b->ops, TRUE);
+    g_array_free(b->results, TRUE);
+    g_free(b);
+}
+
+static void qtest_batch_op(QTestBatch *b, uint8_t op, uint64_t arg)
+{
+    uint8_t buf[8];
+
+    g_byte_array_append(b->ops, &op, 1);
+    stq_le_p(buf, arg);
+    g_byte_array_append(b->ops, buf, 8);
+}
+
+static void qtest_batch_write(QTestBatch *b, uint8_t op, uint64_t addr,
+                              uint64_t value)
+{
+    uint8_t buf[8];
+
+    qtest_batch_op(b, op, addr);
+    stq_le_p(buf, value);
+    g_byte_array_append(b->ops, buf, 8);
+}
+
+static void qtest_batch_result(QTestBatch *b, uint8_t op, uint64_t arg,
+                               void *value)
+{
+    QTestBatchResult r = { .op = op, .value = value };
+
+    qtest_batch_op(b, op, arg);
+    g_array_append_val(b->results, r);
+}
+
+void qtest_batch_writeb(QTestBatch *b, uint64_t addr, uint8_t value)
+{
+    qtest_batch_write(b, QTEST_BATCH_WRITEB, addr, value);
+}
+
+void qtest_batch_writew(QTestBatch *b, uint64_t addr, uint16_t value)
+{
+    qtest_batch_write(b, QTEST_BATCH_WRITEW, addr, value);
+}
+
+void qtest_batch_writel(QTestBatch *b, uint64_t addr, uint32_t value)
+{
+    qtest_batch_write(b, QTEST_BATCH_WRITEL, addr, value);
+}
+
+void qtest_batch_writeq(QTestBatch *b, uint64_t addr, uint64_t value)
+{
+    qtest_batch_write(b, QTEST_BATCH_WRITEQ, addr, value);
+}
+
+void qtest_batch_readb(QTestBatch *b, uint64_t addr, uint8_t *value)
+{
+    qtest_batch_result(b, QTEST_BATCH_READB, addr, value);
+}
+
+void qtest_batch_readw(QTestBatch *b, uint64_t addr, uint16_t *value)
+{
+    qtest_batch_result(b, QTEST_BATCH_READW, addr, value);
+}
+
+void qtest_batch_readl(QTestBatch *b, uint64_t addr, uint32_t *value)
+{
+    qtest_batch_result(b, QTEST_BATCH_READL, addr, value);
+}
+
+void qtest_batch_readq(QTestBatch *b, uint64_t addr, uint64_t *value)
+{
+    qtest_batch_result(b, QTEST_BATCH_READQ, addr, value);
+}
+
+void qtest_batch_clock_step(QTestBatch *b, int64_t step, int64_t *clock)
+{
+    qtest_batch_result(b, QTEST_BATCH_CLOCK_STEP, step, clock);
+}
+
+void qtest_batch_run(QTestBatch *b)
+{
+    QTestState *s = b->s;
+    gchar **args;
+    uint64_t size;
+    uint8_t *data;
+    guint i;
+    int ret;
+
+    g_assert_cmpuint(b->ops->len, <=, QTEST_BATCH_MAX_SIZE);
+    qtest_sendf(s, "batch %u\n", b->ops->len);
+    socket_send(s->fd, (const char *)b->ops->data, b->ops->len);
+
+    args = qtest_rsp(s, 2);
+    ret = qemu_strtou64(args[1], NULL, 0, &size);
+    g_assert(!ret);
+    g_strfreev(args);
+    g_assert_cmpuint(size, ==, b->results->len * 8);
+
+    data = g_malloc(size);
+    qtest_recv_data(s, data, size);
+    for (i = 0; i < b->results->len; i++) {
+        QTestBatchResult *r = &g_array_index(b->results, QTestBatchResult, i);
+        uint64_t value = ldq_le_p(data + i * 8);
+
+        switch (r->op) {
+        case QTEST_BATCH_READB:
+            *(uint8_t *)r->value = value;
+            break;
+        case QTEST_BATCH_READW:
+            *(uint16_t *)r->value = value;
+            break;
+        case QTEST_BATCH_READL:
+            *(uint32_t *)r->value = value;
+            break;
+        case QTEST_BATCH_READQ:
+            *(uint64_t *)r->value = value;
+            break;
+        case QTEST_BATCH_CLOCK_STEP:
+            if (r->value) {
+                *(int64_t *)r->value = value;
+            }
+            break;
+        default:
+            g_assert_not_reached();
+        }
+    }
+    g_free(data);
+
+    g_byte_array_set_size(b->ops, 0);
+    g_array_set_size(b->results, 0);
+}
+
 void qtest_irq_intercept_out(QTestState *s, const char *qom_path)
 {
     qtest_sendf(s, "irq_intercept_out %s\n", qom_path);
@@ -18,6 +18,7 @@
 #define LIBQTEST_H
 
 typedef struct QTestState QTestState;
+typedef struct QTestBatch QTestBatch;
 
 extern QTestState *global_qtest;
 
@@ -73,6 +74,14 @@ QTestState *qtest_init_without_qmp_handshake(bool use_oob,
  */
 void qtest_quit(QTestState *s);
 
+/**
+ * qtest_pid:
+ * @s: #QTestState instance to operate on.
+ *
+ * Returns: the process ID of the QEMU process associated to @s.
+ */
+pid_t qtest_pid(QTestState *s);
+
 /**
  * qtest_qmp_discard_response:
  * @s: #QTestState instance to operate on.
@@ -455,6 +464,128 @@ int64_t qtest_clock_step(QTestState *s, int64_t step);
  */
 int64_t qtest_clock_set(QTestState *s, int64_t val);
 
+/**
+ * qtest_batch_new:
+ * @s: #QTestState instance to operate on.
+ *
+ * Start a batch of memory accesses and clock steps that are sent to QEMU
+ * together and answered with a single reply.  Queued ops do nothing until
+ * qtest_batch_run() is called.
+ *
+ * Returns: The new batch, to be freed with qtest_batch_free().
+ */
+QTestBatch *qtest_batch_new(QTestState *s);
+
+/**
+ * qtest_batch_free:
+ * @b: Batch to free.
+ *
+ * Free a batch; ops queued since the last qtest_batch_run() are dropped.
+ */
+void qtest_batch_free(QTestBatch *b);
+
+/**
+ * qtest_batch_writeb:
+ * @b: Batch to queue the op on.
+ * @addr: Guest address to write to.
+ * @value: Value being written.
+ *
+ * Queue an 8-bit write to memory.
+ */
+void qtest_batch_writeb(QTestBatch *b, uint64_t addr, uint8_t value);
+
+/**
+ * qtest_batch_writew:
+ * @b: Batch to queue the op on.
+ * @addr: Guest address to write to.
+ * @value: Value being written.
+ *
+ * Queue a 16-bit write to memory.
+ */
+void qtest_batch_writew(QTestBatch *b, uint64_t addr, uint16_t value);
+
+/**
+ * qtest_batch_writel:
+ * @b: Batch to queue the op on.
+ * @addr: Guest address to write to.
+ * @value: Value being written.
+ *
+ * Queue a 32-bit write to memory.
+ */
+void qtest_batch_writel(QTestBatch *b, uint64_t addr, uint32_t value);
+
+/**
+ * qtest_batch_writeq:
+ * @b: Batch to queue the op on.
+ * @addr: Guest address to write to.
+ * @value: Value being written.
+ *
+ * Queue a 64-bit write to memory.
+ */
+void qtest_batch_writeq(QTestBatch *b, uint64_t addr, uint64_t value);
+
+/**
+ * qtest_batch_readb:
+ * @b: Batch to queue the op on.
+ * @addr: Guest address to read from.
+ * @value: Where qtest_batch_run() stores the value read.
+ *
+ * Queue an 8-bit read from memory.
+ */
+void qtest_batch_readb(QTestBatch *b, uint64_t addr, uint8_t *value);
+
+/**
+ * qtest_batch_readw:
+ * @b: Batch to queue the op on.
+ * @addr: Guest address to read from.
+ * @value: Where qtest_batch_run() stores the value read.
+ *
+ * Queue a 16-bit read from memory.
+ */
+void qtest_batch_readw(QTestBatch *b, uint64_t addr, uint16_t *value);
+
+/**
+ * qtest_batch_readl:
+ * @b: Batch to queue the op on.
+ * @addr: Guest address to read from.
+ * @value: Where qtest_batch_run() stores the value read.
+ *
+ * Queue a 32-bit read from memory.
+ */
+void qtest_batch_readl(QTestBatch *b, uint64_t addr, uint32_t *value);
+
+/**
+ * qtest_batch_readq:
+ * @b: Batch to queue the op on.
+ * @addr: Guest address to read from.
+ * @value: Where qtest_batch_run() stores the value read.
+ *
+ * Queue a 64-bit read from memory.
+ */
+void qtest_batch_readq(QTestBatch *b, uint64_t addr, uint64_t *value);
+
+/**
+ * qtest_batch_clock_step:
+ * @b: Batch to queue the op on.
+ * @step: Number of nanoseconds to advance the clock by, or -1 to
+ * advance it to the next deadline.
+ * @clock: Where qtest_batch_run() stores the QEMU_CLOCK_VIRTUAL value
+ * after the step, or %NULL.
+ *
+ * Queue an advance of the QEMU_CLOCK_VIRTUAL.
+ */
+void qtest_batch_clock_step(QTestBatch *b, int64_t step, int64_t *clock);
+
+/**
+ * qtest_batch_run:
+ * @b: Batch to run.
+ *
+ * Send the queued ops to QEMU, wait for them to complete and store the
+ * results of the reads and clock steps.  The batch is empty afterwards
+ * and can be reused.
+ */
+void qtest_batch_run(QTestBatch *b);
+
 /**
  * qtest_big_endian:
  * @s: QTestState instance to operate on.
@@ -0,0 +1,372 @@
+/*
+ * micro:bit firmware benchmarks
+ *
+ * Boots the reference firmware below once per benchmark and reports, one
+ * JSON object per line on stdout:
+ *
+ *   boot-to-main  host time from starting QEMU until the firmware runs
+ *   mips-alu      guest MIPS on a register-only loop
+ *   mips-mem      guest MIPS on a loop of calls, loads and stores
+ *   irq-timer     TIMER0 COMPARE interrupts handled per host second
+ *   led-update    LED matrix changes per host second
+ *
+ * Where perf events are allowed, each rate also comes with the L1 data
+ * cache read misses of QEMU during its window, as "<name>-l1d-miss",
+ * per thousand guest instructions or per counted event.
+ *
+ * Run with QTEST_QEMU_BINARY pointing at qemu-system-arm, or through
+ * "make check-bench-microbit".
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/timer.h"
+#include "libqtest.h"
+#ifdef CONFIG_LINUX
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/* Where the firmware reports: MAIN_MAGIC once it runs, then a counter */
+#define BENCH_STATUS        0x20000000
+#define BENCH_COUNTER       0x20000004
+#define BENCH_MAIN_MAGIC    0x4d41494e
+
+/* Offset of the word selecting the benchmark in the firmware image */
+#define BENCH_MODE_OFFSET 0xc0
+
+#define BENCH_BOOT_TIMEOUT_NS (10 * NANOSECONDS_PER_SECOND)
+#define BENCH_WARMUP_US       (200 * 1000)
+#define BENCH_WINDOW_US       (1000 * 1000)
+
+#define BENCH_MAX_THREADS 64
+
+/*
+ * Reference firmware, a raw image for 0x18000 built from:
+ *
+ *     .equ base, 0x18000
+ * vectors:
+ *     .word 0x20004000
+ *     .word base + (reset - vectors) + 1
+ *     .rept 22
+ *     .word base + (hang - vectors) + 1
+ *     .endr
+ *     .word base + (timer0_isr - vectors) + 1   @ IRQ 8
+ *     .rept 23
+ *     .word base + (hang - vectors) + 1
+ *     .endr
+ * mode:
+ *     .word 0
+ * reset:
+ *     ldr r0, =0x20000000
+ *     movs r1, #0
+ *     str r1, [r0, #4]
+ *     ldr r1, =0x4d41494e
+ *     str r1, [r0]
+ *     ldr r3, =base + (mode - vectors)
+ *     ldr r2, [r3]
+ *     cmp r2, #1
+ *     beq mips_alu
+ *     cmp r2, #2
+ *     beq mips_mem
+ *     cmp r2, #3
+ *     beq irq
+ *     cmp r2, #4
+ *     beq led
+ * hang:
+ *     wfi
+ *     b hang
+ * mips_alu:                       @ 7 instructions per iteration
+ *     movs r1, #0
+ * 1:  adds r1, r1, #1
+ *     eors r3, r1
+ *     lsls r4, r3, #1
+ *     adds r5, r4, r3
+ *     subs r6, r5, r1
+ *     str r1, [r0, #4]
+ *     b 1b
+ * mips_mem:                       @ 10 instructions per iteration
+ *     movs r1, #0
+ *     ldr r7, =0x20000100
+ * 1:  bl work
+ *     adds r1, r1, #1
+ *     str r1, [r0, #4]
+ *     b 1b
+ * work:
+ *     ldr r3, [r7]
+ *     adds r3, r3, r1
+ *     str r3, [r7, #4]
+ *     ldr r4, [r7, #4]
+ *     str r4, [r7]
+ *     bx lr
+ * irq:                            @ COMPARE0 every 16 ticks of 16 MHz
+ *     ldr r2, =0x40008504 ; movs r3, #0  ; str r3, [r2]   @ MODE
+ *     ldr r2, =0x40008508 ; movs r3, #3  ; str r3, [r2]   @ BITMODE
+ *     ldr r2, =0x40008510 ; movs r3, #0  ; str r3, [r2]   @ PRESCALER
+ *     ldr r2, =0x40008540 ; movs r3, #16 ; str r3, [r2]   @ CC[0]
+ *     ldr r2, =0x40008200 ; movs r3, #1  ; str r3, [r2]   @ SHORTS
+ *     ldr r2, =0x40008304 ; ldr r3, =0x00010000 ; str r3, [r2]
+ *     ldr r2, =0xe000e100 ; movs r3, #1  ; lsls r3, r3, #8 ; str r3, [r2]
+ *     ldr r2, =0x40008000 ; movs r3, #1  ; str r3, [r2]   @ START
+ *     cpsie i
+ * 1:  wfi
+ *     b 1b
+ * timer0_isr:
+ *     ldr r2, =0x40008140
+ *     movs r3, #0
+ *     str r3, [r2]
+ *     ldr r2, =0x20000000
+ *     ldr r3, [r2, #4]
+ *     adds r3, r3, #1
+ *     str r3, [r2, #4]
+ *     bx lr
+ * led:                            @ toggle the LED at (0, 0)
+ *     ldr r2, =0x50000518
+ *     ldr r3, =0x0000fff0
+ *     str r3, [r2]
+ *     ldr r2, =0x50000504
+ *     ldr r4, =0x00003fe0
+ *     ldr r5, =0x00003ff0
+ *     movs r1, #0
+ * 1:  str r4, [r2]
+ *     str r5, [r2]
+ *     adds r1, r1, #2
+ *     str r1, [r0, #4]
+ *     b 1b
+ */
+static const uint8_t bench_firmware[] = {
+    0x00, 0x40, 0x00, 0x20, 0xc5, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0x49, 0x81, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00, 0xe3, 0x80, 0x01, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x2a, 0x48, 0x00, 0x21, 0x41, 0x60, 0x2a, 0x49,
+    0x01, 0x60, 0x2a, 0x4b, 0x1a, 0x68, 0x01, 0x2a, 0x07, 0xd0, 0x02, 0x2a,
+    0x0d, 0xd0, 0x03, 0x2a, 0x18, 0xd0, 0x04, 0x2a, 0x3a, 0xd0, 0x30, 0xbf,
+    0xfd, 0xe7, 0x00, 0x21, 0x49, 0x1c, 0x4b, 0x40, 0x5c, 0x00, 0xe5, 0x18,
+    0x6e, 0x1a, 0x41, 0x60, 0xf8, 0xe7, 0x00, 0x21, 0x20, 0x4f, 0x00, 0xf0,
+    0x03, 0xf8, 0x49, 0x1c, 0x41, 0x60, 0xfa, 0xe7, 0x3b, 0x68, 0x5b, 0x18,
+    0x7b, 0x60, 0x7c, 0x68, 0x3c, 0x60, 0x70, 0x47, 0x1b, 0x4a, 0x00, 0x23,
+    0x13, 0x60, 0x1b, 0x4a, 0x03, 0x23, 0x13, 0x60, 0x1a, 0x4a, 0x00, 0x23,
+    0x13, 0x60, 0x1a, 0x4a, 0x10, 0x23, 0x13, 0x60, 0x19, 0x4a, 0x01, 0x23,
+    0x13, 0x60, 0x19, 0x4a, 0x19, 0x4b, 0x13, 0x60, 0x19, 0x4a, 0x01, 0x23,
+    0x1b, 0x02, 0x13, 0x60, 0x18, 0x4a, 0x01, 0x23, 0x13, 0x60, 0x62, 0xb6,
+    0x30, 0xbf, 0xfd, 0xe7, 0x16, 0x4a, 0x00, 0x23, 0x13, 0x60, 0x08, 0x4a,
+    0x53, 0x68, 0x5b, 0x1c, 0x53, 0x60, 0x70, 0x47, 0x13, 0x4a, 0x14, 0x4b,
+    0x13, 0x60, 0x14, 0x4a, 0x14, 0x4c, 0x15, 0x4d, 0x00, 0x21, 0x14, 0x60,
+    0x15, 0x60, 0x89, 0x1c, 0x41, 0x60, 0xfa, 0xe7, 0x00, 0x00, 0x00, 0x20,
+    0x4e, 0x49, 0x41, 0x4d, 0xc0, 0x80, 0x01, 0x00, 0x00, 0x01, 0x00, 0x20,
+    0x04, 0x85, 0x00, 0x40, 0x08, 0x85, 0x00, 0x40, 0x10, 0x85, 0x00, 0x40,
+    0x40, 0x85, 0x00, 0x40, 0x00, 0x82, 0x00, 0x40, 0x04, 0x83, 0x00, 0x40,
+    0x00, 0x00, 0x01, 0x00, 0x00, 0xe1, 0x00, 0xe0, 0x00, 0x80, 0x00, 0x40,
+    0x40, 0x81, 0x00, 0x40, 0x18, 0x05, 0x00, 0x50, 0xf0, 0xff, 0x00, 0x00,
+    0x04, 0x05, 0x00, 0x50, 0xe0, 0x3f, 0x00, 0x00, 0xf0, 0x3f, 0x00, 0x00,
+};
+
+enum {
+    BENCH_MODE_BOOT = 0,
+    BENCH_MODE_MIPS_ALU = 1,
+    BENCH_MODE_MIPS_MEM = 2,
+    BENCH_MODE_IRQ = 3,
+    BENCH_MODE_LED = 4,
+};
+
+typedef struct {
+    const char *name;
+    uint32_t mode;
+    /* Guest instructions per counter increment, 0 to report the raw rate */
+    unsigned insns;
+    const char *unit;
+} BenchDef;
+
+static const BenchDef benchmarks[] = {
+    { "mips-alu", BENCH_MODE_MIPS_ALU, 7, "MIPS" },
+    { "mips-mem", BENCH_MODE_MIPS_MEM, 10, "MIPS" },
+    { "irq-timer", BENCH_MODE_IRQ, 0, "irq/s" },
+    { "led-update", BENCH_MODE_LED, 0, "updates/s" },
+    { NULL }
+};
+
+static void bench_report(const char *name, double value, const char *unit)
+{
+    printf("{\"benchmark\": \"%s\", \"value\": %.2f, \"unit\": \"%s\"}\n",
+           name, value, unit);
+    fflush(stdout);
+}
+
+/* Start QEMU on the firmware with @mode selected */
+static QTestState *bench_start(uint32_t mode)
+{
+    uint8_t image[sizeof(bench_firmware)];
+    QTestState *qts;
+    char *path, *args;
+    int fd;
+
+    memcpy(image, bench_firmware, sizeof(image));
+    stl_le_p(&image[BENCH_MODE_OFFSET], mode);
+
+    fd = g_file_open_tmp("microbit-bench-XXXXXX", &path, NULL);
+    g_assert(fd != -1);
+    g_assert(write(fd, image, sizeof(image)) == sizeof(image));
+    close(fd);
+
+    args = g_strdup_printf("-machine microbit,accel=tcg -display none "
+                           "-kernel %s", path);
+    qts = qtest_init(args);
+    g_free(args);
+
+    unlink(path);
+    g_free(path);
+    return qts;
+}
+
+/* Host time in ns until the firmware reports that it runs */
+static int64_t bench_wait_main(QTestState *qts, int64_t start)
+{
+    while (qtest_readl(qts, BENCH_STATUS) != BENCH_MAIN_MAGIC) {
+        if (get_clock() - start > BENCH_BOOT_TIMEOUT_NS) {
+            fprintf(stderr, "microbit-bench: firmware did not start\n");
+            exit(1);
+        }
+        g_usleep(100);
+    }
+    return get_clock() - start;
+}
+
+static void bench_boot(void)
+{
+    int64_t start = get_clock();
+    QTestState *qts = bench_start(BENCH_MODE_BOOT);
+
+    bench_report("boot-to-main", bench_wait_main(qts, start) / 1e6, "ms");
+    qtest_quit(qts);
+}
+
+/* L1 data cache read misses of every thread of QEMU */
+typedef struct {
+    int fds[BENCH_MAX_THREADS];
+    int n;
+} BenchMisses;
+
+#ifdef CONFIG_LINUX
+static void bench_misses_start(BenchMisses *m, pid_t pid)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HW_CACHE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CACHE_L1D |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    char *path = g_strdup_printf("/proc/%d/task", (int)pid);
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const char *tid;
+    int fd;
+
+    m->n = 0;
+    g_free(path);
+    if (!dir) {
+        return;
+    }
+    while (m->n < BENCH_MAX_THREADS && (tid = g_dir_read_name(dir))) {
+        fd = syscall(__NR_perf_event_open, &attr, atoi(tid), -1, -1, 0);
+        if (fd >= 0) {
+            m->fds[m->n++] = fd;
+        }
+    }
+    g_dir_close(dir);
+}
+#else
+static void bench_misses_start(BenchMisses *m, pid_t pid)
+{
+    m->n = 0;
+}
+#endif
+
+/* Misses since bench_misses_start(), or -1 if perf is not available */
+static int64_t bench_misses_stop(BenchMisses *m)
+{
+    int64_t total = m->n ? 0 : -1;
+    uint64_t count;
+    int i;
+
+    for (i = 0; i < m->n; i++) {
+        if (read(m->fds[i], &count, sizeof(count)) == sizeof(count)) {
+            total += count;
+        }
+        close(m->fds[i]);
+    }
+    return total;
+}
+
+/* Counter increments per host second over a window, after a warm-up */
+static void bench_rate(const BenchDef *bench)
+{
+    QTestState *qts = bench_start(bench->mode);
+    BenchMisses m;
+    uint32_t first, last;
+    int64_t start, elapsed, misses;
+    double rate, per;
+    char *name;
+
+    bench_wait_main(qts, get_clock());
+    g_usleep(BENCH_WARMUP_US);
+
+    bench_misses_start(&m, qtest_pid(qts));
+    first = qtest_readl(qts, BENCH_COUNTER);
+    start = get_clock();
+    g_usleep(BENCH_WINDOW_US);
+    last = qtest_readl(qts, BENCH_COUNTER);
+    elapsed = get_clock() - start;
+    misses = bench_misses_stop(&m);
+
+    rate = (double)(uint32_t)(last - first) * NANOSECONDS_PER_SECOND / elapsed;
+    if (bench->insns) {
+        rate = rate * bench->insns / 1e6;
+    }
+    bench_report(bench->name, rate, bench->unit);
+
+    if (misses >= 0 && last != first) {
+        per = (double)(uint32_t)(last - first);
+        if (bench->insns) {
+            per = per * bench->insns / 1000;
+        }
+        name = g_strdup_printf("%s-l1d-miss", bench->name);
+        bench_report(name, misses / per,
+                     bench->insns ? "miss/kinsn" : "miss/event");
+        g_free(name);
+    }
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    const BenchDef *bench;
+
+    if (!getenv("QTEST_QEMU_BINARY")) {
+        fprintf(stderr, "microbit-bench: QTEST_QEMU_BINARY must be set\n");
+        return 1;
+    }
+
+    bench_boot();
+    for (bench = benchmarks; bench->name; bench++) {
+        bench_rate(bench);
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * In-process libFuzzer target for the micro:bit nRF51 peripherals
+ *
+ * The machine is created once.  Each input is a sequence of MMIO reads,
+ * MMIO writes and virtual clock steps, issued straight to the system
+ * address space, after which the devices are put back through their
+ * reset callbacks.  Build with --enable-fuzzing and run e.g.
+ *
+ *   arm-softmmu/qemu-fuzz-arm -max_len=4096 corpus/
+ *
+ * Each op takes 8 bytes:
+ *   byte 0      what to do: 0 read, 1 write, 2 step the clock
+ *   byte 1      which MMIO region, in address order
+ *   bytes 2-3   offset in the region, little endian, made 4-aligned
+ *   bytes 4-7   value to write, or nanoseconds to step (up to 16 ms)
+ *
+ * Flash written through the NVMC is not reset between inputs.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "qemu/main-loop.h"
+#include "exec/memory.h"
+#include "exec/address-spaces.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
+#include "sysemu/reset.h"
+
+#define MICROBIT_FUZZ_OP_SIZE       8
+#define MICROBIT_FUZZ_MAX_REGIONS   64
+#define MICROBIT_FUZZ_MAX_STEP      0xffffff
+
+enum {
+    MICROBIT_FUZZ_READ,
+    MICROBIT_FUZZ_WRITE,
+    MICROBIT_FUZZ_STEP,
+    MICROBIT_FUZZ_OPS,
+};
+
+typedef struct MicrobitFuzzRegion {
+    hwaddr base;
+    uint64_t size;
+} MicrobitFuzzRegion;
+
+static MicrobitFuzzRegion microbit_fuzz_regions[MICROBIT_FUZZ_MAX_REGIONS];
+static int microbit_fuzz_nregions;
+
+/* Fuzz whatever is MMIO; RAM and ROM have nothing to find */
+static void microbit_fuzz_add_region(MemoryRegionSection *section,
+                                     void *opaque)
+{
+    MicrobitFuzzRegion *r;
+
+    if (memory_region_is_ram(section->mr) ||
+        microbit_fuzz_nregions == MICROBIT_FUZZ_MAX_REGIONS) {
+        return;
+    }
+    r = &microbit_fuzz_regions[microbit_fuzz_nregions++];
+    r->base = section->offset_within_address_space;
+    r->size = int128_get64(section->size);
+}
+
+/* Run the bottom halves and expired timers the last op scheduled */
+static void microbit_fuzz_flush(void)
+{
+    main_loop_wait(true);
+}
+
+static void microbit_fuzz_op(const uint8_t *op)
+{
+    MicrobitFuzzRegion *r;
+    uint8_t buf[4];
+    hwaddr addr;
+    uint32_t value = ldl_le_p(op + 4);
+
+    r = &microbit_fuzz_regions[op[1] % microbit_fuzz_nregions];
+    addr = r->base + QEMU_ALIGN_DOWN(lduw_le_p(op + 2) % r->size, 4);
+
+    switch (op[0] % MICROBIT_FUZZ_OPS) {
+    case MICROBIT_FUZZ_READ:
+        address_space_read(&address_space_memory, addr,
+                           MEMTXATTRS_UNSPECIFIED, buf, sizeof(buf));
+        break;
+    case MICROBIT_FUZZ_WRITE:
+        stl_le_p(buf, value);
+        address_space_write(&address_space_memory, addr,
+                            MEMTXATTRS_UNSPECIFIED, buf, sizeof(buf));
+        break;
+    case MICROBIT_FUZZ_STEP:
+        qtest_clock_warp(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                         (value & MICROBIT_FUZZ_MAX_STEP));
+        break;
+    }
+    microbit_fuzz_flush();
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    /* Not libFuzzer's own arguments, which QEMU would not understand.
+       The qtest accelerator runs no guest code and lets us drive the
+       virtual clock.  */
+    static char *args[] = {
+        NULL, (char *)"-machine", (char *)"microbit,accel=qtest",
+        (char *)"-display", (char *)"none", (char *)"-nodefaults",
+        NULL
+    };
+
+    args[0] = (*argv)[0];
+    qemu_init(ARRAY_SIZE(args) - 1, args, NULL);
+
+    address_space_foreach_section(&address_space_memory,
+                                  microbit_fuzz_add_region, NULL);
+    if (!microbit_fuzz_nregions) {
+        fprintf(stderr, "microbit-fuzz: no MMIO regions to fuzz\n");
+        exit(1);
+    }
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i + MICROBIT_FUZZ_OP_SIZE <= size;
+         i += MICROBIT_FUZZ_OP_SIZE) {
+        microbit_fuzz_op(data + i);
+    }
+
+    qemu_devices_reset();
+    microbit_fuzz_flush();
+    return 0;
+}
@@ -0,0 +1,1304 @@
+/*
+ * QTest testcase for the micro:bit nRF51 peripherals
+ *
+ * Run with "-m perf" to also report the cost of an MMIO access and of a
+ * timer compare event.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "qemu/sockets.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "libqtest.h"
+#include "libqos/nrf51.h"
+
+#define BENCH_MMIO_ACCESSES 100000
+#define BENCH_TIMER_EVENTS  10000
+
+/* qtest round trips to wait for a chardev before giving up */
+#define CHARDEV_POLLS       1000
+
+/* The micro:bit mailbox, see hw/arm/microbit.c */
+#define MAILBOX_BASE        0x400FD000
+#define MAILBOX_RING        0x000
+#define MAILBOX_RING_SIZE   0x004
+#define MAILBOX_DOORBELL    0x008
+#define MAILBOX_DONE        0x00C
+#define MAILBOX_SHM_SIZE    0x010
+#define MAILBOX_SIZE        (1024 * 1024)
+#define MAILBOX_TO_HOST     (1u << 0)
+#define MAILBOX_ERROR       (1u << 30)
+#define MAILBOX_DONE_FLAG   (1u << 31)
+
+static void test_timer(void)
+{
+    QTestState *qts = qtest_init("-machine microbit");
+    int n;
+
+    /* 1 MHz */
+    nrf51_timer_init(qts, NRF51_TIMER0_BASE, 4);
+    g_assert_cmpuint(nrf51_timer_capture(qts, NRF51_TIMER0_BASE, 0), ==, 0);
+
+    nrf51_task(qts, NRF51_TIMER0_BASE, NRF51_TASK_START);
+    qtest_clock_step(qts, 1000 * SCALE_US);
+    g_assert_cmpuint(nrf51_timer_capture(qts, NRF51_TIMER0_BASE, 0), ==, 1000);
+
+    /* Stopped timers hold their count */
+    nrf51_task(qts, NRF51_TIMER0_BASE, NRF51_TASK_STOP);
+    qtest_clock_step(qts, 1000 * SCALE_US);
+    g_assert_cmpuint(nrf51_timer_capture(qts, NRF51_TIMER0_BASE, 1), ==, 1000);
+
+    /* Each channel raises COMPARE on the tick its CC matches, not before */
+    nrf51_timer_init(qts, NRF51_TIMER1_BASE, 4);
+    for (n = 0; n < 4; n++) {
+        qtest_writel(qts, NRF51_TIMER1_BASE + NRF51_TIMER_CC(n),
+                     100 * (n + 1));
+        nrf51_event_clear(qts, NRF51_TIMER1_BASE, NRF51_TIMER_COMPARE(n));
+    }
+    qtest_writel(qts, NRF51_TIMER1_BASE + NRF51_INTENSET, 0xf << 16);
+    nrf51_task(qts, NRF51_TIMER1_BASE, NRF51_TASK_START);
+    for (n = 0; n < 4; n++) {
+        qtest_clock_step(qts, 100 * SCALE_US - 1);
+        g_assert(!nrf51_event(qts, NRF51_TIMER1_BASE, NRF51_TIMER_COMPARE(n)));
+        qtest_clock_step(qts, 1);
+        g_assert(nrf51_event(qts, NRF51_TIMER1_BASE, NRF51_TIMER_COMPARE(n)));
+    }
+
+    /* SHORTS: COMPARE0_CLEAR makes the counter periodic */
+    nrf51_timer_init(qts, NRF51_TIMER2_BASE, 4);
+    qtest_writel(qts, NRF51_TIMER2_BASE + NRF51_TIMER_CC(0), 250);
+    qtest_writel(qts, NRF51_TIMER2_BASE + NRF51_SHORTS, 1 << 0);
+    nrf51_task(qts, NRF51_TIMER2_BASE, NRF51_TASK_START);
+    qtest_clock_step(qts, 1100 * SCALE_US);
+    g_assert(nrf51_event(qts, NRF51_TIMER2_BASE, NRF51_TIMER_COMPARE(0)));
+    g_assert_cmpuint(nrf51_timer_capture(qts, NRF51_TIMER2_BASE, 1), ==, 100);
+
+    qtest_quit(qts);
+}
+
+static void test_rtc(void)
+{
+    QTestState *qts = qtest_init("-machine microbit");
+    uint64_t base = NRF51_RTC0_BASE;
+
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_RTC_COUNTER), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_RTC_PRESCALER), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_RTC_CC(0)), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_RTC_EVTEN), ==, 0);
+
+    nrf51_irq_intercept(qts);
+    nrf51_lfclk_start(qts);
+
+    /* COUNTER follows virtual time, at 32768 Hz >> PRESCALER */
+    nrf51_task(qts, base, NRF51_TASK_START);
+    qtest_clock_step(qts, NANOSECONDS_PER_SECOND);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_RTC_COUNTER),
+                    ==, NRF51_RTC_FREQ);
+
+    /* COMPARE0 fires on the tick COUNTER reaches CC0, and raises RTC0 */
+    nrf51_task(qts, base, NRF51_RTC_CLEAR);
+    qtest_writel(qts, base + NRF51_RTC_CC(0), 100);
+    qtest_writel(qts, base + NRF51_INTENSET, NRF51_RTC_EN_COMPARE(0));
+    qtest_clock_step(qts, nrf51_rtc_ticks_ns(0, 100) - 1);
+    g_assert(!nrf51_event(qts, base, NRF51_RTC_COMPARE(0)));
+    g_assert(!qtest_get_irq(qts, NRF51_RTC0_IRQ));
+    qtest_clock_step(qts, 1);
+    g_assert(nrf51_event(qts, base, NRF51_RTC_COMPARE(0)));
+    g_assert(qtest_get_irq(qts, NRF51_RTC0_IRQ));
+
+    nrf51_event_clear(qts, base, NRF51_RTC_COMPARE(0));
+    g_assert(!qtest_get_irq(qts, NRF51_RTC0_IRQ));
+
+    /* TRIGOVRFLW puts COUNTER 16 ticks before the overflow */
+    base = NRF51_RTC1_BASE;
+    qtest_writel(qts, base + NRF51_RTC_PRESCALER, 1);
+    qtest_writel(qts, base + NRF51_INTENSET, NRF51_RTC_EN_OVRFLW);
+    nrf51_task(qts, base, NRF51_RTC_TRIGOVRFLW);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_RTC_COUNTER),
+                    ==, 0x00FFFFF0);
+    nrf51_task(qts, base, NRF51_TASK_START);
+    qtest_clock_step(qts, nrf51_rtc_ticks_ns(1, 16) - 1);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_RTC_COUNTER),
+                    ==, 0x00FFFFFF);
+    g_assert(!nrf51_event(qts, base, NRF51_RTC_OVRFLW));
+    qtest_clock_step(qts, 1);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_RTC_COUNTER), ==, 0);
+    g_assert(nrf51_event(qts, base, NRF51_RTC_OVRFLW));
+    g_assert(qtest_get_irq(qts, NRF51_RTC1_IRQ));
+
+    qtest_quit(qts);
+}
+
+static void test_ppi(void)
+{
+    QTestState *qts = qtest_init("-machine microbit");
+
+    g_assert_cmphex(qtest_readl(qts, NRF51_PPI_BASE + NRF51_PPI_CHEN), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, NRF51_PPI_BASE + NRF51_PPI_EEP(0)),
+                    ==, 0);
+    g_assert_cmphex(qtest_readl(qts, NRF51_PPI_BASE + NRF51_PPI_TEP(0)),
+                    ==, 0);
+    g_assert_cmphex(qtest_readl(qts, NRF51_PPI_BASE + NRF51_PPI_CHG(0)),
+                    ==, 0);
+
+    nrf51_irq_intercept(qts);
+
+    /* TIMER1 counts the COMPARE0 events of a 100 us periodic TIMER0 */
+    nrf51_timer_init(qts, NRF51_TIMER1_BASE, 0);
+    qtest_writel(qts, NRF51_TIMER1_BASE + NRF51_TIMER_MODE,
+                 NRF51_TIMER_MODE_COUNTER);
+    qtest_writel(qts, NRF51_TIMER1_BASE + NRF51_TIMER_CC(0), 3);
+    qtest_writel(qts, NRF51_TIMER1_BASE + NRF51_INTENSET, 1 << 16);
+    nrf51_task(qts, NRF51_TIMER1_BASE, NRF51_TASK_START);
+    nrf51_ppi_connect(qts, 0, NRF51_TIMER0_BASE + NRF51_TIMER_COMPARE(0),
+                      NRF51_TIMER1_BASE + NRF51_TIMER_COUNT);
+
+    nrf51_timer_init(qts, NRF51_TIMER0_BASE, 4);
+    qtest_writel(qts, NRF51_TIMER0_BASE + NRF51_TIMER_CC(0), 100);
+    qtest_writel(qts, NRF51_TIMER0_BASE + NRF51_SHORTS, 1 << 0);
+    nrf51_task(qts, NRF51_TIMER0_BASE, NRF51_TASK_START);
+
+    /* Each event is routed as it happens, though no interrupt is enabled */
+    qtest_clock_step(qts, 300 * SCALE_US - 1);
+    g_assert_cmpuint(nrf51_timer_capture(qts, NRF51_TIMER1_BASE, 1), ==, 2);
+    g_assert(!qtest_get_irq(qts, NRF51_TIMER1_IRQ));
+    qtest_clock_step(qts, 1);
+    g_assert(nrf51_event(qts, NRF51_TIMER1_BASE, NRF51_TIMER_COMPARE(0)));
+    g_assert(qtest_get_irq(qts, NRF51_TIMER1_IRQ));
+
+    /* A group's DIS task disables its channels, EN enables them again */
+    qtest_writel(qts, NRF51_PPI_BASE + NRF51_PPI_CHG(0), 1 << 0);
+    nrf51_task(qts, NRF51_PPI_BASE, NRF51_PPI_CHG_DIS(0));
+    g_assert_cmphex(qtest_readl(qts, NRF51_PPI_BASE + NRF51_PPI_CHEN), ==, 0);
+    qtest_clock_step(qts, 200 * SCALE_US);
+    g_assert_cmpuint(nrf51_timer_capture(qts, NRF51_TIMER1_BASE, 1), ==, 3);
+
+    nrf51_task(qts, NRF51_PPI_BASE, NRF51_PPI_CHG_EN(0));
+    g_assert_cmphex(qtest_readl(qts, NRF51_PPI_BASE + NRF51_PPI_CHEN),
+                    ==, 1 << 0);
+    qtest_clock_step(qts, 100 * SCALE_US);
+    g_assert_cmpuint(nrf51_timer_capture(qts, NRF51_TIMER1_BASE, 1), ==, 4);
+
+    qtest_quit(qts);
+}
+
+/* Let the main loop run until @event is set, or fail */
+static void wait_event(QTestState *qts, uint64_t base, uint32_t event)
+{
+    int i;
+
+    for (i = 0; i < CHARDEV_POLLS && !nrf51_event(qts, base, event); i++) {
+        g_usleep(1000);
+    }
+    g_assert(nrf51_event(qts, base, event));
+}
+
+static void test_lpcomp(void)
+{
+    char *path = g_strdup_printf("%s/microbit-lpcomp-%d.samples",
+                                 g_get_tmp_dir(), getpid());
+    /* AIN1 goes above half the supply for the second 1 ms frame */
+    uint16_t samples[3][8] = {
+        [0][1] = cpu_to_le16(0x100),
+        [1][1] = cpu_to_le16(0x300),
+        [2][1] = cpu_to_le16(0x080),
+    };
+    uint64_t base = NRF51_LPCOMP_BASE;
+    QTestState *qts;
+
+    g_assert(g_file_set_contents(path, (const char *)samples,
+                                 sizeof(samples), NULL));
+    qts = qtest_startf("-machine microbit -global nrf51_adc.samples=%s",
+                       path);
+
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_LPCOMP_ENABLE), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_LPCOMP_PSEL), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_LPCOMP_REFSEL), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_LPCOMP_ANADETECT), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_LPCOMP_RESULT), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_LPCOMP_POWER), ==, 1);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+
+    nrf51_irq_intercept(qts);
+
+    /* START does nothing until the comparator is enabled */
+    nrf51_task(qts, base, NRF51_TASK_START);
+    g_assert(!nrf51_event(qts, base, NRF51_LPCOMP_READY));
+
+    /* AIN1 against 4/8 of the supply, sampled as soon as READY */
+    qtest_writel(qts, base + NRF51_LPCOMP_PSEL, 1);
+    qtest_writel(qts, base + NRF51_LPCOMP_REFSEL, 3);
+    qtest_writel(qts, base + NRF51_LPCOMP_ENABLE, 1);
+    qtest_writel(qts, base + NRF51_SHORTS, NRF51_LPCOMP_SHORTS_READY_SAMPLE);
+    qtest_writel(qts, base + NRF51_INTENSET, NRF51_LPCOMP_INT_UP);
+    nrf51_task(qts, base, NRF51_TASK_START);
+    g_assert(nrf51_event(qts, base, NRF51_LPCOMP_READY));
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_LPCOMP_RESULT), ==, 0);
+
+    /* UP and CROSS on the frame that crosses, and UP raises LPCOMP */
+    qtest_clock_step(qts, SCALE_MS - 1);
+    g_assert(!nrf51_event(qts, base, NRF51_LPCOMP_CROSS));
+    qtest_clock_step(qts, 1);
+    g_assert(nrf51_event(qts, base, NRF51_LPCOMP_UP));
+    g_assert(nrf51_event(qts, base, NRF51_LPCOMP_CROSS));
+    g_assert(!nrf51_event(qts, base, NRF51_LPCOMP_DOWN));
+    g_assert(qtest_get_irq(qts, NRF51_LPCOMP_IRQ));
+    nrf51_task(qts, base, NRF51_LPCOMP_SAMPLE);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_LPCOMP_RESULT), ==, 1);
+    nrf51_event_clear(qts, base, NRF51_LPCOMP_UP);
+    nrf51_event_clear(qts, base, NRF51_LPCOMP_CROSS);
+    g_assert(!qtest_get_irq(qts, NRF51_LPCOMP_IRQ));
+
+    /* DOWN does not interrupt */
+    qtest_clock_step(qts, SCALE_MS);
+    g_assert(nrf51_event(qts, base, NRF51_LPCOMP_DOWN));
+    g_assert(nrf51_event(qts, base, NRF51_LPCOMP_CROSS));
+    g_assert(!qtest_get_irq(qts, NRF51_LPCOMP_IRQ));
+    nrf51_task(qts, base, NRF51_LPCOMP_SAMPLE);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_LPCOMP_RESULT), ==, 0);
+
+    qtest_quit(qts);
+    unlink(path);
+    g_free(path);
+}
+
+static void test_twi(void)
+{
+    QTestState *qts = qtest_init("-machine microbit");
+    uint64_t base = NRF51_TWI0_BASE;
+
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TWI_ENABLE), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TWI_PSELSCL),
+                    ==, 0xFFFFFFFF);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TWI_PSELSDA),
+                    ==, 0xFFFFFFFF);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TWI_FREQUENCY),
+                    ==, 0x04000000);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TWI_ADDRESS), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TWI_POWER), ==, 1);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+
+    nrf51_irq_intercept(qts);
+
+    /* Tasks are ignored until the TWI is enabled */
+    qtest_writel(qts, base + NRF51_TWI_ADDRESS, 0x1D);
+    nrf51_task(qts, base, NRF51_TWI_STARTRX);
+    g_assert(!nrf51_event(qts, base, NRF51_TWI_RXDREADY));
+
+    /* The accelerometer and magnetometer answer WHO_AM_I on TWI0 */
+    qtest_writel(qts, base + NRF51_TWI_ENABLE, NRF51_TWI_ENABLE_ON);
+    qtest_writel(qts, base + NRF51_INTENSET,
+                 NRF51_TWI_INT_RXDREADY | NRF51_TWI_INT_ERROR);
+    g_assert_cmphex(nrf51_twi_read_reg(qts, base, 0x1D, 0x0D), ==, 0x5A);
+    g_assert(qtest_get_irq(qts, NRF51_TWI0_IRQ));
+    nrf51_event_clear(qts, base, NRF51_TWI_RXDREADY);
+    g_assert(!qtest_get_irq(qts, NRF51_TWI0_IRQ));
+    g_assert_cmphex(nrf51_twi_read_reg(qts, base, 0x0E, 0x07), ==, 0xC4);
+    nrf51_event_clear(qts, base, NRF51_TWI_RXDREADY);
+
+    /* Nobody acknowledges address 0x50: ERROR, with ANACK in ERRORSRC */
+    qtest_writel(qts, base + NRF51_TWI_ADDRESS, 0x50);
+    nrf51_task(qts, base, NRF51_TWI_STARTRX);
+    g_assert(nrf51_event(qts, base, NRF51_TWI_ERROR));
+    g_assert(!nrf51_event(qts, base, NRF51_TWI_RXDREADY));
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TWI_ERRORSRC),
+                    ==, NRF51_TWI_ERRORSRC_ANACK);
+    g_assert(qtest_get_irq(qts, NRF51_TWI0_IRQ));
+    qtest_writel(qts, base + NRF51_TWI_ERRORSRC, NRF51_TWI_ERRORSRC_ANACK);
+    nrf51_event_clear(qts, base, NRF51_TWI_ERROR);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TWI_ERRORSRC), ==, 0);
+    g_assert(!qtest_get_irq(qts, NRF51_TWI0_IRQ));
+
+    qtest_quit(qts);
+}
+
+static void test_spi(void)
+{
+    QTestState *qts = qtest_init("-machine microbit");
+    uint64_t base = NRF51_SPI1_BASE;
+    int n;
+
+    /* TWI1 owns the window until ENABLE hands it to SPI1 */
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TWI_ENABLE), ==, 0);
+    qtest_writel(qts, base + NRF51_SPI_ENABLE, NRF51_SPI_ENABLE_ON);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_SPI_ENABLE),
+                    ==, NRF51_SPI_ENABLE_ON);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_SPI_PSELSCK),
+                    ==, 0xFFFFFFFF);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_SPI_PSELMOSI),
+                    ==, 0xFFFFFFFF);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_SPI_PSELMISO),
+                    ==, 0xFFFFFFFF);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_SPI_FREQUENCY),
+                    ==, 0x04000000);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_SPI_CONFIG), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+
+    nrf51_irq_intercept(qts);
+    qtest_writel(qts, base + NRF51_INTENSET, NRF51_SPI_INT_READY);
+
+    /* A chain of TXD writes never stalls, and raises READY once */
+    for (n = 0; n < 3; n++) {
+        qtest_writel(qts, base + NRF51_SPI_TXD, 0xA0 + n);
+    }
+    g_assert(nrf51_event(qts, base, NRF51_SPI_READY));
+    g_assert(qtest_get_irq(qts, NRF51_SPI1_IRQ));
+    nrf51_event_clear(qts, base, NRF51_SPI_READY);
+    g_assert(!qtest_get_irq(qts, NRF51_SPI1_IRQ));
+
+    /* Each RXD read moves the next queued byte in, with READY again */
+    for (n = 0; n < 3; n++) {
+        /* Nothing is on the bus to drive MISO */
+        g_assert_cmphex(qtest_readl(qts, base + NRF51_SPI_RXD), ==, 0);
+        g_assert(nrf51_event(qts, base, NRF51_SPI_READY) == (n < 2));
+        g_assert(qtest_get_irq(qts, NRF51_SPI1_IRQ) == (n < 2));
+        nrf51_event_clear(qts, base, NRF51_SPI_READY);
+    }
+
+    /* Disabled, TXD writes are not exchanged */
+    qtest_writel(qts, base + NRF51_SPI_ENABLE, 0);
+    qtest_writel(qts, base + NRF51_SPI_TXD, 0x55);
+    g_assert(!nrf51_event(qts, base, NRF51_SPI_READY));
+
+    /* ENABLE hands the window back to TWI1 */
+    qtest_writel(qts, base + NRF51_SPI_ENABLE, NRF51_TWI_ENABLE_ON);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TWI_ENABLE),
+                    ==, NRF51_TWI_ENABLE_ON);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TWI_ADDRESS), ==, 0);
+
+    qtest_quit(qts);
+}
+
+static void test_gpiote(void)
+{
+    char *path = g_strdup_printf("%s/microbit-gpiote-%d.script",
+                                 g_get_tmp_dir(), getpid());
+    uint64_t base = NRF51_GPIOTE_BASE;
+    QTestState *qts;
+    int n;
+
+    /* P0.3 pulses high from 100 us to 200 us */
+    g_assert(g_file_set_contents(path, "100000 0x8 1\n200000 0x8 0\n", -1,
+                                 NULL));
+    qts = qtest_startf("-machine microbit -global nrf51_gpio.script=%s",
+                       path);
+
+    for (n = 0; n < 4; n++) {
+        g_assert_cmphex(qtest_readl(qts, base + NRF51_GPIOTE_CONFIG(n)),
+                        ==, 0);
+    }
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+
+    nrf51_irq_intercept(qts);
+
+    /* IN0 fires on the rising edge only, PORT when P0.3 senses high */
+    qtest_writel(qts, base + NRF51_GPIOTE_CONFIG(0),
+                 NRF51_GPIOTE_CFG(NRF51_GPIOTE_MODE_EVENT, 3,
+                                  NRF51_GPIOTE_LOTOHI, 0));
+    qtest_writel(qts, NRF51_GPIO_BASE + NRF51_GPIO_PIN_CNF(3),
+                 NRF51_GPIO_SENSE_HIGH);
+    qtest_writel(qts, base + NRF51_INTENSET, 1 << 0);
+    qtest_clock_step(qts, 100 * SCALE_US - 1);
+    g_assert(!nrf51_event(qts, base, NRF51_GPIOTE_IN(0)));
+    g_assert(!qtest_get_irq(qts, NRF51_GPIOTE_IRQ));
+    qtest_clock_step(qts, 1);
+    g_assert(nrf51_event(qts, base, NRF51_GPIOTE_IN(0)));
+    g_assert(nrf51_event(qts, base, NRF51_GPIOTE_PORT));
+    g_assert(qtest_get_irq(qts, NRF51_GPIOTE_IRQ));
+
+    nrf51_event_clear(qts, base, NRF51_GPIOTE_IN(0));
+    g_assert(!qtest_get_irq(qts, NRF51_GPIOTE_IRQ));
+    qtest_clock_step(qts, 100 * SCALE_US);
+    g_assert(!nrf51_event(qts, base, NRF51_GPIOTE_IN(0)));
+
+    /* Task channels take their pin over at OUTINIT, OUT drives it */
+    qtest_writel(qts, base + NRF51_GPIOTE_CONFIG(1),
+                 NRF51_GPIOTE_CFG(NRF51_GPIOTE_MODE_TASK, 4,
+                                  NRF51_GPIOTE_TOGGLE, 0));
+    qtest_writel(qts, base + NRF51_GPIOTE_CONFIG(2),
+                 NRF51_GPIOTE_CFG(NRF51_GPIOTE_MODE_TASK, 5,
+                                  NRF51_GPIOTE_HITOLO, 1));
+    g_assert_cmphex(qtest_readl(qts, NRF51_GPIO_BASE + NRF51_GPIO_OUT) & 0x30,
+                    ==, 0x20);
+    nrf51_task(qts, base, NRF51_GPIOTE_OUT(1));
+    nrf51_task(qts, base, NRF51_GPIOTE_OUT(2));
+    g_assert_cmphex(qtest_readl(qts, NRF51_GPIO_BASE + NRF51_GPIO_OUT) & 0x30,
+                    ==, 0x10);
+    nrf51_task(qts, base, NRF51_GPIOTE_OUT(1));
+    g_assert_cmphex(qtest_readl(qts, NRF51_GPIO_BASE + NRF51_GPIO_OUT) & 0x30,
+                    ==, 0);
+
+    qtest_quit(qts);
+    unlink(path);
+    g_free(path);
+}
+
+static void test_adc(void)
+{
+    char *path = g_strdup_printf("%s/microbit-adc-%d.samples",
+                                 g_get_tmp_dir(), getpid());
+    /* Two frames of 1 ms, AIN2 only */
+    uint16_t samples[2][8] = {
+        [0][2] = cpu_to_le16(0x200),
+        [1][2] = cpu_to_le16(0x155),
+    };
+    uint64_t base = NRF51_ADC_BASE;
+    QTestState *qts;
+
+    g_assert(g_file_set_contents(path, (const char *)samples,
+                                 sizeof(samples), NULL));
+    qts = qtest_startf("-machine microbit -global nrf51_adc.samples=%s",
+                       path);
+
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_ADC_ENABLE), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_ADC_CONFIG), ==, 0x18);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_ADC_BUSY), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_ADC_RESULT), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_ADC_POWER), ==, 1);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+
+    nrf51_irq_intercept(qts);
+
+    /* START does nothing until the ADC is enabled */
+    nrf51_task(qts, base, NRF51_TASK_START);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_ADC_BUSY), ==, 0);
+
+    /* A 10-bit conversion takes 68 us, then END raises ADC */
+    qtest_writel(qts, base + NRF51_ADC_ENABLE, 1);
+    qtest_writel(qts, base + NRF51_ADC_CONFIG, NRF51_ADC_CFG(2, 2));
+    qtest_writel(qts, base + NRF51_INTENSET, 1);
+    nrf51_task(qts, base, NRF51_TASK_START);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_ADC_BUSY), ==, 1);
+    qtest_clock_step(qts, 68 * SCALE_US - 1);
+    g_assert(!nrf51_event(qts, base, NRF51_ADC_END));
+    g_assert(!qtest_get_irq(qts, NRF51_ADC_IRQ));
+    qtest_clock_step(qts, 1);
+    g_assert(nrf51_event(qts, base, NRF51_ADC_END));
+    g_assert(qtest_get_irq(qts, NRF51_ADC_IRQ));
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_ADC_BUSY), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_ADC_RESULT), ==, 0x200);
+    nrf51_event_clear(qts, base, NRF51_ADC_END);
+    g_assert(!qtest_get_irq(qts, NRF51_ADC_IRQ));
+
+    /* The next frame, truncated to 8 bits in 20 us */
+    qtest_clock_step(qts, SCALE_MS);
+    qtest_writel(qts, base + NRF51_ADC_CONFIG, NRF51_ADC_CFG(0, 2));
+    nrf51_task(qts, base, NRF51_TASK_START);
+    qtest_clock_step(qts, 20 * SCALE_US);
+    g_assert(nrf51_event(qts, base, NRF51_ADC_END));
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_ADC_RESULT), ==, 0x55);
+
+    qtest_quit(qts);
+    unlink(path);
+    g_free(path);
+}
+
+static void test_uart(void)
+{
+    char *path = g_strdup_printf("%s/microbit-uart-%d.sock",
+                                 g_get_tmp_dir(), getpid());
+    QTestState *qts = qtest_startf("-machine microbit "
+                                   "-chardev socket,id=uart,path=%s,"
+                                   "server,nowait -serial chardev:uart",
+                                   path);
+    uint64_t base = NRF51_UART0_BASE;
+    char buf[2];
+    int fd, i, polls;
+    QDict *resp;
+
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_UART_ENABLE), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_UART_PSELTXD),
+                    ==, 0xFFFFFFFF);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_UART_BAUDRATE),
+                    ==, 0x04000000);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+
+    fd = unix_connect(path, &error_abort);
+    /* A QMP round trip lets the chardev accept the connection */
+    resp = qtest_qmp(qts, "{ 'execute': 'query-status' }");
+    QDECREF(resp);
+
+    nrf51_irq_intercept(qts);
+    qtest_writel(qts, base + NRF51_UART_ENABLE, NRF51_UART_ENABLE_ON);
+    qtest_writel(qts, base + NRF51_INTENSET, NRF51_UART_INT_RXDRDY);
+    nrf51_task(qts, base, NRF51_UART_STARTRX);
+
+    /* Bytes come in one at a time, each read of RXD loads the next */
+    g_assert_cmpint(send(fd, "hi", 2, 0), ==, 2);
+    wait_event(qts, base, NRF51_UART_RXDRDY);
+    g_assert(qtest_get_irq(qts, NRF51_UART0_IRQ));
+    nrf51_event_clear(qts, base, NRF51_UART_RXDRDY);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_UART_RXD), ==, 'h');
+    g_assert(nrf51_event(qts, base, NRF51_UART_RXDRDY));
+    nrf51_event_clear(qts, base, NRF51_UART_RXDRDY);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_UART_RXD), ==, 'i');
+    g_assert(!nrf51_event(qts, base, NRF51_UART_RXDRDY));
+    g_assert(!qtest_get_irq(qts, NRF51_UART0_IRQ));
+
+    /* TXD is ready again at once, the bytes reach the chardev in a batch */
+    nrf51_task(qts, base, NRF51_UART_STARTTX);
+    qtest_writel(qts, base + NRF51_UART_TXD, 'o');
+    g_assert(nrf51_event(qts, base, NRF51_UART_TXDRDY));
+    qtest_writel(qts, base + NRF51_UART_TXD, 'k');
+    for (i = 0, polls = 0; i < sizeof(buf) && polls < CHARDEV_POLLS;
+         polls++) {
+        ssize_t len = recv(fd, buf + i, sizeof(buf) - i, MSG_DONTWAIT);
+
+        if (len > 0) {
+            i += len;
+            continue;
+        }
+        g_assert(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+        /* Give the flushing bottom half a turn */
+        qtest_readl(qts, base + NRF51_UART_ENABLE);
+        g_usleep(1000);
+    }
+    g_assert_cmpint(i, ==, sizeof(buf));
+    g_assert(memcmp(buf, "ok", 2) == 0);
+
+    close(fd);
+    qtest_quit(qts);
+    unlink(path);
+    g_free(path);
+}
+
+/*
+ * 1 Mbit/s, an 8-bit LENGTH field, 3 base address bytes and a 2-byte
+ * CRC: a packet with @len bytes of payload is 8 * (len + 8) us on air.
+ */
+static void radio_config(QTestState *qts, uint32_t packetptr)
+{
+    uint64_t base = NRF51_RADIO_BASE;
+
+    qtest_writel(qts, base + NRF51_RADIO_FREQUENCY, 7);
+    qtest_writel(qts, base + NRF51_RADIO_PCNF0, 8);
+    qtest_writel(qts, base + NRF51_RADIO_PCNF1, (3 << 16) | 32);
+    qtest_writel(qts, base + NRF51_RADIO_BASE0, 0x89ABCDEF);
+    qtest_writel(qts, base + NRF51_RADIO_PREFIX0, 0xE7);
+    qtest_writel(qts, base + NRF51_RADIO_TXADDRESS, 0);
+    qtest_writel(qts, base + NRF51_RADIO_RXADDRESSES, 1 << 0);
+    qtest_writel(qts, base + NRF51_RADIO_CRCCNF, 2);
+    qtest_writel(qts, base + NRF51_RADIO_PACKETPTR, packetptr);
+}
+
+static void test_radio(void)
+{
+    char *path = g_strdup_printf("%s/microbit-radio-%d.medium",
+                                 g_get_tmp_dir(), getpid());
+    static const uint8_t packet[] = { 4, 'p', 'i', 'n', 'g' };
+    uint64_t base = NRF51_RADIO_BASE;
+    uint32_t rx_ptr = NRF51_RAM_BASE + 0x100;
+    QTestState *tx, *rx;
+    uint8_t buf[sizeof(packet)];
+
+    /* Both boards share a fresh medium */
+    unlink(path);
+    tx = qtest_startf("-machine microbit -global nrf51_radio.medium=%s",
+                      path);
+    rx = qtest_startf("-machine microbit -global nrf51_radio.medium=%s",
+                      path);
+
+    g_assert_cmphex(qtest_readl(tx, base + NRF51_RADIO_STATE),
+                    ==, NRF51_RADIO_STATE_DISABLED);
+    g_assert_cmphex(qtest_readl(tx, base + NRF51_RADIO_FREQUENCY), ==, 2);
+    g_assert_cmphex(qtest_readl(tx, base + NRF51_RADIO_DATAWHITEIV),
+                    ==, 0x40);
+    g_assert_cmphex(qtest_readl(tx, base + NRF51_RADIO_POWER), ==, 1);
+    g_assert_cmphex(qtest_readl(tx, base + NRF51_RADIO_PACKETPTR), ==, 0);
+    g_assert_cmphex(qtest_readl(tx, base + NRF51_INTENSET), ==, 0);
+
+    nrf51_irq_intercept(tx);
+    nrf51_irq_intercept(rx);
+
+    /* Only what is sent once the receiver has ramped up is heard */
+    radio_config(rx, rx_ptr);
+    qtest_writel(rx, base + NRF51_INTENSET, NRF51_RADIO_INT_END);
+    nrf51_task(rx, base, NRF51_RADIO_RXEN);
+    g_assert(nrf51_event(rx, base, NRF51_RADIO_READY));
+    g_assert_cmphex(qtest_readl(rx, base + NRF51_RADIO_STATE),
+                    ==, NRF51_RADIO_STATE_RXIDLE);
+    nrf51_task(rx, base, NRF51_RADIO_START);
+    g_assert_cmphex(qtest_readl(rx, base + NRF51_RADIO_STATE),
+                    ==, NRF51_RADIO_STATE_RX);
+
+    /* Ramp-up is instantaneous, READY raises RADIO */
+    radio_config(tx, NRF51_RAM_BASE);
+    qtest_memwrite(tx, NRF51_RAM_BASE, packet, sizeof(packet));
+    qtest_writel(tx, base + NRF51_INTENSET, NRF51_RADIO_INT_READY);
+    nrf51_task(tx, base, NRF51_RADIO_TXEN);
+    g_assert(nrf51_event(tx, base, NRF51_RADIO_READY));
+    g_assert(qtest_get_irq(tx, NRF51_RADIO_IRQ));
+    nrf51_event_clear(tx, base, NRF51_RADIO_READY);
+    g_assert(!qtest_get_irq(tx, NRF51_RADIO_IRQ));
+
+    /* END comes after the air time of the packet */
+    nrf51_task(tx, base, NRF51_RADIO_START);
+    g_assert_cmphex(qtest_readl(tx, base + NRF51_RADIO_STATE),
+                    ==, NRF51_RADIO_STATE_TX);
+    qtest_clock_step(tx, 8 * (4 + 8) * SCALE_US - 1);
+    g_assert(!nrf51_event(tx, base, NRF51_RADIO_END));
+    qtest_clock_step(tx, 1);
+    g_assert(nrf51_event(tx, base, NRF51_RADIO_END));
+    g_assert_cmphex(qtest_readl(tx, base + NRF51_RADIO_STATE),
+                    ==, NRF51_RADIO_STATE_TXIDLE);
+
+    /* The other board receives it once its own clock has caught up */
+    g_assert(!nrf51_event(rx, base, NRF51_RADIO_END));
+    qtest_clock_step(rx, 200 * SCALE_US);
+    g_assert(nrf51_event(rx, base, NRF51_RADIO_END));
+    g_assert(qtest_get_irq(rx, NRF51_RADIO_IRQ));
+    g_assert_cmphex(qtest_readl(rx, base + NRF51_RADIO_CRCSTATUS), ==, 1);
+    g_assert_cmphex(qtest_readl(rx, base + NRF51_RADIO_RXMATCH), ==, 0);
+    qtest_memread(rx, rx_ptr, buf, sizeof(buf));
+    g_assert(memcmp(buf, packet, sizeof(packet)) == 0);
+
+    nrf51_task(rx, base, NRF51_RADIO_DISABLE);
+    g_assert(nrf51_event(rx, base, NRF51_RADIO_DISABLED));
+    g_assert_cmphex(qtest_readl(rx, base + NRF51_RADIO_STATE),
+                    ==, NRF51_RADIO_STATE_DISABLED);
+
+    qtest_quit(tx);
+    qtest_quit(rx);
+    unlink(path);
+    g_free(path);
+}
+
+static void test_temp(void)
+{
+    QTestState *qts = qtest_init("-machine microbit "
+                                 "-global nrf51_temp.temperature=-12345");
+    uint64_t base = NRF51_TEMP_BASE;
+
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_TEMP_TEMP), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+
+    nrf51_irq_intercept(qts);
+    qtest_writel(qts, base + NRF51_INTENSET, 1 << 0);
+
+    /* STOP cancels the conversion in progress */
+    nrf51_task(qts, base, NRF51_TASK_START);
+    qtest_clock_step(qts, NRF51_TEMP_NS / 2);
+    nrf51_task(qts, base, NRF51_TASK_STOP);
+    qtest_clock_step(qts, NRF51_TEMP_NS);
+    g_assert(!nrf51_event(qts, base, NRF51_TEMP_DATARDY));
+
+    /* DATARDY after the conversion time, TEMP in 0.25 C steps rounded */
+    nrf51_task(qts, base, NRF51_TASK_START);
+    qtest_clock_step(qts, NRF51_TEMP_NS - 1);
+    g_assert(!nrf51_event(qts, base, NRF51_TEMP_DATARDY));
+    g_assert(!qtest_get_irq(qts, NRF51_TEMP_IRQ));
+    qtest_clock_step(qts, 1);
+    g_assert(nrf51_event(qts, base, NRF51_TEMP_DATARDY));
+    g_assert(qtest_get_irq(qts, NRF51_TEMP_IRQ));
+    g_assert_cmpint((int32_t)qtest_readl(qts, base + NRF51_TEMP_TEMP),
+                    ==, -49);
+
+    nrf51_event_clear(qts, base, NRF51_TEMP_DATARDY);
+    g_assert(!qtest_get_irq(qts, NRF51_TEMP_IRQ));
+
+    qtest_quit(qts);
+}
+
+static void test_ecb(void)
+{
+    /* Key, cleartext and ciphertext of the FIPS-197 AES-128 example */
+    static const uint8_t data[32] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+        0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+        0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+    };
+    static const uint8_t expected[16] = {
+        0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+        0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a,
+    };
+    static const uint8_t zero[16];
+    QTestState *qts = qtest_init("-machine microbit");
+    uint64_t base = NRF51_ECB_BASE;
+    uint32_t ptr = NRF51_RAM_BASE;
+    uint8_t out[16];
+
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_ECB_ECBDATAPTR), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+
+    nrf51_irq_intercept(qts);
+    qtest_memwrite(qts, ptr, data, sizeof(data));
+    qtest_memwrite(qts, ptr + sizeof(data), zero, sizeof(zero));
+    qtest_writel(qts, base + NRF51_ECB_ECBDATAPTR, ptr);
+    qtest_writel(qts, base + NRF51_INTENSET, 0x3);
+
+    /* Aborting a run is an error and leaves the ciphertext alone */
+    nrf51_task(qts, base, NRF51_ECB_STARTECB);
+    nrf51_task(qts, base, NRF51_ECB_STOPECB);
+    g_assert(nrf51_event(qts, base, NRF51_ECB_ERRORECB));
+    g_assert(qtest_get_irq(qts, NRF51_ECB_IRQ));
+    nrf51_event_clear(qts, base, NRF51_ECB_ERRORECB);
+    g_assert(!qtest_get_irq(qts, NRF51_ECB_IRQ));
+    qtest_clock_step(qts, NRF51_ECB_NS);
+    g_assert(!nrf51_event(qts, base, NRF51_ECB_ENDECB));
+
+    /* The ciphertext lands with ENDECB, after the run time */
+    nrf51_task(qts, base, NRF51_ECB_STARTECB);
+    qtest_clock_step(qts, NRF51_ECB_NS - 1);
+    g_assert(!nrf51_event(qts, base, NRF51_ECB_ENDECB));
+    qtest_memread(qts, ptr + sizeof(data), out, sizeof(out));
+    g_assert(memcmp(out, zero, sizeof(out)) == 0);
+    qtest_clock_step(qts, 1);
+    g_assert(nrf51_event(qts, base, NRF51_ECB_ENDECB));
+    g_assert(!nrf51_event(qts, base, NRF51_ECB_ERRORECB));
+    g_assert(qtest_get_irq(qts, NRF51_ECB_IRQ));
+    qtest_memread(qts, ptr + sizeof(data), out, sizeof(out));
+    g_assert(memcmp(out, expected, sizeof(out)) == 0);
+
+    qtest_quit(qts);
+}
+
+static void test_ccm_aar(void)
+{
+    /*
+     * The LE encryption sample data of the Bluetooth Core Specification:
+     * key, packet counter 0, master to slave and IV, as CNFPTR holds them
+     */
+    static const uint8_t cnf[33] = {
+        0x99, 0xad, 0x1b, 0x52, 0x26, 0xa3, 0x7e, 0x3e,
+        0x05, 0x8e, 0x3b, 0x8e, 0x27, 0xc2, 0xc6, 0x66,
+        [24] = 0x01,
+        0x24, 0xab, 0xdc, 0xba, 0xbe, 0xba, 0xaf, 0xde,
+    };
+    /* LL_START_ENC_RSP, and the same packet encrypted */
+    static const uint8_t clear[] = { 0x0f, 0x01, 0x00, 0x06 };
+    static const uint8_t crypt[] = {
+        0x0f, 0x05, 0x00, 0x9f, 0xcd, 0xa7, 0xf4, 0x48,
+    };
+    /*
+     * An IRK that does not match, then the IRK of the specification's
+     * ah() example; the address is its resolvable private address
+     */
+    static const uint8_t irk[32] = {
+        [16] = 0xec, 0x02, 0x34, 0xa3, 0x57, 0xc8, 0xad, 0x05,
+        0x34, 0x10, 0x10, 0xa6, 0x0a, 0x39, 0x7d, 0x9b,
+    };
+    static const uint8_t adv[9] = {
+        [3] = 0xaa, 0xfb, 0x0d, 0x94, 0x81, 0x70,
+    };
+    QTestState *qts = qtest_init("-machine microbit");
+    uint64_t base = NRF51_CCM_BASE;
+    uint32_t cnfptr = NRF51_RAM_BASE;
+    uint32_t inptr = NRF51_RAM_BASE + 0x40;
+    uint32_t outptr = NRF51_RAM_BASE + 0x80;
+    uint8_t out[sizeof(crypt)];
+
+    /* CCM owns the window first */
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_CCM_ENABLE), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_CCM_MODE), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_CCM_MICSTATUS), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_CCM_CNFPTR), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+
+    nrf51_irq_intercept(qts);
+    qtest_memwrite(qts, cnfptr, cnf, sizeof(cnf));
+    qtest_memwrite(qts, inptr, clear, sizeof(clear));
+    qtest_writel(qts, base + NRF51_CCM_ENABLE, NRF51_CCM_ENABLE_ON);
+    qtest_writel(qts, base + NRF51_CCM_CNFPTR, cnfptr);
+    qtest_writel(qts, base + NRF51_CCM_INPTR, inptr);
+    qtest_writel(qts, base + NRF51_CCM_OUTPTR, outptr);
+    qtest_writel(qts, base + NRF51_INTENSET, NRF51_CCM_INT_ENDCRYPT);
+
+    /* CRYPT needs a KSGEN since the last STOP */
+    nrf51_task(qts, base, NRF51_CCM_CRYPT);
+    g_assert(nrf51_event(qts, base, NRF51_CCM_ERROR));
+    g_assert(!qtest_get_irq(qts, NRF51_CCM_AAR_IRQ));
+    nrf51_event_clear(qts, base, NRF51_CCM_ERROR);
+
+    /* KSGEN runs CRYPT through the short, which appends the MIC */
+    qtest_writel(qts, base + NRF51_SHORTS, NRF51_CCM_SHORTS_ENDKSGEN_CRYPT);
+    nrf51_task(qts, base, NRF51_CCM_KSGEN);
+    g_assert(nrf51_event(qts, base, NRF51_CCM_ENDKSGEN));
+    g_assert(nrf51_event(qts, base, NRF51_CCM_ENDCRYPT));
+    g_assert(qtest_get_irq(qts, NRF51_CCM_AAR_IRQ));
+    qtest_memread(qts, outptr, out, sizeof(crypt));
+    g_assert(memcmp(out, crypt, sizeof(crypt)) == 0);
+    nrf51_event_clear(qts, base, NRF51_CCM_ENDCRYPT);
+    g_assert(!qtest_get_irq(qts, NRF51_CCM_AAR_IRQ));
+
+    /* Decryption gets the cleartext back and checks the MIC */
+    qtest_writel(qts, base + NRF51_CCM_MODE, NRF51_CCM_MODE_DECRYPT);
+    qtest_writel(qts, base + NRF51_CCM_INPTR, outptr);
+    qtest_writel(qts, base + NRF51_CCM_OUTPTR, inptr);
+    nrf51_task(qts, base, NRF51_CCM_KSGEN);
+    g_assert(nrf51_event(qts, base, NRF51_CCM_ENDCRYPT));
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_CCM_MICSTATUS), ==, 1);
+    qtest_memread(qts, inptr, out, sizeof(clear));
+    g_assert(memcmp(out, clear, sizeof(clear)) == 0);
+
+    qtest_writeb(qts, outptr + 7, crypt[7] ^ 1);
+    nrf51_task(qts, base, NRF51_CCM_KSGEN);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_CCM_MICSTATUS), ==, 0);
+    nrf51_event_clear(qts, base, NRF51_CCM_ENDCRYPT);
+    g_assert(!qtest_get_irq(qts, NRF51_CCM_AAR_IRQ));
+
+    /* ENABLE hands the window to AAR, which finds the second IRK */
+    base = NRF51_AAR_BASE;
+    qtest_memwrite(qts, cnfptr, irk, sizeof(irk));
+    qtest_memwrite(qts, inptr, adv, sizeof(adv));
+    qtest_writel(qts, base + NRF51_AAR_ENABLE, NRF51_AAR_ENABLE_ON);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_AAR_ENABLE),
+                    ==, NRF51_AAR_ENABLE_ON);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_AAR_NIRK), ==, 1);
+    qtest_writel(qts, base + NRF51_AAR_IRKPTR, cnfptr);
+    qtest_writel(qts, base + NRF51_AAR_ADDRPTR, inptr);
+
+    nrf51_task(qts, base, NRF51_AAR_START);
+    g_assert(nrf51_event(qts, base, NRF51_AAR_END));
+    g_assert(nrf51_event(qts, base, NRF51_AAR_NOTRESOLVED));
+    g_assert(!nrf51_event(qts, base, NRF51_AAR_RESOLVED));
+    nrf51_event_clear(qts, base, NRF51_AAR_END);
+    nrf51_event_clear(qts, base, NRF51_AAR_NOTRESOLVED);
+
+    qtest_writel(qts, base + NRF51_AAR_NIRK, 2);
+    qtest_writel(qts, base + NRF51_INTENSET, 1 << 1);
+    nrf51_task(qts, base, NRF51_AAR_START);
+    g_assert(nrf51_event(qts, base, NRF51_AAR_END));
+    g_assert(nrf51_event(qts, base, NRF51_AAR_RESOLVED));
+    g_assert(!nrf51_event(qts, base, NRF51_AAR_NOTRESOLVED));
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_AAR_STATUS), ==, 1);
+    g_assert(qtest_get_irq(qts, NRF51_CCM_AAR_IRQ));
+
+    qtest_quit(qts);
+}
+
+static void test_wdt(void)
+{
+    QTestState *qts = qtest_init("-machine microbit");
+    uint64_t base = NRF51_WDT_BASE;
+
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_RUNSTATUS), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_REQSTATUS), ==, 1);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_CRV), ==, 0xFFFFFFFF);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_RREN), ==, 1);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_CONFIG), ==, 1);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+
+    nrf51_irq_intercept(qts);
+
+    /* A 1 s timeout, reloaded by RR0 and RR1; CRV is locked once started */
+    qtest_writel(qts, base + NRF51_WDT_CRV, NRF51_RTC_FREQ - 1);
+    qtest_writel(qts, base + NRF51_WDT_RREN, 0x3);
+    qtest_writel(qts, base + NRF51_INTENSET, 1 << 0);
+    nrf51_task(qts, base, NRF51_TASK_START);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_RUNSTATUS), ==, 1);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_REQSTATUS), ==, 0x3);
+    qtest_writel(qts, base + NRF51_WDT_CRV, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_CRV),
+                    ==, NRF51_RTC_FREQ - 1);
+
+    /* Only the right value counts, and every enabled RR must be written */
+    qtest_clock_step(qts, NANOSECONDS_PER_SECOND / 2);
+    qtest_writel(qts, base + NRF51_WDT_RR(0), NRF51_WDT_RELOAD);
+    qtest_writel(qts, base + NRF51_WDT_RR(1), 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_REQSTATUS), ==, 0x2);
+    qtest_clock_step(qts, NANOSECONDS_PER_SECOND / 4);
+    qtest_writel(qts, base + NRF51_WDT_RR(1), NRF51_WDT_RELOAD);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_REQSTATUS), ==, 0x3);
+
+    /* TIMEOUT a full period after the reload, not after START */
+    qtest_clock_step(qts, NANOSECONDS_PER_SECOND - 1);
+    g_assert(!nrf51_event(qts, base, NRF51_WDT_TIMEOUT));
+    g_assert(!qtest_get_irq(qts, NRF51_WDT_IRQ));
+    qtest_clock_step(qts, 1);
+    g_assert(nrf51_event(qts, base, NRF51_WDT_TIMEOUT));
+    g_assert(qtest_get_irq(qts, NRF51_WDT_IRQ));
+
+    /* Too late to reload: the board resets two LFCLK cycles later */
+    qtest_writel(qts, base + NRF51_WDT_RR(0), NRF51_WDT_RELOAD);
+    qtest_writel(qts, base + NRF51_WDT_RR(1), NRF51_WDT_RELOAD);
+    qtest_clock_step(qts, nrf51_rtc_ticks_ns(0, 2));
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_RUNSTATUS), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_WDT_CRV), ==, 0xFFFFFFFF);
+    g_assert(!nrf51_event(qts, base, NRF51_WDT_TIMEOUT));
+
+    qtest_quit(qts);
+}
+
+static void test_qdec(void)
+{
+    char *path = g_strdup_printf("%s/microbit-qdec-%d.trace",
+                                 g_get_tmp_dir(), getpid());
+    uint64_t base = NRF51_QDEC_BASE;
+    /* SAMPLEPER 3 */
+    int64_t sample_ns = 1024 * SCALE_US;
+    QTestState *qts;
+
+    /* The encoder turns at 1000 counts per second from the start */
+    g_assert(g_file_set_contents(path, "0 1000\n", -1, NULL));
+    qts = qtest_startf("-machine microbit -global nrf51_qdec.trace=%s",
+                       path);
+
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_QDEC_ENABLE), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_QDEC_LEDPOL), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_QDEC_SAMPLEPER), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_QDEC_REPORTPER), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_QDEC_ACC), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_QDEC_PSELA),
+                    ==, 0xFFFFFFFF);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_QDEC_PSELB),
+                    ==, 0xFFFFFFFF);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_QDEC_LEDPRE), ==, 0x10);
+    g_assert_cmphex(qtest_readl(qts, base + NRF51_INTENSET), ==, 0);
+
+    nrf51_irq_intercept(qts);
+
+    /* 1.024 counts per sample, so one move each, reported every 10 */
+    qtest_writel(qts, base + NRF51_QDEC_ENABLE, 1);
+    qtest_writel(qts, base + NRF51_QDEC_SAMPLEPER, 3);
+    qtest_writel(qts, base + NRF51_INTENSET, NRF51_QDEC_INT_REPORTRDY);
+    nrf51_task(qts, base, NRF51_TASK_START);
+    qtest_clock_step(qts, 10 * sample_ns - 1);
+    g_assert(nrf51_event(qts, base, NRF51_QDEC_SAMPLERDY));
+    g_assert(!nrf51_event(qts, base, NRF51_QDEC_REPORTRDY));
+    g_assert_cmpint(qtest_readl(qts, base + NRF51_QDEC_ACC), ==, 9);
+    g_assert(!qtest_get_irq(qts, NRF51_QDEC_IRQ));
+    qtest_clock_step(qts, 1);
+    g_assert(nrf51_event(qts, base, NRF51_QDEC_REPORTRDY));
+    g_assert(qtest_get_irq(qts, NRF51_QDEC_IRQ));
+    g_assert_cmpint(qtest_readl(qts, base + NRF51_QDEC_ACC), ==, 10);
+    g_assert_cmpint(qtest_readl(qts, base + NRF51_QDEC_SAMPLE), ==, 1);
+    g_assert_cmpint(qtest_readl(qts, base + NRF51_QDEC_ACCDBL), ==, 0);
+
+    nrf51_task(qts, base, NRF51_QDEC_READCLRACC);
+    g_assert_cmpint(qtest_readl(qts, base + NRF51_QDEC_ACCREAD), ==, 10);
+    g_assert_cmpint(qtest_readl(qts, base + NRF51_QDEC_ACC), ==, 0);
+    nrf51_event_clear(qts, base, NRF51_QDEC_REPORTRDY);
+    g_assert(!qtest_get_irq(qts, NRF51_QDEC_IRQ));
+
+    /* REPORTRDY_READCLRACC latches the next report by itself */
+    qtest_writel(qts, base + NRF51_SHORTS,
+                 NRF51_QDEC_SHORTS_REPORTRDY_READCLRACC);
+    qtest_clock_step(qts, 10 * sample_ns);
+    g_assert(nrf51_event(qts, base, NRF51_QDEC_REPORTRDY));
+    g_assert_cmpint(qtest_readl(qts, base + NRF51_QDEC_ACCREAD), ==, 10);
+    g_assert_cmpint(qtest_readl(qts, base + NRF51_QDEC_ACC), ==, 0);
+
+    /* Stopped, the decoder no longer counts */
+    nrf51_task(qts, base, NRF51_TASK_STOP);
+    qtest_clock_step(qts, 10 * sample_ns);
+    g_assert_cmpint(qtest_readl(qts, base + NRF51_QDEC_ACC), ==, 0);
+
+    qtest_quit(qts);
+    unlink(path);
+    g_free(path);
+}
+
+static void test_rng(void)
+{
+    QTestState *a = qtest_init("-machine microbit "
+                               "-global nrf51_rng.seed=0x1234");
+    QTestState *b = qtest_init("-machine microbit "
+                               "-global nrf51_rng.seed=0x1234");
+    uint8_t va[16], vb[16];
+    int i;
+
+    /* No value before the conversion time has elapsed */
+    nrf51_task(a, NRF51_RNG_BASE, NRF51_TASK_START);
+    qtest_clock_step(a, NRF51_RNG_RAW_NS - 1);
+    g_assert(!nrf51_event(a, NRF51_RNG_BASE, NRF51_RNG_VALRDY));
+    nrf51_task(a, NRF51_RNG_BASE, NRF51_TASK_STOP);
+
+    /* A seeded generator is reproducible */
+    for (i = 0; i < ARRAY_SIZE(va); i++) {
+        va[i] = nrf51_rng_read(a);
+        vb[i] = nrf51_rng_read(b);
+    }
+    g_assert(memcmp(va, vb, sizeof(va)) == 0);
+
+    qtest_quit(a);
+    qtest_quit(b);
+}
+
+static void test_gpio(void)
+{
+    QTestState *qts = qtest_init("-machine microbit");
+
+    qtest_writel(qts, NRF51_GPIO_BASE + NRF51_GPIO_DIR, 0);
+    qtest_writel(qts, NRF51_GPIO_BASE + NRF51_GPIO_DIRSET, 0x00000005);
+    g_assert_cmphex(qtest_readl(qts, NRF51_GPIO_BASE + NRF51_GPIO_DIR),
+                    ==, 0x00000005);
+    qtest_writel(qts, NRF51_GPIO_BASE + NRF51_GPIO_DIRCLR, 0x00000001);
+    g_assert_cmphex(qtest_readl(qts, NRF51_GPIO_BASE + NRF51_GPIO_DIR),
+                    ==, 0x00000004);
+
+    /* DIR, PULL, DRIVE and SENSE read back; DIR=output also sets DIR */
+    qtest_writel(qts, NRF51_GPIO_BASE + NRF51_GPIO_PIN_CNF(3), 0x0003030D);
+    g_assert_cmphex(qtest_readl(qts, NRF51_GPIO_BASE + NRF51_GPIO_PIN_CNF(3)),
+                    ==, 0x0003030D);
+    g_assert_cmphex(qtest_readl(qts, NRF51_GPIO_BASE + NRF51_GPIO_DIR),
+                    ==, 0x0000000C);
+
+    qtest_quit(qts);
+}
+
+static void test_nvmc(void)
+{
+    QTestState *qts = qtest_init("-machine microbit");
+    uint32_t addr = NRF51_FLASH_BASE + 4 * NRF51_NVMC_PAGE_SIZE;
+
+    g_assert_cmphex(qtest_readl(qts, NRF51_NVMC_BASE + NRF51_NVMC_READY),
+                    ==, 1);
+
+    nrf51_nvmc_erase_page(qts, addr);
+    g_assert_cmphex(qtest_readl(qts, addr), ==, 0xFFFFFFFF);
+    g_assert_cmphex(qtest_readl(qts, addr + NRF51_NVMC_PAGE_SIZE - 4),
+                    ==, 0xFFFFFFFF);
+
+    nrf51_nvmc_write(qts, addr, 0x12345678);
+    g_assert_cmphex(qtest_readl(qts, addr), ==, 0x12345678);
+
+    /* Flash is read-only unless writes are enabled */
+    qtest_writel(qts, addr, 0);
+    g_assert_cmphex(qtest_readl(qts, addr), ==, 0x12345678);
+
+    nrf51_nvmc_erase_page(qts, addr);
+    g_assert_cmphex(qtest_readl(qts, addr), ==, 0xFFFFFFFF);
+
+    qtest_quit(qts);
+}
+
+static void test_led(void)
+{
+    QTestState *qts = qtest_init("-machine microbit");
+
+    g_assert_cmphex(nrf51_led_state(qts), ==, 0);
+
+    /* Row 0, columns 0 and 1 are the LEDs at (0, 0) and (2, 0) */
+    nrf51_led_drive(qts, 0, 0x3);
+    g_assert_cmphex(nrf51_led_state(qts), ==, 0x5);
+
+    /* Row 1, column 0 is the LED at (4, 2); row 0 is kept */
+    nrf51_led_drive(qts, 1, 0x1);
+    g_assert_cmphex(nrf51_led_state(qts), ==, 0x5 | (1 << 14));
+
+    nrf51_led_drive(qts, 0, 0);
+    g_assert_cmphex(nrf51_led_state(qts), ==, 1 << 14);
+
+    qtest_quit(qts);
+}
+
+/* Receive a word from the mailbox, and the memfd sent with it if @memfd */
+static uint32_t mailbox_recv(QTestState *qts, int fd, int *memfd)
+{
+    uint32_t val;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &val, .iov_len = sizeof(val) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t len = -1;
+    int polls;
+
+    for (polls = 0; polls < CHARDEV_POLLS; polls++) {
+        len = recvmsg(fd, &msg, MSG_DONTWAIT);
+        if (len >= 0) {
+            break;
+        }
+        g_assert(errno == EAGAIN || errno == EWOULDBLOCK);
+        /* Give the main loop a turn */
+        qtest_readl(qts, MAILBOX_BASE + MAILBOX_DONE);
+        g_usleep(1000);
+    }
+    g_assert_cmpint(len, ==, sizeof(val));
+    if (memfd) {
+        cmsg = CMSG_FIRSTHDR(&msg);
+        g_assert(cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+                 cmsg->cmsg_type == SCM_RIGHTS);
+        memcpy(memfd, CMSG_DATA(cmsg), sizeof(*memfd));
+    }
+    return le32_to_cpu(val);
+}
+
+static void test_mailbox(void)
+{
+    char *path = g_strdup_printf("%s/microbit-mailbox-%d.sock",
+                                 g_get_tmp_dir(), getpid());
+    QTestState *qts = qtest_startf("-machine microbit,mailbox=mb "
+                                   "-chardev socket,id=mb,path=%s,"
+                                   "server,nowait", path);
+    uint32_t ring = NRF51_RAM_BASE + 0x100;
+    uint32_t buf = NRF51_RAM_BASE + 0x200;
+    /* Out to the memfd, back in from it, and one that runs off its end */
+    uint32_t desc[3][4] = {
+        { cpu_to_le32(buf), cpu_to_le32(8), cpu_to_le32(0),
+          cpu_to_le32(MAILBOX_TO_HOST) },
+        { cpu_to_le32(buf + 8), cpu_to_le32(8), cpu_to_le32(16), 0 },
+        { cpu_to_le32(buf), cpu_to_le32(8), cpu_to_le32(MAILBOX_SIZE - 4),
+          cpu_to_le32(MAILBOX_TO_HOST) },
+    };
+    uint8_t data[8];
+    uint8_t *shm;
+    int fd, memfd = -1, i;
+    QDict *resp;
+
+    g_assert_cmphex(qtest_readl(qts, MAILBOX_BASE + MAILBOX_RING), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, MAILBOX_BASE + MAILBOX_RING_SIZE),
+                    ==, 0);
+    g_assert_cmphex(qtest_readl(qts, MAILBOX_BASE + MAILBOX_DOORBELL), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, MAILBOX_BASE + MAILBOX_DONE), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, MAILBOX_BASE + MAILBOX_SHM_SIZE),
+                    ==, MAILBOX_SIZE);
+
+    fd = unix_connect(path, &error_abort);
+    /* A QMP round trip lets the chardev accept the connection */
+    resp = qtest_qmp(qts, "{ 'execute': 'query-status' }");
+    QDECREF(resp);
+
+    /* The harness is handed the memfd along with its size */
+    g_assert_cmpint(mailbox_recv(qts, fd, &memfd), ==, MAILBOX_SIZE);
+    g_assert_cmpint(memfd, >=, 0);
+    shm = mmap(NULL, MAILBOX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+               memfd, 0);
+    g_assert(shm != MAP_FAILED);
+    memcpy(shm + 16, "from-hst", 8);
+
+    qtest_memwrite(qts, buf, "to--host", 8);
+    qtest_memwrite(qts, ring, desc, sizeof(desc));
+    qtest_writel(qts, MAILBOX_BASE + MAILBOX_RING, ring);
+    qtest_writel(qts, MAILBOX_BASE + MAILBOX_RING_SIZE, 4);
+
+    /* One doorbell serves the whole batch and tells the harness */
+    qtest_writel(qts, MAILBOX_BASE + MAILBOX_DOORBELL, 3);
+    g_assert_cmphex(qtest_readl(qts, MAILBOX_BASE + MAILBOX_DONE), ==, 3);
+    g_assert_cmpint(mailbox_recv(qts, fd, NULL), ==, 3);
+    g_assert(memcmp(shm, "to--host", 8) == 0);
+    qtest_memread(qts, buf + 8, data, sizeof(data));
+    g_assert(memcmp(data, "from-hst", 8) == 0);
+    qtest_memread(qts, ring, desc, sizeof(desc));
+    for (i = 0; i < 3; i++) {
+        uint32_t flags = le32_to_cpu(desc[i][3]);
+
+        g_assert(flags & MAILBOX_DONE_FLAG);
+        g_assert_cmpint(!!(flags & MAILBOX_ERROR), ==, i == 2);
+    }
+
+    /* Posting more than the ring holds is refused */
+    qtest_writel(qts, MAILBOX_BASE + MAILBOX_DOORBELL, 3 + 5);
+    g_assert_cmphex(qtest_readl(qts, MAILBOX_BASE + MAILBOX_DONE), ==, 3);
+
+    munmap(shm, MAILBOX_SIZE);
+    close(memfd);
+    close(fd);
+    qtest_quit(qts);
+    unlink(path);
+    g_free(path);
+}
+
+/* Average host time of @n reads of @addr */
+static double bench_readl(QTestState *qts, uint64_t addr, int n)
+{
+    int64_t start = get_clock();
+    int i;
+
+    for (i = 0; i < n; i++) {
+        qtest_readl(qts, addr);
+    }
+    return (double)(get_clock() - start) / n;
+}
+
+/*
+ * Every qtest access is a round trip over the qtest socket, which costs
+ * far more than the dispatch itself.  Reading RAM takes the same path
+ * minus the device, so the difference is what the MMIO dispatch and
+ * the peripheral's read callback add.
+ */
+static void bench_mmio(void)
+{
+    QTestState *qts = qtest_init("-machine microbit");
+    double ram, timer, gpio;
+
+    ram = bench_readl(qts, NRF51_RAM_BASE, BENCH_MMIO_ACCESSES);
+    timer = bench_readl(qts, NRF51_TIMER0_BASE + NRF51_TIMER_CC(0),
+                        BENCH_MMIO_ACCESSES);
+    gpio = bench_readl(qts, NRF51_GPIO_BASE + NRF51_GPIO_DIR,
+                       BENCH_MMIO_ACCESSES);
+
+    g_test_message("RAM read:   %.0f ns per access (qtest round trip)", ram);
+    g_test_message("TIMER read: %.0f ns per access, %+.0f ns dispatch",
+                   timer, timer - ram);
+    g_test_message("GPIO read:  %.0f ns per access, %+.0f ns dispatch",
+                   gpio, gpio - ram);
+
+    qtest_quit(qts);
+}
+
+/*
+ * Let a 1 kHz COMPARE0 event fire repeatedly.  The event must become
+ * visible exactly at the deadline in virtual time, never a nanosecond
+ * late; the host time per period is what a guest waiting on the timer
+ * interrupt pays in the emulator.
+ */
+static void bench_timer(void)
+{
+    QTestState *qts = qtest_init("-machine microbit");
+    int64_t start, elapsed;
+    int i;
+
+    nrf51_timer_init(qts, NRF51_TIMER0_BASE, 4);
+    qtest_writel(qts, NRF51_TIMER0_BASE + NRF51_TIMER_CC(0), 1000);
+    qtest_writel(qts, NRF51_TIMER0_BASE + NRF51_SHORTS, 1 << 0);
+    qtest_writel(qts, NRF51_TIMER0_BASE + NRF51_INTENSET, 1 << 16);
+    nrf51_task(qts, NRF51_TIMER0_BASE, NRF51_TASK_START);
+
+    start = get_clock();
+    for (i = 0; i < BENCH_TIMER_EVENTS; i++) {
+        nrf51_event_clear(qts, NRF51_TIMER0_BASE, NRF51_TIMER_COMPARE(0));
+        qtest_clock_step(qts, 1000 * SCALE_US - 1);
+        g_assert(!nrf51_event(qts, NRF51_TIMER0_BASE, NRF51_TIMER_COMPARE(0)));
+        qtest_clock_step(qts, 1);
+        g_assert(nrf51_event(qts, NRF51_TIMER0_BASE, NRF51_TIMER_COMPARE(0)));
+    }
+    elapsed = get_clock() - start;
+
+    g_test_message("TIMER COMPARE: %.0f ns host time per event",
+                   (double)elapsed / BENCH_TIMER_EVENTS);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/microbit/nrf51/timer", test_timer);
+    qtest_add_func("/microbit/nrf51/rtc", test_rtc);
+    qtest_add_func("/microbit/nrf51/ppi", test_ppi);
+    qtest_add_func("/microbit/nrf51/lpcomp", test_lpcomp);
+    qtest_add_func("/microbit/nrf51/twi", test_twi);
+    qtest_add_func("/microbit/nrf51/spi", test_spi);
+    qtest_add_func("/microbit/nrf51/gpiote", test_gpiote);
+    qtest_add_func("/microbit/nrf51/adc", test_adc);
+    qtest_add_func("/microbit/nrf51/uart", test_uart);
+    qtest_add_func("/microbit/nrf51/radio", test_radio);
+    qtest_add_func("/microbit/nrf51/temp", test_temp);
+    qtest_add_func("/microbit/nrf51/ecb", test_ecb);
+    qtest_add_func("/microbit/nrf51/ccm-aar", test_ccm_aar);
+    qtest_add_func("/microbit/nrf51/wdt", test_wdt);
+    qtest_add_func("/microbit/nrf51/qdec", test_qdec);
+    qtest_add_func("/microbit/nrf51/rng", test_rng);
+    qtest_add_func("/microbit/nrf51/gpio", test_gpio);
+    qtest_add_func("/microbit/nrf51/nvmc", test_nvmc);
+    qtest_add_func("/microbit/nrf51/led", test_led);
+    qtest_add_func("/microbit/mailbox", test_mailbox);
+    if (g_test_perf()) {
+        qtest_add_func("/microbit/nrf51/bench/mmio", bench_mmio);
+        qtest_add_func("/microbit/nrf51/bench/timer", bench_timer);
+    }
+
+    return g_test_run();
+}
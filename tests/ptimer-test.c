@@ -18,19 +18,28 @@
 #include "ptimer-test.h"
 
 static bool triggered;
+static unsigned compare_fired;
 
 static void ptimer_trigger(void *opaque)
 {
     triggered = true;
 }
 
+static void ptimer_compare_trigger(void *opaque, unsigned channels)
+{
+    compare_fired |= channels;
+}
+
 static void ptimer_test_expire_qemu_timers(int64_t expire_time,
                                            QEMUClockType type)
 {
     QEMUTimerList *timer_list = main_loop_tlg.tl[type];
-    QEMUTimer *t = timer_list->active_timers.next;
+    GList *timers = g_list_copy(timer_list->active_timers);
+    GList *l;
+
+    for (l = timers; l != NULL; l = l->next) {
+        QEMUTimer *t = l->data;
 
-    while (t != NULL) {
         if (t->expire_time == expire_time) {
             timer_del(t);
 
@@ -38,9 +47,9 @@ static void ptimer_test_expire_qemu_timers(int64_t expire_time,
                 t->cb(t->opaque);
             }
         }
-
-        t = t->next;
     }
+
+    g_list_free(timers);
 }
 
 static void ptimer_test_set_qemu_time_ns(int64_t ns)
@@ -696,6 +705,87 @@ static void check_oneshot_with_load_0(gconstpointer arg)
     ptimer_free(ptimer);
 }
 
+static void check_compare(void)
+{
+    QEMUBH *bh = qemu_bh_new(ptimer_trigger, NULL);
+    ptimer_state *ptimer = ptimer_init(bh, PTIMER_POLICY_DEFAULT);
+
+    triggered = false;
+    compare_fired = 0;
+
+    ptimer_set_compare_cb(ptimer, ptimer_compare_trigger, NULL);
+    ptimer_set_period(ptimer, 2000000);
+    ptimer_set_limit(ptimer, 10, 1);
+    ptimer_set_compare(ptimer, 0, 7);
+    ptimer_set_compare(ptimer, 1, 3);
+    ptimer_set_compare(ptimer, 2, 3);
+    ptimer_set_compare(ptimer, 3, 0);
+    ptimer_run(ptimer, 0);
+
+    qemu_clock_step(2000000 * 3 - 1);
+
+    g_assert_cmpuint(compare_fired, ==, 0);
+
+    qemu_clock_step(1);
+
+    g_assert_cmpuint(ptimer_get_count(ptimer), ==, 7);
+    g_assert_cmpuint(compare_fired, ==, 1 << 0);
+
+    compare_fired = 0;
+    qemu_clock_step(2000000 * 4);
+
+    g_assert_cmpuint(ptimer_get_count(ptimer), ==, 3);
+    g_assert_cmpuint(compare_fired, ==, (1 << 1) | (1 << 2));
+    g_assert_false(triggered);
+
+    compare_fired = 0;
+    qemu_clock_step(2000000 * 3);
+
+    g_assert_cmpuint(compare_fired, ==, 1 << 3);
+    g_assert_true(triggered);
+
+    /* Matches again after the reload */
+    compare_fired = 0;
+    qemu_clock_step(2000000 * 3);
+
+    g_assert_cmpuint(compare_fired, ==, 1 << 0);
+
+    ptimer_clear_compare(ptimer, 1);
+
+    compare_fired = 0;
+    qemu_clock_step(2000000 * 4);
+
+    g_assert_cmpuint(compare_fired, ==, 1 << 2);
+
+    ptimer_stop(ptimer);
+
+    compare_fired = 0;
+    qemu_clock_step(2000000 * 10);
+
+    g_assert_cmpuint(compare_fired, ==, 0);
+
+    /* Values not below the loaded count never match in oneshot mode */
+    triggered = false;
+    ptimer_set_count(ptimer, 5);
+    ptimer_run(ptimer, 1);
+
+    qemu_clock_step(2000000 * 2);
+
+    g_assert_cmpuint(compare_fired, ==, 1 << 2);
+
+    compare_fired = 0;
+    qemu_clock_step(2000000 * 3);
+
+    g_assert_cmpuint(compare_fired, ==, 1 << 3);
+    g_assert_true(triggered);
+
+    compare_fired = 0;
+    qemu_clock_step(2000000 * 20);
+
+    g_assert_cmpuint(compare_fired, ==, 0);
+    ptimer_free(ptimer);
+}
+
 static void add_ptimer_tests(uint8_t policy)
 {
     char policy_name[256] = "";
@@ -725,6 +815,10 @@ static void add_ptimer_tests(uint8_t policy)
         g_strlcat(policy_name, "no_counter_rounddown,", 256);
     }
 
+    if (policy & PTIMER_POLICY_SYNC_TRIGGER) {
+        g_strlcat(policy_name, "sync_trigger,", 256);
+    }
+
     g_test_add_data_func_full(
         tmp = g_strdup_printf("/ptimer/set_count policy=%s", policy_name),
         g_memdup(&policy, 1), check_set_count, g_free);
@@ -790,7 +884,7 @@ static void add_ptimer_tests(uint8_t policy)
 
 static void add_all_ptimer_policies_comb_tests(void)
 {
-    int last_policy = PTIMER_POLICY_NO_COUNTER_ROUND_DOWN;
+    int last_policy = PTIMER_POLICY_SYNC_TRIGGER;
     int policy = PTIMER_POLICY_DEFAULT;
 
     for (; policy < (last_policy << 1); policy++) {
@@ -810,6 +904,8 @@ int main(int argc, char **argv)
 
     add_all_ptimer_policies_comb_tests();
 
+    g_test_add_func("/ptimer/compare", check_compare);
+
     qtest_allowed = true;
 
     return g_test_run();
@@ -9,6 +9,7 @@
 #include "qemu/atomic.h"
 #include "qemu/qht.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/tb-hash-xx.h"
 
 struct thread_stats {
@@ -20,14 +21,22 @@ struct thread_stats {
     size_t not_rm;
     size_t rz;
     size_t not_rz;
+    size_t fl;
+    /* one lookup in LAT_SAMPLE_PERIOD is timed */
+    size_t lat_n;
+    uint64_t lat_ns;
+    uint64_t lat_max;
 };
 
+#define LAT_SAMPLE_PERIOD 256
+
 struct thread_info {
     void (*func)(struct thread_info *);
     struct thread_stats stats;
     uint64_t r;
     bool write_op; /* writes alternate between insertions and removals */
     bool resize_down;
+    unsigned int n_lookups;
 } QEMU_ALIGNED(64); /* avoid false sharing among threads */
 
 static struct qht ht;
@@ -54,6 +63,11 @@ static double resize_rate; /* 0.0 to 1.0 */
 static unsigned int n_rz_threads = 1;
 static QemuThread *rz_threads;
 
+static struct thread_info *fl_info;
+static unsigned long flush_delay; /* 0 = no flushes */
+static unsigned int n_fl_threads;
+static QemuThread *fl_threads;
+
 static double update_rate; /* 0.0 to 1.0 */
 static uint64_t update_threshold;
 static uint64_t resize_threshold;
@@ -84,7 +98,10 @@ static const char commands_string[] =
     " -R = enable auto-resize\n"
     " -S = resize rate (0.0 to 100.0)\n"
     " -D = delay (in us) between potential resizes\n"
-    " -N = number of resize threads";
+    " -N = number of resize threads\n"
+    "\n"
+    " -F = delay (in us) between flushes, as tb_flush does: the table is\n"
+    "      reset and repopulated (default 0, no flushes)";
 
 static void usage_complete(int argc, char *argv[])
 {
@@ -139,6 +156,41 @@ static void do_rz(struct thread_info *info)
     g_usleep(resize_delay);
 }
 
+/*
+ * Like tb_flush() followed by the guest retranslating its working set.
+ * The first -k keys are reinserted, whether or not they were the ones
+ * present before; an update thread may have inserted some already.
+ */
+static void do_fl(struct thread_info *info)
+{
+    size_t i;
+
+    qht_reset(&ht);
+    for (i = 0; i < init_size; i++) {
+        qht_insert(&ht, &keys[i], h(keys[i]));
+    }
+    info->stats.fl++;
+    g_usleep(flush_delay);
+}
+
+static void *timed_lookup(struct thread_info *info, long *p, uint32_t hash)
+{
+    struct thread_stats *stats = &info->stats;
+    int64_t t0, t;
+    void *ret;
+
+    if (++info->n_lookups % LAT_SAMPLE_PERIOD) {
+        return qht_lookup(&ht, is_equal, p, hash);
+    }
+    t0 = get_clock();
+    ret = qht_lookup(&ht, is_equal, p, hash);
+    t = get_clock() - t0;
+    stats->lat_n++;
+    stats->lat_ns += t;
+    stats->lat_max = MAX(stats->lat_max, t);
+    return ret;
+}
+
 static void do_rw(struct thread_info *info)
 {
     struct thread_stats *stats = &info->stats;
@@ -150,7 +202,7 @@ static void do_rw(struct thread_info *info)
 
         p = &keys[info->r & (lookup_range - 1)];
         hash = h(*p);
-        read = qht_lookup(&ht, is_equal, p, hash);
+        read = timed_lookup(info, p, hash);
         if (read) {
             stats->rd++;
         } else {
@@ -247,6 +299,8 @@ static void create_threads(void)
 {
     th_create_n(&rw_threads, &rw_info, "rw", do_rw, 0, n_rw_threads);
     th_create_n(&rz_threads, &rz_info, "rz", do_rz, n_rw_threads, n_rz_threads);
+    th_create_n(&fl_threads, &fl_info, "fl", do_fl,
+                n_rw_threads + n_rz_threads, n_fl_threads);
 }
 
 static void pr_params(void)
@@ -263,6 +317,9 @@ static void pr_params(void)
         printf(" resize range:      %zu-%zu\n", resize_min, resize_max);
         printf(" # resize threads   %u\n", n_rz_threads);
     }
+    if (flush_delay) {
+        printf(" flush delay:       %lu us\n", flush_delay);
+    }
     printf(" update rate:       %f%%\n", update_rate * 100.0);
     printf(" offset:            %ld\n", populate_offset);
     printf(" initial key range: %zu\n", init_range);
@@ -349,6 +406,12 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
 
         s->rz += stats->rz;
         s->not_rz += stats->not_rz;
+
+        s->fl += stats->fl;
+
+        s->lat_n += stats->lat_n;
+        s->lat_ns += stats->lat_ns;
+        s->lat_max = MAX(s->lat_max, stats->lat_max);
     }
 }
 
@@ -359,6 +422,7 @@ static void pr_stats(void)
 
     add_stats(&s, rw_info, n_rw_threads);
     add_stats(&s, rz_info, n_rz_threads);
+    add_stats(&s, fl_info, n_fl_threads);
 
     printf("Results:\n");
 
@@ -367,6 +431,10 @@ static void pr_stats(void)
                s.rz, (double)s.rz / (s.rz + s.not_rz) * 100, s.rz + s.not_rz);
     }
 
+    if (flush_delay) {
+        printf(" Flushes:           %zu\n", s.fl);
+    }
+
     printf(" Read:              %.2f M (%.2f%% of %.2fM)\n",
            (double)s.rd / 1e6,
            (double)s.rd / (s.rd + s.not_rd) * 100,
@@ -383,6 +451,11 @@ static void pr_stats(void)
     tx = (s.rd + s.not_rd + s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
     printf(" Throughput:        %.2f MT/s\n", tx);
     printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
+    if (s.lat_n) {
+        printf(" Lookup latency:    %.1f ns avg, %" PRIu64 " ns max "
+               "(1 in %d reads, incl. clock overhead)\n",
+               (double)s.lat_ns / s.lat_n, s.lat_max, LAT_SAMPLE_PERIOD);
+    }
 }
 
 static void run_test(void)
@@ -390,7 +463,8 @@ static void run_test(void)
     unsigned int remaining;
     int i;
 
-    while (atomic_read(&n_ready_threads) != n_rw_threads + n_rz_threads) {
+    while (atomic_read(&n_ready_threads) !=
+           n_rw_threads + n_rz_threads + n_fl_threads) {
         cpu_relax();
     }
     atomic_set(&test_start, true);
@@ -405,6 +479,9 @@ static void run_test(void)
     for (i = 0; i < n_rz_threads; i++) {
         qemu_thread_join(&rz_threads[i]);
     }
+    for (i = 0; i < n_fl_threads; i++) {
+        qemu_thread_join(&fl_threads[i]);
+    }
 }
 
 static void parse_args(int argc, char *argv[])
@@ -412,7 +489,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "d:D:g:k:K:l:hn:N:o:r:Rs:S:u:");
+        c = getopt(argc, argv, "d:D:F:g:k:K:l:hn:N:o:r:Rs:S:u:");
         if (c < 0) {
             break;
         }
@@ -423,6 +500,10 @@ static void parse_args(int argc, char *argv[])
         case 'D':
             resize_delay = atol(optarg);
             break;
+        case 'F':
+            flush_delay = atol(optarg);
+            n_fl_threads = flush_delay ? 1 : 0;
+            break;
         case 'g':
             init_range = pow2ceil(atol(optarg));
             lookup_range = pow2ceil(atol(optarg));
@@ -89,7 +89,10 @@ static void test_qmp_protocol(void)
     g_assert(q);
     test_version(qdict_get(q, "version"));
     capabilities = qdict_get_qlist(q, "capabilities");
-    g_assert(capabilities && qlist_empty(capabilities));
+    g_assert(capabilities && qlist_size(capabilities) == 1);
+    g_assert_cmpstr(qstring_get_str(qobject_to(QString,
+                        qlist_entry_obj(qlist_first(capabilities)))),
+                    ==, "cbor");
     QDECREF(resp);
 
     /* Test valid command before handshake */
@@ -100,6 +103,12 @@ static void test_qmp_protocol(void)
     /* Test malformed commands before handshake */
     test_malformed(qts);
 
+    /* Test event batching without cbor, which fails the handshake */
+    resp = qtest_qmp(qts, "{ 'execute': 'qmp_capabilities', "
+                     "'arguments': { 'event-batch-ms': 10 } }");
+    g_assert_cmpstr(get_error_class(resp), ==, "GenericError");
+    QDECREF(resp);
+
     /* Test handshake */
     resp = qtest_qmp(qts, "{ 'execute': 'qmp_capabilities' }");
     ret = qdict_get_qdict(resp, "return");
@@ -13,6 +13,7 @@
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/thread.h"
 #include "trace/control.h"
 #include "trace/simple.h"
 #include "qemu/error-report.h"
@@ -33,8 +34,11 @@
 #define TRACE_RECORD_VALID ((uint64_t)1 << 63)
 
 /*
- * Trace records are written out by a dedicated thread.  The thread waits for
- * records to become available, writes them out, and then waits again.
+ * Each thread writes its trace records into a ring buffer of its own, so
+ * that threads tracing at the same time do not contend on a shared index
+ * or lock.  A dedicated thread waits for records to become available,
+ * writes them out in timestamp order across the buffers, and then waits
+ * again.
  */
 static CompatGMutex trace_lock;
 static CompatGCond trace_available_cond;
@@ -42,15 +46,31 @@ static CompatGCond trace_empty_cond;
 
 static bool trace_available;
 static bool trace_writeout_enabled;
+/* Set by the thread that kicks the writeout thread, until it runs */
+static bool trace_kicked;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 16,
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
+/*
+ * Only the owning thread advances head, only the writeout thread advances
+ * tail; both count bytes modulo 2^32, TRACE_BUF_LEN being a power of two.
+ * Buffers are never freed: the buffer of a thread that has exited goes to
+ * the next new thread once it has been written out.
+ */
+typedef struct TraceThreadBuf {
+    uint8_t buf[TRACE_BUF_LEN];
+    unsigned int head;
+    unsigned int tail;
+    bool owned;
+    Notifier exit;
+    struct TraceThreadBuf *next;
+} TraceThreadBuf;
+
+static TraceThreadBuf *trace_bufs;
+static __thread TraceThreadBuf *trace_thread_buf;
 static volatile gint dropped_events;
 static uint32_t trace_pid;
 static FILE *trace_fp;
@@ -75,53 +95,117 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceThreadBuf *tb, unsigned int idx,
+                             void *dataptr, size_t size);
+static unsigned int write_to_buffer(TraceThreadBuf *tb, unsigned int idx,
+                                    void *dataptr, size_t size);
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void clear_buffer_range(TraceThreadBuf *tb, unsigned int idx,
+                               size_t len)
 {
     uint32_t num = 0;
     while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
+        tb->buf[idx++ % TRACE_BUF_LEN] = 0;
         num++;
     }
 }
+
+static void trace_thread_exit(Notifier *notifier, void *data)
+{
+    TraceThreadBuf *tb = container_of(notifier, TraceThreadBuf, exit);
+
+    atomic_store_release(&tb->owned, false);
+}
+
+/**
+ * Get the calling thread's trace buffer
+ *
+ * Reuses the buffer of a thread that has exited once it is written out,
+ * otherwise adds a new one to the list of buffers.  Returns NULL if memory
+ * runs out.
+ */
+static TraceThreadBuf *get_thread_buf(void)
+{
+    TraceThreadBuf *tb = trace_thread_buf;
+    TraceThreadBuf *old;
+
+    if (likely(tb)) {
+        return tb;
+    }
+    for (tb = atomic_rcu_read(&trace_bufs); tb; tb = tb->next) {
+        if (!atomic_load_acquire(&tb->owned) &&
+            atomic_read(&tb->head) == atomic_read(&tb->tail) &&
+            !atomic_cmpxchg(&tb->owned, false, true)) {
+            break;
+        }
+    }
+    if (!tb) {
+        /* don't use g_malloc, can deadlock when traced */
+        tb = calloc(1, sizeof(*tb));
+        if (!tb) {
+            return NULL;
+        }
+        tb->owned = true;
+        do {
+            old = atomic_read(&trace_bufs);
+            tb->next = old;
+        } while (atomic_cmpxchg(&trace_bufs, old, tb) != old);
+    }
+    trace_thread_buf = tb;
+    tb->exit.notify = trace_thread_exit;
+    qemu_thread_atexit_add(&tb->exit);
+    return tb;
+}
+
 /**
- * Read a trace record from the trace buffer
+ * Read the header of the oldest record of a trace buffer
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * @tb          Trace buffer
+ * @record      Trace record header to fill
  *
- * Returns false if the record is not valid.
+ * Returns false if the record is not valid yet.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static bool peek_trace_record(TraceThreadBuf *tb, TraceRecord *record)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    unsigned int idx = tb->tail;
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
+    /* read the event flag to see if its a valid record */
+    read_from_buffer(tb, idx, record, sizeof(record->event));
+    if (!(record->event & TRACE_RECORD_VALID)) {
         return false;
     }
 
     smp_rmb(); /* read memory barrier before accessing record */
     /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
+    read_from_buffer(tb, idx, record, sizeof(TraceRecord));
+    return true;
+}
+
+/**
+ * Take the oldest record out of a trace buffer
+ *
+ * @tb          Trace buffer, whose oldest record peek_trace_record() found
+ * @length      Length of the record
+ *
+ * Returns the record, to be freed by the caller.
+ */
+static TraceRecord *get_trace_record(TraceThreadBuf *tb, uint32_t length)
+{
+    unsigned int idx = tb->tail;
+    TraceRecord *recordptr;
+
+    recordptr = malloc(length); /* don't use g_malloc, can deadlock when traced */
     /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
+    read_from_buffer(tb, idx, recordptr, length);
+    recordptr->event &= ~TRACE_RECORD_VALID;
     /* clear the trace buffer range for consumed record otherwise any byte
      * with its MSB set may be considered as a valid event id when the writer
      * thread crosses this range of buffer again.
      */
-    clear_buffer_range(idx, record.length);
-    return true;
+    clear_buffer_range(tb, idx, length);
+    /* the owner may only reuse the range once it is clear */
+    atomic_store_release(&tb->tail, idx + length);
+    return recordptr;
 }
 
 /**
@@ -151,16 +235,18 @@ static void wait_for_trace_records_available(void)
     }
     trace_available = false;
     g_mutex_unlock(&trace_lock);
+    atomic_set(&trace_kicked, false);
 }
 
 static gpointer writeout_thread(gpointer opaque)
 {
+    TraceThreadBuf *tb, *oldest;
     TraceRecord *recordptr;
+    TraceRecord record, oldest_record;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
     int dropped_count;
     size_t unused __attribute__ ((unused));
     uint64_t type = TRACE_RECORD_TYPE_EVENT;
@@ -182,12 +268,24 @@ static gpointer writeout_thread(gpointer opaque)
             unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
+        /* Merge the buffers: always write the oldest record there is */
+        for (;;) {
+            oldest = NULL;
+            for (tb = atomic_rcu_read(&trace_bufs); tb; tb = tb->next) {
+                if (peek_trace_record(tb, &record) &&
+                    (!oldest ||
+                     record.timestamp_ns < oldest_record.timestamp_ns)) {
+                    oldest = tb;
+                    oldest_record = record;
+                }
+            }
+            if (!oldest) {
+                break;
+            }
+            recordptr = get_trace_record(oldest, oldest_record.length);
             unused = fwrite(&type, sizeof(type), 1, trace_fp);
             unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
             free(recordptr); /* don't use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
         }
 
         fflush(trace_fp);
@@ -197,84 +295,90 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, &val,
+                                   sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, &slen,
+                                   sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, (void *)s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, uint32_t event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceThreadBuf *tb = get_thread_buf();
+    unsigned int idx, old_idx, new_idx;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
     uint64_t event_u64 = event;
     uint64_t timestamp_ns = get_clock();
 
+    if (unlikely(!tb)) {
+        g_atomic_int_inc(&dropped_events);
+        return -ENOMEM;
+    }
+
+    /* Only a signal handler tracing on this thread can race with us */
     do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
+        old_idx = atomic_read(&tb->head);
         new_idx = old_idx + rec_len;
 
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
+        if (new_idx - atomic_load_acquire(&tb->tail) > TRACE_BUF_LEN) {
             /* Trace Buffer Full, Event dropped ! */
             g_atomic_int_inc(&dropped_events);
             return -ENOSPC;
         }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
-
-    idx = old_idx % TRACE_BUF_LEN;
+    } while (atomic_cmpxchg(&tb->head, old_idx, new_idx) != old_idx);
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    idx = old_idx;
+    idx = write_to_buffer(tb, idx, &event_u64, sizeof(event_u64));
+    idx = write_to_buffer(tb, idx, &timestamp_ns, sizeof(timestamp_ns));
+    idx = write_to_buffer(tb, idx, &rec_len, sizeof(rec_len));
+    idx = write_to_buffer(tb, idx, &trace_pid, sizeof(trace_pid));
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->tbuf = tb;
+    rec->tbuf_idx = old_idx;
+    rec->rec_off = idx;
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+static void read_from_buffer(TraceThreadBuf *tb, unsigned int idx,
+                             void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
     while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
+        data_ptr[x++] = tb->buf[idx++ % TRACE_BUF_LEN];
     }
 }
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
+static unsigned int write_to_buffer(TraceThreadBuf *tb, unsigned int idx,
+                                    void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
     while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
+        tb->buf[idx++ % TRACE_BUF_LEN] = data_ptr[x++];
     }
     return idx; /* most callers wants to know where to write next */
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
+    TraceThreadBuf *tb = rec->tbuf;
     TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    read_from_buffer(tb, rec->tbuf_idx, &record, sizeof(TraceRecord));
     smp_wmb(); /* write barrier before marking as valid */
     record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    write_to_buffer(tb, rec->tbuf_idx, &record, sizeof(TraceRecord));
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    /* One thread wakes the writeout thread, the others go on */
+    if (atomic_read(&tb->head) - atomic_read(&tb->tail)
+        > TRACE_BUF_FLUSH_THRESHOLD &&
+        !atomic_xchg(&trace_kicked, true)) {
         flush_trace_file(false);
     }
 }
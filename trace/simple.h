@@ -18,6 +18,7 @@ bool st_init(void);
 void st_flush_trace_buffer(void);
 
 typedef struct {
+    struct TraceThreadBuf *tbuf;
     unsigned int tbuf_idx;
     unsigned int rec_off;
 } TraceBufferRecord;
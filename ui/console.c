@@ -35,6 +35,8 @@
 
 #define DEFAULT_BACKSCROLL 512
 #define CONSOLE_CURSOR_PERIOD 500
+/* Unchanged refreshes before dropping to GUI_REFRESH_INTERVAL_IDLE */
+#define GUI_IDLE_REFRESHES 10
 
 typedef struct TextAttributes {
     uint8_t fgcol:4;
@@ -172,6 +174,9 @@ struct DisplayState {
     uint64_t last_update;
     uint64_t update_interval;
     bool refreshing;
+    /* Display output since the last refresh, and refreshes without any */
+    bool changed;
+    unsigned idle_refreshes;
     bool have_gfx;
     bool have_text;
 
@@ -197,8 +202,10 @@ static void gui_update(void *opaque)
     uint64_t dcl_interval;
     DisplayState *ds = opaque;
     DisplayChangeListener *dcl;
+    bool pinned = false;
     int i;
 
+    ds->changed = false;
     ds->refreshing = true;
     dpy_refresh(ds);
     ds->refreshing = false;
@@ -209,7 +216,24 @@ static void gui_update(void *opaque)
         if (interval > dcl_interval) {
             interval = dcl_interval;
         }
+        pinned |= dcl->update_interval != 0;
     }
+
+    /*
+     * Listeners that leave update_interval alone only need refreshes to
+     * pick up display changes.  Once the display has stayed unchanged
+     * for a while, refresh at the idle rate; dpy_changed() brings the
+     * normal rate back as soon as something is drawn.
+     */
+    if (ds->changed || pinned) {
+        ds->idle_refreshes = 0;
+    } else if (ds->idle_refreshes < GUI_IDLE_REFRESHES) {
+        ds->idle_refreshes++;
+    }
+    if (ds->idle_refreshes == GUI_IDLE_REFRESHES) {
+        interval = GUI_REFRESH_INTERVAL_IDLE;
+    }
+
     if (ds->update_interval != interval) {
         ds->update_interval = interval;
         for (i = 0; i < nb_consoles; i++) {
@@ -223,6 +247,19 @@ static void gui_update(void *opaque)
     timer_mod(ds->gui_timer, ds->last_update + interval);
 }
 
+/* Something was drawn; leave the idle refresh rate if we were in it */
+static void dpy_changed(DisplayState *ds)
+{
+    ds->changed = true;
+    if (ds->refreshing || ds->idle_refreshes < GUI_IDLE_REFRESHES) {
+        return;
+    }
+    ds->idle_refreshes = 0;
+    if (ds->gui_timer) {
+        timer_mod(ds->gui_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    }
+}
+
 static void gui_setup_refresh(DisplayState *ds)
 {
     DisplayChangeListener *dcl;
@@ -294,6 +331,16 @@ void graphic_hw_invalidate(QemuConsole *con)
     if (con && con->hw_ops->invalidate) {
         con->hw_ops->invalidate(con->hw);
     }
+    if (con && con->ds) {
+        dpy_changed(con->ds);
+    }
+}
+
+void graphic_hw_changed(QemuConsole *con)
+{
+    if (con && con->ds) {
+        dpy_changed(con->ds);
+    }
 }
 
 static void ppm_save(const char *filename, DisplaySurface *ds,
@@ -1564,6 +1611,7 @@ void dpy_gfx_update(QemuConsole *con, int x, int y, int w, int h)
     if (!qemu_console_is_visible(con)) {
         return;
     }
+    dpy_changed(s);
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
@@ -1594,6 +1642,7 @@ void dpy_gfx_replace_surface(QemuConsole *con,
     assert(old_surface != surface || surface == NULL);
 
     con->surface = surface;
+    dpy_changed(s);
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
@@ -1649,6 +1698,7 @@ void dpy_text_cursor(QemuConsole *con, int x, int y)
     if (!qemu_console_is_visible(con)) {
         return;
     }
+    dpy_changed(s);
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
@@ -1667,6 +1717,7 @@ void dpy_text_update(QemuConsole *con, int x, int y, int w, int h)
     if (!qemu_console_is_visible(con)) {
         return;
     }
+    dpy_changed(s);
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
@@ -1685,6 +1736,7 @@ void dpy_text_resize(QemuConsole *con, int w, int h)
     if (!qemu_console_is_visible(con)) {
         return;
     }
+    dpy_changed(s);
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
@@ -1703,6 +1755,7 @@ void dpy_mouse_set(QemuConsole *con, int x, int y, int on)
     if (!qemu_console_is_visible(con)) {
         return;
     }
+    dpy_changed(s);
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
@@ -1721,6 +1774,7 @@ void dpy_cursor_define(QemuConsole *con, QEMUCursor *cursor)
     if (!qemu_console_is_visible(con)) {
         return;
     }
+    dpy_changed(s);
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
@@ -1837,6 +1891,7 @@ void dpy_gl_update(QemuConsole *con,
                    uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
     assert(con->gl);
+    dpy_changed(con->ds);
     con->gl->ops->dpy_gl_update(con->gl, x, y, w, h);
 }
 
@@ -452,6 +452,8 @@ static void curses_display_init(DisplayState *ds, DisplayOptions *opts)
 
     dcl = g_new0(DisplayChangeListener, 1);
     dcl->ops = &dcl_ops;
+    /* Keys are read from dpy_refresh, so don't idle the refresh */
+    dcl->update_interval = GUI_REFRESH_INTERVAL_DEFAULT;
     register_displaychangelistener(dcl);
 
     invalidate = 1;
@@ -975,6 +975,8 @@ static void sdl1_display_init(DisplayState *ds, DisplayOptions *o)
 
     dcl = g_new0(DisplayChangeListener, 1);
     dcl->ops = &dcl_ops;
+    /* Input is polled from dpy_refresh, so don't idle the refresh */
+    dcl->update_interval = GUI_REFRESH_INTERVAL_DEFAULT;
     register_displaychangelistener(dcl);
 
     mouse_mode_notifier.notify = sdl_mouse_mode_change;
@@ -820,6 +820,8 @@ static void sdl2_display_init(DisplayState *ds, DisplayOptions *o)
         sdl2_console[i].dcl.ops = &dcl_2d_ops;
 #endif
         sdl2_console[i].dcl.con = con;
+        /* Input is polled from dpy_refresh, so don't idle the refresh */
+        sdl2_console[i].dcl.update_interval = GUI_REFRESH_INTERVAL_DEFAULT;
         register_displaychangelistener(&sdl2_console[i].dcl);
 
 #if defined(SDL_VIDEO_DRIVER_WINDOWS) || defined(SDL_VIDEO_DRIVER_X11)
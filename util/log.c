@@ -21,6 +21,7 @@
 #include "qemu-common.h"
 #include "qemu/log.h"
 #include "qemu/range.h"
+#include "qemu/thread.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
@@ -32,6 +33,16 @@ int qemu_loglevel;
 static int log_append = 0;
 static GArray *debug_regions;
 
+/* Rate-limited messages seen so far, see qemu_log_mask_ratelimited() */
+typedef struct QEMULogSite {
+    const char *site;
+    uint64_t id;
+    uint64_t count;
+} QEMULogSite;
+
+static GHashTable *log_sites;
+static QemuMutex log_sites_lock;
+
 /* Return the number of characters emitted.  */
 int qemu_log(const char *fmt, ...)
 {
@@ -50,6 +61,60 @@ int qemu_log(const char *fmt, ...)
     return ret;
 }
 
+static guint log_site_hash(gconstpointer key)
+{
+    const QEMULogSite *ls = key;
+
+    return g_str_hash(ls->site) ^ g_int64_hash(&ls->id);
+}
+
+static gboolean log_site_equal(gconstpointer a, gconstpointer b)
+{
+    const QEMULogSite *la = a, *lb = b;
+
+    return la->id == lb->id && !strcmp(la->site, lb->site);
+}
+
+static void __attribute__((constructor)) log_sites_init(void)
+{
+    qemu_mutex_init(&log_sites_lock);
+    log_sites = g_hash_table_new_full(log_site_hash, log_site_equal,
+                                      g_free, NULL);
+}
+
+bool qemu_log_ratelimit(const char *site, uint64_t id)
+{
+    QEMULogSite key = { .site = site, .id = id };
+    QEMULogSite *ls;
+    bool first;
+
+    qemu_mutex_lock(&log_sites_lock);
+    ls = g_hash_table_lookup(log_sites, &key);
+    if (!ls) {
+        ls = g_memdup(&key, sizeof(key));
+        g_hash_table_insert(log_sites, ls, ls);
+    }
+    first = ls->count++ == 0;
+    qemu_mutex_unlock(&log_sites_lock);
+
+    return first;
+}
+
+void qemu_log_ratelimit_foreach(QEMULogRateLimitFunc *func, void *opaque)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    qemu_mutex_lock(&log_sites_lock);
+    g_hash_table_iter_init(&iter, log_sites);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        QEMULogSite *ls = key;
+
+        func(ls->site, ls->id, ls->count, opaque);
+    }
+    qemu_mutex_unlock(&log_sites_lock);
+}
+
 static bool log_uses_own_buffers;
 
 /* enable or disable low levels log */
@@ -526,6 +526,8 @@ void main_loop_wait(int nonblocking)
        missing the warp */
     qemu_start_warp_timer();
     qemu_clock_run_all_timers();
+    /* Timers that did not wake a vCPU leave it halted until the next one */
+    qemu_idle_skip();
 }
 
 /* Functions to operate on the main QEMU AioContext.  */
@@ -114,11 +114,28 @@ void qemu_rec_mutex_init(QemuRecMutex *mutex)
     mutex->initialized = true;
 }
 
+/*
+ * The clock qemu_cond_timedwait() measures its deadline against.  Where
+ * the condattr can be set to CLOCK_MONOTONIC, a step of the wall clock
+ * neither cuts a timed wait short nor stretches it.
+ */
+#ifdef CONFIG_PTHREAD_CONDATTR_SETCLOCK
+#define QEMU_COND_CLOCK CLOCK_MONOTONIC
+#else
+#define QEMU_COND_CLOCK CLOCK_REALTIME
+#endif
+
 void qemu_cond_init(QemuCond *cond)
 {
+    pthread_condattr_t attr;
     int err;
 
-    err = pthread_cond_init(&cond->cond, NULL);
+    pthread_condattr_init(&attr);
+#ifdef CONFIG_PTHREAD_CONDATTR_SETCLOCK
+    pthread_condattr_setclock(&attr, QEMU_COND_CLOCK);
+#endif
+    err = pthread_cond_init(&cond->cond, &attr);
+    pthread_condattr_destroy(&attr);
     if (err)
         error_exit(err, __func__);
     cond->initialized = true;
@@ -167,6 +184,26 @@ void qemu_cond_wait_impl(QemuCond *cond, QemuMutex *mutex, const char *file, con
         error_exit(err, __func__);
 }
 
+bool qemu_cond_timedwait_impl(QemuCond *cond, QemuMutex *mutex, int64_t ns,
+                              const char *file, const int line)
+{
+    struct timespec ts;
+    int err;
+
+    assert(cond->initialized);
+    clock_gettime(QEMU_COND_CLOCK, &ts);
+    ns += ts.tv_nsec;
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    trace_qemu_mutex_unlock(mutex, file, line);
+    err = pthread_cond_timedwait(&cond->cond, &mutex->lock, &ts);
+    trace_qemu_mutex_locked(mutex, file, line);
+    if (err && err != ETIMEDOUT) {
+        error_exit(err, __func__);
+    }
+    return err != ETIMEDOUT;
+}
+
 void qemu_sem_init(QemuSemaphore *sem, int init)
 {
     int rc;
@@ -57,8 +57,14 @@ typedef struct QEMUClock {
 
 QEMUTimerListGroup main_loop_tlg;
 static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
-
-/* A QEMUTimerList is a list of timers attached to a clock. More
+/* Virtual nanoseconds per host nanosecond, see -rtc scale */
+static int virtual_clock_scale = 1;
+/* The main loop's QEMU_CLOCK_VIRTUAL timers are run by the vCPU thread */
+static bool virtual_on_vcpu;
+/* How late the main loop hands such timers back to the vCPU */
+#define VIRTUAL_ON_VCPU_SLACK_NS SCALE_MS
+
+/* A QEMUTimerList is a set of timers attached to a clock. More
  * than one QEMUTimerList can be attached to each clock, for instance
  * used by different AioContexts / threads. Each clock also has
  * a list of the QEMUTimerLists associated with it, in order that
@@ -68,7 +74,14 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+    /* Binary min-heap of the pending timers, by expire_time and then by
+     * the order they were armed in, so active_timers[0] expires next.
+     * n_active_timers may be read without the lock.
+     */
+    QEMUTimer **active_timers;
+    int n_active_timers;
+    int max_active_timers;
+    uint64_t timer_seq;
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -119,6 +132,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -175,7 +189,7 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
 
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!atomic_read(&timer_list->active_timers);
+    return atomic_read(&timer_list->n_active_timers) > 0;
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -188,16 +202,16 @@ bool timerlist_expired(QEMUTimerList *timer_list)
 {
     int64_t expire_time;
 
-    if (!atomic_read(&timer_list->active_timers)) {
+    if (!atomic_read(&timer_list->n_active_timers)) {
         return false;
     }
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->n_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return false;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     return expire_time <= qemu_clock_get_ns(timer_list->clock->type);
@@ -219,7 +233,7 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
     int64_t delta;
     int64_t expire_time;
 
-    if (!atomic_read(&timer_list->active_timers)) {
+    if (!atomic_read(&timer_list->n_active_timers)) {
         return -1;
     }
 
@@ -232,11 +246,11 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->n_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return -1;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
@@ -356,43 +370,106 @@ void timer_deinit(QEMUTimer *ts)
     ts->timer_list = NULL;
 }
 
-static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+static bool timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    QEMUTimer **pt, *t;
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
 
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            atomic_set(pt, t->next);
+static void timerlist_heap_set(QEMUTimerList *timer_list, int i,
+                               QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timerlist_heap_up(QEMUTimerList *timer_list, int i)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (!timer_before(ts, timer_list->active_timers[parent])) {
             break;
         }
-        pt = &t->next;
+        timerlist_heap_set(timer_list, i, timer_list->active_timers[parent]);
+        i = parent;
     }
+    timerlist_heap_set(timer_list, i, ts);
 }
 
-static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
-                                QEMUTimer *ts, int64_t expire_time)
+static void timerlist_heap_down(QEMUTimerList *timer_list, int i)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimer *ts = timer_list->active_timers[i];
+    int n = timer_list->n_active_timers;
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
     for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
+        int child = 2 * i + 1;
+
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            timer_before(timer_list->active_timers[child + 1],
+                         timer_list->active_timers[child])) {
+            child++;
+        }
+        if (!timer_before(timer_list->active_timers[child], ts)) {
             break;
         }
-        pt = &t->next;
+        timerlist_heap_set(timer_list, i, timer_list->active_timers[child]);
+        i = child;
+    }
+    timerlist_heap_set(timer_list, i, ts);
+}
+
+static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    QEMUTimer *last;
+    int i = ts->heap_index;
+    int n;
+
+    if (ts->expire_time == -1) {
+        return;
+    }
+    ts->expire_time = -1;
+
+    /* move the last timer into the hole and let it find its place */
+    n = timer_list->n_active_timers - 1;
+    atomic_set(&timer_list->n_active_timers, n);
+    last = timer_list->active_timers[n];
+    if (i == n) {
+        return;
+    }
+    timerlist_heap_set(timer_list, i, last);
+    if (i > 0 && timer_before(last, timer_list->active_timers[(i - 1) / 2])) {
+        timerlist_heap_up(timer_list, i);
+    } else {
+        timerlist_heap_down(timer_list, i);
+    }
+}
+
+static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
+                                QEMUTimer *ts, int64_t expire_time)
+{
+    int n = timer_list->n_active_timers;
+
+    /* add the timer to the heap; among timers that expire at the same
+       time, those armed first run first */
+    if (n == timer_list->max_active_timers) {
+        timer_list->max_active_timers = MAX(2 * n, 16);
+        timer_list->active_timers = g_renew(QEMUTimer *,
+                                            timer_list->active_timers,
+                                            timer_list->max_active_timers);
     }
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    atomic_set(pt, ts);
+    ts->seq = timer_list->timer_seq++;
+    timerlist_heap_set(timer_list, n, ts);
+    atomic_set(&timer_list->n_active_timers, n + 1);
+    timerlist_heap_up(timer_list, n);
 
-    return pt == &timer_list->active_timers;
+    return ts->heap_index == 0;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -485,7 +562,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     QEMUTimerCB *cb;
     void *opaque;
 
-    if (!atomic_read(&timer_list->active_timers)) {
+    if (!atomic_read(&timer_list->n_active_timers)) {
         return false;
     }
 
@@ -518,16 +595,14 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     for(;;) {
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
+        ts = timer_list->n_active_timers ? timer_list->active_timers[0] : NULL;
         if (!timer_expired_ns(ts, current_time)) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
             break;
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
         qemu_mutex_unlock(&timer_list->active_timers_lock);
@@ -574,6 +649,41 @@ bool timerlistgroup_run_timers(QEMUTimerListGroup *tlg)
     return progress;
 }
 
+void qemu_clock_set_virtual_scale(int scale)
+{
+    assert(scale >= 1 && scale <= MAX_CLOCK_SCALE);
+    virtual_clock_scale = scale;
+}
+
+void qemu_clock_set_virtual_on_vcpu(bool enable)
+{
+    virtual_on_vcpu = enable;
+}
+
+/* Host nanoseconds until @timer_list's next deadline, or -1 */
+static int64_t timerlist_host_deadline_ns(QEMUTimerList *timer_list)
+{
+    int64_t deadline = timerlist_deadline_ns(timer_list);
+
+    switch (timer_list->clock->type) {
+    case QEMU_CLOCK_VIRTUAL:
+    case QEMU_CLOCK_VIRTUAL_RT:
+        /* Round up so we don't wake just before the timer expires */
+        if (virtual_clock_scale > 1 && deadline > 0) {
+            deadline = DIV_ROUND_UP(deadline, virtual_clock_scale);
+        }
+        /* Only wake up if the vCPU did not get to them first */
+        if (virtual_on_vcpu && deadline >= 0 &&
+            timer_list == main_loop_tlg.tl[QEMU_CLOCK_VIRTUAL]) {
+            deadline += VIRTUAL_ON_VCPU_SLACK_NS;
+        }
+        break;
+    default:
+        break;
+    }
+    return deadline;
+}
+
 int64_t timerlistgroup_deadline_ns(QEMUTimerListGroup *tlg)
 {
     int64_t deadline = -1;
@@ -583,7 +693,7 @@ int64_t timerlistgroup_deadline_ns(QEMUTimerListGroup *tlg)
         if (qemu_clock_use_for_deadline(type)) {
             if (!play || type == QEMU_CLOCK_REALTIME) {
                 deadline = qemu_soonest_timeout(deadline,
-                                                timerlist_deadline_ns(tlg->tl[type]));
+                                                timerlist_host_deadline_ns(tlg->tl[type]));
             } else {
                 /* Read clock from the replay file and
                    do not calculate the deadline, based on virtual clock. */
@@ -670,6 +780,15 @@ bool qemu_clock_run_all_timers(void)
     QEMUClockType type;
 
     for (type = 0; type < QEMU_CLOCK_MAX; type++) {
+        if (type == QEMU_CLOCK_VIRTUAL && virtual_on_vcpu) {
+            /* The vCPU has not left translated code since they expired;
+             * the notifier makes it come out and run them.
+             */
+            if (qemu_clock_expired(type)) {
+                qemu_clock_notify(type);
+            }
+            continue;
+        }
         if (qemu_clock_use_for_deadline(type)) {
             progress |= qemu_clock_run_timers(type);
         }
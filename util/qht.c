@@ -69,6 +69,7 @@
 #include "qemu/qht.h"
 #include "qemu/atomic.h"
 #include "qemu/rcu.h"
+#include "qemu/host-utils.h"
 
 //#define QHT_DEBUG
 
@@ -110,6 +111,18 @@ struct qht_bucket {
 
 QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
 
+/*
+ * On 64-bit hosts a bucket's four hashes fill one vector register, so
+ * they can be compared against the looked-up hash at once.
+ */
+#if QHT_BUCKET_ENTRIES == 4 && defined(__SSE2__)
+#include <emmintrin.h>
+#define QHT_MATCH_SSE2
+#elif QHT_BUCKET_ENTRIES == 4 && defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define QHT_MATCH_NEON
+#endif
+
 /**
  * struct qht_map - structure to track an array of buckets
  * @rcu: used by RCU. Keep it as the top field in the struct to help valgrind
@@ -439,27 +452,67 @@ bool qht_reset_size(struct qht *ht, size_t n_elems)
 }
 
 static inline
+/*
+ * Bit i is set if entry i of @b has hash @hash.  A vector load may see
+ * a hash mid-update just like the scalar reads would; the seqlock and
+ * the comparison function catch that.
+ */
+static inline unsigned int qht_bucket_match(struct qht_bucket *b,
+                                            uint32_t hash)
+{
+#if defined(QHT_MATCH_SSE2)
+    __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((__m128i *)b->hashes),
+                                 _mm_set1_epi32(hash));
+
+    return _mm_movemask_ps(_mm_castsi128_ps(eq));
+#elif defined(QHT_MATCH_NEON)
+    static const uint32_t bits[4] = { 1, 2, 4, 8 };
+    uint32x4_t eq = vceqq_u32(vld1q_u32(b->hashes), vdupq_n_u32(hash));
+
+    return vaddvq_u32(vandq_u32(eq, vld1q_u32(bits)));
+#else
+    unsigned int match = 0;
+    int i;
+
+    for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+        if (atomic_read(&b->hashes[i]) == hash) {
+            match |= 1 << i;
+        }
+    }
+    return match;
+#endif
+}
+
 void *qht_do_lookup(struct qht_bucket *head, qht_lookup_func_t func,
                     const void *userp, uint32_t hash)
 {
     struct qht_bucket *b = head;
-    int i;
 
     do {
-        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
-            if (atomic_read(&b->hashes[i]) == hash) {
-                /* The pointer is dereferenced before seqlock_read_retry,
-                 * so (unlike qht_insert__locked) we need to use
-                 * atomic_rcu_read here.
-                 */
-                void *p = atomic_rcu_read(&b->pointers[i]);
-
-                if (likely(p) && likely(func(p, userp))) {
-                    return p;
-                }
+        struct qht_bucket *next = atomic_rcu_read(&b->next);
+        unsigned int match;
+
+        /* Chained buckets are separate allocations: start fetching the
+         * next one while this one is compared.
+         */
+        if (next) {
+            __builtin_prefetch(next);
+        }
+        match = qht_bucket_match(b, hash);
+        while (match) {
+            int i = ctz32(match);
+            /* The pointer is dereferenced before seqlock_read_retry,
+             * so (unlike qht_insert__locked) we need to use
+             * atomic_rcu_read here.
+             */
+            void *p = atomic_rcu_read(&b->pointers[i]);
+
+            if (likely(p) && likely(func(p, userp))) {
+                return p;
             }
+            match &= match - 1;
         }
-        b = atomic_rcu_read(&b->next);
+        b = next;
     } while (b);
 
     return NULL;
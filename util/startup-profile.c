@@ -0,0 +1,102 @@
+/*
+ * Startup phase timeline
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/startup-profile.h"
+
+/* Plenty for the marks in vl.c and a board or two */
+#define STARTUP_PROFILE_MAX 64
+
+typedef struct StartupPhase {
+    const char *name;
+    int64_t end;
+} StartupPhase;
+
+static QemuMutex startup_lock;
+static int64_t startup_begin;
+static StartupPhase startup_phases[STARTUP_PROFILE_MAX];
+static int startup_nphases;
+static bool startup_done;
+
+/* As close to exec as we get */
+static void __attribute__((constructor)) startup_profile_init(void)
+{
+    qemu_mutex_init(&startup_lock);
+    startup_begin = get_clock();
+}
+
+static void startup_profile_add(const char *phase, bool finish)
+{
+    int64_t now = get_clock();
+
+    qemu_mutex_lock(&startup_lock);
+    if (!startup_done && startup_nphases < STARTUP_PROFILE_MAX) {
+        startup_phases[startup_nphases].name = phase;
+        startup_phases[startup_nphases].end = now - startup_begin;
+        startup_nphases++;
+    }
+    if (finish) {
+        atomic_set(&startup_done, true);
+    }
+    qemu_mutex_unlock(&startup_lock);
+}
+
+void startup_profile_mark(const char *phase)
+{
+    /* Cheap once the guest runs, e.g. for marks in reset handlers */
+    if (!atomic_read(&startup_done)) {
+        startup_profile_add(phase, false);
+    }
+}
+
+void startup_profile_finish(const char *phase)
+{
+    if (!atomic_read(&startup_done)) {
+        startup_profile_add(phase, true);
+    }
+}
+
+void startup_profile_foreach(StartupProfileFunc *fn, void *opaque)
+{
+    int64_t prev = 0;
+    int i;
+
+    qemu_mutex_lock(&startup_lock);
+    for (i = 0; i < startup_nphases; i++) {
+        fn(startup_phases[i].name, startup_phases[i].end,
+           startup_phases[i].end - prev, opaque);
+        prev = startup_phases[i].end;
+    }
+    qemu_mutex_unlock(&startup_lock);
+}
+
+typedef struct StartupProfileJSON {
+    FILE *f;
+    const char *sep;
+} StartupProfileJSON;
+
+static void startup_profile_print_json(const char *phase, int64_t end_ns,
+                                       int64_t len_ns, void *opaque)
+{
+    StartupProfileJSON *json = opaque;
+
+    fprintf(json->f, "%s\n    {\"phase\": \"%s\", \"end-ns\": %" PRId64
+            ", \"len-ns\": %" PRId64 "}", json->sep, phase, end_ns, len_ns);
+    json->sep = ",";
+}
+
+void startup_profile_dump_json(FILE *f)
+{
+    StartupProfileJSON json = { f, "" };
+
+    fprintf(f, "{\n  \"complete\": %s,\n  \"phases\": [",
+            atomic_read(&startup_done) ? "true" : "false");
+    startup_profile_foreach(startup_profile_print_json, &json);
+    fprintf(f, "\n  ]\n}\n");
+}
@@ -34,25 +34,6 @@
 #include "sysemu/seccomp.h"
 #endif
 
-#ifdef CONFIG_SDL
-#if defined(__APPLE__) || defined(main)
-#include <SDL.h>
-int qemu_main(int argc, char **argv, char **envp);
-int main(int argc, char **argv)
-{
-    return qemu_main(argc, argv, NULL);
-}
-#undef main
-#define main qemu_main
-#endif
-#endif /* CONFIG_SDL */
-
-#ifdef CONFIG_COCOA
-#undef main
-#define main qemu_main
-#endif /* CONFIG_COCOA */
-
-
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
 #include "hw/hw.h"
@@ -79,10 +60,14 @@ int main(int argc, char **argv)
 #include "sysemu/sysemu.h"
 #include "sysemu/numa.h"
 #include "exec/gdbstub.h"
+#include "exec/tb-coverage.h"
+#include "exec/exec-trace.h"
+#include "exec/sample-profile.h"
 #include "qemu/timer.h"
 #include "chardev/char.h"
 #include "qemu/bitmap.h"
 #include "qemu/log.h"
+#include "qemu/startup-profile.h"
 #include "sysemu/blockdev.h"
 #include "hw/block/block.h"
 #include "migration/misc.h"
@@ -151,6 +136,7 @@ int autostart;
 static int rtc_utc = 1;
 static int rtc_date_offset = -1; /* -1 means no change */
 QEMUClockType rtc_clock;
+static uint64_t rtc_clock_scale = 1;
 int vga_interface_type = VGA_NONE;
 static DisplayOptions dpy;
 int no_frame;
@@ -252,6 +238,9 @@ static QemuOptsList qemu_rtc_opts = {
         },{
             .name = "clock",
             .type = QEMU_OPT_STRING,
+        },{
+            .name = "scale",
+            .type = QEMU_OPT_NUMBER,
         },{
             .name = "driftfix",
             .type = QEMU_OPT_STRING,
@@ -336,6 +325,11 @@ static QemuOptsList qemu_accel_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Enable/disable multi-threaded TCG",
         },
+        {
+            .name = "pool-size",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of TCG threads with thread=pool",
+        },
         { /* end of list */ }
     },
 };
@@ -509,6 +503,68 @@ static QemuOptsList qemu_icount_opts = {
         }, {
             .name = "rrsnapshot",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "rrsnapshot-interval",
+            .type = QEMU_OPT_NUMBER,
+        },
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList qemu_cpu_quota_opts = {
+    .name = "cpu-quota",
+    .merge_lists = true,
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_cpu_quota_opts.head),
+    .desc = {
+        {
+            .name = "insns",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "time",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "period",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "action",
+            .type = QEMU_OPT_STRING,
+        },
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList qemu_tb_coverage_opts = {
+    .name = "tb-coverage",
+    .implied_opt_name = "file",
+    .merge_lists = true,
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_tb_coverage_opts.head),
+    .desc = {
+        {
+            .name = "file",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "format",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "mode",
+            .type = QEMU_OPT_STRING,
+        },
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList qemu_sample_profile_opts = {
+    .name = "sample-profile",
+    .implied_opt_name = "file",
+    .merge_lists = true,
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_sample_profile_opts.head),
+    .desc = {
+        {
+            .name = "file",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "hz",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end of list */ }
     },
@@ -638,6 +694,7 @@ static const RunStateTransition runstate_transitions_def[] = {
     { RUN_STATE_PAUSED, RUN_STATE_POSTMIGRATE },
     { RUN_STATE_PAUSED, RUN_STATE_PRELAUNCH },
     { RUN_STATE_PAUSED, RUN_STATE_COLO},
+    { RUN_STATE_PAUSED, RUN_STATE_DEBUG },
 
     { RUN_STATE_POSTMIGRATE, RUN_STATE_RUNNING },
     { RUN_STATE_POSTMIGRATE, RUN_STATE_FINISH_MIGRATE },
@@ -655,6 +712,7 @@ static const RunStateTransition runstate_transitions_def[] = {
 
     { RUN_STATE_RESTORE_VM, RUN_STATE_RUNNING },
     { RUN_STATE_RESTORE_VM, RUN_STATE_PRELAUNCH },
+    { RUN_STATE_RESTORE_VM, RUN_STATE_DEBUG },
 
     { RUN_STATE_COLO, RUN_STATE_RUNNING },
 
@@ -903,6 +961,18 @@ static void configure_rtc(QemuOpts *opts)
             exit(1);
         }
     }
+    if (qemu_opt_get(opts, "scale")) {
+        rtc_clock_scale = qemu_opt_get_number(opts, "scale", 1);
+        if (rtc_clock != QEMU_CLOCK_VIRTUAL) {
+            error_report("-rtc scale requires clock=vm");
+            exit(1);
+        }
+        if (rtc_clock_scale < 1 || rtc_clock_scale > MAX_CLOCK_SCALE) {
+            error_report("-rtc scale must be between 1 and %d",
+                         MAX_CLOCK_SCALE);
+            exit(1);
+        }
+    }
     value = qemu_opt_get(opts, "driftfix");
     if (value) {
         if (!strcmp(value, "slew")) {
@@ -1932,20 +2002,24 @@ static bool main_loop_should_exit(void)
     return false;
 }
 
-static void main_loop(void)
+bool qemu_main_loop_step(void)
 {
 #ifdef CONFIG_PROFILER
     int64_t ti;
+
+    ti = profile_getclock();
 #endif
-    do {
-#ifdef CONFIG_PROFILER
-        ti = profile_getclock();
-#endif
-        main_loop_wait(false);
+    main_loop_wait(false);
 #ifdef CONFIG_PROFILER
-        dev_time += profile_getclock() - ti;
+    dev_time += profile_getclock() - ti;
 #endif
-    } while (!main_loop_should_exit());
+    return main_loop_should_exit();
+}
+
+void qemu_main_loop(void)
+{
+    while (!qemu_main_loop_step()) {
+    }
 }
 
 static void version(void)
@@ -2719,6 +2793,110 @@ static void qemu_run_exit_notifiers(void)
     notifier_list_notify(&exit_notifiers, NULL);
 }
 
+static char *startup_profile_file;
+
+static void startup_profile_exit(Notifier *n, void *data)
+{
+    FILE *f = fopen(startup_profile_file, "w");
+
+    if (!f) {
+        error_report("-startup-profile: cannot write %s: %s",
+                     startup_profile_file, strerror(errno));
+        return;
+    }
+    startup_profile_dump_json(f);
+    fclose(f);
+}
+
+static Notifier startup_profile_notifier = {
+    .notify = startup_profile_exit,
+};
+
+#ifdef CONFIG_TCG
+static char *tb_coverage_file;
+static char *tb_coverage_image;
+static int tb_coverage_format;
+
+static void tb_coverage_exit(Notifier *n, void *data)
+{
+    FILE *f = fopen(tb_coverage_file, "wb");
+
+    if (!f) {
+        error_report("-tb-coverage: cannot write %s: %s",
+                     tb_coverage_file, strerror(errno));
+        return;
+    }
+    tb_coverage_dump(f, tb_coverage_format, tb_coverage_image);
+    fclose(f);
+}
+
+static Notifier tb_coverage_notifier = {
+    .notify = tb_coverage_exit,
+};
+
+static char *exec_trace_file;
+
+static void exec_trace_exit(Notifier *n, void *data)
+{
+    exec_trace_stop();
+}
+
+static Notifier exec_trace_notifier = {
+    .notify = exec_trace_exit,
+};
+
+static void sample_profile_exit(Notifier *n, void *data)
+{
+    sample_profile_stop();
+}
+
+static Notifier sample_profile_notifier = {
+    .notify = sample_profile_exit,
+};
+
+static void tb_coverage_configure(QemuOpts *opts, const char *image)
+{
+    const char *file = qemu_opt_get(opts, "file");
+    const char *format = qemu_opt_get(opts, "format");
+    const char *mode = qemu_opt_get(opts, "mode");
+    Error *err = NULL;
+
+    if (mode && !strcmp(mode, "edges")) {
+        if (!tb_coverage_edge_map_open(file, &err)) {
+            error_reportf_err(err, "-tb-coverage: ");
+            exit(1);
+        }
+        tcg_tb_coverage = TB_COVERAGE_EDGES;
+        return;
+    }
+    if (!file) {
+        error_report("-tb-coverage: file is required");
+        exit(1);
+    }
+    if (!format || !strcmp(format, "drcov")) {
+        tb_coverage_format = TB_COVERAGE_DRCOV;
+    } else if (!strcmp(format, "lcov")) {
+        tb_coverage_format = TB_COVERAGE_LCOV;
+    } else {
+        error_report("-tb-coverage: format must be drcov or lcov");
+        exit(1);
+    }
+    if (!mode || !strcmp(mode, "translated")) {
+        tcg_tb_coverage = TB_COVERAGE_TRANSLATED;
+    } else if (!strcmp(mode, "executed")) {
+        tcg_tb_coverage = TB_COVERAGE_EXECUTED;
+    } else {
+        error_report("-tb-coverage: mode must be translated, executed "
+                     "or edges");
+        exit(1);
+    }
+
+    tb_coverage_file = g_strdup(file);
+    tb_coverage_image = g_strdup(image ? image : "guest");
+    qemu_add_exit_notifier(&tb_coverage_notifier);
+}
+#endif
+
 bool machine_init_done;
 
 void qemu_add_machine_init_done_notifier(Notifier *notify)
@@ -3034,7 +3212,7 @@ static void register_global_properties(MachineState *ms)
     user_register_global_props();
 }
 
-int main(int argc, char **argv, char **envp)
+void qemu_init(int argc, char **argv, char **envp)
 {
     int i;
     int snapshot, linux_boot;
@@ -3064,6 +3242,7 @@ int main(int argc, char **argv, char **envp)
     char *trace_file = NULL;
     ram_addr_t maxram_size;
     uint64_t ram_slots = 0;
+    uint64_t tb_hot_size;
     FILE *vmstate_dump_file = NULL;
     Error *main_loop_err = NULL;
     Error *err = NULL;
@@ -3077,6 +3256,8 @@ int main(int argc, char **argv, char **envp)
     QSIMPLEQ_HEAD(, BlockdevOptions_queue) bdo_queue
         = QSIMPLEQ_HEAD_INITIALIZER(bdo_queue);
 
+    startup_profile_mark("exec");
+
     module_call_init(MODULE_INIT_TRACE);
 
     qemu_init_cpu_list();
@@ -3089,6 +3270,7 @@ int main(int argc, char **argv, char **envp)
     qemu_init_exec_dir(argv[0]);
 
     module_call_init(MODULE_INIT_QOM);
+    startup_profile_mark("type registration");
 
     qemu_add_opts(&qemu_drive_opts);
     qemu_add_drive_opts(&qemu_legacy_drive_opts);
@@ -3119,6 +3301,9 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_name_opts);
     qemu_add_opts(&qemu_numa_opts);
     qemu_add_opts(&qemu_icount_opts);
+    qemu_add_opts(&qemu_cpu_quota_opts);
+    qemu_add_opts(&qemu_tb_coverage_opts);
+    qemu_add_opts(&qemu_sample_profile_opts);
     qemu_add_opts(&qemu_semihosting_config_opts);
     qemu_add_opts(&qemu_fw_cfg_opts);
     module_call_init(MODULE_INIT_OPTS);
@@ -3623,7 +3808,7 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_watchdog:
                 if (watchdog) {
                     error_report("only one watchdog option may be given");
-                    return 1;
+                    exit(1);
                 }
                 watchdog = optarg;
                 break;
@@ -3913,11 +4098,80 @@ int main(int argc, char **argv, char **envp)
                 error_report("TCG is disabled");
                 exit(1);
 #endif
-                if (qemu_strtoul(optarg, NULL, 0, &tcg_tb_size) < 0) {
+                if (!strcmp(optarg, "auto")) {
+                    tcg_tb_size_auto = true;
+                } else if (qemu_strtoul(optarg, NULL, 0, &tcg_tb_size) < 0) {
                     error_report("Invalid argument to -tb-size");
                     exit(1);
                 }
                 break;
+            case QEMU_OPTION_tb_profile:
+#ifndef CONFIG_TCG
+                error_report("TCG is disabled");
+                exit(1);
+#endif
+                tcg_tb_profile = true;
+                break;
+            case QEMU_OPTION_tb_superblock:
+#ifndef CONFIG_TCG
+                error_report("TCG is disabled");
+                exit(1);
+#endif
+                tcg_tb_superblock = true;
+                break;
+            case QEMU_OPTION_tb_hot_region:
+#ifndef CONFIG_TCG
+                error_report("TCG is disabled");
+                exit(1);
+#endif
+                if (qemu_strtosz(optarg, NULL, &tb_hot_size) < 0 ||
+                    !tb_hot_size) {
+                    error_report("Invalid argument to -tb-hot-region");
+                    exit(1);
+                }
+                tcg_tb_hot_size = tb_hot_size;
+                tcg_tb_profile = true;
+                break;
+            case QEMU_OPTION_tb_speculate:
+#ifndef CONFIG_TCG
+                error_report("TCG is disabled");
+                exit(1);
+#endif
+                tcg_tb_speculate = true;
+                break;
+            case QEMU_OPTION_exec_trace:
+#ifndef CONFIG_TCG
+                error_report("TCG is disabled");
+                exit(1);
+#else
+                g_free(exec_trace_file);
+                exec_trace_file = g_strdup(optarg);
+#endif
+                break;
+            case QEMU_OPTION_sample_profile:
+#ifndef CONFIG_TCG
+                error_report("TCG is disabled");
+                exit(1);
+#endif
+                if (!qemu_opts_parse_noisily(qemu_find_opts("sample-profile"),
+                                             optarg, true)) {
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_tb_coverage:
+#ifndef CONFIG_TCG
+                error_report("TCG is disabled");
+                exit(1);
+#endif
+                if (!qemu_opts_parse_noisily(qemu_find_opts("tb-coverage"),
+                                             optarg, true)) {
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_startup_profile:
+                g_free(startup_profile_file);
+                startup_profile_file = g_strdup(optarg);
+                break;
             case QEMU_OPTION_icount:
                 icount_opts = qemu_opts_parse_noisily(qemu_find_opts("icount"),
                                                       optarg, true);
@@ -3925,6 +4179,12 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 break;
+            case QEMU_OPTION_cpu_quota:
+                if (!qemu_opts_parse_noisily(qemu_find_opts("cpu-quota"),
+                                             optarg, false)) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_incoming:
                 if (!incoming) {
                     runstate_set(RUN_STATE_INMIGRATE);
@@ -4087,6 +4347,11 @@ int main(int argc, char **argv, char **envp)
      * Best done right after the loop.  Do not insert code here!
      */
     loc_set_none();
+    startup_profile_mark("option parsing");
+
+    if (startup_profile_file) {
+        qemu_add_exit_notifier(&startup_profile_notifier);
+    }
 
     replay_configure(icount_opts);
 
@@ -4106,6 +4371,7 @@ int main(int argc, char **argv, char **envp)
         error_report_err(main_loop_err);
         exit(1);
     }
+    startup_profile_mark("main loop");
 
     if (qemu_opts_foreach(qemu_find_opts("sandbox"),
                           parse_sandbox, NULL, NULL)) {
@@ -4402,7 +4668,9 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    startup_profile_mark("backends");
     configure_accelerator(current_machine);
+    startup_profile_mark("accelerator");
 
     /*
      * Register all the global properties, including accel properties,
@@ -4426,6 +4694,30 @@ int main(int argc, char **argv, char **envp)
     kernel_cmdline = qemu_opt_get(machine_opts, "append");
     bios_name = qemu_opt_get(machine_opts, "firmware");
 
+#ifdef CONFIG_TCG
+    opts = qemu_opts_find(qemu_find_opts("tb-coverage"), NULL);
+    if (opts) {
+        tb_coverage_configure(opts, kernel_filename);
+    }
+
+    /* After os_daemonize(), which would leave the writer thread behind */
+    if (exec_trace_file) {
+        exec_trace_start(exec_trace_file);
+        qemu_add_exit_notifier(&exec_trace_notifier);
+    }
+
+    opts = qemu_opts_find(qemu_find_opts("sample-profile"), NULL);
+    if (opts) {
+        if (!qemu_opt_get(opts, "file")) {
+            error_report("-sample-profile: file is required");
+            exit(1);
+        }
+        sample_profile_start(qemu_opt_get(opts, "file"),
+                             qemu_opt_get_number(opts, "hz", 1000));
+        qemu_add_exit_notifier(&sample_profile_notifier);
+    }
+#endif
+
     opts = qemu_opts_find(qemu_find_opts("boot-opts"), NULL);
     if (opts) {
         boot_order = qemu_opt_get(opts, "order");
@@ -4482,6 +4774,21 @@ int main(int argc, char **argv, char **envp)
         configure_icount(icount_opts, &error_abort);
         qemu_opts_del(icount_opts);
     }
+    opts = qemu_opts_find(qemu_find_opts("cpu-quota"), NULL);
+    if (opts) {
+        if (!tcg_enabled()) {
+            error_report("-cpu-quota is only supported with TCG");
+            exit(1);
+        }
+        configure_cpu_quota(opts, &error_fatal);
+    }
+    if (rtc_clock_scale > 1) {
+        if (use_icount) {
+            error_report("-rtc scale is not allowed with -icount");
+            exit(1);
+        }
+        cpu_set_clock_scale(rtc_clock_scale);
+    }
 
     if (tcg_enabled()) {
         qemu_tcg_configure(accel_opts, &error_fatal);
@@ -4621,7 +4928,9 @@ int main(int argc, char **argv, char **envp)
     }
     parse_numa_opts(current_machine);
 
+    startup_profile_mark("machine setup");
     machine_run_board_init(current_machine);
+    startup_profile_mark("board init");
 
     realtime_init();
 
@@ -4677,9 +4986,12 @@ int main(int argc, char **argv, char **envp)
         qemu_register_reset(restore_boot_order, g_strdup(boot_order));
     }
 
+    startup_profile_mark("devices");
+
     /* init local displays */
     ds = init_displaystate();
     qemu_display_init(ds, &dpy);
+    startup_profile_mark("display");
 
     /* must be after terminal init, SDL library changes signal handlers */
     os_setup_signal_handling();
@@ -4716,7 +5028,9 @@ int main(int argc, char **argv, char **envp)
        reading from the other reads, because timer polling functions query
        clock values from the log. */
     replay_checkpoint(CHECKPOINT_RESET);
+    startup_profile_mark("machine done");
     qemu_system_reset(SHUTDOWN_CAUSE_NONE);
+    startup_profile_mark("reset");
     register_global_state();
     if (replay_mode != REPLAY_MODE_NONE) {
         replay_vmstate_init();
@@ -4732,7 +5046,7 @@ int main(int argc, char **argv, char **envp)
     if (vmstate_dump_file) {
         /* dump and exit */
         dump_vmstate_json_to_file(vmstate_dump_file);
-        return 0;
+        exit(0);
     }
 
     if (incoming) {
@@ -4745,12 +5059,14 @@ int main(int argc, char **argv, char **envp)
     } else if (autostart) {
         vm_start();
     }
+    startup_profile_mark("vm start");
 
     accel_setup_post(current_machine);
     os_setup_post();
+}
 
-    main_loop();
-
+void qemu_cleanup(void)
+{
     gdbserver_cleanup();
 
     /* No more vcpu or device emulation activity beyond this point */
@@ -4769,6 +5085,4 @@ int main(int argc, char **argv, char **envp)
     user_creatable_cleanup();
     migration_object_finalize();
     /* TODO: unref root container, check all devices are ok */
-
-    return 0;
 }